@@ -65,6 +65,15 @@ struct acism {
     unsigned tran_size; // #(tranv)
     unsigned nsyms, nchars, nstrs, maxlen;
     SYMBOL symv[256];
+
+    // Prefilter: bytes that could start a match (see fill_startv)
+#   define ACISM_MAX_START 16
+#   define ACISM_START_CASE 1
+#   define ACISM_START_ICASE 2
+    unsigned prefilter;
+    unsigned nstart, nstart_icase; // 0 if too many for SIMD
+    uint8_t startv[ACISM_MAX_START], startv_icase[ACISM_MAX_START];
+    uint8_t startmap[256];
 };
 
 #include "acism.h"
@@ -20,9 +20,80 @@
 #include "_acism.h"
 #include "unix-std.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define ACISM_NEON 1
+#endif
+
 #define BACK ((SYMBOL)0)
 #define ROOT ((STATE) 0)
 
+// Returns the first position in [cp, endp) that could start a match
+static inline const char *
+acism_skip(ac_trie_t const *psp, const char *cp, const char *endp,
+           bool caseless)
+{
+    uint8_t bit = caseless ? ACISM_START_ICASE : ACISM_START_CASE;
+    unsigned n = caseless ? psp->nstart_icase : psp->nstart;
+    const uint8_t *startv = caseless ? psp->startv_icase : psp->startv;
+    unsigned i;
+
+    // Fast path: we are at the start of a pattern already
+    if (psp->startmap[(uint8_t)*cp] & bit)
+        return cp;
+
+#if defined(__SSE2__)
+    if (n > 0) {
+        __m128i needles[ACISM_MAX_START];
+
+        for (i = 0; i < n; ++i)
+            needles[i] = _mm_set1_epi8((char)startv[i]);
+
+        while (endp - cp >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)cp),
+                    m = _mm_cmpeq_epi8(v, needles[0]);
+
+            for (i = 1; i < n; ++i)
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, needles[i]));
+
+            int mask = _mm_movemask_epi8(m);
+            if (mask)
+                return cp + __builtin_ctz(mask);
+
+            cp += 16;
+        }
+    }
+#elif defined(ACISM_NEON)
+    if (n > 0) {
+        uint8x16_t needles[ACISM_MAX_START];
+
+        for (i = 0; i < n; ++i)
+            needles[i] = vdupq_n_u8(startv[i]);
+
+        while (endp - cp >= 16) {
+            uint8x16_t v = vld1q_u8((const uint8_t *)cp),
+                       m = vceqq_u8(v, needles[0]);
+
+            for (i = 1; i < n; ++i)
+                m = vorrq_u8(m, vceqq_u8(v, needles[i]));
+
+            if (vmaxvq_u8(m))
+                break; // Exact position is found below
+            cp += 16;
+        }
+    }
+#else
+    (void)n; (void)startv; (void)i;
+#endif
+
+    while (cp < endp && !(psp->startmap[(uint8_t)*cp] & bit))
+        cp++;
+
+    return cp;
+}
+
 int
 acism_lookup(ac_trie_t const *psp, const char *text, size_t len,
            ACISM_ACTION *cb, void *context, int *statep, bool caseless)
@@ -34,6 +105,13 @@ acism_lookup(ac_trie_t const *psp, const char *text, size_t len,
     int ret = 0;
 
     while (cp < endp) {
+        if (state == ROOT && psp->prefilter) {
+            // No partial match: skip bytes that cannot start any pattern
+            cp = acism_skip(psp, cp, endp, caseless);
+            if (cp == endp)
+                break;
+        }
+
     	s = caseless ? g_ascii_tolower (*cp++) : *cp++;
         _SYMBOL sym = ps.symv[s];
         if (!sym) {
@@ -38,6 +38,7 @@ static inline int bitwid(unsigned u)
     return ret;
 }
 static void   fill_symv(ac_trie_t*, ac_trie_pat_t const*, int ns);
+static void   fill_startv(ac_trie_t*, ac_trie_pat_t const*, int ns);
 static int    create_tree(TNODE*, SYMBOL const*symv, ac_trie_pat_t const*strv, int nstrs);
 static void   add_backlinks(TNODE*, TNODE**, TNODE**);
 static void   prune_backlinks(TNODE*);
@@ -119,6 +120,8 @@ acism_create(ac_trie_pat_t const* strv, int nstrs)
         set_tranv(psp, realloc(psp->tranv, p_size(psp)));
     }
 
+    fill_startv(psp, strv, nstrs);
+
         // Diagnostics/statistics only:
     psp->nstrs = nstrs;
     for (i = psp->maxlen = 0; i < nstrs; ++i)
@@ -155,6 +158,47 @@ fill_symv(ac_trie_t *psp, ac_trie_pat_t const *strv, int nstrs)
 #endif
 }
 
+// Collect the first bytes of all patterns: the lookup can skip any input
+//  that does not contain them while it is in the root state.
+// The caseless set is a superset: the lookup lowercases the input bytes.
+#define ACISM_MAX_PREFILTER 64
+static void
+fill_startv(ac_trie_t *psp, ac_trie_pat_t const *strv, int nstrs)
+{
+    int i, c, ncase = 0, nicase = 0;
+
+    memset(psp->startmap, 0, sizeof psp->startmap);
+
+    for (i = 0; i < nstrs; ++i) {
+        if (strv[i].len == 0) {
+            // Empty pattern matches everywhere
+            psp->prefilter = 0;
+            return;
+        }
+
+        c = (uint8_t)strv[i].ptr[0];
+        psp->startmap[c] |= ACISM_START_CASE | ACISM_START_ICASE;
+        if (c >= 'a' && c <= 'z')
+            psp->startmap[c - 'a' + 'A'] |= ACISM_START_ICASE;
+    }
+
+    for (c = 0; c < 256; ++c) {
+        if (psp->startmap[c] & ACISM_START_CASE) {
+            if (ncase < ACISM_MAX_START) psp->startv[ncase] = c;
+            ncase++;
+        }
+        if (psp->startmap[c] & ACISM_START_ICASE) {
+            if (nicase < ACISM_MAX_START) psp->startv_icase[nicase] = c;
+            nicase++;
+        }
+    }
+
+    // With too many starting bytes skipping does not pay
+    psp->prefilter = nicase > 0 && nicase <= ACISM_MAX_PREFILTER;
+    psp->nstart = ncase <= ACISM_MAX_START ? ncase : 0;
+    psp->nstart_icase = nicase <= ACISM_MAX_START ? nicase : 0;
+}
+
 static int
 create_tree(TNODE *Tree, SYMBOL const *symv, ac_trie_pat_t const *strv, int nstrs)
 {
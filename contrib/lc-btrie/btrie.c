@@ -1548,7 +1548,8 @@ struct walk_context
 	btrie_walk_cb_t *callback;
 	void *user_data;
 
-	btrie_oct_t prefix[(BTRIE_MAX_PREFIX + 7) / 8];
+	/* extra octet for children of the maximum length prefixes */
+	btrie_oct_t prefix[BTRIE_MAX_PREFIX / 8 + 1];
 };
 
 static void
@@ -1562,7 +1563,7 @@ static void walk_tbm_node(const struct tbm_node *node, unsigned pos,
 	btrie_oct_t pbit = 0x80 >> (pos % 8);
 	const void **data_p = tbm_data_p (node, pfx, plen);
 
-	if (pos >= BTRIE_MAX_PREFIX) {
+	if (pos > BTRIE_MAX_PREFIX) {
 		/* This can/should not happen, but don't overwrite buffers if it does. */
 		return;
 	}
@@ -1599,13 +1600,15 @@ static void walk_lc_node(const struct lc_node *node, unsigned pos,
 {
 	btrie_oct_t *prefix = ctx->prefix;
 	unsigned end = pos + lc_len (node);
-	btrie_oct_t save_prefix = prefix[lc_shift (pos)];
+	btrie_oct_t save_prefix;
 
 	if (end > BTRIE_MAX_PREFIX) {
 		/* This can/should not happen, but don't overwrite buffers if it does. */
 		return;
 	}
 
+	save_prefix = prefix[lc_shift (pos)];
+
 	/* construct full prefix to node */
 	memcpy(&prefix[lc_shift (pos)], node->prefix, lc_bytes (node, pos));
 	if (end % 8)
@@ -73,7 +73,8 @@ struct rdns_request {
 		RDNS_REQUEST_NEW = 0,
 		RDNS_REQUEST_REGISTERED = 1,
 		RDNS_REQUEST_SENT,
-		RDNS_REQUEST_REPLIED
+		RDNS_REQUEST_REPLIED,
+		RDNS_REQUEST_CACHED
 	} state;
 
 	uint8_t *packet;
@@ -114,6 +115,7 @@ struct rdns_resolver {
 	struct rdns_async_context *async; /** async callbacks */
 	void *periodic; /** periodic event for resolver */
 	struct rdns_upstream_context *ups;
+	struct rdns_cache_context *cache;
 	struct rdns_plugin *curve_plugin;
 
 	rdns_log_function logger;
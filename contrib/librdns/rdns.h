@@ -167,6 +167,18 @@ struct rdns_upstream_context {
 	void (*fail)(struct rdns_upstream_elt *elt, void *ups_data);
 };
 
+struct rdns_cache_context {
+	void *data;
+	/* Copies cached reply packet to `buf` and returns its length or 0 */
+	size_t (*lookup)(const char *name, size_t len,
+			enum rdns_request_type type, uint8_t *buf, size_t buflen,
+			void *cache_data);
+	/* Called for each parsed reply with its raw packet */
+	void (*store)(const char *name, size_t len,
+			enum rdns_request_type type, const uint8_t *packet, size_t pktlen,
+			struct rdns_reply *reply, void *cache_data);
+};
+
 /**
  * Type of rdns plugin
  */
@@ -284,6 +296,17 @@ void rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 		struct rdns_upstream_context *ups_ctx,
 		void *ups_data);
 
+/**
+ * Set cache of replies for single query requests, replies found in the cache
+ * are delivered from the event loop without sending any packets
+ * @param resolver resolver object
+ * @param cache_ctx cache functions
+ * @param cache_data opaque data
+ */
+void rdns_resolver_set_cache (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data);
+
 /**
  * Set maximum number of dns requests to be sent to a socket to be refreshed
  * @param resolver resolver object
@@ -272,6 +272,13 @@ rdns_process_read (int fd, void *arg)
 		if (rdns_parse_reply (in, r, req, &rep)) {
 			UPSTREAM_OK (req->io->srv);
 
+			if (resolver->cache && req->qcount == 1) {
+				resolver->cache->store (req->requested_names[0].name,
+						req->requested_names[0].len,
+						req->requested_names[0].type,
+						in, r, rep, resolver->cache->data);
+			}
+
 			if (req->resolver->ups && req->io->srv->ups_elt) {
 				req->resolver->ups->ok (req->io->srv->ups_elt,
 						req->resolver->ups->data);
@@ -299,9 +306,21 @@ rdns_process_timer (void *arg)
 	struct rdns_resolver *resolver;
 	struct rdns_server *serv = NULL;
 
-	req->retransmits --;
 	resolver = req->resolver;
 
+	if (req->state == RDNS_REQUEST_CACHED) {
+		/* Deliver reply found in the cache */
+		req->async->del_timer (req->async->data,
+				req->async_event);
+		req->state = RDNS_REQUEST_REPLIED;
+		req->func (req->reply, req->arg);
+		REF_RELEASE (req);
+
+		return;
+	}
+
+	req->retransmits --;
+
 	if (req->retransmits == 0) {
 		if (req->resolver->ups && req->io->srv->ups_elt) {
 			req->resolver->ups->fail (req->io->srv->ups_elt,
@@ -482,6 +501,42 @@ rdns_process_retransmit (int fd, void *arg)
 	}
 }
 
+/*
+ * Parses cached reply as if it has been received from a server, the callback
+ * is called from the event loop as callers expect
+ */
+static bool
+rdns_lookup_cached (struct rdns_resolver *resolver, struct rdns_request *req)
+{
+	uint8_t in[UDP_PACKET_SIZE];
+	struct rdns_reply *rep;
+	size_t r;
+
+	r = resolver->cache->lookup (req->requested_names[0].name,
+			req->requested_names[0].len,
+			req->requested_names[0].type,
+			in, sizeof (in), resolver->cache->data);
+
+	if (r <= sizeof (struct dns_header) + sizeof (struct dns_query)) {
+		return false;
+	}
+
+	if (!rdns_parse_reply (in, r, req, &rep)) {
+		if (req->reply) {
+			rdns_reply_free (req->reply);
+			req->reply = NULL;
+		}
+
+		return false;
+	}
+
+	req->state = RDNS_REQUEST_CACHED;
+	req->async_event = resolver->async->add_timer (resolver->async->data,
+			0.0, req);
+
+	return true;
+}
+
 struct rdns_request*
 rdns_make_request_full (
 		struct rdns_resolver *resolver,
@@ -597,6 +652,11 @@ rdns_make_request_full (
 	req->state = RDNS_REQUEST_NEW;
 	req->async = resolver->async;
 
+	if (resolver->cache && queries == 1 &&
+			rdns_lookup_cached (resolver, req)) {
+		return req;
+	}
+
 	if (resolver->ups) {
 		struct rdns_upstream_elt *elt;
 
@@ -770,6 +830,15 @@ rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 }
 
 
+void
+rdns_resolver_set_cache (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data)
+{
+	resolver->cache = cache_ctx;
+	resolver->cache->data = cache_data;
+}
+
 void
 rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
 		uint64_t max_ioc_uses, double check_time)
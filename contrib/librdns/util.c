@@ -325,6 +325,11 @@ rdns_request_free (struct rdns_request *req)
 			req->async->del_write (req->async->data,
 					req->async_event);
 		}
+		else if (req->state == RDNS_REQUEST_CACHED) {
+			/* Remove delivery timer */
+			req->async->del_timer (req->async->data,
+					req->async_event);
+		}
 #ifdef TWEETNACL
 		if (req->curve_plugin_data != NULL) {
 			req->resolver->curve_plugin->cb.curve_plugin.finish_cb (
@@ -56,6 +56,8 @@ static gboolean raw = FALSE;
 static gboolean extended_urls = FALSE;
 static gboolean mime_output = FALSE;
 static gboolean empty_input = FALSE;
+static gboolean bulk = FALSE;
+static gboolean mbox = FALSE;
 static gchar *key = NULL;
 static GList *children;
 
@@ -128,6 +130,10 @@ static GOptionEntry entries[] =
 		"Sort output in a specific order (name, weight, time)", NULL},
 	{ "empty", 'E', 0, G_OPTION_ARG_NONE, &empty_input,
 	   "Allow empty input instead of reading from stdin", NULL },
+	{ "bulk", 0, 0, G_OPTION_ARG_NONE, &bulk,
+	   "Pipeline files over keep-alive connections (see -n) and output json lines", NULL },
+	{ "mbox", 0, 0, G_OPTION_ARG_NONE, &mbox,
+	   "Scan each message of mbox files separately (bulk mode)", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -292,6 +298,36 @@ struct rspamc_callback_data {
 	gdouble start;
 };
 
+/* State of bulk scan: files are mapped one by one and scanned by messages */
+struct rspamc_bulk_ctx {
+	struct event_base *ev_base;
+	struct rspamc_command *cmd;
+	GQueue *attrs;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_cryptobox_pubkey *key;
+	struct rspamd_cryptobox_keypair *keypair;
+	struct rspamd_keypair_cache *keys_cache;
+	gchar **files;
+	gint nfiles;
+	gint cur_file;
+	DIR *dir;
+	gchar *dirname;
+	gchar *fname;
+	guchar *map;
+	gsize maplen;
+	gsize mappos;
+	guint nmsg;
+	guint inflight;
+	guint64 nscanned;
+	guint64 nerrors;
+};
+
+struct rspamc_bulk_req {
+	struct rspamc_bulk_ctx *ctx;
+	gchar *name;
+	gdouble start;
+};
+
 /*
  * Parse command line
  */
@@ -704,6 +740,15 @@ rspamc_counters_sort (const ucl_object_t **o1, const ucl_object_t **o2)
 					order2 = ucl_object_todouble (elt2) * 1000000;
 				}
 			}
+			else if (g_ascii_strcasecmp (args[0], "p99") == 0) {
+				elt1 = ucl_object_lookup (*o1, "p99");
+				elt2 = ucl_object_lookup (*o2, "p99");
+
+				if (elt1 && elt2) {
+					order1 = ucl_object_todouble (elt1);
+					order2 = ucl_object_todouble (elt2);
+				}
+			}
 
 			g_strfreev (args);
 		}
@@ -715,9 +760,9 @@ rspamc_counters_sort (const ucl_object_t **o1, const ucl_object_t **o2)
 static void
 rspamc_counters_output (FILE *out, ucl_object_t *obj)
 {
-	const ucl_object_t *cur, *sym, *weight, *freq, *tim;
+	const ucl_object_t *cur, *sym, *weight, *freq, *tim, *p99;
 	ucl_object_iter_t iter = NULL;
-	gchar fmt_buf[64], dash_buf[82];
+	gchar fmt_buf[64], dash_buf[94];
 	gint l, max_len = INT_MIN, i;
 
 	if (obj->type != UCL_ARRAY) {
@@ -742,21 +787,22 @@ rspamc_counters_output (FILE *out, ucl_object_t *obj)
 	}
 
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3s | %%%ds | %%6s | %%9s | %%9s |\n", max_len);
-	memset (dash_buf, '-', 40 + max_len);
-	dash_buf[40 + max_len] = '\0';
+		"| %%3s | %%%ds | %%6s | %%9s | %%9s | %%9s |\n", max_len);
+	memset (dash_buf, '-', 52 + max_len);
+	dash_buf[52 + max_len] = '\0';
 
 	printf ("Symbols cache\n");
 	printf (" %s \n", dash_buf);
 	if (tty) {
 		printf ("\033[1m");
 	}
-	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time");
+	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time",
+		"P99 time");
 	if (tty) {
 		printf ("\033[0m");
 	}
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f |\n", max_len);
+		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f | %%9.0f |\n", max_len);
 
 	iter = NULL;
 	i = 0;
@@ -766,12 +812,14 @@ rspamc_counters_output (FILE *out, ucl_object_t *obj)
 		weight = ucl_object_lookup (cur, "weight");
 		freq = ucl_object_lookup (cur, "frequency");
 		tim = ucl_object_lookup (cur, "time");
+		p99 = ucl_object_lookup (cur, "p99");
 		if (sym && weight && freq && tim) {
 			printf (fmt_buf, i,
 				ucl_object_tostring (sym),
 				ucl_object_todouble (weight),
 				(gint)ucl_object_toint (freq),
-				ucl_object_todouble (tim));
+				ucl_object_todouble (tim),
+				p99 ? ucl_object_todouble (p99) : 0.0);
 		}
 		i++;
 	}
@@ -840,7 +888,7 @@ rspamc_stat_output (FILE *out, ucl_object_t *obj)
 	GString *out_str;
 	ucl_object_iter_t iter = NULL;
 	const ucl_object_t *st, *cur;
-	gint64 scanned;
+	gint64 scanned, hits, misses;
 
 	out_str = g_string_sized_new (BUFSIZ);
 
@@ -873,6 +921,10 @@ rspamc_stat_output (FILE *out, ucl_object_t *obj)
 		ucl_object_toint (ucl_object_lookup (obj, "chunks_freed")));
 	rspamd_printf_gstring (out_str, "Oversized chunks: %L\n",
 		ucl_object_toint (ucl_object_lookup (obj, "chunks_oversized")));
+	hits = ucl_object_toint (ucl_object_lookup (obj, "chunks_cache_hits"));
+	misses = ucl_object_toint (ucl_object_lookup (obj, "chunks_cache_misses"));
+	rspamd_printf_gstring (out_str, "Chunks reused from cache: %L (%.2f%%)\n",
+		hits, hits + misses > 0 ? hits * 100.0 / (hits + misses) : 0.0);
 	/* Fuzzy */
 	rspamd_printf_gstring (out_str, "Fuzzy hashes stored: %L\n",
 		ucl_object_toint (ucl_object_lookup (obj, "fuzzy_stored")));
@@ -1384,6 +1436,319 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 	event_base_loop (ev_base, 0);
 }
 
+static void
+rspamc_bulk_unmap (struct rspamc_bulk_ctx *ctx)
+{
+	if (ctx->map) {
+		munmap (ctx->map, ctx->maplen);
+		ctx->map = NULL;
+	}
+
+	g_free (ctx->fname);
+	ctx->fname = NULL;
+}
+
+static gboolean
+rspamc_bulk_map (struct rspamc_bulk_ctx *ctx, const gchar *fname)
+{
+	struct stat st;
+	gint fd;
+	gpointer map;
+
+	fd = open (fname, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot open file %s: %s\n", fname,
+				strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return FALSE;
+	}
+
+	if (!S_ISREG (st.st_mode) || st.st_size == 0) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		rspamd_fprintf (stderr, "cannot mmap file %s: %s\n", fname,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	/* Each message is copied to a request once */
+	(void)madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+	ctx->map = map;
+	ctx->maplen = st.st_size;
+	ctx->mappos = 0;
+	ctx->nmsg = 0;
+	ctx->fname = g_strdup (fname);
+
+	return TRUE;
+}
+
+/* Maps the next regular file from the command line or from a directory */
+static gboolean
+rspamc_bulk_next_file (struct rspamc_bulk_ctx *ctx)
+{
+	struct dirent *ent;
+	struct stat st;
+	gchar filebuf[PATH_MAX];
+
+	rspamc_bulk_unmap (ctx);
+
+	for (;;) {
+		if (ctx->dir) {
+			ent = readdir (ctx->dir);
+
+			if (ent == NULL) {
+				closedir (ctx->dir);
+				ctx->dir = NULL;
+				continue;
+			}
+
+			if (ent->d_name[0] == '.') {
+				continue;
+			}
+
+			rspamd_snprintf (filebuf, sizeof (filebuf), "%s%c%s",
+					ctx->dirname, G_DIR_SEPARATOR, ent->d_name);
+
+			if (rspamc_bulk_map (ctx, filebuf)) {
+				return TRUE;
+			}
+		}
+		else if (ctx->cur_file < ctx->nfiles) {
+			ctx->dirname = ctx->files[ctx->cur_file ++];
+
+			if (stat (ctx->dirname, &st) == -1) {
+				rspamd_fprintf (stderr, "cannot stat file %s\n", ctx->dirname);
+				exit (EXIT_FAILURE);
+			}
+
+			if (S_ISDIR (st.st_mode)) {
+				ctx->dir = opendir (ctx->dirname);
+
+				if (ctx->dir == NULL) {
+					rspamd_fprintf (stderr, "cannot open directory %s\n",
+							ctx->dirname);
+					exit (EXIT_FAILURE);
+				}
+			}
+			else if (rspamc_bulk_map (ctx, ctx->dirname)) {
+				return TRUE;
+			}
+		}
+		else {
+			return FALSE;
+		}
+	}
+}
+
+/* Returns the next message from the mapped files, mbox is split by From lines */
+static gboolean
+rspamc_bulk_next_message (struct rspamc_bulk_ctx *ctx, const gchar **data,
+		gsize *len, gchar **name)
+{
+	const gchar *p, *end;
+	goffset r;
+
+	while (ctx->map == NULL || ctx->mappos >= ctx->maplen) {
+		if (!rspamc_bulk_next_file (ctx)) {
+			return FALSE;
+		}
+	}
+
+	p = (const gchar *)ctx->map + ctx->mappos;
+	end = (const gchar *)ctx->map + ctx->maplen;
+
+	if (!mbox) {
+		*data = p;
+		*len = end - p;
+		*name = g_strdup (ctx->fname);
+		ctx->mappos = ctx->maplen;
+
+		return TRUE;
+	}
+
+	if (end - p > 5 && memcmp (p, "From ", 5) == 0) {
+		/* Skip envelope line */
+		p = memchr (p, '\n', end - p);
+
+		if (p == NULL) {
+			ctx->mappos = ctx->maplen;
+
+			return rspamc_bulk_next_message (ctx, data, len, name);
+		}
+
+		p ++;
+	}
+
+	r = rspamd_substring_search (p, end - p, "\nFrom ", sizeof ("\nFrom ") - 1);
+
+	*data = p;
+	*len = r == -1 ? (gsize)(end - p) : (gsize)r + 1;
+	*name = g_strdup_printf ("%s:%u", ctx->fname, ++ctx->nmsg);
+	ctx->mappos = (p + *len) - (const gchar *)ctx->map;
+
+	return TRUE;
+}
+
+static void rspamc_bulk_start (struct rspamc_bulk_ctx *ctx);
+
+static void
+rspamc_bulk_cb (struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name, ucl_object_t *result, GString *input,
+	gpointer ud, GError *err)
+{
+	struct rspamc_bulk_req *req = (struct rspamc_bulk_req *)ud;
+	struct rspamc_bulk_ctx *ctx = req->ctx;
+	gchar *ucl_out;
+
+	if (result == NULL) {
+		result = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (result,
+				ucl_object_fromstring (err ? err->message : "unknown error"),
+				"error", 0, false);
+		ctx->nerrors ++;
+	}
+	else {
+		ctx->nscanned ++;
+	}
+
+	/* One line per message */
+	ucl_object_insert_key (result, ucl_object_fromstring (req->name),
+			"filename", 0, false);
+	ucl_object_insert_key (result,
+			ucl_object_fromdouble (rspamd_get_ticks () - req->start),
+			"scan_time", 0, false);
+	ucl_out = ucl_object_emit (result, UCL_EMIT_JSON_COMPACT);
+	rspamd_fprintf (stdout, "%s\n", ucl_out);
+	free (ucl_out);
+	ucl_object_unref (result);
+
+	/* Socket is returned to the pool and picked by the next request */
+	rspamd_client_destroy (conn);
+	g_free (req->name);
+	g_slice_free1 (sizeof (*req), req);
+	ctx->inflight --;
+
+	rspamc_bulk_start (ctx);
+
+	if (ctx->inflight == 0) {
+		/* Do not wait for idle keep-alive sockets */
+		event_base_loopbreak (ctx->ev_base);
+	}
+}
+
+static void
+rspamc_bulk_start (struct rspamc_bulk_ctx *ctx)
+{
+	struct rspamd_client_connection *conn;
+	struct rspamc_bulk_req *req;
+	const gchar *data;
+	gchar *name;
+	gsize len;
+	GError *err = NULL;
+
+	while (ctx->inflight < (guint)max_requests &&
+			rspamc_bulk_next_message (ctx, &data, &len, &name)) {
+		conn = rspamd_client_init_keepalive (ctx->ev_base, ctx->addr, timeout,
+				ctx->key, ctx->keypair, ctx->keys_cache);
+
+		if (conn == NULL) {
+			rspamd_fprintf (stderr, "cannot connect to %s\n", connect_str);
+			exit (EXIT_FAILURE);
+		}
+
+		req = g_slice_alloc (sizeof (*req));
+		req->ctx = ctx;
+		req->name = name;
+		req->start = rspamd_get_ticks ();
+
+		if (!rspamd_client_command_data (conn, ctx->cmd->path, ctx->attrs,
+				data, len, rspamc_bulk_cb, req, &err)) {
+			rspamd_fprintf (stderr, "cannot send %s: %e\n", name, err);
+			exit (EXIT_FAILURE);
+		}
+
+		ctx->inflight ++;
+	}
+}
+
+static void
+rspamc_process_bulk (struct event_base *ev_base, struct rspamc_command *cmd,
+	gchar **files, gint nfiles, GQueue *attrs)
+{
+	struct rspamc_bulk_ctx ctx;
+	GPtrArray *addrs = NULL;
+	gdouble start, elapsed;
+
+	if (!cmd->need_input) {
+		rspamd_fprintf (stderr, "command %s does not accept input\n",
+				cmd->name);
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+
+	if (!rspamd_parse_host_port_priority (connect_str, &addrs, NULL, NULL,
+			cmd->is_controller ? DEFAULT_CONTROL_PORT : DEFAULT_PORT, NULL)) {
+		rspamd_fprintf (stderr, "cannot parse %s\n", connect_str);
+		exit (EXIT_FAILURE);
+	}
+
+	if (key) {
+		ctx.key = rspamd_pubkey_from_base32 (key, 0, RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+
+		if (ctx.key == NULL) {
+			rspamd_fprintf (stderr, "invalid key: %s\n", key);
+			exit (EXIT_FAILURE);
+		}
+
+		/* All requests are encrypted with the same keypair */
+		ctx.keypair = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	ctx.ev_base = ev_base;
+	ctx.cmd = cmd;
+	ctx.attrs = attrs;
+	ctx.addr = g_ptr_array_index (addrs, 0);
+	ctx.keys_cache = rspamd_keypair_cache_new (32);
+	ctx.files = files;
+	ctx.nfiles = nfiles;
+
+	start = rspamd_get_ticks ();
+	rspamc_bulk_start (&ctx);
+	event_base_loop (ev_base, 0);
+	elapsed = rspamd_get_ticks () - start;
+
+	rspamd_fprintf (stderr, "%uL messages scanned, %uL errors in %.2f seconds"
+			" (%.1f messages per second)\n",
+			ctx.nscanned, ctx.nerrors, elapsed,
+			elapsed > 0 ? (ctx.nscanned + ctx.nerrors) / elapsed : 0.0);
+
+	if (ctx.key) {
+		rspamd_pubkey_unref (ctx.key);
+		rspamd_keypair_unref (ctx.keypair);
+	}
+
+	rspamd_keypair_cache_destroy (ctx.keys_cache);
+	g_ptr_array_free (addrs, TRUE);
+}
+
 gint
 main (gint argc, gchar **argv, gchar **env)
 {
@@ -1467,7 +1832,11 @@ main (gint argc, gchar **argv, gchar **env)
 
 	add_options (kwattrs);
 
-	if (start_argc == argc) {
+	if (bulk && start_argc < argc) {
+		rspamc_process_bulk (ev_base, cmd, argv + start_argc, argc - start_argc,
+				kwattrs);
+	}
+	else if (start_argc == argc) {
 		/* Do command without input or with stdin */
 		if (empty_input) {
 			rspamc_process_input (ev_base, cmd, NULL, "empty", kwattrs);
@@ -1505,7 +1874,9 @@ main (gint argc, gchar **argv, gchar **env)
 		}
 	}
 
-	event_base_loop (ev_base, 0);
+	if (!bulk || start_argc == argc) {
+		event_base_loop (ev_base, 0);
+	}
 
 	g_queue_free_full (kwattrs, g_free);
 
@@ -40,6 +40,7 @@ struct rspamd_client_connection {
 	gboolean req_sent;
 	struct rspamd_client_request *req;
 	struct rspamd_keypair_cache *keys_cache;
+	rspamd_inet_addr_t *addr; /* Set for keep-alive connections */
 };
 
 struct rspamd_client_request {
@@ -193,18 +194,82 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	return conn;
 }
 
-gboolean
-rspamd_client_command (struct rspamd_client_connection *conn,
-	const gchar *command, GQueue *attrs,
-	FILE *in, rspamd_client_callback cb,
-	gpointer ud, GError **err)
+struct rspamd_client_connection *
+rspamd_client_init_keepalive (struct event_base *ev_base,
+	const rspamd_inet_addr_t *addr, gdouble timeout,
+	struct rspamd_cryptobox_pubkey *key,
+	struct rspamd_cryptobox_keypair *keypair,
+	struct rspamd_keypair_cache *keys_cache)
+{
+	struct rspamd_client_connection *conn;
+	gint fd;
+
+	fd = rspamd_http_keepalive_connect (addr, key, NULL);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	conn = g_slice_alloc0 (sizeof (struct rspamd_client_connection));
+	conn->ev_base = ev_base;
+	conn->fd = fd;
+	conn->req_sent = FALSE;
+	conn->keys_cache = keys_cache;
+	conn->addr = rspamd_inet_address_copy (addr);
+	conn->http_conn = rspamd_http_connection_new (rspamd_client_body_handler,
+			rspamd_client_error_handler,
+			rspamd_client_finish_handler,
+			RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
+			RSPAMD_HTTP_CLIENT,
+			conn->keys_cache);
+
+	conn->server_name = g_string_new (rspamd_inet_address_to_string (addr));
+	if (rspamd_inet_address_get_port (addr) != 0) {
+		rspamd_printf_gstring (conn->server_name, ":%d",
+				(int)rspamd_inet_address_get_port (addr));
+	}
+
+	double_to_tv (timeout, &conn->timeout);
+
+	if (key && keypair) {
+		conn->key = rspamd_pubkey_ref (key);
+		conn->keypair = rspamd_keypair_ref (keypair);
+		rspamd_http_connection_set_key (conn->http_conn, conn->keypair);
+	}
+
+	return conn;
+}
+
+static void
+rspamd_client_send (struct rspamd_client_connection *conn,
+	struct rspamd_client_request *req,
+	const gchar *command, GQueue *attrs)
 {
-	struct rspamd_client_request *req;
 	struct rspamd_http_client_header *nh;
-	gchar *p;
-	gsize remain, old_len;
 	GList *cur;
-	GString *input = NULL;
+
+	/* Convert headers */
+	cur = attrs->head;
+	while (cur != NULL) {
+		nh = cur->data;
+
+		rspamd_http_message_add_header (req->msg, nh->name, nh->value);
+		cur = g_list_next (cur);
+	}
+
+	req->msg->url = rspamd_fstring_append (req->msg->url, "/", 1);
+	req->msg->url = rspamd_fstring_append (req->msg->url, command, strlen (command));
+
+	conn->req = req;
+
+	rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
+		"text/plain", req, conn->fd, &conn->timeout, conn->ev_base);
+}
+
+static struct rspamd_client_request *
+rspamd_client_request_new (struct rspamd_client_connection *conn,
+	rspamd_client_callback cb, gpointer ud)
+{
+	struct rspamd_client_request *req;
 
 	req = g_slice_alloc0 (sizeof (struct rspamd_client_request));
 	req->conn = conn;
@@ -216,6 +281,22 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		req->msg->peer_key = rspamd_pubkey_ref (conn->key);
 	}
 
+	return req;
+}
+
+gboolean
+rspamd_client_command (struct rspamd_client_connection *conn,
+	const gchar *command, GQueue *attrs,
+	FILE *in, rspamd_client_callback cb,
+	gpointer ud, GError **err)
+{
+	struct rspamd_client_request *req;
+	gchar *p;
+	gsize remain, old_len;
+	GString *input = NULL;
+
+	req = rspamd_client_request_new (conn, cb, ud);
+
 	if (in != NULL) {
 		/* Read input stream */
 		input = g_string_sized_new (BUFSIZ);
@@ -251,22 +332,25 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		req->input = NULL;
 	}
 
-	/* Convert headers */
-	cur = attrs->head;
-	while (cur != NULL) {
-		nh = cur->data;
+	rspamd_client_send (conn, req, command, attrs);
 
-		rspamd_http_message_add_header (req->msg, nh->name, nh->value);
-		cur = g_list_next (cur);
-	}
+	return TRUE;
+}
 
-	req->msg->url = rspamd_fstring_append (req->msg->url, "/", 1);
-	req->msg->url = rspamd_fstring_append (req->msg->url, command, strlen (command));
+gboolean
+rspamd_client_command_data (struct rspamd_client_connection *conn,
+	const gchar *command, GQueue *attrs,
+	const gchar *data, gsize len, rspamd_client_callback cb,
+	gpointer ud, GError **err)
+{
+	struct rspamd_client_request *req;
 
-	conn->req = req;
+	req = rspamd_client_request_new (conn, cb, ud);
+	/* Input is not retained, so callback receives NULL instead of it */
+	req->msg->body = rspamd_fstring_new_init (data, len);
+	req->input = NULL;
 
-	rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
-		"text/plain", req, conn->fd, &conn->timeout, conn->ev_base);
+	rspamd_client_send (conn, req, command, attrs);
 
 	return TRUE;
 }
@@ -275,11 +359,23 @@ void
 rspamd_client_destroy (struct rspamd_client_connection *conn)
 {
 	if (conn != NULL) {
+		if (conn->addr && conn->http_conn->fd != -1) {
+			/* Socket is either kept for the next request or closed */
+			rspamd_http_keepalive_release (conn->http_conn, conn->addr,
+					conn->key, conn->ev_base);
+		}
+		else {
+			close (conn->fd);
+		}
+
+		if (conn->addr) {
+			rspamd_inet_address_destroy (conn->addr);
+		}
+
 		rspamd_http_connection_unref (conn->http_conn);
 		if (conn->req != NULL) {
 			rspamd_client_request_free (conn->req);
 		}
-		close (conn->fd);
 		if (conn->key) {
 			rspamd_pubkey_unref (conn->key);
 		}
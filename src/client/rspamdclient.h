@@ -18,10 +18,14 @@
 
 #include "config.h"
 #include "ucl.h"
+#include "addr.h"
 #include <event.h>
 
 struct rspamd_client_connection;
 struct rspamd_http_message;
+struct rspamd_cryptobox_pubkey;
+struct rspamd_cryptobox_keypair;
+struct rspamd_keypair_cache;
 
 struct rspamd_http_client_header {
 	const gchar *name;
@@ -60,6 +64,25 @@ struct rspamd_client_connection * rspamd_client_init (
 	gdouble timeout,
 	const gchar *key);
 
+/**
+ * Start rspamd command over a keep-alive connection: an idle socket to the
+ * same peer is reused if possible and it is returned to the pool on destroy
+ * @param ev_base event base
+ * @param addr address of server
+ * @param timeout timeout in seconds
+ * @param key public key of server or NULL
+ * @param keypair local keypair shared by connections (used if key is set)
+ * @param keys_cache shared keys cache
+ * @return
+ */
+struct rspamd_client_connection * rspamd_client_init_keepalive (
+	struct event_base *ev_base,
+	const rspamd_inet_addr_t *addr,
+	gdouble timeout,
+	struct rspamd_cryptobox_pubkey *key,
+	struct rspamd_cryptobox_keypair *keypair,
+	struct rspamd_keypair_cache *keys_cache);
+
 /**
  *
  * @param conn connection object
@@ -79,6 +102,28 @@ gboolean rspamd_client_command (
 	gpointer ud,
 	GError **err);
 
+/**
+ * Send command with input from memory, input is copied to the request and
+ * callback is called with NULL input
+ * @param conn connection object
+ * @param command command name
+ * @param attrs additional attributes
+ * @param data input data
+ * @param len length of input
+ * @param cb callback to be called on command completion
+ * @param ud opaque user data
+ * @return
+ */
+gboolean rspamd_client_command_data (
+	struct rspamd_client_connection *conn,
+	const gchar *command,
+	GQueue *attrs,
+	const gchar *data,
+	gsize len,
+	rspamd_client_callback cb,
+	gpointer ud,
+	GError **err);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
@@ -22,6 +22,8 @@
 #include "rspamd.h"
 #include "libserver/worker_util.h"
 #include "cryptobox.h"
+#include "keypair.h"
+#include "libutil/hash.h"
 #include "ottery.h"
 #include "libutil/rrd.h"
 #include "unix-std.h"
@@ -29,6 +31,10 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+#define DEFAULT_LEARN_CONCURRENCY 8
+/* Verified credentials are cached for 10 minutes */
+#define DEFAULT_AUTH_CACHE_TTL 600.0
+#define DEFAULT_AUTH_CACHE_SIZE 1024
 
 #define DEFAULT_STATS_PATH RSPAMD_DBDIR "/stats.ucl"
 
@@ -52,6 +58,9 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_RECACHE "/recache"
+#define PATH_LUA_PROFILE "/luaprofile"
+#define PATH_METRICS "/metrics"
 
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
@@ -129,9 +138,11 @@ struct rspamd_controller_worker_ctx {
 	gchar *password;
 	/* Privilleged password */
 	gchar *enable_password;
-	/* Cached versions of the passwords */
-	rspamd_ftok_t cached_password;
-	rspamd_ftok_t cached_enable_password;
+	/* Results of encrypted passwords verification */
+	rspamd_lru_hash_t *auth_cache;
+	guchar auth_cache_key[rspamd_cryptobox_HASHKEYBYTES];
+	gdouble auth_cache_ttl;
+	guint32 auth_cache_size;
 	/* HTTP server */
 	struct rspamd_http_connection_router *http;
 	/* Server's start time */
@@ -166,8 +177,43 @@ struct rspamd_controller_worker_ctx {
 	struct event *rrd_event;
 	struct rspamd_rrd_file *rrd;
 
+	/* Number of messages from a single mbox learned simultaneously */
+	guint32 learn_concurrency;
+
+};
+
+/* Element of the authentication cache */
+struct rspamd_controller_auth_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gboolean valid;
 };
 
+static void
+rspamd_controller_auth_elt_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct rspamd_controller_auth_elt), p);
+}
+
+static guint
+rspamd_controller_auth_hash (gconstpointer p)
+{
+	const struct rspamd_controller_auth_elt *elt = p;
+	guint h;
+
+	/* Digest is a keyed hash, so any part of it is good enough */
+	memcpy (&h, elt->digest, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+rspamd_controller_auth_equal (gconstpointer p1, gconstpointer p2)
+{
+	const struct rspamd_controller_auth_elt *e1 = p1, *e2 = p2;
+
+	return memcmp (e1->digest, e2->digest, sizeof (e1->digest)) == 0;
+}
+
 static gboolean
 rspamd_is_encrypted_password (const gchar *password,
 		struct rspamd_controller_pbkdf const **pbkdf)
@@ -244,36 +290,47 @@ static gboolean
 rspamd_check_encrypted_password (struct rspamd_controller_worker_ctx *ctx,
 		const rspamd_ftok_t * password, const gchar * check,
 		const struct rspamd_controller_pbkdf *pbkdf,
-		gboolean is_enable)
+		struct rspamd_cryptobox_pubkey *peer_key)
 {
 	const gchar *salt, *hash;
 	gchar *salt_decoded, *key_decoded;
 	gsize salt_len = 0, key_len = 0;
 	gboolean ret = TRUE;
 	guchar *local_key;
-	rspamd_ftok_t *cache;
-	gpointer m;
-
-	/* First of all check cached versions to save resources */
-	if (is_enable && ctx->cached_enable_password.len != 0) {
-		if (password->len != ctx->cached_enable_password.len ||
-				!rspamd_constant_memcmp (password->begin,
-						ctx->cached_enable_password.begin, password->len)) {
-			msg_info_ctx ("incorrect or absent enable password has been specified");
-			return FALSE;
-		}
+	const guchar *pk;
+	guint pklen;
+	rspamd_cryptobox_hash_state_t st;
+	struct rspamd_controller_auth_elt search, *elt;
+	time_t now;
+
+	/*
+	 * First of all check cached results to save resources: cache is indexed by
+	 * a keyed hash of the stored password, the supplied one and the client's
+	 * public key, so neither of them is kept in memory
+	 */
+	now = time (NULL);
+	rspamd_cryptobox_hash_init (&st, ctx->auth_cache_key,
+			sizeof (ctx->auth_cache_key));
+	rspamd_cryptobox_hash_update (&st, check, strlen (check) + 1);
+	rspamd_cryptobox_hash_update (&st, password->begin, password->len);
+
+	if (peer_key) {
+		pk = rspamd_pubkey_get_pk (peer_key, &pklen);
+		rspamd_cryptobox_hash_update (&st, pk, pklen);
+	}
+
+	rspamd_cryptobox_hash_final (&st, search.digest);
+
+	if (ctx->auth_cache) {
+		elt = rspamd_lru_hash_lookup (ctx->auth_cache, &search, now);
+
+		if (elt != NULL) {
+			if (!elt->valid) {
+				msg_info_ctx ("incorrect or absent password has been specified");
+			}
 
-		return TRUE;
-	}
-	else if (!is_enable && ctx->cached_password.len != 0) {
-		if (password->len != ctx->cached_password.len ||
-				!rspamd_constant_memcmp (password->begin,
-						ctx->cached_password.begin, password->len)) {
-			msg_info_ctx ("incorrect or absent password has been specified");
-			return FALSE;
+			return elt->valid;
 		}
-
-		return TRUE;
 	}
 
 	g_assert (pbkdf != NULL);
@@ -318,20 +375,12 @@ rspamd_check_encrypted_password (struct rspamd_controller_worker_ctx *ctx,
 		g_free (key_decoded);
 	}
 
-	if (ret) {
-		/* Save cached version */
-		cache = is_enable ? &ctx->cached_enable_password : &ctx->cached_password;
-
-		if (cache->len == 0) {
-			/* Mmap region */
-			m = mmap (NULL, password->len, PROT_WRITE,
-					MAP_PRIVATE | MAP_ANON, -1, 0);
-			memcpy (m, password->begin, password->len);
-			(void)mprotect (m, password->len, PROT_READ);
-			(void)mlock (m, password->len);
-			cache->begin = m;
-			cache->len = password->len;
-		}
+	if (ctx->auth_cache) {
+		elt = g_slice_alloc (sizeof (*elt));
+		memcpy (elt->digest, search.digest, sizeof (elt->digest));
+		elt->valid = ret;
+		rspamd_lru_hash_insert (ctx->auth_cache, elt, elt, now,
+				ctx->auth_cache_ttl);
 	}
 
 	return ret;
@@ -509,7 +558,7 @@ static gboolean rspamd_controller_check_password(
 				}
 				else {
 					ret = rspamd_check_encrypted_password (ctx, password, check,
-							pbkdf, use_enable);
+							pbkdf, msg->peer_key);
 				}
 			}
 			else {
@@ -533,7 +582,7 @@ static gboolean rspamd_controller_check_password(
 				else {
 					check_normal = rspamd_check_encrypted_password (ctx,
 							password,
-							check, pbkdf, FALSE);
+							check, pbkdf, msg->peer_key);
 				}
 
 			}
@@ -549,7 +598,7 @@ static gboolean rspamd_controller_check_password(
 				else {
 					check_enable = rspamd_check_encrypted_password (ctx,
 							password,
-							check, pbkdf, TRUE);
+							check, pbkdf, msg->peer_key);
 				}
 			}
 			else {
@@ -1130,13 +1179,15 @@ rspamd_controller_handle_graph (
 
 /*
  * History command handler:
- * request: /history
+ * request: /history[?since=<seq>]
  * headers: Password
  * reply: json [
  *      { label: "Foo", data: 11 },
  *      { label: "Bar", data: 20 },
  *      {...}
  * ]
+ * if `since` is specified then merely rows with sequence numbers starting
+ * from `since` are returned as {"seq": <next seq>, "rows": [...]}
  */
 static int
 rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
@@ -1144,11 +1195,17 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row, *copied_rows;
-	guint i, rows_proc, row_num;
+	struct roll_history_row *row;
+	GArray *rows;
+	GHashTable *query;
+	GString *syms;
+	rspamd_ftok_t srch, *value;
+	guint i, since = 0, next;
+	gboolean incremental = FALSE;
+	gulong since_val;
 	struct tm *tm;
 	gchar timebuf[32];
-	ucl_object_t *top, *obj;
+	struct rspamd_json_emitter e;
 
 	ctx = session->ctx;
 
@@ -1156,63 +1213,92 @@ rspamd_controller_handle_history (struct rspamd_http_connection_entry *conn_ent,
 		return 0;
 	}
 
-	top = ucl_object_typed_new (UCL_ARRAY);
+	query = rspamd_http_message_parse_query (msg);
 
-	/* Set lock on history */
-	copied_rows = g_slice_alloc (sizeof (*copied_rows) * ctx->srv->history->nrows);
-	memcpy (copied_rows, ctx->srv->history->rows,
-			sizeof (*copied_rows) * ctx->srv->history->nrows);
+	if (query) {
+		srch.begin = (gchar *)"since";
+		srch.len = sizeof ("since") - 1;
 
-	/* Go through all rows */
-	row_num = ctx->srv->history->cur_row;
+		if ((value = g_hash_table_lookup (query, &srch)) != NULL) {
+			if (!rspamd_strtoul (value->begin, value->len, &since_val)) {
+				g_hash_table_unref (query);
+				msg_err_session ("invalid since value");
+				rspamd_controller_send_error (conn_ent, 400, "invalid since");
 
-	for (i = 0, rows_proc = 0; i < ctx->srv->history->nrows; i++, row_num++) {
-		if (row_num == ctx->srv->history->nrows) {
-			row_num = 0;
-		}
-		row = &copied_rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			tm = localtime (&row->tv.tv_sec);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromint (
-					row->tv.tv_sec), "unix_time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
-					"ip", 0, false);
-			ucl_object_insert_key (obj,
-				ucl_object_fromstring (rspamd_action_to_str (
-					row->action)), "action", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromdouble (
-					row->score),		  "score",			0, false);
-			ucl_object_insert_key (obj,
-				ucl_object_fromdouble (
-					row->required_score), "required_score", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->symbols),		  "symbols",		0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->len),			  "size",			0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromdouble (
-					row->scan_time),	  "scan_time",		0, false);
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->user), "user", 0, false);
-			}
-			if (row->from_addr[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->from_addr), "from", 0, false);
+				return 0;
 			}
-			ucl_array_append (top, obj);
-			rows_proc++;
+
+			since = since_val;
+			incremental = TRUE;
+		}
+
+		g_hash_table_unref (query);
+	}
+
+	rows = rspamd_roll_history_copy (ctx->srv->history, since, &next);
+	syms = g_string_sized_new (128);
+
+	/* Rows are written directly to the reply, 256 bytes per row in average */
+	rspamd_json_emitter_init (&e,
+			rspamd_fstring_sized_new (rows->len * 256 + 32));
+
+	if (incremental) {
+		rspamd_json_emit_object_start (&e);
+		rspamd_json_emit_key (&e, "seq");
+		rspamd_json_emit_int (&e, next);
+		rspamd_json_emit_key (&e, "rows");
+	}
+
+	rspamd_json_emit_array_start (&e);
+
+	for (i = 0; i < rows->len; i ++) {
+		row = &g_array_index (rows, struct roll_history_row, i);
+		rspamd_roll_history_symbols_str (row, ctx->cfg->cache, syms);
+		tm = localtime (&row->tv.tv_sec);
+		strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
+		rspamd_json_emit_object_start (&e);
+		rspamd_json_emit_key (&e, "seq");
+		rspamd_json_emit_int (&e, row->seq - 1);
+		rspamd_json_emit_key (&e, "time");
+		rspamd_json_emit_string (&e, timebuf);
+		rspamd_json_emit_key (&e, "unix_time");
+		rspamd_json_emit_int (&e, row->tv.tv_sec);
+		rspamd_json_emit_key (&e, "id");
+		rspamd_json_emit_string (&e, row->message_id);
+		rspamd_json_emit_key (&e, "ip");
+		rspamd_json_emit_string (&e, row->from_addr);
+		rspamd_json_emit_key (&e, "action");
+		rspamd_json_emit_string (&e, rspamd_action_to_str (row->action));
+		rspamd_json_emit_key (&e, "score");
+		rspamd_json_emit_double (&e, row->score);
+		rspamd_json_emit_key (&e, "required_score");
+		rspamd_json_emit_double (&e, row->required_score);
+		rspamd_json_emit_key (&e, "symbols");
+		rspamd_json_emit_string (&e, syms->str);
+		rspamd_json_emit_key (&e, "size");
+		rspamd_json_emit_int (&e, row->len);
+		rspamd_json_emit_key (&e, "scan_time");
+		rspamd_json_emit_double (&e, row->scan_time);
+		if (row->user[0] != '\0') {
+			rspamd_json_emit_key (&e, "user");
+			rspamd_json_emit_string (&e, row->user);
 		}
+		if (row->from_addr[0] != '\0') {
+			rspamd_json_emit_key (&e, "from");
+			rspamd_json_emit_string (&e, row->from_addr);
+		}
+		rspamd_json_emit_object_end (&e);
 	}
 
-	rspamd_controller_send_ucl (conn_ent, top);
-	ucl_object_unref (top);
+	g_array_free (rows, TRUE);
+	g_string_free (syms, TRUE);
+	rspamd_json_emit_array_end (&e);
+
+	if (incremental) {
+		rspamd_json_emit_object_end (&e);
+	}
+
+	rspamd_controller_send_json (conn_ent, e.buf);
 
 	return 0;
 }
@@ -1223,8 +1309,6 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	guint start_row, i, t;
 
 	ctx = session->ctx;
 
@@ -1232,26 +1316,7 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 		return 0;
 	}
 
-	/* Clean from start to the current row */
-	start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-	for (i = 0; i < start_row; i ++) {
-		t = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-		/* We somehow come to the race condition */
-		if (i >= t) {
-			break;
-		}
-
-		row = &ctx->srv->history->rows[i];
-		memset (row, 0, sizeof (*row));
-	}
-
-	start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-	/* Optimistically set all bytes to zero (might cause race) */
-	memset (ctx->srv->history->rows,
-			0,
-			sizeof (*row) * (ctx->srv->history->nrows - start_row));
+	rspamd_roll_history_reset (ctx->srv->history);
 
 	msg_info_session ("<%s> reseted history",
 			rspamd_inet_address_to_string (session->from_addr));
@@ -1365,6 +1430,276 @@ rspamd_controller_check_fin_task (void *ud)
 	return FALSE;
 }
 
+/* Messages from a single mbox learned by a single request */
+struct rspamd_controller_learn_queue {
+	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_http_message *msg;
+	GArray *messages;
+	GPtrArray *tasks;
+	GPtrArray *finished;
+	struct event step_ev;
+	guint cur;
+	guint learned;
+	guint failed;
+	gboolean is_spam;
+	gboolean replied;
+};
+
+/* Split mbox to messages skipping `From ` envelope lines */
+static GArray *
+rspamd_controller_split_mbox (const gchar *p, gsize len)
+{
+	GArray *res;
+	const gchar *end = p + len, *line = p, *next, *start = NULL;
+	rspamd_ftok_t tok;
+
+	res = g_array_new (FALSE, FALSE, sizeof (rspamd_ftok_t));
+
+	while (line < end) {
+		next = memchr (line, '\n', end - line);
+		next = next ? next + 1 : end;
+
+		if (end - line > 5 && memcmp (line, "From ", 5) == 0) {
+			if (start != NULL) {
+				tok.begin = start;
+				tok.len = line - start;
+				g_array_append_val (res, tok);
+			}
+
+			start = next;
+		}
+
+		line = next;
+	}
+
+	if (start == NULL) {
+		/* Not an mbox, so it is a single message */
+		start = p;
+	}
+
+	if (start < end) {
+		tok.begin = start;
+		tok.len = end - start;
+		g_array_append_val (res, tok);
+	}
+
+	return res;
+}
+
+static void
+rspamd_controller_learn_queue_schedule (struct rspamd_controller_learn_queue *q)
+{
+	struct timeval tv = {0, 0};
+
+	event_add (&q->step_ev, &tv);
+}
+
+static void
+rspamd_controller_learn_queue_done (struct rspamd_controller_learn_queue *q,
+		struct rspamd_task *task, gboolean success)
+{
+	struct rspamd_controller_session *session = q->conn_ent->ud;
+
+	if (success) {
+		q->learned ++;
+	}
+	else {
+		q->failed ++;
+		msg_info_session ("cannot learn <%s>: %e", task->message_id,
+				task->err);
+	}
+
+	g_ptr_array_remove_fast (q->tasks, task);
+	/* Task cannot be destroyed from its own callback */
+	g_ptr_array_add (q->finished, task);
+	rspamd_controller_learn_queue_schedule (q);
+}
+
+static gboolean
+rspamd_controller_learn_queue_fin_task (void *ud)
+{
+	struct rspamd_task *task = ud;
+	struct rspamd_controller_learn_queue *q = task->fin_arg;
+	gboolean success = TRUE;
+
+	if (task->err == NULL && !RSPAMD_TASK_IS_PROCESSED (task)) {
+		if (!rspamd_task_process (task, RSPAMD_TASK_PROCESS_LEARN)) {
+			success = FALSE;
+		}
+		else if (!RSPAMD_TASK_IS_PROCESSED (task)) {
+			/* One more iteration */
+			return FALSE;
+		}
+	}
+
+	rspamd_controller_learn_queue_done (q, task,
+			success && task->err == NULL);
+
+	return TRUE;
+}
+
+static void
+rspamd_controller_learn_queue_start (struct rspamd_controller_learn_queue *q,
+		const rspamd_ftok_t *message)
+{
+	struct rspamd_controller_session *session = q->conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (ctx->worker, session->cfg);
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+	task->s = rspamd_session_create (session->pool,
+			rspamd_controller_learn_queue_fin_task,
+			NULL,
+			(event_finalizer_t )rspamd_task_free,
+			task);
+	task->fin_arg = q;
+	task->sock = -1;
+
+	if (!rspamd_task_load_message (task, q->msg, message->begin,
+			message->len)) {
+		q->failed ++;
+		msg_info_session ("cannot load message: %e", task->err);
+		rspamd_session_destroy (task->s);
+
+		return;
+	}
+
+	rspamd_learn_task_spam (task, q->is_spam, session->classifier, NULL);
+
+	if (!rspamd_task_process (task, RSPAMD_TASK_PROCESS_LEARN)) {
+		q->failed ++;
+		msg_info_session ("cannot learn <%s>: %e", task->message_id,
+				task->err);
+		rspamd_session_destroy (task->s);
+
+		return;
+	}
+
+	g_ptr_array_add (q->tasks, task);
+	/* Finalizer might be called immediately if no async events are pending */
+	rspamd_session_pending (task->s);
+}
+
+static void
+rspamd_controller_learn_queue_step (gint fd, short what, gpointer ud)
+{
+	struct rspamd_controller_learn_queue *q = ud;
+	struct rspamd_controller_session *session = q->conn_ent->ud;
+	struct rspamd_task *task;
+	ucl_object_t *top;
+	guint i, concurrency;
+
+	for (i = 0; i < q->finished->len; i ++) {
+		task = g_ptr_array_index (q->finished, i);
+		rspamd_session_destroy (task->s);
+	}
+
+	g_ptr_array_set_size (q->finished, 0);
+
+	concurrency = MAX (session->ctx->learn_concurrency, 1);
+
+	while (q->tasks->len + q->finished->len < concurrency &&
+			q->cur < q->messages->len) {
+		rspamd_controller_learn_queue_start (q,
+				&g_array_index (q->messages, rspamd_ftok_t, q->cur));
+		q->cur ++;
+	}
+
+	if (q->finished->len > 0) {
+		/* Some messages have been processed synchronously */
+		rspamd_controller_learn_queue_schedule (q);
+	}
+	else if (q->tasks->len == 0 && q->cur == q->messages->len && !q->replied) {
+		q->replied = TRUE;
+		msg_info_session ("<%s> learned %ud messages as %s, %ud failed",
+				rspamd_inet_address_to_string (session->from_addr),
+				q->learned,
+				q->is_spam ? "spam" : "ham",
+				q->failed);
+
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_frombool (q->learned > 0),
+				"success", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (q->learned),
+				"learned", 0, false);
+		ucl_object_insert_key (top, ucl_object_fromint (q->failed),
+				"failed", 0, false);
+		rspamd_controller_send_ucl (q->conn_ent, top);
+		ucl_object_unref (top);
+	}
+}
+
+static void
+rspamd_controller_learn_queue_dtor (gpointer ud)
+{
+	struct rspamd_controller_learn_queue *q = ud;
+	struct rspamd_task *task;
+	guint i;
+
+	event_del (&q->step_ev);
+
+	for (i = 0; i < q->tasks->len; i ++) {
+		task = g_ptr_array_index (q->tasks, i);
+		rspamd_session_destroy (task->s);
+	}
+
+	for (i = 0; i < q->finished->len; i ++) {
+		task = g_ptr_array_index (q->finished, i);
+		rspamd_session_destroy (task->s);
+	}
+
+	g_ptr_array_free (q->tasks, TRUE);
+	g_ptr_array_free (q->finished, TRUE);
+	g_array_free (q->messages, TRUE);
+}
+
+/*
+ * Learn all messages from an mbox keeping up to `learn_concurrency` of them
+ * in progress, so asynchronous backends requests are performed in parallel
+ */
+static void
+rspamd_controller_learn_mbox (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_http_message *msg,
+		gboolean is_spam)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_learn_queue *q;
+	GArray *messages;
+
+	messages = rspamd_controller_split_mbox (msg->body_buf.begin,
+			msg->body_buf.len);
+
+	if (messages->len == 0) {
+		g_array_free (messages, TRUE);
+		msg_err_session ("got no messages in mbox, cannot continue");
+		rspamd_controller_send_error (conn_ent, 400, "No messages in mbox");
+
+		return;
+	}
+
+	q = rspamd_mempool_alloc0 (session->pool, sizeof (*q));
+	q->conn_ent = conn_ent;
+	q->msg = msg;
+	q->is_spam = is_spam;
+	q->messages = messages;
+	q->tasks = g_ptr_array_new ();
+	q->finished = g_ptr_array_new ();
+	event_set (&q->step_ev, -1, EV_TIMEOUT, rspamd_controller_learn_queue_step,
+			q);
+	event_base_set (session->ctx->ev_base, &q->step_ev);
+	/* Pending tasks are destroyed if connection is terminated */
+	rspamd_mempool_add_destructor (session->pool,
+			rspamd_controller_learn_queue_dtor, q);
+
+	msg_info_session ("<%s> got %ud messages to learn",
+			rspamd_inet_address_to_string (session->from_addr),
+			q->messages->len);
+	session->is_spam = is_spam;
+	rspamd_controller_learn_queue_step (-1, EV_TIMEOUT, q);
+}
+
 static int
 rspamd_controller_handle_learn_common (
 	struct rspamd_http_connection_entry *conn_ent,
@@ -1374,7 +1709,7 @@ rspamd_controller_handle_learn_common (
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
 	struct rspamd_task *task;
-	const rspamd_ftok_t *cl_header;
+	const rspamd_ftok_t *cl_header, *ct_header;
 
 	ctx = session->ctx;
 
@@ -1390,6 +1725,24 @@ rspamd_controller_handle_learn_common (
 		return 0;
 	}
 
+	cl_header = rspamd_http_message_find_header (msg, "classifier");
+	if (cl_header) {
+		session->classifier = rspamd_mempool_ftokdup (session->pool, cl_header);
+	}
+	else {
+		session->classifier = NULL;
+	}
+
+	ct_header = rspamd_http_message_find_header (msg, "Content-Type");
+
+	if (ct_header && ct_header->len >= sizeof ("application/mbox") - 1 &&
+			rspamd_lc_cmp (ct_header->begin, "application/mbox",
+					sizeof ("application/mbox") - 1) == 0) {
+		rspamd_controller_learn_mbox (conn_ent, msg, is_spam);
+
+		return 0;
+	}
+
 	task = rspamd_task_new (session->ctx->worker, session->cfg);
 
 	task->resolver = ctx->resolver;
@@ -1406,14 +1759,6 @@ rspamd_controller_handle_learn_common (
 	task->sock = -1;
 	session->task = task;
 
-	cl_header = rspamd_http_message_find_header (msg, "classifier");
-	if (cl_header) {
-		session->classifier = rspamd_mempool_ftokdup (session->pool, cl_header);
-	}
-	else {
-		session->classifier = NULL;
-	}
-
 	if (!rspamd_task_load_message (task, msg, msg->body_buf.begin, msg->body_buf.len)) {
 		rspamd_controller_send_error (conn_ent, task->err->code, task->err->message);
 		return 0;
@@ -1437,8 +1782,9 @@ rspamd_controller_handle_learn_common (
  * Learn spam command handler:
  * request: /learnspam
  * headers: Password
- * input: plaintext data
- * reply: json {"success":true} or {"error":"error message"}
+ * input: plaintext data or mbox with `Content-Type: application/mbox`
+ * reply: json {"success":true} or {"error":"error message"},
+ * for mbox: {"success":true,"learned":<n>,"failed":<n>}
  */
 static int
 rspamd_controller_handle_learnspam (
@@ -1451,8 +1797,9 @@ rspamd_controller_handle_learnspam (
  * Learn ham command handler:
  * request: /learnham
  * headers: Password
- * input: plaintext data
- * reply: json {"success":true} or {"error":"error message"}
+ * input: plaintext data or mbox with `Content-Type: application/mbox`
+ * reply: json {"success":true} or {"error":"error message"},
+ * for mbox: {"success":true,"learned":<n>,"failed":<n>}
  */
 static int
 rspamd_controller_handle_learnham (
@@ -1878,7 +2225,7 @@ rspamd_controller_handle_savemap (struct rspamd_http_connection_entry *conn_ent,
 
 struct rspamd_stat_cbdata {
 	struct rspamd_http_connection_entry *conn_ent;
-	ucl_object_t *top;
+	struct rspamd_json_emitter e;
 	ucl_object_t *stat;
 	struct rspamd_task *task;
 	guint64 learned;
@@ -1889,20 +2236,21 @@ rspamd_controller_stat_fin_task (void *ud)
 {
 	struct rspamd_stat_cbdata *cbdata = ud;
 	struct rspamd_http_connection_entry *conn_ent;
-	ucl_object_t *top;
 
 	conn_ent = cbdata->conn_ent;
-	top = cbdata->top;
 
-	ucl_object_insert_key (top,
-			ucl_object_fromint (cbdata->learned), "total_learns", 0, false);
+	rspamd_json_emit_key (&cbdata->e, "total_learns");
+	rspamd_json_emit_int (&cbdata->e, cbdata->learned);
 
 	if (cbdata->stat) {
-		ucl_object_insert_key (top, cbdata->stat, "statfiles", 0, false);
+		rspamd_json_emit_key (&cbdata->e, "statfiles");
+		rspamd_json_emit_ucl (&cbdata->e, cbdata->stat);
 	}
 
-	rspamd_controller_send_ucl (conn_ent, top);
-
+	rspamd_json_emit_object_end (&cbdata->e);
+	rspamd_controller_send_json (conn_ent, cbdata->e.buf);
+	/* Now the buffer belongs to the reply */
+	cbdata->e.buf = NULL;
 
 	return TRUE;
 }
@@ -1913,7 +2261,14 @@ rspamd_controller_stat_cleanup_task (void *ud)
 	struct rspamd_stat_cbdata *cbdata = ud;
 
 	rspamd_task_free (cbdata->task);
-	ucl_object_unref (cbdata->top);
+
+	if (cbdata->stat) {
+		ucl_object_unref (cbdata->stat);
+	}
+
+	if (cbdata->e.buf) {
+		rspamd_fstring_free (cbdata->e.buf);
+	}
 }
 
 /*
@@ -1929,10 +2284,11 @@ rspamd_controller_handle_stat_common (
 	gboolean do_reset)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	ucl_object_t *top, *sub;
+	struct rspamd_json_emitter *e;
 	gint i;
 	guint64 spam = 0, ham = 0;
 	rspamd_mempool_stat_t mem_st;
+	struct rspamd_worker_metrics mem_sums;
 	struct rspamd_stat *stat, stat_copy;
 	struct rspamd_controller_worker_ctx *ctx;
 	struct rspamd_task *task;
@@ -1949,8 +2305,9 @@ rspamd_controller_handle_stat_common (
 	cbdata = rspamd_mempool_alloc0 (session->pool, sizeof (*cbdata));
 	cbdata->conn_ent = conn_ent;
 	cbdata->task = task;
-	top = ucl_object_typed_new (UCL_OBJECT);
-	cbdata->top = top;
+	e = &cbdata->e;
+	rspamd_json_emitter_init (e, NULL);
+	rspamd_json_emit_object_start (e);
 
 	task->s = rspamd_session_create (session->pool,
 			rspamd_controller_stat_fin_task,
@@ -1961,17 +2318,18 @@ rspamd_controller_handle_stat_common (
 	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);;
 	task->sock = conn_ent->conn->fd;
 
-	ucl_object_insert_key (top, ucl_object_fromint (
-			stat->messages_scanned), "scanned", 0, false);
-	ucl_object_insert_key (top, ucl_object_fromint (
-			stat->messages_learned), "learned", 0, false);
+	rspamd_json_emit_key (e, "scanned");
+	rspamd_json_emit_int (e, stat->messages_scanned);
+	rspamd_json_emit_key (e, "learned");
+	rspamd_json_emit_int (e, stat->messages_learned);
 
 	if (stat->messages_scanned > 0) {
-		sub = ucl_object_typed_new (UCL_OBJECT);
+		rspamd_json_emit_key (e, "actions");
+		rspamd_json_emit_object_start (e);
+
 		for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
-			ucl_object_insert_key (sub,
-				ucl_object_fromint (stat->actions_stat[i]),
-				rspamd_action_to_str (i), 0, false);
+			rspamd_json_emit_key (e, rspamd_action_to_str (i));
+			rspamd_json_emit_int (e, stat->actions_stat[i]);
 			if (i < METRIC_ACTION_GREYLIST) {
 				spam += stat->actions_stat[i];
 			}
@@ -1987,38 +2345,51 @@ rspamd_controller_handle_stat_common (
 #endif
 			}
 		}
-		ucl_object_insert_key (top, sub, "actions", 0, false);
-	}
 
-	ucl_object_insert_key (top, ucl_object_fromint (
-			spam), "spam_count", 0, false);
-	ucl_object_insert_key (top, ucl_object_fromint (
-			ham),  "ham_count",	 0, false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (stat->connections_count), "connections", 0, false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (stat->control_connections_count),
-		"control_connections", 0, false);
+		rspamd_json_emit_object_end (e);
+	}
+
+	rspamd_json_emit_key (e, "spam_count");
+	rspamd_json_emit_int (e, spam);
+	rspamd_json_emit_key (e, "ham_count");
+	rspamd_json_emit_int (e, ham);
+	rspamd_json_emit_key (e, "connections");
+	rspamd_json_emit_int (e, stat->connections_count);
+	rspamd_json_emit_key (e, "control_connections");
+	rspamd_json_emit_int (e, stat->control_connections_count);
+
+	rspamd_json_emit_key (e, "pools_allocated");
+	rspamd_json_emit_int (e, mem_st.pools_allocated);
+	rspamd_json_emit_key (e, "pools_freed");
+	rspamd_json_emit_int (e, mem_st.pools_freed);
+	rspamd_json_emit_key (e, "bytes_allocated");
+	rspamd_json_emit_int (e, mem_st.bytes_allocated);
+	rspamd_json_emit_key (e, "chunks_allocated");
+	rspamd_json_emit_int (e, mem_st.chunks_allocated);
+	rspamd_json_emit_key (e, "shared_chunks_allocated");
+	rspamd_json_emit_int (e, mem_st.shared_chunks_allocated);
+	rspamd_json_emit_key (e, "chunks_freed");
+	rspamd_json_emit_int (e, mem_st.chunks_freed);
+	rspamd_json_emit_key (e, "chunks_oversized");
+	rspamd_json_emit_int (e, mem_st.oversized_chunks);
+	rspamd_json_emit_key (e, "chunks_cache_hits");
+	rspamd_json_emit_int (e, mem_st.chunks_cache_hits);
+	rspamd_json_emit_key (e, "chunks_cache_misses");
+	rspamd_json_emit_int (e, mem_st.chunks_cache_misses);
+
+	if (session->ctx->srv->metrics) {
+		/* Memory of subsystems summed over all running workers */
+		rspamd_metrics_sum (session->ctx->srv->metrics, 0, &mem_sums);
+		rspamd_json_emit_key (e, "memory");
+		rspamd_json_emit_object_start (e);
+
+		for (i = 0; i < RSPAMD_METRICS_MEMORY_MAX; i ++) {
+			rspamd_json_emit_key (e, rspamd_metrics_memory_names[i]);
+			rspamd_json_emit_int (e, mem_sums.memory[i]);
+		}
 
-	ucl_object_insert_key (top,
-		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
-		false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (mem_st.pools_freed), "pools_freed", 0, false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (mem_st.bytes_allocated), "bytes_allocated", 0,
-		false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (
-			mem_st.chunks_allocated), "chunks_allocated", 0, false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (mem_st.shared_chunks_allocated),
-		"shared_chunks_allocated", 0, false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (mem_st.chunks_freed), "chunks_freed", 0, false);
-	ucl_object_insert_key (top,
-		ucl_object_fromint (
-			mem_st.oversized_chunks), "chunks_oversized", 0, false);
+		rspamd_json_emit_object_end (e);
+	}
 
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
@@ -2077,6 +2448,280 @@ static int
 rspamd_controller_handle_counters (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_json_emitter e;
+	struct symbols_cache *cache;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->cache;
+
+	if (cache != NULL) {
+		rspamd_json_emitter_init (&e, NULL);
+		rspamd_symbols_cache_counters_emit (cache, &e);
+		rspamd_controller_send_json (conn_ent, e.buf);
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+static void
+rspamd_controller_metrics_histogram (rspamd_fstring_t **out,
+		const gchar *name, const gchar *help,
+		struct rspamd_worker_metrics *sums, guint nsums,
+		gsize hist_offset)
+{
+	struct rspamd_latency_histogram *h;
+	const gchar *type;
+	guint64 cumulative;
+	guint i, j;
+
+	rspamd_printf_fstring (out, "# HELP %s %s\n# TYPE %s histogram\n",
+			name, help, name);
+
+	for (i = 0; i < nsums; i ++) {
+		h = (struct rspamd_latency_histogram *)(((guchar *)&sums[i]) +
+				hist_offset);
+		type = g_quark_to_string (sums[i].type);
+		cumulative = 0;
+
+		for (j = 0; j < RSPAMD_METRICS_LATENCY_BUCKETS - 1; j ++) {
+			cumulative += h->buckets[j];
+			rspamd_printf_fstring (out,
+					"%s_bucket{worker=\"%s\",le=\"%.3f\"} %uL\n",
+					name, type, rspamd_metrics_latency_bounds[j], cumulative);
+		}
+
+		rspamd_printf_fstring (out,
+				"%s_bucket{worker=\"%s\",le=\"+Inf\"} %uL\n"
+				"%s_sum{worker=\"%s\"} %.6f\n"
+				"%s_count{worker=\"%s\"} %uL\n",
+				name, type, h->count,
+				name, type, h->sum_us / 1e6,
+				name, type, h->count);
+	}
+}
+
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * headers: Password
+ * reply: counters of all workers in prometheus text format
+ */
+static int
+rspamd_controller_handle_metrics (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_metrics_segment *seg;
+	struct rspamd_worker_metrics *sums, *m;
+	guint *nrunning;
+	struct rspamd_http_message *reply;
+	rspamd_fstring_t *out;
+	const gchar *type;
+	guint i, j, nsums = 0;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	seg = session->ctx->srv->metrics;
+
+	if (seg == NULL) {
+		rspamd_controller_send_error (conn_ent, 500, "Metrics are not available");
+
+		return 0;
+	}
+
+	sums = rspamd_mempool_alloc0 (session->pool, seg->nslots * sizeof (*sums));
+	nrunning = rspamd_mempool_alloc0 (session->pool,
+			seg->nslots * sizeof (*nrunning));
+
+	/* Slots are read directly from the shared memory, so no IPC is needed */
+	for (i = 0; i < seg->nslots; i ++) {
+		m = &seg->slots[i].m;
+
+		if (m->type == 0) {
+			continue;
+		}
+
+		for (j = 0; j < nsums; j ++) {
+			if (sums[j].type == m->type) {
+				break;
+			}
+		}
+
+		if (j == nsums) {
+			nrunning[nsums] = rspamd_metrics_sum (seg, m->type, &sums[nsums]);
+			nsums ++;
+		}
+	}
+
+	out = rspamd_fstring_sized_new (8192);
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_workers Running worker "
+			"processes\n# TYPE rspamd_workers gauge\n");
+	for (i = 0; i < nsums; i ++) {
+		rspamd_printf_fstring (&out, "rspamd_workers{worker=\"%s\"} %ud\n",
+				g_quark_to_string (sums[i].type), nrunning[i]);
+	}
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_scanned_total Messages "
+			"scanned\n# TYPE rspamd_scanned_total counter\n");
+	for (i = 0; i < nsums; i ++) {
+		rspamd_printf_fstring (&out, "rspamd_scanned_total{worker=\"%s\"} %uL\n",
+				g_quark_to_string (sums[i].type), sums[i].scans);
+	}
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_connections_total Connections "
+			"accepted\n# TYPE rspamd_connections_total counter\n");
+	for (i = 0; i < nsums; i ++) {
+		rspamd_printf_fstring (&out,
+				"rspamd_connections_total{worker=\"%s\"} %uL\n",
+				g_quark_to_string (sums[i].type), sums[i].connections);
+	}
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_actions_total Messages by "
+			"action\n# TYPE rspamd_actions_total counter\n");
+	for (i = 0; i < nsums; i ++) {
+		type = g_quark_to_string (sums[i].type);
+
+		for (j = METRIC_ACTION_REJECT; j <= METRIC_ACTION_NOACTION; j ++) {
+			rspamd_printf_fstring (&out,
+					"rspamd_actions_total{worker=\"%s\",action=\"%s\"} %uL\n",
+					type, rspamd_action_to_str (j), sums[i].actions[j]);
+		}
+	}
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_tasks_inflight Tasks being "
+			"processed\n# TYPE rspamd_tasks_inflight gauge\n");
+	for (i = 0; i < nsums; i ++) {
+		rspamd_printf_fstring (&out, "rspamd_tasks_inflight{worker=\"%s\"} %uL\n",
+				g_quark_to_string (sums[i].type), sums[i].inflight);
+	}
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_memory_bytes Memory used by "
+			"subsystems of running workers\n# TYPE rspamd_memory_bytes gauge\n");
+	for (i = 0; i < nsums; i ++) {
+		type = g_quark_to_string (sums[i].type);
+
+		for (j = 0; j < RSPAMD_METRICS_MEMORY_MAX; j ++) {
+			rspamd_printf_fstring (&out,
+					"rspamd_memory_bytes{worker=\"%s\",subsystem=\"%s\"} %uL\n",
+					type, rspamd_metrics_memory_names[j], sums[i].memory[j]);
+		}
+	}
+
+	rspamd_controller_metrics_histogram (&out, "rspamd_scan_seconds",
+			"Time of messages processing", sums, nsums,
+			G_STRUCT_OFFSET (struct rspamd_worker_metrics, scan_time));
+	rspamd_controller_metrics_histogram (&out, "rspamd_dns_seconds",
+			"Latency of DNS requests", sums, nsums,
+			G_STRUCT_OFFSET (struct rspamd_worker_metrics, dns_time));
+	rspamd_controller_metrics_histogram (&out, "rspamd_redis_seconds",
+			"Latency of redis requests from lua", sums, nsums,
+			G_STRUCT_OFFSET (struct rspamd_worker_metrics, redis_time));
+	rspamd_controller_metrics_histogram (&out, "rspamd_loop_lag_seconds",
+			"Delays of workers event loops", sums, nsums,
+			G_STRUCT_OFFSET (struct rspamd_worker_metrics, loop_lag));
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_loop_stalls_total Event loop "
+			"delays longer than loop_lag_threshold\n"
+			"# TYPE rspamd_loop_stalls_total counter\n");
+	for (i = 0; i < nsums; i ++) {
+		rspamd_printf_fstring (&out,
+				"rspamd_loop_stalls_total{worker=\"%s\"} %uL\n",
+				g_quark_to_string (sums[i].type), sums[i].loop_stalls);
+	}
+
+	rspamd_printf_fstring (&out, "# HELP rspamd_stage_seconds_total Time "
+			"spent in stages of messages processing\n"
+			"# TYPE rspamd_stage_seconds_total counter\n");
+	for (i = 0; i < nsums; i ++) {
+		type = g_quark_to_string (sums[i].type);
+
+		for (j = 0; j < RSPAMD_METRICS_STAGES; j ++) {
+			rspamd_printf_fstring (&out,
+					"rspamd_stage_seconds_total{worker=\"%s\",stage=\"%s\","
+					"clock=\"real\"} %.6f\n"
+					"rspamd_stage_seconds_total{worker=\"%s\",stage=\"%s\","
+					"clock=\"cpu\"} %.6f\n",
+					type, rspamd_task_profile_stage_name (j),
+					sums[i].stages_real_us[j] / 1e6,
+					type, rspamd_task_profile_stage_name (j),
+					sums[i].stages_cpu_us[j] / 1e6);
+		}
+	}
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->status = rspamd_fstring_new_init ("OK", 2);
+	reply->body = out;
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn,
+		reply,
+		NULL,
+		"text/plain; version=0.0.4",
+		conn_ent,
+		conn_ent->conn->fd,
+		conn_ent->rt->ptv,
+		conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
+/*
+ * Regexp cache profile command handler:
+ * request: /recache
+ * headers: Password
+ * reply: json object with classes and regexps cost counters
+ */
+static int
+rspamd_controller_handle_recache (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+	struct rspamd_re_cache *cache;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->re_cache;
+
+	if (cache != NULL) {
+		top = rspamd_re_cache_profile (cache);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+/*
+ * Lua profile command handler:
+ * request: /luaprofile
+ * headers: Password
+ * reply: json array of resources used by lua callbacks of symbols
+ */
+static int
+rspamd_controller_handle_lua_profile (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	ucl_object_t *top;
@@ -2089,7 +2734,7 @@ rspamd_controller_handle_counters (
 	cache = session->ctx->cfg->cache;
 
 	if (cache != NULL) {
-		top = rspamd_symbols_cache_counters (cache);
+		top = rspamd_symbols_cache_lua_profile (cache);
 		rspamd_controller_send_ucl (conn_ent, top);
 		ucl_object_unref (top);
 	}
@@ -2411,6 +3056,9 @@ init_controller_worker (struct rspamd_config *cfg)
 
 	ctx->magic = rspamd_controller_ctx_magic;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->learn_concurrency = DEFAULT_LEARN_CONCURRENCY;
+	ctx->auth_cache_ttl = DEFAULT_AUTH_CACHE_TTL;
+	ctx->auth_cache_size = DEFAULT_AUTH_CACHE_SIZE;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -2515,6 +3163,37 @@ init_controller_worker (struct rspamd_config *cfg)
 			0,
 			"Directory where controller saves server's statistics between restarts");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"learn_concurrency",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					learn_concurrency),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of messages from a single mbox learned in parallel, default: 8");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"auth_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					auth_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to cache results of encrypted passwords checks, default: 10min");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"auth_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					auth_cache_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of cached results of encrypted passwords checks (0 to disable), "
+			"default: 1024");
+
 	return ctx;
 }
 
@@ -2531,7 +3210,6 @@ start_controller_worker (struct rspamd_worker *worker)
 	gpointer key, value;
 	struct rspamd_keypair_cache *cache;
 	gchar *secure_ip;
-	gpointer m;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"controller",
@@ -2595,8 +3273,16 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_controller_password_sane (ctx, ctx->enable_password, "enable "
 			"password");
 
+	if (ctx->auth_cache_size > 0 && ctx->auth_cache_ttl > 0) {
+		ottery_rand_bytes (ctx->auth_cache_key, sizeof (ctx->auth_cache_key));
+		ctx->auth_cache = rspamd_lru_hash_new_full (ctx->auth_cache_size,
+				NULL, rspamd_controller_auth_elt_free,
+				rspamd_controller_auth_hash, rspamd_controller_auth_equal);
+	}
+
 	/* Accept event */
-	cache = rspamd_keypair_cache_new (256);
+	cache = rspamd_keypair_cache_new_shared (ctx->cfg->keypair_cache_size,
+			ctx->cfg->keypair_shared_cache);
 	ctx->http = rspamd_http_router_new (rspamd_controller_error_handler,
 			rspamd_controller_finish_handler, &ctx->io_tv, ctx->ev_base,
 			ctx->static_files_dir, cache);
@@ -2659,6 +3345,15 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_RECACHE,
+			rspamd_controller_handle_recache);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_LUA_PROFILE,
+			rspamd_controller_handle_lua_profile);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+			rspamd_controller_handle_metrics);
 
 	if (ctx->key) {
 		rspamd_http_router_set_key (ctx->http, ctx->key);
@@ -2705,14 +3400,8 @@ start_controller_worker (struct rspamd_worker *worker)
 		rspamd_rrd_close (ctx->rrd);
 	}
 
-	if (ctx->cached_password.len > 0) {
-		m = (gpointer)ctx->cached_password.begin;
-		munmap (m, ctx->cached_password.len);
-	}
-
-	if (ctx->cached_enable_password.len > 0) {
-		m = (gpointer) ctx->cached_enable_password.begin;
-		munmap (m, ctx->cached_enable_password.len);
+	if (ctx->auth_cache) {
+		rspamd_lru_hash_destroy (ctx->auth_cache);
 	}
 
 	exit (EXIT_SUCCESS);
@@ -24,6 +24,7 @@
 #include "map.h"
 #include "fuzzy_storage.h"
 #include "fuzzy_backend.h"
+#include "fuzzy_backend_redis.h"
 #include "ottery.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
@@ -33,13 +34,35 @@
 #include "ref.h"
 #include "xxhash.h"
 #include "libutil/hash.h"
+#include "libutil/sqlite_utils.h"
 #include "unix-std.h"
 
 /* This number is used as expire time in seconds for cache items  (2 days) */
 #define DEFAULT_EXPIRE 172800L
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
+#define DEFAULT_REDIS_TIMEOUT 1.0
+/* Group commit bounds for updates */
+#define DEFAULT_UPDATES_MAX_BATCH 1000
+#define DEFAULT_UPDATES_MAX_DELAY 0.0
+/* Number of digests expired by a single step and delay between steps */
+#define DEFAULT_EXPIRE_SLICE 500
+#define FUZZY_EXPIRE_STEP 0.1
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
+/* Maximum size of fuzzy datagram (batches included) */
+#define FUZZY_MAX_PACKET 1500
+/* Number of datagrams received and replied by a single syscall */
+#define FUZZY_MAX_BATCH 32
+/* Replication defaults */
+#define DEFAULT_REPLICATION_PORT 11336
+#define DEFAULT_REPLICATION_LOG 1000000
+#define DEFAULT_REPLICATION_TIMEOUT 10.0
+/* Maximum number of changes sent to a replica by a single reply */
+#define FUZZY_REPLICATION_BATCH 1000
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define FUZZY_USE_MMSG 1
+#endif
 
 
 #define INVALID_NODE_TIME (guint64) - 1
@@ -90,8 +113,11 @@ struct rspamd_fuzzy_storage_ctx {
 	guint64 magic;
 	struct fuzzy_global_stat stat;
 	char *hashfile;
+	struct rspamd_sqlite3_tune *sqlite_tune;
 	gdouble expire;
 	gdouble sync_timeout;
+	guint expire_slice;
+	struct event expire_ev;
 	radix_compressed_t *update_ips;
 	gchar *update_map;
 	guint keypair_cache_size;
@@ -106,7 +132,44 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_keypair_cache *keypair_cache;
 	rspamd_lru_hash_t *errors_ips;
 	struct rspamd_fuzzy_backend *backend;
+	/* Redis backend shared by all workers (instead of sqlite one) */
+	gchar *backend_type;
+	gchar *redis_servers;
+	gchar *redis_prefix;
+	gchar *redis_password;
+	gchar *redis_dbname;
+	gdouble redis_timeout;
+	struct rspamd_fuzzy_backend_redis *redis;
+	gboolean memory_index;
+	/* Incremented by the first worker when updates are committed */
+	volatile gint *updates_serial;
+	gint index_serial;
+	struct event index_ev;
+	/* Replies are sent after the whole batch of datagrams is processed */
+	gboolean batch_replies;
+	GPtrArray *replies;
+	/* Master: address to serve replicas and number of changes kept */
+	gchar *replication_bind;
+	guint replication_log;
+	struct rspamd_http_connection_router *replication_router;
+	/* Replica: master address and optional public key */
+	gchar *master;
+	gchar *master_key;
+	rspamd_inet_addr_t *master_addr;
+	struct rspamd_cryptobox_pubkey *master_pk;
+	struct rspamd_cryptobox_keypair *replica_kp;
+	struct rspamd_http_connection *replication_conn;
+	gint replication_fd;
+	gint64 replication_seq;
+	struct event replication_ev;
+	struct timeval replication_tv;
 	GQueue *updates_pending;
+	/* Pending writes indexed by digest to coalesce repeated adds */
+	GHashTable *updates_coalesced;
+	guint updates_max_batch;
+	gdouble updates_max_delay;
+	gboolean updates_scheduled;
+	struct event updates_ev;
 	struct rspamd_dns_resolver *resolver;
 };
 
@@ -114,7 +177,9 @@ enum fuzzy_cmd_type {
 	CMD_NORMAL,
 	CMD_SHINGLE,
 	CMD_ENCRYPTED_NORMAL,
-	CMD_ENCRYPTED_SHINGLE
+	CMD_ENCRYPTED_SHINGLE,
+	CMD_BATCH,
+	CMD_ENCRYPTED_BATCH
 };
 
 struct fuzzy_session {
@@ -139,6 +204,18 @@ struct fuzzy_session {
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
+
+	/* Batch: commands in the input buffer and the joint reply */
+	guchar *batch;
+	gsize batch_len;
+	guchar *batch_reply;
+	gsize batch_reply_len;
+	guint batch_pending;
+	/* Command of a batch: its parent session and position */
+	struct fuzzy_session *parent;
+	guint batch_idx;
+	/* Reply is encrypted just before sending */
+	gboolean encrypt_reply;
 };
 
 struct fuzzy_peer_cmd {
@@ -239,6 +316,8 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx)
 
 		if (rspamd_fuzzy_backend_finish_update (ctx->backend)) {
 			ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+			/* Notify other workers about the changes */
+			g_atomic_int_inc (ctx->updates_serial);
 			cur = ctx->updates_pending->head;
 
 			while (cur) {
@@ -248,6 +327,7 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx)
 			}
 
 			g_queue_clear (ctx->updates_pending);
+			g_hash_table_remove_all (ctx->updates_coalesced);
 			msg_info ("updated fuzzy storage: %ud updates processed", nupdates);
 		}
 		else {
@@ -264,6 +344,103 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx)
 	}
 }
 
+static void
+rspamd_fuzzy_updates_timer (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+
+	ctx->updates_scheduled = FALSE;
+	rspamd_fuzzy_process_updates_queue (ctx);
+}
+
+static guint
+fuzzy_digest_hash (gconstpointer p)
+{
+	guint h;
+
+	/* Digests are cryptographic hashes, but they are not aligned in commands */
+	memcpy (&h, p, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+fuzzy_digest_equal (gconstpointer a, gconstpointer b)
+{
+	return (memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0);
+}
+
+/*
+ * Queue update to be committed by the next transaction. Repeated adds of the
+ * same digest are merged to the pending command, so mass learning of the
+ * same messages produces a single row update
+ */
+static void
+rspamd_fuzzy_queue_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_cmd *io_cmd)
+{
+	struct fuzzy_peer_cmd *prev;
+	struct rspamd_fuzzy_cmd *cmd, *prev_cmd;
+	struct timeval tv;
+	gint32 value;
+
+	cmd = io_cmd->is_shingle ? &io_cmd->cmd.shingle.basic :
+			&io_cmd->cmd.normal;
+	prev = g_hash_table_lookup (ctx->updates_coalesced, cmd->digest);
+
+	if (cmd->cmd == FUZZY_WRITE && prev != NULL) {
+		prev_cmd = prev->is_shingle ? &prev->cmd.shingle.basic :
+				&prev->cmd.normal;
+
+		if (prev_cmd->flag == cmd->flag) {
+			/* Weight is increased by the subsequent adds */
+			value = prev_cmd->value + cmd->value;
+		}
+		else {
+			/* Digest is relearned with the new flag and value */
+			value = cmd->value;
+		}
+
+		if (io_cmd->is_shingle && !prev->is_shingle) {
+			prev->is_shingle = TRUE;
+			memcpy (&prev->cmd.shingle, &io_cmd->cmd.shingle,
+					sizeof (prev->cmd.shingle));
+			prev_cmd = &prev->cmd.shingle.basic;
+		}
+
+		prev_cmd->flag = cmd->flag;
+		prev_cmd->value = value;
+		g_slice_free1 (sizeof (*io_cmd), io_cmd);
+
+		return;
+	}
+
+	if (cmd->cmd == FUZZY_WRITE) {
+		g_hash_table_replace (ctx->updates_coalesced, cmd->digest, io_cmd);
+	}
+	else if (prev != NULL) {
+		/* Writes after deletion should not be merged with the previous ones */
+		g_hash_table_remove (ctx->updates_coalesced, cmd->digest);
+	}
+
+	g_queue_push_tail (ctx->updates_pending, io_cmd);
+
+	if (ctx->updates_max_batch > 0 &&
+			g_queue_get_length (ctx->updates_pending) >= ctx->updates_max_batch) {
+		if (ctx->updates_scheduled) {
+			event_del (&ctx->updates_ev);
+			ctx->updates_scheduled = FALSE;
+		}
+
+		rspamd_fuzzy_process_updates_queue (ctx);
+	}
+	else if (ctx->updates_max_delay > 0 && !ctx->updates_scheduled) {
+		double_to_tv (ctx->updates_max_delay, &tv);
+		evtimer_add (&ctx->updates_ev, &tv);
+		ctx->updates_scheduled = TRUE;
+	}
+}
+
 static void
 rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 {
@@ -273,24 +450,85 @@ rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 	REF_RELEASE (session);
 }
 
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *len)
+{
+	if (session->cmd_type == CMD_ENCRYPTED_BATCH) {
+		*len = session->batch_reply_len;
+
+		return session->batch_reply;
+	}
+	else if (session->cmd_type == CMD_BATCH) {
+		/* Skip encryption header */
+		*len = session->batch_reply_len -
+				sizeof (struct rspamd_fuzzy_encrypted_rep_hdr);
+
+		return session->batch_reply +
+				sizeof (struct rspamd_fuzzy_encrypted_rep_hdr);
+	}
+	else if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
+				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
+		/* Encrypted reply */
+		*len = sizeof (session->reply);
+
+		return &session->reply;
+	}
+
+	*len = sizeof (session->reply.rep);
+
+	return &session->reply.rep;
+}
+
+/*
+ * Prepare pending encryption of the reply, a random nonce is generated here
+ */
+static void
+rspamd_fuzzy_reply_message (struct fuzzy_session *session,
+		struct rspamd_cryptobox_message *msg)
+{
+	struct rspamd_fuzzy_encrypted_rep_hdr *hdr;
+
+	if (session->cmd_type == CMD_ENCRYPTED_BATCH) {
+		hdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)session->batch_reply;
+		msg->data = session->batch_reply + sizeof (*hdr);
+		msg->len = session->batch_reply_len - sizeof (*hdr);
+	}
+	else {
+		hdr = &session->reply.hdr;
+		msg->data = (guchar *)&session->reply.rep;
+		msg->len = sizeof (session->reply.rep);
+	}
+
+	ottery_rand_bytes (hdr->nonce, sizeof (hdr->nonce));
+	msg->nonce = hdr->nonce;
+	msg->nm = session->nm;
+	msg->sig = hdr->mac;
+	session->encrypt_reply = FALSE;
+}
+
 static void
 rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 {
 	gssize r;
 	gsize len;
 	gconstpointer data;
+	struct rspamd_cryptobox_message msg;
 
-	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
-				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
-		/* Encrypted reply */
-		data = &session->reply;
-		len = sizeof (session->reply);
+	if (session->ctx->batch_replies) {
+		/* Reply is sent (and encrypted) with the whole batch */
+		REF_RETAIN (session);
+		g_ptr_array_add (session->ctx->replies, session);
+
+		return;
 	}
-	else {
-		data = &session->reply.rep;
-		len = sizeof (session->reply.rep);
+
+	if (session->encrypt_reply) {
+		rspamd_fuzzy_reply_message (session, &msg);
+		rspamd_cryptobox_encrypt_nm_inplace (msg.data, msg.len, msg.nonce,
+				msg.nm, msg.sig, RSPAMD_CRYPTOBOX_MODE_25519);
 	}
 
+	data = rspamd_fuzzy_reply_data (session, &len);
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -386,55 +624,86 @@ rspamd_fuzzy_update_stats (struct rspamd_fuzzy_storage_ctx *ctx,
 	}
 }
 
-static void
-rspamd_fuzzy_process_command (struct fuzzy_session *session)
+static struct rspamd_fuzzy_cmd *
+rspamd_fuzzy_session_cmd (struct fuzzy_session *session, gboolean *encrypted,
+		gboolean *is_shingle, gsize *up_len)
 {
-	gboolean encrypted = FALSE, is_shingle = FALSE;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
-	struct rspamd_fuzzy_reply result;
-	struct fuzzy_peer_cmd *up_cmd;
-	struct fuzzy_peer_request *up_req;
-	struct fuzzy_key_stat *ip_stat = NULL;
-	rspamd_inet_addr_t *naddr;
-	gpointer ptr;
-	gsize up_len = 0;
+
+	*encrypted = FALSE;
+	*is_shingle = FALSE;
+	*up_len = 0;
 
 	switch (session->cmd_type) {
 	case CMD_NORMAL:
 		cmd = &session->cmd.normal;
-		up_len = sizeof (session->cmd.normal);
+		*up_len = sizeof (session->cmd.normal);
 		break;
 	case CMD_SHINGLE:
 		cmd = &session->cmd.shingle.basic;
-		up_len = sizeof (session->cmd.shingle);
-		is_shingle = TRUE;
+		*up_len = sizeof (session->cmd.shingle);
+		*is_shingle = TRUE;
 		break;
 	case CMD_ENCRYPTED_NORMAL:
 		cmd = &session->cmd.enc_normal.cmd;
-		up_len = sizeof (session->cmd.normal);
-		encrypted = TRUE;
+		*up_len = sizeof (session->cmd.normal);
+		*encrypted = TRUE;
 		break;
 	case CMD_ENCRYPTED_SHINGLE:
 		cmd = &session->cmd.enc_shingle.cmd.basic;
-		up_len = sizeof (session->cmd.shingle);
-		encrypted = TRUE;
-		is_shingle = TRUE;
+		*up_len = sizeof (session->cmd.shingle);
+		*encrypted = TRUE;
+		*is_shingle = TRUE;
+		break;
+	default:
+		/* Batches are split to separate commands */
 		break;
 	}
 
-	if (G_UNLIKELY (cmd == NULL || up_len == 0)) {
-		result.value = 500;
-		result.prob = 0.0;
-		goto reply;
+	return cmd;
+}
+
+/*
+ * Store reply for a command of a batch, the whole batch is replied when all
+ * commands are finished
+ */
+static void
+rspamd_fuzzy_batch_reply (struct fuzzy_session *session, guint idx,
+		const struct rspamd_fuzzy_reply *rep)
+{
+	guchar *replies;
+
+	replies = session->batch_reply +
+			sizeof (struct rspamd_fuzzy_encrypted_rep_hdr);
+
+	if (rep) {
+		memcpy (replies + idx * sizeof (*rep), rep, sizeof (*rep));
 	}
 
-	if (session->ctx->encrypted_only && !encrypted) {
-		/* Do not accept unencrypted commands */
-		result.value = 403;
-		result.prob = 0.0;
-		goto reply;
+	g_assert (session->batch_pending > 0);
+
+	if (--session->batch_pending > 0) {
+		return;
 	}
 
+	if (session->cmd_type == CMD_ENCRYPTED_BATCH) {
+		/* All replies are encrypted at once */
+		session->encrypt_reply = TRUE;
+	}
+
+	rspamd_fuzzy_write_reply (session);
+}
+
+static void
+rspamd_fuzzy_make_reply (struct fuzzy_session *session,
+		struct rspamd_fuzzy_cmd *cmd,
+		struct rspamd_fuzzy_reply *result,
+		gboolean encrypted,
+		gboolean is_shingle)
+{
+	struct fuzzy_key_stat *ip_stat = NULL;
+	rspamd_inet_addr_t *naddr;
+
 	if (session->key_stat) {
 		ip_stat = rspamd_lru_hash_lookup (session->key_stat->last_ips,
 				session->addr, -1);
@@ -447,15 +716,98 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 		}
 	}
 
+	result->tag = cmd->tag;
+	memcpy (&session->reply.rep, result, sizeof (*result));
+
+	rspamd_fuzzy_update_stats (session->ctx,
+			session->epoch,
+			result->prob > 0.5,
+			is_shingle,
+			session->key_stat,
+			ip_stat, cmd->cmd,
+			result->value);
+
+	if (session->parent) {
+		/* Reply is sent with the whole batch */
+		rspamd_fuzzy_batch_reply (session->parent, session->batch_idx,
+				&session->reply.rep);
+
+		return;
+	}
+
+	if (encrypted) {
+		/* We need also to encrypt reply */
+		session->encrypt_reply = TRUE;
+	}
+
+	rspamd_fuzzy_write_reply (session);
+}
+
+static void
+rspamd_fuzzy_redis_checked (struct rspamd_fuzzy_reply *rep, gpointer ud)
+{
+	struct fuzzy_session *session = ud;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_reply result;
+	gboolean encrypted, is_shingle;
+	gsize up_len;
+
+	cmd = rspamd_fuzzy_session_cmd (session, &encrypted, &is_shingle, &up_len);
+	memcpy (&result, rep, sizeof (result));
+	rspamd_fuzzy_make_reply (session, cmd, &result, encrypted, is_shingle);
+	REF_RELEASE (session);
+}
+
+static void
+rspamd_fuzzy_process_command (struct fuzzy_session *session)
+{
+	gboolean encrypted = FALSE, is_shingle = FALSE;
+	struct rspamd_fuzzy_cmd *cmd = NULL;
+	struct rspamd_fuzzy_reply result;
+	struct fuzzy_peer_cmd *up_cmd;
+	struct fuzzy_peer_request *up_req;
+	gpointer ptr;
+	gsize up_len = 0;
+
+	cmd = rspamd_fuzzy_session_cmd (session, &encrypted, &is_shingle, &up_len);
+
+	if (G_UNLIKELY (cmd == NULL || up_len == 0)) {
+		result.value = 500;
+		result.prob = 0.0;
+		goto reply;
+	}
+
+	if (session->ctx->encrypted_only && !encrypted) {
+		/* Do not accept unencrypted commands */
+		result.value = 403;
+		result.prob = 0.0;
+		goto reply;
+	}
+
 	result.flag = cmd->flag;
 	if (cmd->cmd == FUZZY_CHECK) {
+		if (session->ctx->redis) {
+			/* Reply is sent when redis replies */
+			REF_RETAIN (session);
+			rspamd_fuzzy_backend_redis_check (session->ctx->redis, cmd,
+					session->ctx->expire, rspamd_fuzzy_redis_checked, session);
+
+			return;
+		}
+
 		result = rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
 				session->ctx->expire);
 	}
 	else {
 		if (rspamd_fuzzy_check_client (session)) {
 
-			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
+			if (session->ctx->redis) {
+				/* All workers can write to redis directly */
+				rspamd_fuzzy_backend_redis_update (session->ctx->redis, cmd,
+						session->ctx->expire);
+			}
+			else if (session->worker->index == 0 ||
+					session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
 				up_cmd = g_slice_alloc0 (sizeof (*up_cmd));
 				up_cmd->is_shingle = is_shingle;
@@ -463,7 +815,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 						(gpointer)&up_cmd->cmd.shingle :
 						(gpointer)&up_cmd->cmd.normal;
 				memcpy (ptr, cmd, up_len);
-				g_queue_push_tail (session->ctx->updates_pending, up_cmd);
+				rspamd_fuzzy_queue_update (session->ctx, up_cmd);
 			}
 			else {
 				/* We need to send request to the peer */
@@ -489,30 +841,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	}
 
 reply:
-	result.tag = cmd->tag;
-	memcpy (&session->reply.rep, &result, sizeof (result));
-
-	rspamd_fuzzy_update_stats (session->ctx,
-			session->epoch,
-			result.prob > 0.5,
-			is_shingle,
-			session->key_stat,
-			ip_stat, cmd->cmd,
-			result.value);
-
-	if (encrypted) {
-		/* We need also to encrypt reply */
-		ottery_rand_bytes (session->reply.hdr.nonce,
-				sizeof (session->reply.hdr.nonce));
-		rspamd_cryptobox_encrypt_nm_inplace ((guchar *)&session->reply.rep,
-				sizeof (session->reply.rep),
-				session->reply.hdr.nonce,
-				session->nm,
-				session->reply.hdr.mac,
-				RSPAMD_CRYPTOBOX_MODE_25519);
-	}
-
-	rspamd_fuzzy_write_reply (session);
+	rspamd_fuzzy_make_reply (session, cmd, &result, encrypted, is_shingle);
 }
 
 
@@ -559,13 +888,21 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 	gsize payload_len;
 	struct rspamd_cryptobox_pubkey *rk;
 	struct fuzzy_key *key;
+	const guchar *magic = fuzzy_encrypted_magic;
 
 	if (s->ctx->default_key == NULL) {
 		msg_warn ("received encrypted request when encryption is not enabled");
 		return FALSE;
 	}
 
-	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+	if (s->cmd_type == CMD_ENCRYPTED_BATCH) {
+		/* Batch is decrypted inplace in the input buffer */
+		hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)(s->batch - sizeof (*hdr));
+		payload = s->batch;
+		payload_len = s->batch_len;
+		magic = fuzzy_encrypted_batch_magic;
+	}
+	else if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
 		hdr = &s->cmd.enc_normal.hdr;
 		payload = (guchar *)&s->cmd.enc_normal.cmd;
 		payload_len = sizeof (s->cmd.enc_normal.cmd);
@@ -577,7 +914,7 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 	}
 
 	/* Compare magic */
-	if (memcmp (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic)) != 0) {
+	if (memcmp (hdr->magic, magic, sizeof (hdr->magic)) != 0) {
 		msg_debug ("invalid magic for the encrypted packet");
 		return FALSE;
 	}
@@ -619,11 +956,85 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 	return TRUE;
 }
 
+/*
+ * Checks that a batch consists of valid commands only
+ */
+static gboolean
+rspamd_fuzzy_batch_valid (struct fuzzy_session *s)
+{
+	struct rspamd_fuzzy_batch_hdr bh;
+	struct rspamd_fuzzy_cmd cmd;
+	const guchar *p;
+	gsize remain, cmdlen;
+	guint i;
+
+	if (s->batch_len < sizeof (bh)) {
+		return FALSE;
+	}
+
+	memcpy (&bh, s->batch, sizeof (bh));
+
+	if (bh.version != RSPAMD_FUZZY_VERSION || bh.cmd != FUZZY_BATCH ||
+			bh.count == 0) {
+		return FALSE;
+	}
+
+	p = s->batch + sizeof (bh);
+	remain = s->batch_len - sizeof (bh);
+
+	for (i = 0; i < bh.count; i ++) {
+		if (remain < sizeof (cmd)) {
+			return FALSE;
+		}
+
+		memcpy (&cmd, p, sizeof (cmd));
+		cmdlen = cmd.shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (cmd);
+
+		/* Batches are supported by the recent protocol version only */
+		if (remain < cmdlen || cmd.cmd > FUZZY_DEL ||
+				rspamd_fuzzy_command_valid (&cmd, cmdlen) !=
+						RSPAMD_FUZZY_EPOCH9) {
+			return FALSE;
+		}
+
+		p += cmdlen;
+		remain -= cmdlen;
+	}
+
+	return remain == 0;
+}
+
 static gboolean
 rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 {
 	enum rspamd_fuzzy_epoch epoch;
 
+	if (buflen >= sizeof (struct rspamd_fuzzy_batch_hdr) &&
+			buf[0] == RSPAMD_FUZZY_VERSION && buf[1] == FUZZY_BATCH) {
+		s->cmd_type = CMD_BATCH;
+		s->batch = buf;
+		s->batch_len = buflen;
+		s->epoch = RSPAMD_FUZZY_EPOCH9;
+
+		return rspamd_fuzzy_batch_valid (s);
+	}
+	else if (buflen >= sizeof (struct rspamd_fuzzy_encrypted_req_hdr) +
+			sizeof (struct rspamd_fuzzy_batch_hdr) &&
+			memcmp (buf, fuzzy_encrypted_batch_magic,
+					sizeof (fuzzy_encrypted_batch_magic)) == 0) {
+		s->cmd_type = CMD_ENCRYPTED_BATCH;
+		s->batch = buf + sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+		s->batch_len = buflen - sizeof (struct rspamd_fuzzy_encrypted_req_hdr);
+		s->epoch = RSPAMD_FUZZY_EPOCH10;
+
+		if (!rspamd_fuzzy_decrypt_command (s)) {
+			return FALSE;
+		}
+
+		return rspamd_fuzzy_batch_valid (s);
+	}
+
 	/* For now, we assume that recvfrom returns a complete datagramm */
 	switch (buflen) {
 	case sizeof (struct rspamd_fuzzy_cmd):
@@ -695,87 +1106,382 @@ fuzzy_session_destroy (gpointer d)
 {
 	struct fuzzy_session *session = d;
 
-	rspamd_inet_address_destroy (session->addr);
+	if (session->parent) {
+		/* Address is owned by the batch */
+		REF_RELEASE (session->parent);
+	}
+	else {
+		rspamd_inet_address_destroy (session->addr);
+		session->worker->nconns--;
+	}
+
+	if (session->batch_reply) {
+		g_free (session->batch_reply);
+	}
+
 	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
-	session->worker->nconns--;
 	g_slice_free1 (sizeof (*session), session);
 }
 
 /*
- * Accept new connection and construct task
+ * Split batch to commands processed as separate sessions
  */
 static void
-accept_fuzzy_socket (gint fd, short what, void *arg)
+rspamd_fuzzy_process_batch (struct fuzzy_session *session)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
-	rspamd_inet_addr_t *addr;
-	gssize r;
-	guint8 buf[512];
-	guint64 *nerrors;
-
-	/* Got some data */
-	if (what == EV_READ) {
-
-		for (;;) {
-			worker->nconns++;
-
-			r = rspamd_inet_address_recvfrom (fd,
-					buf,
-					sizeof (buf),
-					0,
-					&addr);
-
-			if (r == -1) {
-				if (errno == EINTR) {
-					continue;
-				}
-				else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-
-					return;
-				}
-
-				msg_err ("got error while reading from socket: %d, %s",
-						errno,
-						strerror (errno));
-				return;
-			}
+	struct rspamd_fuzzy_batch_hdr bh;
+	const struct rspamd_fuzzy_cmd *cmd;
+	struct fuzzy_session *cs;
+	const guchar *p;
+	gsize cmdlen;
+	guint i;
+	gboolean encrypted;
+
+	encrypted = session->cmd_type == CMD_ENCRYPTED_BATCH;
+	memcpy (&bh, session->batch, sizeof (bh));
+	p = session->batch + sizeof (bh);
+
+	session->batch_reply_len = sizeof (struct rspamd_fuzzy_encrypted_rep_hdr) +
+			bh.count * sizeof (struct rspamd_fuzzy_reply);
+	session->batch_reply = g_malloc0 (session->batch_reply_len);
+	/* Do not reply until all commands are dispatched */
+	session->batch_pending = bh.count + 1;
+
+	for (i = 0; i < bh.count; i ++) {
+		cmd = (const struct rspamd_fuzzy_cmd *)p;
+		cmdlen = cmd->shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+
+		cs = g_slice_alloc0 (sizeof (*cs));
+		REF_INIT_RETAIN (cs, fuzzy_session_destroy);
+		REF_RETAIN (session);
+		cs->parent = session;
+		cs->batch_idx = i;
+		cs->worker = session->worker;
+		cs->fd = session->fd;
+		cs->ctx = session->ctx;
+		cs->time = session->time;
+		cs->addr = session->addr;
+		cs->epoch = session->epoch;
+		cs->key_stat = session->key_stat;
 
-			session = g_slice_alloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
+		if (cmd->shingles_count > 0) {
+			if (encrypted) {
+				cs->cmd_type = CMD_ENCRYPTED_SHINGLE;
+				memcpy (&cs->cmd.enc_shingle.cmd, p, cmdlen);
 			}
 			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
-				}
-				else {
-					*nerrors = *nerrors + 1;
-				}
+				cs->cmd_type = CMD_SHINGLE;
+				memcpy (&cs->cmd.shingle, p, cmdlen);
 			}
-
-			REF_RELEASE (session);
 		}
-	}
+		else {
+			if (encrypted) {
+				cs->cmd_type = CMD_ENCRYPTED_NORMAL;
+				memcpy (&cs->cmd.enc_normal.cmd, p, cmdlen);
+			}
+			else {
+				cs->cmd_type = CMD_NORMAL;
+				memcpy (&cs->cmd.normal, p, cmdlen);
+			}
+		}
+
+		rspamd_fuzzy_process_command (cs);
+		REF_RELEASE (cs);
+		p += cmdlen;
+	}
+
+	rspamd_fuzzy_batch_reply (session, 0, NULL);
+}
+
+static void
+rspamd_fuzzy_process_datagram (struct rspamd_worker *worker, gint fd,
+		guint8 *buf, gssize r, rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+	guint64 *nerrors;
+
+	worker->nconns++;
+	session = g_slice_alloc0 (sizeof (*session));
+	REF_INIT_RETAIN (session, fuzzy_session_destroy);
+	session->worker = worker;
+	session->fd = fd;
+	session->ctx = worker->ctx;
+	session->time = (guint64) time (NULL);
+	session->addr = addr;
+
+	if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
+		if (session->batch) {
+			rspamd_fuzzy_process_batch (session);
+		}
+		else {
+			rspamd_fuzzy_process_command (session);
+		}
+	}
+	else {
+		/* Discard input */
+		session->ctx->stat.invalid_requests ++;
+		msg_debug ("invalid fuzzy command of size %z received", r);
+
+		nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
+				addr, -1);
+
+		if (nerrors == NULL) {
+			nerrors = g_malloc (sizeof (*nerrors));
+			*nerrors = 1;
+			rspamd_lru_hash_insert (session->ctx->errors_ips,
+					rspamd_inet_address_copy (addr),
+					nerrors, -1, -1);
+		}
+		else {
+			*nerrors = *nerrors + 1;
+		}
+	}
+
+	REF_RELEASE (session);
+}
+
+#ifdef FUZZY_USE_MMSG
+/*
+ * Send all replies collected while processing a batch of datagrams
+ */
+static void
+rspamd_fuzzy_send_replies (struct rspamd_fuzzy_storage_ctx *ctx, gint fd)
+{
+	struct mmsghdr msgs[FUZZY_MAX_BATCH];
+	struct iovec iovs[FUZZY_MAX_BATCH];
+	struct rspamd_cryptobox_message enc[FUZZY_MAX_BATCH];
+	struct fuzzy_session *session;
+	guint i, nreplies, nsent = 0, nenc = 0;
+	socklen_t slen;
+	gint r;
+
+	nreplies = MIN (ctx->replies->len, FUZZY_MAX_BATCH);
+	memset (msgs, 0, sizeof (msgs[0]) * nreplies);
+
+	for (i = 0; i < nreplies; i ++) {
+		session = g_ptr_array_index (ctx->replies, i);
+
+		if (session->encrypt_reply) {
+			rspamd_fuzzy_reply_message (session, &enc[nenc ++]);
+		}
+	}
+
+	if (nenc > 0) {
+		/* Short replies are encrypted in parallel */
+		rspamd_cryptobox_encrypt_nm_inplace_multi (enc, nenc,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	for (i = 0; i < nreplies; i ++) {
+		session = g_ptr_array_index (ctx->replies, i);
+		iovs[i].iov_base = (void *)rspamd_fuzzy_reply_data (session,
+				&iovs[i].iov_len);
+		msgs[i].msg_hdr.msg_name = (void *)rspamd_inet_address_get_sa (
+				session->addr, &slen);
+		msgs[i].msg_hdr.msg_namelen = slen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (nsent < nreplies) {
+		r = sendmmsg (fd, msgs + nsent, nreplies - nsent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		nsent += r;
+	}
+
+	for (i = 0; i < ctx->replies->len; i ++) {
+		session = g_ptr_array_index (ctx->replies, i);
+
+		if (i >= nsent) {
+			/* Unsent replies are written one by one handling all errors */
+			rspamd_fuzzy_write_reply (session);
+		}
+
+		REF_RELEASE (session);
+	}
+
+	g_ptr_array_set_size (ctx->replies, 0);
+}
+#endif
+
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_fuzzy_socket (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+	rspamd_inet_addr_t *addr;
+	gssize r;
+#ifdef FUZZY_USE_MMSG
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct mmsghdr msgs[FUZZY_MAX_BATCH];
+	struct iovec iovs[FUZZY_MAX_BATCH];
+	struct sockaddr_storage peers[FUZZY_MAX_BATCH];
+	guint8 bufs[FUZZY_MAX_BATCH][FUZZY_MAX_PACKET];
+	gint i;
+#else
+	guint8 buf[FUZZY_MAX_PACKET];
+#endif
+
+	/* Got some data */
+	if (what == EV_READ) {
+#ifdef FUZZY_USE_MMSG
+		memset (msgs, 0, sizeof (msgs));
+
+		for (i = 0; i < FUZZY_MAX_BATCH; i ++) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = sizeof (bufs[i]);
+			msgs[i].msg_hdr.msg_name = &peers[i];
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		for (;;) {
+			for (i = 0; i < FUZZY_MAX_BATCH; i ++) {
+				msgs[i].msg_hdr.msg_namelen = sizeof (peers[i]);
+			}
+
+			r = recvmmsg (fd, msgs, FUZZY_MAX_BATCH, 0, NULL);
+
+			if (r == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+
+					return;
+				}
+
+				msg_err ("got error while reading from socket: %d, %s",
+						errno,
+						strerror (errno));
+				return;
+			}
+
+			ctx->batch_replies = TRUE;
+
+			for (i = 0; i < r; i ++) {
+				if (msgs[i].msg_hdr.msg_namelen < sizeof (struct sockaddr)) {
+					/* Unnamed peer (e.g. unix socket), we cannot reply */
+					msg_debug ("ignore datagram from an unnamed peer");
+					continue;
+				}
+
+				addr = rspamd_inet_address_from_sa (
+						(struct sockaddr *)&peers[i],
+						msgs[i].msg_hdr.msg_namelen);
+				rspamd_fuzzy_process_datagram (worker, fd, bufs[i],
+						msgs[i].msg_len, addr);
+			}
+
+			ctx->batch_replies = FALSE;
+			rspamd_fuzzy_send_replies (ctx, fd);
+
+			if (r < FUZZY_MAX_BATCH) {
+				/* Socket is drained */
+				return;
+			}
+		}
+#else
+		for (;;) {
+			r = rspamd_inet_address_recvfrom (fd,
+					buf,
+					sizeof (buf),
+					0,
+					&addr);
+
+			if (r == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+
+					return;
+				}
+
+				msg_err ("got error while reading from socket: %d, %s",
+						errno,
+						strerror (errno));
+				return;
+			}
+
+			rspamd_fuzzy_process_datagram (worker, fd, buf, r, addr);
+		}
+#endif
+	}
+}
+
+static void
+rspamd_fuzzy_storage_load_index (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GError *err = NULL;
+
+	/* Changes committed during loading are caught by the next refresh */
+	ctx->index_serial = g_atomic_int_get (ctx->updates_serial);
+
+	if (!rspamd_fuzzy_backend_load_index (ctx->backend, &err)) {
+		msg_err ("cannot load memory index of fuzzy hashes: %e", err);
+		g_error_free (err);
+	}
+}
+
+/*
+ * Workers except the first one do not apply updates, so they reload their
+ * memory index when the first worker commits something
+ */
+static void
+rspamd_fuzzy_index_refresh (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct timeval tv;
+
+	if (ctx->backend &&
+			g_atomic_int_get (ctx->updates_serial) != ctx->index_serial) {
+		rspamd_fuzzy_storage_load_index (ctx);
+		ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	}
+
+	double_to_tv (rspamd_time_jitter (ctx->sync_timeout, 0), &tv);
+	evtimer_add (&ctx->index_ev, &tv);
+}
+
+static void
+rspamd_fuzzy_expire_callback (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct timeval tv;
+	gint64 expired = 0;
+
+	if (ctx->backend) {
+		expired = rspamd_fuzzy_backend_expire (ctx->backend, ctx->expire,
+				ctx->expire_slice);
+
+		if (expired > 0) {
+			ctx->stat.fuzzy_hashes_expired += expired;
+			ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+			g_atomic_int_inc (ctx->updates_serial);
+		}
+	}
+
+	/* Continue shortly if there are more expired hashes */
+	if (expired == ctx->expire_slice) {
+		double_to_tv (FUZZY_EXPIRE_STEP, &tv);
+	}
+	else {
+		double_to_tv (rspamd_time_jitter (ctx->sync_timeout, 0), &tv);
+	}
+
+	evtimer_add (&ctx->expire_ev, &tv);
 }
 
 static void
@@ -790,9 +1496,10 @@ sync_callback (gint fd, short what, void *arg)
 
 	if (ctx->backend) {
 		rspamd_fuzzy_process_updates_queue (ctx);
-		/* Call backend sync */
+		/* Call backend sync, hashes are expired in background steps */
 		old_expired = rspamd_fuzzy_backend_expired (ctx->backend);
-		rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire, TRUE);
+		rspamd_fuzzy_backend_sync (ctx->backend,
+				ctx->expire_slice > 0 ? 0 : ctx->expire, TRUE);
 		new_expired = rspamd_fuzzy_backend_expired (ctx->backend);
 
 		if (old_expired < new_expired) {
@@ -842,10 +1549,7 @@ rspamd_fuzzy_storage_sync (struct rspamd_main *rspamd_main,
 	double_to_tv (next_check, &tmv);
 	evtimer_add (&tev, &tmv);
 
-	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
-	}
+	rspamd_control_worker_reply (worker, fd, &rep);
 
 	return TRUE;
 }
@@ -862,17 +1566,23 @@ rspamd_fuzzy_storage_reload (struct rspamd_main *rspamd_main,
 	struct rspamd_control_reply rep;
 
 	msg_info ("reloading fuzzy storage after receiving reload command");
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_RELOAD;
+
+	if (ctx->redis) {
+		/* Nothing to reopen */
+		rspamd_control_worker_reply (worker, fd, &rep);
+
+		return TRUE;
+	}
 
 	if (ctx->backend) {
 		/* Close backend and reopen it one more time */
 		rspamd_fuzzy_backend_close (ctx->backend);
 	}
 
-	memset (&rep, 0, sizeof (rep));
-	rep.type = RSPAMD_CONTROL_RELOAD;
-
 	if ((ctx->backend = rspamd_fuzzy_backend_open (ctx->hashfile,
-			TRUE,
+			TRUE, ctx->sqlite_tune,
 			&err)) == NULL) {
 		msg_err ("cannot open backend after reload: %e", err);
 		g_error_free (err);
@@ -880,13 +1590,19 @@ rspamd_fuzzy_storage_reload (struct rspamd_main *rspamd_main,
 	}
 	else {
 		rep.reply.reload.status = 0;
-	}
 
-	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
+		if (ctx->replication_bind) {
+			rspamd_fuzzy_backend_log_changes (ctx->backend,
+					ctx->replication_log);
+		}
+
+		if (ctx->memory_index) {
+			rspamd_fuzzy_storage_load_index (ctx);
+		}
 	}
 
+	rspamd_control_worker_reply (worker, fd, &rep);
+
 	return TRUE;
 }
 
@@ -914,14 +1630,12 @@ rspamd_fuzzy_storage_stat_key (struct fuzzy_key_stat *key_stat)
 static ucl_object_t *
 rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat)
 {
-	GHashTableIter it, ip_it;
-	GHashTable *ip_hash;
+	GHashTableIter it;
 	struct fuzzy_key_stat *key_stat;
 	struct fuzzy_key *key;
-	rspamd_lru_element_t *lru_elt;
 	ucl_object_t *obj, *keys_obj, *elt, *ip_elt, *ip_cur;
 	gpointer k, v;
-	gint i;
+	gint i, ip_it;
 	gchar keyname[17];
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
@@ -939,21 +1653,17 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			elt = rspamd_fuzzy_storage_stat_key (key_stat);
 
 			if (key_stat->last_ips && ip_stat) {
-				ip_hash = rspamd_lru_hash_get_htable (key_stat->last_ips);
-
-				if (ip_hash) {
-					g_hash_table_iter_init (&ip_it, ip_hash);
-					ip_elt = ucl_object_typed_new (UCL_OBJECT);
-
-					while (g_hash_table_iter_next (&ip_it, &k, &v)) {
-						lru_elt = v;
-						ip_cur = rspamd_fuzzy_storage_stat_key (lru_elt->data);
-						ucl_object_insert_key (ip_elt, ip_cur,
-								rspamd_inet_address_to_string (k), 0, true);
-					}
-
-					ucl_object_insert_key (elt, ip_elt, "ips", 0, false);
+				ip_it = 0;
+				ip_elt = ucl_object_typed_new (UCL_OBJECT);
+
+				while ((ip_it = rspamd_lru_hash_foreach (key_stat->last_ips,
+						ip_it, &k, &v)) != -1) {
+					ip_cur = rspamd_fuzzy_storage_stat_key (v);
+					ucl_object_insert_key (ip_elt, ip_cur,
+							rspamd_inet_address_to_string (k), 0, true);
 				}
+
+				ucl_object_insert_key (elt, ip_elt, "ips", 0, false);
 			}
 
 			ucl_object_insert_key (keys_obj, elt, keyname, 0, true);
@@ -980,26 +1690,21 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			false);
 
 	if (ctx->errors_ips && ip_stat) {
-		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
-
-		if (ip_hash) {
-			g_hash_table_iter_init (&ip_it, ip_hash);
-			ip_elt = ucl_object_typed_new (UCL_OBJECT);
-
-			while (g_hash_table_iter_next (&ip_it, &k, &v)) {
-				lru_elt = v;
-
-				ucl_object_insert_key (ip_elt,
-						ucl_object_fromint (*(guint64 *)lru_elt->data),
-						rspamd_inet_address_to_string (k), 0, true);
-			}
-
-			ucl_object_insert_key (obj,
-					ip_elt,
-					"errors_ips",
-					0,
-					false);
+		ip_it = 0;
+		ip_elt = ucl_object_typed_new (UCL_OBJECT);
+
+		while ((ip_it = rspamd_lru_hash_foreach (ctx->errors_ips,
+				ip_it, &k, &v)) != -1) {
+			ucl_object_insert_key (ip_elt,
+					ucl_object_fromint (*(guint64 *)v),
+					rspamd_inet_address_to_string (k), 0, true);
 		}
+
+		ucl_object_insert_key (obj,
+				ip_elt,
+				"errors_ips",
+				0,
+				false);
 	}
 
 	/* Checked by epoch */
@@ -1069,9 +1774,18 @@ rspamd_fuzzy_storage_stat (struct rspamd_main *rspamd_main,
 	else {
 		rep.reply.fuzzy_stat.status = 0;
 
-		memcpy (rep.reply.fuzzy_stat.storage_id,
-				rspamd_fuzzy_backend_id (ctx->backend),
-				sizeof (rep.reply.fuzzy_stat.storage_id));
+		if (ctx->redis) {
+			memcpy (rep.reply.fuzzy_stat.storage_id,
+					rspamd_fuzzy_backend_redis_id (ctx->redis),
+					sizeof (rep.reply.fuzzy_stat.storage_id));
+			ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_redis_count (
+					ctx->redis);
+		}
+		else {
+			memcpy (rep.reply.fuzzy_stat.storage_id,
+					rspamd_fuzzy_backend_id (ctx->backend),
+					sizeof (rep.reply.fuzzy_stat.storage_id));
+		}
 
 		obj = rspamd_fuzzy_stat_to_ucl (ctx, TRUE);
 		emit_subr = ucl_object_emit_fd_funcs (outfd);
@@ -1183,6 +1897,23 @@ fuzzy_parse_keypair (rspamd_mempool_t *pool,
 	return TRUE;
 }
 
+static gboolean
+fuzzy_parse_sqlite_tune (rspamd_mempool_t *pool,
+		const ucl_object_t *obj,
+		gpointer ud,
+		struct rspamd_rcl_section *section,
+		GError **err)
+{
+	struct rspamd_rcl_struct_parser *pd = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+
+	ctx = pd->user_struct;
+	ctx->sqlite_tune = rspamd_sqlite3_tune_from_ucl (pool, obj,
+			&rspamd_sqlite3_throughput_tune, err);
+
+	return ctx->sqlite_tune != NULL;
+}
+
 static guint
 fuzzy_kp_hash (gconstpointer p)
 {
@@ -1209,8 +1940,16 @@ init_fuzzy (struct rspamd_config *cfg)
 
 	ctx->magic = rspamd_fuzzy_storage_magic;
 	ctx->sync_timeout = DEFAULT_SYNC_TIMEOUT;
+	ctx->expire_slice = DEFAULT_EXPIRE_SLICE;
+	ctx->redis_timeout = DEFAULT_REDIS_TIMEOUT;
+	ctx->updates_max_batch = DEFAULT_UPDATES_MAX_BATCH;
+	ctx->updates_max_delay = DEFAULT_UPDATES_MAX_DELAY;
 	ctx->expire = DEFAULT_EXPIRE;
 	ctx->keypair_cache_size = DEFAULT_KEYPAIR_CACHE_SIZE;
+	ctx->replication_log = DEFAULT_REPLICATION_LOG;
+	/* Allocated before workers are forked to be shared among them */
+	ctx->updates_serial = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*ctx->updates_serial));
 	ctx->keys = g_hash_table_new_full (fuzzy_kp_hash, fuzzy_kp_equal,
 			NULL, fuzzy_key_dtor);
 	ctx->errors_ips = rspamd_lru_hash_new_full (1024,
@@ -1253,6 +1992,16 @@ init_fuzzy (struct rspamd_config *cfg)
 			0,
 			"Path to fuzzy database (alias for hashfile)");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"sqlite",
+			fuzzy_parse_sqlite_tune,
+			ctx,
+			0,
+			0,
+			"Tuning of sqlite database: wal, mmap_size, cache_size, "
+			"synchronous and busy_timeout");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"sync",
@@ -1264,6 +2013,39 @@ init_fuzzy (struct rspamd_config *cfg)
 			"Time to perform database sync, default: "
 			G_STRINGIFY (DEFAULT_SYNC_TIMEOUT) " seconds");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_max_batch",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_max_batch),
+			RSPAMD_CL_FLAG_UINT,
+			"Commit pending updates when their number reaches this limit "
+			"(0 to commit on sync only), default: "
+			G_STRINGIFY (DEFAULT_UPDATES_MAX_BATCH));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_max_delay",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_max_delay),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Maximum time an update waits for commit "
+			"(0 to commit on sync only), default: "
+			G_STRINGIFY (DEFAULT_UPDATES_MAX_DELAY) " seconds");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"expire_slice",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, expire_slice),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of hashes expired by a single step in background "
+			"(0 to expire hashes on sync only), default: "
+			G_STRINGIFY (DEFAULT_EXPIRE_SLICE));
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"expire",
@@ -1313,10 +2095,506 @@ init_fuzzy (struct rspamd_config *cfg)
 			0,
 			"Allow encrypted requests only (and forbid all unknown keys or plaintext requests)");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"replication_bind",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replication_bind),
+			0,
+			"Serve log of changes to replicas on this address, default port: "
+					G_STRINGIFY (DEFAULT_REPLICATION_PORT));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"replication_log",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, replication_log),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of the last changes kept for replicas, default: "
+					G_STRINGIFY (DEFAULT_REPLICATION_LOG));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"master",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, master),
+			0,
+			"Fetch changes from the master storage at this address");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"master_key",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, master_key),
+			0,
+			"Public key of the master storage to encrypt replication traffic");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"backend",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, backend_type),
+			0,
+			"Storage backend: sqlite (default) or redis");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"servers",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, redis_servers),
+			0,
+			"Redis servers for redis backend");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"prefix",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, redis_prefix),
+			0,
+			"Prefix for redis keys, default: fz");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"password",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, redis_password),
+			0,
+			"Password for redis servers");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"dbname",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, redis_dbname),
+			0,
+			"Redis database to use");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, redis_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Timeout for redis requests, default: "
+			G_STRINGIFY (DEFAULT_REDIS_TIMEOUT) " seconds");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"memory_index",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, memory_index),
+			0,
+			"Keep all hashes in memory and check them without database queries");
+
 
 	return ctx;
 }
 
+/*
+ * Replication: master serves its log of changes via HTTP and replicas fetch
+ * it incrementally applying changes in batched transactions
+ */
+static void
+rspamd_fuzzy_replication_append (gint64 seq, gconstpointer cmd, gsize len,
+		gpointer ud)
+{
+	rspamd_fstring_t **pbody = ud;
+	guint64 nseq = seq;
+	guint32 nlen = len;
+
+	*pbody = rspamd_fstring_append (*pbody, (const gchar *)&nseq,
+			sizeof (nseq));
+	*pbody = rspamd_fstring_append (*pbody, (const gchar *)&nlen,
+			sizeof (nlen));
+	*pbody = rspamd_fstring_append (*pbody, cmd, len);
+}
+
+static int
+rspamd_fuzzy_replication_handler (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = conn_ent->ud;
+	struct rspamd_http_message *reply;
+	const rspamd_ftok_t *hdr;
+	rspamd_fstring_t *body;
+	gulong since = 0;
+	gint64 first, last;
+	gchar numbuf[64];
+
+	if (ctx->encrypted_only &&
+			!rspamd_http_connection_is_encrypted (conn_ent->conn)) {
+		rspamd_controller_send_error (conn_ent, 403, "Encryption required");
+
+		return 0;
+	}
+
+	hdr = rspamd_http_message_find_header (msg, "Seq");
+
+	if (hdr && !rspamd_strtoul (hdr->begin, hdr->len, &since)) {
+		rspamd_controller_send_error (conn_ent, 400, "Invalid sequence");
+
+		return 0;
+	}
+
+	body = rspamd_fstring_sized_new (BUFSIZ);
+	last = rspamd_fuzzy_backend_read_changes (ctx->backend, since,
+			FUZZY_REPLICATION_BATCH, &first,
+			rspamd_fuzzy_replication_append, &body);
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->status = rspamd_fstring_new_init ("OK", 2);
+	reply->body = body;
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%L", last);
+	rspamd_http_message_add_header (reply, "Seq", numbuf);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%L", first);
+	rspamd_http_message_add_header (reply, "First-Seq", numbuf);
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn,
+			reply,
+			NULL,
+			"application/octet-stream",
+			conn_ent,
+			conn_ent->conn->fd,
+			conn_ent->rt->ptv,
+			conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replication_error_handler (
+		struct rspamd_http_connection_entry *conn_ent, GError *err)
+{
+	msg_err ("cannot serve replication request: %e", err);
+}
+
+static void
+rspamd_fuzzy_replication_finish_handler (
+		struct rspamd_http_connection_entry *conn_ent)
+{
+	/* Nothing to do */
+}
+
+static void
+rspamd_fuzzy_replication_accept (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	if ((nfd = rspamd_accept_from_socket (fd, &addr)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	/* Replicas should be allowed to update storage */
+	if (ctx->update_ips != NULL &&
+			radix_find_compressed_addr (ctx->update_ips, addr) ==
+					RADIX_NO_VALUE) {
+		msg_info ("deny replication request from %s",
+				rspamd_inet_address_to_string (addr));
+		close (nfd);
+	}
+	else {
+		rspamd_http_router_handle_socket (ctx->replication_router, nfd, ctx);
+	}
+
+	rspamd_inet_address_destroy (addr);
+}
+
+static void
+rspamd_fuzzy_replication_listen (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GPtrArray *addrs = NULL;
+	rspamd_inet_addr_t *addr;
+	struct event *accept_ev;
+	guint i;
+	gint fd;
+
+	if (!rspamd_parse_host_port_priority (ctx->replication_bind, &addrs,
+			NULL, NULL, DEFAULT_REPLICATION_PORT, NULL)) {
+		msg_err ("cannot parse replication address: %s",
+				ctx->replication_bind);
+		return;
+	}
+
+	ctx->replication_router = rspamd_http_router_new (
+			rspamd_fuzzy_replication_error_handler,
+			rspamd_fuzzy_replication_finish_handler,
+			&ctx->replication_tv,
+			ctx->ev_base,
+			NULL,
+			ctx->keypair_cache);
+
+	if (ctx->default_key) {
+		rspamd_http_router_set_key (ctx->replication_router,
+				ctx->default_key->key);
+	}
+
+	rspamd_http_router_add_path (ctx->replication_router, "/changes",
+			rspamd_fuzzy_replication_handler);
+
+	for (i = 0; i < addrs->len; i ++) {
+		addr = g_ptr_array_index (addrs, i);
+		fd = rspamd_inet_address_listen (addr, SOCK_STREAM, TRUE);
+
+		if (fd == -1) {
+			msg_err ("cannot listen for replicas on %s: %s",
+					rspamd_inet_address_to_string (addr), strerror (errno));
+			continue;
+		}
+
+		accept_ev = g_slice_alloc0 (sizeof (*accept_ev));
+		event_set (accept_ev, fd, EV_READ | EV_PERSIST,
+				rspamd_fuzzy_replication_accept, ctx);
+		event_base_set (ctx->ev_base, accept_ev);
+		event_add (accept_ev, NULL);
+		worker->accept_events = g_list_prepend (worker->accept_events,
+				accept_ev);
+	}
+
+	g_ptr_array_free (addrs, TRUE);
+}
+
+static void
+rspamd_fuzzy_replication_schedule (struct rspamd_fuzzy_storage_ctx *ctx,
+		gdouble after)
+{
+	struct timeval tv;
+
+	double_to_tv (after, &tv);
+	evtimer_add (&ctx->replication_ev, &tv);
+}
+
+static void
+rspamd_fuzzy_replication_done (struct rspamd_fuzzy_storage_ctx *ctx,
+		gboolean more)
+{
+	rspamd_http_connection_unref (ctx->replication_conn);
+	ctx->replication_conn = NULL;
+	close (ctx->replication_fd);
+	ctx->replication_fd = -1;
+	/* Fetch the rest of changes immediately if the batch was full */
+	rspamd_fuzzy_replication_schedule (ctx,
+			more ? 0.0 : rspamd_time_jitter (ctx->sync_timeout, 0));
+}
+
+static gint64
+rspamd_fuzzy_replication_apply (struct rspamd_fuzzy_storage_ctx *ctx,
+		const guchar *p, gsize remain, guint *nchanges)
+{
+	union {
+		struct rspamd_fuzzy_cmd normal;
+		struct rspamd_fuzzy_shingle_cmd shingle;
+	} cmd;
+	guint64 seq;
+	guint32 len;
+	gint64 last = ctx->replication_seq;
+
+	while (remain >= sizeof (seq) + sizeof (len)) {
+		memcpy (&seq, p, sizeof (seq));
+		memcpy (&len, p + sizeof (seq), sizeof (len));
+		p += sizeof (seq) + sizeof (len);
+		remain -= sizeof (seq) + sizeof (len);
+
+		if (len > remain ||
+				(len != sizeof (cmd.normal) && len != sizeof (cmd.shingle))) {
+			msg_err ("invalid change %uL received from master", seq);
+			break;
+		}
+
+		memcpy (&cmd, p, len);
+		p += len;
+		remain -= len;
+
+		if ((cmd.normal.shingles_count > 0) != (len == sizeof (cmd.shingle))) {
+			msg_err ("invalid change %uL received from master", seq);
+			break;
+		}
+
+		if (cmd.normal.cmd == FUZZY_WRITE) {
+			rspamd_fuzzy_backend_add (ctx->backend, &cmd);
+		}
+		else if (cmd.normal.cmd == FUZZY_DEL) {
+			rspamd_fuzzy_backend_del (ctx->backend, &cmd);
+		}
+
+		last = seq;
+		(*nchanges) ++;
+	}
+
+	return last;
+}
+
+static int
+rspamd_fuzzy_replication_fin (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = conn->ud;
+	const rspamd_ftok_t *hdr;
+	gulong first = 0;
+	guint nchanges = 0;
+	gint64 last;
+
+	if (msg->code != 200) {
+		msg_err ("cannot fetch changes from master: %d", msg->code);
+		rspamd_fuzzy_replication_done (ctx, FALSE);
+
+		return 0;
+	}
+
+	hdr = rspamd_http_message_find_header (msg, "First-Seq");
+
+	if (hdr && rspamd_strtoul (hdr->begin, hdr->len, &first) &&
+			(gint64)first > ctx->replication_seq + 1) {
+		msg_err ("changes %L-%L have been already removed from master log, "
+				"full resync is required", ctx->replication_seq + 1,
+				(gint64)first - 1);
+	}
+
+	if (msg->body && msg->body->len > 0 &&
+			rspamd_fuzzy_backend_prepare_update (ctx->backend)) {
+		last = rspamd_fuzzy_replication_apply (ctx,
+				(const guchar *)msg->body->str,
+				msg->body->len, &nchanges);
+
+		if (nchanges > 0) {
+			rspamd_fuzzy_backend_set_replica_seq (ctx->backend, last);
+		}
+
+		if (rspamd_fuzzy_backend_finish_update (ctx->backend)) {
+			if (nchanges > 0) {
+				ctx->replication_seq = last;
+				ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_count (
+						ctx->backend);
+				g_atomic_int_inc (ctx->updates_serial);
+				msg_info ("applied %ud changes from master, last sequence: %L",
+						nchanges, last);
+			}
+		}
+		else {
+			nchanges = 0;
+		}
+	}
+
+	rspamd_fuzzy_replication_done (ctx, nchanges == FUZZY_REPLICATION_BATCH);
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replication_err (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = conn->ud;
+
+	msg_err ("cannot fetch changes from master: %e", err);
+	rspamd_fuzzy_replication_done (ctx, FALSE);
+}
+
+static void
+rspamd_fuzzy_replication_fetch (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct rspamd_http_message *msg;
+	gchar numbuf[64];
+
+	ctx->replication_fd = rspamd_inet_address_connect (ctx->master_addr,
+			SOCK_STREAM, TRUE);
+
+	if (ctx->replication_fd == -1) {
+		msg_err ("cannot connect to master %s: %s",
+				rspamd_inet_address_to_string (ctx->master_addr),
+				strerror (errno));
+		rspamd_fuzzy_replication_schedule (ctx,
+				rspamd_time_jitter (ctx->sync_timeout, 0));
+
+		return;
+	}
+
+	ctx->replication_conn = rspamd_http_connection_new (NULL,
+			rspamd_fuzzy_replication_err,
+			rspamd_fuzzy_replication_fin,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			NULL);
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_new_init ("/changes", sizeof ("/changes") - 1);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%L", ctx->replication_seq);
+	rspamd_http_message_add_header (msg, "Seq", numbuf);
+
+	if (ctx->master_pk) {
+		rspamd_http_connection_set_key (ctx->replication_conn,
+				ctx->replica_kp);
+		msg->peer_key = rspamd_pubkey_ref (ctx->master_pk);
+	}
+
+	rspamd_http_connection_write_message (ctx->replication_conn,
+			msg,
+			NULL,
+			NULL,
+			ctx,
+			ctx->replication_fd,
+			&ctx->replication_tv,
+			ctx->ev_base);
+}
+
+static void
+rspamd_fuzzy_replication_start (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GPtrArray *addrs = NULL;
+
+	if (!rspamd_parse_host_port_priority (ctx->master, &addrs,
+			NULL, NULL, DEFAULT_REPLICATION_PORT, NULL)) {
+		msg_err ("cannot parse master address: %s", ctx->master);
+		return;
+	}
+
+	ctx->master_addr = rspamd_inet_address_copy (g_ptr_array_index (addrs, 0));
+	g_ptr_array_free (addrs, TRUE);
+
+	if (ctx->master_key) {
+		ctx->master_pk = rspamd_pubkey_from_base32 (ctx->master_key, 0,
+				RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+
+		if (ctx->master_pk == NULL) {
+			msg_err ("cannot parse master key: %s", ctx->master_key);
+			return;
+		}
+
+		ctx->replica_kp = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	ctx->replication_seq = rspamd_fuzzy_backend_replica_seq (ctx->backend);
+	msg_info ("start replication from %s, last sequence: %L",
+			rspamd_inet_address_to_string (ctx->master_addr),
+			ctx->replication_seq);
+	evtimer_set (&ctx->replication_ev, rspamd_fuzzy_replication_fetch, ctx);
+	event_base_set (ctx->ev_base, &ctx->replication_ev);
+	rspamd_fuzzy_replication_schedule (ctx, 0.0);
+}
+
 static void
 rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 {
@@ -1338,7 +2616,7 @@ rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 	else {
 		pcmd = g_slice_alloc (sizeof (*pcmd));
 		memcpy (pcmd, &cmd, sizeof (cmd));
-		g_queue_push_tail (ctx->updates_pending, pcmd);
+		rspamd_fuzzy_queue_update (ctx, pcmd);
 	}
 }
 
@@ -1386,6 +2664,10 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 		event_base_set (ctx->ev_base, &ctx->peer_ev);
 		event_add (&ctx->peer_ev, NULL);
 		ctx->updates_pending = g_queue_new ();
+		ctx->updates_coalesced = g_hash_table_new (fuzzy_digest_hash,
+				fuzzy_digest_equal);
+		evtimer_set (&ctx->updates_ev, rspamd_fuzzy_updates_timer, ctx);
+		event_base_set (ctx->ev_base, &ctx->updates_ev);
 
 		/* Timer event */
 		evtimer_set (&tev, sync_callback, worker);
@@ -1394,6 +2676,27 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 		next_check = rspamd_time_jitter (ctx->sync_timeout, 0);
 		double_to_tv (next_check, &tmv);
 		evtimer_add (&tev, &tmv);
+
+		if (ctx->expire > 0 && ctx->expire_slice > 0) {
+			evtimer_set (&ctx->expire_ev, rspamd_fuzzy_expire_callback, ctx);
+			event_base_set (ctx->ev_base, &ctx->expire_ev);
+			double_to_tv (rspamd_time_jitter (ctx->sync_timeout, 0), &tmv);
+			evtimer_add (&ctx->expire_ev, &tmv);
+		}
+
+		/* Only the first worker writes to the database */
+		if (ctx->replication_bind) {
+			rspamd_fuzzy_replication_listen (worker, ctx);
+		}
+
+		if (ctx->master) {
+			rspamd_fuzzy_replication_start (ctx);
+		}
+	}
+	else if (ctx->memory_index) {
+		evtimer_set (&ctx->index_ev, rspamd_fuzzy_index_refresh, ctx);
+		event_base_set (ctx->ev_base, &ctx->index_ev);
+		rspamd_fuzzy_index_refresh (-1, EV_TIMEOUT, ctx);
 	}
 }
 
@@ -1412,23 +2715,60 @@ start_fuzzy (struct rspamd_worker *worker)
 			NULL);
 	ctx->peer_fd = -1;
 
+	if (ctx->backend_type && g_ascii_strcasecmp (ctx->backend_type, "redis") == 0) {
+		ctx->redis = rspamd_fuzzy_backend_redis_new (worker->srv->cfg,
+				ctx->ev_base, ctx->redis_servers, ctx->redis_prefix,
+				ctx->redis_password, ctx->redis_dbname, ctx->redis_timeout,
+				&err);
+
+		if (ctx->redis == NULL) {
+			msg_err ("cannot open redis backend: %e", err);
+			g_error_free (err);
+			exit (EXIT_SUCCESS);
+		}
+
+		if (ctx->memory_index || ctx->replication_bind || ctx->master) {
+			msg_warn ("memory index and replication are not supported by "
+					"redis backend, ignore them");
+			ctx->memory_index = FALSE;
+			ctx->replication_bind = NULL;
+			ctx->master = NULL;
+		}
+
+		ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_redis_count (ctx->redis);
+	}
 	/*
 	 * Open DB and perform VACUUM
 	 */
-	if ((ctx->backend = rspamd_fuzzy_backend_open (ctx->hashfile, TRUE, &err)) == NULL) {
+	else if ((ctx->backend = rspamd_fuzzy_backend_open (ctx->hashfile,
+			TRUE, ctx->sqlite_tune, &err)) == NULL) {
 		msg_err ("cannot open backend: %e", err);
 		g_error_free (err);
 		exit (EXIT_SUCCESS);
 	}
+	else {
+		ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	}
+
+	ctx->replies = g_ptr_array_sized_new (FUZZY_MAX_BATCH);
+	ctx->replication_fd = -1;
+	double_to_tv (DEFAULT_REPLICATION_TIMEOUT, &ctx->replication_tv);
+
+	if (ctx->replication_bind) {
+		rspamd_fuzzy_backend_log_changes (ctx->backend, ctx->replication_log);
+	}
 
-	ctx->stat.fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+	if (ctx->memory_index) {
+		rspamd_fuzzy_storage_load_index (ctx);
+	}
 
 	if (ctx->default_key && ctx->keypair_cache_size > 0) {
 		/* Create keypairs cache */
-		ctx->keypair_cache = rspamd_keypair_cache_new (ctx->keypair_cache_size);
+		ctx->keypair_cache = rspamd_keypair_cache_new_shared (
+				ctx->keypair_cache_size, worker->srv->cfg->keypair_shared_cache);
 	}
 
-	if (worker->index == 0) {
+	if (worker->index == 0 && ctx->backend) {
 		rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire, TRUE);
 	}
 
@@ -1478,12 +2818,13 @@ start_fuzzy (struct rspamd_worker *worker)
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
-	if (worker->index == 0) {
+	if (worker->index == 0 && ctx->backend) {
 		rspamd_fuzzy_process_updates_queue (ctx);
 		rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire, TRUE);
 	}
 
 	rspamd_fuzzy_backend_close (ctx->backend);
+	rspamd_fuzzy_backend_redis_close (ctx->redis);
 	rspamd_log_close (worker->srv->logger);
 
 	if (ctx->peer_fd != -1) {
@@ -1497,7 +2838,21 @@ start_fuzzy (struct rspamd_worker *worker)
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
 
+	if (ctx->replication_router) {
+		rspamd_http_router_free (ctx->replication_router);
+	}
+
+	if (ctx->master_addr) {
+		rspamd_inet_address_destroy (ctx->master_addr);
+	}
+
+	if (ctx->master_pk) {
+		rspamd_pubkey_unref (ctx->master_pk);
+		rspamd_keypair_unref (ctx->replica_kp);
+	}
+
 	rspamd_lru_hash_destroy (ctx->errors_ips);
+	g_ptr_array_free (ctx->replies, TRUE);
 
 	g_hash_table_unref (ctx->keys);
 
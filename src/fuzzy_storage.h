@@ -13,7 +13,11 @@
 #define FUZZY_CHECK 0
 #define FUZZY_WRITE 1
 #define FUZZY_DEL 2
+/* Several commands packed into a single datagram */
+#define FUZZY_BATCH 3
 
+/* Maximum size of a batch datagram (fits ethernet MTU without fragmentation) */
+#define RSPAMD_FUZZY_MAX_BATCH_LEN 1400
 
 /**
  * The epoch of the fuzzy client
@@ -41,6 +45,19 @@ RSPAMD_PACKED(rspamd_fuzzy_shingle_cmd) {
 	struct rspamd_shingle sgl;
 };
 
+/*
+ * Batch is started with this header followed by `count` commands, each of
+ * them is `rspamd_fuzzy_cmd` followed by `rspamd_shingle` if `shingles_count`
+ * is not zero. The reply for a batch is a single datagram with replies for
+ * all commands in the same order
+ */
+RSPAMD_PACKED(rspamd_fuzzy_batch_hdr) {
+	guint8 version;
+	guint8 cmd;
+	guint8 count;
+	guint8 reserved;
+};
+
 RSPAMD_PACKED(rspamd_fuzzy_reply) {
 	gint32 value;
 	guint32 flag;
@@ -77,5 +94,11 @@ RSPAMD_PACKED(rspamd_fuzzy_encrypted_reply) {
 };
 
 static const guchar fuzzy_encrypted_magic[4] = {'r', 's', 'f', 'e'};
+/*
+ * Encrypted batch: `rspamd_fuzzy_encrypted_req_hdr` with this magic followed
+ * by the encrypted batch. The reply is `rspamd_fuzzy_encrypted_rep_hdr`
+ * followed by all replies encrypted at once
+ */
+static const guchar fuzzy_encrypted_batch_magic[4] = {'r', 's', 'f', 'b'};
 
 #endif
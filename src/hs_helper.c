@@ -25,6 +25,11 @@
 #include <glob.h>
 #endif
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#include <signal.h>
+
 static gpointer init_hs_helper (struct rspamd_config *cfg);
 static void start_hs_helper (struct rspamd_worker *worker);
 
@@ -53,6 +58,24 @@ struct hs_helper_ctx {
 	struct rspamd_config *cfg;
 	struct event recompile_timer;
 	struct event_base *ev_base;
+	guint max_jobs;
+	guint njobs;
+	GQueue *pending;
+	gint ncompiled;
+	gboolean forced;
+	gboolean notify_in_flight;
+	gboolean notify_pending;
+};
+
+/*
+ * Compilation of a single re class in a child process
+ */
+struct hs_helper_job {
+	struct hs_helper_ctx *ctx;
+	struct rspamd_worker *worker;
+	const gchar *class_hash;
+	pid_t pid;
+	struct event ev;
 };
 
 static gpointer
@@ -69,6 +92,12 @@ init_hs_helper (struct rspamd_config *cfg)
 	ctx->hs_dir = NULL;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+	ctx->pending = g_queue_new ();
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+	ctx->max_jobs = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+#else
+	ctx->max_jobs = 1;
+#endif
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -94,6 +123,14 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, recompile_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time between recompilation checks");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_jobs",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, max_jobs),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum number of re classes compiled in parallel (number of CPUs by default)");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"timeout",
@@ -116,7 +153,7 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	glob_t globbuf;
 	guint len, i;
 	gint rc;
-	gchar *pattern;
+	gchar *pattern, stream_path[PATH_MAX];
 	gboolean ret = TRUE;
 
 	if (stat (ctx->hs_dir, &st) == -1) {
@@ -141,6 +178,44 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 							strerror (errno));
 					ret = FALSE;
 				}
+
+				/* Streaming database of the same class, if any */
+				rspamd_snprintf (stream_path, sizeof (stream_path), "%ss",
+						globbuf.gl_pathv[i]);
+
+				if (unlink (stream_path) == -1 && errno != ENOENT) {
+					msg_err ("cannot unlink %s: %s", stream_path,
+							strerror (errno));
+					ret = FALSE;
+				}
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
+	globfree (&globbuf);
+	g_free (pattern);
+
+	/*
+	 * Shared deserialized databases are named by their content, so we just
+	 * remove all of them to avoid garbage: processes that have them mapped
+	 * are not affected and the new ones are created on demand
+	 */
+	globbuf.gl_offs = 0;
+	len = strlen (ctx->hs_dir) + 1 + sizeof ("*.hsdb");
+	pattern = g_malloc (len);
+	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR,
+			"*.hsdb");
+
+	if ((rc = glob (pattern, GLOB_DOOFFS, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (unlink (globbuf.gl_pathv[i]) == -1) {
+				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+				ret = FALSE;
 			}
 		}
 	}
@@ -155,31 +230,35 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	return ret;
 }
 
-static gboolean
-rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
-		gboolean forced)
-{
-	GError *err = NULL;
-	static struct rspamd_srv_command srv_cmd;
-	gint ncompiled;
+static void
+rspamd_hs_helper_notify (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker, gboolean forced);
 
-	if (!rspamd_hs_helper_cleanup_dir (ctx, forced)) {
-		msg_warn ("cannot cleanup cache dir '%s'", ctx->hs_dir);
-	}
+static void
+rspamd_hs_helper_notify_reply (struct rspamd_worker *worker,
+		struct rspamd_srv_reply *rep, gint rep_fd,
+		gpointer ud)
+{
+	struct hs_helper_ctx *ctx = ud;
 
-	if ((ncompiled = rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
-			ctx->hs_dir, ctx->max_time, !forced,
-			&err)) == -1) {
-		msg_err ("failed to compile re cache: %e", err);
-		g_error_free (err);
+	ctx->notify_in_flight = FALSE;
 
-		return FALSE;
+	if (ctx->notify_pending) {
+		/* Some classes have been compiled meanwhile */
+		ctx->notify_pending = FALSE;
+		rspamd_hs_helper_notify (ctx, worker, TRUE);
 	}
+}
+
+static void
+rspamd_hs_helper_notify (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker, gboolean forced)
+{
+	static struct rspamd_srv_command srv_cmd;
 
-	if (ncompiled > 0) {
-		msg_info ("compiled %d regular expressions to the hyperscan tree",
-				ncompiled);
-		forced = TRUE;
+	if (ctx->notify_in_flight) {
+		ctx->notify_pending = TRUE;
+		return;
 	}
 
 	/*
@@ -194,8 +273,182 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
 	srv_cmd.cmd.hs_loaded.cache_dir = ctx->hs_dir;
 	srv_cmd.cmd.hs_loaded.forced = forced;
+	ctx->notify_in_flight = TRUE;
 
-	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, -1, NULL, NULL);
+	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, -1,
+			rspamd_hs_helper_notify_reply, ctx);
+}
+
+static gboolean rspamd_hs_helper_start_job (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker, const gchar *class_hash);
+
+static void
+rspamd_hs_helper_job_done (gint fd, short what, gpointer ud)
+{
+	struct hs_helper_job *job = ud;
+	struct hs_helper_ctx *ctx = job->ctx;
+	struct rspamd_worker *worker = job->worker;
+	const gchar *next;
+	gint n = -1, status;
+
+	event_del (&job->ev);
+
+	if (read (fd, &n, sizeof (n)) != sizeof (n)) {
+		n = -1;
+	}
+
+	close (fd);
+
+	if (waitpid (job->pid, &status, 0) == -1 || !WIFEXITED (status) ||
+			WEXITSTATUS (status) != EXIT_SUCCESS) {
+		n = -1;
+	}
+
+	if (n == -1) {
+		msg_err ("failed to compile re class %s", job->class_hash);
+	}
+	else if (n > 0) {
+		ctx->ncompiled += n;
+		/* Let workers switch this class to hyperscan right now */
+		rspamd_hs_helper_notify (ctx, worker, TRUE);
+	}
+
+	g_slice_free1 (sizeof (*job), job);
+	ctx->njobs --;
+
+	while ((next = g_queue_pop_head (ctx->pending)) != NULL) {
+		if (rspamd_hs_helper_start_job (ctx, worker, next)) {
+			break;
+		}
+	}
+
+	if (ctx->njobs == 0) {
+		/* Forget about SIGCHLD after this point */
+		signal (SIGCHLD, SIG_IGN);
+
+		if (ctx->ncompiled > 0) {
+			msg_info ("compiled %d regular expressions to the hyperscan tree",
+					ctx->ncompiled);
+		}
+		else {
+			rspamd_hs_helper_notify (ctx, worker, ctx->forced);
+		}
+	}
+}
+
+static gboolean
+rspamd_hs_helper_start_job (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker, const gchar *class_hash)
+{
+	struct hs_helper_job *job;
+	GError *err = NULL;
+	gint fds[2], n;
+	pid_t cld;
+
+	if (pipe (fds) == -1) {
+		msg_err ("cannot create pipe: %s", strerror (errno));
+		return FALSE;
+	}
+
+	cld = fork ();
+
+	if (cld == -1) {
+		msg_err ("cannot fork: %s", strerror (errno));
+		close (fds[0]);
+		close (fds[1]);
+
+		return FALSE;
+	}
+
+	if (cld == 0) {
+		/* Compile class and report the number of regexps compiled */
+		close (fds[0]);
+
+		if ((n = rspamd_re_cache_compile_hyperscan_class (ctx->cfg->re_cache,
+				ctx->hs_dir, class_hash, ctx->max_time, !ctx->forced,
+				&err)) == -1) {
+			msg_err ("failed to compile re cache: %e", err);
+			g_error_free (err);
+		}
+
+		if (write (fds[1], &n, sizeof (n)) != sizeof (n)) {
+			exit (EXIT_FAILURE);
+		}
+
+		exit (n == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	close (fds[1]);
+	job = g_slice_alloc0 (sizeof (*job));
+	job->ctx = ctx;
+	job->worker = worker;
+	job->class_hash = class_hash;
+	job->pid = cld;
+	event_set (&job->ev, fds[0], EV_READ, rspamd_hs_helper_job_done, job);
+	event_base_set (ctx->ev_base, &job->ev);
+	event_add (&job->ev, NULL);
+	ctx->njobs ++;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
+		gboolean forced)
+{
+	GPtrArray *outdated;
+	guint i;
+	const gchar *next;
+
+	if (ctx->njobs > 0) {
+		msg_info ("hyperscan compilation is still in progress, skip check");
+
+		return TRUE;
+	}
+
+	if (!rspamd_hs_helper_cleanup_dir (ctx, forced)) {
+		msg_warn ("cannot cleanup cache dir '%s'", ctx->hs_dir);
+	}
+
+	/* Classes are named by their content, so merely changed ones are here */
+	outdated = rspamd_re_cache_hyperscan_outdated (ctx->cfg->re_cache,
+			ctx->hs_dir);
+
+	if (outdated->len == 0) {
+		g_ptr_array_free (outdated, TRUE);
+		rspamd_hs_helper_notify (ctx, worker, forced);
+
+		return TRUE;
+	}
+
+	msg_info ("need to compile %ud re classes using %ud processes",
+			outdated->len, MIN (outdated->len, ctx->max_jobs));
+	ctx->forced = forced;
+	ctx->ncompiled = 0;
+
+	for (i = 0; i < outdated->len; i ++) {
+		g_queue_push_tail (ctx->pending, g_ptr_array_index (outdated, i));
+	}
+
+	g_ptr_array_free (outdated, TRUE);
+
+	/* We need to restore SIGCHLD processing */
+	signal (SIGCHLD, SIG_DFL);
+
+	while (ctx->njobs < ctx->max_jobs &&
+			(next = g_queue_pop_head (ctx->pending)) != NULL) {
+		if (!rspamd_hs_helper_start_job (ctx, worker, next)) {
+			g_queue_push_head (ctx->pending, (gpointer)next);
+			break;
+		}
+	}
+
+	if (ctx->njobs == 0) {
+		signal (SIGCHLD, SIG_IGN);
+		g_queue_clear (ctx->pending);
+
+		return FALSE;
+	}
 
 	return TRUE;
 }
@@ -216,10 +469,7 @@ rspamd_hs_helper_reload (struct rspamd_main *rspamd_main,
 	rep.reply.recompile.status = 0;
 
 	/* We write reply before actual recompilation as it takes a lot of time */
-	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
-	}
+	rspamd_control_worker_reply (worker, fd, &rep);
 
 	rspamd_rs_compile (ctx, worker, TRUE);
 
@@ -257,6 +507,10 @@ start_hs_helper (struct rspamd_worker *worker)
 		ctx->hs_dir = RSPAMD_DBDIR "/";
 	}
 
+	if (ctx->max_jobs == 0) {
+		ctx->max_jobs = 1;
+	}
+
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"hs_helper",
 			NULL);
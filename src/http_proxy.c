@@ -27,6 +27,7 @@
 #include "keypairs_cache.h"
 #include "ottery.h"
 #include "unix-std.h"
+#include "utlist.h"
 
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
@@ -47,6 +48,7 @@ struct rspamd_http_upstream {
 	gchar *name;
 	struct upstream_list *u;
 	struct rspamd_cryptobox_pubkey *key;
+	gboolean mirror;
 };
 
 static const guint64 rspamd_http_proxy_magic = 0xcdeb4fd1fc351980ULL;
@@ -68,6 +70,8 @@ struct http_proxy_ctx {
 	GHashTable *upstreams;
 	/* Default upstream */
 	struct rspamd_http_upstream *default_upstream;
+	/* Upstreams that receive copies of all requests */
+	GPtrArray *mirrors;
 	/* Local rotating keypair for upstreams */
 	struct rspamd_cryptobox_keypair *local_key;
 	struct event rotate_ev;
@@ -80,6 +84,7 @@ struct http_proxy_session {
 	struct rspamd_cryptobox_keypair *local_key;
 	struct rspamd_cryptobox_pubkey *remote_key;
 	struct upstream *up;
+	struct rspamd_http_upstream *backend;
 	gint client_sock;
 	gint backend_sock;
 	rspamd_inet_addr_t *client_addr;
@@ -89,6 +94,13 @@ struct http_proxy_session {
 	gboolean replied;
 };
 
+struct http_proxy_mirror_session {
+	struct http_proxy_ctx *ctx;
+	struct rspamd_http_upstream *backend;
+	struct upstream *up;
+	struct rspamd_http_connection *conn;
+};
+
 static GQuark
 http_proxy_quark (void)
 {
@@ -157,6 +169,15 @@ http_proxy_parse_upstream (rspamd_mempool_t *pool,
 		goto err;
 	}
 
+	elt = ucl_object_lookup (obj, "mirror");
+	if (elt && ucl_object_toboolean (elt)) {
+		/* Mirrors are not used to reply to clients */
+		up->mirror = TRUE;
+		g_ptr_array_add (ctx->mirrors, up);
+
+		return TRUE;
+	}
+
 	elt = ucl_object_lookup (obj, "default");
 	if (elt && ucl_object_toboolean (elt)) {
 		ctx->default_upstream = up;
@@ -194,6 +215,7 @@ init_http_proxy (struct rspamd_config *cfg)
 	ctx->magic = rspamd_http_proxy_magic;
 	ctx->timeout = 5.0;
 	ctx->upstreams = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	ctx->mirrors = g_ptr_array_new ();
 	ctx->rotate_tm = DEFAULT_ROTATION_TIME;
 	ctx->cfg = cfg;
 
@@ -232,7 +254,8 @@ init_http_proxy (struct rspamd_config *cfg)
 			ctx,
 			0,
 			0,
-			"List of upstreams");
+			"List of upstreams, upstreams with `mirror` flag receive copies "
+			"of all requests");
 
 	return ctx;
 }
@@ -243,13 +266,16 @@ proxy_session_cleanup (struct http_proxy_session *session)
 	rspamd_inet_address_destroy (session->client_addr);
 
 	if (session->backend_conn) {
+		/* Socket is closed unless the whole reply has been read */
+		rspamd_http_keepalive_release (session->backend_conn,
+				rspamd_upstream_addr (session->up), session->backend->key,
+				session->ev_base);
 		rspamd_http_connection_unref (session->backend_conn);
 	}
 	if (session->client_conn) {
 		rspamd_http_connection_unref (session->client_conn);
 	}
 
-	close (session->backend_sock);
 	close (session->client_sock);
 
 	g_slice_free1 (sizeof (*session), session);
@@ -275,6 +301,7 @@ proxy_backend_error_handler (struct rspamd_http_connection *conn, GError *err)
 	msg_info ("abnormally closing connection from backend: %s, error: %s",
 		rspamd_inet_address_to_string (rspamd_upstream_addr (session->up)),
 		err->message);
+	rspamd_upstream_fail (session->up);
 	rspamd_http_connection_reset (session->backend_conn);
 	/* Terminate session immediately */
 	proxy_client_write_error (session, err->code);
@@ -286,9 +313,16 @@ proxy_backend_finish_handler (struct rspamd_http_connection *conn,
 {
 	struct http_proxy_session *session = conn->ud;
 
+	rspamd_upstream_ok (session->up);
 	rspamd_http_connection_steal_msg (session->backend_conn);
 	rspamd_http_message_remove_header (msg, "Content-Length");
 	rspamd_http_message_remove_header (msg, "Key");
+	rspamd_http_message_remove_header (msg, "Connection");
+	/* Return backend socket to the pool */
+	rspamd_http_keepalive_release (session->backend_conn,
+			rspamd_upstream_addr (session->up), session->backend->key,
+			session->ev_base);
+	session->backend_sock = -1;
 	rspamd_http_connection_reset (session->backend_conn);
 	rspamd_http_connection_write_message (session->client_conn,
 		msg, NULL, NULL, session, session->client_sock,
@@ -308,6 +342,125 @@ proxy_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	proxy_session_cleanup (session);
 }
 
+static void
+proxy_mirror_session_cleanup (struct http_proxy_mirror_session *mirror)
+{
+	rspamd_http_keepalive_release (mirror->conn,
+			rspamd_upstream_addr (mirror->up), mirror->backend->key,
+			mirror->ctx->ev_base);
+	rspamd_http_connection_unref (mirror->conn);
+	g_slice_free1 (sizeof (*mirror), mirror);
+}
+
+static void
+proxy_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct http_proxy_mirror_session *mirror = conn->ud;
+
+	msg_info ("abnormally closing connection from mirror: %s, error: %s",
+		rspamd_inet_address_to_string (rspamd_upstream_addr (mirror->up)),
+		err->message);
+	rspamd_upstream_fail (mirror->up);
+	proxy_mirror_session_cleanup (mirror);
+}
+
+static gint
+proxy_mirror_finish_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct http_proxy_mirror_session *mirror = conn->ud;
+
+	/* Replies of mirrors are not used */
+	rspamd_upstream_ok (mirror->up);
+	proxy_mirror_session_cleanup (mirror);
+
+	return 0;
+}
+
+/*
+ * Copies the request already read from client, as the body is encrypted in
+ * place when it is written to a backend
+ */
+static struct rspamd_http_message *
+proxy_request_copy (struct rspamd_http_message *msg)
+{
+	struct rspamd_http_message *copy;
+	struct rspamd_http_header *hdr;
+	gchar *name, *value;
+
+	copy = rspamd_http_new_message (HTTP_REQUEST);
+	copy->method = msg->method;
+
+	if (msg->url) {
+		copy->url = rspamd_fstring_assign (copy->url, msg->url->str,
+				msg->url->len);
+	}
+
+	if (msg->body && msg->body->len > 0) {
+		copy->body = rspamd_fstring_new_init (msg->body->str, msg->body->len);
+	}
+
+	DL_FOREACH (msg->headers, hdr) {
+		name = g_strndup (hdr->name->begin, hdr->name->len);
+		value = g_strndup (hdr->value->begin, hdr->value->len);
+		rspamd_http_message_add_header (copy, name, value);
+		g_free (name);
+		g_free (value);
+	}
+
+	return copy;
+}
+
+static void
+proxy_mirror_request (struct http_proxy_session *session,
+	struct rspamd_http_upstream *backend,
+	struct rspamd_http_message *msg)
+{
+	struct http_proxy_mirror_session *mirror;
+	struct rspamd_http_message *copy;
+	struct upstream *up;
+	gint sock;
+
+	up = rspamd_upstream_get (backend->u, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (up == NULL) {
+		msg_err ("cannot select mirror upstream for %s", backend->name);
+		return;
+	}
+
+	sock = rspamd_http_keepalive_connect (rspamd_upstream_addr (up),
+			backend->key, NULL);
+
+	if (sock == -1) {
+		msg_err ("cannot connect mirror upstream for %s", backend->name);
+		rspamd_upstream_fail (up);
+		return;
+	}
+
+	mirror = g_slice_alloc0 (sizeof (*mirror));
+	mirror->ctx = session->ctx;
+	mirror->backend = backend;
+	mirror->up = up;
+	mirror->conn = rspamd_http_connection_new (
+			NULL,
+			proxy_mirror_error_handler,
+			proxy_mirror_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
+			RSPAMD_HTTP_CLIENT,
+			session->ctx->keys_cache);
+
+	rspamd_http_connection_set_key (mirror->conn, session->ctx->local_key);
+	copy = proxy_request_copy (msg);
+
+	if (backend->key) {
+		copy->peer_key = rspamd_pubkey_ref (backend->key);
+	}
+
+	rspamd_http_connection_write_message (mirror->conn,
+		copy, NULL, NULL, mirror, sock,
+		&session->ctx->io_tv, session->ev_base);
+}
+
 static gint
 proxy_client_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -316,6 +469,7 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_upstream *backend = NULL;
 	const rspamd_ftok_t *host;
 	gchar hostbuf[512];
+	guint i;
 
 	if (!session->replied) {
 		host = rspamd_http_message_find_header (msg, "Host");
@@ -346,8 +500,9 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 				goto err;
 			}
 
-			session->backend_sock = rspamd_inet_address_connect (
-					rspamd_upstream_addr (session->up), SOCK_STREAM, TRUE);
+			/* Idle connections to backends are reused */
+			session->backend_sock = rspamd_http_keepalive_connect (
+					rspamd_upstream_addr (session->up), backend->key, NULL);
 
 			if (session->backend_sock == -1) {
 				msg_err ("cannot connect upstream for %s", host ? hostbuf : "default");
@@ -355,15 +510,24 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 				goto err;
 			}
 
+			session->backend = backend;
 			rspamd_http_connection_steal_msg (session->client_conn);
 			rspamd_http_message_remove_header (msg, "Content-Length");
 			rspamd_http_message_remove_header (msg, "Key");
+			rspamd_http_message_remove_header (msg, "Connection");
 			rspamd_http_connection_reset (session->client_conn);
+
+			/* Mirrors get copies of the request before it is encrypted */
+			for (i = 0; i < session->ctx->mirrors->len; i ++) {
+				proxy_mirror_request (session,
+						g_ptr_array_index (session->ctx->mirrors, i), msg);
+			}
+
 			session->backend_conn = rspamd_http_connection_new (
 					NULL,
 					proxy_backend_error_handler,
 					proxy_backend_finish_handler,
-					RSPAMD_HTTP_CLIENT_SIMPLE,
+					RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 					RSPAMD_HTTP_CLIENT,
 					session->ctx->keys_cache);
 
@@ -417,6 +581,7 @@ proxy_accept_socket (gint fd, short what, void *arg)
 
 	session = g_slice_alloc0 (sizeof (*session));
 	session->client_sock = nfd;
+	session->backend_sock = -1;
 	session->client_addr = addr;
 
 	session->resolver = ctx->resolver;
@@ -478,8 +643,8 @@ start_http_proxy (struct rspamd_worker *worker)
 	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
 			ctx->ev_base, ctx->resolver->r);
 
-	/* XXX: stupid default */
-	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	ctx->keys_cache = rspamd_keypair_cache_new_shared (
+			ctx->cfg->keypair_cache_size, ctx->cfg->keypair_shared_cache);
 	ctx->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
 			RSPAMD_CRYPTOBOX_MODE_25519);
 
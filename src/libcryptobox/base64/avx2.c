@@ -0,0 +1,129 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * AVX2 implementation of base64 blocks functions. Decoding translates 32
+ * characters at once using nibbles lookup tables (the approach described by
+ * Wojciech Mula) and stops on the first vector containing any character that
+ * is not in alphabet. Encoding processes 24 bytes per iteration.
+ * This file must be compiled with `-mavx2`
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "base64.h"
+#include "platform_config.h"
+#include <immintrin.h>
+
+gsize
+base64_decode_blocks_avx2 (const guchar *in, gsize inlen, guchar *out)
+{
+	const guchar *p = in;
+	__m256i str, hi_nibbles, lo_nibbles, lo, hi, roll, eq_2f, merged;
+	const __m256i lut_lo = _mm256_setr_epi8 (
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8 (
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8 (
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8 (0x2f);
+	const __m256i pack_shuf = _mm256_setr_epi8 (
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i pack_perm = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, -1, -1);
+
+	/* Each iteration stores 32 bytes, of which only 24 are meaningful */
+	while (inlen >= 44) {
+		str = _mm256_loadu_si256 ((const __m256i *)p);
+
+		hi_nibbles = _mm256_and_si256 (_mm256_srli_epi32 (str, 4), mask_2f);
+		lo_nibbles = _mm256_and_si256 (str, mask_2f);
+		lo = _mm256_shuffle_epi8 (lut_lo, lo_nibbles);
+		hi = _mm256_shuffle_epi8 (lut_hi, hi_nibbles);
+
+		if (!_mm256_testz_si256 (lo, hi)) {
+			break;
+		}
+
+		eq_2f = _mm256_cmpeq_epi8 (str, mask_2f);
+		roll = _mm256_shuffle_epi8 (lut_roll,
+				_mm256_add_epi8 (eq_2f, hi_nibbles));
+		str = _mm256_add_epi8 (str, roll);
+
+		/* Pack 4 x 6 bits to 3 bytes in each 32 bits word */
+		merged = _mm256_maddubs_epi16 (str, _mm256_set1_epi32 (0x01400140));
+		merged = _mm256_madd_epi16 (merged, _mm256_set1_epi32 (0x00011000));
+		merged = _mm256_shuffle_epi8 (merged, pack_shuf);
+		merged = _mm256_permutevar8x32_epi32 (merged, pack_perm);
+		_mm256_storeu_si256 ((__m256i *)out, merged);
+
+		p += 32;
+		out += 24;
+		inlen -= 32;
+	}
+
+	return p - in;
+}
+
+gsize
+base64_encode_blocks_avx2 (const guchar *in, gsize inlen, gchar *out)
+{
+	const guchar *p = in;
+	__m256i str, t0, t1, t2, t3, idx, mask;
+	const __m256i spread_shuf = _mm256_set_epi8 (
+			10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+			10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i lut = _mm256_setr_epi8 (
+			65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+			65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+	/* Each iteration reads 28 bytes, of which only 24 are encoded */
+	while (inlen >= 28) {
+		str = _mm256_castsi128_si256 (
+				_mm_loadu_si128 ((const __m128i *)p));
+		str = _mm256_inserti128_si256 (str,
+				_mm_loadu_si128 ((const __m128i *)(p + 12)), 1);
+		str = _mm256_shuffle_epi8 (str, spread_shuf);
+
+		/* Split each 3 bytes to 4 x 6 bits indices */
+		t0 = _mm256_and_si256 (str, _mm256_set1_epi32 (0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16 (t0, _mm256_set1_epi32 (0x04000040));
+		t2 = _mm256_and_si256 (str, _mm256_set1_epi32 (0x003f03f0));
+		t3 = _mm256_mullo_epi16 (t2, _mm256_set1_epi32 (0x01000010));
+		str = _mm256_or_si256 (t1, t3);
+
+		/* Translate indices to alphabet by adding per range offsets */
+		idx = _mm256_subs_epu8 (str, _mm256_set1_epi8 (51));
+		mask = _mm256_cmpgt_epi8 (str, _mm256_set1_epi8 (25));
+		idx = _mm256_sub_epi8 (idx, mask);
+		str = _mm256_add_epi8 (str, _mm256_shuffle_epi8 (lut, idx));
+		_mm256_storeu_si256 ((__m256i *)out, str);
+
+		p += 24;
+		out += 32;
+		inlen -= 24;
+	}
+
+	return p - in;
+}
@@ -0,0 +1,326 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "cryptobox.h"
+#include "base64.h"
+#include "platform_config.h"
+#include "ottery.h"
+
+extern unsigned long cpu_config;
+
+typedef struct base64_impl_t {
+	unsigned long cpu_flags;
+	const char *desc;
+
+	gsize (*decode_blocks) (const guchar *in, gsize inlen, guchar *out);
+	gsize (*encode_blocks) (const guchar *in, gsize inlen, gchar *out);
+} base64_impl_t;
+
+#define BASE64_IMPL(cpuflags, desc, ext) \
+	{(cpuflags), desc, base64_decode_blocks_##ext, base64_encode_blocks_##ext}
+
+BASE64_DECLARE(ref)
+#define BASE64_GENERIC BASE64_IMPL(0, "generic", ref)
+#if defined(HAVE_BASE64_AVX2)
+BASE64_DECLARE(avx2)
+#define BASE64_AVX2 BASE64_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_NEON)
+BASE64_DECLARE(neon)
+#define BASE64_NEON BASE64_IMPL(CPUID_NEON, "neon", neon)
+#endif
+
+/* list implemenations from most optimized to least, with generic as the last entry */
+static const base64_impl_t base64_list[] = {
+		BASE64_GENERIC,
+#if defined(BASE64_AVX2)
+		BASE64_AVX2,
+#endif
+#if defined(BASE64_NEON)
+		BASE64_NEON,
+#endif
+};
+
+static const base64_impl_t *base64_opt = &base64_list[0];
+
+static const char base64_enc_table[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz"
+		"0123456789+/";
+
+/* 0xff - not a base64 character, 0xfe - padding */
+static const guchar base64_dec_table[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+	0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+	0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+	0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+	0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+	0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+gsize
+base64_decode_blocks_ref (const guchar *in, gsize inlen, guchar *out)
+{
+	const guchar *p = in;
+	guint32 a, b, c, d, x;
+
+	while (inlen >= 4) {
+		a = base64_dec_table[p[0]];
+		b = base64_dec_table[p[1]];
+		c = base64_dec_table[p[2]];
+		d = base64_dec_table[p[3]];
+
+		if ((a | b | c | d) & 0xc0) {
+			break;
+		}
+
+		x = (a << 18) | (b << 12) | (c << 6) | d;
+		out[0] = x >> 16;
+		out[1] = x >> 8;
+		out[2] = x;
+
+		p += 4;
+		out += 3;
+		inlen -= 4;
+	}
+
+	return p - in;
+}
+
+gsize
+base64_encode_blocks_ref (const guchar *in, gsize inlen, gchar *out)
+{
+	const guchar *p = in;
+	guint32 x;
+
+	while (inlen >= 3) {
+		x = (p[0] << 16) | (p[1] << 8) | p[2];
+		out[0] = base64_enc_table[(x >> 18) & 0x3F];
+		out[1] = base64_enc_table[(x >> 12) & 0x3F];
+		out[2] = base64_enc_table[(x >> 6) & 0x3F];
+		out[3] = base64_enc_table[x & 0x3F];
+
+		p += 3;
+		out += 4;
+		inlen -= 3;
+	}
+
+	return p - in;
+}
+
+static gboolean
+base64_decode_impl (const base64_impl_t *impl, const gchar *in, gsize inlen,
+		guchar *out, gsize *outlen)
+{
+	const guchar *p = (const guchar *)in, *end = p + inlen;
+	guchar *o = out, c;
+	guint32 acc = 0;
+	guint n = 0;
+	gsize r;
+
+	while (p < end) {
+		if (n == 0) {
+			/* Try block function after each full quantum */
+			r = impl->decode_blocks (p, end - p, o);
+			p += r;
+			o += r / 4 * 3;
+
+			if (p == end) {
+				break;
+			}
+		}
+
+		c = base64_dec_table[*p++];
+
+		if (c == 0xff) {
+			/* Line breaks and garbage are ignored */
+			continue;
+		}
+		else if (c == 0xfe) {
+			break;
+		}
+
+		acc = (acc << 6) | c;
+		n ++;
+
+		if (n == 4) {
+			o[0] = acc >> 16;
+			o[1] = acc >> 8;
+			o[2] = acc;
+			o += 3;
+			acc = 0;
+			n = 0;
+		}
+	}
+
+	switch (n) {
+	case 1:
+		*outlen = o - out;
+		return FALSE;
+	case 2:
+		*o++ = acc >> 4;
+		break;
+	case 3:
+		*o++ = acc >> 10;
+		*o++ = acc >> 2;
+		break;
+	default:
+		break;
+	}
+
+	*outlen = o - out;
+
+	return TRUE;
+}
+
+static gsize
+base64_encode_impl (const base64_impl_t *impl, const guchar *in, gsize inlen,
+		gchar *out)
+{
+	gsize r;
+
+	r = impl->encode_blocks (in, inlen, out);
+
+	return r + base64_encode_blocks_ref (in + r, inlen - r, out + r / 3 * 4);
+}
+
+static bool
+base64_test_impl (const base64_impl_t *impl)
+{
+	guchar in[256], dec[256 + 3], ref_dec[256 + 3];
+	gchar enc[344 + 4], ref_enc[344 + 4];
+	gsize i, r, ref_r, enclen, declen, ref_declen;
+
+	for (i = 0; i < sizeof (in); i ++) {
+		in[i] = i * 7 + 3;
+	}
+
+	for (i = 0; i < sizeof (in); i += 13) {
+		r = base64_encode_impl (impl, in, sizeof (in) - i, enc);
+		ref_r = base64_encode_blocks_ref (in, sizeof (in) - i, ref_enc);
+
+		if (r != ref_r || memcmp (enc, ref_enc, r / 3 * 4) != 0) {
+			return false;
+		}
+
+		/* Add line break inside to check resuming */
+		enclen = r / 3 * 4;
+		memmove (enc + enclen / 2 + 1, enc + enclen / 2, enclen - enclen / 2);
+		enc[enclen / 2] = '\n';
+
+		if (!base64_decode_impl (impl, enc, enclen + 1, dec, &declen) ||
+				!base64_decode_impl (&base64_list[0], enc, enclen + 1,
+						ref_dec, &ref_declen)) {
+			return false;
+		}
+
+		if (declen != r || ref_declen != r || memcmp (dec, in, r) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+const char *
+base64_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (base64_list); i ++) {
+			if (base64_list[i].cpu_flags & cpu_config) {
+				base64_opt = &base64_list[i];
+				g_assert (base64_test_impl (base64_opt));
+				break;
+			}
+		}
+	}
+
+	return base64_opt->desc;
+}
+
+gboolean
+base64_decode (const gchar *in, gsize inlen, guchar *out, gsize *outlen)
+{
+	return base64_decode_impl (base64_opt, in, inlen, out, outlen);
+}
+
+gsize
+base64_encode_blocks (const guchar *in, gsize inlen, gchar *out)
+{
+	return base64_encode_impl (base64_opt, in, inlen, out);
+}
+
+size_t
+base64_test (bool generic, size_t niters, size_t len)
+{
+	size_t cycles;
+	guchar *in, *out;
+	gchar *enc;
+	gsize enclen, outlen;
+	const base64_impl_t *impl;
+
+	g_assert (len > 0);
+	in = g_malloc (len);
+	enc = g_malloc (len / 3 * 4 + 4);
+	out = g_malloc (len + 3);
+	ottery_rand_bytes (in, len);
+
+	impl = generic ? &base64_list[0] : base64_opt;
+	len -= len % 3;
+	enclen = base64_encode_impl (impl, in, len, enc) / 3 * 4;
+
+	for (cycles = 0; cycles < niters; cycles ++) {
+		base64_decode_impl (impl, enc, enclen, out, &outlen);
+	}
+
+	if (outlen != len || memcmp (in, out, len) != 0) {
+		cycles = 0;
+	}
+
+	g_free (in);
+	g_free (enc);
+	g_free (out);
+
+	return cycles;
+}
@@ -0,0 +1,67 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBCRYPTOBOX_BASE64_BASE64_H_
+#define SRC_LIBCRYPTOBOX_BASE64_BASE64_H_
+
+#include "config.h"
+#include <stdbool.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/*
+ * Block functions of implementations: they process as many leading full
+ * blocks as they can and return the number of input bytes consumed. Decoders
+ * stop on the first character that is not in base64 alphabet (including
+ * line breaks and padding), it is handled by the generic code then
+ */
+#define BASE64_DECLARE(ext) \
+	gsize base64_decode_blocks_##ext (const guchar *in, gsize inlen, guchar *out); \
+	gsize base64_encode_blocks_##ext (const guchar *in, gsize inlen, gchar *out);
+
+const char* base64_load (void);
+
+/**
+ * Decode base64 skipping all characters that are not a part of alphabet,
+ * decoding stops on the first padding character
+ * @param in
+ * @param inlen
+ * @param out output buffer of at least `(inlen / 4) * 3 + 3` bytes, may be
+ * equal to `in`
+ * @param outlen output length
+ * @return FALSE if the last quantum is truncated to a single character
+ */
+gboolean base64_decode (const gchar *in, gsize inlen, guchar *out,
+		gsize *outlen);
+
+/**
+ * Encode full 3 bytes blocks of input with no padding and line breaks
+ * @param in
+ * @param inlen
+ * @param out output buffer of at least `(inlen / 3) * 4` bytes
+ * @return number of input bytes encoded (`inlen` rounded down to 3)
+ */
+gsize base64_encode_blocks (const guchar *in, gsize inlen, gchar *out);
+
+size_t base64_test (bool generic, size_t niters, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SRC_LIBCRYPTOBOX_BASE64_BASE64_H_ */
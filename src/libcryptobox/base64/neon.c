@@ -0,0 +1,122 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * NEON implementation of base64 blocks functions, 48 bytes are processed at
+ * once using interleaving loads and stores. Decoding stops on the first
+ * block containing any character that is not in alphabet
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "base64.h"
+#include "platform_config.h"
+#include <arm_neon.h>
+
+static const guchar base64_neon_alphabet[64] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz"
+		"0123456789+/";
+
+/* Returns 6 bits value for each character or 0xff for invalid ones */
+static inline uint8x16_t
+base64_neon_translate (uint8x16_t v)
+{
+	uint8x16_t res = vdupq_n_u8 (0xff), m;
+
+	m = vandq_u8 (vcgeq_u8 (v, vdupq_n_u8 ('A')), vcleq_u8 (v, vdupq_n_u8 ('Z')));
+	res = vbslq_u8 (m, vsubq_u8 (v, vdupq_n_u8 ('A')), res);
+	m = vandq_u8 (vcgeq_u8 (v, vdupq_n_u8 ('a')), vcleq_u8 (v, vdupq_n_u8 ('z')));
+	res = vbslq_u8 (m, vsubq_u8 (v, vdupq_n_u8 ('a' - 26)), res);
+	m = vandq_u8 (vcgeq_u8 (v, vdupq_n_u8 ('0')), vcleq_u8 (v, vdupq_n_u8 ('9')));
+	res = vbslq_u8 (m, vaddq_u8 (v, vdupq_n_u8 (52 - '0')), res);
+	res = vbslq_u8 (vceqq_u8 (v, vdupq_n_u8 ('+')), vdupq_n_u8 (62), res);
+	res = vbslq_u8 (vceqq_u8 (v, vdupq_n_u8 ('/')), vdupq_n_u8 (63), res);
+
+	return res;
+}
+
+gsize
+base64_decode_blocks_neon (const guchar *in, gsize inlen, guchar *out)
+{
+	const guchar *p = in;
+	uint8x16x4_t str;
+	uint8x16x3_t res;
+	uint8x16_t err;
+
+	while (inlen >= 64) {
+		str = vld4q_u8 (p);
+		str.val[0] = base64_neon_translate (str.val[0]);
+		str.val[1] = base64_neon_translate (str.val[1]);
+		str.val[2] = base64_neon_translate (str.val[2]);
+		str.val[3] = base64_neon_translate (str.val[3]);
+		err = vorrq_u8 (vorrq_u8 (str.val[0], str.val[1]),
+				vorrq_u8 (str.val[2], str.val[3]));
+
+		if (vmaxvq_u8 (err) > 63) {
+			break;
+		}
+
+		res.val[0] = vorrq_u8 (vshlq_n_u8 (str.val[0], 2),
+				vshrq_n_u8 (str.val[1], 4));
+		res.val[1] = vorrq_u8 (vshlq_n_u8 (str.val[1], 4),
+				vshrq_n_u8 (str.val[2], 2));
+		res.val[2] = vorrq_u8 (vshlq_n_u8 (str.val[2], 6), str.val[3]);
+		vst3q_u8 (out, res);
+
+		p += 64;
+		out += 48;
+		inlen -= 64;
+	}
+
+	return p - in;
+}
+
+gsize
+base64_encode_blocks_neon (const guchar *in, gsize inlen, gchar *out)
+{
+	const guchar *p = in;
+	uint8x16x3_t str;
+	uint8x16x4_t res, lut;
+	const uint8x16_t mask = vdupq_n_u8 (0x3f);
+
+	lut.val[0] = vld1q_u8 (base64_neon_alphabet);
+	lut.val[1] = vld1q_u8 (base64_neon_alphabet + 16);
+	lut.val[2] = vld1q_u8 (base64_neon_alphabet + 32);
+	lut.val[3] = vld1q_u8 (base64_neon_alphabet + 48);
+
+	while (inlen >= 48) {
+		str = vld3q_u8 (p);
+
+		res.val[0] = vshrq_n_u8 (str.val[0], 2);
+		res.val[1] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (str.val[0], 4),
+				vshrq_n_u8 (str.val[1], 4)), mask);
+		res.val[2] = vandq_u8 (vorrq_u8 (vshlq_n_u8 (str.val[1], 2),
+				vshrq_n_u8 (str.val[2], 6)), mask);
+		res.val[3] = vandq_u8 (str.val[2], mask);
+
+		res.val[0] = vqtbl4q_u8 (lut, res.val[0]);
+		res.val[1] = vqtbl4q_u8 (lut, res.val[1]);
+		res.val[2] = vqtbl4q_u8 (lut, res.val[2]);
+		res.val[3] = vqtbl4q_u8 (lut, res.val[3]);
+		vst4q_u8 ((guchar *)out, res);
+
+		p += 48;
+		out += 64;
+		inlen -= 48;
+	}
+
+	return p - in;
+}
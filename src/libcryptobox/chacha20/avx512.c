@@ -0,0 +1,464 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * AVX-512F implementation of chacha blocks function. Large inputs are
+ * processed by 16 blocks at once, each zmm register holds the same state word
+ * of all 16 blocks. The rest is processed by 4 blocks at once, where each
+ * 128 bits lane of a zmm register holds a row of a single block.
+ * This file must be compiled with `-mavx512f`
+ */
+
+#include "config.h"
+#include "chacha.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+#include <immintrin.h>
+
+void hchacha_ref (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds);
+
+static const guint32 chacha_constants[4] = {
+	0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+};
+
+#define QR(a, b, c, d) do { \
+	a = _mm512_add_epi32 (a, b); d = _mm512_xor_si512 (d, a); \
+	d = _mm512_rol_epi32 (d, 16); \
+	c = _mm512_add_epi32 (c, d); b = _mm512_xor_si512 (b, c); \
+	b = _mm512_rol_epi32 (b, 12); \
+	a = _mm512_add_epi32 (a, b); d = _mm512_xor_si512 (d, a); \
+	d = _mm512_rol_epi32 (d, 8); \
+	c = _mm512_add_epi32 (c, d); b = _mm512_xor_si512 (b, c); \
+	b = _mm512_rol_epi32 (b, 7); \
+} while (0)
+
+/*
+ * Transpose 4x4 matrix of 128 bits lanes, so the lane `i` of register `j`
+ * becomes the lane `j` of register `i`
+ */
+#define TRANSPOSE_LANES(a, b, c, d) do { \
+	__m512i t0, t1, t2, t3; \
+	t0 = _mm512_shuffle_i32x4 (a, b, 0x44); \
+	t1 = _mm512_shuffle_i32x4 (c, d, 0x44); \
+	t2 = _mm512_shuffle_i32x4 (a, b, 0xee); \
+	t3 = _mm512_shuffle_i32x4 (c, d, 0xee); \
+	a = _mm512_shuffle_i32x4 (t0, t1, 0x88); \
+	b = _mm512_shuffle_i32x4 (t0, t1, 0xdd); \
+	c = _mm512_shuffle_i32x4 (t2, t3, 0x88); \
+	d = _mm512_shuffle_i32x4 (t2, t3, 0xdd); \
+} while (0)
+
+/* Transpose 4x4 matrix of 32 bits words in each 128 bits lane */
+#define TRANSPOSE_WORDS(a, b, c, d) do { \
+	__m512i t0, t1, t2, t3; \
+	t0 = _mm512_unpacklo_epi32 (a, b); \
+	t1 = _mm512_unpackhi_epi32 (a, b); \
+	t2 = _mm512_unpacklo_epi32 (c, d); \
+	t3 = _mm512_unpackhi_epi32 (c, d); \
+	a = _mm512_unpacklo_epi64 (t0, t2); \
+	b = _mm512_unpackhi_epi64 (t0, t2); \
+	c = _mm512_unpacklo_epi64 (t1, t3); \
+	d = _mm512_unpackhi_epi64 (t1, t3); \
+} while (0)
+
+static inline void
+chacha_store_block (const unsigned char *in, unsigned char *out, __m512i v)
+{
+	if (in) {
+		v = _mm512_xor_si512 (v, _mm512_loadu_si512 ((const void *)in));
+	}
+
+	_mm512_storeu_si512 ((void *)out, v);
+}
+
+/* Processes 16 blocks, `bytes` must be at least 16 * CHACHA_BLOCKBYTES */
+static void
+chacha_blocks_avx512_16 (guint32 j[12], const unsigned char *in,
+		unsigned char *out, size_t bytes, size_t rounds)
+{
+	__m512i x[16], s[16], ctr_lo, ctr_hi;
+	const __m512i idx = _mm512_set_epi32 (15, 14, 13, 12, 11, 10, 9, 8,
+			7, 6, 5, 4, 3, 2, 1, 0);
+	__mmask16 carry;
+	guint i, k;
+	guint64 counter;
+
+	for (i = 0; i < 4; i ++) {
+		s[i] = _mm512_set1_epi32 (chacha_constants[i]);
+	}
+	for (i = 0; i < 8; i ++) {
+		s[i + 4] = _mm512_set1_epi32 (j[i]);
+	}
+
+	s[14] = _mm512_set1_epi32 (j[10]);
+	s[15] = _mm512_set1_epi32 (j[11]);
+
+	while (bytes >= 16 * CHACHA_BLOCKBYTES) {
+		/* 64 bits counter for each block */
+		ctr_lo = _mm512_set1_epi32 (j[8]);
+		ctr_hi = _mm512_set1_epi32 (j[9]);
+		s[12] = _mm512_add_epi32 (ctr_lo, idx);
+		carry = _mm512_cmplt_epu32_mask (s[12], ctr_lo);
+		s[13] = _mm512_mask_add_epi32 (ctr_hi, carry, ctr_hi,
+				_mm512_set1_epi32 (1));
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = s[i];
+		}
+
+		for (i = rounds; i > 0; i -= 2) {
+			QR (x[0], x[4], x[8], x[12]);
+			QR (x[1], x[5], x[9], x[13]);
+			QR (x[2], x[6], x[10], x[14]);
+			QR (x[3], x[7], x[11], x[15]);
+			QR (x[0], x[5], x[10], x[15]);
+			QR (x[1], x[6], x[11], x[12]);
+			QR (x[2], x[7], x[8], x[13]);
+			QR (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = _mm512_add_epi32 (x[i], s[i]);
+		}
+
+		/*
+		 * After words transposition lane `l` of x[4 * g + k] holds words
+		 * 4 * g .. 4 * g + 3 of block 4 * l + k
+		 */
+		TRANSPOSE_WORDS (x[0], x[1], x[2], x[3]);
+		TRANSPOSE_WORDS (x[4], x[5], x[6], x[7]);
+		TRANSPOSE_WORDS (x[8], x[9], x[10], x[11]);
+		TRANSPOSE_WORDS (x[12], x[13], x[14], x[15]);
+
+		for (k = 0; k < 4; k ++) {
+			TRANSPOSE_LANES (x[k], x[k + 4], x[k + 8], x[k + 12]);
+
+			chacha_store_block (in ? in + (k + 0) * CHACHA_BLOCKBYTES : NULL,
+					out + (k + 0) * CHACHA_BLOCKBYTES, x[k]);
+			chacha_store_block (in ? in + (k + 4) * CHACHA_BLOCKBYTES : NULL,
+					out + (k + 4) * CHACHA_BLOCKBYTES, x[k + 4]);
+			chacha_store_block (in ? in + (k + 8) * CHACHA_BLOCKBYTES : NULL,
+					out + (k + 8) * CHACHA_BLOCKBYTES, x[k + 8]);
+			chacha_store_block (in ? in + (k + 12) * CHACHA_BLOCKBYTES : NULL,
+					out + (k + 12) * CHACHA_BLOCKBYTES, x[k + 12]);
+		}
+
+		counter = ((guint64)j[9] << 32 | j[8]) + 16;
+		j[8] = counter & 0xffffffff;
+		j[9] = counter >> 32;
+
+		bytes -= 16 * CHACHA_BLOCKBYTES;
+		out += 16 * CHACHA_BLOCKBYTES;
+
+		if (in) {
+			in += 16 * CHACHA_BLOCKBYTES;
+		}
+	}
+}
+
+void
+chacha_blocks_avx512 (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+{
+	guint32 j[12];
+	__m512i a, b, c, x0, x1, x2, x3, ctr;
+	const __m512i inc = _mm512_set_epi64 (0, 3, 0, 2, 0, 1, 0, 0),
+			four = _mm512_set_epi64 (0, 4, 0, 4, 0, 4, 0, 4);
+	unsigned char tmp[4 * CHACHA_BLOCKBYTES];
+	size_t i, nblocks;
+	guint64 counter;
+
+	if (!bytes) {
+		return;
+	}
+
+	memcpy (j, state->s, sizeof (j));
+
+	if (bytes >= 16 * CHACHA_BLOCKBYTES) {
+		chacha_blocks_avx512_16 (j, in, out, bytes, state->rounds);
+		nblocks = bytes / (16 * CHACHA_BLOCKBYTES) * 16;
+		bytes -= nblocks * CHACHA_BLOCKBYTES;
+		out += nblocks * CHACHA_BLOCKBYTES;
+
+		if (in) {
+			in += nblocks * CHACHA_BLOCKBYTES;
+		}
+	}
+
+	if (bytes) {
+		a = _mm512_broadcast_i32x4 (
+				_mm_loadu_si128 ((const __m128i *)chacha_constants));
+		b = _mm512_broadcast_i32x4 (_mm_loadu_si128 ((const __m128i *)&j[0]));
+		c = _mm512_broadcast_i32x4 (_mm_loadu_si128 ((const __m128i *)&j[4]));
+		/* Each lane has its own 64 bits counter in the low qword */
+		ctr = _mm512_add_epi64 (inc,
+				_mm512_broadcast_i32x4 (_mm_loadu_si128 ((const __m128i *)&j[8])));
+
+		for (;;) {
+			x0 = a;
+			x1 = b;
+			x2 = c;
+			x3 = ctr;
+
+			for (i = state->rounds; i > 0; i -= 2) {
+				QR (x0, x1, x2, x3);
+				/* Diagonalize */
+				x1 = _mm512_shuffle_epi32 (x1, _MM_PERM_ADCB);
+				x2 = _mm512_shuffle_epi32 (x2, _MM_PERM_BADC);
+				x3 = _mm512_shuffle_epi32 (x3, _MM_PERM_CBAD);
+				QR (x0, x1, x2, x3);
+				x1 = _mm512_shuffle_epi32 (x1, _MM_PERM_CBAD);
+				x2 = _mm512_shuffle_epi32 (x2, _MM_PERM_BADC);
+				x3 = _mm512_shuffle_epi32 (x3, _MM_PERM_ADCB);
+			}
+
+			x0 = _mm512_add_epi32 (x0, a);
+			x1 = _mm512_add_epi32 (x1, b);
+			x2 = _mm512_add_epi32 (x2, c);
+			x3 = _mm512_add_epi32 (x3, ctr);
+			TRANSPOSE_LANES (x0, x1, x2, x3);
+
+			if (bytes >= 4 * CHACHA_BLOCKBYTES) {
+				chacha_store_block (in, out, x0);
+				chacha_store_block (in ? in + CHACHA_BLOCKBYTES : NULL,
+						out + CHACHA_BLOCKBYTES, x1);
+				chacha_store_block (in ? in + 2 * CHACHA_BLOCKBYTES : NULL,
+						out + 2 * CHACHA_BLOCKBYTES, x2);
+				chacha_store_block (in ? in + 3 * CHACHA_BLOCKBYTES : NULL,
+						out + 3 * CHACHA_BLOCKBYTES, x3);
+			}
+			else {
+				/* Partial output, use temporary buffer */
+				_mm512_storeu_si512 ((void *)tmp, x0);
+				_mm512_storeu_si512 ((void *)(tmp + CHACHA_BLOCKBYTES), x1);
+				_mm512_storeu_si512 ((void *)(tmp + 2 * CHACHA_BLOCKBYTES), x2);
+				_mm512_storeu_si512 ((void *)(tmp + 3 * CHACHA_BLOCKBYTES), x3);
+
+				if (in) {
+					for (i = 0; i < bytes; i ++) {
+						out[i] = in[i] ^ tmp[i];
+					}
+				}
+				else {
+					memcpy (out, tmp, bytes);
+				}
+			}
+
+			if (bytes <= 4 * CHACHA_BLOCKBYTES) {
+				nblocks = (bytes + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+				break;
+			}
+
+			ctr = _mm512_add_epi64 (ctr, four);
+			counter = ((guint64)j[9] << 32 | j[8]) + 4;
+			j[8] = counter & 0xffffffff;
+			j[9] = counter >> 32;
+			bytes -= 4 * CHACHA_BLOCKBYTES;
+			out += 4 * CHACHA_BLOCKBYTES;
+
+			if (in) {
+				in += 4 * CHACHA_BLOCKBYTES;
+			}
+		}
+
+		counter = ((guint64)j[9] << 32 | j[8]) + nblocks;
+		j[8] = counter & 0xffffffff;
+		j[9] = counter >> 32;
+		rspamd_explicit_memzero (tmp, sizeof (tmp));
+	}
+
+	/* store the counter back to the state */
+	memcpy (state->s + 32, &j[8], 8);
+	rspamd_explicit_memzero (j, sizeof (j));
+}
+
+void
+hchacha_avx512 (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds)
+{
+	/* Single block function, there is nothing to vectorize here */
+	hchacha_ref (key, iv, out, rounds);
+}
+
+void
+chacha_avx512 (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	memcpy (state.s, key->b, 32);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b, 8);
+	state.rounds = rounds;
+	chacha_blocks_avx512 (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+void
+xchacha_avx512 (const chacha_key *key, const chacha_iv24 *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	hchacha_ref (key->b, iv->b, state.s, rounds);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b + 16, 8);
+	state.rounds = rounds;
+	chacha_blocks_avx512 (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+#define MULTI_LANES 16
+
+/*
+ * Process up to 16 messages, each message uses its own lane, so both hchacha
+ * and all blocks of messages are computed at once
+ */
+static void
+xchacha_multi_avx512_lanes (chacha_multi *msgs, size_t n, size_t rounds)
+{
+	guint32 w[14][MULTI_LANES];
+	__m512i x[16], s[16];
+	unsigned char tmp[CHACHA_BLOCKBYTES];
+	const chacha_multi *m;
+	size_t i, l, b, off, len, maxlen = 0, nblocks;
+
+	for (l = 0; l < MULTI_LANES; l ++) {
+		/* Unused lanes just repeat the first message */
+		m = &msgs[l < n ? l : 0];
+
+		for (i = 0; i < 8; i ++) {
+			memcpy (&w[i][l], m->key->b + i * 4, sizeof (guint32));
+		}
+		for (i = 0; i < 6; i ++) {
+			memcpy (&w[i + 8][l], m->iv->b + i * 4, sizeof (guint32));
+		}
+
+		if (m->len > maxlen) {
+			maxlen = m->len;
+		}
+	}
+
+	/* hchacha of all lanes, subkey is words 0..3 and 12..15 */
+	for (i = 0; i < 4; i ++) {
+		x[i] = _mm512_set1_epi32 (chacha_constants[i]);
+	}
+	for (i = 0; i < 12; i ++) {
+		x[i + 4] = _mm512_loadu_si512 ((const void *)w[i]);
+	}
+
+	for (i = rounds; i > 0; i -= 2) {
+		QR (x[0], x[4], x[8], x[12]);
+		QR (x[1], x[5], x[9], x[13]);
+		QR (x[2], x[6], x[10], x[14]);
+		QR (x[3], x[7], x[11], x[15]);
+		QR (x[0], x[5], x[10], x[15]);
+		QR (x[1], x[6], x[11], x[12]);
+		QR (x[2], x[7], x[8], x[13]);
+		QR (x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 4; i ++) {
+		s[i] = _mm512_set1_epi32 (chacha_constants[i]);
+		s[i + 4] = x[i];
+		s[i + 8] = x[i + 12];
+	}
+
+	s[13] = _mm512_setzero_si512 ();
+	s[14] = _mm512_loadu_si512 ((const void *)w[12]);
+	s[15] = _mm512_loadu_si512 ((const void *)w[13]);
+	rspamd_explicit_memzero (w, sizeof (w));
+
+	/* The first block is used for the message authentication key */
+	nblocks = 1 + (maxlen + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+
+	for (b = 0; b < nblocks; b ++) {
+		s[12] = _mm512_set1_epi32 (b);
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = s[i];
+		}
+
+		for (i = rounds; i > 0; i -= 2) {
+			QR (x[0], x[4], x[8], x[12]);
+			QR (x[1], x[5], x[9], x[13]);
+			QR (x[2], x[6], x[10], x[14]);
+			QR (x[3], x[7], x[11], x[15]);
+			QR (x[0], x[5], x[10], x[15]);
+			QR (x[1], x[6], x[11], x[12]);
+			QR (x[2], x[7], x[8], x[13]);
+			QR (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = _mm512_add_epi32 (x[i], s[i]);
+		}
+
+		/* Now x[l] is the current block of lane `l` */
+		TRANSPOSE_WORDS (x[0], x[1], x[2], x[3]);
+		TRANSPOSE_WORDS (x[4], x[5], x[6], x[7]);
+		TRANSPOSE_WORDS (x[8], x[9], x[10], x[11]);
+		TRANSPOSE_WORDS (x[12], x[13], x[14], x[15]);
+		TRANSPOSE_LANES (x[0], x[4], x[8], x[12]);
+		TRANSPOSE_LANES (x[1], x[5], x[9], x[13]);
+		TRANSPOSE_LANES (x[2], x[6], x[10], x[14]);
+		TRANSPOSE_LANES (x[3], x[7], x[11], x[15]);
+
+		for (l = 0; l < n; l ++) {
+			if (b == 0) {
+				_mm512_storeu_si512 ((void *)msgs[l].block0, x[l]);
+				continue;
+			}
+
+			off = (b - 1) * CHACHA_BLOCKBYTES;
+
+			if (off >= msgs[l].len) {
+				continue;
+			}
+
+			len = msgs[l].len - off;
+
+			if (len >= CHACHA_BLOCKBYTES) {
+				chacha_store_block (msgs[l].data + off, msgs[l].data + off, x[l]);
+			}
+			else {
+				_mm512_storeu_si512 ((void *)tmp, x[l]);
+
+				for (i = 0; i < len; i ++) {
+					msgs[l].data[off + i] ^= tmp[i];
+				}
+			}
+		}
+	}
+
+	rspamd_explicit_memzero (tmp, sizeof (tmp));
+}
+
+void
+xchacha_multi_avx512 (chacha_multi *msgs, size_t nmsgs, size_t rounds)
+{
+	size_t n;
+
+	while (nmsgs > 0) {
+		n = MIN (nmsgs, MULTI_LANES);
+		xchacha_multi_avx512_lanes (msgs, n, rounds);
+		msgs += n;
+		nmsgs -= n;
+	}
+}
@@ -52,6 +52,10 @@ typedef struct chacha_impl_t {
 #define CHACHA_IMPL(cpuflags, desc, ext) \
 		{(cpuflags), desc, chacha_##ext, xchacha_##ext, chacha_blocks_##ext, hchacha_##ext}
 
+#if defined(HAVE_AVX512)
+	CHACHA_DECLARE(avx512)
+	#define CHACHA_AVX512 CHACHA_IMPL(CPUID_AVX512, "avx512", avx512)
+#endif
 #if defined(HAVE_AVX2)
 	CHACHA_DECLARE(avx2)
 	#define CHACHA_AVX2 CHACHA_IMPL(CPUID_AVX2, "avx2", avx2)
@@ -64,12 +68,19 @@ typedef struct chacha_impl_t {
 	CHACHA_DECLARE(sse2)
 	#define CHACHA_SSE2 CHACHA_IMPL(CPUID_SSE2, "sse2", sse2)
 #endif
+#if defined(HAVE_NEON)
+	CHACHA_DECLARE(neon)
+	#define CHACHA_NEON CHACHA_IMPL(CPUID_NEON, "neon", neon)
+#endif
 
 CHACHA_DECLARE(ref)
 #define CHACHA_GENERIC CHACHA_IMPL(0, "generic", ref)
 
 static const chacha_impl_t chacha_list[] = {
 	CHACHA_GENERIC,
+#if defined(CHACHA_AVX512)
+	CHACHA_AVX512,
+#endif
 #if defined(CHACHA_AVX2)
 	CHACHA_AVX2,
 #endif
@@ -77,12 +88,33 @@ static const chacha_impl_t chacha_list[] = {
 	CHACHA_AVX,
 #endif
 #if defined(CHACHA_SSE2)
-	CHACHA_SSE2
+	CHACHA_SSE2,
+#endif
+#if defined(CHACHA_NEON)
+	CHACHA_NEON,
 #endif
 };
 
 static const chacha_impl_t *chacha_impl = &chacha_list[0];
 
+/* Multi-buffer code is used for short messages only */
+#define CHACHA_MULTI_MIN 4
+#define CHACHA_MULTI_MAXLEN (8 * CHACHA_BLOCKBYTES)
+
+typedef void (*xchacha_multi_func) (chacha_multi *msgs, size_t nmsgs,
+		size_t rounds);
+
+#if defined(HAVE_AVX512)
+void xchacha_multi_avx512 (chacha_multi *msgs, size_t nmsgs, size_t rounds);
+#endif
+#if defined(HAVE_NEON)
+void xchacha_multi_neon (chacha_multi *msgs, size_t nmsgs, size_t rounds);
+#endif
+
+static void xchacha_multi_generic (chacha_multi *msgs, size_t nmsgs,
+		size_t rounds);
+static xchacha_multi_func xchacha_multi_impl = xchacha_multi_generic;
+
 static int
 chacha_is_aligned (const void *p)
 {
@@ -103,6 +135,18 @@ chacha_load (void)
 		}
 	}
 
+	/* Multi-buffer code processes independent messages in vector lanes */
+#if defined(HAVE_AVX512)
+	if (cpu_config & CPUID_AVX512) {
+		xchacha_multi_impl = xchacha_multi_avx512;
+	}
+#endif
+#if defined(HAVE_NEON)
+	if (cpu_config & CPUID_NEON) {
+		xchacha_multi_impl = xchacha_multi_neon;
+	}
+#endif
+
 	return chacha_impl->desc;
 }
 
@@ -261,3 +305,47 @@ xchacha (const chacha_key *key, const chacha_iv24 *iv,
 {
 	chacha_impl->xchacha (key, iv, in, out, inlen, rounds);
 }
+
+static void
+xchacha_multi_generic (chacha_multi *msgs, size_t nmsgs, size_t rounds)
+{
+	chacha_state S;
+	size_t i, r;
+
+	for (i = 0; i < nmsgs; i ++) {
+		xchacha_init (&S, msgs[i].key, msgs[i].iv, rounds);
+		memset (msgs[i].block0, 0, sizeof (msgs[i].block0));
+		chacha_update (&S, msgs[i].block0, msgs[i].block0,
+				sizeof (msgs[i].block0));
+		r = chacha_update (&S, msgs[i].data, msgs[i].data, msgs[i].len);
+		chacha_final (&S, msgs[i].data + r);
+	}
+}
+
+void
+xchacha_multi (chacha_multi *msgs, size_t nmsgs, size_t rounds)
+{
+	size_t i, start = 0;
+
+	if (nmsgs < CHACHA_MULTI_MIN) {
+		xchacha_multi_generic (msgs, nmsgs, rounds);
+
+		return;
+	}
+
+	for (i = 0; i < nmsgs; i ++) {
+		if (msgs[i].len > CHACHA_MULTI_MAXLEN) {
+			/* Long messages are processed faster by blocks function */
+			if (i > start) {
+				xchacha_multi_impl (msgs + start, i - start, rounds);
+			}
+
+			xchacha_multi_generic (msgs + i, 1, rounds);
+			start = i + 1;
+		}
+	}
+
+	if (nmsgs > start) {
+		xchacha_multi_impl (msgs + start, nmsgs - start, rounds);
+	}
+}
@@ -53,6 +53,19 @@ typedef struct chacha_iv24_t {
 	unsigned char b[24];
 } chacha_iv24;
 
+/*
+ * Independent xchacha message processed by `xchacha_multi`: the keystream
+ * of the first block is stored in `block0` and the rest of keystream is
+ * xored with `data` inplace
+ */
+typedef struct chacha_multi_t {
+	const chacha_key *key;
+	const chacha_iv24 *iv;
+	unsigned char *data;
+	size_t len;
+	unsigned char block0[CHACHA_BLOCKBYTES];
+} chacha_multi;
+
 void hchacha (const unsigned char key[32], const unsigned char iv[16],
 		unsigned char out[32], size_t rounds);
 
@@ -74,6 +87,13 @@ void xchacha (const chacha_key *key, const chacha_iv24 *iv,
 		const unsigned char *in, unsigned char *out, size_t inlen,
 		size_t rounds);
 
+/*
+ * Process many short independent messages at once, the same as calling
+ * `xchacha_init` + `chacha_update` for the first block and then data for
+ * each message
+ */
+void xchacha_multi (chacha_multi *msgs, size_t nmsgs, size_t rounds);
+
 const char* chacha_load (void);
 
 #endif /* CHACHA_H_ */
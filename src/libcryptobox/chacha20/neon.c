@@ -0,0 +1,362 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * NEON implementation of chacha blocks function for aarch64. Blocks are
+ * processed by 4 at once, each q register holds the same state word of all
+ * 4 blocks
+ */
+
+#include "config.h"
+#include "chacha.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+#include <arm_neon.h>
+
+void hchacha_ref (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds);
+
+static const guint32 chacha_constants[4] = {
+	0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+};
+
+#define ROTL(x, k) vsriq_n_u32 (vshlq_n_u32 ((x), (k)), (x), 32 - (k))
+#define ROTL16(x) vreinterpretq_u32_u16 (vrev32q_u16 (vreinterpretq_u16_u32 (x)))
+
+#define QR(a, b, c, d) do { \
+	a = vaddq_u32 (a, b); d = veorq_u32 (d, a); d = ROTL16 (d); \
+	c = vaddq_u32 (c, d); b = veorq_u32 (b, c); b = ROTL (b, 12); \
+	a = vaddq_u32 (a, b); d = veorq_u32 (d, a); d = ROTL (d, 8); \
+	c = vaddq_u32 (c, d); b = veorq_u32 (b, c); b = ROTL (b, 7); \
+} while (0)
+
+/* Transpose 4x4 matrix of 32 bits words */
+#define TRANSPOSE(a, b, c, d) do { \
+	uint32x4x2_t t01, t23; \
+	t01 = vtrnq_u32 (a, b); \
+	t23 = vtrnq_u32 (c, d); \
+	a = vcombine_u32 (vget_low_u32 (t01.val[0]), vget_low_u32 (t23.val[0])); \
+	b = vcombine_u32 (vget_low_u32 (t01.val[1]), vget_low_u32 (t23.val[1])); \
+	c = vcombine_u32 (vget_high_u32 (t01.val[0]), vget_high_u32 (t23.val[0])); \
+	d = vcombine_u32 (vget_high_u32 (t01.val[1]), vget_high_u32 (t23.val[1])); \
+} while (0)
+
+static inline void
+chacha_store_row (const unsigned char *in, unsigned char *out, uint32x4_t v)
+{
+	uint8x16_t r = vreinterpretq_u8_u32 (v);
+
+	if (in) {
+		r = veorq_u8 (r, vld1q_u8 (in));
+	}
+
+	vst1q_u8 (out, r);
+}
+
+void
+chacha_blocks_neon (chacha_state_internal *state, const unsigned char *in,
+		unsigned char *out, size_t bytes)
+{
+	guint32 j[12];
+	uint32x4_t x[16], s[16], ctr_lo;
+	const guint32 idx_words[4] = {0, 1, 2, 3};
+	const uint32x4_t idx = vld1q_u32 (idx_words);
+	unsigned char tmp[4 * CHACHA_BLOCKBYTES], *dst;
+	const unsigned char *src;
+	size_t i, k, nblocks;
+	guint64 counter;
+
+	if (!bytes) {
+		return;
+	}
+
+	memcpy (j, state->s, sizeof (j));
+
+	for (i = 0; i < 4; i ++) {
+		s[i] = vdupq_n_u32 (chacha_constants[i]);
+	}
+	for (i = 0; i < 8; i ++) {
+		s[i + 4] = vdupq_n_u32 (j[i]);
+	}
+
+	s[14] = vdupq_n_u32 (j[10]);
+	s[15] = vdupq_n_u32 (j[11]);
+
+	for (;;) {
+		/* 64 bits counter for each block, carry mask is all ones */
+		ctr_lo = vdupq_n_u32 (j[8]);
+		s[12] = vaddq_u32 (ctr_lo, idx);
+		s[13] = vsubq_u32 (vdupq_n_u32 (j[9]), vcltq_u32 (s[12], ctr_lo));
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = s[i];
+		}
+
+		for (i = state->rounds; i > 0; i -= 2) {
+			QR (x[0], x[4], x[8], x[12]);
+			QR (x[1], x[5], x[9], x[13]);
+			QR (x[2], x[6], x[10], x[14]);
+			QR (x[3], x[7], x[11], x[15]);
+			QR (x[0], x[5], x[10], x[15]);
+			QR (x[1], x[6], x[11], x[12]);
+			QR (x[2], x[7], x[8], x[13]);
+			QR (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = vaddq_u32 (x[i], s[i]);
+		}
+
+		/* Register x[4 * g + k] now holds words 4 * g .. 4 * g + 3 of block k */
+		TRANSPOSE (x[0], x[1], x[2], x[3]);
+		TRANSPOSE (x[4], x[5], x[6], x[7]);
+		TRANSPOSE (x[8], x[9], x[10], x[11]);
+		TRANSPOSE (x[12], x[13], x[14], x[15]);
+
+		if (bytes >= 4 * CHACHA_BLOCKBYTES) {
+			src = in;
+			dst = out;
+		}
+		else {
+			/* Partial output, use temporary buffer */
+			src = NULL;
+			dst = tmp;
+		}
+
+		for (k = 0; k < 4; k ++) {
+			for (i = 0; i < 4; i ++) {
+				chacha_store_row (src ? src + k * CHACHA_BLOCKBYTES + i * 16 : NULL,
+						dst + k * CHACHA_BLOCKBYTES + i * 16, x[4 * i + k]);
+			}
+		}
+
+		if (bytes < 4 * CHACHA_BLOCKBYTES) {
+			if (in) {
+				for (i = 0; i < bytes; i ++) {
+					out[i] = in[i] ^ tmp[i];
+				}
+			}
+			else {
+				memcpy (out, tmp, bytes);
+			}
+
+			rspamd_explicit_memzero (tmp, sizeof (tmp));
+		}
+
+		if (bytes <= 4 * CHACHA_BLOCKBYTES) {
+			nblocks = (bytes + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+			counter = ((guint64)j[9] << 32 | j[8]) + nblocks;
+			j[8] = counter & 0xffffffff;
+			j[9] = counter >> 32;
+			break;
+		}
+
+		counter = ((guint64)j[9] << 32 | j[8]) + 4;
+		j[8] = counter & 0xffffffff;
+		j[9] = counter >> 32;
+		bytes -= 4 * CHACHA_BLOCKBYTES;
+		out += 4 * CHACHA_BLOCKBYTES;
+
+		if (in) {
+			in += 4 * CHACHA_BLOCKBYTES;
+		}
+	}
+
+	/* store the counter back to the state */
+	memcpy (state->s + 32, &j[8], 8);
+	rspamd_explicit_memzero (j, sizeof (j));
+}
+
+void
+hchacha_neon (const unsigned char key[32], const unsigned char iv[16],
+		unsigned char out[32], size_t rounds)
+{
+	/* Single block function, there is nothing to vectorize here */
+	hchacha_ref (key, iv, out, rounds);
+}
+
+void
+chacha_neon (const chacha_key *key, const chacha_iv *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	memcpy (state.s, key->b, 32);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b, 8);
+	state.rounds = rounds;
+	chacha_blocks_neon (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+void
+xchacha_neon (const chacha_key *key, const chacha_iv24 *iv,
+		const unsigned char *in, unsigned char *out, size_t inlen,
+		size_t rounds)
+{
+	chacha_state_internal state;
+
+	hchacha_ref (key->b, iv->b, state.s, rounds);
+	memset (state.s + 32, 0, 8);
+	memcpy (state.s + 40, iv->b + 16, 8);
+	state.rounds = rounds;
+	chacha_blocks_neon (&state, in, out, inlen);
+	rspamd_explicit_memzero (&state, 48);
+}
+
+#define MULTI_LANES 4
+
+/*
+ * Process up to 4 messages, each message uses its own lane, so both hchacha
+ * and all blocks of messages are computed at once
+ */
+static void
+xchacha_multi_neon_lanes (chacha_multi *msgs, size_t n, size_t rounds)
+{
+	guint32 w[14][MULTI_LANES];
+	uint32x4_t x[16], s[16];
+	unsigned char tmp[CHACHA_BLOCKBYTES];
+	const chacha_multi *m;
+	size_t i, k, l, b, off, len, maxlen = 0, nblocks;
+
+	for (l = 0; l < MULTI_LANES; l ++) {
+		/* Unused lanes just repeat the first message */
+		m = &msgs[l < n ? l : 0];
+
+		for (i = 0; i < 8; i ++) {
+			memcpy (&w[i][l], m->key->b + i * 4, sizeof (guint32));
+		}
+		for (i = 0; i < 6; i ++) {
+			memcpy (&w[i + 8][l], m->iv->b + i * 4, sizeof (guint32));
+		}
+
+		if (m->len > maxlen) {
+			maxlen = m->len;
+		}
+	}
+
+	/* hchacha of all lanes, subkey is words 0..3 and 12..15 */
+	for (i = 0; i < 4; i ++) {
+		x[i] = vdupq_n_u32 (chacha_constants[i]);
+	}
+	for (i = 0; i < 12; i ++) {
+		x[i + 4] = vld1q_u32 (w[i]);
+	}
+
+	for (i = rounds; i > 0; i -= 2) {
+		QR (x[0], x[4], x[8], x[12]);
+		QR (x[1], x[5], x[9], x[13]);
+		QR (x[2], x[6], x[10], x[14]);
+		QR (x[3], x[7], x[11], x[15]);
+		QR (x[0], x[5], x[10], x[15]);
+		QR (x[1], x[6], x[11], x[12]);
+		QR (x[2], x[7], x[8], x[13]);
+		QR (x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 4; i ++) {
+		s[i] = vdupq_n_u32 (chacha_constants[i]);
+		s[i + 4] = x[i];
+		s[i + 8] = x[i + 12];
+	}
+
+	s[13] = vdupq_n_u32 (0);
+	s[14] = vld1q_u32 (w[12]);
+	s[15] = vld1q_u32 (w[13]);
+	rspamd_explicit_memzero (w, sizeof (w));
+
+	/* The first block is used for the message authentication key */
+	nblocks = 1 + (maxlen + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+
+	for (b = 0; b < nblocks; b ++) {
+		s[12] = vdupq_n_u32 (b);
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = s[i];
+		}
+
+		for (i = rounds; i > 0; i -= 2) {
+			QR (x[0], x[4], x[8], x[12]);
+			QR (x[1], x[5], x[9], x[13]);
+			QR (x[2], x[6], x[10], x[14]);
+			QR (x[3], x[7], x[11], x[15]);
+			QR (x[0], x[5], x[10], x[15]);
+			QR (x[1], x[6], x[11], x[12]);
+			QR (x[2], x[7], x[8], x[13]);
+			QR (x[3], x[4], x[9], x[14]);
+		}
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = vaddq_u32 (x[i], s[i]);
+		}
+
+		/* Register x[4 * g + l] now holds words 4 * g .. 4 * g + 3 of lane l */
+		TRANSPOSE (x[0], x[1], x[2], x[3]);
+		TRANSPOSE (x[4], x[5], x[6], x[7]);
+		TRANSPOSE (x[8], x[9], x[10], x[11]);
+		TRANSPOSE (x[12], x[13], x[14], x[15]);
+
+		for (l = 0; l < n; l ++) {
+			if (b == 0) {
+				for (k = 0; k < 4; k ++) {
+					chacha_store_row (NULL, msgs[l].block0 + k * 16, x[4 * k + l]);
+				}
+
+				continue;
+			}
+
+			off = (b - 1) * CHACHA_BLOCKBYTES;
+
+			if (off >= msgs[l].len) {
+				continue;
+			}
+
+			len = msgs[l].len - off;
+
+			if (len >= CHACHA_BLOCKBYTES) {
+				for (k = 0; k < 4; k ++) {
+					chacha_store_row (msgs[l].data + off + k * 16,
+							msgs[l].data + off + k * 16, x[4 * k + l]);
+				}
+			}
+			else {
+				for (k = 0; k < 4; k ++) {
+					chacha_store_row (NULL, tmp + k * 16, x[4 * k + l]);
+				}
+
+				for (i = 0; i < len; i ++) {
+					msgs[l].data[off + i] ^= tmp[i];
+				}
+			}
+		}
+	}
+
+	rspamd_explicit_memzero (tmp, sizeof (tmp));
+}
+
+void
+xchacha_multi_neon (chacha_multi *msgs, size_t nmsgs, size_t rounds)
+{
+	size_t n;
+
+	while (nmsgs > 0) {
+		n = MIN (nmsgs, MULTI_LANES);
+		xchacha_multi_neon_lanes (msgs, n, rounds);
+		msgs += n;
+		nmsgs -= n;
+	}
+}
@@ -29,6 +29,7 @@
 #include "blake2/blake2.h"
 #include "siphash/siphash.h"
 #include "catena/catena.h"
+#include "base64/base64.h"
 #include "ottery.h"
 #include "printf.h"
 
@@ -182,6 +183,11 @@ rspamd_cryptobox_test_instr (gint instr)
 	case CPUID_AVX2:
 		__asm__ volatile ("vpaddq %ymm0, %ymm0, %ymm0");\
 		break;
+#endif
+#ifdef HAVE_AVX512
+	case CPUID_AVX512:
+		__asm__ volatile ("vpaddq %zmm0, %zmm0, %zmm0");
+		break;
 #endif
 	default:
 		return FALSE;
@@ -202,6 +208,7 @@ rspamd_cryptobox_init (void)
 	const guint32 osxsave_mask = (1 << 27);
 	const guint32 fma_movbe_osxsave_mask = ((1 << 12) | (1 << 22) | (1 << 27));
 	const guint32 avx2_bmi12_mask = (1 << 5) | (1 << 3) | (1 << 8);
+	const guint32 avx512f_mask = (1 << 16);
 	gulong bit;
 	static struct rspamd_cryptobox_library_ctx *ctx;
 	GString *buf;
@@ -262,10 +269,21 @@ rspamd_cryptobox_init (void)
 						cpu_config |= CPUID_AVX2;
 					}
 				}
+
+				if ((cpu[1] & avx512f_mask) == avx512f_mask) {
+					if (rspamd_cryptobox_test_instr (CPUID_AVX512)) {
+						cpu_config |= CPUID_AVX512;
+					}
+				}
 			}
 		}
 	}
 
+#if defined(HAVE_NEON) && defined(__aarch64__)
+	/* Advanced SIMD is mandatory for armv8 */
+	cpu_config |= CPUID_NEON;
+#endif
+
 	buf = g_string_new ("");
 
 	for (bit = 0x1; bit != 0; bit <<= 1) {
@@ -289,6 +307,12 @@ rspamd_cryptobox_init (void)
 			case CPUID_AVX2:
 				rspamd_printf_gstring (buf, "avx2, ");
 				break;
+			case CPUID_AVX512:
+				rspamd_printf_gstring (buf, "avx512, ");
+				break;
+			case CPUID_NEON:
+				rspamd_printf_gstring (buf, "neon, ");
+				break;
 			case CPUID_RDRAND:
 				rspamd_printf_gstring (buf, "rdrand, ");
 				break;
@@ -311,6 +335,7 @@ rspamd_cryptobox_init (void)
 	ctx->curve25519_impl = curve25519_load ();
 	ctx->blake2_impl = blake2b_load ();
 	ctx->ed25519_impl = ed25519_load ();
+	ctx->base64_impl = base64_load ();
 #ifdef HAVE_USABLE_OPENSSL
 	ERR_load_ECDSA_strings ();
 	ERR_load_EC_strings ();
@@ -556,6 +581,36 @@ rspamd_cryptobox_verify (const guchar *sig,
 	return ret;
 }
 
+bool
+rspamd_cryptobox_verify_batch (const guchar **sigs,
+		const guchar **m,
+		const gsize *mlen,
+		const guchar **pks,
+		gsize n,
+		bool *valid,
+		enum rspamd_cryptobox_mode mode)
+{
+	bool ret = true, cur;
+	gsize i;
+
+	if (G_LIKELY (mode == RSPAMD_CRYPTOBOX_MODE_25519)) {
+		return ed25519_verify_batch (sigs, m, mlen, pks, n, valid);
+	}
+
+	/* ECDSA signatures are verified one by one */
+	for (i = 0; i < n; i ++) {
+		cur = rspamd_cryptobox_verify (sigs[i], m[i], mlen[i], pks[i], mode);
+
+		if (valid != NULL) {
+			valid[i] = cur;
+		}
+
+		ret = ret && cur;
+	}
+
+	return ret;
+}
+
 static gsize
 rspamd_cryptobox_encrypt_ctx_len (enum rspamd_cryptobox_mode mode)
 {
@@ -984,6 +1039,50 @@ void rspamd_cryptobox_encrypt_nm_inplace (guchar *data, gsize len,
 	rspamd_cryptobox_cleanup (enc_ctx, auth_ctx, mode);
 }
 
+#define CRYPTOBOX_MULTI_CHUNK 64
+
+void
+rspamd_cryptobox_encrypt_nm_inplace_multi (
+		struct rspamd_cryptobox_message *msgs,
+		gsize cnt,
+		enum rspamd_cryptobox_mode mode)
+{
+	chacha_multi cmsgs[CRYPTOBOX_MULTI_CHUNK];
+	gsize i, n;
+
+	if (G_UNLIKELY (mode != RSPAMD_CRYPTOBOX_MODE_25519)) {
+		for (i = 0; i < cnt; i ++) {
+			rspamd_cryptobox_encrypt_nm_inplace (msgs[i].data, msgs[i].len,
+					msgs[i].nonce, msgs[i].nm, msgs[i].sig, mode);
+		}
+
+		return;
+	}
+
+	while (cnt > 0) {
+		n = MIN (cnt, G_N_ELEMENTS (cmsgs));
+
+		for (i = 0; i < n; i ++) {
+			cmsgs[i].key = (const chacha_key *)msgs[i].nm;
+			cmsgs[i].iv = (const chacha_iv24 *)msgs[i].nonce;
+			cmsgs[i].data = msgs[i].data;
+			cmsgs[i].len = msgs[i].len;
+		}
+
+		/* The first block of each keystream is used as the poly1305 key */
+		xchacha_multi (cmsgs, n, 20);
+
+		for (i = 0; i < n; i ++) {
+			poly1305_auth (msgs[i].sig, msgs[i].data, msgs[i].len,
+					(const poly1305_key *)cmsgs[i].block0);
+		}
+
+		rspamd_explicit_memzero (cmsgs, sizeof (cmsgs[0]) * n);
+		msgs += n;
+		cnt -= n;
+	}
+}
+
 static void
 rspamd_cryptobox_flush_outbuf (struct rspamd_cryptobox_segment *st,
 		const guchar *buf, gsize len, gsize offset)
@@ -1196,6 +1295,20 @@ rspamd_cryptobox_siphash (unsigned char *out, const unsigned char *in,
 	siphash24 (out, in, inlen, k);
 }
 
+gboolean
+rspamd_cryptobox_base64_decode (const gchar *in, gsize inlen,
+		guchar *out, gsize *outlen)
+{
+	return base64_decode (in, inlen, out, outlen);
+}
+
+gsize
+rspamd_cryptobox_base64_encode_blocks (const guchar *in, gsize inlen,
+		gchar *out)
+{
+	return base64_encode_blocks (in, inlen, out);
+}
+
 /*
  * Password-Based Key Derivation Function 2 (PKCS #5 v2.0).
  * Code based on IEEE Std 802.11-2007, Annex H.4.2.
@@ -23,6 +23,15 @@ struct rspamd_cryptobox_segment {
 	gsize len;
 };
 
+/* Independent message for multi-buffer encryption */
+struct rspamd_cryptobox_message {
+	guchar *data;
+	gsize len;
+	const guchar *nonce;
+	const guchar *nm;
+	guchar *sig;
+};
+
 #define rspamd_cryptobox_MAX_NONCEBYTES 24
 #define rspamd_cryptobox_MAX_PKBYTES 65
 #define rspamd_cryptobox_MAX_SKBYTES 32
@@ -43,6 +52,8 @@ struct rspamd_cryptobox_segment {
 #define CPUID_SSSE3 0x10
 #define CPUID_SSE41 0x20
 #define CPUID_RDRAND 0x40
+#define CPUID_AVX512 0x80
+#define CPUID_NEON 0x100
 
 typedef guchar rspamd_pk_t[rspamd_cryptobox_MAX_PKBYTES];
 typedef guchar rspamd_sk_t[rspamd_cryptobox_MAX_SKBYTES];
@@ -67,6 +78,7 @@ struct rspamd_cryptobox_library_ctx {
 	const gchar *poly1305_impl;
 	const gchar *siphash_impl;
 	const gchar *blake2_impl;
+	const gchar *base64_impl;
 	unsigned long cpu_config;
 };
 
@@ -159,6 +171,18 @@ void rspamd_cryptobox_encryptv_nm_inplace (struct rspamd_cryptobox_segment *segm
 		const rspamd_nm_t nm, rspamd_mac_t sig,
 		enum rspamd_cryptobox_mode mode);
 
+/**
+ * Encrypt many independent messages inplace, each with its own nonce and
+ * shared key, adding signatures to their `sig`. Short messages are encrypted
+ * in parallel which is much faster than encrypting them one by one
+ * @param msgs messages to encrypt
+ * @param cnt count of messages
+ */
+void rspamd_cryptobox_encrypt_nm_inplace_multi (
+		struct rspamd_cryptobox_message *msgs,
+		gsize cnt,
+		enum rspamd_cryptobox_mode mode);
+
 
 /**
  * Decrypt and verify data chunk inplace
@@ -211,6 +235,26 @@ bool rspamd_cryptobox_verify (const guchar *sig,
 		const rspamd_pk_t pk,
 		enum rspamd_cryptobox_mode mode);
 
+/**
+ * Verifies a batch of digital signatures, for 25519 mode it is significantly
+ * faster than verifying signatures one by one
+ * @param sigs array of signatures
+ * @param m array of messages
+ * @param mlen array of messages lengths
+ * @param pks array of public keys
+ * @param n number of signatures
+ * @param valid output array of `n` elements set to validity of each signature
+ * (could be NULL)
+ * @return true if all signatures are valid, false otherwise
+ */
+bool rspamd_cryptobox_verify_batch (const guchar **sigs,
+		const guchar **m,
+		const gsize *mlen,
+		const guchar **pks,
+		gsize n,
+		bool *valid,
+		enum rspamd_cryptobox_mode mode);
+
 /**
  * Securely clear the buffer specified
  * @param buf buffer to zero
@@ -229,6 +273,30 @@ void rspamd_cryptobox_siphash (unsigned char *out, const unsigned char *in,
 		unsigned long long inlen,
 		const rspamd_sipkey_t k);
 
+/**
+ * Decode base64 using the best available implementation. Characters outside
+ * of alphabet (e.g. line breaks) are skipped, decoding stops on padding
+ * @param in
+ * @param inlen
+ * @param out output buffer of at least `(inlen / 4) * 3 + 3` bytes or `in`
+ * for decoding in place
+ * @param outlen number of bytes written
+ * @return FALSE if input is truncated
+ */
+gboolean rspamd_cryptobox_base64_decode (const gchar *in, gsize inlen,
+		guchar *out, gsize *outlen);
+
+/**
+ * Encode leading full 3 bytes blocks of input to base64 using the best
+ * available implementation (no padding and no line breaks are emitted)
+ * @param in
+ * @param inlen
+ * @param out output buffer of at least `(inlen / 3) * 4` bytes
+ * @return number of input bytes encoded
+ */
+gsize rspamd_cryptobox_base64_encode_blocks (const guchar *in, gsize inlen,
+		gchar *out);
+
 enum rspamd_cryptobox_pbkdf_type {
 	RSPAMD_CRYPTOBOX_PBKDF2 = 0,
 	RSPAMD_CRYPTOBOX_CATENA
@@ -1795,6 +1795,90 @@ void ge_scalarmult_vartime(ge_p3 *r, const unsigned char *a, const ge_p3 *A)
 	}
 }
 
+/*
+ r = b * B + a[0] * A[0] + ... + a[n - 1] * A[n - 1]
+ where each scalar is 32 bytes in a and all points share the same doublings.
+ slides must have space for n * 256 elements and Ai for n * 8 elements.
+ */
+
+void ge_multi_scalarmult_vartime(ge_p2 *r, const unsigned char *b,
+		const unsigned char *a, const ge_p3 *A, size_t n,
+		signed char *slides, ge_cached *Ai)
+{
+	signed char bslide[256];
+	signed char *aslide;
+	ge_cached *cur;
+	ge_p1p1 t;
+	ge_p3 u;
+	ge_p3 A2;
+	size_t k;
+	int i, j;
+
+	slide (bslide, b);
+
+	for (k = 0; k < n; k ++) {
+		slide (slides + k * 256, a + k * 32);
+		/* A,3A,5A,7A,9A,11A,13A,15A */
+		cur = Ai + k * 8;
+		ge_p3_to_cached (&cur[0], &A[k]);
+		ge_p3_dbl (&t, &A[k]);
+		ge_p1p1_to_p3 (&A2, &t);
+
+		for (j = 1; j < 8; j ++) {
+			ge_add (&t, &A2, &cur[j - 1]);
+			ge_p1p1_to_p3 (&u, &t);
+			ge_p3_to_cached (&cur[j], &u);
+		}
+	}
+
+	ge_p2_0 (r);
+
+	for (i = 255; i >= 0; --i) {
+		if (bslide[i]) {
+			break;
+		}
+
+		for (k = 0; k < n; k ++) {
+			if (slides[k * 256 + i]) {
+				break;
+			}
+		}
+
+		if (k < n) {
+			break;
+		}
+	}
+
+	for (; i >= 0; --i) {
+		ge_p2_dbl (&t, r);
+
+		for (k = 0; k < n; k ++) {
+			aslide = slides + k * 256;
+			cur = Ai + k * 8;
+
+			if (aslide[i] > 0) {
+				ge_p1p1_to_p3 (&u, &t);
+				ge_add (&t, &u, &cur[aslide[i] / 2]);
+			}
+			else if (aslide[i] < 0) {
+				ge_p1p1_to_p3 (&u, &t);
+				ge_sub (&t, &u, &cur[(-aslide[i]) / 2]);
+			}
+		}
+
+		if (bslide[i] > 0) {
+			ge_p1p1_to_p3 (&u, &t);
+			ge_madd (&t, &u, &Bi[bslide[i] / 2]);
+		}
+		else if (bslide[i] < 0) {
+			ge_p1p1_to_p3 (&u, &t);
+			ge_msub (&t, &u, &Bi[(-bslide[i]) / 2]);
+		}
+
+		ge_p1p1_to_p2 (r, &t);
+	}
+}
+
 void ge_scalarmult_base(ge_p3 *h, const unsigned char *a)
 {
 	signed char e[64];
@@ -33,6 +33,12 @@ typedef struct ed25519_impl_s {
 			const unsigned char *m,
 			size_t mlen,
 			const unsigned char *pk);
+	int (*verify_batch) (const unsigned char **sigs,
+			const unsigned char **m,
+			const size_t *mlen,
+			const unsigned char **pks,
+			size_t n,
+			int *valid);
 } ed25519_impl_t;
 
 #define ED25519_DECLARE(ext) \
@@ -43,10 +49,17 @@ typedef struct ed25519_impl_s {
     int ed_verify_##ext(const unsigned char *sig, \
         const unsigned char *m, \
 		size_t mlen, \
-        const unsigned char *pk)
+        const unsigned char *pk); \
+    int ed_verify_batch_##ext(const unsigned char **sigs, \
+        const unsigned char **m, \
+        const size_t *mlen, \
+        const unsigned char **pks, \
+        size_t n, \
+        int *valid)
 
 #define ED25519_IMPL(cpuflags, desc, ext) \
-    {(cpuflags), desc, ed_keypair_##ext, ed_sign_##ext, ed_verify_##ext}
+    {(cpuflags), desc, ed_keypair_##ext, ed_sign_##ext, ed_verify_##ext, \
+		ed_verify_batch_##ext}
 
 ED25519_DECLARE(ref);
 #define ED25519_REF ED25519_IMPL(0, "ref", ref)
@@ -103,6 +116,31 @@ ed25519_verify (const unsigned char *sig,
 	return (ret == 0 ? true : false);
 }
 
+bool
+ed25519_verify_batch (const unsigned char **sigs,
+		const unsigned char **m,
+		const size_t *mlen,
+		const unsigned char **pks,
+		size_t n,
+		bool *valid)
+{
+	int *res, ret;
+	size_t i;
+
+	res = g_malloc (sizeof (*res) * MAX (n, 1));
+	ret = ed25519_opt->verify_batch (sigs, m, mlen, pks, n, res);
+
+	if (valid != NULL) {
+		for (i = 0; i < n; i ++) {
+			valid[i] = res[i] ? true : false;
+		}
+	}
+
+	g_free (res);
+
+	return (ret == 0 ? true : false);
+}
+
 struct ed25519_test_vector {
 	const char *message;
 	const char *pk;
@@ -141,3 +141,117 @@ ed_sign_ref(unsigned char *sig, size_t *siglen_p,
 		*siglen_p = 64U;
 	}
 }
+
+/*
+ * Checks all signatures at once using the randomised batch equation:
+ * (sum z_i s_i) B - sum (z_i h_i) A_i - sum z_i R_i == 0, where z_i are
+ * random 128 bits scalars. If the equation does not hold, then signatures
+ * are verified one by one to find the invalid ones.
+ */
+int
+ed_verify_batch_ref(const unsigned char **sigs, const unsigned char **m,
+		const size_t *mlen, const unsigned char **pks, size_t n,
+		int *valid)
+{
+	EVP_MD_CTX sha_ctx;
+	unsigned char h[64];
+	unsigned char zero[32];
+	unsigned char sb[32];
+	unsigned char rcheck[32];
+	unsigned char *scalars, *z;
+	signed char *slides;
+	ge_cached *cached;
+	ge_p3 *points, pos;
+	ge_p2 R;
+	size_t i, j;
+	unsigned char d;
+	int ret = 0, batch_ok = 1;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	/* Points are -A_0 .. -A_n-1, -R_0 .. -R_n-1 */
+	points = g_malloc (sizeof (*points) * n * 2);
+	scalars = g_malloc0 (n * 2 * 32);
+	slides = g_malloc (n * 2 * 256);
+	cached = g_malloc (sizeof (*cached) * n * 2 * 8);
+	memset (zero, 0, sizeof (zero));
+	memset (sb, 0, sizeof (sb));
+
+	for (i = 0; i < n && batch_ok; i ++) {
+		if (sigs[i][63] & 224) {
+			batch_ok = 0;
+			break;
+		}
+		if (ge_frombytes_negate_vartime (&points[i], pks[i]) != 0 ||
+				ge_frombytes_negate_vartime (&points[n + i], sigs[i]) != 0) {
+			batch_ok = 0;
+			break;
+		}
+
+		/* R must be encoded canonically as it is compared by encoding */
+		fe_neg (pos.X, points[n + i].X);
+		fe_copy (pos.Y, points[n + i].Y);
+		fe_copy (pos.Z, points[n + i].Z);
+		fe_neg (pos.T, points[n + i].T);
+		ge_p3_tobytes (rcheck, &pos);
+
+		if (memcmp (rcheck, sigs[i], sizeof (rcheck)) != 0) {
+			batch_ok = 0;
+			break;
+		}
+
+		for (d = 0, j = 0; j < 32; ++j) {
+			d |= pks[i][j];
+		}
+		if (d == 0) {
+			batch_ok = 0;
+			break;
+		}
+
+		g_assert (EVP_DigestInit (&sha_ctx, EVP_sha512()) == 1);
+		EVP_DigestUpdate (&sha_ctx, sigs[i], 32);
+		EVP_DigestUpdate (&sha_ctx, pks[i], 32);
+		EVP_DigestUpdate (&sha_ctx, m[i], mlen[i]);
+		EVP_DigestFinal (&sha_ctx, h, NULL);
+		sc_reduce (h);
+
+		/* z_i is stored as the scalar for R_i */
+		z = scalars + (n + i) * 32;
+		ottery_rand_bytes (z, 16);
+		/* z_i * h_i for A_i */
+		sc_muladd (scalars + i * 32, z, h, zero);
+		/* sum of z_i * s_i for B */
+		sc_muladd (sb, z, sigs[i] + 32, sb);
+	}
+
+	if (batch_ok) {
+		ge_multi_scalarmult_vartime (&R, sb, scalars, points, n * 2,
+				slides, cached);
+		ge_tobytes (rcheck, &R);
+		/* Encoding of the neutral element */
+		zero[0] = 1;
+		batch_ok = verify_32 (rcheck, zero) == 0;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (batch_ok) {
+			valid[i] = 1;
+		}
+		else {
+			valid[i] = ed_verify_ref (sigs[i], m[i], mlen[i], pks[i]) == 0;
+
+			if (!valid[i]) {
+				ret = -1;
+			}
+		}
+	}
+
+	g_free (points);
+	g_free (scalars);
+	g_free (slides);
+	g_free (cached);
+
+	return ret;
+}
@@ -19,6 +19,7 @@
 #include "keypair_private.h"
 #include "hash.h"
 #include "xxhash.h"
+#include "libutil/shared_cache.h"
 
 struct rspamd_keypair_elt {
 	struct rspamd_cryptobox_nm *nm;
@@ -27,6 +28,7 @@ struct rspamd_keypair_elt {
 
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	struct rspamd_shared_cache *shared;
 };
 
 static void
@@ -57,6 +59,13 @@ rspamd_keypair_equal (gconstpointer p1, gconstpointer p2)
 
 struct rspamd_keypair_cache *
 rspamd_keypair_cache_new (guint max_items)
+{
+	return rspamd_keypair_cache_new_shared (max_items, NULL);
+}
+
+struct rspamd_keypair_cache *
+rspamd_keypair_cache_new_shared (guint max_items,
+		struct rspamd_shared_cache *shared)
 {
 	struct rspamd_keypair_cache *c;
 
@@ -65,10 +74,61 @@ rspamd_keypair_cache_new (guint max_items)
 	c = g_slice_alloc (sizeof (*c));
 	c->hash = rspamd_lru_hash_new_full (max_items, NULL,
 			rspamd_keypair_destroy, rspamd_keypair_hash, rspamd_keypair_equal);
+	c->shared = shared;
 
 	return c;
 }
 
+static gboolean
+rspamd_keypair_cache_shared_lookup (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_elt *elt)
+{
+	guchar *nm;
+	gsize nmlen;
+
+	nm = rspamd_shared_cache_lookup (c->shared, elt->pair, sizeof (elt->pair),
+			time (NULL), &nmlen);
+
+	if (nm == NULL) {
+		return FALSE;
+	}
+
+	if (nmlen != sizeof (elt->nm->nm)) {
+		g_free (nm);
+
+		return FALSE;
+	}
+
+	memcpy (elt->nm->nm, nm, nmlen);
+	rspamd_explicit_memzero (nm, nmlen);
+	g_free (nm);
+
+	return TRUE;
+}
+
+static void
+rspamd_keypair_cache_calculate (struct rspamd_keypair_elt *elt,
+		struct rspamd_cryptobox_keypair *lk,
+		struct rspamd_cryptobox_pubkey *rk)
+{
+	if (rk->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
+		struct rspamd_cryptobox_pubkey_25519 *rk_25519 =
+				RSPAMD_CRYPTOBOX_PUBKEY_25519(rk);
+		struct rspamd_cryptobox_keypair_25519 *sk_25519 =
+				RSPAMD_CRYPTOBOX_KEYPAIR_25519(lk);
+
+		rspamd_cryptobox_nm (elt->nm->nm, rk_25519->pk, sk_25519->sk, rk->alg);
+	}
+	else {
+		struct rspamd_cryptobox_pubkey_nist *rk_nist =
+				RSPAMD_CRYPTOBOX_PUBKEY_NIST(rk);
+		struct rspamd_cryptobox_keypair_nist *sk_nist =
+				RSPAMD_CRYPTOBOX_KEYPAIR_NIST(lk);
+
+		rspamd_cryptobox_nm (elt->nm->nm, rk_nist->pk, sk_nist->sk, rk->alg);
+	}
+}
+
 void
 rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
@@ -106,21 +166,15 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		memcpy (&new->pair[rspamd_cryptobox_HASHBYTES], lk->id,
 				rspamd_cryptobox_HASHBYTES);
 
-		if (rk->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
-			struct rspamd_cryptobox_pubkey_25519 *rk_25519 =
-					RSPAMD_CRYPTOBOX_PUBKEY_25519(rk);
-			struct rspamd_cryptobox_keypair_25519 *sk_25519 =
-					RSPAMD_CRYPTOBOX_KEYPAIR_25519(lk);
-
-			rspamd_cryptobox_nm (new->nm->nm, rk_25519->pk, sk_25519->sk, rk->alg);
-		}
-		else {
-			struct rspamd_cryptobox_pubkey_nist *rk_nist =
-					RSPAMD_CRYPTOBOX_PUBKEY_NIST(rk);
-			struct rspamd_cryptobox_keypair_nist *sk_nist =
-					RSPAMD_CRYPTOBOX_KEYPAIR_NIST(lk);
+		if (c->shared == NULL || !rspamd_keypair_cache_shared_lookup (c, new)) {
+			rspamd_keypair_cache_calculate (new, lk, rk);
 
-			rspamd_cryptobox_nm (new->nm->nm, rk_nist->pk, sk_nist->sk, rk->alg);
+			if (c->shared != NULL) {
+				/* Let other processes use this secret */
+				rspamd_shared_cache_insert (c->shared, new->pair,
+						sizeof (new->pair), new->nm->nm, sizeof (new->nm->nm),
+						time (NULL), 0);
+			}
 		}
 
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
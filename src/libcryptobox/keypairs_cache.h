@@ -20,6 +20,7 @@
 #include "keypair.h"
 
 struct rspamd_keypair_cache;
+struct rspamd_shared_cache;
 
 /**
  * Create new keypair cache of the specified size
@@ -28,6 +29,16 @@ struct rspamd_keypair_cache;
  */
 struct rspamd_keypair_cache * rspamd_keypair_cache_new (guint max_items);
 
+/**
+ * Create new keypair cache of the specified size that also looks for the
+ * precomputed values in the cache shared among processes
+ * @param max_items defines maximum count of elements in the cache
+ * @param shared shared cache (if NULL, only the local cache is used)
+ * @return new cache
+ */
+struct rspamd_keypair_cache * rspamd_keypair_cache_new_shared (guint max_items,
+		struct rspamd_shared_cache *shared);
+
 
 /**
  * Process local and remote keypair setting beforenm value as appropriate
@@ -62,11 +62,39 @@ rspamd_email_address_unescape (struct rspamd_email_address *addr)
 	addr->flags |= RSPAMD_EMAIL_ADDR_USER_ALLOCATED;
 }
 
+static struct rspamd_email_address *
+rspamd_email_address_copy (const struct rspamd_email_address *addr)
+{
+	struct rspamd_email_address *ret;
+	gsize nlen;
+
+	ret = g_slice_alloc (sizeof (*ret));
+	memcpy (ret, addr, sizeof (*addr));
+
+	if ((ret->flags & RSPAMD_EMAIL_ADDR_QUOTED) && ret->addr[0] == '"') {
+		if (ret->flags & RSPAMD_EMAIL_ADDR_HAS_BACKSLASH) {
+			/* We also need to unquote user */
+			rspamd_email_address_unescape (ret);
+		}
+
+		/* We need to unquote addr */
+		nlen = ret->domain_len + ret->user_len + 2;
+		ret->addr = g_malloc (nlen + 1);
+		ret->addr_len = rspamd_snprintf ((char *)ret->addr, nlen, "%*s@%*s",
+				(gint)ret->user_len, ret->user,
+				(gint)ret->domain_len, ret->domain);
+		ret->flags |= RSPAMD_EMAIL_ADDR_ADDR_ALLOCATED;
+	}
+
+	REF_INIT_RETAIN (ret, rspamd_email_addr_dtor);
+
+	return ret;
+}
+
 struct rspamd_email_address *
 rspamd_email_address_from_smtp (const gchar *str, guint len)
 {
-	struct rspamd_email_address addr, *ret;
-	gsize nlen;
+	struct rspamd_email_address addr;
 
 	if (str == NULL || len == 0) {
 		return NULL;
@@ -75,30 +103,210 @@ rspamd_email_address_from_smtp (const gchar *str, guint len)
 	rspamd_smtp_addr_parse (str, len, &addr);
 
 	if (addr.flags & RSPAMD_EMAIL_ADDR_VALID) {
-		ret = g_slice_alloc (sizeof (*ret));
-		memcpy (ret, &addr, sizeof (addr));
+		return rspamd_email_address_copy (&addr);
+	}
+
+	return NULL;
+}
+
+static inline void
+rspamd_email_address_trim (const gchar **start, const gchar **end)
+{
+	while (*start < *end && g_ascii_isspace (**start)) {
+		(*start) ++;
+	}
+
+	while (*end > *start && g_ascii_isspace (*(*end - 1))) {
+		(*end) --;
+	}
+}
+
+/*
+ * Adds a single element of an address list, where lt and gt are the angle
+ * brackets and cmt and cmt_end are bounds of the first comment if any
+ */
+static void
+rspamd_email_address_add_mime (GPtrArray *res, const gchar *start,
+		const gchar *end, const gchar *lt, const gchar *gt,
+		const gchar *cmt, const gchar *cmt_end)
+{
+	struct rspamd_email_address addr;
+	const gchar *name = NULL, *name_end = NULL, *a, *a_end;
+
+	rspamd_email_address_trim (&start, &end);
+
+	if (start == end) {
+		return;
+	}
+
+	if (lt != NULL) {
+		/* name-addr: display name is the phrase before angle address */
+		name = start;
+		name_end = lt;
+		a = lt;
+		a_end = gt ? gt + 1 : end;
+	}
+	else if (cmt != NULL && cmt > start) {
+		/* addr-spec (comment), the comment is used as name */
+		a = start;
+		a_end = cmt;
+		name = cmt + 1;
+		name_end = cmt_end ? cmt_end : end;
+	}
+	else {
+		a = start;
+		a_end = end;
+	}
 
-		if ((ret->flags & RSPAMD_EMAIL_ADDR_QUOTED) && ret->addr[0] == '"') {
-			if (ret->flags & RSPAMD_EMAIL_ADDR_HAS_BACKSLASH) {
-				/* We also need to unquote user */
-				rspamd_email_address_unescape (ret);
+	rspamd_email_address_trim (&a, &a_end);
+	rspamd_smtp_addr_parse (a, a_end - a, &addr);
+
+	if (!(addr.flags & RSPAMD_EMAIL_ADDR_VALID)) {
+		/* Keep invalid address as is to be visible for rules */
+		memset (&addr, 0, sizeof (addr));
+		addr.addr = a;
+		addr.addr_len = a_end - a;
+	}
+
+	addr.raw = start;
+	addr.raw_len = end - start;
+
+	if (name) {
+		rspamd_email_address_trim (&name, &name_end);
+
+		if (name_end - name >= 2 && *name == '"' && *(name_end - 1) == '"') {
+			name ++;
+			name_end --;
+		}
+
+		addr.name = name;
+		addr.name_len = name_end - name;
+	}
+
+	g_ptr_array_add (res, rspamd_email_address_copy (&addr));
+}
+
+GPtrArray *
+rspamd_email_address_from_mime (rspamd_mempool_t *pool,
+		const gchar *hdr, guint len)
+{
+	GPtrArray *res;
+	const gchar *p, *end, *elt, *lt = NULL, *gt = NULL,
+		*cmt = NULL, *cmt_end = NULL;
+	gboolean in_quote = FALSE, in_angle = FALSE, seen_at = FALSE;
+	gint depth = 0;
+
+	res = g_ptr_array_sized_new (2);
+
+	if (pool) {
+		rspamd_mempool_add_destructor (pool,
+				(rspamd_mempool_destruct_t)rspamd_email_address_list_destroy,
+				res);
+	}
+
+	if (hdr == NULL) {
+		return res;
+	}
+
+	p = hdr;
+	elt = hdr;
+	end = hdr + len;
+
+	while (p < end) {
+		if (in_quote) {
+			if (*p == '\\' && p + 1 < end) {
+				p ++;
+			}
+			else if (*p == '"') {
+				in_quote = FALSE;
+			}
+		}
+		else if (depth > 0) {
+			if (*p == '\\' && p + 1 < end) {
+				p ++;
 			}
+			else if (*p == '(') {
+				depth ++;
+			}
+			else if (*p == ')') {
+				depth --;
 
-			/* We need to unquote addr */
-			nlen = ret->domain_len + ret->user_len + 2;
-			ret->addr = g_malloc (nlen + 1);
-			ret->addr_len = rspamd_snprintf ((char *)ret->addr, nlen, "%*s@%*s",
-					(gint)ret->user_len, ret->user,
-					(gint)ret->domain_len, ret->domain);
-			ret->flags |= RSPAMD_EMAIL_ADDR_ADDR_ALLOCATED;
+				if (depth == 0 && cmt_end == NULL) {
+					cmt_end = p;
+				}
+			}
+		}
+		else {
+			switch (*p) {
+			case '"':
+				in_quote = TRUE;
+				break;
+			case '(':
+				if (cmt == NULL) {
+					cmt = p;
+				}
+				depth ++;
+				break;
+			case '<':
+				if (!in_angle && lt == NULL) {
+					lt = p;
+				}
+				in_angle = TRUE;
+				break;
+			case '>':
+				if (in_angle && gt == NULL) {
+					gt = p;
+				}
+				in_angle = FALSE;
+				break;
+			case '@':
+				seen_at = TRUE;
+				break;
+			case ':':
+				if (!in_angle && lt == NULL && !seen_at) {
+					/* Group: display name is skipped, members follow */
+					elt = p + 1;
+					cmt = NULL;
+					cmt_end = NULL;
+				}
+				break;
+			case ',':
+			case ';':
+				if (!in_angle) {
+					rspamd_email_address_add_mime (res, elt, p, lt, gt,
+							cmt, cmt_end);
+					elt = p + 1;
+					lt = NULL;
+					gt = NULL;
+					cmt = NULL;
+					cmt_end = NULL;
+					seen_at = FALSE;
+				}
+				break;
+			default:
+				break;
+			}
 		}
 
-		REF_INIT_RETAIN (ret, rspamd_email_addr_dtor);
+		p ++;
+	}
+
+	rspamd_email_address_add_mime (res, elt, end, lt, gt, cmt, cmt_end);
+
+	return res;
+}
 
-		return ret;
+void
+rspamd_email_address_list_destroy (gpointer ptr)
+{
+	GPtrArray *ar = ptr;
+	guint i;
+
+	for (i = 0; i < ar->len; i ++) {
+		rspamd_email_address_unref (g_ptr_array_index (ar, i));
 	}
 
-	return NULL;
+	g_ptr_array_free (ar, TRUE);
 }
 
 struct rspamd_email_address *
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "ref.h"
+#include "mem_pool.h"
 
 struct raw_header;
 
@@ -62,6 +63,24 @@ struct rspamd_email_address {
 struct rspamd_email_address * rspamd_email_address_from_smtp (
 		const gchar *str, guint len);
 
+/**
+ * Parses RFC 5322 address list (e.g. from `From`, `To` or `Cc` headers),
+ * addresses and names point to the input that must stay alive; names are not
+ * decoded and invalid addresses have no RSPAMD_EMAIL_ADDR_VALID flag
+ * @param pool if not NULL, the result is destroyed with the pool
+ * @param hdr header value
+ * @param len length of header value
+ * @return array of struct rspamd_email_address
+ */
+GPtrArray * rspamd_email_address_from_mime (rspamd_mempool_t *pool,
+		const gchar *hdr, guint len);
+
+/**
+ * Destroys array of addresses returned by rspamd_email_address_from_mime
+ * @param ptr
+ */
+void rspamd_email_address_list_destroy (gpointer ptr);
+
 struct rspamd_email_address * rspamd_email_address_ref (
 		struct rspamd_email_address *addr);
 
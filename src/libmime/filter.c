@@ -24,6 +24,17 @@
 
 #define COMMON_PART_FACTOR 95
 
+/* Result inserted by a callback executed in a symbols cache thread */
+struct rspamd_deferred_result {
+	const gchar *symbol;
+	gdouble flag;
+	GList *opts;
+	gboolean single;
+};
+
+/* Queue of deferred results of the current thread if any */
+static GPrivate deferred_results = G_PRIVATE_INIT (NULL);
+
 struct metric_result *
 rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 {
@@ -45,14 +56,28 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	metric_res =
 			rspamd_mempool_alloc (task->task_pool,
 					sizeof (struct metric_result));
-	metric_res->symbols = g_hash_table_new (rspamd_str_hash,
-			rspamd_str_equal);
+	metric_res->cache = task->cfg->cache;
+
+	if (metric_res->cache) {
+		/* Symbols registered in the cache are found by their ids */
+		metric_res->nids = rspamd_symbols_cache_symbols_count (
+				metric_res->cache);
+		metric_res->symbols_by_id = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (struct symbol *) * metric_res->nids);
+	}
+	else {
+		metric_res->nids = 0;
+		metric_res->symbols_by_id = NULL;
+	}
+
+	metric_res->symbols = g_ptr_array_sized_new (32);
 	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
+			(rspamd_mempool_destruct_t) g_ptr_array_unref,
 			metric_res->symbols);
-	metric_res->sym_groups = g_hash_table_new (g_direct_hash, g_direct_equal);
+	metric_res->sym_groups = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_group_score));
 	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
+			(rspamd_mempool_destruct_t) g_array_unref,
 			metric_res->sym_groups);
 	metric_res->metric = metric;
 	metric_res->grow_factor = 0;
@@ -69,10 +94,90 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	return metric_res;
 }
 
+static struct symbol *
+rspamd_metric_result_find_unindexed (struct metric_result *mres,
+		const gchar *name)
+{
+	struct symbol *s;
+	guint i;
+
+	/* Symbols that are not registered in the cache are rare */
+	for (i = 0; i < mres->symbols->len; i ++) {
+		s = g_ptr_array_index (mres->symbols, i);
+
+		if ((s->id < 0 || (guint)s->id >= mres->nids) &&
+				strcmp (s->name, name) == 0) {
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+static struct symbol *
+rspamd_metric_result_find_symbol_id (struct metric_result *mres,
+		const gchar *name, gint id)
+{
+	if (id >= 0 && (guint)id < mres->nids) {
+		return mres->symbols_by_id[id];
+	}
+
+	return rspamd_metric_result_find_unindexed (mres, name);
+}
+
+struct symbol *
+rspamd_metric_result_find_symbol (struct metric_result *mres,
+		const gchar *name)
+{
+	gint id = -1;
+
+	if (mres->cache) {
+		id = rspamd_symbols_cache_find_symbol (mres->cache, name);
+	}
+
+	return rspamd_metric_result_find_symbol_id (mres, name, id);
+}
+
+void
+rspamd_metric_result_remove_symbol (struct metric_result *mres,
+		struct symbol *s)
+{
+	if (s->id >= 0 && (guint)s->id < mres->nids) {
+		mres->symbols_by_id[s->id] = NULL;
+	}
+
+	g_ptr_array_remove (mres->symbols, s);
+}
+
+static gdouble *
+rspamd_metric_result_group_score (struct metric_result *mres,
+		struct rspamd_symbols_group *gr)
+{
+	struct rspamd_group_score *gs, ngs;
+	guint i;
+
+	for (i = 0; i < mres->sym_groups->len; i ++) {
+		gs = &g_array_index (mres->sym_groups, struct rspamd_group_score, i);
+
+		if (gs->gr == gr) {
+			return &gs->score;
+		}
+	}
+
+	ngs.gr = gr;
+	ngs.score = 0;
+	g_array_append_val (mres->sym_groups, ngs);
+	gs = &g_array_index (mres->sym_groups, struct rspamd_group_score,
+			mres->sym_groups->len - 1);
+
+	return &gs->score;
+}
+
 static void
 insert_metric_result (struct rspamd_task *task,
 	struct metric *metric,
 	const gchar *symbol,
+	gint id,
 	double flag,
 	GList * opts,
 	gboolean single)
@@ -93,16 +198,6 @@ insert_metric_result (struct rspamd_task *task,
 	else {
 		w = (*sdef->weight_ptr) * flag;
 		gr = sdef->gr;
-
-		if (gr != NULL) {
-			gr_score = g_hash_table_lookup (metric_res->sym_groups, gr);
-
-			if (gr_score == NULL) {
-				gr_score = rspamd_mempool_alloc (task->task_pool, sizeof (gdouble));
-				*gr_score = 0;
-				g_hash_table_insert (metric_res->sym_groups, gr, gr_score);
-			}
-		}
 	}
 
 	if (task->settings) {
@@ -118,7 +213,9 @@ insert_metric_result (struct rspamd_task *task,
 	}
 
 	/* XXX: does not take grow factor into account */
-	if (gr != NULL && gr_score != NULL && gr->max_score > 0.0) {
+	if (gr != NULL && gr->max_score > 0.0) {
+		gr_score = rspamd_metric_result_group_score (metric_res, gr);
+
 		if (*gr_score >= gr->max_score) {
 			msg_info_task ("maximum group score %.2f for group %s has been reached,"
 					" ignoring symbol %s with weight %.2f", gr->max_score,
@@ -133,7 +230,8 @@ insert_metric_result (struct rspamd_task *task,
 	}
 
 	/* Add metric score */
-	if ((s = g_hash_table_lookup (metric_res->symbols, symbol)) != NULL) {
+	if ((s = rspamd_metric_result_find_symbol_id (metric_res, symbol,
+			id)) != NULL) {
 		if (sdef && (sdef->flags & RSPAMD_SYMBOL_FLAG_ONESHOT)) {
 			/*
 			 * For one shot symbols we do not need to add them again, so
@@ -186,6 +284,7 @@ insert_metric_result (struct rspamd_task *task,
 		s->score = w;
 		s->name = symbol;
 		s->def = sdef;
+		s->id = id;
 		metric_res->score += w;
 
 		if (opts) {
@@ -197,7 +296,11 @@ insert_metric_result (struct rspamd_task *task,
 			s->options = NULL;
 		}
 
-		g_hash_table_insert (metric_res->symbols, (gpointer) symbol, s);
+		if (id >= 0 && (guint)id < metric_res->nids) {
+			metric_res->symbols_by_id[id] = s;
+		}
+
+		g_ptr_array_add (metric_res->symbols, s);
 	}
 	msg_debug ("symbol %s, score %.2f, metric %s, factor: %f",
 		symbol,
@@ -214,7 +317,28 @@ insert_result_common (struct rspamd_task *task,
 	gboolean single)
 {
 	struct metric *metric;
+	struct rspamd_deferred_result *res;
 	GList *cur, *metric_list;
+	GQueue *deferred;
+	gint id = -1;
+
+	deferred = g_private_get (&deferred_results);
+
+	if (deferred != NULL) {
+		/* Results and shared counters are updated by the main thread */
+		res = g_malloc (sizeof (*res));
+		res->symbol = symbol;
+		res->flag = flag;
+		res->opts = opts;
+		res->single = single;
+		g_queue_push_tail (deferred, res);
+
+		return;
+	}
+
+	if (task->cfg->cache) {
+		id = rspamd_symbols_cache_find_symbol (task->cfg->cache, symbol);
+	}
 
 	metric_list = g_hash_table_lookup (task->cfg->metrics_symbols, symbol);
 	if (metric_list) {
@@ -222,7 +346,8 @@ insert_result_common (struct rspamd_task *task,
 
 		while (cur) {
 			metric = cur->data;
-			insert_metric_result (task, metric, symbol, flag, opts, single);
+			insert_metric_result (task, metric, symbol, id, flag, opts,
+					single);
 			cur = g_list_next (cur);
 		}
 	}
@@ -231,6 +356,7 @@ insert_result_common (struct rspamd_task *task,
 		insert_metric_result (task,
 			task->cfg->default_metric,
 			symbol,
+			id,
 			flag,
 			opts,
 			single);
@@ -247,6 +373,31 @@ insert_result_common (struct rspamd_task *task,
 	}
 }
 
+void
+rspamd_task_results_defer (GQueue *results)
+{
+	g_private_set (&deferred_results, results);
+}
+
+void
+rspamd_task_results_flush (struct rspamd_task *task, GQueue *results,
+		gboolean insert)
+{
+	struct rspamd_deferred_result *res;
+
+	while ((res = g_queue_pop_head (results)) != NULL) {
+		if (insert) {
+			insert_result_common (task, res->symbol, res->flag, res->opts,
+					res->single);
+		}
+		else if (res->opts) {
+			g_list_free (res->opts);
+		}
+
+		g_free (res);
+	}
+}
+
 /* Insert result that may be increased on next insertions */
 void
 rspamd_task_insert_result (struct rspamd_task *task,
@@ -267,6 +418,59 @@ rspamd_task_insert_result_single (struct rspamd_task *task,
 	insert_result_common (task, symbol, flag, opts, TRUE);
 }
 
+/* Insert result with the final score as it has been computed before */
+void
+rspamd_task_insert_result_score (struct rspamd_task *task,
+	const gchar *symbol,
+	double score,
+	GList * opts)
+{
+	struct metric *metric = task->cfg->default_metric;
+	struct metric_result *metric_res;
+	struct symbol *s;
+	gdouble *gr_score;
+	gint id = -1;
+
+	if (task->cfg->cache) {
+		id = rspamd_symbols_cache_find_symbol (task->cfg->cache, symbol);
+	}
+
+	metric_res = rspamd_create_metric_result (task, metric->name);
+
+	if ((s = rspamd_metric_result_find_symbol_id (metric_res, symbol,
+			id)) != NULL) {
+		/* Symbol has been already inserted, replace its score */
+		metric_res->score -= s->score;
+	}
+	else {
+		s = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct symbol));
+		s->name = symbol;
+		s->def = g_hash_table_lookup (metric->symbols, symbol);
+		s->id = id;
+
+		if (id >= 0 && (guint)id < metric_res->nids) {
+			metric_res->symbols_by_id[id] = s;
+		}
+
+		g_ptr_array_add (metric_res->symbols, s);
+	}
+
+	if (s->def && s->def->gr && s->def->gr->max_score > 0.0) {
+		gr_score = rspamd_metric_result_group_score (metric_res, s->def->gr);
+		*gr_score += score - s->score;
+	}
+
+	s->score = score;
+	metric_res->score += score;
+
+	if (opts) {
+		s->options = g_list_copy (opts);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) g_list_free, s->options);
+		g_list_free (opts);
+	}
+}
+
 gboolean
 rspamd_action_from_str (const gchar *data, gint *result)
 {
@@ -22,6 +22,15 @@ struct symbol {
 	GList *options;                                 /**< list of symbol's options				*/
 	const gchar *name;
 	struct rspamd_symbol_def *def;					/**< symbol configuration					*/
+	gint id;										/**< id of symbol in the symbols cache		*/
+};
+
+/**
+ * Score of symbols group with the maximum score
+ */
+struct rspamd_group_score {
+	struct rspamd_symbols_group *gr;
+	gdouble score;
 };
 
 /**
@@ -31,8 +40,11 @@ struct metric_result {
 	struct metric *metric;                          /**< pointer to metric structure			*/
 	double score;                                   /**< total score							*/
 	double grow_factor;								/**< current grow factor					*/
-	GHashTable *symbols;                            /**< symbols of metric						*/
-	GHashTable *sym_groups;							/**< groups of symbols						*/
+	struct symbols_cache *cache;					/**< cache used to resolve symbols ids		*/
+	struct symbol **symbols_by_id;					/**< symbols indexed by cache id			*/
+	guint nids;										/**< size of symbols_by_id					*/
+	GPtrArray *symbols;                             /**< symbols of metric in insertion order	*/
+	GArray *sym_groups;								/**< scores of limited groups				*/
 	gdouble actions_limits[METRIC_ACTION_MAX];		/**< set of actions for this metric			*/
 	enum rspamd_metric_action action;               /**< the current action						*/
 };
@@ -46,6 +58,23 @@ struct metric_result {
 struct metric_result * rspamd_create_metric_result (struct rspamd_task *task,
 		const gchar *name);
 
+/**
+ * Find symbol in the metric result
+ * @param mres metric result
+ * @param name name of symbol
+ * @return symbol or NULL if symbol `name` has not been inserted
+ */
+struct symbol * rspamd_metric_result_find_symbol (struct metric_result *mres,
+		const gchar *name);
+
+/**
+ * Remove symbol from the metric result (score is not changed)
+ * @param mres metric result
+ * @param s symbol to remove
+ */
+void rspamd_metric_result_remove_symbol (struct metric_result *mres,
+		struct symbol *s);
+
 /**
  * Insert a result to task
  * @param task worker's task that present message from user
@@ -72,6 +101,38 @@ void rspamd_task_insert_result_single (struct rspamd_task *task,
 	double flag,
 	GList *opts);
 
+/**
+ * Insert a result with the exact score to the default metric of task,
+ * neither weights nor settings are applied to it
+ * @param task worker's task that present message from user
+ * @param symbol symbol to insert
+ * @param score final score of symbol
+ * @param opts list of symbol's options
+ */
+void rspamd_task_insert_result_score (struct rspamd_task *task,
+	const gchar *symbol,
+	double score,
+	GList *opts);
+
+/**
+ * Makes the calling thread collect results inserted by
+ * `rspamd_task_insert_result` and `rspamd_task_insert_result_single` in
+ * `results` instead of inserting them to the task, so results and shared
+ * counters are modified merely by the main thread
+ * @param results queue for results or NULL to insert results directly again
+ */
+void rspamd_task_results_defer (GQueue *results);
+
+/**
+ * Inserts results collected by a thread to the task or frees them, it must
+ * be called from the main thread when the collecting thread is done
+ * @param task task of results
+ * @param results queue of collected results, it is emptied
+ * @param insert insert results if TRUE, just free them otherwise
+ */
+void rspamd_task_results_flush (struct rspamd_task *task, GQueue *results,
+		gboolean insert);
+
 /**
  * Default consolidation function for metric, it get all symbols and multiply symbol
  * weight by some factor that is specified in config. Default factor is 1.
@@ -25,7 +25,11 @@ static const guint8 jpg_sig2[] = {'J', 'F', 'I', 'F'};
 static const guint8 gif_signature[] = {'G', 'I', 'F', '8'};
 static const guint8 bmp_signature[] = {'B', 'M'};
 
-static void process_image (struct rspamd_task *task, struct mime_part *part);
+/* Type and dimensions of all supported images are in the leading bytes */
+#define RSPAMD_IMAGE_HEAD_SIZE 1024
+
+static void process_image (struct rspamd_task *task, struct mime_part *part,
+		const guint8 *data, gsize len);
 
 
 void
@@ -33,39 +37,45 @@ rspamd_images_process (struct rspamd_task *task)
 {
 	guint i;
 	struct mime_part *part;
+	guint8 head[RSPAMD_IMAGE_HEAD_SIZE];
+	gsize len;
 
 	for (i = 0; i < task->parts->len; i ++) {
 		part = g_ptr_array_index (task->parts, i);
-		if (g_mime_content_type_is_type (part->type, "image",
-			"*") && part->content->len > 0) {
-			process_image (task, part);
+
+		if (g_mime_content_type_is_type (part->type, "image", "*")) {
+			len = rspamd_mime_part_get_head (part, head, sizeof (head));
+
+			if (len > 0) {
+				process_image (task, part, head, len);
+			}
 		}
 	}
 
 }
 
 static enum rspamd_image_type
-detect_image_type (GByteArray *data)
+detect_image_type (const guint8 *data, gsize len)
 {
-	if (data->len > sizeof (png_signature) / sizeof (png_signature[0])) {
-		if (memcmp (data->data, png_signature, sizeof (png_signature)) == 0) {
+	if (len > sizeof (png_signature) / sizeof (png_signature[0])) {
+		if (memcmp (data, png_signature, sizeof (png_signature)) == 0) {
 			return IMAGE_TYPE_PNG;
 		}
 	}
-	if (data->len > 10) {
-		if (memcmp (data->data, jpg_sig1, sizeof (jpg_sig1)) == 0) {
-			if (memcmp (data->data + 6, jpg_sig2, sizeof (jpg_sig2)) == 0) {
+	if (len > 10) {
+		if (memcmp (data, jpg_sig1, sizeof (jpg_sig1)) == 0) {
+			if (memcmp (data + 6, jpg_sig2, sizeof (jpg_sig2)) == 0) {
 				return IMAGE_TYPE_JPG;
 			}
 		}
 	}
-	if (data->len > sizeof (gif_signature) / sizeof (gif_signature[0])) {
-		if (memcmp (data->data, gif_signature, sizeof (gif_signature)) == 0) {
+	if (len > sizeof (gif_signature) / sizeof (gif_signature[0])) {
+		if (memcmp (data, gif_signature, sizeof (gif_signature)) == 0) {
 			return IMAGE_TYPE_GIF;
 		}
 	}
-	if (data->len > sizeof (bmp_signature) / sizeof (bmp_signature[0])) {
-		if (memcmp (data->data, bmp_signature, sizeof (bmp_signature)) == 0) {
+	if (len > sizeof (bmp_signature) / sizeof (bmp_signature[0])) {
+		if (memcmp (data, bmp_signature, sizeof (bmp_signature)) == 0) {
 			return IMAGE_TYPE_BMP;
 		}
 	}
@@ -75,20 +85,21 @@ detect_image_type (GByteArray *data)
 
 
 static struct rspamd_image *
-process_png_image (struct rspamd_task *task, GByteArray *data)
+process_png_image (struct rspamd_task *task, struct mime_part *part,
+		const guint8 *data, gsize len)
 {
 	struct rspamd_image *img;
 	guint32 t;
-	guint8 *p;
+	const guint8 *p;
 
-	if (data->len < 24) {
+	if (len < 24) {
 		msg_info_task ("bad png detected (maybe striped)");
 		return NULL;
 	}
 
 	/* In png we should find iHDR section and get data from it */
 	/* Skip signature and read header section */
-	p = data->data + 12;
+	p = data + 12;
 	if (memcmp (p, "IHDR", 4) != 0) {
 		msg_info_task ("png doesn't begins with IHDR section");
 		return NULL;
@@ -96,7 +107,7 @@ process_png_image (struct rspamd_task *task, GByteArray *data)
 
 	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_PNG;
-	img->data = data;
+	img->part = part;
 
 	p += 4;
 	memcpy (&t, p, sizeof (guint32));
@@ -109,19 +120,20 @@ process_png_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_jpg_image (struct rspamd_task *task, GByteArray *data)
+process_jpg_image (struct rspamd_task *task, struct mime_part *part,
+		const guint8 *data, gsize len)
 {
-	guint8 *p;
+	const guint8 *p;
 	guint16 t;
 	gsize remain;
 	struct rspamd_image *img;
 
 	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_JPG;
-	img->data = data;
+	img->part = part;
 
-	p = data->data;
-	remain = data->len;
+	p = data;
+	remain = len;
 	/* In jpeg we should find any data stream (ff c0 .. ff c3) and extract its height and width */
 	while (remain--) {
 		if (*p == 0xFF && remain > 8 &&
@@ -139,22 +151,23 @@ process_jpg_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_gif_image (struct rspamd_task *task, GByteArray *data)
+process_gif_image (struct rspamd_task *task, struct mime_part *part,
+		const guint8 *data, gsize len)
 {
 	struct rspamd_image *img;
-	guint8 *p;
+	const guint8 *p;
 	guint16 t;
 
-	if (data->len < 10) {
+	if (len < 10) {
 		msg_info_task ("bad gif detected (maybe striped)");
 		return NULL;
 	}
 
 	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_GIF;
-	img->data = data;
+	img->part = part;
 
-	p = data->data + 6;
+	p = data + 6;
 	memcpy (&t, p,	   sizeof (guint16));
 	img->width = GUINT16_FROM_LE (t);
 	memcpy (&t, p + 2, sizeof (guint16));
@@ -164,21 +177,22 @@ process_gif_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_bmp_image (struct rspamd_task *task, GByteArray *data)
+process_bmp_image (struct rspamd_task *task, struct mime_part *part,
+		const guint8 *data, gsize len)
 {
 	struct rspamd_image *img;
 	gint32 t;
-	guint8 *p;
+	const guint8 *p;
 
-	if (data->len < 28) {
+	if (len < 28) {
 		msg_info_task ("bad bmp detected (maybe striped)");
 		return NULL;
 	}
 
 	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_BMP;
-	img->data = data;
-	p = data->data + 18;
+	img->part = part;
+	p = data + 18;
 	memcpy (&t, p,	   sizeof (gint32));
 	img->width = abs (GINT32_FROM_LE (t));
 	memcpy (&t, p + 4, sizeof (gint32));
@@ -188,29 +202,38 @@ process_bmp_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static void
-process_image (struct rspamd_task *task, struct mime_part *part)
+process_image (struct rspamd_task *task, struct mime_part *part,
+		const guint8 *data, gsize len)
 {
 	enum rspamd_image_type type;
 	struct rspamd_image *img = NULL;
 	struct raw_header *rh;
 	struct mime_text_part *tp;
 	struct html_image *himg;
+	GByteArray *content;
 	const gchar *cid, *html_cid;
 	guint cid_len, i, j;
 
-	if ((type = detect_image_type (part->content)) != IMAGE_TYPE_UNKNOWN) {
+	if ((type = detect_image_type (data, len)) != IMAGE_TYPE_UNKNOWN) {
 		switch (type) {
 		case IMAGE_TYPE_PNG:
-			img = process_png_image (task, part->content);
+			img = process_png_image (task, part, data, len);
 			break;
 		case IMAGE_TYPE_JPG:
-			img = process_jpg_image (task, part->content);
+			img = process_jpg_image (task, part, data, len);
+
+			if (img == NULL && len == RSPAMD_IMAGE_HEAD_SIZE) {
+				/* Frame header follows large metadata segments */
+				content = rspamd_mime_part_get_content (part);
+				img = process_jpg_image (task, part, content->data,
+						content->len);
+			}
 			break;
 		case IMAGE_TYPE_GIF:
-			img = process_gif_image (task, part->content);
+			img = process_gif_image (task, part, data, len);
 			break;
 		case IMAGE_TYPE_BMP:
-			img = process_bmp_image (task, part->content);
+			img = process_bmp_image (task, part, data, len);
 			break;
 		default:
 			img = NULL;
@@ -275,6 +298,14 @@ process_image (struct rspamd_task *task, struct mime_part *part)
 	}
 }
 
+GByteArray *
+rspamd_image_get_data (struct rspamd_image *img)
+{
+	g_assert (img != NULL);
+
+	return rspamd_mime_part_get_content (img->part);
+}
+
 const gchar *
 rspamd_image_type_str (enum rspamd_image_type type)
 {
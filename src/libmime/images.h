@@ -5,6 +5,7 @@
 #include "rspamd.h"
 
 struct html_image;
+struct mime_part;
 
 enum rspamd_image_type {
 	IMAGE_TYPE_PNG = 0,
@@ -16,7 +17,7 @@ enum rspamd_image_type {
 
 struct rspamd_image {
 	enum rspamd_image_type type;
-	GByteArray *data;
+	struct mime_part *part; /**< content is decoded by rspamd_image_get_data */
 	guint32 width;
 	guint32 height;
 	const gchar *filename;
@@ -28,6 +29,12 @@ struct rspamd_image {
  */
 void rspamd_images_process (struct rspamd_task *task);
 
+/*
+ * Get decoded content of an image, it is decoded on the first call as image
+ * metadata is extracted from the leading bytes only
+ */
+GByteArray * rspamd_image_get_data (struct rspamd_image *img);
+
 /*
  * Get textual representation of an image's type
  */
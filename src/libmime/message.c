@@ -25,6 +25,7 @@
 #include "utlist.h"
 #include "tokenizers/tokenizers.h"
 #include "xxhash.h"
+#include "cryptobox.h"
 
 #ifdef WITH_SNOWBALL
 #include "libstemmer.h"
@@ -117,7 +118,7 @@ parse_recv_header (rspamd_mempool_t * pool,
 		return;
 	}
 
-	g_strstrip (line);
+	/* Line is stripped when headers are collected */
 	p = line;
 	s = line;
 
@@ -381,6 +382,25 @@ parse_recv_header (rspamd_mempool_t * pool,
 	return;
 }
 
+struct received_header *
+rspamd_message_get_received (struct rspamd_task *task, guint idx)
+{
+	struct received_header *recv;
+
+	if (idx >= task->received->len) {
+		return NULL;
+	}
+
+	recv = g_ptr_array_index (task->received, idx);
+
+	if (!recv->parsed) {
+		recv->parsed = TRUE;
+		parse_recv_header (task->task_pool, recv->hdr, recv);
+	}
+
+	return recv;
+}
+
 static void
 append_raw_header (struct rspamd_task *task,
 		GHashTable *target, struct raw_header *rh)
@@ -399,6 +419,26 @@ append_raw_header (struct rspamd_task *task,
 	msg_debug_task ("add raw header %s: %s", rh->name, rh->value);
 }
 
+/*
+ * Most of headers have neither encoded words nor 8 bit characters, and
+ * for them gmime decoding returns just a copy of value
+ */
+static gboolean
+rspamd_header_needs_decode (const gchar *value)
+{
+	const guchar *p = (const guchar *)value;
+
+	while (*p != '\0') {
+		if (*p & 0x80 || (*p == '=' && p[1] == '?')) {
+			return TRUE;
+		}
+
+		p ++;
+	}
+
+	return FALSE;
+}
+
 /* Convert raw headers to a list of struct raw_header * */
 static void
 process_raw_headers (struct rspamd_task *task, GHashTable *target,
@@ -546,14 +586,21 @@ process_raw_headers (struct rspamd_task *task, GHashTable *target,
 			}
 
 			new->value = tmp;
-			new->decoded = g_mime_utils_header_decode_text (new->value);
 
-			if (new->decoded != NULL) {
-				rspamd_mempool_add_destructor (task->task_pool,
-						(rspamd_mempool_destruct_t)g_free, new->decoded);
+			if (rspamd_header_needs_decode (new->value)) {
+				new->decoded = g_mime_utils_header_decode_text (new->value);
+
+				if (new->decoded != NULL) {
+					rspamd_mempool_add_destructor (task->task_pool,
+							(rspamd_mempool_destruct_t)g_free, new->decoded);
+				}
+				else {
+					new->decoded = "";
+				}
 			}
 			else {
-				new->decoded = "";
+				/* Plain ASCII header is decoded to itself */
+				new->decoded = new->value;
 			}
 
 			append_raw_header (task, target, new);
@@ -689,6 +736,52 @@ converter_error_quark (void)
 	return g_quark_from_static_string ("conversion error");
 }
 
+/* Limit of cached converters as charsets come from untrusted input */
+#define RSPAMD_CONVERTERS_MAX 64
+
+static GHashTable *converters = NULL;
+
+/*
+ * Returns converter from `in_enc` to utf8 that is reset to its initial state,
+ * converters are cached per process (failures are cached as well)
+ */
+static iconv_t
+rspamd_converter_get (const gchar *in_enc, gboolean *cached)
+{
+	gpointer key, value;
+	iconv_t ic;
+
+	if (converters == NULL) {
+		converters = g_hash_table_new_full (rspamd_strcase_hash,
+				rspamd_strcase_equal, g_free, NULL);
+	}
+
+	if (g_hash_table_lookup_extended (converters, in_enc, &key, &value)) {
+		ic = (iconv_t)value;
+
+		if (ic != (iconv_t)-1) {
+			/* Reset shift state */
+			iconv (ic, NULL, NULL, NULL, NULL);
+		}
+
+		*cached = TRUE;
+
+		return ic;
+	}
+
+	ic = iconv_open (UTF8_CHARSET, in_enc);
+
+	if (g_hash_table_size (converters) < RSPAMD_CONVERTERS_MAX) {
+		g_hash_table_insert (converters, g_strdup (in_enc), (gpointer)ic);
+		*cached = TRUE;
+	}
+	else {
+		*cached = FALSE;
+	}
+
+	return ic;
+}
+
 static gchar *
 rspamd_text_to_utf8 (struct rspamd_task *task,
 		gchar *input, gsize len, const gchar *in_enc,
@@ -699,8 +792,9 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 	iconv_t ic;
 	rspamd_fstring_t *dst;
 	gsize remain, ret, inremain = len;
+	gboolean cached;
 
-	ic = iconv_open (UTF8_CHARSET, in_enc);
+	ic = rspamd_converter_get (in_enc, &cached);
 
 	if (ic == (iconv_t)-1) {
 		g_set_error (err, converter_error_quark(), EINVAL,
@@ -748,7 +842,11 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 
 	*d = '\0';
 	*olen = dst->len;
-	iconv_close (ic);
+
+	if (!cached) {
+		iconv_close (ic);
+	}
+
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t)rspamd_fstring_free, dst);
 	msg_info_task ("converted from %s to UTF-8 inlen: %z, outlen: %z",
@@ -796,7 +894,7 @@ convert_text_to_utf (struct rspamd_task *task,
 	}
 
 	if (rspamd_regexp_match (utf_compatible_re, ocharset, strlen (ocharset), TRUE)) {
-		if (g_utf8_validate (part_content->data, part_content->len, NULL)) {
+		if (rspamd_fast_utf8_validate (part_content->data, part_content->len)) {
 			SET_PART_UTF (text_part);
 			return part_content;
 		}
@@ -929,42 +1027,12 @@ detect_text_language (struct mime_text_part *part)
 			{ "nqo", "", G_UNICODE_SCRIPT_NKO }
 	};
 	const struct language_match *lm;
-	const int max_chars = 32;
+	GUnicodeScript sel;
 
 	if (part != NULL) {
 		if (IS_PART_UTF (part)) {
-			/* Try to detect encoding by several symbols */
-			const gchar *p, *pp;
-			gunichar c;
-			gint32 remain = part->content->len, max = 0, processed = 0;
-			gint32 scripts[G_N_ELEMENTS (language_codes)];
-			GUnicodeScript scc, sel = G_UNICODE_SCRIPT_COMMON;
-
-			p = part->content->data;
-			memset (scripts, 0, sizeof (scripts));
-
-			while (remain > 0 && processed < max_chars) {
-				c = g_utf8_get_char_validated (p, remain);
-				if (c == (gunichar) -2 || c == (gunichar) -1) {
-					break;
-				}
-				if (g_unichar_isalpha (c)) {
-					scc = g_unichar_get_script (c);
-					if (scc < (gint)G_N_ELEMENTS (scripts)) {
-						scripts[scc]++;
-					}
-					processed ++;
-				}
-				pp = g_utf8_next_char (p);
-				remain -= pp - p;
-				p = pp;
-			}
-			for (remain = 0; remain < (gint)G_N_ELEMENTS (scripts); remain++) {
-				if (scripts[remain] > max) {
-					max = scripts[remain];
-					sel = remain;
-				}
-			}
+			/* Scripts are classified when the part is processed */
+			sel = part->scripts.script;
 			part->script = sel;
 			lm = bsearch (&sel, language_codes, G_N_ELEMENTS (language_codes),
 					sizeof (language_codes[0]), &language_elts_cmp);
@@ -1086,55 +1154,142 @@ rspamd_normalize_text_part (struct rspamd_task *task,
 #endif
 }
 
-#define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
+struct rspamd_word_pos {
+	guint64 h;
+	guint pos;
+};
 
+static gint
+rspamd_word_pos_cmp (const void *a, const void *b)
+{
+	const struct rspamd_word_pos *w1 = a, *w2 = b;
+
+	if (w1->h != w2->h) {
+		return w1->h < w2->h ? -1 : 1;
+	}
+
+	return (gint)w1->pos - (gint)w2->pos;
+}
+
+static inline guint
+rspamd_popcount64 (guint64 v)
+{
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+	return (v * 0x0101010101010101ULL) >> 56;
+}
+
+/*
+ * Cost of replacement is twice higher than cost of add/delete to calculate
+ * percentage properly, hence distance is len1 + len2 - 2 * LCS. LCS is
+ * calculated by the bit-parallel algorithm: for each word of the second part
+ * V = (V + (V & M)) | (V & ~M), where M is a bitmap of positions of this word
+ * in the first part and LCS is the number of zero bits in V, so it takes
+ * O(len1 * len2 / 64) operations instead of O(len1 * len2)
+ */
 static guint
 rspamd_words_levenshtein_distance (struct rspamd_task *task,
 		GArray *w1, GArray *w2)
 {
-	guint s1len, s2len, x, y, lastdiag, olddiag;
-	guint *column, ret;
-	guint64 *h1, *h2;
-	gint eq;
+	guint s1len, s2len, nwords, x, i, lo, hi, mid, lcs = 0;
+	guint64 *v, *m, h, sum, tmp, vi, ui, carry;
+	struct rspamd_word_pos *pos, *cur;
+	GArray *t;
 	static const guint max_words = 8192;
 
+	/* Bitmap is built for the shorter part */
+	if (w1->len > w2->len) {
+		t = w1;
+		w1 = w2;
+		w2 = t;
+	}
+
 	s1len = w1->len;
 	s2len = w2->len;
 
 	if (s1len + s2len > max_words) {
 		msg_err_task ("cannot compare parts with more than %ud words: %ud",
-				max_words, s1len);
+				max_words, s1len + s2len);
 		return 0;
 	}
 
-	column = g_malloc0 ((s1len + 1) * sizeof (guint));
+	if (s1len == 0) {
+		return s2len;
+	}
 
-	for (y = 1; y <= s1len; y++) {
-		column[y] = y;
+	if (s1len == s2len && memcmp (w1->data, w2->data,
+			s1len * sizeof (guint64)) == 0) {
+		return 0;
 	}
 
-	for (x = 1; x <= s2len; x++) {
-		column[0] = x;
+	nwords = (s1len + 63) / 64;
+	v = g_malloc (nwords * 2 * sizeof (guint64));
+	m = v + nwords;
+	memset (v, 0xff, nwords * sizeof (guint64));
+	memset (m, 0, nwords * sizeof (guint64));
 
-		for (y = 1, lastdiag = x - 1; y <= s1len; y++) {
-			olddiag = column[y];
-			h1 = &g_array_index (w1, guint64, y - 1);
-			h2 = &g_array_index (w2, guint64, x - 1);
-			eq = h1 == h2;
-			/*
-			 * Cost of replacement is twice higher than cost of add/delete
-			 * to calculate percentage properly
-			 */
-			column[y] = MIN3 (column[y] + 1, column[y - 1] + 1,
-					lastdiag + (eq * 2));
-			lastdiag = olddiag;
+	pos = g_malloc (s1len * sizeof (*pos));
+
+	for (i = 0; i < s1len; i ++) {
+		pos[i].h = g_array_index (w1, guint64, i);
+		pos[i].pos = i;
+	}
+
+	qsort (pos, s1len, sizeof (*pos), rspamd_word_pos_cmp);
+
+	for (x = 0; x < s2len; x ++) {
+		h = g_array_index (w2, guint64, x);
+		/* Find the first position of this word */
+		lo = 0;
+		hi = s1len;
+
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+
+			if (pos[mid].h < h) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		if (lo == s1len || pos[lo].h != h) {
+			/* Word is not in the first part, V is unchanged */
+			continue;
+		}
+
+		for (cur = &pos[lo]; cur < pos + s1len && cur->h == h; cur ++) {
+			m[cur->pos / 64] |= 1ULL << (cur->pos % 64);
+		}
+
+		for (i = 0, carry = 0; i < nwords; i ++) {
+			vi = v[i];
+			ui = vi & m[i];
+			tmp = vi + ui;
+			sum = tmp + carry;
+			carry = (tmp < vi) || (sum < tmp);
+			v[i] = sum | (vi & ~m[i]);
+			m[i] = 0;
 		}
 	}
 
-	ret = column[s1len];
-	g_free (column);
+	for (i = 0; i < nwords; i ++) {
+		vi = ~v[i];
 
-	return ret;
+		if (i == nwords - 1 && s1len % 64 != 0) {
+			vi &= (1ULL << (s1len % 64)) - 1;
+		}
+
+		lcs += rspamd_popcount64 (vi);
+	}
+
+	g_free (pos);
+	g_free (v);
+
+	return s1len + s2len - lcs * 2;
 }
 
 static gboolean
@@ -1160,6 +1315,29 @@ rspamd_check_gtube (struct rspamd_task *task, struct mime_text_part *part)
 	return FALSE;
 }
 
+/*
+ * Truncates text to the `max_text_part_size` budget keeping utf8 sequences
+ * intact, so boundaries of the truncated text are still valid
+ */
+static void
+rspamd_message_limit_text (struct rspamd_task *task, GByteArray *content)
+{
+	gsize len, limit = task->cfg->max_text_part_size;
+
+	if (limit == 0 || content == NULL || content->len <= limit) {
+		return;
+	}
+
+	len = limit;
+
+	while (len > 0 && (content->data[len] & 0xC0) == 0x80) {
+		len --;
+	}
+
+	g_byte_array_set_size (content, len);
+	rspamd_task_set_limited (task, RSPAMD_TASK_LIMIT_TEXT);
+}
+
 static void
 process_text_part (struct rspamd_task *task,
 	GByteArray *part_content,
@@ -1171,6 +1349,7 @@ process_text_part (struct rspamd_task *task,
 	struct mime_text_part *text_part;
 	const gchar *cd, *p, *c;
 	guint remain;
+	gdouble t1 = 0;
 
 	/* Skip attachments */
 #ifndef GMIME24
@@ -1211,12 +1390,19 @@ process_text_part (struct rspamd_task *task,
 				text_part->orig,
 				type,
 				text_part);
+		rspamd_message_limit_text (task, part_content);
 		text_part->html = rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (*text_part->html));
+		text_part->html->max_tags = task->cfg->max_html_tags;
 		text_part->parent = parent;
 		text_part->mime_part = mime_part;
 
 		text_part->flags |= RSPAMD_MIME_PART_FLAG_BALANCED;
+
+		if (task->profile) {
+			t1 = rspamd_get_ticks ();
+		}
+
 		text_part->content = rspamd_html_process_part_full (
 				task->task_pool,
 				text_part->html,
@@ -1225,6 +1411,14 @@ process_text_part (struct rspamd_task *task,
 				task->urls,
 				task->emails);
 
+		if (task->profile) {
+			task->profile->html += rspamd_get_ticks () - t1;
+		}
+
+		if (text_part->html->flags & RSPAMD_HTML_FLAG_TOO_MANY_TAGS) {
+			rspamd_task_set_limited (task, RSPAMD_TASK_LIMIT_HTML_TAGS);
+		}
+
 		if (text_part->content->len == 0) {
 			text_part->flags |= RSPAMD_MIME_PART_FLAG_EMPTY;
 		}
@@ -1262,7 +1456,17 @@ process_text_part (struct rspamd_task *task,
 				type,
 				text_part);
 		text_part->orig = part_content;
+		rspamd_message_limit_text (task, text_part->content);
+
+		if (task->profile) {
+			t1 = rspamd_get_ticks ();
+		}
+
 		rspamd_url_text_extract (task->task_pool, task, text_part, FALSE);
+
+		if (task->profile) {
+			task->profile->urls += rspamd_get_ticks () - t1;
+		}
 		g_ptr_array_add (task->text_parts, text_part);
 	}
 	else {
@@ -1287,6 +1491,10 @@ process_text_part (struct rspamd_task *task,
 	}
 
 	/* Post process part */
+	rspamd_str_charclass_stats (text_part->content->data,
+			text_part->content->len, &text_part->charclass);
+	rspamd_str_script_stats (text_part->content->data,
+			text_part->content->len, &text_part->scripts);
 	detect_text_language (text_part);
 	rspamd_normalize_text_part (task, text_part);
 
@@ -1306,6 +1514,387 @@ process_text_part (struct rspamd_task *task,
 	}
 }
 
+/*
+ * Locates encoded content of a leaf part in the input: parser persists the
+ * input stream, so part's stream is a memory substream sharing its buffer
+ */
+static void
+rspamd_mime_part_index_content (struct mime_part *part)
+{
+	GMimeDataWrapper *wrapper;
+	GMimeStream *raw_stream;
+	GByteArray *buf;
+	gint64 start, end;
+
+	part->cte = RSPAMD_CTE_UNKNOWN;
+
+	if (!GMIME_IS_PART (part->mime)) {
+		return;
+	}
+
+	wrapper = g_mime_part_get_content_object (GMIME_PART (part->mime));
+#ifdef GMIME24
+	if (wrapper == NULL || !GMIME_IS_DATA_WRAPPER (wrapper)) {
+#else
+	if (wrapper == NULL) {
+#endif
+		return;
+	}
+
+	switch (g_mime_data_wrapper_get_encoding (wrapper)) {
+#ifdef GMIME24
+	case GMIME_CONTENT_ENCODING_DEFAULT:
+	case GMIME_CONTENT_ENCODING_7BIT:
+	case GMIME_CONTENT_ENCODING_8BIT:
+	case GMIME_CONTENT_ENCODING_BINARY:
+		part->cte = RSPAMD_CTE_8BIT;
+		break;
+	case GMIME_CONTENT_ENCODING_BASE64:
+		part->cte = RSPAMD_CTE_B64;
+		break;
+	case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+		part->cte = RSPAMD_CTE_QP;
+		break;
+#else
+	case GMIME_PART_ENCODING_DEFAULT:
+	case GMIME_PART_ENCODING_7BIT:
+	case GMIME_PART_ENCODING_8BIT:
+	case GMIME_PART_ENCODING_BINARY:
+		part->cte = RSPAMD_CTE_8BIT;
+		break;
+	case GMIME_PART_ENCODING_BASE64:
+		part->cte = RSPAMD_CTE_B64;
+		break;
+	case GMIME_PART_ENCODING_QUOTEDPRINTABLE:
+		part->cte = RSPAMD_CTE_QP;
+		break;
+#endif
+	default:
+		/* Uuencode and other exotic encodings are left for GMime */
+		break;
+	}
+
+	if (part->cte != RSPAMD_CTE_UNKNOWN) {
+		raw_stream = g_mime_data_wrapper_get_stream (wrapper);
+
+		if (raw_stream != NULL && GMIME_IS_STREAM_MEM (raw_stream)) {
+			buf = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (raw_stream));
+			start = raw_stream->bound_start;
+			end = raw_stream->bound_end;
+
+			if (buf != NULL && end < 0) {
+				end = buf->len;
+			}
+
+			if (buf != NULL && start >= 0 && start <= end &&
+					end <= (gint64)buf->len) {
+				part->raw_data.begin = (const gchar *)buf->data + start;
+				part->raw_data.len = end - start;
+			}
+		}
+
+		if (part->raw_data.begin == NULL) {
+			part->cte = RSPAMD_CTE_UNKNOWN;
+		}
+
+#ifndef GMIME24
+		if (raw_stream != NULL) {
+			g_object_unref (raw_stream);
+		}
+#endif
+	}
+
+#ifndef GMIME24
+	g_object_unref (wrapper);
+#endif
+}
+
+/*
+ * Decodes content directly from the input, returns NULL if the content
+ * is malformed, so GMime decoder is used for such parts
+ */
+static GByteArray *
+rspamd_mime_part_decode_native (struct mime_part *part)
+{
+	GByteArray *res = NULL;
+	gsize outlen;
+	gssize r;
+
+	switch (part->cte) {
+	case RSPAMD_CTE_8BIT:
+		res = g_byte_array_sized_new (part->raw_data.len);
+		g_byte_array_append (res, (const guint8 *)part->raw_data.begin,
+				part->raw_data.len);
+		break;
+	case RSPAMD_CTE_B64:
+		res = g_byte_array_sized_new (part->raw_data.len / 4 * 3 + 3);
+
+		if (rspamd_cryptobox_base64_decode (part->raw_data.begin,
+				part->raw_data.len, res->data, &outlen)) {
+			g_byte_array_set_size (res, outlen);
+		}
+		else {
+			g_byte_array_free (res, TRUE);
+			res = NULL;
+		}
+		break;
+	case RSPAMD_CTE_QP:
+		res = g_byte_array_sized_new (part->raw_data.len);
+		r = rspamd_decode_qp_buf (part->raw_data.begin, part->raw_data.len,
+				(gchar *)res->data, part->raw_data.len);
+
+		if (r >= 0) {
+			g_byte_array_set_size (res, r);
+		}
+		else {
+			g_byte_array_free (res, TRUE);
+			res = NULL;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return res;
+}
+
+static GByteArray *
+rspamd_mime_part_decode (struct mime_part *mime_part)
+{
+	GMimeObject *part = mime_part->mime;
+	GMimeDataWrapper *wrapper;
+	GMimeStream *part_stream;
+	GByteArray *part_content = NULL;
+
+	part_content = rspamd_mime_part_decode_native (mime_part);
+
+	if (part_content != NULL || !GMIME_IS_PART (part)) {
+		return part_content;
+	}
+
+	wrapper = g_mime_part_get_content_object (GMIME_PART (part));
+#ifdef GMIME24
+	if (wrapper != NULL && GMIME_IS_DATA_WRAPPER (wrapper)) {
+#else
+	if (wrapper != NULL) {
+#endif
+		part_stream = g_mime_stream_mem_new ();
+
+		if (g_mime_data_wrapper_write_to_stream (wrapper,
+				part_stream) != -1) {
+			g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
+					part_stream), FALSE);
+			part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
+					part_stream));
+		}
+		else {
+			msg_warn ("write to stream failed: %d, %s", errno,
+					strerror (errno));
+		}
+
+		g_object_unref (part_stream);
+#ifndef GMIME24
+		g_object_unref (wrapper);
+#endif
+	}
+
+	return part_content;
+}
+
+GByteArray *
+rspamd_mime_part_get_content (struct mime_part *part)
+{
+	g_assert (part != NULL);
+
+	if (part->content == NULL) {
+		part->content = rspamd_mime_part_decode (part);
+
+		if (part->content == NULL) {
+			part->content = g_byte_array_new ();
+		}
+	}
+
+	return part->content;
+}
+
+/*
+ * Base64 and unencoded parts are read from the input only up to the
+ * requested length, other encodings are decoded fully
+ */
+gsize
+rspamd_mime_part_get_head (struct mime_part *part, guchar *buf, gsize len)
+{
+	GByteArray *content;
+	const gchar *p, *end;
+	gchar *b64;
+	guchar *out;
+	gsize nb64 = 0, need, outlen = 0;
+	gboolean decoded = FALSE;
+
+	g_assert (part != NULL);
+
+	if (part->content == NULL) {
+		if (part->cte == RSPAMD_CTE_8BIT) {
+			outlen = MIN (len, part->raw_data.len);
+			memcpy (buf, part->raw_data.begin, outlen);
+			decoded = TRUE;
+		}
+		else if (part->cte == RSPAMD_CTE_B64) {
+			need = (len + 2) / 3 * 4;
+			b64 = g_malloc (need + need / 4 * 3);
+			out = (guchar *)b64 + need;
+			p = part->raw_data.begin;
+			end = p + part->raw_data.len;
+
+			while (p < end && nb64 < need) {
+				if (g_ascii_isalnum (*p) || *p == '+' || *p == '/' ||
+						*p == '=') {
+					b64[nb64 ++] = *p;
+				}
+
+				p ++;
+			}
+
+			/* Decode complete quanta only */
+			nb64 -= nb64 % 4;
+
+			if (nb64 == 0) {
+				decoded = TRUE;
+			}
+			else if (rspamd_cryptobox_base64_decode (b64, nb64, out,
+					&outlen)) {
+				outlen = MIN (outlen, len);
+				memcpy (buf, out, outlen);
+				decoded = TRUE;
+			}
+			else {
+				outlen = 0;
+			}
+
+			g_free (b64);
+		}
+	}
+
+	if (!decoded) {
+		content = rspamd_mime_part_get_content (part);
+		outlen = MIN (len, content->len);
+		memcpy (buf, content->data, outlen);
+	}
+
+	return outlen;
+}
+
+static const struct {
+	const gchar *name;
+	gsize len;
+	gsize offset;
+} rspamd_mime_digests[RSPAMD_MIME_DIGEST_MAX] = {
+	[RSPAMD_MIME_DIGEST_BLAKE2] = {"blake2", rspamd_cryptobox_HASHBYTES, 0},
+	[RSPAMD_MIME_DIGEST_MD5] = {"md5", 16, rspamd_cryptobox_HASHBYTES},
+	[RSPAMD_MIME_DIGEST_SHA1] = {"sha1", 20, rspamd_cryptobox_HASHBYTES + 16},
+	[RSPAMD_MIME_DIGEST_SHA256] = {"sha256", 32, rspamd_cryptobox_HASHBYTES + 36},
+};
+
+#define RSPAMD_MIME_DIGESTS_SIZE (rspamd_cryptobox_HASHBYTES + 68)
+/* Content is fed to all hashes by blocks to keep it in cache */
+#define RSPAMD_MIME_DIGEST_BLOCK 16384
+
+enum rspamd_mime_digest
+rspamd_mime_digest_from_string (const gchar *name)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_MIME_DIGEST_MAX; i ++) {
+		if (g_ascii_strcasecmp (name, rspamd_mime_digests[i].name) == 0) {
+			return i;
+		}
+	}
+
+	return RSPAMD_MIME_DIGEST_MAX;
+}
+
+static void
+rspamd_mime_part_calc_digests (struct mime_part *part, guint types)
+{
+	static const GChecksumType gtypes[RSPAMD_MIME_DIGEST_MAX] = {
+		[RSPAMD_MIME_DIGEST_MD5] = G_CHECKSUM_MD5,
+		[RSPAMD_MIME_DIGEST_SHA1] = G_CHECKSUM_SHA1,
+		[RSPAMD_MIME_DIGEST_SHA256] = G_CHECKSUM_SHA256,
+	};
+	rspamd_cryptobox_hash_state_t st;
+	GChecksum *cks[RSPAMD_MIME_DIGEST_MAX];
+	GByteArray *content;
+	gsize pos, blen, dlen;
+	guint i;
+
+	content = rspamd_mime_part_get_content (part);
+
+	if (part->digests == NULL) {
+		part->digests = g_malloc (RSPAMD_MIME_DIGESTS_SIZE);
+	}
+
+	memset (cks, 0, sizeof (cks));
+
+	if (types & RSPAMD_MIME_DIGEST_FLAG (RSPAMD_MIME_DIGEST_BLAKE2)) {
+		rspamd_cryptobox_hash_init (&st, NULL, 0);
+	}
+
+	for (i = RSPAMD_MIME_DIGEST_MD5; i < RSPAMD_MIME_DIGEST_MAX; i ++) {
+		if (types & RSPAMD_MIME_DIGEST_FLAG (i)) {
+			cks[i] = g_checksum_new (gtypes[i]);
+		}
+	}
+
+	for (pos = 0; pos < content->len; pos += blen) {
+		blen = MIN (content->len - pos, RSPAMD_MIME_DIGEST_BLOCK);
+
+		if (types & RSPAMD_MIME_DIGEST_FLAG (RSPAMD_MIME_DIGEST_BLAKE2)) {
+			rspamd_cryptobox_hash_update (&st, content->data + pos, blen);
+		}
+
+		for (i = RSPAMD_MIME_DIGEST_MD5; i < RSPAMD_MIME_DIGEST_MAX; i ++) {
+			if (cks[i] != NULL) {
+				g_checksum_update (cks[i], content->data + pos, blen);
+			}
+		}
+	}
+
+	if (types & RSPAMD_MIME_DIGEST_FLAG (RSPAMD_MIME_DIGEST_BLAKE2)) {
+		rspamd_cryptobox_hash_final (&st, part->digests);
+	}
+
+	for (i = RSPAMD_MIME_DIGEST_MD5; i < RSPAMD_MIME_DIGEST_MAX; i ++) {
+		if (cks[i] != NULL) {
+			dlen = rspamd_mime_digests[i].len;
+			g_checksum_get_digest (cks[i],
+					part->digests + rspamd_mime_digests[i].offset, &dlen);
+			g_checksum_free (cks[i]);
+		}
+	}
+
+	part->digests_ready |= types;
+}
+
+const guchar *
+rspamd_mime_part_get_digest (struct mime_part *part,
+		enum rspamd_mime_digest type, gsize *len)
+{
+	g_assert (part != NULL);
+	g_assert (type < RSPAMD_MIME_DIGEST_MAX);
+
+	if (!(part->digests_ready & RSPAMD_MIME_DIGEST_FLAG (type))) {
+		rspamd_mime_part_calc_digests (part,
+				(part->digests_wanted | RSPAMD_MIME_DIGEST_FLAG (type)) &
+				~part->digests_ready);
+	}
+
+	if (len) {
+		*len = rspamd_mime_digests[type].len;
+	}
+
+	return part->digests + rspamd_mime_digests[type].offset;
+}
+
 struct mime_foreach_data {
 	struct rspamd_task *task;
 	guint parser_recursion;
@@ -1327,7 +1916,6 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 	struct mime_part *mime_part;
 	GMimeContentType *type;
 	GMimeDataWrapper *wrapper;
-	GMimeStream *part_stream;
 	GByteArray *part_content;
 	gchar *hdrs;
 
@@ -1401,6 +1989,7 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 		}
 
 		mime_part->type = type;
+		mime_part->digests_wanted = task->cfg->part_digests;
 		/* XXX: we don't need it, but it's sometimes dereferenced */
 		mime_part->content = g_byte_array_new ();
 		mime_part->parent = md->parent;
@@ -1441,41 +2030,41 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 		if (wrapper != NULL && GMIME_IS_DATA_WRAPPER (wrapper)) {
 #else
 		if (wrapper != NULL) {
+			g_object_unref (wrapper);
 #endif
-			part_stream = g_mime_stream_mem_new ();
-			if (g_mime_data_wrapper_write_to_stream (wrapper,
-				part_stream) != -1) {
+			mime_part =
+				rspamd_mempool_alloc0 (task->task_pool,
+					sizeof (struct mime_part));
 
-				g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
-						part_stream), FALSE);
-				part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
-							part_stream));
-				g_object_unref (part_stream);
-				mime_part =
-					rspamd_mempool_alloc0 (task->task_pool,
-						sizeof (struct mime_part));
+			hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
+			mime_part->raw_headers = g_hash_table_new (rspamd_strcase_hash,
+					rspamd_strcase_equal);
 
-				hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
-				mime_part->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-						rspamd_strcase_equal);
+			if (hdrs != NULL) {
+				process_raw_headers (task, mime_part->raw_headers,
+						hdrs, strlen (hdrs));
+				mime_part->raw_headers_str = hdrs;
+			}
 
-				if (hdrs != NULL) {
-					process_raw_headers (task, mime_part->raw_headers,
-							hdrs, strlen (hdrs));
-					mime_part->raw_headers_str = hdrs;
-				}
+			mime_part->type = type;
+			mime_part->parent = md->parent;
+			mime_part->filename = g_mime_part_get_filename (GMIME_PART (
+						part));
+			mime_part->mime = part;
+			mime_part->digests_wanted = task->cfg->part_digests;
+			rspamd_mime_part_index_content (mime_part);
 
-				mime_part->type = type;
-				mime_part->content = part_content;
-				mime_part->parent = md->parent;
-				mime_part->filename = g_mime_part_get_filename (GMIME_PART (
-							part));
-				mime_part->mime = part;
-
-				debug_task ("found part with content-type: %s/%s",
-					type->type,
-					type->subtype);
-				g_ptr_array_add (task->parts, mime_part);
+			debug_task ("found part with content-type: %s/%s",
+				type->type,
+				type->subtype);
+			g_ptr_array_add (task->parts, mime_part);
+
+			/*
+			 * Only text parts are decoded here, attachments are decoded
+			 * when their content is requested
+			 */
+			if (g_mime_content_type_is_type (type, "text", "*")) {
+				part_content = rspamd_mime_part_get_content (mime_part);
 				/* Skip empty parts */
 				process_text_part (task,
 					part_content,
@@ -1484,13 +2073,6 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 					md->parent,
 					(part_content->len <= 0));
 			}
-			else {
-				msg_warn_task ("write to stream failed: %d, %s", errno,
-					strerror (errno));
-			}
-#ifndef GMIME24
-			g_object_unref (wrapper);
-#endif
 		}
 		else {
 			msg_warn_task ("cannot get wrapper for mime part, type of part: %s/%s",
@@ -1621,7 +2203,6 @@ rspamd_message_parse (struct rspamd_task *task)
 	const gchar *p;
 	gsize len;
 	goffset hdr_pos;
-	gint i;
 	gdouble diff, *pdiff;
 	guint tw, *ptw, dw;
 
@@ -1657,6 +2238,11 @@ rspamd_message_parse (struct rspamd_task *task)
 				(gint) task->msg.len);
 		/* create a new parser object to parse the stream */
 		parser = g_mime_parser_new_with_stream (stream);
+		/*
+		 * Parts content refers to the input stream instead of being copied,
+		 * input is either mapped file or http body that live as long as task
+		 */
+		g_mime_parser_set_persist_stream (parser, TRUE);
 
 		/* parse the message from the stream */
 		message = g_mime_parser_construct_message (parser);
@@ -1739,68 +2325,85 @@ rspamd_message_parse (struct rspamd_task *task)
 
 	rspamd_images_process (task);
 
-	/* Parse received headers */
+	/*
+	 * Collect received headers, they are parsed on the first access via
+	 * rspamd_message_get_received as most rules use merely the first hops
+	 */
 	first =
 			rspamd_message_get_header (task, "Received", FALSE);
 
-	for (cur = first, i = 0; cur != NULL; cur = g_list_next (cur), i ++) {
+	for (cur = first; cur != NULL; cur = g_list_next (cur)) {
+		rh = cur->data;
 		recv =
 				rspamd_mempool_alloc0 (task->task_pool,
 						sizeof (struct received_header));
-		parse_recv_header (task->task_pool, cur->data, recv);
+		recv->hdr = rh;
 
-		/*
-		 * For the first header we must ensure that
-		 * received is consistent with the IP that we obtain through
-		 * client.
-		 */
-		if (i == 0) {
-			gboolean need_recv_correction = FALSE;
+		if (rh->decoded) {
+			if (rh->decoded == rh->value && *rh->decoded != '\0' &&
+					g_ascii_isspace (rh->decoded[strlen (rh->decoded) - 1])) {
+				/* Plain headers share value with decoded one, keep it raw */
+				rh->decoded = rspamd_mempool_strdup (task->task_pool,
+						rh->value);
+			}
+
+			g_strstrip (rh->decoded);
+		}
 
-			if (recv->real_ip == NULL || task->cfg->ignore_received) {
+		g_ptr_array_add (task->received, recv);
+	}
+
+	/*
+	 * For the first header we must ensure that
+	 * received is consistent with the IP that we obtain through
+	 * client.
+	 */
+	recv = rspamd_message_get_received (task, 0);
+
+	if (recv) {
+		gboolean need_recv_correction = FALSE;
+
+		if (recv->real_ip == NULL || task->cfg->ignore_received) {
+			need_recv_correction = TRUE;
+		}
+		else if (!(task->flags & RSPAMD_TASK_FLAG_NO_IP) && task->from_addr) {
+			rspamd_inet_addr_t *raddr = NULL;
+
+			if (!rspamd_parse_inet_address (&raddr, recv->real_ip, 0)) {
 				need_recv_correction = TRUE;
 			}
-			else if (!(task->flags & RSPAMD_TASK_FLAG_NO_IP) && task->from_addr) {
-				rspamd_inet_addr_t *raddr = NULL;
-
-				if (!rspamd_parse_inet_address (&raddr, recv->real_ip, 0)) {
+			else {
+				if (rspamd_inet_address_compare (raddr, task->from_addr) != 0) {
 					need_recv_correction = TRUE;
 				}
-				else {
-					if (rspamd_inet_address_compare (raddr, task->from_addr) != 0) {
-						need_recv_correction = TRUE;
-					}
-
-					rspamd_inet_address_destroy (raddr);
-				}
 
+				rspamd_inet_address_destroy (raddr);
 			}
 
-			if (need_recv_correction && !(task->flags & RSPAMD_TASK_FLAG_NO_IP)
-					&& task->from_addr) {
-				msg_debug_task ("the first received seems to be"
-						" not ours, replace it with fake one");
+		}
 
-				trecv = rspamd_mempool_alloc0 (task->task_pool,
-								sizeof (struct received_header));
-				trecv->real_ip = rspamd_mempool_strdup (task->task_pool,
-						rspamd_inet_address_to_string (task->from_addr));
-				trecv->from_ip = trecv->real_ip;
+		if (need_recv_correction && !(task->flags & RSPAMD_TASK_FLAG_NO_IP)
+				&& task->from_addr) {
+			msg_debug_task ("the first received seems to be"
+					" not ours, replace it with fake one");
 
-				if (task->hostname) {
-					trecv->real_hostname = task->hostname;
-					trecv->from_hostname = trecv->real_hostname;
-				}
+			trecv = rspamd_mempool_alloc0 (task->task_pool,
+							sizeof (struct received_header));
+			trecv->real_ip = rspamd_mempool_strdup (task->task_pool,
+					rspamd_inet_address_to_string (task->from_addr));
+			trecv->from_ip = trecv->real_ip;
+
+			if (task->hostname) {
+				trecv->real_hostname = task->hostname;
+				trecv->from_hostname = trecv->real_hostname;
 			}
 		}
-
-		g_ptr_array_add (task->received, recv);
 	}
 
 	/* Extract data from received header if we were not given IP */
 	if (task->received->len > 0 && (task->flags & RSPAMD_TASK_FLAG_NO_IP) &&
 			!task->cfg->ignore_received) {
-		recv = g_ptr_array_index (task->received, 0);
+		recv = rspamd_message_get_received (task, 0);
 		if (recv->real_ip) {
 			if (!rspamd_parse_inet_address (&task->from_addr,
 					recv->real_ip,
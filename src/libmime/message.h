@@ -7,15 +7,40 @@
 #define RSPAMD_MESSAGE_H
 
 #include "config.h"
+#include "libutil/str_util.h"
 #include <gmime/gmime.h>
 
 struct rspamd_task;
 struct controller_session;
 struct html_content;
 
+/* Transfer encodings decoded natively */
+enum rspamd_cte {
+	RSPAMD_CTE_UNKNOWN = 0, /**< decoded by GMime */
+	RSPAMD_CTE_8BIT, /**< 7bit, 8bit and binary */
+	RSPAMD_CTE_QP,
+	RSPAMD_CTE_B64,
+};
+
+/* Digests of decoded content of parts */
+enum rspamd_mime_digest {
+	RSPAMD_MIME_DIGEST_BLAKE2 = 0,
+	RSPAMD_MIME_DIGEST_MD5,
+	RSPAMD_MIME_DIGEST_SHA1,
+	RSPAMD_MIME_DIGEST_SHA256,
+	RSPAMD_MIME_DIGEST_MAX
+};
+
+#define RSPAMD_MIME_DIGEST_FLAG(d) (1u << (d))
+
 struct mime_part {
 	GMimeContentType *type;
-	GByteArray *content;
+	GByteArray *content; /**< decoded lazily for non-text parts, use rspamd_mime_part_get_content */
+	rspamd_ftok_t raw_data; /**< encoded content in the input message */
+	enum rspamd_cte cte;
+	guchar *digests; /**< computed lazily, use rspamd_mime_part_get_digest */
+	guint digests_wanted; /**< digests computed together with any requested one */
+	guint digests_ready;
 	GMimeObject *parent;
 	GMimeObject *mime;
 	GHashTable *raw_headers;
@@ -50,6 +75,8 @@ struct mime_text_part {
 	struct mime_part *mime_part;
 	GArray *normalized_words;
 	GArray *normalized_hashes;
+	struct rspamd_charclass_stats charclass; /**< classes of bytes in content */
+	struct rspamd_script_stats scripts; /**< scripts of letters in content */
 	guint nlines;
 	guint64 hash;
 };
@@ -61,6 +88,8 @@ struct received_header {
 	gchar *real_ip;
 	gchar *by_hostname;
 	gint is_error;
+	struct raw_header *hdr; /* Header to parse lazily */
+	gboolean parsed;
 };
 
 struct raw_header {
@@ -80,6 +109,53 @@ struct raw_header {
  */
 gboolean rspamd_message_parse (struct rspamd_task *task);
 
+/**
+ * Get decoded content of mime part, non-text parts are decoded on the first
+ * call of this function
+ * @param part mime part
+ * @return content of part (empty array if it cannot be decoded)
+ */
+GByteArray *rspamd_mime_part_get_content (struct mime_part *part);
+
+/**
+ * Get the first bytes of decoded content of mime part without decoding the
+ * whole part if possible
+ * @param part mime part
+ * @param buf output buffer
+ * @param len maximum number of bytes to get
+ * @return number of bytes written to buf
+ */
+gsize rspamd_mime_part_get_head (struct mime_part *part, guchar *buf,
+		gsize len);
+
+/**
+ * Returns digest of decoded content of mime part. On the first call digests
+ * of all types requested in configuration are computed in a single pass over
+ * the content, so the subsequent calls are free
+ * @param part mime part
+ * @param type digest type
+ * @param len output length of digest
+ * @return digest (owned by part)
+ */
+const guchar *rspamd_mime_part_get_digest (struct mime_part *part,
+		enum rspamd_mime_digest type, gsize *len);
+
+/**
+ * Converts name of digest (`blake2`, `md5`, `sha1` or `sha256`) to its type
+ * @param name name of digest
+ * @return digest type or RSPAMD_MIME_DIGEST_MAX if name is unknown
+ */
+enum rspamd_mime_digest rspamd_mime_digest_from_string (const gchar *name);
+
+/**
+ * Returns received header of a task parsing it on the first access
+ * @param task worker task structure
+ * @param idx number of header starting from the top one
+ * @return parsed header or NULL if there are less than idx + 1 headers
+ */
+struct received_header *rspamd_message_get_received (struct rspamd_task *task,
+		guint idx);
+
 /**
  * Get a list of header's values with specified header's name using raw headers
  * @param task worker task structure
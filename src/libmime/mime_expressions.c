@@ -22,6 +22,7 @@
 #include "html.h"
 #include "email_addr.h"
 #include "lua/lua_common.h"
+#include "xxhash.h"
 
 gboolean rspamd_compare_encoding (struct rspamd_task *task,
 	GArray * args,
@@ -103,6 +104,7 @@ struct rspamd_regexp_atom {
 struct rspamd_function_atom {
 	gchar *name;	/**< name of function								*/
 	GArray *args;	/**< its args										*/
+	guint64 hash;	/**< normalised identity of call (name and args)	*/
 };
 
 enum rspamd_mime_atom_type {
@@ -129,25 +131,26 @@ static struct _fl {
 	const gchar *name;
 	rspamd_internal_func_t func;
 	void *user_data;
+	gboolean pure; /**< result depends merely on a task and arguments */
 } rspamd_functions_list[] = {
-	{"check_smtp_data", rspamd_check_smtp_data, NULL},
-	{"compare_encoding", rspamd_compare_encoding, NULL},
-	{"compare_parts_distance", rspamd_parts_distance, NULL},
-	{"compare_recipients_distance", rspamd_recipients_distance, NULL},
-	{"compare_transfer_encoding", rspamd_compare_transfer_encoding, NULL},
-	{"content_type_compare_param", rspamd_content_type_compare_param, NULL},
-	{"content_type_has_param", rspamd_content_type_has_param, NULL},
-	{"content_type_is_subtype", rspamd_content_type_is_subtype, NULL},
-	{"content_type_is_type", rspamd_content_type_is_type, NULL},
-	{"has_content_part", rspamd_has_content_part, NULL},
-	{"has_content_part_len", rspamd_has_content_part_len, NULL},
-	{"has_fake_html", rspamd_has_fake_html, NULL},
-	{"has_html_tag", rspamd_has_html_tag, NULL},
-	{"has_only_html_part", rspamd_has_only_html_part, NULL},
-	{"header_exists", rspamd_header_exists, NULL},
-	{"is_html_balanced", rspamd_is_html_balanced, NULL},
-	{"is_recipients_sorted", rspamd_is_recipients_sorted, NULL},
-	{"raw_header_exists", rspamd_raw_header_exists, NULL}
+	{"check_smtp_data", rspamd_check_smtp_data, NULL, TRUE},
+	{"compare_encoding", rspamd_compare_encoding, NULL, TRUE},
+	{"compare_parts_distance", rspamd_parts_distance, NULL, TRUE},
+	{"compare_recipients_distance", rspamd_recipients_distance, NULL, TRUE},
+	{"compare_transfer_encoding", rspamd_compare_transfer_encoding, NULL, TRUE},
+	{"content_type_compare_param", rspamd_content_type_compare_param, NULL, TRUE},
+	{"content_type_has_param", rspamd_content_type_has_param, NULL, TRUE},
+	{"content_type_is_subtype", rspamd_content_type_is_subtype, NULL, TRUE},
+	{"content_type_is_type", rspamd_content_type_is_type, NULL, TRUE},
+	{"has_content_part", rspamd_has_content_part, NULL, TRUE},
+	{"has_content_part_len", rspamd_has_content_part_len, NULL, TRUE},
+	{"has_fake_html", rspamd_has_fake_html, NULL, TRUE},
+	{"has_html_tag", rspamd_has_html_tag, NULL, TRUE},
+	{"has_only_html_part", rspamd_has_only_html_part, NULL, TRUE},
+	{"header_exists", rspamd_header_exists, NULL, TRUE},
+	{"is_html_balanced", rspamd_is_html_balanced, NULL, TRUE},
+	{"is_recipients_sorted", rspamd_is_recipients_sorted, NULL, TRUE},
+	{"raw_header_exists", rspamd_raw_header_exists, NULL, TRUE}
 };
 
 const struct rspamd_atom_subr mime_expr_subr = {
@@ -380,6 +383,97 @@ rspamd_mime_expr_parse_regexp_atom (rspamd_mempool_t * pool, const gchar *line,
 	return result;
 }
 
+static const gchar *
+rspamd_mime_expr_arg_str (struct expression_argument *arg, guint *len,
+		guint *flags)
+{
+	const gchar *str;
+
+	if (arg->type == EXPRESSION_ARGUMENT_REGEXP) {
+		str = rspamd_regexp_get_pattern (arg->data);
+		*flags = rspamd_regexp_get_flags (arg->data);
+	}
+	else {
+		str = arg->data;
+		*flags = 0;
+	}
+
+	*len = strlen (str);
+
+	while (*len > 0 && g_ascii_isspace (str[*len - 1])) {
+		(*len) --;
+	}
+
+	return str;
+}
+
+/*
+ * Calls with the same name and the same arguments are the same calls,
+ * regardless of whitespaces and quotes used in the expression
+ */
+static guint64
+rspamd_mime_expr_function_hash (struct rspamd_function_atom *func)
+{
+	XXH64_state_t st;
+	struct expression_argument *arg;
+	const gchar *str;
+	guint i, len, flags;
+
+	XXH64_reset (&st, rspamd_hash_seed ());
+	XXH64_update (&st, func->name, strlen (func->name));
+
+	for (i = 0; i < func->args->len; i ++) {
+		arg = &g_array_index (func->args, struct expression_argument, i);
+		XXH64_update (&st, &arg->type, sizeof (arg->type));
+		str = rspamd_mime_expr_arg_str (arg, &len, &flags);
+
+		if (arg->type == EXPRESSION_ARGUMENT_REGEXP) {
+			XXH64_update (&st, &flags, sizeof (flags));
+		}
+
+		XXH64_update (&st, &len, sizeof (len));
+		XXH64_update (&st, str, len);
+	}
+
+	return XXH64_digest (&st);
+}
+
+/* Compares calls in the same way as they are hashed */
+static gboolean
+rspamd_mime_expr_function_equal (struct rspamd_function_atom *f1,
+		struct rspamd_function_atom *f2)
+{
+	struct expression_argument *a1, *a2;
+	const gchar *s1, *s2;
+	guint i, l1, l2, fl1, fl2;
+
+	if (f1 == f2) {
+		return TRUE;
+	}
+
+	if (strcmp (f1->name, f2->name) != 0 || f1->args->len != f2->args->len) {
+		return FALSE;
+	}
+
+	for (i = 0; i < f1->args->len; i ++) {
+		a1 = &g_array_index (f1->args, struct expression_argument, i);
+		a2 = &g_array_index (f2->args, struct expression_argument, i);
+
+		if (a1->type != a2->type) {
+			return FALSE;
+		}
+
+		s1 = rspamd_mime_expr_arg_str (a1, &l1, &fl1);
+		s2 = rspamd_mime_expr_arg_str (a2, &l2, &fl2);
+
+		if (fl1 != fl2 || l1 != l2 || memcmp (s1, s2, l1) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 struct rspamd_function_atom *
 rspamd_mime_expr_parse_function_atom (const gchar *input)
 {
@@ -493,6 +587,8 @@ rspamd_mime_expr_parse_function_atom (const gchar *input)
 		}
 	}
 
+	res->hash = rspamd_mime_expr_function_hash (res);
+
 	return res;
 }
 
@@ -503,7 +599,8 @@ rspamd_mime_expr_parse (const gchar *line, gsize len,
 	rspamd_expression_atom_t *a = NULL;
 	struct rspamd_mime_atom *mime_atom = NULL;
 	const gchar *p, *end;
-	struct rspamd_config *cfg = ud;
+	struct rspamd_mime_expr_ud *real_ud = ud;
+	struct rspamd_config *cfg = real_ud->cfg;
 	rspamd_regexp_t *own_re;
 	gchar t;
 	gint type = MIME_ATOM_REGEXP, obraces = 0, ebraces = 0;
@@ -640,11 +737,13 @@ set:
 
 				if (mime_atom->d.re->header != NULL) {
 					own_re = mime_atom->d.re->regexp;
-					mime_atom->d.re->regexp = rspamd_re_cache_add (cfg->re_cache,
+					mime_atom->d.re->regexp = rspamd_re_cache_add_group (
+							cfg->re_cache,
 							mime_atom->d.re->regexp,
 							mime_atom->d.re->type,
 							mime_atom->d.re->header,
-							strlen (mime_atom->d.re->header) + 1);
+							strlen (mime_atom->d.re->header) + 1,
+							real_ud->group);
 					/* Pass ownership to the cache */
 					rspamd_regexp_unref (own_re);
 				}
@@ -660,11 +759,13 @@ set:
 			}
 			else {
 				own_re = mime_atom->d.re->regexp;
-				mime_atom->d.re->regexp = rspamd_re_cache_add (cfg->re_cache,
+				mime_atom->d.re->regexp = rspamd_re_cache_add_group (
+						cfg->re_cache,
 						mime_atom->d.re->regexp,
 						mime_atom->d.re->type,
 						NULL,
-						0);
+						0,
+						real_ud->group);
 				/* Pass ownership to the cache */
 				rspamd_regexp_unref (own_re);
 			}
@@ -809,26 +910,71 @@ rspamd_mime_expr_destroy (rspamd_expression_atom_t *atom)
 	}
 }
 
-static gboolean
-rspamd_mime_expr_process_function (struct rspamd_function_atom * func,
-	struct rspamd_task * task,
-	lua_State *L)
+static struct _fl *
+rspamd_mime_expr_find_function (const gchar *name)
 {
-	struct _fl *selected, key;
+	struct _fl key;
 
-	key.name = func->name;
+	key.name = name;
 
-	selected = bsearch (&key,
+	return bsearch (&key,
 			list_ptr,
 			functions_number,
 			sizeof (struct _fl),
 			fl_cmp);
+}
+
+struct rspamd_mime_expr_memo_elt {
+	struct rspamd_function_atom *func;
+	gboolean ret;
+};
+
+/*
+ * Internal functions depend merely on a task and their arguments, so the same
+ * call is evaluated once per task even if it is used in many expressions.
+ * Functions registered by plugins are always called
+ */
+static gboolean
+rspamd_mime_expr_process_function_memo (struct rspamd_function_atom *func,
+		struct rspamd_task *task)
+{
+	GHashTable *memo;
+	struct rspamd_mime_expr_memo_elt *elt;
+	struct _fl *selected;
+
+	selected = rspamd_mime_expr_find_function (func->name);
+
 	if (selected == NULL) {
-		/* Try to check lua function */
 		return FALSE;
 	}
 
-	return selected->func (task, func->args, selected->user_data);
+	if (!selected->pure) {
+		return selected->func (task, func->args, selected->user_data);
+	}
+
+	memo = rspamd_mempool_get_variable (task->task_pool, "mime_expr_memo");
+
+	if (memo == NULL) {
+		memo = g_hash_table_new (g_int64_hash, g_int64_equal);
+		rspamd_mempool_set_variable (task->task_pool, "mime_expr_memo", memo,
+				(rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+	else if ((elt = g_hash_table_lookup (memo, &func->hash)) != NULL) {
+		if (rspamd_mime_expr_function_equal (elt->func, func)) {
+			return elt->ret;
+		}
+
+		/* Hash collision, the first call keeps its slot */
+		return selected->func (task, func->args, selected->user_data);
+	}
+
+	elt = rspamd_mempool_alloc (task->task_pool, sizeof (*elt));
+	elt->func = func;
+	elt->ret = selected->func (task, func->args, selected->user_data);
+	/* Function atoms live longer than tasks, so their hashes could be keys */
+	g_hash_table_insert (memo, &func->hash, elt);
+
+	return elt->ret;
 }
 
 static gint
@@ -875,8 +1021,7 @@ rspamd_mime_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 		}
 	}
 	else {
-		ret = rspamd_mime_expr_process_function (mime_atom->d.func, task,
-				task->cfg->lua_state);
+		ret = rspamd_mime_expr_process_function_memo (mime_atom->d.func, task);
 	}
 
 	return ret;
@@ -901,6 +1046,8 @@ register_expression_function (const gchar *name,
 	new[functions_number - 1].name = name;
 	new[functions_number - 1].func = func;
 	new[functions_number - 1].user_data = user_data;
+	/* Nothing is known about functions registered by plugins */
+	new[functions_number - 1].pure = FALSE;
 	qsort (new, functions_number, sizeof (struct _fl), fl_cmp);
 	list_ptr = new;
 }
@@ -1835,18 +1982,22 @@ compare_subtype (struct rspamd_task *task, GMimeContentType * ct,
 static gboolean
 compare_len (struct mime_part *part, guint min, guint max)
 {
+	guint len;
+
 	if (min == 0 && max == 0) {
 		return TRUE;
 	}
 
+	len = rspamd_mime_part_get_content (part)->len;
+
 	if (min == 0) {
-		return part->content->len <= max;
+		return len <= max;
 	}
 	else if (max == 0) {
-		return part->content->len >= min;
+		return len >= min;
 	}
 	else {
-		return part->content->len >= min && part->content->len <= max;
+		return len >= min && len <= max;
 	}
 }
 
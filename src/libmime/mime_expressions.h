@@ -10,9 +10,18 @@
 #include "expression.h"
 
 struct rspamd_task;
+struct rspamd_config;
 
 extern const struct rspamd_atom_subr mime_expr_subr;
 
+/**
+ * User data for mime expressions parser
+ */
+struct rspamd_mime_expr_ud {
+	struct rspamd_config *cfg;      /**< config to register regexps in		*/
+	const gchar *group;             /**< symbols group of regexps (may be NULL)	*/
+};
+
 /**
  * Function's argument
  */
@@ -127,14 +127,15 @@ struct smtp_metric_callback_data {
 };
 
 static void
-smtp_metric_symbols_callback (gpointer key, gpointer value, void *user_data)
+smtp_metric_symbols_callback (gpointer value, void *user_data)
 {
 	struct smtp_metric_callback_data *cd = user_data;
+	struct symbol *s = value;
 
 	cd->log_offset += rspamd_snprintf (cd->log_buf + cd->log_offset,
 			cd->log_size - cd->log_offset,
 			"%s,",
-			(gchar *)key);
+			s->name);
 }
 
 static void
@@ -193,7 +194,7 @@ smtp_metric_callback (gpointer key, gpointer value, gpointer ud)
 				rs);
 
 	}
-	g_hash_table_foreach (metric_res->symbols, smtp_metric_symbols_callback,
+	g_ptr_array_foreach (metric_res->symbols, smtp_metric_symbols_callback,
 		cd);
 	/* Remove last , from log buf */
 	if (cd->log_buf[cd->log_offset - 1] == ',') {
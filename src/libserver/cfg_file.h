@@ -28,6 +28,9 @@ struct rspamd_stat_classifier;
 struct module_s;
 struct worker_s;
 struct rspamd_external_libs_ctx;
+struct rspamd_composites_index;
+struct rspamd_shared_cache;
+struct rspamd_redis_pool;
 
 enum { VAL_UNDEF=0, VAL_TRUE, VAL_FALSE };
 
@@ -185,6 +188,10 @@ struct rspamd_worker_conf {
 	GHashTable *params;                             /**< params for worker									*/
 	GQueue *active_workers;                         /**< linked list of spawned workers						*/
 	gboolean has_socket;                            /**< whether we should make listening socket in main process */
+	gboolean reuseport;                             /**< each worker binds its own inet sockets			*/
+	guint *cpu_affinity;                            /**< cpus to bind workers to (by worker index)			*/
+	guint cpu_affinity_len;                         /**< number of elements in cpu_affinity				*/
+	gboolean numa;                                  /**< spread workers over NUMA nodes						*/
 	gpointer *ctx;                                  /**< worker's context									*/
 	ucl_object_t *options;                          /**< other worker's options								*/
 	struct rspamd_worker_lua_script *scripts;       /**< registered lua scripts								*/
@@ -210,6 +217,7 @@ enum rspamd_log_format_type {
 	RSPAMD_LOG_MIME_RCPTS,
 	RSPAMD_LOG_TIME_REAL,
 	RSPAMD_LOG_TIME_VIRTUAL,
+	RSPAMD_LOG_TIME_STAGES,
 	RSPAMD_LOG_LUA
 };
 
@@ -255,6 +263,7 @@ struct metric {
 	gboolean accept_unknown_symbols;                /**< if true unknown symbols are registered here	*/
 	gdouble unknown_weight;                         /**< weight of unknown symbols						*/
 	gdouble grow_factor;                            /**< grow factor for metric							*/
+	gboolean early_termination;                     /**< stop checks when action cannot change anymore	*/
 	GHashTable *symbols;                            /**< weights of symbols in metric					*/
 	gchar *subject;                                 /**< subject rewrite string							*/
 	GHashTable * groups; 		                    /**< groups of symbols								*/
@@ -274,6 +283,8 @@ struct rspamd_config {
 	gchar *rspamd_group;                            /**< group to run as									*/
 	rspamd_mempool_t *cfg_pool;                     /**< memory pool for config								*/
 	gchar *cfg_name;                                /**< name of config file								*/
+	gchar *snapshot_file;                           /**< snapshot of parsed config tree (optional)			*/
+	guchar *snapshot_key;                           /**< hash of inputs of config tree or NULL				*/
 	gchar *pid_file;                                /**< name of pid file									*/
 	gchar *temp_dir;                                /**< dir for temp files									*/
 	gchar *control_socket_path;                     /**< path to the control socket							*/
@@ -285,19 +296,31 @@ struct rspamd_config {
 	gboolean raw_mode;                              /**< work in raw mode instead of utf one				*/
 	gboolean one_shot_mode;                         /**< rules add only one symbol							*/
 	gboolean check_text_attachements;               /**< check text attachements as text					*/
+	guint part_digests;                             /**< digests of mime parts computed in a single pass	*/
 	gboolean convert_config;                        /**< convert config to XML format						*/
 	gboolean strict_protocol_headers;               /**< strictly check protocol headers					*/
 	gboolean check_all_filters;                     /**< check all filters									*/
+	gboolean preload_maps;                          /**< read file maps in main before forking workers		*/
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean shared_hyperscan;                      /**< share hyperscan databases among processes			*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 
 	gsize max_diff;                                 /**< maximum diff size for text parts					*/
+	gsize hs_stream_size;                           /**< inputs larger than this are scanned in hs streams	*/
+	gboolean numa_interleave;                       /**< interleave shared memory over NUMA nodes			*/
+	gsize max_text_part_size;                       /**< maximum size of text processed per part			*/
+	guint max_urls;                                 /**< maximum number of urls extracted from text			*/
+	guint max_html_tags;                            /**< maximum number of html tags parsed per part		*/
+	gsize max_re_class_data;                        /**< maximum size of data scanned by a regexp class		*/
 	gsize max_cores_size;                           /**< maximum size occupied by rspamd core files			*/
 	gsize max_cores_count;                          /**< maximum number of core files						*/
 	gchar *cores_dir;                               /**< directory for core files							*/
+	guint keypair_cache_size;                       /**< number of shared secrets cached by each process	*/
+	gsize keypair_shared_cache_size;                /**< memory for shared secrets cached for all processes	*/
+	struct rspamd_shared_cache *keypair_shared_cache; /**< cache of shared secrets for all processes		*/
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
 	gint log_facility;                              /**< log facility in case of syslog						*/
@@ -305,6 +328,8 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	gboolean log_async;                             /**< workers log to shared ring drained by main process	*/
+	gsize log_async_size;                           /**< size of shared log ring							*/
 	gchar *debug_ip_map;                            /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -338,6 +363,7 @@ struct rspamd_config {
 	GHashTable * metrics_symbols;                   /**< hash table of metrics indexed by symbol			*/
 	GHashTable * c_modules;                         /**< hash of c modules indexed by module name			*/
 	GHashTable * composite_symbols;                 /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites indexed by symbols they reference */
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -363,10 +389,15 @@ struct rspamd_config {
 	gchar * checksum;                               /**< real checksum of config file						*/
 	gchar * dump_checksum;                          /**< dump checksum of config file						*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
+	gdouble lua_profile_rate;                       /**< probability to profile lua symbols callbacks		*/
+	gdouble loop_watchdog_interval;                 /**< interval of event loop lag checks					*/
+	gdouble loop_lag_threshold;                     /**< event loop lag to be logged						*/
 
 	gchar * rrd_file;                               /**< rrd file to store statistics						*/
 
 	gchar * history_file;                           /**< file to save rolling history						*/
+	gchar * caches_file;                            /**< file to save shared caches on shutdown				*/
+	GHashTable *persistent_caches;                  /**< shared caches saved on shutdown by name			*/
 
 	gchar * tld_file;                               /**< file to load effective tld list from				*/
 
@@ -379,11 +410,23 @@ struct rspamd_config {
 	guint32 dns_io_per_server;                      /**< number of sockets per DNS server					*/
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
+	gsize dns_cache_size;                           /**< memory for DNS replies cached for all processes	*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache replies without records				*/
+	struct rspamd_shared_cache *dns_cache;          /**< cache of DNS replies for all processes				*/
+	gdouble dns_cache_prefetch;                     /**< fraction of TTL left to refresh cached replies		*/
+	guint32 dns_cache_prefetch_hits;                /**< hits of a cached reply needed to refresh it			*/
+	guint32 dns_cache_prefetch_rate;                /**< refreshes per second allowed for each process		*/
+	gsize result_cache_size;                        /**< memory for results of identical messages			*/
+	gdouble result_cache_ttl;                       /**< time to cache results of messages					*/
+	GList *result_cache_symbols;                    /**< additional symbols depending on content only		*/
+	struct rspamd_shared_cache *result_cache;       /**< cache of content results for all processes			*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
+	gdouble upstream_probe_interval;				/**< interval of active upstreams probes				*/
 	struct upstream_ctx *ups_ctx;					/**< upstream context									*/
+	struct rspamd_redis_pool *redis_pool;			/**< redis connections pool								*/
 
 	guint min_word_len;								/**< minimum length of the word to be considered		*/
 	guint max_word_len;								/**< maximum length of the word to be considered		*/
@@ -515,6 +558,12 @@ gboolean rspamd_config_read (struct rspamd_config *cfg,
 	rspamd_rcl_section_fin_t logger_fin, gpointer logger_ud,
 	GHashTable *vars);
 
+/*
+ * Save parsed config tree to `cfg->snapshot_file`, so the next
+ * `rspamd_config_read` can skip parsing when no input has been changed
+ */
+gboolean rspamd_config_save_snapshot (struct rspamd_config *cfg, GError **err);
+
 /*
  * Register symbols of classifiers inside metrics
  */
@@ -545,6 +594,35 @@ void rspamd_ucl_add_conf_variables (struct ucl_parser *parser, GHashTable *vars)
  */
 gboolean rspamd_init_filters (struct rspamd_config *cfg, bool reconfig);
 
+/**
+ * Register shared cache to be saved on shutdown and restored on start, cache
+ * registered with the same name replaces the previous one
+ * @param cfg config file
+ * @param name unique and persistent name of cache
+ * @param cache shared cache
+ */
+void rspamd_config_register_persistent_cache (struct rspamd_config *cfg,
+		const gchar *name, struct rspamd_shared_cache *cache);
+
+/**
+ * Save elements of all persistent caches that are not expired
+ * @param cfg config file
+ * @param filename file to save to
+ * @return TRUE if caches have been saved
+ */
+gboolean rspamd_config_save_caches (struct rspamd_config *cfg,
+		const gchar *filename);
+
+/**
+ * Load persistent caches saved by `rspamd_config_save_caches`, elements that
+ * have expired since then are skipped
+ * @param cfg config file
+ * @param filename file to load from
+ * @return TRUE if caches have been loaded
+ */
+gboolean rspamd_config_load_caches (struct rspamd_config *cfg,
+		const gchar *filename);
+
 /**
  * Add new symbol to the metric
  * @param cfg
@@ -259,7 +259,13 @@ rspamd_rcl_options_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 	if (rspamd_rcl_section_parse_defaults (section, cfg->cfg_pool, obj,
 			cfg, err)) {
 		/* We need to init this early */
-		rspamd_multipattern_library_init (cfg->hs_cache_dir);
+		rspamd_multipattern_library_init (cfg->hs_cache_dir,
+				cfg->shared_hyperscan);
+
+		if (cfg->numa_interleave) {
+			/* Shared caches are allocated after options are parsed */
+			rspamd_mempool_set_numa_interleave (rspamd_numa_nodes ());
+		}
 
 		return TRUE;
 	}
@@ -548,6 +554,9 @@ rspamd_rcl_worker_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 	struct rspamd_worker_cfg_parser *wparser;
 	struct rspamd_worker_param_parser *whandler;
 	struct rspamd_worker_param_key srch;
+	GArray *cpus;
+	gint64 cpu;
+	guint ncpu;
 
 	g_assert (key != NULL);
 	worker_type = key;
@@ -638,6 +647,40 @@ rspamd_rcl_worker_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 		ucl_object_iterate_free (it);
 	}
 
+	val = ucl_object_lookup (obj, "cpu_affinity");
+
+	if (val != NULL) {
+		cpus = g_array_new (FALSE, FALSE, sizeof (guint));
+		it = ucl_object_iterate_new (val);
+
+		while ((cur = ucl_object_iterate_safe (it, true)) != NULL) {
+			if (!ucl_object_toint_safe (cur, &cpu) || cpu < 0) {
+				g_set_error (err,
+					CFG_RCL_ERROR,
+					EINVAL,
+					"cpu_affinity must be a list of cpu numbers");
+				ucl_object_iterate_free (it);
+				g_array_free (cpus, TRUE);
+
+				return FALSE;
+			}
+
+			ncpu = cpu;
+			g_array_append_val (cpus, ncpu);
+		}
+
+		ucl_object_iterate_free (it);
+
+		if (cpus->len > 0) {
+			wrk->cpu_affinity = rspamd_mempool_alloc (cfg->cfg_pool,
+					cpus->len * sizeof (guint));
+			memcpy (wrk->cpu_affinity, cpus->data, cpus->len * sizeof (guint));
+			wrk->cpu_affinity_len = cpus->len;
+		}
+
+		g_array_free (cpus, TRUE);
+	}
+
 	wrk->options = (ucl_object_t *)obj;
 
 	if (!rspamd_rcl_section_parse_defaults (section, cfg->cfg_pool, obj,
@@ -1596,6 +1639,19 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 			0,
 			"Size of log buffer in bytes (for file logging)");
+	rspamd_rcl_add_default_handler (sub,
+			"log_async",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, log_async),
+			0,
+			"Workers write log lines to a shared memory ring that is written "
+			"to the log by the main process (for file and console logging)");
+	rspamd_rcl_add_default_handler (sub,
+			"log_async_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, log_async_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of shared memory log ring (4Mb by default)");
 	rspamd_rcl_add_default_handler (sub,
 			"log_urls",
 			rspamd_rcl_parse_struct_boolean,
@@ -1796,6 +1852,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, history_file),
 			RSPAMD_CL_FLAG_STRING_PATH,
 			"Path to history file");
+	rspamd_rcl_add_default_handler (sub,
+			"caches_file",
+			rspamd_rcl_parse_struct_string,
+			G_STRUCT_OFFSET (struct rspamd_config, caches_file),
+			RSPAMD_CL_FLAG_STRING_PATH,
+			"Path to file where shared caches are saved on shutdown");
 	rspamd_rcl_add_default_handler (sub,
 			"use_mlock",
 			rspamd_rcl_parse_struct_boolean,
@@ -1820,6 +1882,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 			0,
 			"Always check all filters");
+	rspamd_rcl_add_default_handler (sub,
+			"preload_maps",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, preload_maps),
+			0,
+			"Read file maps once in the main process, so workers share them "
+			"copy-on-write instead of reading them after fork");
 	rspamd_rcl_add_default_handler (sub,
 			"min_word_len",
 			rspamd_rcl_parse_struct_integer,
@@ -1874,6 +1943,52 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 			0,
 			"Use hyperscan in vectorized mode (experimental)");
+	rspamd_rcl_add_default_handler (sub,
+			"shared_hyperscan",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, shared_hyperscan),
+			0,
+			"Map hyperscan databases from hs_cache_dir shared among workers");
+	rspamd_rcl_add_default_handler (sub,
+			"max_text_part_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_text_part_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Truncate text parts larger than this size (0 means no limit)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_urls",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_urls),
+			RSPAMD_CL_FLAG_UINT,
+			"Stop urls extraction from text parts after this number of urls "
+			"(0 means no limit)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_html_tags",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_html_tags),
+			RSPAMD_CL_FLAG_UINT,
+			"Stop html parsing of a part after this number of tags "
+			"(0 means no limit)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_re_class_data",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_re_class_data),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Maximum amount of data scanned by regexps of a class per message "
+			"(0 means no limit)");
+	rspamd_rcl_add_default_handler (sub,
+			"hyperscan_stream_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, hs_stream_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Scan body and mime inputs larger than this size using hyperscan "
+			"streams (0 disables streaming)");
+	rspamd_rcl_add_default_handler (sub,
+			"numa_interleave",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, numa_interleave),
+			0,
+			"Interleave pages of memory shared by workers over all NUMA nodes");
 	rspamd_rcl_add_default_handler (sub,
 			"cores_dir",
 			rspamd_rcl_parse_struct_string,
@@ -1892,6 +2007,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, max_cores_count),
 			RSPAMD_CL_FLAG_INT_SIZE,
 			"Limit of files count in `cores_dir`");
+	rspamd_rcl_add_default_handler (sub,
+			"keypair_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, keypair_cache_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of precomputed shared secrets of encrypted peers cached by each process");
+	rspamd_rcl_add_default_handler (sub,
+			"keypair_shared_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, keypair_shared_cache_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Memory used to share precomputed secrets of encrypted peers among all processes (0 to disable)");
 	rspamd_rcl_add_default_handler (sub,
 			"local_addrs",
 			rspamd_rcl_parse_struct_string,
@@ -1922,6 +2049,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, ignore_received),
 			0,
 			"Ignore data from the first received header");
+	rspamd_rcl_add_default_handler (sub,
+			"lua_profile_rate",
+			rspamd_rcl_parse_struct_double,
+			G_STRUCT_OFFSET (struct rspamd_config, lua_profile_rate),
+			0,
+			"Fraction of lua symbols calls to profile for /luaprofile (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"loop_watchdog",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, loop_watchdog_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Interval of event loop lag checks in workers (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"loop_lag_threshold",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, loop_lag_threshold),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Log workers event loop lag longer than this value");
 	/* New DNS configuration */
 	ssub = rspamd_rcl_add_section_doc (&sub->subsections, "dns", NULL, NULL,
 			UCL_OBJECT, FALSE, TRUE,
@@ -1963,6 +2108,61 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, dns_io_per_server),
 			RSPAMD_CL_FLAG_INT_32,
 			"Number of sockets per DNS server");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Memory used to cache DNS replies for all processes (0 to disable)");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_negative_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to cache DNS replies with no records");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_prefetch",
+			rspamd_rcl_parse_struct_double,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_prefetch),
+			0,
+			"Refresh popular cached DNS replies when this fraction of TTL is left (0 to disable)");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_prefetch_hits",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_prefetch_hits),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of hits during TTL for a cached DNS reply to be refreshed");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_prefetch_rate",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_prefetch_rate),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum number of DNS refreshes per second for each process");
+
+	/* Cache of results for identical messages */
+	ssub = rspamd_rcl_add_section_doc (&sub->subsections, "result_cache", NULL,
+			NULL,
+			UCL_OBJECT, FALSE, TRUE,
+			cfg->doc_strings,
+			"Cache of content dependent results for identical messages");
+	rspamd_rcl_add_default_handler (ssub,
+			"size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, result_cache_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Memory used to cache results for all processes (0 to disable)");
+	rspamd_rcl_add_default_handler (ssub,
+			"ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, result_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to cache results of a message");
+	rspamd_rcl_add_default_handler (ssub,
+			"symbols",
+			rspamd_rcl_parse_struct_string_list,
+			G_STRUCT_OFFSET (struct rspamd_config, result_cache_symbols),
+			0,
+			"Additional symbols that depend on the message content only");
 
 
 	/* New upstreams configuration */
@@ -1988,6 +2188,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, upstream_revive_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time before attempting to recover upstream after an error");
+	rspamd_rcl_add_default_handler (ssub,
+			"probe_interval",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_probe_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Interval of active health probes of upstreams (0 disables probes)");
 
 	/**
 	 * Metric section
@@ -2015,6 +2221,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			"Multiply the subsequent symbols by this number "
 					"(does not affect symbols with score less or "
 					"equal to zero)");
+	rspamd_rcl_add_default_handler (sub,
+			"early_termination",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct metric, early_termination),
+			0,
+			"Stop checking symbols when the remaining ones cannot "
+					"change the action for this metric");
 	rspamd_rcl_add_default_handler (sub,
 			"subject",
 			rspamd_rcl_parse_struct_string,
@@ -2109,6 +2322,20 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_worker_conf, rlimit_maxcore),
 			RSPAMD_CL_FLAG_INT_32,
 			"Max size of core file in bytes");
+	rspamd_rcl_add_default_handler (sub,
+			"reuseport",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport),
+			0,
+			"Bind a separate SO_REUSEPORT socket in each worker, so kernel "
+			"distributes connections between them");
+	rspamd_rcl_add_default_handler (sub,
+			"numa",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, numa),
+			0,
+			"Spread worker instances over NUMA nodes binding each of them "
+			"to cpus of its node");
 
 	/**
 	 * Modules handler
@@ -3100,6 +3327,441 @@ rspamd_rcl_register_worker_parser (struct rspamd_config *cfg, gint type,
 	nparser->def_ud = ud;
 }
 
+/*
+ * Snapshot of the parsed config tree: a fixed header followed by elements
+ * written in depth-first order. Unlike msgpack, it preserves priorities and
+ * multi-value keys of UCL objects. It is reused merely if the hash of all
+ * inputs (main file, variables and files in config dirs) is the same
+ */
+#define RSPAMD_CFG_SNAPSHOT_MAGIC "rcfgsn01"
+#define RSPAMD_CFG_SNAPSHOT_MAGIC_LEN 8
+#define RSPAMD_CFG_SNAPSHOT_MAX_DEPTH 16
+#define RSPAMD_CFG_SNAPSHOT_MAX_NESTING 128
+
+struct rspamd_cfg_snapshot_elt {
+	guint8 type;
+	guint8 priority;
+	guint16 unused;
+	guint32 keylen;
+	guint32 len; /* length of string, boolean value or number of children */
+};
+
+static gint
+rspamd_config_snapshot_name_cmp (gconstpointer a, gconstpointer b)
+{
+	const gchar *s1 = *(const gchar **)a, *s2 = *(const gchar **)b;
+
+	return strcmp (s1, s2);
+}
+
+static void
+rspamd_config_snapshot_hash_dir (rspamd_cryptobox_hash_state_t *st,
+		const gchar *dir, const gchar *skip, guint depth)
+{
+	DIR *d;
+	struct dirent *de;
+	GPtrArray *names;
+	struct stat sb;
+	gchar path[PATH_MAX];
+	const gchar *name;
+	gint64 v;
+	guint i;
+
+	if (depth > RSPAMD_CFG_SNAPSHOT_MAX_DEPTH || (d = opendir (dir)) == NULL) {
+		return;
+	}
+
+	names = g_ptr_array_new_with_free_func (g_free);
+
+	while ((de = readdir (d)) != NULL) {
+		if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0) {
+			continue;
+		}
+
+		/* Snapshot itself and its temporary copies */
+		if (skip && strncmp (de->d_name, skip, strlen (skip)) == 0) {
+			continue;
+		}
+
+		g_ptr_array_add (names, g_strdup (de->d_name));
+	}
+
+	closedir (d);
+	/* Readdir order is not stable */
+	g_ptr_array_sort (names, rspamd_config_snapshot_name_cmp);
+
+	for (i = 0; i < names->len; i ++) {
+		name = g_ptr_array_index (names, i);
+		rspamd_snprintf (path, sizeof (path), "%s%c%s", dir, G_DIR_SEPARATOR,
+				name);
+
+		if (stat (path, &sb) == -1) {
+			continue;
+		}
+
+		rspamd_cryptobox_hash_update (st, path, strlen (path) + 1);
+
+		if (S_ISDIR (sb.st_mode)) {
+			rspamd_config_snapshot_hash_dir (st, path, skip, depth + 1);
+		}
+		else if (S_ISREG (sb.st_mode)) {
+			v = sb.st_size;
+			rspamd_cryptobox_hash_update (st, (const guchar *)&v, sizeof (v));
+			v = sb.st_mtime;
+			rspamd_cryptobox_hash_update (st, (const guchar *)&v, sizeof (v));
+		}
+	}
+
+	g_ptr_array_free (names, TRUE);
+}
+
+static guchar *
+rspamd_config_snapshot_key (struct rspamd_config *cfg, const gchar *filename,
+		const guchar *data, gsize len, GHashTable *vars)
+{
+	rspamd_cryptobox_hash_state_t st;
+	GList *keys, *cur;
+	const gchar *v, *dirs[3];
+	gchar *dname, *skip = NULL;
+	guchar *key;
+	guint i;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, RSPAMD_CFG_SNAPSHOT_MAGIC RVERSION,
+			sizeof (RSPAMD_CFG_SNAPSHOT_MAGIC RVERSION));
+	rspamd_cryptobox_hash_update (&st, data, len);
+
+	if (vars) {
+		keys = g_list_sort (g_hash_table_get_keys (vars),
+				(GCompareFunc)strcmp);
+
+		for (cur = keys; cur != NULL; cur = g_list_next (cur)) {
+			v = g_hash_table_lookup (vars, cur->data);
+			rspamd_cryptobox_hash_update (&st, cur->data,
+					strlen (cur->data) + 1);
+			rspamd_cryptobox_hash_update (&st, v, strlen (v) + 1);
+		}
+
+		g_list_free (keys);
+	}
+
+	/* Included files are not reported by the parser, so check all dirs */
+	dname = g_path_get_dirname (filename);
+	dirs[0] = dname;
+	dirs[1] = vars ? g_hash_table_lookup (vars, "CONFDIR") : NULL;
+	dirs[1] = dirs[1] ? dirs[1] : RSPAMD_CONFDIR;
+	dirs[2] = vars ? g_hash_table_lookup (vars, "LOCAL_CONFDIR") : NULL;
+	dirs[2] = dirs[2] ? dirs[2] : RSPAMD_LOCAL_CONFDIR;
+
+	if (cfg->snapshot_file) {
+		skip = g_path_get_basename (cfg->snapshot_file);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (dirs); i ++) {
+		rspamd_config_snapshot_hash_dir (&st, dirs[i], skip, 0);
+	}
+
+	g_free (dname);
+	g_free (skip);
+
+	key = rspamd_mempool_alloc (cfg->cfg_pool, rspamd_cryptobox_HASHBYTES);
+	rspamd_cryptobox_hash_final (&st, key);
+
+	return key;
+}
+
+static void
+rspamd_config_snapshot_write_elt (GString *buf, const ucl_object_t *obj,
+		gboolean with_key)
+{
+	struct rspamd_cfg_snapshot_elt hdr;
+	const ucl_object_t *cur, *celt;
+	ucl_object_iter_t it = NULL;
+	gint64 iv;
+	gdouble dv;
+	gsize pos;
+
+	memset (&hdr, 0, sizeof (hdr));
+	hdr.type = obj->type;
+	hdr.priority = ucl_object_get_priority (obj);
+
+	if (with_key && obj->key) {
+		hdr.keylen = obj->keylen;
+	}
+
+	if (obj->type == UCL_STRING) {
+		hdr.len = obj->len;
+	}
+	else if (obj->type == UCL_BOOLEAN) {
+		hdr.len = ucl_object_toboolean (obj);
+	}
+	else if (obj->type == UCL_USERDATA) {
+		/* Cannot be restored */
+		hdr.type = UCL_NULL;
+	}
+
+	pos = buf->len;
+	g_string_append_len (buf, (const gchar *)&hdr, sizeof (hdr));
+
+	if (hdr.keylen > 0) {
+		g_string_append_len (buf, obj->key, hdr.keylen);
+	}
+
+	switch (hdr.type) {
+	case UCL_INT:
+		iv = ucl_object_toint (obj);
+		g_string_append_len (buf, (const gchar *)&iv, sizeof (iv));
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		dv = ucl_object_todouble (obj);
+		g_string_append_len (buf, (const gchar *)&dv, sizeof (dv));
+		break;
+	case UCL_STRING:
+		g_string_append_len (buf, obj->value.sv, obj->len);
+		break;
+	case UCL_OBJECT:
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			/* All values of multi-value keys */
+			LL_FOREACH (cur, celt) {
+				rspamd_config_snapshot_write_elt (buf, celt, TRUE);
+				hdr.len ++;
+			}
+		}
+
+		memcpy (buf->str + pos, &hdr, sizeof (hdr));
+		break;
+	case UCL_ARRAY:
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			rspamd_config_snapshot_write_elt (buf, cur, FALSE);
+			hdr.len ++;
+		}
+
+		memcpy (buf->str + pos, &hdr, sizeof (hdr));
+		break;
+	default:
+		break;
+	}
+}
+
+static ucl_object_t *
+rspamd_config_snapshot_read_elt (const guchar **pp, const guchar *end,
+		const gchar **pkey, gsize *pkeylen, guint nesting)
+{
+	struct rspamd_cfg_snapshot_elt hdr;
+	const guchar *p = *pp;
+	const gchar *ckey;
+	gsize ckeylen;
+	ucl_object_t *obj = NULL, *child;
+	gint64 iv;
+	gdouble dv;
+	guint32 i;
+
+	if (nesting > RSPAMD_CFG_SNAPSHOT_MAX_NESTING ||
+			(gsize)(end - p) < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	if ((gsize)(end - p) < hdr.keylen) {
+		return NULL;
+	}
+
+	*pkey = (const gchar *)p;
+	*pkeylen = hdr.keylen;
+	p += hdr.keylen;
+
+	switch (hdr.type) {
+	case UCL_INT:
+		if ((gsize)(end - p) < sizeof (iv)) {
+			return NULL;
+		}
+
+		memcpy (&iv, p, sizeof (iv));
+		p += sizeof (iv);
+		obj = ucl_object_fromint (iv);
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		if ((gsize)(end - p) < sizeof (dv)) {
+			return NULL;
+		}
+
+		memcpy (&dv, p, sizeof (dv));
+		p += sizeof (dv);
+		obj = ucl_object_typed_new (hdr.type);
+		obj->value.dv = dv;
+		break;
+	case UCL_STRING:
+		if ((gsize)(end - p) < hdr.len) {
+			return NULL;
+		}
+
+		obj = ucl_object_fromlstring ((const gchar *)p, hdr.len);
+		p += hdr.len;
+		break;
+	case UCL_BOOLEAN:
+		obj = ucl_object_frombool (hdr.len);
+		break;
+	case UCL_NULL:
+		obj = ucl_object_typed_new (UCL_NULL);
+		break;
+	case UCL_OBJECT:
+	case UCL_ARRAY:
+		obj = ucl_object_typed_new (hdr.type);
+
+		for (i = 0; i < hdr.len; i ++) {
+			child = rspamd_config_snapshot_read_elt (&p, end, &ckey, &ckeylen,
+					nesting + 1);
+
+			if (child == NULL) {
+				ucl_object_unref (obj);
+
+				return NULL;
+			}
+
+			if (hdr.type == UCL_OBJECT) {
+				/* Repeated keys are appended as implicit arrays */
+				ucl_object_insert_key (obj, child, ckey, ckeylen, true);
+			}
+			else {
+				ucl_array_append (obj, child);
+			}
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	ucl_object_set_priority (obj, hdr.priority);
+	*pp = p;
+
+	return obj;
+}
+
+static ucl_object_t *
+rspamd_config_load_snapshot (struct rspamd_config *cfg)
+{
+	guchar *map;
+	const guchar *p, *end;
+	const gchar *key;
+	gsize len, keylen;
+	ucl_object_t *top = NULL;
+
+	map = rspamd_file_xmap (cfg->snapshot_file, PROT_READ, &len);
+
+	if (map == NULL) {
+		return NULL;
+	}
+
+	p = map;
+	end = map + len;
+
+	if (len > RSPAMD_CFG_SNAPSHOT_MAGIC_LEN + rspamd_cryptobox_HASHBYTES &&
+			memcmp (p, RSPAMD_CFG_SNAPSHOT_MAGIC,
+					RSPAMD_CFG_SNAPSHOT_MAGIC_LEN) == 0 &&
+			memcmp (p + RSPAMD_CFG_SNAPSHOT_MAGIC_LEN, cfg->snapshot_key,
+					rspamd_cryptobox_HASHBYTES) == 0) {
+		p += RSPAMD_CFG_SNAPSHOT_MAGIC_LEN + rspamd_cryptobox_HASHBYTES;
+		top = rspamd_config_snapshot_read_elt (&p, end, &key, &keylen, 0);
+
+		if (top != NULL && (p != end || ucl_object_type (top) != UCL_OBJECT)) {
+			ucl_object_unref (top);
+			top = NULL;
+		}
+
+		if (top == NULL) {
+			msg_warn_config ("config snapshot %s is corrupted, ignore it",
+					cfg->snapshot_file);
+		}
+	}
+	else {
+		msg_info_config ("config snapshot %s is outdated", cfg->snapshot_file);
+	}
+
+	munmap (map, len);
+
+	return top;
+}
+
+gboolean
+rspamd_config_save_snapshot (struct rspamd_config *cfg, GError **err)
+{
+	GString *buf;
+	gchar tmpbuf[PATH_MAX];
+	gint fd;
+
+	if (cfg->snapshot_file == NULL || cfg->snapshot_key == NULL ||
+			cfg->rcl_obj == NULL) {
+		g_set_error (err, CFG_RCL_ERROR, EINVAL,
+				"config tree cannot be saved");
+		return FALSE;
+	}
+
+	fd = open (cfg->snapshot_file, O_RDONLY);
+
+	if (fd != -1) {
+		if (read (fd, tmpbuf, RSPAMD_CFG_SNAPSHOT_MAGIC_LEN +
+				rspamd_cryptobox_HASHBYTES) ==
+				RSPAMD_CFG_SNAPSHOT_MAGIC_LEN + rspamd_cryptobox_HASHBYTES &&
+				memcmp (tmpbuf + RSPAMD_CFG_SNAPSHOT_MAGIC_LEN,
+						cfg->snapshot_key, rspamd_cryptobox_HASHBYTES) == 0) {
+			/* Snapshot is up to date */
+			close (fd);
+
+			return TRUE;
+		}
+
+		close (fd);
+	}
+
+	buf = g_string_sized_new (65536);
+	g_string_append_len (buf, RSPAMD_CFG_SNAPSHOT_MAGIC,
+			RSPAMD_CFG_SNAPSHOT_MAGIC_LEN);
+	g_string_append_len (buf, (const gchar *)cfg->snapshot_key,
+			rspamd_cryptobox_HASHBYTES);
+	rspamd_config_snapshot_write_elt (buf, cfg->rcl_obj, FALSE);
+
+	/* Readers must never see a partially written snapshot */
+	rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%s.new.%P", cfg->snapshot_file,
+			getpid ());
+	fd = rspamd_file_xopen (tmpbuf, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, CFG_RCL_ERROR, errno,
+				"cannot open %s: %s", tmpbuf, strerror (errno));
+		g_string_free (buf, TRUE);
+
+		return FALSE;
+	}
+
+	if (write (fd, buf->str, buf->len) != (gssize)buf->len) {
+		g_set_error (err, CFG_RCL_ERROR, errno,
+				"cannot write %s: %s", tmpbuf, strerror (errno));
+		close (fd);
+		unlink (tmpbuf);
+		g_string_free (buf, TRUE);
+
+		return FALSE;
+	}
+
+	close (fd);
+	g_string_free (buf, TRUE);
+
+	if (rename (tmpbuf, cfg->snapshot_file) == -1) {
+		g_set_error (err, CFG_RCL_ERROR, errno,
+				"cannot rename %s to %s: %s", tmpbuf, cfg->snapshot_file,
+				strerror (errno));
+		unlink (tmpbuf);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	const gchar *convert_to, rspamd_rcl_section_fin_t logger_fin,
@@ -3112,6 +3774,8 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	struct rspamd_rcl_section *top, *logger;
 	struct ucl_parser *parser;
 	unsigned char cksumbuf[rspamd_cryptobox_HASHBYTES];
+	ucl_object_t *snapshot = NULL;
+	guint nmaps;
 
 	if (stat (filename, &st) == -1) {
 		msg_err_config ("cannot stat %s: %s", filename, strerror (errno));
@@ -3137,21 +3801,41 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	rspamd_strlcpy (cfg->cfg_pool->tag.uid, cfg->checksum,
 			MIN (sizeof (cfg->cfg_pool->tag.uid), strlen (cfg->checksum)));
 
-	parser = ucl_parser_new (UCL_PARSER_SAVE_COMMENTS);
-	rspamd_ucl_add_conf_variables (parser, vars);
-	rspamd_ucl_add_conf_macros (parser, cfg);
+	if (cfg->snapshot_file) {
+		cfg->snapshot_key = rspamd_config_snapshot_key (cfg, filename,
+				data, st.st_size, vars);
+		snapshot = rspamd_config_load_snapshot (cfg);
+	}
 
-	if (!ucl_parser_add_chunk (parser, data, st.st_size)) {
-		msg_err_config ("ucl parser error: %s", ucl_parser_get_error (parser));
-		ucl_parser_free (parser);
+	if (snapshot != NULL) {
+		/* Comments are not saved, so they are not available in this case */
 		munmap (data, st.st_size);
-		return FALSE;
+		cfg->rcl_obj = snapshot;
+		msg_info_config ("use parsed config tree from %s", cfg->snapshot_file);
 	}
+	else {
+		nmaps = g_list_length (cfg->maps);
+		parser = ucl_parser_new (UCL_PARSER_SAVE_COMMENTS);
+		rspamd_ucl_add_conf_variables (parser, vars);
+		rspamd_ucl_add_conf_macros (parser, cfg);
+
+		if (!ucl_parser_add_chunk (parser, data, st.st_size)) {
+			msg_err_config ("ucl parser error: %s", ucl_parser_get_error (parser));
+			ucl_parser_free (parser);
+			munmap (data, st.st_size);
+			return FALSE;
+		}
 
-	munmap (data, st.st_size);
-	cfg->rcl_obj = ucl_parser_get_object (parser);
-	cfg->config_comments = ucl_object_ref (ucl_parser_get_comments (parser));
-	ucl_parser_free (parser);
+		munmap (data, st.st_size);
+		cfg->rcl_obj = ucl_parser_get_object (parser);
+		cfg->config_comments = ucl_object_ref (ucl_parser_get_comments (parser));
+		ucl_parser_free (parser);
+
+		if (g_list_length (cfg->maps) != nmaps) {
+			/* Parts included by include_map are not stable, never cache them */
+			cfg->snapshot_key = NULL;
+		}
+	}
 
 	top = rspamd_rcl_config_init (cfg);
 	rspamd_rcl_set_lua_globals (cfg, cfg->lua_state, vars);
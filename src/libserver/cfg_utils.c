@@ -27,6 +27,8 @@
 #include "stat_api.h"
 #include "unix-std.h"
 #include "libutil/multipattern.h"
+#include "libutil/shared_cache.h"
+#include "redis_pool.h"
 #include <math.h>
 
 #define DEFAULT_SCORE 10.0
@@ -118,6 +120,8 @@ rspamd_config_new (void)
 	cfg->max_diff = 20480;
 
 	cfg->metrics = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	cfg->persistent_caches = g_hash_table_new (rspamd_str_hash,
+			rspamd_str_equal);
 	if (cfg->c_modules == NULL) {
 		cfg->c_modules = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	}
@@ -134,12 +138,23 @@ rspamd_config_new (void)
 				rspamd_str_equal);
 
 	cfg->map_timeout = DEFAULT_MAP_TIMEOUT;
+	cfg->preload_maps = TRUE;
 
 	cfg->log_level = G_LOG_LEVEL_WARNING;
 	cfg->log_extended = TRUE;
 
 	cfg->dns_max_requests = 64;
+	cfg->dns_cache_size = 4 * 1024 * 1024;
+	cfg->dns_cache_negative_ttl = 60.0;
+	cfg->dns_cache_prefetch = 0.1;
+	cfg->loop_watchdog_interval = 0.25;
+	cfg->loop_lag_threshold = 0.1;
+	cfg->dns_cache_prefetch_hits = 3;
+	cfg->dns_cache_prefetch_rate = 16;
+	cfg->result_cache_ttl = 600.0;
 	cfg->history_rows = 200;
+	cfg->keypair_cache_size = 256;
+	cfg->keypair_shared_cache_size = 1024 * 1024;
 
 	/* Default log line */
 	cfg->log_format_str = "id: <$mid>,$if_qid{ qid: <$>,}$if_ip{ ip: $,}"
@@ -156,6 +171,7 @@ rspamd_config_new (void)
 	cfg->lua_state = rspamd_lua_init ();
 	cfg->cache = rspamd_symbols_cache_new (cfg);
 	cfg->ups_ctx = rspamd_upstreams_library_init ();
+	cfg->redis_pool = rspamd_redis_pool_init ();
 	cfg->re_cache = rspamd_re_cache_new ();
 	cfg->doc_strings = ucl_object_typed_new (UCL_OBJECT);
 	/*
@@ -192,6 +208,7 @@ rspamd_config_free (struct rspamd_config *cfg)
 	g_hash_table_unref (cfg->explicit_modules);
 	g_hash_table_unref (cfg->wrk_parsers);
 	g_hash_table_unref (cfg->trusted_keys);
+	g_hash_table_unref (cfg->persistent_caches);
 
 	if (cfg->checksum) {
 		g_free (cfg->checksum);
@@ -225,8 +242,9 @@ rspamd_config_free (struct rspamd_config *cfg)
 	REF_RELEASE (cfg->libs_ctx);
 	rspamd_re_cache_unref (cfg->re_cache);
 	rspamd_upstreams_library_unref (cfg->ups_ctx);
+	rspamd_redis_pool_destroy (cfg->redis_pool);
 	rspamd_mempool_delete (cfg->cfg_pool);
-	lua_close (cfg->lua_state);
+	rspamd_lua_close (cfg->lua_state);
 	g_slice_free1 (sizeof (*cfg), cfg);
 }
 
@@ -388,6 +406,9 @@ rspamd_config_process_var (struct rspamd_config *cfg, const rspamd_ftok_t *var,
 	else if (rspamd_ftok_cstr_equal (&tok, "time_virtual", TRUE)) {
 		type = RSPAMD_LOG_TIME_VIRTUAL;
 	}
+	else if (rspamd_ftok_cstr_equal (&tok, "time_stages", TRUE)) {
+		type = RSPAMD_LOG_TIME_STAGES;
+	}
 	else if (rspamd_ftok_cstr_equal (&tok, "lua", TRUE)) {
 		type = RSPAMD_LOG_LUA;
 	}
@@ -642,7 +663,8 @@ rspamd_config_post_load (struct rspamd_config *cfg, gboolean validate_cache)
 #endif
 
 	rspamd_regexp_library_init ();
-	rspamd_multipattern_library_init (cfg->hs_cache_dir);
+	rspamd_multipattern_library_init (cfg->hs_cache_dir,
+			cfg->shared_hyperscan);
 
 	if ((def_metric =
 		g_hash_table_lookup (cfg->metrics, DEFAULT_METRIC)) == NULL) {
@@ -682,6 +704,25 @@ rspamd_config_post_load (struct rspamd_config *cfg, gboolean validate_cache)
 		msg_err_config ("cannot parse log format, task logging will not be available");
 	}
 
+	if (cfg->keypair_shared_cache_size > 0 && cfg->keypair_shared_cache == NULL) {
+		/* Must be created before workers are spawned to be shared */
+		cfg->keypair_shared_cache = rspamd_shared_cache_new (cfg->cfg_pool, 0,
+				cfg->keypair_shared_cache_size, 0);
+	}
+
+	if (cfg->dns_cache_size > 0 && cfg->dns_cache == NULL) {
+		cfg->dns_cache = rspamd_shared_cache_new (cfg->cfg_pool, 0,
+				cfg->dns_cache_size, 0);
+		rspamd_config_register_persistent_cache (cfg, "dns", cfg->dns_cache);
+	}
+
+	if (cfg->result_cache_size > 0 && cfg->result_cache == NULL) {
+		cfg->result_cache = rspamd_shared_cache_new (cfg->cfg_pool, 0,
+				cfg->result_cache_size, 0);
+		rspamd_config_register_persistent_cache (cfg, "results",
+				cfg->result_cache);
+	}
+
 	/* Init config cache */
 	rspamd_symbols_cache_init (cfg->cache);
 
@@ -1482,6 +1523,176 @@ rspamd_config_add_metric_symbol (struct rspamd_config *cfg,
 	return TRUE;
 }
 
+/* Header of each cache in the caches file followed by name and data */
+struct rspamd_config_saved_cache {
+	guint32 namelen;
+	guint32 unused;
+	guint64 datalen;
+};
+
+static const guchar rspamd_caches_magic[8] = {'r', 's', 'c', 'a', 'c', 'h', 'e', '1'};
+
+void
+rspamd_config_register_persistent_cache (struct rspamd_config *cfg,
+		const gchar *name, struct rspamd_shared_cache *cache)
+{
+	g_assert (name != NULL);
+	g_assert (cache != NULL);
+
+	g_hash_table_replace (cfg->persistent_caches, (gpointer)name, cache);
+}
+
+gboolean
+rspamd_config_save_caches (struct rspamd_config *cfg, const gchar *filename)
+{
+	struct rspamd_config_saved_cache hdr;
+	GHashTableIter it;
+	gpointer k, v;
+	GByteArray *out, *data;
+	gchar tmpname[PATH_MAX];
+	time_t now;
+	guint total = 0;
+	gint fd;
+	gboolean ret = TRUE;
+
+	if (g_hash_table_size (cfg->persistent_caches) == 0) {
+		return FALSE;
+	}
+
+	now = time (NULL);
+	out = g_byte_array_new ();
+	data = g_byte_array_new ();
+	g_byte_array_append (out, rspamd_caches_magic, sizeof (rspamd_caches_magic));
+	g_hash_table_iter_init (&it, cfg->persistent_caches);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_byte_array_set_size (data, 0);
+		total += rspamd_shared_cache_serialize (v, now, data);
+		memset (&hdr, 0, sizeof (hdr));
+		hdr.namelen = strlen (k);
+		hdr.datalen = data->len;
+		g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+		g_byte_array_append (out, k, hdr.namelen);
+		g_byte_array_append (out, data->data, data->len);
+	}
+
+	g_byte_array_free (data, TRUE);
+	/* Write to a temporary file, so a crash never leaves a truncated file */
+	rspamd_snprintf (tmpname, sizeof (tmpname), "%s.new", filename);
+
+	if ((fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC, 00600)) == -1) {
+		msg_info_config ("cannot save caches to %s: %s", tmpname,
+				strerror (errno));
+		g_byte_array_free (out, TRUE);
+
+		return FALSE;
+	}
+
+	if (write (fd, out->data, out->len) != (gssize)out->len) {
+		msg_info_config ("cannot save caches to %s: %s", tmpname,
+				strerror (errno));
+		unlink (tmpname);
+		ret = FALSE;
+	}
+	else if (rename (tmpname, filename) == -1) {
+		msg_info_config ("cannot rename %s to %s: %s", tmpname, filename,
+				strerror (errno));
+		unlink (tmpname);
+		ret = FALSE;
+	}
+	else {
+		msg_info_config ("saved %ud elements of %ud caches to %s", total,
+				g_hash_table_size (cfg->persistent_caches), filename);
+	}
+
+	close (fd);
+	g_byte_array_free (out, TRUE);
+
+	return ret;
+}
+
+gboolean
+rspamd_config_load_caches (struct rspamd_config *cfg, const gchar *filename)
+{
+	struct rspamd_config_saved_cache hdr;
+	struct rspamd_shared_cache *cache;
+	guchar *map, *p, *end;
+	gchar *name;
+	gsize len;
+	time_t now;
+	gint nelts;
+	guint total = 0;
+	gboolean ret = TRUE;
+
+	map = rspamd_file_xmap (filename, PROT_READ, &len);
+
+	if (map == NULL) {
+		msg_info_config ("cannot load caches from %s: %s", filename,
+				strerror (errno));
+		return FALSE;
+	}
+
+	if (len < sizeof (rspamd_caches_magic) ||
+			memcmp (map, rspamd_caches_magic, sizeof (rspamd_caches_magic)) != 0) {
+		msg_warn_config ("invalid caches file %s", filename);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	now = time (NULL);
+	p = map + sizeof (rspamd_caches_magic);
+	end = map + len;
+
+	while (p < end) {
+		if ((gsize)(end - p) < sizeof (hdr)) {
+			ret = FALSE;
+			break;
+		}
+
+		memcpy (&hdr, p, sizeof (hdr));
+		p += sizeof (hdr);
+
+		if ((gsize)(end - p) < hdr.namelen ||
+				(guint64)(end - p - hdr.namelen) < hdr.datalen) {
+			ret = FALSE;
+			break;
+		}
+
+		name = g_strndup ((const gchar *)p, hdr.namelen);
+		p += hdr.namelen;
+		cache = g_hash_table_lookup (cfg->persistent_caches, name);
+
+		if (cache != NULL) {
+			nelts = rspamd_shared_cache_deserialize (cache, p, hdr.datalen,
+					now);
+
+			if (nelts == -1) {
+				msg_warn_config ("malformed data of cache %s in %s", name,
+						filename);
+			}
+			else {
+				total += nelts;
+			}
+		}
+		else {
+			msg_info_config ("skip saved cache %s that is not used now", name);
+		}
+
+		g_free (name);
+		p += hdr.datalen;
+	}
+
+	if (!ret) {
+		msg_warn_config ("caches file %s is truncated", filename);
+	}
+
+	msg_info_config ("loaded %ud elements of caches from %s", total, filename);
+	munmap (map, len);
+
+	return ret;
+}
+
 gboolean
 rspamd_config_is_module_enabled (struct rspamd_config *cfg,
 		const gchar *module_name)
@@ -44,6 +44,23 @@ struct symbol_remove_data {
 	struct symbol_remove_data *prev, *next;
 };
 
+struct rspamd_composites_elt {
+	const gchar *sym;
+	struct rspamd_composite *comp;
+	/* Composite might be true when none of its symbols are found */
+	gboolean always;
+};
+
+struct rspamd_composites_index {
+	GArray *elts;
+	/* Symbol name -> GArray of offsets in elts */
+	GHashTable *symbols;
+	/* The same arrays indexed by symbols cache ids */
+	GArray **symbols_by_id;
+	guint nids;
+	guint nbits;
+};
+
 static rspamd_expression_atom_t * rspamd_composite_expr_parse (const gchar *line, gsize len,
 		rspamd_mempool_t *pool, gpointer ud, GError **err);
 static gint rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom);
@@ -98,7 +115,7 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 	gint rc = 0;
 	struct rspamd_composite *ncomp;
 
-	if ((ms = g_hash_table_lookup (cd->metric_res->symbols, sym)) == NULL) {
+	if ((ms = rspamd_metric_result_find_symbol (cd->metric_res, sym)) == NULL) {
 		if ((ncomp =
 				g_hash_table_lookup (cd->task->cfg->composite_symbols,
 						sym)) != NULL) {
@@ -114,7 +131,7 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 				}
 				setbit (cd->checked, ncomp->id * 2);
 
-				ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
+				ms = rspamd_metric_result_find_symbol (cd->metric_res, sym);
 			}
 			else {
 				/*
@@ -147,6 +164,11 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 	gpointer k, v;
 	gint rc = 0;
 
+	if (cd->task == NULL) {
+		/* Index probe: no symbols are found */
+		return 0;
+	}
+
 	if (isset (cd->checked, cd->composite->id * 2)) {
 		/* We have already checked this composite, so just return its value */
 		rc = isset (cd->checked, cd->composite->id * 2 + 1);
@@ -332,7 +354,7 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 
 	if (has_valid_op) {
 		if (want_remove_symbol || want_forced) {
-			g_hash_table_remove (cd->metric_res->symbols, key);
+			rspamd_metric_result_remove_symbol (cd->metric_res, rd->ms);
 		}
 		if (want_remove_score || want_forced) {
 			cd->metric_res->score -= rd->ms->score;
@@ -340,6 +362,164 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 	}
 }
 
+static void
+rspamd_composites_index_destroy (gpointer p)
+{
+	struct rspamd_composites_index *idx = p;
+
+	g_array_free (idx->elts, TRUE);
+	g_hash_table_unref (idx->symbols);
+}
+
+static void
+rspamd_composites_index_add (struct rspamd_composites_index *idx,
+		const gchar *sym, guint offset)
+{
+	GArray *ar;
+
+	ar = g_hash_table_lookup (idx->symbols, sym);
+
+	if (ar == NULL) {
+		ar = g_array_sized_new (FALSE, FALSE, sizeof (guint), 1);
+		g_hash_table_insert (idx->symbols, (gpointer)sym, ar);
+	}
+	else if (g_array_index (ar, guint, ar->len - 1) == offset) {
+		/* Symbol is used several times in the same composite */
+		return;
+	}
+
+	g_array_append_val (ar, offset);
+}
+
+struct composites_index_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct rspamd_composites_elt *elt;
+	guint offset;
+};
+
+static void
+rspamd_composites_index_atom (const rspamd_ftok_t *atom, gpointer ud)
+{
+	struct composites_index_cbdata *cbd = ud;
+	struct rspamd_symbols_group *gr;
+	struct rspamd_symbol_def *sdef;
+	struct metric *metric;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar *sym;
+
+	sym = rspamd_mempool_alloc (cbd->cfg->cfg_pool, atom->len + 1);
+	rspamd_strlcpy (sym, atom->begin, atom->len + 1);
+
+	while (*sym != '\0' && !g_ascii_isalnum (*sym)) {
+		sym ++;
+	}
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		metric = g_hash_table_lookup (cbd->cfg->metrics, DEFAULT_METRIC);
+
+		if (metric == NULL ||
+				(gr = g_hash_table_lookup (metric->groups, sym + 2)) == NULL) {
+			return;
+		}
+
+		g_hash_table_iter_init (&it, gr->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+
+			if (g_hash_table_lookup (cbd->cfg->composite_symbols, sdef->name)) {
+				cbd->elt->always = TRUE;
+			}
+
+			rspamd_composites_index_add (cbd->idx, sdef->name, cbd->offset);
+		}
+	}
+	else {
+		/* Nested composites are not indexed by their own symbols */
+		if (g_hash_table_lookup (cbd->cfg->composite_symbols, sym)) {
+			cbd->elt->always = TRUE;
+		}
+
+		rspamd_composites_index_add (cbd->idx, sym, cbd->offset);
+	}
+}
+
+static struct rspamd_composites_index *
+rspamd_composites_index_build (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct rspamd_composites_elt elt, *pelt;
+	struct composites_index_cbdata cbd;
+	struct composites_data cd;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i, max_id = 0;
+	gint id;
+
+	idx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*idx));
+	idx->elts = g_array_sized_new (FALSE, FALSE, sizeof (elt),
+			g_hash_table_size (cfg->composite_symbols));
+	idx->symbols = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, (GDestroyNotify)rspamd_array_free_hard);
+
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		elt.sym = k;
+		elt.comp = v;
+		elt.always = FALSE;
+		g_array_append_val (idx->elts, elt);
+		max_id = MAX (max_id, elt.comp->id);
+	}
+
+	idx->nbits = (max_id + 1) * 2;
+	memset (&cd, 0, sizeof (cd));
+	cd.checked = g_malloc0 (NBYTES (idx->nbits));
+
+	for (i = 0; i < idx->elts->len; i ++) {
+		pelt = &g_array_index (idx->elts, struct rspamd_composites_elt, i);
+		cbd.cfg = cfg;
+		cbd.idx = idx;
+		cbd.elt = pelt;
+		cbd.offset = i;
+		rspamd_expression_atom_foreach (pelt->comp->expr,
+				rspamd_composites_index_atom, &cbd);
+
+		/* Check the value of expression when no symbols are found */
+		cd.composite = pelt->comp;
+
+		if (!pelt->always &&
+				rspamd_process_expression (pelt->comp->expr,
+						RSPAMD_EXPRESSION_FLAG_NOOPT, &cd)) {
+			pelt->always = TRUE;
+		}
+	}
+
+	g_free (cd.checked);
+
+	if (cfg->cache) {
+		idx->nids = rspamd_symbols_cache_symbols_count (cfg->cache);
+		idx->symbols_by_id = rspamd_mempool_alloc0 (cfg->cfg_pool,
+				sizeof (GArray *) * idx->nids);
+		g_hash_table_iter_init (&it, idx->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			id = rspamd_symbols_cache_find_symbol (cfg->cache, k);
+
+			if (id >= 0 && (guint)id < idx->nids) {
+				idx->symbols_by_id[id] = v;
+			}
+		}
+	}
+
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			rspamd_composites_index_destroy, idx);
+
+	return idx;
+}
+
 static void
 composites_metric_callback (gpointer key, gpointer value, gpointer data)
 {
@@ -347,18 +527,49 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 	struct composites_data *cd =
 		rspamd_mempool_alloc (task->task_pool, sizeof (struct composites_data));
 	struct metric_result *metric_res = (struct metric_result *)value;
+	struct rspamd_composites_index *idx = task->cfg->composites_index;
+	struct rspamd_composites_elt *elt;
+	struct symbol *s;
+	GArray *ar;
+	guint8 *marked;
+	guint i, j;
 
 	cd->task = task;
 	cd->metric_res = (struct metric_result *)metric_res;
 	cd->symbols_to_remove = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	cd->checked =
-		rspamd_mempool_alloc0 (task->task_pool,
-			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
+		rspamd_mempool_alloc0 (task->task_pool, NBYTES (idx->nbits));
+	marked = rspamd_mempool_alloc0 (task->task_pool, NBYTES (idx->elts->len));
 
-	/* Process hash table */
-	g_hash_table_foreach (task->cfg->composite_symbols,
-		composites_foreach_callback,
-		cd);
+	/* Mark composites that reference any of the symbols found */
+	for (i = 0; i < metric_res->symbols->len; i ++) {
+		s = g_ptr_array_index (metric_res->symbols, i);
+
+		if (s->id >= 0 && (guint)s->id < idx->nids) {
+			ar = idx->symbols_by_id[s->id];
+		}
+		else {
+			ar = g_hash_table_lookup (idx->symbols, s->name);
+		}
+
+		if (ar) {
+			for (j = 0; j < ar->len; j ++) {
+				setbit (marked, g_array_index (ar, guint, j));
+			}
+		}
+	}
+
+	for (i = 0; i < idx->elts->len; i ++) {
+		elt = &g_array_index (idx->elts, struct rspamd_composites_elt, i);
+
+		if (elt->always || isset (marked, i)) {
+			composites_foreach_callback ((gpointer)elt->sym, elt->comp, cd);
+		}
+		else {
+			/* None of symbols is found, so composite is false */
+			setbit (cd->checked, elt->comp->id * 2);
+		}
+	}
 
 	/* Remove symbols that are in composites */
 	g_hash_table_foreach (cd->symbols_to_remove, composites_remove_symbols, cd);
@@ -369,5 +580,9 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 void
 rspamd_make_composites (struct rspamd_task *task)
 {
+	if (task->cfg->composites_index == NULL) {
+		task->cfg->composites_index = rspamd_composites_index_build (task->cfg);
+	}
+
 	g_hash_table_foreach (task->results, composites_metric_callback, task);
 }
@@ -24,6 +24,10 @@
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* special DNS tokens */
 #define DKIM_DNSKEYNAME     "_domainkey"
 /* reserved DNS sub-zone */
@@ -188,6 +192,12 @@ struct rspamd_dkim_header {
 	guint count;
 };
 
+/* Body hash shared by signatures with the same c14n, algorithm and l= */
+struct rspamd_dkim_body_digest {
+	guint len;
+	guchar digest[EVP_MAX_MD_SIZE];
+};
+
 #define DKIM_ERROR dkim_error_quark ()
 GQuark
 dkim_error_quark (void)
@@ -916,6 +926,43 @@ struct rspamd_dkim_key_cbdata {
 	gpointer ud;
 };
 
+/* Load RSA key from the DER encoded public key stored in keydata */
+static gboolean
+rspamd_dkim_key_load_rsa (rspamd_dkim_key_t *key, GError **err)
+{
+	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
+	if (key->key_bio == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot make ssl bio from key");
+
+		return FALSE;
+	}
+
+	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
+	if (key->key_evp == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract pubkey from bio");
+
+		return FALSE;
+	}
+
+	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
+	if (key->key_rsa == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract rsa key from evp key");
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static rspamd_dkim_key_t *
 rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 		guint keylen, GError **err)
@@ -944,34 +991,30 @@ rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 #endif
 	REF_INIT_RETAIN (key, rspamd_dkim_key_free);
 
-	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
-	if (key->key_bio == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot make ssl bio from key");
+	if (!rspamd_dkim_key_load_rsa (key, err)) {
 		REF_RELEASE (key);
 
 		return NULL;
 	}
 
-	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
-	if (key->key_evp == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract pubkey from bio");
-		REF_RELEASE (key);
+	return key;
+}
 
-		return NULL;
-	}
+rspamd_dkim_key_t *
+rspamd_dkim_key_from_der (const guchar *der, gsize len, guint ttl,
+		GError **err)
+{
+	rspamd_dkim_key_t *key;
 
-	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
-	if (key->key_rsa == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract rsa key from evp key");
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (len);
+	memcpy (key->keydata, der, len);
+	key->keylen = len;
+	key->decoded_len = len;
+	key->ttl = ttl;
+	REF_INIT_RETAIN (key, rspamd_dkim_key_free);
+
+	if (!rspamd_dkim_key_load_rsa (key, err)) {
 		REF_RELEASE (key);
 
 		return NULL;
@@ -980,6 +1023,14 @@ rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 	return key;
 }
 
+const guchar *
+rspamd_dkim_key_get_der (rspamd_dkim_key_t *k, gsize *len)
+{
+	*len = k->decoded_len;
+
+	return k->keydata;
+}
+
 /**
  * Free DKIM key
  * @param key
@@ -1132,132 +1183,182 @@ rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 			   ctx->dns_key);
 }
 
-static gboolean
-rspamd_dkim_relaxed_body_step (rspamd_dkim_context_t *ctx, EVP_MD_CTX *ck,
-		const gchar **start, guint size,
-		guint *remain)
+/*
+ * Body canonicalisation state: `remain` follows l= semantics, bare CR or LF
+ * converted to CRLF are not counted in the body length
+ */
+struct rspamd_dkim_body_state {
+	EVP_MD_CTX *ck;
+	guint remain;
+	guint budget;
+	gboolean limited;
+};
+
+#define DKIM_IS_WSP(c) ((c) == ' ' || (c) == '\t' || (c) == '\v' || (c) == '\f')
+
+/*
+ * Skip characters that are neither spaces nor line breaks: all of them are
+ * above 0x20, so whole words are checked at once
+ */
+static inline const gchar *
+rspamd_dkim_skip_printable (const gchar *p, const gchar *end)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-	gboolean got_sp;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = buf;
-	got_sp = FALSE;
+#if defined(__SSE2__)
+	const __m128i lim = _mm_set1_epi8 (0x20);
+	__m128i v;
+	gint bits;
+#endif
+	guint64 w;
 
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			if (got_sp) {
-				/* Ignore spaces at the end of line */
-				t --;
-			}
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-			}
-			else {
-				h ++;
-				len --;
-				added ++;
-			}
-			break;
+#if defined(__SSE2__)
+	while (end - p >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+		/* Unsigned v <= 0x20 */
+		bits = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_min_epu8 (v, lim), v));
+
+		if (bits != 0) {
+			return p + __builtin_ctz (bits);
 		}
-		else if (g_ascii_isspace (*h)) {
-			if (got_sp) {
-				/* Ignore multiply spaces */
-				h++;
-				len--;
-				continue;
-			}
-			else {
-				*t++ = ' ';
-				h++;
-				inlen--;
-				len--;
-				got_sp = TRUE;
-				continue;
-			}
+
+		p += 16;
+	}
+#endif
+
+	while (end - p >= 8) {
+		memcpy (&w, p, sizeof (w));
+
+		/* Some byte is less than 0x21 */
+		if ((w - 0x2121212121212121ULL) & ~w & 0x8080808080808080ULL) {
+			break;
 		}
-		else {
-			got_sp = FALSE;
+
+		p += 8;
+	}
+
+	while (p < end && (guchar)*p > 0x20) {
+		p ++;
+	}
+
+	return p;
+}
+
+static inline const gchar *
+rspamd_dkim_find_eol (const gchar *p, const gchar *end)
+{
+	while ((p = rspamd_dkim_skip_printable (p, end)) < end) {
+		if (*p == '\r' || *p == '\n') {
+			break;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
+
+		p ++;
 	}
 
-	*start = h;
+	return p;
+}
 
-	if (*remain > 0) {
-		size_t cklen = MIN(t - buf, *remain + added);
-		EVP_DigestUpdate (ck, buf, cklen);
-		*remain = *remain - (cklen - added);
-#if 0
-		msg_debug_dkim ("update signature with buffer (%ud size, %ud remain, %ud added): %*s",
-				cklen, *remain, added, cklen, buf);
-#else
-		msg_debug_dkim ("update signature with body buffer "
-				"(%ud size, %ud remain, %ud added)",
-						cklen, *remain, added);
-#endif
+static inline void
+rspamd_dkim_body_update (struct rspamd_dkim_body_state *st,
+		const gchar *data, gsize len)
+{
+	if (st->limited) {
+		len = MIN (len, st->budget);
+		st->budget -= len;
 	}
 
-	return (len != 0);
+	if (len > 0) {
+		EVP_DigestUpdate (st->ck, data, len);
+	}
 }
 
-static gboolean
-rspamd_dkim_simple_body_step (rspamd_dkim_context_t *ctx,
-		EVP_MD_CTX *ck, const gchar **start, guint size,
-		guint *remain)
+/* Relaxed canonicalisation of a line without its terminator */
+static void
+rspamd_dkim_relaxed_body_line (struct rspamd_dkim_body_state *st,
+		const gchar *p, const gchar *end, gboolean terminated)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = &buf[0];
-
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
+	const gchar *run;
+
+	while (p < end) {
+		run = p;
+
+		/* Run of non space characters, including control ones */
+		while ((p = rspamd_dkim_skip_printable (p, end)) < end &&
+				!DKIM_IS_WSP (*p)) {
+			p ++;
+		}
+
+		rspamd_dkim_body_update (st, run, p - run);
+
+		if (p < end) {
+			while (p < end && DKIM_IS_WSP (*p)) {
+				p ++;
 			}
-			else {
-				h ++;
-				len --;
-				added ++;
+
+			/* Ignore spaces at the end of line */
+			if (p < end || !terminated) {
+				rspamd_dkim_body_update (st, " ", 1);
 			}
-			break;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
 	}
+}
+
+/*
+ * Canonicalise and hash body line by line, hashing runs of unchanged
+ * characters directly from the message
+ */
+static void
+rspamd_dkim_canonize_body_lines (rspamd_dkim_context_t *ctx,
+		const gchar *p, const gchar *end, guint remain)
+{
+	struct rspamd_dkim_body_state st;
+	const gchar *eol;
+	guint added, used;
+	gboolean terminated;
+
+	st.ck = ctx->body_hash;
+	st.remain = remain;
+	st.limited = (ctx->len != 0);
+
+	while (p < end && st.remain > 0) {
+		eol = rspamd_dkim_find_eol (p, end);
+		terminated = (eol < end);
+		added = 0;
+
+		if (terminated && !(eol[0] == '\r' && eol + 1 < end && eol[1] == '\n')) {
+			added = 1;
+		}
+
+		st.budget = st.remain + added;
 
-	*start = h;
+		if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
+			if (terminated && added == 0) {
+				/* Line is already CRLF terminated */
+				rspamd_dkim_body_update (&st, p, eol - p + 2);
+			}
+			else {
+				rspamd_dkim_body_update (&st, p, eol - p);
 
-	if (*remain > 0) {
-		size_t cklen = MIN(t - buf, *remain + added);
-		EVP_DigestUpdate (ck, buf, cklen);
-		*remain = *remain - (cklen - added);
-		msg_debug_dkim ("update signature with body buffer "
-				"(%ud size, %ud remain, %ud added)",
-				cklen, *remain, added);
+				if (terminated) {
+					rspamd_dkim_body_update (&st, CRLF, sizeof (CRLF) - 1);
+				}
+			}
+		}
+		else {
+			rspamd_dkim_relaxed_body_line (&st, p, eol, terminated);
+
+			if (terminated) {
+				rspamd_dkim_body_update (&st, CRLF, sizeof (CRLF) - 1);
+			}
+		}
+
+		if (st.limited) {
+			used = st.remain + added - st.budget;
+			st.remain -= used - added;
+		}
+
+		p = terminated ? eol + (added ? 1 : 2) : end;
 	}
 
-	return (len != 0);
+	msg_debug_dkim ("updated signature with body (%ud remain)", st.remain);
 }
 
 static gboolean
@@ -1305,15 +1406,7 @@ rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
 			}
 		}
 		else {
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				/* Simple canonization */
-				while (rspamd_dkim_simple_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain)) ;
-			}
-			else {
-				while (rspamd_dkim_relaxed_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain)) ;
-			}
+			rspamd_dkim_canonize_body_lines (ctx, start, end, remain);
 		}
 		return TRUE;
 	}
@@ -1710,10 +1803,12 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	const gchar *p, *headers_end = NULL, *end, *body_end;
 	gboolean got_cr = FALSE, got_crlf = FALSE, got_lf = FALSE;
 	guchar raw_digest[EVP_MAX_MD_SIZE];
+	gchar bh_key[64];
 	gsize dlen;
 	gint res = DKIM_CONTINUE;
 	guint i;
 	struct rspamd_dkim_header *dh;
+	struct rspamd_dkim_body_digest *bd;
 	gint nid;
 
 	g_return_val_if_fail (ctx != NULL,		 DKIM_ERROR);
@@ -1789,9 +1884,32 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 
 	/* Start canonization of body part */
 	body_end = end;
-	if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
-		return DKIM_RECORD_ERROR;
+	rspamd_snprintf (bh_key, sizeof (bh_key), "dkim_bh_%d_%d_%z",
+			ctx->body_canon_type, ctx->sig_alg, ctx->len);
+	bd = rspamd_mempool_get_variable (task->task_pool, bh_key);
+
+	if (bd == NULL) {
+		if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
+			return DKIM_RECORD_ERROR;
+		}
+
+		bd = rspamd_mempool_alloc (task->task_pool, sizeof (*bd));
+		bd->len = EVP_MD_CTX_size (ctx->body_hash);
+		EVP_DigestFinal_ex (ctx->body_hash, bd->digest, NULL);
+		rspamd_mempool_set_variable (task->task_pool, bh_key, bd, NULL);
 	}
+	else {
+		msg_debug_dkim ("reuse body hash for %s", bh_key);
+	}
+
+	/* Check bh field before canonizing headers */
+	if (memcmp (ctx->bh, bd->digest, ctx->bhlen) != 0) {
+		msg_debug_dkim ("bh value missmatch: %*xs versus %*xs",
+				(gint)ctx->bhlen, ctx->bh,
+				(gint)bd->len, bd->digest);
+		return DKIM_REJECT;
+	}
+
 	/* Now canonize headers */
 	for (i = 0; i < ctx->hlist->len; i++) {
 		dh = g_ptr_array_index (ctx->hlist, i);
@@ -1801,16 +1919,6 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	/* Canonize dkim signature */
 	rspamd_dkim_canonize_header (ctx, task, DKIM_SIGNHEADER, 1, TRUE);
 
-	dlen = EVP_MD_CTX_size (ctx->body_hash);
-	EVP_DigestFinal_ex (ctx->body_hash, raw_digest, NULL);
-
-	/* Check bh field */
-	if (memcmp (ctx->bh, raw_digest, ctx->bhlen) != 0) {
-		msg_debug_dkim ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
-				dlen, raw_digest);
-		return DKIM_REJECT;
-	}
-
 	dlen = EVP_MD_CTX_size (ctx->headers_hash);
 	EVP_DigestFinal_ex (ctx->headers_hash, raw_digest, NULL);
 	/* Check headers signature */
@@ -138,6 +138,26 @@ const gchar* rspamd_dkim_get_domain (rspamd_dkim_context_t *ctx);
 const gchar* rspamd_dkim_get_dns_key (rspamd_dkim_context_t *ctx);
 guint rspamd_dkim_key_get_ttl (rspamd_dkim_key_t *k);
 
+/**
+ * Get DER encoded public key of a parsed key, e.g. to share it with other
+ * processes
+ * @param k key object
+ * @param len output length of data
+ * @return key data owned by the key
+ */
+const guchar * rspamd_dkim_key_get_der (rspamd_dkim_key_t *k, gsize *len);
+
+/**
+ * Create key from DER encoded public key
+ * @param der key data
+ * @param len length of data
+ * @param ttl time to live of the key
+ * @param err pointer to error object
+ * @return new key with refcount 1 or NULL
+ */
+rspamd_dkim_key_t * rspamd_dkim_key_from_der (const guchar *der, gsize len,
+	guint ttl, GError **err);
+
 /**
  * Free DKIM key
  * @param key
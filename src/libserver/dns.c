@@ -20,6 +20,8 @@
 #include "utlist.h"
 #include "uthash.h"
 #include "rdns_event.h"
+#include "libutil/shared_cache.h"
+#include "libutil/timer_wheel.h"
 
 static struct rdns_upstream_elt* rspamd_dns_select_upstream (const char *name,
 		size_t len, void *ups_data);
@@ -31,6 +33,20 @@ static void rspamd_dns_upstream_ok (struct rdns_upstream_elt *elt,
 static void rspamd_dns_upstream_fail (struct rdns_upstream_elt *elt,
 		void *ups_data);
 
+static size_t rspamd_dns_cache_lookup (const char *name, size_t len,
+		enum rdns_request_type type, uint8_t *buf, size_t buflen,
+		void *cache_data);
+static void rspamd_dns_cache_store (const char *name, size_t len,
+		enum rdns_request_type type, const uint8_t *packet, size_t pktlen,
+		struct rdns_reply *reply, void *cache_data);
+
+static size_t rspamd_dns_synthetic_lookup (const char *name, size_t len,
+		enum rdns_request_type type, uint8_t *buf, size_t buflen,
+		void *cache_data);
+static void rspamd_dns_synthetic_store (const char *name, size_t len,
+		enum rdns_request_type type, const uint8_t *packet, size_t pktlen,
+		struct rdns_reply *reply, void *cache_data);
+
 static struct rdns_upstream_context rspamd_ups_ctx = {
 		.select = rspamd_dns_select_upstream,
 		.select_retransmit = rspamd_dns_select_upstream_retransmit,
@@ -39,20 +55,92 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 		.data = NULL
 };
 
+static struct rdns_cache_context rspamd_dns_cache_ctx = {
+		.lookup = rspamd_dns_cache_lookup,
+		.store = rspamd_dns_cache_store,
+		.data = NULL
+};
+
+static struct rdns_cache_context rspamd_dns_synthetic_ctx = {
+		.lookup = rspamd_dns_synthetic_lookup,
+		.store = rspamd_dns_synthetic_store,
+		.data = NULL
+};
+
+/* Maximum length of a domain name in the wire format */
+#define RSPAMD_DNS_CACHE_MAX_NAME 255
+
+/* Maximum length of the key used to find pending requests */
+#define RSPAMD_DNS_INFLIGHT_KEY_LEN 288
+
+/* Number of cached names whose hits are counted for refreshing */
+#define RSPAMD_DNS_HITS_SIZE 8192
+
+/* Prepended to replies in the cache to find out the time left */
+struct rspamd_dns_cache_hdr {
+	guint64 expire;
+	guint32 ttl;
+	guint32 unused;
+};
+
+/* Background refresh of a cached reply */
+struct rspamd_dns_prefetch {
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_timer tm;
+	enum rdns_request_type type;
+	gchar *name;
+};
+
+/* Request to the resolver shared by all callers asking for the same name */
+struct rspamd_dns_inflight {
+	struct rspamd_dns_resolver *resolver;
+	struct rdns_request *req;
+	GQueue *waiters;
+	gchar *key;
+	gdouble start;
+	gboolean replied;
+};
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
-	struct rdns_request *req;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_async_event *ev;
 };
 
+static void
+rspamd_dns_inflight_free (struct rspamd_dns_inflight *inflight)
+{
+	if (inflight->key) {
+		/* New requests should not join the finished one */
+		if (g_hash_table_lookup (inflight->resolver->inflight,
+				inflight->key) == inflight) {
+			g_hash_table_remove (inflight->resolver->inflight, inflight->key);
+		}
+
+		g_free (inflight->key);
+	}
+
+	g_queue_free (inflight->waiters);
+	g_slice_free1 (sizeof (*inflight), inflight);
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	struct rspamd_dns_inflight *inflight = reqdata->inflight;
+
+	g_queue_remove (inflight->waiters, reqdata);
+
+	if (!inflight->replied && g_queue_get_length (inflight->waiters) == 0) {
+		/* Nobody waits for this reply any longer, so cancel request */
+		rdns_request_release (inflight->req);
+		rspamd_dns_inflight_free (inflight);
+	}
 
-	rdns_request_release (reqdata->req);
 	if (reqdata->pool == NULL) {
 		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
 	}
@@ -61,21 +149,86 @@ rspamd_dns_fin_cb (gpointer arg)
 static void
 rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_request_ud *reqdata;
+	struct rspamd_worker_metrics *wm;
+
+	/*
+	 * Reply is owned by request which is released by librdns after this
+	 * callback, so waiters are not allowed to cancel it
+	 */
+	inflight->replied = TRUE;
+	inflight->resolver->wait_time += rspamd_get_ticks () - inflight->start;
+	inflight->resolver->replies ++;
+	wm = rspamd_metrics_current ();
+
+	if (wm) {
+		/* Coalesced waiters are accounted once per real request */
+		rspamd_metrics_observe (&wm->dns_time,
+				rspamd_get_ticks () - inflight->start);
+	}
 
-	reqdata->cb (reply, reqdata->ud);
+	while ((reqdata = g_queue_pop_head (inflight->waiters)) != NULL) {
+		reqdata->cb (reply, reqdata->ud);
 
-	if (reqdata->session) {
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
+		if (reqdata->session) {
+			rspamd_session_remove_event_specific (reqdata->session,
+					reqdata->ev);
+		}
+		else if (reqdata->pool == NULL) {
+			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+		}
 	}
-	else if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+
+	rspamd_dns_inflight_free (inflight);
+}
+
+static struct rspamd_dns_inflight *
+rspamd_dns_inflight_new (struct rspamd_dns_resolver *resolver,
+		enum rdns_request_type type, const char *name)
+{
+	struct rspamd_dns_inflight *inflight;
+	gchar key[RSPAMD_DNS_INFLIGHT_KEY_LEN];
+	gsize keylen;
+
+	keylen = rspamd_snprintf (key, sizeof (key), "%d:%s", (gint)type, name);
+
+	if (keylen < sizeof (key) - 1) {
+		rspamd_str_lc (key, keylen);
+		inflight = g_hash_table_lookup (resolver->inflight, key);
+
+		if (inflight != NULL) {
+			msg_debug ("join pending DNS request for %s", name);
+
+			return inflight;
+		}
 	}
+	else {
+		/* Too long names are never coalesced */
+		keylen = 0;
+	}
+
+	inflight = g_slice_alloc0 (sizeof (*inflight));
+	inflight->resolver = resolver;
+	inflight->req = rdns_make_request_full (resolver->r, rspamd_dns_callback,
+			inflight, resolver->request_timeout, resolver->max_retransmits, 1,
+			name, type);
+
+	if (inflight->req == NULL) {
+		g_slice_free1 (sizeof (*inflight), inflight);
+
+		return NULL;
+	}
+
+	inflight->waiters = g_queue_new ();
+	inflight->start = rspamd_get_ticks ();
+
+	if (keylen > 0) {
+		inflight->key = g_strdup (key);
+		g_hash_table_insert (resolver->inflight, inflight->key, inflight);
+	}
+
+	return inflight;
 }
 
 gboolean
@@ -87,7 +240,7 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 	enum rdns_request_type type,
 	const char *name)
 {
-	struct rdns_request *req;
+	struct rspamd_dns_inflight *inflight;
 	struct rspamd_dns_request_ud *reqdata = NULL;
 
 	g_assert (resolver != NULL);
@@ -96,6 +249,12 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 		return FALSE;
 	}
 
+	inflight = rspamd_dns_inflight_new (resolver, type, name);
+
+	if (inflight == NULL) {
+		return FALSE;
+	}
+
 	if (pool != NULL) {
 		reqdata =
 			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
@@ -107,26 +266,16 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
+	reqdata->inflight = inflight;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
+	/* Each waiter has its own event, so sessions are finished independently */
+	g_queue_push_tail (inflight->waiters, reqdata);
 
 	if (session) {
-		if (req != NULL) {
-			rspamd_session_add_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
-		}
-	}
-
-	if (req == NULL) {
-		if (pool == NULL) {
-			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
-		}
-		return FALSE;
+		reqdata->ev = rspamd_session_add_event (session,
+				(event_finalizer_t)rspamd_dns_fin_cb,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
@@ -220,6 +369,16 @@ rspamd_dns_server_init (struct upstream *up, gpointer ud)
 	rspamd_upstream_set_data (up, elt);
 }
 
+/*
+ * Query of NS records of the root zone, replies have the same ID, "RS"
+ */
+static const guchar rspamd_dns_probe[] = {
+	'R', 'S', 0x01, 0x00, /* ID, RD flag */
+	0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* QDCOUNT = 1 */
+	0x00, /* root name */
+	0x00, 0x02, 0x00, 0x01 /* NS, IN */
+};
+
 struct rspamd_dns_resolver *
 dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base,
@@ -229,6 +388,7 @@ dns_resolver_init (rspamd_logger_t *logger,
 
 	dns_resolver = g_slice_alloc0 (sizeof (struct rspamd_dns_resolver));
 	dns_resolver->ev_base = ev_base;
+	dns_resolver->inflight = g_hash_table_new (g_str_hash, g_str_equal);
 	if (cfg != NULL) {
 		dns_resolver->request_timeout = cfg->dns_timeout;
 		dns_resolver->max_retransmits = cfg->dns_retransmits;
@@ -274,10 +434,28 @@ dns_resolver_init (rspamd_logger_t *logger,
 		rspamd_upstreams_foreach (dns_resolver->ups, rspamd_dns_server_init,
 				dns_resolver);
 		rspamd_upstreams_set_flags (dns_resolver->ups, RSPAMD_UPSTREAM_FLAG_NORESOLVE);
+
+		if (cfg->upstream_probe_interval > 0) {
+			rspamd_upstreams_set_probe (dns_resolver->ups,
+					RSPAMD_UPSTREAM_PROBE_UDP,
+					rspamd_dns_probe, sizeof (rspamd_dns_probe), "RS");
+		}
 		rdns_resolver_set_upstream_lib (dns_resolver->r, &rspamd_ups_ctx,
 				dns_resolver->ups);
 	}
 
+	if (cfg != NULL && cfg->dns_cache != NULL) {
+		/* Each resolver has its own context as data is stored there */
+		dns_resolver->cache_ctx = rspamd_dns_cache_ctx;
+		rdns_resolver_set_cache (dns_resolver->r, &dns_resolver->cache_ctx,
+				dns_resolver);
+
+		if (cfg->dns_cache_prefetch > 0) {
+			dns_resolver->hits = rspamd_lru_hash_new_full (RSPAMD_DNS_HITS_SIZE,
+					g_free, g_free, rspamd_str_hash, rspamd_str_equal);
+		}
+	}
+
 	rdns_resolver_init (dns_resolver->r);
 
 	return dns_resolver;
@@ -338,3 +516,299 @@ rspamd_dns_upstream_fail (struct rdns_upstream_elt *elt,
 
 	rspamd_upstream_fail (up);
 }
+
+/* Cache key is the type of request followed by the lowercased name */
+static gsize
+rspamd_dns_cache_key (const char *name, size_t len,
+		enum rdns_request_type type, guchar *key)
+{
+	guint16 t = type;
+
+	if (len == 0 || len > RSPAMD_DNS_CACHE_MAX_NAME) {
+		return 0;
+	}
+
+	memcpy (key, &t, sizeof (t));
+	memcpy (key + sizeof (t), name, len);
+	rspamd_str_lc ((gchar *)key + sizeof (t), len);
+
+	return len + sizeof (t);
+}
+
+static void
+rspamd_dns_prefetch_cb (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_prefetch *pf = ud;
+
+	/* Reply has been already stored in the cache by librdns */
+	msg_debug ("refreshed cached DNS reply for %s: %s", pf->name,
+			rdns_strerror (reply->code));
+	g_free (pf->name);
+	g_slice_free1 (sizeof (*pf), pf);
+}
+
+static void
+rspamd_dns_prefetch_run (gpointer ud)
+{
+	struct rspamd_dns_prefetch *pf = ud;
+	struct rspamd_dns_resolver *resolver = pf->resolver;
+	struct rdns_request *req;
+
+	/* Request must not be satisfied by the reply being refreshed */
+	resolver->prefetching = TRUE;
+	req = rdns_make_request_full (resolver->r, rspamd_dns_prefetch_cb, pf,
+			resolver->request_timeout, resolver->max_retransmits, 1,
+			pf->name, pf->type);
+	resolver->prefetching = FALSE;
+
+	if (req == NULL) {
+		g_free (pf->name);
+		g_slice_free1 (sizeof (*pf), pf);
+	}
+}
+
+static void
+rspamd_dns_prefetch_claim_cb (guchar *value, gboolean found, gpointer ud)
+{
+	gboolean *claimed = ud;
+
+	*claimed = !found;
+}
+
+/*
+ * Counts hits of cached replies and schedules refresh of popular ones when
+ * they are about to expire. Refreshes are not started from the lookup itself,
+ * as it is called by librdns while another request is being made.
+ */
+static void
+rspamd_dns_prefetch_check (struct rspamd_dns_resolver *resolver,
+		const char *name, size_t len, enum rdns_request_type type,
+		const guchar *key, gsize keylen,
+		const struct rspamd_dns_cache_hdr *hdr, time_t now)
+{
+	struct rspamd_config *cfg = resolver->cfg;
+	struct rspamd_dns_prefetch *pf;
+	gchar hkey[RSPAMD_DNS_INFLIGHT_KEY_LEN], ckey[sizeof (hkey)];
+	gsize hkeylen;
+	guint *hits, left;
+	gboolean claimed = FALSE;
+
+	if (hdr->expire <= (guint64)now) {
+		return;
+	}
+
+	hkeylen = rspamd_snprintf (hkey, sizeof (hkey), "%d:%*s", (gint)type,
+			(gint)len, name);
+	rspamd_str_lc (hkey, hkeylen);
+	left = hdr->expire - now;
+	hits = rspamd_lru_hash_lookup (resolver->hits, hkey, now);
+
+	if (hits == NULL) {
+		/* Hits are counted during the current TTL of a reply */
+		hits = g_malloc0 (sizeof (*hits));
+		rspamd_lru_hash_insert (resolver->hits, g_strdup (hkey), hits,
+				now, left);
+	}
+
+	(*hits) ++;
+
+	if (*hits < cfg->dns_cache_prefetch_hits ||
+			left > hdr->ttl * cfg->dns_cache_prefetch) {
+		return;
+	}
+
+	if (resolver->prefetch_second != now) {
+		resolver->prefetch_second = now;
+		resolver->prefetch_count = 0;
+	}
+
+	if (resolver->prefetch_count >= cfg->dns_cache_prefetch_rate) {
+		return;
+	}
+
+	/* All processes see the same reply, so only one of them refreshes it */
+	ckey[0] = 'p';
+	memcpy (ckey + 1, key, keylen);
+	rspamd_shared_cache_update (cfg->dns_cache, ckey, keylen + 1, 1, now,
+			left + 1, rspamd_dns_prefetch_claim_cb, &claimed);
+
+	if (!claimed) {
+		return;
+	}
+
+	resolver->prefetch_count ++;
+	pf = g_slice_alloc0 (sizeof (*pf));
+	pf->resolver = resolver;
+	pf->type = type;
+	pf->name = g_strndup (name, len);
+	rspamd_timer_add (rspamd_timer_wheel_get (resolver->ev_base), &pf->tm,
+			0, rspamd_dns_prefetch_run, pf);
+}
+
+static size_t
+rspamd_dns_cache_lookup (const char *name, size_t len,
+		enum rdns_request_type type, uint8_t *buf, size_t buflen,
+		void *cache_data)
+{
+	struct rspamd_dns_resolver *resolver = cache_data;
+	struct rspamd_dns_cache_hdr hdr;
+	guchar key[RSPAMD_DNS_CACHE_MAX_NAME + sizeof (guint16)];
+	gsize keylen, vlen = 0;
+	gpointer val;
+	time_t now;
+
+	if (resolver->prefetching) {
+		return 0;
+	}
+
+	keylen = rspamd_dns_cache_key (name, len, type, key);
+
+	if (keylen == 0) {
+		return 0;
+	}
+
+	now = time (NULL);
+	val = rspamd_shared_cache_lookup (resolver->cfg->dns_cache, key, keylen,
+			now, &vlen);
+
+	if (val == NULL) {
+		return 0;
+	}
+
+	if (vlen <= sizeof (hdr) || vlen - sizeof (hdr) > buflen) {
+		vlen = 0;
+	}
+	else {
+		memcpy (&hdr, val, sizeof (hdr));
+		vlen -= sizeof (hdr);
+		memcpy (buf, (guchar *)val + sizeof (hdr), vlen);
+		msg_debug ("found cached DNS reply for %*s", (gint)len, name);
+
+		if (resolver->hits) {
+			rspamd_dns_prefetch_check (resolver, name, len, type, key, keylen,
+					&hdr, now);
+		}
+	}
+
+	g_free (val);
+
+	return vlen;
+}
+
+static void
+rspamd_dns_cache_store (const char *name, size_t len,
+		enum rdns_request_type type, const uint8_t *packet, size_t pktlen,
+		struct rdns_reply *reply, void *cache_data)
+{
+	struct rspamd_dns_resolver *resolver = cache_data;
+	struct rspamd_config *cfg = resolver->cfg;
+	struct rdns_reply_entry *elt;
+	struct rspamd_dns_cache_hdr *hdr;
+	guchar key[RSPAMD_DNS_CACHE_MAX_NAME + sizeof (guint16)];
+	gsize keylen;
+	gint32 ttl = -1;
+	time_t now;
+
+	switch (reply->code) {
+	case RDNS_RC_NOERROR:
+		/* The whole reply expires with its shortest record */
+		DL_FOREACH (reply->entries, elt) {
+			if (ttl == -1 || elt->ttl < ttl) {
+				ttl = elt->ttl;
+			}
+		}
+		break;
+	case RDNS_RC_NXDOMAIN:
+	case RDNS_RC_NOREC:
+		ttl = cfg->dns_cache_negative_ttl;
+		break;
+	default:
+		/* Temporary failures are never cached */
+		return;
+	}
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	keylen = rspamd_dns_cache_key (name, len, type, key);
+
+	if (keylen == 0) {
+		return;
+	}
+
+	now = time (NULL);
+	hdr = g_malloc (sizeof (*hdr) + pktlen);
+	hdr->expire = now + ttl;
+	hdr->ttl = ttl;
+	hdr->unused = 0;
+	memcpy ((guchar *)hdr + sizeof (*hdr), packet, pktlen);
+	rspamd_shared_cache_insert (cfg->dns_cache, key, keylen, hdr,
+			sizeof (*hdr) + pktlen, now, ttl);
+	g_free (hdr);
+}
+
+/*
+ * Builds NXDOMAIN reply that has the same question as the request
+ */
+static size_t
+rspamd_dns_synthetic_lookup (const char *name, size_t len,
+		enum rdns_request_type type, uint8_t *buf, size_t buflen,
+		void *cache_data)
+{
+	const gchar *p = name, *end = name + len, *dot;
+	guint8 *out = buf;
+	gsize llen;
+
+	/* Header, labels with their lengths, type and class */
+	if (len + 2 + 12 + 4 > buflen) {
+		return 0;
+	}
+
+	memset (out, 0, 12);
+	out[2] = 0x81; /* QR, RD */
+	out[3] = 0x83; /* RA, NXDOMAIN */
+	out[5] = 1; /* QDCOUNT */
+	out += 12;
+
+	while (p < end) {
+		dot = memchr (p, '.', end - p);
+		llen = dot ? (gsize)(dot - p) : (gsize)(end - p);
+
+		if (llen == 0 || llen > 63) {
+			/* Let resolver to deal with such a name */
+			return 0;
+		}
+
+		*out++ = llen;
+		memcpy (out, p, llen);
+		out += llen;
+		p += llen + 1;
+	}
+
+	*out++ = 0;
+	*out++ = ((guint)type >> 8) & 0xff;
+	*out++ = (guint)type & 0xff;
+	*out++ = 0;
+	*out++ = 1; /* IN */
+
+	return out - buf;
+}
+
+static void
+rspamd_dns_synthetic_store (const char *name, size_t len,
+		enum rdns_request_type type, const uint8_t *packet, size_t pktlen,
+		struct rdns_reply *reply, void *cache_data)
+{
+	/* Synthetic replies are never stored */
+}
+
+void
+rspamd_dns_resolver_set_synthetic (struct rspamd_dns_resolver *resolver)
+{
+	g_assert (resolver != NULL);
+
+	if (resolver->r != NULL) {
+		rdns_resolver_set_cache (resolver->r, &rspamd_dns_synthetic_ctx, NULL);
+	}
+}
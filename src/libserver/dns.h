@@ -23,6 +23,7 @@
 #include "logger.h"
 #include "rdns.h"
 #include "upstream.h"
+#include "libutil/hash.h"
 
 struct rspamd_config;
 
@@ -31,8 +32,16 @@ struct rspamd_dns_resolver {
 	struct event_base *ev_base;
 	struct upstream_list *ups;
 	struct rspamd_config *cfg;
+	GHashTable *inflight;
 	gdouble request_timeout;
 	guint max_retransmits;
+	gdouble wait_time;          /**< total time waiting for replies		*/
+	guint64 replies;            /**< replies received (or timed out)	*/
+	rspamd_lru_hash_t *hits;    /**< hits of cached replies				*/
+	time_t prefetch_second;     /**< second of the last refreshes		*/
+	guint prefetch_count;       /**< refreshes during that second		*/
+	gboolean prefetching;       /**< cache is not used when refreshing	*/
+	struct rdns_cache_context cache_ctx;
 };
 
 /* Rspamd DNS API */
@@ -44,7 +53,8 @@ struct rspamd_dns_resolver * dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base, struct rspamd_config *cfg);
 
 /**
- * Make a DNS request
+ * Make a DNS request. Requests for the same name and type sent while another
+ * one is pending are not sent again but get a reply of the pending request
  * @param resolver resolver object
  * @param session async session to register event
  * @param pool memory pool for storage
@@ -74,4 +84,12 @@ gboolean make_dns_request_task_forced (struct rspamd_task *task,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Answer all requests of the resolver with NXDOMAIN instead of querying
+ * servers, replies are still delivered from the event loop. It is intended to
+ * profile message processing without network latency
+ * @param resolver
+ */
+void rspamd_dns_resolver_set_synthetic (struct rspamd_dns_resolver *resolver);
+
 #endif
@@ -16,7 +16,7 @@
 #include "config.h"
 #include "rspamd.h"
 #include "events.h"
-#include "xxhash.h"
+#include "utlist.h"
 
 #define RSPAMD_SESSION_FLAG_WATCHING (1 << 0)
 #define RSPAMD_SESSION_FLAG_DESTROYING (1 << 1)
@@ -52,51 +52,47 @@ struct rspamd_async_event {
 	event_finalizer_t fin;
 	void *user_data;
 	struct rspamd_async_watcher *w;
+	struct rspamd_async_event *prev, *next;
 };
 
 struct rspamd_async_session {
 	session_finalizer_t fin;
 	event_finalizer_t restore;
 	event_finalizer_t cleanup;
-	GHashTable *events;
+	/* Pending events and removed events to be reused */
+	struct rspamd_async_event *events;
+	struct rspamd_async_event *free_events;
+	guint nevents;
 	void *user_data;
 	rspamd_mempool_t *pool;
 	struct rspamd_async_watcher *cur_watcher;
 	guint flags;
 };
 
-static gboolean
-rspamd_event_equal (gconstpointer a, gconstpointer b)
+static struct rspamd_async_event *
+rspamd_session_event_alloc (struct rspamd_async_session *session)
 {
-	const struct rspamd_async_event *ev1 = a, *ev2 = b;
+	struct rspamd_async_event *ev;
 
-	if (ev1->fin == ev2->fin) {
-		return ev1->user_data == ev2->user_data;
+	if (session->free_events != NULL) {
+		ev = session->free_events;
+		session->free_events = ev->next;
+	}
+	else {
+		ev = rspamd_mempool_alloc (session->pool, sizeof (*ev));
 	}
 
-	return FALSE;
+	return ev;
 }
 
-static guint
-rspamd_event_hash (gconstpointer a)
+static void
+rspamd_session_event_release (struct rspamd_async_session *session,
+		struct rspamd_async_event *ev)
 {
-	const struct rspamd_async_event *ev = a;
-	XXH64_state_t st;
-	union {
-		event_finalizer_t f;
-		gpointer p;
-	} u;
-
-	u.f = ev->fin;
-
-	XXH64_reset (&st, rspamd_hash_seed ());
-	XXH64_update (&st, &ev->user_data, sizeof (gpointer));
-	XXH64_update (&st, &u, sizeof (u));
-
-	return XXH64_digest (&st);
+	ev->next = session->free_events;
+	session->free_events = ev;
 }
 
-
 struct rspamd_async_session *
 rspamd_session_create (rspamd_mempool_t * pool, session_finalizer_t fin,
 	event_finalizer_t restore, event_finalizer_t cleanup, void *user_data)
@@ -109,16 +105,11 @@ rspamd_session_create (rspamd_mempool_t * pool, session_finalizer_t fin,
 	new->restore = restore;
 	new->cleanup = cleanup;
 	new->user_data = user_data;
-	new->events = g_hash_table_new (rspamd_event_hash, rspamd_event_equal);
-
-	rspamd_mempool_add_destructor (pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		new->events);
 
 	return new;
 }
 
-void
+struct rspamd_async_event *
 rspamd_session_add_event (struct rspamd_async_session *session,
 	event_finalizer_t fin,
 	void *user_data,
@@ -128,11 +119,10 @@ rspamd_session_add_event (struct rspamd_async_session *session,
 
 	if (session == NULL) {
 		msg_err ("session is NULL");
-		return;
+		return NULL;
 	}
 
-	new = rspamd_mempool_alloc (session->pool,
-			sizeof (struct rspamd_async_event));
+	new = rspamd_session_event_alloc (session);
 	new->fin = fin;
 	new->user_data = user_data;
 	new->subsystem = subsystem;
@@ -145,68 +135,87 @@ rspamd_session_add_event (struct rspamd_async_session *session,
 		new->w = NULL;
 	}
 
-	g_hash_table_insert (session->events, new, new);
+	DL_APPEND (session->events, new);
+	session->nevents ++;
 
 	msg_debug_session ("added event: %p, pending %d events, subsystem: %s",
 		user_data,
-		g_hash_table_size (session->events),
+		session->nevents,
 		g_quark_to_string (subsystem));
+
+	return new;
 }
 
 void
-rspamd_session_remove_event (struct rspamd_async_session *session,
-	event_finalizer_t fin,
-	void *ud)
+rspamd_session_remove_event_specific (struct rspamd_async_session *session,
+	struct rspamd_async_event *ev)
 {
-	struct rspamd_async_event search_ev, *found_ev;
-
 	if (session == NULL) {
 		msg_err ("session is NULL");
 		return;
 	}
 
-	/* Search for event */
-	search_ev.fin = fin;
-	search_ev.user_data = ud;
-	found_ev = g_hash_table_lookup (session->events, &search_ev);
-	g_assert (found_ev != NULL);
+	g_assert (ev != NULL);
+
+	msg_debug_session ("removed event: %p, subsystem: %s, pending %d events",
+			ev->user_data,
+			g_quark_to_string (ev->subsystem),
+			session->nevents);
+	/* Callbacks might destroy the session, so unlink event before them */
+	DL_DELETE (session->events, ev);
+	session->nevents --;
 
-	msg_debug_session ("removed event: %p, subsystem: %s, pending %d events", ud,
-			g_quark_to_string (found_ev->subsystem),
-			g_hash_table_size (session->events));
 	/* Remove event */
-	fin (ud);
+	if (ev->fin != NULL) {
+		ev->fin (ev->user_data);
+	}
 
 	/* Call watcher if needed */
-	if (found_ev->w) {
-		if (found_ev->w->remain > 0) {
-			if (--found_ev->w->remain == 0) {
-				found_ev->w->cb (session->user_data, found_ev->w->ud);
+	if (ev->w) {
+		if (ev->w->remain > 0) {
+			if (--ev->w->remain == 0) {
+				ev->w->cb (session->user_data, ev->w->ud);
 			}
 		}
 	}
 
-	g_hash_table_remove (session->events, found_ev);
-
+	rspamd_session_event_release (session, ev);
 	rspamd_session_pending (session);
 }
 
-static gboolean
-rspamd_session_destroy_callback (gpointer k, gpointer v, gpointer unused)
+void
+rspamd_session_remove_event (struct rspamd_async_session *session,
+	event_finalizer_t fin,
+	void *ud)
 {
-	struct rspamd_async_event *ev = v;
+	struct rspamd_async_event *found_ev = NULL, *cur;
 
-	/* Call event's finalizer */
-	msg_debug ("removed event on destroy: %p, subsystem: %s", ev->user_data,
-		g_quark_to_string (ev->subsystem));
+	if (session == NULL) {
+		msg_err ("session is NULL");
+		return;
+	}
 
-	if (ev->fin != NULL) {
-		ev->fin (ev->user_data);
+	/* Search for event starting from the most recent ones */
+	if (session->events != NULL) {
+		cur = session->events->prev;
+
+		for (;;) {
+			if (cur->fin == fin && cur->user_data == ud) {
+				found_ev = cur;
+				break;
+			}
+
+			if (cur == session->events) {
+				break;
+			}
+
+			cur = cur->prev;
+		}
 	}
 
-	/* We ignore watchers on session destroying */
+	g_assert (found_ev != NULL);
 
-	return TRUE;
+	rspamd_session_remove_event_specific (session, found_ev);
 }
 
 gboolean
@@ -230,14 +239,30 @@ rspamd_session_destroy (struct rspamd_async_session *session)
 void
 rspamd_session_cleanup (struct rspamd_async_session *session)
 {
+	struct rspamd_async_event *ev, *tmp, *events;
+
 	if (session == NULL) {
 		msg_err ("session is NULL");
 		return;
 	}
 
-	g_hash_table_foreach_remove (session->events,
-			rspamd_session_destroy_callback,
-			session);
+	events = session->events;
+	session->events = NULL;
+	session->nevents = 0;
+
+	DL_FOREACH_SAFE (events, ev, tmp) {
+		/* Call event's finalizer */
+		msg_debug ("removed event on destroy: %p, subsystem: %s",
+				ev->user_data,
+				g_quark_to_string (ev->subsystem));
+
+		if (ev->fin != NULL) {
+			ev->fin (ev->user_data);
+		}
+
+		/* We ignore watchers on session destroying */
+		rspamd_session_event_release (session, ev);
+	}
 }
 
 gboolean
@@ -245,7 +270,7 @@ rspamd_session_pending (struct rspamd_async_session *session)
 {
 	gboolean ret = TRUE;
 
-	if (g_hash_table_size (session->events) == 0) {
+	if (session->nevents == 0) {
 		if (session->fin != NULL) {
 			if (!session->fin (session->user_data)) {
 				/* Session finished incompletely, perform restoration */
@@ -308,7 +333,7 @@ rspamd_session_events_pending (struct rspamd_async_session *session)
 {
 	g_assert (session != NULL);
 
-	return g_hash_table_size (session->events);
+	return session->nevents;
 }
 
 void
@@ -350,5 +375,6 @@ rspamd_session_get_watcher (struct rspamd_async_session *s)
 {
 	g_assert (s != NULL);
 
-	return s->cur_watcher;
+	/* Watcher of the finished watching could be reused for the next one */
+	return RSPAMD_SESSION_IS_WATCHING (s) ? s->cur_watcher : NULL;
 }
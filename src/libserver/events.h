@@ -46,8 +46,10 @@ struct rspamd_async_session * rspamd_session_create (rspamd_mempool_t *pool,
  * @param fin finalizer callback
  * @param user_data abstract user_data
  * @param forced unused
+ * @return event that could be removed by `rspamd_session_remove_event_specific`
  */
-void rspamd_session_add_event (struct rspamd_async_session *session,
+struct rspamd_async_event * rspamd_session_add_event (
+	struct rspamd_async_session *session,
 	event_finalizer_t fin, gpointer user_data, GQuark subsystem);
 
 /**
@@ -60,6 +62,14 @@ void rspamd_session_remove_event (struct rspamd_async_session *session,
 	event_finalizer_t fin,
 	gpointer ud);
 
+/**
+ * Remove the specified event without searching for it
+ * @param session session object
+ * @param ev event returned by `rspamd_session_add_event`
+ */
+void rspamd_session_remove_event_specific (struct rspamd_async_session *session,
+	struct rspamd_async_event *ev);
+
 /**
  * Must be called at the end of session, it calls fin functions for all non-forced callbacks
  * @return true if the whole session was destroyed and false if there are forced events
@@ -126,7 +136,7 @@ void rspamd_session_watcher_pop (struct rspamd_async_session *s,
 /**
  * Returns the current watcher for events session
  * @param s
- * @return
+ * @return watcher or NULL if the session is not in watching mode
  */
 struct rspamd_async_watcher* rspamd_session_get_watcher (
 		struct rspamd_async_session *s);
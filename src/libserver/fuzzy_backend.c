@@ -20,6 +20,55 @@
 
 #include <sqlite3.h>
 #include "libutil/sqlite_utils.h"
+#include "khash.h"
+#include "xxhash.h"
+
+/*
+ * Memory index of digests and shingles, sqlite is still used as the durable
+ * storage and all updates are applied to both of them
+ */
+struct rspamd_fuzzy_index_elt {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint64 id;
+	gint64 value;
+	gint64 time;
+	gint flag;
+};
+
+struct rspamd_fuzzy_index_shingle {
+	gint64 value;
+	gint64 number;
+};
+
+static inline khint_t
+rspamd_fuzzy_index_digest_hash (const guchar *digest)
+{
+	khint_t h;
+
+	/* Digest is a cryptographic hash itself, so its prefix is enough */
+	memcpy (&h, digest, sizeof (h));
+
+	return h;
+}
+
+#define rspamd_fuzzy_index_digest_equal(a, b) \
+	(memcmp ((a), (b), rspamd_cryptobox_HASHBYTES) == 0)
+#define rspamd_fuzzy_index_shingle_hash(k) \
+	(kh_int64_hash_func ((khint64_t)(k).value) ^ (khint_t)(k).number)
+#define rspamd_fuzzy_index_shingle_equal(a, b) \
+	((a).value == (b).value && (a).number == (b).number)
+
+KHASH_INIT (fuzzy_digests, const guchar *, struct rspamd_fuzzy_index_elt *, 1,
+		rspamd_fuzzy_index_digest_hash, rspamd_fuzzy_index_digest_equal);
+KHASH_MAP_INIT_INT64 (fuzzy_ids, struct rspamd_fuzzy_index_elt *);
+KHASH_INIT (fuzzy_shingles, struct rspamd_fuzzy_index_shingle, gint64, 1,
+		rspamd_fuzzy_index_shingle_hash, rspamd_fuzzy_index_shingle_equal);
+
+struct rspamd_fuzzy_index {
+	khash_t(fuzzy_digests) *digests;
+	khash_t(fuzzy_ids) *ids;
+	khash_t(fuzzy_shingles) *shingles;
+};
 
 struct rspamd_fuzzy_backend {
 	sqlite3 *db;
@@ -28,10 +77,11 @@ struct rspamd_fuzzy_backend {
 	gsize count;
 	gsize expired;
 	rspamd_mempool_t *pool;
+	struct rspamd_fuzzy_index *index;
+	/* Number of changes kept for replicas (0 if changes are not logged) */
+	gint64 max_changes;
 };
 
-static const gdouble sql_sleep_time = 0.1;
-static const guint max_retries = 10;
 
 #define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         backend->pool->tag.tagname, backend->pool->tag.uid, \
@@ -68,6 +118,29 @@ static const char *create_tables_sql =
 		"CREATE INDEX IF NOT EXISTS dgst_id ON shingles(digest_id);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 		"COMMIT;";
+/* Tables added after the initial schema, so they are created on each open */
+static const char *create_replication_tables_sql =
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS changes("
+		"id INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"cmd BLOB NOT NULL);"
+		"CREATE TABLE IF NOT EXISTS replica("
+		"seq INTEGER NOT NULL);"
+		"COMMIT;";
+/*
+ * Shingles are also grouped to bands of RSPAMD_SHINGLE_BAND elements, so a
+ * digest sharing more than a half of shingles with a message always shares at
+ * least one band with it and candidates are found by a single query
+ */
+static const char *create_bands_sql =
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS bands("
+		"key INTEGER NOT NULL,"
+		"digest_id INTEGER NOT NULL REFERENCES digests(id) ON DELETE CASCADE "
+		"ON UPDATE CASCADE,"
+		"PRIMARY KEY(key, digest_id)) WITHOUT ROWID;"
+		"CREATE INDEX IF NOT EXISTS bdgst_id ON bands(digest_id);"
+		"COMMIT;";
 #if 0
 static const char *create_index_sql =
 		"BEGIN;"
@@ -77,6 +150,25 @@ static const char *create_index_sql =
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 		"COMMIT;";
 #endif
+/* All shingles of a digest are inserted by a single multi-row statement */
+#if RSPAMD_SHINGLE_SIZE != 32
+#error "shingles insert statement should be adjusted to RSPAMD_SHINGLE_SIZE"
+#endif
+#define SHINGLE_ROW "(?,?,?)"
+#define SHINGLE_ROWS4 SHINGLE_ROW "," SHINGLE_ROW "," SHINGLE_ROW "," SHINGLE_ROW
+#define SHINGLE_ROWS16 SHINGLE_ROWS4 "," SHINGLE_ROWS4 "," SHINGLE_ROWS4 "," \
+	SHINGLE_ROWS4
+#define SHINGLE_ROWS32 SHINGLE_ROWS16 "," SHINGLE_ROWS16
+/* Band size is selected so 15 mismatched shingles cannot break all 16 bands */
+#define RSPAMD_SHINGLE_BAND 2
+#define RSPAMD_SHINGLE_BANDS (RSPAMD_SHINGLE_SIZE / RSPAMD_SHINGLE_BAND)
+#define BAND_ROW "(?,?)"
+#define BAND_ROWS4 BAND_ROW "," BAND_ROW "," BAND_ROW "," BAND_ROW
+#define BAND_ROWS16 BAND_ROWS4 "," BAND_ROWS4 "," BAND_ROWS4 "," BAND_ROWS4
+#define BAND_KEYS16 "?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?"
+/* Number of digests sharing bands with a message that are compared with it */
+#define BAND_CANDIDATES "8"
+
 enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_START = 0,
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
@@ -84,15 +176,27 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_INSERT,
 	RSPAMD_FUZZY_BACKEND_UPDATE,
 	RSPAMD_FUZZY_BACKEND_UPDATE_FLAG,
-	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_CHECK,
-	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
+	RSPAMD_FUZZY_BACKEND_INSERT_BANDS,
+	RSPAMD_FUZZY_BACKEND_INSERT_BAND,
+	RSPAMD_FUZZY_BACKEND_CHECK_BANDS,
+	RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID,
+	RSPAMD_FUZZY_BACKEND_COUNT_BANDS,
+	RSPAMD_FUZZY_BACKEND_READ_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
 	RSPAMD_FUZZY_BACKEND_DELETE,
 	RSPAMD_FUZZY_BACKEND_COUNT,
-	RSPAMD_FUZZY_BACKEND_EXPIRE,
+	RSPAMD_FUZZY_BACKEND_SELECT_EXPIRED,
+	RSPAMD_FUZZY_BACKEND_DELETE_ID,
 	RSPAMD_FUZZY_BACKEND_VACUUM,
 	RSPAMD_FUZZY_BACKEND_DELETE_ORPHANED,
+	RSPAMD_FUZZY_BACKEND_LOG_CHANGE,
+	RSPAMD_FUZZY_BACKEND_READ_CHANGES,
+	RSPAMD_FUZZY_BACKEND_FIRST_CHANGE,
+	RSPAMD_FUZZY_BACKEND_TRIM_CHANGES,
+	RSPAMD_FUZZY_BACKEND_GET_REPLICA_SEQ,
+	RSPAMD_FUZZY_BACKEND_SET_REPLICA_SEQ,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
 static struct rspamd_fuzzy_stmts {
@@ -149,10 +253,10 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
 		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
-				"VALUES (?1, ?2, ?3);",
-		.args = "III",
+				"VALUES " SHINGLE_ROWS32 ";",
+		.args = "H",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
@@ -164,9 +268,49 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-		.sql = "SELECT digest_id FROM shingles WHERE value=?1 AND number=?2",
-		.args = "IS",
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_BANDS,
+		.sql = "INSERT OR IGNORE INTO bands(key, digest_id) "
+				"VALUES " BAND_ROWS16 ";",
+		.args = "R",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_BAND,
+		.sql = "INSERT OR IGNORE INTO bands(key, digest_id) VALUES (?1, ?2);",
+		.args = "II",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_CHECK_BANDS,
+		.sql = "SELECT digest_id, COUNT(*) AS cnt FROM bands "
+				"WHERE key IN (" BAND_KEYS16 ") GROUP BY digest_id "
+				"ORDER BY cnt DESC LIMIT " BAND_CANDIDATES ";",
+		.args = "K",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID,
+		.sql = "SELECT value, number FROM shingles WHERE digest_id=?1;",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_COUNT_BANDS,
+		.sql = "SELECT EXISTS(SELECT 1 FROM bands), "
+				"EXISTS(SELECT 1 FROM shingles);",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_READ_SHINGLES,
+		.sql = "SELECT digest_id, number, value FROM shingles "
+				"ORDER BY digest_id;",
+		.args = "",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
@@ -192,10 +336,17 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE,
-		.sql = "DELETE FROM digests WHERE id IN (SELECT id FROM digests WHERE time < ?1 LIMIT ?2);",
+		.idx = RSPAMD_FUZZY_BACKEND_SELECT_EXPIRED,
+		.sql = "SELECT id FROM digests WHERE time < ?1 ORDER BY time LIMIT ?2;",
 		.args = "II",
 		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_DELETE_ID,
+		.sql = "DELETE FROM digests WHERE id=?1;",
+		.args = "I",
+		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
 	{
@@ -212,6 +363,49 @@ static struct rspamd_fuzzy_stmts {
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_CHANGE,
+		.sql = "INSERT INTO changes(cmd) VALUES (?1);",
+		.args = "B",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_READ_CHANGES,
+		.sql = "SELECT id, cmd FROM changes WHERE id > ?1 ORDER BY id LIMIT ?2;",
+		.args = "II",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_FIRST_CHANGE,
+		.sql = "SELECT MIN(id) FROM changes;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_TRIM_CHANGES,
+		.sql = "DELETE FROM changes WHERE id <= "
+				"(SELECT MAX(id) FROM changes) - ?1;",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_GET_REPLICA_SEQ,
+		.sql = "SELECT seq FROM replica WHERE rowid=1;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_SET_REPLICA_SEQ,
+		.sql = "INSERT OR REPLACE INTO replica(rowid, seq) VALUES (1, ?1);",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
 };
 
 static GQuark
@@ -220,6 +414,186 @@ rspamd_fuzzy_backend_quark(void)
 	return g_quark_from_static_string ("fuzzy-storage-backend");
 }
 
+static struct rspamd_fuzzy_index *
+rspamd_fuzzy_index_new (void)
+{
+	struct rspamd_fuzzy_index *idx;
+
+	idx = g_slice_alloc (sizeof (*idx));
+	idx->digests = kh_init (fuzzy_digests);
+	idx->ids = kh_init (fuzzy_ids);
+	idx->shingles = kh_init (fuzzy_shingles);
+
+	return idx;
+}
+
+static void
+rspamd_fuzzy_index_free (struct rspamd_fuzzy_index *idx)
+{
+	struct rspamd_fuzzy_index_elt *elt;
+
+	kh_foreach_value (idx->digests, elt, {
+		g_slice_free1 (sizeof (*elt), elt);
+	});
+
+	kh_destroy (fuzzy_digests, idx->digests);
+	kh_destroy (fuzzy_ids, idx->ids);
+	kh_destroy (fuzzy_shingles, idx->shingles);
+	g_slice_free1 (sizeof (*idx), idx);
+}
+
+static struct rspamd_fuzzy_index_elt *
+rspamd_fuzzy_index_lookup (struct rspamd_fuzzy_index *idx,
+		const guchar *digest)
+{
+	khint_t k;
+
+	k = kh_get (fuzzy_digests, idx->digests, digest);
+
+	if (k != kh_end (idx->digests)) {
+		return kh_value (idx->digests, k);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_index_insert (struct rspamd_fuzzy_index *idx,
+		const guchar *digest, gint64 id, gint64 value, gint64 time, gint flag)
+{
+	struct rspamd_fuzzy_index_elt *elt;
+	khint_t k;
+	gint r;
+
+	elt = rspamd_fuzzy_index_lookup (idx, digest);
+
+	if (elt == NULL) {
+		elt = g_slice_alloc (sizeof (*elt));
+		memcpy (elt->digest, digest, sizeof (elt->digest));
+		k = kh_put (fuzzy_digests, idx->digests, elt->digest, &r);
+		kh_value (idx->digests, k) = elt;
+	}
+	else if (elt->id != id) {
+		k = kh_get (fuzzy_ids, idx->ids, elt->id);
+
+		if (k != kh_end (idx->ids)) {
+			kh_del (fuzzy_ids, idx->ids, k);
+		}
+	}
+
+	elt->id = id;
+	elt->value = value;
+	elt->time = time;
+	elt->flag = flag;
+	k = kh_put (fuzzy_ids, idx->ids, id, &r);
+	kh_value (idx->ids, k) = elt;
+}
+
+static void
+rspamd_fuzzy_index_remove (struct rspamd_fuzzy_index *idx,
+		struct rspamd_fuzzy_index_elt *elt)
+{
+	khint_t k;
+
+	k = kh_get (fuzzy_ids, idx->ids, elt->id);
+
+	if (k != kh_end (idx->ids)) {
+		kh_del (fuzzy_ids, idx->ids, k);
+	}
+
+	k = kh_get (fuzzy_digests, idx->digests, elt->digest);
+
+	if (k != kh_end (idx->digests)) {
+		kh_del (fuzzy_digests, idx->digests, k);
+	}
+
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static void
+rspamd_fuzzy_index_remove_id (struct rspamd_fuzzy_index *idx, gint64 id)
+{
+	khint_t k;
+
+	k = kh_get (fuzzy_ids, idx->ids, id);
+
+	if (k != kh_end (idx->ids)) {
+		rspamd_fuzzy_index_remove (idx, kh_value (idx->ids, k));
+	}
+}
+
+static void
+rspamd_fuzzy_index_insert_shingle (struct rspamd_fuzzy_index *idx,
+		gint64 value, gint64 number, gint64 id)
+{
+	struct rspamd_fuzzy_index_shingle sk;
+	khint_t k;
+	gint r;
+
+	sk.value = value;
+	sk.number = number;
+	k = kh_put (fuzzy_shingles, idx->shingles, sk, &r);
+	kh_value (idx->shingles, k) = id;
+}
+
+/*
+ * Returns id of a digest the shingle belongs to or -1 if it is not found.
+ * Shingles of deleted digests are ignored as sqlite removes them by cascade.
+ */
+static gint64
+rspamd_fuzzy_index_lookup_shingle (struct rspamd_fuzzy_index *idx,
+		gint64 value, gint64 number)
+{
+	struct rspamd_fuzzy_index_shingle sk;
+	khint_t k;
+	gint64 id;
+
+	sk.value = value;
+	sk.number = number;
+	k = kh_get (fuzzy_shingles, idx->shingles, sk);
+
+	if (k != kh_end (idx->shingles)) {
+		id = kh_value (idx->shingles, k);
+
+		if (kh_get (fuzzy_ids, idx->ids, id) != kh_end (idx->ids)) {
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+/* Remove expired digests and shingles of the deleted ones */
+static void
+rspamd_fuzzy_index_cleanup (struct rspamd_fuzzy_index *idx,
+		gint64 expire_lim, gboolean clean_orphaned)
+{
+	struct rspamd_fuzzy_index_elt *elt;
+	khint_t k;
+
+	if (expire_lim > 0) {
+		for (k = kh_begin (idx->digests); k != kh_end (idx->digests); ++k) {
+			if (kh_exist (idx->digests, k)) {
+				elt = kh_value (idx->digests, k);
+
+				if (elt->time < expire_lim) {
+					rspamd_fuzzy_index_remove (idx, elt);
+				}
+			}
+		}
+	}
+
+	if (clean_orphaned) {
+		for (k = kh_begin (idx->shingles); k != kh_end (idx->shingles); ++k) {
+			if (kh_exist (idx->shingles, k) &&
+					kh_get (fuzzy_ids, idx->ids, kh_value (idx->shingles, k)) ==
+							kh_end (idx->ids)) {
+				kh_del (fuzzy_shingles, idx->shingles, k);
+			}
+		}
+	}
+}
+
 static gboolean
 rspamd_fuzzy_backend_prepare_stmts (struct rspamd_fuzzy_backend *bk, GError **err)
 {
@@ -230,8 +604,8 @@ rspamd_fuzzy_backend_prepare_stmts (struct rspamd_fuzzy_backend *bk, GError **er
 			/* Skip already prepared statements */
 			continue;
 		}
-		if (sqlite3_prepare_v2 (bk->db, prepared_stmts[i].sql, -1,
-				&prepared_stmts[i].stmt, NULL) != SQLITE_OK) {
+		if (rspamd_sqlite3_prepare_persistent (bk->db, prepared_stmts[i].sql,
+				&prepared_stmts[i].stmt) != SQLITE_OK) {
 			g_set_error (err, rspamd_fuzzy_backend_quark (),
 				-1, "Cannot initialize prepared sql `%s`: %s",
 				prepared_stmts[i].sql, sqlite3_errmsg (bk->db));
@@ -272,8 +646,11 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *backend,
 	sqlite3_stmt *stmt;
 	int i;
 	const char *argtypes;
-	guint retries = 0;
-	struct timespec ts;
+	gconstpointer blob;
+	const guint64 *hashes;
+	const gint64 *keys;
+	gint64 id;
+	gint j;
 
 	if (idx < 0 || idx >= RSPAMD_FUZZY_BACKEND_MAX) {
 
@@ -284,8 +661,8 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *backend,
 	g_assert ((int)prepared_stmts[idx].idx == idx);
 
 	if (stmt == NULL) {
-		if ((retcode = sqlite3_prepare_v2 (backend->db, prepared_stmts[idx].sql, -1,
-				&prepared_stmts[idx].stmt, NULL)) != SQLITE_OK) {
+		if ((retcode = rspamd_sqlite3_prepare_persistent (backend->db,
+				prepared_stmts[idx].sql, &prepared_stmts[idx].stmt)) != SQLITE_OK) {
 			msg_err_fuzzy_backend ("Cannot initialize prepared sql `%s`: %s",
 					prepared_stmts[idx].sql, sqlite3_errmsg (backend->db));
 
@@ -318,25 +695,56 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *backend,
 			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), 64,
 					SQLITE_STATIC);
 			break;
+		case 'B':
+			/* Blob is passed as pointer followed by gint64 length */
+			blob = va_arg (ap, gconstpointer);
+			sqlite3_bind_blob (stmt, i + 1, blob, va_arg (ap, gint64),
+					SQLITE_STATIC);
+			break;
+		case 'K':
+			/* Array of RSPAMD_SHINGLE_BANDS band keys */
+			keys = va_arg (ap, const gint64 *);
+
+			for (j = 0; j < RSPAMD_SHINGLE_BANDS; j ++) {
+				sqlite3_bind_int64 (stmt, j + 1, keys[j]);
+			}
+			break;
+		case 'R':
+			/* Band keys followed by gint64 digest id, 2 parameters each */
+			keys = va_arg (ap, const gint64 *);
+			id = va_arg (ap, gint64);
+
+			for (j = 0; j < RSPAMD_SHINGLE_BANDS; j ++) {
+				sqlite3_bind_int64 (stmt, j * 2 + 1, keys[j]);
+				sqlite3_bind_int64 (stmt, j * 2 + 2, id);
+			}
+			break;
+		case 'H':
+			/*
+			 * Shingles are passed as array of RSPAMD_SHINGLE_SIZE hashes
+			 * followed by gint64 digest id, each occupies 3 parameters
+			 */
+			hashes = va_arg (ap, const guint64 *);
+			id = va_arg (ap, gint64);
+
+			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				sqlite3_bind_int64 (stmt, j * 3 + 1, hashes[j]);
+				sqlite3_bind_int64 (stmt, j * 3 + 2, j);
+				sqlite3_bind_int64 (stmt, j * 3 + 3, id);
+			}
+			break;
 		}
 	}
 
 	va_end (ap);
 
-retry:
+	/* Locks are waited by the busy handler of the database */
 	retcode = sqlite3_step (stmt);
 
 	if (retcode == prepared_stmts[idx].result) {
 		retcode = SQLITE_OK;
 	}
 	else {
-		if ((retcode == SQLITE_BUSY ||
-				retcode == SQLITE_LOCKED) && retries++ < max_retries) {
-			double_to_ts (sql_sleep_time, &ts);
-			nanosleep (&ts, NULL);
-			goto retry;
-		}
-
 		msg_debug_fuzzy_backend ("failed to execute query %s: %d, %s", prepared_stmts[idx].sql,
 				retcode, sqlite3_errmsg (backend->db));
 	}
@@ -364,103 +772,500 @@ rspamd_fuzzy_backend_close_stmts (struct rspamd_fuzzy_backend *bk)
 	return;
 }
 
+static inline gint64
+rspamd_fuzzy_backend_band_key (const guint64 *hashes, guint band)
+{
+	return (gint64)XXH64 (&hashes[band * RSPAMD_SHINGLE_BAND],
+			sizeof (*hashes) * RSPAMD_SHINGLE_BAND, band);
+}
+
+static void
+rspamd_fuzzy_backend_band_keys (const struct rspamd_shingle *sgl,
+		gint64 *keys)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_BANDS; i ++) {
+		keys[i] = rspamd_fuzzy_backend_band_key (sgl->hashes, i);
+	}
+}
+
+static void rspamd_fuzzy_backend_flush_bands (struct rspamd_fuzzy_backend *backend,
+		gint64 id, const struct rspamd_shingle *sgl, guint32 mask);
+
+/* Fill bands for databases created without them */
+static gboolean
+rspamd_fuzzy_backend_build_bands (struct rspamd_fuzzy_backend *backend)
+{
+	struct rspamd_shingle sgl;
+	sqlite3_stmt *stmt;
+	gint64 id, cur_id = -1, number, ndigests = 0;
+	guint32 mask = 0;
+	gint rc;
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_COUNT_BANDS);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT_BANDS].stmt;
+
+	if (rc != SQLITE_OK || sqlite3_column_int64 (stmt, 0) != 0 ||
+			sqlite3_column_int64 (stmt, 1) == 0) {
+		rspamd_fuzzy_backend_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_COUNT_BANDS);
+
+		return TRUE;
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_COUNT_BANDS);
+	msg_info_fuzzy_backend ("building shingles bands for %s", backend->path);
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_START) != SQLITE_OK) {
+		return FALSE;
+	}
+
+	/* Bands are inserted using another statement, so read shingles first */
+	rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_READ_SHINGLES);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_READ_SHINGLES].stmt;
+	memset (&sgl, 0, sizeof (sgl));
+
+	while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+		id = sqlite3_column_int64 (stmt, 0);
+		number = sqlite3_column_int64 (stmt, 1);
+
+		if (id != cur_id) {
+			if (cur_id != -1) {
+				rspamd_fuzzy_backend_flush_bands (backend, cur_id, &sgl, mask);
+				ndigests ++;
+			}
+
+			cur_id = id;
+			mask = 0;
+		}
+
+		if (number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+			sgl.hashes[number] = sqlite3_column_int64 (stmt, 2);
+			mask |= 1U << number;
+		}
+
+		rc = sqlite3_step (stmt);
+	}
+
+	if (cur_id != -1) {
+		rspamd_fuzzy_backend_flush_bands (backend, cur_id, &sgl, mask);
+		ndigests ++;
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_READ_SHINGLES);
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT) != SQLITE_OK) {
+		rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
+
+		return FALSE;
+	}
+
+	msg_info_fuzzy_backend ("built shingles bands for %L digests", ndigests);
+
+	return TRUE;
+}
+
+/* Insert bands of a digest which all shingles are known (mask) */
+static void
+rspamd_fuzzy_backend_flush_bands (struct rspamd_fuzzy_backend *backend,
+		gint64 id, const struct rspamd_shingle *sgl, guint32 mask)
+{
+	const guint32 band_mask = (1U << RSPAMD_SHINGLE_BAND) - 1;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_BANDS; i ++) {
+		if (((mask >> (i * RSPAMD_SHINGLE_BAND)) & band_mask) == band_mask) {
+			rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+					RSPAMD_FUZZY_BACKEND_INSERT_BAND,
+					rspamd_fuzzy_backend_band_key (sgl->hashes, i), id);
+		}
+	}
+}
+
 static gboolean
 rspamd_fuzzy_backend_run_sql (const gchar *sql, struct rspamd_fuzzy_backend *bk,
 		GError **err)
 {
-	guint retries = 0;
-	struct timespec ts;
 	gint ret;
 
-	do {
-		ret = sqlite3_exec (bk->db, sql, NULL, NULL, NULL);
-		double_to_ts (sql_sleep_time, &ts);
-	} while (ret == SQLITE_BUSY && retries++ < max_retries &&
-			nanosleep (&ts, NULL) == 0);
+	ret = sqlite3_exec (bk->db, sql, NULL, NULL, NULL);
+
+	if (ret != SQLITE_OK) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				-1, "Cannot execute raw sql `%s`: %s",
+				sql, sqlite3_errmsg (bk->db));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static struct rspamd_fuzzy_backend *
+rspamd_fuzzy_backend_open_db (const gchar *path,
+		const struct rspamd_sqlite3_tune *tune,
+		GError **err)
+{
+	struct rspamd_fuzzy_backend *bk;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+
+	g_assert (path != NULL);
+
+	bk = g_slice_alloc (sizeof (*bk));
+	bk->path = g_strdup (path);
+	bk->expired = 0;
+	bk->index = NULL;
+	bk->max_changes = 0;
+	bk->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_backend");
+	bk->db = rspamd_sqlite3_open_or_create (bk->pool, bk->path,
+			create_tables_sql, tune ? tune : &rspamd_sqlite3_throughput_tune,
+			err);
+
+	if (bk->db == NULL) {
+		rspamd_fuzzy_backend_close (bk);
+
+		return NULL;
+	}
+
+	if (!rspamd_fuzzy_backend_run_sql (create_replication_tables_sql, bk, err) ||
+			!rspamd_fuzzy_backend_run_sql (create_bands_sql, bk, err)) {
+		rspamd_fuzzy_backend_close (bk);
+
+		return NULL;
+	}
+
+	if (!rspamd_fuzzy_backend_prepare_stmts (bk, err)) {
+		rspamd_fuzzy_backend_close (bk);
+
+		return NULL;
+	}
+
+	/* Set id for the backend */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, path, strlen (path));
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (bk->id, sizeof (bk->id), "%xs", hash_out);
+	memcpy (bk->pool->tag.uid, bk->id, sizeof (bk->pool->tag.uid));
+
+	if (!rspamd_fuzzy_backend_build_bands (bk)) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				-1, "Cannot build shingles bands: %s", sqlite3_errmsg (bk->db));
+		rspamd_fuzzy_backend_close (bk);
+
+		return NULL;
+	}
+
+	return bk;
+}
+
+struct rspamd_fuzzy_backend *
+rspamd_fuzzy_backend_open (const gchar *path,
+		gboolean vacuum,
+		const struct rspamd_sqlite3_tune *tune,
+		GError **err)
+{
+	struct rspamd_fuzzy_backend *backend;
+
+	if (path == NULL) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				ENOENT, "Path has not been specified");
+		return NULL;
+	}
+
+	/* Open database */
+	if ((backend = rspamd_fuzzy_backend_open_db (path, tune, err)) == NULL) {
+		return NULL;
+	}
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, FALSE, RSPAMD_FUZZY_BACKEND_COUNT)
+			== SQLITE_OK) {
+		backend->count = sqlite3_column_int64 (
+				prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT].stmt, 0);
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_COUNT);
+
+	return backend;
+}
+
+gboolean
+rspamd_fuzzy_backend_load_index (struct rspamd_fuzzy_backend *backend,
+		GError **err)
+{
+	static const gchar digests_sql[] = "SELECT id, flag, digest, value, time "
+			"FROM digests;",
+			shingles_sql[] = "SELECT value, number, digest_id FROM shingles;";
+	struct rspamd_fuzzy_index *idx;
+	sqlite3_stmt *stmt;
+	gint rc;
+
+	g_assert (backend != NULL);
+
+	if (sqlite3_prepare_v2 (backend->db, digests_sql, -1, &stmt, NULL) !=
+			SQLITE_OK) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				-1, "Cannot prepare sql `%s`: %s",
+				digests_sql, sqlite3_errmsg (backend->db));
+
+		return FALSE;
+	}
+
+	idx = rspamd_fuzzy_index_new ();
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		if (sqlite3_column_bytes (stmt, 2) != rspamd_cryptobox_HASHBYTES) {
+			continue;
+		}
+
+		rspamd_fuzzy_index_insert (idx, sqlite3_column_blob (stmt, 2),
+				sqlite3_column_int64 (stmt, 0),
+				sqlite3_column_int64 (stmt, 3),
+				sqlite3_column_int64 (stmt, 4),
+				sqlite3_column_int (stmt, 1));
+	}
+
+	sqlite3_finalize (stmt);
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				-1, "Cannot read digests: %s", sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_index_free (idx);
+
+		return FALSE;
+	}
+
+	if (sqlite3_prepare_v2 (backend->db, shingles_sql, -1, &stmt, NULL) !=
+			SQLITE_OK) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				-1, "Cannot prepare sql `%s`: %s",
+				shingles_sql, sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_index_free (idx);
+
+		return FALSE;
+	}
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		rspamd_fuzzy_index_insert_shingle (idx,
+				sqlite3_column_int64 (stmt, 0),
+				sqlite3_column_int64 (stmt, 1),
+				sqlite3_column_int64 (stmt, 2));
+	}
+
+	sqlite3_finalize (stmt);
+
+	if (rc != SQLITE_DONE) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				-1, "Cannot read shingles: %s", sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_index_free (idx);
+
+		return FALSE;
+	}
+
+	if (backend->index) {
+		rspamd_fuzzy_index_free (backend->index);
+	}
+
+	backend->index = idx;
+	msg_info_fuzzy_backend ("loaded %ud digests and %ud shingles to the "
+			"memory index", kh_size (idx->digests), kh_size (idx->shingles));
+
+	return TRUE;
+}
+
+static gint
+rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
+{
+	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
+
+	return (ia - ib);
+}
+
+/*
+ * Select digest id having the most of shingles (values are sorted in place)
+ */
+static gint64
+rspamd_fuzzy_backend_select_digest (gint64 *shingle_values, gint64 *pmax_cnt)
+{
+	gint64 i, sel_id, cur_id, cur_cnt, max_cnt;
+
+	qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
+			rspamd_fuzzy_backend_int64_cmp);
+	sel_id = -1;
+	cur_id = -1;
+	cur_cnt = 0;
+	max_cnt = 0;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (shingle_values[i] == -1) {
+			continue;
+		}
+
+		/* We have some value here, so we need to check it */
+		if (shingle_values[i] == cur_id) {
+			cur_cnt ++;
+		}
+		else {
+			cur_id = shingle_values[i];
+			if (cur_cnt >= max_cnt) {
+				max_cnt = cur_cnt;
+				sel_id = cur_id;
+			}
+			cur_cnt = 0;
+		}
+	}
+
+	if (cur_cnt > max_cnt) {
+		max_cnt = cur_cnt;
+	}
+
+	*pmax_cnt = max_cnt;
+
+	return sel_id;
+}
+
+/*
+ * The same as the sqlite check but using memory index only
+ */
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_check_index (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_index_elt *elt;
+	struct rspamd_fuzzy_index *idx = backend->index;
+	khint_t k;
+	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, max_cnt;
+
+	elt = rspamd_fuzzy_index_lookup (idx, (const guchar *)cmd->digest);
+
+	if (elt != NULL) {
+		if (time (NULL) - elt->time > expire) {
+			/* Expire element */
+			msg_debug_fuzzy_backend ("requested hash has been expired");
+		}
+		else {
+			rep.value = elt->value;
+			rep.prob = 1.0;
+			rep.flag = elt->flag;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			shingle_values[i] = rspamd_fuzzy_index_lookup_shingle (idx,
+					shcmd->sgl.hashes[i], i);
+		}
+
+		sel_id = rspamd_fuzzy_backend_select_digest (shingle_values, &max_cnt);
+
+		if (sel_id != -1) {
+			rep.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep.prob > 0.5) {
+				msg_debug_fuzzy_backend (
+						"found fuzzy hash with probability %.2f",
+						rep.prob);
+				k = kh_get (fuzzy_ids, idx->ids, sel_id);
+
+				if (k != kh_end (idx->ids)) {
+					elt = kh_value (idx->ids, k);
 
-	if (ret != SQLITE_OK) {
-		g_set_error (err, rspamd_fuzzy_backend_quark (),
-				-1, "Cannot execute raw sql `%s`: %s",
-				sql, sqlite3_errmsg (bk->db));
-		return FALSE;
+					if (time (NULL) - elt->time > expire) {
+						/* Expire element */
+						msg_debug_fuzzy_backend (
+								"requested hash has been expired");
+					}
+					else {
+						rep.value = elt->value;
+						rep.flag = elt->flag;
+					}
+				}
+			}
+			else {
+				/* Otherwise we assume that as error */
+				rep.value = 0;
+			}
+		}
 	}
 
-	return TRUE;
+	return rep;
 }
 
-static struct rspamd_fuzzy_backend *
-rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
+/*
+ * Find digests sharing bands with the shingles and select the most similar
+ * one comparing all its shingles as rspamd_shingles_compare does
+ */
+static gint64
+rspamd_fuzzy_backend_select_band (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_shingle *sgl, gfloat *prob)
 {
-	struct rspamd_fuzzy_backend *bk;
-	rspamd_cryptobox_hash_state_t st;
-	guchar hash_out[rspamd_cryptobox_HASHBYTES];
-
-	g_assert (path != NULL);
-
-	bk = g_slice_alloc (sizeof (*bk));
-	bk->path = g_strdup (path);
-	bk->expired = 0;
-	bk->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_backend");
-	bk->db = rspamd_sqlite3_open_or_create (bk->pool, bk->path,
-			create_tables_sql, err);
+	struct rspamd_shingle stored;
+	gint64 keys[RSPAMD_SHINGLE_BANDS], candidates[RSPAMD_SHINGLE_BANDS];
+	gint64 sel_id = -1, number;
+	guint ncandidates = 0, i, j;
+	gdouble cur, max = 0;
+	sqlite3_stmt *stmt;
+	gint rc;
 
-	if (bk->db == NULL) {
-		rspamd_fuzzy_backend_close (bk);
+	rspamd_fuzzy_backend_band_keys (sgl, keys);
+	rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_CHECK_BANDS, keys);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_BANDS].stmt;
 
-		return NULL;
+	while ((rc == SQLITE_OK || rc == SQLITE_ROW) &&
+			ncandidates < G_N_ELEMENTS (candidates)) {
+		candidates[ncandidates ++] = sqlite3_column_int64 (stmt, 0);
+		rc = sqlite3_step (stmt);
 	}
 
-	if (!rspamd_fuzzy_backend_prepare_stmts (bk, err)) {
-		rspamd_fuzzy_backend_close (bk);
-
-		return NULL;
-	}
+	rspamd_fuzzy_backend_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_CHECK_BANDS);
 
-	/* Set id for the backend */
-	rspamd_cryptobox_hash_init (&st, NULL, 0);
-	rspamd_cryptobox_hash_update (&st, path, strlen (path));
-	rspamd_cryptobox_hash_final (&st, hash_out);
-	rspamd_snprintf (bk->id, sizeof (bk->id), "%xs", hash_out);
-	memcpy (bk->pool->tag.uid, bk->id, sizeof (bk->pool->tag.uid));
+	for (i = 0; i < ncandidates; i ++) {
+		/* Shingles replaced by other digests never match */
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			stored.hashes[j] = ~sgl->hashes[j];
+		}
 
-	return bk;
-}
+		rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID, candidates[i]);
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID].stmt;
 
-struct rspamd_fuzzy_backend *
-rspamd_fuzzy_backend_open (const gchar *path,
-		gboolean vacuum,
-		GError **err)
-{
-	struct rspamd_fuzzy_backend *backend;
+		while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+			number = sqlite3_column_int64 (stmt, 1);
 
-	if (path == NULL) {
-		g_set_error (err, rspamd_fuzzy_backend_quark (),
-				ENOENT, "Path has not been specified");
-		return NULL;
-	}
+			if (number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+				stored.hashes[number] = sqlite3_column_int64 (stmt, 0);
+			}
 
-	/* Open database */
-	if ((backend = rspamd_fuzzy_backend_open_db (path, err)) == NULL) {
-		return NULL;
-	}
+			rc = sqlite3_step (stmt);
+		}
 
-	if (rspamd_fuzzy_backend_run_stmt (backend, FALSE, RSPAMD_FUZZY_BACKEND_COUNT)
-			== SQLITE_OK) {
-		backend->count = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT].stmt, 0);
+		rspamd_fuzzy_backend_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_GET_SHINGLES_BY_ID);
+		cur = rspamd_shingles_compare (&stored, sgl);
+		msg_debug_fuzzy_backend ("shingles of %L are similar to %.2f",
+				candidates[i], cur);
+
+		if (cur > max) {
+			max = cur;
+			sel_id = candidates[i];
+		}
 	}
 
-	rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_COUNT);
-
-	return backend;
-}
-
-static gint
-rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
-{
-	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
+	*prob = max;
 
-	return (ia - ib);
+	return sel_id;
 }
 
 struct rspamd_fuzzy_reply
@@ -471,13 +1276,16 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 	int rc;
 	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
+	gint64 sel_id;
 
 	if (backend == NULL) {
 		return rep;
 	}
 
+	if (backend->index) {
+		return rspamd_fuzzy_backend_check_index (backend, cmd, expire);
+	}
+
 	/* Try direct match first of all */
 	rspamd_fuzzy_backend_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
@@ -506,59 +1314,11 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 		rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
 		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
 
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
-					RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-					shcmd->sgl.hashes[i], i);
-			if (rc == SQLITE_OK) {
-				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
-						0);
-			}
-			else {
-				shingle_values[i] = -1;
-			}
-			msg_debug_fuzzy_backend ("looking for shingle %L -> %L: %d", i,
-					shcmd->sgl.hashes[i], rc);
-		}
-
-		rspamd_fuzzy_backend_cleanup_stmt (backend,
-				RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE);
-
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
-
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
-				}
-				cur_cnt = 0;
-			}
-		}
-
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
-		}
+		sel_id = rspamd_fuzzy_backend_select_band (backend, &shcmd->sgl,
+				&rep.prob);
 
 		if (sel_id != -1) {
 			/* We have some id selected here */
-			rep.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
-
 			if (rep.prob > 0.5) {
 				msg_debug_fuzzy_backend (
 						"found fuzzy hash with probability %.2f",
@@ -622,13 +1382,38 @@ rspamd_fuzzy_backend_prepare_update (struct rspamd_fuzzy_backend *backend)
 	return TRUE;
 }
 
+/*
+ * Append command to the log of changes fetched by replicas
+ */
+static void
+rspamd_fuzzy_backend_log_change (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	gint64 len;
+
+	if (backend->max_changes == 0) {
+		return;
+	}
+
+	len = cmd->shingles_count > 0 ?
+			sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_LOG_CHANGE, cmd, len) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot log change of hash %*xs: %s",
+				(gint)sizeof (cmd->digest), cmd->digest,
+				sqlite3_errmsg (backend->db));
+	}
+}
+
 gboolean
 rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 		const struct rspamd_fuzzy_cmd *cmd)
 {
 	int rc, i;
-	gint64 id, flag;
+	gint64 id, flag, now, band_keys[RSPAMD_SHINGLE_BANDS];
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_index_elt *elt;
 
 	if (backend == NULL) {
 		return FALSE;
@@ -657,6 +1442,11 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 						(gint) sizeof (cmd->digest), cmd->digest,
 						sqlite3_errmsg (backend->db));
 			}
+			else if (backend->index &&
+					(elt = rspamd_fuzzy_index_lookup (backend->index,
+							(const guchar *)cmd->digest)) != NULL) {
+				elt->value += cmd->value;
+			}
 		}
 		else {
 			/* We need to relearn actually */
@@ -671,36 +1461,57 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 						(gint) sizeof (cmd->digest), cmd->digest,
 						sqlite3_errmsg (backend->db));
 			}
+			else if (backend->index &&
+					(elt = rspamd_fuzzy_index_lookup (backend->index,
+							(const guchar *)cmd->digest)) != NULL) {
+				elt->value = cmd->value;
+				elt->flag = cmd->flag;
+			}
 		}
 	}
 	else {
 		rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
+		now = time (NULL);
 		rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
 				RSPAMD_FUZZY_BACKEND_INSERT,
 				(gint) cmd->flag,
 				cmd->digest,
 				(gint64) cmd->value,
-				(gint64) time (NULL));
+				now);
 
 		if (rc == SQLITE_OK) {
+			id = sqlite3_last_insert_rowid (backend->db);
+
+			if (backend->index) {
+				rspamd_fuzzy_index_insert (backend->index,
+						(const guchar *)cmd->digest, id, cmd->value, now,
+						cmd->flag);
+			}
+
 			if (cmd->shingles_count > 0) {
-				id = sqlite3_last_insert_rowid (backend->db);
 				shcmd = (const struct rspamd_fuzzy_shingle_cmd *) cmd;
 
-				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+				rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+						RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
+						shcmd->sgl.hashes, id);
+				msg_debug_fuzzy_backend ("add %d shingles -> %L",
+						RSPAMD_SHINGLE_SIZE, id);
+
+				if (rc == SQLITE_OK) {
+					rspamd_fuzzy_backend_band_keys (&shcmd->sgl, band_keys);
 					rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
-							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], (gint64)i, id);
-					msg_debug_fuzzy_backend ("add shingle %d -> %L: %L",
-							i,
-							shcmd->sgl.hashes[i],
-							id);
-
-					if (rc != SQLITE_OK) {
-						msg_warn_fuzzy_backend ("cannot add shingle %d -> "
-								"%L: %L: %s", i,
-								shcmd->sgl.hashes[i],
-								id, sqlite3_errmsg (backend->db));
+							RSPAMD_FUZZY_BACKEND_INSERT_BANDS,
+							band_keys, id);
+				}
+
+				if (rc != SQLITE_OK) {
+					msg_warn_fuzzy_backend ("cannot add shingles -> "
+							"%L: %s", id, sqlite3_errmsg (backend->db));
+				}
+				else if (backend->index) {
+					for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+						rspamd_fuzzy_index_insert_shingle (backend->index,
+								shcmd->sgl.hashes[i], i, id);
 					}
 				}
 			}
@@ -716,6 +1527,10 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 				RSPAMD_FUZZY_BACKEND_INSERT);
 	}
 
+	if (rc == SQLITE_OK) {
+		rspamd_fuzzy_backend_log_change (backend, cmd);
+	}
+
 	return (rc == SQLITE_OK);
 }
 
@@ -723,6 +1538,7 @@ gboolean
 rspamd_fuzzy_backend_finish_update (struct rspamd_fuzzy_backend *backend)
 {
 	gint rc, wal_frames, wal_checkpointed;
+	GError *err = NULL;
 
 	rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
@@ -732,6 +1548,18 @@ rspamd_fuzzy_backend_finish_update (struct rspamd_fuzzy_backend *backend)
 				sqlite3_errmsg (backend->db));
 		rspamd_fuzzy_backend_run_stmt (backend, TRUE,
 				RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
+
+		if (backend->index) {
+			/* Memory index has uncommitted changes, so reload it */
+			if (!rspamd_fuzzy_backend_load_index (backend, &err)) {
+				msg_err_fuzzy_backend ("cannot reload memory index, "
+						"disable it: %e", err);
+				g_error_free (err);
+				rspamd_fuzzy_index_free (backend->index);
+				backend->index = NULL;
+			}
+		}
+
 		return FALSE;
 	}
 	else {
@@ -753,6 +1581,7 @@ rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
 		const struct rspamd_fuzzy_cmd *cmd)
 {
 	int rc;
+	struct rspamd_fuzzy_index_elt *elt;
 
 	if (backend == NULL) {
 		return FALSE;
@@ -762,6 +1591,16 @@ rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
 			RSPAMD_FUZZY_BACKEND_DELETE,
 			cmd->digest);
 
+	if (rc == SQLITE_OK && backend->index &&
+			(elt = rspamd_fuzzy_index_lookup (backend->index,
+					(const guchar *)cmd->digest)) != NULL) {
+		rspamd_fuzzy_index_remove (backend->index, elt);
+	}
+
+	if (rc == SQLITE_OK) {
+		rspamd_fuzzy_backend_log_change (backend, cmd);
+	}
+
 	return (rc == SQLITE_OK);
 }
 
@@ -778,7 +1617,6 @@ rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 	/* Do not do more than 5k ops per step */
 	const guint64 max_changes = 5000;
 	gboolean ret = FALSE;
-	gint64 expire_lim, expired;
 	gint rc, i, orphaned_cnt = 0;
 	GError *err = NULL;
 	static const gchar orphaned_shingles[] = "SELECT shingles.value,shingles.number "
@@ -797,47 +1635,7 @@ rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 
 	/* Perform expire */
 	if (expire > 0) {
-		expire_lim = time (NULL) - expire;
-
-		if (expire_lim > 0) {
-			ret = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
-					RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
-
-			if (ret == SQLITE_OK) {
-
-				rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
-						RSPAMD_FUZZY_BACKEND_EXPIRE, expire_lim, max_changes);
-
-				if (rc == SQLITE_OK) {
-					expired = sqlite3_changes (backend->db);
-
-					if (expired > 0) {
-						backend->expired += expired;
-						msg_info_fuzzy_backend ("expired %L hashes", expired);
-					}
-				}
-				else {
-					msg_warn_fuzzy_backend (
-							"cannot execute expired statement: %s",
-							sqlite3_errmsg (backend->db));
-				}
-
-				rspamd_fuzzy_backend_cleanup_stmt (backend,
-						RSPAMD_FUZZY_BACKEND_EXPIRE);
-
-				ret = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
-						RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
-
-				if (ret != SQLITE_OK) {
-					rspamd_fuzzy_backend_run_stmt (backend, TRUE,
-							RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
-				}
-			}
-			if (ret != SQLITE_OK) {
-				msg_warn_fuzzy_backend ("cannot expire db: %s",
-						sqlite3_errmsg (backend->db));
-			}
-		}
+		ret = (rspamd_fuzzy_backend_expire (backend, expire, max_changes) >= 0);
 	}
 
 	/* Cleanup database */
@@ -909,6 +1707,21 @@ rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 		}
 	}
 
+	if (backend->max_changes > 0) {
+		if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRIM_CHANGES,
+				backend->max_changes) != SQLITE_OK) {
+			msg_warn_fuzzy_backend ("cannot trim log of changes: %s",
+					sqlite3_errmsg (backend->db));
+		}
+	}
+
+	if (backend->index) {
+		/* Expired elements are not returned anyway, so drop all of them */
+		rspamd_fuzzy_index_cleanup (backend->index,
+				expire > 0 ? time (NULL) - expire : 0, clean_orphaned);
+	}
+
 	return ret;
 }
 
@@ -926,6 +1739,10 @@ rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
 			g_free (backend->path);
 		}
 
+		if (backend->index != NULL) {
+			rspamd_fuzzy_index_free (backend->index);
+		}
+
 		if (backend->pool) {
 			rspamd_mempool_delete (backend->pool);
 		}
@@ -964,3 +1781,176 @@ rspamd_fuzzy_backend_id (struct rspamd_fuzzy_backend *backend)
 {
 	return backend != NULL ? backend->id : 0;
 }
+
+void
+rspamd_fuzzy_backend_log_changes (struct rspamd_fuzzy_backend *backend,
+		gint64 max_changes)
+{
+	g_assert (backend != NULL);
+
+	backend->max_changes = max_changes;
+}
+
+gint64
+rspamd_fuzzy_backend_read_changes (struct rspamd_fuzzy_backend *backend,
+		gint64 since, guint limit, gint64 *first,
+		rspamd_fuzzy_changes_cb cb, gpointer ud)
+{
+	sqlite3_stmt *stmt;
+	gint64 last = since;
+	gint rc;
+
+	g_assert (backend != NULL);
+
+	if (first) {
+		*first = 0;
+
+		if (rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_FIRST_CHANGE) == SQLITE_OK) {
+			*first = sqlite3_column_int64 (
+					prepared_stmts[RSPAMD_FUZZY_BACKEND_FIRST_CHANGE].stmt, 0);
+		}
+
+		rspamd_fuzzy_backend_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_FIRST_CHANGE);
+	}
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_READ_CHANGES, since, (gint64)limit);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_READ_CHANGES].stmt;
+
+	while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+		last = sqlite3_column_int64 (stmt, 0);
+		cb (last, sqlite3_column_blob (stmt, 1), sqlite3_column_bytes (stmt, 1),
+				ud);
+		rc = sqlite3_step (stmt);
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_READ_CHANGES);
+
+	return last;
+}
+
+gint64
+rspamd_fuzzy_backend_expire (struct rspamd_fuzzy_backend *backend,
+		gint64 expire, guint limit)
+{
+	sqlite3_stmt *stmt;
+	GArray *ids;
+	gint64 expire_lim, id, expired = 0;
+	guint i;
+	gint rc;
+
+	if (backend == NULL || expire <= 0) {
+		return 0;
+	}
+
+	expire_lim = time (NULL) - expire;
+
+	if (expire_lim <= 0) {
+		return 0;
+	}
+
+	/* The oldest digests are selected using time index */
+	ids = g_array_sized_new (FALSE, FALSE, sizeof (gint64), limit);
+	rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_SELECT_EXPIRED, expire_lim, (gint64)limit);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_SELECT_EXPIRED].stmt;
+
+	while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+		id = sqlite3_column_int64 (stmt, 0);
+		g_array_append_val (ids, id);
+		rc = sqlite3_step (stmt);
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_SELECT_EXPIRED);
+
+	if (ids->len == 0) {
+		g_array_free (ids, TRUE);
+
+		return 0;
+	}
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_START) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot expire db: %s",
+				sqlite3_errmsg (backend->db));
+		g_array_free (ids, TRUE);
+
+		return -1;
+	}
+
+	for (i = 0; i < ids->len; i ++) {
+		/* Shingles are removed by foreign key constraint */
+		if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_DELETE_ID,
+				g_array_index (ids, gint64, i)) == SQLITE_OK) {
+			expired ++;
+		}
+	}
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot expire db: %s",
+				sqlite3_errmsg (backend->db));
+		rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
+		g_array_free (ids, TRUE);
+
+		return -1;
+	}
+
+	if (backend->index) {
+		for (i = 0; i < ids->len; i ++) {
+			rspamd_fuzzy_index_remove_id (backend->index,
+					g_array_index (ids, gint64, i));
+		}
+	}
+
+	if (expired > 0) {
+		backend->expired += expired;
+		msg_info_fuzzy_backend ("expired %L hashes", expired);
+	}
+
+	g_array_free (ids, TRUE);
+
+	return expired;
+}
+
+gint64
+rspamd_fuzzy_backend_replica_seq (struct rspamd_fuzzy_backend *backend)
+{
+	gint64 seq = 0;
+
+	g_assert (backend != NULL);
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_GET_REPLICA_SEQ) == SQLITE_OK) {
+		seq = sqlite3_column_int64 (
+				prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_REPLICA_SEQ].stmt, 0);
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend,
+			RSPAMD_FUZZY_BACKEND_GET_REPLICA_SEQ);
+
+	return seq;
+}
+
+gboolean
+rspamd_fuzzy_backend_set_replica_seq (struct rspamd_fuzzy_backend *backend,
+		gint64 seq)
+{
+	g_assert (backend != NULL);
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_SET_REPLICA_SEQ, seq) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot save replication sequence: %s",
+				sqlite3_errmsg (backend->db));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -21,15 +21,38 @@
 
 
 struct rspamd_fuzzy_backend;
+struct rspamd_sqlite3_tune;
+
+/**
+ * Callback for logged changes
+ * @param seq sequence number of change
+ * @param cmd raw fuzzy command (either normal or shingle one)
+ * @param len length of command
+ * @param ud opaque userdata
+ */
+typedef void (*rspamd_fuzzy_changes_cb) (gint64 seq, gconstpointer cmd,
+		gsize len, gpointer ud);
 
 /**
  * Open fuzzy backend
  * @param path file to open (legacy file will be converted automatically)
+ * @param tune sqlite tuning profile (throughput profile if NULL)
  * @param err error pointer
  * @return backend structure or NULL
  */
 struct rspamd_fuzzy_backend *rspamd_fuzzy_backend_open (const gchar *path,
 		gboolean vacuum,
+		const struct rspamd_sqlite3_tune *tune,
+		GError **err);
+
+/**
+ * Load all digests and shingles to the memory index, so checks are performed
+ * without sqlite queries (index is replaced if it has been loaded before)
+ * @param backend
+ * @param err error pointer
+ * @return TRUE if index has been loaded
+ */
+gboolean rspamd_fuzzy_backend_load_index (struct rspamd_fuzzy_backend *backend,
 		GError **err);
 
 /**
@@ -82,12 +105,59 @@ gboolean rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 		gint64 expire,
 		gboolean clean_orphaned);
 
+/**
+ * Delete up to `limit` of the oldest expired digests (and their shingles) in a
+ * single transaction, so expiry of large databases could be split to short steps
+ * @param backend
+ * @param expire expire time in seconds
+ * @param limit maximum number of digests to delete
+ * @return number of digests deleted or -1 in case of error
+ */
+gint64 rspamd_fuzzy_backend_expire (struct rspamd_fuzzy_backend *backend,
+		gint64 expire, guint limit);
+
 /**
  * Close storage
  * @param backend
  */
 void rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Log all successful adds and deletes, so replicas can fetch them incrementally
+ * @param backend
+ * @param max_changes number of the last changes kept in the log on sync
+ */
+void rspamd_fuzzy_backend_log_changes (struct rspamd_fuzzy_backend *backend,
+		gint64 max_changes);
+
+/**
+ * Read logged changes following the specified sequence number
+ * @param backend
+ * @param since the last sequence number known by a caller
+ * @param limit maximum number of changes
+ * @param first output sequence number of the oldest change in the log (0 if
+ * the log is empty)
+ * @param cb callback called for each change in order
+ * @param ud userdata for callback
+ * @return sequence number of the last change read (`since` if there are none)
+ */
+gint64 rspamd_fuzzy_backend_read_changes (struct rspamd_fuzzy_backend *backend,
+		gint64 since, guint limit, gint64 *first,
+		rspamd_fuzzy_changes_cb cb, gpointer ud);
+
+/**
+ * Get the sequence number of the last change applied from master
+ */
+gint64 rspamd_fuzzy_backend_replica_seq (struct rspamd_fuzzy_backend *backend);
+
+/**
+ * Save the sequence number of the last change applied from master (must be
+ * called within update transaction to be consistent with changes)
+ */
+gboolean rspamd_fuzzy_backend_set_replica_seq (
+		struct rspamd_fuzzy_backend *backend,
+		gint64 seq);
+
 gsize rspamd_fuzzy_backend_count (struct rspamd_fuzzy_backend *backend);
 gsize rspamd_fuzzy_backend_expired (struct rspamd_fuzzy_backend *backend);
 
@@ -0,0 +1,613 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend_redis.h"
+#include "upstream.h"
+#include "cryptobox.h"
+
+#ifdef WITH_HIREDIS
+#include "hiredis.h"
+#include "adapters/libevent.h"
+
+#define REDIS_DEFAULT_PORT 6379
+#define REDIS_DEFAULT_PREFIX "fz"
+/* EVAL, script, numkeys, digest key, count key, shingles and ARGV */
+#define REDIS_MAX_ARGS (RSPAMD_SHINGLE_SIZE + 10)
+
+struct rspamd_fuzzy_backend_redis {
+	struct upstream_list *servers;
+	struct upstream *selected;
+	redisAsyncContext *conn;
+	struct event_base *ev_base;
+	gchar *prefix;
+	gchar *password;
+	gchar *dbname;
+	gdouble timeout;
+	gsize count;
+	gchar id[MEMPOOL_UID_LEN];
+};
+
+struct rspamd_fuzzy_redis_session {
+	struct rspamd_fuzzy_backend_redis *backend;
+	rspamd_fuzzy_redis_check_cb cb;
+	gpointer ud;
+	gint64 expire;
+	struct event timeout;
+};
+
+/*
+ * KEYS[1]: digest key, KEYS[2..]: shingles keys, ARGV[1]: prefix
+ * Returns {value, flag, time, matched shingles (0 for the direct match)}
+ */
+static const gchar check_script[] =
+		"local v = redis.call('HMGET', KEYS[1], 'V', 'F', 'C')\n"
+		"if v[1] then return {v[1], v[2], v[3], 0} end\n"
+		"local cnt, max, sel = {}, 0, nil\n"
+		"for i = 2, #KEYS do\n"
+		"  local d = redis.call('GET', KEYS[i])\n"
+		"  if d then\n"
+		"    cnt[d] = (cnt[d] or 0) + 1\n"
+		"    if cnt[d] > max then max = cnt[d]; sel = d end\n"
+		"  end\n"
+		"end\n"
+		"if sel and max * 2 > #KEYS - 1 then\n"
+		"  v = redis.call('HMGET', ARGV[1] .. sel, 'V', 'F', 'C')\n"
+		"  if v[1] then return {v[1], v[2], v[3], max} end\n"
+		"end\n"
+		"return false\n";
+
+/*
+ * KEYS[1]: digest key, KEYS[2]: count key, KEYS[3..]: shingles keys
+ * ARGV: flag, value, time, ttl, digest
+ */
+static const gchar add_script[] =
+		"local f = redis.call('HGET', KEYS[1], 'F')\n"
+		"local ttl = tonumber(ARGV[4])\n"
+		"if not f then\n"
+		"  redis.call('HMSET', KEYS[1], 'F', ARGV[1], 'V', ARGV[2], 'C', ARGV[3])\n"
+		"  redis.call('INCR', KEYS[2])\n"
+		"elseif tonumber(f) == tonumber(ARGV[1]) then\n"
+		"  redis.call('HINCRBY', KEYS[1], 'V', ARGV[2])\n"
+		"else\n"
+		"  redis.call('HMSET', KEYS[1], 'F', ARGV[1], 'V', ARGV[2])\n"
+		"end\n"
+		"if ttl > 0 then redis.call('EXPIRE', KEYS[1], ttl) end\n"
+		"for i = 3, #KEYS do\n"
+		"  if ttl > 0 then redis.call('SETEX', KEYS[i], ttl, ARGV[5])\n"
+		"  else redis.call('SET', KEYS[i], ARGV[5]) end\n"
+		"end\n"
+		"return 1\n";
+
+/* KEYS[1]: digest key, KEYS[2]: count key */
+static const gchar del_script[] =
+		"if redis.call('DEL', KEYS[1]) == 1 then redis.call('DECR', KEYS[2]) end\n"
+		"return 1\n";
+
+static GQuark
+rspamd_fuzzy_backend_redis_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-backend-redis");
+}
+
+static void
+rspamd_fuzzy_redis_disconnected (const redisAsyncContext *c, gint status)
+{
+	struct rspamd_fuzzy_backend_redis *backend = c->data;
+
+	if (backend->conn == c) {
+		if (status != REDIS_OK) {
+			msg_err ("connection to redis server %s has been lost: %s",
+					rspamd_upstream_name (backend->selected), c->errstr);
+			rspamd_upstream_fail (backend->selected);
+		}
+
+		backend->conn = NULL;
+	}
+}
+
+static redisAsyncContext *
+rspamd_fuzzy_redis_connection (struct rspamd_fuzzy_backend_redis *backend)
+{
+	rspamd_inet_addr_t *addr;
+
+	if (backend->conn) {
+		return backend->conn;
+	}
+
+	backend->selected = rspamd_upstream_get (backend->servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (backend->selected == NULL) {
+		msg_err ("no redis servers are available for fuzzy storage");
+		return NULL;
+	}
+
+	addr = rspamd_upstream_addr (backend->selected);
+	backend->conn = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (backend->conn == NULL) {
+		msg_err ("cannot connect to redis server %s",
+				rspamd_upstream_name (backend->selected));
+		return NULL;
+	}
+
+	if (backend->conn->err) {
+		msg_err ("cannot connect to redis server %s: %s",
+				rspamd_upstream_name (backend->selected),
+				backend->conn->errstr);
+		rspamd_upstream_fail (backend->selected);
+		redisAsyncFree (backend->conn);
+		backend->conn = NULL;
+
+		return NULL;
+	}
+
+	backend->conn->data = backend;
+	redisAsyncSetDisconnectCallback (backend->conn,
+			rspamd_fuzzy_redis_disconnected);
+	redisLibeventAttach (backend->conn, backend->ev_base);
+
+	if (backend->password) {
+		redisAsyncCommand (backend->conn, NULL, NULL, "AUTH %s",
+				backend->password);
+	}
+	if (backend->dbname) {
+		redisAsyncCommand (backend->conn, NULL, NULL, "SELECT %s",
+				backend->dbname);
+	}
+
+	return backend->conn;
+}
+
+/* Drop connection, so all pending callbacks are called with NULL replies */
+static void
+rspamd_fuzzy_redis_reset (struct rspamd_fuzzy_backend_redis *backend)
+{
+	redisAsyncContext *conn = backend->conn;
+
+	if (conn) {
+		backend->conn = NULL;
+		redisAsyncFree (conn);
+	}
+}
+
+static gchar *
+rspamd_fuzzy_redis_digest_key (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gsize *len)
+{
+	gsize plen = strlen (backend->prefix);
+	gchar *key;
+
+	*len = plen + sizeof (cmd->digest);
+	key = g_malloc (*len);
+	memcpy (key, backend->prefix, plen);
+	memcpy (key + plen, cmd->digest, sizeof (cmd->digest));
+
+	return key;
+}
+
+/* Fill shingles keys to argv starting from the specified position */
+static gint
+rspamd_fuzzy_redis_shingles_keys (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd, const gchar **argv,
+		gsize *argv_len, gint pos)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	gint i;
+
+	if (cmd->shingles_count == 0) {
+		return pos;
+	}
+
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		argv[pos] = g_strdup_printf ("%s_%d_%" G_GUINT64_FORMAT,
+				backend->prefix, i, shcmd->sgl.hashes[i]);
+		argv_len[pos] = strlen (argv[pos]);
+		pos ++;
+	}
+
+	return pos;
+}
+
+static void
+rspamd_fuzzy_redis_session_free (struct rspamd_fuzzy_redis_session *session)
+{
+	g_slice_free1 (sizeof (*session), session);
+}
+
+static void
+rspamd_fuzzy_redis_session_finish (struct rspamd_fuzzy_redis_session *session,
+		struct rspamd_fuzzy_reply *rep)
+{
+	rspamd_fuzzy_redis_check_cb cb = session->cb;
+
+	if (cb) {
+		event_del (&session->timeout);
+		session->cb = NULL;
+		cb (rep, session->ud);
+	}
+}
+
+static gint64
+rspamd_fuzzy_redis_reply_int (redisReply *elt)
+{
+	if (elt->type == REDIS_REPLY_INTEGER) {
+		return elt->integer;
+	}
+	else if (elt->type == REDIS_REPLY_STRING) {
+		return g_ascii_strtoll (elt->str, NULL, 10);
+	}
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	redisReply *reply = r;
+	gint64 matched, ts;
+
+	if (reply == NULL) {
+		/* Connection has been terminated */
+		rspamd_fuzzy_redis_session_finish (session, &rep);
+		rspamd_fuzzy_redis_session_free (session);
+
+		return;
+	}
+
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 4) {
+		ts = rspamd_fuzzy_redis_reply_int (reply->element[2]);
+		matched = rspamd_fuzzy_redis_reply_int (reply->element[3]);
+
+		if (time (NULL) - ts <= session->expire) {
+			rep.value = rspamd_fuzzy_redis_reply_int (reply->element[0]);
+			rep.flag = rspamd_fuzzy_redis_reply_int (reply->element[1]);
+			rep.prob = matched == 0 ? 1.0 :
+					(gfloat)matched / (gfloat)RSPAMD_SHINGLE_SIZE;
+		}
+
+		rspamd_upstream_ok (session->backend->selected);
+	}
+	else if (reply->type == REDIS_REPLY_ERROR) {
+		msg_err ("cannot check fuzzy hash in redis: %s", reply->str);
+	}
+
+	rspamd_fuzzy_redis_session_finish (session, &rep);
+	rspamd_fuzzy_redis_session_free (session);
+}
+
+static void
+rspamd_fuzzy_redis_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_fuzzy_redis_session *session = d;
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+
+	msg_err ("connection to redis server %s timed out",
+			rspamd_upstream_name (backend->selected));
+	rspamd_upstream_fail (backend->selected);
+	/* Session itself is freed when the pending callback is cancelled */
+	rspamd_fuzzy_redis_session_finish (session, &rep);
+	rspamd_fuzzy_redis_reset (backend);
+}
+
+static void
+rspamd_fuzzy_redis_update_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	redisReply *reply = r;
+
+	if (reply && reply->type == REDIS_REPLY_ERROR) {
+		msg_err ("cannot update fuzzy hash in redis: %s", reply->str);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_count_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_backend_redis *backend = priv;
+	redisReply *reply = r;
+
+	if (reply && (reply->type == REDIS_REPLY_STRING ||
+			reply->type == REDIS_REPLY_INTEGER)) {
+		backend->count = MAX (rspamd_fuzzy_redis_reply_int (reply), 0);
+	}
+}
+
+struct rspamd_fuzzy_backend_redis *
+rspamd_fuzzy_backend_redis_new (struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *servers,
+		const gchar *prefix,
+		const gchar *password,
+		const gchar *dbname,
+		gdouble timeout,
+		GError **err)
+{
+	struct rspamd_fuzzy_backend_redis *backend;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+
+	if (servers == NULL) {
+		g_set_error (err, rspamd_fuzzy_backend_redis_quark (),
+				EINVAL, "Redis servers have not been specified");
+		return NULL;
+	}
+
+	backend = g_slice_alloc0 (sizeof (*backend));
+	backend->servers = rspamd_upstreams_create (cfg->ups_ctx);
+
+	if (!rspamd_upstreams_parse_line (backend->servers, servers,
+			REDIS_DEFAULT_PORT, NULL)) {
+		g_set_error (err, rspamd_fuzzy_backend_redis_quark (),
+				EINVAL, "Cannot parse redis servers: %s", servers);
+		rspamd_upstreams_destroy (backend->servers);
+		g_slice_free1 (sizeof (*backend), backend);
+
+		return NULL;
+	}
+
+	backend->ev_base = ev_base;
+	backend->prefix = g_strdup (prefix ? prefix : REDIS_DEFAULT_PREFIX);
+	backend->password = g_strdup (password);
+	backend->dbname = g_strdup (dbname);
+	backend->timeout = timeout;
+
+	/* Workers using the same servers and prefix share the same dataset */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, servers, strlen (servers));
+	rspamd_cryptobox_hash_update (&st, backend->prefix,
+			strlen (backend->prefix));
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (backend->id, sizeof (backend->id), "%xs", hash_out);
+
+	return backend;
+}
+
+void
+rspamd_fuzzy_backend_redis_check (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire,
+		rspamd_fuzzy_redis_check_cb cb,
+		gpointer ud)
+{
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	struct timeval tv;
+	redisAsyncContext *conn;
+	const gchar *argv[REDIS_MAX_ARGS];
+	gsize argv_len[REDIS_MAX_ARGS];
+	gchar numbuf[16];
+	gint argc, i, ret;
+
+	g_assert (backend != NULL);
+
+	if ((conn = rspamd_fuzzy_redis_connection (backend)) == NULL) {
+		cb (&rep, ud);
+		return;
+	}
+
+	argv[0] = "EVAL";
+	argv_len[0] = sizeof ("EVAL") - 1;
+	argv[1] = check_script;
+	argv_len[1] = sizeof (check_script) - 1;
+	argv[3] = rspamd_fuzzy_redis_digest_key (backend, cmd, &argv_len[3]);
+	argc = rspamd_fuzzy_redis_shingles_keys (backend, cmd, argv, argv_len, 4);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%d", argc - 3);
+	argv[2] = numbuf;
+	argv_len[2] = strlen (numbuf);
+	argv[argc] = backend->prefix;
+	argv_len[argc] = strlen (backend->prefix);
+	argc ++;
+
+	session = g_slice_alloc0 (sizeof (*session));
+	session->backend = backend;
+	session->cb = cb;
+	session->ud = ud;
+	session->expire = expire;
+
+	ret = redisAsyncCommandArgv (conn, rspamd_fuzzy_redis_check_callback,
+			session, argc, argv, argv_len);
+
+	/* Arguments are copied to the output buffer */
+	for (i = 3; i < argc - 1; i ++) {
+		g_free ((gpointer)argv[i]);
+	}
+
+	if (ret != REDIS_OK) {
+		g_slice_free1 (sizeof (*session), session);
+		cb (&rep, ud);
+
+		return;
+	}
+
+	event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
+			session);
+	event_base_set (backend->ev_base, &session->timeout);
+	double_to_tv (backend->timeout, &tv);
+	event_add (&session->timeout, &tv);
+}
+
+void
+rspamd_fuzzy_backend_redis_update (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire)
+{
+	redisAsyncContext *conn;
+	const gchar *argv[REDIS_MAX_ARGS];
+	gsize argv_len[REDIS_MAX_ARGS];
+	gchar numbuf[16], flagbuf[16], valbuf[32], timebuf[32], ttlbuf[32];
+	gchar *count_key;
+	gint argc, nkeys, i;
+
+	g_assert (backend != NULL);
+
+	if ((conn = rspamd_fuzzy_redis_connection (backend)) == NULL) {
+		return;
+	}
+
+	count_key = g_strdup_printf ("%s_count", backend->prefix);
+	argv[0] = "EVAL";
+	argv_len[0] = sizeof ("EVAL") - 1;
+	argv[3] = rspamd_fuzzy_redis_digest_key (backend, cmd, &argv_len[3]);
+	argv[4] = count_key;
+	argv_len[4] = strlen (count_key);
+
+	if (cmd->cmd == FUZZY_WRITE) {
+		argv[1] = add_script;
+		argv_len[1] = sizeof (add_script) - 1;
+		argc = rspamd_fuzzy_redis_shingles_keys (backend, cmd, argv,
+				argv_len, 5);
+		nkeys = argc - 3;
+		rspamd_snprintf (flagbuf, sizeof (flagbuf), "%d", (gint)cmd->flag);
+		rspamd_snprintf (valbuf, sizeof (valbuf), "%d", (gint)cmd->value);
+		rspamd_snprintf (timebuf, sizeof (timebuf), "%L", (gint64)time (NULL));
+		rspamd_snprintf (ttlbuf, sizeof (ttlbuf), "%L", expire);
+		argv[argc] = flagbuf;
+		argv_len[argc++] = strlen (flagbuf);
+		argv[argc] = valbuf;
+		argv_len[argc++] = strlen (valbuf);
+		argv[argc] = timebuf;
+		argv_len[argc++] = strlen (timebuf);
+		argv[argc] = ttlbuf;
+		argv_len[argc++] = strlen (ttlbuf);
+		argv[argc] = cmd->digest;
+		argv_len[argc++] = sizeof (cmd->digest);
+	}
+	else {
+		/* Shingles are left to expire, they are ignored without digest */
+		argv[1] = del_script;
+		argv_len[1] = sizeof (del_script) - 1;
+		argc = 5;
+		nkeys = 2;
+	}
+
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%d", nkeys);
+	argv[2] = numbuf;
+	argv_len[2] = strlen (numbuf);
+
+	redisAsyncCommandArgv (conn, rspamd_fuzzy_redis_update_callback, NULL,
+			argc, argv, argv_len);
+
+	for (i = 3; i < nkeys + 3; i ++) {
+		g_free ((gpointer)argv[i]);
+	}
+}
+
+gsize
+rspamd_fuzzy_backend_redis_count (struct rspamd_fuzzy_backend_redis *backend)
+{
+	redisAsyncContext *conn;
+
+	g_assert (backend != NULL);
+
+	if ((conn = rspamd_fuzzy_redis_connection (backend)) != NULL) {
+		redisAsyncCommand (conn, rspamd_fuzzy_redis_count_callback, backend,
+				"GET %s_count", backend->prefix);
+	}
+
+	return backend->count;
+}
+
+const gchar *
+rspamd_fuzzy_backend_redis_id (struct rspamd_fuzzy_backend_redis *backend)
+{
+	g_assert (backend != NULL);
+
+	return backend->id;
+}
+
+void
+rspamd_fuzzy_backend_redis_close (struct rspamd_fuzzy_backend_redis *backend)
+{
+	if (backend) {
+		rspamd_fuzzy_redis_reset (backend);
+		rspamd_upstreams_destroy (backend->servers);
+		g_free (backend->prefix);
+		g_free (backend->password);
+		g_free (backend->dbname);
+		g_slice_free1 (sizeof (*backend), backend);
+	}
+}
+
+#else
+
+static GQuark
+rspamd_fuzzy_backend_redis_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-backend-redis");
+}
+
+struct rspamd_fuzzy_backend_redis *
+rspamd_fuzzy_backend_redis_new (struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *servers,
+		const gchar *prefix,
+		const gchar *password,
+		const gchar *dbname,
+		gdouble timeout,
+		GError **err)
+{
+	g_set_error (err, rspamd_fuzzy_backend_redis_quark (),
+			ENOTSUP, "Rspamd is compiled without redis support");
+
+	return NULL;
+}
+
+void
+rspamd_fuzzy_backend_redis_check (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire,
+		rspamd_fuzzy_redis_check_cb cb,
+		gpointer ud)
+{
+	g_assert_not_reached ();
+}
+
+void
+rspamd_fuzzy_backend_redis_update (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire)
+{
+	g_assert_not_reached ();
+}
+
+gsize
+rspamd_fuzzy_backend_redis_count (struct rspamd_fuzzy_backend_redis *backend)
+{
+	return 0;
+}
+
+const gchar *
+rspamd_fuzzy_backend_redis_id (struct rspamd_fuzzy_backend_redis *backend)
+{
+	return NULL;
+}
+
+void
+rspamd_fuzzy_backend_redis_close (struct rspamd_fuzzy_backend_redis *backend)
+{
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_FUZZY_BACKEND_REDIS_H_
+#define SRC_LIBSERVER_FUZZY_BACKEND_REDIS_H_
+
+#include "config.h"
+#include "fuzzy_storage.h"
+#include <event.h>
+
+/**
+ * @file fuzzy_backend_redis.h
+ *
+ * Asynchronous fuzzy backend storing hashes in redis, so several storage
+ * workers (and hosts) could share the same dataset. Digests are stored as
+ * hashes `<prefix><digest>` with fields `F` (flag), `V` (value) and `C` (time),
+ * each shingle is stored as a key `<prefix>_<number>_<value>` pointing to its
+ * digest. Redis TTL is used for expiration, all checks and updates are
+ * performed by a single lua script call each, pipelined over one connection
+ */
+
+struct rspamd_fuzzy_backend_redis;
+struct rspamd_config;
+
+/**
+ * Callback for asynchronous checks
+ * @param rep reply (zero value and probability if nothing has been found)
+ * @param ud opaque userdata
+ */
+typedef void (*rspamd_fuzzy_redis_check_cb) (struct rspamd_fuzzy_reply *rep,
+		gpointer ud);
+
+/**
+ * Create new redis backend
+ * @param cfg configuration
+ * @param ev_base event base used for connections
+ * @param servers list of redis servers
+ * @param prefix prefix for all keys
+ * @param password optional password
+ * @param dbname optional database
+ * @param timeout timeout for requests in seconds
+ * @param err error pointer
+ * @return new backend or NULL
+ */
+struct rspamd_fuzzy_backend_redis *rspamd_fuzzy_backend_redis_new (
+		struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *servers,
+		const gchar *prefix,
+		const gchar *password,
+		const gchar *dbname,
+		gdouble timeout,
+		GError **err);
+
+/**
+ * Check digest and shingles in redis, callback is called exactly once
+ * @param backend
+ * @param cmd command to check
+ * @param expire expiration time
+ * @param cb callback
+ * @param ud userdata for callback
+ */
+void rspamd_fuzzy_backend_redis_check (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire,
+		rspamd_fuzzy_redis_check_cb cb,
+		gpointer ud);
+
+/**
+ * Add or delete digest (and its shingles) in redis asynchronously
+ * @param backend
+ * @param cmd FUZZY_WRITE or FUZZY_DEL command
+ * @param expire expiration time for digests and shingles (0 for no expiration)
+ */
+void rspamd_fuzzy_backend_redis_update (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire);
+
+/**
+ * Returns the last known number of digests and requests the recent one
+ * @param backend
+ * @return
+ */
+gsize rspamd_fuzzy_backend_redis_count (struct rspamd_fuzzy_backend_redis *backend);
+
+/**
+ * Returns unique id of the dataset (derived from servers and prefix)
+ * @param backend
+ * @return
+ */
+const gchar *rspamd_fuzzy_backend_redis_id (struct rspamd_fuzzy_backend_redis *backend);
+
+/**
+ * Close backend, all pending checks are finished with empty replies
+ * @param backend
+ */
+void rspamd_fuzzy_backend_redis_close (struct rspamd_fuzzy_backend_redis *backend);
+
+#endif /* SRC_LIBSERVER_FUZZY_BACKEND_REDIS_H_ */
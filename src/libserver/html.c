@@ -21,8 +21,6 @@
 #include "html_tags.h"
 #include "url.h"
 
-static sig_atomic_t tags_sorted = 0;
-
 struct html_tag_def {
 	gint id;
 	const gchar *name;
@@ -155,7 +153,6 @@ static struct html_tag_def tag_defs[] = {
 	{Tag_WBR, "wbr", (CM_INLINE | CM_EMPTY)},
 };
 
-static sig_atomic_t entities_sorted = 0;
 struct _entity;
 typedef struct _entity entity;
 
@@ -437,76 +434,74 @@ static entity entities_defs[] = {
 	{"euro", 8364, "E"},
 };
 
-static entity entities_defs_num[ (G_N_ELEMENTS (entities_defs)) ];
-static struct html_tag_def tag_defs_num[ (G_N_ELEMENTS (tag_defs)) ];
+/* Characters that interrupt plain text in html content (and spaces) */
+static const gchar html_text_stop[] = "<& \t\n\v\f\r";
 
-static gint
-tag_cmp (const void *m1, const void *m2)
-{
-	const struct html_tag_def *p1 = m1;
-	const struct html_tag_def *p2 = m2;
-	gsize l1, l2;
+/* Lookup tables, built once per process */
+static GHashTable *html_tag_by_name = NULL;
+static GHashTable *html_entity_by_name = NULL;
+static GHashTable *html_entity_by_code = NULL;
+static struct html_tag_def *html_tag_by_id[N_TAGS];
 
-	l1 = strlen (p1->name);
-	l2 = strlen (p2->name);
+static void
+rspamd_html_library_init (void)
+{
+	rspamd_ftok_t *keys;
+	guint i;
 
-	if (l1 == l2) {
-		return g_ascii_strcasecmp (p1->name, p2->name);
+	if (html_tag_by_name != NULL) {
+		return;
 	}
 
-	return l1 - l2;
-}
+	/* Keys live as long as the process */
+	keys = g_malloc (sizeof (*keys) *
+			(G_N_ELEMENTS (tag_defs) + G_N_ELEMENTS (entities_defs)));
+	html_tag_by_name = g_hash_table_new (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal);
 
-static gint
-tag_cmp_id (const void *m1, const void *m2)
-{
-	const struct html_tag_def *p1 = m1;
-	const struct html_tag_def *p2 = m2;
+	for (i = 0; i < G_N_ELEMENTS (tag_defs); i ++) {
+		keys->begin = tag_defs[i].name;
+		keys->len = strlen (tag_defs[i].name);
+		g_hash_table_insert (html_tag_by_name, keys, &tag_defs[i]);
+		keys ++;
 
-	return p1->id - p2->id;
-}
+		if (tag_defs[i].id >= 0 && tag_defs[i].id < N_TAGS) {
+			html_tag_by_id[tag_defs[i].id] = &tag_defs[i];
+		}
+	}
 
-static gint
-tag_find_id (const void *skey, const void *elt)
-{
-	const struct html_tag *tag = skey;
-	const struct html_tag_def *d = elt;
+	html_entity_by_name = g_hash_table_new (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal);
+	html_entity_by_code = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-	return tag->id - d->id;
-}
+	for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+		keys->begin = entities_defs[i].name;
+		keys->len = strlen (entities_defs[i].name);
 
-static gint
-tag_find (const void *skey, const void *elt)
-{
-	const struct html_tag *tag = skey;
-	const struct html_tag_def *d = elt;
-	gsize tlen;
+		if (g_hash_table_lookup (html_entity_by_name, keys) == NULL) {
+			g_hash_table_insert (html_entity_by_name, keys, &entities_defs[i]);
+		}
 
-	tlen = strlen (d->name);
+		keys ++;
 
-	if (tlen == tag->name.len) {
-		return g_ascii_strncasecmp (tag->name.start, d->name, tag->name.len);
+		if (g_hash_table_lookup (html_entity_by_code,
+				GUINT_TO_POINTER (entities_defs[i].code)) == NULL) {
+			g_hash_table_insert (html_entity_by_code,
+					GUINT_TO_POINTER (entities_defs[i].code),
+					&entities_defs[i]);
+		}
 	}
-
-	return tag->name.len - tlen;
 }
 
-static gint
-entity_cmp (const void *m1, const void *m2)
+static inline struct html_tag_def *
+rspamd_html_find_tag_def (const gchar *name, gsize len)
 {
-	const entity *p1 = m1;
-	const entity *p2 = m2;
-
-	return g_ascii_strcasecmp (p1->name, p2->name);
-}
+	rspamd_ftok_t srch;
 
-static gint
-entity_cmp_num (const void *m1, const void *m2)
-{
-	const entity *p1 = m1;
-	const entity *p2 = m2;
+	srch.begin = name;
+	srch.len = len;
 
-	return p1->code - p2->code;
+	return g_hash_table_lookup (html_tag_by_name, &srch);
 }
 
 static gboolean
@@ -523,8 +518,11 @@ rspamd_html_check_balance (GNode * node, GNode ** cur_level)
 			if (tmp->id == arg->id &&
 				(tmp->flags & FL_CLOSED) == 0) {
 				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
+				/*
+				 * Unlink current node as we find corresponding parent node,
+				 * its memory belongs to the pool
+				 */
+				g_node_unlink (node);
 				/* Change level */
 				*cur_level = cur->parent;
 				return TRUE;
@@ -542,17 +540,13 @@ rspamd_html_check_balance (GNode * node, GNode ** cur_level)
 gboolean
 rspamd_html_tag_seen (struct html_content *hc, const gchar *tagname)
 {
-	struct html_tag tag;
 	struct html_tag_def *found;
 
 	g_assert (hc != NULL);
 	g_assert (hc->tags_seen != NULL);
 
-	tag.name.start = tagname;
-	tag.name.len = strlen (tagname);
-
-	found = bsearch (&tag, tag_defs, G_N_ELEMENTS (tag_defs),
-			sizeof (tag_defs[0]), tag_find);
+	rspamd_html_library_init ();
+	found = rspamd_html_find_tag_def (tagname, strlen (tagname));
 
 	if (found) {
 		return isset (hc->tags_seen, found->id);
@@ -564,16 +558,10 @@ rspamd_html_tag_seen (struct html_content *hc, const gchar *tagname)
 const gchar*
 rspamd_html_tag_by_id (gint id)
 {
-	struct html_tag tag;
-	struct html_tag_def *found;
-
-	tag.id = id;
-	/* Should work as IDs monotonically increase */
-	found = bsearch (&tag, tag_defs_num, G_N_ELEMENTS (tag_defs_num),
-				sizeof (tag_defs_num[0]), tag_find_id);
+	rspamd_html_library_init ();
 
-	if (found) {
-		return found->name;
+	if (id >= 0 && id < N_TAGS && html_tag_by_id[id] != NULL) {
+		return html_tag_by_id[id]->name;
 	}
 
 	return NULL;
@@ -586,7 +574,8 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 	guint l, rep_len;
 	gchar *t = s, *h = s, *e = s, *end_ptr;
 	gint state = 0, val, base;
-	entity *found, key;
+	entity *found;
+	rspamd_ftok_t key;
 
 	if (len == 0) {
 		l = strlen (s);
@@ -595,6 +584,8 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 		l = len;
 	}
 
+	rspamd_html_library_init ();
+
 	while (h - s < (gint)l) {
 		switch (state) {
 		/* Out of entitle */
@@ -606,9 +597,16 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 				continue;
 			}
 			else {
-				*t = *h;
-				h++;
-				t++;
+				/* Copy everything up to the next entity at once */
+				e = memchr (h, '&', l - (h - s));
+				rep_len = e ? e - h : l - (h - s);
+
+				if (t != h) {
+					memmove (t, h, rep_len);
+				}
+
+				h += rep_len;
+				t += rep_len;
 			}
 			break;
 		case 1:
@@ -616,12 +614,12 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 				/* Determine base */
 				/* First find in entities table */
 
-				key.name = e + 1;
+				key.begin = e + 1;
+				key.len = h - e - 1;
 				*h = '\0';
 				if (*(e + 1) != '#' &&
-					(found =
-					bsearch (&key, entities_defs, G_N_ELEMENTS (entities_defs),
-					sizeof (entity), entity_cmp)) != NULL) {
+					(found = g_hash_table_lookup (html_entity_by_name,
+							&key)) != NULL) {
 					if (found->replacement) {
 						rep_len = strlen (found->replacement);
 						memcpy (t, found->replacement, rep_len);
@@ -650,11 +648,8 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 					}
 					else {
 						/* Search for a replacement */
-						key.code = val;
-						found =
-							bsearch (&key, entities_defs_num, G_N_ELEMENTS (
-									entities_defs), sizeof (entity),
-								entity_cmp_num);
+						found = g_hash_table_lookup (html_entity_by_code,
+								GUINT_TO_POINTER (val));
 						if (found) {
 							if (found->replacement) {
 								rep_len = strlen (found->replacement);
@@ -677,12 +672,14 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 
 static void
 rspamd_html_url_is_phished (rspamd_mempool_t *pool,
+	struct html_content *hc,
 	struct rspamd_url *href_url,
 	const guchar *url_text,
 	gsize len,
 	gboolean *url_found)
 {
 	struct rspamd_url *text_url;
+	struct html_anchor anchor;
 	gint rc;
 	gchar *url_str = NULL;
 
@@ -693,6 +690,17 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 		rc = rspamd_url_parse (text_url, url_str, strlen (url_str), pool);
 
 		if (rc == URI_ERRNO_OK) {
+			if (hc->anchors == NULL) {
+				hc->anchors = g_array_sized_new (FALSE, FALSE,
+						sizeof (struct html_anchor), 16);
+				rspamd_mempool_add_destructor (pool, rspamd_array_free_hard,
+						hc->anchors);
+			}
+
+			anchor.href = href_url;
+			anchor.text = text_url;
+			g_array_append_val (hc->anchors, anchor);
+
 			if (href_url->hostlen != text_url->hostlen || memcmp (href_url->host,
 					text_url->host, href_url->hostlen) != 0) {
 
@@ -714,6 +722,22 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 
 }
 
+/*
+ * Nodes of html tree are allocated from the pool: there are usually
+ * thousands of them, and they are freed all at once with the pool.
+ * Hence, they must never be freed with g_node_destroy.
+ */
+static inline GNode *
+rspamd_html_node_new (rspamd_mempool_t *pool, gpointer data)
+{
+	GNode *node;
+
+	node = rspamd_mempool_alloc0 (pool, sizeof (*node));
+	node->data = data;
+
+	return node;
+}
+
 static gboolean
 rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 		struct html_tag *tag, GNode **cur_level, gboolean *balanced)
@@ -722,24 +746,20 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	struct html_tag *parent;
 
 	if (hc->html_tags == NULL) {
-		nnode = g_node_new (NULL);
+		nnode = rspamd_html_node_new (pool, NULL);
 		*cur_level = nnode;
 		hc->html_tags = nnode;
-		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t) g_node_destroy,
-				nnode);
 	}
 
 	tag->parent = *cur_level;
 
 	if (!(tag->flags & CM_INLINE)) {
 		/* Block tag */
-		nnode = g_node_new (tag);
+		nnode = rspamd_html_node_new (pool, tag);
 
 		if (tag->flags & FL_CLOSING) {
 			if (!*cur_level) {
 				msg_debug_pool ("bad parent node");
-				g_node_destroy (nnode);
 				return FALSE;
 			}
 
@@ -790,12 +810,15 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	return TRUE;
 }
 
+/* Component and its list link are allocated in a single pool chunk */
 #define NEW_COMPONENT(comp_type) do {							\
-	comp = rspamd_mempool_alloc (pool, sizeof (*comp));			\
+	comp = rspamd_mempool_alloc (pool, sizeof (*comp) + sizeof (GList)); \
 	comp->type = (comp_type);									\
 	comp->start = NULL;											\
 	comp->len = 0;												\
-	g_queue_push_tail (tag->params, comp);						\
+	link = (GList *)(comp + 1);									\
+	link->data = comp;											\
+	g_queue_push_tail_link (tag->params, link);					\
 	ret = TRUE;													\
 } while(0)
 
@@ -805,6 +828,7 @@ rspamd_html_parse_tag_component (rspamd_mempool_t *pool,
 		struct html_tag *tag)
 {
 	struct html_tag_component *comp;
+	GList *link;
 	gint len;
 	gboolean ret = FALSE;
 
@@ -912,8 +936,8 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 						(gchar *)tag->name.start,
 						tag->name.len);
 
-				found = bsearch (tag, tag_defs, G_N_ELEMENTS (tag_defs),
-					sizeof (tag_defs[0]), tag_find);
+				found = rspamd_html_find_tag_def (tag->name.start,
+						tag->name.len);
 				if (found == NULL) {
 					hc->flags |= RSPAMD_HTML_FLAG_UNKNOWN_ELEMENTS;
 					tag->id = -1;
@@ -1609,24 +1633,9 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	g_assert (hc != NULL);
 	g_assert (pool != NULL);
 
-	if (!tags_sorted) {
-		qsort (tag_defs, G_N_ELEMENTS (
-				tag_defs), sizeof (struct html_tag_def), tag_cmp);
-		memcpy (tag_defs_num, tag_defs, sizeof (tag_defs));
-		qsort (tag_defs_num, G_N_ELEMENTS (tag_defs_num),
-				sizeof (struct html_tag_def), tag_cmp_id);
-		tags_sorted = 1;
-	}
-	if (!entities_sorted) {
-		qsort (entities_defs, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp);
-		memcpy (entities_defs_num, entities_defs, sizeof (entities_defs));
-		qsort (entities_defs_num, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp_num);
-		entities_sorted = 1;
-	}
+	rspamd_html_library_init ();
 
-	hc->tags_seen = rspamd_mempool_alloc0 (pool, NBYTES (G_N_ELEMENTS (tag_defs)));
+	hc->tags_seen = rspamd_mempool_alloc0 (pool, NBYTES (N_TAGS));
 
 	dest = g_byte_array_sized_new (in->len / 3 * 2);
 
@@ -1678,10 +1687,10 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				state = tag_content;
 				substate = 0;
 				savep = NULL;
-				cur_tag = rspamd_mempool_alloc0 (pool, sizeof (*cur_tag));
-				cur_tag->params = g_queue_new ();
-				rspamd_mempool_add_destructor (pool,
-						(rspamd_mempool_destruct_t)g_queue_free, cur_tag->params);
+				/* Tag and its params queue share the same pool chunk */
+				cur_tag = rspamd_mempool_alloc0 (pool,
+						sizeof (*cur_tag) + sizeof (GQueue));
+				cur_tag->params = (GQueue *)(cur_tag + 1);
 				break;
 			}
 
@@ -1809,6 +1818,12 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 						}
 						save_space = FALSE;
 					}
+
+					/* Skip plain text up to the next special character */
+					p ++;
+					p += rspamd_memcspn ((const gchar *)p, end - p,
+							html_text_stop, sizeof (html_text_stop) - 1);
+					continue;
 				}
 			}
 			else {
@@ -1949,7 +1964,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 							(cur_tag->flags & FL_CLOSING)) {
 						/* Insert exception */
 						if (url != NULL && (gint)dest->len > href_offset) {
-							rspamd_html_url_is_phished (pool, url,
+							rspamd_html_url_is_phished (pool, hc, url,
 									dest->data + href_offset,
 									dest->len - href_offset,
 									&url_text);
@@ -1984,6 +1999,12 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 			p++;
 			c = p;
 			cur_tag = NULL;
+
+			if (hc->max_tags > 0 && ++hc->ntags >= hc->max_tags && p < end) {
+				/* Ignore the rest of content */
+				hc->flags |= RSPAMD_HTML_FLAG_TOO_MANY_TAGS;
+				p = end;
+			}
 			break;
 		}
 	}
@@ -17,6 +17,7 @@
 #define RSPAMD_HTML_FLAG_UNBALANCED (1 << 3)
 #define RSPAMD_HTML_FLAG_UNKNOWN_ELEMENTS (1 << 4)
 #define RSPAMD_HTML_FLAG_DUPLICATE_ELEMENTS (1 << 5)
+#define RSPAMD_HTML_FLAG_TOO_MANY_TAGS (1 << 6)
 
 /*
  * Image flags
@@ -48,6 +49,12 @@ struct html_image {
 	struct html_tag *tag;
 };
 
+/* Anchor whose displayed text is an URL itself */
+struct html_anchor {
+	struct rspamd_url *href;
+	struct rspamd_url *text;
+};
+
 struct html_color {
 	union {
 		struct {
@@ -95,6 +102,9 @@ struct html_content {
 	guchar *tags_seen;
 	GPtrArray *images;
 	GPtrArray *blocks;
+	GArray *anchors;
+	guint ntags;
+	guint max_tags; /* Parsing stops after this number of tags if not zero */
 };
 
 /*
@@ -32,6 +32,10 @@
  * described below
  */
 #define MSG_CMD_CHECK "check"
+/*
+ * Check many messages prefixed by their lengths and return results of each
+ */
+#define MSG_CMD_CHECK_BATCH "checkbatch"
 /*
  * Check if message is spam or not, and return score plus list
  * of symbols hit
@@ -94,6 +98,8 @@
 #define DELIVER_TO_HEADER "Deliver-To"
 #define NO_LOG_HEADER "Log"
 #define MLEN_HEADER "Message-Length"
+#define COMPACT_HEADER "Compact"
+#define PROFILE_HEADER "Profile"
 
 
 static GQuark
@@ -177,10 +183,13 @@ rspamd_protocol_handle_url (struct rspamd_task *task,
 	switch (*p) {
 	case 'c':
 	case 'C':
-		/* check */
+		/* check, checkbatch */
 		if (g_ascii_strncasecmp (p, MSG_CMD_CHECK, pathlen) == 0) {
 			task->cmd = CMD_CHECK;
 		}
+		else if (g_ascii_strncasecmp (p, MSG_CMD_CHECK_BATCH, pathlen) == 0) {
+			task->cmd = CMD_CHECK_BATCH;
+		}
 		else {
 			goto err;
 		}
@@ -258,204 +267,243 @@ err:
 	return FALSE;
 }
 
-#define IF_HEADER(name) \
-	srch.begin = (name); \
-	srch.len = sizeof (name) - 1; \
-	if (rspamd_ftok_casecmp (hn_tok, &srch) == 0)
+enum rspamd_protocol_header_type {
+	RSPAMD_PROTOCOL_HDR_UNKNOWN = 0,
+	RSPAMD_PROTOCOL_HDR_DELIVER_TO,
+	RSPAMD_PROTOCOL_HDR_HELO,
+	RSPAMD_PROTOCOL_HDR_HOSTNAME,
+	RSPAMD_PROTOCOL_HDR_FROM,
+	RSPAMD_PROTOCOL_HDR_COMPACT,
+	RSPAMD_PROTOCOL_HDR_JSON,
+	RSPAMD_PROTOCOL_HDR_QUEUE_ID,
+	RSPAMD_PROTOCOL_HDR_RCPT,
+	RSPAMD_PROTOCOL_HDR_IP,
+	RSPAMD_PROTOCOL_HDR_PASS,
+	RSPAMD_PROTOCOL_HDR_PROFILE,
+	RSPAMD_PROTOCOL_HDR_SUBJECT,
+	RSPAMD_PROTOCOL_HDR_SETTINGS_ID,
+	RSPAMD_PROTOCOL_HDR_USER,
+	RSPAMD_PROTOCOL_HDR_URLS,
+	RSPAMD_PROTOCOL_HDR_NO_LOG,
+	RSPAMD_PROTOCOL_HDR_MLEN,
+};
+
+struct rspamd_protocol_header {
+	const gchar *name;
+	gsize len;
+	enum rspamd_protocol_header_type type;
+};
+
+#define PROTOCOL_HEADER(name, type) { (name), sizeof (name) - 1, (type) }
+#define PROTOCOL_HEADERS_SIZE 32
+/*
+ * Perfect hash of known headers names: slots are computed from the length and
+ * from the first and the last characters of the lowercased names, so each
+ * header is compared merely with one candidate. Slots must be recalculated
+ * if a new header is added.
+ */
+#define PROTOCOL_HEADER_HASH(first, last, len) \
+	(((guint)(first) * 7 + (guint)(last) * 22 + (len)) & (PROTOCOL_HEADERS_SIZE - 1))
+
+static const struct rspamd_protocol_header
+		protocol_headers[PROTOCOL_HEADERS_SIZE] = {
+	[1] = PROTOCOL_HEADER (IP_ADDR_HEADER, RSPAMD_PROTOCOL_HDR_IP),
+	[3] = PROTOCOL_HEADER (USER_HEADER, RSPAMD_PROTOCOL_HDR_USER),
+	[4] = PROTOCOL_HEADER (SUBJECT_HEADER, RSPAMD_PROTOCOL_HDR_SUBJECT),
+	[5] = PROTOCOL_HEADER (PROFILE_HEADER, RSPAMD_PROTOCOL_HDR_PROFILE),
+	[6] = PROTOCOL_HEADER (HELO_HEADER, RSPAMD_PROTOCOL_HDR_HELO),
+	[8] = PROTOCOL_HEADER (SETTINGS_ID_HEADER, RSPAMD_PROTOCOL_HDR_SETTINGS_ID),
+	[12] = PROTOCOL_HEADER (FROM_HEADER, RSPAMD_PROTOCOL_HDR_FROM),
+	[14] = PROTOCOL_HEADER (HOSTNAME_HEADER, RSPAMD_PROTOCOL_HDR_HOSTNAME),
+	[16] = PROTOCOL_HEADER (DELIVER_TO_HEADER, RSPAMD_PROTOCOL_HDR_DELIVER_TO),
+	[17] = PROTOCOL_HEADER (NO_LOG_HEADER, RSPAMD_PROTOCOL_HDR_NO_LOG),
+	[20] = PROTOCOL_HEADER (COMPACT_HEADER, RSPAMD_PROTOCOL_HDR_COMPACT),
+	[21] = PROTOCOL_HEADER (URLS_HEADER, RSPAMD_PROTOCOL_HDR_URLS),
+	[22] = PROTOCOL_HEADER (PASS_HEADER, RSPAMD_PROTOCOL_HDR_PASS),
+	[23] = PROTOCOL_HEADER (QUEUE_ID_HEADER, RSPAMD_PROTOCOL_HDR_QUEUE_ID),
+	[25] = PROTOCOL_HEADER (MLEN_HEADER, RSPAMD_PROTOCOL_HDR_MLEN),
+	[26] = PROTOCOL_HEADER (RCPT_HEADER, RSPAMD_PROTOCOL_HDR_RCPT),
+	[30] = PROTOCOL_HEADER (JSON_HEADER, RSPAMD_PROTOCOL_HDR_JSON),
+};
+
+static enum rspamd_protocol_header_type
+rspamd_protocol_header_lookup (const rspamd_ftok_t *name)
+{
+	const struct rspamd_protocol_header *hdr;
+	guint idx;
+
+	if (name->len == 0) {
+		return RSPAMD_PROTOCOL_HDR_UNKNOWN;
+	}
+
+	idx = PROTOCOL_HEADER_HASH (g_ascii_tolower (name->begin[0]),
+			g_ascii_tolower (name->begin[name->len - 1]),
+			name->len);
+	hdr = &protocol_headers[idx];
+
+	if (hdr->name != NULL && hdr->len == name->len &&
+			g_ascii_strncasecmp (hdr->name, name->begin, name->len) == 0) {
+		return hdr->type;
+	}
+
+	return RSPAMD_PROTOCOL_HDR_UNKNOWN;
+}
+
+/* Case insensitive comparison of header value with a literal string */
+#define HEADER_VALUE_IS(tok, str) \
+	((tok)->len == sizeof (str) - 1 && \
+	g_ascii_strncasecmp ((tok)->begin, (str), sizeof (str) - 1) == 0)
 
 gboolean
 rspamd_protocol_handle_headers (struct rspamd_task *task,
 	struct rspamd_http_message *msg)
 {
 	rspamd_fstring_t *hn, *hv;
-	rspamd_ftok_t *hn_tok, *hv_tok, srch;
+	rspamd_ftok_t *hn_tok, *hv_tok;
 	gboolean fl, has_ip = FALSE;
 	struct rspamd_http_header *h;
 	struct rspamd_email_address *addr;
+	guint64 settings_hash;
+	guint32 *hp;
 
 	LL_FOREACH (msg->headers, h)
 	{
 		hn = rspamd_fstring_new_init (h->name->begin, h->name->len);
-		hv = rspamd_fstring_new_init (h->value->begin, h->value->len);
+		hv = rspamd_fstring_new_init (hv_tok->begin, hv_tok->len);
 		hn_tok = rspamd_ftok_map (hn);
 		hv_tok = rspamd_ftok_map (hv);
 
 		g_hash_table_replace (task->request_headers, hn_tok, hv_tok);
 
-		switch (*hn_tok->begin) {
-		case 'd':
-		case 'D':
-			IF_HEADER (DELIVER_TO_HEADER) {
-				task->deliver_to = rspamd_protocol_escape_braces (task, hv);
-				debug_task ("read deliver-to header, value: %s",
-					task->deliver_to);
-			}
-			else {
-				debug_task ("wrong header: %V", hn);
-			}
+		/*
+		 * Values are parsed from the header token in place, only strings
+		 * stored in the task are copied to its pool as request headers
+		 * could be replaced from lua later
+		 */
+		switch (rspamd_protocol_header_lookup (hn_tok)) {
+		case RSPAMD_PROTOCOL_HDR_DELIVER_TO:
+			task->deliver_to = rspamd_protocol_escape_braces (task, hv);
+			debug_task ("read deliver-to header, value: %s",
+				task->deliver_to);
 			break;
-		case 'h':
-		case 'H':
-			IF_HEADER (HELO_HEADER) {
-				task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-				debug_task ("read helo header, value: %s", task->helo);
-			}
-			IF_HEADER (HOSTNAME_HEADER) {
-				task->hostname = rspamd_mempool_ftokdup (task->task_pool,
-						hv_tok);
-				debug_task ("read hostname header, value: %s", task->hostname);
-			}
+		case RSPAMD_PROTOCOL_HDR_HELO:
+			task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			debug_task ("read helo header, value: %s", task->helo);
 			break;
-		case 'f':
-		case 'F':
-			IF_HEADER (FROM_HEADER) {
-				task->from_envelope = rspamd_email_address_from_smtp (hv->str,
-						hv->len);
-				if (!task->from_envelope) {
-					msg_err_task ("bad from header: '%V'", hv);
-				}
-			}
-			else {
-				debug_task ("wrong header: %V", hn);
+		case RSPAMD_PROTOCOL_HDR_HOSTNAME:
+			task->hostname = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			debug_task ("read hostname header, value: %s", task->hostname);
+			break;
+		case RSPAMD_PROTOCOL_HDR_FROM:
+			task->from_envelope = rspamd_email_address_from_smtp (
+					hv_tok->begin, hv_tok->len);
+			if (!task->from_envelope) {
+				msg_err_task ("bad from header: '%T'", hv_tok);
 			}
 			break;
-		case 'j':
-		case 'J':
-			IF_HEADER (JSON_HEADER) {
-				fl = rspamd_config_parse_flag (hv->str, hv->len);
-				if (fl) {
-					task->flags |= RSPAMD_TASK_FLAG_JSON;
-				}
-				else {
-					task->flags &= ~RSPAMD_TASK_FLAG_JSON;
-				}
+		case RSPAMD_PROTOCOL_HDR_COMPACT:
+			fl = rspamd_config_parse_flag (hv_tok->begin, hv_tok->len);
+			if (fl) {
+				task->flags |= RSPAMD_TASK_FLAG_COMPACT;
 			}
 			else {
-				debug_task ("wrong header: %V", hn);
+				task->flags &= ~RSPAMD_TASK_FLAG_COMPACT;
 			}
 			break;
-		case 'q':
-		case 'Q':
-			IF_HEADER (QUEUE_ID_HEADER) {
-				task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
-						hv_tok);
-				debug_task ("read queue_id header, value: %s", task->queue_id);
+		case RSPAMD_PROTOCOL_HDR_JSON:
+			fl = rspamd_config_parse_flag (hv_tok->begin, hv_tok->len);
+			if (fl) {
+				task->flags |= RSPAMD_TASK_FLAG_JSON;
 			}
 			else {
-				debug_task ("wrong header: %V", hn);
+				task->flags &= ~RSPAMD_TASK_FLAG_JSON;
 			}
 			break;
-		case 'r':
-		case 'R':
-			IF_HEADER (RCPT_HEADER) {
-				addr = rspamd_email_address_from_smtp (hv->str, hv->len);
-
-				if (addr) {
-					if (task->rcpt_envelope == NULL) {
-						task->rcpt_envelope = g_ptr_array_new ();
-					}
+		case RSPAMD_PROTOCOL_HDR_QUEUE_ID:
+			task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
+					hv_tok);
+			debug_task ("read queue_id header, value: %s", task->queue_id);
+			break;
+		case RSPAMD_PROTOCOL_HDR_RCPT:
+			addr = rspamd_email_address_from_smtp (hv_tok->begin,
+					hv_tok->len);
 
-					g_ptr_array_add (task->rcpt_envelope, addr);
+			if (addr) {
+				if (task->rcpt_envelope == NULL) {
+					task->rcpt_envelope = g_ptr_array_new ();
 				}
-				else {
-					msg_err_task ("bad from header: '%T'", h->value);
-				}
-				debug_task ("read rcpt header, value: %V", hv);
+
+				g_ptr_array_add (task->rcpt_envelope, addr);
 			}
 			else {
-				debug_task ("wrong header: %V", hn);
+				msg_err_task ("bad rcpt header: '%T'", hv_tok);
 			}
+			debug_task ("read rcpt header, value: %T", hv_tok);
 			break;
-		case 'i':
-		case 'I':
-			IF_HEADER (IP_ADDR_HEADER) {
-				if (!rspamd_parse_inet_address (&task->from_addr, hv->str, hv->len)) {
-					msg_err_task ("bad ip header: '%V'", hv);
-					return FALSE;
-				}
-				debug_task ("read IP header, value: %V", hv);
-				has_ip = TRUE;
-			}
-			else {
-				debug_task ("wrong header: %V", hn);
+		case RSPAMD_PROTOCOL_HDR_IP:
+			if (!rspamd_parse_inet_address (&task->from_addr, hv_tok->begin,
+					hv_tok->len)) {
+				msg_err_task ("bad ip header: '%T'", hv_tok);
+				return FALSE;
 			}
+			debug_task ("read IP header, value: %T", hv_tok);
+			has_ip = TRUE;
 			break;
-		case 'p':
-		case 'P':
-			IF_HEADER (PASS_HEADER) {
-				srch.begin = "all";
-				srch.len = 3;
-
-				if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-					task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
-					debug_task ("pass all filters");
-				}
+		case RSPAMD_PROTOCOL_HDR_PASS:
+			if (HEADER_VALUE_IS (hv_tok, "all")) {
+				task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+				debug_task ("pass all filters");
 			}
 			break;
-		case 's':
-		case 'S':
-			IF_HEADER (SUBJECT_HEADER) {
-				task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-			}
-			IF_HEADER (SETTINGS_ID_HEADER) {
-				guint64 h;
-				guint32 *hp;
-
-				h = XXH64 (hv_tok->begin, hv_tok->len, 0xdeadbabe);
-				hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
-				memcpy (hp, &h, sizeof (*hp));
-				rspamd_mempool_set_variable (task->task_pool, "settings_hash",
-						hp, NULL);
+		case RSPAMD_PROTOCOL_HDR_PROFILE:
+			if (HEADER_VALUE_IS (hv_tok, "yes")) {
+				task->flags |= RSPAMD_TASK_FLAG_PROFILE;
 			}
 			break;
-		case 'u':
-		case 'U':
-			IF_HEADER (USER_HEADER) {
-				/*
-				 * We must ignore User header in case of spamc, as SA has
-				 * different meaning of this header
-				 */
-				if (!RSPAMD_TASK_IS_SPAMC (task)) {
-					task->user = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-				}
+		case RSPAMD_PROTOCOL_HDR_SUBJECT:
+			task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			break;
+		case RSPAMD_PROTOCOL_HDR_SETTINGS_ID:
+			settings_hash = XXH64 (hv_tok->begin, hv_tok->len, 0xdeadbabe);
+			hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
+			memcpy (hp, &settings_hash, sizeof (*hp));
+			rspamd_mempool_set_variable (task->task_pool, "settings_hash",
+					hp, NULL);
+			break;
+		case RSPAMD_PROTOCOL_HDR_USER:
+			/*
+			 * We must ignore User header in case of spamc, as SA has
+			 * different meaning of this header
+			 */
+			if (!RSPAMD_TASK_IS_SPAMC (task)) {
+				task->user = rspamd_mempool_ftokdup (task->task_pool,
+						hv_tok);
 			}
-			IF_HEADER (URLS_HEADER) {
-				srch.begin = "extended";
-				srch.len = 8;
-
-				if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-					task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
-					debug_task ("extended urls information");
-				}
+			break;
+		case RSPAMD_PROTOCOL_HDR_URLS:
+			if (HEADER_VALUE_IS (hv_tok, "extended")) {
+				task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
+				debug_task ("extended urls information");
 			}
 			break;
-		case 'l':
-		case 'L':
-			IF_HEADER (NO_LOG_HEADER) {
-				srch.begin = "no";
-				srch.len = 2;
-
-				if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-					task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
-				}
+		case RSPAMD_PROTOCOL_HDR_NO_LOG:
+			if (HEADER_VALUE_IS (hv_tok, "no")) {
+				task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
 			}
 			break;
-		case 'm':
-		case 'M':
-			IF_HEADER (MLEN_HEADER) {
-				if (!rspamd_strtoul (hv_tok->begin,
-						hv_tok->len,
-						&task->message_len)) {
-					msg_err_task ("Invalid message length header: %V", hv);
-				}
-				else {
-					task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
-				}
+		case RSPAMD_PROTOCOL_HDR_MLEN:
+			if (!rspamd_strtoul (hv_tok->begin,
+					hv_tok->len,
+					&task->message_len)) {
+				msg_err_task ("Invalid message length header: %T", hv_tok);
+			}
+			else {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
 			}
 			break;
 		default:
-			debug_task ("unknown header: %V", hn);
+			debug_task ("unknown header: %T", hn_tok);
 			break;
 		}
 	}
@@ -825,14 +873,13 @@ static ucl_object_t *
 rspamd_metric_result_ucl (struct rspamd_task *task,
 	struct metric_result *mres)
 {
-	GHashTableIter hiter;
 	struct symbol *sym;
 	struct metric *m;
 	gboolean is_spam;
 	enum rspamd_metric_action action = METRIC_ACTION_NOACTION;
 	ucl_object_t *obj = NULL, *sobj;;
-	gpointer h, v;
 	const gchar *subject;
+	guint i;
 
 	m = mres->metric;
 	mres->action = rspamd_check_action_metric (task, mres);
@@ -859,11 +906,10 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 			"subject", 0, false);
 	}
 	/* Now handle symbols */
-	g_hash_table_iter_init (&hiter, mres->symbols);
-	while (g_hash_table_iter_next (&hiter, &h, &v)) {
-		sym = (struct symbol *)v;
+	for (i = 0; i < mres->symbols->len; i ++) {
+		sym = g_ptr_array_index (mres->symbols, i);
 		sobj = rspamd_metric_symbol_ucl (task, m, sym);
-		ucl_object_insert_key (obj, sobj, h, 0, false);
+		ucl_object_insert_key (obj, sobj, sym->name, 0, false);
 	}
 
 	return obj;
@@ -1002,6 +1048,64 @@ rspamd_protocol_write_ucl (struct rspamd_task *task)
 	return top;
 }
 
+static inline guint64
+rspamd_protocol_double_to_le (gdouble d)
+{
+	guint64 v;
+
+	memcpy (&v, &d, sizeof (v));
+
+	return GUINT64_TO_LE (v);
+}
+
+/*
+ * Writes action, score and names of symbols of the default metric directly to
+ * the reply body, so no ucl objects are built for such a reply
+ */
+static void
+rspamd_protocol_compact_output (struct rspamd_task *task,
+		rspamd_fstring_t **out)
+{
+	struct rspamd_protocol_compact_reply hdr;
+	struct metric_result *mres;
+	struct symbol *sym;
+	guint16 len;
+	gsize slen;
+	guint i;
+
+	memset (&hdr, 0, sizeof (hdr));
+	hdr.magic = GUINT32_TO_LE (RSPAMD_PROTOCOL_COMPACT_MAGIC);
+
+	if (RSPAMD_TASK_IS_SKIPPED (task)) {
+		hdr.flags |= GUINT32_TO_LE (RSPAMD_PROTOCOL_COMPACT_SKIPPED);
+	}
+
+	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres == NULL) {
+		hdr.action = GUINT32_TO_LE (METRIC_ACTION_NOACTION);
+		*out = rspamd_fstring_append (*out, (const gchar *)&hdr, sizeof (hdr));
+
+		return;
+	}
+
+	mres->action = rspamd_check_action_metric (task, mres);
+	hdr.action = GUINT32_TO_LE (mres->action);
+	hdr.score = rspamd_protocol_double_to_le (mres->score);
+	hdr.required_score = rspamd_protocol_double_to_le (
+			mres->actions_limits[METRIC_ACTION_REJECT]);
+	hdr.nsymbols = GUINT32_TO_LE (mres->symbols->len);
+	*out = rspamd_fstring_append (*out, (const gchar *)&hdr, sizeof (hdr));
+
+	for (i = 0; i < mres->symbols->len; i ++) {
+		sym = g_ptr_array_index (mres->symbols, i);
+		slen = MIN (strlen (sym->name), G_MAXUINT16);
+		len = GUINT16_TO_LE (slen);
+		*out = rspamd_fstring_append (*out, (const gchar *)&len, sizeof (len));
+		*out = rspamd_fstring_append (*out, sym->name, slen);
+	}
+}
+
 void
 rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	struct rspamd_task *task)
@@ -1010,8 +1114,16 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	GHashTableIter hiter;
 	const struct rspamd_re_cache_stat *restat;
 	gpointer h, v;
-	ucl_object_t *top = NULL;
-	gint action;
+	ucl_object_t *top = NULL, *prof;
+	struct rspamd_worker_metrics *wm;
+	gdouble real[RSPAMD_TASK_PROFILE_MAX], cpu[RSPAMD_TASK_PROFILE_MAX];
+	gdouble t1, c1;
+	gint action, i;
+
+	G_STATIC_ASSERT (RSPAMD_METRICS_STAGES == RSPAMD_TASK_PROFILE_MAX);
+
+	t1 = rspamd_get_ticks ();
+	c1 = rspamd_get_thread_ticks ();
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1021,7 +1133,32 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		rspamd_http_message_add_header (msg, hn->begin, hv->begin);
 	}
 
-	top = rspamd_protocol_write_ucl (task);
+	if (RSPAMD_TASK_IS_COMPACT (task) && msg->method < HTTP_SYMBOLS &&
+			!RSPAMD_TASK_IS_SPAMC (task)) {
+		/* Symbols are 32 bytes long in average */
+		metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		msg->body = rspamd_fstring_sized_new (
+				sizeof (struct rspamd_protocol_compact_reply) +
+				(metric_res ? metric_res->symbols->len * 32 : 0));
+		rspamd_protocol_compact_output (task, &msg->body);
+	}
+	else {
+		top = rspamd_protocol_write_ucl (task);
+	}
+
+	if (task->profile) {
+		/* Output is emitted after logging, so it is not accounted */
+		task->profile->reply += rspamd_get_ticks () - t1;
+		task->profile->reply_cpu += rspamd_get_thread_ticks () - c1;
+
+		if (top != NULL && (task->flags & RSPAMD_TASK_FLAG_PROFILE)) {
+			prof = rspamd_task_profile_ucl (task);
+
+			if (prof) {
+				ucl_object_insert_key (top, prof, "profile", 0, false);
+			}
+		}
+	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
 		rspamd_roll_history_update (task->worker->srv->history, task);
@@ -1044,23 +1181,26 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 				restat->bytes_scanned);
 	}
 
-	msg->body = rspamd_fstring_sized_new (1000);
+	if (top != NULL) {
+		msg->body = rspamd_fstring_sized_new (1000);
 
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &msg->body);
-	}
-	else {
-		if (RSPAMD_TASK_IS_SPAMC (task)) {
-			rspamd_ucl_tospamc_output (task, top, &msg->body);
+		if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &msg->body);
 		}
 		else {
-			rspamd_ucl_torspamc_output (task, top, &msg->body);
+			if (RSPAMD_TASK_IS_SPAMC (task)) {
+				rspamd_ucl_tospamc_output (task, top, &msg->body);
+			}
+			else {
+				rspamd_ucl_torspamc_output (task, top, &msg->body);
+			}
 		}
-	}
 
-	ucl_object_unref (top);
+		ucl_object_unref (top);
+	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
+		wm = task->worker->metrics;
 		/* Update stat for default metric */
 		metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 		if (metric_res != NULL) {
@@ -1072,6 +1212,23 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action],
 						1, __ATOMIC_RELEASE);
 #endif
+				if (wm) {
+					wm->actions[action] ++;
+				}
+			}
+		}
+
+		if (wm) {
+			/* Slot is written by this worker only */
+			wm->scans ++;
+			rspamd_metrics_observe (&wm->scan_time,
+					rspamd_get_ticks () - task->time_real);
+
+			if (rspamd_task_profile_get (task, real, cpu)) {
+				for (i = 0; i < RSPAMD_TASK_PROFILE_MAX; i ++) {
+					wm->stages_real_us[i] += real[i] * 1e6;
+					wm->stages_cpu_us[i] += cpu[i] * 1e6;
+				}
 			}
 		}
 
@@ -1085,18 +1242,100 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 }
 
+static guint32
+rspamd_protocol_log_settings_id (struct rspamd_task *task)
+{
+	guint32 *sid;
+
+	sid = rspamd_mempool_get_variable (task->task_pool, "settings_hash");
+
+	return sid ? *sid : 0;
+}
+
 static void
+rspamd_protocol_fill_log_results (struct rspamd_task *task,
+		struct metric_result *mres,
+		struct rspamd_protocol_log_symbol_result *results)
+{
+	struct symbol *sym;
+	guint i;
+
+	for (i = 0; i < mres->symbols->len; i ++) {
+		sym = g_ptr_array_index (mres->symbols, i);
+
+		if (sym->id >= 0) {
+			results[i].id = sym->id;
+			results[i].score = sym->score;
+		}
+		else {
+			results[i].id = -1;
+			results[i].score = 0.0;
+		}
+	}
+}
+
+static struct rspamd_protocol_log_task_record *
+rspamd_protocol_log_task_record (struct rspamd_task *task, gsize *psz)
+{
+	struct rspamd_protocol_log_task_record *rec;
+	struct metric_result *mres;
+	const guchar *addr;
+	guint nresults = 0, klen;
+	gsize sz;
+
+	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres) {
+		nresults = mres->symbols->len;
+	}
+
+	sz = sizeof (*rec) +
+			sizeof (struct rspamd_protocol_log_symbol_result) * nresults;
+	rec = g_slice_alloc0 (sz);
+	rec->magic = RSPAMD_PROTOCOL_LOG_TASK_MAGIC;
+	rec->nresults = nresults;
+	rec->settings_id = rspamd_protocol_log_settings_id (task);
+	rec->timestamp = rspamd_get_calendar_ticks ();
+	rec->time_real = (rspamd_get_ticks () - task->time_real) * 1000.0;
+	rec->time_virtual = (rspamd_get_virtual_ticks () - task->time_virtual) *
+			1000.0;
+	rec->msg_len = task->msg.len;
+
+	if (mres) {
+		rec->action = rspamd_check_action_metric (task, mres);
+		rec->score = mres->score;
+		rec->required_score = mres->actions_limits[METRIC_ACTION_REJECT];
+		rspamd_protocol_fill_log_results (task, mres, rec->results);
+	}
+	else {
+		rec->action = METRIC_ACTION_NOACTION;
+	}
+
+	if (task->from_addr) {
+		rec->af = rspamd_inet_address_get_af (task->from_addr);
+
+		if (rec->af == AF_INET || rec->af == AF_INET6) {
+			addr = rspamd_inet_address_get_radix_key (task->from_addr, &klen);
+			memcpy (rec->addr, addr, MIN (klen, sizeof (rec->addr)));
+		}
+		else {
+			rec->af = 0;
+		}
+	}
+
+	*psz = sz;
+
+	return rec;
+}
+
+void
 rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 		struct rspamd_task *task)
 {
 	struct rspamd_worker_log_pipe *lp;
 	struct rspamd_protocol_log_message_sum *ls;
+	struct rspamd_protocol_log_task_record *rec;
 	struct metric_result *mres;
-	GHashTableIter it;
-	gpointer k, v;
-	struct symbol *sym;
-	gint id, i;
-	guint32 *sid;
 	gsize sz;
 
 	LL_FOREACH (ctx->log_pipes, lp) {
@@ -1108,43 +1347,15 @@ rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 				if (mres) {
 					sz = sizeof (*ls) +
 							sizeof (struct rspamd_protocol_log_symbol_result) *
-							g_hash_table_size (mres->symbols);
+							mres->symbols->len;
 					ls = g_slice_alloc (sz);
 
 					/* Handle settings id */
-					sid = rspamd_mempool_get_variable (task->task_pool,
-							"settings_hash");
-
-					if (sid) {
-						ls->settings_id = *sid;
-					}
-					else {
-						ls->settings_id = 0;
-					}
-
+					ls->settings_id = rspamd_protocol_log_settings_id (task);
 					ls->score = mres->score;
 					ls->required_score = mres->actions_limits[METRIC_ACTION_REJECT];
-					ls->nresults = g_hash_table_size (mres->symbols);
-
-					g_hash_table_iter_init (&it, mres->symbols);
-					i = 0;
-
-					while (g_hash_table_iter_next (&it, &k, &v)) {
-						id = rspamd_symbols_cache_find_symbol (task->cfg->cache,
-								k);
-						sym = v;
-
-						if (id >= 0) {
-							ls->results[i].id = id;
-							ls->results[i].score = sym->score;
-						}
-						else {
-							ls->results[i].id = -1;
-							ls->results[i].score = 0.0;
-						}
-
-						i ++;
-					}
+					ls->nresults = mres->symbols->len;
+					rspamd_protocol_fill_log_results (task, mres, ls->results);
 				}
 				else {
 					sz = sizeof (*ls);
@@ -1160,6 +1371,16 @@ rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 
 				g_slice_free1 (sz, ls);
 				break;
+			case RSPAMD_LOG_PIPE_TASK:
+				rec = rspamd_protocol_log_task_record (task, &sz);
+
+				if (write (lp->fd, rec, sz) == -1) {
+					msg_info_task ("cannot write to log pipe: %s",
+							strerror (errno));
+				}
+
+				g_slice_free1 (sz, rec);
+				break;
 			default:
 				msg_err_task ("unknown log format %d", lp->type);
 				break;
@@ -1188,6 +1409,9 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 	if (RSPAMD_TASK_IS_SPAMC (task)) {
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
+	if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
 
 	msg->date = time (NULL);
 
@@ -1221,6 +1445,11 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		case CMD_SKIP:
 			rspamd_protocol_http_reply (msg, task);
 
+			if (RSPAMD_TASK_IS_COMPACT (task) && msg->method < HTTP_SYMBOLS &&
+					!RSPAMD_TASK_IS_SPAMC (task)) {
+				ctype = "application/octet-stream";
+			}
+
 			if (task->worker && task->worker->ctx) {
 				actx = task->worker->ctx;
 
@@ -1233,6 +1462,7 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 			msg->body = rspamd_fstring_new_init ("pong" CRLF, 6);
 			ctype = "text/plain";
 			break;
+		case CMD_CHECK_BATCH:
 		case CMD_OTHER:
 			msg_err_task ("BROKEN");
 			break;
@@ -11,6 +11,8 @@
 #include "http.h"
 #include "task.h"
 
+struct rspamd_worker_ctx;
+
 #define RSPAMD_BASE_ERROR 500
 #define RSPAMD_FILTER_ERROR RSPAMD_BASE_ERROR + 1
 #define RSPAMD_NETWORK_ERROR RSPAMD_BASE_ERROR + 2
@@ -30,6 +32,46 @@ struct rspamd_protocol_log_message_sum {
 	struct rspamd_protocol_log_symbol_result results[];
 };
 
+/*
+ * Binary task record written to log pipes of `RSPAMD_LOG_PIPE_TASK` type,
+ * it is followed by `nresults` symbol results (symbols are identified by
+ * their ids in the symbols cache). All numbers are in host byte order.
+ */
+#define RSPAMD_PROTOCOL_LOG_TASK_MAGIC 0x31544c52 /* "RLT1" */
+struct rspamd_protocol_log_task_record {
+	guint32 magic;
+	guint32 nresults;
+	guint32 settings_id;
+	guint32 action;
+	gdouble timestamp;                 /**< calendar time of the scan end		*/
+	gdouble score;
+	gdouble required_score;
+	gdouble time_real;                 /**< scan time in milliseconds			*/
+	gdouble time_virtual;              /**< CPU time in milliseconds			*/
+	guint32 msg_len;
+	guint16 af;                        /**< AF_INET, AF_INET6 or 0 if no IP		*/
+	guint16 unused;
+	guchar addr[16];
+	struct rspamd_protocol_log_symbol_result results[];
+};
+
+/*
+ * Compact reply that is written instead of JSON if `Compact: yes` header is
+ * passed: header is followed by `nsymbols` records, each of them is guint16
+ * length of symbol name and the name itself (without trailing zero). All
+ * numbers are little endian.
+ */
+#define RSPAMD_PROTOCOL_COMPACT_MAGIC 0x31435052 /* "RPC1" */
+struct rspamd_protocol_compact_reply {
+	guint32 magic;
+	guint32 action;
+	gdouble score;
+	gdouble required_score;
+	guint32 nsymbols;
+	guint32 flags;
+} __attribute__((packed));
+#define RSPAMD_PROTOCOL_COMPACT_SKIPPED (1u << 0)
+
 struct metric;
 
 /**
@@ -75,6 +117,14 @@ void rspamd_protocol_http_reply (struct rspamd_http_message *msg,
  */
 ucl_object_t * rspamd_protocol_write_ucl (struct rspamd_task *task);
 
+/**
+ * Write results of task to the log pipes of worker
+ * @param ctx worker context
+ * @param task task object
+ */
+void rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task);
+
 /**
  * Write reply for specified task command
  * @param task task object
@@ -17,6 +17,9 @@
 #include "rspamd.h"
 #include "proxy.h"
 #include "unix-std.h"
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#endif
 
 static void rspamd_proxy_backend_handler (gint fd, gshort what, gpointer data);
 static void rspamd_proxy_client_handler (gint fd, gshort what, gpointer data);
@@ -34,12 +37,53 @@ rspamd_proxy_close (rspamd_proxy_t *proxy)
 		close (proxy->cfd);
 		close (proxy->bfd);
 
+		if (proxy->use_splice) {
+			close (proxy->pipe[0]);
+			close (proxy->pipe[1]);
+		}
+
 		event_del (&proxy->client_ev);
 		event_del (&proxy->backend_ev);
 		proxy->closed = TRUE;
 	}
 }
 
+/*
+ * Reads a portion of data from fd, data is either stored in the exchange buffer
+ * or moved to the pipe
+ */
+static gssize
+rspamd_proxy_read (rspamd_proxy_t *proxy, gint fd)
+{
+#ifdef HAVE_SPLICE
+	if (proxy->use_splice) {
+		return splice (fd, NULL, proxy->pipe[1], NULL, proxy->bufsize,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+#endif
+
+	return read (fd, proxy->buf, proxy->bufsize);
+}
+
+/*
+ * Writes pending data to fd, as the proxy is half duplex, the pipe holds
+ * exactly read_len - buf_offset bytes
+ */
+static gssize
+rspamd_proxy_write (rspamd_proxy_t *proxy, gint fd)
+{
+#ifdef HAVE_SPLICE
+	if (proxy->use_splice) {
+		return splice (proxy->pipe[0], NULL, fd, NULL,
+				proxy->read_len - proxy->buf_offset,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+#endif
+
+	return write (fd, proxy->buf + proxy->buf_offset,
+			proxy->read_len - proxy->buf_offset);
+}
+
 static void
 rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 {
@@ -50,7 +94,7 @@ rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 	if (what == EV_READ) {
 		/* Got data from client */
 		event_del (&proxy->client_ev);
-		r = read (proxy->cfd, proxy->buf, proxy->bufsize);
+		r = rspamd_proxy_read (proxy, proxy->cfd);
 		if (r > 0) {
 			/* Write this buffer to backend */
 			proxy->read_len = r;
@@ -82,9 +126,7 @@ rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 	}
 	else if (what == EV_WRITE) {
 		/* Can write to client */
-		r = write (proxy->cfd,
-				proxy->buf + proxy->buf_offset,
-				proxy->read_len - proxy->buf_offset);
+		r = rspamd_proxy_write (proxy, proxy->cfd);
 		if (r > 0) {
 			/* We wrote something */
 			proxy->buf_offset += r;
@@ -107,7 +149,7 @@ rspamd_proxy_client_handler (gint fd, gshort what, gpointer data)
 			}
 			else {
 				/* Plan another write event */
-				event_add (&proxy->backend_ev, proxy->tv);
+				event_add (&proxy->client_ev, proxy->tv);
 			}
 		}
 		else {
@@ -145,14 +187,14 @@ rspamd_proxy_backend_handler (gint fd, gshort what, gpointer data)
 	if (what == EV_READ) {
 		/* Got data from backend */
 		event_del (&proxy->backend_ev);
-		r = read (proxy->bfd, proxy->buf, proxy->bufsize);
+		r = rspamd_proxy_read (proxy, proxy->bfd);
 		if (r > 0) {
 			/* Write this buffer to client */
 			proxy->read_len = r;
 			proxy->buf_offset = 0;
 			event_del (&proxy->client_ev);
 			event_set (&proxy->client_ev,
-				proxy->bfd,
+				proxy->cfd,
 				EV_WRITE,
 				rspamd_proxy_client_handler,
 				proxy);
@@ -177,9 +219,7 @@ rspamd_proxy_backend_handler (gint fd, gshort what, gpointer data)
 	}
 	else if (what == EV_WRITE) {
 		/* Can write to backend */
-		r = write (proxy->bfd,
-				proxy->buf + proxy->buf_offset,
-				proxy->read_len - proxy->buf_offset);
+		r = rspamd_proxy_write (proxy, proxy->bfd);
 		if (r > 0) {
 			/* We wrote something */
 			proxy->buf_offset += r;
@@ -258,7 +298,17 @@ rspamd_create_proxy (gint cfd,
 	new->pool = pool;
 	new->base = base;
 	new->bufsize = bufsize;
-	new->buf = rspamd_mempool_alloc (pool, bufsize);
+
+#ifdef HAVE_SPLICE
+	if (pipe2 (new->pipe, O_NONBLOCK | O_CLOEXEC) != -1) {
+		new->use_splice = TRUE;
+	}
+#endif
+
+	if (!new->use_splice) {
+		new->buf = rspamd_mempool_alloc (pool, bufsize);
+	}
+
 	new->err_cb = err_cb;
 	new->user_data = ud;
 	new->tv = tv;
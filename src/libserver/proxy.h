@@ -22,7 +22,8 @@
 
 /**
  * @file proxy.h
- * Direct asynchronous proxy implementation
+ * Direct asynchronous proxy implementation, where splice(2) is available data
+ * is relayed through a pipe without copying it to the user space
  */
 
 typedef struct rspamd_proxy_s {
@@ -40,6 +41,8 @@ typedef struct rspamd_proxy_s {
 	gint buf_offset;                        /**< offset to write */
 	gpointer user_data;                     /**< user's data for callbacks */
 	struct timeval *tv;                     /**< timeout for communications */
+	gint pipe[2];                           /**< pipe used for splicing */
+	gboolean use_splice;                    /**< relay data through the pipe */
 	gboolean closed;                        /**< whether descriptors are closed */
 } rspamd_proxy_t;
 
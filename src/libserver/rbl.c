@@ -0,0 +1,566 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rbl.h"
+#include "rspamd.h"
+#include "dns.h"
+#include "url.h"
+#include "libmime/filter.h"
+#include "libmime/message.h"
+#include "utlist.h"
+#include <rdns.h>
+
+/* Reversed IPv6 address is 32 nibbles with dots */
+#define RBL_REVERSED_ADDR_LEN 72
+
+struct rspamd_rbl_returncode {
+	const gchar *symbol;
+	guint32 code;
+};
+
+struct rspamd_rbl_rule {
+	rspamd_mempool_t *pool;
+	const gchar *name;
+	const gchar *suffix;
+	const gchar *symbol;
+	guint flags;
+	GArray *returncodes;
+	GArray *returnbits;
+};
+
+struct rspamd_rbl_engine {
+	rspamd_mempool_t *pool;
+	GPtrArray *rules;
+	radix_compressed_t **exclusions;
+	const gchar *dkim_symbol;
+};
+
+/* Single DNS name and all rules that have produced it */
+struct rspamd_rbl_request {
+	struct rspamd_task *task;
+	const gchar *name;
+	GPtrArray *rules;
+};
+
+/* Data of a task collected for all rules during a check */
+struct rspamd_rbl_check {
+	struct rspamd_rbl_engine *engine;
+	struct rspamd_task *task;
+	GHashTable *requests;
+	GPtrArray *received;
+};
+
+struct rspamd_rbl_engine *
+rspamd_rbl_engine_new (rspamd_mempool_t *pool,
+		radix_compressed_t **exclusions, const gchar *dkim_symbol)
+{
+	struct rspamd_rbl_engine *engine;
+
+	g_assert (pool != NULL);
+
+	engine = rspamd_mempool_alloc0 (pool, sizeof (*engine));
+	engine->pool = pool;
+	engine->exclusions = exclusions;
+	engine->rules = g_ptr_array_new ();
+	rspamd_mempool_add_destructor (pool, rspamd_ptr_array_free_hard,
+			engine->rules);
+
+	if (dkim_symbol) {
+		engine->dkim_symbol = rspamd_mempool_strdup (pool, dkim_symbol);
+	}
+
+	return engine;
+}
+
+struct rspamd_rbl_rule *
+rspamd_rbl_engine_add_rule (struct rspamd_rbl_engine *engine,
+		const gchar *name, const gchar *suffix, const gchar *symbol,
+		guint flags)
+{
+	struct rspamd_rbl_rule *rule;
+
+	g_assert (engine != NULL);
+	g_assert (name != NULL && suffix != NULL);
+
+	rule = rspamd_mempool_alloc0 (engine->pool, sizeof (*rule));
+	rule->pool = engine->pool;
+	rule->name = rspamd_mempool_strdup (engine->pool, name);
+	rule->suffix = rspamd_mempool_strdup (engine->pool, suffix);
+	rule->flags = flags;
+
+	if (symbol) {
+		rule->symbol = rspamd_mempool_strdup (engine->pool, symbol);
+	}
+
+	rule->returncodes = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_rbl_returncode));
+	rspamd_mempool_add_destructor (engine->pool, rspamd_array_free_hard,
+			rule->returncodes);
+	rule->returnbits = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_rbl_returncode));
+	rspamd_mempool_add_destructor (engine->pool, rspamd_array_free_hard,
+			rule->returnbits);
+
+	g_ptr_array_add (engine->rules, rule);
+
+	return rule;
+}
+
+gboolean
+rspamd_rbl_rule_add_returncode (struct rspamd_rbl_rule *rule,
+		const gchar *symbol, const gchar *code)
+{
+	struct rspamd_rbl_returncode rc;
+	struct in_addr ina;
+
+	g_assert (rule != NULL);
+
+	if (inet_pton (AF_INET, code, &ina) != 1) {
+		return FALSE;
+	}
+
+	rc.symbol = rspamd_mempool_strdup (rule->pool, symbol);
+	rc.code = ntohl (ina.s_addr);
+	g_array_append_val (rule->returncodes, rc);
+
+	return TRUE;
+}
+
+void
+rspamd_rbl_rule_add_returnbits (struct rspamd_rbl_rule *rule,
+		const gchar *symbol, guint32 mask)
+{
+	struct rspamd_rbl_returncode rc;
+
+	g_assert (rule != NULL);
+
+	rc.symbol = rspamd_mempool_strdup (rule->pool, symbol);
+	rc.code = mask;
+	g_array_append_val (rule->returnbits, rc);
+}
+
+static void
+rspamd_rbl_process_reply (struct rspamd_task *task,
+		struct rspamd_rbl_rule *rule, struct rdns_reply_entry *entries)
+{
+	struct rdns_reply_entry *elt;
+	struct rspamd_rbl_returncode *rc;
+	guint32 addr;
+	guint i;
+	gboolean found;
+
+	if (rule->returncodes->len == 0 && rule->returnbits->len == 0) {
+		if (rule->symbol) {
+			rspamd_task_insert_result (task, rule->symbol, 1.0, NULL);
+		}
+
+		return;
+	}
+
+	LL_FOREACH (entries, elt) {
+		if (elt->type != RDNS_REQUEST_A) {
+			continue;
+		}
+
+		addr = ntohl (elt->content.a.addr.s_addr);
+		found = FALSE;
+
+		for (i = 0; i < rule->returncodes->len; i ++) {
+			rc = &g_array_index (rule->returncodes,
+					struct rspamd_rbl_returncode, i);
+
+			if (rc->code == addr) {
+				rspamd_task_insert_result (task, rc->symbol, 1.0, NULL);
+				found = TRUE;
+				break;
+			}
+		}
+
+		for (i = 0; i < rule->returnbits->len; i ++) {
+			rc = &g_array_index (rule->returnbits,
+					struct rspamd_rbl_returncode, i);
+
+			if (rc->code & addr) {
+				rspamd_task_insert_result (task, rc->symbol, 1.0, NULL);
+				found = TRUE;
+			}
+		}
+
+		if (!found) {
+			if ((rule->flags & RSPAMD_RBL_FLAG_UNKNOWN) && rule->symbol) {
+				rspamd_task_insert_result (task, rule->symbol, 1.0, NULL);
+			}
+			else {
+				msg_err_task ("RBL %s returned unknown result: %s",
+						rule->suffix, inet_ntoa (elt->content.a.addr));
+			}
+		}
+	}
+}
+
+static void
+rspamd_rbl_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct rspamd_rbl_request *req = arg;
+	guint i;
+
+	if (reply->code != RDNS_RC_NOERROR) {
+		return;
+	}
+
+	/* Fan out the reply to every list that has produced this name */
+	for (i = 0; i < req->rules->len; i ++) {
+		rspamd_rbl_process_reply (req->task, g_ptr_array_index (req->rules, i),
+				reply->entries);
+	}
+}
+
+static void
+rspamd_rbl_add_name (struct rspamd_rbl_check *ck, struct rspamd_rbl_rule *rule,
+		const gchar *prefix, gsize prefixlen)
+{
+	struct rspamd_task *task = ck->task;
+	struct rspamd_rbl_request *req;
+	gchar *name;
+	gsize len;
+	guint i;
+
+	len = prefixlen + strlen (rule->suffix) + 2;
+	name = rspamd_mempool_alloc (task->task_pool, len);
+	rspamd_snprintf (name, len, "%*s.%s", (gint)prefixlen, prefix,
+			rule->suffix);
+
+	req = g_hash_table_lookup (ck->requests, name);
+
+	if (req == NULL) {
+		req = rspamd_mempool_alloc (task->task_pool, sizeof (*req));
+		req->task = task;
+		req->name = name;
+		req->rules = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_ptr_array_free_hard, req->rules);
+		g_hash_table_insert (ck->requests, name, req);
+		g_ptr_array_add (req->rules, rule);
+
+		msg_debug_task ("send RBL request %s", name);
+
+		if (!make_dns_request_task (task, rspamd_rbl_dns_callback, req,
+				RDNS_REQUEST_A, name)) {
+			/* Do not retry a failed name for other lists */
+			g_ptr_array_set_size (req->rules, 0);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < req->rules->len; i ++) {
+		if (g_ptr_array_index (req->rules, i) == rule) {
+			return;
+		}
+	}
+
+	if (req->rules->len > 0) {
+		msg_debug_task ("join pending RBL request %s", name);
+		g_ptr_array_add (req->rules, rule);
+	}
+}
+
+static void
+rspamd_rbl_add_addr (struct rspamd_rbl_check *ck, struct rspamd_rbl_rule *rule,
+		const rspamd_inet_addr_t *addr)
+{
+	gchar buf[RBL_REVERSED_ADDR_LEN], *p;
+	const guchar *key;
+	guint klen, i;
+	gint af;
+
+	af = rspamd_inet_address_get_af (addr);
+
+	if (!((af == AF_INET && (rule->flags & RSPAMD_RBL_FLAG_IPV4)) ||
+			(af == AF_INET6 && (rule->flags & RSPAMD_RBL_FLAG_IPV6)))) {
+		return;
+	}
+
+	key = rspamd_inet_address_get_radix_key (addr, &klen);
+	p = buf;
+
+	for (i = klen; i > 0; i --) {
+		if (af == AF_INET) {
+			p += rspamd_snprintf (p, buf + sizeof (buf) - p, "%d.",
+					(gint)key[i - 1]);
+		}
+		else {
+			p += rspamd_snprintf (p, buf + sizeof (buf) - p, "%xd.%xd.",
+					(gint)(key[i - 1] & 0xf), (gint)(key[i - 1] >> 4));
+		}
+	}
+
+	/* Skip the trailing dot */
+	rspamd_rbl_add_name (ck, rule, buf, p - buf - 1);
+}
+
+/* The same as `validate_dns` in rbl.lua */
+static gboolean
+rspamd_rbl_validate_dns (const gchar *str, gsize len)
+{
+	const gchar *p = str, *end = str + len, *label = str;
+
+	if (len == 0) {
+		return FALSE;
+	}
+
+	while (p <= end) {
+		if (p == end || *p == '.') {
+			if (p == label || p - label > 63 || *label == '-' ||
+					*(p - 1) == '-') {
+				return FALSE;
+			}
+
+			label = p + 1;
+		}
+		else if (!g_ascii_isalnum (*p) && *p != '-') {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_rbl_is_excluded (struct rspamd_rbl_engine *engine,
+		const rspamd_inet_addr_t *addr)
+{
+	if (engine->exclusions && *engine->exclusions) {
+		return radix_find_compressed_addr (*engine->exclusions, addr) !=
+				RADIX_NO_VALUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_rbl_addr_valid (const rspamd_inet_addr_t *addr)
+{
+	gint af;
+
+	if (addr == NULL) {
+		return FALSE;
+	}
+
+	af = rspamd_inet_address_get_af (addr);
+
+	return af == AF_INET || af == AF_INET6;
+}
+
+static void
+rspamd_rbl_check_received (struct rspamd_rbl_check *ck,
+		struct rspamd_rbl_rule *rule)
+{
+	struct rspamd_task *task = ck->task;
+	struct received_header *rh;
+	rspamd_inet_addr_t *addr;
+	guint i;
+
+	if (ck->received == NULL) {
+		/* Parse addresses once for all lists */
+		ck->received = g_ptr_array_new_with_free_func (
+				(GDestroyNotify)rspamd_inet_address_destroy);
+
+		for (i = 0; i < task->received->len; i ++) {
+			rh = rspamd_message_get_received (task, i);
+
+			if (rh->is_error || rh->real_ip == NULL) {
+				continue;
+			}
+
+			addr = NULL;
+
+			if (rspamd_parse_inet_address (&addr, rh->real_ip,
+					strlen (rh->real_ip))) {
+				g_ptr_array_add (ck->received, addr);
+			}
+		}
+	}
+
+	for (i = 0; i < ck->received->len; i ++) {
+		addr = g_ptr_array_index (ck->received, i);
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_EXCLUDE_PRIVATE) &&
+				rspamd_inet_address_is_local (addr)) {
+			continue;
+		}
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_EXCLUDE_LOCAL_IPS) &&
+				rspamd_rbl_is_excluded (ck->engine, addr)) {
+			continue;
+		}
+
+		rspamd_rbl_add_addr (ck, rule, addr);
+	}
+}
+
+static void
+rspamd_rbl_check_dkim (struct rspamd_rbl_check *ck,
+		struct rspamd_rbl_rule *rule)
+{
+	struct rspamd_task *task = ck->task;
+	struct metric_result *mres;
+	struct symbol *s;
+	rspamd_ftok_t tld;
+	const gchar *domain;
+	GList *cur;
+
+	if (ck->engine->dkim_symbol == NULL) {
+		return;
+	}
+
+	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres == NULL) {
+		return;
+	}
+
+	s = rspamd_metric_result_find_symbol (mres, ck->engine->dkim_symbol);
+
+	if (s == NULL) {
+		return;
+	}
+
+	for (cur = s->options; cur != NULL; cur = g_list_next (cur)) {
+		domain = cur->data;
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_DKIM_DOMAINONLY) &&
+				rspamd_url_find_tld (domain, strlen (domain), &tld)) {
+			rspamd_rbl_add_name (ck, rule, tld.begin, tld.len);
+		}
+		else {
+			rspamd_rbl_add_name (ck, rule, domain, strlen (domain));
+		}
+	}
+}
+
+static void
+rspamd_rbl_check_emails (struct rspamd_rbl_check *ck,
+		struct rspamd_rbl_rule *rule)
+{
+	struct rspamd_task *task = ck->task;
+	struct rspamd_url *url;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar *email;
+	gsize len;
+
+	g_hash_table_iter_init (&it, task->emails);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+
+		if (!rspamd_rbl_validate_dns (url->host, url->hostlen)) {
+			continue;
+		}
+
+		if (rule->flags & RSPAMD_RBL_FLAG_EMAILS_DOMAINONLY) {
+			rspamd_rbl_add_name (ck, rule, url->host, url->hostlen);
+		}
+		else if (rspamd_rbl_validate_dns (url->user, url->userlen)) {
+			len = url->userlen + url->hostlen + 2;
+			email = rspamd_mempool_alloc (task->task_pool, len);
+			rspamd_snprintf (email, len, "%*s.%*s",
+					(gint)url->userlen, url->user,
+					(gint)url->hostlen, url->host);
+			rspamd_rbl_add_name (ck, rule, email, len - 1);
+		}
+	}
+}
+
+void
+rspamd_rbl_engine_check (struct rspamd_rbl_engine *engine,
+		struct rspamd_task *task)
+{
+	struct rspamd_rbl_check ck;
+	struct rspamd_rbl_rule *rule;
+	rspamd_inet_addr_t *from;
+	gboolean from_valid;
+	guint i;
+
+	g_assert (engine != NULL);
+	g_assert (task != NULL);
+
+	memset (&ck, 0, sizeof (ck));
+	ck.engine = engine;
+	ck.task = task;
+	ck.requests = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+	from = task->from_addr;
+	from_valid = rspamd_rbl_addr_valid (from);
+
+	for (i = 0; i < engine->rules->len; i ++) {
+		rule = g_ptr_array_index (engine->rules, i);
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_EXCLUDE_USERS) &&
+				task->user != NULL) {
+			continue;
+		}
+
+		if (from_valid) {
+			if ((rule->flags & RSPAMD_RBL_FLAG_EXCLUDE_LOCAL) &&
+					rspamd_rbl_is_excluded (engine, from)) {
+				continue;
+			}
+
+			if ((rule->flags & RSPAMD_RBL_FLAG_EXCLUDE_PRIVATE) &&
+					rspamd_inet_address_is_local (from)) {
+				continue;
+			}
+		}
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_HELO) && task->helo &&
+				rspamd_rbl_validate_dns (task->helo, strlen (task->helo))) {
+			rspamd_rbl_add_name (&ck, rule, task->helo, strlen (task->helo));
+		}
+
+		if (rule->flags & RSPAMD_RBL_FLAG_DKIM) {
+			rspamd_rbl_check_dkim (&ck, rule);
+		}
+
+		if (rule->flags & RSPAMD_RBL_FLAG_EMAILS) {
+			rspamd_rbl_check_emails (&ck, rule);
+		}
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_RDNS) && task->hostname &&
+				*task->hostname != '[' &&
+				strcmp (task->hostname, "unknown") != 0) {
+			rspamd_rbl_add_name (&ck, rule, task->hostname,
+					strlen (task->hostname));
+		}
+
+		if ((rule->flags & RSPAMD_RBL_FLAG_FROM) && from_valid) {
+			rspamd_rbl_add_addr (&ck, rule, from);
+		}
+
+		if (rule->flags & RSPAMD_RBL_FLAG_RECEIVED) {
+			rspamd_rbl_check_received (&ck, rule);
+		}
+	}
+
+	/* Requests themselves are owned by the task pool */
+	g_hash_table_unref (ck.requests);
+
+	if (ck.received) {
+		g_ptr_array_free (ck.received, TRUE);
+	}
+}
@@ -0,0 +1,105 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_RBL_H_
+#define SRC_LIBSERVER_RBL_H_
+
+#include "config.h"
+#include "mem_pool.h"
+#include "radix.h"
+
+/**
+ * @file rbl.h
+ *
+ * Engine of DNS lists checks. It builds names for received hops, sender
+ * address, helo, rdns, DKIM domains and emails, queries each distinct name
+ * merely once per task for all lists that have produced it and maps replies
+ * to symbols by exact return codes or by bits of the returned address
+ */
+
+#define RSPAMD_RBL_FLAG_IPV4 (1u << 0)
+#define RSPAMD_RBL_FLAG_IPV6 (1u << 1)
+#define RSPAMD_RBL_FLAG_RECEIVED (1u << 2)
+#define RSPAMD_RBL_FLAG_FROM (1u << 3)
+#define RSPAMD_RBL_FLAG_RDNS (1u << 4)
+#define RSPAMD_RBL_FLAG_HELO (1u << 5)
+#define RSPAMD_RBL_FLAG_DKIM (1u << 6)
+#define RSPAMD_RBL_FLAG_DKIM_DOMAINONLY (1u << 7)
+#define RSPAMD_RBL_FLAG_EMAILS (1u << 8)
+#define RSPAMD_RBL_FLAG_EMAILS_DOMAINONLY (1u << 9)
+#define RSPAMD_RBL_FLAG_EXCLUDE_USERS (1u << 10)
+#define RSPAMD_RBL_FLAG_EXCLUDE_PRIVATE (1u << 11)
+#define RSPAMD_RBL_FLAG_EXCLUDE_LOCAL (1u << 12)
+#define RSPAMD_RBL_FLAG_EXCLUDE_LOCAL_IPS (1u << 13)
+#define RSPAMD_RBL_FLAG_UNKNOWN (1u << 14)
+
+struct rspamd_rbl_engine;
+struct rspamd_rbl_rule;
+struct rspamd_task;
+
+/**
+ * Create new engine
+ * @param pool pool used for all allocations of the engine
+ * @param exclusions optional pointer to radix of excluded addresses (the
+ * pointer is dereferenced on each check, so maps reloads are visible)
+ * @param dkim_symbol symbol whose options are DKIM domains
+ * @return new engine
+ */
+struct rspamd_rbl_engine *rspamd_rbl_engine_new (rspamd_mempool_t *pool,
+		radix_compressed_t **exclusions, const gchar *dkim_symbol);
+
+/**
+ * Add new list to the engine
+ * @param engine
+ * @param name name of the list used in logs
+ * @param suffix DNS zone of the list
+ * @param symbol symbol inserted for any reply (may be NULL)
+ * @param flags RSPAMD_RBL_FLAG_* flags
+ * @return new rule
+ */
+struct rspamd_rbl_rule *rspamd_rbl_engine_add_rule (
+		struct rspamd_rbl_engine *engine,
+		const gchar *name, const gchar *suffix, const gchar *symbol,
+		guint flags);
+
+/**
+ * Insert `symbol` when the list returns exactly `code`
+ * @param rule
+ * @param symbol
+ * @param code dotted IPv4 address
+ * @return FALSE if `code` is not an IPv4 address
+ */
+gboolean rspamd_rbl_rule_add_returncode (struct rspamd_rbl_rule *rule,
+		const gchar *symbol, const gchar *code);
+
+/**
+ * Insert `symbol` when the returned address has any of bits from `mask` set
+ * (the last octet of the address is the lowest byte of the mask)
+ * @param rule
+ * @param symbol
+ * @param mask
+ */
+void rspamd_rbl_rule_add_returnbits (struct rspamd_rbl_rule *rule,
+		const gchar *symbol, guint32 mask);
+
+/**
+ * Start checks of all lists for the task
+ * @param engine
+ * @param task
+ */
+void rspamd_rbl_engine_check (struct rspamd_rbl_engine *engine,
+		struct rspamd_task *task);
+
+#endif /* SRC_LIBSERVER_RBL_H_ */
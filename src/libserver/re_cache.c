@@ -23,8 +23,10 @@
 #include "libserver/cfg_file.h"
 #include "libutil/util.h"
 #include "libutil/regexp.h"
+#include "libutil/multipattern.h"
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
+#include "libutil/hs_shared.h"
 #include "unix-std.h"
 #include <signal.h>
 
@@ -59,23 +61,44 @@
 
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
-static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '2'},
+		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '2'},
+		rspamd_hs_magic_stream[] = {'r', 's', 'h', 's', 'r', 's', '1', '2'};
+/* Large inputs are fed to streaming databases by chunks of this size */
+#define RSPAMD_RE_STREAM_CHUNK (64 * 1024)
 #endif
 
+/*
+ * Cost accounting shared among all processes, updated without locking
+ */
+struct rspamd_re_cache_profile {
+	guint64 bytes;  /* Bytes scanned */
+	guint64 scans;  /* Number of scans (regexp checks for regexps) */
+	guint64 hits;   /* Number of tasks where regexp has matched */
+	gdouble time;   /* Time spent in seconds */
+};
+
 struct rspamd_re_class {
 	guint64 id;
 	enum rspamd_re_type type;
 	gpointer type_data;
 	gsize type_len;
+	gchar *group;
 	GHashTable *re;
+	gint *re_ids; /* Cache ids of regexps indexed by the position in class */
+	guint nre_ids;
+	struct rspamd_multipattern *lit_mp; /* Required literals of PCRE regexps */
+	GArray *lit_ids; /* Cache ids of regexps indexed by literal number */
+	struct rspamd_re_cache_profile *profile;
+	guint idx; /* Position among classes, assigned on init */
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	rspamd_cryptobox_hash_state_t *st;
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
-	hs_scratch_t *hs_scratch;
+	hs_database_t *hs_stream_db; /* The same regexps in streaming mode */
 	gint *hs_ids;
 	guint nhs;
+	gsize hs_db_maplen; /* Non zero if hs_db is shared mapping */
 #endif
 };
 
@@ -88,27 +111,45 @@ enum rspamd_re_cache_elt_match_type {
 struct rspamd_re_cache_elt {
 	rspamd_regexp_t *re;
 	enum rspamd_re_cache_elt_match_type match_type;
+	gboolean lit_filtered;
 };
 
 struct rspamd_re_cache {
 	GHashTable *re_classes;
 	GPtrArray *re;
+	struct rspamd_re_cache_profile *profile; /* Indexed by cache id */
 	ref_entry_t ref;
 	guint nre;
+	guint nclasses;
 	guint max_re_data;
+	gsize max_class_data; /* Budget of data scanned by a class per task */
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 #ifdef WITH_HYPERSCAN
 	gboolean hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	gboolean shared_hyperscan;
+	gsize stream_size; /* Inputs larger than this are scanned in streams */
 	hs_platform_info_t plt;
 #endif
 };
 
+/* Data scanned by regexps of a class */
+struct rspamd_re_class_input {
+	const guchar **scvec;
+	guint *lenvec;
+	guint cnt;
+	gboolean raw;
+	gboolean ready;
+};
+
 struct rspamd_re_runtime {
 	guchar *checked;
 	guchar *results;
+	guchar *lit_checked;
+	guchar *lit_found;
 	struct rspamd_re_cache *cache;
+	struct rspamd_re_class_input *inputs; /* Indexed by class idx and strong flag */
 	struct rspamd_re_cache_stat stat;
 };
 
@@ -121,7 +162,8 @@ rspamd_re_cache_quark (void)
 static guint64
 rspamd_re_cache_class_id (enum rspamd_re_type type,
 		gpointer type_data,
-		gsize datalen)
+		gsize datalen,
+		const gchar *group)
 {
 	XXH64_state_t st;
 
@@ -132,6 +174,11 @@ rspamd_re_cache_class_id (enum rspamd_re_type type,
 		XXH64_update (&st, type_data, datalen);
 	}
 
+	if (group != NULL) {
+		/* Ungrouped classes keep their old ids and thus hyperscan files */
+		XXH64_update (&st, group, strlen (group) + 1);
+	}
+
 	return XXH64_digest (&st);
 }
 
@@ -150,16 +197,29 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 		g_hash_table_iter_steal (&it);
 		g_hash_table_unref (re_class->re);
 #ifdef WITH_HYPERSCAN
-		if (re_class->hs_db) {
+		if (re_class->hs_db_maplen > 0) {
+			rspamd_hs_shared_unmap (re_class->hs_db, re_class->hs_db_maplen);
+		}
+		else if (re_class->hs_db) {
 			hs_free_database (re_class->hs_db);
 		}
-		if (re_class->hs_scratch) {
-			hs_free_scratch (re_class->hs_scratch);
+		if (re_class->hs_stream_db) {
+			hs_free_database (re_class->hs_stream_db);
 		}
 		if (re_class->hs_ids) {
 			g_free (re_class->hs_ids);
 		}
 #endif
+		g_free (re_class->group);
+		g_free (re_class->re_ids);
+
+		if (re_class->lit_mp) {
+			rspamd_multipattern_destroy (re_class->lit_mp);
+		}
+		if (re_class->lit_ids) {
+			g_array_free (re_class->lit_ids, TRUE);
+		}
+
 		g_slice_free1 (sizeof (*re_class), re_class);
 	}
 
@@ -206,9 +266,54 @@ rspamd_re_cache_is_hs_loaded (struct rspamd_re_cache *cache)
 #endif
 }
 
+gsize
+rspamd_re_cache_hyperscan_size (struct rspamd_re_cache *cache)
+{
+	gsize total = 0;
+#ifdef WITH_HYPERSCAN
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	size_t sz;
+
+	g_assert (cache != NULL);
+
+	if (!cache->hyperscan_loaded) {
+		return 0;
+	}
+
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->hs_db && hs_database_size (re_class->hs_db, &sz) ==
+				HS_SUCCESS) {
+			total += sz;
+		}
+
+		if (re_class->hs_stream_db && hs_database_size (re_class->hs_stream_db,
+				&sz) == HS_SUCCESS) {
+			total += sz;
+		}
+	}
+#endif
+
+	return total;
+}
+
 rspamd_regexp_t *
 rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 		enum rspamd_re_type type, gpointer type_data, gsize datalen)
+{
+	return rspamd_re_cache_add_group (cache, re, type, type_data, datalen,
+			NULL);
+}
+
+rspamd_regexp_t *
+rspamd_re_cache_add_group (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
+		enum rspamd_re_type type, gpointer type_data, gsize datalen,
+		const gchar *group)
 {
 	guint64 class_id;
 	struct rspamd_re_class *re_class;
@@ -218,7 +323,7 @@ rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 	g_assert (cache != NULL);
 	g_assert (re != NULL);
 
-	class_id = rspamd_re_cache_class_id (type, type_data, datalen);
+	class_id = rspamd_re_cache_class_id (type, type_data, datalen, group);
 	re_class = g_hash_table_lookup (cache->re_classes, &class_id);
 
 	if (re_class == NULL) {
@@ -226,6 +331,8 @@ rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 		re_class->id = class_id;
 		re_class->type_len = datalen;
 		re_class->type = type;
+		re_class->idx = G_MAXUINT;
+		re_class->group = g_strdup (group);
 		re_class->re = g_hash_table_new_full (rspamd_regexp_hash,
 				rspamd_regexp_equal, NULL, (GDestroyNotify)rspamd_regexp_unref);
 
@@ -298,6 +405,356 @@ rspamd_re_cache_replace (struct rspamd_re_cache *cache,
 	}
 }
 
+/*
+ * Skips arguments of an escape sequence, `p` points to the character after
+ * backslash, returns pointer to the last character of the sequence
+ */
+static const gchar *
+rspamd_re_cache_skip_escape (const gchar *p)
+{
+	const gchar *c;
+	gchar term = '\0';
+	guint i;
+
+	switch (*p) {
+	case 'x':
+	case 'o':
+	case 'p':
+	case 'P':
+	case 'N':
+	case 'k':
+	case 'g':
+		if (p[1] == '{') {
+			term = '}';
+		}
+		else if (p[1] == '<' && (*p == 'k' || *p == 'g')) {
+			term = '>';
+		}
+		else if (p[1] == '\'' && (*p == 'k' || *p == 'g')) {
+			term = '\'';
+		}
+
+		if (term != '\0') {
+			for (c = p + 2; *c != '\0' && *c != term; c ++);
+
+			return *c == '\0' ? c - 1 : c;
+		}
+
+		if (*p == 'x') {
+			/* Up to two hex digits */
+			for (i = 0; i < 2 && g_ascii_isxdigit (p[1]); i ++) {
+				p ++;
+			}
+		}
+		else if (*p == 'p' || *p == 'P') {
+			/* Single letter property */
+			if (p[1] != '\0') {
+				p ++;
+			}
+		}
+		else if (*p == 'g') {
+			/* Relative or absolute group number */
+			if (p[1] == '-' || p[1] == '+') {
+				p ++;
+			}
+
+			while (g_ascii_isdigit (p[1])) {
+				p ++;
+			}
+		}
+		break;
+	case 'c':
+		/* Control character */
+		if (p[1] != '\0') {
+			p ++;
+		}
+		break;
+	case '0':
+		/* Up to two more octal digits */
+		for (i = 0; i < 2 && p[1] >= '0' && p[1] <= '7'; i ++) {
+			p ++;
+		}
+		break;
+	default:
+		if (g_ascii_isdigit (*p)) {
+			/* Backreference or octal code */
+			while (g_ascii_isdigit (p[1])) {
+				p ++;
+			}
+		}
+		break;
+	}
+
+	return p;
+}
+
+/*
+ * Extract the longest literal that must occur in any text matched by the
+ * pattern, returns NULL if there is no such literal. We are merely
+ * conservative here: groups, classes and escapes just break literals
+ */
+static gchar *
+rspamd_re_cache_extract_literal (rspamd_regexp_t *re, gsize *len)
+{
+	const gchar *p, *c;
+	GString *cur, *best;
+	gchar *res = NULL;
+	gint depth = 0;
+	gboolean in_class = FALSE, utf_icase = FALSE;
+	const guint min_len = 3;
+	guint pcre_flags;
+
+	pcre_flags = rspamd_regexp_get_pcre_flags (re);
+
+	if (pcre_flags & PCRE_FLAG(EXTENDED)) {
+		return NULL;
+	}
+
+#ifndef WITH_PCRE2
+	utf_icase = (pcre_flags & PCRE_FLAG(UTF8)) &&
+			(pcre_flags & PCRE_FLAG(CASELESS));
+#else
+	utf_icase = (pcre_flags & PCRE_FLAG(UTF)) &&
+			(pcre_flags & PCRE_FLAG(CASELESS));
+#endif
+
+	p = rspamd_regexp_get_pattern (re);
+
+	if (utf_icase) {
+		/* Literals are matched with ascii case folding merely */
+		for (c = p; *c != '\0'; c ++) {
+			if (*c & 0x80) {
+				return NULL;
+			}
+		}
+	}
+
+	cur = g_string_sized_new (32);
+	best = g_string_sized_new (32);
+
+#define LIT_FLUSH() do { \
+	if (cur->len > best->len) { \
+		g_string_assign (best, cur->str); \
+	} \
+	g_string_truncate (cur, 0); \
+} while (0)
+
+	for (; *p != '\0'; p ++) {
+		if (in_class) {
+			if (*p == '\\' && p[1] != '\0') {
+				p ++;
+			}
+			else if (*p == ']') {
+				in_class = FALSE;
+			}
+
+			continue;
+		}
+
+		switch (*p) {
+		case '\\':
+			if (p[1] == '\0') {
+				goto end;
+			}
+
+			p ++;
+
+			if (*p == 'Q') {
+				/* Quoted sequences are not supported */
+				g_string_truncate (best, 0);
+				goto end;
+			}
+
+			if (g_ascii_isalnum (*p)) {
+				/*
+				 * Character types, anchors, backreferences and so on, their
+				 * arguments are not literal characters
+				 */
+				p = rspamd_re_cache_skip_escape (p);
+				LIT_FLUSH ();
+			}
+			else if (depth == 0) {
+				g_string_append_c (cur, *p);
+			}
+			break;
+		case '[':
+			LIT_FLUSH ();
+			in_class = TRUE;
+
+			/* Leading ']' is a part of class */
+			if (p[1] == '^') {
+				p ++;
+			}
+			if (p[1] == ']') {
+				p ++;
+			}
+			break;
+		case '(':
+			if (p[1] == '?') {
+				/* Options like (?x) change the meaning of the whole pattern */
+				for (c = p + 2; g_ascii_isalpha (*c) || *c == '-'; c ++) {
+					if (*c == 'x') {
+						g_string_truncate (best, 0);
+						goto end;
+					}
+				}
+			}
+
+			LIT_FLUSH ();
+			depth ++;
+			break;
+		case ')':
+			if (depth > 0) {
+				depth --;
+			}
+			LIT_FLUSH ();
+			break;
+		case '|':
+			if (depth == 0) {
+				/* No single required literal with alternation */
+				g_string_truncate (best, 0);
+				goto end;
+			}
+			break;
+		case '*':
+		case '?':
+		case '{':
+			if (*p == '{' && !g_ascii_isdigit (p[1])) {
+				/* Not a quantifier */
+				if (depth == 0) {
+					g_string_append_c (cur, *p);
+				}
+				break;
+			}
+
+			/* Previous character is optional */
+			if (cur->len > 0) {
+				g_string_truncate (cur, cur->len - 1);
+			}
+			LIT_FLUSH ();
+
+			if (*p == '{') {
+				/* Skip repetition counts */
+				while (p[1] != '\0' && p[1] != '}') {
+					p ++;
+				}
+
+				if (p[1] == '}') {
+					p ++;
+				}
+			}
+			break;
+		case '+':
+			/* Previous character is required but might be repeated */
+			LIT_FLUSH ();
+			break;
+		case '.':
+		case '^':
+		case '$':
+			LIT_FLUSH ();
+			break;
+		default:
+			if (utf_icase && (*p == 'k' || *p == 'K' || *p == 's' || *p == 'S')) {
+				/* These letters also match kelvin sign and long s in utf */
+				LIT_FLUSH ();
+			}
+			else if (depth == 0 && g_ascii_isprint (*p)) {
+				g_string_append_c (cur, *p);
+			}
+			else if (depth == 0) {
+				LIT_FLUSH ();
+			}
+			break;
+		}
+	}
+
+	LIT_FLUSH ();
+#undef LIT_FLUSH
+
+end:
+	if (best->len >= min_len) {
+		*len = best->len;
+		res = g_string_free (best, FALSE);
+	}
+	else {
+		g_string_free (best, TRUE);
+	}
+
+	g_string_free (cur, TRUE);
+
+	return res;
+}
+
+static void
+rspamd_re_cache_build_literals (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	struct rspamd_re_cache_elt *elt;
+	GError *err = NULL;
+	gchar *lit;
+	gsize len;
+	gint id;
+	guint i;
+
+	if (re_class->lit_mp) {
+		rspamd_multipattern_destroy (re_class->lit_mp);
+		g_array_set_size (re_class->lit_ids, 0);
+		re_class->lit_mp = NULL;
+	}
+
+	for (i = 0; i < re_class->nre_ids; i ++) {
+		id = re_class->re_ids[i];
+		elt = g_ptr_array_index (cache->re, id);
+		elt->lit_filtered = FALSE;
+
+		if (elt->match_type != RSPAMD_RE_CACHE_PCRE) {
+			continue;
+		}
+
+		lit = rspamd_re_cache_extract_literal (elt->re, &len);
+
+		if (lit == NULL) {
+			continue;
+		}
+
+		if (re_class->lit_mp == NULL) {
+			/* Case insensitive match is just less precise */
+			re_class->lit_mp = rspamd_multipattern_create (
+					RSPAMD_MULTIPATTERN_ICASE);
+
+			if (re_class->lit_ids == NULL) {
+				re_class->lit_ids = g_array_new (FALSE, FALSE, sizeof (gint));
+			}
+		}
+
+		msg_debug_re_cache ("use literal '%s' to prefilter regexp '%s'",
+				lit, rspamd_regexp_get_pattern (elt->re));
+		rspamd_multipattern_add_pattern_len (re_class->lit_mp, lit, len,
+				RSPAMD_MULTIPATTERN_DEFAULT);
+		g_array_append_val (re_class->lit_ids, id);
+		elt->lit_filtered = TRUE;
+		g_free (lit);
+	}
+
+	if (re_class->lit_mp) {
+		if (!rspamd_multipattern_compile (re_class->lit_mp, &err)) {
+			msg_warn_re_cache ("cannot compile literals for class %s: %e",
+					re_class->hash, err);
+			g_error_free (err);
+			rspamd_multipattern_destroy (re_class->lit_mp);
+			re_class->lit_mp = NULL;
+
+			for (i = 0; i < re_class->lit_ids->len; i ++) {
+				id = g_array_index (re_class->lit_ids, gint, i);
+				elt = g_ptr_array_index (cache->re, id);
+				elt->lit_filtered = FALSE;
+			}
+
+			g_array_set_size (re_class->lit_ids, 0);
+		}
+	}
+}
+
 static gint
 rspamd_re_cache_sort_func (gconstpointer a, gconstpointer b)
 {
@@ -335,8 +792,14 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		if (re_class->st == NULL) {
 			re_class->st = g_slice_alloc (sizeof (*re_class->st));
 			rspamd_cryptobox_hash_init (re_class->st, NULL, 0);
+			g_free (re_class->re_ids);
+			re_class->re_ids = g_malloc (sizeof (*re_class->re_ids) *
+					g_hash_table_size (re_class->re));
+			re_class->nre_ids = 0;
 		}
 
+		re_class->re_ids[re_class->nre_ids++] = i;
+
 		/* Update hashes */
 		rspamd_cryptobox_hash_update (re_class->st, (gpointer) &re_class->id,
 				sizeof (re_class->id));
@@ -375,27 +838,35 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 		if (re_class->st) {
 			/*
-			 * We finally update all classes with the number of expressions
-			 * in the cache to ensure that if even a single re has been changed
-			 * we won't be broken due to id mismatch
+			 * Hyperscan files store positions of regexps in their class, so
+			 * the hash of a class depends merely on its own regexps and
+			 * classes that have not been changed need no recompilation
 			 */
-			rspamd_cryptobox_hash_update (re_class->st,
-					(gpointer)&cache->re->len,
-					sizeof (cache->re->len));
 			rspamd_cryptobox_hash_final (re_class->st, hash_out);
 			rspamd_snprintf (re_class->hash, sizeof (re_class->hash), "%*xs",
 					(gint) rspamd_cryptobox_HASHBYTES, hash_out);
 			g_slice_free1 (sizeof (*re_class->st), re_class->st);
 			re_class->st = NULL;
 		}
+
+		re_class->profile = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+				sizeof (*re_class->profile));
+		re_class->idx = cache->nclasses ++;
 	}
 
+	/* Workers are forked after init, so they share these counters */
+	cache->profile = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->profile) * MAX (cache->re->len, 1));
+	cache->max_class_data = cfg->max_re_class_data;
+
 #ifdef WITH_HYPERSCAN
 	const gchar *platform = "generic";
 	rspamd_fstring_t *features = rspamd_fstring_new ();
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
 	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->shared_hyperscan = cfg->shared_hyperscan;
+	cache->stream_size = cfg->hs_stream_size;
 
 	g_assert (hs_populate_platform (&cache->plt) == HS_SUCCESS);
 
@@ -427,6 +898,21 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 			platform, features);
 
 	rspamd_fstring_free (features);
+
+	if (cache->disable_hyperscan) {
+		/* Otherwise literals are built when hyperscan is loaded */
+		g_hash_table_iter_init (&it, cache->re_classes);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			rspamd_re_cache_build_literals (cache, v);
+		}
+	}
+#else
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_re_cache_build_literals (cache, v);
+	}
 #endif
 }
 
@@ -441,8 +927,14 @@ rspamd_re_cache_runtime_new (struct rspamd_re_cache *cache)
 	REF_RETAIN (cache);
 	rt->checked = g_slice_alloc0 (NBYTES (cache->nre));
 	rt->results = g_slice_alloc0 (cache->nre);
+	rt->lit_checked = g_slice_alloc0 (NBYTES (cache->nre));
+	rt->lit_found = g_slice_alloc0 (NBYTES (cache->nre));
 	rt->stat.regexp_total = cache->nre;
 
+	if (cache->nclasses > 0) {
+		rt->inputs = g_malloc0 (sizeof (*rt->inputs) * cache->nclasses * 2);
+	}
+
 	return rt;
 }
 
@@ -508,6 +1000,11 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 
 		t2 = rspamd_get_ticks ();
 
+		if (rt->cache->profile) {
+			rt->cache->profile[id].bytes += len;
+			rt->cache->profile[id].time += t2 - t1;
+		}
+
 		if (t2 - t1 > slow_time) {
 			msg_info_pool ("regexp '%16s' took %.2f seconds to execute",
 					rspamd_regexp_get_pattern (re), t2 - t1);
@@ -520,6 +1017,7 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 #ifdef WITH_HYPERSCAN
 struct rspamd_re_hyperscan_cbdata {
 	struct rspamd_re_runtime *rt;
+	struct rspamd_re_class *re_class;
 	const guchar **ins;
 	const guint *lens;
 	guint count;
@@ -540,6 +1038,8 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 	guint ret, maxhits, i, processed;
 
 	rt = cbdata->rt;
+	/* Hyperscan ids are positions in the class */
+	id = cbdata->re_class->re_ids[id];
 	pcre_elt = g_ptr_array_index (rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits (pcre_elt->re);
 
@@ -578,85 +1078,221 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 
 	return 0;
 }
-#endif
 
-static guint
-rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re, rspamd_mempool_t *pool,
-		const guchar **in, guint *lens,
-		guint count,
-		gboolean is_raw)
+/*
+ * Feeds input to the streaming database by chunks, matches at the end of
+ * data are reported when stream is closed
+ */
+static gboolean
+rspamd_re_cache_scan_stream (struct rspamd_re_class *re_class,
+		const guchar *in, guint len, hs_scratch_t *scr,
+		struct rspamd_re_hyperscan_cbdata *cbdata)
 {
+	hs_stream_t *stream;
+	guint off, chunk;
+	gboolean ret = TRUE;
 
-	guint64 re_id;
-	guint ret = 0;
-	guint i;
+	if (hs_open_stream (re_class->hs_stream_db, 0, &stream) != HS_SUCCESS) {
+		return FALSE;
+	}
 
-	re_id = rspamd_regexp_get_cache_id (re);
+	for (off = 0; off < len; off += chunk) {
+		chunk = MIN (len - off, RSPAMD_RE_STREAM_CHUNK);
 
-	if (count == 0 || in == NULL) {
-		/* We assume this as absence of the specified data */
-		setbit (rt->checked, re_id);
-		rt->results[re_id] = ret;
-		return ret;
+		if (hs_scan_stream (stream, (const char *)in + off, chunk, 0, scr,
+				rspamd_re_cache_hyperscan_cb, cbdata) != HS_SUCCESS) {
+			ret = FALSE;
+			break;
+		}
 	}
 
-#ifndef WITH_HYPERSCAN
-	for (i = 0; i < count; i++) {
-		ret = rspamd_re_cache_process_pcre (rt,
-				re,
-				pool,
-				in[i],
-				lens[i],
-				is_raw);
-		rt->results[re_id] = ret;
+	if (hs_close_stream (stream, scr, rspamd_re_cache_hyperscan_cb,
+			cbdata) != HS_SUCCESS) {
+		ret = FALSE;
 	}
 
-	setbit (rt->checked, re_id);
-#else
-	struct rspamd_re_cache_elt *elt;
+	return ret;
+}
+#endif
+
+struct rspamd_re_literal_cbdata {
+	struct rspamd_re_runtime *rt;
 	struct rspamd_re_class *re_class;
-	struct rspamd_re_hyperscan_cbdata cbdata;
+};
 
-	elt = g_ptr_array_index (rt->cache->re, re_id);
-	re_class = rspamd_regexp_get_class (re);
+static gint
+rspamd_re_cache_literal_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct rspamd_re_literal_cbdata *cbdata = context;
 
-	if (rt->cache->disable_hyperscan || elt->match_type == RSPAMD_RE_CACHE_PCRE) {
-		for (i = 0; i < count; i++) {
-			ret = rspamd_re_cache_process_pcre (rt,
-					re,
-					pool,
-					in[i],
-					lens[i],
-					is_raw);
-			rt->results[re_id] = ret;
-		}
+	setbit (cbdata->rt->lit_found,
+			g_array_index (cbdata->re_class->lit_ids, gint, strnum));
 
-		setbit (rt->checked, re_id);
-	}
-	else {
+	return 0;
+}
+
+/*
+ * Returns FALSE if the regexp cannot match any of inputs as its required
+ * literal is absent. Literals of all PCRE regexps in a class are searched
+ * in a single pass
+ */
+static gboolean
+rspamd_re_cache_check_literals (struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		const guchar **in, guint *lens,
+		guint count)
+{
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_literal_cbdata cbdata;
+	guint64 re_id;
+	gsize len;
+	guint i;
+
+	re_id = rspamd_regexp_get_cache_id (re);
+	elt = g_ptr_array_index (rt->cache->re, re_id);
+
+	if (!elt->lit_filtered) {
+		return TRUE;
+	}
+
+	if (!isset (rt->lit_checked, re_id)) {
+		cbdata.rt = rt;
+		cbdata.re_class = rspamd_regexp_get_class (re);
+
+		for (i = 0; i < count; i ++) {
+			if (in[i] == NULL) {
+				continue;
+			}
+
+			len = lens[i] > 0 ? lens[i] : strlen ((const gchar *)in[i]);
+
+			if (len > 0) {
+				rspamd_multipattern_lookup (cbdata.re_class->lit_mp,
+						(const gchar *)in[i], len,
+						rspamd_re_cache_literal_cb, &cbdata, NULL);
+			}
+		}
+
+		for (i = 0; i < cbdata.re_class->lit_ids->len; i ++) {
+			setbit (rt->lit_checked,
+					g_array_index (cbdata.re_class->lit_ids, gint, i));
+		}
+	}
+
+	return isset (rt->lit_found, re_id);
+}
+
+static guint
+rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re, rspamd_mempool_t *pool,
+		const guchar **in, guint *lens,
+		guint count,
+		gboolean is_raw,
+		gboolean is_strong)
+{
+
+	guint64 re_id;
+	guint ret = 0;
+	guint i;
+
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	if (count == 0 || in == NULL) {
+		/* We assume this as absence of the specified data */
+		setbit (rt->checked, re_id);
+		rt->results[re_id] = ret;
+		return ret;
+	}
+
+	/*
+	 * Strong headers lookup selects a subset of the class inputs, so
+	 * the shared literals pass is not valid for it
+	 */
+	if (!is_strong && !rspamd_re_cache_check_literals (rt, re, in, lens,
+			count)) {
+		setbit (rt->checked, re_id);
+		return rt->results[re_id];
+	}
+
+#ifndef WITH_HYPERSCAN
+	for (i = 0; i < count; i++) {
+		ret = rspamd_re_cache_process_pcre (rt,
+				re,
+				pool,
+				in[i],
+				lens[i],
+				is_raw);
+		rt->results[re_id] = ret;
+	}
+
+	setbit (rt->checked, re_id);
+#else
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_hyperscan_cbdata cbdata;
+	hs_scratch_t *scr;
+	gdouble t1;
+	gsize nbytes = 0;
+	guint gen;
+
+	elt = g_ptr_array_index (rt->cache->re, re_id);
+	re_class = rspamd_regexp_get_class (re);
+
+	if (rt->cache->disable_hyperscan || elt->match_type == RSPAMD_RE_CACHE_PCRE) {
+		for (i = 0; i < count; i++) {
+			ret = rspamd_re_cache_process_pcre (rt,
+					re,
+					pool,
+					in[i],
+					lens[i],
+					is_raw);
+			rt->results[re_id] = ret;
+		}
+
+		setbit (rt->checked, re_id);
+	}
+	else {
 		for (i = 0; i < count; i ++) {
 			if (rt->cache->max_re_data > 0 && lens[i] > rt->cache->max_re_data) {
 				lens[i] = rt->cache->max_re_data;
 			}
 			rt->stat.bytes_scanned += lens[i];
+			nbytes += lens[i];
 		}
 
-		g_assert (re_class->hs_scratch != NULL);
 		g_assert (re_class->hs_db != NULL);
+		scr = rspamd_hs_scratch_acquire (&gen);
+		g_assert (scr != NULL);
+		t1 = rspamd_get_ticks ();
 
 		/* Go through hyperscan API */
 		if (!rt->cache->vectorized_hyperscan) {
 			for (i = 0; i < count; i++) {
 				cbdata.ins = &in[i];
 				cbdata.re = re;
+				cbdata.re_class = re_class;
 				cbdata.rt = rt;
 				cbdata.lens = &lens[i];
 				cbdata.count = 1;
 				cbdata.pool = pool;
 
-				if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
-						re_class->hs_scratch,
+				if (re_class->hs_stream_db && lens[i] > rt->cache->stream_size) {
+					if (!rspamd_re_cache_scan_stream (re_class, in[i], lens[i],
+							scr, &cbdata)) {
+						ret = 0;
+					}
+					else {
+						ret = rt->results[re_id];
+					}
+				}
+				else if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
+						scr,
 						rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
 					ret = 0;
 				}
@@ -668,13 +1304,14 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 		else {
 			cbdata.ins = in;
 			cbdata.re = re;
+			cbdata.re_class = re_class;
 			cbdata.rt = rt;
 			cbdata.lens = lens;
 			cbdata.count = 1;
 			cbdata.pool = pool;
 
 			if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
-					re_class->hs_scratch,
+					scr,
 					rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
 				ret = 0;
 			}
@@ -682,6 +1319,15 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 				ret = rt->results[re_id];
 			}
 		}
+
+		rspamd_hs_scratch_release (scr, gen);
+
+		/* Includes PCRE checks of prefiltered regexps */
+		if (re_class->profile) {
+			re_class->profile->scans ++;
+			re_class->profile->bytes += nbytes;
+			re_class->profile->time += rspamd_get_ticks () - t1;
+		}
 	}
 #endif
 
@@ -709,35 +1355,120 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 #endif
 }
 
+static void
+rspamd_re_cache_input_alloc (struct rspamd_re_class_input *input, guint cnt)
+{
+	input->scvec = g_malloc (sizeof (*input->scvec) * cnt);
+	input->lenvec = g_malloc (sizeof (*input->lenvec) * cnt);
+	input->cnt = cnt;
+}
+
+static void
+rspamd_re_cache_input_headers (struct rspamd_re_class_input *input,
+		GPtrArray *headerlist, gboolean raw)
+{
+	struct raw_header *rh;
+	const gchar *in, *end;
+	guint i;
+
+	rspamd_re_cache_input_alloc (input, headerlist->len);
+
+	for (i = 0; i < headerlist->len; i ++) {
+		rh = g_ptr_array_index (headerlist, i);
+
+		if (raw) {
+			in = rh->value;
+			input->raw = TRUE;
+			input->lenvec[i] = strlen (rh->value);
+		}
+		else {
+			in = rh->decoded;
+			/* Validate input */
+			if (!in || !g_utf8_validate (in, -1, &end)) {
+				input->lenvec[i] = 0;
+				input->scvec[i] = (guchar *)"";
+				continue;
+			}
+			input->lenvec[i] = end - in;
+		}
+
+		input->scvec[i] = (guchar *)in;
+	}
+}
+
 /*
- * Calculates the specified regexp for the specified class if it's not calculated
+ * Truncates inputs of a class so their total size fits `max_class_data`,
+ * the first inputs are preferred as they are usually the most relevant ones
  */
-static guint
-rspamd_re_cache_exec_re (struct rspamd_task *task,
+static void
+rspamd_re_cache_input_limit (struct rspamd_task *task,
+		struct rspamd_re_cache *cache,
+		struct rspamd_re_class_input *input)
+{
+	gsize remain = cache->max_class_data;
+	guint i;
+	gboolean limited = FALSE;
+
+	if (remain == 0) {
+		return;
+	}
+
+	for (i = 0; i < input->cnt; i ++) {
+		if (input->lenvec[i] > remain) {
+			input->lenvec[i] = remain;
+			limited = TRUE;
+		}
+
+		remain -= input->lenvec[i];
+	}
+
+	if (limited) {
+		rspamd_task_set_limited (task, RSPAMD_TASK_LIMIT_REGEXP);
+	}
+}
+
+/*
+ * Collects data scanned by regexps of a class, it is done once per task, so
+ * regexps of a class that are checked by PCRE share headers lookup and
+ * validation
+ */
+static struct rspamd_re_class_input *
+rspamd_re_cache_get_input (struct rspamd_task *task,
 		struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re,
 		struct rspamd_re_class *re_class,
-		gboolean is_strong)
+		gboolean is_strong,
+		struct rspamd_re_class_input *tmp)
 {
-	guint ret = 0, i, re_id;
+	struct rspamd_re_class_input *input;
 	GPtrArray *headerlist;
 	GList *slist;
 	GHashTableIter it;
 	struct raw_header *rh;
-	const gchar *in, *end;
-	const guchar **scvec;
-	guint *lenvec;
-	gboolean raw = FALSE;
 	struct mime_text_part *part;
 	struct rspamd_url *url;
-	struct rspamd_re_cache *cache = rt->cache;
 	gpointer k, v;
-	guint len, cnt;
+	guint i, cnt;
 
-	msg_debug_re_cache ("get to the slow path for re type: %s: %s",
-			rspamd_re_cache_type_to_string (re_class->type),
-			rspamd_regexp_get_pattern (re));
-	re_id = rspamd_regexp_get_cache_id (re);
+	if (re_class->type != RSPAMD_RE_HEADER &&
+			re_class->type != RSPAMD_RE_RAWHEADER &&
+			re_class->type != RSPAMD_RE_MIMEHEADER) {
+		is_strong = FALSE;
+	}
+
+	if (rt->inputs != NULL && re_class->idx < rt->cache->nclasses) {
+		input = &rt->inputs[re_class->idx * 2 + (is_strong ? 1 : 0)];
+
+		if (input->ready) {
+			return input;
+		}
+	}
+	else {
+		/* Class has been added after the runtime creation */
+		input = tmp;
+	}
+
+	memset (input, 0, sizeof (*input));
+	input->ready = TRUE;
 
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
@@ -748,48 +1479,15 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				is_strong);
 
 		if (headerlist) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task->task_pool, scvec, lenvec, headerlist->len, raw);
-			debug_task ("checking header %s regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			rspamd_re_cache_input_headers (input, headerlist,
+					re_class->type == RSPAMD_RE_RAWHEADER);
 		}
 		break;
 	case RSPAMD_RE_ALLHEADER:
-		raw = TRUE;
-		in = task->raw_headers_content.begin;
-		len = task->raw_headers_content.len;
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task->task_pool, (const guchar **)&in, &len, 1, raw);
-		debug_task ("checking allheader regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		rspamd_re_cache_input_alloc (input, 1);
+		input->raw = TRUE;
+		input->scvec[0] = (const guchar *)task->raw_headers_content.begin;
+		input->lenvec[0] = task->raw_headers_content.len;
 		break;
 	case RSPAMD_RE_MIMEHEADER:
 		headerlist = rspamd_message_get_mime_header_array (task,
@@ -797,135 +1495,72 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				is_strong);
 
 		if (headerlist) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task->task_pool, scvec, lenvec, headerlist->len, raw);
-			debug_task ("checking mime header %s regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			rspamd_re_cache_input_headers (input, headerlist, FALSE);
 		}
 		break;
 	case RSPAMD_RE_MIME:
 	case RSPAMD_RE_RAWMIME:
 		/* Iterate through text parts */
 		if (task->text_parts->len > 0) {
-			cnt = task->text_parts->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+			rspamd_re_cache_input_alloc (input, task->text_parts->len);
 
 			for (i = 0; i < task->text_parts->len; i++) {
 				part = g_ptr_array_index (task->text_parts, i);
 
 				/* Skip empty parts */
 				if (IS_PART_EMPTY (part)) {
-					lenvec[i] = 0;
-					scvec[i] = (guchar *) "";
+					input->lenvec[i] = 0;
+					input->scvec[i] = (guchar *) "";
 					continue;
 				}
 
 				/* Check raw flags */
 				if (!IS_PART_UTF (part)) {
-					raw = TRUE;
+					input->raw = TRUE;
 				}
 				/* Select data for regexp */
 				if (re_class->type == RSPAMD_RE_RAWMIME) {
-					in = part->orig->data;
-					len = part->orig->len;
-					raw = TRUE;
+					input->scvec[i] = part->orig->data;
+					input->lenvec[i] = part->orig->len;
+					input->raw = TRUE;
 				}
 				else {
-					in = part->content->data;
-					len = part->content->len;
+					input->scvec[i] = part->content->data;
+					input->lenvec[i] = part->content->len;
 				}
-
-				scvec[i] = (guchar *) in;
-				lenvec[i] = len;
 			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task->task_pool, scvec, lenvec, cnt, raw);
-			debug_task ("checking mime regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
 		}
 		break;
 	case RSPAMD_RE_URL:
 		cnt = g_hash_table_size (task->urls) + g_hash_table_size (task->emails);
 
 		if (cnt > 0) {
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+			rspamd_re_cache_input_alloc (input, cnt);
 			g_hash_table_iter_init (&it, task->urls);
 			i = 0;
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *)in;
-				lenvec[i++] = len;
+				input->scvec[i] = (guchar *)url->string;
+				input->lenvec[i++] = url->urllen;
 			}
 
 			g_hash_table_iter_init (&it, task->emails);
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *) in;
-				lenvec[i++] = len;
+				input->scvec[i] = (guchar *)url->string;
+				input->lenvec[i++] = url->urllen;
 			}
 
 			g_assert (i == cnt);
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task->task_pool, scvec, lenvec, i, raw);
-			debug_task ("checking url regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
 		}
 		break;
 	case RSPAMD_RE_BODY:
-		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re, task->task_pool,
-				(const guchar **)&in, &len, 1, raw);
-		debug_task ("checking rawbody regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		rspamd_re_cache_input_alloc (input, 1);
+		input->raw = TRUE;
+		input->scvec[0] = (const guchar *)task->msg.begin;
+		input->lenvec[0] = task->msg.len;
 		break;
 	case RSPAMD_RE_SABODY:
 		/* According to SA docs:
@@ -936,9 +1571,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * paragraph when running the rules. All HTML tags and line breaks will
 		 * be removed before matching.
 		 */
-		cnt = task->text_parts->len + 1;
-		scvec = g_malloc (sizeof (*scvec) * cnt);
-		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		rspamd_re_cache_input_alloc (input, task->text_parts->len + 1);
+		input->raw = TRUE;
 
 		/*
 		 * Body rules also include the Subject as the first line
@@ -950,32 +1584,25 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		if (slist) {
 			rh = slist->data;
 
-			scvec[0] = (guchar *)rh->decoded;
-			lenvec[0] = strlen (rh->decoded);
+			input->scvec[0] = (guchar *)rh->decoded;
+			input->lenvec[0] = strlen (rh->decoded);
 		}
 		else {
-			scvec[0] = (guchar *)"";
-			lenvec[0] = 0;
+			input->scvec[0] = (guchar *)"";
+			input->lenvec[0] = 0;
 		}
 		for (i = 0; i < task->text_parts->len; i++) {
 			part = g_ptr_array_index (task->text_parts, i);
 
 			if (part->stripped_content) {
-				scvec[i + 1] = (guchar *)part->stripped_content->data;
-				lenvec[i + 1] = part->stripped_content->len;
+				input->scvec[i + 1] = (guchar *)part->stripped_content->data;
+				input->lenvec[i + 1] = part->stripped_content->len;
 			}
 			else {
-				scvec[i + 1] = (guchar *)"";
-				lenvec[i + 1] = 0;
+				input->scvec[i + 1] = (guchar *)"";
+				input->lenvec[i + 1] = 0;
 			}
 		}
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task->task_pool, scvec, lenvec, cnt, TRUE);
-		debug_task ("checking sa body regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		g_free (scvec);
-		g_free (lenvec);
 		break;
 	case RSPAMD_RE_SARAWBODY:
 		/* According to SA docs:
@@ -986,35 +1613,83 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * broken by line breaks.
 		 */
 		if (task->text_parts->len > 0) {
-			cnt = task->text_parts->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+			rspamd_re_cache_input_alloc (input, task->text_parts->len);
+			input->raw = TRUE;
 
 			for (i = 0; i < task->text_parts->len; i++) {
 				part = g_ptr_array_index (task->text_parts, i);
 
 				if (part->orig) {
-					scvec[i] = (guchar *)part->orig->data;
-					lenvec[i] = part->orig->len;
+					input->scvec[i] = (guchar *)part->orig->data;
+					input->lenvec[i] = part->orig->len;
 				}
 				else {
-					scvec[i] = (guchar *)"";
-					lenvec[i] = 0;
+					input->scvec[i] = (guchar *)"";
+					input->lenvec[i] = 0;
 				}
 			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task->task_pool, scvec, lenvec, cnt, TRUE);
-			debug_task ("checking sa rawbody regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
 		}
 		break;
 	case RSPAMD_RE_MAX:
+		break;
+	}
+
+	rspamd_re_cache_input_limit (task, rt->cache, input);
+
+	return input;
+}
+
+static void
+rspamd_re_cache_input_free (struct rspamd_re_class_input *input)
+{
+	g_free (input->scvec);
+	g_free (input->lenvec);
+}
+
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static guint
+rspamd_re_cache_exec_re (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong)
+{
+	guint ret = 0, re_id;
+	struct rspamd_re_class_input *input, tmp;
+	struct rspamd_re_cache *cache = rt->cache;
+
+	msg_debug_re_cache ("get to the slow path for re type: %s: %s",
+			rspamd_re_cache_type_to_string (re_class->type),
+			rspamd_regexp_get_pattern (re));
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	if (re_class->type == RSPAMD_RE_MAX) {
 		msg_err_task ("regexp of class invalid has been called: %s",
 				rspamd_regexp_get_pattern (re));
-		break;
+	}
+	else {
+		input = rspamd_re_cache_get_input (task, rt, re_class, is_strong, &tmp);
+
+		/* No input means absence of the specified data */
+		if (input->cnt > 0) {
+			ret = rspamd_re_cache_process_regexp_data (rt, re,
+					task->task_pool, input->scvec, input->lenvec, input->cnt,
+					input->raw, (re_class->type == RSPAMD_RE_HEADER ||
+							re_class->type == RSPAMD_RE_RAWHEADER ||
+							re_class->type == RSPAMD_RE_MIMEHEADER) ?
+							is_strong : FALSE);
+		}
+
+		debug_task ("checking %s regexp %s: %s -> %d",
+				rspamd_re_cache_type_to_string (re_class->type),
+				re_class->type_data ? (const gchar *)re_class->type_data : "",
+				rspamd_regexp_get_pattern (re), ret);
+
+		if (input == &tmp) {
+			rspamd_re_cache_input_free (&tmp);
+		}
 	}
 
 #if WITH_HYPERSCAN
@@ -1076,26 +1751,240 @@ rspamd_re_cache_process (struct rspamd_task *task,
 	return 0;
 }
 
-void
-rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
+static void
+rspamd_re_cache_account_runtime (struct rspamd_re_runtime *rt)
 {
-	g_assert (rt != NULL);
+	struct rspamd_re_cache_profile *profile = rt->cache->profile;
+	guint i, j;
 
-	g_slice_free1 (NBYTES (rt->cache->nre), rt->checked);
-	g_slice_free1 (rt->cache->nre, rt->results);
-	REF_RELEASE (rt->cache);
-	g_slice_free1 (sizeof (*rt), rt);
+	if (profile == NULL) {
+		return;
+	}
+
+	for (i = 0; i < NBYTES (rt->cache->nre); i ++) {
+		if (rt->checked[i] == 0) {
+			continue;
+		}
+
+		for (j = i * NBBY; j < MIN ((i + 1) * NBBY, rt->cache->nre); j ++) {
+			if (isset (rt->checked, j)) {
+				profile[j].scans ++;
+
+				if (rt->results[j] > 0) {
+					profile[j].hits ++;
+				}
+			}
+		}
+	}
 }
 
-void
-rspamd_re_cache_unref (struct rspamd_re_cache *cache)
+static void
+rspamd_re_cache_profile_class_info (ucl_object_t *obj,
+		struct rspamd_re_class *re_class)
 {
-	if (cache) {
-		REF_RELEASE (cache);
+	ucl_object_insert_key (obj,
+			ucl_object_fromstring (
+					rspamd_re_cache_type_to_string (re_class->type)),
+			"type", 0, false);
+
+	if (re_class->type_len > 0) {
+		ucl_object_insert_key (obj,
+				ucl_object_fromlstring (re_class->type_data,
+						re_class->type_len - 1),
+				"header", 0, false);
+	}
+
+	if (re_class->group) {
+		ucl_object_insert_key (obj, ucl_object_fromstring (re_class->group),
+				"group", 0, false);
 	}
 }
 
-struct rspamd_re_cache *
+static gint
+rspamd_re_cache_profile_cmp (const void *a, const void *b, gpointer ud)
+{
+	const struct rspamd_re_cache_profile *p1 = a, *p2 = b;
+
+	if (p1->time > p2->time) {
+		return -1;
+	}
+	else if (p1->time < p2->time) {
+		return 1;
+	}
+
+	if (p1->scans > p2->scans) {
+		return -1;
+	}
+	else if (p1->scans < p2->scans) {
+		return 1;
+	}
+
+	return 0;
+}
+
+struct rspamd_re_cache_profile_elt {
+	struct rspamd_re_cache_profile p;
+	gpointer data;
+};
+
+ucl_object_t *
+rspamd_re_cache_profile (struct rspamd_re_cache *cache)
+{
+	ucl_object_t *top, *classes, *regexps, *obj;
+	struct rspamd_re_cache_profile_elt *elts;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	GHashTableIter it;
+	gpointer k, v;
+	const gchar *engine;
+	guint i, n;
+
+	g_assert (cache != NULL);
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	classes = ucl_object_typed_new (UCL_ARRAY);
+	regexps = ucl_object_typed_new (UCL_ARRAY);
+
+	if (cache->profile == NULL) {
+		ucl_object_insert_key (top, classes, "classes", 0, false);
+		ucl_object_insert_key (top, regexps, "regexps", 0, false);
+
+		return top;
+	}
+
+	/* Classes sorted by time spent in hyperscan */
+	n = g_hash_table_size (cache->re_classes);
+	elts = g_malloc0 (sizeof (*elts) * MAX (n, 1));
+	g_hash_table_iter_init (&it, cache->re_classes);
+	i = 0;
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->profile) {
+			memcpy (&elts[i].p, re_class->profile, sizeof (elts[i].p));
+		}
+
+		elts[i ++].data = re_class;
+	}
+
+	g_qsort_with_data (elts, n, sizeof (*elts), rspamd_re_cache_profile_cmp,
+			NULL);
+
+	for (i = 0; i < n; i ++) {
+		re_class = elts[i].data;
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		rspamd_re_cache_profile_class_info (obj, re_class);
+		ucl_object_insert_key (obj, ucl_object_fromstring (re_class->hash),
+				"hash", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (re_class->nre_ids),
+				"regexps", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elts[i].p.scans),
+				"scans", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elts[i].p.bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (elts[i].p.time),
+				"time", 0, false);
+		ucl_array_append (classes, obj);
+	}
+
+	g_free (elts);
+
+	/* Regexps sorted by time spent in PCRE */
+	n = cache->re->len;
+	elts = g_malloc0 (sizeof (*elts) * MAX (n, 1));
+
+	for (i = 0; i < n; i ++) {
+		memcpy (&elts[i].p, &cache->profile[i], sizeof (elts[i].p));
+		elts[i].data = g_ptr_array_index (cache->re, i);
+	}
+
+	g_qsort_with_data (elts, n, sizeof (*elts), rspamd_re_cache_profile_cmp,
+			NULL);
+
+	for (i = 0; i < n; i ++) {
+		elt = elts[i].data;
+		re_class = rspamd_regexp_get_class (elt->re);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_regexp_get_pattern (elt->re)),
+				"re", 0, false);
+
+		if (re_class) {
+			rspamd_re_cache_profile_class_info (obj, re_class);
+		}
+
+		switch (elt->match_type) {
+		case RSPAMD_RE_CACHE_HYPERSCAN:
+			engine = "hyperscan";
+			break;
+		case RSPAMD_RE_CACHE_HYPERSCAN_PRE:
+			engine = "hyperscan_prefilter";
+			break;
+		default:
+			engine = elt->lit_filtered ? "pcre_literal" : "pcre";
+			break;
+		}
+
+		ucl_object_insert_key (obj, ucl_object_fromstring (engine),
+				"engine", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elts[i].p.scans),
+				"checks", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elts[i].p.hits),
+				"hits", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (elts[i].p.scans > 0 ?
+						(gdouble)elts[i].p.hits / elts[i].p.scans : 0.0),
+				"hit_ratio", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (elts[i].p.bytes),
+				"bytes", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (elts[i].p.time),
+				"time", 0, false);
+		ucl_array_append (regexps, obj);
+	}
+
+	g_free (elts);
+
+	ucl_object_insert_key (top, classes, "classes", 0, false);
+	ucl_object_insert_key (top, regexps, "regexps", 0, false);
+
+	return top;
+}
+
+void
+rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
+{
+	guint i;
+
+	g_assert (rt != NULL);
+
+	rspamd_re_cache_account_runtime (rt);
+	g_slice_free1 (NBYTES (rt->cache->nre), rt->checked);
+	g_slice_free1 (rt->cache->nre, rt->results);
+	g_slice_free1 (NBYTES (rt->cache->nre), rt->lit_checked);
+	g_slice_free1 (NBYTES (rt->cache->nre), rt->lit_found);
+
+	if (rt->inputs) {
+		for (i = 0; i < rt->cache->nclasses * 2; i ++) {
+			rspamd_re_cache_input_free (&rt->inputs[i]);
+		}
+
+		g_free (rt->inputs);
+	}
+
+	REF_RELEASE (rt->cache);
+	g_slice_free1 (sizeof (*rt), rt);
+}
+
+void
+rspamd_re_cache_unref (struct rspamd_re_cache *cache)
+{
+	if (cache) {
+		REF_RELEASE (cache);
+	}
+}
+
+struct rspamd_re_cache *
 rspamd_re_cache_ref (struct rspamd_re_cache *cache)
 {
 	if (cache) {
@@ -1235,60 +2124,543 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 	const gint max_tries = 10;
 	gint tries = 0, rc;
 
-	wait_time = max_time / max_tries;
-	/* We need to restore SIGCHLD processing */
-	signal (SIGCHLD, SIG_DFL);
-	cld = fork ();
-	g_assert (cld != -1);
+	wait_time = max_time / max_tries;
+	/* We need to restore SIGCHLD processing */
+	signal (SIGCHLD, SIG_DFL);
+	cld = fork ();
+	g_assert (cld != -1);
+
+	if (cld == 0) {
+		/* Try to compile pattern */
+		if (hs_compile (rspamd_regexp_get_pattern (re),
+				flags | HS_FLAG_PREFILTER,
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+			exit (EXIT_FAILURE);
+		}
+
+		exit (EXIT_SUCCESS);
+	}
+	else {
+		double_to_ts (wait_time, &ts);
+
+		while ((rc = waitpid (cld, &status, WNOHANG)) == 0 && tries ++ < max_tries) {
+			(void)nanosleep (&ts, NULL);
+		}
+
+		/* Child has been terminated */
+		if (rc > 0) {
+			/* Forget about SIGCHLD after this point */
+			signal (SIGCHLD, SIG_IGN);
+
+			if (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS) {
+				return TRUE;
+			}
+			else {
+				msg_err_re_cache (
+						"cannot approximate %s to hyperscan",
+						rspamd_regexp_get_pattern (re));
+
+				return FALSE;
+			}
+		}
+		else {
+			/* We consider that as timeout */
+			kill (cld, SIGKILL);
+			g_assert (waitpid (cld, &status, 0) != -1);
+			msg_err_re_cache (
+					"cannot approximate %s to hyperscan: timeout waiting",
+					rspamd_regexp_get_pattern (re));
+			signal (SIGCHLD, SIG_IGN);
+		}
+	}
+
+	return FALSE;
+}
+#endif
+
+#ifdef WITH_HYPERSCAN
+static void
+rspamd_re_cache_log_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class, const gchar *what, gint n)
+{
+	if (re_class->type_len > 0) {
+		msg_info_re_cache (
+				"%s class %s(%*s) to cache %6s, %d regexps",
+				what,
+				rspamd_re_cache_type_to_string (re_class->type),
+				(gint) re_class->type_len - 1,
+				re_class->type_data,
+				re_class->hash,
+				n);
+	}
+	else {
+		msg_info_re_cache (
+				"%s class %s to cache %6s, %d regexps",
+				what,
+				rspamd_re_cache_type_to_string (re_class->type),
+				re_class->hash,
+				n);
+	}
+}
+
+static gboolean
+rspamd_re_cache_class_streamable (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	if (cache->stream_size == 0) {
+		return FALSE;
+	}
+
+	switch (re_class->type) {
+	case RSPAMD_RE_BODY:
+	case RSPAMD_RE_MIME:
+	case RSPAMD_RE_RAWMIME:
+	case RSPAMD_RE_SABODY:
+	case RSPAMD_RE_SARAWBODY:
+		return TRUE;
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Streaming databases are stored in `<hash>.hss` files using the same layout
+ * as block ones, n == 0 means that a class cannot be scanned in streams
+ */
+static gboolean
+rspamd_re_cache_is_valid_stream_file (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class, const char *cache_dir)
+{
+	gchar path[PATH_MAX];
+	guchar magicbuf[RSPAMD_HS_MAGIC_LEN];
+	hs_platform_info_t test_plt;
+	gint fd;
+	gboolean ret = FALSE;
+
+	if (!rspamd_re_cache_class_streamable (cache, re_class)) {
+		return TRUE;
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hss", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (read (fd, magicbuf, sizeof (magicbuf)) == sizeof (magicbuf) &&
+			memcmp (magicbuf, rspamd_hs_magic_stream, sizeof (magicbuf)) == 0 &&
+			read (fd, &test_plt, sizeof (test_plt)) == sizeof (test_plt) &&
+			memcmp (&test_plt, &cache->plt, sizeof (test_plt)) == 0) {
+		ret = TRUE;
+	}
+
+	close (fd);
+
+	return ret;
+}
+
+static gboolean
+rspamd_re_cache_compile_stream (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const char *cache_dir,
+		const gchar **hs_pats,
+		guint *hs_flags,
+		gint *hs_ids,
+		gint n,
+		GError **err)
+{
+	gchar path[PATH_MAX], tmp_path[PATH_MAX];
+	hs_database_t *stream_db;
+	hs_compile_error_t *hs_errors;
+	gchar *hs_serialized = NULL;
+	gsize serialized_len = 0;
+	guint64 crc = 0;
+	gint fd, nstream = n;
+	struct iovec iov[7];
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hss", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s%c%s.hss.tmp", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (n == 0) {
+		/* Nothing to compile, but the file marks class as processed */
+	}
+	else if (hs_compile_multi (hs_pats, hs_flags, hs_ids, n, HS_MODE_STREAM,
+			&cache->plt, &stream_db, &hs_errors) != HS_SUCCESS) {
+		msg_info_re_cache ("cannot compile streaming database for %s: %s, "
+				"large inputs are scanned in block mode",
+				re_class->hash, hs_errors->message);
+		hs_free_compile_error (hs_errors);
+		nstream = 0;
+	}
+	else {
+		if (hs_serialize_database (stream_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			hs_free_database (stream_db);
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot serialize streaming tree of regexp for %s",
+					re_class->hash);
+
+			return FALSE;
+		}
+
+		hs_free_database (stream_db);
+		crc = XXH64 (hs_serialized, serialized_len, 0xdeadbabe);
+	}
+
+	fd = open (tmp_path, O_CREAT|O_TRUNC|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", tmp_path, strerror (errno));
+		g_free (hs_serialized);
+
+		return FALSE;
+	}
+
+	iov[0].iov_base = (void *) rspamd_hs_magic_stream;
+	iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+	iov[1].iov_base = &cache->plt;
+	iov[1].iov_len = sizeof (cache->plt);
+	iov[2].iov_base = &nstream;
+	iov[2].iov_len = sizeof (nstream);
+	iov[3].iov_base = hs_ids;
+	iov[3].iov_len = sizeof (*hs_ids) * nstream;
+	iov[4].iov_base = hs_flags;
+	iov[4].iov_len = sizeof (*hs_flags) * nstream;
+	iov[5].iov_base = &crc;
+	iov[5].iov_len = sizeof (crc);
+	iov[6].iov_base = hs_serialized;
+	iov[6].iov_len = serialized_len;
+
+	if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno,
+				"cannot serialize streaming tree of regexp to %s: %s",
+				tmp_path, strerror (errno));
+		close (fd);
+		unlink (tmp_path);
+		g_free (hs_serialized);
+
+		return FALSE;
+	}
+
+	close (fd);
+	g_free (hs_serialized);
+
+	if (rename (tmp_path, path) == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno,
+				"cannot rename %s to %s: %s",
+				tmp_path, path, strerror (errno));
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gint
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		GError **err)
+{
+	gchar path[PATH_MAX], tmp_path[PATH_MAX];
+	hs_database_t *test_db;
+	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
+	guint j;
+	guint64 crc;
+	rspamd_regexp_t *re;
+	struct rspamd_re_cache_elt *elt;
+	hs_compile_error_t *hs_errors;
+	guint *hs_flags = NULL;
+	const gchar **hs_pats = NULL;
+	gchar *hs_serialized;
+	gsize serialized_len;
+	struct iovec iov[7];
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE) &&
+			rspamd_re_cache_is_valid_stream_file (cache, re_class, cache_dir)) {
+
+		fd = open (path, O_RDONLY, 00600);
+
+		/* Read number of regexps */
+		g_assert (fd != -1);
+		lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
+		read (fd, &n, sizeof (n));
+		close (fd);
+
+		if (!silent) {
+			rspamd_re_cache_log_class (cache, re_class, "skip already valid", n);
+		}
+
+		return 0;
+	}
+
+	/*
+	 * Write to a temporary file first: workers might load other classes from
+	 * the same dir while this one is being compiled
+	 */
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s%c%s.hs.tmp", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (tmp_path, O_CREAT|O_TRUNC|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", tmp_path, strerror (errno));
+		return -1;
+	}
+
+	n = re_class->nre_ids;
+	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
+	hs_ids = g_malloc (sizeof (*hs_ids) * n);
+	hs_pats = g_malloc (sizeof (*hs_pats) * n);
+	i = 0;
+
+	for (j = 0; j < re_class->nre_ids; j ++) {
+		elt = g_ptr_array_index (cache->re, re_class->re_ids[j]);
+		re = elt->re;
+
+		pcre_flags = rspamd_regexp_get_pcre_flags (re);
+		re_flags = rspamd_regexp_get_flags (re);
+
+		if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+			/* Do not try to compile bad regexp */
+			msg_info_re_cache (
+					"do not try compile %s to hyperscan as it is PCRE only",
+					rspamd_regexp_get_pattern (re));
+			continue;
+		}
+
+		hs_flags[i] = 0;
+#ifndef WITH_PCRE2
+		if (pcre_flags & PCRE_FLAG(UTF8)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#else
+		if (pcre_flags & PCRE_FLAG(UTF)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#endif
+		if (pcre_flags & PCRE_FLAG(CASELESS)) {
+			hs_flags[i] |= HS_FLAG_CASELESS;
+		}
+		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
+			hs_flags[i] |= HS_FLAG_MULTILINE;
+		}
+		if (pcre_flags & PCRE_FLAG(DOTALL)) {
+			hs_flags[i] |= HS_FLAG_DOTALL;
+		}
+		if (rspamd_regexp_get_maxhits (re) == 1) {
+			hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+		}
+
+		if (hs_compile (rspamd_regexp_get_pattern (re),
+				hs_flags[i],
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+			msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
+					rspamd_regexp_get_pattern (re));
+			hs_free_compile_error (hs_errors);
+
+			/* The approximation operation might take a significant
+			 * amount of time, so we need to check if it's finite
+			 */
+			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
+				hs_flags[i] |= HS_FLAG_PREFILTER;
+				/* Position in class is used as hyperscan id */
+				hs_ids[i] = j;
+				hs_pats[i] = rspamd_regexp_get_pattern (re);
+				i++;
+			}
+		}
+		else {
+			hs_ids[i] = j;
+			hs_pats[i] = rspamd_regexp_get_pattern (re);
+			i ++;
+			hs_free_database (test_db);
+		}
+	}
+	/* Adjust real re number */
+	n = i;
+
+	if (n > 0) {
+		/* Create the hs tree */
+		if (hs_compile_multi (hs_pats,
+				hs_flags,
+				hs_ids,
+				n,
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_pats[hs_errors->expression], hs_errors->message);
+			g_free (hs_flags);
+			g_free (hs_ids);
+			g_free (hs_pats);
+			close (fd);
+			unlink (tmp_path);
+			hs_free_compile_error (hs_errors);
+
+			return -1;
+		}
+
+		if (hs_serialize_database (test_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp for %s",
+					re_class->hash);
+
+			close (fd);
+			unlink (tmp_path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_pats);
+			hs_free_database (test_db);
+
+			return -1;
+		}
+
+		hs_free_database (test_db);
+
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * n * <regexp flags>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+		crc = XXH64 (hs_serialized, serialized_len, 0xdeadbabe);
+
+		if (cache->vectorized_hyperscan) {
+			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
+		}
+		else {
+			iov[0].iov_base = (void *) rspamd_hs_magic;
+		}
+		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+		iov[1].iov_base = &cache->plt;
+		iov[1].iov_len = sizeof (cache->plt);
+		iov[2].iov_base = &n;
+		iov[2].iov_len = sizeof (n);
+		iov[3].iov_base = hs_ids;
+		iov[3].iov_len = sizeof (*hs_ids) * n;
+		iov[4].iov_base = hs_flags;
+		iov[4].iov_len = sizeof (*hs_flags) * n;
+		iov[5].iov_base = &crc;
+		iov[5].iov_len = sizeof (crc);
+		iov[6].iov_base = hs_serialized;
+		iov[6].iov_len = serialized_len;
+
+		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp to %s: %s",
+					tmp_path, strerror (errno));
+			close (fd);
+			unlink (tmp_path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_pats);
+			g_free (hs_serialized);
+
+			return -1;
+		}
 
-	if (cld == 0) {
-		/* Try to compile pattern */
-		if (hs_compile (rspamd_regexp_get_pattern (re),
-				flags | HS_FLAG_PREFILTER,
-				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-				&cache->plt,
-				&test_db,
-				&hs_errors) != HS_SUCCESS) {
-			exit (EXIT_FAILURE);
+		rspamd_re_cache_log_class (cache, re_class, "compiled", n);
+		g_free (hs_serialized);
+
+		/* Block mode file is written after the streaming one */
+		if (rspamd_re_cache_class_streamable (cache, re_class) &&
+				!rspamd_re_cache_compile_stream (cache, re_class, cache_dir,
+						hs_pats, hs_flags, hs_ids, n, err)) {
+			close (fd);
+			unlink (tmp_path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_pats);
+
+			return -1;
 		}
 
-		exit (EXIT_SUCCESS);
+		g_free (hs_pats);
+		g_free (hs_ids);
+		g_free (hs_flags);
 	}
 	else {
-		double_to_ts (wait_time, &ts);
+		if (rspamd_re_cache_class_streamable (cache, re_class) &&
+				!rspamd_re_cache_compile_stream (cache, re_class, cache_dir,
+						hs_pats, hs_flags, hs_ids, 0, err)) {
+			close (fd);
+			unlink (tmp_path);
+			g_free (hs_pats);
+			g_free (hs_ids);
+			g_free (hs_flags);
 
-		while ((rc = waitpid (cld, &status, WNOHANG)) == 0 && tries ++ < max_tries) {
-			(void)nanosleep (&ts, NULL);
+			return -1;
 		}
 
-		/* Child has been terminated */
-		if (rc > 0) {
-			/* Forget about SIGCHLD after this point */
-			signal (SIGCHLD, SIG_IGN);
+		g_free (hs_pats);
+		g_free (hs_ids);
+		g_free (hs_flags);
+	}
 
-			if (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS) {
-				return TRUE;
-			}
-			else {
-				msg_err_re_cache (
-						"cannot approximate %s to hyperscan",
-						rspamd_regexp_get_pattern (re));
+	close (fd);
 
-				return FALSE;
-			}
-		}
-		else {
-			/* We consider that as timeout */
-			kill (cld, SIGKILL);
-			g_assert (waitpid (cld, &status, 0) != -1);
-			msg_err_re_cache (
-					"cannot approximate %s to hyperscan: timeout waiting",
-					rspamd_regexp_get_pattern (re));
-			signal (SIGCHLD, SIG_IGN);
+	if (rename (tmp_path, path) == -1) {
+		g_set_error (err,
+				rspamd_re_cache_quark (),
+				errno,
+				"cannot rename %s to %s: %s",
+				tmp_path, path, strerror (errno));
+		unlink (tmp_path);
+
+		return -1;
+	}
+
+	return n;
+}
+
+static struct rspamd_re_class *
+rspamd_re_cache_find_class (struct rspamd_re_cache *cache,
+		const gchar *class_hash)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (strcmp (re_class->hash, class_hash) == 0) {
+			return re_class;
 		}
 	}
 
-	return FALSE;
+	return NULL;
 }
 #endif
 
@@ -1304,260 +2676,85 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
 	return -1;
 #else
-	GHashTableIter it, cit;
+	GHashTableIter it;
 	gpointer k, v;
-	struct rspamd_re_class *re_class;
-	gchar path[PATH_MAX];
-	hs_database_t *test_db;
-	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
-	guint64 crc;
-	rspamd_regexp_t *re;
-	hs_compile_error_t *hs_errors;
-	guint *hs_flags = NULL;
-	const gchar **hs_pats = NULL;
-	gchar *hs_serialized;
-	gsize serialized_len, total = 0;
-	struct iovec iov[7];
+	gint n, total = 0;
 
 	g_hash_table_iter_init (&it, cache->re_classes);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
-		re_class = v;
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
-
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
-
-			fd = open (path, O_RDONLY, 00600);
-
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-			read (fd, &n, sizeof (n));
-			close (fd);
-
-			if (re_class->type_len > 0) {
-				if (!silent) {
-					msg_info_re_cache (
-							"skip already valid class %s(%*s) to cache %6s, %d regexps",
-							rspamd_re_cache_type_to_string (re_class->type),
-							(gint) re_class->type_len - 1,
-							re_class->type_data,
-							re_class->hash,
-							n);
-				}
-			}
-			else {
-				if (!silent) {
-					msg_info_re_cache (
-							"skip already valid class %s to cache %6s, %d regexps",
-							rspamd_re_cache_type_to_string (re_class->type),
-							re_class->hash,
-							n);
-				}
-			}
-
-			continue;
-		}
-
-		fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
-
-		if (fd == -1) {
-			g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
-					"%s: %s", path, strerror (errno));
+		if ((n = rspamd_re_cache_compile_class (cache, v, cache_dir, max_time,
+				silent, err)) == -1) {
 			return -1;
 		}
 
-		g_hash_table_iter_init (&cit, re_class->re);
-		n = g_hash_table_size (re_class->re);
-		hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
-		hs_ids = g_malloc (sizeof (*hs_ids) * n);
-		hs_pats = g_malloc (sizeof (*hs_pats) * n);
-		i = 0;
-
-		while (g_hash_table_iter_next (&cit, &k, &v)) {
-			re = v;
-
-			pcre_flags = rspamd_regexp_get_pcre_flags (re);
-			re_flags = rspamd_regexp_get_flags (re);
-
-			if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
-				/* Do not try to compile bad regexp */
-				msg_info_re_cache (
-						"do not try compile %s to hyperscan as it is PCRE only",
-						rspamd_regexp_get_pattern (re));
-				continue;
-			}
+		total += n;
+	}
 
-			hs_flags[i] = 0;
-#ifndef WITH_PCRE2
-			if (pcre_flags & PCRE_FLAG(UTF8)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
-#else
-			if (pcre_flags & PCRE_FLAG(UTF)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
+	return total;
 #endif
-			if (pcre_flags & PCRE_FLAG(CASELESS)) {
-				hs_flags[i] |= HS_FLAG_CASELESS;
-			}
-			if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-				hs_flags[i] |= HS_FLAG_MULTILINE;
-			}
-			if (pcre_flags & PCRE_FLAG(DOTALL)) {
-				hs_flags[i] |= HS_FLAG_DOTALL;
-			}
-			if (rspamd_regexp_get_maxhits (re) == 1) {
-				hs_flags[i] |= HS_FLAG_SINGLEMATCH;
-			}
-
-			if (hs_compile (rspamd_regexp_get_pattern (re),
-					hs_flags[i],
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-				msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
-						rspamd_regexp_get_pattern (re));
-				hs_free_compile_error (hs_errors);
-
-				/* The approximation operation might take a significant
-				 * amount of time, so we need to check if it's finite
-				 */
-				if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
-					hs_flags[i] |= HS_FLAG_PREFILTER;
-					hs_ids[i] = rspamd_regexp_get_cache_id (re);
-					hs_pats[i] = rspamd_regexp_get_pattern (re);
-					i++;
-				}
-			}
-			else {
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
-				hs_pats[i] = rspamd_regexp_get_pattern (re);
-				i ++;
-				hs_free_database (test_db);
-			}
-		}
-		/* Adjust real re number */
-		n = i;
-
-		if (n > 0) {
-			/* Create the hs tree */
-			if (hs_compile_multi (hs_pats,
-					hs_flags,
-					hs_ids,
-					n,
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-
-				g_set_error (err, rspamd_re_cache_quark (), EINVAL,
-						"cannot create tree of regexp when processing '%s': %s",
-						hs_pats[hs_errors->expression], hs_errors->message);
-				g_free (hs_flags);
-				g_free (hs_ids);
-				g_free (hs_pats);
-				close (fd);
-				hs_free_compile_error (hs_errors);
-
-				return -1;
-			}
+}
 
-			g_free (hs_pats);
+GPtrArray *
+rspamd_re_cache_hyperscan_outdated (struct rspamd_re_cache *cache,
+		const char *cache_dir)
+{
+	GPtrArray *res;
 
-			if (hs_serialize_database (test_db, &hs_serialized,
-					&serialized_len) != HS_SUCCESS) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp for %s",
-						re_class->hash);
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
 
-				close (fd);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				hs_free_database (test_db);
+	res = g_ptr_array_new ();
 
-				return -1;
-			}
+#ifdef WITH_HYPERSCAN
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	gchar path[PATH_MAX];
 
-			hs_free_database (test_db);
+	g_hash_table_iter_init (&it, cache->re_classes);
 
-			/*
-			 * Magic - 8 bytes
-			 * Platform - sizeof (platform)
-			 * n - number of regexps
-			 * n * <regexp ids>
-			 * n * <regexp flags>
-			 * crc - 8 bytes checksum
-			 * <hyperscan blob>
-			 */
-			crc = XXH64 (hs_serialized, serialized_len, 0xdeadbabe);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
 
-			if (cache->vectorized_hyperscan) {
-				iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-			}
-			else {
-				iov[0].iov_base = (void *) rspamd_hs_magic;
-			}
-			iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-			iov[1].iov_base = &cache->plt;
-			iov[1].iov_len = sizeof (cache->plt);
-			iov[2].iov_base = &n;
-			iov[2].iov_len = sizeof (n);
-			iov[3].iov_base = hs_ids;
-			iov[3].iov_len = sizeof (*hs_ids) * n;
-			iov[4].iov_base = hs_flags;
-			iov[4].iov_len = sizeof (*hs_flags) * n;
-			iov[5].iov_base = &crc;
-			iov[5].iov_len = sizeof (crc);
-			iov[6].iov_base = hs_serialized;
-			iov[6].iov_len = serialized_len;
-
-			if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp to %s: %s",
-						path, strerror (errno));
-				close (fd);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				g_free (hs_serialized);
+		if (!rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE) ||
+				!rspamd_re_cache_is_valid_stream_file (cache, re_class,
+						cache_dir)) {
+			g_ptr_array_add (res, re_class->hash);
+		}
+	}
+#endif
 
-				return -1;
-			}
+	return res;
+}
 
-			if (re_class->type_len > 0) {
-				msg_info_re_cache (
-						"compiled class %s(%*s) to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						(gint) re_class->type_len - 1,
-						re_class->type_data,
-						re_class->hash,
-						n);
-			}
-			else {
-				msg_info_re_cache (
-						"compiled class %s to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						re_class->hash,
-						n);
-			}
+gint
+rspamd_re_cache_compile_hyperscan_class (struct rspamd_re_cache *cache,
+		const char *cache_dir, const gchar *class_hash, gdouble max_time,
+		gboolean silent, GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+	g_assert (class_hash != NULL);
 
-			total += n;
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	struct rspamd_re_class *re_class;
 
-			g_free (hs_serialized);
-			g_free (hs_ids);
-			g_free (hs_flags);
-		}
+	re_class = rspamd_re_cache_find_class (cache, class_hash);
 
-		close (fd);
+	if (re_class == NULL) {
+		g_set_error (err, rspamd_re_cache_quark (), ENOENT,
+				"no re class with hash %s", class_hash);
+		return -1;
 	}
 
-	return total;
+	return rspamd_re_cache_compile_class (cache, re_class, cache_dir,
+			max_time, silent, err);
 #endif
 }
 
@@ -1707,6 +2904,84 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 }
 
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Streaming databases are optional, so failures here just make class to be
+ * scanned in block mode only
+ */
+static void
+rspamd_re_cache_load_stream (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class, const char *cache_dir)
+{
+	gchar path[PATH_MAX];
+	guint8 *map, *p;
+	struct stat st;
+	gint fd, n, ret;
+	gsize hdrlen;
+
+	if (re_class->hs_stream_db) {
+		hs_free_database (re_class->hs_stream_db);
+		re_class->hs_stream_db = NULL;
+	}
+
+	if (!rspamd_re_cache_class_streamable (cache, re_class) ||
+			!rspamd_re_cache_is_valid_stream_file (cache, re_class, cache_dir)) {
+		return;
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hss", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return;
+	}
+
+	hdrlen = RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt) + sizeof (n);
+
+	if ((gsize)st.st_size < hdrlen) {
+		close (fd);
+
+		return;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_warn_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+
+		return;
+	}
+
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
+	n = *(gint *)p;
+
+	/* Streaming database must contain the same regexps as the block one */
+	if (n > 0 && n == (gint)re_class->nhs &&
+			hdrlen + 2 * n * sizeof (gint) + sizeof (guint64) <
+			(gsize)st.st_size) {
+		p += sizeof (n) + 2 * n * sizeof (gint) + sizeof (guint64);
+
+		if ((ret = hs_deserialize_database (p, map + st.st_size - p,
+				&re_class->hs_stream_db)) != HS_SUCCESS) {
+			msg_warn_re_cache ("bad streaming hs database in %s: %d",
+					path, ret);
+			re_class->hs_stream_db = NULL;
+		}
+		else {
+			g_assert (rspamd_hs_scratch_register (re_class->hs_stream_db));
+		}
+	}
+
+	munmap (map, st.st_size);
+}
+#endif
+
 gboolean
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir)
@@ -1719,6 +2994,7 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 #else
 	gchar path[PATH_MAX];
 	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	guint nmissing = 0;
 	GHashTableIter it;
 	gpointer k, v;
 	guint8 *map, *p, *end;
@@ -1730,10 +3006,17 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		re_class = v;
+
+		if (re_class->hs_db != NULL) {
+			/* Class content cannot change, so its database is still valid */
+			total += re_class->nhs;
+			continue;
+		}
+
 		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
 				G_DIR_SEPARATOR, re_class->hash);
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, FALSE, FALSE)) {
+		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, FALSE)) {
 			msg_debug_re_cache ("load hyperscan database from '%s'",
 					re_class->hash);
 
@@ -1772,6 +3055,21 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			hs_ids = g_malloc (n * sizeof (*hs_ids));
 			memcpy (hs_ids, p, n * sizeof (*hs_ids));
 			p += n * sizeof (*hs_ids);
+
+			for (i = 0; i < n; i ++) {
+				if (hs_ids[i] < 0 || hs_ids[i] >= (gint)re_class->nre_ids) {
+					msg_err_re_cache ("bad regexp id in %s: %d", path,
+							hs_ids[i]);
+					munmap (map, st.st_size);
+					g_free (hs_ids);
+
+					return FALSE;
+				}
+
+				/* Convert position in class to the cache id */
+				hs_ids[i] = re_class->re_ids[hs_ids[i]];
+			}
+
 			hs_flags = g_malloc (n * sizeof (*hs_flags));
 			memcpy (hs_flags, p, n * sizeof (*hs_flags));
 
@@ -1779,11 +3077,11 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			p += n * sizeof (*hs_ids) + sizeof (guint64);
 
 			/* Cleanup */
-			if (re_class->hs_scratch != NULL) {
-				hs_free_scratch (re_class->hs_scratch);
+			if (re_class->hs_db_maplen > 0) {
+				rspamd_hs_shared_unmap (re_class->hs_db,
+						re_class->hs_db_maplen);
 			}
-
-			if (re_class->hs_db != NULL) {
+			else if (re_class->hs_db != NULL) {
 				hs_free_database (re_class->hs_db);
 			}
 
@@ -1792,11 +3090,26 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			}
 
 			re_class->hs_ids = NULL;
-			re_class->hs_scratch = NULL;
 			re_class->hs_db = NULL;
+			re_class->hs_db_maplen = 0;
+
+			if (cache->shared_hyperscan) {
+				/* Path without the '.hs' suffix */
+				path[strlen (path) - 3] = '\0';
+				re_class->hs_db = rspamd_hs_shared_map (path,
+						(const gchar *)p, end - p,
+						&re_class->hs_db_maplen);
+
+				if (re_class->hs_db == NULL) {
+					msg_warn_re_cache ("cannot share hs database for %s, "
+							"load it privately", path);
+					re_class->hs_db_maplen = 0;
+				}
+			}
 
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
-					!= HS_SUCCESS) {
+			if (re_class->hs_db == NULL &&
+					(ret = hs_deserialize_database (p, end - p,
+					&re_class->hs_db)) != HS_SUCCESS) {
 				msg_err_re_cache ("bad hs database in %s: %d", path, ret);
 				munmap (map, st.st_size);
 				g_free (hs_ids);
@@ -1807,8 +3120,7 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 
 			munmap (map, st.st_size);
 
-			g_assert (hs_alloc_scratch (re_class->hs_db,
-					&re_class->hs_scratch) == HS_SUCCESS);
+			g_assert (rspamd_hs_scratch_register (re_class->hs_db));
 
 			/*
 			 * Now find hyperscan elts that are successfully compiled and
@@ -1829,16 +3141,27 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			re_class->hs_ids = hs_ids;
 			g_free (hs_flags);
 			re_class->nhs = n;
+			rspamd_re_cache_load_stream (cache, re_class, cache_dir);
+			/* Regexps that are not in hyperscan could be prefiltered now */
+			rspamd_re_cache_build_literals (cache, re_class);
 		}
 		else {
-			msg_err_re_cache ("invalid hyperscan hash file '%s'",
+			/* Might be still compiling, use PCRE for this class meanwhile */
+			msg_info_re_cache ("no valid hyperscan hash file '%s' yet",
 					path);
-			return FALSE;
+			nmissing ++;
 		}
 	}
 
-	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
-	cache->hyperscan_loaded = TRUE;
+	if (nmissing > 0) {
+		msg_info_re_cache ("hyperscan database of %d regexps has been "
+				"loaded, %ud classes are not compiled yet", total, nmissing);
+	}
+	else {
+		msg_info_re_cache ("hyperscan database of %d regexps has been loaded",
+				total);
+		cache->hyperscan_loaded = TRUE;
+	}
 
 	return TRUE;
 #endif
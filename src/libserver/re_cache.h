@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "libutil/regexp.h"
+#include "ucl.h"
 
 struct rspamd_re_cache;
 struct rspamd_re_runtime;
@@ -64,6 +65,19 @@ rspamd_regexp_t *
 		rspamd_re_cache_add (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
 		enum rspamd_re_type type, gpointer type_data, gsize datalen);
 
+/**
+ * Add the existing regexp to the cache within a symbols group. Regexps of
+ * different groups are placed to different classes (and hence to different
+ * hyperscan databases), so a class is scanned only if some symbol of its
+ * group is actually checked
+ * @param group name of the group (NULL means no group)
+ */
+rspamd_regexp_t *
+		rspamd_re_cache_add_group (struct rspamd_re_cache *cache,
+		rspamd_regexp_t *re,
+		enum rspamd_re_type type, gpointer type_data, gsize datalen,
+		const gchar *group);
+
 /**
  * Replace regexp in the cache with another regexp
  * @param cache cache object
@@ -87,6 +101,13 @@ void rspamd_re_cache_init (struct rspamd_re_cache *cache,
  */
 gboolean rspamd_re_cache_is_hs_loaded (struct rspamd_re_cache *cache);
 
+/**
+ * Returns size of loaded hyperscan databases in bytes
+ * @param cache
+ * @return
+ */
+gsize rspamd_re_cache_hyperscan_size (struct rspamd_re_cache *cache);
+
 /**
  * Get runtime data for a cache
  */
@@ -130,6 +151,13 @@ void rspamd_re_cache_unref (struct rspamd_re_cache *cache);
  */
 struct rspamd_re_cache *rspamd_re_cache_ref (struct rspamd_re_cache *cache);
 
+/**
+ * Returns the cost report of the cache: bytes scanned and time spent per
+ * class (hyperscan) and per regexp (PCRE) as well as regexps hit ratio.
+ * Counters are shared among all workers.
+ */
+ucl_object_t *rspamd_re_cache_profile (struct rspamd_re_cache *cache);
+
 /**
  * Set limit for all regular expressions in the cache, returns previous limit
  */
@@ -152,6 +180,22 @@ gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, gdouble max_time, gboolean silent,
 		GError **err);
 
+/**
+ * Returns array of hashes of classes that have no valid hyperscan file in the
+ * `cache_dir`, hashes are owned by the cache and the array should be freed
+ */
+GPtrArray *rspamd_re_cache_hyperscan_outdated (struct rspamd_re_cache *cache,
+		const char *cache_dir);
+
+/**
+ * Compile a single class identified by its hash to the `cache_dir`, classes
+ * are independent, so they could be compiled in parallel
+ * @return number of compiled regexps or -1 in case of error
+ */
+gint rspamd_re_cache_compile_hyperscan_class (struct rspamd_re_cache *cache,
+		const char *cache_dir, const gchar *class_hash, gdouble max_time,
+		gboolean silent, GError **err);
+
 
 /**
  * Returns TRUE if the specified file is valid hyperscan cache
@@ -160,7 +204,8 @@ gboolean rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 		const char *path, gboolean silent, gboolean try_load);
 
 /**
- * Loads all hyperscan regexps precompiled
+ * Loads all hyperscan regexps precompiled, classes that are not compiled yet
+ * are matched by PCRE until the next call
  */
 gboolean rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir);
@@ -0,0 +1,375 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "redis_pool.h"
+#include "xxhash.h"
+
+#ifdef WITH_HIREDIS
+#include "hiredis.h"
+#include "adapters/libevent.h"
+
+#define REDIS_POOL_DEFAULT_TIMEOUT 10.0
+#define REDIS_POOL_DEFAULT_MAX_CONNS 100
+
+struct rspamd_redis_pool_elt;
+
+struct rspamd_redis_pool_connection {
+	struct redisAsyncContext *ctx;
+	struct rspamd_redis_pool_elt *elt;
+	GList *entry;
+	struct event timeout;
+	gboolean active;
+};
+
+/* Connections to the same server, database and event base */
+struct rspamd_redis_pool_elt {
+	struct rspamd_redis_pool *pool;
+	GQueue *active;
+	GQueue *inactive;
+	struct event_base *ev_base;
+	guint64 key;
+};
+
+struct rspamd_redis_pool {
+	GHashTable *elts_by_key;
+	GHashTable *elts_by_ctx;
+	gdouble timeout;
+	guint max_conns;
+};
+
+static const guint64 rspamd_redis_pool_seed = 0x8f4a1c3e5b7d9e21ULL;
+
+static guint64
+rspamd_redis_pool_get_key (struct event_base *ev_base, const gchar *db,
+		const gchar *password, const char *ip, int port)
+{
+	XXH64_state_t st;
+
+	XXH64_reset (&st, rspamd_redis_pool_seed);
+
+	if (db) {
+		XXH64_update (&st, db, strlen (db));
+	}
+	if (password) {
+		XXH64_update (&st, password, strlen (password));
+	}
+
+	XXH64_update (&st, ip, strlen (ip));
+	XXH64_update (&st, &port, sizeof (port));
+	XXH64_update (&st, &ev_base, sizeof (ev_base));
+
+	return XXH64_digest (&st);
+}
+
+/* Forget about connection without closing it */
+static void
+rspamd_redis_pool_conn_detach (struct rspamd_redis_pool_connection *conn)
+{
+	struct rspamd_redis_pool_elt *elt = conn->elt;
+
+	if (conn->active) {
+		g_queue_delete_link (elt->active, conn->entry);
+	}
+	else {
+		g_queue_delete_link (elt->inactive, conn->entry);
+		event_del (&conn->timeout);
+	}
+
+	conn->ctx->data = NULL;
+	g_hash_table_remove (elt->pool->elts_by_ctx, conn->ctx);
+	g_slice_free1 (sizeof (*conn), conn);
+}
+
+static void
+rspamd_redis_pool_conn_close (struct rspamd_redis_pool_connection *conn)
+{
+	struct redisAsyncContext *ctx = conn->ctx;
+
+	rspamd_redis_pool_conn_detach (conn);
+	/* Pending callbacks are called with NULL replies */
+	redisAsyncFree (ctx);
+}
+
+/* Called by hiredis on errors, remote close and redisAsyncFree */
+static void
+rspamd_redis_pool_on_disconnect (const struct redisAsyncContext *ac, int status)
+{
+	struct rspamd_redis_pool_connection *conn = ac->data;
+
+	if (conn != NULL) {
+		if (status != REDIS_OK) {
+			msg_info ("redis connection has been lost: %s", ac->errstr);
+		}
+
+		/* Hiredis is going to free the context itself */
+		rspamd_redis_pool_conn_detach (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_on_connect (const struct redisAsyncContext *ac, int status)
+{
+	/*
+	 * Workaround to prevent double close:
+	 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
+	 */
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
+	struct redisAsyncContext *nc = (struct redisAsyncContext *)ac;
+	if (status == REDIS_ERR) {
+		nc->c.fd = -1;
+	}
+#endif
+}
+
+static void
+rspamd_redis_pool_idle_timeout (gint fd, short what, gpointer p)
+{
+	struct rspamd_redis_pool_connection *conn = p;
+
+	msg_debug ("close idle redis connection");
+	rspamd_redis_pool_conn_close (conn);
+}
+
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_new_connection (struct rspamd_redis_pool_elt *elt,
+		const gchar *db, const gchar *password, const char *ip, int port)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct redisAsyncContext *ctx;
+
+	ctx = redisAsyncConnect (ip, port);
+
+	if (ctx == NULL) {
+		msg_err ("cannot connect to redis %s:%d", ip, port);
+
+		return NULL;
+	}
+
+	if (ctx->err != REDIS_OK) {
+		msg_err ("cannot connect to redis %s:%d: %s", ip, port, ctx->errstr);
+		redisAsyncFree (ctx);
+
+		return NULL;
+	}
+
+	conn = g_slice_alloc0 (sizeof (*conn));
+	conn->ctx = ctx;
+	conn->elt = elt;
+	ctx->data = conn;
+
+	g_hash_table_insert (elt->pool->elts_by_ctx, ctx, conn);
+	redisLibeventAttach (ctx, elt->ev_base);
+	redisAsyncSetConnectCallback (ctx, rspamd_redis_pool_on_connect);
+	redisAsyncSetDisconnectCallback (ctx, rspamd_redis_pool_on_disconnect);
+
+	if (password) {
+		redisAsyncCommand (ctx, NULL, NULL, "AUTH %s", password);
+	}
+	if (db) {
+		redisAsyncCommand (ctx, NULL, NULL, "SELECT %s", db);
+	}
+
+	return conn;
+}
+
+static struct rspamd_redis_pool_elt *
+rspamd_redis_pool_new_elt (struct rspamd_redis_pool *pool,
+		struct event_base *ev_base, guint64 key)
+{
+	struct rspamd_redis_pool_elt *elt;
+
+	elt = g_slice_alloc0 (sizeof (*elt));
+	elt->pool = pool;
+	elt->ev_base = ev_base;
+	elt->key = key;
+	elt->active = g_queue_new ();
+	elt->inactive = g_queue_new ();
+
+	g_hash_table_insert (pool->elts_by_key, &elt->key, elt);
+
+	return elt;
+}
+
+static void
+rspamd_redis_pool_elt_dtor (gpointer p)
+{
+	struct rspamd_redis_pool_elt *elt = p;
+	struct rspamd_redis_pool_connection *conn;
+
+	while ((conn = g_queue_peek_head (elt->active)) != NULL) {
+		rspamd_redis_pool_conn_close (conn);
+	}
+
+	while ((conn = g_queue_peek_head (elt->inactive)) != NULL) {
+		rspamd_redis_pool_conn_close (conn);
+	}
+
+	g_queue_free (elt->active);
+	g_queue_free (elt->inactive);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+struct rspamd_redis_pool *
+rspamd_redis_pool_init (void)
+{
+	struct rspamd_redis_pool *pool;
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->elts_by_key = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+			NULL, rspamd_redis_pool_elt_dtor);
+	pool->elts_by_ctx = g_hash_table_new (g_direct_hash, g_direct_equal);
+	pool->timeout = REDIS_POOL_DEFAULT_TIMEOUT;
+	pool->max_conns = REDIS_POOL_DEFAULT_MAX_CONNS;
+
+	return pool;
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+	guint64 key;
+
+	g_assert (pool != NULL);
+	g_assert (ev_base != NULL);
+	g_assert (ip != NULL);
+
+	key = rspamd_redis_pool_get_key (ev_base, db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (elt == NULL) {
+		elt = rspamd_redis_pool_new_elt (pool, ev_base, key);
+	}
+
+	/* The most recently released connections are at the head */
+	while ((conn = g_queue_peek_head (elt->inactive)) != NULL) {
+		if (conn->ctx->err == REDIS_OK) {
+			event_del (&conn->timeout);
+			g_queue_delete_link (elt->inactive, conn->entry);
+			g_queue_push_head (elt->active, conn);
+			conn->entry = elt->active->head;
+			conn->active = TRUE;
+			msg_debug ("reuse redis connection to %s:%d", ip, port);
+
+			return conn->ctx;
+		}
+
+		rspamd_redis_pool_conn_close (conn);
+	}
+
+	conn = rspamd_redis_pool_new_connection (elt, db, password, ip, port);
+
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	g_queue_push_head (elt->active, conn);
+	conn->entry = elt->active->head;
+	conn->active = TRUE;
+
+	return conn->ctx;
+}
+
+void
+rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct rspamd_redis_pool_elt *elt;
+	struct timeval tv;
+
+	g_assert (pool != NULL);
+	g_assert (ctx != NULL);
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+
+	if (conn == NULL) {
+		/* Connection has been already closed by hiredis */
+		return;
+	}
+
+	g_assert (conn->active);
+	elt = conn->elt;
+
+	/*
+	 * Replies that nobody waits for (e.g. the tail of a pipelined blob) or
+	 * subscriptions would be delivered to the next user, so such connections
+	 * are never reused
+	 */
+	if (is_fatal || ctx->err != REDIS_OK || ctx->replies.head != NULL ||
+			(ctx->c.flags & (REDIS_SUBSCRIBED|REDIS_MONITORING)) ||
+			g_queue_get_length (elt->inactive) >= pool->max_conns) {
+		rspamd_redis_pool_conn_close (conn);
+
+		return;
+	}
+
+	g_queue_delete_link (elt->active, conn->entry);
+	g_queue_push_head (elt->inactive, conn);
+	conn->entry = elt->inactive->head;
+	conn->active = FALSE;
+
+	double_to_tv (rspamd_time_jitter (pool->timeout, pool->timeout / 2.0), &tv);
+	event_set (&conn->timeout, -1, EV_TIMEOUT,
+			rspamd_redis_pool_idle_timeout, conn);
+	event_base_set (elt->ev_base, &conn->timeout);
+	event_add (&conn->timeout, &tv);
+}
+
+void
+rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
+{
+	if (pool) {
+		g_hash_table_unref (pool->elts_by_key);
+		g_hash_table_unref (pool->elts_by_ctx);
+		g_slice_free1 (sizeof (*pool), pool);
+	}
+}
+
+#else /* WITH_HIREDIS */
+
+struct rspamd_redis_pool *
+rspamd_redis_pool_init (void)
+{
+	return NULL;
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	return NULL;
+}
+
+void
+rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal)
+{
+}
+
+void
+rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
+{
+}
+
+#endif /* WITH_HIREDIS */
@@ -0,0 +1,73 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_REDIS_POOL_H_
+#define SRC_LIBSERVER_REDIS_POOL_H_
+
+#include "config.h"
+#include <event.h>
+
+/**
+ * @file redis_pool.h
+ *
+ * Pool of persistent asynchronous redis connections. Connections are grouped
+ * by server, database, password and event base, AUTH and SELECT are sent only
+ * once when a connection is established. Released connections are kept idle
+ * for some time and reused by the subsequent requests
+ */
+
+struct rspamd_redis_pool;
+struct redisAsyncContext;
+
+/**
+ * Create new redis pool
+ * @return
+ */
+struct rspamd_redis_pool *rspamd_redis_pool_init (void);
+
+/**
+ * Get an authenticated connection from the pool or create a new one
+ * @param pool
+ * @param ev_base event base the connection is attached to
+ * @param db optional database
+ * @param password optional password
+ * @param ip server address
+ * @param port server port
+ * @return connection or NULL
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect (
+		struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
+/**
+ * Return connection to the pool. Connections with errors or pending replies
+ * as well as connections released with `is_fatal` are closed, so all their
+ * pending callbacks are called with NULL replies
+ * @param pool
+ * @param ctx connection obtained by `rspamd_redis_pool_connect`
+ * @param is_fatal close connection instead of reusing
+ */
+void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal);
+
+/**
+ * Close all connections and destroy the pool
+ * @param pool
+ */
+void rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool);
+
+#endif /* SRC_LIBSERVER_REDIS_POOL_H_ */
@@ -0,0 +1,359 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "result_cache.h"
+#include "rspamd.h"
+#include "filter.h"
+#include "symbols_cache.h"
+#include "cryptobox.h"
+#include "libutil/shared_cache.h"
+
+#define RSPAMD_RESULT_CACHE_KEYLEN 16
+#define RSPAMD_RESULT_CACHE_VAR "result_cache_key"
+
+/*
+ * Each symbol is stored as a header followed by its name and options, every
+ * option is prefixed by guint16 length. Records are not aligned.
+ */
+struct rspamd_result_cache_sym {
+	gdouble score;
+	guint16 nlen;
+	guint16 nopts;
+};
+
+/*
+ * Headers added by relays differ between copies of the same message but they
+ * cannot change how it is parsed
+ */
+static const gchar *rspamd_result_cache_trace_headers[] = {
+	"Received",
+	"Return-Path",
+	"Delivered-To",
+	"X-Original-To",
+	"Envelope-To",
+	"Received-SPF",
+	"Authentication-Results",
+	"ARC-Seal",
+	"ARC-Message-Signature",
+	"ARC-Authentication-Results",
+	NULL
+};
+
+static gboolean
+rspamd_result_cache_is_trace (const gchar *name, gsize len)
+{
+	const gchar **cur;
+
+	while (len > 0 && g_ascii_isspace (name[len - 1])) {
+		len --;
+	}
+
+	for (cur = rspamd_result_cache_trace_headers; *cur != NULL; cur ++) {
+		if (strlen (*cur) == len && g_ascii_strncasecmp (*cur, name, len) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Hashes raw headers in their order skipping trace headers with their
+ * continuation lines, so MIME headers that define how the body is parsed
+ * are always included in the key
+ */
+static void
+rspamd_result_cache_hash_headers (rspamd_cryptobox_hash_state_t *st,
+		const gchar *p, const gchar *end)
+{
+	const gchar *eol, *colon;
+	gboolean skip = FALSE;
+
+	while (p < end) {
+		eol = memchr (p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+
+		if (*p != ' ' && *p != '\t') {
+			colon = memchr (p, ':', eol - p);
+			skip = colon != NULL && rspamd_result_cache_is_trace (p, colon - p);
+		}
+
+		if (!skip) {
+			rspamd_cryptobox_hash_update (st, p, eol - p);
+		}
+
+		p = eol;
+	}
+}
+
+static gboolean
+rspamd_result_cache_key (struct rspamd_task *task, guchar *key)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar out[rspamd_cryptobox_HASHBYTES];
+	const gchar *body, *end;
+	guint32 *settings_hash, sh = 0;
+
+	if (task->raw_headers_content.len == 0 || task->msg.len == 0) {
+		return FALSE;
+	}
+
+	body = task->raw_headers_content.begin + task->raw_headers_content.len;
+	end = task->msg.begin + task->msg.len;
+
+	if (body < task->msg.begin || body >= end) {
+		return FALSE;
+	}
+
+	settings_hash = rspamd_mempool_get_variable (task->task_pool,
+			"settings_hash");
+
+	if (settings_hash) {
+		sh = *settings_hash;
+	}
+	else if (task->settings) {
+		/* Settings are selected by some other data, e.g. recipients */
+		return FALSE;
+	}
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_result_cache_hash_headers (&st, task->raw_headers_content.begin,
+			body);
+	rspamd_cryptobox_hash_update (&st, body, end - body);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&sh, sizeof (sh));
+
+	if (task->cfg->checksum) {
+		rspamd_cryptobox_hash_update (&st, task->cfg->checksum,
+				strlen (task->cfg->checksum));
+	}
+
+	rspamd_cryptobox_hash_final (&st, out);
+	memcpy (key, out, RSPAMD_RESULT_CACHE_KEYLEN);
+
+	return TRUE;
+}
+
+static gchar *
+rspamd_result_cache_strdup (struct rspamd_task *task, const guchar *p,
+		gsize len)
+{
+	gchar *res;
+
+	res = rspamd_mempool_alloc (task->task_pool, len + 1);
+	memcpy (res, p, len);
+	res[len] = '\0';
+
+	return res;
+}
+
+static gboolean
+rspamd_result_cache_restore (struct rspamd_task *task, const guchar *data,
+		gsize len)
+{
+	struct rspamd_result_cache_sym hdr;
+	const guchar *p = data, *end = data + len;
+	gpointer orig_name;
+	gchar *name;
+	GList *opts;
+	guint16 olen;
+	guint i;
+
+	while (p < end) {
+		if (end - p < (gssize)sizeof (hdr)) {
+			return FALSE;
+		}
+
+		memcpy (&hdr, p, sizeof (hdr));
+		p += sizeof (hdr);
+
+		if (end - p < hdr.nlen) {
+			return FALSE;
+		}
+
+		/* Prefer names from config, they are used as long living keys */
+		name = rspamd_result_cache_strdup (task, p, hdr.nlen);
+		p += hdr.nlen;
+
+		if (g_hash_table_lookup_extended (task->cfg->default_metric->symbols,
+				name, &orig_name, NULL)) {
+			name = orig_name;
+		}
+
+		opts = NULL;
+
+		for (i = 0; i < hdr.nopts; i ++) {
+			if (end - p < (gssize)sizeof (olen)) {
+				g_list_free (opts);
+				return FALSE;
+			}
+
+			memcpy (&olen, p, sizeof (olen));
+			p += sizeof (olen);
+
+			if (end - p < olen) {
+				g_list_free (opts);
+				return FALSE;
+			}
+
+			opts = g_list_prepend (opts,
+					rspamd_result_cache_strdup (task, p, olen));
+			p += olen;
+		}
+
+		rspamd_task_insert_result_score (task, name, hdr.score,
+				g_list_reverse (opts));
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_result_cache_lookup (struct rspamd_task *task)
+{
+	struct rspamd_config *cfg = task->cfg;
+	guchar *key;
+	gpointer data;
+	gsize vlen;
+	GList *cur;
+
+	if (cfg->result_cache == NULL || RSPAMD_TASK_IS_EMPTY (task) ||
+			RSPAMD_TASK_IS_SKIPPED (task) ||
+			(task->flags & (RSPAMD_TASK_FLAG_LEARN_SPAM|
+					RSPAMD_TASK_FLAG_LEARN_HAM|RSPAMD_TASK_FLAG_PASS_ALL))) {
+		return FALSE;
+	}
+
+	key = rspamd_mempool_alloc (task->task_pool, RSPAMD_RESULT_CACHE_KEYLEN);
+
+	if (!rspamd_result_cache_key (task, key)) {
+		return FALSE;
+	}
+
+	data = rspamd_shared_cache_lookup (cfg->result_cache, key,
+			RSPAMD_RESULT_CACHE_KEYLEN, time (NULL), &vlen);
+
+	if (data == NULL) {
+		/* Results are stored after filters */
+		rspamd_mempool_set_variable (task->task_pool, RSPAMD_RESULT_CACHE_VAR,
+				key, NULL);
+
+		return FALSE;
+	}
+
+	if (!rspamd_result_cache_restore (task, data, vlen)) {
+		msg_err_task ("cannot restore cached result: bad element length %z",
+				vlen);
+		g_free (data);
+		/* Replace broken element */
+		rspamd_mempool_set_variable (task->task_pool, RSPAMD_RESULT_CACHE_VAR,
+				key, NULL);
+
+		return FALSE;
+	}
+
+	g_free (data);
+	rspamd_symbols_cache_disable_content (task, cfg->cache);
+
+	cur = cfg->result_cache_symbols;
+
+	while (cur) {
+		rspamd_symbols_cache_disable_symbol (task, cfg->cache, cur->data);
+		cur = g_list_next (cur);
+	}
+
+	task->flags |= RSPAMD_TASK_FLAG_CACHED_RESULT;
+	msg_debug_task ("restored content results from cache");
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_result_cache_is_content (struct rspamd_config *cfg,
+		const gchar *symbol)
+{
+	GList *cur;
+
+	if (rspamd_symbols_cache_is_content (cfg->cache, symbol)) {
+		return TRUE;
+	}
+
+	cur = cfg->result_cache_symbols;
+
+	while (cur) {
+		if (strcmp (cur->data, symbol) == 0) {
+			return TRUE;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	return FALSE;
+}
+
+void
+rspamd_result_cache_store (struct rspamd_task *task)
+{
+	struct rspamd_config *cfg = task->cfg;
+	struct rspamd_result_cache_sym hdr;
+	struct metric_result *mres;
+	struct symbol *s;
+	GByteArray *buf;
+	guchar *key;
+	GList *cur;
+	gsize olen;
+	guint16 len16;
+	guint i;
+
+	key = rspamd_mempool_get_variable (task->task_pool, RSPAMD_RESULT_CACHE_VAR);
+
+	if (key == NULL || cfg->result_cache == NULL || task->err != NULL) {
+		return;
+	}
+
+	mres = g_hash_table_lookup (task->results, cfg->default_metric->name);
+	buf = g_byte_array_new ();
+
+	for (i = 0; mres != NULL && i < mres->symbols->len; i ++) {
+		s = g_ptr_array_index (mres->symbols, i);
+
+		if (!rspamd_result_cache_is_content (cfg, s->name)) {
+			continue;
+		}
+
+		hdr.score = s->score;
+		hdr.nlen = MIN (strlen (s->name), G_MAXUINT16);
+		hdr.nopts = MIN (g_list_length (s->options), G_MAXUINT16);
+		g_byte_array_append (buf, (const guint8 *)&hdr, sizeof (hdr));
+		g_byte_array_append (buf, s->name, hdr.nlen);
+
+		cur = s->options;
+
+		while (cur && hdr.nopts > 0) {
+			olen = strlen (cur->data);
+			len16 = MIN (olen, G_MAXUINT16);
+			g_byte_array_append (buf, (const guint8 *)&len16, sizeof (len16));
+			g_byte_array_append (buf, cur->data, len16);
+			cur = g_list_next (cur);
+			hdr.nopts --;
+		}
+	}
+
+	/* Even empty results are stored, as missing symbols are results too */
+	rspamd_shared_cache_insert (cfg->result_cache, key,
+			RSPAMD_RESULT_CACHE_KEYLEN, buf->data, buf->len, time (NULL),
+			cfg->result_cache_ttl);
+	g_byte_array_free (buf, TRUE);
+}
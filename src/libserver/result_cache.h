@@ -0,0 +1,50 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_RESULT_CACHE_H_
+#define SRC_LIBSERVER_RESULT_CACHE_H_
+
+#include "config.h"
+
+/**
+ * @file result_cache.h
+ *
+ * Cache of results for identical messages. Campaigns usually send the same
+ * message to many recipients, so results of symbols that depend merely on the
+ * content (fuzzy hashes and URL blacklists) are stored in a shared cache keyed
+ * by the digest of the message without trace headers, settings id and config
+ * checksum. On a hit these symbols are restored and their callbacks are not
+ * executed, the rest of symbols (e.g. SPF or DKIM) and classifiers are
+ * checked as usual
+ */
+
+struct rspamd_task;
+
+/**
+ * Lookup content results for the task and restore them on a hit, it must be
+ * called before any filters are processed
+ * @param task task object
+ * @return TRUE if cached results have been restored
+ */
+gboolean rspamd_result_cache_lookup (struct rspamd_task *task);
+
+/**
+ * Store content results of the task if it has been checked by lookup and
+ * there was no cached results for it
+ * @param task task object
+ */
+void rspamd_result_cache_store (struct rspamd_task *task);
+
+#endif /* SRC_LIBSERVER_RESULT_CACHE_H_ */
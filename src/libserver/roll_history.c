@@ -43,25 +43,6 @@ rspamd_roll_history_new (rspamd_mempool_t *pool, guint max_rows)
 	return new;
 }
 
-struct history_metric_callback_data {
-	gchar *pos;
-	gint remain;
-};
-
-static void
-roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
-{
-	struct history_metric_callback_data *cb = user_data;
-	struct symbol *s = value;
-	guint wr;
-
-	if (cb->remain > 0) {
-		wr = rspamd_snprintf (cb->pos, cb->remain, "%s, ", s->name);
-		cb->pos += wr;
-		cb->remain -= wr;
-	}
-}
-
 /**
  * Update roll history with data from task
  * @param history roll history object
@@ -71,28 +52,19 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	guint row_num;
+	guint seq, i;
 	struct roll_history_row *row;
 	struct metric_result *metric_res;
-	struct history_metric_callback_data cbdata;
+	struct symbol *s;
 
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, history->nrows, 0);
+	/* Obtain sequence number and the row, no locking is required */
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
+	seq = g_atomic_int_add (&history->seq, 1);
 #else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
+	seq = g_atomic_int_exchange_and_add ((gint *)&history->seq, 1);
 #endif
-
-	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set (&row->completed, FALSE);
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
-		return;
-	}
+	row = &history->rows[seq % history->nrows];
+	g_atomic_int_set (&row->seq, 0);
 
 	/* Add information from task to roll history */
 	if (task->from_addr) {
@@ -110,7 +82,7 @@ rspamd_roll_history_update (struct roll_history *history,
 	rspamd_strlcpy (row->message_id, task->message_id,
 		sizeof (row->message_id));
 	if (task->user) {
-		rspamd_strlcpy (row->user, task->user, sizeof (row->message_id));
+		rspamd_strlcpy (row->user, task->user, sizeof (row->user));
 	}
 	else {
 		row->user[0] = '\0';
@@ -118,30 +90,127 @@ rspamd_roll_history_update (struct roll_history *history,
 
 	/* Get default metric */
 	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+	row->nsymbols = 0;
+
 	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
 		row->action = METRIC_ACTION_NOACTION;
+		row->score = 0;
+		row->required_score = 0;
 	}
 	else {
 		row->score = metric_res->score;
 		row->action = rspamd_check_action_metric (task, metric_res);
 		row->required_score = metric_res->actions_limits[METRIC_ACTION_REJECT];
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof (row->symbols);
-		g_hash_table_foreach (metric_res->symbols,
-			roll_history_symbols_callback,
-			&cbdata);
-		if (cbdata.remain > 0) {
-			/* Remove last whitespace and comma */
-			*cbdata.pos-- = '\0';
-			*cbdata.pos-- = '\0';
-			*cbdata.pos = '\0';
+		/* Symbols are stored as ids to avoid strings copying */
+		for (i = 0; i < metric_res->symbols->len &&
+				row->nsymbols < G_N_ELEMENTS (row->symbols); i ++) {
+			s = g_ptr_array_index (metric_res->symbols, i);
+
+			if (s->id >= 0) {
+				row->symbols[row->nsymbols ++] = s->id;
+			}
 		}
 	}
 
 	row->scan_time = rspamd_get_ticks () - task->time_real;
 	row->len = task->msg.len;
-	g_atomic_int_set (&row->completed, TRUE);
+	g_atomic_int_set (&row->seq, seq + 1);
+}
+
+GArray *
+rspamd_roll_history_copy (struct roll_history *history,
+	guint since, guint *next)
+{
+	GArray *res;
+	struct roll_history_row *row, copy;
+	guint end, start, seq;
+
+	end = g_atomic_int_get (&history->seq);
+
+	/* Unknown sequence (e.g. from the previous run) means all rows */
+	if (since > end) {
+		since = 0;
+	}
+
+	start = end > history->nrows ? end - history->nrows : 0;
+	start = MAX (start, since);
+	res = g_array_sized_new (FALSE, FALSE, sizeof (copy), end - start);
+
+	for (seq = start; seq < end; seq ++) {
+		row = &history->rows[seq % history->nrows];
+
+		if (g_atomic_int_get (&row->seq) != seq + 1) {
+			/* Row is being written or has been overwritten */
+			continue;
+		}
+
+		memcpy (&copy, row, sizeof (copy));
+
+		if (g_atomic_int_get (&row->seq) == seq + 1) {
+			g_array_append_val (res, copy);
+		}
+	}
+
+	if (next) {
+		*next = end;
+	}
+
+	return res;
+}
+
+void
+rspamd_roll_history_reset (struct roll_history *history)
+{
+	guint i;
+
+	for (i = 0; i < history->nrows; i ++) {
+		g_atomic_int_set (&history->rows[i].seq, 0);
+	}
+}
+
+void
+rspamd_roll_history_symbols_str (const struct roll_history_row *row,
+		struct symbols_cache *cache, GString *out)
+{
+	const gchar *sym;
+	guint i;
+
+	g_string_truncate (out, 0);
+
+	for (i = 0; i < row->nsymbols && cache != NULL; i ++) {
+		sym = rspamd_symbols_cache_symbol_by_id (cache, row->symbols[i]);
+
+		if (sym) {
+			if (out->len > 0) {
+				g_string_append_len (out, ", ", 2);
+			}
+
+			g_string_append (out, sym);
+		}
+	}
+}
+
+static void
+rspamd_roll_history_parse_symbols (struct roll_history_row *row,
+		const gchar *str, struct symbols_cache *cache)
+{
+	gchar **syms, **cur;
+	gint id;
+
+	syms = g_strsplit_set (str, ", ", -1);
+
+	for (cur = syms; *cur != NULL &&
+			row->nsymbols < G_N_ELEMENTS (row->symbols); cur ++) {
+		if (**cur != '\0') {
+			id = rspamd_symbols_cache_find_symbol (cache, *cur);
+
+			if (id >= 0) {
+				row->symbols[row->nsymbols ++] = id;
+			}
+		}
+	}
+
+	g_strfreev (syms);
 }
 
 /**
@@ -151,7 +220,8 @@ rspamd_roll_history_update (struct roll_history *history,
  * @return TRUE if history has been loaded
  */
 gboolean
-rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
+rspamd_roll_history_load (struct roll_history *history, const gchar *filename,
+		struct symbols_cache *cache)
 {
 	gint fd;
 	struct stat st;
@@ -253,9 +323,9 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 
 			elt = ucl_object_lookup (cur, "symbols");
 
-			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->symbols, ucl_object_tostring (elt),
-						sizeof (row->symbols));
+			if (elt && ucl_object_type (elt) == UCL_STRING && cache) {
+				rspamd_roll_history_parse_symbols (row, ucl_object_tostring (elt),
+						cache);
 			}
 
 			elt = ucl_object_lookup (cur, "user");
@@ -302,13 +372,13 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 				row->action = ucl_object_toint (elt);
 			}
 
-			row->completed = TRUE;
+			row->seq = i + 1;
 		}
 	}
 
 	ucl_object_unref (top);
 
-	history->cur_row = n;
+	history->seq = n;
 
 	return TRUE;
 }
@@ -320,13 +390,16 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
  * @return TRUE if history has been saved
  */
 gboolean
-rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
+rspamd_roll_history_save (struct roll_history *history, const gchar *filename,
+		struct symbols_cache *cache)
 {
 	gint fd;
 	ucl_object_t *obj, *elt;
 	guint i;
 	struct roll_history_row *row;
 	struct ucl_emitter_functions *emitter_func;
+	GArray *rows;
+	GString *syms;
 
 	g_assert (history != NULL);
 
@@ -336,21 +409,19 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 	}
 
 	obj = ucl_object_typed_new (UCL_ARRAY);
+	rows = rspamd_roll_history_copy (history, 0, NULL);
+	syms = g_string_sized_new (128);
 
-	for (i = 0; i < history->nrows; i ++) {
-		row = &history->rows[i];
-
-		if (!row->completed) {
-			continue;
-		}
-
+	for (i = 0; i < rows->len; i ++) {
+		row = &g_array_index (rows, struct roll_history_row, i);
+		rspamd_roll_history_symbols_str (row, cache, syms);
 		elt = ucl_object_typed_new (UCL_OBJECT);
 
 		ucl_object_insert_key (elt, ucl_object_fromdouble (
 				tv_to_double (&row->tv)), "time", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromstring (row->message_id),
 				"id", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromstring (row->symbols),
+		ucl_object_insert_key (elt, ucl_object_fromstring (syms->str),
 				"symbols", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromstring (row->user),
 				"user", 0, false);
@@ -370,6 +441,9 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 		ucl_array_append (obj, elt);
 	}
 
+	g_array_free (rows, TRUE);
+	g_string_free (syms, TRUE);
+
 	emitter_func = ucl_object_emit_fd_funcs (fd);
 	ucl_object_emit_full (obj, UCL_EMIT_JSON_COMPACT, emitter_func, NULL);
 	ucl_object_emit_funcs_free (emitter_func);
@@ -25,16 +25,16 @@
  */
 
 #define HISTORY_MAX_ID 64
-#define HISTORY_MAX_SYMBOLS 128
+#define HISTORY_MAX_SYMBOLS 64
 #define HISTORY_MAX_USER 32
 #define HISTORY_MAX_ADDR 32
 
 struct rspamd_task;
+struct symbols_cache;
 
 struct roll_history_row {
 	struct timeval tv;
 	gchar message_id[HISTORY_MAX_ID];
-	gchar symbols[HISTORY_MAX_SYMBOLS];
 	gchar user[HISTORY_MAX_USER];
 	gchar from_addr[HISTORY_MAX_ADDR];
 	gsize len;
@@ -42,13 +42,20 @@ struct roll_history_row {
 	gdouble score;
 	gdouble required_score;
 	gint action;
-	guint completed;
+	guint nsymbols;
+	guint32 symbols[HISTORY_MAX_SYMBOLS];           /**< ids of symbols in the symbols cache	*/
+	guint seq;                                      /**< sequence number + 1, 0 while row is being written */
 };
 
+/*
+ * Rows are written by many processes without locking: each writer takes the
+ * next sequence number atomically and writes row `seq % nrows`, readers
+ * check that row sequence is the same before and after copying it
+ */
 struct roll_history {
 	struct roll_history_row *rows;
 	guint nrows;
-	guint cur_row;
+	guint seq;                                      /**< sequence number of the next row		*/
 };
 
 /**
@@ -67,22 +74,50 @@ struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool,
 void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
+/**
+ * Copy completed rows with sequence numbers starting from `since`
+ * @param history roll history object
+ * @param since the first sequence number needed (0 for all rows)
+ * @param next output sequence number of the next row to be written
+ * @return array of `struct roll_history_row` ordered by sequence numbers
+ * (must be freed by a caller)
+ */
+GArray * rspamd_roll_history_copy (struct roll_history *history,
+	guint since, guint *next);
+
+/**
+ * Write comma separated names of row's symbols to `out`
+ * @param row history row
+ * @param cache symbols cache used to convert symbols ids to names
+ * @param out output string (truncated first)
+ */
+void rspamd_roll_history_symbols_str (const struct roll_history_row *row,
+	struct symbols_cache *cache, GString *out);
+
+/**
+ * Remove all rows from history (sequence numbers are not reset)
+ * @param history roll history object
+ */
+void rspamd_roll_history_reset (struct roll_history *history);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
  * @param filename filename to load from
+ * @param cache symbols cache used to convert symbols names to ids
  * @return TRUE if history has been loaded
  */
 gboolean rspamd_roll_history_load (struct roll_history *history,
-	const gchar *filename);
+	const gchar *filename, struct symbols_cache *cache);
 
 /**
  * Save history to file
  * @param history roll history object
  * @param filename filename to load from
+ * @param cache symbols cache used to convert symbols ids to names
  * @return TRUE if history has been saved
  */
 gboolean rspamd_roll_history_save (struct roll_history *history,
-	const gchar *filename);
+	const gchar *filename, struct symbols_cache *cache);
 
 #endif /* ROLL_HISTORY_H_ */
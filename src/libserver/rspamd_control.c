@@ -32,6 +32,11 @@ static struct timeval worker_io_timeout = {
 		.tv_sec = 0,
 		.tv_usec = 500000
 };
+/* How often main checks acks of a shared broadcast */
+static struct timeval bcast_check_interval = {
+		.tv_sec = 0,
+		.tv_usec = 10000
+};
 
 struct rspamd_control_session;
 
@@ -41,6 +46,7 @@ struct rspamd_control_reply_elt {
 	struct rspamd_worker *wrk;
 	gpointer ud;
 	gint attached_fd;
+	gboolean shared;
 	struct rspamd_control_reply_elt *prev, *next;
 };
 
@@ -52,6 +58,9 @@ struct rspamd_control_session {
 	struct rspamd_control_reply_elt *replies;
 	guint replies_remain;
 	gboolean is_reply;
+	gboolean bcast_pending;
+	gdouble bcast_deadline;
+	struct event bcast_ev;
 };
 
 static const struct rspamd_control_cmd_match {
@@ -160,10 +169,18 @@ rspamd_control_connection_close (struct rspamd_control_session *session)
 	struct rspamd_control_reply_elt *elt, *telt;
 
 	DL_FOREACH_SAFE (session->replies, elt, telt) {
-		event_del (&elt->io_ev);
+		if (!elt->shared) {
+			event_del (&elt->io_ev);
+		}
+
 		g_slice_free1 (sizeof (*elt), elt);
 	}
 
+	if (session->bcast_pending) {
+		event_del (&session->bcast_ev);
+		session->rspamd_main->control_bcast->busy = FALSE;
+	}
+
 	rspamd_http_connection_unref (session->conn);
 	close (session->fd);
 	g_slice_free1 (sizeof (*session), session);
@@ -371,6 +388,48 @@ rspamd_control_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+static gboolean
+rspamd_control_send_cmd (struct rspamd_worker *wrk,
+		struct rspamd_control_command *cmd,
+		gint attached_fd)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	gssize r;
+
+	memset (&msg, 0, sizeof (msg));
+
+	/* Attach fd to the message */
+	if (attached_fd != -1) {
+		memset (fdspace, 0, sizeof (fdspace));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cmsg), &attached_fd, sizeof (int));
+	}
+
+	iov.iov_base = cmd;
+	iov.iov_len = sizeof (*cmd);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	r = sendmsg (wrk->control_pipe[0], &msg, 0);
+
+	if (r != sizeof (*cmd)) {
+		msg_err ("cannot write request to the worker %P (%s): %s",
+				wrk->pid, g_quark_to_string (wrk->type), strerror (errno));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static struct rspamd_control_reply_elt *
 rspamd_control_broadcast_cmd (struct rspamd_main *rspamd_main,
 		struct rspamd_control_command *cmd,
@@ -381,40 +440,13 @@ rspamd_control_broadcast_cmd (struct rspamd_main *rspamd_main,
 	struct rspamd_worker *wrk;
 	struct rspamd_control_reply_elt *rep_elt, *res = NULL;
 	gpointer k, v;
-	struct msghdr msg;
-	struct cmsghdr *cmsg;
-	struct iovec iov;
-	guchar fdspace[CMSG_SPACE(sizeof (int))];
-	gssize r;
 
 	g_hash_table_iter_init (&it, rspamd_main->workers);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		wrk = v;
 
-		memset (&msg, 0, sizeof (msg));
-
-		/* Attach fd to the message */
-		if (attached_fd != -1) {
-			memset (fdspace, 0, sizeof (fdspace));
-			msg.msg_control = fdspace;
-			msg.msg_controllen = sizeof (fdspace);
-			cmsg = CMSG_FIRSTHDR (&msg);
-			cmsg->cmsg_level = SOL_SOCKET;
-			cmsg->cmsg_type = SCM_RIGHTS;
-			cmsg->cmsg_len = CMSG_LEN (sizeof (int));
-			memcpy (CMSG_DATA (cmsg), &attached_fd, sizeof (int));
-		}
-
-		iov.iov_base = cmd;
-		iov.iov_len = sizeof (*cmd);
-		msg.msg_iov = &iov;
-		msg.msg_iovlen = 1;
-
-		r = sendmsg (wrk->control_pipe[0], &msg, 0);
-
-		if (r == sizeof (*cmd)) {
-
+		if (rspamd_control_send_cmd (wrk, cmd, attached_fd)) {
 			rep_elt = g_slice_alloc0 (sizeof (*rep_elt));
 			rep_elt->wrk = wrk;
 			rep_elt->ud = ud;
@@ -427,13 +459,127 @@ rspamd_control_broadcast_cmd (struct rspamd_main *rspamd_main,
 
 			DL_APPEND (res, rep_elt);
 		}
+	}
+
+	return res;
+}
+
+static inline gboolean
+rspamd_control_bcast_acked (struct rspamd_control_bcast *bc, gint slot)
+{
+	return (g_atomic_int_get (&bc->acks[slot / 32]) & (1u << (slot % 32))) != 0;
+}
+
+static void
+rspamd_control_bcast_check (gint fd, short what, gpointer ud)
+{
+	struct rspamd_control_session *session = ud;
+	struct rspamd_control_bcast *bc = session->rspamd_main->control_bcast;
+	struct rspamd_control_reply_elt *elt;
+	gboolean finished = TRUE;
+
+	DL_FOREACH (session->replies, elt) {
+		if (!rspamd_control_bcast_acked (bc, elt->wrk->control_slot)) {
+			finished = FALSE;
+			break;
+		}
+	}
+
+	if (!finished && rspamd_get_ticks () < session->bcast_deadline) {
+		evtimer_add (&session->bcast_ev, &bcast_check_interval);
+
+		return;
+	}
+
+	DL_FOREACH (session->replies, elt) {
+		if (rspamd_control_bcast_acked (bc, elt->wrk->control_slot)) {
+			memcpy (&elt->reply, &bc->replies[elt->wrk->control_slot],
+					sizeof (elt->reply));
+		}
 		else {
-			msg_err ("cannot write request to the worker %P (%s): %s",
-					wrk->pid, g_quark_to_string (wrk->type), strerror (errno));
+			msg_warn ("timeout waiting reply from %P (%s)",
+					elt->wrk->pid, g_quark_to_string (elt->wrk->type));
 		}
 	}
 
-	return res;
+	/* Late replies are ignored as workers check sequence number */
+	bc->busy = FALSE;
+	session->bcast_pending = FALSE;
+	session->replies_remain = 0;
+	rspamd_control_write_reply (session);
+}
+
+/*
+ * Sends command via shared slot, so replies are collected from the shared
+ * memory by a single timer. Returns FALSE if the slot cannot be used and the
+ * command should be sent to each worker in the usual way
+ */
+static gboolean
+rspamd_control_broadcast_shared (struct rspamd_control_session *session)
+{
+	struct rspamd_main *rspamd_main = session->rspamd_main;
+	struct rspamd_control_bcast *bc = rspamd_main->control_bcast;
+	struct rspamd_control_command wcmd;
+	struct rspamd_control_reply_elt *rep_elt;
+	struct rspamd_worker *wrk;
+	GHashTableIter it;
+	gpointer k, v;
+	static guint seq = 0;
+
+	if (bc == NULL || bc->busy) {
+		return FALSE;
+	}
+
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		wrk = v;
+
+		if (wrk->control_slot < 0) {
+			return FALSE;
+		}
+	}
+
+	if (++seq == 0) {
+		seq = 1;
+	}
+
+	bc->busy = TRUE;
+	memset (bc->acks, 0, sizeof (bc->acks));
+	memset (bc->replies, 0, sizeof (bc->replies));
+	memcpy (&bc->cmd, &session->cmd, sizeof (bc->cmd));
+	/* Full barrier: workers must see the command before the new sequence */
+	g_atomic_int_set (&bc->seq, seq);
+
+	memset (&wcmd, 0, sizeof (wcmd));
+	wcmd.type = RSPAMD_CONTROL_BROADCAST;
+	wcmd.cmd.bcast.seq = seq;
+
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		wrk = v;
+
+		if (rspamd_control_send_cmd (wrk, &wcmd, -1)) {
+			rep_elt = g_slice_alloc0 (sizeof (*rep_elt));
+			rep_elt->wrk = wrk;
+			rep_elt->ud = session;
+			rep_elt->attached_fd = -1;
+			rep_elt->reply.type = session->cmd.type;
+			rep_elt->shared = TRUE;
+
+			DL_APPEND (session->replies, rep_elt);
+		}
+	}
+
+	session->bcast_pending = TRUE;
+	session->bcast_deadline = rspamd_get_ticks () +
+			tv_to_double (&worker_io_timeout);
+	evtimer_set (&session->bcast_ev, rspamd_control_bcast_check, session);
+	event_base_set (rspamd_main->ev_base, &session->bcast_ev);
+	evtimer_add (&session->bcast_ev, &bcast_check_interval);
+
+	return TRUE;
 }
 
 static gint
@@ -470,8 +616,9 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		if (!found) {
 			rspamd_control_send_error (session, 404, "Command not defined");
 		}
-		else {
-			/* Send command to all workers */
+		else if (session->cmd.type == RSPAMD_CONTROL_FUZZY_STAT ||
+				!rspamd_control_broadcast_shared (session)) {
+			/* Fuzzy stat replies carry descriptors, so use control pipes */
 			session->replies = rspamd_control_broadcast_cmd (
 					session->rspamd_main, &session->cmd, -1,
 					rspamd_control_wrk_io, session);
@@ -513,6 +660,7 @@ struct rspamd_worker_control_data {
 		rspamd_worker_control_handler handler;
 		gpointer ud;
 	} handlers[RSPAMD_CONTROL_MAX];
+	guint bcast_seq;
 };
 
 static void
@@ -572,18 +720,40 @@ rspamd_control_default_cmd_handler (gint fd,
 		break;
 	}
 
-	r = write (fd, &rep, sizeof (rep));
-
-	if (r != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
-	}
+	rspamd_control_worker_reply (cd->worker, fd, &rep);
 
 	if (attached_fd != -1) {
 		close (attached_fd);
 	}
 }
 
+void
+rspamd_control_worker_reply (struct rspamd_worker *worker,
+		gint fd,
+		struct rspamd_control_reply *rep)
+{
+	struct rspamd_worker_control_data *cd = worker->control_data;
+	struct rspamd_control_bcast *bc = worker->srv->control_bcast;
+	gint slot = worker->control_slot;
+
+	if (cd != NULL && cd->bcast_seq != 0) {
+		/* Main has already started another command if sequence differs */
+		if (g_atomic_int_get (&bc->seq) == cd->bcast_seq) {
+			memcpy (&bc->replies[slot], rep, sizeof (*rep));
+			g_atomic_int_or (&bc->acks[slot / 32], 1u << (slot % 32));
+		}
+
+		cd->bcast_seq = 0;
+
+		return;
+	}
+
+	if (write (fd, rep, sizeof (*rep)) != sizeof (*rep)) {
+		msg_err ("cannot write reply to the control socket: %s",
+				strerror (errno));
+	}
+}
+
 static void
 rspamd_control_default_worker_handler (gint fd, short what, gpointer ud)
 {
@@ -592,6 +762,7 @@ rspamd_control_default_worker_handler (gint fd, short what, gpointer ud)
 	struct msghdr msg;
 	struct iovec iov;
 	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	struct rspamd_control_bcast *bc;
 	gint rfd = -1;
 	gssize r;
 
@@ -629,6 +800,32 @@ rspamd_control_default_worker_handler (gint fd, short what, gpointer ud)
 			rfd = *(int *) CMSG_DATA(CMSG_FIRSTHDR (&msg));
 		}
 
+		if (cmd.type == RSPAMD_CONTROL_BROADCAST) {
+			bc = cd->worker->srv->control_bcast;
+
+			if (bc == NULL || cd->worker->control_slot < 0 ||
+					g_atomic_int_get (&bc->seq) != cmd.cmd.bcast.seq) {
+				msg_info ("ignore stale broadcast command");
+
+				if (rfd != -1) {
+					close (rfd);
+				}
+
+				return;
+			}
+
+			/* Replies go to the shared slot until the next command */
+			cd->bcast_seq = cmd.cmd.bcast.seq;
+			memcpy (&cmd, &bc->cmd, sizeof (cmd));
+
+			if ((gint)cmd.type < 0 || cmd.type >= RSPAMD_CONTROL_BROADCAST) {
+				msg_err ("invalid broadcast command: %d", (gint)cmd.type);
+				cd->bcast_seq = 0;
+
+				return;
+			}
+		}
+
 		if (cd->handlers[cmd.type].handler) {
 			cd->handlers[cmd.type].handler (cd->worker->srv,
 					cd->worker,
@@ -812,6 +1009,12 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 				rspamd_control_broadcast_cmd (srv, &wcmd, rfd,
 						rspamd_control_log_pipe_io_handler, NULL);
 				break;
+			case RSPAMD_SRV_READY:
+				/* Main retires the previous generation once all are ready */
+				worker->ready = TRUE;
+				msg_info ("%s process %P is ready",
+						g_quark_to_string (worker->type), worker->pid);
+				break;
 			default:
 				msg_err ("unknown command type: %d", cmd.type);
 				break;
@@ -874,6 +1077,37 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 	}
 }
 
+struct rspamd_control_bcast *
+rspamd_control_bcast_new (rspamd_mempool_t *pool)
+{
+	return rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct rspamd_control_bcast));
+}
+
+gint
+rspamd_control_bcast_acquire (struct rspamd_control_bcast *bc)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_CONTROL_BCAST_SLOTS; i ++) {
+		if (!(bc->used[i / 32] & (1u << (i % 32)))) {
+			bc->used[i / 32] |= 1u << (i % 32);
+
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void
+rspamd_control_bcast_release (struct rspamd_control_bcast *bc, gint slot)
+{
+	if (slot >= 0 && slot < RSPAMD_CONTROL_BCAST_SLOTS) {
+		bc->used[slot / 32] &= ~(1u << (slot % 32));
+	}
+}
+
 void
 rspamd_srv_start_watching (struct rspamd_worker *worker,
 		struct event_base *ev_base)
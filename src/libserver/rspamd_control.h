@@ -32,6 +32,7 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_LOG_PIPE,
 	RSPAMD_CONTROL_FUZZY_STAT,
 	RSPAMD_CONTROL_FUZZY_SYNC,
+	RSPAMD_CONTROL_BROADCAST,
 	RSPAMD_CONTROL_MAX
 };
 
@@ -39,10 +40,12 @@ enum rspamd_srv_type {
 	RSPAMD_SRV_SOCKETPAIR = 0,
 	RSPAMD_SRV_HYPERSCAN_LOADED,
 	RSPAMD_SRV_LOG_PIPE,
+	RSPAMD_SRV_READY,
 };
 
 enum rspamd_log_pipe_type {
 	RSPAMD_LOG_PIPE_SYMBOLS = 0,
+	RSPAMD_LOG_PIPE_TASK,
 };
 
 struct rspamd_control_command {
@@ -73,6 +76,9 @@ struct rspamd_control_command {
 		struct {
 			guint unused;
 		} fuzzy_sync;
+		struct {
+			guint seq;
+		} bcast;
 	} cmd;
 };
 
@@ -111,6 +117,25 @@ struct rspamd_control_reply {
 	} reply;
 };
 
+#define RSPAMD_CONTROL_BCAST_SLOTS 256
+
+/*
+ * Command slot shared by the main process and all workers. Main writes a
+ * command here and wakes workers with a short RSPAMD_CONTROL_BROADCAST
+ * message carrying the sequence number. Each worker copies the command, puts
+ * its reply to its own slot and sets the corresponding ack bit, so main
+ * collects all replies without reading from every control pipe
+ */
+struct rspamd_control_bcast {
+	guint seq;                                          /**< sequence of the current command (0 - none)	*/
+	struct rspamd_control_command cmd;                  /**< current command								*/
+	guint acks[RSPAMD_CONTROL_BCAST_SLOTS / 32];        /**< replies ready, set by workers				*/
+	struct rspamd_control_reply replies[RSPAMD_CONTROL_BCAST_SLOTS];
+	/* Used by main process only */
+	guint used[RSPAMD_CONTROL_BCAST_SLOTS / 32];        /**< slots owned by running workers				*/
+	gboolean busy;                                      /**< command is in progress						*/
+};
+
 #define PAIR_ID_LEN 16
 struct rspamd_srv_command {
 	enum rspamd_srv_type type;
@@ -128,6 +153,9 @@ struct rspamd_srv_command {
 		struct {
 			enum rspamd_log_pipe_type type;
 		} log_pipe;
+		struct {
+			guint unused;
+		} ready;
 	} cmd;
 };
 
@@ -178,6 +206,31 @@ void rspamd_control_worker_add_cmd_handler (struct rspamd_worker *worker,
 		rspamd_worker_control_handler handler,
 		gpointer ud);
 
+/**
+ * Send reply for a control command: to the shared broadcast slot if the
+ * command has been received via broadcast or to the control pipe otherwise
+ */
+void rspamd_control_worker_reply (struct rspamd_worker *worker,
+		gint fd,
+		struct rspamd_control_reply *rep);
+
+/**
+ * Allocate shared broadcast slot
+ * @param pool pool used for the shared allocation (must outlive all workers)
+ */
+struct rspamd_control_bcast *rspamd_control_bcast_new (rspamd_mempool_t *pool);
+
+/**
+ * Reserve a broadcast slot for a new worker (called by main before fork)
+ * @return slot number or -1 if there are no free slots
+ */
+gint rspamd_control_bcast_acquire (struct rspamd_control_bcast *bc);
+
+/**
+ * Release slot of a terminated worker
+ */
+void rspamd_control_bcast_release (struct rspamd_control_bcast *bc, gint slot);
+
 /**
  * Start watching on srv pipe
  */
@@ -236,6 +236,13 @@ rspamd_flatten_record_dtor (struct spf_resolved *r)
 		g_free (addr->spf_string);
 	}
 
+	if (r->trie4) {
+		radix_destroy_compressed (r->trie4);
+	}
+	if (r->trie6) {
+		radix_destroy_compressed (r->trie6);
+	}
+
 	g_free (r->domain);
 	g_array_free (r->elts, TRUE);
 	g_slice_free1 (sizeof (*r), r);
@@ -1874,3 +1881,324 @@ spf_record_unref (struct spf_resolved *rec)
 {
 	REF_RELEASE (rec);
 }
+
+/* Records with less elements are checked in order */
+#define SPF_TRIE_MIN_ELTS 16
+
+struct spf_trie_prefix {
+	guchar key[sizeof (struct in6_addr)];
+	guint bits;
+	guint idx;
+};
+
+static gboolean
+spf_addr_matches (struct spf_addr *addr, gint af, const guint8 *key,
+		guint klen)
+{
+	const guint8 *s;
+	guint mask, bmask;
+
+	if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
+			((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
+		if (af == AF_INET6) {
+			s = (const guint8 *)addr->addr6;
+			mask = addr->m.dual.mask_v6;
+		}
+		else {
+			s = (const guint8 *)addr->addr4;
+			mask = addr->m.dual.mask_v4;
+		}
+
+		bmask = mask / CHAR_BIT;
+
+		if (mask > klen * CHAR_BIT || memcmp (s, key, bmask) != 0) {
+			return FALSE;
+		}
+
+		if (bmask * CHAR_BIT != mask) {
+			mask = (0xff << (CHAR_BIT - (mask - bmask * CHAR_BIT))) & 0xff;
+
+			return (s[bmask] & mask) == (key[bmask] & mask);
+		}
+
+		return TRUE;
+	}
+
+	return (addr->flags & RSPAMD_SPF_FLAG_ANY) != 0;
+}
+
+static gint
+spf_trie_prefix_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct spf_trie_prefix *p1 = a, *p2 = b;
+	gint r;
+
+	if (p1->bits != p2->bits) {
+		return p1->bits < p2->bits ? -1 : 1;
+	}
+
+	r = memcmp (p1->key, p2->key, sizeof (p1->key));
+
+	if (r != 0) {
+		return r;
+	}
+
+	return p1->idx < p2->idx ? -1 : (p1->idx > p2->idx);
+}
+
+/*
+ * Addresses matching several prefixes are matched by a chain of nested
+ * prefixes, so each prefix stores the minimal index of itself and all its
+ * parents. Longest prefix match then returns the first matching element.
+ */
+static radix_compressed_t *
+spf_record_build_trie (struct spf_resolved *rec, gint af)
+{
+	radix_compressed_t *trie;
+	GArray *prefixes;
+	struct spf_trie_prefix pfx, *cur, *prev = NULL;
+	struct spf_addr *addr;
+	guint i, j, klen, flag, maxbits;
+	uintptr_t parent, val;
+
+	if (af == AF_INET6) {
+		klen = sizeof (struct in6_addr);
+		flag = RSPAMD_SPF_FLAG_IPV6;
+	}
+	else {
+		klen = sizeof (struct in_addr);
+		flag = RSPAMD_SPF_FLAG_IPV4;
+	}
+
+	maxbits = klen * CHAR_BIT;
+	prefixes = g_array_sized_new (FALSE, FALSE, sizeof (pfx), rec->elts->len);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		memset (&pfx, 0, sizeof (pfx));
+		pfx.idx = i;
+
+		if (addr->flags & flag) {
+			pfx.bits = af == AF_INET6 ? addr->m.dual.mask_v6 :
+					addr->m.dual.mask_v4;
+
+			if (pfx.bits > maxbits) {
+				/* Never matches */
+				continue;
+			}
+
+			memcpy (pfx.key, af == AF_INET6 ? addr->addr6 : addr->addr4, klen);
+
+			/* Clear host bits */
+			for (j = pfx.bits; j < maxbits; j ++) {
+				pfx.key[j / CHAR_BIT] &= ~(0x80 >> (j % CHAR_BIT));
+			}
+		}
+		else if (!(addr->flags & RSPAMD_SPF_FLAG_ANY)) {
+			continue;
+		}
+
+		g_array_append_val (prefixes, pfx);
+	}
+
+	g_array_sort (prefixes, spf_trie_prefix_cmp);
+	trie = radix_create_compressed ();
+
+	for (i = 0; i < prefixes->len; i ++) {
+		cur = &g_array_index (prefixes, struct spf_trie_prefix, i);
+
+		if (prev && prev->bits == cur->bits &&
+				memcmp (prev->key, cur->key, klen) == 0) {
+			/* Duplicate prefix with a greater index */
+			continue;
+		}
+
+		/* Only shorter prefixes have been inserted so far */
+		parent = radix_find_compressed (trie, cur->key, klen);
+		val = cur->idx + 1;
+
+		if (parent != RADIX_NO_VALUE && parent < val) {
+			val = parent;
+		}
+
+		radix_insert_compressed (trie, cur->key, klen, maxbits - cur->bits,
+				val);
+		prev = cur;
+	}
+
+	g_array_free (prefixes, TRUE);
+
+	return trie;
+}
+
+void
+rspamd_spf_record_compile (struct spf_resolved *rec)
+{
+	g_assert (rec != NULL);
+
+	if (rec->failed || rec->trie4 || rec->elts->len < SPF_TRIE_MIN_ELTS) {
+		return;
+	}
+
+	rec->trie4 = spf_record_build_trie (rec, AF_INET);
+	rec->trie6 = spf_record_build_trie (rec, AF_INET6);
+}
+
+struct spf_addr *
+rspamd_spf_record_match (struct spf_resolved *rec,
+		const rspamd_inet_addr_t *addr)
+{
+	struct spf_addr *cur;
+	const guint8 *key;
+	guint klen, i;
+	gint af;
+	uintptr_t val;
+
+	if (addr == NULL) {
+		return NULL;
+	}
+
+	af = rspamd_inet_address_get_af (addr);
+	key = rspamd_inet_address_get_radix_key (addr, &klen);
+
+	if (rec->trie4 && (af == AF_INET || af == AF_INET6)) {
+		val = radix_find_compressed (af == AF_INET6 ? rec->trie6 : rec->trie4,
+				key, klen);
+
+		if (val == RADIX_NO_VALUE) {
+			return NULL;
+		}
+
+		return &g_array_index (rec->elts, struct spf_addr, val - 1);
+	}
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		cur = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (spf_addr_matches (cur, af, key, klen)) {
+			return cur;
+		}
+	}
+
+	return NULL;
+}
+
+/* Packing format for the shared cache */
+#define SPF_PACKED_MAGIC 0x31465053U
+
+struct spf_packed_header {
+	guint32 magic;
+	guint32 nelts;
+	gint64 expire;
+};
+
+struct spf_packed_addr {
+	guchar addr6[sizeof (struct in6_addr)];
+	guchar addr4[sizeof (struct in_addr)];
+	guint16 mask_v4;
+	guint16 mask_v6;
+	guint32 flags;
+	guint32 mech;
+	guint32 slen;
+};
+
+guchar *
+rspamd_spf_record_pack (struct spf_resolved *rec, time_t expire, gsize *len)
+{
+	struct spf_packed_header hdr;
+	struct spf_packed_addr paddr;
+	struct spf_addr *addr;
+	GByteArray *ar;
+	guint i;
+
+	g_assert (rec != NULL);
+	g_assert (len != NULL);
+
+	ar = g_byte_array_sized_new (sizeof (hdr) + rec->elts->len *
+			(sizeof (paddr) + 16));
+	hdr.magic = SPF_PACKED_MAGIC;
+	hdr.nelts = rec->elts->len;
+	hdr.expire = expire;
+	g_byte_array_append (ar, (const guint8 *)&hdr, sizeof (hdr));
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		memset (&paddr, 0, sizeof (paddr));
+		memcpy (paddr.addr6, addr->addr6, sizeof (paddr.addr6));
+		memcpy (paddr.addr4, addr->addr4, sizeof (paddr.addr4));
+		paddr.mask_v4 = addr->m.dual.mask_v4;
+		paddr.mask_v6 = addr->m.dual.mask_v6;
+		paddr.flags = addr->flags;
+		paddr.mech = addr->mech;
+		paddr.slen = addr->spf_string ? strlen (addr->spf_string) : 0;
+		g_byte_array_append (ar, (const guint8 *)&paddr, sizeof (paddr));
+
+		if (paddr.slen > 0) {
+			g_byte_array_append (ar, (const guint8 *)addr->spf_string,
+					paddr.slen);
+		}
+	}
+
+	*len = ar->len;
+
+	return g_byte_array_free (ar, FALSE);
+}
+
+struct spf_resolved *
+rspamd_spf_record_unpack (const gchar *domain, const guchar *data, gsize len,
+		time_t now)
+{
+	struct spf_packed_header hdr;
+	struct spf_packed_addr paddr;
+	struct spf_resolved *res;
+	struct spf_addr addr;
+	const guchar *p = data, *end = data + len;
+	guint i;
+
+	if (len < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	if (hdr.magic != SPF_PACKED_MAGIC || hdr.expire <= now ||
+			hdr.nelts > (end - p) / sizeof (paddr)) {
+		return NULL;
+	}
+
+	res = g_slice_alloc0 (sizeof (*res));
+	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+			hdr.nelts);
+	res->domain = g_strdup (domain);
+	res->ttl = hdr.expire - now;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+
+	for (i = 0; i < hdr.nelts; i ++) {
+		if ((gsize)(end - p) < sizeof (paddr)) {
+			REF_RELEASE (res);
+			return NULL;
+		}
+
+		memcpy (&paddr, p, sizeof (paddr));
+		p += sizeof (paddr);
+
+		if ((gsize)(end - p) < paddr.slen) {
+			REF_RELEASE (res);
+			return NULL;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, paddr.addr6, sizeof (addr.addr6));
+		memcpy (addr.addr4, paddr.addr4, sizeof (addr.addr4));
+		addr.m.dual.mask_v4 = paddr.mask_v4;
+		addr.m.dual.mask_v6 = paddr.mask_v6;
+		addr.flags = paddr.flags;
+		addr.mech = paddr.mech;
+		addr.spf_string = g_strndup ((const gchar *)p, paddr.slen);
+		p += paddr.slen;
+		g_array_append_val (res->elts, addr);
+	}
+
+	return res;
+}
@@ -4,6 +4,7 @@
 #include "config.h"
 #include "ref.h"
 #include "addr.h"
+#include "radix.h"
 
 struct rspamd_task;
 struct spf_resolved;
@@ -59,6 +60,9 @@ struct spf_resolved {
 	guint ttl;
 	gboolean failed;
 	GArray *elts; /* Flat list of struct spf_addr */
+	/* Index of the first matching element plus one, see rspamd_spf_record_compile */
+	radix_compressed_t *trie4;
+	radix_compressed_t *trie6;
 	ref_entry_t ref; /* Refcounting */
 };
 
@@ -74,6 +78,32 @@ gboolean resolve_spf (struct rspamd_task *task, spf_cb_t callback);
 const gchar * rspamd_spf_get_domain (struct rspamd_task *task);
 
 
+/*
+ * Build prefix tries for records with many elements, so the first element
+ * matching an address is found without checking all elements in order
+ */
+void rspamd_spf_record_compile (struct spf_resolved *rec);
+
+/*
+ * Returns the first element of the record matching the address or NULL
+ */
+struct spf_addr * rspamd_spf_record_match (struct spf_resolved *rec,
+		const rspamd_inet_addr_t *addr);
+
+/*
+ * Serialize flattened record expiring at `expire` to a buffer that should be
+ * freed by g_free
+ */
+guchar * rspamd_spf_record_pack (struct spf_resolved *rec, time_t expire,
+		gsize *len);
+
+/*
+ * Restore flattened record from a buffer made by rspamd_spf_record_pack,
+ * returns NULL if data is invalid or the record has been expired
+ */
+struct spf_resolved * rspamd_spf_record_unpack (const gchar *domain,
+		const guchar *data, gsize len, time_t now);
+
 /*
  * Increase refcount
  */
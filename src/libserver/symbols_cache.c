@@ -18,6 +18,7 @@
 #include "rspamd.h"
 #include "message.h"
 #include "symbols_cache.h"
+#include "filter.h"
 #include "cfg_file.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
@@ -52,11 +53,53 @@ struct rspamd_symbols_cache_header {
 	guchar unused[128];
 };
 
+/*
+ * Flat element of the execution order: it keeps the data needed by the
+ * processing loop inline and refers to the rest of the item
+ */
+struct cache_order_elt {
+	struct cache_item *item;
+	guint32 id;
+	guint32 type;
+	guint32 ndeps;
+	guint32 deps_offset;
+};
+
 struct symbols_cache_order {
 	GPtrArray *d;
+	/* Copy of d sorted topologically with resolved dependencies ids */
+	struct cache_order_elt *elts;
+	guint32 *deps;
 	ref_entry_t ref;
 };
 
+/*
+ * Maximum positive and negative contributions of each item (including its
+ * virtual children) to the score of a metric that has early termination
+ * enabled
+ */
+struct symbols_cache_bounds {
+	struct metric *metric;
+	gdouble *pos;
+	gdouble *neg;
+	/* Composites and classifiers are evaluated after the cache */
+	gdouble post_pos;
+	gdouble post_neg;
+};
+
+struct symbols_cache_cpu_job;
+
+/* Threads that execute SYMBOL_TYPE_CPU callbacks */
+struct symbols_cache_threads {
+	GAsyncQueue *jobs;
+	GAsyncQueue *done;
+	/* Finished jobs taken from `done` while waiting for another job */
+	GQueue ready;
+	GPtrArray *threads;
+	gint notify_fd[2];
+	struct event notify_ev;
+};
+
 struct symbols_cache {
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
@@ -72,11 +115,30 @@ struct symbols_cache {
 	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	struct event resort_ev;
+	/* Score bounds for early termination, rebuilt when items are changed */
+	GPtrArray *bounds;
+	guchar *unbounded_items;
+	guint bounds_items;
+	struct symbols_cache_threads *threads;
 };
 
+/*
+ * Log-bucketed histogram of execution times: bucket `i` counts executions
+ * that took from 2^(i - 1) to 2^i microseconds
+ */
+#define CACHE_HIST_BUCKETS 24
+
+/* Per process counters that are merged into the shared items on resort */
 struct counter_data {
 	gdouble value;
 	gint number;
+	guint32 frequency;
+	guint32 hist[CACHE_HIST_BUCKETS];
+	/* Sums for sampled calls of lua callbacks */
+	gdouble lua_cpu;
+	gdouble lua_mem;
+	guint32 lua_yields;
+	guint32 lua_samples;
 };
 
 struct cache_item {
@@ -85,8 +147,14 @@ struct cache_item {
 	gdouble weight;
 	guint32 frequency;
 	guint32 avg_counter;
-
-	/* Per process counter */
+	guint32 hist[CACHE_HIST_BUCKETS];
+	/* Averages per sampled call of lua callback */
+	gdouble lua_cpu;
+	gdouble lua_mem;
+	gdouble lua_yields;
+	guint32 lua_samples;
+
+	/* Per process counter, merged to the shared block above */
 	struct counter_data *cd;
 	gchar *symbol;
 	enum rspamd_symbol_type type;
@@ -126,6 +194,14 @@ struct delayed_cache_condition {
 	lua_State *L;
 };
 
+struct cache_savepoint_bounds {
+	struct symbols_cache_bounds *b;
+	struct metric_result *rs;
+	/* Reachable score interval for the not yet finished items */
+	gdouble pos;
+	gdouble neg;
+};
+
 struct cache_savepoint {
 	guchar *processed_bits;
 	guint pass;
@@ -134,10 +210,29 @@ struct cache_savepoint {
 	gdouble lim;
 	GPtrArray *waitq;
 	struct symbols_cache_order *order;
+	/* NULL if early termination is not possible for this task */
+	struct cache_savepoint_bounds *bounds;
+	guint nbounds;
+	guint unbounded;
+	/* The task must not be touched while this job is running */
+	struct symbols_cache_cpu_job *cpu_job;
+};
+
+struct symbols_cache_cpu_job {
+	struct rspamd_task *task;
+	struct cache_item *item;
+	struct cache_savepoint *checkpoint;
+	struct symbols_cache *cache;
+	/* Results inserted by the callback, they are added by the main thread */
+	GQueue results;
+	gdouble diff;
+	gboolean finished;
 };
 
 /* XXX: Maybe make it configurable */
 #define CACHE_RELOAD_TIME 60.0
+/* Limit shared counters to allow new measurements to affect averages */
+#define CACHE_MAX_COUNTER 100000
 /* weight, frequency, time */
 #define TIME_ALPHA (1.0)
 #define WEIGHT_ALPHA (0.1)
@@ -168,6 +263,8 @@ rspamd_symbols_cache_order_dtor (gpointer p)
 	struct symbols_cache_order *ord = p;
 
 	g_ptr_array_free (ord->d, TRUE);
+	g_free (ord->elts);
+	g_free (ord->deps);
 	g_slice_free1 (sizeof (*ord), ord);
 }
 
@@ -184,7 +281,7 @@ rspamd_symbols_cache_order_new (gsize nelts)
 {
 	struct symbols_cache_order *ord;
 
-	ord = g_slice_alloc (sizeof (*ord));
+	ord = g_slice_alloc0 (sizeof (*ord));
 	ord->d = g_ptr_array_sized_new (nelts);
 	REF_INIT_RETAIN (ord, rspamd_symbols_cache_order_dtor);
 
@@ -250,6 +347,51 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	return 0;
 }
 
+static inline guint
+rspamd_symbols_cache_hist_bucket (gdouble microseconds)
+{
+	guint64 us;
+	guint bucket;
+
+	if (microseconds < 1.0) {
+		return 0;
+	}
+
+	us = microseconds;
+	bucket = g_bit_storage (us);
+
+	return MIN (bucket, CACHE_HIST_BUCKETS - 1);
+}
+
+/*
+ * Returns the upper bound of the bucket that contains the specified quantile
+ * of the histogram
+ */
+static gdouble
+rspamd_symbols_cache_hist_quantile (const guint32 *hist, gdouble q)
+{
+	guint64 total = 0, cur = 0;
+	guint i;
+
+	for (i = 0; i < CACHE_HIST_BUCKETS; i ++) {
+		total += hist[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < CACHE_HIST_BUCKETS; i ++) {
+		cur += hist[i];
+
+		if (cur >= total * q) {
+			break;
+		}
+	}
+
+	return (gdouble)(1ULL << MIN (i, CACHE_HIST_BUCKETS - 1));
+}
+
 /**
  * Set counter for a symbol
  */
@@ -259,14 +401,92 @@ rspamd_set_counter (struct cache_item *item, gdouble value)
 	struct counter_data *cd;
 	cd = item->cd;
 
-	/* Cumulative moving average using per-process counter data */
-	if (cd->number == 0) {
-		cd->value = 0;
+	/* Accumulate per-process data until the next merge to the shared item */
+	cd->value += value;
+	cd->number ++;
+	cd->hist[rspamd_symbols_cache_hist_bucket (value)] ++;
+
+	return cd->value / (gdouble)cd->number;
+}
+
+static void
+rspamd_symbols_cache_tsort_visit (struct cache_item *it, guchar *visited,
+		GPtrArray *res)
+{
+	struct cache_dependency *dep;
+	guint i;
+
+	if (isset (visited, it->id)) {
+		/* Already placed or a cyclic dependency */
+		return;
+	}
+
+	setbit (visited, it->id);
+
+	for (i = 0; i < it->deps->len; i ++) {
+		dep = g_ptr_array_index (it->deps, i);
+
+		if (dep->item != NULL) {
+			rspamd_symbols_cache_tsort_visit (dep->item, visited, res);
+		}
+	}
+
+	g_ptr_array_add (res, it);
+}
+
+/*
+ * Place dependencies before their dependents keeping the logical order
+ * otherwise and build the flat representation used by the processing loop
+ */
+static void
+rspamd_symbols_cache_flatten (struct symbols_cache_order *ord)
+{
+	struct cache_item *it;
+	struct cache_dependency *dep;
+	struct cache_order_elt *elt;
+	GPtrArray *sorted;
+	guchar *visited;
+	guint i, j, ndeps = 0, off = 0;
+	guint32 max_id = 0;
+
+	for (i = 0; i < ord->d->len; i ++) {
+		it = g_ptr_array_index (ord->d, i);
+		max_id = MAX (max_id, (guint32)it->id);
+		ndeps += it->deps->len;
+	}
+
+	visited = g_malloc0 (NBYTES (max_id + 1));
+	sorted = g_ptr_array_sized_new (ord->d->len);
+
+	for (i = 0; i < ord->d->len; i ++) {
+		rspamd_symbols_cache_tsort_visit (g_ptr_array_index (ord->d, i),
+				visited, sorted);
 	}
 
-	cd->value = cd->value + (value - cd->value) / (gdouble)(++cd->number);
+	g_free (visited);
+	g_ptr_array_free (ord->d, TRUE);
+	ord->d = sorted;
+
+	ord->elts = g_malloc0 (sizeof (*ord->elts) * MAX (sorted->len, 1));
+	ord->deps = g_malloc (sizeof (*ord->deps) * MAX (ndeps, 1));
+
+	for (i = 0; i < sorted->len; i ++) {
+		it = g_ptr_array_index (sorted, i);
+		elt = &ord->elts[i];
+		elt->item = it;
+		elt->id = it->id;
+		elt->type = it->type;
+		elt->deps_offset = off;
 
-	return cd->value;
+		for (j = 0; j < it->deps->len; j ++) {
+			dep = g_ptr_array_index (it->deps, j);
+
+			if (dep->item != NULL) {
+				ord->deps[off ++] = dep->item->id;
+				elt->ndeps ++;
+			}
+		}
+	}
 }
 
 static void
@@ -284,6 +504,7 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	}
 
 	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+	rspamd_symbols_cache_flatten (ord);
 
 	if (cache->items_by_order) {
 		REF_RELEASE (cache->items_by_order);
@@ -304,8 +525,6 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 	guint i, j;
 	gint id;
 
-	rspamd_symbols_cache_resort (cache);
-
 	cur = cache->delayed_deps;
 	while (cur) {
 		ddep = cur->data;
@@ -382,6 +601,9 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 			}
 		}
 	}
+
+	/* Dependencies must be resolved here to sort items topologically */
+	rspamd_symbols_cache_resort (cache);
 }
 
 static gboolean
@@ -548,6 +770,7 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 	memset (&hdr, 0, sizeof (hdr));
 	memcpy (hdr.magic, rspamd_symbols_cache_magic,
 			sizeof (rspamd_symbols_cache_magic));
+	hdr.nitems = g_hash_table_size (cache->items_by_symbol);
 
 	if (write (fd, &hdr, sizeof (hdr)) == -1) {
 		msg_info_cache ("cannot write to file %s, error %d, %s", name,
@@ -643,7 +866,6 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 	item->parent = parent;
 	cache->used_items ++;
 	msg_debug_cache ("used items: %d, added symbol: %s", cache->used_items, name);
-	rspamd_set_counter (item, 0);
 	g_ptr_array_add (cache->items_by_id, item);
 	item->deps = g_ptr_array_new ();
 	item->rdeps = g_ptr_array_new ();
@@ -760,6 +982,11 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 			g_list_free (cache->delayed_conditions);
 		}
 
+		if (cache->bounds) {
+			g_ptr_array_free (cache->bounds, TRUE);
+		}
+
+		g_free (cache->unbounded_items);
 		g_hash_table_destroy (cache->items_by_symbol);
 		rspamd_mempool_delete (cache->static_pool);
 		g_ptr_array_free (cache->items_by_id, TRUE);
@@ -1030,6 +1257,99 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Return true if the remaining symbols cannot move any metric across an
+ * action threshold. We assume that each symbol is inserted at most once with
+ * a multiplier in [-1, 1], so this is an approximation enabled explicitly
+ * by `early_termination` in all metrics.
+ */
+static gboolean
+rspamd_symbols_cache_metric_settled (struct rspamd_task *task,
+		struct cache_savepoint *cp)
+{
+	struct cache_savepoint_bounds *cb;
+	gdouble lo, hi, sc;
+	guint i, j;
+
+	if (cp->bounds == NULL || cp->unbounded > 0 || task->settings != NULL ||
+			(task->flags & RSPAMD_TASK_FLAG_PASS_ALL)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < cp->nbounds; i ++) {
+		cb = &cp->bounds[i];
+
+		if (cb->rs == NULL) {
+			cb->rs = rspamd_create_metric_result (task, cb->b->metric->name);
+		}
+
+		lo = cb->rs->score + cb->neg;
+		hi = cb->rs->score + cb->pos;
+
+		for (j = METRIC_ACTION_REJECT; j < METRIC_ACTION_MAX; j ++) {
+			sc = cb->rs->actions_limits[j];
+
+			/* Non-positive limits are never selected as actions */
+			if (isnan (sc) || sc <= 0) {
+				continue;
+			}
+
+			if (lo < sc && hi >= sc) {
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/* Mark item as finished and exclude it from the reachable score interval */
+static void
+rspamd_symbols_cache_item_finished (struct symbols_cache *cache,
+		guint id,
+		struct cache_savepoint *cp)
+{
+	struct cache_savepoint_bounds *cb;
+	guint i;
+
+	if (isset (cp->processed_bits, id * 2 + 1)) {
+		return;
+	}
+
+	setbit (cp->processed_bits, id * 2 + 1);
+
+	if (cp->bounds != NULL && id < cp->version) {
+		for (i = 0; i < cp->nbounds; i ++) {
+			cb = &cp->bounds[i];
+			cb->pos -= cb->b->pos[id];
+			cb->neg -= cb->b->neg[id];
+		}
+
+		if (isset (cache->unbounded_items, id)) {
+			cp->unbounded --;
+		}
+	}
+}
+
+/* Fast check for the case when all dependencies are already finished */
+static inline gboolean
+rspamd_symbols_cache_deps_finished (struct cache_savepoint *cp,
+		const struct cache_order_elt *elt)
+{
+	guint32 i, dep_id;
+
+	for (i = 0; i < elt->ndeps; i ++) {
+		dep_id = cp->order->deps[elt->deps_offset + i];
+
+		if (dep_id < cp->version &&
+				!isset (cp->processed_bits, dep_id * 2 + 1)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 {
@@ -1043,7 +1363,7 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	cache = task->cfg->cache;
 
 	/* Specify that we are done with this item */
-	setbit (checkpoint->processed_bits, item->id * 2 + 1);
+	rspamd_symbols_cache_item_finished (cache, item->id, checkpoint);
 
 	if (checkpoint->pass > 0) {
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
@@ -1058,6 +1378,10 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 
 				rspamd_symbols_cache_check_symbol (task, cache, it, checkpoint,
 						NULL);
+
+				if (checkpoint->cpu_job) {
+					break;
+				}
 			}
 		}
 	}
@@ -1065,6 +1389,150 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	msg_debug_task ("finished watcher, %ud symbols waiting", remain);
 }
 
+static void
+rspamd_symbols_cache_job_fin (gpointer ud)
+{
+	struct symbols_cache_cpu_job *job = ud, *cur;
+	struct symbols_cache_threads *thr;
+
+	if (job->finished) {
+		return;
+	}
+
+	/*
+	 * Session is destroyed or cleaned up while the job is running, so we have
+	 * to wait for the thread to stop using the task
+	 */
+	thr = job->cache->threads;
+
+	if (!g_queue_remove (&thr->ready, job)) {
+		while ((cur = g_async_queue_pop (thr->done)) != job) {
+			g_queue_push_tail (&thr->ready, cur);
+		}
+	}
+
+	job->checkpoint->cpu_job = NULL;
+	rspamd_task_results_flush (job->task, &job->results, FALSE);
+	g_free (job);
+}
+
+static void
+rspamd_symbols_cache_job_done (struct symbols_cache *cache,
+		struct symbols_cache_cpu_job *job)
+{
+	struct rspamd_task *task = job->task;
+	struct cache_item *item = job->item;
+	const gdouble slow_diff_limit = 1e5;
+
+	if (job->diff > slow_diff_limit) {
+		msg_info_task ("slow rule: %s: %d ms", item->symbol,
+				(gint)(job->diff / 1000.));
+	}
+
+	rspamd_set_counter (item, job->diff);
+	rspamd_task_results_flush (task, &job->results, TRUE);
+	rspamd_symbols_cache_item_finished (cache, item->id, job->checkpoint);
+	job->checkpoint->cpu_job = NULL;
+	job->finished = TRUE;
+	/* This can continue processing of the task */
+	rspamd_session_remove_event (task->s, rspamd_symbols_cache_job_fin, job);
+	g_free (job);
+}
+
+static void
+rspamd_symbols_cache_threads_notify (gint fd, short what, gpointer ud)
+{
+	struct symbols_cache *cache = ud;
+	struct symbols_cache_threads *thr = cache->threads;
+	struct symbols_cache_cpu_job *job;
+	guchar buf[64];
+
+	while (read (fd, buf, sizeof (buf)) > 0);
+
+	while ((job = g_queue_pop_head (&thr->ready)) != NULL) {
+		rspamd_symbols_cache_job_done (cache, job);
+	}
+
+	while ((job = g_async_queue_try_pop (thr->done)) != NULL) {
+		rspamd_symbols_cache_job_done (cache, job);
+	}
+}
+
+static gpointer
+rspamd_symbols_cache_thread_func (gpointer ud)
+{
+	struct symbols_cache_threads *thr = ud;
+	struct symbols_cache_cpu_job *job;
+	gdouble t1;
+	guchar c = 0;
+
+	for (;;) {
+		job = g_async_queue_pop (thr->jobs);
+		t1 = rspamd_get_ticks ();
+		rspamd_task_results_defer (&job->results);
+		job->item->func (job->task, job->item->user_data);
+		rspamd_task_results_defer (NULL);
+		job->diff = (rspamd_get_ticks () - t1) * 1e6;
+		g_async_queue_push (thr->done, job);
+
+		/* If pipe is full, then the main thread has enough to read anyway */
+		if (write (thr->notify_fd[1], &c, sizeof (c)) == -1) {
+			continue;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns TRUE if an item has been deferred until a task has no events */
+static gboolean
+rspamd_symbols_cache_defer_cpu (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_item *item,
+		struct cache_savepoint *checkpoint)
+{
+	guint i;
+
+	if (!(item->type & SYMBOL_TYPE_CPU) || cache->threads == NULL ||
+			rspamd_session_events_pending (task->s) == 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < checkpoint->waitq->len; i ++) {
+		if (g_ptr_array_index (checkpoint->waitq, i) == item) {
+			return TRUE;
+		}
+	}
+
+	msg_debug_task ("defer execution of %s as task has pending events",
+			item->symbol);
+	g_ptr_array_add (checkpoint->waitq, item);
+
+	return TRUE;
+}
+
+static void
+rspamd_symbols_cache_dispatch_cpu (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_item *item,
+		struct cache_savepoint *checkpoint)
+{
+	struct symbols_cache_cpu_job *job;
+
+	job = g_malloc0 (sizeof (*job));
+	g_queue_init (&job->results);
+	job->task = task;
+	job->item = item;
+	job->checkpoint = checkpoint;
+	job->cache = cache;
+	checkpoint->cpu_job = job;
+
+	msg_debug_task ("execute %s, %d in a thread", item->symbol, item->id);
+	rspamd_session_add_event (task->s, rspamd_symbols_cache_job_fin, job,
+			rspamd_symbols_cache_quark ());
+	g_async_queue_push (cache->threads->jobs, job);
+}
+
 static gboolean
 rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache,
@@ -1080,9 +1548,19 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 	gboolean check = TRUE;
 	const gdouble slow_diff_limit = 1e5;
 
+	if (checkpoint->cpu_job) {
+		/* Task is owned by a thread now */
+		return FALSE;
+	}
+
 	if (item->type & (SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_CALLBACK)) {
 
 		g_assert (item->func != NULL);
+
+		if (rspamd_symbols_cache_defer_cpu (task, cache, item, checkpoint)) {
+			return FALSE;
+		}
+
 		/* Check has been started */
 		setbit (checkpoint->processed_bits, item->id * 2);
 
@@ -1108,7 +1586,12 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 			}
 		}
 
-		if (check) {
+		if (check && (item->type & SYMBOL_TYPE_CPU) && cache->threads) {
+			rspamd_symbols_cache_dispatch_cpu (task, cache, item, checkpoint);
+
+			return FALSE;
+		}
+		else if (check) {
 			t1 = rspamd_get_ticks ();
 			pending_before = rspamd_session_events_pending (task->s);
 			/* Watch for events appeared */
@@ -1130,13 +1613,15 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 						(gint)(diff / 1000.));
 			}
 
+			rspamd_metrics_note_activity (RSPAMD_METRICS_ACTIVITY_SYMBOL,
+					item->symbol, t2 - t1);
 			rspamd_set_counter (item, diff);
 			rspamd_session_watch_stop (task->s);
 			pending_after = rspamd_session_events_pending (task->s);
 
 			if (pending_before == pending_after) {
 				/* No new events registered */
-				setbit (checkpoint->processed_bits, item->id * 2 + 1);
+				rspamd_symbols_cache_item_finished (cache, item->id, checkpoint);
 
 				return TRUE;
 			}
@@ -1146,14 +1631,14 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		else {
 			msg_debug_task ("skipping check of %s as its condition is false",
 					item->symbol);
-			setbit (checkpoint->processed_bits, item->id * 2 + 1);
+			rspamd_symbols_cache_item_finished (cache, item->id, checkpoint);
 
 			return TRUE;
 		}
 	}
 	else {
 		setbit (checkpoint->processed_bits, item->id * 2);
-		setbit (checkpoint->processed_bits, item->id * 2 + 1);
+		rspamd_symbols_cache_item_finished (cache, item->id, checkpoint);
 
 		return TRUE;
 	}
@@ -1247,6 +1732,206 @@ rspamd_symbols_cache_tm (gint fd, short what, void *data)
 			data);
 }
 
+/*
+ * Suspends processing of a task till the next loop iteration if its owner
+ * wants other tasks to run
+ */
+static gboolean
+rspamd_symbols_cache_yield (struct rspamd_task *task)
+{
+	struct event *ev;
+	struct timeval tv;
+
+	if (task->yield_callback == NULL || !task->yield_callback (task)) {
+		return FALSE;
+	}
+
+	rspamd_session_add_event (task->s,
+			rspamd_symbols_cache_continuation, task,
+			rspamd_symbols_cache_quark ());
+	ev = rspamd_mempool_alloc (task->task_pool, sizeof (*ev));
+	event_set (ev, -1, EV_TIMEOUT, rspamd_symbols_cache_tm, task);
+	event_base_set (task->ev_base, ev);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	event_add (ev, &tv);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)event_del, ev);
+
+	return TRUE;
+}
+
+static void
+rspamd_symbols_cache_bounds_dtor (gpointer p)
+{
+	struct symbols_cache_bounds *b = p;
+
+	g_free (b->pos);
+	g_free (b->neg);
+	g_free (b);
+}
+
+static void
+rspamd_symbols_cache_build_bounds (struct symbols_cache *cache)
+{
+	struct symbols_cache_bounds *b;
+	struct cache_item *item;
+	struct rspamd_symbol_def *sdef;
+	struct metric *metric;
+	GList *cur;
+	gdouble w;
+	gint id;
+	guint i;
+
+	if (cache->bounds) {
+		g_ptr_array_free (cache->bounds, TRUE);
+	}
+
+	g_free (cache->unbounded_items);
+	cache->bounds = g_ptr_array_new_full (1, rspamd_symbols_cache_bounds_dtor);
+	cache->unbounded_items = g_malloc0 (NBYTES (cache->used_items));
+	cache->bounds_items = cache->used_items;
+
+	/* Callbacks without virtual children can insert any symbols */
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->type & SYMBOL_TYPE_CALLBACK) {
+			setbit (cache->unbounded_items, item->id);
+		}
+	}
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent != -1) {
+			clrbit (cache->unbounded_items, item->parent);
+		}
+	}
+
+	cur = cache->cfg->metrics_list;
+
+	while (cur) {
+		metric = cur->data;
+		cur = g_list_next (cur);
+
+		if (metric->grow_factor > 1.0) {
+			msg_warn_cache ("cannot use early termination for metric %s: "
+					"grow factor %.2f is greater than 1",
+					metric->name, metric->grow_factor);
+			continue;
+		}
+
+		b = g_malloc0 (sizeof (*b));
+		b->metric = metric;
+		b->pos = g_malloc0 (cache->used_items * sizeof (gdouble));
+		b->neg = g_malloc0 (cache->used_items * sizeof (gdouble));
+
+		for (i = 0; i < cache->items_by_id->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_id, i);
+
+			if (item->symbol == NULL) {
+				continue;
+			}
+
+			sdef = g_hash_table_lookup (metric->symbols, item->symbol);
+
+			if (sdef == NULL) {
+				continue;
+			}
+
+			w = *sdef->weight_ptr;
+
+			if (item->type & (SYMBOL_TYPE_COMPOSITE|SYMBOL_TYPE_CLASSIFIER)) {
+				if (w > 0) {
+					b->post_pos += w;
+				}
+				else {
+					b->post_neg += w;
+				}
+
+				continue;
+			}
+
+			id = item->id;
+
+			/* Virtual symbols are inserted by their parents */
+			if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent != -1) {
+				id = item->parent;
+			}
+
+			if (w > 0) {
+				b->pos[id] += w;
+			}
+			else {
+				b->neg[id] += w;
+			}
+		}
+
+		g_ptr_array_add (cache->bounds, b);
+	}
+}
+
+static void
+rspamd_symbols_cache_init_bounds (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_savepoint *checkpoint)
+{
+	struct symbols_cache_bounds *b;
+	struct cache_savepoint_bounds *cb;
+	struct metric *metric;
+	GList *cur;
+	guint i, j;
+
+	cur = task->cfg->metrics_list;
+
+	if (cur == NULL) {
+		return;
+	}
+
+	/* All metrics must agree to skip the remaining checks */
+	while (cur) {
+		metric = cur->data;
+
+		if (!metric->early_termination) {
+			return;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	if (cache->bounds == NULL || cache->bounds_items != cache->used_items) {
+		rspamd_symbols_cache_build_bounds (cache);
+	}
+
+	if (cache->bounds->len != g_list_length (task->cfg->metrics_list)) {
+		return;
+	}
+
+	checkpoint->nbounds = cache->bounds->len;
+	checkpoint->bounds = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*cb) * checkpoint->nbounds);
+
+	for (i = 0; i < checkpoint->nbounds; i ++) {
+		b = g_ptr_array_index (cache->bounds, i);
+		cb = &checkpoint->bounds[i];
+		cb->b = b;
+		cb->pos = b->post_pos;
+		cb->neg = b->post_neg;
+
+		for (j = 0; j < checkpoint->version; j ++) {
+			cb->pos += b->pos[j];
+			cb->neg += b->neg[j];
+		}
+	}
+
+	for (j = 0; j < checkpoint->version; j ++) {
+		if (isset (cache->unbounded_items, j)) {
+			checkpoint->unbounded ++;
+		}
+	}
+}
+
 static struct cache_savepoint *
 rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 		struct symbols_cache *cache)
@@ -1276,6 +1961,7 @@ rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 			rspamd_symbols_cache_order_unref, checkpoint->order);
 	rspamd_mempool_add_destructor (task->task_pool,
 			rspamd_ptr_array_free_hard, checkpoint->waitq);
+	rspamd_symbols_cache_init_bounds (task, cache, checkpoint);
 	task->checkpoint = checkpoint;
 
 	rspamd_create_metric_result (task, DEFAULT_METRIC);
@@ -1344,6 +2030,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 	struct symbols_cache *cache)
 {
 	struct cache_item *item = NULL;
+	struct cache_order_elt *elt;
 	struct cache_savepoint *checkpoint;
 	gint i;
 	gdouble total_microseconds = 0;
@@ -1385,10 +2072,27 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (checkpoint->order->d, i);
+			if (rspamd_symbols_cache_metric_settled (task, checkpoint)) {
+				msg_info_task ("<%s> cannot change action with the remaining "
+						"checks, so do not plan any more checks",
+						task->message_id);
+				return TRUE;
+			}
 
-			if (!isset (checkpoint->processed_bits, item->id * 2)) {
-				if (!rspamd_symbols_cache_check_deps (task, cache, item,
+			elt = &checkpoint->order->elts[i];
+
+			if (!(elt->type & (SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_CALLBACK))) {
+				/* Nothing to execute, so avoid touching the item itself */
+				setbit (checkpoint->processed_bits, elt->id * 2);
+				rspamd_symbols_cache_item_finished (cache, elt->id, checkpoint);
+				continue;
+			}
+
+			item = elt->item;
+
+			if (!isset (checkpoint->processed_bits, elt->id * 2)) {
+				if (!rspamd_symbols_cache_deps_finished (checkpoint, elt) &&
+						!rspamd_symbols_cache_check_deps (task, cache, item,
 						checkpoint)) {
 					msg_debug_task ("blocked execution of %d unless deps are "
 									"resolved",
@@ -1401,6 +2105,10 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 						checkpoint, &total_microseconds);
 			}
 
+			if (checkpoint->cpu_job) {
+				return TRUE;
+			}
+
 			if (total_microseconds > max_microseconds) {
 				/* Maybe we should stop and check pending events? */
 				if (rspamd_session_events_pending (task->s) > start_events_pending) {
@@ -1426,10 +2134,28 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 
 					return TRUE;
 				}
+
+				if (rspamd_symbols_cache_yield (task)) {
+					msg_debug_task ("yield after spending %d microseconds "
+							"processing symbols", (gint)total_microseconds);
+
+					return TRUE;
+				}
 			}
 		}
 
 		checkpoint->pass ++;
+
+		if (checkpoint->waitq->len > 0 &&
+				rspamd_session_events_pending (task->s) == 0) {
+			if (rspamd_symbols_cache_yield (task)) {
+				/* Blocked symbols are checked on the next pass */
+				return TRUE;
+			}
+
+			/* Nothing to wait for, so check the blocked symbols now */
+			return rspamd_symbols_cache_process_symbols (task, cache);
+		}
 	}
 	else {
 		/* We just go through the blocked symbols and check if they are ready */
@@ -1440,6 +2166,13 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 				continue;
 			}
 
+			if (rspamd_symbols_cache_metric_settled (task, checkpoint)) {
+				msg_info_task ("<%s> cannot change action with the remaining "
+						"checks, so do not plan any more checks",
+						task->message_id);
+				return TRUE;
+			}
+
 			if (!isset (checkpoint->processed_bits, item->id * 2)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, item,
 						checkpoint)) {
@@ -1450,6 +2183,10 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 						checkpoint, &total_microseconds);
 			}
 
+			if (checkpoint->cpu_job) {
+				return TRUE;
+			}
+
 			if (total_microseconds > max_microseconds) {
 				/* Maybe we should stop and check pending events? */
 				if (rspamd_session_events_pending (task->s) >
@@ -1459,6 +2196,10 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 							(gint)total_microseconds);
 					return TRUE;
 				}
+
+				if (rspamd_symbols_cache_yield (task)) {
+					return TRUE;
+				}
 			}
 		}
 	}
@@ -1471,6 +2212,20 @@ struct counters_cbdata {
 	struct symbols_cache *cache;
 };
 
+static void
+rspamd_symbols_cache_counters_hist (ucl_object_t *obj, const guint32 *hist)
+{
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_symbols_cache_hist_quantile (hist, 0.5)),
+			"p50", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_symbols_cache_hist_quantile (hist, 0.95)),
+			"p95", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_symbols_cache_hist_quantile (hist, 0.99)),
+			"p99", 0, false);
+}
+
 static void
 rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 {
@@ -1495,6 +2250,7 @@ rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 					"frequency", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromdouble (parent->avg_time),
 					"time", 0, false);
+			rspamd_symbols_cache_counters_hist (obj, parent->hist);
 		}
 		else {
 			ucl_object_insert_key (obj, ucl_object_fromdouble (item->weight),
@@ -1503,6 +2259,7 @@ rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 					"frequency", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromdouble (item->avg_time),
 					"time", 0, false);
+			rspamd_symbols_cache_counters_hist (obj, item->hist);
 		}
 
 		ucl_array_append (top, obj);
@@ -1525,6 +2282,155 @@ rspamd_symbols_cache_counters (struct symbols_cache * cache)
 	return top;
 }
 
+void
+rspamd_symbols_cache_add_lua_profile (struct symbols_cache *cache, gint id,
+		gdouble cpu, gint64 mem, guint yields)
+{
+	struct cache_item *item;
+	struct counter_data *cd;
+
+	g_assert (cache != NULL);
+
+	if (id < 0 || id >= (gint)cache->items_by_id->len) {
+		return;
+	}
+
+	item = g_ptr_array_index (cache->items_by_id, id);
+	cd = item->cd;
+	cd->lua_cpu += cpu;
+	cd->lua_mem += mem;
+	cd->lua_yields += yields;
+	cd->lua_samples ++;
+}
+
+ucl_object_t *
+rspamd_symbols_cache_lua_profile (struct symbols_cache *cache)
+{
+	ucl_object_t *top, *obj;
+	struct cache_item *item;
+	guint i;
+
+	g_assert (cache != NULL);
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	/* Callback symbols are included as they are usually lua callbacks */
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->lua_samples == 0) {
+			continue;
+		}
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (item->symbol),
+				"symbol", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (item->lua_samples),
+				"samples", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (item->lua_cpu),
+				"cpu", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (item->lua_mem),
+				"memory", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (item->lua_yields),
+				"yields", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	return top;
+}
+
+ucl_object_t *
+rspamd_symbols_cache_local_counters (struct symbols_cache *cache)
+{
+	ucl_object_t *top, *obj;
+	struct cache_item *item;
+	struct counter_data *cd;
+	guint i;
+
+	g_assert (cache != NULL);
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+		cd = item->cd;
+
+		if (cd->number == 0 && cd->frequency == 0 && cd->lua_samples == 0) {
+			continue;
+		}
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (item->symbol),
+				"symbol", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cd->number),
+				"calls", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (cd->frequency),
+				"hits", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (cd->value),
+				"time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (cd->lua_cpu),
+				"lua_cpu", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	return top;
+}
+
+static void
+rspamd_symbols_cache_counters_emit_item (struct rspamd_json_emitter *e,
+		gdouble weight, guint32 frequency, gdouble avg_time,
+		const guint32 *hist)
+{
+	rspamd_json_emit_key (e, "weight");
+	rspamd_json_emit_double (e, weight);
+	rspamd_json_emit_key (e, "frequency");
+	rspamd_json_emit_int (e, frequency);
+	rspamd_json_emit_key (e, "time");
+	rspamd_json_emit_double (e, avg_time);
+	rspamd_json_emit_key (e, "p50");
+	rspamd_json_emit_double (e, rspamd_symbols_cache_hist_quantile (hist, 0.5));
+	rspamd_json_emit_key (e, "p95");
+	rspamd_json_emit_double (e, rspamd_symbols_cache_hist_quantile (hist, 0.95));
+	rspamd_json_emit_key (e, "p99");
+	rspamd_json_emit_double (e, rspamd_symbols_cache_hist_quantile (hist, 0.99));
+}
+
+void
+rspamd_symbols_cache_counters_emit (struct symbols_cache *cache,
+		struct rspamd_json_emitter *e)
+{
+	struct cache_item *item, *parent;
+	guint i;
+
+	g_assert (cache != NULL);
+	rspamd_json_emit_array_start (e);
+
+	for (i = 0; i < cache->items_by_order->d->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_order->d, i);
+
+		if (item->type & SYMBOL_TYPE_CALLBACK) {
+			continue;
+		}
+
+		rspamd_json_emit_object_start (e);
+		rspamd_json_emit_key (e, "symbol");
+		rspamd_json_emit_string (e, item->symbol);
+
+		if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent != -1) {
+			g_assert (item->parent < (gint)cache->items_by_id->len);
+			parent = g_ptr_array_index (cache->items_by_id, item->parent);
+			rspamd_symbols_cache_counters_emit_item (e, item->weight,
+					item->frequency, parent->avg_time, parent->hist);
+		}
+		else {
+			rspamd_symbols_cache_counters_emit_item (e, item->weight,
+					item->frequency, item->avg_time, item->hist);
+		}
+
+		rspamd_json_emit_object_end (e);
+	}
+
+	rspamd_json_emit_array_end (e);
+}
+
 static void
 rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 {
@@ -1532,7 +2438,10 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 	gdouble tm;
 	struct symbols_cache *cache = ud;
 	struct cache_item *item, *parent;
-	guint i;
+	struct counter_data *cd;
+	gdouble total_freq = 1;
+	guint32 total;
+	guint i, j;
 
 	/* Plan new event */
 	tm = rspamd_time_jitter (cache->reload_time, 0);
@@ -1544,20 +2453,54 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 
 	rspamd_mempool_lock_mutex (cache->mtx);
 
-	/* Gather stats from shared execution times */
+	/*
+	 * Items are allocated in the shared pool, so all workers merge their
+	 * local measurements into the same averages weighted by the number
+	 * of samples
+	 */
 	for (i = 0; i < cache->items_by_id->len; i ++) {
 		item = g_ptr_array_index (cache->items_by_id, i);
+		cd = item->cd;
 
 		if (item->type & (SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL)) {
-			if (item->cd->number > 0) {
-				item->avg_counter += item->cd->number + 1;
-				item->avg_time = item->avg_time +
-						(item->cd->value - item->avg_time) /
-								(gdouble)item->avg_counter;
-				item->cd->value = item->avg_time;
-				item->cd->number = item->avg_counter;
+			if (cd->number > 0) {
+				total = item->avg_counter + cd->number;
+				item->avg_time = (item->avg_time * item->avg_counter +
+						cd->value) / (gdouble)total;
+				item->avg_counter = MIN (total, CACHE_MAX_COUNTER);
+				cd->value = 0;
+				cd->number = 0;
 			}
 		}
+
+		if (cd->frequency > 0) {
+			item->frequency += cd->frequency;
+			cd->frequency = 0;
+		}
+
+		for (j = 0; j < CACHE_HIST_BUCKETS; j ++) {
+			item->hist[j] += cd->hist[j];
+			cd->hist[j] = 0;
+		}
+
+		if (cd->lua_samples > 0) {
+			total = item->lua_samples + cd->lua_samples;
+			item->lua_cpu = (item->lua_cpu * item->lua_samples +
+					cd->lua_cpu) / (gdouble)total;
+			item->lua_mem = (item->lua_mem * item->lua_samples +
+					cd->lua_mem) / (gdouble)total;
+			item->lua_yields = (item->lua_yields * item->lua_samples +
+					cd->lua_yields) / (gdouble)total;
+			item->lua_samples = MIN (total, CACHE_MAX_COUNTER);
+			cd->lua_cpu = 0;
+			cd->lua_mem = 0;
+			cd->lua_yields = 0;
+			cd->lua_samples = 0;
+		}
+
+		if (!(item->type & SYMBOL_TYPE_VIRTUAL)) {
+			total_freq += item->frequency;
+		}
 	}
 	/* Sync virtual symbols */
 	for (i = 0; i < cache->items_by_id->len; i ++) {
@@ -1575,6 +2518,7 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 
 	rspamd_mempool_unlock_mutex (cache->mtx);
 
+	cache->total_freq = total_freq;
 	rspamd_symbols_cache_resort (cache);
 }
 
@@ -1593,6 +2537,73 @@ rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 	event_add (&cache->resort_ev, &tv);
 }
 
+void
+rspamd_symbols_cache_start_threads (struct symbols_cache *cache,
+		struct event_base *ev_base, guint nthreads)
+{
+	struct symbols_cache_threads *thr;
+	GThread *th;
+	GError *err = NULL;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	if (nthreads == 0 || cache->threads != NULL) {
+		return;
+	}
+
+	thr = g_malloc0 (sizeof (*thr));
+
+	if (pipe (thr->notify_fd) == -1) {
+		msg_err_cache ("cannot create notification pipe: %s",
+				strerror (errno));
+		g_free (thr);
+
+		return;
+	}
+
+	rspamd_socket_nonblocking (thr->notify_fd[0]);
+	rspamd_socket_nonblocking (thr->notify_fd[1]);
+	thr->jobs = g_async_queue_new ();
+	thr->done = g_async_queue_new ();
+	thr->threads = g_ptr_array_sized_new (nthreads);
+	g_queue_init (&thr->ready);
+
+	for (i = 0; i < nthreads; i ++) {
+		th = rspamd_create_thread ("symcache", rspamd_symbols_cache_thread_func,
+				thr, &err);
+
+		if (th == NULL) {
+			msg_err_cache ("cannot create thread: %e", err);
+			g_error_free (err);
+			err = NULL;
+			break;
+		}
+
+		g_ptr_array_add (thr->threads, th);
+	}
+
+	if (thr->threads->len == 0) {
+		close (thr->notify_fd[0]);
+		close (thr->notify_fd[1]);
+		g_async_queue_unref (thr->jobs);
+		g_async_queue_unref (thr->done);
+		g_ptr_array_free (thr->threads, TRUE);
+		g_free (thr);
+
+		return;
+	}
+
+	event_set (&thr->notify_ev, thr->notify_fd[0], EV_READ | EV_PERSIST,
+			rspamd_symbols_cache_threads_notify, cache);
+	event_base_set (ev_base, &thr->notify_ev);
+	event_add (&thr->notify_ev, NULL);
+	cache->threads = thr;
+
+	msg_info_cache ("started %ud threads for cpu bound symbols",
+			thr->threads->len);
+}
+
 void
 rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 		const gchar *symbol)
@@ -1604,14 +2615,13 @@ rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 	item = g_hash_table_lookup (cache->items_by_symbol, symbol);
 
 	if (item != NULL) {
-		/* We assume ++ as atomic op */
-		item->frequency ++;
-		cache->total_freq ++;
+		/* Shared frequency is updated on resort to avoid lost updates */
+		item->cd->frequency ++;
 
 		/* For virtual symbols we also increase counter for parent */
 		if (item->parent != -1) {
 			parent = g_ptr_array_index (cache->items_by_id, item->parent);
-			parent->frequency ++;
+			parent->cd->frequency ++;
 		}
 	}
 }
@@ -1744,7 +2754,7 @@ rspamd_symbols_cache_disable_symbol (struct rspamd_task *task,
 		item = g_ptr_array_index (cache->items_by_id, id);
 
 		setbit (checkpoint->processed_bits, item->id * 2);
-		setbit (checkpoint->processed_bits, item->id * 2 + 1);
+		rspamd_symbols_cache_item_finished (cache, item->id, checkpoint);
 
 		msg_debug_task ("disable execution of %s", symbol);
 	}
@@ -1753,6 +2763,55 @@ rspamd_symbols_cache_disable_symbol (struct rspamd_task *task,
 	}
 }
 
+void
+rspamd_symbols_cache_disable_content (struct rspamd_task *task,
+		struct symbols_cache *cache)
+{
+	struct cache_savepoint *checkpoint;
+	struct cache_item *item;
+	guint i;
+
+	if (task->checkpoint == NULL) {
+		checkpoint = rspamd_symbols_cache_make_checkpoint (task, cache);
+		task->checkpoint = checkpoint;
+	}
+	else {
+		checkpoint = task->checkpoint;
+	}
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if ((item->type & SYMBOL_TYPE_CONTENT) && item->parent == -1) {
+			setbit (checkpoint->processed_bits, item->id * 2);
+			rspamd_symbols_cache_item_finished (cache, item->id, checkpoint);
+		}
+	}
+}
+
+gboolean
+rspamd_symbols_cache_is_content (struct symbols_cache *cache,
+		const gchar *symbol)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	item = g_hash_table_lookup (cache->items_by_symbol, symbol);
+
+	if (item == NULL || (item->type & SYMBOL_TYPE_CLASSIFIER)) {
+		/* Classifiers results change after learning, so they are not cached */
+		return FALSE;
+	}
+
+	/* Virtual symbols are inserted by their parent callbacks */
+	if (item->parent != -1) {
+		item = g_ptr_array_index (cache->items_by_id, item->parent);
+	}
+
+	return (item->type & SYMBOL_TYPE_CONTENT) != 0;
+}
+
 struct rspamd_abstract_callback_data* rspamd_symbols_cache_get_cbdata (
 		struct symbols_cache *cache, const gchar *symbol)
 {
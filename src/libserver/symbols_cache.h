@@ -36,7 +36,9 @@ enum rspamd_symbol_type {
 	SYMBOL_TYPE_COMPOSITE = (1 << 5),
 	SYMBOL_TYPE_CLASSIFIER = (1 << 6),
 	SYMBOL_TYPE_FINE = (1 << 7),
-	SYMBOL_TYPE_EMPTY = (1 << 8) /* Allow execution on empty tasks */
+	SYMBOL_TYPE_EMPTY = (1 << 8), /* Allow execution on empty tasks */
+	SYMBOL_TYPE_CPU = (1 << 9), /* Pure CPU callback that can run in a thread */
+	SYMBOL_TYPE_CONTENT = (1 << 10) /* Result depends merely on the message body */
 };
 
 /**
@@ -159,6 +161,46 @@ gboolean rspamd_symbols_cache_validate (struct symbols_cache *cache,
  */
 ucl_object_t *rspamd_symbols_cache_counters (struct symbols_cache * cache);
 
+/**
+ * Account resources used by a sampled call of lua callback of symbol, they
+ * are merged to the shared counters on resort
+ * @param cache
+ * @param id id of symbol
+ * @param cpu cpu time in seconds
+ * @param mem growth of lua heap in bytes
+ * @param yields number of times the callback has been suspended
+ */
+void rspamd_symbols_cache_add_lua_profile (struct symbols_cache *cache, gint id,
+		gdouble cpu, gint64 mem, guint yields);
+
+/**
+ * Returns average resources used per call of lua callbacks for all symbols
+ * that have been profiled
+ * @param cache
+ * @return array of objects with `symbol`, `samples`, `cpu`, `memory` and
+ * `yields`
+ */
+ucl_object_t *rspamd_symbols_cache_lua_profile (struct symbols_cache *cache);
+
+/**
+ * Returns counters accumulated by this process that are not yet merged to
+ * the shared items, e.g. when the cache is not refreshed periodically
+ * @param cache
+ * @return array of objects with `symbol`, `calls`, `hits`, `time` (total
+ * microseconds) and `lua_cpu` (total seconds of sampled lua calls)
+ */
+ucl_object_t *rspamd_symbols_cache_local_counters (struct symbols_cache *cache);
+
+struct rspamd_json_emitter;
+/**
+ * Write statistics about the cache as JSON array directly to emitter (the
+ * same output as `rspamd_symbols_cache_counters` but with no ucl objects)
+ * @param cache
+ * @param e
+ */
+void rspamd_symbols_cache_counters_emit (struct symbols_cache *cache,
+		struct rspamd_json_emitter *e);
+
 /**
  * Start cache reloading
  * @param cache
@@ -167,6 +209,19 @@ ucl_object_t *rspamd_symbols_cache_counters (struct symbols_cache * cache);
 void rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 		struct event_base *ev_base);
 
+/**
+ * Start threads to execute callbacks registered with SYMBOL_TYPE_CPU flag.
+ * Such callbacks are executed in a thread only if a task has no other
+ * pending events, so they must not use Lua, logging or async events and may
+ * only read the task and insert results, which are collected by the thread
+ * and added to the task by the main thread when the callback is finished
+ * @param cache
+ * @param ev_base
+ * @param nthreads number of threads
+ */
+void rspamd_symbols_cache_start_threads (struct symbols_cache *cache,
+		struct event_base *ev_base, guint nthreads);
+
 /**
  * Increases counter for a specific symbol
  * @param cache
@@ -200,6 +255,24 @@ void rspamd_symbols_cache_add_delayed_dependency (struct symbols_cache *cache,
 void rspamd_symbols_cache_disable_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache, const gchar *symbol);
 
+/**
+ * Disable execution of all symbols registered with SYMBOL_TYPE_CONTENT flag
+ * @param task task object
+ * @param cache cache object
+ */
+void rspamd_symbols_cache_disable_content (struct rspamd_task *task,
+		struct symbols_cache *cache);
+
+/**
+ * Checks if symbol (or its parent) is registered with SYMBOL_TYPE_CONTENT,
+ * symbols of classifiers are never considered as content ones
+ * @param cache cache object
+ * @param symbol symbol name
+ * @return TRUE if the result of symbol depends merely on the message body
+ */
+gboolean rspamd_symbols_cache_is_content (struct symbols_cache *cache,
+		const gchar *symbol);
+
 
 /**
  * Get abstract callback data for a symbol (or its parent symbol)
@@ -22,6 +22,7 @@
 #include "email_addr.h"
 #include "composites.h"
 #include "stat_api.h"
+#include "result_cache.h"
 #include "unix-std.h"
 #include <utlist.h>
 
@@ -31,17 +32,90 @@ rspamd_task_quark (void)
 	return g_quark_from_static_string ("task-error");
 }
 
+/* Finished tasks are kept to reuse their pools and containers */
+#define RSPAMD_TASK_CACHE_MAX 16
+static GPtrArray *tasks_cache = NULL;
+
+static void
+rspamd_task_containers_new (struct rspamd_task *task)
+{
+	task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "task");
+	task->results = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
+	task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_fstring_mapped_ftok_free);
+	task->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_fstring_mapped_ftok_free);
+	task->emails = g_hash_table_new (rspamd_url_hash, rspamd_emails_cmp);
+	task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
+	task->parts = g_ptr_array_sized_new (4);
+	task->text_parts = g_ptr_array_sized_new (2);
+	task->received = g_ptr_array_sized_new (8);
+}
+
+static void
+rspamd_task_containers_clear (struct rspamd_task *task)
+{
+	g_hash_table_remove_all (task->results);
+	g_hash_table_remove_all (task->raw_headers);
+	g_hash_table_remove_all (task->request_headers);
+	g_hash_table_remove_all (task->reply_headers);
+	g_hash_table_remove_all (task->emails);
+	g_hash_table_remove_all (task->urls);
+	g_ptr_array_set_size (task->parts, 0);
+	g_ptr_array_set_size (task->text_parts, 0);
+	g_ptr_array_set_size (task->received, 0);
+}
+
+static void
+rspamd_task_containers_destroy (struct rspamd_task *task)
+{
+	g_hash_table_unref (task->results);
+	g_hash_table_unref (task->raw_headers);
+	g_hash_table_unref (task->request_headers);
+	g_hash_table_unref (task->reply_headers);
+	g_hash_table_unref (task->emails);
+	g_hash_table_unref (task->urls);
+	g_ptr_array_free (task->parts, TRUE);
+	g_ptr_array_free (task->text_parts, TRUE);
+	g_ptr_array_free (task->received, TRUE);
+}
+
 /*
  * Create new task
  */
 struct rspamd_task *
 rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 {
-	struct rspamd_task *new_task;
+	struct rspamd_task *new_task, cached;
 
 	g_assert (cfg != NULL);
 
-	new_task = g_slice_alloc0 (sizeof (struct rspamd_task));
+	if (tasks_cache != NULL && tasks_cache->len > 0) {
+		new_task = g_ptr_array_remove_index_fast (tasks_cache,
+				tasks_cache->len - 1);
+		/* Containers are already cleared */
+		memcpy (&cached, new_task, sizeof (cached));
+		memset (new_task, 0, sizeof (*new_task));
+		new_task->task_pool = cached.task_pool;
+		new_task->results = cached.results;
+		new_task->raw_headers = cached.raw_headers;
+		new_task->request_headers = cached.request_headers;
+		new_task->reply_headers = cached.reply_headers;
+		new_task->emails = cached.emails;
+		new_task->urls = cached.urls;
+		new_task->parts = cached.parts;
+		new_task->text_parts = cached.text_parts;
+		new_task->received = cached.received;
+	}
+	else {
+		new_task = g_slice_alloc0 (sizeof (struct rspamd_task));
+		rspamd_task_containers_new (new_task);
+	}
+
 	new_task->worker = worker;
 	new_task->cfg = cfg;
 	REF_RETAIN (cfg);
@@ -54,47 +128,10 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 	new_task->time_real = rspamd_get_ticks ();
 	new_task->time_virtual = rspamd_get_virtual_ticks ();
 
-	new_task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "task");
-
-	new_task->results = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->results);
 	new_task->re_rt = rspamd_re_cache_runtime_new (cfg->re_cache);
-	new_task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
-	new_task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
-			rspamd_fstring_mapped_ftok_free);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->request_headers);
-	new_task->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
-			rspamd_fstring_mapped_ftok_free);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->raw_headers);
-	new_task->emails = g_hash_table_new (rspamd_url_hash, rspamd_emails_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->emails);
-	new_task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->urls);
-	new_task->parts = g_ptr_array_sized_new (4);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->parts);
-	new_task->text_parts = g_ptr_array_sized_new (2);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->text_parts);
-	new_task->received = g_ptr_array_sized_new (8);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->received);
+	/* Timings of stages are cheap, so they are always collected */
+	new_task->profile = rspamd_mempool_alloc0 (new_task->task_pool,
+			sizeof (*new_task->profile));
 
 	new_task->sock = -1;
 	new_task->flags |= (RSPAMD_TASK_FLAG_MIME|RSPAMD_TASK_FLAG_JSON);
@@ -171,7 +208,14 @@ rspamd_task_free (struct rspamd_task *task)
 
 		for (i = 0; i < task->parts->len; i ++) {
 			p = g_ptr_array_index (task->parts, i);
-			g_byte_array_free (p->content, TRUE);
+
+			if (p->content) {
+				g_byte_array_free (p->content, TRUE);
+			}
+
+			if (p->digests) {
+				g_free (p->digests);
+			}
 
 			if (p->raw_headers_str) {
 				g_free (p->raw_headers_str);
@@ -236,9 +280,7 @@ rspamd_task_free (struct rspamd_task *task)
 			g_error_free (task->err);
 		}
 
-		if (event_get_base (&task->timeout_ev) != NULL) {
-			event_del (&task->timeout_ev);
-		}
+		rspamd_timer_cancel (&task->timeout_ev);
 
 		if (task->guard_ev) {
 			event_del (task->guard_ev);
@@ -247,8 +289,21 @@ rspamd_task_free (struct rspamd_task *task)
 		rspamd_re_cache_runtime_destroy (task->re_rt);
 		REF_RELEASE (task->cfg);
 
-		rspamd_mempool_delete (task->task_pool);
-		g_slice_free1 (sizeof (struct rspamd_task), task);
+		if (tasks_cache == NULL) {
+			tasks_cache = g_ptr_array_sized_new (RSPAMD_TASK_CACHE_MAX);
+		}
+
+		if (tasks_cache->len < RSPAMD_TASK_CACHE_MAX) {
+			/* Containers must be alive while pool destructors are called */
+			rspamd_mempool_reset (task->task_pool);
+			rspamd_task_containers_clear (task);
+			g_ptr_array_add (tasks_cache, task);
+		}
+		else {
+			rspamd_mempool_delete (task->task_pool);
+			rspamd_task_containers_destroy (task);
+			g_slice_free1 (sizeof (struct rspamd_task), task);
+		}
 	}
 }
 
@@ -319,8 +374,17 @@ rspamd_task_load_message (struct rspamd_task *task,
 			return FALSE;
 		}
 
-		map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (st.st_size == 0) {
+			/* Empty files cannot be mapped */
+			close (fd);
+			task->msg.begin = NULL;
+			task->msg.len = 0;
+			task->flags |= RSPAMD_TASK_FLAG_EMPTY;
+
+			return TRUE;
+		}
 
+		map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
 		if (map == MAP_FAILED) {
 			close (fd);
@@ -330,6 +394,12 @@ rspamd_task_load_message (struct rspamd_task *task,
 		}
 
 		close (fd);
+
+		/* Message is parsed from the beginning to the end */
+		if (madvise (map, st.st_size, MADV_SEQUENTIAL) == -1) {
+			msg_debug_task ("madvise failed for %s: %s", fp, strerror (errno));
+		}
+
 		task->msg.begin = map;
 		task->msg.len = st.st_size;
 		task->flags |= RSPAMD_TASK_FLAG_FILE;
@@ -411,6 +481,9 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+static enum rspamd_task_profile_stage rspamd_task_profile_stage_by_bit (
+		guint st);
+
 static gboolean
 rspamd_process_filters (struct rspamd_task *task)
 {
@@ -424,6 +497,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 	gint st;
 	gboolean ret = TRUE;
 	GError *stat_error = NULL;
+	gdouble t1 = 0, c1 = 0;
 
 	/* Avoid nested calls */
 	if (task->flags & RSPAMD_TASK_FLAG_PROCESSING) {
@@ -439,6 +513,11 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	st = rspamd_task_select_processing_stage (task, stages);
 
+	if (task->profile) {
+		t1 = rspamd_get_ticks ();
+		c1 = rspamd_get_thread_ticks ();
+	}
+
 	switch (st) {
 	case RSPAMD_TASK_STAGE_READ_MESSAGE:
 		if (!rspamd_message_parse (task)) {
@@ -451,6 +530,11 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 
 	case RSPAMD_TASK_STAGE_FILTERS:
+		if (task->checkpoint == NULL) {
+			/* Restore content results before the first pass */
+			rspamd_result_cache_lookup (task);
+		}
+
 		if (!rspamd_process_filters (task)) {
 			ret = FALSE;
 		}
@@ -469,6 +553,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 
 	case RSPAMD_TASK_STAGE_COMPOSITES:
+		rspamd_result_cache_store (task);
 		rspamd_make_composites (task);
 		break;
 
@@ -510,6 +595,17 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 	}
 
+	if (task->profile && st > 0 && ffs (st) <= RSPAMD_TASK_STAGES_COUNT) {
+		t1 = rspamd_get_ticks () - t1;
+		task->profile->stages[ffs (st) - 1] += t1;
+		task->profile->stages_cpu[ffs (st) - 1] +=
+				rspamd_get_thread_ticks () - c1;
+		/* Reported by the loop watchdog if the loop has been blocked */
+		rspamd_metrics_note_activity (RSPAMD_METRICS_ACTIVITY_STAGE,
+				rspamd_task_profile_stage_name (
+						rspamd_task_profile_stage_by_bit (st)), t1);
+	}
+
 	if (RSPAMD_TASK_IS_SKIPPED (task)) {
 		task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
 	}
@@ -711,11 +807,10 @@ rspamd_task_log_metric_res (struct rspamd_task *task,
 	static gchar scorebuf[32];
 	rspamd_ftok_t res = {.begin = NULL, .len = 0};
 	struct metric_result *mres;
-	GHashTableIter it;
 	gboolean first = TRUE;
-	gpointer k, v;
 	rspamd_fstring_t *symbuf;
 	struct symbol *sym;
+	guint i;
 
 	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 
@@ -745,10 +840,8 @@ rspamd_task_log_metric_res (struct rspamd_task *task,
 			break;
 		case RSPAMD_LOG_SYMBOLS:
 			symbuf = rspamd_fstring_sized_new (128);
-			g_hash_table_iter_init (&it, mres->symbols);
-
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				sym = (struct symbol *) v;
+			for (i = 0; i < mres->symbols->len; i ++) {
+				sym = g_ptr_array_index (mres->symbols, i);
 
 				if (first) {
 					rspamd_printf_fstring (&symbuf, "%s", sym->name);
@@ -919,6 +1012,183 @@ rspamd_task_write_addr_list (struct rspamd_task *task,
 	return res;
 }
 
+static const gchar *profile_stage_names[RSPAMD_TASK_PROFILE_MAX] = {
+	[RSPAMD_TASK_PROFILE_READ] = "read",
+	[RSPAMD_TASK_PROFILE_PARSE] = "parse",
+	[RSPAMD_TASK_PROFILE_PRE_FILTERS] = "pre_filters",
+	[RSPAMD_TASK_PROFILE_FILTERS] = "filters",
+	[RSPAMD_TASK_PROFILE_CLASSIFIERS] = "classifiers",
+	[RSPAMD_TASK_PROFILE_COMPOSITES] = "composites",
+	[RSPAMD_TASK_PROFILE_POST_FILTERS] = "post_filters",
+	[RSPAMD_TASK_PROFILE_REPLY] = "reply",
+	[RSPAMD_TASK_PROFILE_WAIT] = "wait",
+};
+
+static const gchar *task_limit_names[RSPAMD_TASK_LIMIT_MAX] = {
+	[RSPAMD_TASK_LIMIT_TEXT] = "text",
+	[RSPAMD_TASK_LIMIT_URLS] = "urls",
+	[RSPAMD_TASK_LIMIT_HTML_TAGS] = "html_tags",
+	[RSPAMD_TASK_LIMIT_REGEXP] = "regexp",
+};
+
+void
+rspamd_task_set_limited (struct rspamd_task *task,
+		enum rspamd_task_limit limit)
+{
+	g_assert (limit < RSPAMD_TASK_LIMIT_MAX);
+
+	if (task->limits & (1U << limit)) {
+		return;
+	}
+
+	task->limits |= (1U << limit);
+	task->flags |= RSPAMD_TASK_FLAG_LIMITED;
+	msg_info_task ("<%s>: %s budget is exceeded, process reduced data",
+			task->message_id, task_limit_names[limit]);
+	rspamd_task_insert_result (task, RSPAMD_LIMITS_SYMBOL, 1.0,
+			g_list_prepend (NULL, (gpointer)task_limit_names[limit]));
+}
+
+const gchar *
+rspamd_task_profile_stage_name (enum rspamd_task_profile_stage st)
+{
+	if (st < RSPAMD_TASK_PROFILE_MAX) {
+		return profile_stage_names[st];
+	}
+
+	return "unknown";
+}
+
+static enum rspamd_task_profile_stage
+rspamd_task_profile_stage_by_bit (guint st)
+{
+	switch (st) {
+	case RSPAMD_TASK_STAGE_READ_MESSAGE:
+		return RSPAMD_TASK_PROFILE_PARSE;
+	case RSPAMD_TASK_STAGE_PRE_FILTERS:
+		return RSPAMD_TASK_PROFILE_PRE_FILTERS;
+	case RSPAMD_TASK_STAGE_FILTERS:
+		return RSPAMD_TASK_PROFILE_FILTERS;
+	case RSPAMD_TASK_STAGE_CLASSIFIERS_PRE:
+	case RSPAMD_TASK_STAGE_CLASSIFIERS:
+	case RSPAMD_TASK_STAGE_CLASSIFIERS_POST:
+	case RSPAMD_TASK_STAGE_LEARN_PRE:
+	case RSPAMD_TASK_STAGE_LEARN:
+	case RSPAMD_TASK_STAGE_LEARN_POST:
+		return RSPAMD_TASK_PROFILE_CLASSIFIERS;
+	case RSPAMD_TASK_STAGE_COMPOSITES:
+		return RSPAMD_TASK_PROFILE_COMPOSITES;
+	case RSPAMD_TASK_STAGE_POST_FILTERS:
+		return RSPAMD_TASK_PROFILE_POST_FILTERS;
+	default:
+		/* Connect, envelope and done are bookkeeping */
+		return RSPAMD_TASK_PROFILE_WAIT;
+	}
+}
+
+gboolean
+rspamd_task_profile_get (struct rspamd_task *task,
+		gdouble real[RSPAMD_TASK_PROFILE_MAX],
+		gdouble cpu[RSPAMD_TASK_PROFILE_MAX])
+{
+	struct rspamd_task_profile *prof = task->profile;
+	enum rspamd_task_profile_stage pst;
+	gdouble total, busy = 0;
+	guint i;
+
+	memset (real, 0, sizeof (gdouble) * RSPAMD_TASK_PROFILE_MAX);
+	memset (cpu, 0, sizeof (gdouble) * RSPAMD_TASK_PROFILE_MAX);
+
+	if (prof == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+		pst = rspamd_task_profile_stage_by_bit (1u << i);
+
+		if (pst != RSPAMD_TASK_PROFILE_WAIT) {
+			real[pst] += prof->stages[i];
+			cpu[pst] += prof->stages_cpu[i];
+		}
+	}
+
+	real[RSPAMD_TASK_PROFILE_READ] = prof->read;
+	real[RSPAMD_TASK_PROFILE_REPLY] = prof->reply;
+	cpu[RSPAMD_TASK_PROFILE_REPLY] = prof->reply_cpu;
+
+	for (i = 0; i < RSPAMD_TASK_PROFILE_WAIT; i ++) {
+		busy += real[i];
+	}
+
+	total = rspamd_get_ticks () - task->time_real;
+	real[RSPAMD_TASK_PROFILE_WAIT] = MAX (0, total - busy);
+
+	return TRUE;
+}
+
+ucl_object_t *
+rspamd_task_profile_ucl (struct rspamd_task *task)
+{
+	gdouble real[RSPAMD_TASK_PROFILE_MAX], cpu[RSPAMD_TASK_PROFILE_MAX];
+	ucl_object_t *top, *elt;
+	guint i;
+
+	if (!rspamd_task_profile_get (task, real, cpu)) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_TASK_PROFILE_MAX; i ++) {
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (real[i]),
+				"real", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (cpu[i]),
+				"cpu", 0, false);
+		ucl_object_insert_key (top, elt, profile_stage_names[i], 0, false);
+	}
+
+	return top;
+}
+
+/* Writes `stage: real/cpu` pairs in milliseconds */
+static rspamd_fstring_t *
+rspamd_task_write_profile (struct rspamd_task *task,
+		struct rspamd_log_format *lf, rspamd_fstring_t *logbuf)
+{
+	gdouble real[RSPAMD_TASK_PROFILE_MAX], cpu[RSPAMD_TASK_PROFILE_MAX];
+	rspamd_fstring_t *res = logbuf, *varbuf;
+	rspamd_ftok_t var = {.begin = NULL, .len = 0};
+	guint i;
+
+	if (!rspamd_task_profile_get (task, real, cpu)) {
+		return res;
+	}
+
+	varbuf = rspamd_fstring_new ();
+
+	for (i = 0; i < RSPAMD_TASK_PROFILE_MAX; i ++) {
+		if (real[i] == 0 && cpu[i] == 0) {
+			continue;
+		}
+
+		if (varbuf->len > 0) {
+			varbuf = rspamd_fstring_append (varbuf, ", ", 2);
+		}
+
+		rspamd_printf_fstring (&varbuf, "%s: %.2f/%.2fms",
+				profile_stage_names[i], real[i] * 1000.0, cpu[i] * 1000.0);
+	}
+
+	var.begin = varbuf->str;
+	var.len = varbuf->len;
+	res = rspamd_task_log_write_var (task, logbuf, &var,
+			(const rspamd_ftok_t *)lf->data);
+	rspamd_fstring_free (varbuf);
+
+	return res;
+}
+
 static rspamd_fstring_t *
 rspamd_task_log_variable (struct rspamd_task *task,
 		struct rspamd_log_format *lf, rspamd_fstring_t *logbuf)
@@ -991,6 +1261,8 @@ rspamd_task_log_variable (struct rspamd_task *task,
 				task->cfg->clock_res);
 		var.len = strlen (var.begin);
 		break;
+	case RSPAMD_LOG_TIME_STAGES:
+		return rspamd_task_write_profile (task, lf, logbuf);
 	/* InternetAddress vars */
 	case RSPAMD_LOG_SMTP_FROM:
 		if (task->from_envelope) {
@@ -23,6 +23,7 @@
 #include "mem_pool.h"
 #include "dns.h"
 #include "re_cache.h"
+#include "timer_wheel.h"
 
 #include <gmime/gmime.h>
 
@@ -34,6 +35,7 @@ enum rspamd_command {
 	CMD_SKIP,
 	CMD_PING,
 	CMD_PROCESS,
+	CMD_CHECK_BATCH,
 	CMD_OTHER
 };
 
@@ -103,6 +105,14 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS (1 << 20)
 #define RSPAMD_TASK_FLAG_HAS_HAM_TOKENS (1 << 21)
 #define RSPAMD_TASK_FLAG_EMPTY (1 << 22)
+#define RSPAMD_TASK_FLAG_COMPACT (1 << 23)
+#define RSPAMD_TASK_FLAG_KEEPALIVE (1 << 24)
+#define RSPAMD_TASK_FLAG_ADMITTED (1 << 25)
+#define RSPAMD_TASK_FLAG_PROFILE (1 << 26)
+#define RSPAMD_TASK_FLAG_CACHED_RESULT (1 << 27)
+#define RSPAMD_TASK_FLAG_LIMITED (1 << 28)
+
+#define RSPAMD_LIMITS_SYMBOL "LIMITS_EXCEEDED"
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -110,19 +120,65 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_IS_PROCESSED(task) (((task)->processed_stages & RSPAMD_TASK_STAGE_DONE))
 #define RSPAMD_TASK_IS_CLASSIFIED(task) (((task)->processed_stages & RSPAMD_TASK_STAGE_CLASSIFIERS))
 #define RSPAMD_TASK_IS_EMPTY(task) (((task)->flags & RSPAMD_TASK_FLAG_EMPTY))
+#define RSPAMD_TASK_IS_COMPACT(task) (((task)->flags & RSPAMD_TASK_FLAG_COMPACT))
 
-struct rspamd_email_address;
+/* Number of bits used by `enum rspamd_task_stage` */
+#define RSPAMD_TASK_STAGES_COUNT 15
+
+/**
+ * Timings collected if `profile` is set for a task, they include merely
+ * synchronous work, so time spent waiting for DNS and other replies is not
+ * accounted
+ */
+struct rspamd_task_profile {
+	gdouble stages[RSPAMD_TASK_STAGES_COUNT];	/**< time spent in each stage, indexed by bit	*/
+	gdouble stages_cpu[RSPAMD_TASK_STAGES_COUNT];	/**< cpu time of each stage, indexed by bit	*/
+	gdouble html;								/**< time spent parsing html parts				*/
+	gdouble urls;								/**< time spent extracting urls from text parts	*/
+	gdouble read;								/**< time spent reading a request				*/
+	gdouble reply;								/**< time spent composing a reply				*/
+	gdouble reply_cpu;							/**< cpu time spent composing a reply			*/
+};
+
+/**
+ * Groups of stages reported in logs, replies and metrics
+ */
+enum rspamd_task_profile_stage {
+	RSPAMD_TASK_PROFILE_READ = 0,
+	RSPAMD_TASK_PROFILE_PARSE,
+	RSPAMD_TASK_PROFILE_PRE_FILTERS,
+	RSPAMD_TASK_PROFILE_FILTERS,
+	RSPAMD_TASK_PROFILE_CLASSIFIERS,
+	RSPAMD_TASK_PROFILE_COMPOSITES,
+	RSPAMD_TASK_PROFILE_POST_FILTERS,
+	RSPAMD_TASK_PROFILE_REPLY,
+	/* Time of waiting for async events */
+	RSPAMD_TASK_PROFILE_WAIT,
+	RSPAMD_TASK_PROFILE_MAX
+};
 
+struct rspamd_email_address;
+struct rspamd_stat_tokens;
 
 /**
  * Worker task structure
  */
+/* Resource budgets of a task, see `rspamd_task_set_limited` */
+enum rspamd_task_limit {
+	RSPAMD_TASK_LIMIT_TEXT = 0,
+	RSPAMD_TASK_LIMIT_URLS,
+	RSPAMD_TASK_LIMIT_HTML_TAGS,
+	RSPAMD_TASK_LIMIT_REGEXP,
+	RSPAMD_TASK_LIMIT_MAX
+};
+
 struct rspamd_task {
 	struct rspamd_worker *worker;					/**< pointer to worker object						*/
 	guint processed_stages;							/**< bits of stages that are processed				*/
 	enum rspamd_command cmd;						/**< command										*/
 	gint sock;										/**< socket descriptor								*/
 	guint flags;									/**< Bit flags										*/
+	guint limits;									/**< Bits of exceeded resource budgets				*/
 	guint32 dns_requests;							/**< number of DNS requests per this task			*/
 	gulong message_len;								/**< Message length									*/
 	gchar *helo;									/**< helo header value								*/
@@ -150,7 +206,7 @@ struct rspamd_task {
 	GHashTable *raw_headers;						/**< list of raw headers							*/
 	GHashTable *results;							/**< hash table of metric_result indexed by
 													 *    metric's name									*/
-	GPtrArray *tokens;								/**< statistics tokens */
+	struct rspamd_stat_tokens *tokens;				/**< statistics tokens */
 
 	InternetAddressList *rcpt_mime;
 	GPtrArray *rcpt_envelope;						/**< array of rspamd_email_address					*/
@@ -169,13 +225,16 @@ struct rspamd_task {
 	gboolean (*fin_callback)(struct rspamd_task *task, void *arg);
 													/**< calback for filters finalizing					*/
 	void *fin_arg;									/**< argument for fin callback						*/
+	gboolean (*yield_callback)(struct rspamd_task *task);
+													/**< checks if task should let others run			*/
 
 	struct rspamd_dns_resolver *resolver;			/**< DNS resolver									*/
 	struct event_base *ev_base;						/**< Event base										*/
-	struct event timeout_ev;						/**< Global task timeout							*/
+	struct rspamd_timer timeout_ev;					/**< Global task timeout							*/
 	struct event *guard_ev;							/**< Event for input sanity guard 					*/
 
 	gpointer checkpoint;							/**< Opaque checkpoint data							*/
+	struct rspamd_task_profile *profile;			/**< Timings of processing (may be NULL)			*/
 
 	struct {
 		guint32 action;								/**< Action of pre filters							*/
@@ -268,4 +327,36 @@ gboolean rspamd_learn_task_spam (struct rspamd_task *task,
  */
 void rspamd_task_write_log (struct rspamd_task *task);
 
+/**
+ * Marks task as processed with reduced data because of some exceeded budget,
+ * it sets `RSPAMD_TASK_FLAG_LIMITED` and inserts `LIMITS_EXCEEDED` symbol
+ * with the name of the budget as an option (once per budget)
+ * @param task task object
+ * @param limit exceeded budget
+ */
+void rspamd_task_set_limited (struct rspamd_task *task,
+		enum rspamd_task_limit limit);
+
+/**
+ * Groups timings of a task by the reported stages, time of waiting is
+ * computed as the time since the task start not spent in the stages
+ * @param task task object
+ * @param real wall time of each stage in seconds
+ * @param cpu cpu time of each stage in seconds
+ * @return FALSE if timings are not collected for a task
+ */
+gboolean rspamd_task_profile_get (struct rspamd_task *task,
+		gdouble real[RSPAMD_TASK_PROFILE_MAX],
+		gdouble cpu[RSPAMD_TASK_PROFILE_MAX]);
+
+/**
+ * Returns name of the reported stage
+ */
+const gchar *rspamd_task_profile_stage_name (enum rspamd_task_profile_stage st);
+
+/**
+ * Returns ucl object with timings of the reported stages
+ */
+ucl_object_t *rspamd_task_profile_ucl (struct rspamd_task *task);
+
 #endif /* TASK_H_ */
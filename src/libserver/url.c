@@ -162,13 +162,36 @@ struct url_callback_data {
 	const gchar *last_at;
 	url_insert_function func;
 	void *funcd;
+	guint nurls;
+	guint max_urls; /* Search stops after this number of urls if not zero */
 };
 
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	gsize max_patlen;
+	gboolean prefilter;
+	/* Public suffixes index: rspamd_ftok_t -> struct url_tld_elt */
+	GHashTable *tlds;
 };
 
+enum url_tld_flags {
+	URL_TLD_NORMAL = (1 << 0),
+	URL_TLD_STAR = (1 << 1),
+};
+
+struct url_tld_elt {
+	rspamd_ftok_t tok; /* Must be the first */
+	gint flags;
+};
+
+/*
+ * Every pattern in the search trie contains one of these characters, so for
+ * large texts we scan the trie merely around them
+ */
+static const gchar url_triggers[] = ":@.";
+#define URL_PREFILTER_MIN_LEN 4096
+
 struct url_match_scanner *url_scanner = NULL;
 
 enum {
@@ -336,6 +359,105 @@ rspamd_url_strerror (enum uri_errno err)
 	return NULL;
 }
 
+static void
+rspamd_url_add_tld (struct url_match_scanner *scanner, const gchar *line)
+{
+	struct url_tld_elt *elt;
+	rspamd_ftok_t srch;
+	gchar *str;
+	gint flags = URL_TLD_NORMAL;
+
+	srch.begin = line;
+
+	if (line[0] == '*') {
+		/* *.tld means any label under tld */
+		if (line[1] != '.' || line[2] == '\0') {
+			return;
+		}
+
+		srch.begin = line + 2;
+		flags = URL_TLD_STAR;
+	}
+
+	srch.len = strlen (srch.begin);
+	elt = g_hash_table_lookup (scanner->tlds, &srch);
+
+	if (elt != NULL) {
+		elt->flags |= flags;
+		return;
+	}
+
+	/* Element and string are allocated in a single chunk */
+	elt = g_malloc (sizeof (*elt) + srch.len + 1);
+	str = (gchar *)(elt + 1);
+	rspamd_strlcpy (str, srch.begin, srch.len + 1);
+	rspamd_str_lc (str, srch.len);
+	elt->tok.begin = str;
+	elt->tok.len = srch.len;
+	elt->flags = flags;
+	g_hash_table_insert (scanner->tlds, &elt->tok, elt);
+}
+
+/*
+ * Finds the longest public suffix of the host and returns the domain
+ * registered under it (suffix with one more label), O(labels) lookups
+ */
+static gboolean
+rspamd_url_tld_lookup (const gchar *host, gsize hostlen, rspamd_ftok_t *out)
+{
+	const gchar *p, *end, *label, *q;
+	struct url_tld_elt *elt;
+	rspamd_ftok_t srch;
+	gint flags;
+
+	if (url_scanner == NULL || hostlen == 0 ||
+			g_hash_table_size (url_scanner->tlds) == 0) {
+		return FALSE;
+	}
+
+	end = host + hostlen;
+
+	if (end[-1] == '.') {
+		/* Dot at the end of domain */
+		end --;
+	}
+
+	label = host;
+	p = memchr (host, '.', end - host);
+
+	/* Suffixes are checked starting from the longest one */
+	while (p != NULL && p + 1 < end) {
+		srch.begin = p + 1;
+		srch.len = end - srch.begin;
+		elt = g_hash_table_lookup (url_scanner->tlds, &srch);
+		flags = elt ? (elt->flags & URL_TLD_NORMAL) : 0;
+
+		if (flags == 0) {
+			/* Check if the parent suffix is a wildcard */
+			q = memchr (srch.begin, '.', srch.len);
+
+			if (q != NULL && q + 1 < end) {
+				srch.begin = q + 1;
+				srch.len = end - srch.begin;
+				elt = g_hash_table_lookup (url_scanner->tlds, &srch);
+				flags = elt ? (elt->flags & URL_TLD_STAR) : 0;
+			}
+		}
+
+		if (flags != 0) {
+			out->begin = label;
+			out->len = end - label;
+
+			return TRUE;
+		}
+
+		label = p + 1;
+		p = memchr (label, '.', end - label);
+	}
+
+	return FALSE;
+}
+
 static void
 rspamd_url_parse_tld_file (const gchar *fname,
 		struct url_match_scanner *scanner)
@@ -372,6 +494,7 @@ rspamd_url_parse_tld_file (const gchar *fname,
 			continue;
 		}
 
+		rspamd_url_add_tld (scanner, linebuf);
 		flags = URL_FLAG_NOHTML | URL_FLAG_TLD_MATCH;
 
 #ifndef WITH_HYPERSCAN
@@ -428,6 +551,40 @@ rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 	g_array_append_vals (sc->matchers, static_matchers, n);
 }
 
+static void
+rspamd_url_init_prefilter (struct url_match_scanner *sc)
+{
+	struct url_matcher *m;
+	guint i;
+
+	sc->prefilter = FALSE;
+	sc->max_patlen = 0;
+
+#ifndef WITH_HYPERSCAN
+	/*
+	 * Hyperscan is fast enough on its own and its star TLD patterns have no
+	 * length limit, so windows scan is used with acism only
+	 */
+	for (i = 0; i < sc->matchers->len; i ++) {
+		m = &g_array_index (sc->matchers, struct url_matcher, i);
+
+		if (m->patlen == 0 || rspamd_memcspn (m->pattern, m->patlen,
+				url_triggers, sizeof (url_triggers) - 1) == m->patlen) {
+			msg_info ("pattern %s has no trigger characters, disable url "
+					"prefilter", m->pattern);
+			return;
+		}
+
+		sc->max_patlen = MAX (sc->max_patlen, m->patlen);
+	}
+
+	sc->prefilter = sc->max_patlen > 0;
+#else
+	(void)m;
+	(void)i;
+#endif
+}
+
 void
 rspamd_url_init (const gchar *tld_file)
 {
@@ -439,6 +596,8 @@ rspamd_url_init (const gchar *tld_file)
 				sizeof (struct url_matcher), 512);
 		url_scanner->search_trie = rspamd_multipattern_create_sized (512,
 				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
+		url_scanner->tlds = g_hash_table_new_full (rspamd_ftok_icase_hash,
+				rspamd_ftok_icase_equal, g_free, NULL);
 		rspamd_url_add_static_matchers (url_scanner);
 
 		if (tld_file != NULL) {
@@ -455,6 +614,7 @@ rspamd_url_init (const gchar *tld_file)
 			g_error_free (err);
 		}
 
+		rspamd_url_init_prefilter (url_scanner);
 		msg_info ("initialized trie of %ud elements",
 				url_scanner->matchers->len);
 	}
@@ -1093,68 +1253,6 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = url->host;
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = url->host + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-
-		p--;
-	}
-
-	if (ndots == 0 || p == start - 1) {
-		url->tld = (gchar *) pos;
-		url->tldlen = url->host + url->hostlen - pos;
-	}
-
-	return 1;
-}
-
 static gboolean
 rspamd_url_is_ip (struct rspamd_url *uri, rspamd_mempool_t *pool)
 {
@@ -1421,6 +1519,7 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	const gchar *end;
 	guint i, complen, ret;
 	gsize unquoted_len = 0;
+	rspamd_ftok_t tld;
 
 	const struct {
 		enum rspamd_url_protocol proto;
@@ -1576,9 +1675,16 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	}
 
 	/* Find TLD part */
-	if (rspamd_multipattern_lookup (url_scanner->search_trie,
-			uri->host, uri->hostlen,
-			rspamd_tld_trie_callback, uri, NULL) == 0) {
+	if (rspamd_url_tld_lookup (uri->host, uri->hostlen, &tld)) {
+		uri->tld = (gchar *)tld.begin;
+		uri->tldlen = tld.len;
+
+		if (uri->host[uri->hostlen - 1] == '.') {
+			/* This is dot at the end of domain */
+			uri->hostlen --;
+		}
+	}
+	else {
 		/* Ignore URL's without TLD if it is not a numeric URL */
 		if (!rspamd_url_is_ip (uri, pool)) {
 			return URI_ERRNO_TLD_MISSING;
@@ -1592,85 +1698,14 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
-
-static gint
-rspamd_tld_trie_find_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
-
-	if (*pos != '.' || match_pos != (gint)cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint)cbdata->len - 1) {
-			/* Search more */
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-
-		p--;
-	}
-
-	if (ndots == 0 || p == start - 1) {
-		cbdata->out->begin = pos;
-		cbdata->out->len = cbdata->begin + cbdata->len - pos;
-	}
-
-	return 1;
-}
-
 gboolean
 rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
-
 	g_assert (in != NULL);
 	g_assert (out != NULL);
 	g_assert (url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
-
-	if (rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
-			rspamd_tld_trie_find_callback, &cbdata, NULL) == 0) {
-		return FALSE;
-	}
-
-	return TRUE;
+	return rspamd_url_tld_lookup (in, inlen, out);
 }
 
 static const gchar url_braces[] = {
@@ -2085,6 +2120,96 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 	return 0;
 }
 
+struct url_window_cbdata {
+	rspamd_multipattern_cb_t cb;
+	gpointer ud;
+	const gchar *begin;
+	gsize len;
+	gint offset;
+};
+
+static gint
+rspamd_url_window_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct url_window_cbdata *wcb = context;
+
+	/* Callbacks expect offsets in the whole text */
+	return wcb->cb (mp, strnum, match_start + wcb->offset,
+			match_pos + wcb->offset, wcb->begin, wcb->len, wcb->ud);
+}
+
+/*
+ * Search trie in a text: for large texts we find trigger characters first
+ * and scan merely the windows of max pattern length around them. As each
+ * pattern has a trigger character inside, the set and the order of matches
+ * is the same as for the whole text scan
+ */
+static gint
+rspamd_url_trie_lookup (const gchar *in, gsize inlen,
+		rspamd_multipattern_cb_t cb, gpointer ud)
+{
+	struct url_window_cbdata wcb;
+	const gchar *p, *end, *t, *wstart, *wend;
+	gsize span, ntriggers = sizeof (url_triggers) - 1;
+	gint ret;
+
+	if (!url_scanner->prefilter || inlen < URL_PREFILTER_MIN_LEN) {
+		return rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
+				cb, ud, NULL);
+	}
+
+	wcb.cb = cb;
+	wcb.ud = ud;
+	wcb.begin = in;
+	wcb.len = inlen;
+
+	span = url_scanner->max_patlen;
+	p = in;
+	end = in + inlen;
+	t = p + rspamd_memcspn (p, end - p, url_triggers, ntriggers);
+
+	while (t < end) {
+		/* Any match that includes t is inside [t - span + 1, t + span) */
+		wstart = (gsize)(t - p) >= span ? t - span + 1 : p;
+		wend = (gsize)(end - t) > span ? t + span : end;
+
+		/* Join windows of the subsequent triggers that overlap this one */
+		for (;;) {
+			if (wend == end) {
+				t = end;
+				break;
+			}
+
+			t ++;
+			t += rspamd_memcspn (t, end - t, url_triggers, ntriggers);
+
+			if (t == end || (t >= wend && (gsize)(t - wend) >= span - 1)) {
+				break;
+			}
+
+			wend = (gsize)(end - t) > span ? t + span : end;
+		}
+
+		wcb.offset = wstart - in;
+		ret = rspamd_multipattern_lookup (url_scanner->search_trie, wstart,
+				wend - wstart, rspamd_url_window_callback, &wcb, NULL);
+
+		if (ret != 0) {
+			return ret;
+		}
+
+		p = wend;
+	}
+
+	return 0;
+}
+
 gboolean
 rspamd_url_find (rspamd_mempool_t *pool,
 		const gchar *begin,
@@ -2101,8 +2226,7 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	cb.is_html = is_html;
 	cb.pool = pool;
 
-	ret = rspamd_multipattern_lookup (url_scanner->search_trie, begin, len,
-			rspamd_url_trie_callback, &cb, NULL);
+	ret = rspamd_url_trie_lookup (begin, len, rspamd_url_trie_callback, &cb);
 
 	if (ret) {
 		if (url_str) {
@@ -2115,6 +2239,61 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	return FALSE;
 }
 
+struct url_parse_cache_elt {
+	struct rspamd_url *url;
+	enum uri_errno rc;
+};
+
+#define URL_PARSE_CACHE_VAR "url_parse_cache"
+
+/*
+ * The same url is usually repeated many times in a message (e.g. tracking
+ * links in html and text parts), so the results of parsing are kept per
+ * memory pool (so per task) and keyed by the raw candidate string. Each
+ * consumer gets its own copy of the parsed url, as flags and linked urls are
+ * set by consumers, whilst the parsed strings are shared
+ */
+static enum uri_errno
+rspamd_url_parse_cached (rspamd_mempool_t *pool, gchar *str,
+		struct rspamd_url **purl, gboolean *cached)
+{
+	GHashTable *cache;
+	struct url_parse_cache_elt *elt;
+	gchar *key;
+
+	cache = rspamd_mempool_get_variable (pool, URL_PARSE_CACHE_VAR);
+
+	if (cache == NULL) {
+		cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		rspamd_mempool_set_variable (pool, URL_PARSE_CACHE_VAR, cache,
+				(rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	elt = g_hash_table_lookup (cache, str);
+
+	if (elt != NULL) {
+		*purl = rspamd_mempool_alloc (pool, sizeof (struct rspamd_url));
+		memcpy (*purl, elt->url, sizeof (struct rspamd_url));
+		*cached = TRUE;
+
+		return elt->rc;
+	}
+
+	/* Parsing modifies the string, so we need to save the key */
+	key = rspamd_mempool_strdup (pool, str);
+	elt = rspamd_mempool_alloc (pool, sizeof (*elt));
+	elt->url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
+	g_strstrip (str);
+	elt->rc = rspamd_url_parse (elt->url, str, strlen (str), pool);
+	g_hash_table_insert (cache, key, elt);
+
+	*purl = rspamd_mempool_alloc (pool, sizeof (struct rspamd_url));
+	memcpy (*purl, elt->url, sizeof (struct rspamd_url));
+	*cached = FALSE;
+
+	return elt->rc;
+}
+
 static gint
 rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 		guint strnum,
@@ -2131,6 +2310,7 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 	const gchar *pos;
 	struct url_callback_data *cb = context;
 	gint rc;
+	gboolean cached;
 	rspamd_mempool_t *pool;
 
 	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
@@ -2174,16 +2354,18 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 		cb->start = m.m_begin;
 		cb->fin = m.m_begin + m.m_len;
-		url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
-		g_strstrip (cb->url_str);
-		rc = rspamd_url_parse (url, cb->url_str, strlen (cb->url_str), pool);
+		rc = rspamd_url_parse_cached (pool, cb->url_str, &url, &cached);
 
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
 			if (cb->func) {
 				cb->func (url, cb->start - text, cb->fin - text, cb->funcd);
 			}
+
+			if (cb->max_urls > 0 && ++cb->nurls >= cb->max_urls) {
+				return 1;
+			}
 		}
-		else if (rc != URI_ERRNO_OK) {
+		else if (rc != URI_ERRNO_OK && !cached) {
 			msg_info_pool_check ("extract of url '%s' failed: %s",
 					cb->url_str,
 					rspamd_url_strerror (rc));
@@ -2236,7 +2418,7 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	struct process_exception *ex;
 	struct rspamd_task *task;
 	gchar *url_str = NULL;
-	struct rspamd_url *query_url;
+	struct rspamd_url *query_url, *existing = NULL;
 	gint rc;
 
 	task = cbd->task;
@@ -2254,7 +2436,9 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 		}
 	}
 	else {
-		if (!g_hash_table_lookup (task->urls, url)) {
+		existing = g_hash_table_lookup (task->urls, url);
+
+		if (!existing) {
 			g_hash_table_insert (task->urls, url, url);
 		}
 	}
@@ -2263,8 +2447,11 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 			cbd->part->urls_offset,
 			ex);
 
-	/* We also search the query for additional url inside */
-	if (url->querylen > 0) {
+	/*
+	 * We also search the query for additional url inside, unless this very
+	 * url has been already processed (parsed urls are shared within a task)
+	 */
+	if (url->querylen > 0 && existing != url) {
 		if (rspamd_url_find (task->task_pool,
 				url->query,
 				url->querylen,
@@ -2294,6 +2481,35 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	}
 }
 
+static guint
+rspamd_url_find_multiple_limited (rspamd_mempool_t *pool, const gchar *in,
+		gsize inlen, gboolean is_html, guint max_urls,
+		url_insert_function func, gpointer ud)
+{
+	struct url_callback_data cb;
+
+	g_assert (in != NULL);
+
+	if (inlen == 0) {
+		inlen = strlen (in);
+	}
+
+	memset (&cb, 0, sizeof (cb));
+	cb.begin = in;
+	cb.end = in + inlen;
+	cb.is_html = is_html;
+	cb.pool = pool;
+	cb.max_urls = max_urls;
+
+	cb.funcd = ud;
+	cb.func = func;
+
+	rspamd_url_trie_lookup (in, inlen,
+			rspamd_url_trie_generic_callback_multiple, &cb);
+
+	return cb.nurls;
+}
+
 void
 rspamd_url_text_extract (rspamd_mempool_t *pool,
 		struct rspamd_task *task,
@@ -2301,19 +2517,37 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 		gboolean is_html)
 {
 	struct rspamd_url_mimepart_cbdata mcbd;
+	guint nurls, max_urls = 0;
 
 	if (part->content == NULL || part->content->len == 0) {
 		msg_warn_task ("got empty text part");
 		return;
 	}
 
+	if (task->cfg->max_urls > 0) {
+		nurls = g_hash_table_size (task->urls) +
+				g_hash_table_size (task->emails);
+
+		if (nurls >= task->cfg->max_urls) {
+			rspamd_task_set_limited (task, RSPAMD_TASK_LIMIT_URLS);
+			return;
+		}
+
+		max_urls = task->cfg->max_urls - nurls;
+	}
+
 	mcbd.task = task;
 	mcbd.part = part;
 
-	rspamd_url_find_multiple (task->task_pool, part->content->data,
-			part->content->len, is_html,
+	nurls = rspamd_url_find_multiple_limited (task->task_pool,
+			part->content->data,
+			part->content->len, is_html, max_urls,
 			rspamd_url_text_part_callback, &mcbd);
 
+	if (max_urls > 0 && nurls >= max_urls) {
+		rspamd_task_set_limited (task, RSPAMD_TASK_LIMIT_URLS);
+	}
+
 	/* Handle offsets of this part */
 	if (part->urls_offset != NULL) {
 		part->urls_offset = g_list_reverse (part->urls_offset);
@@ -2327,26 +2561,7 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen, gboolean is_html,
 		url_insert_function func, gpointer ud)
 {
-	struct url_callback_data cb;
-
-	g_assert (in != NULL);
-
-	if (inlen == 0) {
-		inlen = strlen (in);
-	}
-
-	memset (&cb, 0, sizeof (cb));
-	cb.begin = in;
-	cb.end = in + inlen;
-	cb.is_html = is_html;
-	cb.pool = pool;
-
-	cb.funcd = ud;
-	cb.func = func;
-
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	rspamd_url_find_multiple_limited (pool, in, inlen, is_html, 0, func, ud);
 }
 
 void
@@ -2371,9 +2586,8 @@ rspamd_url_find_single (rspamd_mempool_t *pool, const gchar *in,
 	cb.funcd = ud;
 	cb.func = func;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_single, &cb, NULL);
+	rspamd_url_trie_lookup (in, inlen,
+			rspamd_url_trie_generic_callback_single, &cb);
 }
 
 
@@ -0,0 +1,213 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "worker_metrics.h"
+
+const gdouble rspamd_metrics_latency_bounds[RSPAMD_METRICS_LATENCY_BUCKETS - 1] = {
+	0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+const gchar *rspamd_metrics_memory_names[RSPAMD_METRICS_MEMORY_MAX] = {
+	"tasks", "maps", "symcache", "config", "pools", "lua", "hyperscan"
+};
+
+/* Slot of the current process, set after fork */
+static struct rspamd_worker_metrics *current_metrics = NULL;
+/* Longest activities since the last check of the loop watchdog */
+static struct rspamd_metrics_activity activities[RSPAMD_METRICS_ACTIVITY_MAX];
+
+struct rspamd_metrics_segment *
+rspamd_metrics_segment_new (rspamd_mempool_t *pool, guint nslots)
+{
+	struct rspamd_metrics_segment *seg;
+	guchar *p;
+
+	g_assert (nslots > 0);
+
+	seg = rspamd_mempool_alloc0 (pool, sizeof (*seg));
+	/* Shared allocations are not aligned to cache lines */
+	p = rspamd_mempool_alloc0_shared (pool,
+			(nslots + 1) * sizeof (struct rspamd_metrics_slot));
+	p += (RSPAMD_METRICS_CACHELINE -
+			((guintptr)p % RSPAMD_METRICS_CACHELINE)) % RSPAMD_METRICS_CACHELINE;
+	seg->slots = (struct rspamd_metrics_slot *)p;
+	seg->nslots = nslots;
+
+	return seg;
+}
+
+struct rspamd_worker_metrics *
+rspamd_metrics_acquire (struct rspamd_metrics_segment *seg, GQuark type)
+{
+	struct rspamd_worker_metrics *m, *unused = NULL;
+	guint i;
+
+	for (i = 0; i < seg->nslots; i ++) {
+		m = &seg->slots[i].m;
+
+		if (m->pid != 0) {
+			continue;
+		}
+
+		if (m->type == type) {
+			/* Continue counters of the dead worker of the same type */
+			m->inflight = 0;
+			memset (m->memory, 0, sizeof (m->memory));
+
+			return m;
+		}
+
+		if (m->type == 0 && unused == NULL) {
+			unused = m;
+		}
+	}
+
+	if (unused) {
+		unused->type = type;
+	}
+
+	return unused;
+}
+
+void
+rspamd_metrics_release (struct rspamd_worker_metrics *m)
+{
+	if (m) {
+		m->pid = 0;
+		m->inflight = 0;
+		memset (m->memory, 0, sizeof (m->memory));
+	}
+}
+
+void
+rspamd_metrics_set_current (struct rspamd_worker_metrics *m)
+{
+	current_metrics = m;
+}
+
+struct rspamd_worker_metrics *
+rspamd_metrics_current (void)
+{
+	return current_metrics;
+}
+
+void
+rspamd_metrics_observe (struct rspamd_latency_histogram *h, gdouble seconds)
+{
+	guint i;
+
+	if (seconds < 0) {
+		seconds = 0;
+	}
+
+	for (i = 0; i < RSPAMD_METRICS_LATENCY_BUCKETS - 1; i ++) {
+		if (seconds <= rspamd_metrics_latency_bounds[i]) {
+			break;
+		}
+	}
+
+	h->buckets[i] ++;
+	h->count ++;
+	h->sum_us += (guint64)(seconds * 1e6);
+}
+
+void
+rspamd_metrics_note_activity (enum rspamd_metrics_activity_type type,
+		const gchar *name, gdouble seconds)
+{
+	g_assert (type < RSPAMD_METRICS_ACTIVITY_MAX);
+
+	if (seconds > activities[type].time) {
+		activities[type].name = name;
+		activities[type].time = seconds;
+	}
+}
+
+const struct rspamd_metrics_activity *
+rspamd_metrics_activity_get (enum rspamd_metrics_activity_type type)
+{
+	g_assert (type < RSPAMD_METRICS_ACTIVITY_MAX);
+
+	return &activities[type];
+}
+
+void
+rspamd_metrics_activity_reset (void)
+{
+	memset (activities, 0, sizeof (activities));
+}
+
+static void
+rspamd_metrics_histogram_add (struct rspamd_latency_histogram *res,
+		const struct rspamd_latency_histogram *h)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_METRICS_LATENCY_BUCKETS; i ++) {
+		res->buckets[i] += h->buckets[i];
+	}
+
+	res->count += h->count;
+	res->sum_us += h->sum_us;
+}
+
+guint
+rspamd_metrics_sum (struct rspamd_metrics_segment *seg, GQuark type,
+		struct rspamd_worker_metrics *res)
+{
+	struct rspamd_worker_metrics *m;
+	guint i, j, nrunning = 0;
+
+	memset (res, 0, sizeof (*res));
+	res->type = type;
+
+	for (i = 0; i < seg->nslots; i ++) {
+		m = &seg->slots[i].m;
+
+		if (m->type == 0 || (type != 0 && m->type != type)) {
+			continue;
+		}
+
+		if (m->pid != 0) {
+			nrunning ++;
+			res->inflight += m->inflight;
+
+			for (j = 0; j < RSPAMD_METRICS_MEMORY_MAX; j ++) {
+				res->memory[j] += m->memory[j];
+			}
+		}
+
+		res->scans += m->scans;
+		res->connections += m->connections;
+
+		for (j = 0; j <= METRIC_ACTION_NOACTION; j ++) {
+			res->actions[j] += m->actions[j];
+		}
+
+		rspamd_metrics_histogram_add (&res->scan_time, &m->scan_time);
+		rspamd_metrics_histogram_add (&res->dns_time, &m->dns_time);
+		rspamd_metrics_histogram_add (&res->redis_time, &m->redis_time);
+		rspamd_metrics_histogram_add (&res->loop_lag, &m->loop_lag);
+		res->loop_stalls += m->loop_stalls;
+
+		for (j = 0; j < RSPAMD_METRICS_STAGES; j ++) {
+			res->stages_real_us[j] += m->stages_real_us[j];
+			res->stages_cpu_us[j] += m->stages_cpu_us[j];
+		}
+	}
+
+	return nrunning;
+}
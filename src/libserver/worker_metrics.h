@@ -0,0 +1,192 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_WORKER_METRICS_H_
+#define SRC_LIBSERVER_WORKER_METRICS_H_
+
+#include "config.h"
+#include "mem_pool.h"
+#include "cfg_file.h"
+
+/**
+ * @file worker_metrics.h
+ *
+ * Per-worker counters placed in shared memory. Each worker owns a single
+ * slot padded to a cache line and is the only process writing to it, so
+ * updates are plain stores without atomics or locks. Readers (the
+ * controller) sum all slots on request and can see slightly stale values
+ */
+
+#define RSPAMD_METRICS_CACHELINE 64
+#define RSPAMD_METRICS_MAX_SLOTS 256
+/* Including the last (infinite) bucket */
+#define RSPAMD_METRICS_LATENCY_BUCKETS 13
+/* Number of reported stages of tasks (RSPAMD_TASK_PROFILE_MAX) */
+#define RSPAMD_METRICS_STAGES 9
+
+/**
+ * Subsystems whose memory usage is accounted in each worker
+ */
+enum rspamd_metrics_memory_type {
+	RSPAMD_METRICS_MEMORY_TASKS = 0,	/**< pools of tasks						*/
+	RSPAMD_METRICS_MEMORY_MAPS,			/**< pools of maps and radix trees		*/
+	RSPAMD_METRICS_MEMORY_SYMCACHE,		/**< symbols cache						*/
+	RSPAMD_METRICS_MEMORY_CONFIG,		/**< configuration pool					*/
+	RSPAMD_METRICS_MEMORY_POOLS,		/**< all memory pools					*/
+	RSPAMD_METRICS_MEMORY_LUA,			/**< lua heap							*/
+	RSPAMD_METRICS_MEMORY_HYPERSCAN,	/**< loaded hyperscan databases			*/
+	RSPAMD_METRICS_MEMORY_MAX
+};
+
+struct rspamd_latency_histogram {
+	guint64 buckets[RSPAMD_METRICS_LATENCY_BUCKETS]; /* non cumulative */
+	guint64 count;
+	guint64 sum_us;
+};
+
+struct rspamd_worker_metrics {
+	pid_t pid;                      /**< owner of slot, 0 if not running		*/
+	GQuark type;                    /**< type of the last owner					*/
+	guint64 scans;                  /**< messages scanned						*/
+	guint64 connections;            /**< connections accepted					*/
+	guint64 actions[METRIC_ACTION_NOACTION + 1];
+	guint64 inflight;               /**< tasks being processed now (gauge)		*/
+	struct rspamd_latency_histogram scan_time;
+	struct rspamd_latency_histogram dns_time;
+	struct rspamd_latency_histogram redis_time;
+	guint64 stages_real_us[RSPAMD_METRICS_STAGES];	/**< wall time of tasks stages	*/
+	guint64 stages_cpu_us[RSPAMD_METRICS_STAGES];	/**< cpu time of tasks stages	*/
+	struct rspamd_latency_histogram loop_lag;	/**< delays of the event loop watchdog	*/
+	guint64 loop_stalls;            /**< delays longer than the lag threshold		*/
+	guint64 memory[RSPAMD_METRICS_MEMORY_MAX];	/**< bytes used by subsystems (gauges)	*/
+};
+
+/**
+ * Kinds of synchronous work that can block the event loop of a worker
+ */
+enum rspamd_metrics_activity_type {
+	RSPAMD_METRICS_ACTIVITY_STAGE = 0,
+	RSPAMD_METRICS_ACTIVITY_SYMBOL,
+	RSPAMD_METRICS_ACTIVITY_MAX
+};
+
+/**
+ * The longest activity of a kind since the last watchdog check
+ */
+struct rspamd_metrics_activity {
+	const gchar *name;              /**< static or config lifetime string		*/
+	gdouble time;                   /**< duration in seconds					*/
+};
+
+struct rspamd_metrics_slot {
+	struct rspamd_worker_metrics m;
+	guchar pad[RSPAMD_METRICS_CACHELINE -
+			sizeof (struct rspamd_worker_metrics) % RSPAMD_METRICS_CACHELINE];
+};
+
+struct rspamd_metrics_segment {
+	guint nslots;
+	struct rspamd_metrics_slot *slots;
+};
+
+/**
+ * Names of memory subsystems indexed by `rspamd_metrics_memory_type`
+ */
+extern const gchar *rspamd_metrics_memory_names[RSPAMD_METRICS_MEMORY_MAX];
+
+/**
+ * Upper bounds of latency buckets in seconds (the last bucket is unbounded)
+ */
+extern const gdouble rspamd_metrics_latency_bounds[RSPAMD_METRICS_LATENCY_BUCKETS - 1];
+
+/**
+ * Allocate shared segment of metrics slots
+ * @param pool pool used for the shared allocation (must outlive all workers)
+ * @param nslots number of slots
+ * @return new segment
+ */
+struct rspamd_metrics_segment *rspamd_metrics_segment_new (
+		rspamd_mempool_t *pool, guint nslots);
+
+/**
+ * Pick a slot for a new worker of the specified type (called by the main
+ * process before fork). Slots previously owned by workers of the same type
+ * are preferred, so the sums per type never decrease on workers restarts
+ * @param seg
+ * @param type
+ * @return slot or NULL if there are no free slots
+ */
+struct rspamd_worker_metrics *rspamd_metrics_acquire (
+		struct rspamd_metrics_segment *seg, GQuark type);
+
+/**
+ * Mark slot as not running, counters are kept for the next worker
+ * @param m
+ */
+void rspamd_metrics_release (struct rspamd_worker_metrics *m);
+
+/**
+ * Set slot of the current process (called after fork)
+ * @param m
+ */
+void rspamd_metrics_set_current (struct rspamd_worker_metrics *m);
+
+/**
+ * Returns slot of the current process or NULL
+ */
+struct rspamd_worker_metrics *rspamd_metrics_current (void);
+
+/**
+ * Account value in histogram
+ * @param h
+ * @param seconds
+ */
+void rspamd_metrics_observe (struct rspamd_latency_histogram *h,
+		gdouble seconds);
+
+/**
+ * Record synchronous activity of the current process, only the longest one of
+ * each kind is kept until `rspamd_metrics_activity_reset`
+ * @param type kind of activity
+ * @param name name that must live until the next reset
+ * @param seconds duration
+ */
+void rspamd_metrics_note_activity (enum rspamd_metrics_activity_type type,
+		const gchar *name, gdouble seconds);
+
+/**
+ * Returns the longest activity of the specified kind since the last reset
+ * @param type
+ * @return activity with NULL name if nothing has been recorded
+ */
+const struct rspamd_metrics_activity *rspamd_metrics_activity_get (
+		enum rspamd_metrics_activity_type type);
+
+/**
+ * Forget all recorded activities
+ */
+void rspamd_metrics_activity_reset (void);
+
+/**
+ * Sum all slots of the specified type
+ * @param seg
+ * @param type type of workers or 0 for all workers
+ * @param res result (zeroed by this function)
+ * @return number of running workers accounted
+ */
+guint rspamd_metrics_sum (struct rspamd_metrics_segment *seg, GQuark type,
+		struct rspamd_worker_metrics *res);
+
+#endif /* SRC_LIBSERVER_WORKER_METRICS_H_ */
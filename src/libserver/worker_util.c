@@ -24,6 +24,7 @@
 #include "rspamd_control.h"
 #include "libutil/map.h"
 #include "libutil/map_private.h"
+#include "re_cache.h"
 
 #ifdef WITH_GPERF_TOOLS
 #include <gperftools/profiler.h>
@@ -42,6 +43,9 @@
 #ifdef HAVE_LIBUTIL_H
 #include <libutil.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
 /**
  * Return worker's control structure by its type
@@ -243,6 +247,145 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
 
+/*
+ * Watchdog measures how late its timer is called, which is the time the event
+ * loop has been blocked by synchronous code
+ */
+struct rspamd_worker_watchdog {
+	struct event ev;
+	struct timeval tv;
+	gdouble interval;
+	gdouble expected;
+	gdouble threshold;
+	struct rspamd_worker *worker;
+};
+
+static void
+rspamd_worker_watchdog_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_watchdog *wd = ud;
+	const struct rspamd_metrics_activity *stage, *symbol;
+	gdouble now, lag;
+
+	now = rspamd_get_ticks ();
+	lag = now - wd->expected;
+
+	if (lag < 0) {
+		lag = 0;
+	}
+
+	if (wd->worker->metrics) {
+		rspamd_metrics_observe (&wd->worker->metrics->loop_lag, lag);
+	}
+
+	if (lag > wd->threshold) {
+		if (wd->worker->metrics) {
+			wd->worker->metrics->loop_stalls ++;
+		}
+
+		stage = rspamd_metrics_activity_get (RSPAMD_METRICS_ACTIVITY_STAGE);
+		symbol = rspamd_metrics_activity_get (RSPAMD_METRICS_ACTIVITY_SYMBOL);
+		msg_warn ("event loop of %s process has been blocked for %.3f seconds; "
+				"longest stage: %s (%.1f ms), longest symbol: %s (%.1f ms)",
+				g_quark_to_string (wd->worker->type), lag,
+				stage->name ? stage->name : "none", stage->time * 1000.0,
+				symbol->name ? symbol->name : "none", symbol->time * 1000.0);
+	}
+
+	rspamd_metrics_activity_reset ();
+	wd->expected = now + wd->interval;
+	event_add (&wd->ev, &wd->tv);
+}
+
+static void
+rspamd_worker_watchdog_start (struct rspamd_worker *worker,
+		struct event_base *ev_base)
+{
+	struct rspamd_worker_watchdog *wd;
+	struct rspamd_config *cfg = worker->srv->cfg;
+
+	if (cfg->loop_watchdog_interval <= 0) {
+		return;
+	}
+
+	/* Lives as long as the process */
+	wd = g_malloc0 (sizeof (*wd));
+	wd->worker = worker;
+	wd->interval = cfg->loop_watchdog_interval;
+	wd->threshold = cfg->loop_lag_threshold;
+	double_to_tv (wd->interval, &wd->tv);
+	event_set (&wd->ev, -1, EV_TIMEOUT, rspamd_worker_watchdog_handler, wd);
+	event_base_set (ev_base, &wd->ev);
+	wd->expected = rspamd_get_ticks () + wd->interval;
+	event_add (&wd->ev, &wd->tv);
+	rspamd_metrics_activity_reset ();
+}
+
+/* Interval of memory accounting of workers in seconds */
+#define RSPAMD_WORKER_MEMORY_INTERVAL 10.0
+
+struct rspamd_worker_memory_timer {
+	struct event ev;
+	struct timeval tv;
+	struct rspamd_worker *worker;
+};
+
+static void
+rspamd_worker_account_memory (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_metrics *m = worker->metrics;
+	struct rspamd_config *cfg = worker->srv->cfg;
+	lua_State *L = cfg->lua_state;
+
+	m->memory[RSPAMD_METRICS_MEMORY_TASKS] = rspamd_mempool_tag_bytes ("task");
+	m->memory[RSPAMD_METRICS_MEMORY_MAPS] = rspamd_mempool_tag_bytes ("map") +
+			rspamd_mempool_tag_bytes ("radix");
+	m->memory[RSPAMD_METRICS_MEMORY_SYMCACHE] =
+			rspamd_mempool_tag_bytes ("symcache");
+	m->memory[RSPAMD_METRICS_MEMORY_CONFIG] = rspamd_mempool_tag_bytes ("cfg");
+	m->memory[RSPAMD_METRICS_MEMORY_POOLS] = rspamd_mempool_tag_bytes (NULL);
+
+	if (L) {
+		m->memory[RSPAMD_METRICS_MEMORY_LUA] =
+				(guint64)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+				lua_gc (L, LUA_GCCOUNTB, 0);
+	}
+
+	if (cfg->re_cache) {
+		m->memory[RSPAMD_METRICS_MEMORY_HYPERSCAN] =
+				rspamd_re_cache_hyperscan_size (cfg->re_cache);
+	}
+}
+
+static void
+rspamd_worker_memory_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_memory_timer *mt = ud;
+
+	rspamd_worker_account_memory (mt->worker);
+	event_add (&mt->ev, &mt->tv);
+}
+
+static void
+rspamd_worker_memory_start (struct rspamd_worker *worker,
+		struct event_base *ev_base)
+{
+	struct rspamd_worker_memory_timer *mt;
+
+	if (worker->metrics == NULL) {
+		return;
+	}
+
+	/* Lives as long as the process */
+	mt = g_malloc0 (sizeof (*mt));
+	mt->worker = worker;
+	double_to_tv (RSPAMD_WORKER_MEMORY_INTERVAL, &mt->tv);
+	evtimer_set (&mt->ev, rspamd_worker_memory_handler, mt);
+	event_base_set (ev_base, &mt->ev);
+	event_add (&mt->ev, &mt->tv);
+	rspamd_worker_account_memory (worker);
+}
+
 struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *))
@@ -267,6 +410,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 	rspamd_worker_init_signals (worker, ev_base);
 	rspamd_control_worker_add_default_handler (worker, ev_base);
+	rspamd_worker_watchdog_start (worker, ev_base);
+	rspamd_worker_memory_start (worker, ev_base);
 
 	/* Accept all sockets */
 	if (accept_handler) {
@@ -289,6 +434,17 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	return ev_base;
 }
 
+void
+rspamd_worker_notify_ready (struct rspamd_worker *worker,
+		struct event_base *ev_base)
+{
+	struct rspamd_srv_command srv_cmd;
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_READY;
+	rspamd_srv_send_command (worker, ev_base, &srv_cmd, -1, NULL, NULL);
+}
+
 void
 rspamd_worker_stop_accept (struct rspamd_worker *worker)
 {
@@ -412,6 +568,29 @@ rspamd_controller_send_ucl (struct rspamd_http_connection_entry *entry,
 	entry->is_reply = TRUE;
 }
 
+void
+rspamd_controller_send_json (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_t *body)
+{
+	struct rspamd_http_message *msg;
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->date = time (NULL);
+	msg->code = 200;
+	msg->status = rspamd_fstring_new_init ("OK", 2);
+	msg->body = body;
+	rspamd_http_connection_reset (entry->conn);
+	rspamd_http_connection_write_message (entry->conn,
+		msg,
+		NULL,
+		"application/json",
+		entry,
+		entry->conn->fd,
+		entry->rt->ptv,
+		entry->rt->ev_base);
+	entry->is_reply = TRUE;
+}
+
 static void
 rspamd_worker_drop_priv (struct rspamd_main *rspamd_main)
 {
@@ -478,6 +657,166 @@ rspamd_worker_set_limits (struct rspamd_main *rspamd_main,
 	}
 }
 
+/*
+ * Bind own SO_REUSEPORT sockets for inet addresses of the worker (unix sockets
+ * are still shared and inherited from the main process). Every address that
+ * cannot be bound is reported, the worker fails if none of inet addresses of
+ * a bind line could be bound
+ */
+static void
+rspamd_worker_listen_reuseport (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+	struct rspamd_worker_bind_conf *bcf;
+	rspamd_inet_addr_t *addr;
+	GList *ls;
+	guint i, ninet, nbound;
+	gint fd;
+
+	ls = g_list_copy (wrk->cf->listen_socks);
+
+	LL_FOREACH (wrk->cf->bind_conf, bcf) {
+		if (bcf->is_systemd) {
+			continue;
+		}
+
+		ninet = 0;
+		nbound = 0;
+
+		for (i = 0; i < bcf->cnt; i ++) {
+			addr = g_ptr_array_index (bcf->addrs, i);
+
+			if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+				continue;
+			}
+
+			ninet ++;
+			fd = rspamd_inet_address_listen_reuseport (addr,
+					wrk->cf->worker->listen_type, TRUE);
+
+			if (fd == -1) {
+				msg_err_main ("cannot listen on %s:%d: %s",
+						rspamd_inet_address_to_string (addr),
+						(gint)rspamd_inet_address_get_port (addr),
+						strerror (errno));
+				continue;
+			}
+
+			nbound ++;
+			ls = g_list_prepend (ls, GINT_TO_POINTER (fd));
+		}
+
+		if (ninet > 0 && nbound == 0) {
+			msg_err_main ("cannot listen on any address of %s", bcf->name);
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	wrk->cf->listen_socks = ls;
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Parses sysfs list of cpus of a NUMA node, e.g. "0-7,16-23" */
+static gboolean
+rspamd_worker_numa_cpus (guint node, cpu_set_t *set)
+{
+	gchar path[PATH_MAX], buf[1024], *p, *end;
+	gulong first, last, cpu;
+	guint ncpus = 0;
+	gssize r;
+	gint fd;
+
+	rspamd_snprintf (path, sizeof (path),
+			"/sys/devices/system/node/node%ud/cpulist", node);
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	r = read (fd, buf, sizeof (buf) - 1);
+	close (fd);
+
+	if (r <= 0) {
+		return FALSE;
+	}
+
+	buf[r] = '\0';
+	CPU_ZERO (set);
+	p = buf;
+
+	while (*p != '\0') {
+		if (!g_ascii_isdigit (*p)) {
+			p ++;
+			continue;
+		}
+
+		first = strtoul (p, &end, 10);
+		last = first;
+
+		if (*end == '-') {
+			last = strtoul (end + 1, &end, 10);
+		}
+
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu ++) {
+			CPU_SET (cpu, set);
+			ncpus ++;
+		}
+
+		p = end;
+	}
+
+	return ncpus > 0;
+}
+#endif
+
+static void
+rspamd_worker_set_affinity (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	guint cpu, node, nnodes;
+
+	if (wrk->cf->cpu_affinity_len == 0) {
+		if (wrk->cf->numa && (nnodes = rspamd_numa_nodes ()) > 1) {
+			/* Instances are spread over nodes */
+			node = wrk->index % nnodes;
+
+			if (!rspamd_worker_numa_cpus (node, &set)) {
+				msg_warn_main ("cannot get cpus of numa node %ud", node);
+			}
+			else if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+				msg_warn_main ("cannot bind worker to numa node %ud: %s", node,
+						strerror (errno));
+			}
+			else {
+				/*
+				 * Memory allocated by the worker from now is placed on its
+				 * node by the kernel, shared data is replicated per node
+				 */
+				rspamd_numa_set_node (node);
+			}
+		}
+
+		return;
+	}
+
+	cpu = wrk->cf->cpu_affinity[wrk->index % wrk->cf->cpu_affinity_len];
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_warn_main ("cannot bind worker to cpu %ud: %s", cpu,
+				strerror (errno));
+	}
+#else
+	if (wrk->cf->cpu_affinity_len > 0 || wrk->cf->numa) {
+		msg_warn_main ("cpu affinity is not supported by the system");
+	}
+#endif
+}
+
 struct rspamd_worker *
 rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		struct rspamd_worker_conf *cf,
@@ -507,6 +846,28 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	memcpy (wrk->cf, cf, sizeof (struct rspamd_worker_conf));
 	wrk->index = index;
 	wrk->ctx = cf->ctx;
+	wrk->generation = rspamd_main->generation;
+
+	if (rspamd_main->metrics) {
+		wrk->metrics = rspamd_metrics_acquire (rspamd_main->metrics, cf->type);
+
+		if (wrk->metrics == NULL) {
+			msg_warn_main ("no free metrics slots for %s process",
+					cf->worker->name);
+		}
+	}
+
+	wrk->control_slot = -1;
+
+	if (rspamd_main->control_bcast) {
+		wrk->control_slot = rspamd_control_bcast_acquire (
+				rspamd_main->control_bcast);
+
+		if (wrk->control_slot == -1) {
+			msg_warn_main ("no free broadcast slots for %s process",
+					cf->worker->name);
+		}
+	}
 
 	wrk->pid = fork ();
 
@@ -514,6 +875,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	case 0:
 		/* Update pid for logging */
 		rspamd_log_update_pid (cf->type, rspamd_main->logger);
+		rspamd_metrics_set_current (wrk->metrics);
 		/* Remove the inherited event base */
 		event_reinit (rspamd_main->ev_base);
 		event_base_free (rspamd_main->ev_base);
@@ -526,6 +888,13 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		}
 
 		g_random_set_seed (ottery_rand_uint32 ());
+
+		if (cf->reuseport) {
+			/* Privileged ports can be bound before dropping privilleges only */
+			rspamd_worker_listen_reuseport (rspamd_main, wrk);
+		}
+
+		rspamd_worker_set_affinity (rspamd_main, wrk);
 		/* Drop privilleges */
 		rspamd_worker_drop_priv (rspamd_main);
 		/* Set limits */
@@ -575,6 +944,11 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		rspamd_socket_nonblocking (wrk->control_pipe[0]);
 		rspamd_socket_nonblocking (wrk->srv_pipe[0]);
 		rspamd_srv_start_watching (wrk, ev_base);
+
+		if (wrk->metrics) {
+			wrk->metrics->pid = wrk->pid;
+		}
+
 		/* Insert worker into worker's table, pid is index */
 		g_hash_table_insert (rspamd_main->workers, GSIZE_TO_POINTER (
 				wrk->pid), wrk);
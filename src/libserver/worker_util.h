@@ -57,6 +57,16 @@ void rspamd_worker_set_signal_handler (int signo,
  */
 void rspamd_worker_stop_accept (struct rspamd_worker *worker);
 
+/**
+ * Tell the main process that worker is fully initialised and can process
+ * requests (used by workers with RSPAMD_WORKER_NOTIFY_READY flag), so the
+ * previous generation of workers can be retired on reload
+ * @param worker
+ * @param ev_base
+ */
+void rspamd_worker_notify_ready (struct rspamd_worker *worker,
+		struct event_base *ev_base);
+
 typedef gint (*rspamd_controller_func_t) (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg,
@@ -108,6 +118,15 @@ void rspamd_controller_send_string (struct rspamd_http_connection_entry *entry,
 void rspamd_controller_send_ucl (struct rspamd_http_connection_entry *entry,
 	ucl_object_t *obj);
 
+/**
+ * Send JSON that has been already written to fstring (e.g. by
+ * `rspamd_json_emitter`) using HTTP
+ * @param entry router entry
+ * @param body JSON body (owned by the reply afterwards)
+ */
+void rspamd_controller_send_json (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_t *body);
+
 /**
  * Return worker's control structure by its type
  * @param type
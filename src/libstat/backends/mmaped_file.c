@@ -15,9 +15,24 @@
  */
 #include "config.h"
 #include "stat_internal.h"
+#include "lua/lua_common.h"
+#include "libmime/message.h"
+#include "ref.h"
+#include "xxhash.h"
 #include "unix-std.h"
 
-#define CHAIN_LENGTH 128
+/* Number of blocks in a bucket, each bucket occupies a single cache line */
+#define BUCKET_SLOTS 4
+/* Maximum number of displacements when inserting a new block */
+#define MAX_KICKS 16
+/* How many tokens ahead should we prefetch buckets */
+#define PREFETCH_DISTANCE 8
+
+#ifdef __GNUC__
+#define STATFILE_PREFETCH(p, rw) __builtin_prefetch ((p), (rw), 1)
+#else
+#define STATFILE_PREFETCH(p, rw) do {} while (0)
+#endif
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
@@ -55,6 +70,13 @@ struct stat_file_block {
 	double value;                           /**< double value                       */
 };
 
+/**
+ * Cache line sized bucket of blocks, used since version 1.3
+ */
+struct stat_file_bucket {
+	struct stat_file_block blocks[BUCKET_SLOTS];
+};
+
 /**
  * Statistic file
  */
@@ -82,10 +104,53 @@ typedef struct {
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
 
+/* Default limit of bytes mapped for per user statfiles by each process */
+#define DEFAULT_USERS_MAX_MAPPED (256 * 1024 * 1024)
 
-#define RSPAMD_STATFILE_VERSION {'1', '2'}
+struct rspamd_mmaped_file_ctx;
+
+/**
+ * Per user statfile, it is referenced by the cache of open statfiles and by
+ * tasks that use it
+ */
+struct rspamd_mmaped_file_user {
+	rspamd_mmaped_file_t *mf;
+	struct rspamd_mmaped_file_ctx *ctx;
+	gchar *name;
+	GList *lru_link;                        /**< NULL if evicted from cache	*/
+	ref_entry_t ref;
+};
+
+/**
+ * Backend context: either a single statfile or a directory of per user ones
+ */
+struct rspamd_mmaped_file_ctx {
+	rspamd_mmaped_file_t *mf;               /**< common statfile (optional for users) */
+	struct rspamd_statfile_config *stcf;
+	rspamd_mempool_t *pool;
+	lua_State *L;
+	gboolean per_user;
+	gint cbref_user;
+	const gchar *users_path;                /**< root of users hierarchy	*/
+	gsize users_size;                       /**< size of new user statfiles	*/
+	gsize max_mapped;                       /**< limit of cached maps		*/
+	gsize mapped;                           /**< bytes of cached maps		*/
+	GHashTable *users;                      /**< name -> cached user		*/
+	GQueue lru;                             /**< most recent users first	*/
+};
+
+
+#define RSPAMD_STATFILE_VERSION {'1', '3'}
+#define RSPAMD_STATFILE_LEGACY_VERSION {'1', '2'}
 #define BACKUP_SUFFIX ".old"
 
+/* Legacy statfiles store blocks right after the first section */
+#define LEGACY_DATA_OFFSET (sizeof (struct stat_file) - \
+	sizeof (struct stat_file_block))
+/* Buckets are aligned to a cache line starting from version 1.3 */
+#define DATA_OFFSET ((sizeof (struct stat_file_header) + \
+	sizeof (struct stat_file_section) + 63) & ~((gsize)63))
+
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	   rspamd_mmaped_file_t *file,
 	   guint32 h1, guint32 h2, double value);
@@ -97,36 +162,112 @@ gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
 		struct rspamd_statfile_config *stcf,
 		rspamd_mempool_t *pool);
 
+/*
+ * Each block can be stored in one of two buckets: the primary one is selected
+ * by hash1 and the alternative one is derived from both hashes
+ */
+static inline struct stat_file_bucket *
+rspamd_mmaped_file_bucket (rspamd_mmaped_file_t *file, guint64 idx)
+{
+	return (struct stat_file_bucket *)((u_char *)file->map + file->seek_pos) +
+			idx;
+}
+
+static inline guint64
+rspamd_mmaped_file_bucket1 (rspamd_mmaped_file_t *file, guint32 h1, guint32 h2)
+{
+	return h1 % file->cur_section.length;
+}
+
+static inline guint64
+rspamd_mmaped_file_bucket2 (rspamd_mmaped_file_t *file, guint32 h1, guint32 h2)
+{
+	return (((guint64)h2 * 0x9E3779B97F4A7C15ULL) ^ h1) %
+			file->cur_section.length;
+}
+
+static inline void
+rspamd_mmaped_file_prefetch (rspamd_mmaped_file_t *file, guint64 hash,
+		gboolean write)
+{
+	guint32 h1, h2;
+
+	memcpy (&h1, (guchar *)&hash, sizeof (h1));
+	memcpy (&h2, (guchar *)&hash + sizeof (h1), sizeof (h2));
+
+	if (write) {
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file,
+				rspamd_mmaped_file_bucket1 (file, h1, h2)), 1);
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file,
+				rspamd_mmaped_file_bucket2 (file, h1, h2)), 1);
+	}
+	else {
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file,
+				rspamd_mmaped_file_bucket1 (file, h1, h2)), 0);
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file,
+				rspamd_mmaped_file_bucket2 (file, h1, h2)), 0);
+	}
+}
+
+static struct stat_file_block *
+rspamd_mmaped_file_find_block (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2)
+{
+	struct stat_file_bucket *bucket;
+	guint i;
+
+	bucket = rspamd_mmaped_file_bucket (file,
+			rspamd_mmaped_file_bucket1 (file, h1, h2));
+
+	for (i = 0; i < BUCKET_SLOTS; i++) {
+		if (bucket->blocks[i].hash1 == h1 && bucket->blocks[i].hash2 == h2) {
+			return &bucket->blocks[i];
+		}
+	}
+
+	bucket = rspamd_mmaped_file_bucket (file,
+			rspamd_mmaped_file_bucket2 (file, h1, h2));
+
+	for (i = 0; i < BUCKET_SLOTS; i++) {
+		if (bucket->blocks[i].hash1 == h1 && bucket->blocks[i].hash2 == h2) {
+			return &bucket->blocks[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct stat_file_block *
+rspamd_mmaped_file_free_block (struct stat_file_bucket *bucket)
+{
+	guint i;
+
+	for (i = 0; i < BUCKET_SLOTS; i++) {
+		if (bucket->blocks[i].hash1 == 0 && bucket->blocks[i].hash2 == 0) {
+			return &bucket->blocks[i];
+		}
+	}
+
+	return NULL;
+}
+
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	guint32 h1,
 	guint32 h2)
 {
 	struct stat_file_block *block;
-	guint i, blocknum;
-	u_char *c;
 
 	if (!file->map) {
 		return 0;
 	}
 
-	blocknum = h1 % file->cur_section.length;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
+	block = rspamd_mmaped_file_find_block (file, h1, h2);
 
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			break;
-		}
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			return block->value;
-		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+	if (block != NULL) {
+		return block->value;
 	}
 
-
 	return 0;
 }
 
@@ -135,80 +276,95 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t *file,
 		guint32 h1, guint32 h2, double value)
 {
-	struct stat_file_block *block, *to_expire = NULL;
+	struct stat_file_block *block, cur, tmp;
+	struct stat_file_bucket *b1, *b2, *bucket;
 	struct stat_file_header *header;
-	guint i, blocknum;
-	u_char *c;
-	double min = G_MAXDOUBLE;
+	guint64 idx, alt;
+	guint i, kick;
 
 	if (!file->map) {
 		return;
 	}
 
-	blocknum = h1 % file->cur_section.length;
 	header = (struct stat_file_header *)file->map;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
-
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			/* Need to expire some block in chain */
-			msg_info_pool ("chain %ud is full in statfile %s, starting expire",
-				blocknum,
-				file->filename);
-			break;
-		}
-		/* First try to find block in chain */
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			msg_debug_pool ("%s found existing block %ud in chain %ud, value %.2f",
-					file->filename,
-					i,
-					blocknum,
-					value);
-			block->value = value;
-			return;
-		}
-		/* Check whether we have a free block in chain */
-		if (block->hash1 == 0 && block->hash2 == 0) {
-			/* Write new block here */
-			msg_debug_pool ("%s found free block %ud in chain %ud, set h1=%ud, h2=%ud",
+	block = rspamd_mmaped_file_find_block (file, h1, h2);
+
+	if (block != NULL) {
+		msg_debug_pool ("%s found existing block for h1=%ud, h2=%ud, value %.2f",
 				file->filename,
-				i,
-				blocknum,
 				h1,
-				h2);
-			block->hash1 = h1;
-			block->hash2 = h2;
-			block->value = value;
+				h2,
+				value);
+		block->value = value;
+
+		return;
+	}
+
+	cur.hash1 = h1;
+	cur.hash2 = h2;
+	cur.value = value;
+	idx = rspamd_mmaped_file_bucket1 (file, h1, h2);
+
+	/*
+	 * Bucketised cuckoo insertion: if both buckets are full, displace
+	 * some block to its alternative bucket and repeat for that block
+	 */
+	for (kick = 0; kick < MAX_KICKS; kick ++) {
+		b1 = rspamd_mmaped_file_bucket (file,
+				rspamd_mmaped_file_bucket1 (file, cur.hash1, cur.hash2));
+		b2 = rspamd_mmaped_file_bucket (file,
+				rspamd_mmaped_file_bucket2 (file, cur.hash1, cur.hash2));
+
+		if ((block = rspamd_mmaped_file_free_block (b1)) != NULL ||
+				(block = rspamd_mmaped_file_free_block (b2)) != NULL) {
+			msg_debug_pool ("%s found free block after %ud kicks, "
+					"set h1=%ud, h2=%ud",
+					file->filename,
+					kick,
+					cur.hash1,
+					cur.hash2);
+			memcpy (block, &cur, sizeof (cur));
 			header->used_blocks++;
 
 			return;
 		}
 
-		/* Expire block with minimum value otherwise */
-		if (block->value < min) {
-			to_expire = block;
-			min = block->value;
+		bucket = rspamd_mmaped_file_bucket (file, idx);
+		block = &bucket->blocks[(cur.hash1 + kick) % BUCKET_SLOTS];
+		memcpy (&tmp, block, sizeof (tmp));
+		memcpy (block, &cur, sizeof (cur));
+		memcpy (&cur, &tmp, sizeof (cur));
+
+		alt = rspamd_mmaped_file_bucket1 (file, cur.hash1, cur.hash2);
+
+		if (alt == idx) {
+			alt = rspamd_mmaped_file_bucket2 (file, cur.hash1, cur.hash2);
 		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
-	}
 
-	/* Try expire some block */
-	if (to_expire) {
-		block = to_expire;
+		idx = alt;
 	}
-	else {
-		/* Expire first block in chain */
-		c = (u_char *) file->map + file->seek_pos + blocknum *
-			sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+
+	/* Expire block with minimum value in the buckets of the last displaced one */
+	msg_info_pool ("buckets are full in statfile %s, starting expire",
+			file->filename);
+	b1 = rspamd_mmaped_file_bucket (file,
+			rspamd_mmaped_file_bucket1 (file, cur.hash1, cur.hash2));
+	b2 = rspamd_mmaped_file_bucket (file,
+			rspamd_mmaped_file_bucket2 (file, cur.hash1, cur.hash2));
+	block = &b1->blocks[0];
+
+	for (i = 0; i < BUCKET_SLOTS; i++) {
+		if (b1->blocks[i].value < block->value) {
+			block = &b1->blocks[i];
+		}
+		if (b2->blocks[i].value < block->value) {
+			block = &b2->blocks[i];
+		}
 	}
 
-	block->hash1 = h1;
-	block->hash2 = h2;
-	block->value = value;
+	if (block->value < cur.value) {
+		memcpy (block, &cur, sizeof (cur));
+	}
 }
 
 void
@@ -319,19 +475,23 @@ rspamd_mmaped_file_get_total (rspamd_mmaped_file_t *file)
 
 	/* If total blocks is 0 we have old version of header, so set total blocks correctly */
 	if (header->total_blocks == 0) {
-		header->total_blocks = file->cur_section.length;
+		header->total_blocks = file->cur_section.length * BUCKET_SLOTS;
 	}
 
 	return header->total_blocks;
 }
 
-/* Check whether specified file is statistic file and calculate its len in blocks */
+/*
+ * Check whether specified file is statistic file and calculate its len in
+ * buckets, returns 1 if a file has legacy layout and should be converted
+ */
 static gint
 rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 {
 	struct stat_file *f;
 	gchar *c;
 	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar legacy_version[] = RSPAMD_STATFILE_LEGACY_VERSION;
 
 
 	if (!file || !file->map) {
@@ -358,6 +518,14 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp (c, legacy_version, sizeof (legacy_version)) == 0) {
+		msg_info_pool ("file %s has legacy version %c.%c and should be "
+				"converted",
+				file->filename,
+				*c,
+				*(c + 1));
+		return 1;
+	}
 	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
@@ -370,16 +538,17 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
-		file->len) {
+	if (file->cur_section.length == 0 ||
+			DATA_OFFSET + file->cur_section.length *
+			sizeof (struct stat_file_bucket) > file->len) {
 		msg_info_pool ("file %s is truncated: %z, must be %z",
 			file->filename,
 			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
+			DATA_OFFSET + file->cur_section.length *
+			sizeof (struct stat_file_bucket));
 		return -1;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
+	file->seek_pos = DATA_OFFSET;
 
 	return 0;
 }
@@ -398,10 +567,9 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 	u_char *map, *pos;
 	struct stat_file_block *block;
 	struct stat_file_header *header, *nh;
+	static gchar legacy_version[] = RSPAMD_STATFILE_LEGACY_VERSION;
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < DATA_OFFSET + sizeof (struct stat_file_bucket)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -493,18 +661,28 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	pos = map + (sizeof (struct stat_file) - sizeof (struct stat_file_block));
-	while (old_size - (pos - map) >= sizeof (struct stat_file_block)) {
+	header = (struct stat_file_header *)map;
+
+	/* Both layouts are plain arrays of blocks starting from different offsets */
+	if (old_size > sizeof (*header) && memcmp (header->version, legacy_version,
+			sizeof (legacy_version)) == 0) {
+		pos = map + LEGACY_DATA_OFFSET;
+	}
+	else {
+		pos = map + DATA_OFFSET;
+	}
+
+	while (pos < map + old_size &&
+			old_size - (pos - map) >= sizeof (struct stat_file_block)) {
 		block = (struct stat_file_block *)pos;
 		if (block->hash1 != 0 && block->value != 0) {
 			rspamd_mmaped_file_set_block_common (pool,
 					new, block->hash1,
 					block->hash2, block->value);
 		}
-		pos += sizeof (block);
+		pos += sizeof (*block);
 	}
 
-	header = (struct stat_file_header *)map;
 	rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
 	nh = new->map;
 	/* Copy tokenizer configuration */
@@ -564,6 +742,8 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 {
 	struct stat st;
 	rspamd_mmaped_file_t *new_file;
+	const ucl_object_t *elt;
+	gint ret;
 
 
 	if (stat (filename, &st) == -1) {
@@ -622,11 +802,20 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	if (rspamd_mmaped_file_check (pool, new_file) == -1) {
-		close (new_file->fd);
+	if ((ret = rspamd_mmaped_file_check (pool, new_file)) != 0) {
 		rspamd_file_unlock (new_file->fd, FALSE);
+		close (new_file->fd);
 		munmap (new_file->map, st.st_size);
 		g_slice_free1 (sizeof (*new_file), new_file);
+
+		if (ret == 1) {
+			/* Convert legacy statfile to the bucketed layout */
+			msg_warn_pool ("convert statfile %s to the new version", filename);
+
+			return rspamd_mmaped_file_reindex (pool, filename, st.st_size,
+					size, stcf);
+		}
+
 		return NULL;
 	}
 
@@ -634,6 +823,19 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 
 	new_file->cf = stcf;
 
+#ifdef MADV_HUGEPAGE
+	elt = stcf->opts ? ucl_object_lookup (stcf->opts, "hugepages") : NULL;
+
+	if (elt != NULL && ucl_object_toboolean (elt)) {
+		if (madvise (new_file->map, new_file->len, MADV_HUGEPAGE) == -1) {
+			msg_info_pool ("cannot use huge pages for %s: %s", filename,
+					strerror (errno));
+		}
+	}
+#else
+	(void)elt;
+#endif
+
 	rspamd_mmaped_file_preload (new_file);
 
 	g_assert (stcf->clcf != NULL);
@@ -679,24 +881,23 @@ rspamd_mmaped_file_create (const gchar *filename,
 	struct stat_file_block block = { 0, 0, 0 };
 	struct rspamd_stat_tokenizer *tokenizer;
 	gint fd;
-	guint buflen = 0, nblocks;
+	guint buflen = 0, nblocks, nbuckets;
 	gchar *buf = NULL;
+	guchar padding[64];
 	gpointer tok_conf;
 	gsize tok_conf_len;
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < DATA_OFFSET + sizeof (struct stat_file_bucket)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
 		return -1;
 	}
 
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
+	nbuckets = (size - DATA_OFFSET) / sizeof (struct stat_file_bucket);
+	nblocks = nbuckets * BUCKET_SLOTS;
 	header.total_blocks = nblocks;
+	memset (padding, 0, sizeof (padding));
 
 	if ((fd =
 		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -709,7 +910,7 @@ rspamd_mmaped_file_create (const gchar *filename,
 
 	rspamd_fallocate (fd,
 		0,
-		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
+		DATA_OFFSET + sizeof (block) * nblocks);
 
 	header.create_time = (guint64) time (NULL);
 	g_assert (stcf->clcf != NULL);
@@ -731,7 +932,7 @@ rspamd_mmaped_file_create (const gchar *filename,
 		return -1;
 	}
 
-	section.length = (guint64) nblocks;
+	section.length = (guint64) nbuckets;
 	if (write (fd, &section, sizeof (section)) == -1) {
 		msg_info_pool ("cannot write section header to file %s, error %d, %s",
 			filename,
@@ -742,6 +943,18 @@ rspamd_mmaped_file_create (const gchar *filename,
 		return -1;
 	}
 
+	/* Align buckets to a cache line */
+	if (write (fd, padding, DATA_OFFSET - sizeof (header) -
+			sizeof (section)) == -1) {
+		msg_info_pool ("cannot write padding to file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		close (fd);
+
+		return -1;
+	}
+
 	/* Buffer for write 256 blocks at once */
 	if (nblocks > 256) {
 		buflen = sizeof (block) * 256;
@@ -789,28 +1002,264 @@ rspamd_mmaped_file_create (const gchar *filename,
 	return 0;
 }
 
+static void
+rspamd_mmaped_file_user_dtor (struct rspamd_mmaped_file_user *u)
+{
+	if (u->mf) {
+		rspamd_mmaped_file_close_file (u->ctx->pool, u->mf);
+	}
+
+	g_free (u->name);
+	g_slice_free1 (sizeof (*u), u);
+}
+
+static void
+rspamd_mmaped_file_user_unref (gpointer p)
+{
+	struct rspamd_mmaped_file_user *u = p;
+
+	REF_RELEASE (u);
+}
+
+/* Remove user from the cache, it is closed when no tasks are using it */
+static void
+rspamd_mmaped_file_user_evict (struct rspamd_mmaped_file_ctx *ctx,
+		struct rspamd_mmaped_file_user *u)
+{
+	g_queue_delete_link (&ctx->lru, u->lru_link);
+	u->lru_link = NULL;
+	ctx->mapped -= u->mf->len;
+	g_hash_table_remove (ctx->users, u->name);
+	REF_RELEASE (u);
+}
+
+static const gchar *
+rspamd_mmaped_file_get_user (struct rspamd_mmaped_file_ctx *ctx,
+		struct rspamd_task *task)
+{
+	const gchar *user = NULL;
+	struct rspamd_task **ptask;
+	lua_State *L = ctx->L;
+	GString *tb;
+	gint err_idx;
+
+	if (ctx->cbref_user == -1) {
+		return rspamd_task_get_principal_recipient (task);
+	}
+
+	/* Execute lua function to get userdata */
+	lua_pushcfunction (L, &rspamd_lua_traceback);
+	err_idx = lua_gettop (L);
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->cbref_user);
+	ptask = lua_newuserdata (L, sizeof (struct rspamd_task *));
+	*ptask = task;
+	rspamd_lua_setclass (L, "rspamd{task}", -1);
+
+	if (lua_pcall (L, 1, 1, err_idx) != 0) {
+		tb = lua_touserdata (L, -1);
+		msg_err_task ("call to user extraction script failed: %v", tb);
+		g_string_free (tb, TRUE);
+	}
+	else if (lua_type (L, -1) == LUA_TSTRING) {
+		user = rspamd_mempool_strdup (task->task_pool, lua_tostring (L, -1));
+	}
+
+	/* Result + error function */
+	lua_pop (L, 2);
+
+	return user;
+}
+
+/*
+ * Users statfiles are placed to `users_path`/xx/yy/<hash>.stat, where hash is
+ * derived from the user name, so directories never grow too large
+ */
+static gboolean
+rspamd_mmaped_file_user_path (struct rspamd_mmaped_file_ctx *ctx,
+		const gchar *user, gboolean create_dirs, gchar *path, gsize pathlen)
+{
+	gchar hex[17];
+	gsize dlen;
+
+	rspamd_snprintf (hex, sizeof (hex), "%016xL",
+			(guint64)XXH64 (user, strlen (user), 0));
+
+	dlen = rspamd_snprintf (path, pathlen, "%s/%c%c", ctx->users_path,
+			hex[0], hex[1]);
+
+	if (create_dirs && mkdir (path, 0755) == -1 && errno != EEXIST) {
+		msg_err ("cannot create directory %s: %s", path,
+				strerror (errno));
+		return FALSE;
+	}
+
+	dlen += rspamd_snprintf (path + dlen, pathlen - dlen, "/%c%c", hex[2],
+			hex[3]);
+
+	if (create_dirs && mkdir (path, 0755) == -1 && errno != EEXIST) {
+		msg_err ("cannot create directory %s: %s", path,
+				strerror (errno));
+		return FALSE;
+	}
+
+	rspamd_snprintf (path + dlen, pathlen - dlen, "/%s.stat", hex);
+
+	return TRUE;
+}
+
+/* Create statfile atomically, so concurrent learns never truncate it */
+static gboolean
+rspamd_mmaped_file_user_create (struct rspamd_mmaped_file_ctx *ctx,
+		const gchar *path)
+{
+	gchar tmp[PATH_MAX];
+	gboolean ret = TRUE;
+
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.%P.tmp", path, getpid ());
+
+	if (rspamd_mmaped_file_create (tmp, ctx->users_size, ctx->stcf,
+			ctx->pool) != 0) {
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	if (link (tmp, path) == -1 && errno != EEXIST) {
+		msg_err ("cannot create %s: %s", path, strerror (errno));
+		ret = FALSE;
+	}
+
+	unlink (tmp);
+
+	return ret;
+}
+
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_user_runtime (struct rspamd_mmaped_file_ctx *ctx,
+		struct rspamd_task *task, gboolean learn)
+{
+	struct rspamd_mmaped_file_user *u, *tail;
+	rspamd_mmaped_file_t *mf;
+	const gchar *user;
+	gchar path[PATH_MAX];
+
+	user = rspamd_mmaped_file_get_user (ctx, task);
+
+	if (user == NULL) {
+		/* Common statfile is used for messages without users */
+		return ctx->mf;
+	}
+
+	rspamd_mempool_set_variable (task->task_pool, "stat_user",
+			(gpointer)user, NULL);
+	u = g_hash_table_lookup (ctx->users, user);
+
+	if (u == NULL) {
+		if (!rspamd_mmaped_file_user_path (ctx, user, learn, path,
+				sizeof (path))) {
+			return NULL;
+		}
+
+		if (access (path, R_OK) == -1) {
+			if (!learn) {
+				/* User has no statistics yet */
+				return NULL;
+			}
+
+			if (!rspamd_mmaped_file_user_create (ctx, path)) {
+				return NULL;
+			}
+
+			msg_info_task ("created statfile %s for user %s", path, user);
+		}
+
+		mf = rspamd_mmaped_file_open (ctx->pool, path, ctx->users_size,
+				ctx->stcf);
+
+		if (mf == NULL) {
+			return NULL;
+		}
+
+		mf->pool = ctx->pool;
+		u = g_slice_alloc0 (sizeof (*u));
+		u->mf = mf;
+		u->ctx = ctx;
+		u->name = g_strdup (user);
+		REF_INIT_RETAIN (u, rspamd_mmaped_file_user_dtor);
+		g_hash_table_insert (ctx->users, u->name, u);
+		g_queue_push_head (&ctx->lru, u);
+		u->lru_link = ctx->lru.head;
+		ctx->mapped += mf->len;
+
+		/* Unmap least recently used statfiles */
+		while (ctx->mapped > ctx->max_mapped && ctx->lru.length > 1) {
+			tail = g_queue_peek_tail (&ctx->lru);
+			rspamd_mmaped_file_user_evict (ctx, tail);
+		}
+	}
+	else if (u->lru_link != ctx->lru.head) {
+		g_queue_unlink (&ctx->lru, u->lru_link);
+		g_queue_push_head_link (&ctx->lru, u->lru_link);
+	}
+
+	/* Statfile cannot be unmapped while the task is using it */
+	REF_RETAIN (u);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_mmaped_file_user_unref, u);
+
+	return u->mf;
+}
+
 gpointer
 rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg, struct rspamd_statfile *st)
 {
 	struct rspamd_statfile_config *stf = st->stcf;
-	rspamd_mmaped_file_t *mf;
-	const ucl_object_t *filenameo, *sizeo;
-	const gchar *filename;
+	struct rspamd_mmaped_file_ctx *mctx;
+	rspamd_mmaped_file_t *mf = NULL;
+	const ucl_object_t *filenameo, *sizeo, *users_enabled, *elt;
+	const gchar *filename, *lua_script;
 	gsize size;
 
-	filenameo = ucl_object_lookup (stf->opts, "filename");
+	mctx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*mctx));
+	mctx->stcf = stf;
+	mctx->pool = cfg->cfg_pool;
+	mctx->L = cfg->lua_state;
+	mctx->cbref_user = -1;
 
-	if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
-		filenameo = ucl_object_lookup (stf->opts, "path");
+	users_enabled = ucl_object_lookup_any (stf->opts, "per_user",
+			"users_enabled", NULL);
 
-		if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
-			msg_err_config ("statfile %s has no filename defined", stf->symbol);
-			return NULL;
-		}
+	if (users_enabled == NULL && stf->clcf->opts) {
+		users_enabled = ucl_object_lookup_any (stf->clcf->opts, "per_user",
+				"users_enabled", NULL);
 	}
 
-	filename = ucl_object_tostring (filenameo);
+	if (users_enabled != NULL) {
+		if (ucl_object_type (users_enabled) == UCL_BOOLEAN) {
+			mctx->per_user = ucl_object_toboolean (users_enabled);
+		}
+		else if (ucl_object_type (users_enabled) == UCL_STRING) {
+			lua_script = ucl_object_tostring (users_enabled);
+
+			if (luaL_dostring (cfg->lua_state, lua_script) != 0) {
+				msg_err_config ("cannot execute lua script for users "
+						"extraction: %s", lua_tostring (cfg->lua_state, -1));
+			}
+			else if (lua_type (cfg->lua_state, -1) == LUA_TFUNCTION) {
+				mctx->per_user = TRUE;
+				mctx->cbref_user = luaL_ref (cfg->lua_state,
+						LUA_REGISTRYINDEX);
+			}
+			else {
+				msg_err_config ("lua script must return "
+						"function(task) and not %s",
+						lua_typename (cfg->lua_state, lua_type (
+								cfg->lua_state, -1)));
+			}
+		}
+	}
 
 	sizeo = ucl_object_lookup (stf->opts, "size");
 
@@ -820,24 +1269,86 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 	}
 
 	size = ucl_object_toint (sizeo);
+
+	if (mctx->per_user) {
+		elt = ucl_object_lookup (stf->opts, "users_path");
+
+		if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+			msg_err_config ("statfile %s has no users_path defined",
+					stf->symbol);
+			return NULL;
+		}
+
+		mctx->users_path = ucl_object_tostring (elt);
+
+		if (mkdir (mctx->users_path, 0755) == -1 && errno != EEXIST) {
+			msg_err_config ("cannot create users directory %s: %s",
+					mctx->users_path, strerror (errno));
+			return NULL;
+		}
+
+		elt = ucl_object_lookup (stf->opts, "users_size");
+		mctx->users_size = (elt && ucl_object_type (elt) == UCL_INT) ?
+				ucl_object_toint (elt) : size;
+		elt = ucl_object_lookup (stf->opts, "users_max_mapped");
+		mctx->max_mapped = (elt && ucl_object_type (elt) == UCL_INT) ?
+				ucl_object_toint (elt) : DEFAULT_USERS_MAX_MAPPED;
+		mctx->users = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		g_queue_init (&mctx->lru);
+	}
+
+	filenameo = ucl_object_lookup (stf->opts, "filename");
+
+	if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+		filenameo = ucl_object_lookup (stf->opts, "path");
+
+		if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+			if (mctx->per_user) {
+				/* Messages without users are not classified */
+				return (gpointer)mctx;
+			}
+
+			msg_err_config ("statfile %s has no filename defined", stf->symbol);
+			return NULL;
+		}
+	}
+
+	filename = ucl_object_tostring (filenameo);
 	mf = rspamd_mmaped_file_open (cfg->cfg_pool, filename, size, stf);
 
-	if (mf != NULL) {
-		mf->pool = cfg->cfg_pool;
+	if (mf == NULL) {
+		return NULL;
 	}
 
-	return (gpointer)mf;
+	mf->pool = cfg->cfg_pool;
+	mctx->mf = mf;
+
+	return (gpointer)mctx;
 }
 
 void
 rspamd_mmaped_file_close (gpointer p)
 {
-	rspamd_mmaped_file_t *mf = p;
+	struct rspamd_mmaped_file_ctx *ctx = p;
+	struct rspamd_mmaped_file_user *u;
 
 	g_assert (p != NULL);
 
-	rspamd_mmaped_file_close_file (mf->pool, mf);
+	if (ctx->mf) {
+		rspamd_mmaped_file_close_file (ctx->pool, ctx->mf);
+	}
+
+	if (ctx->per_user) {
+		while ((u = g_queue_peek_tail (&ctx->lru)) != NULL) {
+			rspamd_mmaped_file_user_evict (ctx, u);
+		}
+
+		g_hash_table_unref (ctx->users);
 
+		if (ctx->cbref_user != -1) {
+			luaL_unref (ctx->L, LUA_REGISTRYINDEX, ctx->cbref_user);
+		}
+	}
 }
 
 gpointer
@@ -846,29 +1357,41 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 		gboolean learn,
 		gpointer p)
 {
-	rspamd_mmaped_file_t *mf = p;
+	struct rspamd_mmaped_file_ctx *ctx = p;
 
-	return (gpointer)mf;
+	if (ctx->per_user) {
+		return (gpointer)rspamd_mmaped_file_user_runtime (ctx, task, learn);
+	}
+
+	return (gpointer)ctx->mf;
 }
 
 gboolean
-rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_mmaped_file_process_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
 	guint32 h1, h2;
-	rspamd_token_t *tok;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
+	for (i = 0; i < MIN (tokens->len, PREFETCH_DISTANCE); i++) {
+		rspamd_mmaped_file_prefetch (mf, tokens->hashes[i], FALSE);
+	}
+
 	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, tok->data, sizeof (h1));
-		memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
-		tok->values[id] = rspamd_mmaped_file_get_block (mf, h1, h2);
+		if (i + PREFETCH_DISTANCE < tokens->len) {
+			rspamd_mmaped_file_prefetch (mf,
+					tokens->hashes[i + PREFETCH_DISTANCE], FALSE);
+		}
+
+		memcpy (&h1, (guchar *)&tokens->hashes[i], sizeof (h1));
+		memcpy (&h2, (guchar *)&tokens->hashes[i] + sizeof (h1), sizeof (h2));
+		tokens->values[id][i] = rspamd_mmaped_file_get_block (mf, h1, h2);
 	}
 
 	if (mf->cf->is_spam) {
@@ -882,24 +1405,32 @@ rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
 }
 
 gboolean
-rspamd_mmaped_file_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_mmaped_file_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
 	guint32 h1, h2;
-	rspamd_token_t *tok;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
+	for (i = 0; i < MIN (tokens->len, PREFETCH_DISTANCE); i++) {
+		rspamd_mmaped_file_prefetch (mf, tokens->hashes[i], TRUE);
+	}
+
 	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, tok->data, sizeof (h1));
-		memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+		if (i + PREFETCH_DISTANCE < tokens->len) {
+			rspamd_mmaped_file_prefetch (mf,
+					tokens->hashes[i + PREFETCH_DISTANCE], TRUE);
+		}
+
+		memcpy (&h1, (guchar *)&tokens->hashes[i], sizeof (h1));
+		memcpy (&h2, (guchar *)&tokens->hashes[i] + sizeof (h1), sizeof (h2));
 		rspamd_mmaped_file_set_block (task->task_pool, mf, h1, h2,
-				tok->values[id]);
+				tokens->values[id][i]);
 	}
 
 	return TRUE;
@@ -960,6 +1491,7 @@ rspamd_mmaped_file_get_stat (gpointer runtime,
 	ucl_object_t *res = NULL;
 	guint64 rev;
 	rspamd_mmaped_file_t *mf = (rspamd_mmaped_file_t *)runtime;
+	struct rspamd_mmaped_file_ctx *mctx = ctx;
 
 	if (mf != NULL) {
 		res = ucl_object_typed_new (UCL_OBJECT);
@@ -978,7 +1510,8 @@ rspamd_mmaped_file_get_stat (gpointer runtime,
 				"type", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromint (0),
 				"languages", 0, false);
-		ucl_object_insert_key (res, ucl_object_fromint (0),
+		ucl_object_insert_key (res, ucl_object_fromint (
+				(mctx && mctx->per_user) ? g_hash_table_size (mctx->users) : 0),
 				"users", 0, false);
 
 		if (mf->cf->label) {
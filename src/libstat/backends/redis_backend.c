@@ -18,6 +18,9 @@
 #include "stat_internal.h"
 #include "upstream.h"
 #include "lua/lua_common.h"
+#include "redis_pool.h"
+#include "libutil/timer_wheel.h"
+#include <openssl/evp.h>
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -32,6 +35,32 @@
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_SCRIPT_SHA_LEN 40
+
+/*
+ * Server side scripts: tokens are passed as a single argument with comma
+ * separated names, as 64 bit tokens cannot be represented by Lua numbers.
+ * Classification returns pairs of positions and values for the tokens found,
+ * learning applies all increments including the number of learns
+ */
+static const gchar rspamd_redis_classify_script[] =
+		"local res = {}\n"
+		"local i = 1\n"
+		"for tok in string.gmatch(ARGV[1], '[^,]+') do\n"
+		"  local v = redis.call('HGET', KEYS[1], tok)\n"
+		"  if v then res[#res + 1] = i; res[#res + 1] = v end\n"
+		"  i = i + 1\n"
+		"end\n"
+		"return res\n";
+static const gchar rspamd_redis_learn_script[] =
+		"local cmd = ARGV[2] == '1' and 'HINCRBY' or 'HINCRBYFLOAT'\n"
+		"for tok, val in string.gmatch(ARGV[3], '([^:,]+):([^,]+)') do\n"
+		"  redis.call(cmd, KEYS[1], tok, val)\n"
+		"end\n"
+		"redis.call('HINCRBY', KEYS[1], 'learns', ARGV[1])\n"
+		"return 1\n";
+static gchar rspamd_redis_classify_sha[REDIS_SCRIPT_SHA_LEN + 1];
+static gchar rspamd_redis_learn_sha[REDIS_SCRIPT_SHA_LEN + 1];
 
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -43,6 +72,8 @@ struct redis_stat_ctx {
 	const gchar *dbname;
 	gdouble timeout;
 	gboolean enable_users;
+	gboolean sharded;
+	gboolean scripts;
 	gint cbref_user;
 };
 
@@ -56,14 +87,28 @@ struct redis_stat_runtime {
 	struct redis_stat_ctx *ctx;
 	struct rspamd_task *task;
 	struct upstream *selected;
-	struct event timeout_event;
+	struct rspamd_timer timeout_event;
 	GArray *results;
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
 	guint64 learned;
 	gint id;
+	guint pending; /* Session events of requests to the server */
 	enum rspamd_redis_connection_state conn_state;
+	GPtrArray *shards;
+	rspamd_fstring_t *script_tokens; /* Packed tokens for scripts */
+	const gchar *script_learns; /* Increment of learns for learn script */
+	gboolean script_sent; /* Script body has been sent after NOSCRIPT */
+};
+
+/* Connection to a single shard with tokens assigned to it */
+struct redis_stat_shard {
+	struct redis_stat_runtime *rt;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	struct rspamd_timer timeout_event;
+	GArray *tokens;
 };
 
 /* Used to get statistics from redis */
@@ -334,14 +379,14 @@ rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 }
 
 static rspamd_fstring_t *
-rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_redis_tokens_to_query (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens, GArray *subset,
 		const gchar *arg0, const gchar *arg1, gboolean learn, gint idx,
 		gboolean intvals)
 {
 	rspamd_fstring_t *out;
-	rspamd_token_t *tok;
 	gchar n0[64], n1[64];
-	guint i, l0, l1, larg0, larg1;
+	guint i, j, ntokens, l0, l1, larg0, larg1;
 	guint64 num;
 
 	g_assert (tokens != NULL);
@@ -349,6 +394,7 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 	larg0 = strlen (arg0);
 	larg1 = strlen (arg1);
 	out = rspamd_fstring_sized_new (1024);
+	ntokens = subset ? subset->len : tokens->len;
 
 	if (!learn) {
 		rspamd_printf_fstring (&out, ""
@@ -357,14 +403,14 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 				"%s\r\n"
 				"$%d\r\n"
 				"%s\r\n",
-				(tokens->len + 2),
+				(ntokens + 2),
 				larg0, arg0,
 				larg1, arg1);
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&num, tok->data, sizeof (num));
+	for (i = 0; i < ntokens; i ++) {
+		j = subset ? g_array_index (subset, guint, i) : i;
+		num = tokens->hashes[j];
 
 		if (learn) {
 			rspamd_printf_fstring (&out, ""
@@ -380,11 +426,11 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 
 			if (intvals) {
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%L",
-						(gint64)tok->values[idx]);
+						(gint64)tokens->values[idx][j]);
 			}
 			else {
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%f",
-						tok->values[idx]);
+						tokens->values[idx][j]);
 			}
 
 			rspamd_printf_fstring (&out, ""
@@ -404,6 +450,57 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 	return out;
 }
 
+static rspamd_fstring_t *
+rspamd_redis_tokens_to_packed (struct rspamd_stat_tokens *tokens,
+		gboolean learn, gint idx, gboolean intvals)
+{
+	rspamd_fstring_t *out;
+	guint i;
+
+	out = rspamd_fstring_sized_new (tokens->len * (learn ? 24 : 21));
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (i > 0) {
+			out = rspamd_fstring_append (out, ",", 1);
+		}
+
+		rspamd_printf_fstring (&out, "%uL", tokens->hashes[i]);
+
+		if (learn) {
+			if (intvals) {
+				rspamd_printf_fstring (&out, ":%L",
+						(gint64)tokens->values[idx][i]);
+			}
+			else {
+				rspamd_printf_fstring (&out, ":%f", tokens->values[idx][i]);
+			}
+		}
+	}
+
+	return out;
+}
+
+static void
+rspamd_redis_script_sha (const gchar *script, gchar *out)
+{
+	guchar digest[EVP_MAX_MD_SIZE];
+	guint dlen = 0;
+
+	g_assert (EVP_Digest (script, strlen (script), digest, &dlen,
+			EVP_sha1 (), NULL) == 1);
+	rspamd_encode_hex_buf (digest, dlen, out, REDIS_SCRIPT_SHA_LEN + 1);
+	out[REDIS_SCRIPT_SHA_LEN] = '\0';
+}
+
+/* Scripts are loaded to the server by sending their body on NOSCRIPT error */
+static gboolean
+rspamd_redis_is_noscript (struct redis_stat_runtime *rt, redisReply *reply)
+{
+	return reply != NULL && reply->type == REDIS_REPLY_ERROR &&
+			!rt->script_sent && reply->len >= 8 &&
+			memcmp (reply->str, "NOSCRIPT", 8) == 0;
+}
+
 static void
 rspamd_redis_async_cbdata_cleanup (struct rspamd_redis_stat_cbdata *cbdata)
 {
@@ -680,7 +777,14 @@ rspamd_redis_fin (gpointer data)
 		rt->conn_state = RSPAMD_REDIS_DISCONNECTED;
 	}
 
-	event_del (&rt->timeout_event);
+	/* Learns and tokens are requested in the same pipeline */
+	if (rt->pending > 0) {
+		rt->pending --;
+	}
+
+	if (rt->pending == 0) {
+		rspamd_timer_cancel (&rt->timeout_event);
+	}
 }
 
 static void
@@ -692,11 +796,11 @@ rspamd_redis_fin_learn (gpointer data)
 		rt->conn_state = RSPAMD_REDIS_DISCONNECTED;
 	}
 
-	event_del (&rt->timeout_event);
+	rspamd_timer_cancel (&rt->timeout_event);
 }
 
 static void
-rspamd_redis_timeout (gint fd, short what, gpointer d)
+rspamd_redis_timeout (gpointer d)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (d);
 	struct rspamd_task *task;
@@ -707,7 +811,8 @@ rspamd_redis_timeout (gint fd, short what, gpointer d)
 			rspamd_upstream_name (rt->selected));
 	rspamd_upstream_fail (rt->selected);
 	rt->conn_state = RSPAMD_REDIS_TIMEDOUT;
-	redisAsyncFree (rt->redis);
+	rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+			rt->redis, TRUE);
 	rt->redis = NULL;
 }
 
@@ -774,7 +879,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
 	redisReply *reply = r, *elt;
 	struct rspamd_task *task;
-	rspamd_token_t *tok;
+	gdouble *values;
 	guint i, processed = 0, found = 0;
 	gulong val;
 	gdouble float_val;
@@ -786,29 +891,30 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
 				if (reply->elements == task->tokens->len) {
+					values = task->tokens->values[rt->id];
+
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
 						elt = reply->element[i];
 
 						if (G_LIKELY (elt->type == REDIS_REPLY_INTEGER)) {
-							tok->values[rt->id] = elt->integer;
+							values[i] = elt->integer;
 							found ++;
 						}
 						else if (elt->type == REDIS_REPLY_STRING) {
 							if (rt->stcf->clcf->flags &
 									RSPAMD_FLAG_CLASSIFIER_INTEGER) {
 								rspamd_strtoul (elt->str, elt->len, &val);
-								tok->values[rt->id] = val;
+								values[i] = val;
 							}
 							else {
 								float_val = strtod (elt->str, NULL);
-								tok->values[rt->id] = float_val;
+								values[i] = float_val;
 							}
 
 							found ++;
 						}
 						else {
-							tok->values[rt->id] = 0;
+							values[i] = 0;
 						}
 
 						processed ++;
@@ -871,11 +977,431 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 
 	if (rt->conn_state == RSPAMD_REDIS_CONNECTED) {
-		redisAsyncFree (rt->redis);
+		/* Replies for the rest of the pipelined commands are not read */
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				rt->redis, TRUE);
 		rt->conn_state = RSPAMD_REDIS_DISCONNECTED;
 	}
 }
 
+/* Called when we have received values of the found tokens from script */
+static void
+rspamd_redis_script_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r, *elt;
+	struct rspamd_task *task;
+	gdouble *values;
+	guint i, found = 0;
+	glong idx;
+	gulong val;
+
+	task = rt->task;
+
+	if (c->err == 0 && rspamd_redis_is_noscript (rt, reply)) {
+		rt->script_sent = TRUE;
+
+		if (redisAsyncCommand (c, rspamd_redis_script_processed, rt,
+				"EVAL %s 1 %s %b", rspamd_redis_classify_script,
+				rt->redis_object_expanded, rt->script_tokens->str,
+				rt->script_tokens->len) == REDIS_OK) {
+			/* Session event is still pending */
+			return;
+		}
+	}
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			if (reply->type == REDIS_REPLY_ARRAY && reply->elements % 2 == 0) {
+				values = task->tokens->values[rt->id];
+
+				for (i = 0; i < task->tokens->len; i ++) {
+					values[i] = 0;
+				}
+
+				for (i = 0; i < reply->elements; i += 2) {
+					elt = reply->element[i];
+					idx = elt->type == REDIS_REPLY_INTEGER ? elt->integer : 0;
+
+					if (idx <= 0 || idx > (glong)task->tokens->len) {
+						msg_err_task ("got invalid token position from redis "
+								"script: %l", idx);
+						continue;
+					}
+
+					elt = reply->element[i + 1];
+
+					if (elt->type == REDIS_REPLY_STRING) {
+						if (rt->stcf->clcf->flags &
+								RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+							rspamd_strtoul (elt->str, elt->len, &val);
+							values[idx - 1] = val;
+						}
+						else {
+							values[idx - 1] = strtod (elt->str, NULL);
+						}
+
+						found ++;
+					}
+				}
+
+				if (rt->stcf->is_spam) {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+				}
+				else {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+				}
+			}
+			else if (reply->type == REDIS_REPLY_ERROR) {
+				msg_err_task ("redis script failed: %s", reply->str);
+			}
+			else {
+				msg_err_task ("got invalid reply from redis script: %d",
+						reply->type);
+			}
+
+			msg_debug_task ("received tokens for %s: %d processed, %d found",
+					rt->redis_object_expanded, task->tokens->len, found);
+			rspamd_upstream_ok (rt->selected);
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (rt->selected), c->errstr);
+		rspamd_upstream_fail (rt->selected);
+	}
+
+	rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+}
+
+/* Called when learn script has been executed */
+static void
+rspamd_redis_script_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
+	struct rspamd_task *task;
+
+	task = rt->task;
+
+	if (c->err == 0 && rspamd_redis_is_noscript (rt, reply)) {
+		rt->script_sent = TRUE;
+
+		if (redisAsyncCommand (c, rspamd_redis_script_learned, rt,
+				"EVAL %s 1 %s %s %s %b", rspamd_redis_learn_script,
+				rt->redis_object_expanded, rt->script_learns,
+				(rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) ?
+						"1" : "0",
+				rt->script_tokens->str, rt->script_tokens->len) == REDIS_OK) {
+			return;
+		}
+	}
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+		msg_err_task ("redis script failed: %s", reply->str);
+	}
+
+	rspamd_redis_learned (c, r, priv);
+}
+
+static void
+rspamd_redis_shard_fin (gpointer data)
+{
+	struct redis_stat_shard *shard = data;
+
+	rspamd_timer_cancel (&shard->timeout_event);
+}
+
+static void
+rspamd_redis_shard_timeout (gpointer d)
+{
+	struct redis_stat_shard *shard = d;
+	struct rspamd_task *task;
+	redisAsyncContext *redis;
+
+	task = shard->rt->task;
+
+	msg_err_task ("connection to redis shard %s timed out",
+			rspamd_upstream_name (shard->selected));
+	rspamd_upstream_fail (shard->selected);
+
+	if (shard->redis) {
+		redis = shard->redis;
+		shard->redis = NULL;
+		/* This will call all pending callbacks with NULL reply */
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				redis, TRUE);
+	}
+}
+
+static void
+rspamd_redis_shards_free (struct redis_stat_runtime *rt)
+{
+	struct redis_stat_shard *shard;
+	redisAsyncContext *redis;
+	guint i;
+
+	if (rt->shards == NULL) {
+		return;
+	}
+
+	for (i = 0; i < rt->shards->len; i ++) {
+		shard = g_ptr_array_index (rt->shards, i);
+
+		if (shard->redis) {
+			rspamd_timer_cancel (&shard->timeout_event);
+			redis = shard->redis;
+			shard->redis = NULL;
+			rspamd_redis_pool_release_connection (rt->task->cfg->redis_pool,
+					redis, FALSE);
+		}
+	}
+
+	g_ptr_array_set_size (rt->shards, 0);
+}
+
+/* Called when we have received tokens values from a shard */
+static void
+rspamd_redis_shard_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_shard *shard = priv;
+	struct redis_stat_runtime *rt = shard->rt;
+	redisReply *reply = r, *elt;
+	struct rspamd_task *task;
+	gdouble *values;
+	guint i, idx, found = 0;
+	gulong val;
+
+	task = rt->task;
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			if (reply->type == REDIS_REPLY_ARRAY &&
+					reply->elements == shard->tokens->len) {
+				values = task->tokens->values[rt->id];
+
+				for (i = 0; i < reply->elements; i ++) {
+					elt = reply->element[i];
+					idx = g_array_index (shard->tokens, guint, i);
+
+					if (G_LIKELY (elt->type == REDIS_REPLY_INTEGER)) {
+						values[idx] = elt->integer;
+						found ++;
+					}
+					else if (elt->type == REDIS_REPLY_STRING) {
+						if (rt->stcf->clcf->flags &
+								RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+							rspamd_strtoul (elt->str, elt->len, &val);
+							values[idx] = val;
+						}
+						else {
+							values[idx] = strtod (elt->str, NULL);
+						}
+
+						found ++;
+					}
+					else {
+						values[idx] = 0;
+					}
+				}
+
+				if (rt->stcf->is_spam) {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+				}
+				else {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+				}
+			}
+			else {
+				msg_err_task ("got invalid reply from redis shard %s: %d",
+						rspamd_upstream_name (shard->selected), reply->type);
+			}
+
+			msg_debug_task ("received tokens for %s from %s: %d processed, "
+					"%d found",
+					rt->redis_object_expanded,
+					rspamd_upstream_name (shard->selected),
+					shard->tokens->len, found);
+			rspamd_upstream_ok (shard->selected);
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis shard %s: %s",
+				rspamd_upstream_name (shard->selected), c->errstr);
+		rspamd_upstream_fail (shard->selected);
+		/* Context is freed by hiredis on error */
+		shard->redis = NULL;
+	}
+
+	rspamd_session_remove_event (task->s, rspamd_redis_shard_fin, shard);
+}
+
+/* Called when we have set tokens in a shard during learning */
+static void
+rspamd_redis_shard_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_shard *shard = priv;
+	struct rspamd_task *task;
+	redisAsyncContext *redis = NULL;
+
+	task = shard->rt->task;
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			rspamd_upstream_ok (shard->selected);
+			/* As for the single connection, we do not wait for all replies */
+			redis = shard->redis;
+			shard->redis = NULL;
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis shard %s: %s",
+				rspamd_upstream_name (shard->selected), c->errstr);
+		rspamd_upstream_fail (shard->selected);
+		shard->redis = NULL;
+	}
+
+	rspamd_session_remove_event (task->s, rspamd_redis_shard_fin, shard);
+
+	if (redis) {
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				redis, TRUE);
+	}
+}
+
+/*
+ * Split tokens between shards using consistent hashing of tokens over
+ * the list of upstreams, each shard gets its own connection
+ */
+static gboolean
+rspamd_redis_shard_tokens (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		struct upstream_list *ups)
+{
+	struct rspamd_task *task = rt->task;
+	struct redis_stat_shard *shard;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	guint i, j;
+
+	if (rt->shards == NULL) {
+		rt->shards = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_ptr_array_free_hard, rt->shards);
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		up = rspamd_upstream_get_forced (ups, RSPAMD_UPSTREAM_HASHED,
+				(const guchar *)&tokens->hashes[i], sizeof (tokens->hashes[i]));
+
+		if (up == NULL) {
+			msg_err_task ("no upstreams reachable");
+			return FALSE;
+		}
+
+		shard = NULL;
+
+		for (j = 0; j < rt->shards->len; j ++) {
+			shard = g_ptr_array_index (rt->shards, j);
+
+			if (shard->selected == up) {
+				break;
+			}
+
+			shard = NULL;
+		}
+
+		if (shard == NULL) {
+			shard = rspamd_mempool_alloc0 (task->task_pool, sizeof (*shard));
+			shard->rt = rt;
+			shard->selected = up;
+			shard->tokens = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+					tokens->len / MAX (rspamd_upstreams_count (ups), 1) + 1);
+			rspamd_mempool_add_destructor (task->task_pool,
+					rspamd_array_free_hard, shard->tokens);
+
+			addr = rspamd_upstream_addr (up);
+			g_assert (addr != NULL);
+			shard->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+					task->ev_base, rt->ctx->dbname, rt->ctx->password,
+					rspamd_inet_address_to_string (addr),
+					rspamd_inet_address_get_port (addr));
+
+			if (shard->redis == NULL) {
+				rspamd_upstream_fail (up);
+			}
+
+			/* Pointer array does not own shards, they live in the pool */
+			g_ptr_array_add (rt->shards, shard);
+		}
+
+		g_array_append_val (shard->tokens, i);
+	}
+
+	return TRUE;
+}
+
+/* Send a pipelined query for each shard concurrently */
+static gboolean
+rspamd_redis_shards_send (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens,
+		gboolean learn, gint id)
+{
+	struct rspamd_task *task = rt->task;
+	struct redis_stat_shard *shard;
+	rspamd_fstring_t *query;
+	const gchar *redis_cmd;
+	guint i, sent = 0;
+	gint ret;
+
+	if (learn) {
+		if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+			redis_cmd = "HINCRBY";
+		}
+		else {
+			redis_cmd = "HINCRBYFLOAT";
+		}
+	}
+	else {
+		redis_cmd = "HMGET";
+	}
+
+	for (i = 0; i < rt->shards->len; i ++) {
+		shard = g_ptr_array_index (rt->shards, i);
+
+		if (shard->redis == NULL || shard->tokens->len == 0) {
+			continue;
+		}
+
+		query = rspamd_redis_tokens_to_query (task, tokens, shard->tokens,
+				redis_cmd, rt->redis_object_expanded, learn, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+		g_assert (query != NULL);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+		ret = redisAsyncFormattedCommand (shard->redis,
+				learn ? rspamd_redis_shard_learned : rspamd_redis_shard_processed,
+				shard, query->str, query->len);
+
+		if (ret == REDIS_OK) {
+			rspamd_session_add_event (task->s, rspamd_redis_shard_fin, shard,
+					rspamd_redis_stat_quark ());
+			rspamd_timer_add (rspamd_timer_wheel_get (task->ev_base),
+					&shard->timeout_event, rt->ctx->timeout,
+					rspamd_redis_shard_timeout, shard);
+			sent ++;
+		}
+		else {
+			msg_err_task ("call to redis shard %s failed: %s",
+					rspamd_upstream_name (shard->selected),
+					shard->redis->errstr);
+		}
+	}
+
+	return sent > 0;
+}
+
 static gboolean
 rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
@@ -999,9 +1525,48 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		backend->dbname = NULL;
 	}
 
+	/*
+	 * Distribute tokens over all servers, read and write servers must be
+	 * the same in this mode
+	 */
+	elt = ucl_object_lookup (obj, "sharded");
+	if (elt) {
+		backend->sharded = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->sharded = FALSE;
+	}
+
+	/* Process tokens by server side scripts to reduce traffic */
+	elt = ucl_object_lookup (obj, "scripts");
+	if (elt) {
+		backend->scripts = ucl_object_toboolean (elt);
+
+		if (backend->scripts && backend->sharded) {
+			msg_warn_config ("statfile %s: scripts are not supported for "
+					"sharded statistics, disable them", symbol);
+			backend->scripts = FALSE;
+		}
+	}
+	else {
+		backend->scripts = FALSE;
+	}
+
 	return TRUE;
 }
 
+static void
+rspamd_redis_set_probe (struct redis_stat_ctx *backend,
+		struct upstream_list *ups)
+{
+	static const gchar ping[] = "PING\r\n";
+
+	/* Servers that require authentication reply with an error */
+	rspamd_upstreams_set_probe (ups, RSPAMD_UPSTREAM_PROBE_TCP,
+			(const guchar *)ping, sizeof (ping) - 1,
+			backend->password ? NULL : "+PONG");
+}
+
 gpointer
 rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg, struct rspamd_statfile *st)
@@ -1040,6 +1605,21 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
 
+	if (cfg->upstream_probe_interval > 0) {
+		rspamd_redis_set_probe (backend, backend->read_servers);
+
+		if (backend->write_servers) {
+			rspamd_redis_set_probe (backend, backend->write_servers);
+		}
+	}
+
+	if (backend->scripts && rspamd_redis_classify_sha[0] == '\0') {
+		rspamd_redis_script_sha (rspamd_redis_classify_script,
+				rspamd_redis_classify_sha);
+		rspamd_redis_script_sha (rspamd_redis_learn_script,
+				rspamd_redis_learn_sha);
+	}
+
 	st_elt = g_slice_alloc0 (sizeof (*st_elt));
 	st_elt->ev_base = ctx->ev_base;
 	st_elt->ctx = backend;
@@ -1062,7 +1642,6 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	struct redis_stat_runtime *rt;
 	struct upstream *up;
 	rspamd_inet_addr_t *addr;
-	struct timeval tv;
 
 	g_assert (ctx != NULL);
 	g_assert (stcf != NULL);
@@ -1072,7 +1651,19 @@ rspamd_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
-	if (learn) {
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rspamd_redis_expand_object (ctx->redis_object, ctx, task,
+			&rt->redis_object_expanded);
+
+	if (ctx->sharded) {
+		/* Learns counter is stored in a shard selected by the object name */
+		up = rspamd_upstream_get_forced (
+				learn ? ctx->write_servers : ctx->read_servers,
+				RSPAMD_UPSTREAM_HASHED,
+				(const guchar *)rt->redis_object_expanded,
+				strlen (rt->redis_object_expanded));
+	}
+	else if (learn) {
 		up = rspamd_upstream_get (ctx->write_servers,
 				RSPAMD_UPSTREAM_MASTER_SLAVE,
 				NULL,
@@ -1090,9 +1681,6 @@ rspamd_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
-	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
-	rspamd_redis_expand_object (ctx->redis_object, ctx, task,
-			&rt->redis_object_expanded);
 	rt->selected = up;
 	rt->task = task;
 	rt->ctx = ctx;
@@ -1101,21 +1689,27 @@ rspamd_redis_runtime (struct rspamd_task *task,
 
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+	rt->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			task->ev_base, ctx->dbname, ctx->password,
+			rspamd_inet_address_to_string (addr),
 			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
 
-	redisLibeventAttach (rt->redis, task->ev_base);
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect to redis server %s",
+				rspamd_upstream_name (up));
+		rspamd_upstream_fail (up);
+
+		return NULL;
+	}
+
 	rspamd_session_add_event (task->s, rspamd_redis_fin, rt,
 			rspamd_redis_stat_quark ());
+	rt->pending ++;
 
 	/* Now check stats */
-	event_set (&rt->timeout_event, -1, EV_TIMEOUT, rspamd_redis_timeout, rt);
-	event_base_set (task->ev_base, &rt->timeout_event);
-	double_to_tv (ctx->timeout, &tv);
-	event_add (&rt->timeout_event, &tv);
+	rspamd_timer_add (rspamd_timer_wheel_get (task->ev_base),
+			&rt->timeout_event, ctx->timeout, rspamd_redis_timeout, rt);
 
-	rspamd_redis_maybe_auth (ctx, rt->redis);
 	redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
 			rt->redis_object_expanded, "learns");
 
@@ -1140,36 +1734,62 @@ rspamd_redis_close (gpointer p)
 
 gboolean
 rspamd_redis_process_tokens (struct rspamd_task *task,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	rspamd_fstring_t *query;
-	struct timeval tv;
 	gint ret;
 
+	/*
+	 * Tokens are requested without waiting for the learns reply, as redis
+	 * replies to pipelined commands in order
+	 */
 	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL ||
-			rt->conn_state != RSPAMD_REDIS_CONNECTED) {
+			rt->conn_state == RSPAMD_REDIS_TIMEDOUT) {
 		return FALSE;
 	}
 
 	rt->id = id;
-	query = rspamd_redis_tokens_to_query (task, tokens,
-			"HMGET", rt->redis_object_expanded, FALSE, -1,
-			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-	g_assert (query != NULL);
-	rspamd_mempool_add_destructor (task->task_pool,
+
+	if (rt->ctx->sharded) {
+		if (!rspamd_redis_shard_tokens (rt, tokens, rt->ctx->read_servers)) {
+			return FALSE;
+		}
+
+		return rspamd_redis_shards_send (rt, tokens, FALSE, id);
+	}
+
+	if (rt->ctx->scripts) {
+		rt->script_tokens = rspamd_redis_tokens_to_packed (tokens, FALSE, -1,
+				FALSE);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free,
+				rt->script_tokens);
+		ret = redisAsyncCommand (rt->redis, rspamd_redis_script_processed, rt,
+				"EVALSHA %s 1 %s %b", rspamd_redis_classify_sha,
+				rt->redis_object_expanded, rt->script_tokens->str,
+				rt->script_tokens->len);
+	}
+	else {
+		query = rspamd_redis_tokens_to_query (task, tokens, NULL,
+				"HMGET", rt->redis_object_expanded, FALSE, -1,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+		g_assert (query != NULL);
+		rspamd_mempool_add_destructor (task->task_pool,
 				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
 
-	ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_processed, rt,
-			query->str, query->len);
+		ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_processed,
+				rt, query->str, query->len);
+	}
+
 	if (ret == REDIS_OK) {
 		rspamd_session_add_event (task->s, rspamd_redis_fin, rt,
 				rspamd_redis_stat_quark ());
+		rt->pending ++;
 		/* Reset timeout */
-		event_del (&rt->timeout_event);
-		double_to_tv (rt->ctx->timeout, &tv);
-		event_add (&rt->timeout_event, &tv);
+		rspamd_timer_add (rspamd_timer_wheel_get (task->ev_base),
+				&rt->timeout_event, rt->ctx->timeout, rspamd_redis_timeout, rt);
 
 		return TRUE;
 	}
@@ -1186,9 +1806,12 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 
+	rspamd_redis_shards_free (rt);
+
 	if (rt->conn_state == RSPAMD_REDIS_CONNECTED) {
-		event_del (&rt->timeout_event);
-		redisAsyncFree (rt->redis);
+		rspamd_timer_cancel (&rt->timeout_event);
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				rt->redis, FALSE);
 		rt->redis = NULL;
 
 		rt->conn_state = RSPAMD_REDIS_DISCONNECTED;
@@ -1196,16 +1819,15 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 }
 
 gboolean
-rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_redis_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	struct upstream *up;
 	rspamd_inet_addr_t *addr;
-	struct timeval tv;
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
-	rspamd_token_t *tok;
 	gint ret;
 
 	if (rt->conn_state != RSPAMD_REDIS_DISCONNECTED) {
@@ -1215,10 +1837,18 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		return FALSE;
 	}
 
-	up = rspamd_upstream_get (rt->ctx->write_servers,
-			RSPAMD_UPSTREAM_MASTER_SLAVE,
-			NULL,
-			0);
+	if (rt->ctx->sharded) {
+		up = rspamd_upstream_get_forced (rt->ctx->write_servers,
+				RSPAMD_UPSTREAM_HASHED,
+				(const guchar *)rt->redis_object_expanded,
+				strlen (rt->redis_object_expanded));
+	}
+	else {
+		up = rspamd_upstream_get (rt->ctx->write_servers,
+				RSPAMD_UPSTREAM_MASTER_SLAVE,
+				NULL,
+				0);
+	}
 
 	if (up == NULL) {
 		msg_err_task ("no upstreams reachable");
@@ -1229,18 +1859,21 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+	rt->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			task->ev_base, rt->ctx->dbname, rt->ctx->password,
+			rspamd_inet_address_to_string (addr),
 			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
 
-	redisLibeventAttach (rt->redis, task->ev_base);
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect to redis server %s",
+				rspamd_upstream_name (up));
+		rspamd_upstream_fail (up);
 
-	event_set (&rt->timeout_event, -1, EV_TIMEOUT, rspamd_redis_timeout, rt);
-	event_base_set (task->ev_base, &rt->timeout_event);
-	double_to_tv (rt->ctx->timeout, &tv);
-	event_add (&rt->timeout_event, &tv);
+		return FALSE;
+	}
 
-	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
+	rspamd_timer_add (rspamd_timer_wheel_get (task->ev_base),
+			&rt->timeout_event, rt->ctx->timeout, rspamd_redis_timeout, rt);
 
 	if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
 		redis_cmd = "HINCRBY";
@@ -1250,9 +1883,46 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->id = id;
-	query = rspamd_redis_tokens_to_query (task, tokens,
-			redis_cmd, rt->redis_object_expanded, TRUE, id,
-			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+
+	if (rt->ctx->scripts && !rt->ctx->sharded) {
+		/* See the comment about learn or unlearn detection below */
+		rt->script_learns = tokens->values[id][0] > 0 ? "1" : "-1";
+		rt->script_tokens = rspamd_redis_tokens_to_packed (tokens, TRUE, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free,
+				rt->script_tokens);
+
+		ret = redisAsyncCommand (rt->redis, rspamd_redis_script_learned, rt,
+				"EVALSHA %s 1 %s %s %s %b", rspamd_redis_learn_sha,
+				rt->redis_object_expanded, rt->script_learns,
+				(rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) ?
+						"1" : "0",
+				rt->script_tokens->str, rt->script_tokens->len);
+
+		if (ret == REDIS_OK) {
+			rspamd_session_add_event (task->s, rspamd_redis_fin_learn, rt,
+					rspamd_redis_stat_quark ());
+			rt->conn_state = RSPAMD_REDIS_CONNECTED;
+
+			return TRUE;
+		}
+
+		msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+
+		return FALSE;
+	}
+
+	if (rt->ctx->sharded) {
+		/* Tokens are sent to their shards, here we update learns only */
+		query = rspamd_fstring_sized_new (64);
+	}
+	else {
+		query = rspamd_redis_tokens_to_query (task, tokens, NULL,
+				redis_cmd, rt->redis_object_expanded, TRUE, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+	}
+
 	g_assert (query != NULL);
 
 	/*
@@ -1261,9 +1931,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	 * we could understand that we are learning or unlearning
 	 */
 
-	tok = g_ptr_array_index (task->tokens, 0);
-
-	if (tok->values[id] > 0) {
+	if (tokens->values[id][0] > 0) {
 		rspamd_printf_fstring (&query, ""
 				"*4\r\n"
 				"$7\r\n"
@@ -1302,11 +1970,19 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		rspamd_session_add_event (task->s, rspamd_redis_fin_learn, rt,
 				rspamd_redis_stat_quark ());
 		/* Reset timeout */
-		event_del (&rt->timeout_event);
-		double_to_tv (rt->ctx->timeout, &tv);
-		event_add (&rt->timeout_event, &tv);
+		rspamd_timer_add (rspamd_timer_wheel_get (task->ev_base),
+				&rt->timeout_event, rt->ctx->timeout, rspamd_redis_timeout, rt);
 		rt->conn_state = RSPAMD_REDIS_CONNECTED;
 
+		if (rt->ctx->sharded) {
+			if (!rspamd_redis_shard_tokens (rt, tokens,
+					rt->ctx->write_servers)) {
+				return FALSE;
+			}
+
+			return rspamd_redis_shards_send (rt, tokens, TRUE, id);
+		}
+
 		return TRUE;
 	}
 	else {
@@ -1323,9 +1999,12 @@ rspamd_redis_finalize_learn (struct rspamd_task *task, gpointer runtime,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 
+	rspamd_redis_shards_free (rt);
+
 	if (rt->conn_state == RSPAMD_REDIS_CONNECTED) {
-		event_del (&rt->timeout_event);
-		redisAsyncFree (rt->redis);
+		rspamd_timer_cancel (&rt->timeout_event);
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				rt->redis, FALSE);
 		rt->redis = NULL;
 
 		rt->conn_state = RSPAMD_REDIS_DISCONNECTED;
@@ -1381,8 +2060,9 @@ rspamd_redis_get_stat (gpointer runtime,
 		st = rt->ctx->stat_elt->ud;
 
 		if (rt->redis) {
-			event_del (&rt->timeout_event);
-			redisAsyncFree (rt->redis);
+			rspamd_timer_cancel (&rt->timeout_event);
+			rspamd_redis_pool_release_connection (rt->task->cfg->redis_pool,
+					rt->redis, FALSE);
 			rt->redis = NULL;
 
 			rt->conn_state = RSPAMD_REDIS_DISCONNECTED;
@@ -21,10 +21,13 @@
 #include "libmime/message.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
+#include "libutil/hash.h"
 
 #define SQLITE3_BACKEND_TYPE "sqlite3"
 #define SQLITE3_SCHEMA_VERSION "1"
 #define SQLITE3_DEFAULT "default"
+/* Number of tokens looked up by a single query */
+#define SQLITE3_TOKENS_BATCH 128
 
 struct rspamd_stat_sqlite3_db {
 	sqlite3 *sqlite;
@@ -37,6 +40,26 @@ struct rspamd_stat_sqlite3_db {
 	gboolean enable_languages;
 	gint cbref_user;
 	gint cbref_language;
+	sqlite3_stmt *batch_stmt;
+	sqlite3_stmt *version_stmt;
+	rspamd_lru_hash_t *tokens_cache;
+	guint tokens_cache_size;
+	gint64 data_version;
+};
+
+/* Cached value of a token for the specific user and language */
+struct rspamd_stat_sqlite3_cached_token {
+	guint64 token;
+	gint64 user_id;
+	gint64 lang_id;
+	gint64 value;
+};
+
+/* Row of a batched tokens lookup */
+struct rspamd_stat_sqlite3_token_row {
+	guint64 token;
+	gint64 value;
+	gint64 lang_id;
 };
 
 struct rspamd_stat_sqlite3_rt {
@@ -281,6 +304,15 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_BACKEND_MAX] =
 	}
 };
 
+/*
+ * Tokens values for the specific user and the specific or default language,
+ * `token IN (...)` is expanded to SQLITE3_TOKENS_BATCH arguments
+ */
+static const char *get_tokens_batch_sql =
+		"SELECT token, value, language FROM tokens "
+		"WHERE user=?1 AND (language=?2 OR language=0) "
+		"AND token IN (";
+
 static GQuark
 rspamd_sqlite3_backend_quark (void)
 {
@@ -418,6 +450,213 @@ rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
 	return id;
 }
 
+static guint
+rspamd_sqlite3_cached_token_hash (gconstpointer p)
+{
+	const struct rspamd_stat_sqlite3_cached_token *ct = p;
+
+	/* Tokens are hashes themselves */
+	return (guint)(ct->token ^ (ct->token >> 32) ^
+			(ct->user_id * 0x9E3779B1U) ^ (ct->lang_id * 0x85EBCA77U));
+}
+
+static gboolean
+rspamd_sqlite3_cached_token_equal (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_stat_sqlite3_cached_token *ct1 = a, *ct2 = b;
+
+	return ct1->token == ct2->token && ct1->user_id == ct2->user_id &&
+			ct1->lang_id == ct2->lang_id;
+}
+
+static void
+rspamd_sqlite3_cached_token_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct rspamd_stat_sqlite3_cached_token), p);
+}
+
+static void
+rspamd_sqlite3_reset_cache (struct rspamd_stat_sqlite3_db *bk)
+{
+	if (bk->tokens_cache) {
+		rspamd_lru_hash_destroy (bk->tokens_cache);
+	}
+
+	/* Key and value are the same structure */
+	bk->tokens_cache = rspamd_lru_hash_new_full (bk->tokens_cache_size,
+			NULL, rspamd_sqlite3_cached_token_free,
+			rspamd_sqlite3_cached_token_hash,
+			rspamd_sqlite3_cached_token_equal);
+}
+
+/*
+ * Data version is changed each time when another connection (e.g. controller
+ * learning) commits changes to the database, so cache is invalidated
+ */
+static void
+rspamd_sqlite3_check_version (struct rspamd_stat_sqlite3_db *bk)
+{
+	gint64 version;
+
+	if (bk->version_stmt == NULL) {
+		return;
+	}
+
+	sqlite3_reset (bk->version_stmt);
+
+	if (sqlite3_step (bk->version_stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int64 (bk->version_stmt, 0);
+
+		if (version != bk->data_version) {
+			bk->data_version = version;
+			rspamd_sqlite3_reset_cache (bk);
+		}
+	}
+	else {
+		/* Cannot check if values are still valid */
+		rspamd_sqlite3_reset_cache (bk);
+	}
+
+	sqlite3_reset (bk->version_stmt);
+}
+
+static sqlite3_stmt *
+rspamd_sqlite3_prepare_batch (struct rspamd_stat_sqlite3_db *bk)
+{
+	GString *sql;
+	sqlite3_stmt *stmt = NULL;
+	guint i;
+
+	sql = g_string_new (get_tokens_batch_sql);
+
+	for (i = 0; i < SQLITE3_TOKENS_BATCH; i ++) {
+		rspamd_printf_gstring (sql, i == 0 ? "?%d" : ",?%d", i + 3);
+	}
+
+	g_string_append (sql, ");");
+
+	if (sqlite3_prepare_v2 (bk->sqlite, sql->str, -1, &stmt, NULL)
+			!= SQLITE_OK) {
+		msg_warn_pool ("cannot prepare batched tokens query for %s: %s",
+				bk->fname, sqlite3_errmsg (bk->sqlite));
+		stmt = NULL;
+	}
+
+	g_string_free (sql, TRUE);
+
+	return stmt;
+}
+
+static gint
+rspamd_sqlite3_token_row_cmp (const void *a, const void *b)
+{
+	const struct rspamd_stat_sqlite3_token_row *r1 = a, *r2 = b;
+
+	if (r1->token != r2->token) {
+		return r1->token < r2->token ? -1 : 1;
+	}
+
+	/* Specific language goes first */
+	if (r1->lang_id != r2->lang_id) {
+		return r1->lang_id > r2->lang_id ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static gint64
+rspamd_sqlite3_get_token (struct rspamd_task *task,
+		struct rspamd_stat_sqlite3_db *bk,
+		struct rspamd_stat_sqlite3_rt *rt,
+		guint64 token)
+{
+	gint64 iv = 0;
+
+	if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+			RSPAMD_STAT_BACKEND_GET_TOKEN,
+			(gint64)token, rt->user_id, rt->lang_id, &iv) != SQLITE_OK) {
+		iv = 0;
+	}
+
+	return iv;
+}
+
+/* Get values of tokens from `batch` indices and store them in the cache */
+static void
+rspamd_sqlite3_get_batch (struct rspamd_task *task,
+		struct rspamd_stat_sqlite3_db *bk,
+		struct rspamd_stat_sqlite3_rt *rt,
+		struct rspamd_stat_tokens *tokens,
+		gint id, const guint *batch, guint n)
+{
+	struct rspamd_stat_sqlite3_token_row rows[SQLITE3_TOKENS_BATCH * 2];
+	struct rspamd_stat_sqlite3_cached_token *ct;
+	sqlite3_stmt *stmt = bk->batch_stmt;
+	guint i, nrows = 0, lo, hi, mid;
+	guint64 token;
+	gint64 iv;
+
+	if (stmt != NULL) {
+		sqlite3_reset (stmt);
+		sqlite3_bind_int64 (stmt, 1, rt->user_id);
+		sqlite3_bind_int64 (stmt, 2, rt->lang_id);
+
+		/* Unused arguments are filled with the last token */
+		for (i = 0; i < SQLITE3_TOKENS_BATCH; i ++) {
+			sqlite3_bind_int64 (stmt, i + 3,
+					(gint64)tokens->hashes[batch[MIN (i, n - 1)]]);
+		}
+
+		while (nrows < G_N_ELEMENTS (rows) &&
+				sqlite3_step (stmt) == SQLITE_ROW) {
+			rows[nrows].token = sqlite3_column_int64 (stmt, 0);
+			rows[nrows].value = sqlite3_column_int64 (stmt, 1);
+			rows[nrows].lang_id = sqlite3_column_int64 (stmt, 2);
+			nrows ++;
+		}
+
+		sqlite3_reset (stmt);
+		qsort (rows, nrows, sizeof (rows[0]), rspamd_sqlite3_token_row_cmp);
+	}
+
+	for (i = 0; i < n; i ++) {
+		token = tokens->hashes[batch[i]];
+
+		if (stmt != NULL) {
+			/* Lower bound, so the specific language row is preferred */
+			lo = 0;
+			hi = nrows;
+
+			while (lo < hi) {
+				mid = (lo + hi) / 2;
+
+				if (rows[mid].token < token) {
+					lo = mid + 1;
+				}
+				else {
+					hi = mid;
+				}
+			}
+
+			iv = (lo < nrows && rows[lo].token == token) ? rows[lo].value : 0;
+		}
+		else {
+			iv = rspamd_sqlite3_get_token (task, bk, rt, token);
+		}
+
+		tokens->values[id][batch[i]] = iv;
+
+		if (bk->tokens_cache) {
+			ct = g_slice_alloc (sizeof (*ct));
+			ct->token = token;
+			ct->user_id = rt->user_id;
+			ct->lang_id = rt->lang_id;
+			ct->value = iv;
+			rspamd_lru_hash_insert (bk->tokens_cache, ct, ct, 0, 0);
+		}
+	}
+}
+
 static struct rspamd_stat_sqlite3_db *
 rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf,
@@ -438,7 +677,8 @@ rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 	};
 
 	bk = g_slice_alloc0 (sizeof (*bk));
-	bk->sqlite = rspamd_sqlite3_open_or_create (pool, path, create_tables_sql, err);
+	bk->sqlite = rspamd_sqlite3_open_or_create (pool, path, create_tables_sql,
+			NULL, err);
 	bk->pool = pool;
 
 	if (bk->sqlite == NULL) {
@@ -509,6 +749,9 @@ rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 	rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
 
+	/* Falls back to the lookups of the individual tokens on failure */
+	bk->batch_stmt = rspamd_sqlite3_prepare_batch (bk);
+
 	return bk;
 }
 
@@ -522,6 +765,7 @@ rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx,
 	const ucl_object_t *filenameo, *lang_enabled, *users_enabled;
 	const gchar *filename, *lua_script;
 	struct rspamd_stat_sqlite3_db *bk;
+	const ucl_object_t *cache_size;
 	GError *err = NULL;
 
 	filenameo = ucl_object_lookup (stf->opts, "filename");
@@ -623,6 +867,23 @@ rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx,
 				stf->symbol);
 	}
 
+	cache_size = ucl_object_lookup (stf->opts, "tokens_cache");
+
+	if (cache_size != NULL && ucl_object_toint (cache_size) > 0) {
+		if (sqlite3_prepare_v2 (bk->sqlite, "PRAGMA data_version;", -1,
+				&bk->version_stmt, NULL) != SQLITE_OK) {
+			msg_warn_config ("cannot use tokens cache for %s: %s",
+					stf->symbol, sqlite3_errmsg (bk->sqlite));
+			bk->version_stmt = NULL;
+		}
+		else {
+			bk->tokens_cache_size = ucl_object_toint (cache_size);
+			bk->data_version = -1;
+			rspamd_sqlite3_reset_cache (bk);
+			msg_info_config ("enable cache of %ud tokens for %s",
+					bk->tokens_cache_size, stf->symbol);
+		}
+	}
 
 	return (gpointer) bk;
 }
@@ -638,6 +899,16 @@ rspamd_sqlite3_close (gpointer p)
 					RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
 		}
 
+		if (bk->batch_stmt) {
+			sqlite3_finalize (bk->batch_stmt);
+		}
+		if (bk->version_stmt) {
+			sqlite3_finalize (bk->version_stmt);
+		}
+		if (bk->tokens_cache) {
+			rspamd_lru_hash_destroy (bk->tokens_cache);
+		}
+
 		rspamd_sqlite3_close_prstmt (bk->sqlite, bk->prstmt);
 		sqlite3_close (bk->sqlite);
 		g_free (bk->fname);
@@ -666,72 +937,90 @@ rspamd_sqlite3_runtime (struct rspamd_task *task,
 
 gboolean
 rspamd_sqlite3_process_tokens (struct rspamd_task *task,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
-	gint64 iv = 0, idx;
-	guint i;
-	rspamd_token_t *tok;
+	struct rspamd_stat_sqlite3_cached_token search, *ct;
+	guint batch[SQLITE3_TOKENS_BATCH];
+	guint i, nbatch = 0;
 
 	g_assert (p != NULL);
 	g_assert (tokens != NULL);
 
 	bk = rt->db;
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
+	if (bk == NULL) {
+		/* Statfile is does not exist, so all values are zero */
+		memset (tokens->values[id], 0, sizeof (gdouble) * tokens->len);
 
-		if (bk == NULL) {
-			/* Statfile is does not exist, so all values are zero */
-			tok->values[id] = 0.0;
-			continue;
-		}
+		return TRUE;
+	}
 
-		if (!bk->in_transaction) {
-			rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-					RSPAMD_STAT_BACKEND_TRANSACTION_START_DEF);
-			bk->in_transaction = TRUE;
-		}
+	if (tokens->len == 0) {
+		return TRUE;
+	}
 
-		if (rt->user_id == -1) {
-			if (bk->enable_users) {
-				rt->user_id = rspamd_sqlite3_get_user (bk, task, FALSE);
-			}
-			else {
-				rt->user_id = 0;
-			}
-		}
+	if (!bk->in_transaction) {
+		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_START_DEF);
+		bk->in_transaction = TRUE;
+	}
 
-		if (rt->lang_id == -1) {
-			if (bk->enable_languages) {
-				rt->lang_id = rspamd_sqlite3_get_language (bk, task, FALSE);
-			}
-			else {
-				rt->lang_id = 0;
-			}
+	if (rt->user_id == -1) {
+		if (bk->enable_users) {
+			rt->user_id = rspamd_sqlite3_get_user (bk, task, FALSE);
 		}
+		else {
+			rt->user_id = 0;
+		}
+	}
 
-		memcpy (&idx, tok->data, sizeof (idx));
-
-		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-				RSPAMD_STAT_BACKEND_GET_TOKEN,
-				idx, rt->user_id, rt->lang_id, &iv) == SQLITE_OK) {
-			tok->values[id] = iv;
+	if (rt->lang_id == -1) {
+		if (bk->enable_languages) {
+			rt->lang_id = rspamd_sqlite3_get_language (bk, task, FALSE);
 		}
 		else {
-			tok->values[id] = 0.0;
+			rt->lang_id = 0;
 		}
+	}
+
+	if (bk->tokens_cache) {
+		rspamd_sqlite3_check_version (bk);
+		search.user_id = rt->user_id;
+		search.lang_id = rt->lang_id;
+	}
 
-		if (rt->cf->is_spam) {
-			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+	for (i = 0; i < tokens->len; i ++) {
+		if (bk->tokens_cache) {
+			search.token = tokens->hashes[i];
+			ct = rspamd_lru_hash_lookup (bk->tokens_cache, &search, 0);
+
+			if (ct != NULL) {
+				tokens->values[id][i] = ct->value;
+				continue;
+			}
 		}
-		else {
-			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+
+		batch[nbatch ++] = i;
+
+		if (nbatch == G_N_ELEMENTS (batch)) {
+			rspamd_sqlite3_get_batch (task, bk, rt, tokens, id, batch, nbatch);
+			nbatch = 0;
 		}
 	}
 
+	if (nbatch > 0) {
+		rspamd_sqlite3_get_batch (task, bk, rt, tokens, id, batch, nbatch);
+	}
+
+	if (rt->cf->is_spam) {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+	}
+	else {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	}
 
 	return TRUE;
 }
@@ -759,14 +1048,14 @@ rspamd_sqlite3_finalize_process (struct rspamd_task *task, gpointer runtime,
 }
 
 gboolean
-rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_sqlite3_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
 	gint64 iv = 0, idx;
 	guint i;
-	rspamd_token_t *tok;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
@@ -774,7 +1063,6 @@ rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	bk = rt->db;
 
 	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
 		if (bk == NULL) {
 			/* Statfile is does not exist, so all values are zero */
 			return FALSE;
@@ -804,8 +1092,8 @@ rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 			}
 		}
 
-		iv = tok->values[id];
-		memcpy (&idx, tok->data, sizeof (idx));
+		iv = tokens->values[id][i];
+		idx = tokens->hashes[i];
 
 		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_SET_TOKEN,
@@ -838,6 +1126,11 @@ rspamd_sqlite3_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		bk->in_transaction = FALSE;
 	}
 
+	/* Data version is not changed by our own commits */
+	if (bk->tokens_cache) {
+		rspamd_sqlite3_reset_cache (bk);
+	}
+
 #ifdef SQLITE_OPEN_WAL
 #ifdef SQLITE_CHECKPOINT_TRUNCATE
 	mode = SQLITE_CHECKPOINT_TRUNCATE;
@@ -80,14 +80,6 @@ inv_chi_square (struct rspamd_task *task, gdouble value, gint freedom_deg)
 	return MIN (1.0, sum);
 }
 
-struct bayes_task_closure {
-	double ham_prob;
-	double spam_prob;
-	guint64 processed_tokens;
-	guint64 total_hits;
-	struct rspamd_task *task;
-};
-
 /*
  * Mathematically we use pow(complexity, complexity), where complexity is the
  * window index
@@ -95,72 +87,96 @@ struct bayes_task_closure {
 static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
+/*
+ * Tokens are scored in blocks: local probabilities of a block are computed
+ * without branches (so the loop could be vectorised by compiler) and their
+ * product is converted to log domain at once. Local probabilities are
+ * roughly 1/8 of inverse count of a token at least, so the product of a block
+ * cannot underflow for any sane number of learns
+ */
+#define BAYES_BLOCK_SIZE 8
+
+void
+bayes_score_tokens (const gdouble *spam_counts, const gdouble *ham_counts,
+		const guint *window_idx, guint len,
+		guint64 spam_learns, guint64 ham_learns,
+		struct bayes_tokens_score *res)
+{
+	gdouble bayes_spam_prob[BAYES_BLOCK_SIZE], bayes_ham_prob[BAYES_BLOCK_SIZE];
+	gdouble spam_prod, ham_prod, spam_norm, ham_norm;
+	gdouble spam_freq, ham_freq, spam_prob, ham_prob, total_count, fw, w;
+	guint i, j, n;
+
+	spam_norm = 1.0 / MAX (1., (gdouble)spam_learns);
+	ham_norm = 1.0 / MAX (1., (gdouble)ham_learns);
+
+	for (i = 0; i < len; i += BAYES_BLOCK_SIZE) {
+		n = MIN (BAYES_BLOCK_SIZE, len - i);
+
+		for (j = 0; j < n; j ++) {
+			total_count = spam_counts[i + j] + ham_counts[i + j];
+			spam_freq = spam_counts[i + j] * spam_norm;
+			ham_freq = ham_counts[i + j] * ham_norm;
+			spam_prob = spam_freq / (spam_freq + ham_freq);
+			ham_prob = ham_freq / (spam_freq + ham_freq);
+			fw = feature_weight[window_idx[i + j] %
+					G_N_ELEMENTS (feature_weight)];
+			/* Weight is the same for both classes */
+			w = ((spam_freq - ham_freq) * (spam_freq - ham_freq)) /
+					((spam_freq + ham_freq) * (spam_freq + ham_freq)) *
+					(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+
+			/* Tokens that are not found in statistics are ignored */
+			bayes_spam_prob[j] = total_count > 0 ?
+					PROB_COMBINE (spam_prob, total_count, w, 0.5) : 1.0;
+			bayes_ham_prob[j] = total_count > 0 ?
+					PROB_COMBINE (ham_prob, total_count, w, 0.5) : 1.0;
+			res->processed_tokens += total_count > 0;
+			res->total_hits += total_count;
+		}
+
+		spam_prod = 1.0;
+		ham_prod = 1.0;
+
+		for (j = 0; j < n; j ++) {
+			spam_prod *= bayes_spam_prob[j];
+			ham_prod *= bayes_ham_prob[j];
+		}
+
+		res->spam_prob += log (spam_prod);
+		res->ham_prob += log (ham_prod);
+	}
+}
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Sum all positive values for each token over statfiles of each class
  */
 static void
-bayes_classify_token (struct rspamd_classifier *ctx,
-		rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_collect_counts (struct rspamd_classifier *ctx,
+		struct rspamd_stat_tokens *tokens,
+		gdouble *spam_counts, gdouble *ham_counts)
 {
-	guint i;
+	guint i, j;
 	gint id;
-	guint64 spam_count = 0, ham_count = 0, total_count = 0;
 	struct rspamd_statfile *st;
-	struct rspamd_task *task;
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub, val;
+	const gdouble *values;
+	gdouble *counts;
 
-	task = cl->task;
+	memset (spam_counts, 0, sizeof (*spam_counts) * tokens->len);
+	memset (ham_counts, 0, sizeof (*ham_counts) * tokens->len);
 
 	for (i = 0; i < ctx->statfiles_ids->len; i++) {
 		id = g_array_index (ctx->statfiles_ids, gint, i);
 		st = g_ptr_array_index (ctx->ctx->statfiles, id);
 		g_assert (st != NULL);
-		val = tok->values[id];
+		values = tokens->values[id];
+		counts = st->stcf->is_spam ? spam_counts : ham_counts;
 
-		if (val > 0) {
-			if (st->stcf->is_spam) {
-				spam_count += val;
-			}
-			else {
-				ham_count += val;
-			}
-
-			total_count += val;
-			cl->total_hits += val;
+		for (j = 0; j < tokens->len; j ++) {
+			counts[j] += values[j] > 0 ? values[j] : 0;
 		}
 	}
-
-	/* Probability for this token */
-	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-		fw = feature_weight[tok->window_idx % G_N_ELEMENTS (feature_weight)];
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
-		cl->spam_prob += log (bayes_spam_prob);
-		cl->ham_prob += log (bayes_ham_prob);
-		cl->processed_tokens ++;
-
-		msg_debug_bayes ("token: weight: %f, total_count: %L, "
-				"spam_count: %L, ham_count: %L,"
-				"spam_prob: %.3f, ham_prob: %.3f, "
-				"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-				"current spam prob: %.3f, current ham prob: %.3f",
-				fw, total_count, spam_count, ham_count,
-				spam_prob, ham_prob,
-				bayes_spam_prob, bayes_ham_prob,
-				cl->spam_prob, cl->ham_prob);
-	}
 }
 
 /*
@@ -193,14 +209,13 @@ bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
 
 gboolean
 bayes_classify (struct rspamd_classifier * ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task)
 {
-	double final_prob, h, s, *pprob;
+	double final_prob, h, s, *pprob, *spam_counts, *ham_counts;
 	char *sumbuf;
 	struct rspamd_statfile *st = NULL;
-	struct bayes_task_closure cl;
-	rspamd_token_t *tok;
+	struct bayes_tokens_score cl;
 	guint i;
 	gint id;
 	GList *cur;
@@ -209,7 +224,6 @@ bayes_classify (struct rspamd_classifier * ctx,
 	g_assert (tokens != NULL);
 
 	memset (&cl, 0, sizeof (cl));
-	cl.task = task;
 
 	/* Check min learns */
 	if (ctx->cfg->min_learns > 0) {
@@ -229,11 +243,13 @@ bayes_classify (struct rspamd_classifier * ctx,
 		}
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		bayes_classify_token (ctx, tok, &cl);
-	}
+	spam_counts = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*spam_counts) * tokens->len);
+	ham_counts = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*ham_counts) * tokens->len);
+	bayes_collect_counts (ctx, tokens, spam_counts, ham_counts);
+	bayes_score_tokens (spam_counts, ham_counts, tokens->window_idx,
+			tokens->len, ctx->spam_learns, ctx->ham_learns, &cl);
 
 	h = 1 - inv_chi_square (task, cl.spam_prob, cl.processed_tokens);
 	s = 1 - inv_chi_square (task, cl.ham_prob, cl.processed_tokens);
@@ -318,7 +334,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 
 gboolean
 bayes_learn_spam (struct rspamd_classifier * ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
@@ -327,7 +343,7 @@ bayes_learn_spam (struct rspamd_classifier * ctx,
 	guint i, j;
 	gint id;
 	struct rspamd_statfile *st;
-	rspamd_token_t *tok;
+	gdouble *values;
 	gboolean incrementing;
 
 	g_assert (ctx != NULL);
@@ -335,33 +351,32 @@ bayes_learn_spam (struct rspamd_classifier * ctx,
 
 	incrementing = ctx->cfg->flags & RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		for (j = 0; j < ctx->statfiles_ids->len; j++) {
-			id = g_array_index (ctx->statfiles_ids, gint, j);
-			st = g_ptr_array_index (ctx->ctx->statfiles, id);
-			g_assert (st != NULL);
+	for (j = 0; j < ctx->statfiles_ids->len; j++) {
+		id = g_array_index (ctx->statfiles_ids, gint, j);
+		st = g_ptr_array_index (ctx->ctx->statfiles, id);
+		g_assert (st != NULL);
+		values = tokens->values[id];
 
+		for (i = 0; i < tokens->len; i++) {
 			if (!!st->stcf->is_spam == !!is_spam) {
 				if (incrementing) {
-					tok->values[id] = 1;
+					values[i] = 1;
 				}
 				else {
-					tok->values[id]++;
+					values[i]++;
 				}
 			}
-			else if (tok->values[id] > 0 && unlearn) {
+			else if (values[i] > 0 && unlearn) {
 				/* Unlearning */
 				if (incrementing) {
-					tok->values[id] = -1;
+					values[i] = -1;
 				}
 				else {
-					tok->values[id]--;
+					values[i]--;
 				}
 			}
 			else if (incrementing) {
-				tok->values[id] = 0;
+				values[i] = 0;
 			}
 		}
 	}
@@ -12,17 +12,17 @@ struct rspamd_classifier_config;
 struct rspamd_task;
 struct rspamd_classifier;
 
-struct token_node_s;
+struct rspamd_stat_tokens;
 
 struct rspamd_stat_classifier {
 	char *name;
 	void (*init_func)(rspamd_mempool_t *pool,
 			struct rspamd_classifier *cl);
 	gboolean (*classify_func)(struct rspamd_classifier * ctx,
-			GPtrArray *tokens,
+			struct rspamd_stat_tokens *tokens,
 			struct rspamd_task *task);
 	gboolean (*learn_spam_func)(struct rspamd_classifier * ctx,
-			GPtrArray *input,
+			struct rspamd_stat_tokens *input,
 			struct rspamd_task *task,
 			gboolean is_spam,
 			gboolean unlearn,
@@ -33,15 +33,31 @@ struct rspamd_stat_classifier {
 void bayes_init (rspamd_mempool_t *pool,
 		struct rspamd_classifier *);
 gboolean bayes_classify (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task);
 gboolean bayes_learn_spam (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
 		GError **err);
 
+/* Log domain probabilities accumulated over tokens */
+struct bayes_tokens_score {
+	gdouble spam_prob;
+	gdouble ham_prob;
+	guint64 processed_tokens;
+	guint64 total_hits;
+};
+
+/*
+ * Add scores of `len` tokens with the specified spam and ham counts to `res`
+ */
+void bayes_score_tokens (const gdouble *spam_counts, const gdouble *ham_counts,
+		const guint *window_idx, guint len,
+		guint64 spam_learns, guint64 ham_learns,
+		struct bayes_tokens_score *res);
+
 #endif
 /*
  * vi:ts=4
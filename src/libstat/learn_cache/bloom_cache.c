@@ -0,0 +1,261 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "learn_cache.h"
+#include "rspamd.h"
+#include "bloom.h"
+#include "unix-std.h"
+
+#define BLOOM_CACHE_DEFAULT_SIZE 100000
+#define BLOOM_CACHE_DEFAULT_INTERVAL 600.0
+/* Gives about 0.1% of false positives with blocked bloom filter */
+#define BLOOM_CACHE_BITS_PER_ELT 16
+
+struct rspamd_stat_cache_bloom {
+	rspamd_bloom_blocked_t *cur;
+	rspamd_bloom_blocked_t *next;
+	const gchar *path;
+	guint64 size;
+	guint64 nelts;
+	guint64 capacity;
+	guint64 next_nelts;
+	guint64 next_capacity;
+	gdouble interval;
+	gdouble last_rebuild;
+	gboolean periodic;
+	gboolean valid;
+};
+
+struct rspamd_stat_cache_bloom *
+rspamd_stat_cache_bloom_new (const ucl_object_t *cf, gboolean periodic)
+{
+	struct rspamd_stat_cache_bloom *bloom;
+	const ucl_object_t *elt;
+
+	if (cf == NULL || ucl_object_type (cf) != UCL_OBJECT) {
+		return NULL;
+	}
+
+	elt = ucl_object_lookup (cf, "bloom");
+
+	if (elt == NULL || !ucl_object_toboolean (elt)) {
+		return NULL;
+	}
+
+	bloom = g_slice_alloc0 (sizeof (*bloom));
+	bloom->size = BLOOM_CACHE_DEFAULT_SIZE;
+	bloom->interval = BLOOM_CACHE_DEFAULT_INTERVAL;
+	bloom->periodic = periodic;
+
+	elt = ucl_object_lookup (cf, "bloom_size");
+
+	if (elt != NULL && ucl_object_toint (elt) > 0) {
+		bloom->size = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (cf, "bloom_rebuild");
+
+	if (elt != NULL && ucl_object_todouble (elt) > 0) {
+		bloom->interval = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (cf, "bloom_file");
+
+	if (elt != NULL && ucl_object_type (elt) == UCL_STRING) {
+		bloom->path = ucl_object_tostring (elt);
+	}
+
+	return bloom;
+}
+
+gboolean
+rspamd_stat_cache_bloom_check (struct rspamd_stat_cache_bloom *bloom,
+		const void *id, gsize len)
+{
+	if (bloom == NULL || !bloom->valid || bloom->cur == NULL) {
+		return TRUE;
+	}
+
+	return rspamd_bloom_blocked_check (bloom->cur, id, len);
+}
+
+void
+rspamd_stat_cache_bloom_add (struct rspamd_stat_cache_bloom *bloom,
+		const void *id, gsize len)
+{
+	if (bloom == NULL) {
+		return;
+	}
+
+	if (bloom->cur) {
+		rspamd_bloom_blocked_add (bloom->cur, id, len);
+		bloom->nelts ++;
+	}
+
+	/* Backing store might be already read past this id */
+	if (bloom->next) {
+		rspamd_stat_cache_bloom_rebuild_add (bloom, id, len);
+	}
+}
+
+void
+rspamd_stat_cache_bloom_invalidate (struct rspamd_stat_cache_bloom *bloom)
+{
+	if (bloom != NULL) {
+		bloom->valid = FALSE;
+	}
+}
+
+gboolean
+rspamd_stat_cache_bloom_need_rebuild (struct rspamd_stat_cache_bloom *bloom,
+		gdouble now)
+{
+	if (bloom == NULL || bloom->next != NULL) {
+		return FALSE;
+	}
+
+	if (now - bloom->last_rebuild < bloom->interval) {
+		return FALSE;
+	}
+
+	return bloom->periodic || !bloom->valid || bloom->nelts > bloom->capacity;
+}
+
+void
+rspamd_stat_cache_bloom_rebuild_start (struct rspamd_stat_cache_bloom *bloom,
+		guint64 nelts)
+{
+	g_assert (bloom != NULL);
+
+	if (bloom->next) {
+		rspamd_bloom_blocked_destroy (bloom->next);
+	}
+
+	/* Leave some space for the messages learned after rebuild */
+	bloom->next_capacity = MAX (bloom->size, nelts * 2);
+	bloom->next_nelts = 0;
+	bloom->next = rspamd_bloom_blocked_create (bloom->next_capacity,
+			BLOOM_CACHE_BITS_PER_ELT, RSPAMD_BLOOM_BLOCKED_DEFAULT);
+}
+
+void
+rspamd_stat_cache_bloom_rebuild_add (struct rspamd_stat_cache_bloom *bloom,
+		const void *id, gsize len)
+{
+	g_assert (bloom != NULL && bloom->next != NULL);
+
+	rspamd_bloom_blocked_add (bloom->next, id, len);
+	bloom->next_nelts ++;
+}
+
+void
+rspamd_stat_cache_bloom_rebuild_finish (struct rspamd_stat_cache_bloom *bloom,
+		gboolean success, gdouble now)
+{
+	GError *err = NULL;
+
+	g_assert (bloom != NULL);
+
+	/* Failed rebuilds are also rate limited */
+	bloom->last_rebuild = now;
+
+	if (bloom->next == NULL) {
+		return;
+	}
+
+	if (!success) {
+		rspamd_bloom_blocked_destroy (bloom->next);
+		bloom->next = NULL;
+
+		return;
+	}
+
+	if (bloom->cur) {
+		rspamd_bloom_blocked_destroy (bloom->cur);
+	}
+
+	bloom->cur = bloom->next;
+	bloom->nelts = bloom->next_nelts;
+	bloom->capacity = bloom->next_capacity;
+	bloom->next = NULL;
+	bloom->valid = TRUE;
+
+	msg_info ("rebuilt learn cache bloom filter: %L elements",
+			(gint64)bloom->nelts);
+
+	if (bloom->path) {
+		if (!rspamd_bloom_blocked_save (bloom->cur, bloom->path, &err)) {
+			msg_warn ("cannot save learn cache bloom filter: %e", err);
+			g_error_free (err);
+		}
+	}
+}
+
+gboolean
+rspamd_stat_cache_bloom_load (struct rspamd_stat_cache_bloom *bloom,
+		gdouble mtime)
+{
+	rspamd_bloom_blocked_t *loaded;
+	struct stat st;
+	GError *err = NULL;
+
+	if (bloom == NULL || bloom->path == NULL) {
+		return FALSE;
+	}
+
+	if (stat (bloom->path, &st) == -1 || st.st_mtime < mtime) {
+		/* Absent or older than the backing store */
+		return FALSE;
+	}
+
+	loaded = rspamd_bloom_blocked_load (bloom->path, &err);
+
+	if (loaded == NULL) {
+		msg_warn ("cannot load learn cache bloom filter: %e", err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	if (bloom->cur) {
+		rspamd_bloom_blocked_destroy (bloom->cur);
+	}
+
+	bloom->cur = loaded;
+	/* Number of elements is not persisted, so it is estimated from size */
+	bloom->capacity = rspamd_bloom_blocked_capacity (loaded,
+			BLOOM_CACHE_BITS_PER_ELT);
+	bloom->nelts = 0;
+	bloom->last_rebuild = st.st_mtime;
+	bloom->valid = TRUE;
+
+	return TRUE;
+}
+
+void
+rspamd_stat_cache_bloom_destroy (struct rspamd_stat_cache_bloom *bloom)
+{
+	if (bloom) {
+		if (bloom->cur) {
+			rspamd_bloom_blocked_destroy (bloom->cur);
+		}
+		if (bloom->next) {
+			rspamd_bloom_blocked_destroy (bloom->next);
+		}
+
+		g_slice_free1 (sizeof (*bloom), bloom);
+	}
+}
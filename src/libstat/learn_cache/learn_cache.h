@@ -59,6 +59,74 @@ struct rspamd_stat_cache {
 				gpointer runtime); \
 		void rspamd_stat_cache_##name##_close (gpointer ctx)
 
+/*
+ * Bloom filter in front of a learn cache: if the filter does not contain
+ * message id, then the message has definitely not been learned and the
+ * cache itself is not queried. The filter is periodically rebuilt from the
+ * backing store into a new generation that replaces the current one
+ */
+struct rspamd_stat_cache_bloom;
+
+/*
+ * Create bloom front if it is enabled in cache configuration `cf`
+ * (`bloom = true`), returns NULL otherwise. If `periodic` is FALSE, then
+ * filter is rebuilt only when it is invalidated or overfilled
+ */
+struct rspamd_stat_cache_bloom * rspamd_stat_cache_bloom_new (
+		const ucl_object_t *cf, gboolean periodic);
+
+/*
+ * Returns TRUE if the message id might be in cache, so the slow check is
+ * needed. Invalid (stale or not yet built) filter always returns TRUE
+ */
+gboolean rspamd_stat_cache_bloom_check (struct rspamd_stat_cache_bloom *bloom,
+		const void *id, gsize len);
+
+/*
+ * Register the newly learned message id
+ */
+void rspamd_stat_cache_bloom_add (struct rspamd_stat_cache_bloom *bloom,
+		const void *id, gsize len);
+
+/*
+ * Mark filter as stale, e.g. when backing store is modified by others
+ */
+void rspamd_stat_cache_bloom_invalidate (struct rspamd_stat_cache_bloom *bloom);
+
+/*
+ * Returns TRUE if a new generation should be built from the backing store,
+ * rebuilds are performed not more often than `bloom_rebuild` interval
+ */
+gboolean rspamd_stat_cache_bloom_need_rebuild (
+		struct rspamd_stat_cache_bloom *bloom, gdouble now);
+
+/*
+ * Start building new generation sized for `nelts` elements (or for the
+ * configured size if `nelts` is zero)
+ */
+void rspamd_stat_cache_bloom_rebuild_start (
+		struct rspamd_stat_cache_bloom *bloom, guint64 nelts);
+
+/*
+ * Add an id read from the backing store to the new generation
+ */
+void rspamd_stat_cache_bloom_rebuild_add (struct rspamd_stat_cache_bloom *bloom,
+		const void *id, gsize len);
+
+/*
+ * Replace the current generation with the new one (`success`) or drop it
+ */
+void rspamd_stat_cache_bloom_rebuild_finish (
+		struct rspamd_stat_cache_bloom *bloom, gboolean success, gdouble now);
+
+/*
+ * Try to load the last persisted generation if it is newer than `mtime`
+ */
+gboolean rspamd_stat_cache_bloom_load (struct rspamd_stat_cache_bloom *bloom,
+		gdouble mtime);
+
+void rspamd_stat_cache_bloom_destroy (struct rspamd_stat_cache_bloom *bloom);
+
 RSPAMD_STAT_CACHE_DEF(sqlite3);
 #ifdef WITH_HIREDIS
 RSPAMD_STAT_CACHE_DEF(redis);
@@ -20,13 +20,16 @@
 #include "stat_internal.h"
 #include "cryptobox.h"
 #include "ucl.h"
+#include "redis_pool.h"
 #include "hiredis.h"
-#include "adapters/libevent.h"
 
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
 #define REDIS_DEFAULT_PORT 6379
 #define DEFAULT_REDIS_KEY "learned_ids"
+#define REDIS_SCAN_COUNT 1000
+
+struct rspamd_redis_cache_scan;
 
 struct rspamd_redis_cache_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -36,6 +39,17 @@ struct rspamd_redis_cache_ctx {
 	const gchar *dbname;
 	const gchar *redis_object;
 	gdouble timeout;
+	struct rspamd_stat_cache_bloom *bloom;
+	struct rspamd_redis_cache_scan *scan;
+};
+
+/* Rebuild of bloom filter from the learned ids hash */
+struct rspamd_redis_cache_scan {
+	struct rspamd_redis_cache_ctx *ctx;
+	struct rspamd_redis_pool *pool;
+	struct upstream *selected;
+	struct event timeout_event;
+	redisAsyncContext *redis;
 };
 
 struct rspamd_redis_cache_runtime {
@@ -52,26 +66,22 @@ rspamd_stat_cache_redis_quark (void)
 	return g_quark_from_static_string ("redis-statistics");
 }
 
-static void
-rspamd_redis_cache_maybe_auth (struct rspamd_redis_cache_ctx *ctx,
-		redisAsyncContext *redis)
-{
-	if (ctx->password) {
-		redisAsyncCommand (redis, NULL, NULL, "AUTH %s", ctx->password);
-	}
-	if (ctx->dbname) {
-		redisAsyncCommand (redis, NULL, NULL, "SELECT %s", ctx->dbname);
-	}
-}
-
 /* Called on connection termination */
 static void
 rspamd_redis_cache_fin (gpointer data)
 {
 	struct rspamd_redis_cache_runtime *rt = data;
+	redisAsyncContext *redis;
 
 	event_del (&rt->timeout_event);
-	redisAsyncFree (rt->redis);
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		/* Connection with the pending request is not reused */
+		rspamd_redis_pool_release_connection (rt->task->cfg->redis_pool,
+				redis, FALSE);
+	}
 }
 
 static void
@@ -99,7 +109,12 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	task = rt->task;
 
-	if (c->err == 0) {
+	if (rt->redis == NULL) {
+		/* Connection has been closed */
+		return;
+	}
+
+	if (c->err == 0 && reply != NULL) {
 		if (G_LIKELY (reply->type == REDIS_REPLY_INTEGER)) {
 			val = reply->integer;
 		}
@@ -146,7 +161,12 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	task = rt->task;
 
-	if (c->err == 0) {
+	if (rt->redis == NULL) {
+		/* Connection has been closed */
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
 		/* XXX: we ignore results here */
 		rspamd_upstream_ok (rt->selected);
 	}
@@ -157,12 +177,193 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 	rspamd_session_remove_event (task->s, rspamd_redis_cache_fin, rt);
 }
 
+static void
+rspamd_redis_cache_scan_fin (struct rspamd_redis_cache_scan *scan,
+		gboolean success)
+{
+	redisAsyncContext *redis;
+
+	event_del (&scan->timeout_event);
+
+	if (scan->redis) {
+		redis = scan->redis;
+		scan->redis = NULL;
+		rspamd_redis_pool_release_connection (scan->pool, redis, !success);
+	}
+
+	if (success) {
+		rspamd_upstream_ok (scan->selected);
+	}
+	else {
+		rspamd_upstream_fail (scan->selected);
+	}
+
+	rspamd_stat_cache_bloom_rebuild_finish (scan->ctx->bloom, success,
+			rspamd_get_calendar_ticks ());
+	scan->ctx->scan = NULL;
+	g_slice_free1 (sizeof (*scan), scan);
+}
+
+static void
+rspamd_redis_cache_scan_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_cache_scan *scan = d;
+
+	msg_err ("cannot rebuild learn cache bloom filter: "
+			"connection to redis server %s timed out",
+			rspamd_upstream_name (scan->selected));
+	rspamd_redis_cache_scan_fin (scan, FALSE);
+}
+
+static gboolean
+rspamd_redis_cache_scan_next (struct rspamd_redis_cache_scan *scan,
+		const gchar *cursor);
+
+/* Called on each portion of the learned ids */
+static void
+rspamd_redis_cache_scan_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cache_scan *scan = priv;
+	redisReply *reply = r, *elts;
+	guint i;
+
+	if (scan->redis == NULL) {
+		/* Connection has been closed */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2 ||
+			reply->element[0]->type != REDIS_REPLY_STRING ||
+			reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		msg_err ("cannot rebuild learn cache bloom filter: bad reply");
+		rspamd_redis_cache_scan_fin (scan, FALSE);
+
+		return;
+	}
+
+	elts = reply->element[1];
+
+	/* Fields and values are interleaved */
+	for (i = 0; i + 1 < elts->elements; i += 2) {
+		if (elts->element[i]->type == REDIS_REPLY_STRING) {
+			rspamd_stat_cache_bloom_rebuild_add (scan->ctx->bloom,
+					elts->element[i]->str, elts->element[i]->len);
+		}
+	}
+
+	if (strcmp (reply->element[0]->str, "0") == 0) {
+		rspamd_redis_cache_scan_fin (scan, TRUE);
+	}
+	else if (!rspamd_redis_cache_scan_next (scan, reply->element[0]->str)) {
+		rspamd_redis_cache_scan_fin (scan, FALSE);
+	}
+}
+
+/* Called when we know the number of learned ids */
+static void
+rspamd_redis_cache_scan_len_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cache_scan *scan = priv;
+	redisReply *reply = r;
+
+	if (scan->redis == NULL) {
+		/* Connection has been closed */
+		return;
+	}
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+		msg_err ("cannot rebuild learn cache bloom filter: bad reply");
+		rspamd_redis_cache_scan_fin (scan, FALSE);
+
+		return;
+	}
+
+	rspamd_stat_cache_bloom_rebuild_start (scan->ctx->bloom, reply->integer);
+
+	if (!rspamd_redis_cache_scan_next (scan, "0")) {
+		rspamd_redis_cache_scan_fin (scan, FALSE);
+	}
+}
+
+static gboolean
+rspamd_redis_cache_scan_next (struct rspamd_redis_cache_scan *scan,
+		const gchar *cursor)
+{
+	struct timeval tv;
+
+	if (redisAsyncCommand (scan->redis, rspamd_redis_cache_scan_cb, scan,
+			"HSCAN %s %s COUNT %d",
+			scan->ctx->redis_object, cursor, REDIS_SCAN_COUNT) != REDIS_OK) {
+		return FALSE;
+	}
+
+	event_del (&scan->timeout_event);
+	double_to_tv (REDIS_STAT_TIMEOUT, &tv);
+	event_add (&scan->timeout_event, &tv);
+
+	return TRUE;
+}
+
+/*
+ * Learned ids are written by all scanners of the cluster, so bloom filter is
+ * rebuilt from redis in background each `bloom_rebuild` interval
+ */
+static void
+rspamd_redis_cache_scan_start (struct rspamd_redis_cache_ctx *ctx,
+		struct rspamd_task *task)
+{
+	struct rspamd_redis_cache_scan *scan;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+
+	up = rspamd_upstream_get (ctx->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	if (up == NULL) {
+		rspamd_stat_cache_bloom_rebuild_finish (ctx->bloom, FALSE,
+				rspamd_get_calendar_ticks ());
+		return;
+	}
+
+	scan = g_slice_alloc0 (sizeof (*scan));
+	scan->ctx = ctx;
+	scan->pool = task->cfg->redis_pool;
+	scan->selected = up;
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+	scan->redis = rspamd_redis_pool_connect (scan->pool,
+			task->ev_base, ctx->dbname, ctx->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+	event_set (&scan->timeout_event, -1, EV_TIMEOUT,
+			rspamd_redis_cache_scan_timeout, scan);
+	event_base_set (task->ev_base, &scan->timeout_event);
+	ctx->scan = scan;
+
+	if (scan->redis == NULL ||
+			redisAsyncCommand (scan->redis, rspamd_redis_cache_scan_len_cb,
+					scan, "HLEN %s", ctx->redis_object) != REDIS_OK) {
+		msg_err_task ("cannot rebuild learn cache bloom filter: "
+				"cannot connect to redis server %s",
+				rspamd_upstream_name (up));
+		rspamd_redis_cache_scan_fin (scan, FALSE);
+
+		return;
+	}
+
+	double_to_tv (REDIS_STAT_TIMEOUT, &tv);
+	event_add (&scan->timeout_event, &tv);
+}
+
 static void
 rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 {
 	rspamd_cryptobox_hash_state_t st;
-	rspamd_token_t *tok;
-	guint i;
 	guchar out[rspamd_cryptobox_HASHBYTES];
 	gchar *b32out;
 	gchar *user = NULL;
@@ -175,10 +376,9 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 		rspamd_cryptobox_hash_update (&st, user, strlen (user));
 	}
 
-	for (i = 0; i < task->tokens->len; i ++) {
-		tok = g_ptr_array_index (task->tokens, i);
-		rspamd_cryptobox_hash_update (&st, tok->data, tok->datalen);
-	}
+	/* All tokens hashes are hashed as a single contiguous block */
+	rspamd_cryptobox_hash_update (&st, (const guchar *)task->tokens->hashes,
+			task->tokens->len * sizeof (task->tokens->hashes[0]));
 
 	rspamd_cryptobox_hash_final (&st, out);
 
@@ -307,6 +507,11 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 	}
 
 	cache_ctx->stcf = stf;
+	cache_ctx->bloom = rspamd_stat_cache_bloom_new (cf, TRUE);
+
+	if (cache_ctx->bloom) {
+		rspamd_stat_cache_bloom_load (cache_ctx->bloom, 0);
+	}
 
 	return (gpointer)cache_ctx;
 }
@@ -319,6 +524,7 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	struct rspamd_redis_cache_runtime *rt;
 	struct upstream *up;
 	rspamd_inet_addr_t *addr;
+	gchar *h;
 
 	g_assert (ctx != NULL);
 
@@ -332,6 +538,24 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
+	if (!learn) {
+		rspamd_stat_cache_redis_generate_id (task);
+
+		if (ctx->bloom) {
+			if (ctx->scan == NULL && rspamd_stat_cache_bloom_need_rebuild (
+					ctx->bloom, rspamd_get_calendar_ticks ())) {
+				rspamd_redis_cache_scan_start (ctx, task);
+			}
+
+			h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+
+			if (!rspamd_stat_cache_bloom_check (ctx->bloom, h, strlen (h))) {
+				/* Definitely not learned, so there is nothing to check */
+				return NULL;
+			}
+		}
+	}
+
 	if (learn) {
 		up = rspamd_upstream_get (ctx->write_servers,
 				RSPAMD_UPSTREAM_MASTER_SLAVE,
@@ -357,20 +581,22 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+	rt->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			task->ev_base, ctx->dbname, ctx->password,
+			rspamd_inet_address_to_string (addr),
 			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
 
-	redisLibeventAttach (rt->redis, task->ev_base);
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect to redis server %s",
+				rspamd_upstream_name (up));
+		rspamd_upstream_fail (up);
+
+		return NULL;
+	}
 
 	/* Now check stats */
 	event_set (&rt->timeout_event, -1, EV_TIMEOUT, rspamd_redis_cache_timeout, rt);
 	event_base_set (task->ev_base, &rt->timeout_event);
-	rspamd_redis_cache_maybe_auth (ctx, rt->redis);
-
-	if (!learn) {
-		rspamd_stat_cache_redis_generate_id (task);
-	}
 
 	return rt;
 }
@@ -384,6 +610,11 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 	struct timeval tv;
 	gchar *h;
 
+	if (rt == NULL) {
+		/* No connection */
+		return RSPAMD_LEARN_OK;
+	}
+
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 
 	if (h == NULL) {
@@ -414,6 +645,10 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	gchar *h;
 	gint flag;
 
+	if (rt == NULL) {
+		return RSPAMD_LEARN_OK;
+	}
+
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 	g_assert (h != NULL);
 
@@ -426,6 +661,7 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 		rspamd_session_add_event (task->s, rspamd_redis_cache_fin, rt,
 				rspamd_stat_cache_redis_quark ());
 		event_add (&rt->timeout_event, &tv);
+		rspamd_stat_cache_bloom_add (rt->ctx->bloom, h, strlen (h));
 	}
 
 	/* We need to return OK every time */
@@ -435,5 +671,16 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 void
 rspamd_stat_cache_redis_close (gpointer c)
 {
+	struct rspamd_redis_cache_ctx *ctx = c;
+
+	if (ctx == NULL) {
+		return;
+	}
+
+	if (ctx->scan) {
+		rspamd_redis_cache_scan_fin (ctx->scan, FALSE);
+	}
 
+	rspamd_stat_cache_bloom_destroy (ctx->bloom);
+	ctx->bloom = NULL;
 }
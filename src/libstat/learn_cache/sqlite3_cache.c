@@ -23,6 +23,7 @@
 #include "fstring.h"
 #include "message.h"
 #include "libutil/sqlite_utils.h"
+#include "unix-std.h"
 
 static const char *create_tables_sql =
 		""
@@ -109,8 +110,136 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_CACHE_MAX] =
 struct rspamd_stat_sqlite3_ctx {
 	sqlite3 *db;
 	GArray *prstmt;
+	struct rspamd_stat_cache_bloom *bloom;
+	sqlite3_stmt *version_stmt;
+	gint64 data_version;
 };
 
+static void
+rspamd_stat_cache_sqlite3_rebuild_bloom (struct rspamd_stat_sqlite3_ctx *ctx)
+{
+	sqlite3_stmt *stmt;
+	gint64 count = 0;
+	gint rc;
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT count(*) FROM learns;", -1,
+			&stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step (stmt) == SQLITE_ROW) {
+			count = sqlite3_column_int64 (stmt, 0);
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT digest FROM learns;", -1,
+			&stmt, NULL) != SQLITE_OK) {
+		msg_err ("cannot rebuild learn cache bloom filter: %s",
+				sqlite3_errmsg (ctx->db));
+		rspamd_stat_cache_bloom_rebuild_finish (ctx->bloom, FALSE,
+				rspamd_get_calendar_ticks ());
+
+		return;
+	}
+
+	rspamd_stat_cache_bloom_rebuild_start (ctx->bloom, count);
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		rspamd_stat_cache_bloom_rebuild_add (ctx->bloom,
+				sqlite3_column_blob (stmt, 0),
+				sqlite3_column_bytes (stmt, 0));
+	}
+
+	if (rc != SQLITE_DONE) {
+		msg_err ("cannot rebuild learn cache bloom filter: %s",
+				sqlite3_errmsg (ctx->db));
+	}
+
+	sqlite3_finalize (stmt);
+	rspamd_stat_cache_bloom_rebuild_finish (ctx->bloom, rc == SQLITE_DONE,
+			rspamd_get_calendar_ticks ());
+}
+
+/*
+ * Bloom filter knows only about our own learns, so it is invalidated when
+ * another process commits to the database
+ */
+static void
+rspamd_stat_cache_sqlite3_check_version (struct rspamd_stat_sqlite3_ctx *ctx)
+{
+	gint64 version;
+
+	sqlite3_reset (ctx->version_stmt);
+
+	if (sqlite3_step (ctx->version_stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int64 (ctx->version_stmt, 0);
+
+		if (version != ctx->data_version) {
+			ctx->data_version = version;
+			rspamd_stat_cache_bloom_invalidate (ctx->bloom);
+		}
+	}
+	else {
+		rspamd_stat_cache_bloom_invalidate (ctx->bloom);
+	}
+
+	sqlite3_reset (ctx->version_stmt);
+}
+
+static void
+rspamd_stat_cache_sqlite3_check_bloom (struct rspamd_stat_sqlite3_ctx *ctx)
+{
+	rspamd_stat_cache_sqlite3_check_version (ctx);
+
+	if (rspamd_stat_cache_bloom_need_rebuild (ctx->bloom,
+			rspamd_get_calendar_ticks ())) {
+		rspamd_stat_cache_sqlite3_rebuild_bloom (ctx);
+	}
+}
+
+static void
+rspamd_stat_cache_sqlite3_init_bloom (struct rspamd_stat_sqlite3_ctx *ctx,
+		const gchar *dbpath, const ucl_object_t *cf)
+{
+	gchar walpath[PATH_MAX];
+	struct stat st;
+	gdouble mtime = 0;
+
+	ctx->bloom = rspamd_stat_cache_bloom_new (cf, FALSE);
+
+	if (ctx->bloom == NULL) {
+		return;
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "PRAGMA data_version;", -1,
+			&ctx->version_stmt, NULL) != SQLITE_OK) {
+		msg_warn ("cannot use bloom filter for learn cache: %s",
+				sqlite3_errmsg (ctx->db));
+		ctx->version_stmt = NULL;
+		rspamd_stat_cache_bloom_destroy (ctx->bloom);
+		ctx->bloom = NULL;
+
+		return;
+	}
+
+	ctx->data_version = -1;
+	rspamd_stat_cache_sqlite3_check_version (ctx);
+
+	/* Persisted filter is usable if the database has not been modified since */
+	if (stat (dbpath, &st) != -1) {
+		mtime = st.st_mtime;
+	}
+
+	rspamd_snprintf (walpath, sizeof (walpath), "%s-wal", dbpath);
+
+	if (stat (walpath, &st) != -1) {
+		mtime = MAX (mtime, st.st_mtime);
+	}
+
+	if (!rspamd_stat_cache_bloom_load (ctx->bloom, mtime)) {
+		rspamd_stat_cache_sqlite3_rebuild_bloom (ctx);
+	}
+}
+
 gpointer
 rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg,
@@ -135,7 +264,7 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 	rspamd_snprintf (dbpath, sizeof (dbpath), "%s", path);
 
 	sqlite = rspamd_sqlite3_open_or_create (cfg->cfg_pool,
-			dbpath, create_tables_sql, &err);
+			dbpath, create_tables_sql, NULL, &err);
 
 	if (sqlite == NULL) {
 		msg_err ("cannot open sqlite3 cache: %e", err);
@@ -143,7 +272,7 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 		err = NULL;
 	}
 	else {
-		new = g_slice_alloc (sizeof (*new));
+		new = g_slice_alloc0 (sizeof (*new));
 		new->db = sqlite;
 		new->prstmt = rspamd_sqlite3_init_prstmt (sqlite, prepared_stmts,
 				RSPAMD_STAT_CACHE_MAX, &err);
@@ -156,6 +285,9 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 			g_slice_free1 (sizeof (*new), new);
 			new = NULL;
 		}
+		else {
+			rspamd_stat_cache_sqlite3_init_bloom (new, dbpath, cf);
+		}
 	}
 
 	return new;
@@ -176,10 +308,8 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 {
 	struct rspamd_stat_sqlite3_ctx *ctx = runtime;
 	rspamd_cryptobox_hash_state_t st;
-	rspamd_token_t *tok;
 	guchar *out;
 	gchar *user = NULL;
-	guint i;
 	gint rc;
 	gint64 flag;
 
@@ -198,13 +328,25 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 			rspamd_cryptobox_hash_update (&st, user, strlen (user));
 		}
 
-		for (i = 0; i < task->tokens->len; i ++) {
-			tok = g_ptr_array_index (task->tokens, i);
-			rspamd_cryptobox_hash_update (&st, tok->data, tok->datalen);
-		}
+		/* All tokens hashes are hashed as a single contiguous block */
+		rspamd_cryptobox_hash_update (&st, (const guchar *)task->tokens->hashes,
+				task->tokens->len * sizeof (task->tokens->hashes[0]));
 
 		rspamd_cryptobox_hash_final (&st, out);
 
+		if (ctx->bloom) {
+			rspamd_stat_cache_sqlite3_check_bloom (ctx);
+
+			if (!rspamd_stat_cache_bloom_check (ctx->bloom, out,
+					rspamd_cryptobox_HASHBYTES)) {
+				/* Definitely not learned */
+				rspamd_mempool_set_variable (task->task_pool, "words_hash",
+						out, NULL);
+
+				return RSPAMD_LEARN_OK;
+			}
+		}
+
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_DEF);
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -259,6 +401,7 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 				(gint64)rspamd_cryptobox_HASHBYTES, h, flag);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
+		rspamd_stat_cache_bloom_add (ctx->bloom, h, rspamd_cryptobox_HASHBYTES);
 	}
 	else {
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -282,6 +425,11 @@ rspamd_stat_cache_sqlite3_close (gpointer c)
 	struct rspamd_stat_sqlite3_ctx *ctx = (struct rspamd_stat_sqlite3_ctx *)c;
 
 	if (ctx != NULL) {
+		if (ctx->version_stmt) {
+			sqlite3_finalize (ctx->version_stmt);
+		}
+
+		rspamd_stat_cache_bloom_destroy (ctx->bloom);
 		rspamd_sqlite3_close_prstmt (ctx->db, ctx->prstmt);
 		sqlite3_close (ctx->db);
 		g_slice_free1 (sizeof (*ctx), ctx);
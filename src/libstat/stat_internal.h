@@ -51,13 +51,19 @@ struct rspamd_statfile {
 	gpointer bkcf;
 };
 
-#define RSPAMD_MAX_TOKEN_LEN 8
-typedef struct token_node_s {
-	guchar data[RSPAMD_MAX_TOKEN_LEN];
-	guint window_idx;
-	guint datalen;
-	gdouble values[];
-} rspamd_token_t;
+/*
+ * Tokens are stored as a structure of arrays: token `i` is identified by
+ * `hashes[i]`, has window index `window_idx[i]` and value `values[id][i]`
+ * for a statfile with index `id`
+ */
+struct rspamd_stat_tokens {
+	guint64 *hashes;
+	guint *window_idx;
+	gdouble **values;
+	guint len;
+	guint allocated;
+	guint nvalues;
+};
 
 struct rspamd_stat_async_elt;
 
@@ -185,9 +185,8 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 		reserved_len += 5;
 	}
 
-	task->tokens = g_ptr_array_sized_new (reserved_len);
-	rspamd_mempool_add_destructor (task->task_pool,
-			rspamd_ptr_array_free_hard, task->tokens);
+	task->tokens = rspamd_stat_tokens_new (task->task_pool,
+			st_ctx->statfiles->len, reserved_len);
 	pdiff = rspamd_mempool_get_variable (task->task_pool, "parts_distance");
 
 	for (i = 0; i < task->text_parts->len; i ++) {
@@ -259,13 +258,16 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 	}
 }
 
+/*
+ * Lookups of all statfiles are started at once, so asynchronous backends wait
+ * for their replies concurrently with each other and with synchronous ones
+ */
 static void
 rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 		struct rspamd_task *task)
 {
 	guint i;
 	struct rspamd_statfile *st;
-	struct rspamd_classifier *cl;
 	gpointer bk_run;
 
 	g_assert (task->stat_runtimes != NULL);
@@ -273,22 +275,10 @@ rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 	for (i = 0; i < st_ctx->statfiles->len; i++) {
 		st = g_ptr_array_index (st_ctx->statfiles, i);
 		bk_run = g_ptr_array_index (task->stat_runtimes, i);
-		cl = st->classifier;
 		g_assert (st != NULL);
 
 		if (bk_run != NULL) {
 			st->backend->process_tokens (task, task->tokens, i, bk_run);
-
-			if (st->stcf->is_spam) {
-				cl->spam_learns = st->backend->total_learns (task,
-						bk_run,
-						st_ctx);
-			}
-			else {
-				cl->ham_learns = st->backend->total_learns (task,
-						bk_run,
-						st_ctx);
-			}
 		}
 	}
 }
@@ -299,6 +289,7 @@ rspamd_stat_backends_post_process (struct rspamd_stat_ctx *st_ctx,
 {
 	guint i;
 	struct rspamd_statfile *st;
+	struct rspamd_classifier *cl;
 	gpointer bk_run;
 
 	g_assert (task->stat_runtimes != NULL);
@@ -306,9 +297,22 @@ rspamd_stat_backends_post_process (struct rspamd_stat_ctx *st_ctx,
 	for (i = 0; i < st_ctx->statfiles->len; i++) {
 		st = g_ptr_array_index (st_ctx->statfiles, i);
 		bk_run = g_ptr_array_index (task->stat_runtimes, i);
+		cl = st->classifier;
 		g_assert (st != NULL);
 
 		if (bk_run != NULL) {
+			/* Learns of asynchronous backends are known when all replies arrived */
+			if (st->stcf->is_spam) {
+				cl->spam_learns = st->backend->total_learns (task,
+						bk_run,
+						st_ctx);
+			}
+			else {
+				cl->ham_learns = st->backend->total_learns (task,
+						bk_run,
+						st_ctx);
+			}
+
 			st->backend->finalize_process (task, bk_run, st_ctx);
 		}
 	}
@@ -363,12 +367,12 @@ rspamd_stat_classify (struct rspamd_task *task, lua_State *L, guint stage,
 	}
 
 	if (stage == RSPAMD_TASK_STAGE_CLASSIFIERS_PRE) {
-		/* Preprocess tokens */
+		/* Preprocess tokens and start lookups in all backends */
 		rspamd_stat_preprocess (st_ctx, task, FALSE);
+		rspamd_stat_backends_process (st_ctx, task);
 	}
 	else if (stage == RSPAMD_TASK_STAGE_CLASSIFIERS) {
-		/* Process backends */
-		rspamd_stat_backends_process (st_ctx, task);
+		/* Lookups are started with runtimes, so here we just wait for them */
 	}
 	else if (stage == RSPAMD_TASK_STAGE_CLASSIFIERS_POST) {
 		/* Process classifiers */
@@ -742,7 +746,7 @@ rspamd_stat_has_classifier_symbols (struct rspamd_task *task,
 		id = g_array_index (cl->statfiles_ids, gint, i);
 		st = g_ptr_array_index (st_ctx->statfiles, id);
 
-		if (g_hash_table_lookup (mres->symbols, st->stcf->symbol)) {
+		if (rspamd_metric_result_find_symbol (mres, st->stcf->symbol)) {
 			if (is_spam == !!st->stcf->is_spam) {
 				msg_debug_task ("do not autolearn %s as symbol %s is already "
 						"added", is_spam ? "spam" : "ham", st->stcf->symbol);
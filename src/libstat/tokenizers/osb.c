@@ -256,21 +256,125 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 
 
 
+static inline guint64
+rspamd_tokenizer_osb_hash (struct rspamd_osb_tokenizer_config *osb_cf,
+		rspamd_ftok_t *token, gboolean is_utf, const gchar *prefix,
+		guint64 seed)
+{
+	guint64 cur;
+
+	if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+		cur = rspamd_fstrhash_lc (token, is_utf);
+	}
+	else {
+		/* We know that the words are normalized */
+		if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
+			cur = XXH64 (token->begin, token->len, osb_cf->seed);
+		}
+		else {
+			rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
+					token->len, osb_cf->sk);
+
+			if (prefix) {
+				cur ^= seed;
+			}
+		}
+	}
+
+	return cur;
+}
+
+/*
+ * Generate tokens for all full windows at once: word `p` is paired with
+ * word `p - i` for each distance `i` in the window. Pairs are computed for
+ * the whole text per distance in flat arrays and then stored directly
+ * in the tokens storage
+ */
+static void
+rspamd_tokenizer_osb_pairs (struct rspamd_osb_tokenizer_config *osb_cf,
+		const guint64 *hashes, guint nwords,
+		struct rspamd_stat_tokens *result)
+{
+	guint window_size = osb_cf->window_size, nrows, i, p, stride, start;
+	guint64 *first, *pairs, *out;
+	guint32 *h1, *h2, *cur32;
+	guchar *t;
+
+	nrows = nwords - window_size;
+	stride = window_size - 1;
+	start = rspamd_stat_tokens_reserve (result, nrows * stride);
+	out = result->hashes + start;
+	pairs = g_malloc (nrows * sizeof (guint64));
+
+	if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+		/* Two 32 bits halves of a pair are stored as a single 64 bits value */
+		cur32 = g_malloc (nwords * sizeof (guint32));
+		h1 = (guint32 *)pairs;
+		h2 = h1 + nrows;
+
+		for (p = 0; p < nwords; p ++) {
+			cur32[p] = hashes[p];
+		}
+
+		for (i = 1; i < window_size; i ++) {
+			for (p = 0; p < nrows; p ++) {
+				h1[p] = cur32[p + window_size] * primes[0] +
+						cur32[p + window_size - i] * primes[i << 1];
+			}
+			for (p = 0; p < nrows; p ++) {
+				h2[p] = cur32[p + window_size] * primes[1] +
+						cur32[p + window_size - i] * primes[(i << 1) - 1];
+			}
+
+			for (p = 0; p < nrows; p ++) {
+				t = (guchar *)&out[p * stride + i - 1];
+				memcpy (t, &h1[p], sizeof (h1[p]));
+				memcpy (t + sizeof (h1[p]), &h2[p], sizeof (h2[p]));
+			}
+		}
+
+		g_free (cur32);
+	}
+	else {
+		first = g_malloc (nrows * sizeof (guint64));
+
+		for (p = 0; p < nrows; p ++) {
+			first[p] = hashes[p + window_size] * primes[0];
+		}
+
+		for (i = 1; i < window_size; i ++) {
+			for (p = 0; p < nrows; p ++) {
+				pairs[p] = first[p] +
+						hashes[p + window_size - i] * primes[i << 1];
+			}
+
+			for (p = 0; p < nrows; p ++) {
+				out[p * stride + i - 1] = pairs[p];
+			}
+		}
+
+		g_free (first);
+	}
+
+	g_free (pairs);
+
+	for (p = 0; p < nrows * stride; p ++) {
+		result->window_idx[start + p] = p % stride + 2;
+	}
+}
+
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		rspamd_mempool_t *pool,
 		GArray *words,
 		gboolean is_utf,
 		const gchar *prefix,
-		GPtrArray *result)
+		struct rspamd_stat_tokens *result)
 {
-	rspamd_token_t *new_tok = NULL;
-	rspamd_ftok_t *token;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 *hashpipe, cur, seed;
+	guint64 *hashes, *hashpipe, cur, seed;
 	guint32 h1, h2;
-	gsize token_size;
-	guint processed = 0, i, w, window_size;
+	guint processed, i, w, window_size, idx;
 
 	if (words == NULL) {
 		return FALSE;
@@ -286,75 +390,53 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		seed = osb_cf->seed;
 	}
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
-	token_size = sizeof (rspamd_token_t) + sizeof (gdouble) * ctx->statfiles->len;
-	g_assert (token_size > 0);
+	/* Hash all words first */
+	hashes = g_malloc (MAX (words->len, 1) * sizeof (guint64));
 
 	for (w = 0; w < words->len; w ++) {
-		token = &g_array_index (words, rspamd_ftok_t, w);
+		hashes[w] = rspamd_tokenizer_osb_hash (osb_cf,
+				&g_array_index (words, rspamd_ftok_t, w),
+				is_utf, prefix, seed);
+	}
 
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			cur = rspamd_fstrhash_lc (token, is_utf);
-		}
-		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = XXH64 (token->begin, token->len, osb_cf->seed);
-			}
-			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
-						token->len, osb_cf->sk);
+	if (words->len > window_size) {
+		rspamd_tokenizer_osb_pairs (osb_cf, hashes, words->len, result);
+		g_free (hashes);
 
-				if (prefix) {
-					cur ^= seed;
-				}
-			}
-		}
+		return TRUE;
+	}
+
+	/* Text is shorter than a window, so the hashpipe is never shifted */
+	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
+	memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
+
+	for (processed = 0; processed < words->len; processed ++) {
+		hashpipe[window_size - processed - 1] = hashes[processed];
+	}
+
+	g_free (hashes);
 
 #define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (pool, token_size); \
-    new_tok->datalen = sizeof (gint64); \
+    idx = rspamd_stat_tokens_reserve (result, 1); \
     if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
         h1 = ((guint32)hashpipe[0]) * primes[0] + \
             ((guint32)hashpipe[i]) * primes[i << 1]; \
         h2 = ((guint32)hashpipe[0]) * primes[1] + \
             ((guint32)hashpipe[i]) * primes[(i << 1) - 1]; \
-        memcpy(new_tok->data, &h1, sizeof (h1)); \
-        memcpy(new_tok->data + sizeof (h1), &h2, sizeof (h2)); \
+        memcpy ((guchar *)&cur, &h1, sizeof (h1)); \
+        memcpy ((guchar *)&cur + sizeof (h1), &h2, sizeof (h2)); \
     } \
     else { \
         cur = hashpipe[0] * primes[0] + hashpipe[i] * primes[i << 1]; \
-        memcpy (new_tok->data, &cur, sizeof (cur)); \
     } \
-    new_tok->window_idx = i + 1; \
-    g_ptr_array_add (result, new_tok); \
+    result->hashes[idx] = cur; \
+    result->window_idx[idx] = i + 1; \
   } while(0)
 
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			hashpipe[window_size - ++processed] = cur;
-		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
-			hashpipe[0] = cur;
-			processed++;
-
-			for (i = 1; i < window_size; i++) {
-				ADD_TOKEN;
-			}
-		}
-	}
-
-	if (processed <= window_size) {
-		memmove (hashpipe, hashpipe + (window_size - processed + 1), processed);
+	memmove (hashpipe, hashpipe + (window_size - processed + 1), processed);
 
-		for (i = 1; i < processed; i++) {
-			ADD_TOKEN;
-		}
+	for (i = 1; i < processed; i++) {
+		ADD_TOKEN;
 	}
 
 #undef ADD_TOKEN
@@ -55,16 +55,67 @@ const gchar t_delimiters[255] = {
 	0, 0, 0, 0, 0
 };
 
-gint
-token_node_compare_func (gconstpointer a, gconstpointer b)
+static void
+rspamd_stat_tokens_dtor (gpointer p)
 {
-	const rspamd_token_t *aa = a, *bb = b;
+	struct rspamd_stat_tokens *tokens = p;
+	guint i;
 
-	if (aa->datalen != bb->datalen) {
-		return aa->datalen - bb->datalen;
+	for (i = 0; i < tokens->nvalues; i ++) {
+		g_free (tokens->values[i]);
 	}
 
-	return memcmp (aa->data, bb->data, aa->datalen);
+	g_free (tokens->values);
+	g_free (tokens->window_idx);
+	g_free (tokens->hashes);
+}
+
+struct rspamd_stat_tokens *
+rspamd_stat_tokens_new (rspamd_mempool_t *pool, guint nvalues, guint reserved)
+{
+	struct rspamd_stat_tokens *tokens;
+	guint i;
+
+	tokens = rspamd_mempool_alloc0 (pool, sizeof (*tokens));
+	tokens->nvalues = nvalues;
+	tokens->allocated = MAX (reserved, 16);
+	tokens->hashes = g_malloc (tokens->allocated * sizeof (guint64));
+	tokens->window_idx = g_malloc (tokens->allocated * sizeof (guint));
+	tokens->values = g_malloc0 (MAX (nvalues, 1) * sizeof (gdouble *));
+
+	for (i = 0; i < nvalues; i ++) {
+		tokens->values[i] = g_malloc0 (tokens->allocated * sizeof (gdouble));
+	}
+
+	rspamd_mempool_add_destructor (pool, rspamd_stat_tokens_dtor, tokens);
+
+	return tokens;
+}
+
+guint
+rspamd_stat_tokens_reserve (struct rspamd_stat_tokens *tokens, guint n)
+{
+	guint start = tokens->len, nalloc, i;
+
+	if (tokens->len + n > tokens->allocated) {
+		nalloc = MAX (tokens->allocated * 2, tokens->len + n);
+		tokens->hashes = g_realloc (tokens->hashes, nalloc * sizeof (guint64));
+		tokens->window_idx = g_realloc (tokens->window_idx,
+				nalloc * sizeof (guint));
+
+		for (i = 0; i < tokens->nvalues; i ++) {
+			tokens->values[i] = g_realloc (tokens->values[i],
+					nalloc * sizeof (gdouble));
+			memset (tokens->values[i] + tokens->allocated, 0,
+					(nalloc - tokens->allocated) * sizeof (gdouble));
+		}
+
+		tokens->allocated = nalloc;
+	}
+
+	tokens->len += n;
+
+	return start;
 }
 
 /* Get next word from specified f_str_t buf */
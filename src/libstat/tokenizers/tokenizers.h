@@ -11,6 +11,7 @@
 
 struct rspamd_tokenizer_runtime;
 struct rspamd_stat_ctx;
+struct rspamd_stat_tokens;
 
 /* Common tokenizer structure */
 struct rspamd_stat_tokenizer {
@@ -22,12 +23,18 @@ struct rspamd_stat_tokenizer {
 			GArray *words,
 			gboolean is_utf,
 			const gchar *prefix,
-			GPtrArray *result);
+			struct rspamd_stat_tokens *result);
 };
 
-/* Compare two token nodes */
-gint token_node_compare_func (gconstpointer a, gconstpointer b);
+/* Create tokens storage with `nvalues` values per token freed with the pool */
+struct rspamd_stat_tokens * rspamd_stat_tokens_new (rspamd_mempool_t *pool,
+		guint nvalues, guint reserved);
 
+/*
+ * Append `n` tokens with zero values to the storage and return the index of
+ * the first of them
+ */
+guint rspamd_stat_tokens_reserve (struct rspamd_stat_tokens *tokens, guint n);
 
 /* Tokenize text into array of words (rspamd_ftok_t type) */
 GArray * rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
@@ -40,7 +47,7 @@ gint rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		GArray *words,
 		gboolean is_utf,
 		const gchar *prefix,
-		GPtrArray *result);
+		struct rspamd_stat_tokens *result);
 
 gpointer rspamd_tokenizer_osb_get_config (rspamd_mempool_t *pool,
 		struct rspamd_tokenizer_config *cf,
@@ -730,9 +730,9 @@ rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
-int
-rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+static int
+rspamd_inet_address_listen_common (const rspamd_inet_addr_t *addr, gint type,
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -762,6 +762,15 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	(void)setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+#ifdef HAVE_SO_REUSEPORT
+	if (reuseport && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT,
+			(const void *)&on, sizeof (gint)) == -1) {
+		msg_warn ("cannot set SO_REUSEPORT: %d, '%s'", errno, strerror (errno));
+		close (fd);
+		return -1;
+	}
+#endif
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -815,6 +824,27 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
+int
+rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
+		gboolean async)
+{
+	return rspamd_inet_address_listen_common (addr, type, async, FALSE);
+}
+
+int
+rspamd_inet_address_listen_reuseport (const rspamd_inet_addr_t *addr,
+		gint type, gboolean async)
+{
+#ifdef HAVE_SO_REUSEPORT
+	return rspamd_inet_address_listen_common (addr, type, async, TRUE);
+#else
+	msg_warn ("SO_REUSEPORT is not supported by the system");
+	errno = ENOTSUP;
+
+	return -1;
+#endif
+}
+
 gssize
 rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 		rspamd_inet_addr_t **target)
@@ -861,18 +891,29 @@ rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 		return -1;
 	}
 
-	if (addr->af == AF_UNIX) {
-		sa = (struct sockaddr *)&addr->u.un->addr;
-	}
-	else {
-		sa = &addr->u.in.addr.sa;
-	}
-
+	sa = rspamd_inet_address_get_sa (addr, NULL);
 	r = sendto (fd, buf, len, fl, sa, addr->slen);
 
 	return r;
 }
 
+const struct sockaddr *
+rspamd_inet_address_get_sa (const rspamd_inet_addr_t *addr,
+		socklen_t *sz)
+{
+	g_assert (addr != NULL);
+
+	if (sz) {
+		*sz = addr->slen;
+	}
+
+	if (addr->af == AF_UNIX) {
+		return (const struct sockaddr *)&addr->u.un->addr;
+	}
+
+	return &addr->u.in.addr.sa;
+}
+
 static gboolean
 rspamd_check_port_priority (const char *line, guint default_port,
 		guint *priority, gchar *out,
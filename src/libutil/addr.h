@@ -152,6 +152,15 @@ gssize rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 gssize rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Get socket address for the specified inet_addr structure
+ * @param addr
+ * @param sz output length of socket address
+ * @return pointer to the socket address stored in `addr`
+ */
+const struct sockaddr * rspamd_inet_address_get_sa (const rspamd_inet_addr_t *addr,
+		socklen_t *sz);
+
 /**
  * Set port for inet address
  */
@@ -175,6 +184,17 @@ int rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
  */
 int rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	gboolean async);
+
+/**
+ * Listen on a specified inet address setting SO_REUSEPORT option, so several
+ * processes could have their own sockets bound to the same address
+ * @param addr
+ * @param type
+ * @param async
+ * @return new socket or -1 (SO_REUSEPORT is not supported by the system)
+ */
+int rspamd_inet_address_listen_reuseport (const rspamd_inet_addr_t *addr,
+	gint type, gboolean async);
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
@@ -27,6 +27,10 @@
 #include <aio.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 /* Linux syscall numbers */
 #if defined(__i386__)
 # define SYS_io_setup      245
@@ -50,9 +54,24 @@
 # define SYS_io_cancel      0
 #endif
 
+/* io_uring syscalls have the same numbers on all architectures */
+#ifndef SYS_io_uring_setup
+# define SYS_io_uring_setup     425
+#endif
+#ifndef SYS_io_uring_enter
+# define SYS_io_uring_enter     426
+#endif
+#ifndef SYS_io_uring_register
+# define SYS_io_uring_register  427
+#endif
+
 #define SYS_eventfd       323
 #define MAX_AIO_EV        64
 
+/* Registered buffers used by io_uring for small requests */
+#define RSPAMD_AIO_FIXED_BUFS 16
+#define RSPAMD_AIO_FIXED_BUF_SIZE (64 * 1024)
+
 struct io_cbdata {
 	gint fd;
 	rspamd_aio_cb cb;
@@ -60,6 +79,9 @@ struct io_cbdata {
 	gpointer buf;
 	gpointer io_buf;
 	gpointer ud;
+	gint fixed_idx;     /**< registered buffer used or -1 */
+	gboolean is_read;
+	struct iovec iov;   /**< must live until the request is completed */
 };
 
 #ifdef LINUX
@@ -128,6 +150,107 @@ struct io_event {
 	gint64 res2;    /* secondary result */
 };
 
+/* io_uring kernel interface, see include/uapi/linux/io_uring.h */
+
+#define IORING_OP_READV       1
+#define IORING_OP_WRITEV      2
+#define IORING_OP_READ_FIXED  4
+#define IORING_OP_WRITE_FIXED 5
+
+#define IORING_ENTER_GETEVENTS (1U << 0)
+#define IORING_FEAT_SINGLE_MMAP (1U << 0)
+
+#define IORING_REGISTER_BUFFERS 0
+#define IORING_REGISTER_EVENTFD 4
+
+#define IORING_OFF_SQ_RING 0ULL
+#define IORING_OFF_CQ_RING 0x8000000ULL
+#define IORING_OFF_SQES    0x10000000ULL
+
+struct io_uring_sqe {
+	guint8 opcode;
+	guint8 flags;
+	guint16 ioprio;
+	gint32 fd;
+	guint64 off;
+	guint64 addr;
+	guint32 len;
+	guint32 rw_flags;
+	guint64 user_data;
+	guint16 buf_index;
+	guint16 personality;
+	gint32 splice_fd_in;
+	guint64 pad[2];
+};
+
+struct io_uring_cqe {
+	guint64 user_data;
+	gint32 res;
+	guint32 flags;
+};
+
+struct io_sqring_offsets {
+	guint32 head;
+	guint32 tail;
+	guint32 ring_mask;
+	guint32 ring_entries;
+	guint32 flags;
+	guint32 dropped;
+	guint32 array;
+	guint32 resv1;
+	guint64 resv2;
+};
+
+struct io_cqring_offsets {
+	guint32 head;
+	guint32 tail;
+	guint32 ring_mask;
+	guint32 ring_entries;
+	guint32 overflow;
+	guint32 cqes;
+	guint32 flags;
+	guint32 resv1;
+	guint64 resv2;
+};
+
+struct io_uring_params {
+	guint32 sq_entries;
+	guint32 cq_entries;
+	guint32 flags;
+	guint32 sq_thread_cpu;
+	guint32 sq_thread_idle;
+	guint32 features;
+	guint32 wq_fd;
+	guint32 resv[3];
+	struct io_sqring_offsets sq_off;
+	struct io_cqring_offsets cq_off;
+};
+
+struct rspamd_io_uring {
+	gint ring_fd;
+	guint *sq_head;
+	guint *sq_tail;
+	guint *sq_mask;
+	guint *sq_array;
+	guint *cq_head;
+	guint *cq_tail;
+	guint *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	gpointer sq_ring;
+	gpointer cq_ring;
+	gsize sq_ring_sz;
+	gsize cq_ring_sz;
+	gsize sqes_sz;
+	guint sq_entries;
+	guint to_submit;            /**< queued but not yet submitted entries */
+	gboolean submit_pending;
+	struct event submit_ev;
+	guint nfixed;               /**< number of registered buffers */
+	guint32 fixed_free;         /**< bitmask of free registered buffers */
+	struct iovec fixed[RSPAMD_AIO_FIXED_BUFS];
+};
+
 /* Linux specific io calls */
 static int
 io_setup (guint nr_reqs, aio_context_t *ctx)
@@ -163,6 +286,25 @@ io_cancel (aio_context_t ctx, struct iocb *iocb, struct io_event *result)
 	return syscall (SYS_io_cancel, ctx, iocb, result);
 }
 
+static int
+io_uring_setup (guint entries, struct io_uring_params *p)
+{
+	return syscall (SYS_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (gint fd, guint to_submit, guint min_complete, guint flags)
+{
+	return syscall (SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static int
+io_uring_register (gint fd, guint opcode, const void *arg, guint nr_args)
+{
+	return syscall (SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
 # ifndef HAVE_SYS_EVENTFD_H
 static int
 eventfd (guint initval, guint flags)
@@ -184,6 +326,7 @@ struct aio_context {
 	gint event_fd;
 	struct event eventfd_ev;
 	aio_context_t io_ctx;
+	struct rspamd_io_uring *uring; /**< used instead of io_ctx if not NULL */
 #elif defined(HAVE_AIO_H)
 	/* POSIX aio */
 	struct event rtsigs[128];
@@ -191,6 +334,47 @@ struct aio_context {
 };
 
 #ifdef LINUX
+static void
+rspamd_uring_complete (struct aio_context *ctx)
+{
+	struct rspamd_io_uring *ring = ctx->uring;
+	struct io_uring_cqe *cqe;
+	struct io_cbdata *ev_data;
+	guint head;
+
+	head = *ring->cq_head;
+
+	while (head != g_atomic_int_get (ring->cq_tail)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		ev_data = (struct io_cbdata *) (uintptr_t) cqe->user_data;
+		head ++;
+		/* Release entry before calling callback that can queue more */
+		g_atomic_int_set (ring->cq_head, head);
+
+		if (ev_data->fixed_idx != -1) {
+			if (ev_data->is_read && cqe->res > 0) {
+				memcpy (ev_data->buf, ring->fixed[ev_data->fixed_idx].iov_base,
+						cqe->res);
+			}
+
+			ring->fixed_free |= 1U << ev_data->fixed_idx;
+		}
+
+		ev_data->cb (ev_data->fd,
+			cqe->res,
+			ev_data->len,
+			ev_data->buf,
+			ev_data->ud);
+
+		if (ev_data->io_buf) {
+			free (ev_data->io_buf);
+		}
+
+		g_slice_free1 (sizeof (struct io_cbdata), ev_data);
+		head = *ring->cq_head;
+	}
+}
+
 /* Eventfd read callback */
 static void
 rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
@@ -210,6 +394,12 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 		msg_err ("eventfd read returned error: %s", strerror (errno));
 	}
 
+	if (ctx->uring) {
+		rspamd_uring_complete (ctx);
+
+		return;
+	}
+
 	ts.tv_sec = 0;
 	ts.tv_nsec = 0;
 
@@ -245,6 +435,269 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 	}
 }
 
+static void
+rspamd_uring_flush (struct aio_context *ctx)
+{
+	struct rspamd_io_uring *ring = ctx->uring;
+	gint r;
+
+	while (ring->to_submit > 0) {
+		r = io_uring_enter (ring->ring_fd, ring->to_submit, 0, 0);
+
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+
+			/* Entries are kept in queue and submitted on the next flush */
+			if (r == -1 && errno != EAGAIN && errno != EBUSY) {
+				msg_err ("io_uring_enter failed: %s", strerror (errno));
+			}
+
+			break;
+		}
+
+		ring->to_submit -= r;
+	}
+}
+
+static void
+rspamd_uring_submit_cb (gint fd, gshort what, gpointer ud)
+{
+	struct aio_context *ctx = ud;
+
+	ctx->uring->submit_pending = FALSE;
+	rspamd_uring_flush (ctx);
+}
+
+/*
+ * Returns a free submission entry. Requests queued during the same event
+ * loop iteration are submitted to the kernel by a single syscall
+ */
+static struct io_uring_sqe *
+rspamd_uring_get_sqe (struct aio_context *ctx)
+{
+	struct rspamd_io_uring *ring = ctx->uring;
+	struct io_uring_sqe *sqe;
+	guint tail, idx;
+	struct timeval tv = {0, 0};
+
+	tail = *ring->sq_tail;
+
+	if (tail - g_atomic_int_get (ring->sq_head) >= ring->sq_entries) {
+		/* Ring is full, so push it to the kernel now */
+		rspamd_uring_flush (ctx);
+
+		if (tail - g_atomic_int_get (ring->sq_head) >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+	ring->sq_array[idx] = idx;
+
+	if (!ring->submit_pending) {
+		ring->submit_pending = TRUE;
+		evtimer_add (&ring->submit_ev, &tv);
+	}
+
+	return sqe;
+}
+
+static void
+rspamd_uring_commit_sqe (struct aio_context *ctx)
+{
+	struct rspamd_io_uring *ring = ctx->uring;
+
+	/* Full barrier: kernel must see entry before the new tail */
+	g_atomic_int_set (ring->sq_tail, *ring->sq_tail + 1);
+	ring->to_submit ++;
+}
+
+static gint
+rspamd_uring_queue (struct aio_context *ctx, gboolean is_read,
+	gint fd, gpointer buf, guint64 len, guint64 offset,
+	rspamd_aio_cb cb, gpointer ud)
+{
+	struct rspamd_io_uring *ring = ctx->uring;
+	struct io_uring_sqe *sqe;
+	struct io_cbdata *cbdata;
+	gint idx;
+
+	sqe = rspamd_uring_get_sqe (ctx);
+
+	if (sqe == NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	cbdata = g_slice_alloc0 (sizeof (struct io_cbdata));
+	cbdata->cb = cb;
+	cbdata->buf = buf;
+	cbdata->len = len;
+	cbdata->ud = ud;
+	cbdata->fd = fd;
+	cbdata->is_read = is_read;
+	cbdata->fixed_idx = -1;
+
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->user_data = (guint64)((uintptr_t)cbdata);
+
+	if (len <= RSPAMD_AIO_FIXED_BUF_SIZE && ring->fixed_free != 0) {
+		/* Registered buffers need no page pinning on each request */
+		idx = ffs (ring->fixed_free) - 1;
+		ring->fixed_free &= ~(1U << idx);
+		cbdata->fixed_idx = idx;
+
+		if (!is_read) {
+			memcpy (ring->fixed[idx].iov_base, buf, len);
+		}
+
+		sqe->opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->addr = (guint64)((uintptr_t)ring->fixed[idx].iov_base);
+		sqe->len = len;
+		sqe->buf_index = idx;
+	}
+	else {
+		/* Caller's buffer must be valid until callback is called */
+		cbdata->iov.iov_base = buf;
+		cbdata->iov.iov_len = len;
+		sqe->opcode = is_read ? IORING_OP_READV : IORING_OP_WRITEV;
+		sqe->addr = (guint64)((uintptr_t)&cbdata->iov);
+		sqe->len = 1;
+	}
+
+	rspamd_uring_commit_sqe (ctx);
+
+	return len;
+}
+
+static struct rspamd_io_uring *
+rspamd_uring_init (struct aio_context *ctx)
+{
+	struct rspamd_io_uring *ring;
+	struct io_uring_params p;
+	guchar *sq_ptr, *cq_ptr;
+	guint i;
+
+	memset (&p, 0, sizeof (p));
+	ring = g_malloc0 (sizeof (*ring));
+	ring->ring_fd = io_uring_setup (MAX_AIO_EV, &p);
+
+	if (ring->ring_fd == -1) {
+		/* Old kernel or io_uring is disabled by sysctl or seccomp */
+		g_free (ring);
+
+		return NULL;
+	}
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof (guint);
+	ring->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof (struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_sz = MAX (ring->sq_ring_sz, ring->cq_ring_sz);
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+
+	sq_ptr = mmap (NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+
+	if (sq_ptr == MAP_FAILED) {
+		goto err;
+	}
+
+	ring->sq_ring = sq_ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	}
+	else {
+		cq_ptr = mmap (NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+
+		if (cq_ptr == MAP_FAILED) {
+			goto err;
+		}
+	}
+
+	ring->cq_ring = cq_ptr;
+	ring->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head = (guint *)(sq_ptr + p.sq_off.head);
+	ring->sq_tail = (guint *)(sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (guint *)(sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (guint *)(sq_ptr + p.sq_off.array);
+	ring->cq_head = (guint *)(cq_ptr + p.cq_off.head);
+	ring->cq_tail = (guint *)(cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (guint *)(cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+	ring->sq_entries = p.sq_entries;
+
+	if (io_uring_register (ring->ring_fd, IORING_REGISTER_EVENTFD,
+			&ctx->event_fd, 1) == -1) {
+		msg_err ("cannot register eventfd for io_uring: %s", strerror (errno));
+		goto err;
+	}
+
+	for (i = 0; i < RSPAMD_AIO_FIXED_BUFS; i ++) {
+		if (posix_memalign (&ring->fixed[i].iov_base, 4096,
+				RSPAMD_AIO_FIXED_BUF_SIZE) != 0) {
+			break;
+		}
+
+		ring->fixed[i].iov_len = RSPAMD_AIO_FIXED_BUF_SIZE;
+	}
+
+	ring->nfixed = i;
+
+	if (ring->nfixed > 0 && io_uring_register (ring->ring_fd,
+			IORING_REGISTER_BUFFERS, ring->fixed, ring->nfixed) == 0) {
+		ring->fixed_free = (1U << ring->nfixed) - 1;
+	}
+	else {
+		/* Likely RLIMIT_MEMLOCK, we can still work without fixed buffers */
+		msg_info ("cannot register io_uring buffers: %s", strerror (errno));
+
+		for (i = 0; i < ring->nfixed; i ++) {
+			free (ring->fixed[i].iov_base);
+		}
+
+		ring->nfixed = 0;
+	}
+
+	evtimer_set (&ring->submit_ev, rspamd_uring_submit_cb, ctx);
+	event_base_set (ctx->base, &ring->submit_ev);
+
+	return ring;
+
+err:
+	if (ring->sqes) {
+		munmap (ring->sqes, ring->sqes_sz);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap (ring->cq_ring, ring->cq_ring_sz);
+	}
+	if (ring->sq_ring) {
+		munmap (ring->sq_ring, ring->sq_ring_sz);
+	}
+
+	close (ring->ring_fd);
+	g_free (ring);
+
+	return NULL;
+}
+
 #endif
 
 /**
@@ -279,7 +732,14 @@ rspamd_aio_init (struct event_base *base)
 				new);
 			event_base_set (new->base, &new->eventfd_ev);
 			event_add (&new->eventfd_ev, NULL);
-			if (io_setup (MAX_AIO_EV, &new->io_ctx) == -1) {
+
+			/* Prefer io_uring if kernel supports it */
+			new->uring = rspamd_uring_init (new);
+
+			if (new->uring) {
+				new->has_aio = TRUE;
+			}
+			else if (io_setup (MAX_AIO_EV, &new->io_ctx) == -1) {
 				msg_err ("io_setup failed: %s", strerror (errno));
 				close (new->event_fd);
 			}
@@ -308,6 +768,11 @@ rspamd_aio_open (struct aio_context *ctx, const gchar *path, int flags)
 	}
 #ifdef LINUX
 
+	if (ctx->uring) {
+		/* io_uring is asynchronous for buffered I/O as well */
+		return open (path, flags);
+	}
+
 	fd = open (path, flags | O_DIRECT);
 
 	return fd;
@@ -337,13 +802,23 @@ rspamd_aio_read (gint fd,
 		struct iocb *iocb[1];
 		struct io_cbdata *cbdata;
 
-		cbdata = g_slice_alloc (sizeof (struct io_cbdata));
+		if (ctx->uring) {
+			if (rspamd_uring_queue (ctx, TRUE, fd, buf, len, offset,
+					cb, ud) == -1) {
+				goto blocking;
+			}
+
+			return len;
+		}
+
+		cbdata = g_slice_alloc0 (sizeof (struct io_cbdata));
 		cbdata->cb = cb;
 		cbdata->buf = buf;
 		cbdata->len = len;
 		cbdata->ud = ud;
 		cbdata->fd = fd;
 		cbdata->io_buf = NULL;
+		cbdata->fixed_idx = -1;
 
 		iocb[0] = alloca (sizeof (struct iocb));
 		memset (iocb[0], 0, sizeof (struct iocb));
@@ -381,7 +856,7 @@ blocking:
 #else
 		r = lseek (fd, offset, SEEK_SET);
 #endif
-		if (r > 0) {
+		if (r != -1) {
 			r = read (fd, buf, len);
 			if (r >= 0) {
 				cb (fd, 0, r, buf, ud);
@@ -414,12 +889,22 @@ rspamd_aio_write (gint fd,
 		struct iocb *iocb[1];
 		struct io_cbdata *cbdata;
 
-		cbdata = g_slice_alloc (sizeof (struct io_cbdata));
+		if (ctx->uring) {
+			if (rspamd_uring_queue (ctx, FALSE, fd, buf, len, offset,
+					cb, ud) == -1) {
+				goto blocking;
+			}
+
+			return len;
+		}
+
+		cbdata = g_slice_alloc0 (sizeof (struct io_cbdata));
 		cbdata->cb = cb;
 		cbdata->buf = buf;
 		cbdata->len = len;
 		cbdata->ud = ud;
 		cbdata->fd = fd;
+		cbdata->fixed_idx = -1;
 		/* We need to align pointer on boundary of 512 bytes here */
 		if (posix_memalign (&cbdata->io_buf, 512, len) != 0) {
 			return -1;
@@ -462,7 +947,7 @@ blocking:
 #else
 		r = lseek (fd, offset, SEEK_SET);
 #endif
-		if (r > 0) {
+		if (r != -1) {
 			r = write (fd, buf, len);
 			if (r >= 0) {
 				cb (fd, 0, r, buf, ud);
@@ -489,6 +974,16 @@ rspamd_aio_close (gint fd, struct aio_context *ctx)
 		struct iocb iocb;
 		struct io_event ev;
 
+		if (ctx->uring) {
+			/*
+			 * Descriptor is resolved on submission, whilst submitted
+			 * requests keep their own reference to the file
+			 */
+			rspamd_uring_flush (ctx);
+
+			return close (fd);
+		}
+
 		memset (&iocb, 0, sizeof (struct iocb));
 		iocb.aio_fildes = fd;
 		iocb.aio_lio_opcode = IO_CMD_NOOP;
@@ -30,7 +30,8 @@ typedef void (*rspamd_aio_cb) (gint fd, gint res, guint64 len, gpointer data,
 	gpointer ud);
 
 /**
- * Initialize aio with specified event base
+ * Initialize aio with specified event base. On Linux io_uring is used if
+ * supported by kernel, then native aio, otherwise all operations are blocking
  */
 struct aio_context * rspamd_aio_init (struct event_base *base);
 
@@ -16,6 +16,16 @@
 #include "config.h"
 #include "bloom.h"
 #include "xxhash.h"
+#include "printf.h"
+#include "unix-std.h"
+#include "ottery.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define RSPAMD_BLOOM_NEON 1
+#endif
 
 /* 4 bits are used for counting (implementing delete operation) */
 #define SIZE_BIT 4
@@ -51,7 +61,22 @@
 		n) (a[n * SIZE_BIT / CHAR_BIT] & (0xF << \
 	(n % (CHAR_BIT / SIZE_BIT) * SIZE_BIT)))
 
-/* Common hash functions */
+#define BLOOM_ARRAY_SIZE(size) (((size) + CHAR_BIT - 1) / CHAR_BIT * SIZE_BIT)
+
+/* On-disk representation, followed by seeds and counters array */
+struct rspamd_bloom_file_header {
+	gchar magic[8];
+	guint64 asize;
+	guint64 nfuncs;
+};
+
+static const gchar rspamd_bloom_magic[8] = {'r', 's', 'b', 'l', 'o', 'o', 'm', '1'};
+
+static GQuark
+rspamd_bloom_quark (void)
+{
+	return g_quark_from_static_string ("rspamd-bloom");
+}
 
 
 rspamd_bloom_filter_t *
@@ -65,7 +90,7 @@ rspamd_bloom_create (size_t size, size_t nfuncs, ...)
 		return NULL;
 	}
 	if (!(bloom->a =
-		g_new0 (gchar, (size + CHAR_BIT - 1) / CHAR_BIT * SIZE_BIT))) {
+		g_new0 (gchar, BLOOM_ARRAY_SIZE (size)))) {
 		g_free (bloom);
 		return NULL;
 	}
@@ -96,24 +121,33 @@ rspamd_bloom_destroy (rspamd_bloom_filter_t * bloom)
 }
 
 gboolean
-rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_add_buf (rspamd_bloom_filter_t * bloom, const void *buf, gsize len)
 {
-	size_t n, len;
+	size_t n;
 	u_char t;
 	guint v;
 
-	if (s == NULL) {
+	if (buf == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = XXH64 (s, len, bloom->seeds[n]) % bloom->asize;
+		v = XXH64 (buf, len, bloom->seeds[n]) % bloom->asize;
 		INCBIT (bloom->a, v, t);
 	}
 
 	return TRUE;
 }
 
+gboolean
+rspamd_bloom_add (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_add_buf (bloom, s, strlen (s));
+}
+
 gboolean
 rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s)
 {
@@ -135,17 +169,17 @@ rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s)
 }
 
 gboolean
-rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
+rspamd_bloom_check_buf (rspamd_bloom_filter_t * bloom, const void *buf,
+		gsize len)
 {
-	size_t n, len;
+	size_t n;
 	guint v;
 
-	if (s == NULL) {
+	if (buf == NULL) {
 		return FALSE;
 	}
-	len = strlen (s);
 	for (n = 0; n < bloom->nfuncs; ++n) {
-		v = XXH64 (s, len, bloom->seeds[n]) % bloom->asize;
+		v = XXH64 (buf, len, bloom->seeds[n]) % bloom->asize;
 		if (!(GETBIT (bloom->a, v))) {
 			return FALSE;
 		}
@@ -153,3 +187,475 @@ rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
 
 	return TRUE;
 }
+
+gboolean
+rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
+{
+	if (s == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_bloom_check_buf (bloom, s, strlen (s));
+}
+
+gboolean
+rspamd_bloom_save (rspamd_bloom_filter_t * bloom, const gchar *path,
+		GError **err)
+{
+	struct rspamd_bloom_file_header hdr;
+	gchar tmppath[PATH_MAX];
+	gint fd;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_bloom_magic, sizeof (hdr.magic));
+	hdr.asize = bloom->asize;
+	hdr.nfuncs = bloom->nfuncs;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.new", path);
+	fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot create %s: %s", tmppath, strerror (errno));
+		return FALSE;
+	}
+
+	if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			write (fd, bloom->seeds, sizeof (guint32) * bloom->nfuncs) !=
+					(gssize)(sizeof (guint32) * bloom->nfuncs) ||
+			write (fd, bloom->a, BLOOM_ARRAY_SIZE (bloom->asize)) !=
+					(gssize)BLOOM_ARRAY_SIZE (bloom->asize)) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot write %s: %s", tmppath, strerror (errno));
+		close (fd);
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	if (rename (tmppath, path) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot rename %s: %s", tmppath, strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+rspamd_bloom_filter_t *
+rspamd_bloom_load (const gchar *path, GError **err)
+{
+	struct rspamd_bloom_file_header hdr;
+	rspamd_bloom_filter_t *bloom;
+	struct stat st;
+	gint fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			memcmp (hdr.magic, rspamd_bloom_magic, sizeof (hdr.magic)) != 0 ||
+			hdr.asize == 0 || hdr.nfuncs == 0 || hdr.nfuncs > 256 ||
+			(guint64)st.st_size != sizeof (hdr) + sizeof (guint32) * hdr.nfuncs +
+					BLOOM_ARRAY_SIZE (hdr.asize)) {
+		g_set_error (err, rspamd_bloom_quark (), EINVAL,
+				"%s is not a valid bloom filter", path);
+		close (fd);
+
+		return NULL;
+	}
+
+	bloom = g_malloc (sizeof (*bloom));
+	bloom->asize = hdr.asize;
+	bloom->nfuncs = hdr.nfuncs;
+	bloom->seeds = g_new (guint32, hdr.nfuncs);
+	bloom->a = g_malloc (BLOOM_ARRAY_SIZE (hdr.asize));
+
+	if (read (fd, bloom->seeds, sizeof (guint32) * hdr.nfuncs) !=
+			(gssize)(sizeof (guint32) * hdr.nfuncs) ||
+			read (fd, bloom->a, BLOOM_ARRAY_SIZE (hdr.asize)) !=
+			(gssize)BLOOM_ARRAY_SIZE (hdr.asize)) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot read %s: %s", path, strerror (errno));
+		close (fd);
+		rspamd_bloom_destroy (bloom);
+
+		return NULL;
+	}
+
+	close (fd);
+
+	return bloom;
+}
+
+#define BLOOM_BLOCK_WORDS (RSPAMD_BLOOM_BLOCK_SIZE / sizeof (guint64))
+#define BLOOM_BLOCK_BITS (RSPAMD_BLOOM_BLOCK_SIZE * CHAR_BIT)
+#define BLOOM_BLOCK_COUNTERS (BLOOM_BLOCK_BITS / SIZE_BIT)
+
+struct rspamd_bloom_blocked_file_header {
+	gchar magic[8];
+	guint64 nblocks;
+	guint64 seed;
+	guint64 flags;
+};
+
+static const gchar rspamd_bloom_blocked_magic[8] = {
+	'r', 's', 'b', 'l', 'k', 'b', 'f', '1'
+};
+
+/* Odd multipliers used to derive positions in all words from a single hash */
+static const guint32 rspamd_bloom_salts[BLOOM_BLOCK_WORDS] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static guint64 *
+rspamd_bloom_blocked_alloc (guint64 nblocks)
+{
+	guint64 *blocks;
+
+	if (posix_memalign ((void **)&blocks, RSPAMD_BLOOM_BLOCK_SIZE,
+			nblocks * RSPAMD_BLOOM_BLOCK_SIZE) != 0) {
+		abort ();
+	}
+
+	memset (blocks, 0, nblocks * RSPAMD_BLOOM_BLOCK_SIZE);
+
+	return blocks;
+}
+
+/*
+ * Returns block of element, the lower 32 bits of hash are used for positions
+ * inside block and the higher bits select the block
+ */
+static inline guint64 *
+rspamd_bloom_blocked_get (rspamd_bloom_blocked_t *bloom, const void *buf,
+		gsize len, guint32 *h)
+{
+	guint64 hv;
+
+	hv = XXH64 (buf, len, bloom->seed);
+	*h = hv & 0xFFFFFFFFULL;
+
+	return bloom->blocks + ((hv >> 32) * bloom->nblocks >> 32) *
+			BLOOM_BLOCK_WORDS;
+}
+
+/* Shift of bit (or counter) in each word of block */
+static inline void
+rspamd_bloom_blocked_shifts (guint32 h, gboolean counting,
+		guint shifts[BLOOM_BLOCK_WORDS])
+{
+	guint i;
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		if (counting) {
+			shifts[i] = ((h * rspamd_bloom_salts[i]) >> 28) * SIZE_BIT;
+		}
+		else {
+			shifts[i] = (h * rspamd_bloom_salts[i]) >> 26;
+		}
+	}
+}
+
+rspamd_bloom_blocked_t *
+rspamd_bloom_blocked_create (gsize nelts, guint bits_per_elt, gint flags)
+{
+	rspamd_bloom_blocked_t *bloom;
+	guint64 per_block;
+
+	g_assert (bits_per_elt > 0);
+
+	per_block = (flags & RSPAMD_BLOOM_BLOCKED_COUNTING) ?
+			BLOOM_BLOCK_COUNTERS : BLOOM_BLOCK_BITS;
+	bloom = g_malloc0 (sizeof (*bloom));
+	bloom->nblocks = ((guint64)nelts * bits_per_elt + per_block - 1) / per_block;
+	bloom->nblocks = MAX (bloom->nblocks, 1);
+	/* Block index is calculated from 32 bits of hash */
+	g_assert (bloom->nblocks <= G_MAXUINT32);
+	bloom->flags = flags;
+	bloom->seed = ottery_rand_uint64 ();
+	bloom->blocks = rspamd_bloom_blocked_alloc (bloom->nblocks);
+
+	return bloom;
+}
+
+void
+rspamd_bloom_blocked_destroy (rspamd_bloom_blocked_t *bloom)
+{
+	if (bloom) {
+		/* Not g_free as blocks are allocated using posix_memalign */
+		free (bloom->blocks);
+		g_free (bloom);
+	}
+}
+
+void
+rspamd_bloom_blocked_add (rspamd_bloom_blocked_t *bloom,
+		const void *buf, gsize len)
+{
+	guint64 *block, mask[BLOOM_BLOCK_WORDS], cnt;
+	guint shifts[BLOOM_BLOCK_WORDS], i;
+	guint32 h;
+
+	block = rspamd_bloom_blocked_get (bloom, buf, len, &h);
+
+	if (bloom->flags & RSPAMD_BLOOM_BLOCKED_COUNTING) {
+		rspamd_bloom_blocked_shifts (h, TRUE, shifts);
+
+		for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+			cnt = (block[i] >> shifts[i]) & 0xF;
+
+			/* Saturated counters are never changed */
+			if (cnt != 0xF) {
+				block[i] += 1ULL << shifts[i];
+			}
+		}
+
+		return;
+	}
+
+	rspamd_bloom_blocked_shifts (h, FALSE, shifts);
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		mask[i] = 1ULL << shifts[i];
+	}
+
+#if defined(__SSE2__)
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i += 2) {
+		_mm_store_si128 ((__m128i *)(block + i),
+				_mm_or_si128 (_mm_load_si128 ((const __m128i *)(block + i)),
+						_mm_loadu_si128 ((const __m128i *)(mask + i))));
+	}
+#elif defined(RSPAMD_BLOOM_NEON)
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i += 2) {
+		vst1q_u64 (block + i, vorrq_u64 (vld1q_u64 (block + i),
+				vld1q_u64 (mask + i)));
+	}
+#else
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		block[i] |= mask[i];
+	}
+#endif
+}
+
+gboolean
+rspamd_bloom_blocked_check (rspamd_bloom_blocked_t *bloom,
+		const void *buf, gsize len)
+{
+	guint64 *block, mask[BLOOM_BLOCK_WORDS];
+	guint shifts[BLOOM_BLOCK_WORDS], i;
+	guint32 h;
+#if defined(__SSE2__)
+	__m128i missing;
+#elif defined(RSPAMD_BLOOM_NEON)
+	uint64x2_t missing;
+#endif
+
+	block = rspamd_bloom_blocked_get (bloom, buf, len, &h);
+
+	if (bloom->flags & RSPAMD_BLOOM_BLOCKED_COUNTING) {
+		rspamd_bloom_blocked_shifts (h, TRUE, shifts);
+
+		for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+			if (((block[i] >> shifts[i]) & 0xF) == 0) {
+				return FALSE;
+			}
+		}
+
+		return TRUE;
+	}
+
+	rspamd_bloom_blocked_shifts (h, FALSE, shifts);
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		mask[i] = 1ULL << shifts[i];
+	}
+
+	/* Accumulate bits of mask that are not set in block */
+#if defined(__SSE2__)
+	missing = _mm_setzero_si128 ();
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i += 2) {
+		missing = _mm_or_si128 (missing, _mm_andnot_si128 (
+				_mm_load_si128 ((const __m128i *)(block + i)),
+				_mm_loadu_si128 ((const __m128i *)(mask + i))));
+	}
+
+	return _mm_movemask_epi8 (_mm_cmpeq_epi8 (missing,
+			_mm_setzero_si128 ())) == 0xFFFF;
+#elif defined(RSPAMD_BLOOM_NEON)
+	missing = vdupq_n_u64 (0);
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i += 2) {
+		missing = vorrq_u64 (missing, vbicq_u64 (vld1q_u64 (mask + i),
+				vld1q_u64 (block + i)));
+	}
+
+	return vmaxvq_u32 (vreinterpretq_u32_u64 (missing)) == 0;
+#else
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		if ((block[i] & mask[i]) != mask[i]) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+#endif
+}
+
+gboolean
+rspamd_bloom_blocked_del (rspamd_bloom_blocked_t *bloom,
+		const void *buf, gsize len)
+{
+	guint64 *block, cnt;
+	guint shifts[BLOOM_BLOCK_WORDS], i;
+	guint32 h;
+
+	if (!(bloom->flags & RSPAMD_BLOOM_BLOCKED_COUNTING)) {
+		return FALSE;
+	}
+
+	block = rspamd_bloom_blocked_get (bloom, buf, len, &h);
+	rspamd_bloom_blocked_shifts (h, TRUE, shifts);
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		if (((block[i] >> shifts[i]) & 0xF) == 0) {
+			return FALSE;
+		}
+	}
+
+	for (i = 0; i < BLOOM_BLOCK_WORDS; i ++) {
+		cnt = (block[i] >> shifts[i]) & 0xF;
+
+		if (cnt != 0xF) {
+			block[i] -= 1ULL << shifts[i];
+		}
+	}
+
+	return TRUE;
+}
+
+gsize
+rspamd_bloom_blocked_capacity (rspamd_bloom_blocked_t *bloom,
+		guint bits_per_elt)
+{
+	guint64 per_block;
+
+	g_assert (bits_per_elt > 0);
+
+	per_block = (bloom->flags & RSPAMD_BLOOM_BLOCKED_COUNTING) ?
+			BLOOM_BLOCK_COUNTERS : BLOOM_BLOCK_BITS;
+
+	return bloom->nblocks * per_block / bits_per_elt;
+}
+
+gboolean
+rspamd_bloom_blocked_save (rspamd_bloom_blocked_t *bloom, const gchar *path,
+		GError **err)
+{
+	struct rspamd_bloom_blocked_file_header hdr;
+	gchar tmppath[PATH_MAX];
+	gsize size;
+	gint fd;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_bloom_blocked_magic, sizeof (hdr.magic));
+	hdr.nblocks = bloom->nblocks;
+	hdr.seed = bloom->seed;
+	hdr.flags = bloom->flags;
+	size = bloom->nblocks * RSPAMD_BLOOM_BLOCK_SIZE;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.new", path);
+	fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot create %s: %s", tmppath, strerror (errno));
+		return FALSE;
+	}
+
+	if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			write (fd, bloom->blocks, size) != (gssize)size) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot write %s: %s", tmppath, strerror (errno));
+		close (fd);
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	if (rename (tmppath, path) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot rename %s: %s", tmppath, strerror (errno));
+		unlink (tmppath);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+rspamd_bloom_blocked_t *
+rspamd_bloom_blocked_load (const gchar *path, GError **err)
+{
+	struct rspamd_bloom_blocked_file_header hdr;
+	rspamd_bloom_blocked_t *bloom;
+	struct stat st;
+	gsize size;
+	gint fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			memcmp (hdr.magic, rspamd_bloom_blocked_magic,
+					sizeof (hdr.magic)) != 0 ||
+			hdr.nblocks == 0 || hdr.nblocks > G_MAXUINT32 ||
+			(guint64)st.st_size != sizeof (hdr) +
+					hdr.nblocks * RSPAMD_BLOOM_BLOCK_SIZE) {
+		g_set_error (err, rspamd_bloom_quark (), EINVAL,
+				"%s is not a valid blocked bloom filter", path);
+		close (fd);
+
+		return NULL;
+	}
+
+	size = hdr.nblocks * RSPAMD_BLOOM_BLOCK_SIZE;
+	bloom = g_malloc0 (sizeof (*bloom));
+	bloom->nblocks = hdr.nblocks;
+	bloom->seed = hdr.seed;
+	bloom->flags = hdr.flags;
+	bloom->blocks = rspamd_bloom_blocked_alloc (hdr.nblocks);
+
+	if (read (fd, bloom->blocks, size) != (gssize)size) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot read %s: %s", path, strerror (errno));
+		close (fd);
+		rspamd_bloom_blocked_destroy (bloom);
+
+		return NULL;
+	}
+
+	close (fd);
+
+	return bloom;
+}
@@ -45,4 +45,102 @@ gboolean rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s);
  */
 gboolean rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s);
 
+/*
+ * Add binary data of the specified length to bloom filter
+ */
+gboolean rspamd_bloom_add_buf (rspamd_bloom_filter_t * bloom,
+		const void *buf, gsize len);
+
+/*
+ * Check whether binary data is in bloom filter (false positives are possible)
+ */
+gboolean rspamd_bloom_check_buf (rspamd_bloom_filter_t * bloom,
+		const void *buf, gsize len);
+
+/*
+ * Save bloom filter to the specified file, the file is replaced atomically
+ */
+gboolean rspamd_bloom_save (rspamd_bloom_filter_t * bloom, const gchar *path,
+		GError **err);
+
+/*
+ * Load bloom filter saved by `rspamd_bloom_save`
+ */
+rspamd_bloom_filter_t * rspamd_bloom_load (const gchar *path, GError **err);
+
+/*
+ * Blocked bloom filter: all bits of an element are placed in a single cache
+ * line, so each operation touches one block of memory and requires one hash
+ * calculation. Each block consists of 8 words of 64 bits and an element sets
+ * one bit in each word (or increments one of 16 counters of 4 bits in each
+ * word for counting filters)
+ */
+#define RSPAMD_BLOOM_BLOCK_SIZE 64
+
+enum rspamd_bloom_blocked_flags {
+	RSPAMD_BLOOM_BLOCKED_DEFAULT = 0,
+	/* Use counters to allow deletion (4 times more memory) */
+	RSPAMD_BLOOM_BLOCKED_COUNTING = (1u << 0),
+};
+
+typedef struct rspamd_bloom_blocked_s {
+	guint64 nblocks;
+	guint64 seed;
+	gint flags;
+	guint64 *blocks;
+} rspamd_bloom_blocked_t;
+
+/*
+ * Create new blocked bloom filter
+ * @param nelts expected number of elements
+ * @param bits_per_elt number of bits per element (e.g. 16 bits give about
+ * 0.1% of false positives)
+ * @param flags flags from `enum rspamd_bloom_blocked_flags`
+ */
+rspamd_bloom_blocked_t * rspamd_bloom_blocked_create (gsize nelts,
+		guint bits_per_elt, gint flags);
+
+/*
+ * Destroy blocked bloom filter
+ */
+void rspamd_bloom_blocked_destroy (rspamd_bloom_blocked_t *bloom);
+
+/*
+ * Add binary data of the specified length to blocked bloom filter
+ */
+void rspamd_bloom_blocked_add (rspamd_bloom_blocked_t *bloom,
+		const void *buf, gsize len);
+
+/*
+ * Delete binary data from blocked bloom filter, returns FALSE if the filter
+ * is not counting or data has not been added
+ */
+gboolean rspamd_bloom_blocked_del (rspamd_bloom_blocked_t *bloom,
+		const void *buf, gsize len);
+
+/*
+ * Check whether binary data is in blocked bloom filter (false positives are possible)
+ */
+gboolean rspamd_bloom_blocked_check (rspamd_bloom_blocked_t *bloom,
+		const void *buf, gsize len);
+
+/*
+ * Returns number of elements the filter has been created for (restored from
+ * size for the loaded filters)
+ */
+gsize rspamd_bloom_blocked_capacity (rspamd_bloom_blocked_t *bloom,
+		guint bits_per_elt);
+
+/*
+ * Save blocked bloom filter to the specified file, the file is replaced atomically
+ */
+gboolean rspamd_bloom_blocked_save (rspamd_bloom_blocked_t *bloom,
+		const gchar *path, GError **err);
+
+/*
+ * Load blocked bloom filter saved by `rspamd_bloom_blocked_save`
+ */
+rspamd_bloom_blocked_t * rspamd_bloom_blocked_load (const gchar *path,
+		GError **err);
+
 #endif
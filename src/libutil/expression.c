@@ -22,7 +22,6 @@
 #include "ottery.h"
 
 #define RSPAMD_EXPR_FLAG_NEGATE (1 << 0)
-#define RSPAMD_EXPR_FLAG_PROCESSED (1 << 1)
 
 #define MIN_RESORT_EVALS 50
 #define MAX_RESORT_EVALS 150
@@ -44,15 +43,37 @@ struct rspamd_expression_elt {
 		} lim;
 	} p;
 	gint flags;
-	gint value;
 	gint priority;
 };
 
+/*
+ * AST is compiled to a postfix program: each operation node is represented by
+ * its operands programs each followed by an instruction that folds operand
+ * into the accumulator of the node. Folding instruction jumps to the end of
+ * the node's program when the rest of operands could not change its value.
+ */
+enum rspamd_expression_insn_type {
+	INSN_ATOM = 0,
+	INSN_CONST,
+	INSN_OP_FIRST,
+	INSN_OP_NEXT
+};
+
+struct rspamd_expression_insn {
+	enum rspamd_expression_insn_type type;
+	struct rspamd_expression_elt *elt;
+	struct rspamd_expression_elt *parelt;
+	gint val;               /**< limit for operations or constant value */
+	guint jump;             /**< offset of the first instruction after node */
+};
+
 struct rspamd_expression {
 	const struct rspamd_atom_subr *subr;
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *insns;
+	guint max_stack;
 	guint next_resort;
 	guint evals;
 };
@@ -356,7 +377,13 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 
 		g_array_free (expr->expressions, TRUE);
 		g_ptr_array_free (expr->expression_stack, TRUE);
-		g_node_destroy (expr->ast);
+
+		if (expr->insns) {
+			g_array_free (expr->insns, TRUE);
+		}
+		if (expr->ast) {
+			g_node_destroy (expr->ast);
+		}
 	}
 }
 
@@ -551,6 +578,90 @@ rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 	return n;
 }
 
+static void
+rspamd_ast_compile_node (struct rspamd_expression *expr, GNode *node,
+		guint depth)
+{
+	struct rspamd_expression_elt *elt = node->data, *celt, *parelt = NULL;
+	struct rspamd_expression_insn insn, *pinsn;
+	GNode *cld;
+	gint lim = G_MININT;
+	guint start, i, nops = 0;
+
+	memset (&insn, 0, sizeof (insn));
+
+	if (depth + 1 > expr->max_stack) {
+		expr->max_stack = depth + 1;
+	}
+
+	switch (elt->type) {
+	case ELT_ATOM:
+		insn.type = INSN_ATOM;
+		insn.elt = elt;
+		g_array_append_val (expr->insns, insn);
+		break;
+	case ELT_LIMIT:
+		insn.type = INSN_CONST;
+		insn.val = elt->p.lim.val;
+		g_array_append_val (expr->insns, insn);
+		break;
+	case ELT_OP:
+		g_assert (node->children != NULL);
+		start = expr->insns->len;
+
+		/* Limit is defined either by the parent or by the node itself */
+		if (node->parent) {
+			parelt = node->parent->data;
+			celt = node->parent->children->data;
+
+			if (celt->type == ELT_LIMIT) {
+				lim = celt->p.lim.val;
+			}
+		}
+
+		DL_FOREACH (node->children, cld) {
+			celt = cld->data;
+
+			if (celt->type == ELT_LIMIT) {
+				lim = celt->p.lim.val;
+				continue;
+			}
+
+			/* The accumulator is on the stack after the first operand */
+			rspamd_ast_compile_node (expr, cld, nops > 0 ? depth + 1 : depth);
+			insn.type = nops > 0 ? INSN_OP_NEXT : INSN_OP_FIRST;
+			insn.elt = elt;
+			insn.parelt = parelt;
+			insn.val = lim;
+			g_array_append_val (expr->insns, insn);
+			nops ++;
+		}
+
+		if (nops == 0) {
+			insn.type = INSN_CONST;
+			insn.val = G_MININT;
+			g_array_append_val (expr->insns, insn);
+		}
+
+		for (i = start; i < expr->insns->len; i ++) {
+			pinsn = &g_array_index (expr->insns, struct rspamd_expression_insn, i);
+
+			if (pinsn->elt == elt && pinsn->type != INSN_ATOM) {
+				pinsn->jump = expr->insns->len;
+			}
+		}
+		break;
+	}
+}
+
+static void
+rspamd_ast_compile (struct rspamd_expression *expr)
+{
+	g_array_set_size (expr->insns, 0);
+	expr->max_stack = 0;
+	rspamd_ast_compile_node (expr, expr->ast, 0);
+}
+
 gboolean
 rspamd_parse_expression (const gchar *line, gsize len,
 		const struct rspamd_atom_subr *subr, gpointer subr_data,
@@ -590,6 +701,9 @@ rspamd_parse_expression (const gchar *line, gsize len,
 			sizeof (struct rspamd_expression_elt));
 	operand_stack = g_ptr_array_sized_new (32);
 	e->ast = NULL;
+	e->insns = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_expression_insn));
+	e->max_stack = 0;
 	e->expression_stack = g_ptr_array_sized_new (32);
 	e->subr = subr;
 	e->evals = 0;
@@ -843,6 +957,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	/* Now set less expensive branches to be evaluated first */
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
+	rspamd_ast_compile (e);
 
 	if (target) {
 		*target = e;
@@ -964,110 +1079,89 @@ rspamd_ast_do_op (struct rspamd_expression_elt *elt, gint val,
 }
 
 static gint
-rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node,
-		gpointer data, GPtrArray *track)
+rspamd_ast_process_atom (struct rspamd_expression *expr,
+		struct rspamd_expression_elt *elt, gpointer data, GPtrArray *track)
 {
-	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
-	GNode *cld;
-	gint acc = G_MININT, lim = G_MININT, val;
+	gint val;
 	gdouble t1, t2;
 	gboolean calc_ticks = FALSE;
 
-	elt = node->data;
-
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
-
-			/*
-			 * Sometimes get ticks for this expression. 'Sometimes' here means
-			 * that we get lowest 5 bits of the counter `evals` and 5 bits
-			 * of some shifted address to provide some sort of jittering for
-			 * ticks evaluation
-			 */
-			if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
-				t1 = rspamd_get_ticks ();
-			}
+	/*
+	 * Sometimes get ticks for this expression. 'Sometimes' here means
+	 * that we get lowest 5 bits of the counter `evals` and 5 bits
+	 * of some shifted address to provide some sort of jittering for
+	 * ticks evaluation
+	 */
+	if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (elt) >> 4 & 0x1F)) {
+		calc_ticks = TRUE;
+		t1 = rspamd_get_ticks ();
+	}
 
-			elt->value = expr->subr->process (data, elt->p.atom);
+	val = expr->subr->process (data, elt->p.atom);
 
-			if (elt->value) {
-				elt->p.atom->hits ++;
+	if (val) {
+		elt->p.atom->hits ++;
 
-				if (track) {
-					g_ptr_array_add (track, elt->p.atom);
-				}
-			}
-
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks ();
-				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
-						(expr->evals);
-			}
-
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
+		if (track) {
+			g_ptr_array_add (track, elt->p.atom);
 		}
+	}
 
-		return elt->value;
-		break;
-	case ELT_LIMIT:
-
-		return elt->p.lim.val;
-		break;
-	case ELT_OP:
-		g_assert (node->children != NULL);
-		cld = node->children;
-
-		/* Try to find limit at the parent node */
-		if (node->parent) {
-			parelt = node->parent->data;
-			celt = node->parent->children->data;
+	if (calc_ticks) {
+		t2 = rspamd_get_ticks ();
+		elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
+				(expr->evals);
+	}
 
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim.val;
-			}
-		}
+	return val;
+}
 
-		DL_FOREACH (node->children, cld) {
-			celt = cld->data;
+static gint
+rspamd_ast_process (struct rspamd_expression *expr, gint flags,
+		gpointer data, GPtrArray *track)
+{
+	struct rspamd_expression_insn *insn;
+	gint *stack, val;
+	guint i = 0, sp = 0;
 
-			/* Save limit if we've found it */
-			if (celt->type == ELT_LIMIT) {
-				lim = celt->p.lim.val;
-				continue;
-			}
+	stack = g_alloca (expr->max_stack * sizeof (*stack));
 
-			val = rspamd_ast_process_node (expr, flags, cld, data, track);
+	while (i < expr->insns->len) {
+		insn = &g_array_index (expr->insns, struct rspamd_expression_insn, i);
 
-			if (acc == G_MININT) {
-				acc = rspamd_ast_do_op (elt, val, 0, lim, TRUE);
-			}
-			else {
-				acc = rspamd_ast_do_op (elt, val, acc, lim, FALSE);
-			}
+		switch (insn->type) {
+		case INSN_ATOM:
+			stack[sp ++] = rspamd_ast_process_atom (expr, insn->elt, data, track);
+			break;
+		case INSN_CONST:
+			stack[sp ++] = insn->val;
+			break;
+		case INSN_OP_FIRST:
+			stack[sp - 1] = rspamd_ast_do_op (insn->elt, stack[sp - 1], 0,
+					insn->val, TRUE);
+			break;
+		case INSN_OP_NEXT:
+			val = stack[-- sp];
+			stack[sp - 1] = rspamd_ast_do_op (insn->elt, val, stack[sp - 1],
+					insn->val, FALSE);
+			break;
+		}
 
-			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-				if (rspamd_ast_node_done (elt, parelt, acc, lim)) {
-					return acc;
-				}
-			}
+		if (insn->type >= INSN_OP_FIRST &&
+				!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+				rspamd_ast_node_done (insn->elt, insn->parelt, stack[sp - 1],
+						insn->val)) {
+			/* Skip the rest of operands */
+			i = insn->jump;
+		}
+		else {
+			i ++;
 		}
-		break;
 	}
 
-	return acc;
-}
-
-static gboolean
-rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
-{
-	struct rspamd_expression_elt *elt = n->data;
+	g_assert (sp == 1);
 
-	elt->value = 0;
-	elt->flags = 0;
-
-	return FALSE;
+	return stack[0];
 }
 
 gint
@@ -1080,11 +1174,7 @@ rspamd_process_expression_track (struct rspamd_expression *expr, gint flags,
 	/* Ensure that stack is empty at this point */
 	g_assert (expr->expression_stack->len == 0);
 
-	ret = rspamd_ast_process_node (expr, flags, expr->ast, data, track);
-
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+	ret = rspamd_ast_process (expr, flags, data, track);
 
 	expr->evals ++;
 
@@ -1099,6 +1189,7 @@ rspamd_process_expression_track (struct rspamd_expression *expr, gint flags,
 		/* Now set less expensive branches to be evaluated first */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 				rspamd_ast_resort_traverse, NULL);
+		rspamd_ast_compile (expr);
 	}
 
 	return ret;
@@ -19,68 +19,181 @@
 
 /**
  * LRU hashing
+ *
+ * Elements are stored in a dense array and indexed by an open addressing
+ * table of array offsets (linear probing with backward shift deletion),
+ * so both lookup and insertion are O(1). Eviction uses CLOCK algorithm:
+ * the hand walks the elements array skipping (and clearing) referenced
+ * elements and evicts the first expired or unreferenced one.
  */
 
-static const guint expire_aggressive_count = 10;
+static const guint lru_initial_size = 16;
 
 struct rspamd_lru_hash_s {
 	guint maxsize;
+	guint nelts;
+	guint eltsize;
+	guint nbuckets;
+	guint hand;
 	GDestroyNotify value_destroy;
 	GDestroyNotify key_destroy;
-	struct rspamd_min_heap *heap;
-	GHashTable *tbl;
+	GHashFunc hfunc;
+	GEqualFunc eqfunc;
+	rspamd_lru_element_t *elts;
+	/* Offset in elts plus one, zero means empty bucket */
+	guint32 *buckets;
 };
 
 static void
-rspamd_lru_destroy_node (gpointer value)
+rspamd_lru_hash_rebuild (rspamd_lru_hash_t *hash, guint eltsize)
 {
-	rspamd_lru_element_t *elt = (rspamd_lru_element_t *)value;
+	guint i, b, mask, nbuckets = 2;
+
+	while (nbuckets < eltsize * 2) {
+		nbuckets <<= 1;
+	}
+
+	hash->elts = g_realloc (hash->elts, eltsize * sizeof (*hash->elts));
+	hash->eltsize = eltsize;
+
+	if (nbuckets != hash->nbuckets) {
+		g_free (hash->buckets);
+		hash->buckets = g_malloc0 (nbuckets * sizeof (*hash->buckets));
+		hash->nbuckets = nbuckets;
+		mask = nbuckets - 1;
 
-	if (elt) {
-		if (elt->hash && elt->hash->key_destroy) {
-			elt->hash->key_destroy (elt->key);
+		for (i = 0; i < hash->nelts; i ++) {
+			b = hash->elts[i].hv & mask;
+
+			while (hash->buckets[b] != 0) {
+				b = (b + 1) & mask;
+			}
+
+			hash->buckets[b] = i + 1;
 		}
-		if (elt->hash && elt->hash->value_destroy) {
-			elt->hash->value_destroy (elt->data);
+	}
+}
+
+/*
+ * Returns offset of element with the specified key or -1, in the latter case
+ * `pbucket` is set to the empty bucket where the key should be placed
+ */
+static gint
+rspamd_lru_hash_find (rspamd_lru_hash_t *hash, gconstpointer key, guint hv,
+		guint *pbucket)
+{
+	guint b, mask = hash->nbuckets - 1;
+	rspamd_lru_element_t *elt;
+
+	b = hv & mask;
+
+	while (hash->buckets[b] != 0) {
+		elt = &hash->elts[hash->buckets[b] - 1];
+
+		if (elt->hv == hv && hash->eqfunc (elt->key, key)) {
+			*pbucket = b;
+			return hash->buckets[b] - 1;
 		}
 
-		g_slice_free1 (sizeof (*elt), elt);
+		b = (b + 1) & mask;
 	}
+
+	*pbucket = b;
+
+	return -1;
 }
 
-static inline guint
-rspamd_lru_priority (guint ttl, guint usages)
+static guint
+rspamd_lru_hash_bucket (rspamd_lru_hash_t *hash, guint idx)
 {
-	/* 1 day */
-	static const  guint max_ttl = 3600 * 24;
+	guint b, mask = hash->nbuckets - 1;
+
+	b = hash->elts[idx].hv & mask;
 
-	if (ttl > 0 && usages > 0) {
-		return G_MAXUINT / (MIN (max_ttl, ttl) * usages);
+	while (hash->buckets[b] != idx + 1) {
+		b = (b + 1) & mask;
 	}
 
-	return G_MAXUINT;
+	return b;
 }
 
-static rspamd_lru_element_t *
-rspamd_lru_create_node (rspamd_lru_hash_t *hash,
-	gpointer key,
-	gpointer value,
-	time_t now,
-	guint ttl)
+static void
+rspamd_lru_hash_remove_elt (rspamd_lru_hash_t *hash, guint idx)
 {
-	rspamd_lru_element_t *node;
-
-	node = g_slice_alloc (sizeof (rspamd_lru_element_t));
-	node->data = value;
-	node->key = key;
-	node->ttl = ttl;
-	node->helt.pri = now;
-	node->hash = hash;
-	node->usages = 1;
-	node->storage = now;
-	node->helt.pri = rspamd_lru_priority (ttl, 1);
-
-	return node;
+	guint b, j, ideal, mask = hash->nbuckets - 1, last;
+	rspamd_lru_element_t *elt = &hash->elts[idx];
+
+	if (hash->key_destroy) {
+		hash->key_destroy (elt->key);
+	}
+	if (hash->value_destroy) {
+		hash->value_destroy (elt->data);
+	}
+
+	/* Free bucket and shift the following buckets of the same cluster back */
+	b = rspamd_lru_hash_bucket (hash, idx);
+	hash->buckets[b] = 0;
+	j = b;
+
+	for (;;) {
+		j = (j + 1) & mask;
+
+		if (hash->buckets[j] == 0) {
+			break;
+		}
+
+		ideal = hash->elts[hash->buckets[j] - 1].hv & mask;
+
+		if (((j - ideal) & mask) >= ((j - b) & mask)) {
+			hash->buckets[b] = hash->buckets[j];
+			hash->buckets[j] = 0;
+			b = j;
+		}
+	}
+
+	/* Move the last element to the freed place */
+	last = hash->nelts - 1;
+
+	if (idx != last) {
+		b = rspamd_lru_hash_bucket (hash, last);
+		memcpy (elt, &hash->elts[last], sizeof (*elt));
+		hash->buckets[b] = idx + 1;
+	}
+
+	hash->nelts --;
+
+	if (hash->hand >= hash->nelts) {
+		hash->hand = 0;
+	}
+}
+
+static inline gboolean
+rspamd_lru_hash_expired (rspamd_lru_element_t *elt, time_t now)
+{
+	return elt->ttl != 0 && ((guint)now) - elt->storage > elt->ttl;
+}
+
+static void
+rspamd_lru_hash_evict (rspamd_lru_hash_t *hash, time_t now)
+{
+	rspamd_lru_element_t *elt;
+
+	/* Terminates in at most two passes as referenced bits are cleared */
+	while (hash->nelts > 0) {
+		if (hash->hand >= hash->nelts) {
+			hash->hand = 0;
+		}
+
+		elt = &hash->elts[hash->hand];
+
+		if (!elt->referenced || rspamd_lru_hash_expired (elt, now)) {
+			rspamd_lru_hash_remove_elt (hash, hash->hand);
+			break;
+		}
+
+		elt->referenced = FALSE;
+		hash->hand ++;
+	}
 }
 
 rspamd_lru_hash_t *
@@ -93,12 +206,14 @@ rspamd_lru_hash_new_full (
 {
 	rspamd_lru_hash_t *new;
 
-	new = g_slice_alloc (sizeof (rspamd_lru_hash_t));
-	new->tbl = g_hash_table_new_full (hf, cmpf, NULL, rspamd_lru_destroy_node);
-	new->heap = rspamd_min_heap_create (maxsize);
-	new->maxsize = maxsize;
+	new = g_slice_alloc0 (sizeof (rspamd_lru_hash_t));
+	new->maxsize = maxsize > 0 ? maxsize : 0;
 	new->value_destroy = value_destroy;
 	new->key_destroy = key_destroy;
+	new->hfunc = hf;
+	new->eqfunc = cmpf;
+	rspamd_lru_hash_rebuild (new, new->maxsize > 0 ?
+			MIN (new->maxsize, lru_initial_size) : lru_initial_size);
 
 	return new;
 }
@@ -118,19 +233,21 @@ gpointer
 rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash, gconstpointer key, time_t now)
 {
 	rspamd_lru_element_t *res;
+	guint b;
+	gint idx;
 
-	res = g_hash_table_lookup (hash->tbl, key);
-	if (res != NULL) {
-		if (res->ttl != 0) {
-			if (((guint)now) - res->storage > res->ttl) {
-				rspamd_min_heap_remove_elt (hash->heap, &res->helt);
-				g_hash_table_remove (hash->tbl, key);
-				return NULL;
-			}
+	idx = rspamd_lru_hash_find (hash, key, hash->hfunc (key), &b);
+
+	if (idx != -1) {
+		res = &hash->elts[idx];
+
+		if (rspamd_lru_hash_expired (res, now)) {
+			rspamd_lru_hash_remove_elt (hash, idx);
+			return NULL;
 		}
 
-		rspamd_min_heap_update_elt (hash->heap, &res->helt,
-				rspamd_lru_priority (res->ttl, ++res->usages));
+		res->referenced = TRUE;
+		res->usages ++;
 
 		return res->data;
 	}
@@ -143,47 +260,88 @@ rspamd_lru_hash_insert (rspamd_lru_hash_t *hash, gpointer key, gpointer value,
 	time_t now, guint ttl)
 {
 	rspamd_lru_element_t *res;
-	guint i;
+	guint b, hv, newsize;
+	gint idx;
 
-	res = g_hash_table_lookup (hash->tbl, key);
+	hv = hash->hfunc (key);
+	idx = rspamd_lru_hash_find (hash, key, hv, &b);
 
-	if (res != NULL) {
-		rspamd_min_heap_remove_elt (hash->heap, &res->helt);
-		g_hash_table_remove (hash->tbl, key);
+	if (idx != -1) {
+		/* Replace element in place */
+		res = &hash->elts[idx];
+
+		if (hash->key_destroy && res->key != key) {
+			hash->key_destroy (res->key);
+		}
+		if (hash->value_destroy && res->data != value) {
+			hash->value_destroy (res->data);
+		}
 	}
 	else {
-		if (hash->maxsize > 0 &&
-				g_hash_table_size (hash->tbl) >= hash->maxsize) {
-
-			for (i = 0; i < MIN (hash->maxsize, expire_aggressive_count); i ++) {
-				res = (rspamd_lru_element_t *)rspamd_min_heap_pop (hash->heap);
-
-				if (res) {
-					g_hash_table_remove (hash->tbl, res->key);
-				}
-				else {
-					break;
-				}
+		if (hash->maxsize > 0 && hash->nelts >= hash->maxsize) {
+			rspamd_lru_hash_evict (hash, now);
+			/* Buckets might be shifted */
+			rspamd_lru_hash_find (hash, key, hv, &b);
+		}
+		else if (hash->nelts >= hash->eltsize) {
+			newsize = hash->eltsize * 2;
+
+			if (hash->maxsize > 0) {
+				newsize = MIN (newsize, hash->maxsize);
 			}
+
+			rspamd_lru_hash_rebuild (hash, newsize);
+			rspamd_lru_hash_find (hash, key, hv, &b);
 		}
+
+		res = &hash->elts[hash->nelts];
+		hash->buckets[b] = ++hash->nelts;
+		res->hv = hv;
 	}
 
-	res = rspamd_lru_create_node (hash, key, value, now, ttl);
-	g_hash_table_insert (hash->tbl, key, res);
-	rspamd_min_heap_push (hash->heap, &res->helt);
+	res->key = key;
+	res->data = value;
+	res->ttl = ttl;
+	res->usages = 1;
+	res->storage = now;
+	res->referenced = FALSE;
 }
 
 void
 rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
 {
-	rspamd_min_heap_destroy (hash->heap);
-	g_hash_table_unref (hash->tbl);
+	guint i;
+
+	for (i = 0; i < hash->nelts; i ++) {
+		if (hash->key_destroy) {
+			hash->key_destroy (hash->elts[i].key);
+		}
+		if (hash->value_destroy) {
+			hash->value_destroy (hash->elts[i].data);
+		}
+	}
+
+	g_free (hash->elts);
+	g_free (hash->buckets);
 	g_slice_free1 (sizeof (rspamd_lru_hash_t), hash);
 }
 
+gint
+rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, gint it, gpointer *k,
+		gpointer *v)
+{
+	if (it < 0 || (guint)it >= hash->nelts) {
+		return -1;
+	}
+
+	*k = hash->elts[it].key;
+	*v = hash->elts[it].data;
+
+	return it + 1;
+}
 
-GHashTable *
-rspamd_lru_hash_get_htable (rspamd_lru_hash_t *hash)
+guint
+rspamd_lru_hash_size (rspamd_lru_hash_t *hash)
 {
-	return hash->tbl;
+	return hash->nelts;
 }
@@ -8,19 +8,18 @@
 #define RSPAMD_HASH_H
 
 #include "config.h"
-#include "heap.h"
 
 struct rspamd_lru_hash_s;
 typedef struct rspamd_lru_hash_s rspamd_lru_hash_t;
 
 typedef struct rspamd_lru_element_s {
-	struct rspamd_min_heap_elt helt;
 	guint ttl;
 	guint usages;
 	time_t storage;
 	gpointer data;
 	gpointer key;
-	rspamd_lru_hash_t *hash;
+	guint hv;               /**< hash value of key */
+	gboolean referenced;    /**< element was used since the last clock pass */
 } rspamd_lru_element_t;
 
 
@@ -82,9 +81,21 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 void rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash);
 
 /**
- * Get hash table for this lru hash (use rspamd_lru_element_t as data)
+ * Iterate over elements of lru hash
+ * @param hash hash object
+ * @param it iterator, must be 0 for the first call
+ * @param k output key
+ * @param v output value
+ * @return next value of iterator or -1 if there are no more elements
+ */
+gint rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, gint it, gpointer *k,
+		gpointer *v);
+
+/**
+ * Returns number of elements in lru hash
+ * @param hash hash object
  */
-GHashTable *rspamd_lru_hash_get_htable (rspamd_lru_hash_t *hash);
+guint rspamd_lru_hash_size (rspamd_lru_hash_t *hash);
 #endif
 
 /*
@@ -0,0 +1,272 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "libutil/hs_shared.h"
+#include "libutil/util.h"
+#include "libutil/printf.h"
+#include "libutil/logger.h"
+#include "xxhash.h"
+#include "unix-std.h"
+
+#ifdef WITH_HYPERSCAN
+
+struct rspamd_hs_scratch_cache {
+	GPtrArray *free;
+	guint gen;
+};
+
+static void rspamd_hs_scratch_cache_dtor (gpointer p);
+
+/* Prototype scratch that covers all registered databases */
+static hs_scratch_t *hs_scratch_proto = NULL;
+/* Changed each time when prototype grows */
+static guint hs_scratch_gen = 0;
+static GMutex hs_scratch_lock;
+/* Per thread scratches cloned from prototype and not currently used */
+static GPrivate hs_scratch_cache = G_PRIVATE_INIT (rspamd_hs_scratch_cache_dtor);
+
+static gboolean
+rspamd_hs_shared_create (const gchar *path, const gchar *serialized,
+		gsize len, gsize dblen)
+{
+	gchar tmp[PATH_MAX];
+	gpointer map;
+	gint fd, ret;
+
+	/* Each process writes its own temporary file and then renames it */
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.%P.tmp", path, getpid ());
+	fd = rspamd_file_xopen (tmp, O_RDWR|O_CREAT|O_EXCL, 00644);
+
+	if (fd == -1) {
+		msg_err ("cannot create %s: %s", tmp, strerror (errno));
+		return FALSE;
+	}
+
+	if (ftruncate (fd, dblen) == -1) {
+		msg_err ("cannot truncate %s to %z bytes: %s", tmp, dblen,
+				strerror (errno));
+		close (fd);
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, dblen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot mmap %s: %s", tmp, strerror (errno));
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	/* Hyperscan database has no pointers inside, so it could be relocated */
+	if ((ret = hs_deserialize_database_at (serialized, len, map))
+			!= HS_SUCCESS) {
+		msg_err ("cannot deserialize database to %s: %d", tmp, ret);
+		munmap (map, dblen);
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	munmap (map, dblen);
+
+	if (rename (tmp, path) == -1) {
+		msg_err ("cannot rename %s to %s: %s", tmp, path, strerror (errno));
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+hs_database_t *
+rspamd_hs_shared_map (const gchar *prefix,
+		const gchar *serialized, gsize len, gsize *maplen)
+{
+	gchar path[PATH_MAX];
+	size_t dblen;
+	gpointer map;
+	gsize flen;
+
+	g_assert (prefix != NULL);
+	g_assert (serialized != NULL);
+	g_assert (maplen != NULL);
+
+	if (hs_serialized_database_size (serialized, len, &dblen) != HS_SUCCESS) {
+		return NULL;
+	}
+
+	/*
+	 * Name of the file depends on the content, so it cannot be stale.
+	 * Processes bound to NUMA nodes map a replica of their node: pages of a
+	 * file are placed on the node of the process that has written it
+	 */
+	if (rspamd_numa_node () >= 0) {
+		rspamd_snprintf (path, sizeof (path), "%s.%xL.n%d.hsdb", prefix,
+				(guint64)XXH64 (serialized, len, 0xdeadbabe),
+				rspamd_numa_node ());
+	}
+	else {
+		rspamd_snprintf (path, sizeof (path), "%s.%xL.hsdb", prefix,
+				(guint64)XXH64 (serialized, len, 0xdeadbabe));
+	}
+	map = rspamd_file_xmap (path, PROT_READ, &flen);
+
+	if (map != NULL && flen != dblen) {
+		/* Broken file */
+		munmap (map, flen);
+		unlink (path);
+		map = NULL;
+	}
+
+	if (map == NULL) {
+		if (!rspamd_hs_shared_create (path, serialized, len, dblen)) {
+			return NULL;
+		}
+
+		map = rspamd_file_xmap (path, PROT_READ, &flen);
+
+		if (map == NULL) {
+			msg_err ("cannot map %s: %s", path, strerror (errno));
+			return NULL;
+		}
+	}
+
+	*maplen = flen;
+
+	return map;
+}
+
+void
+rspamd_hs_shared_unmap (hs_database_t *db, gsize maplen)
+{
+	if (db != NULL) {
+		munmap ((gpointer)db, maplen);
+	}
+}
+
+static void
+rspamd_hs_scratch_cache_flush (struct rspamd_hs_scratch_cache *cache)
+{
+	guint i;
+
+	for (i = 0; i < cache->free->len; i ++) {
+		hs_free_scratch (g_ptr_array_index (cache->free, i));
+	}
+
+	g_ptr_array_set_size (cache->free, 0);
+}
+
+static void
+rspamd_hs_scratch_cache_dtor (gpointer p)
+{
+	struct rspamd_hs_scratch_cache *cache = p;
+
+	rspamd_hs_scratch_cache_flush (cache);
+	g_ptr_array_free (cache->free, TRUE);
+	g_free (cache);
+}
+
+gboolean
+rspamd_hs_scratch_register (const hs_database_t *db)
+{
+	gboolean ret = TRUE;
+
+	g_assert (db != NULL);
+
+	g_mutex_lock (&hs_scratch_lock);
+
+	/* Existing scratch is reallocated merely if it is too small for db */
+	if (hs_alloc_scratch (db, &hs_scratch_proto) != HS_SUCCESS) {
+		msg_err ("cannot allocate hyperscan scratch");
+		ret = FALSE;
+	}
+	else {
+		hs_scratch_gen ++;
+	}
+
+	g_mutex_unlock (&hs_scratch_lock);
+
+	return ret;
+}
+
+hs_scratch_t *
+rspamd_hs_scratch_acquire (guint *pgen)
+{
+	struct rspamd_hs_scratch_cache *cache;
+	hs_scratch_t *scratch = NULL;
+	guint gen;
+
+	g_assert (pgen != NULL);
+
+	cache = g_private_get (&hs_scratch_cache);
+
+	if (cache == NULL) {
+		cache = g_malloc0 (sizeof (*cache));
+		cache->free = g_ptr_array_new ();
+		g_private_set (&hs_scratch_cache, cache);
+	}
+
+	g_mutex_lock (&hs_scratch_lock);
+	gen = hs_scratch_gen;
+
+	if (cache->gen != gen) {
+		/* Cached scratches could be too small for new databases */
+		rspamd_hs_scratch_cache_flush (cache);
+		cache->gen = gen;
+	}
+
+	if (cache->free->len > 0) {
+		scratch = g_ptr_array_remove_index_fast (cache->free,
+				cache->free->len - 1);
+	}
+	else if (hs_scratch_proto != NULL &&
+			hs_clone_scratch (hs_scratch_proto, &scratch) != HS_SUCCESS) {
+		msg_err ("cannot clone hyperscan scratch");
+		scratch = NULL;
+	}
+
+	g_mutex_unlock (&hs_scratch_lock);
+	*pgen = gen;
+
+	return scratch;
+}
+
+void
+rspamd_hs_scratch_release (hs_scratch_t *scratch, guint gen)
+{
+	struct rspamd_hs_scratch_cache *cache;
+
+	if (scratch == NULL) {
+		return;
+	}
+
+	cache = g_private_get (&hs_scratch_cache);
+
+	if (cache != NULL && cache->gen == gen) {
+		g_ptr_array_add (cache->free, scratch);
+	}
+	else {
+		/* Scratch has been acquired before prototype has grown */
+		hs_free_scratch (scratch);
+	}
+}
+
+#endif
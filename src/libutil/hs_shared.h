@@ -0,0 +1,81 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_HS_SHARED_H_
+#define SRC_LIBUTIL_HS_SHARED_H_
+
+#include "config.h"
+
+#ifdef WITH_HYPERSCAN
+#include "hs.h"
+
+/**
+ * @file hs_shared.h
+ *
+ * Hyperscan databases that are shared among processes: serialized database
+ * is deserialized once to a file named after its hash and this file is then
+ * mapped read only by all processes, so each process owns merely its scratch
+ *
+ * Scratch space is shared by all databases of a process as well: a single
+ * prototype scratch is grown to cover every registered database and scans
+ * acquire clones of it, so the number of scratches depends merely on the
+ * depth of nested scans and not on the number of databases
+ */
+
+/**
+ * Get hyperscan database shared through file `prefix`.<hash>.hsdb, processes
+ * bound to a NUMA node use `prefix`.<hash>.n<node>.hsdb instead
+ * @param prefix prefix of the shared file path
+ * @param serialized serialized database
+ * @param len length of serialized database
+ * @param maplen output length of mapping
+ * @return database or NULL in case of error
+ */
+hs_database_t *rspamd_hs_shared_map (const gchar *prefix,
+		const gchar *serialized, gsize len, gsize *maplen);
+
+/**
+ * Unmap shared database obtained by `rspamd_hs_shared_map`
+ * @param db database
+ * @param maplen length of mapping
+ */
+void rspamd_hs_shared_unmap (hs_database_t *db, gsize maplen);
+
+/**
+ * Grow shared scratch to be suitable for scanning of `db`
+ * @param db database
+ * @return TRUE if scratch has been allocated
+ */
+gboolean rspamd_hs_scratch_register (const hs_database_t *db);
+
+/**
+ * Acquire scratch that is suitable for all registered databases, it must be
+ * released by `rspamd_hs_scratch_release` when scan is finished. Scans
+ * started from callbacks of other scans obtain distinct scratches.
+ * @param pgen output generation of scratch to be passed to release
+ * @return scratch or NULL if no databases are registered
+ */
+hs_scratch_t *rspamd_hs_scratch_acquire (guint *pgen);
+
+/**
+ * Release scratch obtained by `rspamd_hs_scratch_acquire`
+ * @param scratch scratch
+ * @param gen generation returned on acquire
+ */
+void rspamd_hs_scratch_release (hs_scratch_t *scratch, guint gen);
+
+#endif
+
+#endif /* SRC_LIBUTIL_HS_SHARED_H_ */
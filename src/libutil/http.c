@@ -49,8 +49,28 @@ struct rspamd_http_connection_private {
 	guint outlen;
 	gsize wr_pos;
 	gsize wr_total;
+	rspamd_fstring_t *pipelined; /* Data read after the end of request */
+	gboolean keepalive; /* Reply is read and socket could be reused */
+	gboolean replied; /* Some data of reply has been read */
 };
 
+struct rspamd_http_keepalive_elt {
+	gint fd;
+	struct event ev;
+	GQueue *idle;
+	GList *link;
+};
+
+struct rspamd_http_keepalive_pool {
+	GHashTable *idle; /* peer -> GQueue of idle sockets */
+	pid_t pid;
+};
+
+#define RSPAMD_HTTP_KEEPALIVE_IDLE_MAX 8
+#define RSPAMD_HTTP_KEEPALIVE_TIMEOUT 30.0
+
+static struct rspamd_http_keepalive_pool keepalive_pool;
+
 enum http_magic_type {
 	HTTP_MAGIC_PLAIN = 0,
 	HTTP_MAGIC_HTML,
@@ -604,6 +624,11 @@ rspamd_http_on_headers_complete (http_parser * parser)
 	if (parser->flags & F_SPAMC) {
 		priv->msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
+	else if (http_should_keep_alive (parser) &&
+			(conn->type == RSPAMD_HTTP_SERVER ||
+			(conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE))) {
+		priv->msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
 
 	priv->msg->body_buf.begin = priv->msg->body->str;
 	priv->msg->method = parser->method;
@@ -621,7 +646,13 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 
 	priv = conn->priv;
 
-	priv->msg->body = rspamd_fstring_append (priv->msg->body, at, length);
+	if (at == priv->msg->body->str + priv->msg->body->len) {
+		/* Data has been read directly to the body */
+		priv->msg->body->len += length;
+	}
+	else {
+		priv->msg->body = rspamd_fstring_append (priv->msg->body, at, length);
+	}
 
 	/* Append might cause realloc */
 	priv->msg->body_buf.begin = priv->msg->body->str;
@@ -810,9 +841,21 @@ rspamd_http_on_message_complete (http_parser * parser)
 			event_del (&priv->ev);
 		}
 
+		if (conn->type == RSPAMD_HTTP_CLIENT &&
+				(priv->msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE)) {
+			/* The whole reply is read, so the socket could be reused */
+			priv->keepalive = TRUE;
+		}
+
 		rspamd_http_connection_ref (conn);
 		ret = conn->finish_handler (conn, priv->msg);
 		conn->finished = TRUE;
+
+		if (conn->type == RSPAMD_HTTP_SERVER) {
+			/* Do not parse the next pipelined request to this message */
+			http_parser_pause (parser, 1);
+		}
+
 		rspamd_http_connection_unref (conn);
 	}
 
@@ -921,13 +964,46 @@ static gssize
 rspamd_http_try_read (gint fd,
 		struct rspamd_http_connection *conn,
 		struct rspamd_http_connection_private *priv,
-		struct _rspamd_http_privbuf *pbuf)
+		struct _rspamd_http_privbuf *pbuf,
+		const gchar **buf_ptr)
 {
 	gssize r;
-	rspamd_fstring_t *buf;
+	rspamd_fstring_t *buf, *body;
+	guint64 remain;
 
 	buf = priv->buf->data;
-	r = read (fd, buf->str, buf->allocated);
+	*buf_ptr = buf->str;
+	body = priv->msg ? priv->msg->body : NULL;
+	remain = priv->parser.content_length;
+
+	if (body != NULL && remain > 0 && remain != ULLONG_MAX &&
+			!(priv->parser.flags & F_CHUNKED) &&
+			body->allocated - body->len >= remain &&
+			(priv->pipelined == NULL || priv->pipelined->len == 0)) {
+		/*
+		 * Body is preallocated from Content-Length, so we read it directly to
+		 * the place where it should be: parser callback will not copy it
+		 */
+		r = read (fd, body->str + body->len, remain);
+
+		if (r > 0) {
+			*buf_ptr = body->str + body->len;
+		}
+
+		return r;
+	}
+
+	if (priv->pipelined != NULL && priv->pipelined->len > 0) {
+		/* Data of the next request that has been read with the previous one */
+		r = MIN (priv->pipelined->len, buf->allocated);
+		memcpy (buf->str, priv->pipelined->str, r);
+		memmove (priv->pipelined->str, priv->pipelined->str + r,
+				priv->pipelined->len - r);
+		priv->pipelined->len -= r;
+	}
+	else {
+		r = read (fd, buf->str, buf->allocated);
+	}
 
 	if (r <= 0) {
 		return r;
@@ -939,13 +1015,39 @@ rspamd_http_try_read (gint fd,
 	return r;
 }
 
+static gboolean
+rspamd_http_parse_data (struct rspamd_http_connection *conn,
+		struct rspamd_http_connection_private *priv,
+		const gchar *data, gsize len)
+{
+	gsize parsed;
+
+	parsed = http_parser_execute (&priv->parser, &priv->parser_cb, data, len);
+
+	if (HTTP_PARSER_ERRNO (&priv->parser) == HPE_PAUSED) {
+		/* Request is complete, save the rest for the next one */
+		if (parsed < len) {
+			if (priv->pipelined == NULL) {
+				priv->pipelined = rspamd_fstring_sized_new (len - parsed);
+			}
+
+			priv->pipelined = rspamd_fstring_append (priv->pipelined,
+					data + parsed, len - parsed);
+		}
+
+		return TRUE;
+	}
+
+	return parsed == len && priv->parser.http_errno == 0;
+}
+
 static void
 rspamd_http_event_handler (int fd, short what, gpointer ud)
 {
 	struct rspamd_http_connection *conn = (struct rspamd_http_connection *)ud;
 	struct rspamd_http_connection_private *priv;
 	struct _rspamd_http_privbuf *pbuf;
-	rspamd_fstring_t *buf;
+	const gchar *d;
 	gssize r;
 	GError *err;
 
@@ -953,14 +1055,14 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	pbuf = priv->buf;
 	REF_RETAIN (pbuf);
 	rspamd_http_connection_ref (conn);
-	buf = priv->buf->data;
 
 	if (what == EV_READ) {
-		r = rspamd_http_try_read (fd, conn, priv, pbuf);
+		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					buf->str, r) != (size_t)r || priv->parser.http_errno != 0) {
+			priv->replied = TRUE;
+
+			if (!rspamd_http_parse_data (conn, priv, d, r)) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -976,7 +1078,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		else if (r == 0) {
 			if (!conn->finished) {
 				err = g_error_new (HTTP_ERROR,
-						errno,
+						ECONNRESET,
 						"IO read error: unexpected EOF");
 				conn->error_handler (conn, err);
 				g_error_free (err);
@@ -1004,11 +1106,12 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	}
 	else if (what == EV_TIMEOUT) {
 		/* Let's try to read from the socket first */
-		r = rspamd_http_try_read (fd, conn, priv, pbuf);
+		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					buf->str, r) != (size_t)r || priv->parser.http_errno != 0) {
+			priv->replied = TRUE;
+
+			if (!rspamd_http_parse_data (conn, priv, d, r)) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -1180,6 +1283,9 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 		if (priv->peer_key) {
 			rspamd_pubkey_unref (priv->peer_key);
 		}
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
 
 		g_slice_free1 (sizeof (struct rspamd_http_connection_private), priv);
 	}
@@ -1200,7 +1306,16 @@ rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 		conn->type == RSPAMD_HTTP_SERVER ? HTTP_REQUEST : HTTP_RESPONSE);
 	priv->msg = req;
 
-	if (priv->peer_key) {
+	if (conn->type == RSPAMD_HTTP_SERVER) {
+		/* Each request of a reused connection defines its own peer */
+		if (priv->peer_key) {
+			rspamd_pubkey_unref (priv->peer_key);
+			priv->peer_key = NULL;
+		}
+
+		priv->encrypted = FALSE;
+	}
+	else if (priv->peer_key) {
 		priv->msg->peer_key = priv->peer_key;
 		priv->peer_key = NULL;
 		priv->encrypted = TRUE;
@@ -1229,6 +1344,11 @@ rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 		event_base_set (base, &priv->ev);
 	}
 	event_add (&priv->ev, priv->ptv);
+
+	if (priv->pipelined != NULL && priv->pipelined->len > 0) {
+		/* Next request has been already read */
+		event_active (&priv->ev, EV_READ, 0);
+	}
 }
 
 static void
@@ -1343,6 +1463,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	struct rspamd_http_header *hdr;
 	struct tm t, *ptm;
 	gchar datebuf[64], repbuf[512], *pbody;
+	const gchar *conn_hdr;
 	gint i, hdrcount, meth_len = 0, preludelen = 0;
 	gsize bodylen, enclen = 0;
 	rspamd_fstring_t *buf;
@@ -1355,6 +1476,8 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	conn->fd = fd;
 	conn->ud = ud;
 	priv->msg = msg;
+	priv->keepalive = FALSE;
+	priv->replied = FALSE;
 
 	if (timeout == NULL) {
 		priv->ptv = NULL;
@@ -1508,6 +1631,9 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				t.tm_hour,
 				t.tm_min,
 				t.tm_sec);
+			conn_hdr = (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) ?
+					"keep-alive" : "close";
+
 			if (mime_type == NULL) {
 				mime_type = encrypted ? "application/octet-stream" : "text/plain";
 			}
@@ -1515,13 +1641,14 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				/* Internal reply (encrypted) */
 				meth_len = rspamd_snprintf (repbuf, sizeof (repbuf),
 						"HTTP/1.1 %d %V\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: %s", /* NO \r\n at the end ! */
 						msg->code,
 						msg->status,
+						conn_hdr,
 						"rspamd/" RVERSION,
 						datebuf,
 						bodylen,
@@ -1529,23 +1656,25 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				enclen += meth_len;
 				/* External reply */
 				rspamd_printf_fstring (&buf, "HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
+						conn_hdr,
 						datebuf,
 						enclen);
 			}
 			else {
 				meth_len = rspamd_printf_fstring (&buf, "HTTP/1.1 %d %V\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: %s\r\n",
 						msg->code,
 						msg->status,
+						conn_hdr,
 						"rspamd/" RVERSION,
 						datebuf,
 						bodylen,
@@ -1564,22 +1693,28 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	}
 	else {
 		/* Format request */
+		conn_hdr = (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) ?
+				"keep-alive" : "close";
 		enclen += msg->url->len +
 				strlen (http_method_str (msg->method)) + 1 /* method + space */;
 		if (host == NULL && msg->host == NULL) {
 			/* Fallback to HTTP/1.0 */
 			if (encrypted) {
 				rspamd_printf_fstring (&buf, "%s %s HTTP/1.0\r\n"
+					"Connection: %s\r\n"
 					"Content-Length: %z\r\n",
 					"POST",
 					"/post",
+					conn_hdr,
 					enclen);
 			}
 			else {
 				rspamd_printf_fstring (&buf, "%s %V HTTP/1.0\r\n"
+					"Connection: %s\r\n"
 					"Content-Length: %z\r\n",
 					http_method_str (msg->method),
 					msg->url,
+					conn_hdr,
 					bodylen);
 			}
 		}
@@ -1587,21 +1722,23 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 			if (encrypted) {
 				if (host != NULL) {
 					rspamd_printf_fstring (&buf, "%s %s HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %s\r\n"
 									"Content-Length: %z\r\n",
 							"POST",
 							"/post",
+							conn_hdr,
 							host,
 							enclen);
 				}
 				else {
 					rspamd_printf_fstring (&buf, "%s %s HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %V\r\n"
 									"Content-Length: %z\r\n",
 							"POST",
 							"/post",
+							conn_hdr,
 							msg->host,
 							enclen);
 				}
@@ -1609,21 +1746,23 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 			else {
 				if (host != NULL) {
 					rspamd_printf_fstring (&buf, "%s %V HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %s\r\n"
 									"Content-Length: %z\r\n",
 							http_method_str (msg->method),
 							msg->url,
+							conn_hdr,
 							host,
 							bodylen);
 				}
 				else {
 					rspamd_printf_fstring (&buf, "%s %V HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %V\r\n"
 									"Content-Length: %z\r\n",
 							http_method_str (msg->method),
 							msg->url,
+							conn_hdr,
 							msg->host,
 							bodylen);
 				}
@@ -1846,6 +1985,57 @@ rspamd_http_message_free (struct rspamd_http_message *msg)
 	g_slice_free1 (sizeof (struct rspamd_http_message), msg);
 }
 
+struct rspamd_http_message *
+rspamd_http_message_copy (const struct rspamd_http_message *msg)
+{
+	struct rspamd_http_message *copy;
+	struct rspamd_http_header *hdr, *nhdr;
+
+	copy = rspamd_http_new_message (msg->type);
+
+	if (msg->url != NULL) {
+		copy->url = rspamd_fstring_assign (copy->url, msg->url->str,
+				msg->url->len);
+	}
+	if (msg->host != NULL) {
+		copy->host = rspamd_fstring_new_init (msg->host->str, msg->host->len);
+	}
+	if (msg->status != NULL) {
+		copy->status = rspamd_fstring_new_init (msg->status->str,
+				msg->status->len);
+	}
+	if (msg->body != NULL) {
+		copy->body = rspamd_fstring_new_init (msg->body->str, msg->body->len);
+	}
+	if (msg->peer_key != NULL) {
+		copy->peer_key = rspamd_pubkey_ref (msg->peer_key);
+	}
+
+	LL_FOREACH (msg->headers, hdr) {
+		nhdr = g_slice_alloc (sizeof (struct rspamd_http_header));
+		nhdr->combined = rspamd_fstring_new_init (hdr->combined->str,
+				hdr->combined->len);
+		nhdr->name = g_slice_alloc (sizeof (*nhdr->name));
+		nhdr->value = g_slice_alloc (sizeof (*nhdr->value));
+		nhdr->name->begin = nhdr->combined->str +
+				(hdr->name->begin - hdr->combined->str);
+		nhdr->name->len = hdr->name->len;
+		nhdr->value->begin = nhdr->combined->str +
+				(hdr->value->begin - hdr->combined->str);
+		nhdr->value->len = hdr->value->len;
+		DL_APPEND (copy->headers, nhdr);
+	}
+
+	copy->date = msg->date;
+	copy->last_modified = msg->last_modified;
+	copy->port = msg->port;
+	copy->code = msg->code;
+	copy->method = msg->method;
+	copy->flags = msg->flags;
+
+	return copy;
+}
+
 void
 rspamd_http_message_add_header (struct rspamd_http_message *msg,
 	const gchar *name,
@@ -2329,6 +2519,198 @@ rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn)
 	return FALSE;
 }
 
+static gchar *
+rspamd_http_keepalive_key (const rspamd_inet_addr_t *addr,
+		struct rspamd_cryptobox_pubkey *peer_key)
+{
+	gchar keybuf[256];
+
+	/* Peers are distinguished by address and short id of their public key */
+	rspamd_snprintf (keybuf, sizeof (keybuf), "%s:%d:%*xs",
+			rspamd_inet_address_to_string (addr),
+			(gint)rspamd_inet_address_get_port (addr),
+			peer_key ? RSPAMD_KEYPAIR_SHORT_ID_LEN : 0,
+			peer_key ? rspamd_pubkey_get_id (peer_key) : (const guchar *)"");
+
+	return g_strdup (keybuf);
+}
+
+static void
+rspamd_http_keepalive_queue_dtor (gpointer p)
+{
+	g_queue_free (p);
+}
+
+static GHashTable *
+rspamd_http_keepalive_idle (void)
+{
+	if (keepalive_pool.idle == NULL || keepalive_pool.pid != getpid ()) {
+		/*
+		 * Sockets inherited from the parent process are never reused (and the
+		 * table is not freed as its events belong to the parent)
+		 */
+		keepalive_pool.idle = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, rspamd_http_keepalive_queue_dtor);
+		keepalive_pool.pid = getpid ();
+	}
+
+	return keepalive_pool.idle;
+}
+
+static void
+rspamd_http_keepalive_elt_free (struct rspamd_http_keepalive_elt *elt)
+{
+	g_queue_delete_link (elt->idle, elt->link);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static void
+rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http_keepalive_elt *elt = ud;
+
+	/* Peer has closed connection, sent unexpected data or timeout is over */
+	msg_debug ("close idle keep-alive socket %d", fd);
+	close (elt->fd);
+	rspamd_http_keepalive_elt_free (elt);
+}
+
+gint
+rspamd_http_keepalive_connect (const rspamd_inet_addr_t *addr,
+		struct rspamd_cryptobox_pubkey *peer_key,
+		gboolean *reused)
+{
+	struct rspamd_http_keepalive_elt *elt;
+	GQueue *idle;
+	gchar *key, c;
+	gint fd;
+
+	if (reused != NULL) {
+		*reused = FALSE;
+	}
+
+	key = rspamd_http_keepalive_key (addr, peer_key);
+	idle = g_hash_table_lookup (rspamd_http_keepalive_idle (), key);
+	g_free (key);
+
+	while (idle != NULL && idle->length > 0) {
+		elt = g_queue_peek_head (idle);
+		event_del (&elt->ev);
+		fd = elt->fd;
+		rspamd_http_keepalive_elt_free (elt);
+
+		/* Check that the peer has not closed connection since the last loop */
+		if (recv (fd, &c, 1, MSG_PEEK) == -1 && errno == EAGAIN) {
+			msg_debug ("reuse keep-alive socket %d", fd);
+
+			if (reused != NULL) {
+				*reused = TRUE;
+			}
+
+			return fd;
+		}
+
+		close (fd);
+	}
+
+	return rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+}
+
+gboolean
+rspamd_http_keepalive_stale (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (conn->type != RSPAMD_HTTP_CLIENT || priv->replied) {
+		return FALSE;
+	}
+
+	/* Peer has closed an idle socket while our request was being sent */
+	return err != NULL && err->domain == HTTP_ERROR &&
+			(err->code == ECONNRESET || err->code == EPIPE);
+}
+
+void
+rspamd_http_keepalive_release (struct rspamd_http_connection *conn,
+		const rspamd_inet_addr_t *addr,
+		struct rspamd_cryptobox_pubkey *peer_key,
+		struct event_base *ev_base)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	struct rspamd_http_keepalive_elt *elt;
+	struct timeval tv;
+	GHashTable *pool;
+	GQueue *idle;
+	gchar *key;
+
+	if (conn->fd == -1) {
+		return;
+	}
+
+	/* Socket is set when reading or writing, so its event is initialized */
+	event_del (&priv->ev);
+
+	if (!priv->keepalive || (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) == 0) {
+		close (conn->fd);
+		conn->fd = -1;
+
+		return;
+	}
+
+	priv->keepalive = FALSE;
+
+	/*
+	 * The key actually used by the connection wins, so an encrypted socket is
+	 * never given to a plain client of the same peer and vice versa
+	 */
+	if (priv->peer_key != NULL) {
+		peer_key = priv->peer_key;
+	}
+	else if (priv->msg != NULL && priv->msg->peer_key != NULL) {
+		peer_key = priv->msg->peer_key;
+	}
+	else if (!priv->encrypted) {
+		peer_key = NULL;
+	}
+
+	pool = rspamd_http_keepalive_idle ();
+	key = rspamd_http_keepalive_key (addr, peer_key);
+	idle = g_hash_table_lookup (pool, key);
+
+	if (idle == NULL) {
+		idle = g_queue_new ();
+		g_hash_table_insert (pool, key, idle);
+	}
+	else {
+		g_free (key);
+	}
+
+	if (idle->length >= RSPAMD_HTTP_KEEPALIVE_IDLE_MAX) {
+		/* Drop the oldest idle socket */
+		elt = g_queue_peek_tail (idle);
+		event_del (&elt->ev);
+		close (elt->fd);
+		rspamd_http_keepalive_elt_free (elt);
+	}
+
+	elt = g_slice_alloc0 (sizeof (*elt));
+	elt->fd = conn->fd;
+	elt->idle = idle;
+	g_queue_push_head (idle, elt);
+	elt->link = idle->head;
+
+	double_to_tv (RSPAMD_HTTP_KEEPALIVE_TIMEOUT, &tv);
+	event_set (&elt->ev, elt->fd, EV_READ, rspamd_http_keepalive_handler, elt);
+
+	if (ev_base != NULL) {
+		event_base_set (ev_base, &elt->ev);
+	}
+
+	event_add (&elt->ev, &tv);
+	conn->fd = -1;
+}
+
 GHashTable *
 rspamd_http_message_parse_query (struct rspamd_http_message *msg)
 {
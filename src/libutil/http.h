@@ -28,6 +28,7 @@
 #include "keypair.h"
 #include "keypairs_cache.h"
 #include "fstring.h"
+#include "addr.h"
 
 enum rspamd_http_connection_type {
 	RSPAMD_HTTP_SERVER,
@@ -48,6 +49,10 @@ struct rspamd_http_header {
  * Legacy spamc protocol
  */
 #define RSPAMD_HTTP_FLAG_SPAMC 1 << 1
+/**
+ * Request: peer wants to reuse connection, reply: connection is not closed
+ */
+#define RSPAMD_HTTP_FLAG_KEEPALIVE 1 << 2
 
 /**
  * HTTP message structure, used for requests and replies
@@ -76,7 +81,8 @@ struct rspamd_http_message {
 enum rspamd_http_options {
 	RSPAMD_HTTP_BODY_PARTIAL = 0x1, /**< Call body handler on all body data portions */
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */
-	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4 /**< Encrypt data for client */
+	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */
+	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 0x8 /**< Ask server to keep connection alive */
 };
 
 struct rspamd_http_connection_private;
@@ -238,6 +244,46 @@ rspamd_http_connection_unref (struct rspamd_http_connection *conn)
  */
 void rspamd_http_connection_reset (struct rspamd_http_connection *conn);
 
+/**
+ * Get an idle socket connected to the specified peer from the keep-alive pool
+ * of the current process or connect a new one
+ * @param addr address of peer
+ * @param peer_key public key of peer (NULL for plain connections)
+ * @param reused set to TRUE if the socket is taken from the pool (may be NULL)
+ * @return non-blocking socket or -1 in case of error
+ */
+gint rspamd_http_keepalive_connect (const rspamd_inet_addr_t *addr,
+		struct rspamd_cryptobox_pubkey *peer_key,
+		gboolean *reused);
+
+/**
+ * Check whether an error of a client connection means that the peer has closed
+ * or reset the socket before sending anything of the reply. If such a socket
+ * has been taken from the keep-alive pool, the request should be sent once
+ * more over a fresh connection
+ * @param conn client connection
+ * @param err error passed to the error handler
+ * @return TRUE if the request could be repeated
+ */
+gboolean rspamd_http_keepalive_stale (struct rspamd_http_connection *conn,
+		GError *err);
+
+/**
+ * Release socket of a client connection: it is placed to the keep-alive pool
+ * if the last reply has been read completely and the server permits to keep the
+ * connection alive, otherwise the socket is closed. Connection cannot use its
+ * socket afterwards (but it can be reset and used with another socket)
+ * @param conn client connection
+ * @param addr address of peer
+ * @param peer_key public key of peer (NULL for plain connections), the key
+ * used by the connection itself takes precedence
+ * @param ev_base event base used to watch idle socket
+ */
+void rspamd_http_keepalive_release (struct rspamd_http_connection *conn,
+		const rspamd_inet_addr_t *addr,
+		struct rspamd_cryptobox_pubkey *peer_key,
+		struct event_base *ev_base);
+
 /**
  * Extract the current message from a connection to deal with separately
  * @param conn
@@ -288,6 +334,15 @@ const rspamd_ftok_t * rspamd_http_message_find_header (
 gboolean rspamd_http_message_remove_header (struct rspamd_http_message *msg,
 	const gchar *name);
 
+/**
+ * Create a deep copy of HTTP message, e.g. to send a request once more as
+ * a connection takes ownership of the messages written
+ * @param msg
+ * @return new message
+ */
+struct rspamd_http_message * rspamd_http_message_copy (
+		const struct rspamd_http_message *msg);
+
 /**
  * Free HTTP message
  * @param msg
@@ -30,6 +30,35 @@
 #define REPEATS_MAX 300
 #define LOG_ID 6
 #define RSPAMD_LOGBUF_SIZE 8192
+#define RSPAMD_LOG_RING_SIZE (4 * 1024 * 1024)
+/* Seconds after which an uncommitted record is treated as left by a dead writer */
+#define RSPAMD_LOG_RING_STALL 5
+#define RSPAMD_LOG_RING_IOV 64
+
+enum rspamd_log_ring_state {
+	RSPAMD_LOG_RING_FREE = 0,
+	RSPAMD_LOG_RING_COMMITTED,
+	RSPAMD_LOG_RING_PADDING,
+};
+
+struct rspamd_log_ring_rec {
+	guint32 len;
+	gint state;
+};
+
+/*
+ * Shared memory ring with many writers (workers) and a single reader (main).
+ * Writers reserve space by moving `head` with CAS and commit records by
+ * setting their state, reader moves `tail`. Positions grow monotonically and
+ * are taken modulo size that is a power of two.
+ */
+struct rspamd_log_ring {
+	gint head;
+	gint tail;
+	gint dropped;
+	guint32 size;
+	guchar data[];
+};
 
 /**
  * Static structure that store logging parameters
@@ -64,6 +93,12 @@ struct rspamd_logger_s {
 	rspamd_mempool_t *pool;
 	rspamd_mempool_mutex_t *mtx;
 	guint64 log_cnt[4];
+	struct rspamd_log_ring *ring;
+	gboolean ring_producer;
+	gboolean ring_draining;
+	guint32 ring_reported_drops;
+	guint32 ring_stall_pos;
+	time_t ring_stall_time;
 };
 
 static const gchar lf_chr = '\n';
@@ -71,13 +106,13 @@ static const gchar lf_chr = '\n';
 static rspamd_logger_t *default_logger = NULL;
 
 #define RSPAMD_LOGGER_LOCK(l) do {				\
-	if ((l) != NULL && !(l)->no_lock) {			\
+	if ((l) != NULL && !(l)->no_lock && !(l)->ring_producer) {	\
 		rspamd_mempool_lock_mutex ((l)->mtx);	\
 	}											\
 } while (0)
 
 #define RSPAMD_LOGGER_UNLOCK(l) do {			\
-	if ((l) != NULL && !(l)->no_lock) {			\
+	if ((l) != NULL && !(l)->no_lock && !(l)->ring_producer) {	\
 		rspamd_mempool_unlock_mutex ((l)->mtx);	\
 	}											\
 } while (0)
@@ -161,6 +196,196 @@ direct_write_log_line (rspamd_logger_t *rspamd_log,
 	}
 }
 
+#define RSPAMD_LOG_RING_ALIGN(sz) (((sz) + 7) & ~(gsize)7)
+
+static struct rspamd_log_ring *
+rspamd_log_ring_new (rspamd_mempool_t *pool, gsize size)
+{
+	struct rspamd_log_ring *ring;
+	guint32 rsize = 4096;
+
+	while (rsize < size && rsize < G_MAXINT32 / 2) {
+		rsize <<= 1;
+	}
+
+	ring = rspamd_mempool_alloc0_shared (pool, sizeof (*ring) + rsize);
+	ring->size = rsize;
+
+	return ring;
+}
+
+/*
+ * Put line to the ring without any locking, returns FALSE if there is no
+ * space in the ring (the line is dropped then)
+ */
+static gboolean
+rspamd_log_ring_push (struct rspamd_log_ring *ring,
+		const struct iovec *iov, guint iovcnt)
+{
+	struct rspamd_log_ring_rec *rec;
+	guint32 head, tail, pos, pad, need, len = 0;
+	guchar *p;
+	guint i;
+
+	for (i = 0; i < iovcnt; i ++) {
+		len += iov[i].iov_len;
+	}
+
+	need = RSPAMD_LOG_RING_ALIGN (sizeof (*rec) + len);
+
+	if (need > ring->size / 4) {
+		g_atomic_int_inc (&ring->dropped);
+		return FALSE;
+	}
+
+	for (;;) {
+		head = g_atomic_int_get (&ring->head);
+		tail = g_atomic_int_get (&ring->tail);
+		pos = head & (ring->size - 1);
+		/* Records are never split, the rest of the ring is skipped instead */
+		pad = pos + need > ring->size ? ring->size - pos : 0;
+
+		if (head - tail + pad + need > ring->size) {
+			g_atomic_int_inc (&ring->dropped);
+			return FALSE;
+		}
+
+		if (g_atomic_int_compare_and_exchange (&ring->head, (gint)head,
+				(gint)(head + pad + need))) {
+			break;
+		}
+	}
+
+	if (pad > 0) {
+		rec = (struct rspamd_log_ring_rec *)(ring->data + pos);
+		rec->len = pad - sizeof (*rec);
+		g_atomic_int_set (&rec->state, RSPAMD_LOG_RING_PADDING);
+		pos = 0;
+	}
+
+	rec = (struct rspamd_log_ring_rec *)(ring->data + pos);
+	rec->len = len;
+	p = (guchar *)(rec + 1);
+
+	for (i = 0; i < iovcnt; i ++) {
+		memcpy (p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	g_atomic_int_set (&rec->state, RSPAMD_LOG_RING_COMMITTED);
+
+	return TRUE;
+}
+
+static void
+rspamd_log_ring_zero (struct rspamd_log_ring *ring, guint32 from, guint32 to)
+{
+	guint32 pos = from & (ring->size - 1), len = to - from;
+
+	if (pos + len > ring->size) {
+		memset (ring->data + pos, 0, ring->size - pos);
+		memset (ring->data, 0, len - (ring->size - pos));
+	}
+	else {
+		memset (ring->data + pos, 0, len);
+	}
+}
+
+/*
+ * Write all committed lines from the ring, called by the main process only
+ */
+static void
+rspamd_log_ring_drain (rspamd_logger_t *rspamd_log)
+{
+	struct rspamd_log_ring *ring = rspamd_log->ring;
+	struct rspamd_log_ring_rec *rec, *recs[RSPAMD_LOG_RING_IOV];
+	struct iovec iov[RSPAMD_LOG_RING_IOV];
+	guint32 head, tail, pos, next, dropped;
+	gchar tmpbuf[128];
+	guint niov, i;
+	time_t now;
+
+	if (ring == NULL || rspamd_log->ring_producer || rspamd_log->ring_draining) {
+		return;
+	}
+
+	rspamd_log->ring_draining = TRUE;
+	head = g_atomic_int_get (&ring->head);
+	tail = g_atomic_int_get (&ring->tail);
+
+	while (tail != head) {
+		niov = 0;
+		next = tail;
+
+		while (next != head && niov < G_N_ELEMENTS (iov)) {
+			pos = next & (ring->size - 1);
+			rec = (struct rspamd_log_ring_rec *)(ring->data + pos);
+
+			if (g_atomic_int_get (&rec->state) == RSPAMD_LOG_RING_FREE) {
+				break;
+			}
+
+			if (g_atomic_int_get (&rec->state) == RSPAMD_LOG_RING_COMMITTED) {
+				iov[niov].iov_base = rec + 1;
+				iov[niov].iov_len = rec->len;
+				recs[niov ++] = rec;
+			}
+			else {
+				rec->state = RSPAMD_LOG_RING_FREE;
+			}
+
+			next += RSPAMD_LOG_RING_ALIGN (sizeof (*rec) + rec->len);
+		}
+
+		if (niov > 0) {
+			if (rspamd_log->enabled) {
+				direct_write_log_line (rspamd_log, iov, niov, TRUE);
+			}
+
+			for (i = 0; i < niov; i ++) {
+				recs[i]->state = RSPAMD_LOG_RING_FREE;
+			}
+		}
+
+		if (next == tail) {
+			/* Record is reserved but not committed yet */
+			now = time (NULL);
+
+			if (rspamd_log->ring_stall_pos != tail ||
+					rspamd_log->ring_stall_time == 0) {
+				rspamd_log->ring_stall_pos = tail;
+				rspamd_log->ring_stall_time = now;
+			}
+			else if (now - rspamd_log->ring_stall_time > RSPAMD_LOG_RING_STALL) {
+				/* Writer has likely died, skip everything reserved so far */
+				rspamd_log_ring_zero (ring, tail, head);
+				g_atomic_int_add (&ring->dropped, 1);
+				g_atomic_int_set (&ring->tail, head);
+				rspamd_log->ring_stall_time = 0;
+			}
+
+			break;
+		}
+
+		rspamd_log->ring_stall_time = 0;
+		g_atomic_int_set (&ring->tail, next);
+		tail = next;
+	}
+
+	dropped = g_atomic_int_get (&ring->dropped);
+
+	if (dropped != rspamd_log->ring_reported_drops && rspamd_log->enabled) {
+		rspamd_snprintf (tmpbuf, sizeof (tmpbuf),
+				"%ud log messages have been dropped as log ring is full",
+				dropped - rspamd_log->ring_reported_drops);
+		rspamd_log->ring_reported_drops = dropped;
+		rspamd_log->log_func (NULL, "logger", NULL, G_STRFUNC,
+				G_LOG_LEVEL_WARNING, tmpbuf, TRUE, rspamd_log);
+	}
+
+	rspamd_log->ring_draining = FALSE;
+}
+
 static void
 rspamd_escape_log_string (gchar *str)
 {
@@ -352,6 +577,15 @@ rspamd_set_logger (struct rspamd_config *cfg,
 	}
 
 	rspamd->logger->cfg = cfg;
+
+	/* Ring is shared with workers, so it is created once and never resized */
+	if (cfg->log_async && rspamd->logger->ring == NULL &&
+			cfg->log_type != RSPAMD_LOG_SYSLOG) {
+		rspamd->logger->ring = rspamd_log_ring_new (rspamd->logger->pool,
+				cfg->log_async_size != 0 ?
+				cfg->log_async_size : RSPAMD_LOG_RING_SIZE);
+	}
+
 	/* Set up buffer */
 	if (rspamd->cfg->log_buffered) {
 		if (rspamd->cfg->log_buf_size != 0) {
@@ -399,6 +633,10 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 {
 	rspamd_log->pid = getpid ();
 	rspamd_log->process_type = ptype;
+	/* Forked processes put lines to the ring drained by the main process */
+	rspamd_log->ring_producer = rspamd_log->ring != NULL &&
+			rspamd_log->cfg->log_async &&
+			rspamd_log->type != RSPAMD_LOG_SYSLOG;
 
 	/* We also need to clear all messages pending */
 	if (rspamd_log->repeats > 0) {
@@ -422,6 +660,8 @@ rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *rspamd_log)
 void
 rspamd_log_flush (rspamd_logger_t *rspamd_log)
 {
+	rspamd_log_ring_drain (rspamd_log);
+
 	if (rspamd_log->is_buffered &&
 		(rspamd_log->type == RSPAMD_LOG_CONSOLE ||
 		 rspamd_log->type == RSPAMD_LOG_FILE)) {
@@ -571,7 +811,11 @@ file_log_helper (rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	guint i;
 
-	if (!rspamd_log->is_buffered) {
+	if (rspamd_log->ring_producer) {
+		/* Never wait for storage in workers */
+		rspamd_log_ring_push (rspamd_log->ring, iov, iovcnt);
+	}
+	else if (!rspamd_log->is_buffered) {
 		/* Write string directly */
 		direct_write_log_line (rspamd_log, (void *) iov, iovcnt, TRUE);
 	}
@@ -1032,3 +1276,11 @@ rspamd_log_lock (rspamd_logger_t *logger)
 		logger->no_lock = FALSE;
 	}
 }
+
+void
+rspamd_log_drain (rspamd_logger_t *logger)
+{
+	if (logger) {
+		rspamd_log_ring_drain (logger);
+	}
+}
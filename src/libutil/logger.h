@@ -61,6 +61,12 @@ void rspamd_log_update_pid (GQuark ptype, rspamd_logger_t *logger);
  */
 void rspamd_log_flush (rspamd_logger_t *logger);
 
+/**
+ * Write lines put by workers to the shared log ring (if `log_async` is enabled),
+ * must be called periodically by the main process
+ */
+void rspamd_log_drain (rspamd_logger_t *logger);
+
 /**
  * Log function that is compatible for glib messages
  */
@@ -24,10 +24,12 @@
 #include "cryptobox.h"
 #include "unix-std.h"
 #include "http_parser.h"
+#include "xxhash.h"
 #include "libutil/regexp.h"
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
+#include "libutil/hs_shared.h"
 #endif
 #ifndef WITH_PCRE2
 #include <pcre.h>
@@ -39,6 +41,55 @@ static const gchar *hash_fill = "1";
 static void free_http_cbdata_common (struct http_callback_data *cbd);
 static void free_http_cbdata_dtor (gpointer p);
 static void free_http_cbdata (struct http_callback_data *cbd);
+
+static void
+http_map_cache_path (struct rspamd_map *map, struct http_map_data *data,
+		gchar *buf, gsize len)
+{
+	rspamd_snprintf (buf, len, "%s" G_DIR_SEPARATOR_S "rspamd_map_%xL.cache",
+			map->cfg->temp_dir, data->cache_id);
+}
+
+/*
+ * Load data fetched by another process, the cache file contains data that
+ * has been already verified by the fetching process
+ */
+static gboolean
+http_map_read_cached (struct rspamd_map *map, struct http_map_data *data)
+{
+	struct map_cb_data cbdata;
+	gchar path[PATH_MAX];
+	guchar *in;
+	gsize inlen;
+	gint version;
+	rspamd_mempool_t *pool = map->pool;
+
+	version = g_atomic_int_get (&data->shared->version);
+	http_map_cache_path (map, data, path, sizeof (path));
+	in = rspamd_file_xmap (path, PROT_READ, &inlen);
+
+	if (in == NULL) {
+		msg_err_pool ("cannot read map cache %s: %s", path, strerror (errno));
+		return FALSE;
+	}
+
+	cbdata.state = 0;
+	cbdata.prev_data = *map->user_data;
+	cbdata.cur_data = NULL;
+	cbdata.map = map;
+
+	map->read_callback (map->pool, in, inlen, &cbdata, TRUE);
+	map->fin_callback (map->pool, &cbdata);
+	*map->user_data = cbdata.cur_data;
+	munmap (in, inlen);
+
+	data->version = version;
+	data->last_checked = data->shared->last_checked;
+	rspamd_strlcpy (data->etag, data->shared->etag, sizeof (data->etag));
+	msg_info_pool ("read map data for %s from cache %s", data->host, path);
+
+	return TRUE;
+}
 /**
  * Write HTTP request
  */
@@ -51,12 +102,13 @@ write_http_request (struct http_callback_data *cbd)
 
 	pool = cbd->map->pool;
 
-	if (cbd->fd != -1) {
-		close (cbd->fd);
+	if (cbd->conn->fd != -1) {
+		/* Socket of the previous stage is reused if the server permits that */
+		rspamd_http_keepalive_release (cbd->conn, cbd->addr, NULL, cbd->ev_base);
+		cbd->fd = rspamd_http_keepalive_connect (cbd->addr, NULL,
+				&cbd->reused);
 	}
 
-	cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
-
 	if (cbd->fd != -1) {
 		msg = rspamd_http_new_message (HTTP_REQUEST);
 
@@ -68,6 +120,10 @@ write_http_request (struct http_callback_data *cbd)
 						cbd->data->last_checked);
 				rspamd_http_message_add_header (msg, "If-Modified-Since", datebuf);
 			}
+			if (cbd->data->etag[0] != '\0') {
+				rspamd_http_message_add_header (msg, "If-None-Match",
+						cbd->data->etag);
+			}
 		}
 		else if (cbd->stage == map_load_pubkey) {
 			msg->url = rspamd_fstring_new_init (cbd->data->path, strlen (cbd->data->path));
@@ -231,6 +287,13 @@ free_http_cbdata_common (struct http_callback_data *cbd)
 	}
 
 	if (cbd->conn) {
+		if (cbd->fd != -1 && cbd->conn->fd == cbd->fd) {
+			/* Socket is either kept for the next map check or closed */
+			rspamd_http_keepalive_release (cbd->conn, cbd->addr, NULL,
+					cbd->ev_base);
+			cbd->fd = -1;
+		}
+
 		rspamd_http_connection_unref (cbd->conn);
 		cbd->conn = NULL;
 	}
@@ -279,6 +342,20 @@ http_map_error (struct rspamd_http_connection *conn,
 
 	pool = cbd->map->pool;
 
+	if (cbd->reused && rspamd_http_keepalive_stale (conn, err)) {
+		/* Peer has closed an idle socket, so repeat request over a new one */
+		msg_debug_pool ("keep-alive connection to %s is closed, retry request",
+				cbd->data->host);
+		rspamd_http_keepalive_release (conn, cbd->addr, NULL, cbd->ev_base);
+		cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+		cbd->reused = FALSE;
+		rspamd_http_connection_reset (conn);
+		write_http_request (cbd);
+		REF_RELEASE (cbd);
+
+		return;
+	}
+
 	msg_err_pool ("connection with http server terminated incorrectly: %s",
 			err->message);
 	REF_RELEASE (cbd);
@@ -292,6 +369,7 @@ http_map_finish (struct rspamd_http_connection *conn,
 	struct rspamd_map *map;
 	rspamd_mempool_t *pool;
 	char fpath[PATH_MAX];
+	const rspamd_ftok_t *etag;
 	guchar *aux_data, *in = NULL;
 	gsize inlen = 0;
 	struct stat st;
@@ -309,6 +387,12 @@ http_map_finish (struct rspamd_http_connection *conn,
 				cbd->data->last_checked = msg->date;
 			}
 
+			etag = rspamd_http_message_find_header (msg, "ETag");
+
+			if (etag != NULL && etag->len < sizeof (cbd->etag)) {
+				rspamd_strlcpy (cbd->etag, etag->begin, etag->len + 1);
+			}
+
 			/* Maybe we need to check signature ? */
 			if (map->is_signed) {
 				close (cbd->out_fd);
@@ -420,7 +504,24 @@ http_map_finish (struct rspamd_http_connection *conn,
 		map->fin_callback (map->pool, &cbd->cbdata);
 
 		*map->user_data = cbd->cbdata.cur_data;
+		/* Entity tag is valid only when the data has been loaded */
+		rspamd_strlcpy (cbd->data->etag, cbd->etag, sizeof (cbd->data->etag));
 		msg_info_pool ("read map data from %s", cbd->data->host);
+
+		/* Publish data to other processes */
+		http_map_cache_path (map, cbd->data, fpath, sizeof (fpath));
+
+		if (rename (cbd->tmpfile, fpath) == -1) {
+			msg_warn_pool ("cannot store map cache %s: %s", fpath,
+					strerror (errno));
+		}
+		else {
+			cbd->data->shared->last_checked = cbd->data->last_checked;
+			rspamd_strlcpy (cbd->data->shared->etag, cbd->etag,
+					sizeof (cbd->data->shared->etag));
+			cbd->data->version = g_atomic_int_add (
+					&cbd->data->shared->version, 1) + 1;
+		}
 	}
 	else if (msg->code == 304 && cbd->stage == map_load_file) {
 		msg_debug_pool ("data is not modified for server %s",
@@ -432,6 +533,8 @@ http_map_finish (struct rspamd_http_connection *conn,
 		else {
 			cbd->data->last_checked = msg->date;
 		}
+
+		cbd->data->shared->last_checked = cbd->data->last_checked;
 	}
 	else {
 		msg_info_pool ("cannot load map %s from %s: HTTP error %d",
@@ -439,6 +542,10 @@ http_map_finish (struct rspamd_http_connection *conn,
 	}
 
 end:
+	if (in != NULL) {
+		munmap (in, inlen);
+	}
+
 	REF_RELEASE (cbd);
 
 	return 0;
@@ -615,14 +722,15 @@ rspamd_map_dns_callback (struct rdns_reply *reply, void *arg)
 			if (cbd->addr != NULL) {
 				rspamd_inet_address_set_port (cbd->addr, cbd->data->port);
 				/* Try to open a socket */
-				cbd->fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM,
-						TRUE);
+				cbd->fd = rspamd_http_keepalive_connect (cbd->addr, NULL,
+						&cbd->reused);
 
 				if (cbd->fd != -1) {
 					cbd->stage = map_load_file;
 					cbd->conn = rspamd_http_connection_new (http_map_read,
 							http_map_error, http_map_finish,
-							RSPAMD_HTTP_BODY_PARTIAL|RSPAMD_HTTP_CLIENT_SIMPLE,
+							RSPAMD_HTTP_BODY_PARTIAL|RSPAMD_HTTP_CLIENT_SIMPLE|
+							RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 							RSPAMD_HTTP_CLIENT, NULL);
 
 					write_http_request (cbd);
@@ -659,10 +767,27 @@ http_callback (gint fd, short what, void *ud)
 	struct http_callback_data *cbd;
 	rspamd_mempool_t *pool;
 	gchar tmpbuf[PATH_MAX];
+	time_t now;
 
 	data = map->map_data;
 	pool = map->pool;
 
+	if (g_atomic_int_get (&data->shared->version) != data->version &&
+			http_map_read_cached (map, data)) {
+		/* Another process has fetched new data */
+		jitter_timeout_event (map, FALSE, FALSE, FALSE);
+		return;
+	}
+
+	now = time (NULL);
+
+	if (data->version != 0 &&
+			now - data->shared->last_fetch < map->cfg->map_timeout) {
+		msg_debug_pool ("map has been checked recently by other process");
+		jitter_timeout_event (map, FALSE, FALSE, FALSE);
+		return;
+	}
+
 	if (!g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
 		msg_debug_pool (
 				"don't try to reread map as it is locked by other process, will reread it later");
@@ -670,6 +795,14 @@ http_callback (gint fd, short what, void *ud)
 		return;
 	}
 
+	data->shared->last_fetch = now;
+
+	if (data->version == g_atomic_int_get (&data->shared->version)) {
+		/* Use validators obtained by other processes for the same data */
+		data->last_checked = data->shared->last_checked;
+		rspamd_strlcpy (data->etag, data->shared->etag, sizeof (data->etag));
+	}
+
 	/* Plan event */
 	cbd = g_slice_alloc0 (sizeof (struct http_callback_data));
 
@@ -728,6 +861,36 @@ http_callback (gint fd, short what, void *ud)
 }
 
 /* Start watching event for all maps */
+void
+rspamd_map_preload (struct rspamd_config *cfg)
+{
+	GList *cur;
+	struct rspamd_map *map;
+	struct file_map_data *fdata;
+	struct stat st;
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (map->protocol != MAP_PROTO_FILE || map->preloaded) {
+			continue;
+		}
+
+		fdata = map->map_data;
+
+		if (stat (fdata->filename, &st) == -1) {
+			continue;
+		}
+
+		/* Workers compare mtime with this one to detect changes */
+		memcpy (&fdata->st, &st, sizeof (st));
+
+		if (read_map_file (map, fdata)) {
+			map->preloaded = TRUE;
+		}
+	}
+}
+
 void
 rspamd_map_watch (struct rspamd_config *cfg,
 		struct event_base *ev_base,
@@ -748,7 +911,7 @@ rspamd_map_watch (struct rspamd_config *cfg,
 			evtimer_set (&map->ev, file_callback, map);
 			/* Read initial data */
 			fdata = map->map_data;
-			if (fdata->st.st_mtime != -1) {
+			if (fdata->st.st_mtime != -1 && !map->preloaded) {
 				/* Do not try to read non-existent file */
 				read_map_file (map, map->map_data);
 			}
@@ -966,6 +1129,10 @@ rspamd_map_add (struct rspamd_config *cfg,
 		hdata =
 			rspamd_mempool_alloc0 (cfg->map_pool,
 				sizeof (struct http_map_data));
+		hdata->shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+				sizeof (struct http_map_shared));
+		/* Cache file name is stable between reloads */
+		hdata->cache_id = XXH64 (new_map->uri, strlen (new_map->uri), 0);
 
 		memset (&up, 0, sizeof (up));
 		if (http_parser_parse_url (new_map->uri, strlen (new_map->uri), FALSE,
@@ -1428,6 +1595,33 @@ rspamd_radix_read (rspamd_mempool_t * pool,
 {
 	radix_compressed_t *tree;
 	rspamd_mempool_t *rpool;
+	struct file_map_data *fdata;
+	GError *err = NULL;
+
+	if (data->cur_data == NULL && final &&
+			radix_is_compiled_image ((const guchar *)chunk, len)) {
+		/* Compiled images of local files are mapped to share their pages */
+		if (data->map && data->map->protocol == MAP_PROTO_FILE) {
+			fdata = data->map->map_data;
+			tree = radix_compressed_load (fdata->filename, &err);
+		}
+		else {
+			tree = radix_compressed_load_buf ((const guchar *)chunk, len, &err);
+		}
+
+		if (tree == NULL) {
+			msg_err_pool ("cannot load compiled radix map: %e", err);
+			g_error_free (err);
+			/* Keep an empty trie to replace the previous data consistently */
+			tree = radix_create_compressed ();
+		}
+
+		rpool = radix_get_pool (tree);
+		memcpy (rpool->tag.uid, pool->tag.uid, sizeof (rpool->tag.uid));
+		data->cur_data = tree;
+
+		return chunk + len;
+	}
 
 	if (data->cur_data == NULL) {
 		tree = radix_create_compressed ();
@@ -1462,7 +1656,7 @@ struct rspamd_regexp_map {
 	GPtrArray *values;
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
-	hs_scratch_t *hs_scratch;
+	gsize hs_db_maplen;
 	const gchar **patterns;
 	gint *flags;
 	gint *ids;
@@ -1498,11 +1692,13 @@ rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
 	g_ptr_array_free (re_map->values, TRUE);
 
 #ifdef WITH_HYPERSCAN
-	if (re_map->hs_scratch) {
-		hs_free_scratch (re_map->hs_scratch);
-	}
 	if (re_map->hs_db) {
-		hs_free_database (re_map->hs_db);
+		if (re_map->hs_db_maplen) {
+			rspamd_hs_shared_unmap (re_map->hs_db, re_map->hs_db_maplen);
+		}
+		else {
+			hs_free_database (re_map->hs_db);
+		}
 	}
 	if (re_map->patterns) {
 		g_free (re_map->patterns);
@@ -1518,6 +1714,81 @@ rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
 	g_slice_free1 (sizeof (*re_map), re_map);
 }
 
+#ifdef WITH_HYPERSCAN
+static gboolean
+rspamd_re_map_try_load_hs (struct rspamd_regexp_map *re_map,
+		const guchar *hash)
+{
+	gchar fp[PATH_MAX];
+	gpointer map;
+	gsize len;
+	struct rspamd_config *cfg = re_map->map->cfg;
+
+	if (cfg->hs_cache_dir == NULL) {
+		return FALSE;
+	}
+
+	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmc", cfg->hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+	if ((map = rspamd_file_xmap (fp, PROT_READ, &len)) != NULL) {
+		if (cfg->shared_hyperscan) {
+			/* Strip '.hsmc' suffix */
+			fp[strlen (fp) - 5] = '\0';
+			re_map->hs_db = rspamd_hs_shared_map (fp, map, len,
+					&re_map->hs_db_maplen);
+
+			if (re_map->hs_db != NULL) {
+				munmap (map, len);
+				return TRUE;
+			}
+
+			re_map->hs_db_maplen = 0;
+			rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmc", cfg->hs_cache_dir,
+					(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+		}
+
+		if (hs_deserialize_database (map, len, &re_map->hs_db) == HS_SUCCESS) {
+			munmap (map, len);
+			return TRUE;
+		}
+
+		munmap (map, len);
+		/* Remove stale file */
+		(void)unlink (fp);
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_re_map_try_save_hs (struct rspamd_regexp_map *re_map,
+		const guchar *hash)
+{
+	gchar fp[PATH_MAX];
+	char *bytes = NULL;
+	gsize len;
+	gint fd;
+	struct rspamd_config *cfg = re_map->map->cfg;
+
+	if (cfg->hs_cache_dir == NULL) {
+		return;
+	}
+
+	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmc", cfg->hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY|O_CREAT|O_EXCL, 00644)) != -1) {
+		if (hs_serialize_database (re_map->hs_db, &bytes, &len) == HS_SUCCESS) {
+			(void)write (fd, bytes, len);
+			free (bytes);
+		}
+
+		close (fd);
+	}
+}
+#endif
+
 static void
 rspamd_re_map_insert_helper (gpointer st, gpointer key, gpointer value)
 {
@@ -1552,6 +1823,8 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 	hs_compile_error_t *err;
 	rspamd_mempool_t *pool;
 	rspamd_regexp_t *re;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash[rspamd_cryptobox_HASHBYTES];
 	gint pcre_flags;
 
 	pool = re_map->map->pool;
@@ -1596,26 +1869,51 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 		re_map->ids[i] = i;
 	}
 
-	if (hs_compile_multi (re_map->patterns,
-			re_map->flags,
-			re_map->ids,
-			re_map->regexps->len,
-			HS_MODE_BLOCK,
-			&plt,
-			&re_map->hs_db,
-			&err) != HS_SUCCESS) {
+	/* Compiled database is cached by patterns, flags and platform */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&plt, sizeof (plt));
 
-		msg_err_pool ("cannot create tree of regexp when processing '%s': %s",
-				re_map->patterns[err->expression], err->message);
-		re_map->hs_db = NULL;
-		hs_free_compile_error (err);
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		rspamd_cryptobox_hash_update (&st, (const guchar *)re_map->patterns[i],
+				strlen (re_map->patterns[i]) + 1);
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&re_map->flags[i],
+				sizeof (re_map->flags[i]));
+	}
+
+	rspamd_cryptobox_hash_final (&st, hash);
+
+	if (!rspamd_re_map_try_load_hs (re_map, hash)) {
+		if (hs_compile_multi (re_map->patterns,
+				re_map->flags,
+				re_map->ids,
+				re_map->regexps->len,
+				HS_MODE_BLOCK,
+				&plt,
+				&re_map->hs_db,
+				&err) != HS_SUCCESS) {
+
+			msg_err_pool ("cannot create tree of regexp when processing '%s': %s",
+					re_map->patterns[err->expression], err->message);
+			re_map->hs_db = NULL;
+			hs_free_compile_error (err);
+
+			return;
+		}
 
-		return;
+		rspamd_re_map_try_save_hs (re_map, hash);
 	}
 
-	if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+	if (!rspamd_hs_scratch_register (re_map->hs_db)) {
 		msg_err_pool ("cannot allocate scratch space for hyperscan");
-		hs_free_database (re_map->hs_db);
+
+		if (re_map->hs_db_maplen) {
+			rspamd_hs_shared_unmap (re_map->hs_db, re_map->hs_db_maplen);
+			re_map->hs_db_maplen = 0;
+		}
+		else {
+			hs_free_database (re_map->hs_db);
+		}
+
 		re_map->hs_db = NULL;
 	}
 #endif
@@ -1689,9 +1987,13 @@ rspamd_match_regexp_map (struct rspamd_regexp_map *map,
 	}
 
 #ifdef WITH_HYPERSCAN
-	if (map->hs_db && map->hs_scratch) {
-		res = hs_scan (map->hs_db, in, len, 0, map->hs_scratch,
+	hs_scratch_t *scr;
+	guint gen;
+
+	if (map->hs_db && (scr = rspamd_hs_scratch_acquire (&gen)) != NULL) {
+		res = hs_scan (map->hs_db, in, len, 0, scr,
 				rspamd_match_hs_single_handler, (void *)&i);
+		rspamd_hs_scratch_release (scr, gen);
 
 		if (res == HS_SCAN_TERMINATED) {
 			res = 1;
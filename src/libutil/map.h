@@ -55,6 +55,12 @@ struct rspamd_map* rspamd_map_add (struct rspamd_config *cfg,
 	map_fin_cb_t fin_callback,
 	void **user_data);
 
+/**
+ * Read all file maps synchronously, this is done by the main process before
+ * forking workers, so the parsed data is shared copy-on-write
+ */
+void rspamd_map_preload (struct rspamd_config *cfg);
+
 /**
  * Start watching of maps by adding events to libevent event loop
  */
@@ -48,6 +48,8 @@ struct rspamd_map {
 	guint32 checksum;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	/* Data has been read before fork, so workers should not read it again */
+	gboolean preloaded;
 	rspamd_map_dtor dtor;
 	gpointer dtor_data;
 };
@@ -60,6 +62,20 @@ struct file_map_data {
 	struct stat st;
 };
 
+/**
+ * State of HTTP map shared between all processes: a map is fetched by one
+ * process that stores verified data to the cache file, others load that file
+ */
+#define HTTP_MAP_ETAG_MAX 128
+
+struct http_map_shared {
+	gint version;
+	time_t last_fetch;
+	time_t last_checked;
+	/* Empty if the server does not send entity tags */
+	gchar etag[HTTP_MAP_ETAG_MAX];
+};
+
 /**
  * Data specific to HTTP maps
  */
@@ -69,7 +85,12 @@ struct http_map_data {
 	gchar *path;
 	gchar *host;
 	time_t last_checked;
+	gchar etag[HTTP_MAP_ETAG_MAX];
 	gboolean request_sent;
+	struct http_map_shared *shared;
+	/* Version of the shared data loaded by this process */
+	gint version;
+	guint64 cache_id;
 };
 
 enum rspamd_map_http_stage {
@@ -90,10 +111,14 @@ struct http_callback_data {
 	struct map_cb_data cbdata;
 	struct rspamd_cryptobox_pubkey *pk;
 	gchar *tmpfile;
+	/* Entity tag of the data being loaded */
+	gchar etag[HTTP_MAP_ETAG_MAX];
 
 	enum rspamd_map_http_stage stage;
 	gint out_fd;
 	gint fd;
+	/* Socket is taken from the keep-alive pool */
+	gboolean reused;
 
 	ref_entry_t ref;
 };
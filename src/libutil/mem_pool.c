@@ -24,6 +24,9 @@
 #ifdef HAVE_SCHED_YIELD
 #include <sched.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 /* Sleep time for spin lock in nanoseconds */
 #define MUTEX_SLEEP_TIME 10000000L
@@ -42,11 +45,46 @@
  */
 #undef MEMORY_GREEDY
 
+/*
+ * Freed chunks are kept in a process local cache of size classes (from 4Kb
+ * to 1Mb) to reuse warm memory in new pools: chunk is stored in the largest
+ * class not greater than its length
+ */
+#define MEMPOOL_CACHE_MIN_SHIFT 12
+#define MEMPOOL_CACHE_CLASSES 9
+#define MEMPOOL_CACHE_MAX_BYTES (8 * 1024 * 1024)
+
+static struct _pool_chain *chunks_cache[MEMPOOL_CACHE_CLASSES];
+static gsize chunks_cache_bytes = 0;
+/* Symbols cache threads can allocate chunks of their tasks pools */
+G_LOCK_DEFINE_STATIC (chunks_cache);
+
+/*
+ * Running estimation of the final size of pools with the same tag, that is
+ * used as the size of their first chunk
+ */
+#define MEMPOOL_ENTRIES_MAX 64
+#define MEMPOOL_SIZE_HINT_MAX (1024 * 1024)
+
+struct rspamd_mempool_entry_point {
+	gchar tag[MEMPOOL_TAG_LEN];
+	gsize size_hint;
+	gsize bytes; /* Chunks held by live pools of this tag */
+};
+
+static struct rspamd_mempool_entry_point entries[MEMPOOL_ENTRIES_MAX];
+static guint nentries = 0;
+G_LOCK_DEFINE_STATIC (entries);
+/* Chunks held by all live pools of the current process */
+static gsize pools_bytes = 0;
+
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
+/* Number of NUMA nodes to interleave shared chunks over */
+static guint numa_interleave_nodes = 0;
 
 /**
  * Function that return free space in pool page
@@ -61,6 +99,183 @@ pool_chain_free (struct _pool_chain *chain)
 			chain->len - occupied : 0);
 }
 
+static gint
+rspamd_mempool_cache_class (gsize len)
+{
+	gint cls = 0;
+	gsize sz = 1ULL << MEMPOOL_CACHE_MIN_SHIFT;
+
+	if (len < sz) {
+		return -1;
+	}
+
+	while (cls < MEMPOOL_CACHE_CLASSES - 1 && (sz << 1) <= len) {
+		sz <<= 1;
+		cls ++;
+	}
+
+	return cls;
+}
+
+static struct _pool_chain *
+rspamd_mempool_cache_get (gsize size)
+{
+	struct _pool_chain *chain;
+	gint cls, start;
+
+	start = rspamd_mempool_cache_class (size);
+
+	if (start == -1) {
+		start = 0;
+	}
+
+	/*
+	 * Chunks of the same class as size are likely of the same length, chunks
+	 * of the next class are always large enough
+	 */
+	G_LOCK (chunks_cache);
+
+	for (cls = start; cls < MEMPOOL_CACHE_CLASSES && cls <= start + 1; cls ++) {
+		chain = chunks_cache[cls];
+
+		if (chain != NULL && chain->len >= size) {
+			chunks_cache[cls] = chain->next;
+			chunks_cache_bytes -= chain->len;
+			G_UNLOCK (chunks_cache);
+
+			return chain;
+		}
+	}
+
+	G_UNLOCK (chunks_cache);
+
+	return NULL;
+}
+
+static gboolean
+rspamd_mempool_cache_put (struct _pool_chain *chain)
+{
+	gint cls;
+
+	if (always_malloc || chain->len > MEMPOOL_CACHE_MAX_BYTES / 4) {
+		return FALSE;
+	}
+
+	cls = rspamd_mempool_cache_class (chain->len);
+
+	if (cls == -1) {
+		return FALSE;
+	}
+
+	G_LOCK (chunks_cache);
+
+	if (chunks_cache_bytes + chain->len > MEMPOOL_CACHE_MAX_BYTES) {
+		G_UNLOCK (chunks_cache);
+
+		return FALSE;
+	}
+
+	chain->next = chunks_cache[cls];
+	chunks_cache[cls] = chain;
+	chunks_cache_bytes += chain->len;
+	G_UNLOCK (chunks_cache);
+
+	return TRUE;
+}
+
+static struct rspamd_mempool_entry_point *
+rspamd_mempool_entry_get (const gchar *tag)
+{
+	struct rspamd_mempool_entry_point *e = NULL;
+	guint i;
+
+	G_LOCK (entries);
+
+	for (i = 0; i < nentries; i ++) {
+		if (strcmp (entries[i].tag, tag) == 0) {
+			e = &entries[i];
+			break;
+		}
+	}
+
+	if (e == NULL && nentries < MEMPOOL_ENTRIES_MAX) {
+		e = &entries[nentries ++];
+		rspamd_strlcpy (e->tag, tag, sizeof (e->tag));
+		e->size_hint = 0;
+		e->bytes = 0;
+	}
+
+	G_UNLOCK (entries);
+
+	return e;
+}
+
+/* Chunks of tasks pools could be allocated and freed by threads */
+static inline void
+rspamd_mempool_account (rspamd_mempool_t *pool, gssize len)
+{
+	g_atomic_pointer_add (&pools_bytes, len);
+
+	if (pool->entry) {
+		g_atomic_pointer_add (&pool->entry->bytes, len);
+	}
+}
+
+static void
+rspamd_mempool_entry_update (rspamd_mempool_t *pool)
+{
+	struct _pool_chain *cur;
+	gsize used = 0, hint;
+	guint i;
+
+	if (pool->entry == NULL || pool->pools[RSPAMD_MEMPOOL_NORMAL] == NULL) {
+		return;
+	}
+
+	for (i = 0; i < pool->pools[RSPAMD_MEMPOOL_NORMAL]->len; i ++) {
+		cur = g_ptr_array_index (pool->pools[RSPAMD_MEMPOOL_NORMAL], i);
+		used += cur->pos - cur->begin;
+	}
+
+	if (used == 0) {
+		return;
+	}
+
+	/* Exponential moving average to smooth spikes of large pools */
+	hint = pool->entry->size_hint;
+	hint = hint == 0 ? used : (hint * 3 + used) / 4;
+	pool->entry->size_hint = MIN (hint, MEMPOOL_SIZE_HINT_MAX);
+}
+
+/* MPOL_INTERLEAVE from numaif.h, libnuma is not required for a syscall */
+#define RSPAMD_MPOL_INTERLEAVE 3
+
+static void
+rspamd_mempool_interleave (gpointer map, gsize len)
+{
+#ifdef SYS_mbind
+	gulong mask;
+
+	if (numa_interleave_nodes <= 1) {
+		return;
+	}
+
+	if (numa_interleave_nodes >= sizeof (mask) * NBBY) {
+		mask = G_MAXULONG;
+	}
+	else {
+		mask = (1UL << numa_interleave_nodes) - 1;
+	}
+
+	/* Pages are not touched yet, so the policy applies to all of them */
+	if (syscall (SYS_mbind, map, len, RSPAMD_MPOL_INTERLEAVE, &mask,
+			sizeof (mask) * NBBY, 0) == -1) {
+		msg_debug ("cannot interleave %z bytes of shared memory: %s", len,
+				strerror (errno));
+	}
+#endif
+}
+
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
@@ -82,6 +297,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 					sizeof (struct _pool_chain));
 			abort ();
 		}
+		rspamd_mempool_interleave (map, size + sizeof (struct _pool_chain));
 		chain = map;
 		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
 #elif defined(HAVE_MMAP_ZERO)
@@ -102,6 +318,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 					sizeof (struct _pool_chain));
 			abort ();
 		}
+		rspamd_mempool_interleave (map, size + sizeof (struct _pool_chain));
 		chain = map;
 		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
 #else
@@ -111,9 +328,20 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
 	}
 	else {
-		map = g_slice_alloc (sizeof (struct _pool_chain) + size);
-		chain = map;
-		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+		chain = always_malloc ? NULL : rspamd_mempool_cache_get (size);
+
+		if (chain != NULL) {
+			/* Cached chunk could be larger than requested */
+			size = chain->len;
+			g_atomic_int_inc (&mem_pool_stat->chunks_cache_hits);
+		}
+		else {
+			map = g_slice_alloc (sizeof (struct _pool_chain) + size);
+			chain = map;
+			chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+			g_atomic_int_inc (&mem_pool_stat->chunks_cache_misses);
+		}
+
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
 		g_atomic_int_inc (&mem_pool_stat->chunks_allocated);
 	}
@@ -121,6 +349,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 	chain->pos = align_ptr (chain->begin, MEM_ALIGNMENT);
 	chain->len = size;
 	chain->lock = NULL;
+	chain->next = NULL;
 
 	return chain;
 }
@@ -197,9 +426,6 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 {
 	rspamd_mempool_t *new;
 	gpointer map;
-	unsigned char uidbuf[10];
-	const gchar hexdigits[] = "0123456789abcdef";
-	unsigned i;
 
 	g_return_val_if_fail (size > 0, NULL);
 	/* Allocate statistic structure if it is not allocated before */
@@ -260,18 +486,14 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 
 	if (tag) {
 		rspamd_strlcpy (new->tag.tagname, tag, sizeof (new->tag.tagname));
+		new->entry = rspamd_mempool_entry_get (new->tag.tagname);
 	}
 	else {
 		new->tag.tagname[0] = '\0';
 	}
 
 	/* Generate new uid */
-	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
-	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
-		new->tag.uid[i * 2] = hexdigits[(uidbuf[i] >> 4) & 0xf];
-		new->tag.uid[i * 2 + 1] = hexdigits[uidbuf[i] & 0xf];
-	}
-	new->tag.uid[19] = '\0';
+	rspamd_mempool_generate_uid (new);
 
 	mem_pool_stat->pools_allocated++;
 
@@ -284,7 +506,7 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 {
 	guint8 *tmp;
 	struct _pool_chain *new, *cur;
-	gsize free = 0;
+	gsize free = 0, elt_len;
 
 	if (pool) {
 		POOL_MTX_LOCK ();
@@ -311,19 +533,28 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 		}
 
 		if (cur == NULL || free < size) {
+			elt_len = pool->elt_len;
+
+			if (cur == NULL && pool_type == RSPAMD_MEMPOOL_NORMAL &&
+					pool->entry && pool->entry->size_hint > elt_len) {
+				/* First chunk is large enough for a typical pool of this tag */
+				elt_len = pool->entry->size_hint;
+			}
+
 			/* Allocate new chain element */
-			if (pool->elt_len >= size + MEM_ALIGNMENT) {
-				new = rspamd_mempool_chain_new (pool->elt_len + MEM_ALIGNMENT,
+			if (elt_len >= size + MEM_ALIGNMENT) {
+				new = rspamd_mempool_chain_new (elt_len + MEM_ALIGNMENT,
 						pool_type);
 			}
 			else {
 				mem_pool_stat->oversized_chunks++;
 				new = rspamd_mempool_chain_new (
-						size + pool->elt_len + MEM_ALIGNMENT, pool_type);
+						size + elt_len + MEM_ALIGNMENT, pool_type);
 			}
 
 			/* Connect to pool subsystem */
 			rspamd_mempool_append_chain (pool, new, pool_type);
+			rspamd_mempool_account (pool, new->len);
 			/* No need to align again */
 			tmp = new->pos;
 			new->pos = tmp + size;
@@ -500,16 +731,31 @@ rspamd_mempool_replace_destructor (rspamd_mempool_t * pool,
 	}
 }
 
-void
-rspamd_mempool_delete (rspamd_mempool_t * pool)
+static void
+rspamd_mempool_chain_free (struct _pool_chain *cur,
+		enum rspamd_mempool_chain_type pool_type)
 {
-	struct _pool_chain *cur;
-	struct _pool_destructors *destructor;
-	gpointer ptr;
-	guint i, j;
 	gsize len;
 
-	POOL_MTX_LOCK ();
+	g_atomic_int_add (&mem_pool_stat->bytes_allocated,
+			-((gint)cur->len));
+	g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
+
+	len = cur->len + sizeof (struct _pool_chain);
+
+	if (pool_type == RSPAMD_MEMPOOL_SHARED) {
+		munmap ((void *)cur, len);
+	}
+	else if (!rspamd_mempool_cache_put (cur)) {
+		g_slice_free1 (len, cur);
+	}
+}
+
+static void
+rspamd_mempool_destructors_enforce (rspamd_mempool_t *pool)
+{
+	struct _pool_destructors *destructor;
+	guint i;
 
 	/* Call all pool destructors */
 	for (i = 0; i < pool->destructors->len; i ++) {
@@ -519,25 +765,53 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 			destructor->func (destructor->data);
 		}
 	}
+}
 
+static void
+rspamd_mempool_trash_free (rspamd_mempool_t *pool)
+{
+	gpointer ptr;
+	guint i;
+
+	for (i = 0; i < pool->trash_stack->len; i++) {
+		ptr = g_ptr_array_index (pool->trash_stack, i);
+		g_free (ptr);
+	}
+}
+
+static void
+rspamd_mempool_generate_uid (rspamd_mempool_t *pool)
+{
+	unsigned char uidbuf[10];
+	const gchar hexdigits[] = "0123456789abcdef";
+	unsigned i;
+
+	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
+	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
+		pool->tag.uid[i * 2] = hexdigits[(uidbuf[i] >> 4) & 0xf];
+		pool->tag.uid[i * 2 + 1] = hexdigits[uidbuf[i] & 0xf];
+	}
+	pool->tag.uid[19] = '\0';
+}
+
+void
+rspamd_mempool_delete (rspamd_mempool_t * pool)
+{
+	struct _pool_chain *cur;
+	guint i, j;
+
+	POOL_MTX_LOCK ();
+
+	rspamd_mempool_destructors_enforce (pool);
 	g_array_free (pool->destructors, TRUE);
+	rspamd_mempool_entry_update (pool);
 
 	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
 		if (pool->pools[i]) {
 			for (j = 0; j < pool->pools[i]->len; j++) {
 				cur = g_ptr_array_index (pool->pools[i], j);
-				g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-						-((gint)cur->len));
-				g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-
-				len = cur->len + sizeof (struct _pool_chain);
-
-				if (i == RSPAMD_MEMPOOL_SHARED) {
-					munmap ((void *)cur, len);
-				}
-				else {
-					g_slice_free1 (len, cur);
-				}
+				rspamd_mempool_account (pool, -((gssize)cur->len));
+				rspamd_mempool_chain_free (cur, i);
 			}
 
 			g_ptr_array_free (pool->pools[i], TRUE);
@@ -549,11 +823,7 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 	}
 
 	if (pool->trash_stack) {
-		for (i = 0; i < pool->trash_stack->len; i++) {
-			ptr = g_ptr_array_index (pool->trash_stack, i);
-			g_free (ptr);
-		}
-
+		rspamd_mempool_trash_free (pool);
 		g_ptr_array_free (pool->trash_stack, TRUE);
 	}
 
@@ -562,24 +832,76 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 	g_slice_free (rspamd_mempool_t, pool);
 }
 
+void
+rspamd_mempool_reset (rspamd_mempool_t *pool)
+{
+	struct _pool_chain *cur;
+	guint i, j, first;
+	gsize hint;
+
+	POOL_MTX_LOCK ();
+
+	rspamd_mempool_destructors_enforce (pool);
+	g_array_set_size (pool->destructors, 0);
+	rspamd_mempool_entry_update (pool);
+
+	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
+		if (pool->pools[i]) {
+			first = 0;
+
+			if (i == RSPAMD_MEMPOOL_NORMAL && pool->pools[i]->len > 0) {
+				cur = g_ptr_array_index (pool->pools[i], 0);
+				hint = MAX (pool->elt_len,
+						pool->entry ? pool->entry->size_hint : 0);
+
+				/*
+				 * Keep the first chunk if it is not oversized and it is not
+				 * smaller than a typical pool of this tag
+				 */
+				if (cur->len >= hint && cur->len <= (hint + MEM_ALIGNMENT) * 4) {
+					cur->pos = align_ptr (cur->begin, MEM_ALIGNMENT);
+					first = 1;
+				}
+			}
+
+			for (j = first; j < pool->pools[i]->len; j++) {
+				cur = g_ptr_array_index (pool->pools[i], j);
+				rspamd_mempool_account (pool, -((gssize)cur->len));
+				rspamd_mempool_chain_free (cur, i);
+			}
+
+			g_ptr_array_set_size (pool->pools[i], first);
+		}
+	}
+
+	if (pool->variables) {
+		g_hash_table_remove_all (pool->variables);
+	}
+
+	if (pool->trash_stack) {
+		rspamd_mempool_trash_free (pool);
+		g_ptr_array_set_size (pool->trash_stack, 0);
+	}
+
+	rspamd_mempool_generate_uid (pool);
+	g_atomic_int_inc (&mem_pool_stat->pools_freed);
+	mem_pool_stat->pools_allocated++;
+	POOL_MTX_UNLOCK ();
+}
+
 void
 rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 {
 	struct _pool_chain *cur;
 	guint i;
-	gsize len;
 
 	POOL_MTX_LOCK ();
 
 	if (pool->pools[RSPAMD_MEMPOOL_TMP]) {
 		for (i = 0; i < pool->pools[RSPAMD_MEMPOOL_TMP]->len; i++) {
 			cur = g_ptr_array_index (pool->pools[RSPAMD_MEMPOOL_TMP], i);
-			g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-					-((gint)cur->len));
-			g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-			len = cur->len + sizeof (struct _pool_chain);
-
-			g_slice_free1 (len, cur);
+			rspamd_mempool_account (pool, -((gssize)cur->len));
+			rspamd_mempool_chain_free (cur, RSPAMD_MEMPOOL_TMP);
 		}
 
 		g_ptr_array_free (pool->pools[RSPAMD_MEMPOOL_TMP], TRUE);
@@ -602,6 +924,8 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_cache_hits = mem_pool_stat->chunks_cache_hits;
+		st->chunks_cache_misses = mem_pool_stat->chunks_cache_misses;
 	}
 }
 
@@ -874,3 +1198,33 @@ rspamd_mempool_remove_variable (rspamd_mempool_t *pool, const gchar *name)
 		g_hash_table_remove (pool->variables, name);
 	}
 }
+
+void
+rspamd_mempool_set_numa_interleave (guint nodes)
+{
+	numa_interleave_nodes = nodes;
+}
+
+gsize
+rspamd_mempool_tag_bytes (const gchar *tag)
+{
+	gsize ret = 0;
+	guint i;
+
+	if (tag == NULL) {
+		return (gsize)g_atomic_pointer_get (&pools_bytes);
+	}
+
+	G_LOCK (entries);
+
+	for (i = 0; i < nentries; i ++) {
+		if (strcmp (entries[i].tag, tag) == 0) {
+			ret = (gsize)g_atomic_pointer_get (&entries[i].bytes);
+			break;
+		}
+	}
+
+	G_UNLOCK (entries);
+
+	return ret;
+}
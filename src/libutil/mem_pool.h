@@ -66,6 +66,7 @@ struct _pool_chain {
 	guint8 *pos;                    /**< current start of free space in block   */
 	gsize len;                      /**< length of block                        */
 	rspamd_mempool_mutex_t *lock;
+	struct _pool_chain *next;       /**< next free block in chunks cache        */
 };
 
 /**
@@ -90,6 +91,7 @@ struct rspamd_mempool_tag {
  * Memory pool type
  */
 struct rspamd_mutex_s;
+struct rspamd_mempool_entry_point;
 typedef struct memory_pool_s {
 	GPtrArray *pools[RSPAMD_MEMPOOL_MAX];
 	GArray *destructors;
@@ -97,6 +99,7 @@ typedef struct memory_pool_s {
 	GHashTable *variables;                  /**< private memory pool variables			*/
 	gsize elt_len;							/**< size of an element						*/
 	struct rspamd_mempool_tag tag;          /**< memory pool tag						*/
+	struct rspamd_mempool_entry_point *entry; /**< size estimation for pools with this tag */
 } rspamd_mempool_t;
 
 /**
@@ -110,6 +113,8 @@ typedef struct memory_pool_stat_s {
 	guint shared_chunks_allocated;      /**< shared chunks allocated							*/
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
+	guint chunks_cache_hits;            /**< chunks reused from cache of freed chunks			*/
+	guint chunks_cache_misses;          /**< chunks allocated as cache had no suitable chunk	*/
 } rspamd_mempool_stat_t;
 
 
@@ -227,6 +232,13 @@ void rspamd_mempool_replace_destructor (rspamd_mempool_t *pool,
  */
 void rspamd_mempool_delete (rspamd_mempool_t *pool);
 
+/**
+ * Call destructors chain of pool and release its memory except for the first
+ * chunk, so pool could be used again as a new one (with a new uid)
+ * @param pool memory pool object
+ */
+void rspamd_mempool_reset (rspamd_mempool_t *pool);
+
 /**
  * Get new mutex from pool (allocated in shared memory)
  * @param pool memory pool object
@@ -288,6 +300,22 @@ void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset (void);
 
+/**
+ * Interleave pages of shared chunks allocated after this call over the
+ * specified number of NUMA nodes, so memory written by processes on all nodes
+ * is not concentrated on a single one
+ * @param nodes number of nodes (0 or 1 disables interleaving)
+ */
+void rspamd_mempool_set_numa_interleave (guint nodes);
+
+/**
+ * Returns size of chunks held by live pools of the current process that have
+ * the specified tag, it allows to attribute memory usage to subsystems
+ * @param tag tag of pools or NULL for all pools
+ * @return number of bytes
+ */
+gsize rspamd_mempool_tag_bytes (const gchar *tag);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
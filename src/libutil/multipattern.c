@@ -24,23 +24,22 @@
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
+#include "libutil/hs_shared.h"
 #else
 #include "acism.h"
 #endif
 
-#define MAX_SCRATCH 4
-
 static const char *hs_cache_dir = NULL;
+static gboolean hs_shared_db = FALSE;
 
 struct rspamd_multipattern {
 #ifdef WITH_HYPERSCAN
 	hs_database_t *db;
-	hs_scratch_t *scratch[MAX_SCRATCH];
+	gsize db_maplen;
 	GArray *hs_pats;
 	GArray *hs_ids;
 	GArray *hs_flags;
 	rspamd_cryptobox_hash_state_t hash_state;
-	guint scratch_used;
 #else
 	ac_trie_t *t;
 	GArray *pats;
@@ -57,9 +56,10 @@ rspamd_multipattern_quark (void)
 }
 
 void
-rspamd_multipattern_library_init (const gchar *cache_dir)
+rspamd_multipattern_library_init (const gchar *cache_dir, gboolean shared_db)
 {
 	hs_cache_dir = cache_dir;
+	hs_shared_db = shared_db;
 }
 
 #ifdef WITH_HYPERSCAN
@@ -429,6 +429,21 @@ rspamd_multipattern_try_load_hs (struct rspamd_multipattern *mp,
 			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
 
 	if ((map = rspamd_file_xmap (fp, PROT_READ, &len)) != NULL) {
+		if (hs_shared_db) {
+			/* Strip '.hsmp' suffix */
+			fp[strlen (fp) - 5] = '\0';
+			mp->db = rspamd_hs_shared_map (fp, map, len, &mp->db_maplen);
+
+			if (mp->db != NULL) {
+				munmap (map, len);
+				return TRUE;
+			}
+
+			mp->db_maplen = 0;
+			rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmp", hs_cache_dir,
+					(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+		}
+
 		if (hs_deserialize_database (map, len, &mp->db) == HS_SUCCESS) {
 			munmap (map, len);
 			return TRUE;
@@ -508,9 +523,7 @@ rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 
 		rspamd_multipattern_try_save_hs (mp, hash);
 
-		for (i = 0; i < MAX_SCRATCH; i ++) {
-			g_assert (hs_alloc_scratch (mp->db, &mp->scratch[i]) == HS_SUCCESS);
-		}
+		g_assert (rspamd_hs_scratch_register (mp->db));
 	}
 #else
 	if (mp->cnt > 0) {
@@ -527,7 +540,9 @@ struct rspamd_multipattern_cbdata {
 	const gchar *in;
 	gsize len;
 	rspamd_multipattern_cb_t cb;
+	rspamd_multipattern_vector_cb_t vcb;
 	gpointer ud;
+	guint input;
 	guint nfound;
 	gint ret;
 };
@@ -549,7 +564,13 @@ rspamd_multipattern_hs_cb (unsigned int id,
 			from = 0;
 		}
 
-		ret = cbd->cb (cbd->mp, id, from, to, cbd->in, cbd->len, cbd->ud);
+		if (cbd->vcb) {
+			ret = cbd->vcb (cbd->mp, id, from, to, cbd->input,
+					cbd->in, cbd->len, cbd->ud);
+		}
+		else {
+			ret = cbd->cb (cbd->mp, id, from, to, cbd->in, cbd->len, cbd->ud);
+		}
 
 		cbd->nfound ++;
 		cbd->ret = ret;
@@ -566,8 +587,15 @@ rspamd_multipattern_acism_cb (int strnum, int textpos, void *context)
 	ac_trie_pat_t pat;
 
 	pat = g_array_index (cbd->mp->pats, ac_trie_pat_t, strnum);
-	ret = cbd->cb (cbd->mp, strnum, textpos - pat.len,
-			textpos, cbd->in, cbd->len, cbd->ud);
+
+	if (cbd->vcb) {
+		ret = cbd->vcb (cbd->mp, strnum, textpos - pat.len,
+				textpos, cbd->input, cbd->in, cbd->len, cbd->ud);
+	}
+	else {
+		ret = cbd->cb (cbd->mp, strnum, textpos - pat.len,
+				textpos, cbd->in, cbd->len, cbd->ud);
+	}
 
 	cbd->nfound ++;
 	cbd->ret = ret;
@@ -594,28 +622,21 @@ rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 	cbd.in = in;
 	cbd.len = len;
 	cbd.cb = cb;
+	cbd.vcb = NULL;
 	cbd.ud = ud;
+	cbd.input = 0;
 	cbd.nfound = 0;
 	cbd.ret = 0;
 
 #ifdef WITH_HYPERSCAN
-	hs_scratch_t *scr = NULL;
-	guint i;
-
-	for (i = 0; i < MAX_SCRATCH; i ++) {
-		if (!(mp->scratch_used & (1 << i))) {
-			mp->scratch_used |= (1 << i);
-			scr = mp->scratch[i];
-			break;
-		}
-	}
+	hs_scratch_t *scr;
+	guint gen;
 
+	scr = rspamd_hs_scratch_acquire (&gen);
 	g_assert (scr != NULL);
-
 	ret = hs_scan (mp->db, in, len, 0, scr,
 			rspamd_multipattern_hs_cb, &cbd);
-
-	mp->scratch_used &= ~(1 << i);
+	rspamd_hs_scratch_release (scr, gen);
 
 	if (ret == HS_SUCCESS) {
 		ret = 0;
@@ -637,6 +658,101 @@ rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 	return ret;
 }
 
+gint
+rspamd_multipattern_lookup_vector (struct rspamd_multipattern *mp,
+		const gchar **in, const gsize *lens, guint ninputs,
+		rspamd_multipattern_vector_cb_t cb,
+		gpointer ud, guint *pnfound)
+{
+	struct rspamd_multipattern_cbdata cbd;
+	gint ret = 0;
+	guint j;
+
+	g_assert (mp != NULL);
+
+	if (mp->cnt == 0 || !mp->compiled || ninputs == 0) {
+		if (pnfound) {
+			*pnfound = 0;
+		}
+
+		return 0;
+	}
+
+	g_assert (in != NULL && lens != NULL);
+
+	cbd.mp = mp;
+	cbd.cb = NULL;
+	cbd.vcb = cb;
+	cbd.ud = ud;
+	cbd.nfound = 0;
+	cbd.ret = 0;
+
+#ifdef WITH_HYPERSCAN
+	hs_scratch_t *scr;
+	guint gen;
+
+	/*
+	 * We don't use hs_scan_vector here as it treats all inputs as a single
+	 * contiguous block, so matches could span several unrelated inputs.
+	 * Instead, we reuse the same scratch for all inputs.
+	 */
+	scr = rspamd_hs_scratch_acquire (&gen);
+	g_assert (scr != NULL);
+
+	for (j = 0; j < ninputs; j ++) {
+		if (in[j] == NULL || lens[j] == 0) {
+			continue;
+		}
+
+		cbd.in = in[j];
+		cbd.len = lens[j];
+		cbd.input = j;
+		ret = hs_scan (mp->db, in[j], lens[j], 0, scr,
+				rspamd_multipattern_hs_cb, &cbd);
+
+		if (ret == HS_SUCCESS) {
+			ret = 0;
+		}
+		else if (ret == HS_SCAN_TERMINATED) {
+			ret = cbd.ret;
+			break;
+		}
+		else {
+			/* Error */
+			break;
+		}
+	}
+
+	rspamd_hs_scratch_release (scr, gen);
+#else
+	gint state;
+	gboolean icase = mp->flags & RSPAMD_MULTIPATTERN_ICASE;
+
+	for (j = 0; j < ninputs; j ++) {
+		if (in[j] == NULL || lens[j] == 0) {
+			continue;
+		}
+
+		cbd.in = in[j];
+		cbd.len = lens[j];
+		cbd.input = j;
+		state = 0;
+		ret = acism_lookup (mp->t, in[j], lens[j],
+				rspamd_multipattern_acism_cb, &cbd, &state, icase);
+
+		if (ret != 0) {
+			break;
+		}
+	}
+#endif
+
+	if (pnfound) {
+		*pnfound = cbd.nfound;
+	}
+
+	return ret;
+}
+
 
 void
 rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
@@ -648,11 +764,12 @@ rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
 		gchar *p;
 
 		if (mp->compiled && mp->cnt > 0) {
-			for (i = 0; i < MAX_SCRATCH; i ++) {
-				hs_free_scratch (mp->scratch[i]);
+			if (mp->db_maplen > 0) {
+				rspamd_hs_shared_unmap (mp->db, mp->db_maplen);
+			}
+			else {
+				hs_free_database (mp->db);
 			}
-
-			hs_free_database (mp->db);
 		}
 
 		for (i = 0; i < mp->cnt; i ++) {
@@ -56,11 +56,34 @@ typedef gint (*rspamd_multipattern_cb_t) (struct rspamd_multipattern *mp,
 		gsize len,
 		void *context);
 
+/**
+ * Called on pattern match in a vectored lookup
+ * @param mp multipattern structure
+ * @param strnum number of pattern matched
+ * @param match_start start of match in the input
+ * @param match_pos end of match in the input
+ * @param input index of input where pattern has been matched
+ * @param text input text
+ * @param len length of input text
+ * @param context userdata
+ * @return if 0 then search for another pattern, otherwise return this value to caller
+ */
+typedef gint (*rspamd_multipattern_vector_cb_t) (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		guint input,
+		const gchar *text,
+		gsize len,
+		void *context);
+
 /**
  * Init multipart library and set the appropriate cache dir
  * @param cache_dir
+ * @param shared_db map cached databases shared among processes
  */
-void rspamd_multipattern_library_init (const gchar *cache_dir);
+void rspamd_multipattern_library_init (const gchar *cache_dir,
+		gboolean shared_db);
 
 /**
  * Creates empty multipattern structure
@@ -129,6 +152,24 @@ gboolean rspamd_multipattern_compile (struct rspamd_multipattern *mp,
 gint rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 		const gchar *in, gsize len, rspamd_multipattern_cb_t cb,
 		gpointer ud, guint *pnfound);
+
+/**
+ * Lookups for patterns in several independent inputs at once. Matches cannot
+ * span inputs boundaries, but scanning setup is performed merely once for all
+ * inputs
+ * @param mp
+ * @param in array of inputs (NULL or empty inputs are skipped)
+ * @param lens array of inputs lengths
+ * @param ninputs number of inputs
+ * @param cb if callback returns non-zero, then search is terminated and that value is returned
+ * @param ud callback data
+ * @return
+ */
+gint rspamd_multipattern_lookup_vector (struct rspamd_multipattern *mp,
+		const gchar **in, const gsize *lens, guint ninputs,
+		rspamd_multipattern_vector_cb_t cb,
+		gpointer ud, guint *pnfound);
+
 /**
  * Get pattern string from multipattern identified by index
  * @param mp
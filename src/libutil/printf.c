@@ -42,6 +42,7 @@
 #include "fstring.h"
 #include "str_util.h"
 #include <math.h>
+#include <float.h>
 
 /**
  * From FreeBSD libutil code
@@ -50,6 +51,340 @@ static const int maxscale = 6;
 static const gchar _hex[] = "0123456789abcdef";
 static const gchar _HEX[] = "0123456789ABCDEF";
 
+static const gchar rspamd_digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/*
+ * Short decimal representation of doubles using Grisu2 algorithm by
+ * Florian Loitsch ("Printing Floating-Point Numbers Quickly and Accurately
+ * with Integers"), the output is always converted back to the same double
+ */
+struct rspamd_diy_fp {
+	guint64 f;
+	gint e;
+};
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+#define DP_EXPONENT_BIAS (0x3FF + 52)
+
+/* Normalized powers of 10 from 10^-348 to 10^340 with step 8 */
+static const guint64 rspamd_cached_powers_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+	0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+	0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+	0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+	0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+	0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+	0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+	0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+	0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+	0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+	0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+	0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+	0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+	0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+	0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+	0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+	0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+	0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+	0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+	0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+	0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+	0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const gint16 rspamd_cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const guint64 rspamd_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+static inline struct rspamd_diy_fp
+rspamd_diy_fp_mul (struct rspamd_diy_fp x, struct rspamd_diy_fp y)
+{
+	struct rspamd_diy_fp r;
+	guint64 a, b, c, d, ac, bc, ad, bd, tmp;
+
+	a = x.f >> 32;
+	b = x.f & 0xFFFFFFFFULL;
+	c = y.f >> 32;
+	d = y.f & 0xFFFFFFFFULL;
+	ac = a * c;
+	bc = b * c;
+	ad = a * d;
+	bd = b * d;
+	tmp = (bd >> 32) + (ad & 0xFFFFFFFFULL) + (bc & 0xFFFFFFFFULL);
+	/* Round */
+	tmp += 1U << 31;
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+
+	return r;
+}
+
+static inline struct rspamd_diy_fp
+rspamd_diy_fp_normalize (struct rspamd_diy_fp x)
+{
+	gint s = __builtin_clzll (x.f);
+
+	x.f <<= s;
+	x.e -= s;
+
+	return x;
+}
+
+static void
+rspamd_grisu_round (gchar *buf, gint len, guint64 delta, guint64 rest,
+		guint64 ten_kappa, guint64 wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+			(rest + ten_kappa < wp_w ||
+			 wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1] --;
+		rest += ten_kappa;
+	}
+}
+
+static gint
+rspamd_grisu_digits (struct rspamd_diy_fp w, struct rspamd_diy_fp mp,
+		guint64 delta, gchar *buf, gint *k)
+{
+	struct rspamd_diy_fp one;
+	guint64 wp_w, p2, tmp;
+	guint32 p1, d;
+	gint kappa, len = 0, idx;
+
+	one.f = 1ULL << -mp.e;
+	one.e = mp.e;
+	wp_w = mp.f - w.f;
+	p1 = mp.f >> -one.e;
+	p2 = mp.f & (one.f - 1);
+
+	for (kappa = 1; kappa < 10 && p1 >= rspamd_pow10[kappa]; kappa ++);
+
+	while (kappa > 0) {
+		d = p1 / (guint32)rspamd_pow10[kappa - 1];
+		p1 %= (guint32)rspamd_pow10[kappa - 1];
+
+		if (d || len) {
+			buf[len++] = '0' + d;
+		}
+
+		kappa --;
+		tmp = ((guint64)p1 << -one.e) + p2;
+
+		if (tmp <= delta) {
+			*k += kappa;
+			rspamd_grisu_round (buf, len, delta, tmp,
+					rspamd_pow10[kappa] << -one.e, wp_w);
+
+			return len;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		d = p2 >> -one.e;
+
+		if (d || len) {
+			buf[len++] = '0' + d;
+		}
+
+		p2 &= one.f - 1;
+		kappa --;
+
+		if (p2 < delta) {
+			*k += kappa;
+			idx = -kappa;
+			rspamd_grisu_round (buf, len, delta, p2, one.f,
+					wp_w * (idx < 20 ? rspamd_pow10[idx] : 0));
+
+			return len;
+		}
+	}
+}
+
+/* Writes digits of positive finite `v`, returns their number and exponent */
+static gint
+rspamd_grisu2 (gdouble v, gchar *buf, gint *k)
+{
+	union {
+		gdouble d;
+		guint64 u;
+	} u;
+	struct rspamd_diy_fp w, wp, wm, c;
+	gint biased_e, ck, idx;
+	gdouble dk;
+
+	u.d = v;
+	biased_e = (u.u >> 52) & 0x7FF;
+
+	if (biased_e != 0) {
+		w.f = (u.u & DP_SIGNIFICAND_MASK) + DP_HIDDEN_BIT;
+		w.e = biased_e - DP_EXPONENT_BIAS;
+	}
+	else {
+		w.f = u.u & DP_SIGNIFICAND_MASK;
+		w.e = 1 - DP_EXPONENT_BIAS;
+	}
+
+	/* Boundaries m+ and m- with the same exponent */
+	wp.f = (w.f << 1) + 1;
+	wp.e = w.e - 1;
+	wp = rspamd_diy_fp_normalize (wp);
+
+	if (w.f == DP_HIDDEN_BIT) {
+		wm.f = (w.f << 2) - 1;
+		wm.e = w.e - 2;
+	}
+	else {
+		wm.f = (w.f << 1) - 1;
+		wm.e = w.e - 1;
+	}
+
+	wm.f <<= wm.e - wp.e;
+	wm.e = wp.e;
+
+	/* Cached power c = 10^-k, such that exponent of w * c is in [-60, -32] */
+	dk = (-61 - wp.e) * 0.30102999566398114 + 347;
+	ck = (gint)dk;
+
+	if (dk - ck > 0.0) {
+		ck ++;
+	}
+
+	idx = (ck >> 3) + 1;
+	*k = -(-348 + idx * 8);
+	c.f = rspamd_cached_powers_f[idx];
+	c.e = rspamd_cached_powers_e[idx];
+
+	w = rspamd_diy_fp_mul (rspamd_diy_fp_normalize (w), c);
+	wp = rspamd_diy_fp_mul (wp, c);
+	wm = rspamd_diy_fp_mul (wm, c);
+	wm.f ++;
+	wp.f --;
+
+	return rspamd_grisu_digits (w, wp, wp.f - wm.f, buf, k);
+}
+
+/*
+ * Prints the round-trip representation of a finite double: decimal notation
+ * is used for numbers from 1e-6 to 1e21 and exponential otherwise
+ */
+static gint
+rspamd_dtoa_shortest (gdouble v, gchar *out)
+{
+	gchar *p = out, digits[24];
+	gint len, k, kk, i, e;
+
+	if (signbit (v)) {
+		*p++ = '-';
+		v = -v;
+	}
+
+	if (v == 0) {
+		*p++ = '0';
+
+		return p - out;
+	}
+
+	len = rspamd_grisu2 (v, digits, &k);
+	/* 10^(kk-1) <= v < 10^kk */
+	kk = len + k;
+
+	if (k >= 0 && kk <= 21) {
+		/* 1234e3 -> 1234000 */
+		memcpy (p, digits, len);
+		p += len;
+
+		for (i = len; i < kk; i ++) {
+			*p++ = '0';
+		}
+	}
+	else if (kk > 0 && kk <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memcpy (p, digits, kk);
+		p += kk;
+		*p++ = '.';
+		memcpy (p, digits + kk, len - kk);
+		p += len - kk;
+	}
+	else if (kk > -6 && kk <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		*p++ = '0';
+		*p++ = '.';
+
+		for (i = kk; i < 0; i ++) {
+			*p++ = '0';
+		}
+
+		memcpy (p, digits, len);
+		p += len;
+	}
+	else {
+		/* 1234e30 -> 1.234e33 */
+		*p++ = digits[0];
+
+		if (len > 1) {
+			*p++ = '.';
+			memcpy (p, digits + 1, len - 1);
+			p += len - 1;
+		}
+
+		*p++ = 'e';
+		e = kk - 1;
+
+		if (e < 0) {
+			*p++ = '-';
+			e = -e;
+		}
+
+		if (e >= 100) {
+			*p++ = '0' + e / 100;
+			e %= 100;
+			*p++ = rspamd_digit_pairs[e * 2];
+			*p++ = rspamd_digit_pairs[e * 2 + 1];
+		}
+		else if (e >= 10) {
+			*p++ = rspamd_digit_pairs[e * 2];
+			*p++ = rspamd_digit_pairs[e * 2 + 1];
+		}
+		else {
+			*p++ = '0' + e;
+		}
+	}
+
+	return p - out;
+}
+
 static gchar *
 rspamd_humanize_number (gchar *buf, gchar *last, gint64 num, gboolean bytes)
 {
@@ -113,39 +448,40 @@ rspamd_sprintf_num (gchar *buf, gchar *last, guint64 ui64, gchar zero,
 {
 	gchar *p, temp[sizeof ("18446744073709551615")];
 	size_t len;
-	guint32 ui32;
+	guint32 ui32, idx;
 
 	p = temp + sizeof(temp);
 
 	if (hexadecimal == 0) {
+		/* Two digits at once, the higher part is handled by 64 bits division */
+		while (ui64 > G_MAXUINT32) {
+			idx = (ui64 % 100) * 2;
+			ui64 /= 100;
+			*--p = rspamd_digit_pairs[idx + 1];
+			*--p = rspamd_digit_pairs[idx];
+		}
 
-		if (ui64 <= G_MAXUINT32) {
-
-			/*
-			 * To divide 64-bit numbers and to find remainders
-			 * on the x86 platform gcc and icc call the libc functions
-			 * [u]divdi3() and [u]moddi3(), they call another function
-			 * in its turn.  On FreeBSD it is the qdivrem() function,
-			 * its source code is about 170 lines of the code.
-			 * The glibc counterpart is about 150 lines of the code.
-			 *
-			 * For 32-bit numbers and some divisors gcc and icc use
-			 * a inlined multiplication and shifts.  For example,
-			 * guint "i32 / 10" is compiled to
-			 *
-			 *	 (i32 * 0xCCCCCCCD) >> 35
-			 */
-
-			ui32 = (guint32) ui64;
-
-			do {
-				*--p = (gchar) (ui32 % 10 + '0');
-			} while (ui32 /= 10);
+		/*
+		 * To divide 64-bit numbers and to find remainders
+		 * on the x86 platform gcc and icc call the libc functions
+		 * [u]divdi3() and [u]moddi3(), whilst for 32-bit numbers
+		 * and constant divisors they use multiplication and shifts
+		 */
+		ui32 = (guint32) ui64;
 
-		} else {
-			do {
-				*--p = (gchar) (ui64 % 10 + '0');
-			} while (ui64 /= 10);
+		while (ui32 >= 100) {
+			idx = (ui32 % 100) * 2;
+			ui32 /= 100;
+			*--p = rspamd_digit_pairs[idx + 1];
+			*--p = rspamd_digit_pairs[idx];
+		}
+
+		if (ui32 >= 10) {
+			*--p = rspamd_digit_pairs[ui32 * 2 + 1];
+			*--p = rspamd_digit_pairs[ui32 * 2];
+		}
+		else {
+			*--p = (gchar) (ui32 + '0');
 		}
 
 	} else if (hexadecimal == 1) {
@@ -375,7 +711,7 @@ rspamd_vprintf_common (rspamd_printf_append_func func,
 	const gchar *fmt,
 	va_list args)
 {
-	gchar zero, numbuf[G_ASCII_DTOSTR_BUF_SIZE], *p, *last, c;
+	gchar zero, numbuf[G_ASCII_DTOSTR_BUF_SIZE], *p, *last, c, gfmt[8];
 	const gchar *buf_start = fmt;
 	gint d;
 	gdouble f, scale;
@@ -747,8 +1083,25 @@ rspamd_vprintf_common (rspamd_printf_append_func func,
 					f = (gdouble) va_arg (args, long double);
 				}
 
-				g_ascii_formatd (numbuf, sizeof (numbuf), "%g", (double)f);
-				slen = strlen (numbuf);
+				if (frac_width == 0 && isfinite (f)) {
+					slen = rspamd_dtoa_shortest (f, numbuf);
+				}
+				else {
+					if (frac_width > DBL_DIG + 2) {
+						frac_width = DBL_DIG + 2;
+					}
+
+					gfmt[0] = '%';
+					gfmt[1] = '.';
+					gfmt[2] = rspamd_digit_pairs[frac_width * 2];
+					gfmt[3] = rspamd_digit_pairs[frac_width * 2 + 1];
+					gfmt[4] = 'g';
+					gfmt[5] = '\0';
+					g_ascii_formatd (numbuf, sizeof (numbuf),
+							frac_width ? gfmt : "%g", (double)f);
+					slen = strlen (numbuf);
+				}
+
 				RSPAMD_PRINTF_APPEND (numbuf, slen);
 
 				continue;
@@ -30,8 +30,8 @@
  *	%[0][width][u][x|X|h|H]L	    gint64/guint64
  *	%[0][width][.width]f	    double
  *	%[0][width][.width]F	    long double
- *	%[0][width][.width]g	    double
- *	%[0][width][.width]G	    long double
+ *	%[.width]g	                double (shortest round-trip form if no precision)
+ *	%[.width]G	                long double
  *	%B                          boolean (true or false)
  *	%P						    pid_t
  *	%r				            rlim_t
@@ -18,6 +18,7 @@
 #include "rspamd.h"
 #include "mem_pool.h"
 #include "btrie.h"
+#include "unix-std.h"
 
 #define msg_err_radix(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "radix", tree->pool->tag.uid, \
@@ -36,12 +37,237 @@
         G_STRFUNC, \
         __VA_ARGS__)
 
+/*
+ * Compiled image contains sorted disjoint ranges of keys for IPv4 and IPv6
+ * keys lengths, each range is mapped to the value of the most specific
+ * prefix covering it, so lookup is a binary search over the mmaped image
+ */
+#define RADIX_IMAGE_MAGIC "rsradix1"
+#define RADIX_IMAGE_MAX_KEYLEN 16
+
+static const guint radix_image_keylens[] = {4, 16};
+
+struct radix_image_header {
+	gchar magic[8];
+	guint32 size;
+	guint32 strings_len;
+	guint32 nsegs[G_N_ELEMENTS (radix_image_keylens)];
+};
+
+/* Large tables are indexed by the first bits of keys to shorten searches */
+#define RADIX_IMAGE_INDEX_BITS 16
+#define RADIX_IMAGE_INDEX_MIN 4096
+
+struct radix_image_table {
+	const guchar *starts;
+	const guchar *ends;
+	const guint32 *values;
+	/* Number of ranges starting before each index bucket, built on load */
+	guint32 *index;
+	guint32 nsegs;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	size_t size;
 	struct btrie *tree;
+	/* Read only compiled image */
+	guchar *image;
+	gsize image_len;
+	gboolean image_mapped;
+	const gchar *strings;
+	guint32 strings_len;
+	struct radix_image_table tables[G_N_ELEMENTS (radix_image_keylens)];
 };
 
+static GQuark
+radix_error_quark (void)
+{
+	return g_quark_from_static_string ("radix-error");
+}
+
+#ifdef __GNUC__
+#define RADIX_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#else
+#define RADIX_PREFETCH(p) do {} while (0)
+#endif
+
+/* Number of keys searched simultaneously in batched lookups */
+#define RADIX_BATCH_SIZE 16
+
+/* Keys are compared as big endian numbers */
+static inline gint
+radix_image_keycmp (const guchar *a, const guchar *b, gsize keylen)
+{
+	guint64 x, y;
+	guint32 x32, y32;
+
+	if (keylen == 4) {
+		memcpy (&x32, a, sizeof (x32));
+		memcpy (&y32, b, sizeof (y32));
+		x32 = GUINT32_FROM_BE (x32);
+		y32 = GUINT32_FROM_BE (y32);
+
+		return x32 < y32 ? -1 : (x32 > y32);
+	}
+
+	memcpy (&x, a, sizeof (x));
+	memcpy (&y, b, sizeof (y));
+
+	if (x == y) {
+		memcpy (&x, a + sizeof (x), sizeof (x));
+		memcpy (&y, b + sizeof (y), sizeof (y));
+	}
+
+	x = GUINT64_FROM_BE (x);
+	y = GUINT64_FROM_BE (y);
+
+	return x < y ? -1 : (x > y);
+}
+
+static const struct radix_image_table *
+radix_image_table (radix_compressed_t *tree, gsize keylen)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (radix_image_keylens); i ++) {
+		if (radix_image_keylens[i] == keylen) {
+			return tree->tables[i].nsegs > 0 ? &tree->tables[i] : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/* Value of the range preceding `pos` (the first range starting after key) */
+static uintptr_t
+radix_image_value (radix_compressed_t *tree,
+		const struct radix_image_table *tbl, guint pos,
+		const guint8 *key, gsize keylen)
+{
+	if (pos == 0 ||
+			radix_image_keycmp (tbl->ends + (pos - 1) * keylen, key, keylen) < 0 ||
+			tbl->values[pos - 1] >= tree->strings_len) {
+		return RADIX_NO_VALUE;
+	}
+
+	return (uintptr_t)(tree->strings + tbl->values[pos - 1]);
+}
+
+static inline void
+radix_image_bounds (const struct radix_image_table *tbl, const guint8 *key,
+		guint *lo, guint *hi)
+{
+	guint bucket;
+
+	if (tbl->index) {
+		bucket = ((guint)key[0] << 8) | key[1];
+		*lo = tbl->index[bucket];
+		*hi = tbl->index[bucket + 1];
+	}
+	else {
+		*lo = 0;
+		*hi = tbl->nsegs;
+	}
+}
+
+static uintptr_t
+radix_image_find (radix_compressed_t *tree, const guint8 *key, gsize keylen)
+{
+	const struct radix_image_table *tbl;
+	guint lo, hi, mid;
+
+	tbl = radix_image_table (tree, keylen);
+
+	if (tbl == NULL) {
+		return RADIX_NO_VALUE;
+	}
+
+	/* Find the last range that starts not after the key */
+	radix_image_bounds (tbl, key, &lo, &hi);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (radix_image_keycmp (tbl->starts + mid * keylen, key, keylen) <= 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return radix_image_value (tree, tbl, lo, key, keylen);
+}
+
+/*
+ * Binary searches of several keys are interleaved, so the next probe of each
+ * key is prefetched while the others are compared
+ */
+static void
+radix_image_find_batch (radix_compressed_t *tree, const guint8 **keys,
+		const gsize *keylens, guint nkeys, uintptr_t *results)
+{
+	const struct radix_image_table *tbls[RADIX_BATCH_SIZE];
+	guint lo[RADIX_BATCH_SIZE], hi[RADIX_BATCH_SIZE], mid, i, active;
+	gsize kl;
+
+	g_assert (nkeys <= RADIX_BATCH_SIZE);
+	active = 0;
+
+	for (i = 0; i < nkeys; i ++) {
+		tbls[i] = radix_image_table (tree, keylens[i]);
+		lo[i] = 0;
+		hi[i] = 0;
+
+		if (tbls[i] != NULL) {
+			radix_image_bounds (tbls[i], keys[i], &lo[i], &hi[i]);
+			mid = lo[i] + (hi[i] - lo[i]) / 2;
+			RADIX_PREFETCH (tbls[i]->starts + mid * keylens[i]);
+			active ++;
+		}
+	}
+
+	while (active > 0) {
+		active = 0;
+
+		for (i = 0; i < nkeys; i ++) {
+			if (lo[i] >= hi[i]) {
+				continue;
+			}
+
+			kl = keylens[i];
+			mid = lo[i] + (hi[i] - lo[i]) / 2;
+
+			if (radix_image_keycmp (tbls[i]->starts + mid * kl, keys[i], kl) <= 0) {
+				lo[i] = mid + 1;
+			}
+			else {
+				hi[i] = mid;
+			}
+
+			if (lo[i] < hi[i]) {
+				mid = lo[i] + (hi[i] - lo[i]) / 2;
+				RADIX_PREFETCH (tbls[i]->starts + mid * kl);
+				active ++;
+			}
+			else if (lo[i] > 0) {
+				RADIX_PREFETCH (tbls[i]->ends + (lo[i] - 1) * kl);
+			}
+		}
+	}
+
+	for (i = 0; i < nkeys; i ++) {
+		if (tbls[i] == NULL) {
+			results[i] = RADIX_NO_VALUE;
+		}
+		else {
+			results[i] = radix_image_value (tree, tbls[i], lo[i], keys[i],
+					keylens[i]);
+		}
+	}
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
@@ -49,6 +275,10 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 
 	g_assert (tree != NULL);
 
+	if (tree->image) {
+		return radix_image_find (tree, key, keylen);
+	}
+
 	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
 
 	if (ret == NULL) {
@@ -72,6 +302,11 @@ radix_insert_compressed (radix_compressed_t * tree,
 	g_assert (tree != NULL);
 	g_assert (keybits >= masklen);
 
+	if (tree->image) {
+		msg_err_radix ("cannot insert to a compiled radix image");
+		return RADIX_NO_VALUE;
+	}
+
 	msg_debug_radix ("want insert value %p with mask %z, key: %*xs",
 			(gpointer)value, keybits - masklen, (int)keylen, key);
 
@@ -97,12 +332,12 @@ radix_create_compressed (void)
 {
 	radix_compressed_t *tree;
 
-	tree = g_slice_alloc (sizeof (*tree));
+	tree = g_slice_alloc0 (sizeof (*tree));
 	if (tree == NULL) {
 		return NULL;
 	}
 
-	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "radix");
 	tree->size = 0;
 	tree->tree = btrie_init (tree->pool);
 
@@ -113,11 +348,79 @@ void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
 	if (tree) {
+		if (tree->image) {
+			if (tree->image_mapped) {
+				munmap (tree->image, tree->image_len);
+			}
+			else {
+				g_free (tree->image);
+			}
+		}
+
 		rspamd_mempool_delete (tree->pool);
 		g_slice_free1 (sizeof (*tree), tree);
 	}
 }
 
+void
+radix_find_compressed_batch (radix_compressed_t *tree, const guint8 **keys,
+		const gsize *keylens, guint nkeys, uintptr_t *results)
+{
+	guint i, n;
+
+	g_assert (tree != NULL);
+
+	if (tree->image) {
+		for (i = 0; i < nkeys; i += n) {
+			n = MIN (nkeys - i, RADIX_BATCH_SIZE);
+			radix_image_find_batch (tree, keys + i, keylens + i, n,
+					results + i);
+		}
+	}
+	else {
+		for (i = 0; i < nkeys; i ++) {
+			results[i] = radix_find_compressed (tree, keys[i], keylens[i]);
+		}
+	}
+}
+
+void
+radix_find_compressed_addr_batch (radix_compressed_t *tree,
+		const rspamd_inet_addr_t **addrs, guint naddrs, uintptr_t *results)
+{
+	const guint8 *keys[RADIX_BATCH_SIZE];
+	gsize keylens[RADIX_BATCH_SIZE];
+	uintptr_t res[RADIX_BATCH_SIZE];
+	guint idx[RADIX_BATCH_SIZE];
+	guint i, j, n, nkeys, klen;
+
+	for (i = 0; i < naddrs; i += n) {
+		n = MIN (naddrs - i, RADIX_BATCH_SIZE);
+		nkeys = 0;
+
+		for (j = 0; j < n; j ++) {
+			results[i + j] = RADIX_NO_VALUE;
+
+			if (addrs[i + j] != NULL) {
+				klen = 0;
+				keys[nkeys] = rspamd_inet_address_get_radix_key (addrs[i + j],
+						&klen);
+
+				if (keys[nkeys] && klen) {
+					keylens[nkeys] = klen;
+					idx[nkeys ++] = i + j;
+				}
+			}
+		}
+
+		radix_find_compressed_batch (tree, keys, keylens, nkeys, res);
+
+		for (j = 0; j < nkeys; j ++) {
+			results[idx[j]] = res[j];
+		}
+	}
+}
+
 uintptr_t
 radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr)
@@ -254,5 +557,388 @@ radix_get_info (radix_compressed_t *tree)
 		return NULL;
 	}
 
+	if (tree->image) {
+		return "compiled image";
+	}
+
 	return btrie_stats (tree->tree);
 }
+
+/* Big endian arithmetic on keys */
+static gboolean
+radix_image_key_inc (guchar *key, guint keylen)
+{
+	gint i;
+
+	for (i = keylen - 1; i >= 0; i --) {
+		if (++key[i] != 0) {
+			return TRUE;
+		}
+	}
+
+	/* Overflow */
+	return FALSE;
+}
+
+static void
+radix_image_key_dec (guchar *key, guint keylen)
+{
+	gint i;
+
+	for (i = keylen - 1; i >= 0; i --) {
+		if (key[i]-- != 0) {
+			return;
+		}
+	}
+}
+
+struct radix_image_builder {
+	guint keylen;
+	GArray *starts;
+	GArray *ends;
+	GArray *values;
+	GHashTable *strings_idx;
+	GString *strings;
+	guchar pos[RADIX_IMAGE_MAX_KEYLEN];
+	gboolean done;
+	gint top;
+	struct {
+		guchar end[RADIX_IMAGE_MAX_KEYLEN];
+		guint32 value;
+	} stack[BTRIE_MAX_PREFIX + 1];
+};
+
+static void
+radix_image_emit (struct radix_image_builder *b, const guchar *start,
+		const guchar *end, guint32 value)
+{
+	guchar next[RADIX_IMAGE_MAX_KEYLEN];
+	guint n = b->values->len;
+
+	if (n > 0 && g_array_index (b->values, guint32, n - 1) == value) {
+		/* Merge adjacent ranges with the same value */
+		memcpy (next, b->ends->data + (n - 1) * b->keylen, b->keylen);
+
+		if (radix_image_key_inc (next, b->keylen) &&
+				memcmp (next, start, b->keylen) == 0) {
+			memcpy (b->ends->data + (n - 1) * b->keylen, end, b->keylen);
+			return;
+		}
+	}
+
+	g_array_append_vals (b->starts, start, b->keylen);
+	g_array_append_vals (b->ends, end, b->keylen);
+	g_array_append_val (b->values, value);
+}
+
+static guint32
+radix_image_string (struct radix_image_builder *b, const gchar *str)
+{
+	gpointer off;
+	guint32 ret;
+
+	if (g_hash_table_lookup_extended (b->strings_idx, str, NULL, &off)) {
+		return GPOINTER_TO_UINT (off);
+	}
+
+	ret = b->strings->len;
+	g_string_append_len (b->strings, str, strlen (str) + 1);
+	g_hash_table_insert (b->strings_idx, (gpointer)str, GUINT_TO_POINTER (ret));
+
+	return ret;
+}
+
+/* Prefixes are walked in lexicographical order, so they are nested intervals */
+static void
+radix_image_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_image_builder *b = user_data;
+	guchar start[RADIX_IMAGE_MAX_KEYLEN], last[RADIX_IMAGE_MAX_KEYLEN];
+	guint nbytes, i;
+
+	if (len > b->keylen * NBBY || b->done) {
+		/* Cannot match keys of this length */
+		return;
+	}
+
+	if (!post) {
+		nbytes = (len + NBBY - 1) / NBBY;
+		memset (start, 0, b->keylen);
+		memcpy (start, prefix, nbytes);
+
+		if (len % NBBY) {
+			start[nbytes - 1] &= 0xff << (NBBY - len % NBBY);
+		}
+
+		if (b->top >= 0 && memcmp (b->pos, start, b->keylen) < 0) {
+			/* Gap before this prefix belongs to the enclosing one */
+			memcpy (last, start, b->keylen);
+			radix_image_key_dec (last, b->keylen);
+			radix_image_emit (b, b->pos, last, b->stack[b->top].value);
+		}
+
+		memcpy (b->pos, start, b->keylen);
+		b->top ++;
+		memcpy (b->stack[b->top].end, start, b->keylen);
+
+		for (i = len; i < b->keylen * NBBY; i ++) {
+			b->stack[b->top].end[i / NBBY] |= 0x80 >> (i % NBBY);
+		}
+
+		b->stack[b->top].value = radix_image_string (b, data);
+	}
+	else {
+		g_assert (b->top >= 0);
+
+		if (memcmp (b->pos, b->stack[b->top].end, b->keylen) <= 0) {
+			radix_image_emit (b, b->pos, b->stack[b->top].end,
+					b->stack[b->top].value);
+			memcpy (b->pos, b->stack[b->top].end, b->keylen);
+
+			if (!radix_image_key_inc (b->pos, b->keylen)) {
+				/* The end of keys space */
+				b->done = TRUE;
+			}
+		}
+
+		b->top --;
+	}
+}
+
+gboolean
+radix_compressed_save (radix_compressed_t *tree, const gchar *path,
+		GError **err)
+{
+	struct radix_image_header hdr;
+	struct radix_image_builder b[G_N_ELEMENTS (radix_image_keylens)];
+	GHashTable *strings_idx;
+	GString *strings;
+	gchar tmppath[PATH_MAX];
+	gboolean ret = TRUE;
+	guint i;
+	gint fd;
+
+	g_assert (tree != NULL);
+
+	if (tree->image) {
+		g_set_error (err, radix_error_quark (), EINVAL,
+				"radix trie is already compiled");
+		return FALSE;
+	}
+
+	strings_idx = g_hash_table_new (g_direct_hash, g_direct_equal);
+	strings = g_string_new (NULL);
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RADIX_IMAGE_MAGIC, sizeof (hdr.magic));
+	hdr.size = tree->size;
+
+	for (i = 0; i < G_N_ELEMENTS (radix_image_keylens); i ++) {
+		memset (&b[i], 0, sizeof (b[i]));
+		b[i].keylen = radix_image_keylens[i];
+		b[i].starts = g_array_new (FALSE, FALSE, 1);
+		b[i].ends = g_array_new (FALSE, FALSE, 1);
+		b[i].values = g_array_new (FALSE, FALSE, sizeof (guint32));
+		b[i].strings_idx = strings_idx;
+		b[i].strings = strings;
+		b[i].top = -1;
+		btrie_walk (tree->tree, radix_image_walk_cb, &b[i]);
+		hdr.nsegs[i] = b[i].values->len;
+	}
+
+	hdr.strings_len = strings->len;
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s.new", path);
+	fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, radix_error_quark (), errno,
+				"cannot create %s: %s", tmppath, strerror (errno));
+		ret = FALSE;
+	}
+	else {
+		if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
+			ret = FALSE;
+		}
+
+		for (i = 0; i < G_N_ELEMENTS (radix_image_keylens) && ret; i ++) {
+			if (write (fd, b[i].starts->data, b[i].starts->len) !=
+					(gssize)b[i].starts->len ||
+					write (fd, b[i].ends->data, b[i].ends->len) !=
+					(gssize)b[i].ends->len ||
+					write (fd, b[i].values->data,
+							b[i].values->len * sizeof (guint32)) !=
+					(gssize)(b[i].values->len * sizeof (guint32))) {
+				ret = FALSE;
+			}
+		}
+
+		if (ret && write (fd, strings->str, strings->len) !=
+				(gssize)strings->len) {
+			ret = FALSE;
+		}
+
+		if (!ret) {
+			g_set_error (err, radix_error_quark (), errno,
+					"cannot write %s: %s", tmppath, strerror (errno));
+		}
+
+		close (fd);
+
+		if (ret && rename (tmppath, path) == -1) {
+			g_set_error (err, radix_error_quark (), errno,
+					"cannot rename %s: %s", tmppath, strerror (errno));
+			ret = FALSE;
+		}
+
+		if (!ret) {
+			unlink (tmppath);
+		}
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (radix_image_keylens); i ++) {
+		g_array_free (b[i].starts, TRUE);
+		g_array_free (b[i].ends, TRUE);
+		g_array_free (b[i].values, TRUE);
+	}
+
+	g_hash_table_unref (strings_idx);
+	g_string_free (strings, TRUE);
+
+	return ret;
+}
+
+gboolean
+radix_is_compiled_image (const guchar *data, gsize len)
+{
+	return len >= sizeof (struct radix_image_header) &&
+			memcmp (data, RADIX_IMAGE_MAGIC, sizeof (RADIX_IMAGE_MAGIC) - 1) == 0;
+}
+
+static void
+radix_image_build_index (radix_compressed_t *tree,
+		struct radix_image_table *tbl, guint keylen)
+{
+	const guint nbuckets = 1u << RADIX_IMAGE_INDEX_BITS;
+	guint i, bucket, next = 0;
+	const guchar *start;
+
+	tbl->index = rspamd_mempool_alloc (tree->pool,
+			(nbuckets + 1) * sizeof (*tbl->index));
+
+	/* Ranges are sorted, so buckets are filled in a single pass */
+	for (i = 0; i < tbl->nsegs; i ++) {
+		start = tbl->starts + i * keylen;
+		bucket = ((guint)start[0] << 8) | start[1];
+
+		while (next <= bucket) {
+			tbl->index[next ++] = i;
+		}
+	}
+
+	while (next <= nbuckets) {
+		tbl->index[next ++] = tbl->nsegs;
+	}
+}
+
+static radix_compressed_t *
+radix_image_init (guchar *image, gsize len, gboolean mapped, GError **err)
+{
+	radix_compressed_t *tree;
+	struct radix_image_header hdr;
+	const guchar *p;
+	gsize expected = sizeof (hdr);
+	guint i;
+
+	if (!radix_is_compiled_image (image, len)) {
+		g_set_error (err, radix_error_quark (), EINVAL,
+				"invalid radix image");
+		return NULL;
+	}
+
+	memcpy (&hdr, image, sizeof (hdr));
+
+	for (i = 0; i < G_N_ELEMENTS (radix_image_keylens); i ++) {
+		expected += (gsize)hdr.nsegs[i] *
+				(radix_image_keylens[i] * 2 + sizeof (guint32));
+	}
+
+	expected += hdr.strings_len;
+
+	if (expected != len || (hdr.strings_len > 0 &&
+			image[len - 1] != '\0')) {
+		g_set_error (err, radix_error_quark (), EINVAL,
+				"invalid radix image size: %z, %z expected", len, expected);
+		return NULL;
+	}
+
+	tree = g_slice_alloc0 (sizeof (*tree));
+	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "radix");
+	tree->size = hdr.size;
+	tree->image = image;
+	tree->image_len = len;
+	tree->image_mapped = mapped;
+	p = image + sizeof (hdr);
+
+	for (i = 0; i < G_N_ELEMENTS (radix_image_keylens); i ++) {
+		tree->tables[i].nsegs = hdr.nsegs[i];
+		tree->tables[i].starts = p;
+		p += hdr.nsegs[i] * radix_image_keylens[i];
+		tree->tables[i].ends = p;
+		p += hdr.nsegs[i] * radix_image_keylens[i];
+		tree->tables[i].values = (const guint32 *)p;
+		p += hdr.nsegs[i] * sizeof (guint32);
+	}
+
+	tree->strings = (const gchar *)p;
+	tree->strings_len = hdr.strings_len;
+
+	for (i = 0; i < G_N_ELEMENTS (radix_image_keylens); i ++) {
+		if (tree->tables[i].nsegs >= RADIX_IMAGE_INDEX_MIN) {
+			radix_image_build_index (tree, &tree->tables[i],
+					radix_image_keylens[i]);
+		}
+	}
+
+	return tree;
+}
+
+radix_compressed_t *
+radix_compressed_load (const gchar *path, GError **err)
+{
+	radix_compressed_t *tree;
+	guchar *image;
+	gsize len;
+
+	image = rspamd_file_xmap (path, PROT_READ, &len);
+
+	if (image == NULL) {
+		g_set_error (err, radix_error_quark (), errno,
+				"cannot map %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	tree = radix_image_init (image, len, TRUE, err);
+
+	if (tree == NULL) {
+		munmap (image, len);
+	}
+
+	return tree;
+}
+
+radix_compressed_t *
+radix_compressed_load_buf (const guchar *data, gsize len, GError **err)
+{
+	radix_compressed_t *tree;
+	guchar *image;
+
+	image = g_malloc (len);
+	memcpy (image, data, len);
+	tree = radix_image_init (image, len, FALSE, err);
+
+	if (tree == NULL) {
+		g_free (image);
+	}
+
+	return tree;
+}
@@ -59,6 +59,29 @@ uintptr_t radix_find_compressed (radix_compressed_t * tree, const guint8 *key,
 uintptr_t radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Find several keys in tree at once. Lookups in compiled images are
+ * interleaved to hide memory latency
+ * @param tree
+ * @param keys array of keys
+ * @param keylens lengths of keys
+ * @param nkeys number of keys
+ * @param results output array of `nkeys` values (or RADIX_NO_VALUE)
+ */
+void radix_find_compressed_batch (radix_compressed_t *tree,
+		const guint8 **keys, const gsize *keylens, guint nkeys,
+		uintptr_t *results);
+
+/**
+ * Find several addresses in tree at once, NULL addresses are not found
+ * @param tree
+ * @param addrs array of addresses
+ * @param naddrs number of addresses
+ * @param results output array of `naddrs` values (or RADIX_NO_VALUE)
+ */
+void radix_find_compressed_addr_batch (radix_compressed_t *tree,
+		const rspamd_inet_addr_t **addrs, guint naddrs, uintptr_t *results);
+
 /**
  * Destroy the complete radix trie
  * @param tree
@@ -107,4 +130,35 @@ const gchar * radix_get_info (radix_compressed_t *tree);
  */
 rspamd_mempool_t* radix_get_pool (radix_compressed_t *tree);
 
+/**
+ * Save radix tree as a compiled image: sorted ranges of IPv4 and IPv6 keys
+ * with the values of the most specific prefixes. Values must be strings.
+ * @param tree
+ * @param path output file, replaced atomically
+ * @param err
+ * @return TRUE if an image has been saved
+ */
+gboolean radix_compressed_save (radix_compressed_t *tree, const gchar *path,
+		GError **err);
+
+/**
+ * Map a compiled radix image. The resulting tree is read only and its values
+ * point to the mapped strings
+ * @param path
+ * @param err
+ * @return new radix tree or NULL
+ */
+radix_compressed_t *radix_compressed_load (const gchar *path, GError **err);
+
+/**
+ * Load a compiled radix image from a buffer, the data is copied
+ */
+radix_compressed_t *radix_compressed_load_buf (const guchar *data, gsize len,
+		GError **err);
+
+/**
+ * Returns TRUE if data starts with a compiled radix image header
+ */
+gboolean radix_is_compiled_image (const guchar *data, gsize len);
+
 #endif
@@ -21,6 +21,13 @@
 #include "cryptobox.h"
 #include <math.h>
 
+/*
+ * Updates are written to the shared mapping directly, so msync is merely
+ * needed to bound the amount of data lost on crash: many updates are batched
+ * into a single writeback instead of syncing the whole file on each of them
+ */
+#define RSPAMD_RRD_SYNC_INTERVAL 60.0
+
 #define msg_err_rrd(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "rrd", file->id, \
         G_STRFUNC, \
@@ -1177,8 +1184,11 @@ rspamd_rrd_add_record (struct rspamd_rrd_file *file,
 	file->live_head->last_up = seconds;
 	file->live_head->last_up_usec = microseconds;
 
-	/* Sync and invalidate */
-	msync (file->map, file->size, MS_ASYNC | MS_INVALIDATE);
+	if (ticks - file->last_sync >= RSPAMD_RRD_SYNC_INTERVAL ||
+			ticks < file->last_sync) {
+		msync (file->map, file->size, MS_ASYNC);
+		file->last_sync = ticks;
+	}
 
 	g_free (pdp_new);
 	g_free (pdp_temp);
@@ -1200,6 +1210,8 @@ rspamd_rrd_close (struct rspamd_rrd_file * file)
 		return -1;
 	}
 
+	/* Write updates batched since the last sync */
+	msync (file->map, file->size, MS_SYNC);
 	munmap (file->map, file->size);
 	g_free (file->filename);
 	g_free (file->id);
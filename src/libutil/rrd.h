@@ -204,6 +204,7 @@ struct rspamd_rrd_file {
 	gsize size; /* its size */
 	gboolean finalized;
 	gchar *id;
+	gdouble last_sync; /* time of the last msync */
 };
 
 
@@ -0,0 +1,683 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "libutil/shared_cache.h"
+#include "xxhash.h"
+
+#define SHARED_CACHE_DEFAULT_SHARDS 16
+/* Average element size used when elements limit is not specified */
+#define SHARED_CACHE_AVG_ELT 128
+#define SHARED_CACHE_MIN_ELTS 16
+#define SHARED_CACHE_ALIGN(x) (((x) + 7) & ~((gsize)7))
+
+static const guint64 rspamd_shared_cache_seed = 0xb32ad7c55eb2e647ULL;
+
+/* Header of data stored in the ring followed by key and value */
+struct rspamd_shared_cache_record {
+	guint32 len;            /**< aligned length including header */
+	guint32 hv;             /**< hash of key */
+	guint32 klen;
+	guint32 vlen;           /**< G_MAXUINT32 for padding till the end of ring */
+};
+
+#define SHARED_CACHE_PAD G_MAXUINT32
+
+/* Header of serialized element followed by key and value */
+struct rspamd_shared_cache_saved {
+	guint32 klen;
+	guint32 vlen;
+	gint64 expire;          /**< 0 for elements with no ttl */
+};
+
+struct rspamd_shared_cache_elt {
+	guint32 hv;
+	guint32 off;            /**< offset of record in the ring */
+	time_t expire;          /**< 0 for elements with no ttl */
+	gint referenced;
+};
+
+struct rspamd_shared_cache_shard {
+	rspamd_mempool_rwlock_t *lock;
+	struct rspamd_shared_cache_elt *elts;
+	/* Offset in elts plus one, zero means empty bucket */
+	guint32 *buckets;
+	guchar *data;
+	guint32 nelts;
+	guint32 hand;
+	/* Ring state */
+	guint32 head;
+	guint32 tail;
+	guint32 used;
+	/* Statistics */
+	guint hits;
+	guint misses;
+	guint evictions;
+};
+
+struct rspamd_shared_cache {
+	struct rspamd_shared_cache_shard *shards;
+	guint nshards;
+	guint32 max_elts;
+	guint32 nbuckets;
+	guint32 data_size;
+};
+
+static inline struct rspamd_shared_cache_record *
+rspamd_shared_cache_rec (struct rspamd_shared_cache_shard *shard, guint32 off)
+{
+	return (struct rspamd_shared_cache_record *)(shard->data + off);
+}
+
+static struct rspamd_shared_cache_shard *
+rspamd_shared_cache_get_shard (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen, guint32 *phv)
+{
+	guint64 h;
+
+	h = XXH64 (key, keylen, rspamd_shared_cache_seed);
+	*phv = (guint32)h;
+
+	return &cache->shards[(h >> 32) % cache->nshards];
+}
+
+/*
+ * Returns offset of element with the specified key or -1, in the latter case
+ * `pbucket` is set to the empty bucket where the key should be placed
+ */
+static gint
+rspamd_shared_cache_find (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard,
+		gconstpointer key, gsize keylen, guint32 hv, guint32 *pbucket)
+{
+	guint32 b, mask = cache->nbuckets - 1;
+	struct rspamd_shared_cache_elt *elt;
+	struct rspamd_shared_cache_record *rec;
+
+	b = hv & mask;
+
+	while (shard->buckets[b] != 0) {
+		elt = &shard->elts[shard->buckets[b] - 1];
+
+		if (elt->hv == hv) {
+			rec = rspamd_shared_cache_rec (shard, elt->off);
+
+			if (rec->klen == keylen && memcmp (rec + 1, key, keylen) == 0) {
+				*pbucket = b;
+				return shard->buckets[b] - 1;
+			}
+		}
+
+		b = (b + 1) & mask;
+	}
+
+	*pbucket = b;
+
+	return -1;
+}
+
+static guint32
+rspamd_shared_cache_bucket (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard, guint32 idx)
+{
+	guint32 b, mask = cache->nbuckets - 1;
+
+	b = shard->elts[idx].hv & mask;
+
+	while (shard->buckets[b] != idx + 1) {
+		b = (b + 1) & mask;
+	}
+
+	return b;
+}
+
+/* Removes element, its record in the ring is reclaimed later */
+static void
+rspamd_shared_cache_remove_elt (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard, guint32 idx)
+{
+	guint32 b, j, ideal, last, mask = cache->nbuckets - 1;
+
+	b = rspamd_shared_cache_bucket (cache, shard, idx);
+	shard->buckets[b] = 0;
+	j = b;
+
+	for (;;) {
+		j = (j + 1) & mask;
+
+		if (shard->buckets[j] == 0) {
+			break;
+		}
+
+		ideal = shard->elts[shard->buckets[j] - 1].hv & mask;
+
+		if (((j - ideal) & mask) >= ((j - b) & mask)) {
+			shard->buckets[b] = shard->buckets[j];
+			shard->buckets[j] = 0;
+			b = j;
+		}
+	}
+
+	last = shard->nelts - 1;
+
+	if (idx != last) {
+		b = rspamd_shared_cache_bucket (cache, shard, last);
+		memcpy (&shard->elts[idx], &shard->elts[last], sizeof (shard->elts[0]));
+		shard->buckets[b] = idx + 1;
+	}
+
+	shard->nelts --;
+
+	if (shard->hand >= shard->nelts) {
+		shard->hand = 0;
+	}
+}
+
+static inline gboolean
+rspamd_shared_cache_expired (struct rspamd_shared_cache_elt *elt, time_t now)
+{
+	return elt->expire != 0 && elt->expire <= now;
+}
+
+static void
+rspamd_shared_cache_evict (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard, time_t now)
+{
+	struct rspamd_shared_cache_elt *elt;
+
+	while (shard->nelts > 0) {
+		if (shard->hand >= shard->nelts) {
+			shard->hand = 0;
+		}
+
+		elt = &shard->elts[shard->hand];
+
+		if (!elt->referenced || rspamd_shared_cache_expired (elt, now)) {
+			rspamd_shared_cache_remove_elt (cache, shard, shard->hand);
+			shard->evictions ++;
+			break;
+		}
+
+		elt->referenced = 0;
+		shard->hand ++;
+	}
+}
+
+/* Returns element that owns record at offset `off` or -1 for a dead record */
+static gint
+rspamd_shared_cache_find_off (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard, guint32 hv, guint32 off)
+{
+	guint32 b, mask = cache->nbuckets - 1;
+	struct rspamd_shared_cache_elt *elt;
+
+	b = hv & mask;
+
+	while (shard->buckets[b] != 0) {
+		elt = &shard->elts[shard->buckets[b] - 1];
+
+		if (elt->off == off) {
+			return shard->buckets[b] - 1;
+		}
+
+		b = (b + 1) & mask;
+	}
+
+	return -1;
+}
+
+/* Frees the oldest record in the ring, called when head is behind tail */
+static void
+rspamd_shared_cache_reclaim (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard, time_t now)
+{
+	struct rspamd_shared_cache_record *rec;
+	struct rspamd_shared_cache_elt *elt;
+	guint32 len;
+	gint idx;
+
+	len = cache->data_size - shard->tail;
+
+	if (len < sizeof (*rec)) {
+		/* Implicit padding */
+		shard->used -= len;
+		shard->tail = 0;
+
+		return;
+	}
+
+	rec = rspamd_shared_cache_rec (shard, shard->tail);
+	len = rec->len;
+
+	if (rec->vlen != SHARED_CACHE_PAD) {
+		idx = rspamd_shared_cache_find_off (cache, shard, rec->hv, shard->tail);
+
+		if (idx != -1) {
+			elt = &shard->elts[idx];
+
+			if (elt->referenced && !rspamd_shared_cache_expired (elt, now) &&
+					shard->tail - shard->head >= len) {
+				/* Second chance: move record to the head */
+				memmove (shard->data + shard->head, rec, len);
+				elt->off = shard->head;
+				elt->referenced = 0;
+				shard->head += len;
+				shard->used += len;
+			}
+			else {
+				rspamd_shared_cache_remove_elt (cache, shard, idx);
+				shard->evictions ++;
+			}
+		}
+	}
+
+	shard->used -= len;
+	shard->tail += len;
+
+	if (shard->tail == cache->data_size) {
+		shard->tail = 0;
+	}
+}
+
+/* Returns offset of `need` contiguous bytes in the ring */
+static guint32
+rspamd_shared_cache_reserve (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard, guint32 need, time_t now)
+{
+	struct rspamd_shared_cache_record *rec;
+	guint32 avail;
+
+	for (;;) {
+		if (shard->used == 0) {
+			shard->head = 0;
+			shard->tail = 0;
+		}
+
+		if (shard->used == 0 || shard->head > shard->tail) {
+			avail = cache->data_size - shard->head;
+
+			if (avail >= need) {
+				break;
+			}
+
+			/* Pad till the end and wrap */
+			if (avail >= sizeof (*rec)) {
+				rec = rspamd_shared_cache_rec (shard, shard->head);
+				rec->len = avail;
+				rec->hv = 0;
+				rec->klen = 0;
+				rec->vlen = SHARED_CACHE_PAD;
+			}
+
+			shard->used += avail;
+			shard->head = 0;
+		}
+		else {
+			avail = shard->tail - shard->head;
+
+			if (avail >= need) {
+				break;
+			}
+
+			rspamd_shared_cache_reclaim (cache, shard, now);
+		}
+	}
+
+	shard->head += need;
+	shard->used += need;
+
+	return shard->head - need;
+}
+
+struct rspamd_shared_cache *
+rspamd_shared_cache_new (rspamd_mempool_t *pool,
+		guint nshards, gsize max_bytes, guint max_elts)
+{
+	struct rspamd_shared_cache *cache;
+	struct rspamd_shared_cache_shard *shard;
+	gsize data_size;
+	guint32 nbuckets = 2, i;
+
+	g_assert (pool != NULL);
+
+	if (nshards == 0) {
+		nshards = SHARED_CACHE_DEFAULT_SHARDS;
+	}
+
+	data_size = SHARED_CACHE_ALIGN (max_bytes / nshards);
+	g_assert (data_size < G_MAXUINT32);
+
+	if (max_elts == 0) {
+		max_elts = data_size / SHARED_CACHE_AVG_ELT;
+	}
+	else {
+		max_elts /= nshards;
+	}
+
+	max_elts = MAX (max_elts, SHARED_CACHE_MIN_ELTS);
+
+	while (nbuckets < max_elts * 2) {
+		nbuckets <<= 1;
+	}
+
+	cache = rspamd_mempool_alloc0_shared (pool, sizeof (*cache));
+	cache->nshards = nshards;
+	cache->max_elts = max_elts;
+	cache->nbuckets = nbuckets;
+	cache->data_size = data_size;
+	cache->shards = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*cache->shards) * nshards);
+
+	for (i = 0; i < nshards; i ++) {
+		shard = &cache->shards[i];
+		shard->lock = rspamd_mempool_get_rwlock (pool);
+		shard->elts = rspamd_mempool_alloc_shared (pool,
+				sizeof (*shard->elts) * max_elts);
+		shard->buckets = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*shard->buckets) * nbuckets);
+		/* Data is not touched until it is used */
+		shard->data = rspamd_mempool_alloc_shared (pool, data_size);
+	}
+
+	return cache;
+}
+
+/*
+ * Stores a new record for the key that is not in the shard, returns pointer
+ * to its value
+ */
+static guchar *
+rspamd_shared_cache_store (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_shard *shard,
+		gconstpointer key, gsize keylen, guint32 hv, gsize vlen,
+		time_t now, guint ttl)
+{
+	struct rspamd_shared_cache_record *rec;
+	struct rspamd_shared_cache_elt *elt;
+	guint32 b, off;
+	gsize need;
+
+	need = SHARED_CACHE_ALIGN (sizeof (*rec) + keylen + vlen);
+
+	if (shard->nelts >= cache->max_elts) {
+		rspamd_shared_cache_evict (cache, shard, now);
+	}
+
+	off = rspamd_shared_cache_reserve (cache, shard, need, now);
+	rec = rspamd_shared_cache_rec (shard, off);
+	rec->len = need;
+	rec->hv = hv;
+	rec->klen = keylen;
+	rec->vlen = vlen;
+	memcpy (rec + 1, key, keylen);
+
+	/* Buckets might be shifted by evictions */
+	rspamd_shared_cache_find (cache, shard, key, keylen, hv, &b);
+	elt = &shard->elts[shard->nelts];
+	elt->hv = hv;
+	elt->off = off;
+	elt->expire = ttl != 0 ? now + ttl : 0;
+	elt->referenced = 0;
+	shard->buckets[b] = ++shard->nelts;
+
+	return ((guchar *)(rec + 1)) + keylen;
+}
+
+gboolean
+rspamd_shared_cache_insert (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen,
+		gconstpointer value, gsize vlen,
+		time_t now, guint ttl)
+{
+	struct rspamd_shared_cache_shard *shard;
+	guint32 hv, b;
+	gint idx;
+
+	if (SHARED_CACHE_ALIGN (sizeof (struct rspamd_shared_cache_record) +
+			keylen + vlen) > cache->data_size) {
+		return FALSE;
+	}
+
+	shard = rspamd_shared_cache_get_shard (cache, key, keylen, &hv);
+	rspamd_mempool_wlock_rwlock (shard->lock);
+
+	idx = rspamd_shared_cache_find (cache, shard, key, keylen, hv, &b);
+
+	if (idx != -1) {
+		rspamd_shared_cache_remove_elt (cache, shard, idx);
+	}
+
+	memcpy (rspamd_shared_cache_store (cache, shard, key, keylen, hv, vlen,
+			now, ttl), value, vlen);
+
+	rspamd_mempool_wunlock_rwlock (shard->lock);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shared_cache_update (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen, gsize vlen,
+		time_t now, guint ttl,
+		rspamd_shared_cache_update_cb cb, gpointer ud)
+{
+	struct rspamd_shared_cache_shard *shard;
+	struct rspamd_shared_cache_record *rec;
+	struct rspamd_shared_cache_elt *elt;
+	guchar *value;
+	guint32 hv, b;
+	gint idx;
+
+	if (SHARED_CACHE_ALIGN (sizeof (*rec) + keylen + vlen) > cache->data_size) {
+		return FALSE;
+	}
+
+	shard = rspamd_shared_cache_get_shard (cache, key, keylen, &hv);
+	rspamd_mempool_wlock_rwlock (shard->lock);
+
+	idx = rspamd_shared_cache_find (cache, shard, key, keylen, hv, &b);
+
+	if (idx != -1) {
+		elt = &shard->elts[idx];
+		rec = rspamd_shared_cache_rec (shard, elt->off);
+
+		if (rec->vlen == vlen && !rspamd_shared_cache_expired (elt, now)) {
+			cb (((guchar *)(rec + 1)) + rec->klen, TRUE, ud);
+			elt->expire = ttl != 0 ? now + ttl : 0;
+			elt->referenced = 1;
+			rspamd_mempool_wunlock_rwlock (shard->lock);
+
+			return TRUE;
+		}
+
+		rspamd_shared_cache_remove_elt (cache, shard, idx);
+	}
+
+	value = rspamd_shared_cache_store (cache, shard, key, keylen, hv, vlen,
+			now, ttl);
+	memset (value, 0, vlen);
+	cb (value, FALSE, ud);
+
+	rspamd_mempool_wunlock_rwlock (shard->lock);
+
+	return TRUE;
+}
+
+gpointer
+rspamd_shared_cache_lookup (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen,
+		time_t now, gsize *vlen)
+{
+	struct rspamd_shared_cache_shard *shard;
+	struct rspamd_shared_cache_record *rec;
+	struct rspamd_shared_cache_elt *elt;
+	gpointer res = NULL;
+	guint32 hv, b;
+	gint idx;
+
+	shard = rspamd_shared_cache_get_shard (cache, key, keylen, &hv);
+	rspamd_mempool_rlock_rwlock (shard->lock);
+
+	idx = rspamd_shared_cache_find (cache, shard, key, keylen, hv, &b);
+
+	if (idx != -1) {
+		elt = &shard->elts[idx];
+
+		if (!rspamd_shared_cache_expired (elt, now)) {
+			rec = rspamd_shared_cache_rec (shard, elt->off);
+			res = g_malloc (rec->vlen + 1);
+			memcpy (res, ((guchar *)(rec + 1)) + rec->klen, rec->vlen);
+			((guchar *)res)[rec->vlen] = '\0';
+
+			if (vlen) {
+				*vlen = rec->vlen;
+			}
+
+			/* Readers can race here but they all set the same value */
+			g_atomic_int_set (&elt->referenced, 1);
+		}
+	}
+
+	if (res) {
+		g_atomic_int_inc (&shard->hits);
+	}
+	else {
+		g_atomic_int_inc (&shard->misses);
+	}
+
+	rspamd_mempool_runlock_rwlock (shard->lock);
+
+	return res;
+}
+
+gboolean
+rspamd_shared_cache_remove (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen)
+{
+	struct rspamd_shared_cache_shard *shard;
+	guint32 hv, b;
+	gint idx;
+
+	shard = rspamd_shared_cache_get_shard (cache, key, keylen, &hv);
+	rspamd_mempool_wlock_rwlock (shard->lock);
+
+	idx = rspamd_shared_cache_find (cache, shard, key, keylen, hv, &b);
+
+	if (idx != -1) {
+		rspamd_shared_cache_remove_elt (cache, shard, idx);
+	}
+
+	rspamd_mempool_wunlock_rwlock (shard->lock);
+
+	return idx != -1;
+}
+
+void
+rspamd_shared_cache_stat (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_stat *st)
+{
+	struct rspamd_shared_cache_shard *shard;
+	guint i;
+
+	memset (st, 0, sizeof (*st));
+
+	for (i = 0; i < cache->nshards; i ++) {
+		shard = &cache->shards[i];
+		rspamd_mempool_rlock_rwlock (shard->lock);
+		st->elts += shard->nelts;
+		st->bytes += shard->used;
+		st->hits += g_atomic_int_get (&shard->hits);
+		st->misses += g_atomic_int_get (&shard->misses);
+		st->evictions += shard->evictions;
+		rspamd_mempool_runlock_rwlock (shard->lock);
+	}
+}
+
+guint
+rspamd_shared_cache_serialize (struct rspamd_shared_cache *cache,
+		time_t now, GByteArray *out)
+{
+	struct rspamd_shared_cache_shard *shard;
+	struct rspamd_shared_cache_elt *elt;
+	struct rspamd_shared_cache_record *rec;
+	struct rspamd_shared_cache_saved saved;
+	guint i, j, nelts = 0;
+
+	for (i = 0; i < cache->nshards; i ++) {
+		shard = &cache->shards[i];
+		rspamd_mempool_rlock_rwlock (shard->lock);
+
+		for (j = 0; j < shard->nelts; j ++) {
+			elt = &shard->elts[j];
+
+			if (rspamd_shared_cache_expired (elt, now)) {
+				continue;
+			}
+
+			rec = rspamd_shared_cache_rec (shard, elt->off);
+			saved.klen = rec->klen;
+			saved.vlen = rec->vlen;
+			saved.expire = elt->expire;
+			g_byte_array_append (out, (const guint8 *)&saved, sizeof (saved));
+			/* Key and value are contiguous in the record */
+			g_byte_array_append (out, (const guint8 *)(rec + 1),
+					rec->klen + rec->vlen);
+			nelts ++;
+		}
+
+		rspamd_mempool_runlock_rwlock (shard->lock);
+	}
+
+	return nelts;
+}
+
+gint
+rspamd_shared_cache_deserialize (struct rspamd_shared_cache *cache,
+		const guchar *data, gsize len, time_t now)
+{
+	struct rspamd_shared_cache_saved saved;
+	const guchar *p = data, *end = data + len;
+	guint ttl;
+	gint nelts = 0;
+
+	while (p < end) {
+		if (end - p < (gssize)sizeof (saved)) {
+			return -1;
+		}
+
+		memcpy (&saved, p, sizeof (saved));
+		p += sizeof (saved);
+
+		if ((gsize)(end - p) < (gsize)saved.klen + saved.vlen) {
+			return -1;
+		}
+
+		if (saved.expire != 0 && saved.expire <= now) {
+			p += saved.klen + saved.vlen;
+			continue;
+		}
+
+		ttl = saved.expire != 0 ? saved.expire - now : 0;
+
+		if (rspamd_shared_cache_insert (cache, p, saved.klen,
+				p + saved.klen, saved.vlen, now, ttl)) {
+			nelts ++;
+		}
+
+		p += saved.klen + saved.vlen;
+	}
+
+	return nelts;
+}
@@ -0,0 +1,157 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_SHARED_CACHE_H_
+#define SRC_LIBUTIL_SHARED_CACHE_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/**
+ * @file shared_cache.h
+ *
+ * Fixed size cache placed in shared memory, so all workers forked after its
+ * creation share the same elements. Cache is split to shards, each protected
+ * by its own rwlock and owning a fixed number of elements and a fixed data
+ * ring, where keys and values are copied. Elements are evicted when they are
+ * expired, when there are no free elements (CLOCK order) or when their data is
+ * overwritten by the ring (referenced elements are moved forward instead if it
+ * is possible)
+ */
+
+struct rspamd_shared_cache;
+
+struct rspamd_shared_cache_stat {
+	guint64 elts;
+	guint64 bytes;
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+};
+
+/**
+ * Create new shared cache. It must be created before workers are spawned and
+ * it is destroyed with the pool specified
+ * @param pool pool used to allocate shared memory
+ * @param nshards number of shards (0 for the default number)
+ * @param max_bytes memory limit for keys and values in all shards
+ * @param max_elts limit of elements in all shards (0 to derive from max_bytes)
+ * @return new cache object
+ */
+struct rspamd_shared_cache *rspamd_shared_cache_new (rspamd_mempool_t *pool,
+		guint nshards, gsize max_bytes, guint max_elts);
+
+/**
+ * Insert or replace element in the cache
+ * @param cache cache object
+ * @param key key data
+ * @param keylen length of key
+ * @param value value data
+ * @param vlen length of value
+ * @param now current time
+ * @param ttl time to live of element in seconds (0 for no expiration)
+ * @return TRUE if element has been inserted
+ */
+gboolean rspamd_shared_cache_insert (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen,
+		gconstpointer value, gsize vlen,
+		time_t now, guint ttl);
+
+/**
+ * Callback for in place updates of values
+ * @param value value data, it is not aligned and it is zero filled for new
+ * elements
+ * @param found TRUE if the element has already been in the cache
+ * @param ud user data
+ */
+typedef void (*rspamd_shared_cache_update_cb) (guchar *value, gboolean found,
+		gpointer ud);
+
+/**
+ * Atomically update value of the element, so concurrent workers cannot lose
+ * modifications of each other. Elements that are missing, expired or have
+ * value of another length are replaced by a zero filled value of `vlen` bytes
+ * @param cache cache object
+ * @param key key data
+ * @param keylen length of key
+ * @param vlen length of value
+ * @param now current time
+ * @param ttl time to live of element in seconds since this update (0 for no
+ * expiration)
+ * @param cb callback called under the lock of shard, it must not access cache
+ * @param ud user data for callback
+ * @return TRUE if element has been updated or inserted
+ */
+gboolean rspamd_shared_cache_update (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen, gsize vlen,
+		time_t now, guint ttl,
+		rspamd_shared_cache_update_cb cb, gpointer ud);
+
+/**
+ * Lookup element in the cache
+ * @param cache cache object
+ * @param key key data
+ * @param keylen length of key
+ * @param now current time
+ * @param vlen output length of value
+ * @return copy of value that should be freed by g_free or NULL if an element
+ * has not been found or it has been expired
+ */
+gpointer rspamd_shared_cache_lookup (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen,
+		time_t now, gsize *vlen);
+
+/**
+ * Remove element from the cache
+ * @param cache cache object
+ * @param key key data
+ * @param keylen length of key
+ * @return TRUE if element has been removed
+ */
+gboolean rspamd_shared_cache_remove (struct rspamd_shared_cache *cache,
+		gconstpointer key, gsize keylen);
+
+/**
+ * Get statistics for the cache
+ * @param cache cache object
+ * @param st output statistics
+ */
+void rspamd_shared_cache_stat (struct rspamd_shared_cache *cache,
+		struct rspamd_shared_cache_stat *st);
+
+/**
+ * Serialize all elements of the cache that are not expired, so they could be
+ * restored after restart
+ * @param cache cache object
+ * @param now current time
+ * @param out array to append serialized elements to
+ * @return number of elements serialized
+ */
+guint rspamd_shared_cache_serialize (struct rspamd_shared_cache *cache,
+		time_t now, GByteArray *out);
+
+/**
+ * Insert elements serialized by `rspamd_shared_cache_serialize`, elements keep
+ * their original expiration time and those that have expired are skipped
+ * @param cache cache object
+ * @param data serialized data
+ * @param len length of data
+ * @param now current time
+ * @return number of elements inserted or -1 if data is malformed
+ */
+gint rspamd_shared_cache_deserialize (struct rspamd_shared_cache *cache,
+		const guchar *data, gsize len, time_t now);
+
+#endif /* SRC_LIBUTIL_SHARED_CACHE_H_ */
@@ -19,6 +19,48 @@
 
 #define SHINGLES_WINDOW 3
 
+/*
+ * Derive siphash keys for all shingles from the initial key, the last set of
+ * keys is reused as the same key is normally used for all messages
+ */
+static const rspamd_sipkey_t *
+rspamd_shingles_keys (const guchar key[16])
+{
+	static rspamd_sipkey_t keys[RSPAMD_SHINGLE_SIZE];
+	static guchar cached_key[16];
+	static gboolean cached = FALSE;
+	guchar shabuf[rspamd_cryptobox_HASHBYTES], *out_key;
+	const guchar *cur_key;
+	rspamd_cryptobox_hash_state_t bs;
+	gint i;
+
+	if (cached && memcmp (cached_key, key, sizeof (cached_key)) == 0) {
+		return keys;
+	}
+
+	cur_key = key;
+	out_key = (guchar *)&keys[0];
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		/*
+		 * To generate a set of hashes we just apply sha256 to the
+		 * initial key as many times as many hashes are required and
+		 * xor left and right parts of sha256 to get a single 16 bytes SIP key.
+		 */
+		rspamd_cryptobox_hash_init (&bs, NULL, 0);
+		rspamd_cryptobox_hash_update (&bs, cur_key, 16);
+		rspamd_cryptobox_hash_final (&bs, shabuf);
+		memcpy (out_key, shabuf, 16);
+		cur_key = out_key;
+		out_key += 16;
+	}
+
+	memcpy (cached_key, key, sizeof (cached_key));
+	cached = TRUE;
+
+	return keys;
+}
+
 struct rspamd_shingle*
 rspamd_shingles_generate (GArray *input,
 		const guchar key[16],
@@ -27,15 +69,13 @@ rspamd_shingles_generate (GArray *input,
 		gpointer filterd)
 {
 	struct rspamd_shingle *res;
-	GArray *hashes[RSPAMD_SHINGLE_SIZE];
-	rspamd_sipkey_t keys[RSPAMD_SHINGLE_SIZE];
-	guchar shabuf[rspamd_cryptobox_HASHBYTES], *out_key;
-	const guchar *cur_key;
+	const rspamd_sipkey_t *keys;
+	guint64 *hashes = NULL, val;
 	rspamd_fstring_t *row;
 	rspamd_ftok_t *word;
-	rspamd_cryptobox_hash_state_t bs;
-	guint64 val;
+	gsize nrows, r = 0;
 	gint i, j, beg = 0;
+	gboolean inline_min;
 
 	if (pool != NULL) {
 		res = rspamd_mempool_alloc (pool, sizeof (*res));
@@ -44,30 +84,20 @@ rspamd_shingles_generate (GArray *input,
 		res = g_malloc (sizeof (*res));
 	}
 
-	rspamd_cryptobox_hash_init (&bs, NULL, 0);
+	keys = rspamd_shingles_keys (key);
 	row = rspamd_fstring_sized_new (256);
-	cur_key = key;
-	out_key = (guchar *)&keys[0];
-
-	/* Init hashes pipes and keys */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
-				input->len + SHINGLES_WINDOW);
-		/*
-		 * To generate a set of hashes we just apply sha256 to the
-		 * initial key as many times as many hashes are required and
-		 * xor left and right parts of sha256 to get a single 16 bytes SIP key.
-		 */
-		rspamd_cryptobox_hash_update (&bs, cur_key, 16);
-		rspamd_cryptobox_hash_final (&bs, shabuf);
-
-		for (j = 0; j < 16; j ++) {
-			out_key[j] = shabuf[j];
+	/* A row per each window or a single row for short inputs */
+	nrows = input->len >= SHINGLES_WINDOW ? input->len - SHINGLES_WINDOW + 1 : 1;
+	/* Minimum is calculated in place, other filters need all hashes */
+	inline_min = (filter == rspamd_shingles_default_filter);
+
+	if (inline_min) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = G_MAXUINT64;
 		}
-
-		rspamd_cryptobox_hash_init (&bs, NULL, 0);
-		cur_key = out_key;
-		out_key += 16;
+	}
+	else {
+		hashes = g_malloc (sizeof (*hashes) * nrows * RSPAMD_SHINGLE_SIZE);
 	}
 
 	/* Now parse input words into a vector of hashes using rolling window */
@@ -83,18 +113,32 @@ rspamd_shingles_generate (GArray *input,
 			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
 				rspamd_cryptobox_siphash ((guchar *)&val, row->str, row->len,
 						keys[j]);
-				g_array_append_val (hashes[j], val);
+
+				if (inline_min) {
+					if (val < res->hashes[j]) {
+						res->hashes[j] = val;
+					}
+				}
+				else {
+					hashes[j * nrows + r] = val;
+				}
 			}
 
+			r ++;
 			row = rspamd_fstring_assign (row, "", 0);
 		}
 	}
 
-	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		res->hashes[i] = filter ((guint64 *)hashes[i]->data, hashes[i]->len,
-				i, key, filterd);
-		g_array_free (hashes[i], TRUE);
+	g_assert (r == nrows);
+
+	if (!inline_min) {
+		/* Now we need to filter all hashes and make a shingles result */
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = filter (hashes + i * nrows, nrows,
+					i, key, filterd);
+		}
+
+		g_free (hashes);
 	}
 
 	rspamd_fstring_free (row);
@@ -16,8 +16,32 @@
 #include "config.h"
 #include "libutil/logger.h"
 #include "libutil/sqlite_utils.h"
+#include "libutil/util.h"
 #include "unix-std.h"
 
+#define RSPAMD_SQLITE_MMAP_LIMIT 268435456
+#define RSPAMD_SQLITE_CACHE_SIZE 262144
+/* Busy handler doubles delays from min to max delay */
+#define RSPAMD_SQLITE_BUSY_MIN_DELAY 0.001
+#define RSPAMD_SQLITE_BUSY_STEPS 5
+#define RSPAMD_SQLITE_BUSY_MAX_DELAY \
+	(RSPAMD_SQLITE_BUSY_MIN_DELAY * (1 << RSPAMD_SQLITE_BUSY_STEPS))
+
+const struct rspamd_sqlite3_tune rspamd_sqlite3_default_tune = {
+	.wal = TRUE,
+	.mmap_size = RSPAMD_SQLITE_MMAP_LIMIT,
+	.cache_size = RSPAMD_SQLITE_CACHE_SIZE,
+	.synchronous = "NORMAL",
+	.busy_timeout = 1.0,
+};
+
+const struct rspamd_sqlite3_tune rspamd_sqlite3_throughput_tune = {
+	.wal = TRUE,
+	.mmap_size = RSPAMD_SQLITE_MMAP_LIMIT * 4,
+	.cache_size = -65536,
+	.synchronous = "NORMAL",
+	.busy_timeout = 5.0,
+};
 
 static GQuark
 rspamd_sqlite3_quark (void)
@@ -25,6 +49,102 @@ rspamd_sqlite3_quark (void)
 	return g_quark_from_static_string ("rspamd-sqlite3");
 }
 
+gint
+rspamd_sqlite3_prepare_persistent (sqlite3 *db, const gchar *sql,
+		sqlite3_stmt **pstmt)
+{
+#if SQLITE_VERSION_NUMBER >= 3020000
+	/* Do not use lookaside memory for statements that are reused forever */
+	return sqlite3_prepare_v3 (db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+			pstmt, NULL);
+#else
+	return sqlite3_prepare_v2 (db, sql, -1, pstmt, NULL);
+#endif
+}
+
+struct rspamd_sqlite3_tune *
+rspamd_sqlite3_tune_from_ucl (rspamd_mempool_t *pool,
+		const ucl_object_t *obj,
+		const struct rspamd_sqlite3_tune *base,
+		GError **err)
+{
+	struct rspamd_sqlite3_tune *tune;
+	const ucl_object_t *elt;
+	const gchar *sync;
+	gint64 ival;
+	static const gchar *sync_modes[] = {"OFF", "NORMAL", "FULL", "EXTRA"};
+	guint i;
+
+	g_assert (pool != NULL);
+
+	if (obj == NULL || ucl_object_type (obj) != UCL_OBJECT) {
+		g_set_error (err, rspamd_sqlite3_quark (), EINVAL,
+				"sqlite tuning must be an object");
+
+		return NULL;
+	}
+
+	tune = rspamd_mempool_alloc (pool, sizeof (*tune));
+	memcpy (tune, base ? base : &rspamd_sqlite3_default_tune, sizeof (*tune));
+
+	if ((elt = ucl_object_lookup (obj, "wal")) != NULL) {
+		tune->wal = ucl_object_toboolean (elt);
+	}
+
+	if ((elt = ucl_object_lookup (obj, "mmap_size")) != NULL) {
+		if (!ucl_object_toint_safe (elt, &ival) || ival < 0) {
+			g_set_error (err, rspamd_sqlite3_quark (), EINVAL,
+					"invalid mmap_size");
+
+			return NULL;
+		}
+
+		tune->mmap_size = ival;
+	}
+
+	if ((elt = ucl_object_lookup (obj, "cache_size")) != NULL) {
+		if (!ucl_object_toint_safe (elt, &ival)) {
+			g_set_error (err, rspamd_sqlite3_quark (), EINVAL,
+					"invalid cache_size");
+
+			return NULL;
+		}
+
+		tune->cache_size = ival;
+	}
+
+	if ((elt = ucl_object_lookup (obj, "synchronous")) != NULL) {
+		sync = ucl_object_tostring (elt);
+		tune->synchronous = NULL;
+
+		for (i = 0; sync != NULL && i < G_N_ELEMENTS (sync_modes); i ++) {
+			if (g_ascii_strcasecmp (sync, sync_modes[i]) == 0) {
+				tune->synchronous = sync_modes[i];
+				break;
+			}
+		}
+
+		if (tune->synchronous == NULL) {
+			g_set_error (err, rspamd_sqlite3_quark (), EINVAL,
+					"invalid synchronous mode: %s", sync ? sync : "(null)");
+
+			return NULL;
+		}
+	}
+
+	if ((elt = ucl_object_lookup (obj, "busy_timeout")) != NULL) {
+		if (!ucl_object_todouble_safe (elt, &tune->busy_timeout) ||
+				tune->busy_timeout < 0) {
+			g_set_error (err, rspamd_sqlite3_quark (), EINVAL,
+					"invalid busy_timeout");
+
+			return NULL;
+		}
+	}
+
+	return tune;
+}
+
 GArray*
 rspamd_sqlite3_init_prstmt (sqlite3 *db,
 		struct rspamd_sqlite3_prstmt *init_stmt,
@@ -43,8 +163,8 @@ rspamd_sqlite3_init_prstmt (sqlite3 *db,
 		nst = &g_array_index (res, struct rspamd_sqlite3_prstmt, i);
 		memcpy (nst, &init_stmt[i], sizeof (*nst));
 
-		if (sqlite3_prepare_v2 (db, init_stmt[i].sql, -1,
-				&nst->stmt, NULL) != SQLITE_OK) {
+		if (rspamd_sqlite3_prepare_persistent (db, init_stmt[i].sql,
+				&nst->stmt) != SQLITE_OK) {
 			g_set_error (err, rspamd_sqlite3_quark (),
 				-1, "Cannot initialize prepared sql `%s`: %s",
 				nst->sql, sqlite3_errmsg (db));
@@ -243,34 +363,57 @@ rspamd_sqlite3_wait (rspamd_mempool_t *pool, const gchar *lock)
 	return TRUE;
 }
 
-#define RSPAMD_SQLITE_MMAP_LIMIT 268435456
-#define RSPAMD_SQLITE_CACHE_SIZE 262144
+/*
+ * Called by sqlite when database is locked, `ud` is timeout in milliseconds.
+ * Waiting with exponential backoff allows to avoid retry loops in callers.
+ */
+static gint
+rspamd_sqlite3_busy_handler (void *ud, gint count)
+{
+	gdouble timeout = GPOINTER_TO_SIZE (ud) / 1000.0, waited, delay;
+	struct timespec ts;
+
+	if (count <= RSPAMD_SQLITE_BUSY_STEPS) {
+		delay = RSPAMD_SQLITE_BUSY_MIN_DELAY * (1 << count);
+		waited = delay - RSPAMD_SQLITE_BUSY_MIN_DELAY;
+	}
+	else {
+		delay = RSPAMD_SQLITE_BUSY_MAX_DELAY;
+		waited = RSPAMD_SQLITE_BUSY_MAX_DELAY * 2 - RSPAMD_SQLITE_BUSY_MIN_DELAY +
+				(count - RSPAMD_SQLITE_BUSY_STEPS - 1) * delay;
+	}
+
+	if (waited >= timeout) {
+		/* Give up and return SQLITE_BUSY to the caller */
+		return 0;
+	}
+
+	double_to_ts (MIN (delay, timeout - waited), &ts);
+	nanosleep (&ts, NULL);
+
+	return 1;
+}
 
 sqlite3 *
 rspamd_sqlite3_open_or_create (rspamd_mempool_t *pool, const gchar *path, const
-		gchar *create_sql, GError **err)
+		gchar *create_sql, const struct rspamd_sqlite3_tune *tune, GError **err)
 {
 	sqlite3 *sqlite;
 	gint rc, flags, lock_fd;
-	gchar lock_path[PATH_MAX], dbdir[PATH_MAX], *pdir;
+	gchar lock_path[PATH_MAX], dbdir[PATH_MAX], *pdir, pragma[128];
 	static const char sqlite_wal[] =
 									"PRAGMA journal_mode=\"wal\";"
 									"PRAGMA wal_autocheckpoint = 16;"
 									"PRAGMA journal_size_limit = 1536;",
 			exclusive_lock_sql[] =	"PRAGMA locking_mode=\"exclusive\";",
 
-			fsync_sql[] = 			"PRAGMA synchronous=\"NORMAL\";",
-
-			foreign_keys[] = 		"PRAGMA foreign_keys=\"ON\";",
-
-			enable_mmap[] = 		"PRAGMA mmap_size="
-									G_STRINGIFY(RSPAMD_SQLITE_MMAP_LIMIT) ";",
-
-			other_pragmas[] = 		"PRAGMA read_uncommitted=\"ON\";"
-									"PRAGMA cache_size="
-									G_STRINGIFY(RSPAMD_SQLITE_CACHE_SIZE) ";";
+			foreign_keys[] = 		"PRAGMA foreign_keys=\"ON\";";
 	gboolean create = FALSE, has_lock = FALSE;
 
+	if (tune == NULL) {
+		tune = &rspamd_sqlite3_default_tune;
+	}
+
 	flags = SQLITE_OPEN_READWRITE;
 #ifdef SQLITE_OPEN_SHAREDCACHE
 	flags |= SQLITE_OPEN_SHAREDCACHE;
@@ -348,7 +491,8 @@ rspamd_sqlite3_open_or_create (rspamd_mempool_t *pool, const gchar *path, const
 	}
 
 	if (create && has_lock) {
-		if (sqlite3_exec (sqlite, sqlite_wal, NULL, NULL, NULL) != SQLITE_OK) {
+		if (tune->wal &&
+				sqlite3_exec (sqlite, sqlite_wal, NULL, NULL, NULL) != SQLITE_OK) {
 			msg_warn_pool_check ("WAL mode is not supported (%s), locking issues might occur",
 					sqlite3_errmsg (sqlite));
 		}
@@ -402,12 +546,16 @@ rspamd_sqlite3_open_or_create (rspamd_mempool_t *pool, const gchar *path, const
 		}
 	}
 
-	if (sqlite3_exec (sqlite, sqlite_wal, NULL, NULL, NULL) != SQLITE_OK) {
+	if (tune->wal &&
+			sqlite3_exec (sqlite, sqlite_wal, NULL, NULL, NULL) != SQLITE_OK) {
 		msg_warn_pool_check ("WAL mode is not supported (%s), locking issues might occur",
 				sqlite3_errmsg (sqlite));
 	}
 
-	if (sqlite3_exec (sqlite, fsync_sql, NULL, NULL, NULL) != SQLITE_OK) {
+	rspamd_snprintf (pragma, sizeof (pragma), "PRAGMA synchronous=\"%s\";",
+			tune->synchronous);
+
+	if (sqlite3_exec (sqlite, pragma, NULL, NULL, NULL) != SQLITE_OK) {
 		msg_warn_pool_check ("cannot set synchronous: %s",
 				sqlite3_errmsg (sqlite));
 	}
@@ -419,18 +567,29 @@ rspamd_sqlite3_open_or_create (rspamd_mempool_t *pool, const gchar *path, const
 	}
 
 #if defined(__LP64__) || defined(_LP64)
-	if ((rc = sqlite3_exec (sqlite, enable_mmap, NULL, NULL, NULL)) != SQLITE_OK) {
+	rspamd_snprintf (pragma, sizeof (pragma), "PRAGMA mmap_size=%L;",
+			tune->mmap_size);
+
+	if ((rc = sqlite3_exec (sqlite, pragma, NULL, NULL, NULL)) != SQLITE_OK) {
 		msg_warn_pool_check ("cannot enable mmap: %s",
 				sqlite3_errmsg (sqlite));
 	}
 #endif
 
-	if ((rc = sqlite3_exec (sqlite, other_pragmas, NULL, NULL, NULL)) !=
+	rspamd_snprintf (pragma, sizeof (pragma), "PRAGMA read_uncommitted=\"ON\";"
+			"PRAGMA cache_size=%L;", tune->cache_size);
+
+	if ((rc = sqlite3_exec (sqlite, pragma, NULL, NULL, NULL)) !=
 			SQLITE_OK) {
 		msg_warn_pool_check ("cannot execute tuning pragmas: %s",
 				sqlite3_errmsg (sqlite));
 	}
 
+	if (tune->busy_timeout > 0) {
+		sqlite3_busy_handler (sqlite, rspamd_sqlite3_busy_handler,
+				GSIZE_TO_POINTER ((gsize)(tune->busy_timeout * 1000.0)));
+	}
+
 	if (has_lock && lock_fd != -1) {
 		msg_debug_pool_check ("removing lock from %s", lock_path);
 		rspamd_file_unlock (lock_fd, FALSE);
@@ -19,9 +19,41 @@
 #include "config.h"
 #include "mem_pool.h"
 #include "sqlite3.h"
+#include "ucl.h"
 
 #define RSPAMD_SQLITE3_STMT_MULTIPLE (1 << 0)
 
+/**
+ * Tuning profile applied to databases when they are opened
+ */
+struct rspamd_sqlite3_tune {
+	gboolean wal; /* Use write ahead log */
+	gint64 mmap_size; /* Bytes of database to mmap, 0 disables mmap */
+	gint64 cache_size; /* Pages if positive, KiB if negative as in sqlite */
+	const gchar *synchronous; /* off, normal, full or extra */
+	gdouble busy_timeout; /* Seconds to wait for locks, 0 means no waiting */
+};
+
+/* Profile used when no profile is specified */
+extern const struct rspamd_sqlite3_tune rspamd_sqlite3_default_tune;
+/* Profile for databases with many concurrent writers, e.g. fuzzy storage */
+extern const struct rspamd_sqlite3_tune rspamd_sqlite3_throughput_tune;
+
+/**
+ * Parse tuning profile from ucl object, missing keys are copied from `base`
+ * @param pool pool to allocate profile
+ * @param obj object with keys: wal, mmap_size, cache_size, synchronous and
+ * busy_timeout
+ * @param base profile used as defaults (default profile if NULL)
+ * @param err
+ * @return new profile or NULL
+ */
+struct rspamd_sqlite3_tune *rspamd_sqlite3_tune_from_ucl (
+		rspamd_mempool_t *pool,
+		const ucl_object_t *obj,
+		const struct rspamd_sqlite3_tune *base,
+		GError **err);
+
 struct rspamd_sqlite3_prstmt {
 	gint idx;
 	const gchar *sql;
@@ -32,6 +64,16 @@ struct rspamd_sqlite3_prstmt {
 	gint flags;
 };
 
+/**
+ * Prepare statement that is supposed to be cached and reused many times
+ * @param db
+ * @param sql
+ * @param pstmt output statement
+ * @return sqlite error code
+ */
+gint rspamd_sqlite3_prepare_persistent (sqlite3 *db, const gchar *sql,
+		sqlite3_stmt **pstmt);
+
 /**
  * Create prepared statements for specified database from init statements
  * @param db
@@ -66,10 +108,11 @@ void rspamd_sqlite3_close_prstmt (sqlite3 *db, GArray *stmts);
  * Creates or opens sqlite database trying to share it between processes
  * @param path
  * @param create_sql
+ * @param tune tuning profile (default profile if NULL)
  * @return
  */
 sqlite3 * rspamd_sqlite3_open_or_create (rspamd_mempool_t *pool, const gchar *path, const
-		gchar *create_sql, GError **err);
+		gchar *create_sql, const struct rspamd_sqlite3_tune *tune, GError **err);
 
 
 /**
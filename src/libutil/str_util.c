@@ -17,8 +17,18 @@
 #include "util.h"
 #include "xxhash.h"
 #include "url.h"
+#include "cryptobox.h"
 #include <math.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define RSPAMD_STR_NEON 1
+#endif
+
+#define MEMCSPN_SIMD_MAX 8
+
 static const guchar lc_map[256] = {
 		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
 		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
@@ -54,35 +64,95 @@ static const guchar lc_map[256] = {
 		0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
 };
 
-void
-rspamd_str_lc (gchar *str, guint size)
+#if defined(__SSE2__)
+static inline __m128i
+rspamd_str_lc_sse2 (__m128i v)
 {
-	guint leftover = size % 4;
-	guint fp, i;
-	const uint8_t* s = (const uint8_t*) str;
-	gchar *dest = str;
-	guchar c1, c2, c3, c4;
+	const __m128i ua = _mm_set1_epi8 ('A'), lc = _mm_set1_epi8 (0x20),
+			sign = _mm_set1_epi8 ((gchar)0x80),
+			lim = _mm_set1_epi8 ((gchar)(26 ^ 0x80));
+	__m128i upper;
 
-	fp = size - leftover;
+	/* Unsigned (c - 'A') < 26 using signed comparison */
+	upper = _mm_cmplt_epi8 (_mm_xor_si128 (_mm_sub_epi8 (v, ua), sign), lim);
 
-	for (i = 0; i != fp; i += 4) {
-		c1 = s[i], c2 = s[i + 1], c3 = s[i + 2], c4 = s[i + 3];
-		dest[0] = lc_map[c1];
-		dest[1] = lc_map[c2];
-		dest[2] = lc_map[c3];
-		dest[3] = lc_map[c4];
-		dest += 4;
+	return _mm_or_si128 (v, _mm_and_si128 (upper, lc));
+}
+#elif defined(RSPAMD_STR_NEON)
+static inline uint8x16_t
+rspamd_str_lc_neon (uint8x16_t v)
+{
+	uint8x16_t upper;
+
+	upper = vcltq_u8 (vsubq_u8 (v, vdupq_n_u8 ('A')), vdupq_n_u8 (26));
+
+	return vorrq_u8 (v, vandq_u8 (upper, vdupq_n_u8 (0x20)));
+}
+#endif
+
+/* Copy `len` bytes converting them to lowercase, `dst` can be equal to `src` */
+static inline void
+rspamd_str_lc_copy (gchar *dst, const gchar *src, gsize len)
+{
+#if defined(__SSE2__)
+	while (len >= 16) {
+		_mm_storeu_si128 ((__m128i *)dst,
+				rspamd_str_lc_sse2 (_mm_loadu_si128 ((const __m128i *)src)));
+		dst += 16;
+		src += 16;
+		len -= 16;
+	}
+#elif defined(RSPAMD_STR_NEON)
+	while (len >= 16) {
+		vst1q_u8 ((uint8_t *)dst,
+				rspamd_str_lc_neon (vld1q_u8 ((const uint8_t *)src)));
+		dst += 16;
+		src += 16;
+		len -= 16;
+	}
+#endif
+
+	while (len > 0) {
+		*dst++ = lc_map[(guchar)*src++];
+		len --;
+	}
+}
+
+/* Returns length of the leading part of string with no high bit set */
+static gsize
+rspamd_str_ascii_prefix (const guchar *p, gsize len)
+{
+	const guchar *s = p, *end = p + len;
+
+#if defined(__SSE2__)
+	while (end - p >= 16) {
+		if (_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)p)) != 0) {
+			break;
+		}
+
+		p += 16;
 	}
+#elif defined(RSPAMD_STR_NEON)
+	while (end - p >= 16) {
+		if (vmaxvq_u8 (vld1q_u8 (p)) >= 0x80) {
+			break;
+		}
 
-	switch (leftover) {
-	case 3:
-		*dest++ = lc_map[(guchar)str[i++]];
-	case 2:
-		*dest++ = lc_map[(guchar)str[i++]];
-	case 1:
-		*dest++ = lc_map[(guchar)str[i]];
+		p += 16;
 	}
+#endif
 
+	while (p < end && *p < 0x80) {
+		p ++;
+	}
+
+	return p - s;
+}
+
+void
+rspamd_str_lc (gchar *str, guint size)
+{
+	rspamd_str_lc_copy (str, str, size);
 }
 
 gint
@@ -94,9 +164,42 @@ rspamd_lc_cmp (const gchar *s, const gchar *d, gsize l)
 		guchar c[4];
 		guint32 n;
 	} cmp1, cmp2;
-	gsize leftover = l % 4;
+	gsize leftover;
 	gint ret = 0;
+#if defined(__SSE2__)
+	__m128i v1, v2;
+
+	while (l >= 16) {
+		v1 = rspamd_str_lc_sse2 (_mm_loadu_si128 ((const __m128i *)s));
+		v2 = rspamd_str_lc_sse2 (_mm_loadu_si128 ((const __m128i *)d));
+
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v1, v2)) != 0xffff) {
+			/* Result is calculated by the scalar code below */
+			break;
+		}
+
+		s += 16;
+		d += 16;
+		l -= 16;
+	}
+#elif defined(RSPAMD_STR_NEON)
+	uint8x16_t v1, v2;
+
+	while (l >= 16) {
+		v1 = rspamd_str_lc_neon (vld1q_u8 ((const uint8_t *)s));
+		v2 = rspamd_str_lc_neon (vld1q_u8 ((const uint8_t *)d));
+
+		if (vminvq_u8 (vceqq_u8 (v1, v2)) == 0) {
+			break;
+		}
 
+		s += 16;
+		d += 16;
+		l -= 16;
+	}
+#endif
+
+	leftover = l % 4;
 	fp = l - leftover;
 
 	for (i = 0; i != fp; i += 4) {
@@ -117,6 +220,9 @@ rspamd_lc_cmp (const gchar *s, const gchar *d, gsize l)
 		}
 	}
 
+	s += fp;
+	d += fp;
+
 	while (leftover > 0) {
 		if (g_ascii_tolower (*s) != g_ascii_tolower (*d)) {
 			return (*s) - (*d);
@@ -143,8 +249,22 @@ rspamd_str_lc_utf8 (gchar *str, guint size)
 	gint remain = size;
 	gint r;
 	gunichar uc;
+	gsize ascii_len;
+
+	/* ASCII prefix is converted in place with no unicode tables lookups */
+	ascii_len = rspamd_str_ascii_prefix ((const guchar *)str, size);
+	rspamd_str_lc_copy (str, str, ascii_len);
+	s += ascii_len;
+	d += ascii_len;
+	remain -= ascii_len;
 
 	while (remain > 0) {
+		if (!((guchar)*s & 0x80)) {
+			*d++ = lc_map[(guchar)*s++];
+			remain --;
+			continue;
+		}
+
 		uc = g_utf8_get_char (s);
 		uc = g_unichar_tolower (uc);
 		p = g_utf8_next_char (s);
@@ -175,7 +295,13 @@ rspamd_str_lc_utf8 (gchar *str, guint size)
 gboolean
 rspamd_strcase_equal (gconstpointer v, gconstpointer v2)
 {
-	if (g_ascii_strcasecmp ((const gchar *)v, (const gchar *)v2) == 0) {
+	gsize l1, l2;
+
+	/* Lengths are found by libc vectorised code, so compare by blocks then */
+	l1 = strlen ((const gchar *)v);
+	l2 = strlen ((const gchar *)v2);
+
+	if (l1 == l2 && rspamd_lc_cmp ((const gchar *)v, (const gchar *)v2, l1) == 0) {
 		return TRUE;
 	}
 
@@ -196,42 +322,30 @@ rspamd_strcase_equal (gconstpointer v, gconstpointer v2)
 #define XXH_ONESHOT XXH32
 #endif
 
+#define ICASE_HASH_BLOCK 256
+
 static guint
 rspamd_icase_hash (const gchar *in, gsize len)
 {
-	guint leftover = len % 4;
-	guint fp, i;
-	const uint8_t* s = (const uint8_t*) in;
-	union {
-		struct {
-			guchar c1, c2, c3, c4;
-		} c;
-		guint32 pp;
-	} u;
+	gchar buf[ICASE_HASH_BLOCK];
+	gsize r;
 	XXH_STATE st;
 
-	fp = len - leftover;
+	if (len <= sizeof (buf)) {
+		/* The same digest as streaming variant gives */
+		rspamd_str_lc_copy (buf, in, len);
+
+		return XXH_ONESHOT (buf, len, rspamd_hash_seed ());
+	}
+
 	XXH_RESET (&st, rspamd_hash_seed ());
 
-	for (i = 0; i != fp; i += 4) {
-		u.c.c1 = s[i], u.c.c2 = s[i + 1], u.c.c3 = s[i + 2], u.c.c4 = s[i + 3];
-		u.c.c1 = lc_map[u.c.c1];
-		u.c.c2 = lc_map[u.c.c2];
-		u.c.c3 = lc_map[u.c.c3];
-		u.c.c4 = lc_map[u.c.c4];
-		XXH_UPDATE (&st, &u.pp, sizeof (u));
-	}
-
-	u.pp = 0;
-	switch (leftover) {
-	case 3:
-		u.c.c3 = lc_map[(guchar)s[i++]];
-	case 2:
-		u.c.c2 = lc_map[(guchar)s[i++]];
-	case 1:
-		u.c.c1 = lc_map[(guchar)s[i]];
-		XXH_UPDATE (&st, &u.pp, leftover);
-		break;
+	while (len > 0) {
+		r = MIN (len, sizeof (buf));
+		rspamd_str_lc_copy (buf, in, r);
+		XXH_UPDATE (&st, buf, r);
+		in += r;
+		len -= r;
 	}
 
 	return XXH_DIGEST (&st);
@@ -519,11 +633,30 @@ rspamd_encode_base32_buf (const guchar *in, gsize inlen, gchar *out,
 	gchar *o, *end;
 	gsize i;
 	gint remain = -1, x;
+	guint64 v;
 
 	end = out + outlen;
 	o = out;
-
-	for (i = 0; i < inlen && o < end - 1; i++) {
+	i = 0;
+
+	/* Encode full groups of 5 bytes to 8 characters at once */
+	while (inlen - i >= 5 && end - o >= 8) {
+		v = (guint64)in[i] | (guint64)in[i + 1] << 8 |
+				(guint64)in[i + 2] << 16 | (guint64)in[i + 3] << 24 |
+				(guint64)in[i + 4] << 32;
+		o[0] = b32[v & 0x1F];
+		o[1] = b32[v >> 5 & 0x1F];
+		o[2] = b32[v >> 10 & 0x1F];
+		o[3] = b32[v >> 15 & 0x1F];
+		o[4] = b32[v >> 20 & 0x1F];
+		o[5] = b32[v >> 25 & 0x1F];
+		o[6] = b32[v >> 30 & 0x1F];
+		o[7] = b32[v >> 35 & 0x1F];
+		o += 8;
+		i += 5;
+	}
+
+	for (; i < inlen && o < end - 1; i++) {
 		switch (i % 5) {
 		case 0:
 			/* 8 bits of input and 3 to remain */
@@ -640,11 +773,45 @@ rspamd_decode_base32_buf (const gchar *in, gsize inlen,
 	guint acc = 0U;
 	guint processed_bits = 0;
 	gsize i;
+	guint64 v;
 
 	end = out + outlen;
 	o = out;
+	i = 0;
+
+	/*
+	 * Decode full groups of 8 characters to 5 bytes at once, the group must
+	 * be followed by some character as the last byte is written lazily below
+	 */
+	while (inlen - i > 8 && end - o > 5) {
+		v = (guint64)b32_dec[(guchar)in[i]] |
+				(guint64)b32_dec[(guchar)in[i + 1]] << 5 |
+				(guint64)b32_dec[(guchar)in[i + 2]] << 10 |
+				(guint64)b32_dec[(guchar)in[i + 3]] << 15 |
+				(guint64)b32_dec[(guchar)in[i + 4]] << 20 |
+				(guint64)b32_dec[(guchar)in[i + 5]] << 25 |
+				(guint64)b32_dec[(guchar)in[i + 6]] << 30 |
+				(guint64)b32_dec[(guchar)in[i + 7]] << 35;
+		decoded = b32_dec[(guchar)in[i]] | b32_dec[(guchar)in[i + 1]] |
+				b32_dec[(guchar)in[i + 2]] | b32_dec[(guchar)in[i + 3]] |
+				b32_dec[(guchar)in[i + 4]] | b32_dec[(guchar)in[i + 5]] |
+				b32_dec[(guchar)in[i + 6]] | b32_dec[(guchar)in[i + 7]];
+
+		if (decoded & 0xe0) {
+			/* Invalid characters are handled below */
+			break;
+		}
+
+		o[0] = v & 0xFF;
+		o[1] = v >> 8 & 0xFF;
+		o[2] = v >> 16 & 0xFF;
+		o[3] = v >> 24 & 0xFF;
+		o[4] = v >> 32 & 0xFF;
+		o += 5;
+		i += 8;
+	}
 
-	for (i = 0; i < inlen; i ++) {
+	for (; i < inlen; i ++) {
 		c = (guchar)in[i];
 
 		if (processed_bits >= 8) {
@@ -725,7 +892,7 @@ rspamd_encode_base64_common (const guchar *in, gsize inlen, gint str_len,
 	} } \
 while (0)
 
-	gsize allocated_len = (inlen / 3) * 4 + 5;
+	gsize allocated_len = (inlen / 3) * 4 + 5, r, line;
 	gchar *out, *o;
 	guint64 n;
 	guint32 rem, t, carry;
@@ -744,6 +911,35 @@ while (0)
 	o = out;
 	cols = 0;
 
+	/*
+	 * Lines of multiple of 4 characters contain whole 3 bytes blocks, so
+	 * they are encoded by the vectorised encoder; the last line is encoded
+	 * below as it is followed by padding
+	 */
+	if (str_len <= 0) {
+		r = rspamd_cryptobox_base64_encode_blocks (in, inlen, o);
+		in += r;
+		inlen -= r;
+		o += r / 3 * 4;
+	}
+	else if (str_len % 4 == 0) {
+		line = str_len / 4 * 3;
+
+		while (inlen > line) {
+			rspamd_cryptobox_base64_encode_blocks (in, line, o);
+			o += str_len;
+			*o++ = '\r';
+			*o++ = '\n';
+
+			if (fold) {
+				*o++ = '\t';
+			}
+
+			in += line;
+			inlen -= line;
+		}
+	}
+
 	while (inlen > 6) {
 		n = *(guint64 *)in;
 		n = GUINT64_TO_BE (n);
@@ -1009,6 +1205,81 @@ rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 	return column[s1len];
 }
 
+gint
+rspamd_strings_levenshtein_distance_bounded (const gchar *s1, gsize s1len,
+		const gchar *s2, gsize s2len, guint max_dist)
+{
+	guint x, y, lo, hi, lastdiag, olddiag, best, inf, v;
+	guint *row;
+	const gchar *t;
+	gsize tlen;
+
+	g_assert (s1 != NULL);
+	g_assert (s2 != NULL);
+
+	if (s1len == 0) {
+		s1len = strlen (s1);
+	}
+	if (s2len == 0) {
+		s2len = strlen (s2);
+	}
+
+	/* Row is build for the shorter string */
+	if (s1len > s2len) {
+		t = s1;
+		s1 = s2;
+		s2 = t;
+		tlen = s1len;
+		s1len = s2len;
+		s2len = tlen;
+	}
+
+	inf = max_dist + 1;
+
+	if (s2len - s1len > max_dist) {
+		return inf;
+	}
+
+	row = g_malloc ((s1len + 1) * sizeof (guint));
+
+	for (y = 0; y <= s1len; y++) {
+		row[y] = MIN (y, inf);
+	}
+
+	for (x = 1; x <= s2len; x++) {
+		lo = x > max_dist ? x - max_dist : 1;
+		hi = MIN (s1len, x + max_dist);
+		lastdiag = row[lo - 1];
+		/* Cells outside of the band are considered as infinite */
+		row[lo - 1] = lo == 1 ? MIN (x, inf) : inf;
+		best = row[lo - 1];
+
+		for (y = lo; y <= hi; y++) {
+			olddiag = row[y];
+			v = MIN3 (olddiag + 1, row[y - 1] + 1,
+					lastdiag + (s1[y - 1] == s2[x - 1] ? 0 : 1));
+			row[y] = MIN (v, inf);
+			lastdiag = olddiag;
+
+			if (row[y] < best) {
+				best = row[y];
+			}
+		}
+
+		if (best >= inf) {
+			/* Minimum of a row never decreases */
+			g_free (row);
+
+			return inf;
+		}
+	}
+
+	v = row[s1len];
+	g_free (row);
+
+	return v;
+}
+
 GString *
 rspamd_header_value_fold (const gchar *name,
 		const gchar *value,
@@ -1180,6 +1451,117 @@ rspamd_header_value_fold (const gchar *name,
 	return res;
 }
 
+/* Longer patterns are searched by Karp-Rabin and two-way algorithms */
+#define SUBSTRING_SIMD_MAX 32
+
+static inline gboolean
+rspamd_substring_verify (const gchar *in, const gchar *srch, gsize srchlen,
+		gboolean caseless)
+{
+	if (caseless) {
+		return rspamd_lc_cmp (in, srch, srchlen) == 0;
+	}
+
+	return memcmp (in, srch, srchlen) == 0;
+}
+
+/*
+ * Candidate positions are found by comparing the first and the last
+ * characters of pattern with 16 positions at once, then they are verified
+ * by the full comparison. Requires `1 < srchlen <= inlen`
+ */
+static inline goffset
+rspamd_substring_search_simd (const gchar *in, gsize inlen,
+		const gchar *srch, gsize srchlen, gboolean caseless)
+{
+	gsize j = 0, k, last = srchlen - 1;
+	guchar first_c, last_c;
+#if defined(__SSE2__)
+	__m128i a, b, first_v, last_v;
+	guint bits;
+#elif defined(RSPAMD_STR_NEON)
+	uint8x16_t a, b, m, first_v, last_v;
+	guint64 bits;
+#endif
+
+	first_c = caseless ? lc_map[(guchar)srch[0]] : (guchar)srch[0];
+	last_c = caseless ? lc_map[(guchar)srch[last]] : (guchar)srch[last];
+
+#if defined(__SSE2__)
+	first_v = _mm_set1_epi8 (first_c);
+	last_v = _mm_set1_epi8 (last_c);
+
+	while (inlen - j >= last + 16) {
+		a = _mm_loadu_si128 ((const __m128i *)(in + j));
+		b = _mm_loadu_si128 ((const __m128i *)(in + j + last));
+
+		if (caseless) {
+			a = rspamd_str_lc_sse2 (a);
+			b = rspamd_str_lc_sse2 (b);
+		}
+
+		bits = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, first_v),
+				_mm_cmpeq_epi8 (b, last_v)));
+
+		while (bits != 0) {
+			k = j + __builtin_ctz (bits);
+
+			if (rspamd_substring_verify (in + k + 1, srch + 1, srchlen - 2,
+					caseless)) {
+				return k;
+			}
+
+			bits &= bits - 1;
+		}
+
+		j += 16;
+	}
+#elif defined(RSPAMD_STR_NEON)
+	first_v = vdupq_n_u8 (first_c);
+	last_v = vdupq_n_u8 (last_c);
+
+	while (inlen - j >= last + 16) {
+		a = vld1q_u8 ((const uint8_t *)(in + j));
+		b = vld1q_u8 ((const uint8_t *)(in + j + last));
+
+		if (caseless) {
+			a = rspamd_str_lc_neon (a);
+			b = rspamd_str_lc_neon (b);
+		}
+
+		m = vandq_u8 (vceqq_u8 (a, first_v), vceqq_u8 (b, last_v));
+		/* No movemask in NEON: narrow each byte of mask to 4 bits */
+		bits = vget_lane_u64 (vreinterpret_u64_u8 (
+				vshrn_n_u16 (vreinterpretq_u16_u8 (m), 4)), 0);
+
+		while (bits != 0) {
+			k = j + __builtin_ctzll (bits) / 4;
+
+			if (rspamd_substring_verify (in + k + 1, srch + 1, srchlen - 2,
+					caseless)) {
+				return k;
+			}
+
+			bits &= ~(0xfULL << ((k - j) * 4));
+		}
+
+		j += 16;
+	}
+#endif
+
+	for (; j <= inlen - srchlen; j ++) {
+		if ((caseless ? lc_map[(guchar)in[j]] : (guchar)in[j]) == first_c &&
+				(caseless ? lc_map[(guchar)in[j + last]] :
+						(guchar)in[j + last]) == last_c &&
+				rspamd_substring_verify (in + j + 1, srch + 1, srchlen - 2,
+						caseless)) {
+			return j;
+		}
+	}
+
+	return -1;
+}
+
 #define RKHASH(a, b, h) ((((h) - (a)*d) << 1) + (b))
 
 goffset
@@ -1188,11 +1570,21 @@ rspamd_substring_search (const gchar *in, gsize inlen,
 {
 	gint d, hash_srch, hash_in;
 	gsize i, j;
+	const gchar *p;
 
 	if (inlen < srchlen) {
 		return -1;
 	}
 
+	if (srchlen == 1) {
+		p = memchr (in, srch[0], inlen);
+
+		return p ? p - in : -1;
+	}
+	else if (srchlen > 1 && srchlen <= SUBSTRING_SIMD_MAX) {
+		return rspamd_substring_search_simd (in, inlen, srch, srchlen, FALSE);
+	}
+
 	/* Preprocessing */
 	for (d = i = 1; i < srchlen; ++i) {
 		/* computes d = 2^(m-1) with the left-shift operator */
@@ -1231,6 +1623,10 @@ rspamd_substring_search_caseless (const gchar *in, gsize inlen,
 		return -1;
 	}
 
+	if (srchlen > 1 && srchlen <= SUBSTRING_SIMD_MAX) {
+		return rspamd_substring_search_simd (in, inlen, srch, srchlen, TRUE);
+	}
+
 	/* Preprocessing */
 	for (d = i = 1; i < srchlen; ++i) {
 		/* computes d = 2^(m-1) with the left-shift operator */
@@ -1341,6 +1737,14 @@ rspamd_substring_search_twoway (const gchar *in, gint inlen,
 {
 	int i, j, ell, memory, p, per, q;
 
+	if (srchlen > 1 && srchlen <= SUBSTRING_SIMD_MAX) {
+		if (inlen < srchlen) {
+			return -1;
+		}
+
+		return rspamd_substring_search_simd (in, inlen, srch, srchlen, FALSE);
+	}
+
 	/* Preprocessing */
 	i = rspamd_two_way_max_suffix (srch, srchlen, &p);
 	j = rspamd_two_way_max_suffix_tilde (srch, srchlen, &q);
@@ -1536,6 +1940,148 @@ rspamd_string_find_eoh (GString *input)
 	return -1;
 }
 
+#if defined(__SSE2__)
+/* Returns value of hex digits and sets `valid` mask for them */
+static inline __m128i
+rspamd_str_hex_sse2 (__m128i v, __m128i *valid)
+{
+	const __m128i sign = _mm_set1_epi8 ((gchar)0x80);
+	__m128i d, l, isdigit, isalpha;
+
+	d = _mm_sub_epi8 (v, _mm_set1_epi8 ('0'));
+	isdigit = _mm_cmplt_epi8 (_mm_xor_si128 (d, sign),
+			_mm_set1_epi8 ((gchar)(10 ^ 0x80)));
+	l = _mm_sub_epi8 (_mm_or_si128 (v, _mm_set1_epi8 (0x20)),
+			_mm_set1_epi8 ('a'));
+	isalpha = _mm_cmplt_epi8 (_mm_xor_si128 (l, sign),
+			_mm_set1_epi8 ((gchar)(6 ^ 0x80)));
+	*valid = _mm_or_si128 (isdigit, isalpha);
+
+	return _mm_or_si128 (_mm_and_si128 (isdigit, d),
+			_mm_and_si128 (isalpha, _mm_add_epi8 (l, _mm_set1_epi8 (10))));
+}
+
+/* Converts values of nibbles to lowercase hex digits */
+static inline __m128i
+rspamd_str_hexdigit_sse2 (__m128i v)
+{
+	__m128i alpha;
+
+	alpha = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 (9)),
+			_mm_set1_epi8 ('a' - '0' - 10));
+
+	return _mm_add_epi8 (_mm_add_epi8 (v, _mm_set1_epi8 ('0')), alpha);
+}
+#elif defined(RSPAMD_STR_NEON)
+static inline uint8x16_t
+rspamd_str_hex_neon (uint8x16_t v, uint8x16_t *valid)
+{
+	uint8x16_t d, l, isdigit, isalpha;
+
+	d = vsubq_u8 (v, vdupq_n_u8 ('0'));
+	isdigit = vcltq_u8 (d, vdupq_n_u8 (10));
+	l = vsubq_u8 (vorrq_u8 (v, vdupq_n_u8 (0x20)), vdupq_n_u8 ('a'));
+	isalpha = vcltq_u8 (l, vdupq_n_u8 (6));
+	*valid = vorrq_u8 (isdigit, isalpha);
+
+	return vbslq_u8 (isdigit, d, vaddq_u8 (l, vdupq_n_u8 (10)));
+}
+#endif
+
+/* Encodes leading 16 bytes blocks, returns number of input bytes encoded */
+static inline gsize
+rspamd_encode_hex_simd (const guchar *in, gsize inlen, gchar *out)
+{
+	const guchar *p = in;
+#if defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi8 (0x0f);
+	__m128i v, hi, lo;
+
+	while (inlen >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+		hi = rspamd_str_hexdigit_sse2 (
+				_mm_and_si128 (_mm_srli_epi16 (v, 4), mask));
+		lo = rspamd_str_hexdigit_sse2 (_mm_and_si128 (v, mask));
+		_mm_storeu_si128 ((__m128i *)out, _mm_unpacklo_epi8 (hi, lo));
+		_mm_storeu_si128 ((__m128i *)(out + 16), _mm_unpackhi_epi8 (hi, lo));
+		p += 16;
+		out += 32;
+		inlen -= 16;
+	}
+#elif defined(RSPAMD_STR_NEON)
+	const uint8x16_t digits = vld1q_u8 ((const uint8_t *)"0123456789abcdef");
+	uint8x16_t v;
+	uint8x16x2_t res;
+
+	while (inlen >= 16) {
+		v = vld1q_u8 (p);
+		res.val[0] = vqtbl1q_u8 (digits, vshrq_n_u8 (v, 4));
+		res.val[1] = vqtbl1q_u8 (digits, vandq_u8 (v, vdupq_n_u8 (0x0f)));
+		vst2q_u8 ((uint8_t *)out, res);
+		p += 16;
+		out += 32;
+		inlen -= 16;
+	}
+#endif
+
+	return p - in;
+}
+
+/*
+ * Decodes leading 32 characters blocks, stops on the first block with any
+ * non hex character. Returns number of input characters decoded
+ */
+static inline gsize
+rspamd_decode_hex_simd (const gchar *in, gsize inlen, guchar *out)
+{
+	const gchar *p = in;
+#if defined(__SSE2__)
+	const __m128i lo_mask = _mm_set1_epi16 (0xff);
+	__m128i v1, v2, valid1, valid2;
+
+	while (inlen >= 32) {
+		v1 = rspamd_str_hex_sse2 (_mm_loadu_si128 ((const __m128i *)p),
+				&valid1);
+		v2 = rspamd_str_hex_sse2 (_mm_loadu_si128 ((const __m128i *)(p + 16)),
+				&valid2);
+
+		if (_mm_movemask_epi8 (_mm_and_si128 (valid1, valid2)) != 0xffff) {
+			break;
+		}
+
+		/* The first digit of each pair is in the low byte of 16 bits word */
+		v1 = _mm_or_si128 (_mm_slli_epi16 (_mm_and_si128 (v1, lo_mask), 4),
+				_mm_srli_epi16 (v1, 8));
+		v2 = _mm_or_si128 (_mm_slli_epi16 (_mm_and_si128 (v2, lo_mask), 4),
+				_mm_srli_epi16 (v2, 8));
+		_mm_storeu_si128 ((__m128i *)out, _mm_packus_epi16 (v1, v2));
+		p += 32;
+		out += 16;
+		inlen -= 32;
+	}
+#elif defined(RSPAMD_STR_NEON)
+	uint8x16x2_t str;
+	uint8x16_t hi, lo, valid1, valid2;
+
+	while (inlen >= 32) {
+		str = vld2q_u8 ((const uint8_t *)p);
+		hi = rspamd_str_hex_neon (str.val[0], &valid1);
+		lo = rspamd_str_hex_neon (str.val[1], &valid2);
+
+		if (vminvq_u8 (vandq_u8 (valid1, valid2)) == 0) {
+			break;
+		}
+
+		vst1q_u8 (out, vorrq_u8 (vshlq_n_u8 (hi, 4), lo));
+		p += 32;
+		out += 16;
+		inlen -= 32;
+	}
+#endif
+
+	return p - in;
+}
+
 gint
 rspamd_encode_hex_buf (const guchar *in, gsize inlen, gchar *out,
 		gsize outlen)
@@ -1543,11 +2089,17 @@ rspamd_encode_hex_buf (const guchar *in, gsize inlen, gchar *out,
 	gchar *o, *end;
 	const guchar *p;
 	static const gchar hexdigests[16] = "0123456789abcdef";
+	gsize r;
 
 	end = out + outlen;
 	o = out;
 	p = in;
 
+	r = rspamd_encode_hex_simd (p, MIN (inlen, outlen / 2), o);
+	p += r;
+	o += r * 2;
+	inlen -= r;
+
 	while (inlen > 0 && o < end - 1) {
 		*o++ = hexdigests[((*p >> 4) & 0xF)];
 		*o++ = hexdigests[((*p++) & 0xF)];
@@ -1594,6 +2146,7 @@ rspamd_decode_hex_buf (const gchar *in, gsize inlen,
 	guchar *o, *end, ret = 0;
 	const gchar *p;
 	gchar c;
+	gsize r;
 
 	end = out + outlen;
 	o = out;
@@ -1602,6 +2155,15 @@ rspamd_decode_hex_buf (const gchar *in, gsize inlen,
 	/* We ignore trailing chars if we have not even input */
 	inlen = inlen - inlen % 2;
 
+	r = rspamd_decode_hex_simd (p, MIN (inlen, outlen * 2), o);
+
+	if (r > 0) {
+		p += r;
+		o += r / 2;
+		inlen -= r;
+		ret = o[-1];
+	}
+
 	while (inlen > 1 && o < end) {
 		c = *p++;
 
@@ -1628,6 +2190,92 @@ rspamd_decode_hex_buf (const gchar *in, gsize inlen,
 	return -1;
 }
 
+static inline gint
+rspamd_hex_digit (gchar c)
+{
+	if      (c >= '0' && c <= '9') return c - '0';
+	else if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	else if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+
+	return -1;
+}
+
+gssize
+rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen)
+{
+	const gchar *p, *end, *eq, *s;
+	gchar *o, *oend;
+	gint hi, lo;
+	gsize cpy;
+
+	p = in;
+	end = in + inlen;
+	o = out;
+	oend = out + outlen;
+
+	while (p < end) {
+		/* Literal runs are copied at once */
+		eq = memchr (p, '=', end - p);
+		cpy = (eq ? eq : end) - p;
+
+		if (cpy > (gsize)(oend - o)) {
+			return -1;
+		}
+
+		memmove (o, p, cpy);
+		o += cpy;
+
+		if (eq == NULL) {
+			break;
+		}
+
+		p = eq + 1;
+
+		if (end - p >= 2 && (hi = rspamd_hex_digit (p[0])) != -1 &&
+				(lo = rspamd_hex_digit (p[1])) != -1) {
+			if (o >= oend) {
+				return -1;
+			}
+
+			*o++ = (hi << 4) | lo;
+			p += 2;
+			continue;
+		}
+
+		/* Soft line break, whitespace padding is allowed before it */
+		s = p;
+
+		while (s < end && (*s == ' ' || *s == '\t')) {
+			s ++;
+		}
+
+		if (s == end) {
+			p = s;
+		}
+		else if (*s == '\n') {
+			p = s + 1;
+		}
+		else if (*s == '\r') {
+			p = s + 1;
+
+			if (p < end && *p == '\n') {
+				p ++;
+			}
+		}
+		else {
+			/* Invalid sequence is kept as is */
+			if (o >= oend) {
+				return -1;
+			}
+
+			*o++ = '=';
+		}
+	}
+
+	return o - out;
+}
+
 guchar*
 rspamd_decode_hex (const gchar *in, gsize inlen)
 {
@@ -1703,17 +2351,13 @@ static int
 rspamd_gstring_append_double (double val, void *ud)
 {
 	GString *buf = ud;
-	const double delta = 0.0000001;
 
 	if (val == (double) (int) val) {
 		rspamd_printf_gstring (buf, "%.1f", val);
 	}
-	else if (fabs (val - (double) (int) val) < delta) {
-		/* Write at maximum precision */
-		rspamd_printf_gstring (buf, "%.*g", DBL_DIG, val);
-	}
 	else {
-		rspamd_printf_gstring (buf, "%f", val);
+		/* The short form that is parsed back to the same value */
+		rspamd_printf_gstring (buf, "%g", val);
 	}
 
 	return 0;
@@ -1772,17 +2416,13 @@ static int
 rspamd_fstring_emit_append_double (double val, void *ud)
 {
 	rspamd_fstring_t **buf = ud;
-	const double delta = 0.0000001;
 
-	if (val == (double)((gint) val)) {
+	if (val == (double) (int) val) {
 		rspamd_printf_fstring (buf, "%.1f", val);
 	}
-	else if (fabs (val - (double) (int) val) < delta) {
-		/* Write at maximum precision */
-		rspamd_printf_fstring (buf, "%.*g", DBL_DIG, val);
-	}
 	else {
-		rspamd_printf_fstring (buf, "%f", val);
+		/* The short form that is parsed back to the same value */
+		rspamd_printf_fstring (buf, "%g", val);
 	}
 
 	return 0;
@@ -1805,6 +2445,208 @@ rspamd_ucl_emit_fstring_comments (const ucl_object_t *obj,
 	ucl_object_emit_full (obj, emit_type, &func, comments);
 }
 
+/*
+ * Streaming JSON emitter
+ */
+void
+rspamd_json_emitter_init (struct rspamd_json_emitter *e,
+		rspamd_fstring_t *buf)
+{
+	g_assert (e != NULL);
+
+	e->buf = buf ? buf : rspamd_fstring_sized_new (BUFSIZ);
+	e->nonempty = 0;
+	e->depth = 0;
+	e->after_key = FALSE;
+}
+
+/* Writes separator before a new element of the current container */
+static inline void
+rspamd_json_emit_element (struct rspamd_json_emitter *e)
+{
+	guint64 bit;
+
+	if (e->after_key) {
+		e->after_key = FALSE;
+		return;
+	}
+
+	if (e->depth > 0) {
+		bit = 1ULL << (e->depth - 1);
+
+		if (e->nonempty & bit) {
+			rspamd_fstring_emit_append_character (',', 1, &e->buf);
+		}
+		else {
+			e->nonempty |= bit;
+		}
+	}
+}
+
+static inline void
+rspamd_json_emit_container_start (struct rspamd_json_emitter *e, gchar c)
+{
+	rspamd_json_emit_element (e);
+	g_assert (e->depth < RSPAMD_JSON_EMITTER_MAX_DEPTH);
+	e->depth ++;
+	e->nonempty &= ~(1ULL << (e->depth - 1));
+	rspamd_fstring_emit_append_character (c, 1, &e->buf);
+}
+
+static inline void
+rspamd_json_emit_container_end (struct rspamd_json_emitter *e, gchar c)
+{
+	g_assert (e->depth > 0);
+	e->depth --;
+	rspamd_fstring_emit_append_character (c, 1, &e->buf);
+}
+
+void
+rspamd_json_emit_object_start (struct rspamd_json_emitter *e)
+{
+	rspamd_json_emit_container_start (e, '{');
+}
+
+void
+rspamd_json_emit_object_end (struct rspamd_json_emitter *e)
+{
+	rspamd_json_emit_container_end (e, '}');
+}
+
+void
+rspamd_json_emit_array_start (struct rspamd_json_emitter *e)
+{
+	rspamd_json_emit_container_start (e, '[');
+}
+
+void
+rspamd_json_emit_array_end (struct rspamd_json_emitter *e)
+{
+	rspamd_json_emit_container_end (e, ']');
+}
+
+static void
+rspamd_json_emit_escaped (struct rspamd_json_emitter *e,
+		const gchar *str, gsize len)
+{
+	const gchar *p = str, *c = str, *end = str + len;
+	gchar esc[8];
+
+	rspamd_fstring_emit_append_character ('"', 1, &e->buf);
+
+	while (p < end) {
+		if ((guchar)*p < 0x20 || *p == '"' || *p == '\\') {
+			if (p > c) {
+				e->buf = rspamd_fstring_append (e->buf, c, p - c);
+			}
+
+			switch (*p) {
+			case '\n':
+				e->buf = rspamd_fstring_append (e->buf, "\\n", 2);
+				break;
+			case '\r':
+				e->buf = rspamd_fstring_append (e->buf, "\\r", 2);
+				break;
+			case '\b':
+				e->buf = rspamd_fstring_append (e->buf, "\\b", 2);
+				break;
+			case '\t':
+				e->buf = rspamd_fstring_append (e->buf, "\\t", 2);
+				break;
+			case '\f':
+				e->buf = rspamd_fstring_append (e->buf, "\\f", 2);
+				break;
+			case '\\':
+				e->buf = rspamd_fstring_append (e->buf, "\\\\", 2);
+				break;
+			case '"':
+				e->buf = rspamd_fstring_append (e->buf, "\\\"", 2);
+				break;
+			default:
+				rspamd_snprintf (esc, sizeof (esc), "\\u%04xd", (guint)(guchar)*p);
+				e->buf = rspamd_fstring_append (e->buf, esc, 6);
+				break;
+			}
+
+			c = ++p;
+		}
+		else {
+			p ++;
+		}
+	}
+
+	if (p > c) {
+		e->buf = rspamd_fstring_append (e->buf, c, p - c);
+	}
+
+	rspamd_fstring_emit_append_character ('"', 1, &e->buf);
+}
+
+void
+rspamd_json_emit_key (struct rspamd_json_emitter *e, const gchar *key)
+{
+	g_assert (key != NULL);
+
+	rspamd_json_emit_element (e);
+	rspamd_json_emit_escaped (e, key, strlen (key));
+	rspamd_fstring_emit_append_character (':', 1, &e->buf);
+	e->after_key = TRUE;
+}
+
+void
+rspamd_json_emit_lstring (struct rspamd_json_emitter *e,
+		const gchar *str, gsize len)
+{
+	rspamd_json_emit_element (e);
+	rspamd_json_emit_escaped (e, str, len);
+}
+
+void
+rspamd_json_emit_string (struct rspamd_json_emitter *e, const gchar *str)
+{
+	if (str == NULL) {
+		rspamd_json_emit_element (e);
+		e->buf = rspamd_fstring_append (e->buf, "null", 4);
+	}
+	else {
+		rspamd_json_emit_lstring (e, str, strlen (str));
+	}
+}
+
+void
+rspamd_json_emit_int (struct rspamd_json_emitter *e, gint64 val)
+{
+	rspamd_json_emit_element (e);
+	rspamd_fstring_emit_append_int (val, &e->buf);
+}
+
+void
+rspamd_json_emit_double (struct rspamd_json_emitter *e, gdouble val)
+{
+	rspamd_json_emit_element (e);
+	rspamd_fstring_emit_append_double (val, &e->buf);
+}
+
+void
+rspamd_json_emit_bool (struct rspamd_json_emitter *e, gboolean val)
+{
+	rspamd_json_emit_element (e);
+
+	if (val) {
+		e->buf = rspamd_fstring_append (e->buf, "true", 4);
+	}
+	else {
+		e->buf = rspamd_fstring_append (e->buf, "false", 5);
+	}
+}
+
+void
+rspamd_json_emit_ucl (struct rspamd_json_emitter *e, const ucl_object_t *obj)
+{
+	rspamd_json_emit_element (e);
+	rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON_COMPACT, &e->buf);
+}
+
 guint
 rspamd_url_hash (gconstpointer u)
 {
@@ -1869,3 +2711,387 @@ rspamd_urls_cmp (gconstpointer a, gconstpointer b)
 
 	return r == 0;
 }
+
+gsize
+rspamd_memcspn (const gchar *s, gsize len, const gchar *reject, gsize rlen)
+{
+	const gchar *p = s, *end = s + len;
+	guint64 mask[4] = {0, 0, 0, 0};
+	guchar c;
+	gsize i;
+
+	if (len == 0 || rlen == 0) {
+		return len;
+	}
+
+#if defined(__SSE2__)
+	if (rlen <= MEMCSPN_SIMD_MAX) {
+		__m128i needles[MEMCSPN_SIMD_MAX], v, m;
+		gint bits;
+
+		for (i = 0; i < rlen; i ++) {
+			needles[i] = _mm_set1_epi8 (reject[i]);
+		}
+
+		while (end - p >= 16) {
+			v = _mm_loadu_si128 ((const __m128i *)p);
+			m = _mm_cmpeq_epi8 (v, needles[0]);
+
+			for (i = 1; i < rlen; i ++) {
+				m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, needles[i]));
+			}
+
+			bits = _mm_movemask_epi8 (m);
+
+			if (bits != 0) {
+				return p - s + __builtin_ctz (bits);
+			}
+
+			p += 16;
+		}
+	}
+#elif defined(RSPAMD_STR_NEON)
+	if (rlen <= MEMCSPN_SIMD_MAX) {
+		uint8x16_t needles[MEMCSPN_SIMD_MAX], v, m;
+
+		for (i = 0; i < rlen; i ++) {
+			needles[i] = vdupq_n_u8 (reject[i]);
+		}
+
+		while (end - p >= 16) {
+			v = vld1q_u8 ((const uint8_t *)p);
+			m = vceqq_u8 (v, needles[0]);
+
+			for (i = 1; i < rlen; i ++) {
+				m = vorrq_u8 (m, vceqq_u8 (v, needles[i]));
+			}
+
+			if (vmaxvq_u8 (m) != 0) {
+				/* Exact position is found by the scalar loop below */
+				break;
+			}
+
+			p += 16;
+		}
+	}
+#endif
+
+	for (i = 0; i < rlen; i ++) {
+		c = reject[i];
+		mask[c >> 6] |= 1ULL << (c & 63);
+	}
+
+	while (p < end) {
+		c = *p;
+
+		if (mask[c >> 6] & (1ULL << (c & 63))) {
+			break;
+		}
+
+		p ++;
+	}
+
+	return p - s;
+}
+
+gboolean
+rspamd_fast_utf8_validate (const guchar *data, gsize len)
+{
+	const guchar *p = data, *end = data + len;
+	guint64 w;
+
+#if defined(__SSE2__)
+	__m128i v, zero = _mm_setzero_si128 ();
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+
+		/* High bit set or zero byte */
+		if ((_mm_movemask_epi8 (v) |
+				_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero))) != 0) {
+			break;
+		}
+
+		p += 16;
+	}
+#elif defined(RSPAMD_STR_NEON)
+	uint8x16_t v;
+
+	while (end - p >= 16) {
+		v = vld1q_u8 (p);
+
+		if (vmaxvq_u8 (v) >= 0x80 || vminvq_u8 (v) == 0) {
+			break;
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (end - p >= 8) {
+		memcpy (&w, p, sizeof (w));
+
+		/* High bit set or zero byte (see "determine if a word has a zero byte") */
+		if ((w & 0x8080808080808080ULL) ||
+				((w - 0x0101010101010101ULL) & ~w & 0x8080808080808080ULL)) {
+			break;
+		}
+
+		p += 8;
+	}
+
+	while (p < end && *p != 0 && *p < 0x80) {
+		p ++;
+	}
+
+	if (p == end) {
+		return TRUE;
+	}
+
+	/* All bytes before p are ASCII, so p is at characters boundary */
+	return g_utf8_validate ((const gchar *)p, end - p, NULL);
+}
+
+static inline guint
+rspamd_popcount32 (guint32 v)
+{
+	v = v - ((v >> 1) & 0x55555555U);
+	v = (v & 0x33333333U) + ((v >> 2) & 0x33333333U);
+
+	return (((v + (v >> 4)) & 0x0F0F0F0FU) * 0x01010101U) >> 24;
+}
+
+void
+rspamd_str_charclass_stats (const guchar *data, gsize len,
+		struct rspamd_charclass_stats *st)
+{
+	const guchar *p = data, *end = data + len;
+	gboolean a, h, a1, h1;
+#if defined(__SSE2__)
+	__m128i x, y, ax, ay;
+	const __m128i lc = _mm_set1_epi8 (0x20), la = _mm_set1_epi8 ('a'),
+			sign = _mm_set1_epi8 ((gchar)0x80),
+			lim = _mm_set1_epi8 ((gchar)(26 ^ 0x80));
+	guint32 ma, mh, ma1, mh1;
+#elif defined(RSPAMD_STR_NEON)
+	uint8x16_t x, y, ax, ay, hx, hy;
+	const uint8x16_t lc = vdupq_n_u8 (0x20), la = vdupq_n_u8 ('a'),
+			lim = vdupq_n_u8 (26), one = vdupq_n_u8 (1),
+			hb = vdupq_n_u8 (0x80);
+#endif
+
+	memset (st, 0, sizeof (*st));
+
+#if defined(__SSE2__)
+/* Unsigned ((c | 0x20) - 'a') < 26 using signed comparison */
+#define SSE_ISALPHA(v) _mm_cmplt_epi8 (_mm_xor_si128 ( \
+		_mm_sub_epi8 (_mm_or_si128 ((v), lc), la), sign), lim)
+
+	/* Pair of each byte with the next one, so we need 17 bytes */
+	while (end - p >= 17) {
+		x = _mm_loadu_si128 ((const __m128i *)p);
+		y = _mm_loadu_si128 ((const __m128i *)(p + 1));
+		ax = SSE_ISALPHA (x);
+		ay = SSE_ISALPHA (y);
+		ma = _mm_movemask_epi8 (ax);
+		mh = _mm_movemask_epi8 (x);
+		ma1 = _mm_movemask_epi8 (ay);
+		mh1 = _mm_movemask_epi8 (y);
+
+		st->ascii_alpha += rspamd_popcount32 (ma);
+		st->high_bit += rspamd_popcount32 (mh);
+		st->mixed_pairs += rspamd_popcount32 ((ma & mh1) | (mh & ma1));
+		st->same_pairs += rspamd_popcount32 ((ma & ma1) | (mh & mh1));
+
+		p += 16;
+	}
+#undef SSE_ISALPHA
+#elif defined(RSPAMD_STR_NEON)
+	while (end - p >= 17) {
+		x = vld1q_u8 (p);
+		y = vld1q_u8 (p + 1);
+		ax = vcltq_u8 (vsubq_u8 (vorrq_u8 (x, lc), la), lim);
+		ay = vcltq_u8 (vsubq_u8 (vorrq_u8 (y, lc), la), lim);
+		hx = vcgeq_u8 (x, hb);
+		hy = vcgeq_u8 (y, hb);
+
+		st->ascii_alpha += vaddvq_u8 (vandq_u8 (ax, one));
+		st->high_bit += vaddvq_u8 (vandq_u8 (hx, one));
+		st->mixed_pairs += vaddvq_u8 (vandq_u8 (vorrq_u8 (
+				vandq_u8 (ax, hy), vandq_u8 (hx, ay)), one));
+		st->same_pairs += vaddvq_u8 (vandq_u8 (vorrq_u8 (
+				vandq_u8 (ax, ay), vandq_u8 (hx, hy)), one));
+
+		p += 16;
+	}
+#endif
+
+	while (p < end) {
+		a = g_ascii_isalpha (*p);
+		h = (*p & 0x80) != 0;
+		st->ascii_alpha += a;
+		st->high_bit += h;
+
+		if (p + 1 < end) {
+			a1 = g_ascii_isalpha (p[1]);
+			h1 = (p[1] & 0x80) != 0;
+
+			if ((a && h1) || (h && a1)) {
+				st->mixed_pairs ++;
+			}
+			else if ((a && a1) || (h && h1)) {
+				st->same_pairs ++;
+			}
+		}
+
+		p ++;
+	}
+}
+
+/*
+ * UTF-8 decoder is based on the DFA by Bjoern Hoehrmann
+ * (http://bjoern.hoehrmann.de/utf-8/decoder/dfa/), MIT license.
+ * The first part maps bytes to classes, the second one is the transition
+ * table indexed by state (multiple of 12) and class.
+ */
+#define RSPAMD_UTF8_ACCEPT 0
+#define RSPAMD_UTF8_REJECT 12
+
+static const guint8 rspamd_utf8_dfa[] = {
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+	8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3, 11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8,
+
+	0,12,24,36,60,96,84,12,12,12,48,72, 12,12,12,12,12,12,12,12,12,12,12,12,
+	12,0,12,12,12,12,12,0,12,0,12,12, 12,24,12,12,12,12,12,24,12,24,12,12,
+	12,12,12,12,12,12,12,24,12,12,12,12, 12,24,12,12,12,12,12,12,12,24,12,12,
+	12,12,12,12,12,12,12,36,12,36,12,12, 12,36,12,12,12,12,12,36,12,36,12,12,
+	12,36,12,12,12,12,12,12,12,12,12,12,
+};
+
+/* Scripts counted for the most common one, like chartable does */
+#define RSPAMD_SCRIPTS_COUNTED (G_UNICODE_SCRIPT_NKO + 1)
+
+static inline void
+rspamd_script_stats_letter (struct rspamd_script_stats *st, guint *counts,
+		gint *prev, gint cur)
+{
+	if (cur != -1) {
+		st->letters ++;
+
+		if (cur < RSPAMD_SCRIPTS_COUNTED) {
+			counts[cur] ++;
+		}
+
+		if (*prev != -1) {
+			st->letter_pairs ++;
+
+			if (*prev != cur) {
+				st->script_changes ++;
+			}
+		}
+	}
+
+	*prev = cur;
+}
+
+gboolean
+rspamd_str_script_stats (const guchar *data, gsize len,
+		struct rspamd_script_stats *st)
+{
+	const guchar *p = data, *end = data + len;
+	guint32 state = RSPAMD_UTF8_ACCEPT, cp = 0, type;
+	guint counts[RSPAMD_SCRIPTS_COUNTED], max = 0, i;
+	gint prev = -1;
+#if defined(__SSE2__)
+	__m128i x;
+	const __m128i lc = _mm_set1_epi8 (0x20), la = _mm_set1_epi8 ('a'),
+			sign = _mm_set1_epi8 ((gchar)0x80),
+			lim = _mm_set1_epi8 ((gchar)(26 ^ 0x80));
+	guint32 ma, nalpha;
+#endif
+
+	memset (st, 0, sizeof (*st));
+	memset (counts, 0, sizeof (counts));
+	st->valid = TRUE;
+	st->script = G_UNICODE_SCRIPT_COMMON;
+
+	while (p < end) {
+		if (state == RSPAMD_UTF8_ACCEPT) {
+#if defined(__SSE2__)
+			/* Blocks of ASCII: all letters are latin, so only pairs matter */
+			while (end - p >= 16) {
+				x = _mm_loadu_si128 ((const __m128i *)p);
+
+				if (_mm_movemask_epi8 (x) != 0) {
+					break;
+				}
+
+				ma = _mm_movemask_epi8 (_mm_cmplt_epi8 (_mm_xor_si128 (
+						_mm_sub_epi8 (_mm_or_si128 (x, lc), la), sign), lim));
+
+				if (ma != 0) {
+					nalpha = rspamd_popcount32 (ma);
+					st->letters += nalpha;
+					counts[G_UNICODE_SCRIPT_LATIN] += nalpha;
+					st->letter_pairs += rspamd_popcount32 (ma & (ma >> 1));
+
+					if ((ma & 1) && prev != -1) {
+						st->letter_pairs ++;
+
+						if (prev != G_UNICODE_SCRIPT_LATIN) {
+							st->script_changes ++;
+						}
+					}
+				}
+
+				prev = (ma & 0x8000) ? G_UNICODE_SCRIPT_LATIN : -1;
+				p += 16;
+			}
+
+			if (p == end) {
+				break;
+			}
+#endif
+
+			if (*p < 0x80) {
+				rspamd_script_stats_letter (st, counts, &prev,
+						g_ascii_isalpha (*p) ? G_UNICODE_SCRIPT_LATIN : -1);
+				p ++;
+				continue;
+			}
+		}
+
+		type = rspamd_utf8_dfa[*p];
+		cp = (state != RSPAMD_UTF8_ACCEPT) ?
+				(*p & 0x3fu) | (cp << 6) : (0xffu >> type) & *p;
+		state = rspamd_utf8_dfa[256 + state + type];
+		p ++;
+
+		if (state == RSPAMD_UTF8_ACCEPT) {
+			rspamd_script_stats_letter (st, counts, &prev,
+					g_unichar_isalpha (cp) ? (gint)g_unichar_get_script (cp) : -1);
+		}
+		else if (state == RSPAMD_UTF8_REJECT) {
+			break;
+		}
+	}
+
+	if (state != RSPAMD_UTF8_ACCEPT) {
+		st->valid = FALSE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (counts); i ++) {
+		if (counts[i] > max) {
+			max = counts[i];
+			st->script = i;
+		}
+	}
+
+	return st->valid;
+}
@@ -175,6 +175,18 @@ gint rspamd_encode_hex_buf (const guchar *in, gsize inlen, gchar *out,
 gint rspamd_decode_hex_buf (const gchar *in, gsize inlen,
 		guchar *out, gsize outlen);
 
+/**
+ * Decode quoted-printable content (RFC 2045) removing soft line breaks,
+ * invalid escape sequences are copied as is
+ * @param in input
+ * @param inlen input length
+ * @param out output buf (may overlap with `in`)
+ * @param outlen output buf len
+ * @return decoded len or -1 if `outlen` is not enough
+ */
+gssize rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen);
+
 /**
  * Encode string using base64 encoding
  * @param in input
@@ -219,6 +231,20 @@ gsize rspamd_decode_url (gchar *dst, const gchar *src, gsize size);
 gint rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 		const gchar *s2, gsize s2len);
 
+/**
+ * Return levenstein distance between two strings if it is not greater than
+ * `max_dist`, only a band of 2 * `max_dist` + 1 diagonals is evaluated and
+ * comparison stops as soon as distance is known to exceed `max_dist`
+ * @param s1
+ * @param s1len
+ * @param s2
+ * @param s2len
+ * @param max_dist maximum distance of interest
+ * @return distance or `max_dist` + 1 if strings differ more
+ */
+gint rspamd_strings_levenshtein_distance_bounded (const gchar *s1, gsize s1len,
+		const gchar *s2, gsize s2len, guint max_dist);
+
 /**
  * Fold header using rfc822 rules, return new GString from the previous one
  * @param name name of header (used just for folding)
@@ -230,7 +256,9 @@ GString *rspamd_header_value_fold (const gchar *name,
 		guint fold_max);
 
 /**
- * Search for a substring `srch` in the text `in` using Karp-Rabin algorithm
+ * Search for a substring `srch` in the text `in`. Short patterns are
+ * searched using SIMD filter on the first and the last characters, long
+ * patterns are searched using Karp-Rabin algorithm
  * @param in input
  * @param inlen input len
  * @param srch search string
@@ -241,7 +269,8 @@ goffset rspamd_substring_search (const gchar *in, gsize inlen,
 	const gchar *srch, gsize srchlen);
 
 /**
- * Search for a substring `srch` in the text `in` using Karp-Rabin algorithm in caseless matter (ASCII only)
+ * Search for a substring `srch` in the text `in` in caseless matter (ASCII only),
+ * algorithms are the same as for `rspamd_substring_search`
  * @param in input
  * @param inlen input len
  * @param srch search string
@@ -254,6 +283,7 @@ goffset rspamd_substring_search_caseless (const gchar *in, gsize inlen,
 /**
  * Search for a substring `srch` in the text `in` using 2-way algorithm:
  * http://www-igm.univ-mlv.fr/~lecroq/string/node26.html#SECTION00260
+ * Short patterns are searched as in `rspamd_substring_search`
  * @param in input
  * @param inlen input len
  * @param srch search string
@@ -300,6 +330,111 @@ void rspamd_ucl_emit_fstring_comments (const ucl_object_t *obj,
 		rspamd_fstring_t **target,
 		const ucl_object_t *comments);
 
+/*
+ * Streaming JSON emitter: writes compact JSON directly to fstring without
+ * building intermediate UCL objects. Caller is responsible for emitting keys
+ * inside objects only and for closing all containers
+ */
+#define RSPAMD_JSON_EMITTER_MAX_DEPTH 64
+
+struct rspamd_json_emitter {
+	rspamd_fstring_t *buf;      /**< output buffer (could be reallocated)		*/
+	guint64 nonempty;           /**< bit per depth: container has elements	*/
+	guint depth;                /**< current depth of containers			*/
+	gboolean after_key;         /**< key has been written, value is expected	*/
+};
+
+/**
+ * Init emitter to append JSON to the specified buffer
+ * @param e emitter
+ * @param buf target buffer (could be NULL)
+ */
+void rspamd_json_emitter_init (struct rspamd_json_emitter *e,
+		rspamd_fstring_t *buf);
+
+void rspamd_json_emit_object_start (struct rspamd_json_emitter *e);
+void rspamd_json_emit_object_end (struct rspamd_json_emitter *e);
+void rspamd_json_emit_array_start (struct rspamd_json_emitter *e);
+void rspamd_json_emit_array_end (struct rspamd_json_emitter *e);
+
+/**
+ * Emit key of an object, the next emitted element is its value
+ */
+void rspamd_json_emit_key (struct rspamd_json_emitter *e, const gchar *key);
+
+/**
+ * Emit string value (NULL string is emitted as null)
+ */
+void rspamd_json_emit_string (struct rspamd_json_emitter *e, const gchar *str);
+void rspamd_json_emit_lstring (struct rspamd_json_emitter *e,
+		const gchar *str, gsize len);
+void rspamd_json_emit_int (struct rspamd_json_emitter *e, gint64 val);
+void rspamd_json_emit_double (struct rspamd_json_emitter *e, gdouble val);
+void rspamd_json_emit_bool (struct rspamd_json_emitter *e, gboolean val);
+
+/**
+ * Emit existing UCL object as a value
+ */
+void rspamd_json_emit_ucl (struct rspamd_json_emitter *e,
+		const ucl_object_t *obj);
+
+/**
+ * Returns the length of the initial segment of `s` that consists of bytes
+ * not from `reject` (like strcspn but for arbitrary memory). Uses SIMD
+ * when `rlen` is small
+ * @param s input
+ * @param len length of input
+ * @param reject bytes to search for
+ * @param rlen number of bytes in `reject`
+ * @return offset of the first byte from `reject` or `len` if not found
+ */
+gsize rspamd_memcspn (const gchar *s, gsize len,
+		const gchar *reject, gsize rlen);
+
+struct rspamd_charclass_stats {
+	guint ascii_alpha; /**< number of ascii letters */
+	guint high_bit; /**< number of bytes with high bit set */
+	guint mixed_pairs; /**< ascii letter adjacent to a byte with high bit */
+	guint same_pairs; /**< two ascii letters or two bytes with high bit */
+};
+
+/**
+ * Calculates classes of bytes and their adjacent pairs in a single pass
+ * @param data input
+ * @param len length of input
+ * @param st output statistics
+ */
+void rspamd_str_charclass_stats (const guchar *data, gsize len,
+		struct rspamd_charclass_stats *st);
+
+struct rspamd_script_stats {
+	guint letters; /**< number of alphabetic characters */
+	guint letter_pairs; /**< adjacent alphabetic characters */
+	guint script_changes; /**< adjacent letters of different scripts */
+	GUnicodeScript script; /**< the most common script of letters */
+	gboolean valid; /**< FALSE if input is not utf8, stats are partial then */
+};
+
+/**
+ * Decodes utf8 input and classifies scripts of its letters in a single pass,
+ * ASCII runs are processed by blocks
+ * @param data input
+ * @param len length of input
+ * @param st output statistics
+ * @return FALSE if input is not a valid utf8
+ */
+gboolean rspamd_str_script_stats (const guchar *data, gsize len,
+		struct rspamd_script_stats *st);
+
+/**
+ * Validates utf8 like g_utf8_validate (including rejection of zero bytes)
+ * but checks ASCII parts of the input using SIMD or words
+ * @param data input
+ * @param len length of input
+ * @return TRUE if input is a valid utf8 string
+ */
+gboolean rspamd_fast_utf8_validate (const guchar *data, gsize len);
+
 guint rspamd_url_hash (gconstpointer u);
 
 /* Compare two emails for building emails hash */
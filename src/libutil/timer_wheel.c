@@ -0,0 +1,279 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "timer_wheel.h"
+#include "util.h"
+#include "utlist.h"
+#include <math.h>
+
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 3
+/* Longer timeouts are clamped to the range of the last level */
+#define TIMER_WHEEL_MAX_DELTA ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct rspamd_timer_wheel {
+	struct rspamd_timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	struct event_base *ev_base;
+	struct event ev;
+	gdouble resolution;
+	gdouble start;
+	/* The next tick to be processed */
+	guint64 now;
+	guint ntimers;
+	gboolean running;
+};
+
+static GHashTable *shared_wheels = NULL;
+
+static inline guint64
+rspamd_timer_wheel_tick (struct rspamd_timer_wheel *wheel)
+{
+	return (rspamd_get_ticks () - wheel->start) / wheel->resolution;
+}
+
+static void
+rspamd_timer_wheel_insert (struct rspamd_timer_wheel *wheel,
+		struct rspamd_timer *t)
+{
+	guint64 delta;
+	guint level, idx;
+
+	if (t->expire < wheel->now) {
+		t->expire = wheel->now;
+	}
+
+	delta = t->expire - wheel->now;
+
+	if (delta > TIMER_WHEEL_MAX_DELTA) {
+		delta = TIMER_WHEEL_MAX_DELTA;
+		t->expire = wheel->now + delta;
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level ++) {
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	idx = (t->expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	t->head = &wheel->slots[level][idx];
+	DL_APPEND (*t->head, t);
+}
+
+/* Moves timers of the upper level slot to the lower levels */
+static guint
+rspamd_timer_wheel_cascade (struct rspamd_timer_wheel *wheel, guint level)
+{
+	struct rspamd_timer *list, *t, *tmp;
+	guint idx;
+
+	idx = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	list = wheel->slots[level][idx];
+	wheel->slots[level][idx] = NULL;
+
+	DL_FOREACH_SAFE (list, t, tmp) {
+		rspamd_timer_wheel_insert (wheel, t);
+	}
+
+	return idx;
+}
+
+static void
+rspamd_timer_wheel_step (struct rspamd_timer_wheel *wheel)
+{
+	struct rspamd_timer *list, *t;
+	guint idx, level;
+
+	idx = wheel->now & TIMER_WHEEL_MASK;
+
+	if (idx == 0) {
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level ++) {
+			if (rspamd_timer_wheel_cascade (wheel, level) != 0) {
+				break;
+			}
+		}
+	}
+
+	list = wheel->slots[0][idx];
+	wheel->slots[0][idx] = NULL;
+	wheel->now ++;
+
+	/* Callbacks are allowed to cancel any timers in this list */
+	DL_FOREACH (list, t) {
+		t->head = &list;
+	}
+
+	while (list != NULL) {
+		t = list;
+		DL_DELETE (list, t);
+		t->head = NULL;
+		wheel->ntimers --;
+		t->cb (t->ud);
+	}
+}
+
+static void
+rspamd_timer_wheel_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_timer_wheel *wheel = ud;
+	guint64 target;
+
+	target = rspamd_timer_wheel_tick (wheel);
+
+	while (wheel->now <= target) {
+		rspamd_timer_wheel_step (wheel);
+
+		if (wheel->ntimers == 0) {
+			break;
+		}
+	}
+
+	if (wheel->ntimers == 0) {
+		/* Do not wake idle processes */
+		event_del (&wheel->ev);
+		wheel->running = FALSE;
+	}
+}
+
+struct rspamd_timer_wheel *
+rspamd_timer_wheel_new (struct event_base *ev_base, gdouble resolution)
+{
+	struct rspamd_timer_wheel *wheel;
+
+	g_assert (resolution > 0);
+
+	wheel = g_malloc0 (sizeof (*wheel));
+	wheel->ev_base = ev_base;
+	wheel->resolution = resolution;
+	wheel->start = rspamd_get_ticks ();
+	event_set (&wheel->ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_timer_wheel_handler, wheel);
+	event_base_set (ev_base, &wheel->ev);
+
+	return wheel;
+}
+
+struct rspamd_timer_wheel *
+rspamd_timer_wheel_get (struct event_base *ev_base)
+{
+	struct rspamd_timer_wheel *wheel;
+
+	if (shared_wheels == NULL) {
+		shared_wheels = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	wheel = g_hash_table_lookup (shared_wheels, ev_base);
+
+	if (wheel == NULL) {
+		wheel = rspamd_timer_wheel_new (ev_base,
+				RSPAMD_TIMER_WHEEL_RESOLUTION);
+		g_hash_table_insert (shared_wheels, ev_base, wheel);
+	}
+
+	return wheel;
+}
+
+void
+rspamd_timer_wheel_destroy (struct rspamd_timer_wheel *wheel)
+{
+	struct rspamd_timer *t, *tmp;
+	guint level, idx;
+
+	if (wheel == NULL) {
+		return;
+	}
+
+	if (shared_wheels &&
+			g_hash_table_lookup (shared_wheels, wheel->ev_base) == wheel) {
+		g_hash_table_remove (shared_wheels, wheel->ev_base);
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level ++) {
+		for (idx = 0; idx < TIMER_WHEEL_SLOTS; idx ++) {
+			DL_FOREACH_SAFE (wheel->slots[level][idx], t, tmp) {
+				t->head = NULL;
+				t->wheel = NULL;
+			}
+		}
+	}
+
+	if (wheel->running) {
+		event_del (&wheel->ev);
+	}
+
+	g_free (wheel);
+}
+
+guint
+rspamd_timer_wheel_count (struct rspamd_timer_wheel *wheel)
+{
+	g_assert (wheel != NULL);
+
+	return wheel->ntimers;
+}
+
+void
+rspamd_timer_add (struct rspamd_timer_wheel *wheel,
+		struct rspamd_timer *t,
+		gdouble timeout,
+		rspamd_timer_cb cb,
+		gpointer ud)
+{
+	struct timeval tv;
+	guint64 cur;
+
+	g_assert (wheel != NULL);
+	g_assert (t != NULL);
+
+	rspamd_timer_cancel (t);
+	cur = rspamd_timer_wheel_tick (wheel);
+
+	if (wheel->ntimers == 0 && !wheel->running) {
+		/* Idle wheel has not been advanced */
+		wheel->now = cur;
+	}
+
+	/* The current tick is partially elapsed */
+	t->expire = cur + 1 + (guint64)ceil (MAX (timeout, 0) / wheel->resolution);
+	t->cb = cb;
+	t->ud = ud;
+	t->wheel = wheel;
+	rspamd_timer_wheel_insert (wheel, t);
+	wheel->ntimers ++;
+
+	if (!wheel->running) {
+		double_to_tv (wheel->resolution, &tv);
+		event_add (&wheel->ev, &tv);
+		wheel->running = TRUE;
+	}
+}
+
+void
+rspamd_timer_cancel (struct rspamd_timer *t)
+{
+	g_assert (t != NULL);
+
+	if (t->head != NULL) {
+		DL_DELETE (*t->head, t);
+		t->head = NULL;
+
+		if (t->wheel) {
+			t->wheel->ntimers --;
+		}
+	}
+}
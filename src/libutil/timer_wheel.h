@@ -0,0 +1,105 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_TIMER_WHEEL_H_
+#define SRC_LIBUTIL_TIMER_WHEEL_H_
+
+#include "config.h"
+#include <event.h>
+
+/**
+ * Hierarchical timer wheel for coarse timeouts. All timers of a wheel are
+ * dispatched from a single libevent timer, which is active merely when some
+ * timers are armed. Adding and cancelling of timers are O(1) operations.
+ */
+
+/* Default resolution of wheels in seconds */
+#define RSPAMD_TIMER_WHEEL_RESOLUTION 0.05
+
+struct rspamd_timer_wheel;
+
+typedef void (*rspamd_timer_cb) (gpointer ud);
+
+/**
+ * Timer element, it is embedded in the structures of its users and must be
+ * zero filled before the first use
+ */
+struct rspamd_timer {
+	rspamd_timer_cb cb;
+	gpointer ud;
+	guint64 expire;
+	struct rspamd_timer_wheel *wheel;
+	struct rspamd_timer **head;
+	struct rspamd_timer *prev, *next;
+};
+
+/**
+ * Creates new timer wheel
+ * @param ev_base event base used to dispatch timers
+ * @param resolution granularity of timers in seconds
+ * @return new timer wheel
+ */
+struct rspamd_timer_wheel *rspamd_timer_wheel_new (struct event_base *ev_base,
+		gdouble resolution);
+
+/**
+ * Returns timer wheel shared by all users of the specified event base
+ * creating it with the default resolution if needed
+ * @param ev_base event base
+ * @return shared timer wheel
+ */
+struct rspamd_timer_wheel *rspamd_timer_wheel_get (struct event_base *ev_base);
+
+/**
+ * Destroys timer wheel, pending timers are not called
+ * @param wheel timer wheel
+ */
+void rspamd_timer_wheel_destroy (struct rspamd_timer_wheel *wheel);
+
+/**
+ * Returns number of armed timers
+ * @param wheel timer wheel
+ * @return number of timers
+ */
+guint rspamd_timer_wheel_count (struct rspamd_timer_wheel *wheel);
+
+/**
+ * Arms timer to call `cb` after `timeout` seconds, timer that is already armed
+ * is rescheduled. Timers are never called before their timeout, but could
+ * be called later up to the wheel resolution.
+ * @param wheel timer wheel
+ * @param t timer element
+ * @param timeout timeout in seconds
+ * @param cb callback
+ * @param ud opaque data for callback
+ */
+void rspamd_timer_add (struct rspamd_timer_wheel *wheel,
+		struct rspamd_timer *t,
+		gdouble timeout,
+		rspamd_timer_cb cb,
+		gpointer ud);
+
+/**
+ * Cancels timer if it is armed
+ * @param t timer element
+ */
+void rspamd_timer_cancel (struct rspamd_timer *t);
+
+/**
+ * Checks if timer is armed
+ */
+#define rspamd_timer_is_armed(t) ((t)->head != NULL)
+
+#endif /* SRC_LIBUTIL_TIMER_WHEEL_H_ */
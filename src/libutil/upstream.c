@@ -21,6 +21,8 @@
 #include "rdns.h"
 #include "xxhash.h"
 #include "utlist.h"
+#include "unix-std.h"
+#include <math.h>
 
 struct upstream_inet_addr_entry {
 	rspamd_inet_addr_t *addr;
@@ -36,8 +38,16 @@ struct upstream {
 	guint weight;
 	guint cur_weight;
 	guint errors;
+	/* Exponentially weighted moving average of requests time */
+	gdouble latency;
+	/* Decayed count of keys routed by hashed rotation */
+	guint hash_load;
 	guint dns_requests;
 	gint active_idx;
+	/* Index of the shared probe slot or -1 */
+	gint probe_idx;
+	gboolean probe_down;
+	gboolean revive_pending;
 	gchar *name;
 	struct event ev;
 	struct timeval tv;
@@ -57,15 +67,77 @@ struct upstream {
 	ref_entry_t ref;
 };
 
+struct upstream_ring_point {
+	guint64 point;
+	struct upstream *up;
+};
+
 struct upstream_list {
 	struct upstream_ctx *ctx;
 	GPtrArray *ups;
 	GPtrArray *alive;
 	rspamd_mutex_t *lock;
 	guint64 hash_seed;
+	/* Consistent hash ring over all upstreams, rebuilt when they are added */
+	GArray *ring;
+	gboolean ring_dirty;
+	gdouble hash_load_factor;
+	guint hash_total;
 	guint cur_elt;
 	enum rspamd_upstream_flag flags;
 	enum rspamd_upstream_rotation rot_alg;
+	enum rspamd_upstream_probe_type probe_type;
+	guchar *probe_payload;
+	gsize probe_len;
+	gchar *probe_expect;
+	/* Generation of probes results applied to this list */
+	guint probe_gen;
+};
+
+#define UPSTREAM_PROBE_SLOTS 128
+#define UPSTREAM_PROBE_MAX_PAYLOAD 128
+#define UPSTREAM_PROBE_MAX_EXPECT 16
+
+struct upstream_probe_slot {
+	struct sockaddr_storage sa;
+	socklen_t slen;
+	enum rspamd_upstream_probe_type type;
+	gint down;
+	guint payload_len;
+	guint expect_len;
+	guchar payload[UPSTREAM_PROBE_MAX_PAYLOAD];
+	gchar expect[UPSTREAM_PROBE_MAX_EXPECT];
+};
+
+/*
+ * Lives in shared memory: slots are registered by any process, whilst their
+ * states are written by the prober only
+ */
+struct upstream_probes {
+	rspamd_mempool_mutex_t *lock;
+	volatile guint generation;
+	volatile guint nslots;
+	struct upstream_probe_slot slots[UPSTREAM_PROBE_SLOTS];
+};
+
+struct upstream_prober;
+
+struct upstream_probe_conn {
+	struct upstream_prober *prober;
+	rspamd_inet_addr_t *addr;
+	guint idx;
+	gint fd;
+	struct event ev;
+};
+
+struct upstream_prober {
+	struct upstream_ctx *ctx;
+	struct event_base *ev_base;
+	pid_t pid;
+	struct event ev;
+	struct timeval tv;
+	struct timeval timeout_tv;
+	struct upstream_probe_conn conns[UPSTREAM_PROBE_SLOTS];
 };
 
 struct upstream_ctx {
@@ -79,6 +151,9 @@ struct upstream_ctx {
 	guint dns_retransmits;
 	GQueue *upstreams;
 	gboolean configured;
+	rspamd_mempool_t *shared_pool;
+	struct upstream_probes *probes;
+	struct upstream_prober *prober;
 	ref_entry_t ref;
 };
 
@@ -134,6 +209,15 @@ rspamd_upstream_ctx_dtor (struct upstream_ctx *ctx)
 		cur = g_list_next (cur);
 	}
 
+	if (ctx->prober && ctx->prober->pid == getpid ()) {
+		/* Events of the prober are not touched in the forked processes */
+		rspamd_upstreams_probe_stop (ctx);
+	}
+
+	if (ctx->shared_pool) {
+		rspamd_mempool_delete (ctx->shared_pool);
+	}
+
 	g_queue_free (ctx->upstreams);
 	g_slice_free1 (sizeof (*ctx), ctx);
 }
@@ -316,7 +400,10 @@ rspamd_upstream_revive_cb (int fd, short what, void *arg)
 
 	rspamd_mutex_lock (up->lock);
 	event_del (&up->ev);
-	if (up->ls) {
+	up->revive_pending = FALSE;
+
+	/* Upstreams that are down according to probes wait for their recovery */
+	if (up->ls && !up->probe_down) {
 		rspamd_upstream_set_active (up->ls, up);
 	}
 
@@ -363,6 +450,7 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 	ntim = rspamd_time_jitter (up->ctx->revive_time, up->ctx->revive_jitter);
 	double_to_tv (ntim, &up->tv);
 	event_add (&up->ev, &up->tv);
+	up->revive_pending = TRUE;
 
 	rspamd_mutex_unlock (ls->lock);
 }
@@ -433,7 +521,40 @@ rspamd_upstream_ok (struct upstream *up)
 	rspamd_mutex_unlock (up->lock);
 }
 
+/* Weight of the latest request in the latency average */
+#define LATENCY_EWMA_ALPHA 0.3
+
+void
+rspamd_upstream_ok_latency (struct upstream *up, gdouble latency)
+{
+	rspamd_upstream_ok (up);
+
+	if (latency < 0) {
+		return;
+	}
+
+	rspamd_mutex_lock (up->lock);
+
+	if (up->latency == 0) {
+		up->latency = latency;
+	}
+	else {
+		up->latency = LATENCY_EWMA_ALPHA * latency +
+				(1.0 - LATENCY_EWMA_ALPHA) * up->latency;
+	}
+
+	rspamd_mutex_unlock (up->lock);
+}
+
+gdouble
+rspamd_upstream_latency (struct upstream *up)
+{
+	return up->latency;
+}
+
 #define SEED_CONSTANT 0xa574de7df64e9b9dULL
+/* Maximum load of an upstream relative to the average for bounded hashing */
+#define DEFAULT_HASH_LOAD_FACTOR 1.25
 
 struct upstream_list*
 rspamd_upstreams_create (struct upstream_ctx *ctx)
@@ -444,6 +565,7 @@ rspamd_upstreams_create (struct upstream_ctx *ctx)
 	ls->hash_seed = SEED_CONSTANT;
 	ls->ups = g_ptr_array_new ();
 	ls->alive = g_ptr_array_new ();
+	ls->ring = g_array_new (FALSE, FALSE, sizeof (struct upstream_ring_point));
 	ls->lock = rspamd_mutex_new ();
 	ls->cur_elt = 0;
 	ls->ctx = ctx;
@@ -515,6 +637,135 @@ rspamd_upstream_name (struct upstream *up)
 	return up->name;
 }
 
+static struct upstream_probes *
+rspamd_upstream_probes_get (struct upstream_ctx *ctx)
+{
+	if (ctx->probes == NULL) {
+		ctx->shared_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				"upstreams");
+		ctx->probes = rspamd_mempool_alloc0_shared (ctx->shared_pool,
+				sizeof (*ctx->probes));
+		ctx->probes->lock = rspamd_mempool_get_mutex (ctx->shared_pool);
+	}
+
+	return ctx->probes;
+}
+
+/*
+ * Upstreams with the same address and probe type share a single slot, so
+ * lists created by different processes are probed once
+ */
+static void
+rspamd_upstream_probe_bind (struct upstream_list *ls, struct upstream *up)
+{
+	struct upstream_probes *probes;
+	struct upstream_probe_slot *slot;
+	struct upstream_addr_elt *elt;
+	const struct sockaddr *sa;
+	socklen_t slen;
+	guint i;
+
+	up->probe_idx = -1;
+
+	if (up->addrs.addr == NULL || up->addrs.addr->len == 0) {
+		return;
+	}
+
+	probes = rspamd_upstream_probes_get (ls->ctx);
+	elt = g_ptr_array_index (up->addrs.addr, 0);
+	sa = rspamd_inet_address_get_sa (elt->addr, &slen);
+
+	if (sa == NULL || slen > sizeof (slot->sa)) {
+		return;
+	}
+
+	rspamd_mempool_lock_mutex (probes->lock);
+
+	for (i = 0; i < probes->nslots; i ++) {
+		slot = &probes->slots[i];
+
+		if (slot->type == ls->probe_type && slot->slen == slen &&
+				memcmp (&slot->sa, sa, slen) == 0) {
+			up->probe_idx = i;
+			break;
+		}
+	}
+
+	if (up->probe_idx == -1 && probes->nslots < UPSTREAM_PROBE_SLOTS) {
+		slot = &probes->slots[probes->nslots];
+		memcpy (&slot->sa, sa, slen);
+		slot->slen = slen;
+		slot->type = ls->probe_type;
+		slot->down = 0;
+		slot->payload_len = MIN (ls->probe_len, sizeof (slot->payload));
+		memcpy (slot->payload, ls->probe_payload, slot->payload_len);
+
+		if (ls->probe_expect) {
+			rspamd_strlcpy (slot->expect, ls->probe_expect,
+					sizeof (slot->expect));
+			slot->expect_len = strlen (slot->expect);
+		}
+		else {
+			slot->expect_len = 0;
+		}
+
+		up->probe_idx = probes->nslots ++;
+	}
+
+	rspamd_mempool_unlock_mutex (probes->lock);
+}
+
+/*
+ * Applies the recent probes results to the list, it is called with the list
+ * locked. Upstreams inactive due to errors are left to their revive timers
+ */
+static void
+rspamd_upstreams_probe_sync (struct upstream_list *ups)
+{
+	struct upstream_probes *probes = ups->ctx->probes;
+	struct upstream *up;
+	gboolean down, changed = FALSE;
+	guint i;
+
+	ups->probe_gen = probes->generation;
+
+	for (i = 0; i < ups->ups->len; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+
+		if (up->probe_idx == -1) {
+			continue;
+		}
+
+		down = probes->slots[up->probe_idx].down;
+
+		if (down && !up->probe_down) {
+			up->probe_down = TRUE;
+
+			if (up->active_idx != -1) {
+				g_ptr_array_remove (ups->alive, up);
+				up->active_idx = -1;
+				changed = TRUE;
+			}
+		}
+		else if (!down && up->probe_down) {
+			up->probe_down = FALSE;
+
+			if (up->active_idx == -1 && !up->revive_pending) {
+				g_ptr_array_add (ups->alive, up);
+				changed = TRUE;
+			}
+		}
+	}
+
+	if (changed) {
+		/* Indexes are shifted by removals */
+		for (i = 0; i < ups->alive->len; i ++) {
+			up = g_ptr_array_index (ups->alive, i);
+			up->active_idx = i;
+		}
+	}
+}
+
 gboolean
 rspamd_upstreams_add_upstream (struct upstream_list *ups,
 		const gchar *str, guint16 def_port, void *data)
@@ -553,6 +804,7 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups,
 	up->ud = data;
 	up->cur_weight = up->weight;
 	up->ls = ups;
+	up->probe_idx = -1;
 	REF_INIT_RETAIN (up, rspamd_upstream_dtor);
 	up->lock = rspamd_mutex_new ();
 	up->ctx = ups->ctx;
@@ -561,7 +813,12 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups,
 	up->ctx_pos = g_queue_peek_tail_link (ups->ctx->upstreams);
 	g_ptr_array_sort (up->addrs.addr, rspamd_upstream_addr_sort_func);
 
+	if (ups->probe_type != RSPAMD_UPSTREAM_PROBE_NONE) {
+		rspamd_upstream_probe_bind (ups, up);
+	}
+
 	rspamd_upstream_set_active (ups, up);
+	ups->ring_dirty = TRUE;
 
 	return TRUE;
 }
@@ -618,6 +875,13 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_ROUND_ROBIN;
 		p += sizeof ("round-robin:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"hash-bounded:",
+			sizeof ("hash-bounded:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_HASHED;
+		ups->hash_load_factor = DEFAULT_HASH_LOAD_FACTOR;
+		p += sizeof ("hash-bounded:") - 1;
+	}
 	else if (g_ascii_strncasecmp (p,
 			"hash:",
 			sizeof ("hash:") - 1) == 0) {
@@ -630,6 +894,12 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"latency:",
+			sizeof ("latency:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
 
 	while (p < end) {
 		len = strcspn (p, separators);
@@ -689,6 +959,9 @@ rspamd_upstreams_destroy (struct upstream_list *ups)
 		}
 
 		g_ptr_array_free (ups->ups, TRUE);
+		g_array_free (ups->ring, TRUE);
+		g_free (ups->probe_payload);
+		g_free (ups->probe_expect);
 		rspamd_mutex_free (ups->lock);
 		g_slice_free1 (sizeof (*ups), ups);
 	}
@@ -699,15 +972,25 @@ rspamd_upstream_restore_cb (gpointer elt, gpointer ls)
 {
 	struct upstream *up = (struct upstream *)elt;
 	struct upstream_list *ups = (struct upstream_list *)ls;
+	gboolean revive_pending;
 
 	/* Here the upstreams list is already locked */
 	rspamd_mutex_lock (up->lock);
-	event_del (&up->ev);
+	revive_pending = up->revive_pending;
+
+	if (revive_pending) {
+		event_del (&up->ev);
+		up->revive_pending = FALSE;
+	}
+
 	g_ptr_array_add (ups->alive, up);
 	up->active_idx = ups->alive->len - 1;
 	rspamd_mutex_unlock (up->lock);
-	/* For revive event */
-	REF_RELEASE (up);
+
+	if (revive_pending) {
+		/* For revive event */
+		REF_RELEASE (up);
+	}
 }
 
 static struct upstream*
@@ -758,40 +1041,176 @@ rspamd_upstream_get_round_robin (struct upstream_list *ups, gboolean use_cur)
 }
 
 /*
- * The key idea of this function is obtained from the following paper:
- * A Fast, Minimal Memory, Consistent Hash Algorithm
- * John Lamping, Eric Veach
- *
- * http://arxiv.org/abs/1406.2294
+ * Power of two choices: the faster of two random upstreams is selected, so
+ * slow upstreams get less load without herding all requests to the fastest
+ * one. Upstreams with no latency measured are preferred to obtain it.
  */
-static guint32
-rspamd_consistent_hash (guint64 key, guint32 nbuckets)
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups)
+{
+	struct upstream *u1, *u2;
+	guint i1, i2;
+	gdouble l1, l2;
+
+	rspamd_mutex_lock (ups->lock);
+
+	if (ups->alive->len == 1) {
+		u1 = g_ptr_array_index (ups->alive, 0);
+		rspamd_mutex_unlock (ups->lock);
+
+		return u1;
+	}
+
+	i1 = ottery_rand_range (ups->alive->len - 1);
+	/* Select another upstream */
+	i2 = (i1 + 1 + ottery_rand_range (ups->alive->len - 2)) % ups->alive->len;
+	u1 = g_ptr_array_index (ups->alive, i1);
+	u2 = g_ptr_array_index (ups->alive, i2);
+	rspamd_mutex_unlock (ups->lock);
+
+	/* Recent errors are penalized */
+	l1 = u1->latency * (1 + u1->errors);
+	l2 = u2->latency * (1 + u2->errors);
+
+	return l1 <= l2 ? u1 : u2;
+}
+
+/* Points of each upstream on the hash ring */
+#define HASH_RING_VNODES 160
+/* Loads are halved when this number of keys per upstream is routed */
+#define HASH_LOAD_DECAY 1024
+
+static gint
+rspamd_upstream_ring_cmp (gconstpointer a, gconstpointer b)
 {
-	gint64 b = -1, j = 0;
+	const struct upstream_ring_point *p1 = a, *p2 = b;
 
-	while (j < nbuckets) {
-		b = j;
-		key *= 2862933555777941757ULL + 1;
-		j = (b + 1) * (double)(1ULL << 31) / (double)((key >> 33) + 1ULL);
+	if (p1->point < p2->point) {
+		return -1;
+	}
+	else if (p1->point > p2->point) {
+		return 1;
 	}
 
-	return b;
+	return 0;
 }
 
+static void
+rspamd_upstream_build_ring (struct upstream_list *ups)
+{
+	struct upstream_ring_point pt;
+	struct upstream *up;
+	guint i, j;
+	guint64 h;
+
+	g_array_set_size (ups->ring, 0);
+
+	for (i = 0; i < ups->ups->len; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+		h = XXH64 (up->name, strlen (up->name), ups->hash_seed);
+
+		for (j = 0; j < HASH_RING_VNODES; j ++) {
+			pt.point = XXH64 (&j, sizeof (j), h);
+			pt.up = up;
+			g_array_append_val (ups->ring, pt);
+		}
+	}
+
+	g_array_sort (ups->ring, rspamd_upstream_ring_cmp);
+	ups->ring_dirty = FALSE;
+}
+
+static void
+rspamd_upstream_account_load (struct upstream_list *ups, struct upstream *up)
+{
+	struct upstream *cur;
+	guint i;
+
+	up->hash_load ++;
+	ups->hash_total ++;
+
+	if (ups->hash_total >= HASH_LOAD_DECAY * ups->ups->len) {
+		ups->hash_total = 0;
+
+		for (i = 0; i < ups->ups->len; i ++) {
+			cur = g_ptr_array_index (ups->ups, i);
+			cur->hash_load /= 2;
+			ups->hash_total += cur->hash_load;
+		}
+	}
+}
+
+/*
+ * Keys are mapped to the next point on the ring of all upstreams, so a key
+ * moves only when its upstream is dead (or overloaded with bounded loads)
+ * and returns back when it is alive again.
+ * Bounded loads are described in the following paper:
+ * Consistent Hashing with Bounded Loads
+ * Vahab Mirrokni, Mikkel Thorup, Morteza Zadimoghaddam
+ *
+ * https://arxiv.org/abs/1608.01350
+ */
 static struct upstream*
 rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint keylen)
 {
+	struct upstream_ring_point *pt;
+	struct upstream *up, *selected = NULL;
 	guint64 k;
-	guint32 idx;
+	guint lo, hi, mid, i, capacity = G_MAXUINT;
 
 	/* Generate 64 bits input key */
 	k = XXH64 (key, keylen, ups->hash_seed);
 
 	rspamd_mutex_lock (ups->lock);
-	idx = rspamd_consistent_hash (k, ups->alive->len);
+
+	if (ups->ring_dirty) {
+		rspamd_upstream_build_ring (ups);
+	}
+
+	if (ups->hash_load_factor > 0) {
+		capacity = ceil (ups->hash_load_factor * (ups->hash_total + 1) /
+				MAX (ups->alive->len, 1));
+	}
+
+	/* Find the first point not less than the key */
+	lo = 0;
+	hi = ups->ring->len;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		pt = &g_array_index (ups->ring, struct upstream_ring_point, mid);
+
+		if (pt->point < k) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (i = 0; i < ups->ring->len; i ++) {
+		pt = &g_array_index (ups->ring, struct upstream_ring_point,
+				(lo + i) % ups->ring->len);
+		up = pt->up;
+
+		if (up->active_idx != -1 && up->hash_load < capacity) {
+			selected = up;
+			break;
+		}
+	}
+
+	if (selected == NULL) {
+		/* Everything is overloaded */
+		selected = g_ptr_array_index (ups->alive, 0);
+	}
+
+	if (ups->hash_load_factor > 0) {
+		rspamd_upstream_account_load (ups, selected);
+	}
+
 	rspamd_mutex_unlock (ups->lock);
 
-	return g_ptr_array_index (ups->alive, idx);
+	return selected;
 }
 
 static struct upstream*
@@ -802,6 +1221,11 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	enum rspamd_upstream_rotation type;
 
 	rspamd_mutex_lock (ups->lock);
+	if (ups->probe_type != RSPAMD_UPSTREAM_PROBE_NONE && ups->ctx->probes &&
+			ups->probe_gen != ups->ctx->probes->generation) {
+		rspamd_upstreams_probe_sync (ups);
+	}
+
 	if (ups->alive->len == 0) {
 		/* We have no upstreams alive */
 		g_ptr_array_foreach (ups->ups, rspamd_upstream_restore_cb, ups);
@@ -830,6 +1254,8 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		return rspamd_upstream_get_round_robin (ups, TRUE);
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		return rspamd_upstream_get_round_robin (ups, FALSE);
+	case RSPAMD_UPSTREAM_LATENCY:
+		return rspamd_upstream_get_latency (ups);
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
@@ -932,3 +1358,234 @@ rspamd_upstreams_foreach (struct upstream_list *ups,
 		cb (up, ud);
 	}
 }
+
+void
+rspamd_upstreams_set_probe (struct upstream_list *ups,
+		enum rspamd_upstream_probe_type type,
+		const guchar *payload, gsize len,
+		const gchar *expect)
+{
+	struct upstream *up;
+	guint i;
+
+	g_assert (ups != NULL);
+
+	g_free (ups->probe_payload);
+	g_free (ups->probe_expect);
+	ups->probe_type = type;
+	ups->probe_payload = g_memdup (payload, len);
+	ups->probe_len = len;
+	ups->probe_expect = g_strdup (expect);
+
+	for (i = 0; i < ups->ups->len; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+
+		if (type != RSPAMD_UPSTREAM_PROBE_NONE) {
+			rspamd_upstream_probe_bind (ups, up);
+		}
+		else {
+			up->probe_idx = -1;
+		}
+	}
+}
+
+static void
+rspamd_upstream_probe_mark (struct upstream_probe_conn *conn, gboolean down)
+{
+	struct upstream_probes *probes = conn->prober->ctx->probes;
+	struct upstream_probe_slot *slot = &probes->slots[conn->idx];
+
+	if (slot->down != down) {
+		slot->down = down;
+		probes->generation ++;
+
+		if (conn->addr) {
+			msg_info ("upstream %s:%d is %s according to probe",
+					rspamd_inet_address_to_string (conn->addr),
+					(gint)rspamd_inet_address_get_port (conn->addr),
+					down ? "down" : "up");
+		}
+	}
+}
+
+static void
+rspamd_upstream_probe_finish (struct upstream_probe_conn *conn, gboolean down)
+{
+	event_del (&conn->ev);
+	close (conn->fd);
+	conn->fd = -1;
+	rspamd_upstream_probe_mark (conn, down);
+	rspamd_inet_address_destroy (conn->addr);
+	conn->addr = NULL;
+}
+
+static void
+rspamd_upstream_probe_io (gint fd, short what, gpointer ud)
+{
+	struct upstream_probe_conn *conn = ud;
+	struct upstream_prober *prober = conn->prober;
+	struct upstream_probe_slot *slot;
+	guchar buf[UPSTREAM_PROBE_MAX_EXPECT];
+	gssize r;
+
+	slot = &prober->ctx->probes->slots[conn->idx];
+
+	if (what == EV_TIMEOUT) {
+		rspamd_upstream_probe_finish (conn, TRUE);
+	}
+	else if (what == EV_WRITE) {
+		/* Stream socket is connected */
+		if (write (fd, slot->payload, slot->payload_len) !=
+				(gssize)slot->payload_len) {
+			rspamd_upstream_probe_finish (conn, TRUE);
+		}
+		else {
+			event_del (&conn->ev);
+			event_set (&conn->ev, fd, EV_READ, rspamd_upstream_probe_io, conn);
+			event_base_set (prober->ev_base, &conn->ev);
+			event_add (&conn->ev, &prober->timeout_tv);
+		}
+	}
+	else {
+		r = read (fd, buf, sizeof (buf));
+
+		if (r <= 0) {
+			rspamd_upstream_probe_finish (conn, TRUE);
+		}
+		else {
+			rspamd_upstream_probe_finish (conn, r < (gssize)slot->expect_len ||
+					memcmp (buf, slot->expect, slot->expect_len) != 0);
+		}
+	}
+}
+
+static void
+rspamd_upstream_probe_timer (gint fd, short what, gpointer ud)
+{
+	struct upstream_prober *prober = ud;
+	struct upstream_probes *probes = prober->ctx->probes;
+	struct upstream_probe_slot *slot;
+	struct upstream_probe_conn *conn;
+	guint i, nslots;
+	gboolean stream;
+	short ev_type;
+
+	/* Slots could be registered by other processes */
+	rspamd_mempool_lock_mutex (probes->lock);
+	nslots = probes->nslots;
+	rspamd_mempool_unlock_mutex (probes->lock);
+
+	for (i = 0; i < nslots; i ++) {
+		conn = &prober->conns[i];
+		slot = &probes->slots[i];
+
+		if (conn->fd != -1) {
+			/* The previous probe is still pending */
+			continue;
+		}
+
+		conn->addr = rspamd_inet_address_from_sa ((struct sockaddr *)&slot->sa,
+				slot->slen);
+
+		if (conn->addr == NULL) {
+			continue;
+		}
+
+		stream = slot->type == RSPAMD_UPSTREAM_PROBE_TCP;
+		conn->fd = rspamd_inet_address_connect (conn->addr,
+				stream ? SOCK_STREAM : SOCK_DGRAM, TRUE);
+
+		if (conn->fd == -1) {
+			rspamd_upstream_probe_mark (conn, TRUE);
+			rspamd_inet_address_destroy (conn->addr);
+			conn->addr = NULL;
+			continue;
+		}
+
+		if (stream) {
+			ev_type = EV_WRITE;
+		}
+		else {
+			ev_type = EV_READ;
+
+			if (write (conn->fd, slot->payload, slot->payload_len) == -1) {
+				rspamd_upstream_probe_mark (conn, TRUE);
+				close (conn->fd);
+				conn->fd = -1;
+				rspamd_inet_address_destroy (conn->addr);
+				conn->addr = NULL;
+				continue;
+			}
+		}
+
+		event_set (&conn->ev, conn->fd, ev_type, rspamd_upstream_probe_io, conn);
+		event_base_set (prober->ev_base, &conn->ev);
+		event_add (&conn->ev, &prober->timeout_tv);
+	}
+}
+
+void
+rspamd_upstreams_probe_start (struct upstream_ctx *ctx,
+		struct event_base *ev_base, gdouble interval)
+{
+	struct upstream_prober *prober;
+	guint i;
+
+	g_assert (ctx != NULL);
+
+	if (ctx->prober != NULL || interval <= 0) {
+		return;
+	}
+
+	/* Shared slots must be allocated before forking */
+	rspamd_upstream_probes_get (ctx);
+
+	prober = g_malloc0 (sizeof (*prober));
+	prober->ctx = ctx;
+	prober->ev_base = ev_base;
+	prober->pid = getpid ();
+
+	for (i = 0; i < G_N_ELEMENTS (prober->conns); i ++) {
+		prober->conns[i].prober = prober;
+		prober->conns[i].idx = i;
+		prober->conns[i].fd = -1;
+	}
+
+	double_to_tv (interval, &prober->tv);
+	/* Probes must not overlap */
+	double_to_tv (interval / 2.0, &prober->timeout_tv);
+	event_set (&prober->ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_upstream_probe_timer, prober);
+	event_base_set (ev_base, &prober->ev);
+	event_add (&prober->ev, &prober->tv);
+
+	ctx->prober = prober;
+}
+
+void
+rspamd_upstreams_probe_stop (struct upstream_ctx *ctx)
+{
+	struct upstream_prober *prober;
+	struct upstream_probe_conn *conn;
+	guint i;
+
+	if (ctx == NULL || ctx->prober == NULL) {
+		return;
+	}
+
+	prober = ctx->prober;
+	event_del (&prober->ev);
+
+	for (i = 0; i < G_N_ELEMENTS (prober->conns); i ++) {
+		conn = &prober->conns[i];
+
+		if (conn->fd != -1) {
+			event_del (&conn->ev);
+			close (conn->fd);
+			rspamd_inet_address_destroy (conn->addr);
+		}
+	}
+
+	g_free (prober);
+	ctx->prober = NULL;
+}
@@ -12,6 +12,7 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -19,6 +20,12 @@ enum rspamd_upstream_flag {
 	RSPAMD_UPSTREAM_FLAG_NORESOLVE = (1 << 0),
 };
 
+enum rspamd_upstream_probe_type {
+	RSPAMD_UPSTREAM_PROBE_NONE = 0,
+	RSPAMD_UPSTREAM_PROBE_UDP,
+	RSPAMD_UPSTREAM_PROBE_TCP,
+};
+
 struct rspamd_config;
 /* Opaque upstream structures */
 struct upstream;
@@ -62,6 +69,21 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Increase upstream successes count and account the time of the request
+ * in the moving average latency of this upstream
+ * @param up
+ * @param latency time of the request in seconds
+ */
+void rspamd_upstream_ok_latency (struct upstream *up, gdouble latency);
+
+/**
+ * Returns moving average latency of an upstream in seconds (0 if unknown)
+ * @param up
+ * @return
+ */
+gdouble rspamd_upstream_latency (struct upstream *up);
+
 /**
  * Create new list of upstreams
  * @return
@@ -183,7 +205,8 @@ gpointer rspamd_upstream_get_data (struct upstream *up);
 /**
  * Get new upstream from the list
  * @param ups upstream list
- * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` it is required to specify `key` and `keylen` as arguments
+ * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` it is required to specify `key` and `keylen` as arguments,
+ * `RSPAMD_UPSTREAM_LATENCY` selects the faster of two random upstreams
  * @return
  */
 struct upstream* rspamd_upstream_get (struct upstream_list *ups,
@@ -200,6 +223,41 @@ struct upstream* rspamd_upstream_get_forced (struct upstream_list *ups,
 		enum rspamd_upstream_rotation forced_type,
 		const guchar *key, gsize keylen);
 
+/**
+ * Enables active health checks for upstreams of the list: the probe `payload`
+ * is sent to the first address of each upstream and the upstream is considered
+ * alive if a reply starting with `expect` is received (any reply if `expect`
+ * is NULL). Probes are performed by a single process started with
+ * `rspamd_upstreams_probe_start` and their results are shared with all
+ * processes forked after it, so it should be called only if probes are
+ * enabled in the configuration
+ * @param ups upstream list
+ * @param type transport of probes
+ * @param payload data sent to an upstream
+ * @param len length of payload
+ * @param expect expected prefix of the reply
+ */
+void rspamd_upstreams_set_probe (struct upstream_list *ups,
+		enum rspamd_upstream_probe_type type,
+		const guchar *payload, gsize len,
+		const gchar *expect);
+
+/**
+ * Starts periodic probes of upstreams of the library context, must be called
+ * before forking of the processes that use these upstreams
+ * @param ctx
+ * @param ev_base
+ * @param interval interval of probes in seconds
+ */
+void rspamd_upstreams_probe_start (struct upstream_ctx *ctx,
+		struct event_base *ev_base, gdouble interval);
+
+/**
+ * Stops probes started by `rspamd_upstreams_probe_start`
+ * @param ctx
+ */
+void rspamd_upstreams_probe_stop (struct upstream_ctx *ctx);
+
 /**
  * Re-resolve addresses for all upstreams registered
  */
@@ -1852,6 +1852,20 @@ rspamd_get_virtual_ticks (void)
 	return res;
 }
 
+gdouble
+rspamd_get_thread_ticks (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return (double)ts.tv_sec + ts.tv_nsec / 1000000000.;
+	}
+#endif
+
+	return rspamd_get_virtual_ticks ();
+}
+
 gdouble
 rspamd_get_calendar_ticks (void)
 {
@@ -2140,3 +2154,44 @@ rspamd_file_xmap (const char *fname, guint mode,
 
 	return map;
 }
+
+static gint rspamd_numa_current_node = -1;
+
+guint
+rspamd_numa_nodes (void)
+{
+	static guint nnodes = 0;
+	gchar path[PATH_MAX];
+
+	if (nnodes == 0) {
+		for (;;) {
+			rspamd_snprintf (path, sizeof (path),
+					"/sys/devices/system/node/node%ud", nnodes);
+
+			if (access (path, F_OK) == -1) {
+				break;
+			}
+
+			nnodes ++;
+		}
+
+		if (nnodes == 0) {
+			/* Not a NUMA system or no sysfs */
+			nnodes = 1;
+		}
+	}
+
+	return nnodes;
+}
+
+void
+rspamd_numa_set_node (gint node)
+{
+	rspamd_numa_current_node = node;
+}
+
+gint
+rspamd_numa_node (void)
+{
+	return rspamd_numa_current_node;
+}
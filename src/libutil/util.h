@@ -352,6 +352,13 @@ gdouble rspamd_get_ticks (void);
  */
 gdouble rspamd_get_virtual_ticks (void);
 
+/**
+ * Portably return cpu time of the calling thread as seconds (falls back to
+ * the process cpu time)
+ * @return
+ */
+gdouble rspamd_get_thread_ticks (void);
+
 
 /**
  * Return the real timestamp as unixtime
@@ -443,4 +450,22 @@ int rspamd_file_xopen (const char *fname, int oflags, guint mode);
 gpointer rspamd_file_xmap (const char *fname, guint mode,
 		gsize *size);
 
+/**
+ * Returns number of NUMA nodes of the system (1 if it cannot be detected)
+ * @return number of nodes
+ */
+guint rspamd_numa_nodes (void);
+
+/**
+ * Sets NUMA node which the current process is bound to
+ * @param node node number or -1 if the process is not bound
+ */
+void rspamd_numa_set_node (gint node);
+
+/**
+ * Returns NUMA node which the current process is bound to or -1
+ * @return node number
+ */
+gint rspamd_numa_node (void);
+
 #endif
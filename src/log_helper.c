@@ -21,6 +21,7 @@
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
 #include "libutil/addr.h"
+#include "libserver/protocol.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "utlist.h"
@@ -54,6 +55,11 @@ struct log_helper_ctx {
 	struct rspamd_worker_lua_script *scripts;
 	lua_State *L;
 	gint pair[2];
+	/* Binary task records */
+	gchar *binary_log;
+	gint binary_fd;
+	gint task_pair[2];
+	struct event task_ev;
 };
 
 static gpointer
@@ -67,6 +73,17 @@ init_log_helper (struct rspamd_config *cfg)
 
 	ctx->magic = rspamd_log_helper_magic;
 	ctx->cfg = cfg;
+	ctx->binary_fd = -1;
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"binary_log",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct log_helper_ctx, binary_log),
+			0,
+			"Append binary records of all scanned tasks to this file "
+			"(use `rspamadm logdecode` to read it)");
 
 	return ctx;
 }
@@ -133,12 +150,85 @@ rspamd_log_helper_read (gint fd, short what, gpointer ud)
 	}
 }
 
+static void
+rspamd_log_helper_task_read (gint fd, short what, gpointer ud)
+{
+	struct log_helper_ctx *ctx = ud;
+	static guchar buf[65536];
+	struct rspamd_protocol_log_task_record rec;
+	gssize r;
+
+	r = read (fd, buf, sizeof (buf));
+
+	if (r >= (gssize)sizeof (rec)) {
+		memcpy (&rec, buf, sizeof (rec));
+
+		if (rec.magic != RSPAMD_PROTOCOL_LOG_TASK_MAGIC ||
+				rec.nresults != (r - sizeof (rec)) /
+				sizeof (struct rspamd_protocol_log_symbol_result)) {
+			msg_warn ("cannot read data from task log pipe: bad record of "
+					"%z bytes", r);
+		}
+		else if (write (ctx->binary_fd, buf, r) == -1) {
+			msg_err ("cannot write task record to %s: %s", ctx->binary_log,
+					strerror (errno));
+		}
+	}
+	else if (r == -1) {
+		msg_warn ("cannot read data from task log pipe: %s", strerror (errno));
+	}
+}
+
+static void
+rspamd_log_helper_task_reply_handler (struct rspamd_worker *worker,
+		struct rspamd_srv_reply *rep, gint rep_fd,
+		gpointer ud)
+{
+	struct log_helper_ctx *ctx = ud;
+
+	close (ctx->task_pair[1]);
+	msg_info ("start writing task records to %s", ctx->binary_log);
+	event_set (&ctx->task_ev, ctx->task_pair[0], EV_READ | EV_PERSIST,
+			rspamd_log_helper_task_read, ctx);
+	event_base_set (ctx->ev_base, &ctx->task_ev);
+	event_add (&ctx->task_ev, NULL);
+}
+
+static gboolean
+rspamd_log_helper_open_binary (struct log_helper_ctx *ctx)
+{
+	gssize r = -1;
+
+	ctx->binary_fd = open (ctx->binary_log, O_WRONLY | O_CREAT | O_APPEND,
+			S_IWUSR | S_IRUSR | S_IRGRP);
+
+	if (ctx->binary_fd == -1) {
+		msg_err ("cannot open binary log %s: %s", ctx->binary_log,
+				strerror (errno));
+		return FALSE;
+	}
+
+#ifdef HAVE_SOCK_SEQPACKET
+	r = socketpair (AF_LOCAL, SOCK_SEQPACKET, 0, ctx->task_pair);
+#endif
+	if (r == -1 && socketpair (AF_LOCAL, SOCK_DGRAM, 0, ctx->task_pair) == -1) {
+		msg_err ("cannot create socketpair: %s", strerror (errno));
+		close (ctx->binary_fd);
+		ctx->binary_fd = -1;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_log_helper_reply_handler (struct rspamd_worker *worker,
 		struct rspamd_srv_reply *rep, gint rep_fd,
 		gpointer ud)
 {
 	struct log_helper_ctx *ctx = ud;
+	static struct rspamd_srv_command task_srv_cmd;
 
 	close (ctx->pair[1]);
 	msg_info ("start waiting for log events");
@@ -146,6 +236,15 @@ rspamd_log_helper_reply_handler (struct rspamd_worker *worker,
 			rspamd_log_helper_read, ctx);
 	event_base_set (ctx->ev_base, &ctx->log_ev);
 	event_add (&ctx->log_ev, NULL);
+
+	/* Commands are sent one by one as replies are not matched to requests */
+	if (ctx->binary_log && rspamd_log_helper_open_binary (ctx)) {
+		task_srv_cmd.type = RSPAMD_SRV_LOG_PIPE;
+		task_srv_cmd.cmd.log_pipe.type = RSPAMD_LOG_PIPE_TASK;
+		rspamd_srv_send_command (worker, ctx->ev_base, &task_srv_cmd,
+				ctx->task_pair[1],
+				rspamd_log_helper_task_reply_handler, ctx);
+	}
 }
 
 static void
@@ -179,9 +278,15 @@ start_log_helper (struct rspamd_worker *worker)
 	rspamd_mempool_lock_mutex (worker->srv->start_mtx);
 	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, ctx->pair[1],
 			rspamd_log_helper_reply_handler, ctx);
+
 	rspamd_mempool_unlock_mutex (worker->srv->start_mtx);
 	event_base_loop (ctx->ev_base, 0);
 	close (ctx->pair[0]);
+
+	if (ctx->binary_fd != -1) {
+		close (ctx->task_pair[0]);
+		close (ctx->binary_fd);
+	}
 	rspamd_worker_block_signals ();
 
 	rspamd_log_close (worker->srv->logger);
@@ -0,0 +1,463 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "events.h"
+
+/***
+ * @module rspamd_async
+ * Symbols callbacks are executed in coroutines, so `rspamd_redis.make_request`,
+ * `rspamd_http.request`, `rspamd_tcp.request` and resolver methods called
+ * without `callback` suspend the caller and return the arguments that would
+ * be passed to a callback (without `task`). This module allows to run
+ * several such functions concurrently and to start coroutines for tasks
+ * outside of symbols callbacks. Please note that in plain Lua 5.1 it is not
+ * possible to suspend a coroutine from `pcall`, whilst LuaJIT allows that.
+ * @example
+local rspamd_async = require "rspamd_async"
+local rspamd_redis = require "rspamd_redis"
+
+rspamd_config:register_symbol('REDIS_CHECK', 1.0, function(task)
+  local function get(key)
+    return function()
+      local err, data = rspamd_redis.make_request({
+        task = task,
+        host = '127.0.0.1',
+        cmd = 'GET',
+        args = {key}
+      })
+      if not err then return data end
+    end
+  end
+
+  -- Both requests are sent at the same time
+  local a, b = rspamd_async.join(get('a'), get('b'))
+  if a and b then
+    return true
+  end
+end)
+ */
+
+/***
+ * @function async.run(task, func, ...)
+ * Starts `func` with the specified arguments in a new coroutine for `task`
+ * @param {rspamd_task} task task object
+ * @param {function} func function to run
+ */
+LUA_FUNCTION_DEF (async, run);
+/***
+ * @function async.join(func1, func2, ...)
+ * Runs all functions concurrently, suspends the calling coroutine until all
+ * of them have returned and returns first results of each function. Must be
+ * called from a coroutine, e.g. from a symbol callback
+ * @return {...} first results of the functions in the same order
+ */
+LUA_FUNCTION_DEF (async, join);
+
+static const struct luaL_reg asynclib_f[] = {
+	LUA_INTERFACE_DEF (async, run),
+	LUA_INTERFACE_DEF (async, join),
+	{NULL, NULL}
+};
+
+/* Finished threads are reused for the next calls */
+#define LUA_THREAD_POOL_VAR "lua_thread_pool"
+#define LUA_THREAD_POOL_MAX 128
+
+struct lua_async_join {
+	struct rspamd_lua_thread *parent;
+	gint results_ref;
+	guint nchildren;
+	guint pending;
+	gboolean waiting;
+};
+
+struct lua_async_join_child {
+	struct lua_async_join *join;
+	guint idx;
+};
+
+static struct rspamd_lua_thread *
+lua_thread_new (lua_State *L)
+{
+	struct rspamd_lua_thread *thr;
+
+	thr = g_slice_alloc0 (sizeof (*thr));
+	thr->main = L;
+	thr->L = lua_newthread (L);
+	thr->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	/* Allow to find thread by its state */
+	lua_pushlightuserdata (L, thr->L);
+	lua_pushlightuserdata (L, thr);
+	lua_rawset (L, LUA_REGISTRYINDEX);
+
+	return thr;
+}
+
+static void
+lua_thread_destroy (struct rspamd_lua_thread *thr)
+{
+	lua_pushlightuserdata (thr->main, thr->L);
+	lua_pushnil (thr->main);
+	lua_rawset (thr->main, LUA_REGISTRYINDEX);
+	luaL_unref (thr->main, LUA_REGISTRYINDEX, thr->ref);
+	g_slice_free1 (sizeof (*thr), thr);
+}
+
+static void
+lua_thread_pool_dtor (gpointer p)
+{
+	GQueue *pool = p;
+	struct rspamd_lua_thread *thr;
+
+	/* Lua state is closed at this point, so threads are already collected */
+	while ((thr = g_queue_pop_head (pool)) != NULL) {
+		g_slice_free1 (sizeof (*thr), thr);
+	}
+
+	g_queue_free (pool);
+}
+
+static GQueue *
+lua_thread_get_pool (lua_State *L, struct rspamd_task *task)
+{
+	GQueue *pool;
+
+	if (task->cfg == NULL || task->cfg->lua_state != L) {
+		return NULL;
+	}
+
+	pool = rspamd_mempool_get_variable (task->cfg->cfg_pool,
+			LUA_THREAD_POOL_VAR);
+
+	if (pool == NULL) {
+		pool = g_queue_new ();
+		rspamd_mempool_set_variable (task->cfg->cfg_pool, LUA_THREAD_POOL_VAR,
+				pool, lua_thread_pool_dtor);
+	}
+
+	return pool;
+}
+
+static void
+lua_thread_task_dtor (gpointer p)
+{
+	struct rspamd_lua_thread *thr = p;
+
+	lua_thread_destroy (thr);
+}
+
+static void
+lua_thread_log_error (struct rspamd_lua_thread *thr)
+{
+	struct rspamd_task *task = thr->task;
+	lua_Debug d;
+	GString *tb;
+	gint i = 0;
+
+	tb = g_string_sized_new (100);
+	g_string_append_printf (tb, "%s; trace:", lua_tostring (thr->L, -1));
+
+	while (lua_getstack (thr->L, i++, &d)) {
+		lua_getinfo (thr->L, "nSl", &d);
+		g_string_append_printf (tb, " [%d]:{%s:%d - %s [%s]};",
+				i - 1, d.short_src, d.currentline,
+				(d.name ? d.name : "<unknown>"), d.what);
+	}
+
+	msg_err_task ("call to (%s) failed: %v", thr->name, tb);
+	g_string_free (tb, TRUE);
+}
+
+static void
+lua_thread_run (struct rspamd_lua_thread *thr, gint nargs)
+{
+	struct rspamd_task *task = thr->task;
+	GQueue *pool;
+	gint ret, nresults = 0;
+	gdouble t1 = 0;
+	gint64 m1 = 0, m2;
+
+	if (thr->profile) {
+		t1 = rspamd_get_virtual_ticks ();
+		m1 = lua_gc (thr->main, LUA_GCCOUNT, 0) * 1024LL +
+				lua_gc (thr->main, LUA_GCCOUNTB, 0);
+	}
+
+#if LUA_VERSION_NUM >= 502
+	ret = lua_resume (thr->L, NULL, nargs);
+#else
+	ret = lua_resume (thr->L, nargs);
+#endif
+
+	if (thr->profile) {
+		thr->cpu += rspamd_get_virtual_ticks () - t1;
+		m2 = lua_gc (thr->main, LUA_GCCOUNT, 0) * 1024LL +
+				lua_gc (thr->main, LUA_GCCOUNTB, 0);
+
+		/* Heap could shrink if a collection step has been performed */
+		if (m2 > m1) {
+			thr->mem += m2 - m1;
+		}
+	}
+
+	if (ret == LUA_YIELD) {
+		thr->yields ++;
+
+		if (!thr->yielded) {
+			/* Thread is now owned by the task */
+			thr->yielded = TRUE;
+			rspamd_session_watcher_push_specific (task->s, thr->w);
+			rspamd_mempool_add_destructor (task->task_pool,
+					lua_thread_task_dtor, thr);
+		}
+
+		return;
+	}
+
+	if (ret == 0) {
+		nresults = lua_gettop (thr->L);
+	}
+	else {
+		lua_thread_log_error (thr);
+		lua_settop (thr->L, 0);
+	}
+
+	if (thr->fin) {
+		thr->fin (thr, nresults);
+	}
+
+	lua_settop (thr->L, 0);
+
+	if (thr->yielded) {
+		rspamd_session_watcher_pop (task->s, thr->w);
+
+		return;
+	}
+
+	pool = lua_thread_get_pool (thr->main, task);
+
+	if (ret == 0 && pool != NULL && pool->length < LUA_THREAD_POOL_MAX) {
+		g_queue_push_head (pool, thr);
+	}
+	else {
+		lua_thread_destroy (thr);
+	}
+}
+
+void
+rspamd_lua_thread_call (lua_State *L, struct rspamd_task *task,
+		const gchar *name, gint nargs, gboolean profile,
+		rspamd_lua_thread_fin_t fin, gpointer ud)
+{
+	struct rspamd_lua_thread *thr = NULL;
+	GQueue *pool;
+
+	pool = lua_thread_get_pool (L, task);
+
+	if (pool != NULL) {
+		thr = g_queue_pop_head (pool);
+	}
+
+	if (thr == NULL) {
+		thr = lua_thread_new (L);
+	}
+
+	thr->task = task;
+	thr->name = name;
+	thr->fin = fin;
+	thr->ud = ud;
+	thr->yielded = FALSE;
+	thr->profile = profile;
+	thr->cpu = 0;
+	thr->mem = 0;
+	thr->yields = 0;
+	thr->w = rspamd_session_get_watcher (task->s);
+
+	lua_xmove (L, thr->L, nargs + 1);
+	lua_thread_run (thr, nargs);
+}
+
+struct rspamd_lua_thread *
+rspamd_lua_thread_current (lua_State *L)
+{
+	struct rspamd_lua_thread *thr;
+
+	lua_pushlightuserdata (L, L);
+	lua_rawget (L, LUA_REGISTRYINDEX);
+	thr = lua_touserdata (L, -1);
+	lua_pop (L, 1);
+
+	return thr;
+}
+
+lua_State *
+rspamd_lua_callback_state (lua_State *L)
+{
+	struct rspamd_lua_thread *thr;
+
+	thr = rspamd_lua_thread_current (L);
+
+	return thr ? thr->main : L;
+}
+
+gint
+rspamd_lua_thread_yield (struct rspamd_lua_thread *thr, gint nresults)
+{
+	return lua_yield (thr->L, nresults);
+}
+
+void
+rspamd_lua_thread_resume (struct rspamd_lua_thread *thr, gint nargs)
+{
+	g_assert (thr->yielded);
+
+	lua_thread_run (thr, nargs);
+}
+
+static gint
+lua_async_run (lua_State *L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+	lua_State *main;
+	gint nargs;
+
+	if (task == NULL || lua_type (L, 2) != LUA_TFUNCTION) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	nargs = lua_gettop (L) - 2;
+	main = rspamd_lua_callback_state (L);
+
+	if (main == L) {
+		rspamd_lua_thread_call (L, task, "async", nargs, FALSE, NULL, NULL);
+	}
+	else {
+		/* Function and arguments must be moved to the owner of threads */
+		lua_xmove (L, main, nargs + 1);
+		rspamd_lua_thread_call (main, task, "async", nargs, FALSE, NULL,
+				NULL);
+	}
+
+	return 0;
+}
+
+static void
+lua_async_join_push_results (struct lua_async_join *join, lua_State *L)
+{
+	guint i;
+	gint tbl;
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, join->results_ref);
+	tbl = lua_gettop (L);
+
+	for (i = 1; i <= join->nchildren; i ++) {
+		lua_rawgeti (L, tbl, i);
+	}
+
+	lua_remove (L, tbl);
+	luaL_unref (L, LUA_REGISTRYINDEX, join->results_ref);
+}
+
+static void
+lua_async_join_child_fin (struct rspamd_lua_thread *thr, gint nresults)
+{
+	struct lua_async_join_child *child = thr->ud;
+	struct lua_async_join *join = child->join;
+
+	if (nresults > 0) {
+		lua_rawgeti (thr->main, LUA_REGISTRYINDEX, join->results_ref);
+		lua_pushvalue (thr->L, -nresults);
+		lua_xmove (thr->L, thr->main, 1);
+		lua_rawseti (thr->main, -2, child->idx);
+		lua_pop (thr->main, 1);
+	}
+
+	join->pending --;
+
+	if (join->pending == 0 && join->waiting) {
+		lua_async_join_push_results (join, join->parent->L);
+		rspamd_lua_thread_resume (join->parent, join->nchildren);
+	}
+}
+
+static gint
+lua_async_join (lua_State *L)
+{
+	struct rspamd_lua_thread *thr;
+	struct lua_async_join *join;
+	struct lua_async_join_child *children;
+	gint i, n;
+
+	thr = rspamd_lua_thread_current (L);
+
+	if (thr == NULL) {
+		return luaL_error (L, "join must be called from a coroutine");
+	}
+
+	n = lua_gettop (L);
+
+	for (i = 1; i <= n; i ++) {
+		luaL_checktype (L, i, LUA_TFUNCTION);
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	join = rspamd_mempool_alloc0 (thr->task->task_pool, sizeof (*join));
+	children = rspamd_mempool_alloc (thr->task->task_pool,
+			sizeof (*children) * n);
+	join->parent = thr;
+	join->nchildren = n;
+	join->pending = n;
+	lua_createtable (L, n, 0);
+	join->results_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	for (i = 0; i < n; i ++) {
+		children[i].join = join;
+		children[i].idx = i + 1;
+		lua_pushvalue (L, i + 1);
+		lua_xmove (L, thr->main, 1);
+		rspamd_lua_thread_call (thr->main, thr->task, thr->name, 0, FALSE,
+				lua_async_join_child_fin, &children[i]);
+	}
+
+	if (join->pending == 0) {
+		/* Everything has been done without suspending */
+		lua_async_join_push_results (join, L);
+
+		return n;
+	}
+
+	join->waiting = TRUE;
+
+	return rspamd_lua_thread_yield (thr, 0);
+}
+
+static gint
+lua_load_async (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, asynclib_f);
+
+	return 1;
+}
+
+void
+luaopen_async (lua_State *L)
+{
+	rspamd_lua_add_preload (L, "rspamd_async", lua_load_async);
+}
@@ -16,6 +16,21 @@
 #include "lua_common.h"
 #include "cdb.h"
 
+/***
+ * @module rspamd_cdb
+ * This module provides read only access to constant databases. Databases are
+ * memory mapped and shared by all objects opened for the same file, the file
+ * is checked for modifications periodically and it is replaced atomically when
+ * a new version is successfully opened.
+ * @example
+local rspamd_cdb = require "rspamd_cdb"
+local db = rspamd_cdb.create("cdb:///var/lib/rspamd/reputation.cdb")
+
+local value = db:lookup('key')
+-- Lookup of several keys at once returns a table of found keys and values
+local values = db:lookup({'key1', 'key2'})
+ */
+
 #define CDB_REFRESH_TIME 60
 
 LUA_FUNCTION_DEF (cdb, create);
@@ -35,21 +50,109 @@ static const struct luaL_reg cdblib_f[] = {
 	{NULL, NULL}
 };
 
-static struct cdb *
+struct rspamd_lua_cdb {
+	struct cdb db;
+	gchar *filename; /* Key in lua_cdbs */
+	ino_t ino;
+	off_t size;
+	time_t last_check;
+	ref_entry_t ref;
+};
+
+/* Opened databases indexed by file name */
+static GHashTable *lua_cdbs = NULL;
+
+static struct rspamd_lua_cdb *
 lua_check_cdb (lua_State * L)
 {
 	void *ud = luaL_checkudata (L, 1, "rspamd{cdb}");
 
 	luaL_argcheck (L, ud != NULL, 1, "'cdb' expected");
-	return ud ? *((struct cdb **)ud) : NULL;
+	return ud ? *((struct rspamd_lua_cdb **)ud) : NULL;
 }
 
+static gboolean
+lua_cdb_open (const gchar *filename, struct cdb *db, struct stat *st)
+{
+	gint fd;
+
+	if ((fd = open (filename, O_RDONLY)) == -1) {
+		msg_warn ("cannot open cdb: %s, %s", filename, strerror (errno));
+		return FALSE;
+	}
+
+	memset (db, 0, sizeof (*db));
+
+	if (fstat (fd, st) == -1 || cdb_init (db, fd) == -1) {
+		msg_warn ("cannot open cdb: %s, %s", filename, strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+lua_cdb_dtor (struct rspamd_lua_cdb *lcdb)
+{
+	g_hash_table_remove (lua_cdbs, lcdb->filename);
+	cdb_free (&lcdb->db);
+	(void)close (lcdb->db.cdb_fd);
+	g_free (lcdb->filename);
+	g_slice_free1 (sizeof (*lcdb), lcdb);
+}
+
+/*
+ * Checks whether the database file has been replaced and switches to the new
+ * version, the old one is used until the new one is opened successfully
+ */
+static void
+lua_cdb_maybe_reload (struct rspamd_lua_cdb *lcdb)
+{
+	struct stat st;
+	struct cdb ndb;
+	time_t now;
+
+	now = time (NULL);
+
+	if (now - lcdb->last_check < CDB_REFRESH_TIME) {
+		return;
+	}
+
+	lcdb->last_check = now;
+
+	if (stat (lcdb->filename, &st) == -1) {
+		return;
+	}
+
+	if (st.st_mtime == lcdb->db.mtime && st.st_ino == lcdb->ino &&
+			st.st_size == lcdb->size) {
+		return;
+	}
+
+	if (lua_cdb_open (lcdb->filename, &ndb, &st)) {
+		cdb_free (&lcdb->db);
+		(void)close (lcdb->db.cdb_fd);
+		memcpy (&lcdb->db, &ndb, sizeof (ndb));
+		lcdb->ino = st.st_ino;
+		lcdb->size = st.st_size;
+		msg_info ("cdb %s has been reloaded", lcdb->filename);
+	}
+}
+
+/***
+ * function cdb.create(filename)
+ * Opens constant database, databases opened for the same file are shared
+ * @param {string} filename path to the database optionally starting from `cdb://`
+ * @return {cdb} database object or nil
+ */
 static gint
 lua_cdb_create (lua_State *L)
 {
-	struct cdb *cdb, **pcdb;
+	struct rspamd_lua_cdb *lcdb, **pcdb;
 	const gchar *filename;
-	gint fd;
+	struct stat st;
 
 	filename = luaL_checkstring (L, 1);
 	/* If file begins with cdb://, just skip it */
@@ -57,75 +160,123 @@ lua_cdb_create (lua_State *L)
 		filename += sizeof ("cdb://") - 1;
 	}
 
-	if ((fd = open (filename, O_RDONLY)) == -1) {
-		msg_warn ("cannot open cdb: %s, %s", filename, strerror (errno));
-		lua_pushnil (L);
+	if (lua_cdbs == NULL) {
+		lua_cdbs = g_hash_table_new (g_str_hash, g_str_equal);
+	}
+
+	lcdb = g_hash_table_lookup (lua_cdbs, filename);
+
+	if (lcdb) {
+		REF_RETAIN (lcdb);
 	}
 	else {
-		cdb = g_malloc (sizeof (struct cdb));
-		cdb->filename = g_strdup (filename);
-		cdb->check_timer_ev = NULL;
-		cdb->check_timer_tv = NULL;
-		if (cdb_init (cdb, fd) == -1) {
-			msg_warn ("cannot open cdb: %s, %s", filename, strerror (errno));
+		lcdb = g_slice_alloc0 (sizeof (*lcdb));
+
+		if (!lua_cdb_open (filename, &lcdb->db, &st)) {
+			g_slice_free1 (sizeof (*lcdb), lcdb);
 			lua_pushnil (L);
+
+			return 1;
 		}
-		else {
-			pcdb = lua_newuserdata (L, sizeof (struct cdb *));
-			rspamd_lua_setclass (L, "rspamd{cdb}", -1);
-			*pcdb = cdb;
-		}
+
+		lcdb->filename = g_strdup (filename);
+		lcdb->ino = st.st_ino;
+		lcdb->size = st.st_size;
+		lcdb->last_check = time (NULL);
+		REF_INIT_RETAIN (lcdb, lua_cdb_dtor);
+		g_hash_table_insert (lua_cdbs, lcdb->filename, lcdb);
 	}
 
+	pcdb = lua_newuserdata (L, sizeof (struct rspamd_lua_cdb *));
+	rspamd_lua_setclass (L, "rspamd{cdb}", -1);
+	*pcdb = lcdb;
+
 	return 1;
 }
 
 static gint
 lua_cdb_get_name (lua_State *L)
 {
-	struct cdb *cdb = lua_check_cdb (L);
+	struct rspamd_lua_cdb *lcdb = lua_check_cdb (L);
 
-	if (!cdb) {
+	if (!lcdb) {
 		lua_error (L);
 		return 1;
 	}
-	lua_pushstring (L, cdb->filename);
+	lua_pushstring (L, lcdb->filename);
 	return 1;
 }
 
+/* Pushes value of the key or returns FALSE */
+static gboolean
+lua_cdb_push_value (lua_State *L, struct cdb *db, const gchar *key,
+		gsize keylen)
+{
+	const void *value;
+
+	if (cdb_find (db, key, keylen) > 0) {
+		/* Data is pushed directly from the mapped file */
+		value = cdb_getdata (db);
+
+		if (value) {
+			lua_pushlstring (L, value, cdb_datalen (db));
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/***
+ * @method cdb:lookup(key)
+ * Lookups value(s) in the database
+ * @param {string or table} key a key or an array of keys
+ * @return {string or table} value of the key or nil, for an array of keys a table where found keys are mapped to their values is returned
+ */
 static gint
 lua_cdb_lookup (lua_State *L)
 {
-	struct cdb *cdb = lua_check_cdb (L);
+	struct rspamd_lua_cdb *lcdb = lua_check_cdb (L);
 	const gchar *what;
-	gchar *value;
-	gsize vlen;
-	gint64 vpos;
+	gsize wlen;
+	guint i, n;
 
-	if (!cdb) {
+	if (!lcdb) {
 		lua_error (L);
 		return 1;
 	}
-	/*
-	 * XXX: this code is placed here because event_loop is called inside workers, so start
-	 * monitoring on first check, not on creation
-	 */
-	if (cdb->check_timer_ev == NULL) {
-		cdb_add_timer (cdb, CDB_REFRESH_TIME);
-	}
 
-	what = luaL_checkstring (L, 2);
-	if (cdb_find (cdb, what, strlen (what)) > 0) {
-		/* Extract and push value to lua as string */
-		vpos = cdb_datapos (cdb);
-		vlen = cdb_datalen (cdb);
-		value = g_malloc (vlen);
-		cdb_read (cdb, value, vlen, vpos);
-		lua_pushlstring (L, value, vlen);
-		g_free (value);
+	lua_cdb_maybe_reload (lcdb);
+
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		n = rspamd_lua_table_size (L, 2);
+		lua_createtable (L, 0, n);
+
+		for (i = 1; i <= n; i ++) {
+			lua_rawgeti (L, 2, i);
+
+			if (lua_type (L, -1) == LUA_TSTRING) {
+				what = lua_tolstring (L, -1, &wlen);
+				lua_pushvalue (L, -1);
+
+				if (lua_cdb_push_value (L, &lcdb->db, what, wlen)) {
+					lua_settable (L, -4);
+				}
+				else {
+					lua_pop (L, 1);
+				}
+			}
+
+			lua_pop (L, 1);
+		}
 	}
 	else {
-		lua_pushnil (L);
+		what = luaL_checklstring (L, 2, &wlen);
+
+		if (!lua_cdb_push_value (L, &lcdb->db, what, wlen)) {
+			lua_pushnil (L);
+		}
 	}
 
 	return 1;
@@ -134,13 +285,10 @@ lua_cdb_lookup (lua_State *L)
 static gint
 lua_cdb_destroy (lua_State *L)
 {
-	struct cdb *cdb = lua_check_cdb (L);
+	struct rspamd_lua_cdb *lcdb = lua_check_cdb (L);
 
-	if (cdb) {
-		cdb_free (cdb);
-		(void)close (cdb->cdb_fd);
-		g_free (cdb->filename);
-		g_free (cdb);
+	if (lcdb) {
+		REF_RELEASE (lcdb);
 	}
 
 	return 0;
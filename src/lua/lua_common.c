@@ -202,12 +202,123 @@ rspamd_lua_set_path (lua_State *L, struct rspamd_config *cfg)
 	lua_pop (L, 1);
 }
 
+#ifndef WITH_LUAJIT
+/*
+ * Allocator of lua states: blocks up to LUA_ALLOC_MAX bytes are carved from
+ * slabs allocated from a memory pool and reused via free lists of size
+ * classes, so short lived objects created while scanning tasks are cheap to
+ * allocate and free. Slabs are returned when the state is closed.
+ * LuaJIT on 64 bit platforms does not allow custom allocators.
+ */
+#define LUA_ALLOC_GRAIN 16
+#define LUA_ALLOC_MAX 512
+#define LUA_ALLOC_CLASSES (LUA_ALLOC_MAX / LUA_ALLOC_GRAIN)
+#define LUA_ALLOC_SLAB (64 * 1024)
+#define LUA_ALLOC_CLASS(sz) (((sz) - 1) / LUA_ALLOC_GRAIN)
+
+struct rspamd_lua_allocator {
+	rspamd_mempool_t *pool;
+	gpointer free_lists[LUA_ALLOC_CLASSES];
+};
+
+static gpointer
+rspamd_lua_alloc_small (struct rspamd_lua_allocator *a, guint cl)
+{
+	gpointer p;
+	guchar *slab;
+	gsize sz = (cl + 1) * LUA_ALLOC_GRAIN, i;
+
+	if (a->free_lists[cl] == NULL) {
+		slab = rspamd_mempool_alloc (a->pool, LUA_ALLOC_SLAB);
+
+		for (i = 0; i + sz <= LUA_ALLOC_SLAB; i += sz) {
+			*(gpointer *)(slab + i) = a->free_lists[cl];
+			a->free_lists[cl] = slab + i;
+		}
+	}
+
+	p = a->free_lists[cl];
+	a->free_lists[cl] = *(gpointer *)p;
+
+	return p;
+}
+
+static inline void
+rspamd_lua_free_block (struct rspamd_lua_allocator *a, gpointer p, gsize size)
+{
+	guint cl;
+
+	if (size <= LUA_ALLOC_MAX) {
+		cl = LUA_ALLOC_CLASS (size);
+		*(gpointer *)p = a->free_lists[cl];
+		a->free_lists[cl] = p;
+	}
+	else {
+		free (p);
+	}
+}
+
+static void *
+rspamd_lua_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct rspamd_lua_allocator *a = ud;
+	gpointer n;
+
+	if (nsize == 0) {
+		if (ptr != NULL) {
+			rspamd_lua_free_block (a, ptr, osize);
+		}
+
+		return NULL;
+	}
+
+	if (ptr == NULL) {
+		/* Lua 5.2 passes type of object as `osize` for new blocks */
+		osize = 0;
+	}
+
+	if (nsize <= LUA_ALLOC_MAX) {
+		if (ptr != NULL && osize <= LUA_ALLOC_MAX &&
+				LUA_ALLOC_CLASS (osize) == LUA_ALLOC_CLASS (nsize)) {
+			return ptr;
+		}
+
+		n = rspamd_lua_alloc_small (a, LUA_ALLOC_CLASS (nsize));
+	}
+	else {
+		if (ptr != NULL && osize > LUA_ALLOC_MAX) {
+			return realloc (ptr, nsize);
+		}
+
+		n = malloc (nsize);
+
+		if (n == NULL) {
+			return NULL;
+		}
+	}
+
+	if (ptr != NULL) {
+		memcpy (n, ptr, MIN (osize, nsize));
+		rspamd_lua_free_block (a, ptr, osize);
+	}
+
+	return n;
+}
+#endif
+
 lua_State *
 rspamd_lua_init ()
 {
 	lua_State *L;
+#ifndef WITH_LUAJIT
+	struct rspamd_lua_allocator *a;
 
+	a = g_slice_alloc0 (sizeof (*a));
+	a->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "lua");
+	L = lua_newstate (rspamd_lua_alloc, a);
+#else
 	L = luaL_newstate ();
+#endif
 	luaL_openlibs (L);
 	luaopen_logger (L);
 	luaopen_mempool (L);
@@ -241,12 +352,31 @@ rspamd_lua_init ()
 	luaopen_fann (L);
 	luaopen_sqlite3 (L);
 	luaopen_cryptobox (L);
+	luaopen_shared_cache (L);
+	luaopen_rbl (L);
+	luaopen_ffi (L);
+	luaopen_async (L);
 
 	rspamd_lua_add_preload (L, "ucl", luaopen_ucl);
 
 	return L;
 }
 
+void
+rspamd_lua_close (lua_State *L)
+{
+#ifndef WITH_LUAJIT
+	struct rspamd_lua_allocator *a;
+
+	lua_getallocf (L, (void **)&a);
+	lua_close (L);
+	rspamd_mempool_delete (a->pool);
+	g_slice_free1 (sizeof (*a), a);
+#else
+	lua_close (L);
+#endif
+}
+
 /**
  * Initialize new locked lua_State structure
  */
@@ -271,7 +401,7 @@ rspamd_free_lua_locked (struct lua_locked_state *st)
 {
 	g_assert (st != NULL);
 
-	lua_close (st->L);
+	rspamd_lua_close (st->L);
 
 	rspamd_mutex_free (st->m);
 
@@ -157,6 +157,11 @@ gpointer rspamd_lua_check_class (lua_State *L, gint index, const gchar *name);
  */
 lua_State *rspamd_lua_init (void);
 
+/**
+ * Close lua state created by `rspamd_lua_init`
+ */
+void rspamd_lua_close (lua_State *L);
+
 /**
  * Load and initialize lua plugins
  */
@@ -188,6 +193,13 @@ struct rspamd_lua_ip * lua_check_ip (lua_State * L, gint pos);
 
 struct rspamd_lua_text * lua_check_text (lua_State * L, gint pos);
 
+/**
+ * Returns data of a lua string or `rspamd{text}` without copying
+ * @param len output length of data
+ * @return data or NULL if argument is neither a string nor a text
+ */
+const gchar * lua_check_text_or_string (lua_State * L, gint pos, gsize *len);
+
 /**
  * Push specific header to lua
  */
@@ -255,6 +267,10 @@ void luaopen_html (lua_State * L);
 void luaopen_fann (lua_State *L);
 void luaopen_sqlite3 (lua_State *L);
 void luaopen_cryptobox (lua_State *L);
+void luaopen_shared_cache (lua_State *L);
+void luaopen_rbl (lua_State *L);
+void luaopen_ffi (lua_State *L);
+void luaopen_async (lua_State *L);
 
 void rspamd_lua_call_post_filters (struct rspamd_task *task);
 void rspamd_lua_call_pre_filters (struct rspamd_task *task);
@@ -335,5 +351,74 @@ void lua_push_internet_address_list (lua_State *L, InternetAddressList *addrs);
  * @return
  */
 gboolean lua_push_internet_address (lua_State *L, InternetAddress *ia);
+
+struct rspamd_lua_thread;
+struct rspamd_async_watcher;
+
+/**
+ * Called when a thread has finished, `nresults` values returned by the
+ * function are on the top of `thr->L` (0 on errors)
+ */
+typedef void (*rspamd_lua_thread_fin_t) (struct rspamd_lua_thread *thr,
+		gint nresults);
+
+/**
+ * Coroutine that runs lua code for a task and could be suspended while
+ * asynchronous requests are pending
+ */
+struct rspamd_lua_thread {
+	lua_State *L;                           /**< state of the thread				*/
+	lua_State *main;                        /**< state that owns the thread			*/
+	struct rspamd_task *task;
+	struct rspamd_async_watcher *w;         /**< watcher kept while suspended		*/
+	const gchar *name;                      /**< name used in logs					*/
+	rspamd_lua_thread_fin_t fin;
+	gpointer ud;
+	gint ref;
+	gboolean yielded;
+	/* Resources used by the thread, measured if `profile` is set */
+	gboolean profile;
+	gdouble cpu;                            /**< cpu time in seconds				*/
+	gint64 mem;                             /**< growth of lua heap in bytes		*/
+	guint yields;
+};
+
+/**
+ * Calls function with `nargs` arguments from the top of `L` in a thread. The
+ * function and arguments are popped from `L`.
+ * @param L state that owns the thread
+ * @param task task for which the function is called
+ * @param name name used in logs
+ * @param nargs number of arguments
+ * @param profile measure resources used by the thread till `fin` is called
+ * @param fin callback called when the function has returned (may be NULL)
+ * @param ud opaque data for `fin`
+ */
+void rspamd_lua_thread_call (lua_State *L, struct rspamd_task *task,
+		const gchar *name, gint nargs, gboolean profile,
+		rspamd_lua_thread_fin_t fin, gpointer ud);
+
+/**
+ * Returns thread that is running in `L` or NULL if `L` is not a thread
+ * created by `rspamd_lua_thread_call`
+ */
+struct rspamd_lua_thread *rspamd_lua_thread_current (lua_State *L);
+
+/**
+ * Returns state suitable for storing callbacks that are called after the
+ * current function returns, as threads could be finished before
+ */
+lua_State *rspamd_lua_callback_state (lua_State *L);
+
+/**
+ * Suspends thread, must be returned from a lua C function
+ */
+gint rspamd_lua_thread_yield (struct rspamd_lua_thread *thr, gint nresults);
+
+/**
+ * Resumes suspended thread passing `nargs` values from the top of `thr->L` as
+ * the results of the function that has yielded
+ */
+void rspamd_lua_thread_resume (struct rspamd_lua_thread *thr, gint nargs);
 #endif /* WITH_LUA */
 #endif /* RSPAMD_LUA_H */
@@ -19,6 +19,7 @@
 #include "libserver/composites.h"
 #include "lua/lua_map.h"
 #include "utlist.h"
+#include "ottery.h"
 
 /***
  * This module is used to configure rspamd and is normally available as global
@@ -176,6 +177,7 @@ LUA_FUNCTION_DEF (config, get_classifier);
  *     + `nice` if symbol can produce negative score;
  *     + `empty` if symbol can be called for empty messages
  *     + `skip` if symbol should be skipped now
+ *     + `content` if result of symbol depends merely on the message body (allows result caching)
  * - `parent`: id of parent symbol (useful for virtual symbols)
  *
  * @return {number} id of symbol registered
@@ -389,6 +391,24 @@ LUA_FUNCTION_DEF (config, newindex);
  *   + `url`: url regexp
  * - `header`: for header and rawheader regexp means the name of header
  * - `pcre_only`: flag regexp as pcre only regexp
+ * - `group`: symbols group of regexp, regexps of different groups are scanned
+ *   separately, so disabled groups do not cost anything
+ *
+ * Registered regexps are matched by `task:process_regexp` with the results
+ * cached per task, e.g.:
+ * @example
+local re = rspamd_config:register_regexp({
+  re = rspamd_regexp.create_cached('/^\\s*KMail/i'),
+  type = 'header',
+  header = 'User-Agent',
+})
+rspamd_config:register_symbol({
+  name = 'KMAIL_MUA',
+  callback = function(task)
+    return task:process_regexp({re = re}) > 0
+  end
+})
+ * @return {regexp} regexp object to be used with `task:process_regexp` or nil on error
  */
 LUA_FUNCTION_DEF (config, register_regexp);
 
@@ -439,6 +459,15 @@ LUA_FUNCTION_DEF (config, get_symbol_callback);
  */
 LUA_FUNCTION_DEF (config, set_symbol_callback);
 
+/***
+ * @method rspamd_config:register_part_digest(name)
+ * Requests digest of mime parts content, all requested digests of a part are
+ * computed in a single pass when any of them is accessed via `mime_part:get_digest`
+ * @param {string} name digest name: `blake2`, `md5`, `sha1` or `sha256`
+ * @return {boolean} true if digest is known
+ */
+LUA_FUNCTION_DEF (config, register_part_digest);
+
 static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, get_module_opt),
 	LUA_INTERFACE_DEF (config, get_mempool),
@@ -471,6 +500,7 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, get_symbols_count),
 	LUA_INTERFACE_DEF (config, get_symbol_callback),
 	LUA_INTERFACE_DEF (config, set_symbol_callback),
+	LUA_INTERFACE_DEF (config, register_part_digest),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__newindex", lua_config_newindex},
 	{NULL, NULL}
@@ -629,6 +659,7 @@ struct lua_callback_data {
 		gint ref;
 	} callback;
 	gboolean cb_is_ref;
+	gint id;
 };
 
 /*
@@ -823,83 +854,84 @@ lua_config_get_key (lua_State *L)
 }
 
 static void
-lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+lua_metric_symbol_callback_return (struct rspamd_lua_thread *thr, gint nresults)
 {
-	struct lua_callback_data *cd = ud;
-	struct rspamd_task **ptask;
-	gint level = lua_gettop (cd->L), nresults, err_idx;
-	lua_State *L = cd->L;
-	GString *tb;
-
-	lua_pushcfunction (L, &rspamd_lua_traceback);
-	err_idx = lua_gettop (L);
-
-	level ++;
-
-	if (cd->cb_is_ref) {
-		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->callback.ref);
-	}
-	else {
-		lua_getglobal (L, cd->callback.name);
+	struct lua_callback_data *cd = thr->ud;
+	struct rspamd_task *task = thr->task;
+	lua_State *L = thr->L;
+	gint level = lua_gettop (L) - nresults;
+
+	if (thr->profile) {
+		rspamd_symbols_cache_add_lua_profile (task->cfg->cache, cd->id,
+				thr->cpu, thr->mem, thr->yields);
 	}
 
-	ptask = lua_newuserdata (L, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (L, "rspamd{task}", -1);
-	*ptask = task;
+	if (nresults >= 1) {
+		/* Function returned boolean, so maybe we need to insert result? */
+		gint res = 0;
+		GList *opts = NULL;
+		gint i;
+		gdouble flag = 1.0;
 
-	if (lua_pcall (L, 1, LUA_MULTRET, err_idx) != 0) {
-		tb = lua_touserdata (L, -1);
-		msg_err_task ("call to (%s) failed: %v", cd->symbol, tb);
-		g_string_free (tb, TRUE);
-		lua_pop (L, 1);
-	}
-	else {
-		nresults = lua_gettop (L) - level;
+		if (lua_type (L, level + 1) == LUA_TBOOLEAN) {
+			res = lua_toboolean (L, level + 1);
+		}
+		else {
+			res = lua_tonumber (L, level + 1);
+		}
 
-		if (nresults >= 1) {
-			/* Function returned boolean, so maybe we need to insert result? */
-			gint res = 0;
-			GList *opts = NULL;
-			gint i;
-			gdouble flag = 1.0;
+		if (res) {
+			gint first_opt = 2;
 
-			if (lua_type (cd->L, level + 1) == LUA_TBOOLEAN) {
-				res = lua_toboolean (L, level + 1);
+			if (lua_type (L, level + 2) == LUA_TNUMBER) {
+				flag = lua_tonumber (L, level + 2);
+				/* Shift opt index */
+				first_opt = 3;
 			}
 			else {
-				res = lua_tonumber (L, level + 1);
+				flag = res;
 			}
 
-			if (res) {
-				gint first_opt = 2;
+			for (i = lua_gettop (L); i >= level + first_opt; i--) {
+				if (lua_type (L, i) == LUA_TSTRING) {
+					const char *opt = lua_tostring (L, i);
 
-				if (lua_type (L, level + 2) == LUA_TNUMBER) {
-					flag = lua_tonumber (L, level + 2);
-					/* Shift opt index */
-					first_opt = 3;
-				}
-				else {
-					flag = res;
+					opts = g_list_prepend (opts,
+							rspamd_mempool_strdup (task->task_pool,
+									opt));
 				}
+			}
 
-				for (i = lua_gettop (L); i >= level + first_opt; i--) {
-					if (lua_type (L, i) == LUA_TSTRING) {
-						const char *opt = lua_tostring (L, i);
+			rspamd_task_insert_result (task, cd->symbol, flag, opts);
+		}
 
-						opts = g_list_prepend (opts,
-								rspamd_mempool_strdup (task->task_pool,
-										opt));
-					}
-				}
+		lua_pop (L, nresults);
+	}
+}
 
-				rspamd_task_insert_result (task, cd->symbol, flag, opts);
-			}
+static void
+lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_callback_data *cd = ud;
+	lua_State *L = cd->L;
+	gdouble rate = task->cfg->lua_profile_rate;
+	gboolean profile;
 
-			lua_pop (L, nresults);
-		}
+	/* Merely a fraction of calls is profiled to keep overhead low */
+	profile = rate > 0 && (rate >= 1.0 ||
+			ottery_rand_uint32 () < rate * (gdouble)G_MAXUINT32);
+
+	if (cd->cb_is_ref) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->callback.ref);
+	}
+	else {
+		lua_getglobal (L, cd->callback.name);
 	}
 
-	lua_pop (L, 1); /* Error function */
+	rspamd_lua_task_push (L, task);
+	/* Callback could be suspended by asynchronous requests */
+	rspamd_lua_thread_call (L, task, cd->symbol, 1, profile,
+			lua_metric_symbol_callback_return, cd);
 }
 
 static gint
@@ -948,6 +980,7 @@ rspamd_register_symbol_fromlua (lua_State *L,
 			cd,
 			type,
 			parent);
+	cd->id = ret;
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)lua_destroy_cfg_symbol,
 			cd);
@@ -996,6 +1029,9 @@ lua_parse_symbol_flags (const gchar *str)
 		if (strstr (str, "skip") != NULL) {
 			ret |= SYMBOL_TYPE_SKIPPED;
 		}
+		if (strstr (str, "content") != NULL) {
+			ret |= SYMBOL_TYPE_CONTENT;
+		}
 	}
 
 	return ret;
@@ -1662,11 +1698,11 @@ lua_config_register_regexp (lua_State *L)
 	struct rspamd_config *cfg = lua_check_config (L, 1);
 	struct rspamd_lua_regexp *re = NULL;
 	rspamd_regexp_t *cache_re;
-	const gchar *type_str = NULL, *header_str = NULL;
+	const gchar *type_str = NULL, *header_str = NULL, *group = NULL;
 	gsize header_len = 0;
 	GError *err = NULL;
 	enum rspamd_re_type type = RSPAMD_RE_BODY;
-	gboolean pcre_only = FALSE;
+	gboolean pcre_only = FALSE, registered = FALSE;
 	guint old_flags;
 
 	/*
@@ -1680,11 +1716,12 @@ lua_config_register_regexp (lua_State *L)
 	 *   + `url`: url regexp
 	 * - `header`: for header and rawheader regexp means the name of header
 	 * - `pcre_only`: allow merely pcre for this regexp
+	 * - `group`: symbols group of this regexp
 	 */
 	if (cfg != NULL) {
 		if (!rspamd_lua_parse_table_arguments (L, 2, &err,
-				"*re=U{regexp};*type=S;header=S;pcre_only=B",
-				&re, &type_str, &header_str, &pcre_only)) {
+				"*re=U{regexp};*type=S;header=S;pcre_only=B;group=S",
+				&re, &type_str, &header_str, &pcre_only, &group)) {
 			msg_err_config ("cannot get parameters list: %e", err);
 
 			if (err) {
@@ -1713,8 +1750,8 @@ lua_config_register_regexp (lua_State *L)
 					header_len = strlen (header_str) + 1;
 				}
 
-				cache_re = rspamd_re_cache_add (cfg->re_cache, re->re, type,
-						(gpointer) header_str, header_len);
+				cache_re = rspamd_re_cache_add_group (cfg->re_cache, re->re,
+						type, (gpointer) header_str, header_len, group);
 
 				/*
 				 * XXX: here are dragons!
@@ -1732,11 +1769,21 @@ lua_config_register_regexp (lua_State *L)
 					rspamd_regexp_unref (re->re);
 					re->re = rspamd_regexp_ref (cache_re);
 				}
+
+				registered = TRUE;
 			}
 		}
 	}
 
-	return 0;
+	if (registered) {
+		/* Return the passed regexp object to allow registration inline */
+		lua_getfield (L, 2, "re");
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
 }
 
 static gint
@@ -1901,6 +1948,31 @@ lua_config_set_symbol_callback (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_config_register_part_digest (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+	enum rspamd_mime_digest type;
+
+	if (cfg == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	type = rspamd_mime_digest_from_string (name);
+
+	if (type != RSPAMD_MIME_DIGEST_MAX) {
+		cfg->part_digests |= RSPAMD_MIME_DIGEST_FLAG (type);
+		lua_pushboolean (L, TRUE);
+	}
+	else {
+		msg_err_config ("unknown digest type: %s", name);
+		lua_pushboolean (L, FALSE);
+	}
+
+	return 1;
+}
+
 void
 luaopen_config (lua_State * L)
 {
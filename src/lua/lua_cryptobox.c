@@ -625,7 +625,7 @@ lua_cryptobox_hash_create_keyed (lua_State *L)
 /***
  * @method cryptobox_hash:update(data)
  * Updates hash with the specified data (hash should not be finalized using `hex` or `bin` methods)
- * @param {string} data data to hash
+ * @param {string or text} data data to hash
  */
 static gint
 lua_cryptobox_hash_update (lua_State *L)
@@ -634,7 +634,7 @@ lua_cryptobox_hash_update (lua_State *L)
 	const gchar *data;
 	gsize len;
 
-	data = luaL_checklstring (L, 2, &len);
+	data = lua_check_text_or_string (L, 2, &len);
 
 	if (h && data) {
 		rspamd_cryptobox_hash_update (h, data, len);
@@ -710,7 +710,7 @@ lua_cryptobox_hash_gc (lua_State *L)
  * Check memory using specified cryptobox key and signature
  * @param {pubkey} pk public key to verify
  * @param {sig} signature to check
- * @param {string} data data to check signature against
+ * @param {string or text} data data to check signature against
  * @return {boolean} `true` - if string matches cryptobox signature
  */
 static gint
@@ -724,7 +724,7 @@ lua_cryptobox_verify_memory (lua_State *L)
 
 	pk = lua_check_cryptobox_pubkey (L, 1);
 	signature = lua_check_cryptobox_sign (L, 2);
-	data = luaL_checklstring (L, 3, &len);
+	data = lua_check_text_or_string (L, 3, &len);
 
 	if (pk != NULL && signature != NULL && data != NULL) {
 		ret = rspamd_cryptobox_verify (signature->str, data, len,
@@ -794,7 +794,7 @@ lua_cryptobox_verify_file (lua_State *L)
  * @function rspamd_cryptobox.sign_memory(kp, data)
  * Sign data using specified keypair
  * @param {keypair} kp keypair to sign
- * @param {string} data
+ * @param {string or text} data
  * @return {cryptobox_signature} signature object
  */
 static gint
@@ -806,7 +806,7 @@ lua_cryptobox_sign_memory (lua_State *L)
 	rspamd_fstring_t *sig, **psig;
 
 	kp = lua_check_cryptobox_keypair (L, 1);
-	data = luaL_checklstring (L, 2, &len);
+	data = lua_check_text_or_string (L, 2, &len);
 
 	if (!kp || !data) {
 		luaL_error (L, "invalid arguments");
@@ -21,7 +21,10 @@
 /***
  * @module rspamd_resolver
  * This module allows to resolve DNS names from LUA code. All resolving is executed
- * asynchronously. Here is an example of name resolution:
+ * asynchronously. If `callback` is omitted in the table form of arguments with
+ * `task` specified in a coroutine (e.g. in a symbol callback), then the
+ * coroutine is suspended until the reply and `results, err` are returned.
+ * Here is an example of name resolution:
  * @example
 local function symbol_callback(task)
 	local host = 'example.com'
@@ -83,6 +86,7 @@ struct lua_dns_cbdata {
 	const gchar *user_str;
 	struct rspamd_async_watcher *w;
 	struct rspamd_async_session *s;
+	struct rspamd_lua_thread *thread;
 };
 
 static int
@@ -135,76 +139,85 @@ lua_dns_callback (struct rdns_reply *reply, gpointer arg)
 	struct rspamd_dns_resolver **presolver;
 	struct rdns_reply_entry *elt;
 	rspamd_inet_addr_t *addr;
+	lua_State *L = cd->thread ? cd->thread->L : cd->L;
 
-	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
-	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
-	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
+	if (!cd->thread) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->cbref);
+		presolver = lua_newuserdata (L, sizeof (gpointer));
+		rspamd_lua_setclass (L, "rspamd{resolver}", -1);
 
-	*presolver = cd->resolver;
-	lua_pushstring (cd->L, cd->to_resolve);
+		*presolver = cd->resolver;
+		lua_pushstring (L, cd->to_resolve);
+	}
 
 	/*
 	 * XXX: rework to handle different request types
 	 */
 	if (reply->code == RDNS_RC_NOERROR) {
-		lua_newtable (cd->L);
+		lua_newtable (L);
 		LL_FOREACH (reply->entries, elt)
 		{
 			switch (elt->type) {
 			case RDNS_REQUEST_A:
 				addr = rspamd_inet_address_new (AF_INET, &elt->content.a.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_AAAA:
 				addr = rspamd_inet_address_new (AF_INET6, &elt->content.aaa.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_PTR:
-				lua_pushstring (cd->L, elt->content.ptr.name);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.ptr.name);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_TXT:
 			case RDNS_REQUEST_SPF:
-				lua_pushstring (cd->L, elt->content.txt.data);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.txt.data);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_MX:
 				/* mx['name'], mx['priority'] */
-				lua_newtable (cd->L);
-				rspamd_lua_table_set (cd->L, "name", elt->content.mx.name);
-				lua_pushstring (cd->L, "priority");
-				lua_pushnumber (cd->L, elt->content.mx.priority);
-				lua_settable (cd->L, -3);
+				lua_newtable (L);
+				rspamd_lua_table_set (L, "name", elt->content.mx.name);
+				lua_pushstring (L, "priority");
+				lua_pushnumber (L, elt->content.mx.priority);
+				lua_settable (L, -3);
 
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			}
 		}
-		lua_pushnil (cd->L);
+		lua_pushnil (L);
 	}
 	else {
-		lua_pushnil (cd->L);
-		lua_pushstring (cd->L, rdns_strerror (reply->code));
+		lua_pushnil (L);
+		lua_pushstring (L, rdns_strerror (reply->code));
 	}
 
-	if (cd->user_str != NULL) {
-		lua_pushstring (cd->L, cd->user_str);
+	if (cd->thread) {
+		/* Suspended caller gets merely results and error */
+		rspamd_lua_thread_resume (cd->thread, 2);
 	}
 	else {
-		lua_pushnil (cd->L);
-	}
+		if (cd->user_str != NULL) {
+			lua_pushstring (L, cd->user_str);
+		}
+		else {
+			lua_pushnil (L);
+		}
 
-	if (lua_pcall (cd->L, 5, 0, 0) != 0) {
-		msg_info ("call to dns callback failed: %s", lua_tostring (cd->L, -1));
-		lua_pop (cd->L, 1);
-	}
+		if (lua_pcall (L, 5, 0, 0) != 0) {
+			msg_info ("call to dns callback failed: %s", lua_tostring (L, -1));
+			lua_pop (L, 1);
+		}
 
-	/* Unref function */
-	luaL_unref (cd->L, LUA_REGISTRYINDEX, cd->cbref);
+		/* Unref function */
+		luaL_unref (L, LUA_REGISTRYINDEX, cd->cbref);
+	}
 
 	if (cd->s) {
 		rspamd_session_watcher_pop (cd->s, cd->w);
@@ -262,6 +275,7 @@ lua_dns_resolver_resolve_common (lua_State *L,
 	struct lua_dns_cbdata *cbdata;
 	gint cbref = -1;
 	struct rspamd_task *task = NULL;
+	struct rspamd_lua_thread *thread = NULL;
 
 	/* Check arguments */
 	if (lua_type (L, first) == LUA_TUSERDATA) {
@@ -292,25 +306,37 @@ lua_dns_resolver_resolve_common (lua_State *L,
 		to_resolve = luaL_checkstring (L, -1);
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "task");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TUSERDATA) {
+			task = lua_check_task (L, -1);
+			session = task->s;
+			pool = task->task_pool;
+		}
+		lua_pop (L, 1);
+
 		lua_pushstring (L, "callback");
 		lua_gettable (L, -2);
 
-		if (to_resolve == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
+		if (lua_type (L, -1) != LUA_TFUNCTION && task != NULL) {
+			/* Suspend the caller if it is possible */
+			thread = rspamd_lua_thread_current (L);
+		}
+
+		if (to_resolve == NULL ||
+				(lua_type (L, -1) != LUA_TFUNCTION && thread == NULL)) {
 			lua_pop (L, 2);
 			msg_err ("DNS request has bad params");
 			lua_pushboolean (L, FALSE);
 			return 1;
 		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 
-		lua_pushstring (L, "task");
-		lua_gettable (L, -2);
-		if (lua_type (L, -1) == LUA_TUSERDATA) {
-			task = lua_check_task (L, -1);
-			session = task->s;
-			pool = task->task_pool;
+		if (thread) {
+			lua_pop (L, 1);
+		}
+		else {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 		}
-		lua_pop (L, 1);
 
 		if (task == NULL) {
 			lua_pushstring (L, "session");
@@ -344,11 +370,13 @@ lua_dns_resolver_resolve_common (lua_State *L,
 		lua_pop (L, 1);
 	}
 
-	if (pool != NULL && session != NULL && to_resolve != NULL && cbref != -1) {
+	if (pool != NULL && session != NULL && to_resolve != NULL &&
+			(cbref != -1 || thread != NULL)) {
 		cbdata = rspamd_mempool_alloc0 (pool, sizeof (struct lua_dns_cbdata));
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_callback_state (L);
 		cbdata->resolver = resolver;
 		cbdata->cbref = cbref;
+		cbdata->thread = thread;
 		cbdata->user_str = rspamd_mempool_strdup (pool, user_str);
 
 		if (type != RDNS_REQUEST_PTR) {
@@ -401,6 +429,18 @@ lua_dns_resolver_resolve_common (lua_State *L,
 				cbdata->s = session;
 				cbdata->w = rspamd_session_get_watcher (session);
 				rspamd_session_watcher_push (session);
+
+				if (thread) {
+					lua_pop (L, 1);
+
+					return rspamd_lua_thread_yield (thread, 0);
+				}
+			}
+			else if (thread) {
+				lua_pushnil (L);
+				lua_pushstring (L, "cannot make DNS request");
+
+				return 2;
 			}
 			else {
 				lua_pushnil (L);
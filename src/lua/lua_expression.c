@@ -15,6 +15,8 @@
  */
 #include "lua_common.h"
 #include "expression.h"
+#include "filter.h"
+#include "libserver/re_cache.h"
 
 /***
  * @module rspamd_expression
@@ -26,7 +28,7 @@
  * @function rspamd_expression.create(line, {parse_func, process_func}, pool)
  * Create expression from the line using atom parsing routines and the specified memory pool
  * @param {string} line expression line
- * @param {table} atom_functions parse_atom function and process_atom function
+ * @param {table|rspamd_expr_atoms} atom_functions parse_atom function and process_atom function or registry of native atoms
  * @param {rspamd_mempool} memory pool to use for this function
  * @return {expr, err} expression object and error message of `expr` is nil
  * @example
@@ -52,6 +54,30 @@ pool:destroy()
  */
 LUA_FUNCTION_DEF (expr, create);
 
+/***
+ * @function rspamd_expression.create_atoms(pool)
+ * Create registry of native atoms. Expressions created with a registry instead
+ * of lua callbacks are processed without calling lua for regexp, symbol and
+ * nested expression atoms, such expressions accept merely tasks as their input
+ * @param {rspamd_mempool} memory pool to use for atoms
+ * @return {rspamd_expr_atoms} new registry
+ * @example
+local rspamd_expression = require "rspamd_expression"
+local rspamd_mempool = require "rspamd_mempool"
+local rspamd_regexp = require "rspamd_regexp"
+
+local pool = rspamd_mempool.create()
+local atoms = rspamd_expression.create_atoms(pool)
+local re = rspamd_regexp.create('/^spam/i')
+
+rspamd_config:register_regexp({re = re, type = 'header', header = 'Subject'})
+atoms:add_regexp('SUBJ_SPAM', {re = re, type = 'header', header = 'Subject'})
+atoms:add_symbol('SPF_FAIL', 'R_SPF_FAIL')
+local expr = rspamd_expression.create('SUBJ_SPAM & SPF_FAIL', atoms, pool)
+-- expr:process(task)
+ */
+LUA_FUNCTION_DEF (expr, create_atoms);
+
 /***
  * @method rspamd_expression:to_string()
  * Converts rspamd expression to string
@@ -93,6 +119,57 @@ static const struct luaL_reg exprlib_m[] = {
 
 static const struct luaL_reg exprlib_f[] = {
 	LUA_INTERFACE_DEF (expr, create),
+	LUA_INTERFACE_DEF (expr, create_atoms),
+	{NULL, NULL}
+};
+
+/***
+ * @method rspamd_expr_atoms:add_regexp(name, params)
+ * Registers atom that is matched by the regexp cache. Parameters are:
+ *
+ * - `re`*: regular expression registered in the cache
+ * - `type`*: type of the regular expression (`header`, `mime`, `sabody` etc)
+ * - `header`: header name for header regexps
+ * - `strong`: case sensitive match of header name
+ * - `not`: invert the result
+ * @param {string} name name of atom
+ * @param {table} params regexp parameters
+ */
+LUA_FUNCTION_DEF (expr_atoms, add_regexp);
+
+/***
+ * @method rspamd_expr_atoms:add_symbol(name[, symbol])
+ * Registers atom that is true when the task has the specified symbol
+ * @param {string} name name of atom
+ * @param {string} symbol name of symbol (`name` by default)
+ */
+LUA_FUNCTION_DEF (expr_atoms, add_symbol);
+
+/***
+ * @method rspamd_expr_atoms:add_expression(name, expr)
+ * Registers atom that evaluates nested expression. Its positive result is
+ * inserted as symbol `name` with matched atoms as options, so each nested
+ * expression is evaluated at most once per task
+ * @param {string} name name of atom and symbol
+ * @param {rspamd_expression} expr expression created with the same registry
+ */
+LUA_FUNCTION_DEF (expr_atoms, add_expression);
+
+/***
+ * @method rspamd_expr_atoms:add_function(name, func)
+ * Registers atom that calls lua function with task as its argument, the
+ * function should return a number
+ * @param {string} name name of atom
+ * @param {function} func callback
+ */
+LUA_FUNCTION_DEF (expr_atoms, add_function);
+
+static const struct luaL_reg expr_atomslib_m[] = {
+	LUA_INTERFACE_DEF (expr_atoms, add_regexp),
+	LUA_INTERFACE_DEF (expr_atoms, add_symbol),
+	LUA_INTERFACE_DEF (expr_atoms, add_expression),
+	LUA_INTERFACE_DEF (expr_atoms, add_function),
+	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
 
@@ -107,12 +184,66 @@ static const struct rspamd_atom_subr lua_atom_subr = {
 	.destroy = NULL
 };
 
+static rspamd_expression_atom_t * lua_native_atom_parse (const gchar *line,
+		gsize len, rspamd_mempool_t *pool, gpointer ud, GError **err);
+static gint lua_native_atom_process (gpointer input,
+		rspamd_expression_atom_t *atom);
+static gint lua_native_atom_priority (rspamd_expression_atom_t *atom);
+
+static const struct rspamd_atom_subr lua_native_atom_subr = {
+	.parse = lua_native_atom_parse,
+	.process = lua_native_atom_process,
+	.priority = lua_native_atom_priority,
+	.destroy = NULL
+};
+
+enum lua_native_atom_type {
+	LUA_NATIVE_ATOM_REGEXP = 0,
+	LUA_NATIVE_ATOM_SYMBOL,
+	LUA_NATIVE_ATOM_EXPRESSION,
+	LUA_NATIVE_ATOM_FUNCTION,
+};
+
+struct lua_expression;
+
+struct lua_native_atom {
+	enum lua_native_atom_type type;
+	const gchar *name;
+	union {
+		struct {
+			rspamd_regexp_t *re;
+			enum rspamd_re_type type;
+			const gchar *header;
+			gsize header_len;
+			gboolean strong;
+			gboolean negate;
+		} re;
+		const gchar *symbol;
+		struct lua_expression *expr;
+		gint cbref;
+	} d;
+};
+
+struct lua_expr_atoms {
+	/* Atom name -> struct lua_native_atom */
+	GHashTable *atoms;
+	rspamd_mempool_t *pool;
+	lua_State *L;
+};
+
+/* Atom of expression, resolved on the first call */
+struct lua_native_atom_ref {
+	struct lua_expr_atoms *registry;
+	struct lua_native_atom *atom;
+};
+
 struct lua_expression {
 	struct rspamd_expression *expr;
 	gint parse_idx;
 	gint process_idx;
 	lua_State *L;
 	rspamd_mempool_t *pool;
+	struct lua_expr_atoms *atoms;
 };
 
 static GQuark
@@ -187,10 +318,221 @@ lua_atom_process (gpointer input, rspamd_expression_atom_t *atom)
 	return ret;
 }
 
+static struct lua_expr_atoms *
+lua_check_expr_atoms (lua_State * L, gint pos)
+{
+	void *ud = luaL_checkudata (L, pos, "rspamd{expr_atoms}");
+	luaL_argcheck (L, ud != NULL, pos, "'expr_atoms' expected");
+	return ud ? *((struct lua_expr_atoms **)ud) : NULL;
+}
+
+/* The same delimiters as SA meta rules use */
+static const gchar native_atom_delimiters[] = ", \t()><+!|&\n";
+
+static rspamd_expression_atom_t *
+lua_native_atom_parse (const gchar *line, gsize len,
+		rspamd_mempool_t *pool, gpointer ud, GError **err)
+{
+	struct lua_expression *e = (struct lua_expression *)ud;
+	struct lua_native_atom_ref *ref;
+	rspamd_expression_atom_t *atom;
+	gsize rlen;
+
+	rlen = rspamd_memcspn (line, len, native_atom_delimiters,
+			sizeof (native_atom_delimiters) - 1);
+
+	if (rlen == 0) {
+		g_set_error (err, lua_expr_quark(), 500, "cannot parse native atom");
+		return NULL;
+	}
+
+	ref = rspamd_mempool_alloc0 (e->pool, sizeof (*ref));
+	ref->registry = e->atoms;
+
+	atom = rspamd_mempool_alloc0 (e->pool, sizeof (*atom));
+	atom->str = rspamd_mempool_alloc (e->pool, rlen + 1);
+	rspamd_strlcpy ((gchar *)atom->str, line, rlen + 1);
+	atom->len = rlen;
+	atom->data = ref;
+
+	return atom;
+}
+
+static struct lua_native_atom *
+lua_native_atom_resolve (rspamd_expression_atom_t *atom)
+{
+	struct lua_native_atom_ref *ref = atom->data;
+
+	/* Atoms could be registered after expressions that refer to them */
+	if (ref->atom == NULL) {
+		ref->atom = g_hash_table_lookup (ref->registry->atoms, atom->str);
+	}
+
+	return ref->atom;
+}
+
+static gint
+lua_native_atom_priority (rspamd_expression_atom_t *atom)
+{
+	struct lua_native_atom *na = lua_native_atom_resolve (atom);
+	gint ret = 0;
+
+	if (na == NULL) {
+		return 0;
+	}
+
+	/* Cheaper atoms are preferred, the same order as mime expressions use */
+	switch (na->type) {
+	case LUA_NATIVE_ATOM_SYMBOL:
+		ret = 200;
+		break;
+	case LUA_NATIVE_ATOM_FUNCTION:
+		ret = 50;
+		break;
+	case LUA_NATIVE_ATOM_EXPRESSION:
+		ret = 0;
+		break;
+	case LUA_NATIVE_ATOM_REGEXP:
+		switch (na->d.re.type) {
+		case RSPAMD_RE_HEADER:
+		case RSPAMD_RE_RAWHEADER:
+		case RSPAMD_RE_MIMEHEADER:
+			ret = 100;
+			break;
+		case RSPAMD_RE_URL:
+			ret = 90;
+			break;
+		case RSPAMD_RE_MIME:
+		case RSPAMD_RE_RAWMIME:
+			ret = 10;
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		break;
+	}
+
+	return ret;
+}
+
+static gboolean
+lua_native_task_has_symbol (struct rspamd_task *task, const gchar *symbol)
+{
+	struct metric_result *mres;
+
+	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	return mres != NULL &&
+			rspamd_metric_result_find_symbol (mres, symbol) != NULL;
+}
+
+static gint
+lua_native_expression_process (struct lua_native_atom *na,
+		struct rspamd_task *task)
+{
+	rspamd_expression_atom_t *matched;
+	GPtrArray *trace;
+	GList *opts = NULL;
+	gint res;
+	guint i;
+
+	if (lua_native_task_has_symbol (task, na->name)) {
+		return 1;
+	}
+
+	trace = g_ptr_array_sized_new (32);
+	res = rspamd_process_expression_track (na->d.expr->expr, 0, task, trace);
+
+	if (res > 0) {
+		for (i = 0; i < trace->len; i ++) {
+			matched = g_ptr_array_index (trace, i);
+			opts = g_list_prepend (opts, rspamd_mempool_strdup (task->task_pool,
+					matched->str));
+		}
+
+		/* Symbol should be one shot to be evaluated once */
+		rspamd_task_insert_result (task, na->name, res, opts);
+	}
+
+	g_ptr_array_free (trace, TRUE);
+
+	return res;
+}
+
+static gint
+lua_native_atom_process (gpointer input, rspamd_expression_atom_t *atom)
+{
+	struct rspamd_task *task = input;
+	struct lua_native_atom *na;
+	lua_State *L;
+	gint ret = 0;
+
+	na = lua_native_atom_resolve (atom);
+
+	if (na == NULL) {
+		msg_debug_task ("cannot find atom %s", atom->str);
+		return 0;
+	}
+
+	switch (na->type) {
+	case LUA_NATIVE_ATOM_REGEXP:
+		ret = rspamd_re_cache_process (task, task->re_rt, na->d.re.re,
+				na->d.re.type, (gpointer)na->d.re.header, na->d.re.header_len,
+				na->d.re.strong);
+
+		if (na->d.re.negate) {
+			ret = ret ? 0 : 1;
+		}
+		break;
+	case LUA_NATIVE_ATOM_SYMBOL:
+		ret = lua_native_task_has_symbol (task, na->d.symbol) ? 1 : 0;
+		break;
+	case LUA_NATIVE_ATOM_EXPRESSION:
+		ret = lua_native_expression_process (na, task);
+		break;
+	case LUA_NATIVE_ATOM_FUNCTION:
+		L = ((struct lua_native_atom_ref *)atom->data)->registry->L;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, na->d.cbref);
+		rspamd_lua_task_push (L, task);
+
+		if (lua_pcall (L, 1, 1, 0) != 0) {
+			msg_info_task ("callback call failed: %s", lua_tostring (L, -1));
+		}
+		else if (lua_isnumber (L, -1)) {
+			ret = lua_tonumber (L, -1);
+		}
+		else if (lua_isboolean (L, -1)) {
+			ret = lua_toboolean (L, -1);
+		}
+
+		lua_pop (L, 1);
+		break;
+	}
+
+	if (ret > 0) {
+		msg_debug_task ("atom: %s, result: %d", atom->str, ret);
+	}
+
+	return ret;
+}
+
+/* Native expressions accept tasks and lua ones pass the input to callbacks */
+static gpointer
+lua_expr_input (lua_State *L, struct lua_expression *e)
+{
+	if (e->atoms) {
+		return lua_check_task (L, 2);
+	}
+
+	return GINT_TO_POINTER (2);
+}
+
 static gint
 lua_expr_process (lua_State *L)
 {
 	struct lua_expression *e = rspamd_lua_expression (L, 1);
+	gpointer input;
 	gint res;
 	gint flags = 0;
 
@@ -198,7 +540,13 @@ lua_expr_process (lua_State *L)
 		flags = lua_tonumber (L, 3);
 	}
 
-	res = rspamd_process_expression (e->expr, flags, GINT_TO_POINTER (2));
+	input = lua_expr_input (L, e);
+
+	if (input == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	res = rspamd_process_expression (e->expr, flags, input);
 
 	lua_pushnumber (L, res);
 
@@ -214,14 +562,20 @@ lua_expr_process_traced (lua_State *L)
 	guint i;
 	gint flags = 0;
 	GPtrArray *trace;
+	gpointer input;
 
 	if (lua_gettop (L) >= 3) {
 		flags = lua_tonumber (L, 3);
 	}
 
+	input = lua_expr_input (L, e);
+
+	if (input == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
 	trace = g_ptr_array_sized_new (32);
-	res = rspamd_process_expression_track (e->expr, flags, GINT_TO_POINTER (2),
-			trace);
+	res = rspamd_process_expression_track (e->expr, flags, input, trace);
 
 	lua_pushnumber (L, res);
 
@@ -248,9 +602,38 @@ lua_expr_create (lua_State *L)
 	GError *err = NULL;
 	rspamd_mempool_t *pool;
 
+	struct lua_expr_atoms **patoms;
+
 	/* Check sanity of the arguments */
-	if (lua_type (L, 1) != LUA_TSTRING || lua_type (L, 2) != LUA_TTABLE ||
-			rspamd_lua_check_mempool (L, 3) == NULL) {
+	if (lua_type (L, 1) != LUA_TSTRING || rspamd_lua_check_mempool (L, 3) == NULL) {
+		msg_info ("bad arguments to lua_expr_create");
+		lua_pushnil (L);
+		lua_pushstring (L, "bad arguments");
+	}
+	else if ((patoms = rspamd_lua_check_class (L, 2, "rspamd{expr_atoms}")) != NULL) {
+		line = lua_tolstring (L, 1, &len);
+		pool = rspamd_lua_check_mempool (L, 3);
+
+		e = rspamd_mempool_alloc0 (pool, sizeof (*e));
+		e->L = L;
+		e->pool = pool;
+		e->atoms = *patoms;
+
+		if (!rspamd_parse_expression (line, len, &lua_native_atom_subr, e, pool,
+				&err, &e->expr)) {
+			lua_pushnil (L);
+			lua_pushstring (L, err->message);
+			g_error_free (err);
+
+			return 2;
+		}
+
+		pe = lua_newuserdata (L, sizeof (struct lua_expression *));
+		rspamd_lua_setclass (L, "rspamd{expr}", -1);
+		*pe = e;
+		lua_pushnil (L);
+	}
+	else if (lua_type (L, 2) != LUA_TTABLE) {
 		msg_info ("bad arguments to lua_expr_create");
 		lua_pushnil (L);
 		lua_pushstring (L, "bad arguments");
@@ -289,7 +672,7 @@ lua_expr_create (lua_State *L)
 
 		/* Table is still on the top of stack */
 
-		e = rspamd_mempool_alloc (pool, sizeof (*e));
+		e = rspamd_mempool_alloc0 (pool, sizeof (*e));
 		e->L = L;
 		e->pool = pool;
 
@@ -376,6 +759,154 @@ lua_expr_atoms (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_expr_create_atoms (lua_State *L)
+{
+	struct lua_expr_atoms *atoms, **patoms;
+	rspamd_mempool_t *pool = rspamd_lua_check_mempool (L, 1);
+
+	if (pool == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	atoms = rspamd_mempool_alloc0 (pool, sizeof (*atoms));
+	atoms->pool = pool;
+	atoms->L = L;
+	atoms->atoms = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, atoms->atoms);
+
+	patoms = lua_newuserdata (L, sizeof (*patoms));
+	rspamd_lua_setclass (L, "rspamd{expr_atoms}", -1);
+	*patoms = atoms;
+
+	return 1;
+}
+
+static struct lua_native_atom *
+lua_expr_atoms_new_atom (struct lua_expr_atoms *atoms, const gchar *name,
+		enum lua_native_atom_type type)
+{
+	struct lua_native_atom *na;
+
+	na = rspamd_mempool_alloc0 (atoms->pool, sizeof (*na));
+	na->type = type;
+	na->name = rspamd_mempool_strdup (atoms->pool, name);
+	/* Expressions that has already resolved the old atom keep using it */
+	g_hash_table_insert (atoms->atoms, (gpointer)na->name, na);
+
+	return na;
+}
+
+static gint
+lua_expr_atoms_add_regexp (lua_State *L)
+{
+	struct lua_expr_atoms *atoms = lua_check_expr_atoms (L, 1);
+	const gchar *name = luaL_checkstring (L, 2), *type_str = NULL,
+			*header = NULL;
+	struct rspamd_lua_regexp *re = NULL;
+	struct lua_native_atom *na;
+	enum rspamd_re_type type;
+	gboolean strong = FALSE, negate = FALSE;
+	gsize header_len = 0;
+	GError *err = NULL;
+	gint ret;
+
+	if (atoms == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!rspamd_lua_parse_table_arguments (L, 3, &err,
+			"*re=U{regexp};*type=S;header=V;strong=B;not=B",
+			&re, &type_str, &header_len, &header, &strong, &negate)) {
+		ret = luaL_error (L, "invalid table arguments: %s", err->message);
+		g_error_free (err);
+
+		return ret;
+	}
+
+	type = rspamd_re_cache_type_from_string (type_str);
+
+	if (type == RSPAMD_RE_MAX) {
+		return luaL_error (L, "invalid regexp type: %s", type_str);
+	}
+
+	if ((type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER ||
+			type == RSPAMD_RE_MIMEHEADER) && header == NULL) {
+		return luaL_error (L, "header argument is mandatory for header regexps");
+	}
+
+	na = lua_expr_atoms_new_atom (atoms, name, LUA_NATIVE_ATOM_REGEXP);
+	na->d.re.re = rspamd_regexp_ref (re->re);
+	rspamd_mempool_add_destructor (atoms->pool,
+			(rspamd_mempool_destruct_t)rspamd_regexp_unref, na->d.re.re);
+	na->d.re.type = type;
+	na->d.re.strong = strong;
+	na->d.re.negate = negate;
+
+	if (header) {
+		na->d.re.header = rspamd_mempool_alloc (atoms->pool, header_len + 1);
+		rspamd_strlcpy ((gchar *)na->d.re.header, header, header_len + 1);
+		na->d.re.header_len = header_len;
+	}
+
+	return 0;
+}
+
+static gint
+lua_expr_atoms_add_symbol (lua_State *L)
+{
+	struct lua_expr_atoms *atoms = lua_check_expr_atoms (L, 1);
+	const gchar *name = luaL_checkstring (L, 2), *symbol;
+	struct lua_native_atom *na;
+
+	if (atoms == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	symbol = luaL_optstring (L, 3, name);
+	na = lua_expr_atoms_new_atom (atoms, name, LUA_NATIVE_ATOM_SYMBOL);
+	na->d.symbol = rspamd_mempool_strdup (atoms->pool, symbol);
+
+	return 0;
+}
+
+static gint
+lua_expr_atoms_add_expression (lua_State *L)
+{
+	struct lua_expr_atoms *atoms = lua_check_expr_atoms (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct lua_expression *e = rspamd_lua_expression (L, 3);
+	struct lua_native_atom *na;
+
+	if (atoms == NULL || name == NULL || e == NULL || e->atoms != atoms) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	na = lua_expr_atoms_new_atom (atoms, name, LUA_NATIVE_ATOM_EXPRESSION);
+	na->d.expr = e;
+
+	return 0;
+}
+
+static gint
+lua_expr_atoms_add_function (lua_State *L)
+{
+	struct lua_expr_atoms *atoms = lua_check_expr_atoms (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct lua_native_atom *na;
+
+	if (atoms == NULL || name == NULL || lua_type (L, 3) != LUA_TFUNCTION) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	na = lua_expr_atoms_new_atom (atoms, name, LUA_NATIVE_ATOM_FUNCTION);
+	lua_pushvalue (L, 3);
+	na->d.cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return 0;
+}
+
 static gint
 lua_load_expression (lua_State * L)
 {
@@ -401,4 +932,16 @@ luaopen_expression (lua_State * L)
 	rspamd_lua_add_preload (L, "rspamd_expression", lua_load_expression);
 
 	lua_pop (L, 1);                      /* remove metatable from stack */
+
+	luaL_newmetatable (L, "rspamd{expr_atoms}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{expr_atoms}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, expr_atomslib_m);
+	lua_pop (L, 1);                      /* remove metatable from stack */
 }
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "unix-std.h"
 
 #ifdef WITH_FANN
 #include <fann.h>
@@ -345,7 +346,9 @@ lua_fann_get_outputs (lua_State *L)
 
 /***
  * @method rspamd_fann:save(fname)
- * Save fann to file named 'fname'
+ * Save fann to file named 'fname'. ANN is written to a temporary file which
+ * is then renamed to `fname`, so readers always see either previous or new
+ * ANN completely and need no locking
  * @param {string} fname filename to save fann into
  * @return {boolean} true if ann has been saved
  */
@@ -357,13 +360,26 @@ lua_fann_save (lua_State *L)
 #else
 	struct fann *f = rspamd_lua_check_fann (L, 1);
 	const gchar *fname = luaL_checkstring (L, 2);
+	gchar tmpname[PATH_MAX];
 
 	if (f != NULL && fname != NULL) {
-		if (fann_save (f, fname) == 0) {
-			lua_pushboolean (L, true);
+		rspamd_snprintf (tmpname, sizeof (tmpname), "%s.new.%P", fname,
+				getpid ());
+
+		if (fann_save (f, tmpname) == 0) {
+			if (rename (tmpname, fname) == -1) {
+				msg_err ("cannot rename ANN %s to %s: %s", tmpname, fname,
+						strerror (errno));
+				unlink (tmpname);
+				lua_pushboolean (L, false);
+			}
+			else {
+				lua_pushboolean (L, true);
+			}
 		}
 		else {
-			msg_err ("cannot save ANN to %s: %s", fname, strerror (errno));
+			msg_err ("cannot save ANN to %s: %s", tmpname, strerror (errno));
+			unlink (tmpname);
 			lua_pushboolean (L, false);
 		}
 	}
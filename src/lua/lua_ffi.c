@@ -0,0 +1,255 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "lua_ffi.h"
+#include "message.h"
+#include "url.h"
+
+/***
+ * @module rspamd_ffi
+ * This module provides declarations of the C ABI that allows LuaJIT code to
+ * read task headers, urls and words of text parts via `ffi` without lua stack
+ * marshalling, so such reads can be compiled by JIT. All returned data is
+ * owned by the task and must not be used after the task is finished. Values
+ * of `task` objects are pointers to pointers of tasks for `ffi`.
+ * @example
+local rspamd_ffi = require "rspamd_ffi"
+local ffi = require "ffi"
+
+ffi.cdef(rspamd_ffi.cdef)
+
+local function count_words(task)
+  local t = ffi.cast('struct rspamd_task **', task)[0]
+  local nwords = ffi.new('unsigned int[1]')
+  local total = 0
+
+  for i = 0,ffi.C.rspamd_ffi_task_text_parts_count(t) - 1 do
+    local words = ffi.C.rspamd_ffi_text_part_words(t, i, nwords)
+
+    if words ~= nil then
+      total = total + nwords[0]
+    end
+  end
+
+  return total
+end
+ */
+
+/* Must be kept in sync with lua_ffi.h */
+static const gchar rspamd_ffi_cdef[] =
+	"struct rspamd_task;\n"
+	"struct rspamd_ffi_header {\n"
+	"  const char *name;\n"
+	"  const char *value;\n"
+	"  const char *decoded;\n"
+	"  const char *separator;\n"
+	"  int tab_separated;\n"
+	"  int empty_separator;\n"
+	"};\n"
+	"struct rspamd_ffi_url {\n"
+	"  const char *string;\n"
+	"  const char *host;\n"
+	"  const char *user;\n"
+	"  const char *data;\n"
+	"  const char *query;\n"
+	"  const char *tld;\n"
+	"  unsigned int len;\n"
+	"  unsigned int hostlen;\n"
+	"  unsigned int userlen;\n"
+	"  unsigned int datalen;\n"
+	"  unsigned int querylen;\n"
+	"  unsigned int tldlen;\n"
+	"  unsigned int port;\n"
+	"  int protocol;\n"
+	"  unsigned int flags;\n"
+	"};\n"
+	"struct rspamd_ffi_word {\n"
+	"  size_t len;\n"
+	"  const char *begin;\n"
+	"};\n"
+	"unsigned int rspamd_ffi_task_headers (struct rspamd_task *task,\n"
+	"  const char *name, int strong,\n"
+	"  struct rspamd_ffi_header *out, unsigned int max);\n"
+	"unsigned int rspamd_ffi_task_urls (struct rspamd_task *task,\n"
+	"  int need_emails, struct rspamd_ffi_url *out, unsigned int max);\n"
+	"unsigned int rspamd_ffi_task_text_parts_count (struct rspamd_task *task);\n"
+	"const struct rspamd_ffi_word *rspamd_ffi_text_part_words (\n"
+	"  struct rspamd_task *task, unsigned int part, unsigned int *nwords);\n";
+
+/* Words are returned directly from normalized words of text parts */
+G_STATIC_ASSERT (sizeof (struct rspamd_ffi_word) == sizeof (rspamd_ftok_t));
+G_STATIC_ASSERT (G_STRUCT_OFFSET (struct rspamd_ffi_word, begin) ==
+		G_STRUCT_OFFSET (rspamd_ftok_t, begin));
+
+unsigned int
+rspamd_ffi_task_headers (struct rspamd_task *task,
+		const char *name, int strong,
+		struct rspamd_ffi_header *out, unsigned int max)
+{
+	struct raw_header *rh;
+	struct rspamd_ffi_header *fh;
+	unsigned int n = 0;
+
+	if (task == NULL || name == NULL) {
+		return 0;
+	}
+
+	rh = g_hash_table_lookup (task->raw_headers, name);
+
+	while (rh) {
+		if (rh->name == NULL || (strong && strcmp (rh->name, name) != 0)) {
+			rh = rh->next;
+			continue;
+		}
+
+		if (n < max) {
+			fh = &out[n];
+			fh->name = rh->name;
+			fh->value = rh->value;
+			fh->decoded = rh->decoded;
+			fh->separator = rh->separator;
+			fh->tab_separated = rh->tab_separated;
+			fh->empty_separator = rh->empty_separator;
+		}
+
+		n ++;
+		rh = rh->next;
+	}
+
+	return n;
+}
+
+static unsigned int
+rspamd_ffi_fill_urls (GHashTable *tbl, struct rspamd_ffi_url *out,
+		unsigned int n, unsigned int max)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	struct rspamd_ffi_url *fu;
+
+	g_hash_table_iter_init (&it, tbl);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+
+		if (n < max) {
+			fu = &out[n];
+			fu->string = url->string;
+			fu->len = url->urllen;
+			fu->host = url->host;
+			fu->hostlen = url->hostlen;
+			fu->user = url->user;
+			fu->userlen = url->userlen;
+			fu->data = url->data;
+			fu->datalen = url->datalen;
+			fu->query = url->query;
+			fu->querylen = url->querylen;
+			fu->tld = url->tld;
+			fu->tldlen = url->tldlen;
+			fu->port = url->port;
+			fu->protocol = url->protocol;
+			fu->flags = url->flags;
+		}
+
+		n ++;
+	}
+
+	return n;
+}
+
+unsigned int
+rspamd_ffi_task_urls (struct rspamd_task *task, int need_emails,
+		struct rspamd_ffi_url *out, unsigned int max)
+{
+	unsigned int n = 0;
+
+	if (task == NULL) {
+		return 0;
+	}
+
+	n = rspamd_ffi_fill_urls (task->urls, out, n, max);
+
+	if (need_emails) {
+		n = rspamd_ffi_fill_urls (task->emails, out, n, max);
+	}
+
+	return n;
+}
+
+unsigned int
+rspamd_ffi_task_text_parts_count (struct rspamd_task *task)
+{
+	if (task == NULL || task->text_parts == NULL) {
+		return 0;
+	}
+
+	return task->text_parts->len;
+}
+
+const struct rspamd_ffi_word *
+rspamd_ffi_text_part_words (struct rspamd_task *task, unsigned int part,
+		unsigned int *nwords)
+{
+	struct mime_text_part *tp;
+
+	if (nwords) {
+		*nwords = 0;
+	}
+
+	if (part >= rspamd_ffi_task_text_parts_count (task)) {
+		return NULL;
+	}
+
+	tp = g_ptr_array_index (task->text_parts, part);
+
+	if (IS_PART_EMPTY (tp) || tp->normalized_words == NULL ||
+			tp->normalized_words->len == 0) {
+		return NULL;
+	}
+
+	if (nwords) {
+		*nwords = tp->normalized_words->len;
+	}
+
+	return (const struct rspamd_ffi_word *)tp->normalized_words->data;
+}
+
+static gint
+lua_load_ffi (lua_State *L)
+{
+	lua_newtable (L);
+
+	lua_pushstring (L, "cdef");
+	lua_pushlstring (L, rspamd_ffi_cdef, sizeof (rspamd_ffi_cdef) - 1);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "luajit");
+#ifdef WITH_LUAJIT
+	lua_pushboolean (L, TRUE);
+#else
+	lua_pushboolean (L, FALSE);
+#endif
+	lua_settable (L, -3);
+
+	return 1;
+}
+
+void
+luaopen_ffi (lua_State *L)
+{
+	rspamd_lua_add_preload (L, "rspamd_ffi", lua_load_ffi);
+}
@@ -0,0 +1,105 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LUA_LUA_FFI_H_
+#define SRC_LUA_LUA_FFI_H_
+
+#include <stddef.h>
+
+/**
+ * @file lua_ffi.h
+ *
+ * Stable C ABI for reading hot task data from LuaJIT via `ffi.cdef` without
+ * lua stack marshalling. Only plain C types are used here and all returned
+ * pointers are owned by the task, so they are valid until the task is
+ * destroyed. Declarations are duplicated as text in `lua_ffi.c` and both
+ * copies must be kept in sync.
+ */
+
+struct rspamd_task;
+
+struct rspamd_ffi_header {
+	const char *name;
+	const char *value;
+	const char *decoded;
+	const char *separator;
+	int tab_separated;
+	int empty_separator;
+};
+
+struct rspamd_ffi_url {
+	const char *string;
+	const char *host;
+	const char *user;
+	const char *data;
+	const char *query;
+	const char *tld;
+	unsigned int len;
+	unsigned int hostlen;
+	unsigned int userlen;
+	unsigned int datalen;
+	unsigned int querylen;
+	unsigned int tldlen;
+	unsigned int port;
+	int protocol;
+	unsigned int flags;
+};
+
+/* Has the same layout as rspamd_ftok_t */
+struct rspamd_ffi_word {
+	size_t len;
+	const char *begin;
+};
+
+/**
+ * Fill `out` with up to `max` headers named `name`
+ * @param task
+ * @param name header name
+ * @param strong compare names case sensitively
+ * @param out output array (may be NULL if max is 0)
+ * @param max size of `out`
+ * @return total number of matching headers (may be greater than `max`)
+ */
+unsigned int rspamd_ffi_task_headers (struct rspamd_task *task,
+		const char *name, int strong,
+		struct rspamd_ffi_header *out, unsigned int max);
+
+/**
+ * Fill `out` with up to `max` urls of the task
+ * @param task
+ * @param need_emails include emails as well
+ * @param out output array (may be NULL if max is 0)
+ * @param max size of `out`
+ * @return total number of urls (may be greater than `max`)
+ */
+unsigned int rspamd_ffi_task_urls (struct rspamd_task *task, int need_emails,
+		struct rspamd_ffi_url *out, unsigned int max);
+
+/**
+ * Returns number of text parts of the task
+ */
+unsigned int rspamd_ffi_task_text_parts_count (struct rspamd_task *task);
+
+/**
+ * Returns normalized words of a text part without copying
+ * @param task
+ * @param part index of text part
+ * @param nwords output number of words
+ * @return array of words or NULL if a part has no words
+ */
+const struct rspamd_ffi_word *rspamd_ffi_text_part_words (
+		struct rspamd_task *task, unsigned int part, unsigned int *nwords);
+
+#endif /* SRC_LUA_LUA_FFI_H_ */
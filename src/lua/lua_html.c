@@ -66,6 +66,7 @@ LUA_FUNCTION_DEF (html, has_tag);
  * - `unknown_element` - part has some unknown elements
  * - `duplicate_element` - part has some duplicate elements that should be unique (namely, `title` tag)
  * - `unbalanced` - part has unbalanced tags
+ * - `too_many_tags` - parsing has been stopped after `max_html_tags` tags
  * @param {string} name name of property
  * @return {boolean} true if the part has the specified property
  */
@@ -95,11 +96,23 @@ LUA_FUNCTION_DEF (html, get_images);
  */
 LUA_FUNCTION_DEF (html, get_blocks);
 
+/***
+ * @method html:get_anchors()
+ * Returns a table of anchors whose displayed text is an URL. Each element
+ * provides the following data:
+ *
+ * `href` - URL from the `href` attribute
+ * `text` - URL found in the displayed text
+ * @return {table} table of anchors in html part
+ */
+LUA_FUNCTION_DEF (html, get_anchors);
+
 static const struct luaL_reg htmllib_m[] = {
 	LUA_INTERFACE_DEF (html, has_tag),
 	LUA_INTERFACE_DEF (html, has_property),
 	LUA_INTERFACE_DEF (html, get_images),
 	LUA_INTERFACE_DEF (html, get_blocks),
+	LUA_INTERFACE_DEF (html, get_anchors),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -180,6 +193,7 @@ lua_html_has_property (lua_State *L)
 		 * - `unknown_element`
 		 * - `duplicate_element`
 		 * - `unbalanced`
+		 * - `too_many_tags`
 		 */
 		if (strcmp (propname, "no_html") == 0) {
 			ret = hc->flags & RSPAMD_HTML_FLAG_BAD_START;
@@ -199,6 +213,9 @@ lua_html_has_property (lua_State *L)
 		else if (strcmp (propname, "unbalanced") == 0) {
 			ret = hc->flags & RSPAMD_HTML_FLAG_UNBALANCED;
 		}
+		else if (strcmp (propname, "too_many_tags") == 0) {
+			ret = hc->flags & RSPAMD_HTML_FLAG_TOO_MANY_TAGS;
+		}
 	}
 
 	lua_pushboolean (L, ret);
@@ -336,6 +353,49 @@ lua_html_get_blocks (lua_State *L)
 	return 1;
 }
 
+static void
+lua_html_push_url (lua_State *L, struct rspamd_url *url)
+{
+	struct rspamd_url **purl;
+
+	purl = lua_newuserdata (L, sizeof (gpointer));
+	*purl = url;
+	rspamd_lua_setclass (L, "rspamd{url}", -1);
+}
+
+static gint
+lua_html_get_anchors (lua_State *L)
+{
+	struct html_content *hc = lua_check_html (L, 1);
+	struct html_anchor *anchor;
+	guint i;
+
+	if (hc != NULL) {
+		lua_createtable (L, hc->anchors ? hc->anchors->len : 0, 0);
+
+		if (hc->anchors) {
+			for (i = 0; i < hc->anchors->len; i ++) {
+				anchor = &g_array_index (hc->anchors, struct html_anchor, i);
+
+				lua_createtable (L, 0, 2);
+				lua_pushstring (L, "href");
+				lua_html_push_url (L, anchor->href);
+				lua_settable (L, -3);
+				lua_pushstring (L, "text");
+				lua_html_push_url (L, anchor->text);
+				lua_settable (L, -3);
+
+				lua_rawseti (L, -2, i + 1);
+			}
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_html_tag_get_type (lua_State *L)
 {
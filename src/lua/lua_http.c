@@ -64,8 +64,11 @@ struct lua_http_cbdata {
 	struct timeval tv;
 	rspamd_inet_addr_t *addr;
 	gchar *mime_type;
+	gboolean keepalive;
+	gboolean reused;
 	gint fd;
 	gint cbref;
+	struct rspamd_lua_thread *thread;
 };
 
 static const int default_http_timeout = 5000;
@@ -89,11 +92,19 @@ lua_http_fin (gpointer arg)
 
 	luaL_unref (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	if (cbd->conn) {
+		if (cbd->fd != -1) {
+			/* Socket is either kept for the next request or closed */
+			rspamd_http_keepalive_release (cbd->conn, cbd->addr, NULL,
+					cbd->ev_base);
+			cbd->fd = -1;
+		}
+
 		/* Here we already have a connection, so we need to unref it */
 		rspamd_http_connection_unref (cbd->conn);
 	}
-	else if (cbd->msg != NULL) {
-		/* We need to free message */
+
+	if (cbd->msg != NULL) {
+		/* We need to free message (or its copy kept to repeat request) */
 		rspamd_http_message_free (cbd->msg);
 	}
 
@@ -127,6 +138,13 @@ lua_http_maybe_free (struct lua_http_cbdata *cbd)
 static void
 lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 {
+	if (cbd->thread) {
+		lua_pushstring (cbd->thread->L, err);
+		rspamd_lua_thread_resume (cbd->thread, 1);
+
+		return;
+	}
+
 	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	lua_pushstring (cbd->L, err);
 
@@ -136,11 +154,35 @@ lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 	}
 }
 
+static gboolean lua_http_make_connection (struct lua_http_cbdata *cbd,
+		gboolean fresh);
+
 static void
 lua_http_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
 
+	if (cbd->reused && cbd->msg != NULL &&
+			rspamd_http_keepalive_stale (conn, err)) {
+		/* Peer has closed an idle socket, so repeat request over a new one */
+		msg_debug ("keep-alive connection to %V is closed, retry request: %e",
+				cbd->msg->host, err);
+		rspamd_http_keepalive_release (cbd->conn, cbd->addr, NULL,
+				cbd->ev_base);
+		cbd->fd = -1;
+		rspamd_http_connection_unref (cbd->conn);
+		cbd->conn = NULL;
+
+		if (lua_http_make_connection (cbd, TRUE)) {
+			return;
+		}
+
+		lua_http_push_error (cbd, "unable to make connection to the host");
+		lua_http_maybe_free (cbd);
+
+		return;
+	}
+
 	lua_http_push_error (cbd, err->message);
 	lua_http_maybe_free (cbd);
 }
@@ -151,24 +193,31 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
 	struct rspamd_http_header *h;
+	lua_State *L = cbd->thread ? cbd->thread->L : cbd->L;
 
-	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
+	if (!cbd->thread) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	}
 	/* Error */
-	lua_pushnil (cbd->L);
+	lua_pushnil (L);
 	/* Reply code */
-	lua_pushinteger (cbd->L, msg->code);
+	lua_pushinteger (L, msg->code);
 	/* Body */
-	lua_pushlstring (cbd->L, msg->body->str, msg->body->len);
+	lua_pushlstring (L, msg->body->str, msg->body->len);
 	/* Headers */
-	lua_newtable (cbd->L);
+	lua_newtable (L);
 	LL_FOREACH (msg->headers, h) {
-		lua_pushlstring (cbd->L, h->name->begin, h->name->len);
-		lua_pushlstring (cbd->L, h->value->begin, h->value->len);
-		lua_settable (cbd->L, -3);
+		lua_pushlstring (L, h->name->begin, h->name->len);
+		lua_pushlstring (L, h->value->begin, h->value->len);
+		lua_settable (L, -3);
 	}
-	if (lua_pcall (cbd->L, 4, 0, 0) != 0) {
-		msg_info ("callback call failed: %s", lua_tostring (cbd->L, -1));
-		lua_pop (cbd->L, 1);
+
+	if (cbd->thread) {
+		rspamd_lua_thread_resume (cbd->thread, 4);
+	}
+	else if (lua_pcall (L, 4, 0, 0) != 0) {
+		msg_info ("callback call failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
 	}
 
 	lua_http_maybe_free (cbd);
@@ -177,12 +226,20 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 }
 
 static gboolean
-lua_http_make_connection (struct lua_http_cbdata *cbd)
+lua_http_make_connection (struct lua_http_cbdata *cbd, gboolean fresh)
 {
+	struct rspamd_http_message *msg;
 	int fd;
 
 	rspamd_inet_address_set_port (cbd->addr, cbd->msg->port);
-	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+
+	if (cbd->keepalive && !fresh) {
+		fd = rspamd_http_keepalive_connect (cbd->addr, NULL, &cbd->reused);
+	}
+	else {
+		fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+		cbd->reused = FALSE;
+	}
 
 	if (fd == -1) {
 		msg_info ("cannot connect to %V", cbd->msg->host);
@@ -190,13 +247,23 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 	}
 	cbd->fd = fd;
 	cbd->conn = rspamd_http_connection_new (NULL, lua_http_error_handler,
-			lua_http_finish_handler, RSPAMD_HTTP_CLIENT_SIMPLE,
+			lua_http_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE |
+			(cbd->keepalive ? RSPAMD_HTTP_CLIENT_KEEP_ALIVE : 0),
 			RSPAMD_HTTP_CLIENT, NULL);
 
-	rspamd_http_connection_write_message (cbd->conn, cbd->msg,
+	if (cbd->reused) {
+		/* Idle socket could be already closed, so keep request to repeat it */
+		msg = rspamd_http_message_copy (cbd->msg);
+	}
+	else {
+		/* Message is now owned by a connection object */
+		msg = cbd->msg;
+		cbd->msg = NULL;
+	}
+
+	rspamd_http_connection_write_message (cbd->conn, msg,
 			NULL, cbd->mime_type, cbd, fd, &cbd->tv, cbd->ev_base);
-	/* Message is now owned by a connection object */
-	cbd->msg = NULL;
 
 	return TRUE;
 }
@@ -220,7 +287,7 @@ lua_http_dns_handler (struct rdns_reply *reply, gpointer ud)
 					&reply->entries->content.aaa.addr);
 		}
 
-		if (!lua_http_make_connection (cbd)) {
+		if (!lua_http_make_connection (cbd, FALSE)) {
 			lua_http_push_error (cbd, "unable to make connection to the host");
 			lua_http_maybe_free (cbd);
 		}
@@ -246,6 +313,18 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
 	}
 }
 
+/* Suspended callers expect an error instead of boolean */
+static void
+lua_http_push_failure (lua_State *L, struct rspamd_lua_thread *thread)
+{
+	if (thread) {
+		lua_pushstring (L, "cannot make http request");
+	}
+	else {
+		lua_pushboolean (L, FALSE);
+	}
+}
+
 /***
  * @function rspamd_http.request({params...})
  * This function creates HTTP request and accepts several parameters as a table using key=value syntax.
@@ -261,7 +340,10 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {string} mime_type MIME type of the HTTP content (for example, `text/html`)
  * @param {string/text} body full body content, can be opaque `rspamd{text}` to avoid data copying
  * @param {number} timeout floating point request timeout value in seconds (default is 5.0 seconds)
+ * @param {boolean} keepalive reuse idle connections to the same host (default is `false`)
  * @return {boolean} `true` if a request has been successfuly scheduled. If this value is `false` then some error occurred, the callback thus will not be called
+ *
+ * If `callback` is omitted in a coroutine (e.g. in a symbol callback) and `task` is specified, then the coroutine is suspended until the request is finished and `err_message, code, body, headers` are returned instead
  */
 static gint
 lua_http_request (lua_State *L)
@@ -279,6 +361,8 @@ lua_http_request (lua_State *L)
 	struct rspamd_task *task = NULL;
 	gdouble timeout = default_http_timeout;
 	gchar *mime_type = NULL;
+	gboolean keepalive = FALSE;
+	struct rspamd_lua_thread *thread = NULL;
 
 	if (lua_gettop (L) >= 2) {
 		/* url, callback and event_base format */
@@ -320,16 +404,6 @@ lua_http_request (lua_State *L)
 		url = luaL_checkstring (L, -1);
 		lua_pop (L, 1);
 
-		lua_pushstring (L, "callback");
-		lua_gettable (L, -2);
-		if (url == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
-			lua_pop (L, 1);
-			msg_err ("http request has bad params");
-			lua_pushboolean (L, FALSE);
-			return 1;
-		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
-
 		lua_pushstring (L, "task");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TUSERDATA) {
@@ -340,6 +414,27 @@ lua_http_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "callback");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) != LUA_TFUNCTION && task != NULL) {
+			/* Suspend the caller if it is possible */
+			thread = rspamd_lua_thread_current (L);
+		}
+		if (url == NULL ||
+				(lua_type (L, -1) != LUA_TFUNCTION && thread == NULL)) {
+			lua_pop (L, 1);
+			msg_err ("http request has bad params");
+			lua_pushboolean (L, FALSE);
+			return 1;
+		}
+		if (thread) {
+			lua_pop (L, 1);
+			cbref = -1;
+		}
+		else {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+
 		if (task == NULL) {
 			lua_pushstring (L, "ev_base");
 			lua_gettable (L, -2);
@@ -374,7 +469,7 @@ lua_http_request (lua_State *L)
 
 		msg = rspamd_http_message_from_url (url);
 		if (msg == NULL) {
-			lua_pushboolean (L, FALSE);
+			lua_http_push_failure (L, thread);
 			return 1;
 		}
 
@@ -399,6 +494,13 @@ lua_http_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "keepalive");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			keepalive = lua_toboolean (L, -1);
+		}
+		lua_pop (L, 1);
+
 		lua_pushstring (L, "body");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TSTRING) {
@@ -423,11 +525,13 @@ lua_http_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_callback_state (L);
 	cbd->cbref = cbref;
+	cbd->thread = thread;
 	cbd->msg = msg;
 	cbd->ev_base = ev_base;
 	cbd->mime_type = mime_type;
+	cbd->keepalive = keepalive;
 	msec_to_tv (timeout, &cbd->tv);
 	cbd->fd = -1;
 
@@ -443,9 +547,9 @@ lua_http_request (lua_State *L)
 
 	if (rspamd_parse_inet_address (&cbd->addr, msg->host->str, msg->host->len)) {
 		/* Host is numeric IP, no need to resolve */
-		if (!lua_http_make_connection (cbd)) {
+		if (!lua_http_make_connection (cbd, FALSE)) {
 			lua_http_maybe_free (cbd);
-			lua_pushboolean (L, FALSE);
+			lua_http_push_failure (L, thread);
 
 			return 1;
 		}
@@ -459,7 +563,7 @@ lua_http_request (lua_State *L)
 					RDNS_REQUEST_A,
 					to_resolve)) {
 				lua_http_maybe_free (cbd);
-				lua_pushboolean (L, FALSE);
+				lua_http_push_failure (L, thread);
 				g_free (to_resolve);
 
 				return 1;
@@ -473,13 +577,17 @@ lua_http_request (lua_State *L)
 			if (!make_dns_request_task (task, lua_http_dns_handler, cbd,
 					RDNS_REQUEST_A, to_resolve)) {
 				lua_http_maybe_free (cbd);
-				lua_pushboolean (L, FALSE);
+				lua_http_push_failure (L, thread);
 
 				return 1;
 			}
 		}
 	}
 
+	if (thread) {
+		return rspamd_lua_thread_yield (thread, 0);
+	}
+
 	lua_pushboolean (L, TRUE);
 	return 1;
 }
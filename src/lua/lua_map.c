@@ -98,6 +98,74 @@ static const struct luaL_reg maplib_m[] = {
 	{NULL, NULL}
 };
 
+/***
+ * @module rspamd_map_group
+ * Map group allows to match values against many maps at once. Set and hash
+ * maps of a group are merged into a single hash table, so each value is
+ * looked up once for all of them, radix and regexp maps are checked in a
+ * single native loop. Merged table is rebuilt when any of its maps is
+ * reloaded.
+ * @example
+local rspamd_map_group = require "rspamd_map_group"
+local group = rspamd_map_group.create()
+
+group:add(rspamd_config:add_map({url = 'file:///tmp/a', type = 'set'}), 1)
+group:add(rspamd_config:add_map({url = 'file:///tmp/b', type = 'set'}), 2)
+-- Returns {1} if 'example.com' is in map `a` merely
+local ids = group:match({'example.com', 'example.net'})
+ */
+
+/***
+ * @function map_group.create()
+ * Creates new empty group of maps
+ * @return {map_group} new group
+ */
+LUA_FUNCTION_DEF (map_group, create);
+/***
+ * @method map_group:add(map, id)
+ * Adds map to the group
+ * @param {map} map radix, set, hash or regexp map
+ * @param {number} id positive number returned by `match` if a value matches the map
+ * @return {boolean} `true` if map has been added
+ */
+LUA_FUNCTION_DEF (map_group, add);
+/***
+ * @method map_group:match(values)
+ * Matches values against all maps of the group, strings are matched against
+ * set, hash and regexp maps and ip objects are matched against radix maps
+ * @param {table|string|ip} values list of values or a single value
+ * @return {table} sorted list of unique ids of matched maps
+ */
+LUA_FUNCTION_DEF (map_group, match);
+LUA_FUNCTION_DEF (map_group, gc);
+
+static const struct luaL_reg map_grouplib_m[] = {
+	LUA_INTERFACE_DEF (map_group, add),
+	LUA_INTERFACE_DEF (map_group, match),
+	{"__gc", lua_map_group_gc},
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
+static const struct luaL_reg map_grouplib_f[] = {
+	LUA_INTERFACE_DEF (map_group, create),
+	{NULL, NULL}
+};
+
+struct lua_map_group_member {
+	struct rspamd_lua_map *map;
+	guint id;
+	/* Data of set or hash map merged into the group table */
+	gpointer merged_data;
+};
+
+struct lua_map_group {
+	GArray *members;
+	/* Keys (owned by maps) to GArray of ids */
+	GHashTable *merged;
+	guint max_id;
+};
+
 struct lua_map_callback_data {
 	lua_State *L;
 	gint ref;
@@ -609,6 +677,264 @@ lua_map_get_key (lua_State * L)
 	return 1;
 }
 
+static struct lua_map_group *
+lua_check_map_group (lua_State *L, gint pos)
+{
+	void *ud = luaL_checkudata (L, pos, "rspamd{map_group}");
+	luaL_argcheck (L, ud != NULL, pos, "'map_group' expected");
+	return ud ? *((struct lua_map_group **)ud) : NULL;
+}
+
+static void
+lua_map_group_ids_free (gpointer p)
+{
+	g_array_free (p, TRUE);
+}
+
+static gint
+lua_map_group_create (lua_State *L)
+{
+	struct lua_map_group *group, **pgroup;
+
+	group = g_slice_alloc0 (sizeof (*group));
+	group->members = g_array_new (FALSE, FALSE,
+			sizeof (struct lua_map_group_member));
+	pgroup = lua_newuserdata (L, sizeof (*pgroup));
+	*pgroup = group;
+	rspamd_lua_setclass (L, "rspamd{map_group}", -1);
+
+	return 1;
+}
+
+static gint
+lua_map_group_gc (lua_State *L)
+{
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+
+	if (group) {
+		/* Keys are not touched here, so they could be freed already */
+		if (group->merged) {
+			g_hash_table_destroy (group->merged);
+		}
+
+		g_array_free (group->members, TRUE);
+		g_slice_free1 (sizeof (*group), group);
+	}
+
+	return 0;
+}
+
+static gint
+lua_map_group_add (lua_State *L)
+{
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+	struct rspamd_lua_map *map = lua_check_map (L, 2);
+	struct lua_map_group_member m;
+	gint id = luaL_checknumber (L, 3);
+
+	if (group == NULL || map == NULL || id <= 0) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (map->type == RSPAMD_LUA_MAP_CALLBACK) {
+		lua_pushboolean (L, FALSE);
+
+		return 1;
+	}
+
+	memset (&m, 0, sizeof (m));
+	m.map = map;
+	m.id = id;
+	g_array_append_val (group->members, m);
+	group->max_id = MAX (group->max_id, (guint)id);
+
+	/* Merged table is rebuilt on the next match */
+	if (group->merged) {
+		g_hash_table_destroy (group->merged);
+		group->merged = NULL;
+	}
+
+	lua_pushboolean (L, TRUE);
+
+	return 1;
+}
+
+static inline gboolean
+lua_map_group_is_merged (struct rspamd_lua_map *map)
+{
+	return map->type == RSPAMD_LUA_MAP_SET || map->type == RSPAMD_LUA_MAP_HASH;
+}
+
+/* Rebuilds merged table if it is absent or any of its maps is reloaded */
+static void
+lua_map_group_refresh (struct lua_map_group *group)
+{
+	struct lua_map_group_member *m;
+	GHashTableIter it;
+	GArray *ids;
+	gpointer k, v;
+	gboolean stale = group->merged == NULL;
+	guint i;
+
+	for (i = 0; i < group->members->len && !stale; i ++) {
+		m = &g_array_index (group->members, struct lua_map_group_member, i);
+
+		if (lua_map_group_is_merged (m->map) &&
+				m->merged_data != m->map->data.hash) {
+			stale = TRUE;
+		}
+	}
+
+	if (!stale) {
+		return;
+	}
+
+	if (group->merged) {
+		g_hash_table_destroy (group->merged);
+	}
+
+	group->merged = g_hash_table_new_full (rspamd_strcase_hash,
+			rspamd_strcase_equal, NULL, lua_map_group_ids_free);
+
+	for (i = 0; i < group->members->len; i ++) {
+		m = &g_array_index (group->members, struct lua_map_group_member, i);
+
+		if (!lua_map_group_is_merged (m->map)) {
+			continue;
+		}
+
+		m->merged_data = m->map->data.hash;
+
+		if (m->merged_data == NULL) {
+			continue;
+		}
+
+		g_hash_table_iter_init (&it, m->merged_data);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			ids = g_hash_table_lookup (group->merged, k);
+
+			if (ids == NULL) {
+				ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), 1);
+				g_hash_table_insert (group->merged, k, ids);
+			}
+
+			g_array_append_val (ids, m->id);
+		}
+	}
+}
+
+static void
+lua_map_group_match_value (lua_State *L, gint pos,
+		struct lua_map_group *group, guchar *matched)
+{
+	struct lua_map_group_member *m;
+	struct rspamd_lua_ip *addr = NULL;
+	const gchar *key = NULL;
+	GArray *ids;
+	gsize len;
+	guint i;
+
+	if (lua_type (L, pos) == LUA_TSTRING) {
+		key = lua_tolstring (L, pos, &len);
+	}
+	else if (lua_type (L, pos) == LUA_TUSERDATA) {
+		addr = lua_check_ip (L, pos);
+
+		if (addr == NULL || addr->addr == NULL) {
+			return;
+		}
+	}
+	else {
+		return;
+	}
+
+	if (key) {
+		/* All set and hash maps are checked by a single lookup */
+		ids = g_hash_table_lookup (group->merged, key);
+
+		if (ids) {
+			for (i = 0; i < ids->len; i ++) {
+				matched[g_array_index (ids, guint, i)] = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < group->members->len; i ++) {
+		m = &g_array_index (group->members, struct lua_map_group_member, i);
+
+		if (matched[m->id]) {
+			continue;
+		}
+
+		if (key && m->map->type == RSPAMD_LUA_MAP_REGEXP) {
+			if (len > 0 && rspamd_match_regexp_map (m->map->data.re_map, key, len)) {
+				matched[m->id] = 1;
+			}
+		}
+		else if (addr && m->map->type == RSPAMD_LUA_MAP_RADIX) {
+			if (radix_find_compressed_addr (m->map->data.radix, addr->addr)
+					!= RADIX_NO_VALUE) {
+				matched[m->id] = 1;
+			}
+		}
+	}
+}
+
+static gint
+lua_map_group_match (lua_State *L)
+{
+	struct lua_map_group *group = lua_check_map_group (L, 1);
+	guchar *matched;
+	guint i, n = 0;
+
+	if (group == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_map_group_refresh (group);
+	matched = g_malloc0 (group->max_id + 1);
+
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		for (i = 1; ; i ++) {
+			lua_rawgeti (L, 2, i);
+
+			if (lua_isnil (L, -1)) {
+				lua_pop (L, 1);
+				break;
+			}
+
+			lua_map_group_match_value (L, lua_gettop (L), group, matched);
+			lua_pop (L, 1);
+		}
+	}
+	else {
+		lua_map_group_match_value (L, 2, group, matched);
+	}
+
+	lua_newtable (L);
+
+	for (i = 1; i <= group->max_id; i ++) {
+		if (matched[i]) {
+			lua_pushnumber (L, i);
+			lua_rawseti (L, -2, ++n);
+		}
+	}
+
+	g_free (matched);
+
+	return 1;
+}
+
+static gint
+lua_load_map_group (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, map_grouplib_f);
+
+	return 1;
+}
+
 static int
 lua_map_is_signed (lua_State *L)
 {
@@ -776,4 +1102,10 @@ luaopen_map (lua_State * L)
 	rspamd_lua_new_class (L, "rspamd{map}", maplib_m);
 
 	lua_pop (L, 1);
+
+	rspamd_lua_new_class (L, "rspamd{map_group}", map_grouplib_m);
+
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_map_group", lua_load_map_group);
 }
@@ -15,6 +15,7 @@
  */
 #include "lua_common.h"
 #include "message.h"
+#include "cryptobox.h"
 
 /* Textpart methods */
 /***
@@ -191,6 +192,18 @@ LUA_FUNCTION_DEF (mimepart, get_header_full);
  * @return {text} opaque text object (zero-copy if not casted to lua string)
  */
 LUA_FUNCTION_DEF (mimepart, get_content);
+/***
+ * @method mime_part:get_raw_content()
+ * Get the content of part before decoding of its transfer encoding
+ * @return {text} opaque text object referring to the message or `nil` if content cannot be located
+ */
+LUA_FUNCTION_DEF (mimepart, get_raw_content);
+/***
+ * @method mime_part:get_raw_headers()
+ * Get all headers of part as a single string
+ * @return {text} opaque text object or `nil` if part has no headers
+ */
+LUA_FUNCTION_DEF (mimepart, get_raw_headers);
 /***
  * @method mime_part:get_length()
  * Get length of the content of the part
@@ -209,12 +222,23 @@ LUA_FUNCTION_DEF (mimepart, get_type);
  * @return {string} filename or `nil` if no file is associated with this part
  */
 LUA_FUNCTION_DEF (mimepart, get_filename);
+/***
+ * @method mime_part:get_digest([name])
+ * Get digest of the decoded content of the part, digests registered with
+ * `rspamd_config:register_part_digest` are computed together on the first call
+ * @param {string} name digest name: `blake2` (default), `md5`, `sha1` or `sha256`
+ * @return {string} hex encoded digest
+ */
+LUA_FUNCTION_DEF (mimepart, get_digest);
 
 static const struct luaL_reg mimepartlib_m[] = {
 	LUA_INTERFACE_DEF (mimepart, get_content),
+	LUA_INTERFACE_DEF (mimepart, get_raw_content),
+	LUA_INTERFACE_DEF (mimepart, get_raw_headers),
 	LUA_INTERFACE_DEF (mimepart, get_length),
 	LUA_INTERFACE_DEF (mimepart, get_type),
 	LUA_INTERFACE_DEF (mimepart, get_filename),
+	LUA_INTERFACE_DEF (mimepart, get_digest),
 	LUA_INTERFACE_DEF (mimepart, get_header),
 	LUA_INTERFACE_DEF (mimepart, get_header_raw),
 	LUA_INTERFACE_DEF (mimepart, get_header_full),
@@ -447,16 +471,58 @@ lua_mimepart_get_content (lua_State * L)
 {
 	struct mime_part *part = lua_check_mimepart (L);
 	struct rspamd_lua_text *t;
+	GByteArray *content;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
+	content = rspamd_mime_part_get_content (part);
 	t = lua_newuserdata (L, sizeof (*t));
 	rspamd_lua_setclass (L, "rspamd{text}", -1);
-	t->start = part->content->data;
-	t->len = part->content->len;
+	t->start = content->data;
+	t->len = content->len;
+	t->own = FALSE;
+
+	return 1;
+}
+
+static gint
+lua_mimepart_get_raw_content (lua_State * L)
+{
+	struct mime_part *part = lua_check_mimepart (L);
+	struct rspamd_lua_text *t;
+
+	if (part == NULL || part->raw_data.begin == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->start = part->raw_data.begin;
+	t->len = part->raw_data.len;
+	t->own = FALSE;
+
+	return 1;
+}
+
+static gint
+lua_mimepart_get_raw_headers (lua_State * L)
+{
+	struct mime_part *part = lua_check_mimepart (L);
+	struct rspamd_lua_text *t;
+
+	if (part == NULL || part->raw_headers_str == NULL) {
+		lua_pushnil (L);
+		return 1;
+	}
+
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->start = part->raw_headers_str;
+	t->len = strlen (part->raw_headers_str);
 	t->own = FALSE;
 
 	return 1;
@@ -472,7 +538,7 @@ lua_mimepart_get_length (lua_State * L)
 		return 1;
 	}
 
-	lua_pushinteger (L, part->content->len);
+	lua_pushinteger (L, rspamd_mime_part_get_content (part)->len);
 
 	return 1;
 }
@@ -513,6 +579,34 @@ lua_mimepart_get_filename (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_mimepart_get_digest (lua_State * L)
+{
+	struct mime_part *part = lua_check_mimepart (L);
+	enum rspamd_mime_digest type = RSPAMD_MIME_DIGEST_BLAKE2;
+	const guchar *digest;
+	gchar hexbuf[rspamd_cryptobox_HASHBYTES * 2 + 1];
+	gsize dlen;
+
+	if (part == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TSTRING) {
+		type = rspamd_mime_digest_from_string (lua_tostring (L, 2));
+
+		if (type == RSPAMD_MIME_DIGEST_MAX) {
+			return luaL_error (L, "unknown digest type: %s", lua_tostring (L, 2));
+		}
+	}
+
+	digest = rspamd_mime_part_get_digest (part, type, &dlen);
+	rspamd_encode_hex_buf (digest, dlen, hexbuf, sizeof (hexbuf));
+	lua_pushlstring (L, hexbuf, dlen * 2);
+
+	return 1;
+}
+
 static gint
 lua_mimepart_get_header_common (lua_State *L, gboolean full, gboolean raw)
 {
@@ -0,0 +1,399 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "libserver/rbl.h"
+
+/***
+ * @module rspamd_rbl
+ * This module provides native engine of DNS lists checks. Names for all lists
+ * are built in C, each distinct name is queried merely once per task and
+ * replies are mapped to symbols either by exact return codes or by bits of
+ * the returned address.
+ * @example
+local rspamd_rbl = require "rspamd_rbl"
+local engine = rspamd_rbl.create(rspamd_config, {dkim_symbol = 'R_DKIM_ALLOW'})
+
+engine:add_rule('spamhaus', {
+  rbl = 'zen.spamhaus.org',
+  ipv4 = true,
+  received = true,
+  returncodes = {
+    RBL_SPAMHAUS_SBL = '127.0.0.2',
+    RBL_SPAMHAUS_XBL = {'127.0.0.4', '127.0.0.5'},
+  }
+})
+rspamd_config:register_symbol('RBL_CHECKS', 1.0, function(task)
+  engine:check(task)
+end)
+ */
+
+/* Lua bindings */
+/***
+ * @function rbl.create(cfg, params)
+ * Creates new engine allocated from configuration. The following parameters
+ * are allowed:
+ *
+ * - `exclusions`: radix map of addresses excluded from checks
+ * - `dkim_symbol`: symbol whose options are checked as DKIM domains
+ * @param {rspamd_config} cfg configuration
+ * @param {table} params engine parameters
+ * @return {rspamd_rbl} new engine
+ */
+LUA_FUNCTION_DEF (rbl, create);
+/***
+ * @method rbl:add_rule(name, rule)
+ * Adds new list described by a table in the format of `rbl` module rules
+ * (`rbl`, `symbol`, `returncodes`, `returnbits` and boolean flags). Return
+ * codes could be either dotted addresses or lua patterns that match just one
+ * address, e.g. `127%.0%.0%.2`
+ * @param {string} name name of the list
+ * @param {table} rule rule definition
+ * @return {boolean} `false` if the rule cannot be handled by this engine
+ */
+LUA_FUNCTION_DEF (rbl, add_rule);
+/***
+ * @method rbl:check(task)
+ * Starts checks of all lists for the task
+ * @param {rspamd_task} task task object
+ */
+LUA_FUNCTION_DEF (rbl, check);
+
+static const struct luaL_reg rbllib_m[] = {
+	LUA_INTERFACE_DEF (rbl, add_rule),
+	LUA_INTERFACE_DEF (rbl, check),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
+static const struct luaL_reg rbllib_f[] = {
+	LUA_INTERFACE_DEF (rbl, create),
+	{NULL, NULL}
+};
+
+static const struct {
+	const gchar *name;
+	guint flag;
+} rbl_flags[] = {
+	{"ipv4", RSPAMD_RBL_FLAG_IPV4},
+	{"ipv6", RSPAMD_RBL_FLAG_IPV6},
+	{"received", RSPAMD_RBL_FLAG_RECEIVED},
+	{"from", RSPAMD_RBL_FLAG_FROM},
+	{"rdns", RSPAMD_RBL_FLAG_RDNS},
+	{"helo", RSPAMD_RBL_FLAG_HELO},
+	{"dkim", RSPAMD_RBL_FLAG_DKIM},
+	{"dkim_domainonly", RSPAMD_RBL_FLAG_DKIM_DOMAINONLY},
+	{"emails", RSPAMD_RBL_FLAG_EMAILS},
+	{"exclude_users", RSPAMD_RBL_FLAG_EXCLUDE_USERS},
+	{"exclude_private_ips", RSPAMD_RBL_FLAG_EXCLUDE_PRIVATE},
+	{"exclude_local", RSPAMD_RBL_FLAG_EXCLUDE_LOCAL},
+	{"exclude_local_ips", RSPAMD_RBL_FLAG_EXCLUDE_LOCAL_IPS},
+	{"unknown", RSPAMD_RBL_FLAG_UNKNOWN},
+};
+
+static struct rspamd_rbl_engine *
+lua_check_rbl (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{rbl}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'rbl' expected");
+	return ud ? *((struct rspamd_rbl_engine **)ud) : NULL;
+}
+
+/*
+ * Converts lua pattern of a return code to a dotted address, patterns that
+ * could match more than one address are rejected
+ */
+static gboolean
+lua_rbl_returncode_literal (const gchar *pattern, gchar *out, gsize outlen)
+{
+	const gchar *p = pattern;
+	gchar *d = out, *end = out + outlen - 1;
+
+	while (*p && d < end) {
+		if (*p == '%' && p[1] == '.') {
+			p ++;
+		}
+		else if (!g_ascii_isdigit (*p) && *p != '.') {
+			return FALSE;
+		}
+
+		*d++ = *p++;
+	}
+
+	*d = '\0';
+
+	return *p == '\0';
+}
+
+/* Checks code at the top of the stack */
+static gboolean
+lua_rbl_check_returncode (lua_State *L)
+{
+	struct in_addr ina;
+	gchar buf[INET_ADDRSTRLEN];
+
+	return lua_type (L, -1) == LUA_TSTRING &&
+			lua_rbl_returncode_literal (lua_tostring (L, -1), buf, sizeof (buf)) &&
+			inet_pton (AF_INET, buf, &ina) == 1;
+}
+
+/* Rule table is at index 3 */
+static gboolean
+lua_rbl_check_returncodes (lua_State *L)
+{
+	gboolean ret = TRUE;
+
+	lua_getfield (L, 3, "returncodes");
+
+	if (lua_type (L, -1) == LUA_TTABLE) {
+		lua_pushnil (L);
+
+		while (ret && lua_next (L, -2) != 0) {
+			if (lua_type (L, -2) != LUA_TSTRING) {
+				ret = FALSE;
+			}
+			else if (lua_type (L, -1) == LUA_TTABLE) {
+				lua_pushnil (L);
+
+				while (ret && lua_next (L, -2) != 0) {
+					ret = lua_rbl_check_returncode (L);
+					lua_pop (L, 1);
+				}
+
+				if (!ret) {
+					/* Key of the inner table */
+					lua_pop (L, 1);
+				}
+			}
+			else {
+				ret = lua_rbl_check_returncode (L);
+			}
+
+			lua_pop (L, 1);
+		}
+
+		if (!ret) {
+			/* Key of the outer table */
+			lua_pop (L, 1);
+		}
+	}
+	else if (lua_type (L, -1) != LUA_TNIL) {
+		ret = FALSE;
+	}
+
+	lua_pop (L, 1);
+
+	return ret;
+}
+
+/* Adds code at the top of the stack */
+static void
+lua_rbl_add_returncode (lua_State *L, struct rspamd_rbl_rule *rule,
+		const gchar *symbol)
+{
+	gchar buf[INET_ADDRSTRLEN];
+
+	lua_rbl_returncode_literal (lua_tostring (L, -1), buf, sizeof (buf));
+	rspamd_rbl_rule_add_returncode (rule, symbol, buf);
+}
+
+static gint
+lua_rbl_create (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct rspamd_rbl_engine *engine, **pengine;
+	struct rspamd_lua_map **pmap;
+	radix_compressed_t **exclusions = NULL;
+	const gchar *dkim_symbol = NULL;
+
+	if (cfg == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		lua_getfield (L, 2, "exclusions");
+
+		if ((pmap = rspamd_lua_check_class (L, -1, "rspamd{map}")) != NULL) {
+			if ((*pmap)->type != RSPAMD_LUA_MAP_RADIX) {
+				lua_pop (L, 1);
+
+				return luaL_error (L, "exclusions must be a radix map");
+			}
+
+			exclusions = &(*pmap)->data.radix;
+		}
+
+		lua_pop (L, 1);
+
+		lua_getfield (L, 2, "dkim_symbol");
+
+		if (lua_type (L, -1) == LUA_TSTRING) {
+			dkim_symbol = lua_tostring (L, -1);
+		}
+
+		engine = rspamd_rbl_engine_new (cfg->cfg_pool, exclusions, dkim_symbol);
+		lua_pop (L, 1);
+	}
+	else {
+		engine = rspamd_rbl_engine_new (cfg->cfg_pool, NULL, NULL);
+	}
+
+	pengine = lua_newuserdata (L, sizeof (*pengine));
+	rspamd_lua_setclass (L, "rspamd{rbl}", -1);
+	*pengine = engine;
+
+	return 1;
+}
+
+static gint
+lua_rbl_add_rule (lua_State *L)
+{
+	struct rspamd_rbl_engine *engine = lua_check_rbl (L);
+	struct rspamd_rbl_rule *rule;
+	const gchar *name, *suffix, *symbol = NULL;
+	guint flags = 0, i;
+
+	name = luaL_checkstring (L, 2);
+
+	if (engine == NULL || name == NULL || lua_type (L, 3) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_getfield (L, 3, "rbl");
+	suffix = lua_tostring (L, -1);
+	lua_pop (L, 1);
+
+	if (suffix == NULL || !lua_rbl_check_returncodes (L)) {
+		lua_pushboolean (L, FALSE);
+
+		return 1;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (rbl_flags); i ++) {
+		lua_getfield (L, 3, rbl_flags[i].name);
+
+		if (lua_toboolean (L, -1)) {
+			flags |= rbl_flags[i].flag;
+
+			if (rbl_flags[i].flag == RSPAMD_RBL_FLAG_EMAILS &&
+					lua_type (L, -1) == LUA_TSTRING &&
+					strcmp (lua_tostring (L, -1), "domain_only") == 0) {
+				flags |= RSPAMD_RBL_FLAG_EMAILS_DOMAINONLY;
+			}
+		}
+
+		lua_pop (L, 1);
+	}
+
+	lua_getfield (L, 3, "symbol");
+
+	if (lua_type (L, -1) == LUA_TSTRING) {
+		symbol = lua_tostring (L, -1);
+	}
+
+	/* Strings are copied to the engine pool */
+	rule = rspamd_rbl_engine_add_rule (engine, name, suffix, symbol, flags);
+	lua_pop (L, 1);
+
+	lua_getfield (L, 3, "returncodes");
+
+	if (lua_type (L, -1) == LUA_TTABLE) {
+		lua_pushnil (L);
+
+		while (lua_next (L, -2) != 0) {
+			symbol = lua_tostring (L, -2);
+
+			if (lua_type (L, -1) == LUA_TTABLE) {
+				lua_pushnil (L);
+
+				while (lua_next (L, -2) != 0) {
+					lua_rbl_add_returncode (L, rule, symbol);
+					lua_pop (L, 1);
+				}
+			}
+			else {
+				lua_rbl_add_returncode (L, rule, symbol);
+			}
+
+			lua_pop (L, 1);
+		}
+	}
+
+	lua_pop (L, 1);
+
+	lua_getfield (L, 3, "returnbits");
+
+	if (lua_type (L, -1) == LUA_TTABLE) {
+		lua_pushnil (L);
+
+		while (lua_next (L, -2) != 0) {
+			if (lua_type (L, -2) == LUA_TSTRING && lua_isnumber (L, -1)) {
+				rspamd_rbl_rule_add_returnbits (rule, lua_tostring (L, -2),
+						lua_tonumber (L, -1));
+			}
+
+			lua_pop (L, 1);
+		}
+	}
+
+	lua_pop (L, 1);
+	lua_pushboolean (L, TRUE);
+
+	return 1;
+}
+
+static gint
+lua_rbl_check (lua_State *L)
+{
+	struct rspamd_rbl_engine *engine = lua_check_rbl (L);
+	struct rspamd_task *task = lua_check_task (L, 2);
+
+	if (engine && task) {
+		rspamd_rbl_engine_check (engine, task);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_rbl (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, rbllib_f);
+
+	return 1;
+}
+
+void
+luaopen_rbl (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{rbl}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{rbl}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, rbllib_m);
+	lua_pop (L, 1);                      /* remove metatable from stack */
+
+	rspamd_lua_add_preload (L, "rspamd_rbl", lua_load_rbl);
+}
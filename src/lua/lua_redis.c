@@ -16,10 +16,10 @@
 #include "lua_common.h"
 #include "dns.h"
 #include "utlist.h"
+#include "redis_pool.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
-#include "adapters/libevent.h"
 #endif
 
 #define REDIS_DEFAULT_TIMEOUT 1.0
@@ -49,6 +49,7 @@ end
  */
 
 LUA_FUNCTION_DEF (redis, make_request);
+LUA_FUNCTION_DEF (redis, make_pipeline);
 LUA_FUNCTION_DEF (redis, make_request_sync);
 LUA_FUNCTION_DEF (redis, connect);
 LUA_FUNCTION_DEF (redis, connect_sync);
@@ -58,6 +59,7 @@ LUA_FUNCTION_DEF (redis, gc);
 
 static const struct luaL_reg redislib_f[] = {
 	LUA_INTERFACE_DEF (redis, make_request),
+	LUA_INTERFACE_DEF (redis, make_pipeline),
 	LUA_INTERFACE_DEF (redis, make_request_sync),
 	LUA_INTERFACE_DEF (redis, connect),
 	LUA_INTERFACE_DEF (redis, connect_sync),
@@ -88,11 +90,24 @@ struct lua_redis_userdata {
 	guint16 terminated;
 };
 
+/* Several commands sent at once with a single reply to lua */
+struct lua_redis_pipeline {
+	gchar *err;
+	gint results_ref;
+	guint nexpected;
+	guint nreplies;
+	gboolean multi;
+	gboolean replied;
+};
+
 struct lua_redis_specific_userdata {
 	gint cbref;
+	struct rspamd_lua_thread *thread;
+	struct lua_redis_pipeline *pipeline;
 	guint nargs;
 	gchar **args;
 	struct event timeout;
+	gdouble start;
 	struct lua_redis_userdata *c;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_specific_userdata *next;
@@ -147,7 +162,8 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 			 * still be alive here!
 			 */
 			ctx->ref.refcount = 100500;
-			redisAsyncFree (ud->ctx);
+			rspamd_redis_pool_release_connection (ud->task->cfg->redis_pool,
+					ud->ctx, ctx->cmds_pending > 0);
 			ctx->ref.refcount = 0;
 		}
 		LL_FOREACH_SAFE (ud->specific, cur, tmp) {
@@ -158,6 +174,13 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 				luaL_unref (ud->L, LUA_REGISTRYINDEX, cur->cbref);
 			}
 
+			if (cur->pipeline) {
+				luaL_unref (ud->L, LUA_REGISTRYINDEX,
+						cur->pipeline->results_ref);
+				g_free (cur->pipeline->err);
+				g_slice_free1 (sizeof (*cur->pipeline), cur->pipeline);
+			}
+
 			g_slice_free1 (sizeof (*cur), cur);
 		}
 	}
@@ -205,8 +228,17 @@ lua_redis_push_error (const gchar *err,
 {
 	struct rspamd_task **ptask;
 	struct lua_redis_userdata *ud = sp_ud->c;
-
-	if (sp_ud->cbref != -1) {
+	struct rspamd_lua_thread *thread;
+
+	if (sp_ud->thread) {
+		/* Timeout could be followed by an error for the same request */
+		thread = sp_ud->thread;
+		sp_ud->thread = NULL;
+		lua_pushstring (thread->L, err);
+		lua_pushnil (thread->L);
+		rspamd_lua_thread_resume (thread, 2);
+	}
+	else if (sp_ud->cbref != -1) {
 		/* Push error */
 		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, sp_ud->cbref);
 		ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
@@ -243,6 +275,8 @@ lua_redis_push_reply (lua_State *L, const redisReply *r)
 		break;
 	case REDIS_REPLY_STRING:
 	case REDIS_REPLY_STATUS:
+	case REDIS_REPLY_ERROR:
+		/* Errors could be elements of transactions replies */
 		lua_pushlstring (L, r->str, r->len);
 		break;
 	case REDIS_REPLY_ARRAY:
@@ -269,8 +303,16 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 {
 	struct rspamd_task **ptask;
 	struct lua_redis_userdata *ud = sp_ud->c;
-
-	if (sp_ud->cbref != -1) {
+	struct rspamd_lua_thread *thread;
+
+	if (sp_ud->thread) {
+		thread = sp_ud->thread;
+		sp_ud->thread = NULL;
+		lua_pushnil (thread->L);
+		lua_redis_push_reply (thread->L, r);
+		rspamd_lua_thread_resume (thread, 2);
+	}
+	else if (sp_ud->cbref != -1) {
 		/* Push error */
 		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, sp_ud->cbref);
 		ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
@@ -291,6 +333,124 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 	rspamd_session_remove_event (ud->task->s, lua_redis_fin, sp_ud);
 }
 
+/**
+ * Push replies of pipeline to lua callback
+ * @param ctx
+ * @param sp_ud
+ */
+static void
+lua_redis_pipeline_push (struct lua_redis_ctx *ctx,
+		struct lua_redis_specific_userdata *sp_ud)
+{
+	struct lua_redis_userdata *ud = sp_ud->c;
+	struct lua_redis_pipeline *p = sp_ud->pipeline;
+	struct rspamd_lua_thread *thread;
+	lua_State *L;
+
+	if (p->replied) {
+		return;
+	}
+
+	p->replied = TRUE;
+	thread = sp_ud->thread;
+	L = thread ? thread->L : ud->L;
+
+	if (!thread) {
+		if (sp_ud->cbref == -1) {
+			return;
+		}
+
+		lua_rawgeti (L, LUA_REGISTRYINDEX, sp_ud->cbref);
+		rspamd_lua_task_push (L, ud->task);
+	}
+
+	if (p->err) {
+		lua_pushstring (L, p->err);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, p->results_ref);
+
+	if (thread) {
+		rspamd_lua_thread_resume (thread, 2);
+	}
+	else if (lua_pcall (L, 3, 0, 0) != 0) {
+		msg_info ("call to callback failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
+	}
+}
+
+static void
+lua_redis_pipeline_error (struct lua_redis_pipeline *p, const gchar *err)
+{
+	/* Merely the first error is reported */
+	if (p->err == NULL) {
+		p->err = g_strdup (err);
+	}
+}
+
+/**
+ * Process the next reply of pipeline
+ * @return TRUE if it was the last reply expected
+ */
+static gboolean
+lua_redis_pipeline_reply (redisAsyncContext *c, redisReply *reply,
+		struct lua_redis_specific_userdata *sp_ud)
+{
+	struct lua_redis_pipeline *p = sp_ud->pipeline;
+	lua_State *L = sp_ud->c->L;
+	gboolean last, result;
+	guint i;
+
+	p->nreplies ++;
+	last = p->nreplies >= p->nexpected;
+	/* In a transaction merely the reply of EXEC has results */
+	result = !p->multi || last;
+
+	if (c->err != 0) {
+		lua_redis_pipeline_error (p,
+				c->err == REDIS_ERR_IO ? strerror (errno) : c->errstr);
+	}
+	else if (reply == NULL) {
+		lua_redis_pipeline_error (p, "received no data from server");
+	}
+	else if (reply->type == REDIS_REPLY_ERROR) {
+		lua_redis_pipeline_error (p, reply->str);
+
+		if (result && !p->multi) {
+			/* Failed commands are represented by `false` */
+			lua_rawgeti (L, LUA_REGISTRYINDEX, p->results_ref);
+			lua_pushboolean (L, FALSE);
+			lua_rawseti (L, -2, p->nreplies);
+			lua_pop (L, 1);
+		}
+	}
+	else if (result && !p->replied) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, p->results_ref);
+
+		if (!p->multi) {
+			lua_redis_push_reply (L, reply);
+			lua_rawseti (L, -2, p->nreplies);
+		}
+		else if (reply->type == REDIS_REPLY_ARRAY) {
+			for (i = 0; i < reply->elements; i ++) {
+				lua_redis_push_reply (L, reply->element[i]);
+				lua_rawseti (L, -2, i + 1);
+			}
+		}
+		else {
+			/* EXEC returns nil if a watched key has been modified */
+			lua_redis_pipeline_error (p, "transaction has been aborted");
+		}
+
+		lua_pop (L, 1);
+	}
+
+	return last;
+}
+
 /**
  * Callback for redis replies
  * @param c context of redis connection
@@ -304,6 +464,7 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct lua_redis_specific_userdata *sp_ud = priv;
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_userdata *ud;
+	struct rspamd_worker_metrics *wm;
 	redisAsyncContext *ac;
 
 	ctx = sp_ud->ctx;
@@ -314,10 +475,26 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 		return;
 	}
 
+	if (sp_ud->pipeline && !lua_redis_pipeline_reply (c, reply, sp_ud)) {
+		/* More replies are pending */
+		return;
+	}
+
+	wm = rspamd_metrics_current ();
+
+	if (wm) {
+		rspamd_metrics_observe (&wm->redis_time,
+				rspamd_get_ticks () - sp_ud->start);
+	}
+
 	event_del (&sp_ud->timeout);
 	ctx->cmds_pending --;
 
-	if (c->err == 0) {
+	if (sp_ud->pipeline) {
+		lua_redis_pipeline_push (ctx, sp_ud);
+		rspamd_session_remove_event (ud->task->s, lua_redis_fin, sp_ud);
+	}
+	else if (c->err == 0) {
 		if (r != NULL) {
 			if (reply->type != REDIS_REPLY_ERROR) {
 				lua_redis_push_data (reply, ctx, sp_ud);
@@ -346,7 +523,8 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 		ud->ctx = NULL;
 
 		if (ac != NULL) {
-			redisAsyncFree (ac);
+			rspamd_redis_pool_release_connection (ud->task->cfg->redis_pool,
+					ac, FALSE);
 		}
 	}
 }
@@ -360,7 +538,17 @@ lua_redis_timeout (int fd, short what, gpointer u)
 
 	ctx = sp_ud->ctx;
 	msg_info ("timeout while querying redis server");
-	lua_redis_push_error ("timeout while connecting the server", ctx, sp_ud, FALSE);
+
+	if (sp_ud->pipeline) {
+		/* Event is removed when all replies are drained by hiredis */
+		lua_redis_pipeline_error (sp_ud->pipeline,
+				"timeout while connecting the server");
+		lua_redis_pipeline_push (ctx, sp_ud);
+	}
+	else {
+		lua_redis_push_error ("timeout while connecting the server", ctx,
+				sp_ud, FALSE);
+	}
 
 	if (sp_ud->c->ctx) {
 		ac = sp_ud->c->ctx;
@@ -370,7 +558,8 @@ lua_redis_timeout (int fd, short what, gpointer u)
 		 * This will call all callbacks pending so the entire context
 		 * will be destructed
 		 */
-		redisAsyncFree (ac);
+		rspamd_redis_pool_release_connection (sp_ud->c->task->cfg->redis_pool,
+				ac, TRUE);
 	}
 }
 
@@ -420,23 +609,6 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	*nargs = top;
 }
 
-static void
-lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
-{
-	/*
-	 * Workaround to prevent double close:
-	 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
-	 */
-#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
-	struct redisAsyncContext *nc = (struct redisAsyncContext *)c;
-	if (status == REDIS_ERR) {
-		nc->c.fd = -1;
-	}
-#endif
-}
-
-
-
 /***
  * @function rspamd_redis.make_request({params})
  * Make request to redis server, params is a table of key=value arguments in any order
@@ -446,7 +618,9 @@ lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
- * @return {boolean} `true` if a request has been scheduled
+ * @return {boolean} `true` if a request has been scheduled, if `callback` is
+ * omitted in a coroutine (e.g. in a symbol callback), then the coroutine is
+ * suspended until the reply and `err, data` are returned instead
  */
 static int
 lua_redis_make_request (lua_State *L)
@@ -463,6 +637,7 @@ lua_redis_make_request (lua_State *L)
 	struct timeval tv;
 	gboolean ret = FALSE;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
+	struct rspamd_lua_thread *thread = NULL;
 
 	if (lua_istable (L, 1)) {
 		/* Table version */
@@ -480,8 +655,12 @@ lua_redis_make_request (lua_State *L)
 			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 		}
 		else {
-			msg_err ("bad callback argument for lua redis");
 			lua_pop (L, 1);
+			thread = rspamd_lua_thread_current (L);
+
+			if (thread == NULL) {
+				msg_err ("bad callback argument for lua redis");
+			}
 		}
 
 		lua_pushstring (L, "cmd");
@@ -544,10 +723,12 @@ lua_redis_make_request (lua_State *L)
 			ctx->async = TRUE;
 			ud = &ctx->d.async;
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_callback_state (L);
 
 			sp_ud = g_slice_alloc (sizeof (*sp_ud));
 			sp_ud->cbref = cbref;
+			sp_ud->thread = thread;
+			sp_ud->pipeline = NULL;
 			sp_ud->c = ud;
 
 			lua_pushstring (L, "args");
@@ -578,7 +759,7 @@ lua_redis_make_request (lua_State *L)
 			ctx->async = TRUE;
 			ud = &ctx->d.async;
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_callback_state (L);
 
 			args_pos = 3;
 
@@ -591,11 +772,14 @@ lua_redis_make_request (lua_State *L)
 			}
 			else {
 				cbref = -1;
+				thread = rspamd_lua_thread_current (L);
 			}
 
 
 			sp_ud = g_slice_alloc (sizeof (*sp_ud));
 			sp_ud->cbref = cbref;
+			sp_ud->thread = thread;
+			sp_ud->pipeline = NULL;
 			sp_ud->c = ud;
 			cmd = luaL_checkstring (L, args_pos);
 			if (top > 4) {
@@ -618,31 +802,18 @@ lua_redis_make_request (lua_State *L)
 	if (ret) {
 		ud->terminated = 0;
 		ud->timeout = timeout;
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
+		ud->ctx = rspamd_redis_pool_connect (ud->task->cfg->redis_pool,
+				ud->task->ev_base, dbname, password,
+				rspamd_inet_address_to_string (addr->addr),
 				rspamd_inet_address_get_port (addr->addr));
 
-		if (ud->ctx == NULL || ud->ctx->err) {
-			if (ud->ctx) {
-				redisAsyncFree (ud->ctx);
-				ud->ctx = NULL;
-			}
-
+		if (ud->ctx == NULL) {
 			REF_RELEASE (ctx);
 			lua_pushboolean (L, FALSE);
 
 			return 1;
 		}
 
-		redisAsyncSetConnectCallback (ud->ctx, lua_redis_connect_cb);
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
-
-		if (password) {
-			redisAsyncCommand (ud->ctx, NULL, NULL, "AUTH %s", password);
-		}
-		if (dbname) {
-			redisAsyncCommand (ud->ctx, NULL, NULL, "SELECT %s", dbname);
-		}
-
 		ret = redisAsyncCommandArgv (ud->ctx,
 					lua_redis_callback,
 					sp_ud,
@@ -657,6 +828,7 @@ lua_redis_make_request (lua_State *L)
 					g_quark_from_static_string ("lua redis"));
 
 			sp_ud->ctx = ctx;
+			sp_ud->start = rspamd_get_ticks ();
 			REF_RETAIN (ctx);
 			ctx->cmds_pending ++;
 			double_to_tv (timeout, &tv);
@@ -667,13 +839,19 @@ lua_redis_make_request (lua_State *L)
 		}
 		else {
 			msg_info ("call to redis failed: %s", ud->ctx->errstr);
-			redisAsyncFree (ud->ctx);
+			rspamd_redis_pool_release_connection (ud->task->cfg->redis_pool,
+					ud->ctx, TRUE);
 			ud->ctx = NULL;
 			REF_RELEASE (ctx);
 			ret = FALSE;
 		}
 	}
 
+	if (ret && thread) {
+		/* Reply is returned on resume */
+		return rspamd_lua_thread_yield (thread, 0);
+	}
+
 	lua_pushboolean (L, ret);
 
 	if (ret) {
@@ -688,6 +866,293 @@ lua_redis_make_request (lua_State *L)
 	return 1;
 }
 
+struct lua_redis_pipeline_cmd {
+	gchar **args;
+	guint nargs;
+};
+
+/***
+ * @function rspamd_redis.make_pipeline({params})
+ * Sends several commands to redis server at once using a single connection
+ * and calls callback when all replies are received, params is a table of
+ * key=value arguments in any order
+ * @param {task} task worker task object
+ * @param {ip|string} host server address
+ * @param {function} callback callback to be called in form `function (task, err, results)`, where `err` is the first error occurred and `results` is a list of replies for each command (`false` for failed commands)
+ * @param {table} commands list of commands in form `{cmd, {args}}`
+ * @param {boolean} multi send commands as a transaction (`MULTI`/`EXEC`), so `results` are the elements of `EXEC` reply
+ * @param {number} timeout timeout in seconds for all replies (1.0 by default)
+ * @param {string} password password for `AUTH` command
+ * @param {string} dbname database for `SELECT` command
+ * @return {boolean} `true` if commands have been sent, if `callback` is
+ * omitted in a coroutine, then the coroutine is suspended until all replies
+ * and `err, results` are returned instead
+ * @example
+rspamd_redis.make_pipeline({
+  task = task,
+  host = '127.0.0.1:6379',
+  multi = true,
+  commands = {
+    {'INCR', {counter_key}},
+    {'EXPIRE', {counter_key, '3600'}},
+  },
+  callback = function(task, err, results)
+    if not err then
+      rspamd_logger.infox(task, 'counter is now %s', results[1])
+    end
+  end
+})
+ */
+static int
+lua_redis_make_pipeline (lua_State *L)
+{
+	struct lua_redis_ctx *ctx;
+	rspamd_inet_addr_t *ip = NULL;
+	struct lua_redis_userdata *ud;
+	struct lua_redis_specific_userdata *sp_ud;
+	struct lua_redis_pipeline *p;
+	struct lua_redis_pipeline_cmd *pcmd;
+	struct rspamd_lua_ip *addr = NULL;
+	struct rspamd_task *task = NULL;
+	struct rspamd_lua_thread *thread = NULL;
+	const gchar *host, *cmd;
+	const gchar *password = NULL, *dbname = NULL;
+	GArray *cmds;
+	gint cbref = -1;
+	struct timeval tv;
+	gboolean multi = FALSE;
+	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
+	guint i, sent = 0;
+
+	if (!lua_istable (L, 1)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushstring (L, "task");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TUSERDATA) {
+		task = lua_check_task (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "host");
+	lua_gettable (L, 1);
+
+	if (lua_type (L, -1) == LUA_TUSERDATA) {
+		addr = lua_check_ip (L, -1);
+	}
+	else if (lua_type (L, -1) == LUA_TSTRING) {
+		host = lua_tostring (L, -1);
+
+		if (rspamd_parse_inet_address (&ip, host, strlen (host))) {
+			addr = g_alloca (sizeof (*addr));
+			addr->addr = ip;
+
+			if (rspamd_inet_address_get_port (ip) == 0) {
+				rspamd_inet_address_set_port (ip, 6379);
+			}
+
+			if (task) {
+				rspamd_mempool_add_destructor (task->task_pool,
+						(rspamd_mempool_destruct_t)rspamd_inet_address_destroy,
+						ip);
+			}
+		}
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "timeout");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TNUMBER) {
+		timeout = lua_tonumber (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "password");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TSTRING) {
+		password = lua_tostring (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "dbname");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TSTRING) {
+		dbname = lua_tostring (L, -1);
+	}
+	lua_pop (L, 1);
+
+	lua_pushstring (L, "multi");
+	lua_gettable (L, 1);
+	multi = lua_toboolean (L, -1);
+	lua_pop (L, 1);
+
+	if (task == NULL || addr == NULL) {
+		if (ip && task == NULL) {
+			rspamd_inet_address_destroy (ip);
+		}
+
+		msg_err ("incorrect function invocation");
+		lua_pushboolean (L, FALSE);
+
+		return 1;
+	}
+
+	/* Parse all commands before connecting */
+	cmds = g_array_new (FALSE, FALSE, sizeof (*pcmd));
+	lua_pushstring (L, "commands");
+	lua_gettable (L, 1);
+
+	if (lua_type (L, -1) == LUA_TTABLE) {
+		for (i = 1; ; i ++) {
+			lua_rawgeti (L, -1, i);
+
+			if (lua_type (L, -1) != LUA_TTABLE) {
+				lua_pop (L, 1);
+				break;
+			}
+
+			lua_rawgeti (L, -1, 1);
+			cmd = lua_tostring (L, -1);
+
+			if (cmd != NULL) {
+				g_array_set_size (cmds, cmds->len + 1);
+				pcmd = &g_array_index (cmds, struct lua_redis_pipeline_cmd,
+						cmds->len - 1);
+				lua_rawgeti (L, -2, 2);
+				lua_redis_parse_args (L, -1, cmd, &pcmd->args, &pcmd->nargs);
+				lua_pop (L, 1);
+			}
+
+			lua_pop (L, 2);
+		}
+	}
+	lua_pop (L, 1);
+
+	if (cmds->len == 0) {
+		g_array_free (cmds, TRUE);
+		msg_err ("no commands in redis pipeline");
+		lua_pushboolean (L, FALSE);
+
+		return 1;
+	}
+
+	lua_pushstring (L, "callback");
+	lua_gettable (L, 1);
+	if (lua_type (L, -1) == LUA_TFUNCTION) {
+		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	else {
+		lua_pop (L, 1);
+		thread = rspamd_lua_thread_current (L);
+	}
+
+	ctx = g_slice_alloc0 (sizeof (struct lua_redis_ctx));
+	REF_INIT_RETAIN (ctx, lua_redis_dtor);
+	ctx->async = TRUE;
+	ud = &ctx->d.async;
+	ud->task = task;
+	ud->L = rspamd_lua_callback_state (L);
+	ud->timeout = timeout;
+
+	p = g_slice_alloc0 (sizeof (*p));
+	p->multi = multi;
+	lua_createtable (L, cmds->len, 0);
+	p->results_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	sp_ud = g_slice_alloc0 (sizeof (*sp_ud));
+	sp_ud->cbref = cbref;
+	sp_ud->thread = thread;
+	sp_ud->pipeline = p;
+	sp_ud->c = ud;
+	sp_ud->ctx = ctx;
+	sp_ud->start = rspamd_get_ticks ();
+	LL_PREPEND (ud->specific, sp_ud);
+
+	ud->ctx = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			task->ev_base, dbname, password,
+			rspamd_inet_address_to_string (addr->addr),
+			rspamd_inet_address_get_port (addr->addr));
+
+	if (ud->ctx != NULL) {
+		/* Commands are formatted by hiredis, so arguments are not kept */
+		if (!multi ||
+				redisAsyncCommand (ud->ctx, lua_redis_callback, sp_ud,
+						"MULTI") == REDIS_OK) {
+			sent = multi ? 1 : 0;
+
+			for (i = 0; i < cmds->len; i ++) {
+				pcmd = &g_array_index (cmds, struct lua_redis_pipeline_cmd, i);
+
+				if (redisAsyncCommandArgv (ud->ctx, lua_redis_callback, sp_ud,
+						pcmd->nargs, (const gchar **)pcmd->args,
+						NULL) != REDIS_OK) {
+					break;
+				}
+
+				sent ++;
+			}
+
+			if (multi && i == cmds->len &&
+					redisAsyncCommand (ud->ctx, lua_redis_callback, sp_ud,
+							"EXEC") == REDIS_OK) {
+				sent ++;
+			}
+		}
+	}
+
+	for (i = 0; i < cmds->len; i ++) {
+		pcmd = &g_array_index (cmds, struct lua_redis_pipeline_cmd, i);
+		lua_redis_free_args (pcmd->args, pcmd->nargs);
+	}
+
+	if (sent == 0) {
+		if (ud->ctx) {
+			msg_info ("call to redis failed: %s", ud->ctx->errstr);
+			rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+					ud->ctx, TRUE);
+			ud->ctx = NULL;
+		}
+
+		g_array_free (cmds, TRUE);
+		REF_RELEASE (ctx);
+
+		if (thread) {
+			lua_pushstring (L, "cannot send commands to redis");
+		}
+		else {
+			lua_pushboolean (L, FALSE);
+		}
+
+		return 1;
+	}
+
+	if (sent < cmds->len + (multi ? 2 : 0)) {
+		lua_redis_pipeline_error (p, "cannot send all commands to redis");
+	}
+
+	g_array_free (cmds, TRUE);
+	p->nexpected = sent;
+	rspamd_session_add_event (task->s, lua_redis_fin, sp_ud,
+			g_quark_from_static_string ("lua redis"));
+	REF_RETAIN (ctx);
+	ctx->cmds_pending ++;
+	double_to_tv (timeout, &tv);
+	event_set (&sp_ud->timeout, -1, EV_TIMEOUT, lua_redis_timeout, sp_ud);
+	event_base_set (task->ev_base, &sp_ud->timeout);
+	event_add (&sp_ud->timeout, &tv);
+	/* Connection object is not exposed, so it is owned by the event */
+	REF_RELEASE (ctx);
+
+	if (thread) {
+		return rspamd_lua_thread_yield (thread, 0);
+	}
+
+	lua_pushboolean (L, TRUE);
+
+	return 1;
+}
+
 /***
  * @function rspamd_redis.make_request_sync({params})
  * Make blocking request to redis server, params is a table of key=value arguments in any order
@@ -876,7 +1341,7 @@ lua_redis_connect (lua_State *L)
 			ctx->async = TRUE;
 			ud = &ctx->d.async;
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_callback_state (L);
 			ret = TRUE;
 		}
 	}
@@ -884,18 +1349,17 @@ lua_redis_connect (lua_State *L)
 	if (ret && ctx) {
 		ud->terminated = 0;
 		ud->timeout = timeout;
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
+		ud->ctx = rspamd_redis_pool_connect (ud->task->cfg->redis_pool,
+				ud->task->ev_base, NULL, NULL,
+				rspamd_inet_address_to_string (addr->addr),
 				rspamd_inet_address_get_port (addr->addr));
 
-		if (ud->ctx == NULL || ud->ctx->err) {
+		if (ud->ctx == NULL) {
 			REF_RELEASE (ctx);
 			lua_pushboolean (L, FALSE);
 
 			return 1;
 		}
-
-		redisAsyncSetConnectCallback (ud->ctx, lua_redis_connect_cb);
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
 		pctx = lua_newuserdata (L, sizeof (ctx));
 		*pctx = ctx;
 		rspamd_lua_setclass (L, "rspamd{redis}", -1);
@@ -1042,8 +1506,11 @@ lua_redis_add_cmd (lua_State *L)
 
 			sp_ud = g_slice_alloc (sizeof (*sp_ud));
 			sp_ud->cbref = cbref;
+			sp_ud->thread = NULL;
+			sp_ud->pipeline = NULL;
 			sp_ud->c = &ctx->d.async;
 			sp_ud->ctx = ctx;
+			sp_ud->start = rspamd_get_ticks ();
 
 			lua_redis_parse_args (L, args_pos, cmd, &sp_ud->args,
 						&sp_ud->nargs);
@@ -1116,7 +1583,9 @@ lua_redis_add_cmd (lua_State *L)
 
 /***
  * @method rspamd_redis:exec()
- * Executes pending commands (suitable for blocking IO only for now)
+ * Executes pending commands (suitable for blocking IO only for now). Pending
+ * commands are cleared afterwards, so the same connection could be used for
+ * the subsequent pipelines
  * @return {table} pairs in format [bool, result] for each request pending
  */
 static int
@@ -1145,6 +1614,11 @@ lua_redis_exec (lua_State *L)
 			return 0;
 		}
 		else {
+			if (!lua_checkstack (L, ctx->cmds_pending * 2)) {
+				return luaL_error (L, "too many pending commands: %d",
+						(gint)ctx->cmds_pending);
+			}
+
 			for (i = 0; i < ctx->cmds_pending; i ++) {
 				ret = redisGetReply (ctx->d.sync, (void **)&r);
 
@@ -1167,6 +1641,8 @@ lua_redis_exec (lua_State *L)
 
 				nret += 2;
 			}
+
+			ctx->cmds_pending = 0;
 		}
 	}
 
@@ -1210,6 +1686,15 @@ lua_redis_connect_sync (lua_State *L)
 	return 1;
 }
 static int
+lua_redis_make_pipeline (lua_State *L)
+{
+	msg_warn ("rspamd is compiled with no redis support");
+
+	lua_pushboolean (L, FALSE);
+
+	return 1;
+}
+static int
 lua_redis_add_cmd (lua_State *L)
 {
 	msg_warn ("rspamd is compiled with no redis support");
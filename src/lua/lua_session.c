@@ -167,7 +167,7 @@ lua_session_create (lua_State *L)
 	}
 
 	cbdata = rspamd_mempool_alloc0 (mempool, sizeof (struct lua_session_udata));
-	cbdata->L = L;
+	cbdata->L = rspamd_lua_callback_state (L);
 	cbdata->pool = mempool;
 	lua_pushvalue (L, 2);
 	cbdata->cbref_fin = luaL_ref (L, LUA_REGISTRYINDEX);
@@ -251,7 +251,7 @@ lua_session_register_async_event (lua_State *L)
 			cbdata =
 				rspamd_mempool_alloc (cbd->pool,
 					sizeof (struct lua_event_udata));
-			cbdata->L = L;
+			cbdata->L = rspamd_lua_callback_state (L);
 			lua_pushvalue (L, 1);
 			cbdata->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 			cbdata->session = session;
@@ -0,0 +1,575 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "libutil/shared_cache.h"
+
+/***
+ * @module rspamd_shared_cache
+ * Shared cache is a fixed size cache of strings placed in shared memory, so
+ * all workers see the same elements. Cache should be created when the
+ * configuration is loaded (before workers are spawned) and it lives as long as
+ * the configuration (or the memory pool) used to create it.
+ * @example
+local rspamd_shared_cache = require "rspamd_shared_cache"
+local cache = rspamd_shared_cache.create(rspamd_config, {bytes = 1024 * 1024})
+
+cache:set('key', 'value', 60)
+local v = cache:get('key') -- 'value' during the next 60 seconds
+ */
+
+/* Lua bindings */
+/***
+ * @function shared_cache.create(cfg|pool, params)
+ * Creates new shared cache allocated from configuration or memory pool. The
+ * following parameters are allowed:
+ *
+ * - `bytes`: memory limit for keys and values (required)
+ * - `shards`: number of independently locked shards
+ * - `elts`: limit of elements (derived from `bytes` by default)
+ * - `persistent`: unique name used to save elements on shutdown and to restore
+ * them on start (allowed for caches created from configuration only)
+ * @param {rspamd_config|rspamd_mempool} cfg configuration or pool
+ * @param {table} params cache parameters
+ * @return {rspamd_shared_cache} new cache object
+ */
+LUA_FUNCTION_DEF (shared_cache, create);
+/***
+ * @method shared_cache:set(key, value[, ttl])
+ * Inserts or replaces value for the specified key
+ * @param {string} key key of element
+ * @param {string} value value of element
+ * @param {number} ttl time to live in seconds (no expiration by default)
+ * @return {boolean} `true` if an element has been inserted
+ */
+LUA_FUNCTION_DEF (shared_cache, set);
+/***
+ * @method shared_cache:get(key)
+ * Returns value for the specified key
+ * @param {string} key key of element
+ * @return {string} value of element or nil if it is not found or expired
+ */
+LUA_FUNCTION_DEF (shared_cache, get);
+/***
+ * @method shared_cache:remove(key)
+ * Removes the specified key from the cache
+ * @param {string} key key of element
+ * @return {boolean} `true` if an element has been removed
+ */
+LUA_FUNCTION_DEF (shared_cache, remove);
+/***
+ * @method shared_cache:stat()
+ * Returns statistics of the cache
+ * @return {table} table with `elts`, `bytes`, `hits`, `misses` and `evictions`
+ */
+LUA_FUNCTION_DEF (shared_cache, stat);
+/***
+ * @method shared_cache:bucket_get(key, rate[, now])
+ * Returns level of leaky bucket stored in the cache
+ * @param {string} key key of bucket
+ * @param {number} rate leak rate of bucket per second
+ * @param {number} now current time (the current time by default)
+ * @return {number} level of bucket leaked till `now` or 0 if it is not found
+ */
+LUA_FUNCTION_DEF (shared_cache, bucket_get);
+/***
+ * @method shared_cache:bucket_add(key, rate, delta, ttl[, drift[, interval[, now]]])
+ * Atomically leaks bucket and adds `delta` to its level. Deltas are also
+ * accumulated as pending until they are taken to be sent elsewhere: this
+ * happens when pending deltas reach `drift` or when the bucket has not been
+ * flushed for `interval` seconds. The pending delta is taken by one worker
+ * merely.
+ * @param {string} key key of bucket
+ * @param {number} rate leak rate of bucket per second
+ * @param {number} delta value added to the level
+ * @param {number} ttl time to live of bucket in seconds
+ * @param {number} drift maximum pending delta (pending deltas are not taken if not specified)
+ * @param {number} interval maximum time between flushes of pending deltas
+ * @param {number} now current time (the current time by default)
+ * @return {number,number} new level and the pending delta taken (0 if it is not taken)
+ */
+LUA_FUNCTION_DEF (shared_cache, bucket_add);
+/***
+ * @method shared_cache:bucket_sync(key, rate, level, ttl[, now])
+ * Replaces level of bucket with the level obtained from the external storage
+ * after deltas have been flushed there. Deltas that are pending since then
+ * are added to the new level.
+ * @param {string} key key of bucket
+ * @param {number} rate leak rate of bucket per second
+ * @param {number} level external level
+ * @param {number} ttl time to live of bucket in seconds
+ * @param {number} now current time (the current time by default)
+ * @return {number} new level of bucket
+ */
+LUA_FUNCTION_DEF (shared_cache, bucket_sync);
+/***
+ * @method shared_cache:serialize([now])
+ * Serializes all elements that are not expired
+ * @param {number} now current time (the current time by default)
+ * @return {string,number} serialized elements and their number
+ */
+LUA_FUNCTION_DEF (shared_cache, serialize);
+/***
+ * @method shared_cache:deserialize(data[, now])
+ * Inserts elements serialized by `shared_cache:serialize`, elements keep
+ * their expiration time and expired elements are skipped
+ * @param {string} data serialized elements
+ * @param {number} now current time (the current time by default)
+ * @return {number} number of elements inserted or nil if data is malformed
+ */
+LUA_FUNCTION_DEF (shared_cache, deserialize);
+
+static const struct luaL_reg shared_cachelib_m[] = {
+	LUA_INTERFACE_DEF (shared_cache, set),
+	LUA_INTERFACE_DEF (shared_cache, get),
+	LUA_INTERFACE_DEF (shared_cache, remove),
+	LUA_INTERFACE_DEF (shared_cache, stat),
+	LUA_INTERFACE_DEF (shared_cache, bucket_get),
+	LUA_INTERFACE_DEF (shared_cache, bucket_add),
+	LUA_INTERFACE_DEF (shared_cache, bucket_sync),
+	LUA_INTERFACE_DEF (shared_cache, serialize),
+	LUA_INTERFACE_DEF (shared_cache, deserialize),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
+static const struct luaL_reg shared_cachelib_f[] = {
+	LUA_INTERFACE_DEF (shared_cache, create),
+	{NULL, NULL}
+};
+
+/* Leaky bucket stored as a value of cache */
+struct lua_shared_cache_bucket {
+	gdouble level;
+	gdouble atime;
+	gdouble pending;
+	gdouble synced;
+};
+
+struct lua_shared_cache_bucket_op {
+	gdouble rate;
+	gdouble now;
+	gdouble delta;
+	gdouble drift;
+	gdouble interval;
+	gdouble level;
+	gdouble taken;
+	gboolean sync;
+};
+
+static struct rspamd_shared_cache *
+lua_check_shared_cache (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{shared_cache}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'shared_cache' expected");
+	return ud ? *((struct rspamd_shared_cache **)ud) : NULL;
+}
+
+static gint
+lua_shared_cache_create (lua_State *L)
+{
+	struct rspamd_shared_cache *cache, **pcache;
+	struct rspamd_config **pcfg, *cfg = NULL;
+	rspamd_mempool_t **ppool, *pool = NULL;
+	const gchar *persistent = NULL;
+	gint64 bytes = 0, shards = 0, elts = 0;
+	GError *err = NULL;
+	gint ret;
+
+	if ((pcfg = rspamd_lua_check_class (L, 1, "rspamd{config}")) != NULL) {
+		cfg = *pcfg;
+		pool = cfg->cfg_pool;
+	}
+	else if ((ppool = rspamd_lua_check_class (L, 1, "rspamd{mempool}")) != NULL) {
+		pool = *ppool;
+	}
+
+	if (pool == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!rspamd_lua_parse_table_arguments (L, 2, &err,
+			"*bytes=I;shards=I;elts=I;persistent=S",
+			&bytes, &shards, &elts, &persistent)) {
+		ret = luaL_error (L, "invalid table arguments: %s", err->message);
+		g_error_free (err);
+
+		return ret;
+	}
+
+	if (bytes <= 0 || shards < 0 || elts < 0) {
+		return luaL_error (L, "invalid cache limits");
+	}
+
+	if (persistent && cfg == NULL) {
+		return luaL_error (L, "persistent caches require config");
+	}
+
+	cache = rspamd_shared_cache_new (pool, shards, bytes, elts);
+
+	if (persistent) {
+		rspamd_config_register_persistent_cache (cfg,
+				rspamd_mempool_strdup (pool, persistent), cache);
+	}
+	pcache = lua_newuserdata (L, sizeof (*pcache));
+	rspamd_lua_setclass (L, "rspamd{shared_cache}", -1);
+	*pcache = cache;
+
+	return 1;
+}
+
+static gint
+lua_shared_cache_set (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	const gchar *key, *value;
+	gsize klen, vlen;
+	guint ttl = 0;
+
+	key = luaL_checklstring (L, 2, &klen);
+	value = luaL_checklstring (L, 3, &vlen);
+
+	if (lua_isnumber (L, 4)) {
+		ttl = lua_tonumber (L, 4);
+	}
+
+	if (cache) {
+		lua_pushboolean (L, rspamd_shared_cache_insert (cache, key, klen,
+				value, vlen, time (NULL), ttl));
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_shared_cache_get (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	const gchar *key;
+	gchar *value;
+	gsize klen, vlen;
+
+	key = luaL_checklstring (L, 2, &klen);
+
+	if (cache) {
+		value = rspamd_shared_cache_lookup (cache, key, klen, time (NULL),
+				&vlen);
+
+		if (value) {
+			lua_pushlstring (L, value, vlen);
+			g_free (value);
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_shared_cache_remove (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	const gchar *key;
+	gsize klen;
+
+	key = luaL_checklstring (L, 2, &klen);
+
+	if (cache) {
+		lua_pushboolean (L, rspamd_shared_cache_remove (cache, key, klen));
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_shared_cache_stat (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	struct rspamd_shared_cache_stat st;
+
+	if (cache) {
+		rspamd_shared_cache_stat (cache, &st);
+		lua_createtable (L, 0, 5);
+		lua_pushnumber (L, st.elts);
+		lua_setfield (L, -2, "elts");
+		lua_pushnumber (L, st.bytes);
+		lua_setfield (L, -2, "bytes");
+		lua_pushnumber (L, st.hits);
+		lua_setfield (L, -2, "hits");
+		lua_pushnumber (L, st.misses);
+		lua_setfield (L, -2, "misses");
+		lua_pushnumber (L, st.evictions);
+		lua_setfield (L, -2, "evictions");
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static void
+lua_shared_cache_bucket_leak (struct lua_shared_cache_bucket *bk,
+		gdouble rate, gdouble now)
+{
+	if (now > bk->atime) {
+		bk->level -= rate * (now - bk->atime);
+
+		if (bk->level < 0) {
+			bk->level = 0;
+		}
+
+		bk->atime = now;
+	}
+}
+
+static void
+lua_shared_cache_bucket_update (guchar *value, gboolean found, gpointer ud)
+{
+	struct lua_shared_cache_bucket_op *op = ud;
+	struct lua_shared_cache_bucket bk;
+
+	/* Values are not aligned in the cache */
+	memcpy (&bk, value, sizeof (bk));
+
+	if (!found) {
+		bk.atime = op->now;
+	}
+
+	if (op->sync) {
+		bk.level = op->level + bk.pending;
+		bk.atime = op->now;
+	}
+	else {
+		lua_shared_cache_bucket_leak (&bk, op->rate, op->now);
+		bk.level += op->delta;
+		bk.pending += op->delta;
+
+		if (op->drift > 0 && (bk.pending >= op->drift ||
+				op->now - bk.synced >= op->interval)) {
+			op->taken = bk.pending;
+			bk.pending = 0;
+			bk.synced = op->now;
+		}
+	}
+
+	op->level = bk.level;
+	memcpy (value, &bk, sizeof (bk));
+}
+
+static gint
+lua_shared_cache_bucket_get (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	struct lua_shared_cache_bucket bk;
+	const gchar *key;
+	gchar *value;
+	gsize klen, vlen;
+	gdouble rate, now;
+
+	key = luaL_checklstring (L, 2, &klen);
+	rate = luaL_checknumber (L, 3);
+	now = luaL_optnumber (L, 4, rspamd_get_calendar_ticks ());
+
+	if (cache) {
+		value = rspamd_shared_cache_lookup (cache, key, klen, now, &vlen);
+
+		if (value && vlen == sizeof (bk)) {
+			memcpy (&bk, value, sizeof (bk));
+			lua_shared_cache_bucket_leak (&bk, rate, now);
+			lua_pushnumber (L, bk.level);
+		}
+		else {
+			lua_pushnumber (L, 0);
+		}
+
+		g_free (value);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_shared_cache_bucket_add (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	struct lua_shared_cache_bucket_op op;
+	const gchar *key;
+	gsize klen;
+	guint ttl;
+
+	memset (&op, 0, sizeof (op));
+	key = luaL_checklstring (L, 2, &klen);
+	op.rate = luaL_checknumber (L, 3);
+	op.delta = luaL_checknumber (L, 4);
+	ttl = luaL_checknumber (L, 5);
+	op.drift = luaL_optnumber (L, 6, 0);
+	op.interval = luaL_optnumber (L, 7, 0);
+	op.now = luaL_optnumber (L, 8, rspamd_get_calendar_ticks ());
+
+	if (cache) {
+		if (!rspamd_shared_cache_update (cache, key, klen,
+				sizeof (struct lua_shared_cache_bucket), op.now, ttl,
+				lua_shared_cache_bucket_update, &op)) {
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		lua_pushnumber (L, op.level);
+		lua_pushnumber (L, op.taken);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 2;
+}
+
+static gint
+lua_shared_cache_bucket_sync (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	struct lua_shared_cache_bucket_op op;
+	const gchar *key;
+	gsize klen;
+	guint ttl;
+
+	memset (&op, 0, sizeof (op));
+	key = luaL_checklstring (L, 2, &klen);
+	op.rate = luaL_checknumber (L, 3);
+	op.level = luaL_checknumber (L, 4);
+	ttl = luaL_checknumber (L, 5);
+	op.now = luaL_optnumber (L, 6, rspamd_get_calendar_ticks ());
+	op.sync = TRUE;
+
+	if (cache) {
+		if (!rspamd_shared_cache_update (cache, key, klen,
+				sizeof (struct lua_shared_cache_bucket), op.now, ttl,
+				lua_shared_cache_bucket_update, &op)) {
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		lua_pushnumber (L, op.level);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_shared_cache_serialize (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	GByteArray *out;
+	time_t now = time (NULL);
+	guint nelts;
+
+	if (lua_isnumber (L, 2)) {
+		now = lua_tonumber (L, 2);
+	}
+
+	if (cache) {
+		out = g_byte_array_new ();
+		nelts = rspamd_shared_cache_serialize (cache, now, out);
+		lua_pushlstring (L, (const gchar *)out->data, out->len);
+		lua_pushnumber (L, nelts);
+		g_byte_array_free (out, TRUE);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 2;
+}
+
+static gint
+lua_shared_cache_deserialize (lua_State *L)
+{
+	struct rspamd_shared_cache *cache = lua_check_shared_cache (L);
+	const gchar *data;
+	gsize len;
+	time_t now = time (NULL);
+	gint nelts;
+
+	data = luaL_checklstring (L, 2, &len);
+
+	if (lua_isnumber (L, 3)) {
+		now = lua_tonumber (L, 3);
+	}
+
+	if (cache) {
+		nelts = rspamd_shared_cache_deserialize (cache, (const guchar *)data,
+				len, now);
+
+		if (nelts >= 0) {
+			lua_pushnumber (L, nelts);
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_load_shared_cache (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, shared_cachelib_f);
+
+	return 1;
+}
+
+void
+luaopen_shared_cache (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{shared_cache}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{shared_cache}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, shared_cachelib_m);
+	lua_pop (L, 1);                      /* remove metatable from stack */
+
+	rspamd_lua_add_preload (L, "rspamd_shared_cache", lua_load_shared_cache);
+}
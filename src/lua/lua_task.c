@@ -118,7 +118,8 @@ end
 LUA_FUNCTION_DEF (task, set_pre_result);
 /***
  * @method task:get_urls([need_emails])
- * Get all URLs found in a message.
+ * Get all URLs found in a message. The list is cached for the task and it
+ * should not be modified.
  * @param {boolean} need_emails if `true` then reutrn also email urls
  * @return {table rspamd_url} list of all urls found
 @example
@@ -157,7 +158,8 @@ LUA_FUNCTION_DEF (task, get_content);
 LUA_FUNCTION_DEF (task, get_emails);
 /***
  * @method task:get_text_parts()
- * Get all text (and HTML) parts found in a message
+ * Get all text (and HTML) parts found in a message. The list is cached for the
+ * task and it should not be modified.
  * @return {table rspamd_text_part} list of text parts
  */
 LUA_FUNCTION_DEF (task, get_text_parts);
@@ -211,6 +213,8 @@ LUA_FUNCTION_DEF (task, get_header_raw);
  * - `decoded` - decoded value of a header
  * - `tab_separated` - `true` if a header and a value are separated by `tab` character
  * - `empty_separator` - `true` if there are no separator between a header and a value
+ *
+ * The list is cached for the task and it should not be modified.
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {list of tables} all values of a header as specified above
@@ -243,7 +247,11 @@ LUA_FUNCTION_DEF (task, get_raw_headers);
  * - `by_hostname` - MTA hostname
  *
  * Please note that in some situations rspamd cannot parse all the fields of received headers.
- * In that case you should check all strings for validity.
+ * In that case you should check all strings for validity. The list is cached
+ * for the task and it should not be modified.
+ * Headers are parsed when they are requested, so rules that need merely the
+ * first hops should limit their number.
+ * @param {number} max optional number of top received headers to parse
  * @return {table of tables} list of received headers described above
  */
 LUA_FUNCTION_DEF (task, get_received_headers);
@@ -302,6 +310,7 @@ LUA_FUNCTION_DEF (task, has_recipients);
  * - `addr` - address part of the address
  * - `user` - user part (if present) of the address, e.g. `blah`
  * - `domain` - domain part (if present), e.g. `foo.com`
+ * The list is cached for the task and it should not be modified.
  * @param {integer|string} type if specified has the following meaning: `0` or `any` means try SMTP recipients and fallback to MIME if failed, `1` or `smtp` means checking merely SMTP recipients and `2` or `mime` means MIME recipients only
  * @return {list of addresses} list of recipients or `nil`
  */
@@ -495,10 +504,14 @@ LUA_FUNCTION_DEF (task, get_settings_id);
 
 /***
  * @method task:process_re(params)
- * Processes the specified regexp and returns number of captures (cached or new)
+ * Processes the specified regexp and returns number of captures (cached or new).
+ * Regexp must be registered by `rspamd_config:register_regexp` when config
+ * is loaded, so it is checked along with other regexps of its class (by
+ * hyperscan if available) and the result is cached for the whole task.
  * Params is the table with the follwoing fields (mandatory fields are marked with `*`):
  * - `re`* : regular expression object
- * - `type`*: type of regular expression:
+ * - `type`: type of regular expression, it can be omitted as the type is
+ *   defined on registration:
  *   + `mime`: mime regexp
  *   + `header`: header regexp
  *   + `rawheader`: raw header expression
@@ -555,6 +568,7 @@ LUA_FUNCTION_DEF (task, set_flag);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `limited`: message has been processed partially as some resource budget is exceeded
  * @param {string} flag to check
  * @return {boolean} true if flags is set
  */
@@ -573,6 +587,7 @@ LUA_FUNCTION_DEF (task, has_flag);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `limited`: message has been processed partially as some resource budget is exceeded
  * @return {array of strings} table with all flags as strings
  */
 LUA_FUNCTION_DEF (task, get_flags);
@@ -672,14 +687,22 @@ static const struct luaL_reg imagelib_m[] = {
 LUA_FUNCTION_DEF (text, len);
 LUA_FUNCTION_DEF (text, str);
 LUA_FUNCTION_DEF (text, ptr);
+LUA_FUNCTION_DEF (text, sub);
+LUA_FUNCTION_DEF (text, eq);
+LUA_FUNCTION_DEF (text, lt);
+LUA_FUNCTION_DEF (text, le);
 LUA_FUNCTION_DEF (text, gc);
 
 static const struct luaL_reg textlib_m[] = {
 	LUA_INTERFACE_DEF (text, len),
 	LUA_INTERFACE_DEF (text, str),
 	LUA_INTERFACE_DEF (text, ptr),
+	LUA_INTERFACE_DEF (text, sub),
 	{"__len", lua_text_len},
 	{"__tostring", lua_text_str},
+	{"__eq", lua_text_eq},
+	{"__lt", lua_text_lt},
+	{"__le", lua_text_le},
 	{"__gc", lua_text_gc},
 	{NULL, NULL}
 };
@@ -709,6 +732,23 @@ lua_check_text (lua_State * L, gint pos)
 	return ud ? (struct rspamd_lua_text *)ud : NULL;
 }
 
+const gchar *
+lua_check_text_or_string (lua_State * L, gint pos, gsize *len)
+{
+	struct rspamd_lua_text *t;
+
+	if (lua_type (L, pos) == LUA_TSTRING) {
+		return lua_tolstring (L, pos, len);
+	}
+	else if ((t = rspamd_lua_check_class (L, pos, "rspamd{text}")) != NULL) {
+		*len = t->len;
+
+		return t->start;
+	}
+
+	return NULL;
+}
+
 /* Task methods */
 static int
 lua_task_process_message (lua_State *L)
@@ -959,6 +999,77 @@ lua_task_set_pre_result (lua_State * L)
 	return 0;
 }
 
+/*
+ * Heavy accessors keep their results in a per task table referenced from the
+ * lua registry. Cache keys include the size (or the pointer) of the source
+ * data, so changed task data produces a different key and the stale value is
+ * simply not used any longer
+ */
+#define LUA_TASK_CACHE_VAR "lua_task_cache"
+
+struct lua_task_cache {
+	lua_State *L;
+	gint ref;
+};
+
+static void
+lua_task_cache_dtor (gpointer p)
+{
+	struct lua_task_cache *cache = p;
+
+	luaL_unref (cache->L, LUA_REGISTRYINDEX, cache->ref);
+}
+
+/* Pushes cached value and returns TRUE if it has been found */
+static gboolean
+lua_task_get_cached (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	struct lua_task_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_getfield (L, -1, key);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 2);
+
+		return FALSE;
+	}
+
+	lua_remove (L, -2);
+
+	return TRUE;
+}
+
+/* Saves value on the top of the stack leaving it there */
+static void
+lua_task_set_cached (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	struct lua_task_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache == NULL) {
+		cache = rspamd_mempool_alloc (task->task_pool, sizeof (*cache));
+		/* Registry is shared by all threads of the state */
+		cache->L = task->cfg->lua_state;
+		lua_newtable (L);
+		cache->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		rspamd_mempool_set_variable (task->task_pool, LUA_TASK_CACHE_VAR,
+				cache, lua_task_cache_dtor);
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_pushvalue (L, -2);
+	lua_setfield (L, -2, key);
+	lua_pop (L, 1);
+}
+
 struct lua_tree_cb_data {
 	lua_State *L;
 	int i;
@@ -982,12 +1093,22 @@ lua_task_get_urls (lua_State * L)
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct lua_tree_cb_data cb;
 	gboolean need_emails = FALSE;
+	gchar key[64];
 
 	if (task) {
 		if (lua_gettop (L) >= 2) {
 			need_emails = lua_toboolean (L, 2);
 		}
 
+		/* Urls could be added by redirectors during checks */
+		rspamd_snprintf (key, sizeof (key), "urls:%d:%ud:%ud", need_emails,
+				g_hash_table_size (task->urls),
+				g_hash_table_size (task->emails));
+
+		if (lua_task_get_cached (L, task, key)) {
+			return 1;
+		}
+
 		lua_newtable (L);
 		cb.i = 1;
 		cb.L = L;
@@ -996,6 +1117,8 @@ lua_task_get_urls (lua_State * L)
 		if (need_emails) {
 			g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
 		}
+
+		lua_task_set_cached (L, task, key);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1077,8 +1200,16 @@ lua_task_get_text_parts (lua_State * L)
 	guint i;
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct mime_text_part *part, **ppart;
+	gchar key[32];
 
 	if (task != NULL) {
+		rspamd_snprintf (key, sizeof (key), "text_parts:%ud",
+				task->text_parts->len);
+
+		if (lua_task_get_cached (L, task, key)) {
+			return 1;
+		}
+
 		lua_newtable (L);
 
 		for (i = 0; i < task->text_parts->len; i ++) {
@@ -1089,6 +1220,8 @@ lua_task_get_text_parts (lua_State * L)
 			/* Make it array */
 			lua_rawseti (L, -2, i + 1);
 		}
+
+		lua_task_set_cached (L, task, key);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1308,6 +1441,8 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 	gboolean strong = FALSE;
 	struct rspamd_task *task = lua_check_task (L, 1);
 	const gchar *name;
+	gchar key[256];
+	gint ret;
 
 	name = luaL_checkstring (L, 2);
 
@@ -1316,8 +1451,26 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 			strong = lua_toboolean (L, 3);
 		}
 
-		return rspamd_lua_push_header (L, task->raw_headers, name,
+		if (!full || strlen (name) > sizeof (key) - 32) {
+			/* Plain strings are cheap to push */
+			return rspamd_lua_push_header (L, task->raw_headers, name,
+					strong, full, raw);
+		}
+
+		rspamd_snprintf (key, sizeof (key), "header_full:%d:%s", strong, name);
+
+		if (lua_task_get_cached (L, task, key)) {
+			return 1;
+		}
+
+		ret = rspamd_lua_push_header (L, task->raw_headers, name,
 				strong, full, raw);
+
+		if (!lua_isnil (L, -1)) {
+			lua_task_set_cached (L, task, key);
+		}
+
+		return ret;
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1368,13 +1521,26 @@ lua_task_get_received_headers (lua_State * L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct received_header *rh;
-	guint i, k = 1;
+	guint i, k = 1, max;
+	gchar key[32];
 
 	if (task) {
+		max = task->received->len;
+
+		if (lua_isnumber (L, 2)) {
+			max = MIN (max, lua_tonumber (L, 2));
+		}
+
+		rspamd_snprintf (key, sizeof (key), "received:%ud", max);
+
+		if (lua_task_get_cached (L, task, key)) {
+			return 1;
+		}
+
 		lua_newtable (L);
 
-		for (i = 0; i < task->received->len; i ++) {
-			rh = g_ptr_array_index (task->received, i);
+		for (i = 0; i < max; i ++) {
+			rh = rspamd_message_get_received (task, i);
 
 			if (rh->is_error || G_UNLIKELY (
 					rh->from_ip == NULL &&
@@ -1396,6 +1562,8 @@ lua_task_get_received_headers (lua_State * L)
 			rspamd_lua_table_set (L, "by_hostname", rh->by_hostname);
 			lua_rawseti (L, -2, k ++);
 		}
+
+		lua_task_set_cached (L, task, key);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1600,6 +1768,7 @@ lua_task_get_recipients (lua_State *L)
 	InternetAddressList *addrs = NULL;
 	GPtrArray *ptrs = NULL;
 	gint what = 0;
+	gchar key[64];
 
 	if (task) {
 		if (lua_gettop (L) == 2) {
@@ -1628,14 +1797,31 @@ lua_task_get_recipients (lua_State *L)
 		}
 
 		if (addrs) {
-			lua_push_internet_address_list (L, addrs);
+			rspamd_snprintf (key, sizeof (key), "rcpt_mime:%p:%d", addrs,
+					internet_address_list_length (addrs));
 		}
 		else if (ptrs) {
-			lua_push_emails_address_list (L, ptrs);
+			rspamd_snprintf (key, sizeof (key), "rcpt_smtp:%p:%ud", ptrs,
+					ptrs->len);
 		}
 		else {
 			lua_pushnil (L);
+
+			return 1;
+		}
+
+		if (lua_task_get_cached (L, task, key)) {
+			return 1;
+		}
+
+		if (addrs) {
+			lua_push_internet_address_list (L, addrs);
+		}
+		else {
+			lua_push_emails_address_list (L, ptrs);
 		}
+
+		lua_task_set_cached (L, task, key);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -2060,7 +2246,8 @@ lua_push_symbol_result (lua_State *L,
 
 	metric_res = g_hash_table_lookup (task->results, metric->name);
 	if (metric_res) {
-		if ((s = g_hash_table_lookup (metric_res->symbols, symbol)) != NULL) {
+		if ((s = rspamd_metric_result_find_symbol (metric_res,
+				symbol)) != NULL) {
 			j = 1;
 			lua_newtable (L);
 			lua_pushstring (L, "metric");
@@ -2164,7 +2351,7 @@ lua_task_has_symbol (lua_State *L)
 		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 
 		if (mres) {
-			found = g_hash_table_lookup (mres->symbols, symbol) != NULL;
+			found = rspamd_metric_result_find_symbol (mres, symbol) != NULL;
 		}
 
 		lua_pushboolean (L, found);
@@ -2181,20 +2368,19 @@ lua_task_get_symbols (lua_State *L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct metric_result *mres;
-	gint i = 1;
-	GHashTableIter it;
-	gpointer k, v;
+	struct symbol *s;
+	guint i;
 
 	if (task) {
 		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 
 		if (mres) {
-			lua_createtable (L, g_hash_table_size (mres->symbols), 0);
-			g_hash_table_iter_init (&it, mres->symbols);
+			lua_createtable (L, mres->symbols->len, 0);
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				lua_pushstring (L, k);
-				lua_rawseti (L, -2, i ++);
+			for (i = 0; i < mres->symbols->len; i ++) {
+				s = g_ptr_array_index (mres->symbols, i);
+				lua_pushstring (L, s->name);
+				lua_rawseti (L, -2, i + 1);
 			}
 		}
 		else {
@@ -2213,22 +2399,19 @@ lua_task_get_symbols_numeric (lua_State *L)
 {
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct metric_result *mres;
-	gint i = 1, id;
-	GHashTableIter it;
-	gpointer k, v;
+	struct symbol *s;
+	guint i;
 
 	if (task) {
 		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
 
 		if (mres) {
-			lua_createtable (L, g_hash_table_size (mres->symbols), 0);
-			g_hash_table_iter_init (&it, mres->symbols);
+			lua_createtable (L, mres->symbols->len, 0);
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				id = rspamd_symbols_cache_find_symbol (task->cfg->cache,
-						k);
-				lua_pushnumber (L, id);
-				lua_rawseti (L, -2, i++);
+			for (i = 0; i < mres->symbols->len; i ++) {
+				s = g_ptr_array_index (mres->symbols, i);
+				lua_pushnumber (L, s->id);
+				lua_rawseti (L, -2, i + 1);
 			}
 		}
 		else {
@@ -2493,6 +2676,7 @@ lua_task_has_flag (lua_State *L)
 		LUA_TASK_GET_FLAG (flag, "learn_ham", RSPAMD_TASK_FLAG_LEARN_HAM);
 		LUA_TASK_GET_FLAG (flag, "broken_headers",
 				RSPAMD_TASK_FLAG_BROKEN_HEADERS);
+		LUA_TASK_GET_FLAG (flag, "limited", RSPAMD_TASK_FLAG_LIMITED);
 
 		if (!found) {
 			msg_warn_task ("unknown flag requested: %s", flag);
@@ -2555,6 +2739,10 @@ lua_task_get_flags (lua_State *L)
 					lua_pushstring (L, "learn_ham");
 					lua_rawseti (L, -2, idx++);
 					break;
+				case RSPAMD_TASK_FLAG_LIMITED:
+					lua_pushstring (L, "limited");
+					lua_rawseti (L, -2, idx++);
+					break;
 				default:
 					break;
 				}
@@ -2749,7 +2937,7 @@ lua_task_process_regexp (lua_State *L)
 	 */
 	if (task != NULL) {
 		if (!rspamd_lua_parse_table_arguments (L, 2, &err,
-					"*re=U{regexp};*type=S;header=V;strong=B",
+					"*re=U{regexp};type=S;header=V;strong=B",
 					&re, &type_str, &header_len, &header_str,
 					&strong)) {
 			msg_err_task ("cannot get parameters list: %e", err);
@@ -2759,9 +2947,12 @@ lua_task_process_regexp (lua_State *L)
 			}
 		}
 		else {
-			type = rspamd_re_cache_type_from_string (type_str);
+			if (type_str) {
+				type = rspamd_re_cache_type_from_string (type_str);
+			}
 
-			if ((type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER)
+			if (type_str &&
+					(type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER)
 					&& header_str == NULL) {
 				msg_err_task (
 						"header argument is mandatory for header/rawheader regexps");
@@ -2897,7 +3088,7 @@ lua_image_get_size (lua_State *L)
 	struct rspamd_image *img = lua_check_image (L);
 
 	if (img != NULL) {
-		lua_pushinteger (L, img->data->len);
+		lua_pushinteger (L, rspamd_image_get_data (img)->len);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -2970,6 +3161,125 @@ lua_text_ptr (lua_State *L)
 	return 1;
 }
 
+/*
+ * Returns a slice of text in the same manner as `string.sub` does, slices of
+ * texts that do not own their memory refer to the same memory
+ */
+static gint
+lua_text_sub (lua_State *L)
+{
+	struct rspamd_lua_text *t = lua_check_text (L, 1), *nt;
+	gint64 start, end;
+	gchar *cpy;
+
+	if (t == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	start = luaL_optnumber (L, 2, 1);
+	end = luaL_optnumber (L, 3, -1);
+
+	if (start < 0) {
+		start += (gint64)t->len + 1;
+	}
+
+	if (end < 0) {
+		end += (gint64)t->len + 1;
+	}
+
+	if (start < 1) {
+		start = 1;
+	}
+
+	if (end > (gint64)t->len) {
+		end = t->len;
+	}
+
+	nt = lua_newuserdata (L, sizeof (*nt));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+
+	if (start > end) {
+		nt->start = t->start;
+		nt->len = 0;
+		nt->own = FALSE;
+	}
+	else if (t->own) {
+		/* Owned memory could be freed before the slice */
+		nt->len = end - start + 1;
+		cpy = g_malloc (nt->len);
+		memcpy (cpy, t->start + start - 1, nt->len);
+		nt->start = cpy;
+		nt->own = TRUE;
+	}
+	else {
+		nt->start = t->start + start - 1;
+		nt->len = end - start + 1;
+		nt->own = FALSE;
+	}
+
+	return 1;
+}
+
+static gint
+lua_text_cmp (struct rspamd_lua_text *t1, struct rspamd_lua_text *t2)
+{
+	gint ret;
+
+	ret = memcmp (t1->start, t2->start, MIN (t1->len, t2->len));
+
+	if (ret == 0) {
+		ret = (t1->len > t2->len) - (t1->len < t2->len);
+	}
+
+	return ret;
+}
+
+static gint
+lua_text_eq (lua_State *L)
+{
+	struct rspamd_lua_text *t1 = lua_check_text (L, 1),
+			*t2 = lua_check_text (L, 2);
+
+	if (t1 == NULL || t2 == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, t1->len == t2->len &&
+			memcmp (t1->start, t2->start, t1->len) == 0);
+
+	return 1;
+}
+
+static gint
+lua_text_lt (lua_State *L)
+{
+	struct rspamd_lua_text *t1 = lua_check_text (L, 1),
+			*t2 = lua_check_text (L, 2);
+
+	if (t1 == NULL || t2 == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, lua_text_cmp (t1, t2) < 0);
+
+	return 1;
+}
+
+static gint
+lua_text_le (lua_State *L)
+{
+	struct rspamd_lua_text *t1 = lua_check_text (L, 1),
+			*t2 = lua_check_text (L, 2);
+
+	if (t1 == NULL || t2 == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, lua_text_cmp (t1, t2) <= 0);
+
+	return 1;
+}
+
 static gint
 lua_text_gc (lua_State *L)
 {
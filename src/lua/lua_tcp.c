@@ -66,6 +66,7 @@ struct lua_tcp_cbdata {
 	GString *in;
 	gchar *stop_pattern;
 	struct rspamd_async_watcher *w;
+	struct rspamd_lua_thread *thread;
 	struct event ev;
 	gint fd;
 	gint cbref;
@@ -127,6 +128,15 @@ lua_tcp_push_error (struct lua_tcp_cbdata *cbd, const char *err, ...)
 {
 	va_list ap;
 
+	if (cbd->thread) {
+		va_start (ap, err);
+		lua_pushvfstring (cbd->thread->L, err, ap);
+		va_end (ap);
+		rspamd_lua_thread_resume (cbd->thread, 1);
+
+		return;
+	}
+
 	va_start (ap, err);
 	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	lua_pushvfstring (cbd->L, err, ap);
@@ -142,20 +152,26 @@ static void
 lua_tcp_push_data (struct lua_tcp_cbdata *cbd, const gchar *str, gsize len)
 {
 	struct rspamd_lua_text *t;
+	lua_State *L = cbd->thread ? cbd->thread->L : cbd->L;
 
-	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
+	if (!cbd->thread) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	}
 	/* Error */
-	lua_pushnil (cbd->L);
+	lua_pushnil (L);
 	/* Body */
-	t = lua_newuserdata (cbd->L, sizeof (*t));
-	rspamd_lua_setclass (cbd->L, "rspamd{text}", -1);
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
 	t->start = str;
 	t->len = len;
 	t->own = FALSE;
 
-	if (lua_pcall (cbd->L, 2, 0, 0) != 0) {
-		msg_info ("callback call failed: %s", lua_tostring (cbd->L, -1));
-		lua_pop (cbd->L, 1);
+	if (cbd->thread) {
+		rspamd_lua_thread_resume (cbd->thread, 2);
+	}
+	else if (lua_pcall (L, 2, 0, 0) != 0) {
+		msg_info ("callback call failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
 	}
 }
 
@@ -431,6 +447,10 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, rspamd_mempool_t *pool,
  * - `timeout`: floating point value that specifies timeout for IO operations in seconds
  * - `partial`: boolean flag that specifies that callback should be called on any data portion received
  * - `stop_pattern`: stop reading on finding a certain pattern (e.g. \r\n.\r\n for smtp)
+ *
+ * If `callback` is omitted in a coroutine (e.g. in a symbol callback) for a
+ * request with `task` and without `partial`, then the coroutine is suspended
+ * until the reply and `err, data` are returned instead
  * @return {boolean} true if request has been sent
  */
 static gint
@@ -449,7 +469,8 @@ lua_tcp_request (lua_State *L)
 	struct iovec *iov = NULL;
 	guint niov = 0, total_out;
 	gdouble timeout = default_tcp_timeout;
-	gboolean partial = FALSE, do_shutdown = FALSE;
+	gboolean partial = FALSE, do_shutdown = FALSE, ret;
+	struct rspamd_lua_thread *thread = NULL;
 
 	if (lua_type (L, 1) == LUA_TTABLE) {
 		lua_pushstring (L, "host");
@@ -462,15 +483,12 @@ lua_tcp_request (lua_State *L)
 		port = luaL_checknumber (L, -1);
 		lua_pop (L, 1);
 
-		lua_pushstring (L, "callback");
+		lua_pushstring (L, "partial");
 		lua_gettable (L, -2);
-		if (host == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
-			lua_pop (L, 1);
-			msg_err ("tcp request has bad params");
-			lua_pushboolean (L, FALSE);
-			return 1;
+		if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			partial = lua_toboolean (L, -1);
 		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		lua_pop (L, 1);
 
 		lua_pushstring (L, "task");
 		lua_gettable (L, -2);
@@ -483,6 +501,27 @@ lua_tcp_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "callback");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) != LUA_TFUNCTION && task != NULL && !partial) {
+			/* Suspend the caller if it is possible */
+			thread = rspamd_lua_thread_current (L);
+		}
+		if (host == NULL ||
+				(lua_type (L, -1) != LUA_TFUNCTION && thread == NULL)) {
+			lua_pop (L, 1);
+			msg_err ("tcp request has bad params");
+			lua_pushboolean (L, FALSE);
+			return 1;
+		}
+		if (thread) {
+			lua_pop (L, 1);
+			cbref = -1;
+		}
+		else {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+
 		if (task == NULL) {
 			lua_pushstring (L, "ev_base");
 			lua_gettable (L, -2);
@@ -539,13 +578,6 @@ lua_tcp_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
-		lua_pushstring (L, "partial");
-		lua_gettable (L, -2);
-		if (lua_type (L, -1) == LUA_TBOOLEAN) {
-			partial = lua_toboolean (L, -1);
-		}
-		lua_pop (L, 1);
-
 		lua_pushstring (L, "shutdown");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TBOOLEAN) {
@@ -615,8 +647,9 @@ lua_tcp_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_callback_state (L);
 	cbd->cbref = cbref;
+	cbd->thread = thread;
 	cbd->ev_base = ev_base;
 	msec_to_tv (timeout, &cbd->tv);
 	cbd->fd = -1;
@@ -645,28 +678,45 @@ lua_tcp_request (lua_State *L)
 		/* Host is numeric IP, no need to resolve */
 		if (!lua_tcp_make_connection (cbd)) {
 			lua_tcp_maybe_free (cbd);
-			lua_pushboolean (L, FALSE);
+
+			if (thread) {
+				lua_pushstring (L, "cannot connect to the host");
+			}
+			else {
+				lua_pushboolean (L, FALSE);
+			}
 
 			return 1;
 		}
 	}
 	else {
 		if (task == NULL) {
-			if (!make_dns_request (resolver, session, NULL, lua_tcp_dns_handler, cbd,
-					RDNS_REQUEST_A, host)) {
-				lua_tcp_push_error (cbd, "cannot resolve host: %s", host);
-				lua_tcp_maybe_free (cbd);
-			}
+			ret = make_dns_request (resolver, session, NULL, lua_tcp_dns_handler,
+					cbd, RDNS_REQUEST_A, host);
 		}
 		else {
-			if (!make_dns_request_task (task, lua_tcp_dns_handler, cbd,
-					RDNS_REQUEST_A, host)) {
-				lua_tcp_push_error (cbd, "cannot resolve host: %s", host);
+			ret = make_dns_request_task (task, lua_tcp_dns_handler, cbd,
+					RDNS_REQUEST_A, host);
+		}
+
+		if (!ret) {
+			if (thread) {
+				/* Thread is still running, so the error is just returned */
 				lua_tcp_maybe_free (cbd);
+				lua_pushfstring (L, "cannot resolve host: %s", host);
+
+				return 1;
 			}
+
+			lua_tcp_push_error (cbd, "cannot resolve host: %s", host);
+			lua_tcp_maybe_free (cbd);
 		}
 	}
 
+	if (thread) {
+		return rspamd_lua_thread_yield (thread, 0);
+	}
+
 	lua_pushboolean (L, TRUE);
 	return 1;
 }
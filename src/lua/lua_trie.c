@@ -16,6 +16,7 @@
 #include "lua_common.h"
 #include "message.h"
 #include "libutil/multipattern.h"
+#include "cryptobox.h"
 
 /***
  * @module rspamd_trie
@@ -35,6 +36,11 @@ local function trie_callback(number, pos)
 end
 
 trie:match('some big text', trie_callback)
+-- Without a callback numbers of the matched patterns are returned
+local matched = trie:match('some big text')
+ *
+ * Tries with the same patterns share a single compiled matcher, which is also
+ * loaded from the hyperscan cache when it is configured.
  */
 
 /* Suffix trie */
@@ -57,22 +63,48 @@ static const struct luaL_reg trielib_f[] = {
 	{NULL, NULL}
 };
 
-static struct rspamd_multipattern *
+struct rspamd_lua_trie {
+	struct rspamd_multipattern *mp;
+	gchar *hash; /* Key in lua_tries */
+	ref_entry_t ref;
+};
+
+struct lua_trie_cbdata {
+	lua_State *L;
+	guchar *seen; /* Patterns already added to the result in collect mode */
+	gint tbl; /* Stack position of the result table in collect mode */
+	guint nfound;
+	gboolean collect;
+};
+
+/* Compiled tries indexed by hash of their patterns */
+static GHashTable *lua_tries = NULL;
+
+static struct rspamd_lua_trie *
 lua_check_trie (lua_State * L, gint idx)
 {
-	void *ud = luaL_checkudata (L, 1, "rspamd{trie}");
+	void *ud = luaL_checkudata (L, idx, "rspamd{trie}");
+
+	luaL_argcheck (L, ud != NULL, idx, "'trie' expected");
+	return ud ? *((struct rspamd_lua_trie **)ud) : NULL;
+}
 
-	luaL_argcheck (L, ud != NULL, 1, "'trie' expected");
-	return ud ? *((struct rspamd_multipattern **)ud) : NULL;
+static void
+lua_trie_dtor (struct rspamd_lua_trie *trie)
+{
+	g_hash_table_remove (lua_tries, trie->hash);
+	rspamd_multipattern_destroy (trie->mp);
+	g_free (trie->hash);
+	g_slice_free1 (sizeof (*trie), trie);
 }
 
 static gint
 lua_trie_destroy (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct rspamd_lua_trie *trie = lua_check_trie (L, 1);
 
 	if (trie) {
-		rspamd_multipattern_destroy (trie);
+		REF_RELEASE (trie);
 	}
 
 	return 0;
@@ -80,14 +112,22 @@ lua_trie_destroy (lua_State *L)
 
 /***
  * function trie.create(patterns)
- * Creates new trie data structure
+ * Creates new trie data structure, tries created from the same patterns share
+ * the compiled matcher
  * @param {table} array of string patterns
  * @return {trie} new trie object
  */
 static gint
 lua_trie_create (lua_State *L)
 {
-	struct rspamd_multipattern *trie, **ptrie;
+	struct rspamd_lua_trie *trie, **ptrie;
+	struct rspamd_multipattern *mp;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash[rspamd_cryptobox_HASHBYTES];
+	gchar hexhash[rspamd_cryptobox_HASHBYTES * 2 + 1];
+	const gchar *pat;
+	gsize patlen;
+	guint64 hlen;
 	gint npat = 0, flags = RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_GLOB;
 	GError *err = NULL;
 
@@ -96,45 +136,75 @@ lua_trie_create (lua_State *L)
 		lua_pushnil (L);
 	}
 	else {
+		if (lua_tries == NULL) {
+			lua_tries = g_hash_table_new (g_str_hash, g_str_equal);
+		}
+
+		rspamd_cryptobox_hash_init (&st, NULL, 0);
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&flags,
+				sizeof (flags));
 		lua_pushvalue (L, 1);
 		lua_pushnil (L);
 
 		while (lua_next (L, -2) != 0) {
 			if (lua_isstring (L, -1)) {
+				pat = lua_tolstring (L, -1, &patlen);
+				/* Length is hashed as well to separate adjacent patterns */
+				hlen = patlen;
+				rspamd_cryptobox_hash_update (&st, (const guchar *)&hlen,
+						sizeof (hlen));
+				rspamd_cryptobox_hash_update (&st, pat, patlen);
 				npat ++;
 			}
 
 			lua_pop (L, 1);
 		}
 
-		trie = rspamd_multipattern_create_sized (npat, flags);
-		lua_pushnil (L);
+		rspamd_cryptobox_hash_final (&st, hash);
+		rspamd_snprintf (hexhash, sizeof (hexhash), "%*xs",
+				(gint)sizeof (hash), hash);
+		trie = g_hash_table_lookup (lua_tries, hexhash);
 
-		while (lua_next (L, -2) != 0) {
-			if (lua_isstring (L, -1)) {
-				const gchar *pat;
-				gsize patlen;
+		if (trie) {
+			REF_RETAIN (trie);
+		}
+		else {
+			mp = rspamd_multipattern_create_sized (npat, flags);
+			lua_pushnil (L);
 
-				pat = lua_tolstring (L, -1, &patlen);
-				rspamd_multipattern_add_pattern_len (trie, pat, patlen, flags);
+			while (lua_next (L, -2) != 0) {
+				if (lua_isstring (L, -1)) {
+					pat = lua_tolstring (L, -1, &patlen);
+					rspamd_multipattern_add_pattern_len (mp, pat, patlen, flags);
+				}
+
+				lua_pop (L, 1);
 			}
 
-			lua_pop (L, 1);
+			if (!rspamd_multipattern_compile (mp, &err)) {
+				msg_err ("cannot compile multipattern: %e", err);
+				g_error_free (err);
+				rspamd_multipattern_destroy (mp);
+			}
+			else {
+				trie = g_slice_alloc0 (sizeof (*trie));
+				trie->mp = mp;
+				trie->hash = g_strdup (hexhash);
+				REF_INIT_RETAIN (trie, lua_trie_dtor);
+				g_hash_table_insert (lua_tries, trie->hash, trie);
+			}
 		}
 
 		lua_pop (L, 1); /* table */
 
-		if (!rspamd_multipattern_compile (trie, &err)) {
-			msg_err ("cannot compile multipattern: %e", err);
-			g_error_free (err);
-			rspamd_multipattern_destroy (trie);
-			lua_pushnil (L);
-		}
-		else {
+		if (trie) {
 			ptrie = lua_newuserdata (L, sizeof (void *));
 			rspamd_lua_setclass (L, "rspamd{trie}", -1);
 			*ptrie = trie;
 		}
+		else {
+			lua_pushnil (L);
+		}
 	}
 
 	return 1;
@@ -149,9 +219,21 @@ lua_trie_callback (struct rspamd_multipattern *mp,
 		gsize len,
 		void *context)
 {
-	lua_State *L = context;
+	struct lua_trie_cbdata *cbd = context;
+	lua_State *L = cbd->L;
 	gint ret;
 
+	if (cbd->collect) {
+		/* Each pattern is reported once */
+		if (!cbd->seen[strnum]) {
+			cbd->seen[strnum] = 1;
+			lua_pushnumber (L, strnum + 1);
+			lua_rawseti (L, cbd->tbl, ++cbd->nfound);
+		}
+
+		return 0;
+	}
+
 	/* Function */
 	lua_pushvalue (L, 3);
 	lua_pushnumber (L, strnum + 1);
@@ -171,18 +253,68 @@ lua_trie_callback (struct rspamd_multipattern *mp,
 	return ret;
 }
 
+static gint
+lua_trie_vector_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint textpos,
+		guint input,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	return lua_trie_callback (mp, strnum, match_start, textpos, text, len,
+			context);
+}
+
 /*
- * We assume that callback argument is at pos 3 and icase is in position 4
+ * We assume that callback argument is at pos 3 and icase is in position 4,
+ * if there is no callback then matches are collected into a table pushed
+ * on the stack
  */
+static void
+lua_trie_cbdata_init (lua_State *L, struct rspamd_lua_trie *trie,
+		struct lua_trie_cbdata *cbd)
+{
+	memset (cbd, 0, sizeof (*cbd));
+	cbd->L = L;
+
+	if (lua_type (L, 3) != LUA_TFUNCTION) {
+		cbd->collect = TRUE;
+		cbd->seen = g_malloc0 (rspamd_multipattern_get_npatterns (trie->mp) + 1);
+		lua_newtable (L);
+		cbd->tbl = lua_gettop (L);
+	}
+}
+
+static gint
+lua_trie_push_result (lua_State *L, struct lua_trie_cbdata *cbd,
+		gboolean found)
+{
+	if (cbd->collect) {
+		g_free (cbd->seen);
+
+		if (cbd->nfound == 0) {
+			lua_pop (L, 1);
+			lua_pushboolean (L, FALSE);
+		}
+	}
+	else {
+		lua_pushboolean (L, found);
+	}
+
+	return 1;
+}
+
 static gint
-lua_trie_search_str (lua_State *L, struct rspamd_multipattern *trie,
-		const gchar *str, gsize len)
+lua_trie_search_str (lua_State *L, struct rspamd_lua_trie *trie,
+		const gchar *str, gsize len, struct lua_trie_cbdata *cbd)
 {
 	gint ret;
 	guint nfound = 0;
 
-	if ((ret = rspamd_multipattern_lookup (trie, str, len,
-			lua_trie_callback, L, &nfound)) == 0) {
+	if ((ret = rspamd_multipattern_lookup (trie->mp, str, len,
+			lua_trie_callback, cbd, &nfound)) == 0) {
 		return nfound;
 	}
 
@@ -190,117 +322,168 @@ lua_trie_search_str (lua_State *L, struct rspamd_multipattern *trie,
 }
 
 /***
- * @method trie:match(input, cb[, caseless])
+ * @method trie:match(input[, cb[, caseless]])
  * Search for patterns in `input` invoking `cb` optionally ignoring case
- * @param {table or string} input one or several (if `input` is an array) strings of input text
+ * @param {table or string or text} input one or several (if `input` is a table, its keys are ignored) strings or `rspamd{text}` objects of input text, other values in a table raise an error
  * @param {function} cb callback called on each pattern match in form `function (idx, pos)` where `idx` is a numeric index of pattern (starting from 1) and `pos` is a numeric offset where the pattern ends
  * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @return {boolean or table} `true` if any pattern has been found (`cb` might be called multiple times however); if `cb` is not a function, then an array of indices of the matched patterns (each index once, in order of matches) is returned, or `false` if nothing has been found
  */
 static gint
 lua_trie_match (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
-	const gchar *text;
-	gsize len;
+	struct rspamd_lua_trie *trie = lua_check_trie (L, 1);
+	struct lua_trie_cbdata cbd;
+	const gchar *text, **texts;
+	gsize len, *lens;
+	guint i, n = 0, nfound = 0;
 	gboolean found = FALSE;
 
-	if (trie) {
-		if (lua_type (L, 2) == LUA_TTABLE) {
-			lua_pushvalue (L, 2);
-			lua_pushnil (L);
+	if (!trie) {
+		lua_pushboolean (L, FALSE);
+		return 1;
+	}
 
-			while (lua_next (L, -2) != 0) {
-				if (lua_isstring (L, -1)) {
-					text = lua_tolstring (L, -1, &len);
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		/* Inputs are independent, so any keys could be used */
+		lua_pushnil (L);
 
-					if (lua_trie_search_str (L, trie, text, len)) {
-						found = TRUE;
-					}
-				}
-				lua_pop (L, 1);
+		while (lua_next (L, 2) != 0) {
+			if (lua_check_text_or_string (L, -1, &len) == NULL) {
+				return luaL_error (L, "invalid input for trie:match: %s",
+						lua_typename (L, lua_type (L, -1)));
 			}
 
-			lua_pop (L, 1); /* table */
+			n ++;
+			lua_pop (L, 1);
 		}
-		else if (lua_type (L, 2) == LUA_TSTRING) {
-			text = lua_tolstring (L, 2, &len);
+	}
+
+	lua_trie_cbdata_init (L, trie, &cbd);
+
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		if (n > 0) {
+			texts = g_malloc0 (n * sizeof (*texts));
+			lens = g_malloc0 (n * sizeof (*lens));
+			i = 0;
+
+			/* Strings and texts are kept alive by the table itself */
+			lua_pushnil (L);
+
+			while (lua_next (L, 2) != 0) {
+				texts[i] = lua_check_text_or_string (L, -1, &lens[i]);
+				i ++;
+				lua_pop (L, 1);
+			}
 
-			if (lua_trie_search_str (L, trie, text, len)) {
+			if (rspamd_multipattern_lookup_vector (trie->mp, texts, lens, n,
+					lua_trie_vector_callback, &cbd, &nfound) != 0 ||
+					nfound > 0) {
 				found = TRUE;
 			}
+
+			g_free (texts);
+			g_free (lens);
+		}
+	}
+	else if ((text = lua_check_text_or_string (L, 2, &len)) != NULL) {
+		if (lua_trie_search_str (L, trie, text, len, &cbd)) {
+			found = TRUE;
 		}
 	}
 
-	lua_pushboolean (L, found);
-	return 1;
+	return lua_trie_push_result (L, &cbd, found);
 }
 
 /***
- * @method trie:search_mime(task, cb[, caseless])
+ * @method trie:search_mime(task[, cb[, caseless]])
  * This is a helper mehthod to search pattern within text parts of a message in rspamd task
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
  * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @return {boolean or table} `true` if any pattern has been found (`cb` might be called multiple times however) or matched patterns if `cb` is not a function @see trie:match
  */
 static gint
 lua_trie_search_mime (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct rspamd_lua_trie *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_trie_cbdata cbd;
 	struct mime_text_part *part;
-	const gchar *text;
-	gsize len, i;
+	const gchar **texts;
+	gsize *lens;
+	guint i, n = 0, nfound = 0;
 	gboolean found = FALSE;
 
-	if (trie) {
+	if (!trie) {
+		lua_pushboolean (L, FALSE);
+		return 1;
+	}
+
+	lua_trie_cbdata_init (L, trie, &cbd);
+
+	if (task && task->text_parts->len > 0) {
+		texts = g_malloc (task->text_parts->len * sizeof (*texts));
+		lens = g_malloc (task->text_parts->len * sizeof (*lens));
+
 		for (i = 0; i < task->text_parts->len; i ++) {
 			part = g_ptr_array_index (task->text_parts, i);
 
 			if (!IS_PART_EMPTY (part) && part->content != NULL) {
-				text = part->content->data;
-				len = part->content->len;
-
-				if (lua_trie_search_str (L, trie, text, len) != 0) {
-					found = TRUE;
-				}
+				texts[n] = part->content->data;
+				lens[n] = part->content->len;
+				n ++;
 			}
 		}
+
+		/* All parts are scanned in a single call */
+		if (rspamd_multipattern_lookup_vector (trie->mp, texts, lens, n,
+				lua_trie_vector_callback, &cbd, &nfound) != 0 || nfound > 0) {
+			found = TRUE;
+		}
+
+		g_free (texts);
+		g_free (lens);
 	}
 
-	lua_pushboolean (L, found);
-	return 1;
+	return lua_trie_push_result (L, &cbd, found);
 }
 
 /***
- * @method trie:search_rawmsg(task, cb[, caseless])
+ * @method trie:search_rawmsg(task[, cb[, caseless]])
  * This is a helper mehthod to search pattern within the whole undecoded content of rspamd task
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
  * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @return {boolean or table} `true` if any pattern has been found (`cb` might be called multiple times however) or matched patterns if `cb` is not a function @see trie:match
  */
 static gint
 lua_trie_search_rawmsg (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct rspamd_lua_trie *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_trie_cbdata cbd;
 	const gchar *text;
 	gsize len;
 	gboolean found = FALSE;
 
-	if (trie) {
+	if (!trie) {
+		lua_pushboolean (L, FALSE);
+		return 1;
+	}
+
+	lua_trie_cbdata_init (L, trie, &cbd);
+
+	if (task) {
 		text = task->msg.begin;
 		len = task->msg.len;
 
-		if (lua_trie_search_str (L, trie, text, len) != 0) {
+		if (lua_trie_search_str (L, trie, text, len, &cbd) != 0) {
 			found = TRUE;
 		}
 	}
 
-	lua_pushboolean (L, found);
-	return 1;
+	return lua_trie_push_result (L, &cbd, found);
 }
 
 static gint
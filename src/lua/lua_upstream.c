@@ -57,12 +57,14 @@ LUA_FUNCTION_DEF (upstream_list, destroy);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_by_hash);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_round_robin);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_master_slave);
+LUA_FUNCTION_DEF (upstream_list, get_upstream_by_latency);
 
 static const struct luaL_reg upstream_list_m[] = {
 
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_hash),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_round_robin),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_master_slave),
+	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_latency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_upstream_list_destroy},
 	{NULL, NULL}
@@ -133,8 +135,9 @@ lua_upstream_fail (lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional time of the request in seconds used by latency rotation
  */
 static gint
 lua_upstream_ok (lua_State *L)
@@ -142,7 +145,12 @@ lua_upstream_ok (lua_State *L)
 	struct upstream *up = lua_check_upstream (L);
 
 	if (up) {
-		rspamd_upstream_ok (up);
+		if (lua_isnumber (L, 2)) {
+			rspamd_upstream_ok_latency (up, lua_tonumber (L, 2));
+		}
+		else {
+			rspamd_upstream_ok (up);
+		}
 	}
 
 	return 0;
@@ -319,6 +327,37 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method upstream_list:get_upstream_by_latency()
+ * Get the faster of two random upstreams, latency is reported by `upstream:ok(latency)`
+ * @return {upstream} upstream from a list selected by latency
+ */
+static gint
+lua_upstream_list_get_upstream_by_latency (lua_State *L)
+{
+	struct upstream_list *upl;
+	struct upstream *selected, **pselected;
+
+	upl = lua_check_upstream_list (L);
+	if (upl) {
+
+		selected = rspamd_upstream_get (upl, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		if (selected) {
+			pselected = lua_newuserdata (L, sizeof (struct upstream *));
+			rspamd_lua_setclass (L, "rspamd{upstream}", -1);
+			*pselected = selected;
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_upstream_list (lua_State * L)
 {
@@ -20,6 +20,8 @@
 #include "cfg_rcl.h"
 #include "tokenizers/tokenizers.h"
 #include "libserver/url.h"
+#include "email_addr.h"
+#include "cryptobox.h"
 #include "unix-std.h"
 #include <math.h>
 #include <glob.h>
@@ -87,6 +89,27 @@ LUA_FUNCTION_DEF (util, decode_base32);
  * @return {table/strings} list of strings representing words in the text
  */
 LUA_FUNCTION_DEF (util, tokenize_text);
+/***
+ * @function util.tokenize_text_hashes(input[, exceptions[, compat]])
+ * Create tokens from a text just like `tokenize_text` does but return
+ * case insensitive hashes of words instead of strings
+ * @param {text/string} input input data
+ * @param {table} exceptions, a table of pairs containing <start_pos,lenght> of exceptions in the input
+ * @return {table/numbers} list of 32 bit hashes of words in the text
+ */
+LUA_FUNCTION_DEF (util, tokenize_text_hashes);
+/***
+ * @function util.tokenize_text_cb(input, callback[, exceptions[, compat]])
+ * Create tokens from a text and call `callback(word, index)` for each of them.
+ * `word` is a text object that points to the input directly, the same object is
+ * reused for all words, so it is valid during the callback call merely. Iteration
+ * stops if callback returns `false`
+ * @param {text/string} input input data
+ * @param {function} callback function called for each word
+ * @param {table} exceptions, a table of pairs containing <start_pos,lenght> of exceptions in the input
+ * @return {number} number of words processed
+ */
+LUA_FUNCTION_DEF (util, tokenize_text_cb);
 LUA_FUNCTION_DEF (util, process_message);
 /***
  * @function util.tanh(num)
@@ -105,11 +128,12 @@ LUA_FUNCTION_DEF (util, tanh);
 LUA_FUNCTION_DEF (util, parse_html);
 
 /***
- * @function util.levenshtein_distance(s1, s2)
+ * @function util.levenshtein_distance(s1, s2[, max])
  * Returns levenstein distance between two strings
  * @param {string} s1 the first string
  * @param {string} s2 the second string
- * @return {number} number of differences in two strings
+ * @param {number} max if specified, stop comparison when distance is greater than this value
+ * @return {number} number of differences in two strings (or `max + 1` if strings differ more than `max`)
  */
 LUA_FUNCTION_DEF (util, levenshtein_distance);
 
@@ -185,6 +209,23 @@ LUA_FUNCTION_DEF (util, glob);
  */
 LUA_FUNCTION_DEF (util, parse_mail_address);
 
+/***
+ * @function util.parse_dmarc_record(record)
+ * Parses DMARC policy record (a TXT record of `_dmarc.<domain>`) and returns
+ * a table with the following fields:
+ *
+ * - `p`: policy (`none`, `quarantine` or `reject`)
+ * - `sp`: subdomains policy (missing if not specified)
+ * - `adkim`: DKIM alignment mode (`r` or `s`)
+ * - `aspf`: SPF alignment mode (`r` or `s`)
+ * - `pct`: percentage of messages to apply policy to
+ * - `rua`: aggregate reports address (missing if not specified)
+ *
+ * @param {string} record TXT record
+ * @return {table|nil|boolean,string} policy table, nil if the record is not a DMARC record or false and error string if it is not valid
+ */
+LUA_FUNCTION_DEF (util, parse_dmarc_record);
+
 /***
  * @function util.strlen_utf8(str)
  * Returns length of string encoded in utf-8 in characters.
@@ -311,6 +352,8 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, encode_base32),
 	LUA_INTERFACE_DEF (util, decode_base32),
 	LUA_INTERFACE_DEF (util, tokenize_text),
+	LUA_INTERFACE_DEF (util, tokenize_text_hashes),
+	LUA_INTERFACE_DEF (util, tokenize_text_cb),
 	LUA_INTERFACE_DEF (util, tanh),
 	LUA_INTERFACE_DEF (util, parse_html),
 	LUA_INTERFACE_DEF (util, levenshtein_distance),
@@ -321,6 +364,7 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, get_tld),
 	LUA_INTERFACE_DEF (util, glob),
 	LUA_INTERFACE_DEF (util, parse_mail_address),
+	LUA_INTERFACE_DEF (util, parse_dmarc_record),
 	LUA_INTERFACE_DEF (util, strlen_utf8),
 	LUA_INTERFACE_DEF (util, strcasecmp_utf8),
 	LUA_INTERFACE_DEF (util, strcasecmp_ascii),
@@ -531,8 +575,6 @@ lua_util_decode_base64 (lua_State *L)
 	const gchar *s = NULL;
 	gsize inlen, outlen;
 	gboolean zero_copy = FALSE, grab_own = FALSE;
-	gint state = 0;
-	guint save = 0;
 
 	if (lua_type (L, 1) == LUA_TSTRING) {
 		s = luaL_checklstring (L, 1, &inlen);
@@ -554,7 +596,7 @@ lua_util_decode_base64 (lua_State *L)
 	if (s != NULL) {
 		if (zero_copy) {
 			/* Decode in place */
-			outlen = g_base64_decode_step (s, inlen, (guchar *)s, &state, &save);
+			rspamd_cryptobox_base64_decode (s, inlen, (guchar *)s, &outlen);
 			t = lua_newuserdata (L, sizeof (*t));
 			rspamd_lua_setclass (L, "rspamd{text}", -1);
 			t->start = s;
@@ -566,8 +608,8 @@ lua_util_decode_base64 (lua_State *L)
 			rspamd_lua_setclass (L, "rspamd{text}", -1);
 			t->len = (inlen / 4) * 3 + 3;
 			t->start = g_malloc (t->len);
-			outlen = g_base64_decode_step (s, inlen, (guchar *)t->start,
-					&state, &save);
+			rspamd_cryptobox_base64_decode (s, inlen, (guchar *)t->start,
+					&outlen);
 			t->len = outlen;
 			t->own = TRUE;
 		}
@@ -655,22 +697,25 @@ lua_util_decode_base32 (lua_State *L)
 	return 1;
 }
 
-static gint
-lua_util_tokenize_text (lua_State *L)
+/*
+ * Tokenizes text at position 1 using exceptions from `ex_pos` and compat flag
+ * from `compat_pos`, words point to the input that is left on the stack
+ */
+static GArray *
+lua_util_tokenize_input (lua_State *L, gint ex_pos, gint compat_pos)
 {
 	const gchar *in = NULL;
-	gsize len, pos, ex_len, i;
+	gsize len, pos, ex_len;
 	GList *exceptions = NULL, *cur;
 	struct rspamd_lua_text *t;
 	struct process_exception *ex;
 	GArray *res;
-	rspamd_ftok_t *w;
 	gboolean compat = FALSE;
 
 	if (lua_type (L, 1) == LUA_TSTRING) {
 		in = luaL_checklstring (L, 1, &len);
 	}
-	else if (lua_type (L, 1) == LUA_TTABLE) {
+	else if (lua_type (L, 1) == LUA_TUSERDATA) {
 		t = lua_check_text (L, 1);
 
 		if (t) {
@@ -680,12 +725,11 @@ lua_util_tokenize_text (lua_State *L)
 	}
 
 	if (in == NULL) {
-		lua_pushnil (L);
-		return 1;
+		return NULL;
 	}
 
-	if (lua_gettop (L) > 1 && lua_type (L, 2) == LUA_TTABLE) {
-		lua_pushvalue (L, 2);
+	if (lua_gettop (L) >= ex_pos && lua_type (L, ex_pos) == LUA_TTABLE) {
+		lua_pushvalue (L, ex_pos);
 		lua_pushnil (L);
 
 		while (lua_next (L, -2) != 0) {
@@ -710,8 +754,8 @@ lua_util_tokenize_text (lua_State *L)
 		lua_pop (L, 1);
 	}
 
-	if (lua_gettop (L) > 2 && lua_type (L, 3) == LUA_TBOOLEAN) {
-		compat = lua_toboolean (L, 3);
+	if (lua_gettop (L) >= compat_pos && lua_type (L, compat_pos) == LUA_TBOOLEAN) {
+		compat = lua_toboolean (L, compat_pos);
 	}
 
 	if (exceptions) {
@@ -721,27 +765,138 @@ lua_util_tokenize_text (lua_State *L)
 	res = rspamd_tokenize_text ((gchar *)in, len, TRUE, NULL, exceptions, compat,
 			NULL);
 
+	cur = exceptions;
+	while (cur) {
+		ex = cur->data;
+		g_slice_free1 (sizeof (*ex), ex);
+		cur = g_list_next (cur);
+	}
+
+	g_list_free (exceptions);
+
+	return res;
+}
+
+static gint
+lua_util_tokenize_text (lua_State *L)
+{
+	GArray *res;
+	rspamd_ftok_t *w;
+	guint i;
+
+	res = lua_util_tokenize_input (L, 2, 3);
+
 	if (res == NULL) {
 		lua_pushnil (L);
 	}
 	else {
-		lua_newtable (L);
+		lua_createtable (L, res->len, 0);
 
 		for (i = 0; i < res->len; i ++) {
 			w = &g_array_index (res, rspamd_ftok_t, i);
 			lua_pushlstring (L, w->begin, w->len);
 			lua_rawseti (L, -2, i + 1);
 		}
+
+		g_array_free (res, TRUE);
 	}
 
-	cur = exceptions;
-	while (cur) {
-		ex = cur->data;
-		g_slice_free1 (sizeof (*ex), ex);
-		cur = g_list_next (cur);
+	return 1;
+}
+
+static gint
+lua_util_tokenize_text_hashes (lua_State *L)
+{
+	GArray *res;
+	rspamd_ftok_t *w;
+	guint i;
+
+	res = lua_util_tokenize_input (L, 2, 3);
+
+	if (res == NULL) {
+		lua_pushnil (L);
 	}
+	else {
+		lua_createtable (L, res->len, 0);
 
-	g_list_free (exceptions);
+		for (i = 0; i < res->len; i ++) {
+			w = &g_array_index (res, rspamd_ftok_t, i);
+			lua_pushnumber (L, rspamd_fstrhash_lc (w, TRUE));
+			lua_rawseti (L, -2, i + 1);
+		}
+
+		g_array_free (res, TRUE);
+	}
+
+	return 1;
+}
+
+static gint
+lua_util_tokenize_text_cb (lua_State *L)
+{
+	GArray *res;
+	rspamd_ftok_t *w;
+	struct rspamd_lua_text *t;
+	guint i;
+	gint err_idx;
+	GString *tb;
+
+	if (lua_type (L, 2) != LUA_TFUNCTION) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	res = lua_util_tokenize_input (L, 3, 4);
+
+	if (res == NULL) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	lua_pushcfunction (L, &rspamd_lua_traceback);
+	err_idx = lua_gettop (L);
+	/* Single view object for all words */
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->own = FALSE;
+
+	for (i = 0; i < res->len; i ++) {
+		w = &g_array_index (res, rspamd_ftok_t, i);
+		t->start = w->begin;
+		t->len = w->len;
+
+		lua_pushvalue (L, 2);
+		lua_pushvalue (L, err_idx + 1);
+		lua_pushnumber (L, i + 1);
+
+		if (lua_pcall (L, 2, 1, err_idx) != 0) {
+			tb = lua_touserdata (L, -1);
+			msg_err ("call to tokenize callback failed: %v", tb);
+
+			if (tb) {
+				g_string_free (tb, TRUE);
+			}
+
+			lua_pop (L, 1);
+			i ++;
+			break;
+		}
+
+		if (lua_type (L, -1) == LUA_TBOOLEAN && !lua_toboolean (L, -1)) {
+			lua_pop (L, 1);
+			i ++;
+			break;
+		}
+
+		lua_pop (L, 1);
+	}
+
+	/* Text object could be kept by callback, so do not let it point to input */
+	t->start = NULL;
+	t->len = 0;
+	lua_settop (L, err_idx - 1);
+	g_array_free (res, TRUE);
+	lua_pushnumber (L, i);
 
 	return 1;
 }
@@ -810,11 +965,17 @@ lua_util_levenshtein_distance (lua_State *L)
 	gsize s1len, s2len;
 	gint dist = 0;
 
-	s1 = luaL_checklstring (L, 1, &s1len);
-	s2 = luaL_checklstring (L, 2, &s2len);
+	s1 = lua_check_text_or_string (L, 1, &s1len);
+	s2 = lua_check_text_or_string (L, 2, &s2len);
 
 	if (s1 && s2) {
-		dist = rspamd_strings_levenshtein_distance (s1, s1len, s2, s2len);
+		if (lua_type (L, 3) == LUA_TNUMBER) {
+			dist = rspamd_strings_levenshtein_distance_bounded (s1, s1len,
+					s2, s2len, lua_tonumber (L, 3));
+		}
+		else {
+			dist = rspamd_strings_levenshtein_distance (s1, s1len, s2, s2len);
+		}
 	}
 
 	lua_pushnumber (L, dist);
@@ -900,7 +1061,7 @@ lua_util_is_uppercase (lua_State *L)
 	gunichar uc;
 	guint nlc = 0, nuc = 0;
 
-	str = luaL_checklstring (L, 1, &sz);
+	str = lua_check_text_or_string (L, 1, &sz);
 	remain = sz;
 
 	if (str && remain > 0) {
@@ -1004,32 +1165,241 @@ lua_util_glob (lua_State *L)
 	return 1;
 }
 
+static void
+lua_util_push_email_address (lua_State *L, struct rspamd_email_address *addr)
+{
+	gchar *name, *decoded;
+
+	lua_createtable (L, 0, 4);
+
+	if (addr->name_len > 0 &&
+			rspamd_substring_search (addr->name, addr->name_len, "=?", 2) != -1) {
+		/* Names are not decoded by the parser */
+		name = g_strndup (addr->name, addr->name_len);
+		decoded = g_mime_utils_header_decode_phrase (name);
+		rspamd_lua_table_set (L, "name", decoded ? decoded : name);
+		g_free (decoded);
+		g_free (name);
+	}
+	else {
+		lua_pushstring (L, "name");
+		lua_pushlstring (L, addr->name ? addr->name : "", addr->name_len);
+		lua_settable (L, -3);
+	}
+
+	lua_pushstring (L, "addr");
+	lua_pushlstring (L, addr->addr ? addr->addr : "", addr->addr_len);
+	lua_settable (L, -3);
+
+	if ((addr->flags & RSPAMD_EMAIL_ADDR_VALID) &&
+			!(addr->flags & RSPAMD_EMAIL_ADDR_EMPTY)) {
+		lua_pushstring (L, "user");
+		lua_pushlstring (L, addr->user, addr->user_len);
+		lua_settable (L, -3);
+		lua_pushstring (L, "domain");
+		lua_pushlstring (L, addr->domain, addr->domain_len);
+		lua_settable (L, -3);
+	}
+}
+
 static gint
 lua_util_parse_mail_address (lua_State *L)
 {
-	InternetAddressList *ia;
-	const gchar *str = luaL_checkstring (L, 1);
-	gboolean ret = FALSE;
+	GPtrArray *addrs;
+	const gchar *str;
+	gsize len;
+	guint i;
 
-	if (str) {
-		ia = internet_address_list_parse_string (str);
+	str = luaL_checklstring (L, 1, &len);
+	addrs = rspamd_email_address_from_mime (NULL, str, len);
+
+	if (addrs->len > 0) {
+		lua_createtable (L, addrs->len, 0);
+
+		for (i = 0; i < addrs->len; i ++) {
+			lua_util_push_email_address (L, g_ptr_array_index (addrs, i));
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	rspamd_email_address_list_destroy (addrs);
+
+	return 1;
+}
+
+static gboolean
+lua_util_dmarc_token_is (const gchar *s, gsize len, const gchar *tok)
+{
+	gsize toklen = strlen (tok);
+
+	return len == toklen && g_ascii_strncasecmp (s, tok, len) == 0;
+}
+
+static const gchar *
+lua_util_dmarc_token_find (const gchar *s, gsize len, const gchar **toks)
+{
+	while (*toks) {
+		if (lua_util_dmarc_token_is (s, len, *toks)) {
+			return *toks;
+		}
+
+		toks ++;
+	}
+
+	return NULL;
+}
+
+static gint
+lua_util_parse_dmarc_record (lua_State *L)
+{
+	const gchar *rec, *p, *end, *sep, *tag, *val, *canon, *err = NULL;
+	static const gchar *policies[] = {"none", "quarantine", "reject", NULL},
+			*modes[] = {"r", "s", NULL};
+	const gchar *policy = "none", *sp = NULL, *adkim = "r", *aspf = "r";
+	gsize len, taglen, vallen;
+	gboolean first = TRUE, has_rua = FALSE;
+	gulong pct = 100;
+
+	rec = luaL_checklstring (L, 1, &len);
+	p = rec;
+	end = rec + len;
+	lua_createtable (L, 0, 6);
+
+	while (p < end) {
+		/* Separators could be escaped in zone files */
+		while (p < end && (g_ascii_isspace (*p) || *p == ';' || *p == '\\')) {
+			p ++;
+		}
+
+		if (p == end) {
+			break;
+		}
+
+		sep = memchr (p, ';', end - p);
+
+		if (sep == NULL) {
+			sep = end;
+		}
+
+		tag = p;
+		val = memchr (p, '=', sep - p);
+		p = sep;
+
+		if (val == NULL) {
+			if (first) {
+				break;
+			}
+
+			err = "invalid tag";
+			break;
+		}
+
+		taglen = val - tag;
+
+		while (taglen > 0 && g_ascii_isspace (tag[taglen - 1])) {
+			taglen --;
+		}
+
+		val ++;
+
+		while (val < sep && g_ascii_isspace (*val)) {
+			val ++;
+		}
 
-		if (ia != NULL) {
-			ret = TRUE;
+		vallen = sep - val;
+
+		while (vallen > 0 && (g_ascii_isspace (val[vallen - 1]) ||
+				val[vallen - 1] == '\\')) {
+			vallen --;
+		}
+
+		if (first) {
+			/* Version must be the first tag */
+			if (!lua_util_dmarc_token_is (tag, taglen, "v") ||
+					!lua_util_dmarc_token_is (val, vallen, "DMARC1")) {
+				break;
+			}
+
+			first = FALSE;
+		}
+		else if (lua_util_dmarc_token_is (tag, taglen, "p") ||
+				lua_util_dmarc_token_is (tag, taglen, "sp")) {
+			if ((canon = lua_util_dmarc_token_find (val, vallen,
+					policies)) == NULL) {
+				err = "invalid policy";
+				break;
+			}
+
+			if (taglen == 1) {
+				policy = canon;
+			}
+			else {
+				sp = canon;
+			}
+		}
+		else if (lua_util_dmarc_token_is (tag, taglen, "adkim") ||
+				lua_util_dmarc_token_is (tag, taglen, "aspf")) {
+			if ((canon = lua_util_dmarc_token_find (val, vallen,
+					modes)) == NULL) {
+				err = "invalid alignment mode";
+				break;
+			}
 
-			lua_push_internet_address_list (L, ia);
-#ifdef GMIME24
-		g_object_unref (ia);
-#else
-		internet_address_list_destroy (ia);
-#endif
+			if (taglen == 5) {
+				adkim = canon;
+			}
+			else {
+				aspf = canon;
+			}
+		}
+		else if (lua_util_dmarc_token_is (tag, taglen, "pct")) {
+			if (vallen == 0 || !rspamd_strtoul (val, vallen, &pct) ||
+					pct > 100) {
+				err = "invalid percentage";
+				break;
+			}
+		}
+		else if (lua_util_dmarc_token_is (tag, taglen, "rua")) {
+			if (!has_rua && vallen > 0) {
+				lua_pushstring (L, "rua");
+				lua_pushlstring (L, val, vallen);
+				lua_settable (L, -3);
+				has_rua = TRUE;
+			}
 		}
+		/* Other tags are not used */
 	}
 
-	if (!ret) {
+	if (first) {
+		lua_pop (L, 1);
 		lua_pushnil (L);
+
+		return 1;
+	}
+
+	if (err != NULL) {
+		lua_pop (L, 1);
+		lua_pushboolean (L, FALSE);
+		lua_pushstring (L, err);
+
+		return 2;
+	}
+
+	rspamd_lua_table_set (L, "p", policy);
+
+	if (sp) {
+		rspamd_lua_table_set (L, "sp", sp);
 	}
 
+	rspamd_lua_table_set (L, "adkim", adkim);
+	rspamd_lua_table_set (L, "aspf", aspf);
+	lua_pushstring (L, "pct");
+	lua_pushnumber (L, pct);
+	lua_settable (L, -3);
+
 	return 1;
 }
 
@@ -1039,7 +1409,7 @@ lua_util_strlen_utf8 (lua_State *L)
 	const gchar *str, *end;
 	gsize len;
 
-	str = lua_tolstring (L, 1, &len);
+	str = lua_check_text_or_string (L, 1, &len);
 
 	if (str) {
 		if (g_utf8_validate (str, len, &end)) {
@@ -1066,8 +1436,8 @@ lua_util_strcasecmp_utf8 (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 1, &len2);
+	str1 = lua_check_text_or_string (L, 1, &len1);
+	str2 = lua_check_text_or_string (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -1093,8 +1463,8 @@ lua_util_strcasecmp_ascii (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 1, &len2);
+	str1 = lua_check_text_or_string (L, 1, &len1);
+	str2 = lua_check_text_or_string (L, 2, &len2);
 
 	if (str1 && str2) {
 
@@ -1120,8 +1490,8 @@ lua_util_strequal_caseless (lua_State *L)
 	gsize len1, len2;
 	gint ret = -1;
 
-	str1 = lua_tolstring (L, 1, &len1);
-	str2 = lua_tolstring (L, 1, &len2);
+	str1 = lua_check_text_or_string (L, 1, &len1);
+	str2 = lua_check_text_or_string (L, 2, &len2);
 
 	if (str1 && str2) {
 
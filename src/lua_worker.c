@@ -24,6 +24,8 @@
 #include "message.h"
 #include "map.h"
 #include "dns.h"
+#include "http.h"
+#include "utlist.h"
 #include "unix-std.h"
 
 #include "lua/lua_common.h"
@@ -34,6 +36,8 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+/* Maximum number of idle request tables kept for reuse */
+#define LUA_WORKER_REQUESTS_POOL_MAX 64
 
 gpointer init_lua_worker (struct rspamd_config *cfg);
 void start_lua_worker (struct rspamd_worker *worker);
@@ -67,16 +71,40 @@ struct rspamd_lua_worker_ctx {
 	gint cbref_accept;
 	/* Callback for finishing */
 	gint cbref_fin;
+	/* Callback for HTTP requests */
+	gint cbref_http;
 	/* Config file */
 	struct rspamd_config *cfg;
 	/* The rest options */
 	ucl_object_t *opts;
+	/* Time to wait for the next request on a keep-alive connection */
+	gdouble keepalive_timeout;
+	struct timeval keepalive_tv;
+	struct timeval io_tv;
+	/* References of idle request tables */
+	GArray *requests_pool;
+};
+
+/*
+ * HTTP connection served by lua worker
+ */
+struct rspamd_lua_worker_session {
+	struct rspamd_lua_worker_ctx *ctx;
+	struct rspamd_http_connection *conn;
+	rspamd_inet_addr_t *addr;
+	gint fd;
+	/* Reply is being written */
+	gboolean replied;
+	gboolean keepalive;
+	/* Number of requests served */
+	guint nrequests;
 };
 
 /* Lua bindings */
 LUA_FUNCTION_DEF (worker, get_ev_base);
 LUA_FUNCTION_DEF (worker, register_accept_callback);
 LUA_FUNCTION_DEF (worker, register_exit_callback);
+LUA_FUNCTION_DEF (worker, register_http_callback);
 LUA_FUNCTION_DEF (worker, get_option);
 LUA_FUNCTION_DEF (worker, get_resolver);
 LUA_FUNCTION_DEF (worker, get_cfg);
@@ -85,6 +113,7 @@ static const struct luaL_reg lua_workerlib_m[] = {
 	LUA_INTERFACE_DEF (worker, get_ev_base),
 	LUA_INTERFACE_DEF (worker, register_accept_callback),
 	LUA_INTERFACE_DEF (worker, register_exit_callback),
+	LUA_INTERFACE_DEF (worker, register_http_callback),
 	LUA_INTERFACE_DEF (worker, get_option),
 	LUA_INTERFACE_DEF (worker, get_resolver),
 	LUA_INTERFACE_DEF (worker, get_cfg),
@@ -176,6 +205,35 @@ lua_worker_register_exit_callback (lua_State *L)
 	return 1;
 }
 
+/*
+ * Callback is called for each HTTP request as
+ * f(worker, req) -> code, body, headers, where req is a table with
+ * `method`, `path`, `headers`, `body` and `from` fields. Request tables are
+ * reused for the following requests, so they must not be stored.
+ */
+static int
+lua_worker_register_http_callback (lua_State *L)
+{
+	struct rspamd_lua_worker_ctx *ctx = lua_check_lua_worker (L);
+
+	if (ctx) {
+		if (!lua_isfunction (L, 2)) {
+			msg_err ("invalid callback passed");
+			lua_pushnil (L);
+		}
+		else {
+			lua_pushvalue (L, 2);
+			ctx->cbref_http = luaL_ref (L, LUA_REGISTRYINDEX);
+			return 0;
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 /* XXX: This fucntions should be rewritten completely */
 static int
 lua_worker_get_option (lua_State *L)
@@ -245,6 +303,258 @@ lua_worker_get_cfg (lua_State *L)
 
 /* End of lua API */
 
+/* Removes all keys of the table at `idx` */
+static void
+lua_worker_clear_table (lua_State *L, gint idx)
+{
+	lua_pushnil (L);
+
+	while (lua_next (L, idx) != 0) {
+		lua_pop (L, 1);
+		/* Assigning nil to the existing fields is allowed while traversing */
+		lua_pushvalue (L, -1);
+		lua_pushnil (L);
+		lua_rawset (L, idx);
+	}
+}
+
+/*
+ * Pushes request table filled from `msg`, tables of the finished requests
+ * are reused to avoid garbage per each request
+ */
+static gint
+lua_worker_request_push (struct rspamd_lua_worker_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_lua_worker_ctx *ctx = session->ctx;
+	struct rspamd_http_header *h;
+	lua_State *L = ctx->L;
+	gint ref, req_idx, hdrs_idx;
+
+	if (ctx->requests_pool->len > 0) {
+		ref = g_array_index (ctx->requests_pool, gint,
+				ctx->requests_pool->len - 1);
+		g_array_set_size (ctx->requests_pool, ctx->requests_pool->len - 1);
+		lua_rawgeti (L, LUA_REGISTRYINDEX, ref);
+	}
+	else {
+		lua_createtable (L, 0, 5);
+		lua_pushvalue (L, -1);
+		ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+
+	req_idx = lua_gettop (L);
+
+	lua_pushstring (L, "method");
+	lua_pushstring (L, http_method_str (msg->method));
+	lua_rawset (L, req_idx);
+
+	lua_pushstring (L, "path");
+	if (msg->url) {
+		lua_pushlstring (L, msg->url->str, msg->url->len);
+	}
+	else {
+		lua_pushstring (L, "/");
+	}
+	lua_rawset (L, req_idx);
+
+	lua_pushstring (L, "body");
+	if (msg->body_buf.len > 0) {
+		lua_pushlstring (L, msg->body_buf.begin, msg->body_buf.len);
+	}
+	else {
+		lua_pushnil (L);
+	}
+	lua_rawset (L, req_idx);
+
+	lua_pushstring (L, "from");
+	rspamd_lua_ip_push (L, session->addr);
+	lua_rawset (L, req_idx);
+
+	lua_pushstring (L, "headers");
+	lua_rawget (L, req_idx);
+
+	if (lua_istable (L, -1)) {
+		lua_worker_clear_table (L, lua_gettop (L));
+	}
+	else {
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushstring (L, "headers");
+		lua_pushvalue (L, -2);
+		lua_rawset (L, req_idx);
+	}
+
+	hdrs_idx = lua_gettop (L);
+
+	LL_FOREACH (msg->headers, h) {
+		lua_pushlstring (L, h->name->begin, h->name->len);
+		lua_pushlstring (L, h->value->begin, h->value->len);
+		lua_rawset (L, hdrs_idx);
+	}
+
+	lua_pop (L, 1);
+
+	return ref;
+}
+
+static void
+lua_worker_request_release (struct rspamd_lua_worker_ctx *ctx, gint ref)
+{
+	if (ctx->requests_pool->len < LUA_WORKER_REQUESTS_POOL_MAX) {
+		g_array_append_val (ctx->requests_pool, ref);
+	}
+	else {
+		luaL_unref (ctx->L, LUA_REGISTRYINDEX, ref);
+	}
+}
+
+static void
+lua_worker_session_free (struct rspamd_lua_worker_session *session)
+{
+	msg_debug ("closing connection from %s after %ud requests",
+			rspamd_inet_address_to_string (session->addr),
+			session->nrequests);
+	close (session->fd);
+	rspamd_http_connection_unref (session->conn);
+	rspamd_inet_address_destroy (session->addr);
+	g_slice_free1 (sizeof (*session), session);
+}
+
+/*
+ * Calls lua callback for the request and writes its result
+ */
+static void
+lua_worker_http_reply (struct rspamd_lua_worker_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_lua_worker_ctx *ctx = session->ctx, **pctx;
+	struct rspamd_http_message *reply;
+	lua_State *L = ctx->L;
+	const gchar *body, *name, *value, *mime_type = NULL;
+	gsize bodylen = 0;
+	gint top, ref, code = 200;
+
+	top = lua_gettop (L);
+	session->nrequests ++;
+	session->keepalive = ctx->keepalive_timeout > 0 &&
+			(msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE);
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->cbref_http);
+	pctx = lua_newuserdata (L, sizeof (gpointer));
+	rspamd_lua_setclass (L, "rspamd{worker}", -1);
+	*pctx = ctx;
+	ref = lua_worker_request_push (session, msg);
+
+	if (lua_pcall (L, 2, 3, 0) != 0) {
+		msg_info ("call to worker http callback failed: %s",
+				lua_tostring (L, -1));
+		reply->code = 500;
+		reply->status = rspamd_fstring_new_init ("Internal error",
+				sizeof ("Internal error") - 1);
+		reply->body = rspamd_fstring_new ();
+	}
+	else {
+		if (lua_isnumber (L, -3)) {
+			code = lua_tointeger (L, -3);
+		}
+
+		body = lua_tolstring (L, -2, &bodylen);
+		reply->code = code;
+		reply->status = code < 400 ? rspamd_fstring_new_init ("OK", 2) :
+				rspamd_fstring_new_init ("Error", 5);
+		reply->body = body ? rspamd_fstring_new_init (body, bodylen) :
+				rspamd_fstring_new ();
+
+		if (lua_istable (L, -1)) {
+			lua_pushnil (L);
+
+			while (lua_next (L, -2) != 0) {
+				name = lua_tostring (L, -2);
+				value = lua_tostring (L, -1);
+
+				if (name && value) {
+					if (g_ascii_strcasecmp (name, "Content-Type") == 0) {
+						/* Reply is formatted before the stack is restored */
+						mime_type = value;
+					}
+					else {
+						rspamd_http_message_add_header (reply, name, value);
+					}
+				}
+
+				lua_pop (L, 1);
+			}
+		}
+	}
+
+	if (session->keepalive) {
+		reply->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
+
+	session->replied = TRUE;
+	rspamd_http_connection_reset (session->conn);
+	rspamd_http_connection_write_message (session->conn,
+			reply,
+			NULL,
+			mime_type,
+			session,
+			session->fd,
+			&ctx->io_tv,
+			ctx->ev_base);
+
+	lua_settop (L, top);
+	lua_worker_request_release (ctx, ref);
+}
+
+static gint
+lua_worker_http_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_lua_worker_session *session = conn->ud;
+	struct rspamd_lua_worker_ctx *ctx = session->ctx;
+
+	if (!session->replied) {
+		lua_worker_http_reply (session, msg);
+	}
+	else if (session->keepalive) {
+		/* The whole reply is written, wait for the next request */
+		session->replied = FALSE;
+		rspamd_http_connection_reset (conn);
+		rspamd_http_connection_read_message (conn,
+				session,
+				session->fd,
+				&ctx->keepalive_tv,
+				ctx->ev_base);
+	}
+	else {
+		lua_worker_session_free (session);
+	}
+
+	return 0;
+}
+
+static void
+lua_worker_http_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamd_lua_worker_session *session = conn->ud;
+
+	if (session->nrequests > 0 && !session->replied) {
+		/* Peer has not sent the next request */
+		msg_debug ("closing idle connection from %s: %e",
+				rspamd_inet_address_to_string (session->addr), err);
+	}
+	else {
+		msg_info ("abnormally closing connection from %s: %e",
+				rspamd_inet_address_to_string (session->addr), err);
+	}
+
+	lua_worker_session_free (session);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -253,6 +563,7 @@ lua_accept_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
 	struct rspamd_lua_worker_ctx *ctx, **pctx;
+	struct rspamd_lua_worker_session *session;
 	gint nfd;
 	lua_State *L;
 	rspamd_inet_addr_t *addr;
@@ -274,7 +585,28 @@ lua_accept_socket (gint fd, short what, void *arg)
 		rspamd_inet_address_to_string (addr),
 		rspamd_inet_address_get_port (addr));
 
-	/* Call finalizer function */
+	if (ctx->cbref_http != 0) {
+		session = g_slice_alloc0 (sizeof (*session));
+		session->ctx = ctx;
+		session->fd = nfd;
+		session->addr = addr;
+		session->conn = rspamd_http_connection_new (
+				NULL,
+				lua_worker_http_error_handler,
+				lua_worker_http_finish_handler,
+				0,
+				RSPAMD_HTTP_SERVER,
+				NULL);
+		rspamd_http_connection_read_message (session->conn,
+				session,
+				nfd,
+				&ctx->io_tv,
+				ctx->ev_base);
+
+		return;
+	}
+
+	/* Call accept function */
 	lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->cbref_accept);
 	pctx = lua_newuserdata (L, sizeof (gpointer));
 	rspamd_lua_setclass (L, "rspamd{worker}", -1);
@@ -328,6 +660,16 @@ init_lua_worker (struct rspamd_config *cfg)
 			0,
 			"Run the following lua script when accepting a connection");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_lua_worker_ctx, keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to wait for the next HTTP request on a keep-alive "
+					"connection, default: 0 (connections are closed after reply)");
+
 	rspamd_rcl_register_worker_parser (cfg, type, rspamd_lua_worker_parser,
 		ctx);
 
@@ -384,18 +726,28 @@ start_lua_worker (struct rspamd_worker *worker)
 		exit (EXIT_SUCCESS);
 	}
 
-	if (ctx->cbref_accept == 0) {
+	if (ctx->cbref_accept == 0 && ctx->cbref_http == 0) {
 		msg_err ("No accept function defined, so no reason to exist");
 		exit (EXIT_SUCCESS);
 	}
 
+	ctx->requests_pool = g_array_new (FALSE, FALSE, sizeof (gint));
+	double_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
+	msec_to_tv (DEFAULT_WORKER_IO_TIMEOUT, &ctx->io_tv);
+
 	/* Maps events */
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver);
 
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
-	luaL_unref (L, LUA_REGISTRYINDEX, ctx->cbref_accept);
+	if (ctx->cbref_accept != 0) {
+		luaL_unref (L, LUA_REGISTRYINDEX, ctx->cbref_accept);
+	}
+
+	if (ctx->cbref_http != 0) {
+		luaL_unref (L, LUA_REGISTRYINDEX, ctx->cbref_http);
+	}
 	if (ctx->cbref_fin != 0) {
 		/* Call finalizer function */
 		lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->cbref_fin);
@@ -120,78 +120,23 @@ chartable_module_reconfig (struct rspamd_config *cfg)
 static gboolean
 check_part (struct mime_text_part *part, gboolean raw_mode)
 {
-	guchar *p, *p1;
-	gunichar c, t;
-	GUnicodeScript scc, sct;
-	guint32 mark = 0, total = 0, max = 0, i;
-	guint32 remain = part->content->len;
-	guint32 scripts[G_UNICODE_SCRIPT_NKO];
-	GUnicodeScript sel = 0;
-
-	p = part->content->data;
+	guint32 mark = 0, total = 0;
 
 	if (IS_PART_UTF (part) || raw_mode) {
-		while (remain > 1) {
-			if ((g_ascii_isalpha (*p) &&
-				(*(p + 1) & 0x80)) ||
-				((*p & 0x80) && g_ascii_isalpha (*(p + 1)))) {
-				mark++;
-				total++;
-			}
-			/* Current and next symbols are of one class */
-			else if (((*p & 0x80) &&
-				(*(p + 1) & 0x80)) ||
-				(g_ascii_isalpha (*p) && g_ascii_isalpha (*(p + 1)))) {
-				total++;
-			}
-			p++;
-			remain--;
-		}
+		/* Adjacent pairs are counted when the part is processed */
+		mark = part->charclass.mixed_pairs;
+		total = part->charclass.mixed_pairs + part->charclass.same_pairs;
 	}
 	else {
-		memset (&scripts, 0, sizeof (scripts));
-		while (remain > 0) {
-			c = g_utf8_get_char_validated (p, remain);
-			if (c == (gunichar) - 2 || c == (gunichar) - 1) {
-				/* Invalid characters detected, stop processing */
-				return FALSE;
-			}
-
-			scc = g_unichar_get_script (c);
-			if (scc < (gint)G_N_ELEMENTS (scripts)) {
-				scripts[scc]++;
-			}
-			p1 = g_utf8_next_char (p);
-			remain -= p1 - p;
-			p = p1;
-
-			if (remain > 0) {
-				t = g_utf8_get_char_validated (p, remain);
-				if (t == (gunichar) - 2 || t == (gunichar) - 1) {
-					/* Invalid characters detected, stop processing */
-					return FALSE;
-				}
-				sct = g_unichar_get_script (t);
-				if (g_unichar_isalpha (c) && g_unichar_isalpha (t)) {
-					/* We have two unicode alphanumeric characters, so we can check its script */
-					if (sct != scc) {
-						mark++;
-					}
-					total++;
-				}
-				p1 = g_utf8_next_char (p);
-				remain -= p1 - p;
-				p = p1;
-			}
+		/* Scripts of adjacent letters are also classified at that time */
+		if (!part->scripts.valid) {
+			/* Invalid characters detected, stop processing */
+			return FALSE;
 		}
-		/* Detect the mostly charset of this part */
-		for (i = 0; i < G_N_ELEMENTS (scripts); i++) {
-			if (scripts[i] > max) {
-				max = scripts[i];
-				sel = i;
-			}
-		}
-		part->script = sel;
+
+		mark = part->scripts.script_changes;
+		total = part->scripts.letter_pairs;
+		part->script = part->scripts.script;
 	}
 
 	if (total == 0) {
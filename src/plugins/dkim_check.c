@@ -33,6 +33,7 @@
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shared_cache.h"
 #include "rspamd.h"
 #include "utlist.h"
 
@@ -42,6 +43,7 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
 #define DEFAULT_TIME_JITTER 60
+#define DEFAULT_SHARED_CACHE_SIZE (1024 * 1024)
 
 struct dkim_ctx {
 	struct module_ctx ctx;
@@ -55,6 +57,10 @@ struct dkim_ctx {
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
+	/* Kept across reloads, so new workers start with resolved keys */
+	rspamd_mempool_t *shared_pool;
+	struct rspamd_shared_cache *shared_cache;
+	gsize shared_cache_size;
 	gboolean trusted_only;
 	gboolean skip_multi;
 };
@@ -158,6 +164,15 @@ dkim_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"dkim",
+			"Memory used to share DKIM keys among all processes (0 to disable)",
+			"shared_cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"dkim",
 			"Allow this time difference when checking DKIM signature time validity",
@@ -216,6 +231,35 @@ dkim_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	return 0;
 }
 
+/*
+ * Shared cache is not bound to the config pool, so it survives reloads and
+ * is recreated merely when its size is changed. Modules are configured by the
+ * main process before workers are spawned
+ */
+static void
+dkim_module_shared_cache_init (gsize size)
+{
+	if (dkim_module_ctx->shared_cache != NULL &&
+			dkim_module_ctx->shared_cache_size == size) {
+		return;
+	}
+
+	if (dkim_module_ctx->shared_pool != NULL) {
+		rspamd_mempool_delete (dkim_module_ctx->shared_pool);
+		dkim_module_ctx->shared_pool = NULL;
+		dkim_module_ctx->shared_cache = NULL;
+	}
+
+	dkim_module_ctx->shared_cache_size = size;
+
+	if (size > 0) {
+		dkim_module_ctx->shared_pool = rspamd_mempool_new (
+				rspamd_mempool_suggest_size (), "dkim");
+		dkim_module_ctx->shared_cache = rspamd_shared_cache_new (
+				dkim_module_ctx->shared_pool, 0, size, 0);
+	}
+}
+
 gint
 dkim_module_config (struct rspamd_config *cfg)
 {
@@ -223,6 +267,7 @@ dkim_module_config (struct rspamd_config *cfg)
 	const gchar *str;
 	gint res = TRUE, cb_id;
 	guint cache_size;
+	gsize shared_cache_size;
 	gboolean got_trusted = FALSE;
 
 	if (!rspamd_config_is_module_enabled (cfg, "dkim")) {
@@ -261,6 +306,14 @@ dkim_module_config (struct rspamd_config *cfg)
 	else {
 		cache_size = DEFAULT_CACHE_SIZE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "dkim",
+		"shared_cache_size")) != NULL) {
+		shared_cache_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_cache_size = DEFAULT_SHARED_CACHE_SIZE;
+	}
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "dkim", "time_jitter")) != NULL) {
@@ -360,6 +413,13 @@ dkim_module_config (struct rspamd_config *cfg)
 				g_free, /* Keys are just C-strings */
 				dkim_module_key_dtor);
 
+		dkim_module_shared_cache_init (shared_cache_size);
+
+		if (dkim_module_ctx->shared_cache) {
+			rspamd_config_register_persistent_cache (cfg, "dkim",
+					dkim_module_ctx->shared_cache);
+		}
+
 		msg_info_config ("init internal dkim module");
 #ifndef HAVE_OPENSSL
 		msg_warn_config (
@@ -374,8 +434,14 @@ gint
 dkim_module_reconfig (struct rspamd_config *cfg)
 {
 	struct module_ctx saved_ctx;
+	rspamd_mempool_t *shared_pool;
+	struct rspamd_shared_cache *shared_cache;
+	gsize shared_cache_size;
 
 	saved_ctx = dkim_module_ctx->ctx;
+	shared_pool = dkim_module_ctx->shared_pool;
+	shared_cache = dkim_module_ctx->shared_cache;
+	shared_cache_size = dkim_module_ctx->shared_cache_size;
 	rspamd_mempool_delete (dkim_module_ctx->dkim_pool);
 	radix_destroy_compressed (dkim_module_ctx->whitelist_ip);
 	if (dkim_module_ctx->dkim_domains) {
@@ -384,6 +450,9 @@ dkim_module_reconfig (struct rspamd_config *cfg)
 
 	memset (dkim_module_ctx, 0, sizeof (*dkim_module_ctx));
 	dkim_module_ctx->ctx = saved_ctx;
+	dkim_module_ctx->shared_pool = shared_pool;
+	dkim_module_ctx->shared_cache = shared_cache;
+	dkim_module_ctx->shared_cache_size = shared_cache_size;
 	dkim_module_ctx->dkim_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 
 	return dkim_module_config (cfg);
@@ -500,6 +569,85 @@ dkim_module_check (struct dkim_check_result *res)
 	}
 }
 
+/* Keys are stored as expiration time followed by DER encoded public key */
+static void
+dkim_module_shared_cache_insert (rspamd_dkim_key_t *key,
+		rspamd_dkim_context_t *ctx, struct rspamd_task *task)
+{
+	const guchar *der;
+	guchar *data;
+	gsize derlen;
+	guint64 expire;
+	guint ttl;
+
+	ttl = rspamd_dkim_key_get_ttl (key);
+
+	if (dkim_module_ctx->shared_cache == NULL || ttl == 0) {
+		return;
+	}
+
+	der = rspamd_dkim_key_get_der (key, &derlen);
+	expire = task->tv.tv_sec + ttl;
+	data = g_malloc (sizeof (expire) + derlen);
+	memcpy (data, &expire, sizeof (expire));
+	memcpy (data + sizeof (expire), der, derlen);
+	rspamd_shared_cache_insert (dkim_module_ctx->shared_cache,
+			rspamd_dkim_get_dns_key (ctx), strlen (rspamd_dkim_get_dns_key (ctx)),
+			data, sizeof (expire) + derlen,
+			task->tv.tv_sec, ttl);
+	g_free (data);
+}
+
+/* Keys parsed by other processes are moved to the local cache */
+static rspamd_dkim_key_t *
+dkim_module_shared_cache_lookup (rspamd_dkim_context_t *ctx,
+		struct rspamd_task *task)
+{
+	rspamd_dkim_key_t *key;
+	const gchar *dns_key;
+	guchar *data;
+	gsize len;
+	guint64 expire;
+	GError *err = NULL;
+
+	if (dkim_module_ctx->shared_cache == NULL) {
+		return NULL;
+	}
+
+	dns_key = rspamd_dkim_get_dns_key (ctx);
+	data = rspamd_shared_cache_lookup (dkim_module_ctx->shared_cache,
+			dns_key, strlen (dns_key), task->tv.tv_sec, &len);
+
+	if (data == NULL) {
+		return NULL;
+	}
+
+	memcpy (&expire, data, MIN (len, sizeof (expire)));
+
+	if (len <= sizeof (expire) || expire <= (guint64)task->tv.tv_sec) {
+		g_free (data);
+
+		return NULL;
+	}
+
+	key = rspamd_dkim_key_from_der (data + sizeof (expire),
+			len - sizeof (expire), expire - task->tv.tv_sec, &err);
+	g_free (data);
+
+	if (key == NULL) {
+		msg_info_task ("cannot load shared key for %s: %e", dns_key, err);
+		g_error_free (err);
+
+		return NULL;
+	}
+
+	rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+			g_strdup (dns_key),
+			key, task->tv.tv_sec, rspamd_dkim_key_get_ttl (key));
+
+	return key;
+}
+
 static void
 dkim_module_key_handler (rspamd_dkim_key_t *key,
 	gsize keylen,
@@ -520,6 +668,7 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
 			g_strdup (rspamd_dkim_get_dns_key (ctx)),
 			key, res->task->tv.tv_sec, rspamd_dkim_key_get_ttl (key));
+		dkim_module_shared_cache_insert (key, ctx, task);
 		/* Another ref belongs to the check context */
 		 res->key = rspamd_dkim_key_ref (key);
 		/* Release key when task is processed */
@@ -631,6 +780,10 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 							rspamd_dkim_get_dns_key (ctx),
 							task->tv.tv_sec);
 
+					if (key == NULL) {
+						key = dkim_module_shared_cache_lookup (ctx, task);
+					}
+
 					if (key != NULL) {
 						cur->key = rspamd_dkim_key_ref (key);
 						/* Release key when task is processed */
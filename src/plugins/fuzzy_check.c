@@ -33,6 +33,8 @@
 #include "config.h"
 #include "libmime/message.h"
 #include "libutil/map.h"
+#include "libutil/hash.h"
+#include "libutil/timer_wheel.h"
 #include "libmime/images.h"
 #include "libserver/worker_util.h"
 #include "fuzzy_storage.h"
@@ -52,6 +54,7 @@
 #define DEFAULT_IO_TIMEOUT 500
 #define DEFAULT_RETRANSMITS 3
 #define DEFAULT_PORT 11335
+#define DEFAULT_CACHE_EXPIRE 60
 
 static const gint rspamd_fuzzy_hash_len = 5;
 
@@ -79,6 +82,8 @@ struct fuzzy_rule {
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	gboolean batch;
+	rspamd_lru_hash_t *cache;
 	gint learn_condition_cb;
 };
 
@@ -96,6 +101,8 @@ struct fuzzy_ctx {
 	guint32 min_width;
 	guint32 io_timeout;
 	guint32 retransmits;
+	guint32 cache_size;
+	guint32 cache_expire;
 };
 
 struct fuzzy_client_session {
@@ -104,8 +111,8 @@ struct fuzzy_client_session {
 	struct upstream *server;
 	struct fuzzy_rule *rule;
 	struct event ev;
-	struct event timev;
-	struct timeval tv;
+	struct rspamd_timer timev;
+	gdouble timeout;
 	gint state;
 	gint fd;
 	guint retransmits;
@@ -128,12 +135,21 @@ struct fuzzy_learn_session {
 
 #define FUZZY_CMD_FLAG_REPLIED (1 << 0)
 #define FUZZY_CMD_FLAG_SENT (1 << 1)
+#define FUZZY_CMD_FLAG_CACHED (1 << 2)
 
 struct fuzzy_cmd_io {
 	guint32 tag;
 	guint32 flags;
 	struct rspamd_fuzzy_cmd *cmd;
 	struct iovec io;
+	/* Reply found in the local cache */
+	struct rspamd_fuzzy_reply *cached;
+};
+
+/* Element of the local cache of replies, it is both key and value */
+struct fuzzy_cached_reply {
+	gchar digest[rspamd_cryptobox_HASHBYTES];
+	struct rspamd_fuzzy_reply rep;
 };
 
 static struct fuzzy_ctx *fuzzy_module_ctx = NULL;
@@ -158,6 +174,26 @@ module_t fuzzy_check_module = {
 	RSPAMD_MODULE_VER
 };
 
+static guint
+fuzzy_cached_hash (gconstpointer key)
+{
+	const struct fuzzy_cached_reply *cached = key;
+	guint ret;
+
+	/* Digest is a cryptographic hash itself */
+	memcpy (&ret, cached->digest, sizeof (ret));
+
+	return ret;
+}
+
+static gboolean
+fuzzy_cached_equal (gconstpointer v, gconstpointer v2)
+{
+	const struct fuzzy_cached_reply *c1 = v, *c2 = v2;
+
+	return memcmp (c1->digest, c2->digest, sizeof (c1->digest)) == 0;
+}
+
 static void
 parse_flags (struct fuzzy_rule *rule,
 	struct rspamd_config *cfg,
@@ -347,6 +383,24 @@ fuzzy_free_rule (gpointer r)
 	}
 }
 
+/*
+ * Storages reply to checks of any digest, so a check of an empty one is used
+ * to probe them
+ */
+static void
+fuzzy_rule_set_probe (struct fuzzy_rule *rule)
+{
+	struct rspamd_fuzzy_cmd cmd;
+
+	memset (&cmd, 0, sizeof (cmd));
+	cmd.version = RSPAMD_FUZZY_VERSION;
+	cmd.cmd = FUZZY_CHECK;
+	cmd.tag = ottery_rand_uint32 ();
+
+	rspamd_upstreams_set_probe (rule->servers, RSPAMD_UPSTREAM_PROBE_UDP,
+			(const guchar *)&cmd, sizeof (cmd), NULL);
+}
+
 static gint
 fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id)
 {
@@ -409,6 +463,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id
 	if ((value = ucl_object_lookup (obj, "skip_unknown")) != NULL) {
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
+	if ((value = ucl_object_lookup (obj, "batch")) != NULL) {
+		rule->batch = ucl_obj_toboolean (value);
+	}
 
 	if ((value = ucl_object_lookup (obj, "servers")) != NULL) {
 		rule->servers = rspamd_upstreams_create (cfg->ups_ctx);
@@ -421,6 +478,14 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id
 			return -1;
 		}
 	}
+	if (fuzzy_module_ctx->cache_size > 0) {
+		rule->cache = rspamd_lru_hash_new_full (fuzzy_module_ctx->cache_size,
+				g_free, NULL, fuzzy_cached_hash, fuzzy_cached_equal);
+		rspamd_mempool_add_destructor (fuzzy_module_ctx->fuzzy_pool,
+				(rspamd_mempool_destruct_t)rspamd_lru_hash_destroy,
+				rule->cache);
+	}
+
 	if ((value = ucl_object_lookup (obj, "fuzzy_map")) != NULL) {
 		it = NULL;
 		while ((cur = ucl_object_iterate (value, &it, true)) != NULL) {
@@ -495,6 +560,12 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id
 	rspamd_cryptobox_hash (rule->shingles_key->str, k, strlen (k), NULL, 0);
 	rule->shingles_key->len = 16;
 
+	if (rule->servers && rule->peer_key == NULL &&
+			cfg->upstream_probe_interval > 0) {
+		/* Encrypted storages are not probed as probes have no keys */
+		fuzzy_rule_set_probe (rule);
+	}
+
 	if (rspamd_upstreams_count (rule->servers) == 0) {
 		msg_err_config ("no servers defined for fuzzy rule with symbol: %s",
 			rule->symbol);
@@ -519,6 +590,19 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id
 	return 0;
 }
 
+static struct rspamd_keypair_cache *
+fuzzy_keypairs_cache (void)
+{
+	/* Shared secrets cache is available only when configuration is loaded */
+	if (fuzzy_module_ctx->keypairs_cache == NULL) {
+		/* TODO: this should match rules count actually */
+		fuzzy_module_ctx->keypairs_cache = rspamd_keypair_cache_new_shared (32,
+				fuzzy_module_ctx->cfg->keypair_shared_cache);
+	}
+
+	return fuzzy_module_ctx->keypairs_cache;
+}
+
 gint
 fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 {
@@ -526,9 +610,6 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 
 	fuzzy_module_ctx->fuzzy_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 	fuzzy_module_ctx->cfg = cfg;
-	/* TODO: this should match rules count actually */
-	fuzzy_module_ctx->keypairs_cache = rspamd_keypair_cache_new (32);
-
 	*ctx = (struct module_ctx *)fuzzy_module_ctx;
 
 	rspamd_rcl_add_doc_by_path (cfg,
@@ -604,6 +685,24 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check",
+			"Number of replies cached locally for each rule (0 to disable cache)",
+			"cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check",
+			"Time to keep replies in the local cache",
+			"cache_expire",
+			UCL_TIME,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check",
 			"Whitelisted IPs map",
@@ -677,6 +776,16 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"If true then send all commands for a message in a single datagram "
+			"(requires fuzzy storage with batches support)",
+			"batch",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check.rule",
 			"Default symbol for rule (if no flags defined or matched)",
@@ -824,6 +933,24 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 		fuzzy_module_ctx->retransmits = DEFAULT_RETRANSMITS;
 	}
 
+	if ((value =
+			rspamd_config_get_module_opt (cfg, "fuzzy_check",
+			"cache_size")) != NULL) {
+		fuzzy_module_ctx->cache_size = ucl_obj_toint (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_size = 0;
+	}
+
+	if ((value =
+			rspamd_config_get_module_opt (cfg, "fuzzy_check",
+			"cache_expire")) != NULL) {
+		fuzzy_module_ctx->cache_expire = ucl_obj_todouble (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_expire = DEFAULT_CACHE_EXPIRE;
+	}
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check",
 		"whitelist")) != NULL) {
@@ -850,9 +977,12 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check", "rule")) != NULL) {
 
+		/* Results depend on the sender address if whitelist is used */
 		cb_id = rspamd_symbols_cache_add_symbol (cfg->cache,
 					"FUZZY_CALLBACK", 0, fuzzy_symbol_callback, NULL,
-					SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_FINE,
+					SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_FINE|
+					(rspamd_config_get_module_opt (cfg, "fuzzy_check",
+							"whitelist") ? 0 : SYMBOL_TYPE_CONTENT),
 					-1);
 
 		LL_FOREACH (value, cur) {
@@ -897,7 +1027,7 @@ fuzzy_io_fin (void *ud)
 	}
 
 	event_del (&session->ev);
-	event_del (&session->timev);
+	rspamd_timer_cancel (&session->timev);
 	close (session->fd);
 }
 
@@ -907,19 +1037,19 @@ fuzzy_preprocess_words (struct mime_text_part *part, rspamd_mempool_t *pool)
 	return part->normalized_words;
 }
 
+/*
+ * Fill encryption header, data itself is encrypted afterwards
+ */
 static void
-fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
-		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
-		guchar *data, gsize datalen)
+fuzzy_encrypt_hdr (struct fuzzy_rule *rule,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr)
 {
 	const guchar *pk;
 	guint pklen;
 
 	g_assert (hdr != NULL);
-	g_assert (data != NULL);
 	g_assert (rule != NULL);
 
-	/* Encrypt data */
 	memcpy (hdr->magic,
 			fuzzy_encrypted_magic,
 			sizeof (hdr->magic));
@@ -929,13 +1059,94 @@ fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
 	memcpy (hdr->pubkey, pk, MIN (pklen, sizeof (hdr->pubkey)));
 	pk = rspamd_pubkey_get_pk (rule->peer_key, &pklen);
 	memcpy (hdr->key_id, pk, MIN (sizeof (hdr->key_id), pklen));
-	rspamd_keypair_cache_process (fuzzy_module_ctx->keypairs_cache,
+	rspamd_keypair_cache_process (fuzzy_keypairs_cache (),
 			rule->local_key, rule->peer_key);
+}
+
+static void
+fuzzy_encrypt_cmd (struct fuzzy_rule *rule,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		guchar *data, gsize datalen)
+{
+	g_assert (data != NULL);
+
+	fuzzy_encrypt_hdr (rule, hdr);
 	rspamd_cryptobox_encrypt_nm_inplace (data, datalen,
 			hdr->nonce, rspamd_pubkey_get_nm (rule->peer_key), hdr->mac,
 			rspamd_pubkey_alg (rule->peer_key));
 }
 
+/*
+ * Encrypt all commands of a rule at once, the headers of commands must be
+ * filled by `fuzzy_encrypt_hdr`
+ */
+static void
+fuzzy_encrypt_commands (struct fuzzy_rule *rule, GPtrArray *commands)
+{
+	struct rspamd_cryptobox_message *msgs;
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	struct fuzzy_cmd_io *io;
+	guint i, n = 0;
+
+	if (rule->peer_key == NULL || rule->batch) {
+		/* Batches are encrypted when sent */
+		return;
+	}
+
+	msgs = g_alloca (sizeof (*msgs) * commands->len);
+
+	for (i = 0; i < commands->len; i ++) {
+		io = g_ptr_array_index (commands, i);
+
+		if (io->flags & FUZZY_CMD_FLAG_CACHED) {
+			continue;
+		}
+
+		hdr = io->io.iov_base;
+		msgs[n].data = (guchar *)io->io.iov_base + sizeof (*hdr);
+		msgs[n].len = io->io.iov_len - sizeof (*hdr);
+		msgs[n].nonce = hdr->nonce;
+		msgs[n].nm = rspamd_pubkey_get_nm (rule->peer_key);
+		msgs[n].sig = hdr->mac;
+		n ++;
+	}
+
+	rspamd_cryptobox_encrypt_nm_inplace_multi (msgs, n,
+			rspamd_pubkey_alg (rule->peer_key));
+}
+
+/*
+ * Create command replied from the local cache, such a command is not sent
+ */
+static struct fuzzy_cmd_io *
+fuzzy_cmd_from_cache (struct fuzzy_rule *rule,
+		int c,
+		struct rspamd_fuzzy_cmd *cmd,
+		rspamd_mempool_t *pool)
+{
+	struct fuzzy_cached_reply srch, *cached;
+	struct fuzzy_cmd_io *io;
+
+	if (rule->cache == NULL || c != FUZZY_CHECK) {
+		return NULL;
+	}
+
+	memcpy (srch.digest, cmd->digest, sizeof (srch.digest));
+	cached = rspamd_lru_hash_lookup (rule->cache, &srch, time (NULL));
+
+	if (cached == NULL) {
+		return NULL;
+	}
+
+	io = rspamd_mempool_alloc0 (pool, sizeof (*io));
+	io->flags = FUZZY_CMD_FLAG_REPLIED|FUZZY_CMD_FLAG_CACHED;
+	io->cmd = cmd;
+	io->cached = rspamd_mempool_alloc (pool, sizeof (*io->cached));
+	memcpy (io->cached, &cached->rep, sizeof (*io->cached));
+
+	return io;
+}
+
 static struct fuzzy_cmd_io *
 fuzzy_cmd_from_task_meta (struct fuzzy_rule *rule,
 		int c,
@@ -1009,9 +1220,13 @@ fuzzy_cmd_from_task_meta (struct fuzzy_rule *rule,
 	io->flags = 0;
 	io->tag = cmd->tag;
 	io->cmd = cmd;
+	io->cached = NULL;
 
-	if (rule->peer_key) {
-		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
+	if (rule->peer_key && !rule->batch) {
+		/* Command is encrypted inplace, so keep a plain copy */
+		io->cmd = rspamd_mempool_alloc (pool, sizeof (*cmd));
+		memcpy (io->cmd, cmd, sizeof (*cmd));
+		fuzzy_encrypt_hdr (rule, &enccmd->hdr);
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
 	}
@@ -1064,6 +1279,11 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 	}
 	rspamd_cryptobox_hash_final (&st, shcmd->basic.digest);
 
+	if ((io = fuzzy_cmd_from_cache (rule, c, &shcmd->basic, pool)) != NULL) {
+		/* Shingles are not needed */
+		return io;
+	}
+
 	msg_debug_pool ("loading shingles with key %*xs", 16,
 			rule->shingles_key->str);
 	sh = rspamd_shingles_generate (words,
@@ -1086,10 +1306,13 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 	io->tag = shcmd->basic.tag;
 	io->flags = 0;
 	io->cmd = &shcmd->basic;
+	io->cached = NULL;
 
-	if (rule->peer_key) {
-		/* Encrypt data */
-		fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd, sizeof (*shcmd));
+	if (rule->peer_key && !rule->batch) {
+		/* Command is encrypted inplace, so keep a plain copy */
+		io->cmd = rspamd_mempool_alloc (pool, sizeof (shcmd->basic));
+		memcpy (io->cmd, &shcmd->basic, sizeof (shcmd->basic));
+		fuzzy_encrypt_hdr (rule, &encshcmd->hdr);
 		io->io.iov_base = encshcmd;
 		io->io.iov_len = sizeof (*encshcmd);
 	}
@@ -1136,14 +1359,22 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 	rspamd_cryptobox_hash_update (&st, data, datalen);
 	rspamd_cryptobox_hash_final (&st, cmd->digest);
 
+	if ((io = fuzzy_cmd_from_cache (rule, c, cmd, pool)) != NULL) {
+		return io;
+	}
+
 	io = rspamd_mempool_alloc (pool, sizeof (*io));
 	io->flags = 0;
 	io->tag = cmd->tag;
 	io->cmd = cmd;
+	io->cached = NULL;
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		g_assert (enccmd != NULL);
-		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *) cmd, sizeof (*cmd));
+		/* Command is encrypted inplace, so keep a plain copy */
+		io->cmd = rspamd_mempool_alloc (pool, sizeof (*cmd));
+		memcpy (io->cmd, cmd, sizeof (*cmd));
+		fuzzy_encrypt_hdr (rule, &enccmd->hdr);
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
 	}
@@ -1174,14 +1405,96 @@ fuzzy_cmd_to_wire (gint fd, struct iovec *io)
 	return TRUE;
 }
 
+/*
+ * Finish batch in the buffer (encrypting it if needed) and send it
+ */
+static gboolean
+fuzzy_batch_to_wire (gint fd, struct fuzzy_rule *rule, guchar *buf,
+		gsize len, guint count)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	struct rspamd_fuzzy_batch_hdr *bh;
+	struct iovec io;
+	gsize hdrlen;
+
+	hdrlen = rule->peer_key ? sizeof (*hdr) : 0;
+	hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)buf;
+	bh = (struct rspamd_fuzzy_batch_hdr *)(buf + hdrlen);
+	bh->version = RSPAMD_FUZZY_VERSION;
+	bh->cmd = FUZZY_BATCH;
+	bh->count = count;
+	bh->reserved = 0;
+
+	if (rule->peer_key) {
+		fuzzy_encrypt_cmd (rule, hdr, (guchar *)bh, len - hdrlen);
+		memcpy (hdr->magic, fuzzy_encrypted_batch_magic, sizeof (hdr->magic));
+	}
+
+	io.iov_base = buf;
+	io.iov_len = len;
+
+	return fuzzy_cmd_to_wire (fd, &io);
+}
+
+/*
+ * Send all commands that have not been replied packed in as few datagrams
+ * as possible with a single encryption envelope per datagram
+ */
 static gboolean
-fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
+fuzzy_cmd_batch_to_wire (gint fd, struct fuzzy_rule *rule, GPtrArray *v)
+{
+	guchar buf[RSPAMD_FUZZY_MAX_BATCH_LEN];
+	struct fuzzy_cmd_io *io;
+	gsize start, len;
+	guint i, count = 0;
+	gboolean processed = FALSE;
+
+	start = (rule->peer_key ? sizeof (struct rspamd_fuzzy_encrypted_req_hdr) : 0)
+			+ sizeof (struct rspamd_fuzzy_batch_hdr);
+	len = start;
+
+	for (i = 0; i < v->len; i ++) {
+		io = g_ptr_array_index (v, i);
+
+		if (io->flags & FUZZY_CMD_FLAG_REPLIED) {
+			continue;
+		}
+
+		if (len + io->io.iov_len > sizeof (buf) || count == G_MAXUINT8) {
+			if (!fuzzy_batch_to_wire (fd, rule, buf, len, count)) {
+				return FALSE;
+			}
+
+			len = start;
+			count = 0;
+		}
+
+		memcpy (buf + len, io->io.iov_base, io->io.iov_len);
+		len += io->io.iov_len;
+		count ++;
+		io->flags |= FUZZY_CMD_FLAG_SENT;
+		processed = TRUE;
+	}
+
+	if (count > 0 && !fuzzy_batch_to_wire (fd, rule, buf, len, count)) {
+		return FALSE;
+	}
+
+	return processed;
+}
+
+static gboolean
+fuzzy_cmd_vector_to_wire (gint fd, struct fuzzy_rule *rule, GPtrArray *v)
 {
 	guint i;
 	gboolean all_sent = TRUE, all_replied = TRUE;
 	struct fuzzy_cmd_io *io;
 	gboolean processed = FALSE;
 
+	if (rule->batch) {
+		return fuzzy_cmd_batch_to_wire (fd, rule, v);
+	}
+
 	/* First try to resend unsent commands */
 	for (i = 0; i < v->len; i ++) {
 		io = g_ptr_array_index (v, i);
@@ -1212,12 +1525,50 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 			}
 		}
 
-		return fuzzy_cmd_vector_to_wire (fd, v);
+		return fuzzy_cmd_vector_to_wire (fd, rule, v);
 	}
 
 	return processed;
 }
 
+/*
+ * Decrypt the envelope of a batch reply inplace, all replies follow it
+ */
+static void
+fuzzy_process_batch_envelope (guchar **pos, gint *r, struct fuzzy_rule *rule)
+{
+	struct rspamd_fuzzy_encrypted_rep_hdr hdr;
+	guchar *p = *pos;
+
+	if (!rule->batch || !rule->peer_key || *r <= 0) {
+		return;
+	}
+
+	if ((guint)*r < sizeof (hdr)) {
+		*r = 0;
+		return;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+	rspamd_keypair_cache_process (fuzzy_keypairs_cache (),
+			rule->local_key, rule->peer_key);
+
+	if (!rspamd_cryptobox_decrypt_nm_inplace (p,
+			*r - sizeof (hdr),
+			hdr.nonce,
+			rspamd_pubkey_get_nm (rule->peer_key),
+			hdr.mac,
+			rspamd_pubkey_alg (rule->peer_key))) {
+		msg_info ("cannot decrypt reply");
+		*r = 0;
+		return;
+	}
+
+	*pos = p;
+	*r -= sizeof (hdr);
+}
+
 /*
  * Read replies one-by-one and remove them from req array
  */
@@ -1231,9 +1582,12 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	struct fuzzy_cmd_io *io;
 	const struct rspamd_fuzzy_reply *rep;
 	struct rspamd_fuzzy_encrypted_reply encrep;
-	gboolean found = FALSE;
+	gboolean found = FALSE, encrypted;
 
-	if (rule->peer_key) {
+	/* Replies for batches are encrypted all together */
+	encrypted = rule->peer_key && !rule->batch;
+
+	if (encrypted) {
 		required_size = sizeof (encrep);
 	}
 	else {
@@ -1244,13 +1598,13 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		return NULL;
 	}
 
-	if (rule->peer_key) {
+	if (encrypted) {
 		memcpy (&encrep, p, sizeof (encrep));
 		*pos += required_size;
 		*r -= required_size;
 
 		/* Try to decrypt reply */
-		rspamd_keypair_cache_process (fuzzy_module_ctx->keypairs_cache,
+		rspamd_keypair_cache_process (fuzzy_keypairs_cache (),
 				rule->local_key, rule->peer_key);
 
 		if (!rspamd_cryptobox_decrypt_nm_inplace ((guchar *)&encrep.rep,
@@ -1300,6 +1654,102 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	return NULL;
 }
 
+/*
+ * Insert symbol for a reply from fuzzy storage (or from the local cache)
+ */
+static void
+fuzzy_insert_result (struct rspamd_task *task, struct fuzzy_rule *rule,
+		const struct rspamd_fuzzy_reply *rep, struct rspamd_fuzzy_cmd *cmd)
+{
+	struct fuzzy_mapping *map;
+	const gchar *symbol;
+	gchar buf[256];
+	double nval;
+
+	/* Get mapping by flag */
+	if ((map =
+			g_hash_table_lookup (rule->mappings,
+					GINT_TO_POINTER (rep->flag))) == NULL) {
+		/* Default symbol and default weight */
+		symbol = rule->symbol;
+
+	}
+	else {
+		/* Get symbol and weight from map */
+		symbol = map->symbol;
+	}
+
+	/*
+	 * Hash is assumed to be found if probability is more than 0.5
+	 * In that case `value` means number of matches
+	 * Otherwise `value` means error code
+	 */
+	if (rep->prob > 0.5) {
+		nval = fuzzy_normalize (rep->value,
+				rule->max_score);
+		nval *= rep->prob;
+		msg_info_task (
+				"found fuzzy hash %*xs with weight: "
+						"%.2f, in list: %s:%d%s",
+				rspamd_fuzzy_hash_len, cmd->digest,
+				nval,
+				symbol,
+				rep->flag,
+				map == NULL ? "(unknown)" : "");
+		if (map != NULL || !rule->skip_unknown) {
+			rspamd_snprintf (buf,
+					sizeof (buf),
+					"%d:%*xs:%.2f",
+					rep->flag,
+					rspamd_fuzzy_hash_len, cmd->digest,
+					rep->prob,
+					nval);
+			rspamd_task_insert_result_single (task,
+					symbol,
+					nval,
+					g_list_prepend (NULL,
+							rspamd_mempool_strdup (
+									task->task_pool,
+									buf)));
+		}
+	}
+	else if (rep->value == 403) {
+		msg_info_task (
+				"fuzzy check error for %s(%d): forbidden",
+				symbol,
+				rep->flag);
+	}
+	else if (rep->value != 0) {
+		msg_info_task (
+				"fuzzy check error for %s(%d): unknown error (%d)",
+				symbol,
+				rep->flag,
+				rep->value);
+	}
+	/* Not found */
+}
+
+/*
+ * Remember reply for a checked digest, errors are not cached
+ */
+static void
+fuzzy_cache_reply (struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd *cmd,
+		const struct rspamd_fuzzy_reply *rep)
+{
+	struct fuzzy_cached_reply *cached;
+
+	if (rule->cache == NULL || cmd->cmd != FUZZY_CHECK ||
+			(rep->prob <= 0.5 && rep->value != 0)) {
+		return;
+	}
+
+	cached = g_malloc (sizeof (*cached));
+	memcpy (cached->digest, cmd->digest, sizeof (cached->digest));
+	memcpy (&cached->rep, rep, sizeof (cached->rep));
+	rspamd_lru_hash_insert (rule->cache, cached, cached, time (NULL),
+			fuzzy_module_ctx->cache_expire);
+}
+
 /* Fuzzy check callback */
 static void
 fuzzy_check_io_callback (gint fd, short what, void *arg)
@@ -1307,14 +1757,11 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 	struct fuzzy_client_session *session = arg;
 	const struct rspamd_fuzzy_reply *rep;
 	struct rspamd_task *task;
-	struct fuzzy_mapping *map;
 	guchar buf[2048], *p;
-	const gchar *symbol;
 	struct fuzzy_cmd_io *io;
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	guint i;
 	gint r;
-	double nval;
 	enum {
 		return_error = 0,
 		return_want_more,
@@ -1334,78 +1781,20 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 		else {
 			p = buf;
 			ret = return_want_more;
+			fuzzy_process_batch_envelope (&p, &r, session->rule);
 
 			while ((rep = fuzzy_process_reply (&p, &r,
 					session->commands, session->rule, &cmd)) != NULL) {
-				/* Get mapping by flag */
-				if ((map =
-						g_hash_table_lookup (session->rule->mappings,
-								GINT_TO_POINTER (rep->flag))) == NULL) {
-					/* Default symbol and default weight */
-					symbol = session->rule->symbol;
-
-				}
-				else {
-					/* Get symbol and weight from map */
-					symbol = map->symbol;
-				}
-
-
-				/*
-				 * Hash is assumed to be found if probability is more than 0.5
-				 * In that case `value` means number of matches
-				 * Otherwise `value` means error code
-				 */
-				if (rep->prob > 0.5) {
-					nval = fuzzy_normalize (rep->value,
-							session->rule->max_score);
-					nval *= rep->prob;
-					msg_info_task (
-							"found fuzzy hash %*xs with weight: "
-									"%.2f, in list: %s:%d%s",
-							rspamd_fuzzy_hash_len, cmd->digest,
-							nval,
-							symbol,
-							rep->flag,
-							map == NULL ? "(unknown)" : "");
-					if (map != NULL || !session->rule->skip_unknown) {
-						rspamd_snprintf (buf,
-								sizeof (buf),
-								"%d:%*xs:%.2f",
-								rep->flag,
-								rspamd_fuzzy_hash_len, cmd->digest,
-								rep->prob,
-								nval);
-						rspamd_task_insert_result_single (session->task,
-								symbol,
-								nval,
-								g_list_prepend (NULL,
-										rspamd_mempool_strdup (
-												session->task->task_pool,
-												buf)));
-					}
-				}
-				else if (rep->value == 403) {
-					msg_info_task (
-							"fuzzy check error for %s(%d): forbidden",
-							symbol,
-							rep->flag);
-				}
-				else if (rep->value != 0) {
-					msg_info_task (
-							"fuzzy check error for %s(%d): unknown error (%d)",
-							symbol,
-							rep->flag,
-							rep->value);
-				}
-				/* Not found */
+				fuzzy_insert_result (task, session->rule, rep, cmd);
+				fuzzy_cache_reply (session->rule, cmd, rep);
 
 				ret = return_finished;
 			}
 		}
 	}
 	else if (what & EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->rule,
+				session->commands)) {
 			ret = return_error;
 		}
 		else {
@@ -1463,7 +1852,7 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 
 /* Fuzzy check timeout callback */
 static void
-fuzzy_check_timer_callback (gint fd, short what, void *arg)
+fuzzy_check_timer_callback (void *arg)
 {
 	struct fuzzy_client_session *session = arg;
 	struct rspamd_task *task;
@@ -1480,13 +1869,15 @@ fuzzy_check_timer_callback (gint fd, short what, void *arg)
 	else {
 		/* Plan write event */
 		event_del (&session->ev);
-		event_set (&session->ev, fd, EV_WRITE|EV_READ,
+		event_set (&session->ev, session->fd, EV_WRITE|EV_READ,
 				fuzzy_check_io_callback, session);
+		event_base_set (session->task->ev_base, &session->ev);
 		event_add (&session->ev, NULL);
 
 		/* Plan new retransmit timer */
-		event_del (&session->timev);
-		event_add (&session->timev, &session->tv);
+		rspamd_timer_add (rspamd_timer_wheel_get (session->task->ev_base),
+				&session->timev, session->timeout,
+				fuzzy_check_timer_callback, session);
 		session->retransmits ++;
 	}
 }
@@ -1532,6 +1923,7 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 		else {
 			p = buf;
 			ret = return_want_more;
+			fuzzy_process_batch_envelope (&p, &r, session->rule);
 
 			while ((rep = fuzzy_process_reply (&p, &r,
 					session->commands, session->rule, &cmd)) != NULL) {
@@ -1590,7 +1982,8 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 	}
 	else if (what & EV_WRITE) {
 			/* Send commands to storage */
-			if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+			if (!fuzzy_cmd_vector_to_wire (fd, session->rule,
+					session->commands)) {
 				if (*(session->err) == NULL) {
 					g_set_error (session->err,
 						g_quark_from_static_string ("fuzzy check"),
@@ -1757,26 +2150,30 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 
 	/* Process images */
 	GList *cur;
+	GByteArray *image_data;
 
 	cur = task->images;
 	while (cur) {
 		image = cur->data;
-		if (image->data->len > 0) {
-			if (fuzzy_module_ctx->min_height <= 0 || image->height >=
-				fuzzy_module_ctx->min_height) {
-				if (fuzzy_module_ctx->min_width <= 0 || image->width >=
-					fuzzy_module_ctx->min_width) {
+		/* Dimensions are known without decoding the image */
+		if (fuzzy_module_ctx->min_height <= 0 || image->height >=
+			fuzzy_module_ctx->min_height) {
+			if (fuzzy_module_ctx->min_width <= 0 || image->width >=
+				fuzzy_module_ctx->min_width) {
+				image_data = rspamd_image_get_data (image);
+
+				if (image_data->len > 0) {
 					if (c == FUZZY_CHECK) {
 						io = fuzzy_cmd_from_data_part (rule, c, flag, value,
 								task->task_pool,
-								image->data->data, image->data->len);
+								image_data->data, image_data->len);
 						if (io) {
 							g_ptr_array_add (res, io);
 						}
 					}
 					io = fuzzy_cmd_from_data_part (rule, c, flag, value,
 							task->task_pool,
-							image->data->data, image->data->len);
+							image_data->data, image_data->len);
 					if (io) {
 						g_ptr_array_add (res, io);
 					}
@@ -1790,8 +2187,9 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	for (i = 0; i < task->parts->len; i ++) {
 		mime_part = g_ptr_array_index (task->parts, i);
 
-		if (mime_part->content->len > 0 &&
-			fuzzy_check_content_type (rule, mime_part->type)) {
+		/* Check type first to avoid decoding of unrelated parts */
+		if (fuzzy_check_content_type (rule, mime_part->type) &&
+			rspamd_mime_part_get_content (mime_part)->len > 0) {
 			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->content->len >=
 				fuzzy_module_ctx->min_bytes) {
 				io = fuzzy_cmd_from_data_part (rule, c, flag, value,
@@ -1818,6 +2216,8 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 		return NULL;
 	}
 
+	fuzzy_encrypt_commands (rule, res);
+
 	return res;
 }
 
@@ -1848,7 +2248,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 			session =
 				rspamd_mempool_alloc0 (task->task_pool,
 					sizeof (struct fuzzy_client_session));
-			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
+			session->timeout = fuzzy_module_ctx->io_timeout / 1000.0;
 			session->state = 0;
 			session->commands = commands;
 			session->task = task;
@@ -1861,10 +2261,9 @@ register_fuzzy_client_call (struct rspamd_task *task,
 			event_base_set (session->task->ev_base, &session->ev);
 			event_add (&session->ev, NULL);
 
-			evtimer_set (&session->timev, fuzzy_check_timer_callback,
-					session);
-			event_base_set (session->task->ev_base, &session->timev);
-			event_add (&session->timev, &session->tv);
+			rspamd_timer_add (rspamd_timer_wheel_get (session->task->ev_base),
+					&session->timev, session->timeout,
+					fuzzy_check_timer_callback, session);
 
 			rspamd_session_add_event (task->s,
 				fuzzy_io_fin,
@@ -1874,6 +2273,32 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	}
 }
 
+/*
+ * Insert results for commands replied from the local cache, returns TRUE if
+ * some commands still need to be sent to storage
+ */
+static gboolean
+fuzzy_process_cached (struct rspamd_task *task, struct fuzzy_rule *rule,
+		GPtrArray *commands)
+{
+	struct fuzzy_cmd_io *io;
+	guint i;
+	gboolean need_io = FALSE;
+
+	for (i = 0; i < commands->len; i ++) {
+		io = g_ptr_array_index (commands, i);
+
+		if (io->flags & FUZZY_CMD_FLAG_CACHED) {
+			fuzzy_insert_result (task, rule, io->cached, io->cmd);
+		}
+		else {
+			need_io = TRUE;
+		}
+	}
+
+	return need_io;
+}
+
 /* This callback is called when we check message in fuzzy hashes storage */
 static void
 fuzzy_symbol_callback (struct rspamd_task *task, void *unused)
@@ -1898,7 +2323,13 @@ fuzzy_symbol_callback (struct rspamd_task *task, void *unused)
 		rule = cur->data;
 		commands = fuzzy_generate_commands (task, rule, FUZZY_CHECK, 0, 0);
 		if (commands != NULL) {
-			register_fuzzy_client_call (task, rule, commands);
+			if (fuzzy_process_cached (task, rule, commands)) {
+				register_fuzzy_client_call (task, rule, commands);
+			}
+			else {
+				/* All replies are cached */
+				g_ptr_array_free (commands, TRUE);
+			}
 		}
 		cur = g_list_next (cur);
 	}
@@ -17,11 +17,11 @@ limitations under the License.
 
 -- Dmarc policy filter
 
-local rspamd_regexp = require "rspamd_regexp"
 local rspamd_logger = require "rspamd_logger"
 local rspamd_redis = require "rspamd_redis"
 local upstream_list = require "rspamd_upstream_list"
 local rspamd_util = require "rspamd_util"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 
 --local dumper = require 'pl.pretty'.dump
 
@@ -38,8 +38,10 @@ local symbols = {
 local default_port = 6379
 local upstreams = nil
 local dmarc_redis_key_prefix = "dmarc_"
-local dmarc_domain = nil
-local elts_re = rspamd_regexp.create_cached("\\\\{0,1};\\s+")
+-- Shared memory cache of policy records
+local policy_cache = nil
+local cache_size = 1024 * 1024
+local cache_expire = 3600
 
 local function dmarc_report(task, spf_ok, dkim_ok)
   local ip = task:get_from_ip()
@@ -52,12 +54,37 @@ local function dmarc_report(task, spf_ok, dkim_ok)
   return res
 end
 
+-- Returns policy record (empty string if there is no record or '!' if the
+-- record is invalid) and parsed policy
+local function dmarc_parse_results(results)
+  local record, policy
+
+  for _,r in ipairs(results) do
+    local p = rspamd_util.parse_dmarc_record(r)
+
+    if p ~= nil then
+      if record or not p then
+        -- Invalid or multiple policies
+        return '!'
+      end
+
+      record,policy = r,p
+    end
+  end
+
+  return record or '',policy
+end
+
 local function dmarc_callback(task)
   local from = task:get_from(2)
+  local hfrom_domain
   local dmarc_domain
+  local lookups = {}
+  local done = false
 
   if from and from[1] and from[1]['domain'] and not from[2] then
-    dmarc_domain = rspamd_util.get_tld(from[1]['domain'])
+    hfrom_domain = string.lower(from[1]['domain'])
+    dmarc_domain = rspamd_util.get_tld(hfrom_domain)
   else
     return
   end
@@ -72,126 +99,19 @@ local function dmarc_callback(task)
     end
   end
 
-  local function dmarc_dns_cb(resolver, to_resolve, results, err, key)
+  local function dmarc_check_policy(lookup_domain, policy)
+    local strict_spf = policy['aspf'] == 's'
+    local strict_dkim = policy['adkim'] == 's'
+    local pct = policy['pct']
+    local rua = policy['rua']
+    local p = policy['p']
 
-    local lookup_domain = string.sub(to_resolve, 8)
-    if not results then
-      if lookup_domain ~= dmarc_domain then
-        local resolve_name = '_dmarc.' .. dmarc_domain
-        task:get_resolver():resolve_txt({
-          task=task,
-          name = resolve_name,
-          callback = dmarc_dns_cb})
-        return
-      end
-
-      return
+    if lookup_domain ~= hfrom_domain and policy['sp'] then
+      p = policy['sp']
     end
 
-    local strict_spf = false
-    local strict_dkim = false
-    local strict_policy = false
-    local quarantine_policy = false
-    local found_policy = false
-    local failed_policy = false
-    local rua
-
-    for _,r in ipairs(results) do
-      if failed_policy then break end
-      (function()
-        if not string.match(r, '^v=DMARC1[;\\][; ]') then
-          return
-        else
-          if found_policy then
-            failed_policy = true
-            return
-          else
-            found_policy = true
-          end
-        end
-        local elts = elts_re:split(r)
-
-        if elts then
-          for _,e in ipairs(elts) do
-            dkim_pol = string.match(e, '^adkim=(.)$')
-            if dkim_pol then
-              if dkim_pol == 's' then
-                strict_dkim = true
-              elseif dkim_pol ~= 'r' then
-                failed_policy = true
-                return
-              end
-            end
-            spf_pol = string.match(e, '^aspf=(.)$')
-            if spf_pol then
-              if spf_pol == 's' then
-                strict_spf = true
-              elseif spf_pol ~= 'r' then
-                failed_policy = true
-                return
-              end
-            end
-            policy = string.match(e, '^p=(.+)$')
-            if policy then
-              if (policy == 'reject') then
-                strict_policy = true
-              elseif (policy == 'quarantine') then
-                strict_policy = true
-                quarantine_policy = true
-              elseif (policy ~= 'none') then
-                failed_policy = true
-                return
-              end
-            end
-            subdomain_policy = string.match(e, '^sp=(.+)$')
-            if subdomain_policy and lookup_domain == dmarc_domain then
-              if (subdomain_policy == 'reject') then
-                if dmarc_domain ~= from[1]['domain'] then
-                  strict_policy = true
-                end
-              elseif (subdomain_policy == 'quarantine') then
-                if dmarc_domain ~= from[1]['domain'] then
-                  strict_policy = true
-                  quarantine_policy = true
-                end
-              elseif (subdomain_policy == 'none') then
-                if dmarc_domain ~= from[1]['domain'] then
-                  strict_policy = false
-                  quarantine_policy = false
-                end
-              else
-                failed_policy = true
-                return
-              end
-            end
-            pct = string.match(e, '^pct=(%d+)$')
-            if pct then
-              pct = tonumber(pct)
-            end
-
-            if not rua then
-              rua = string.match(e, '^rua=([^%s]+)$')
-            end
-          end
-        end
-      end)()
-    end
-
-    if not found_policy then
-      if lookup_domain ~= dmarc_domain then
-        local resolve_name = '_dmarc.' .. dmarc_domain
-        task:get_resolver():resolve_txt({
-          task=task,
-          name = resolve_name,
-          callback = dmarc_dns_cb})
-
-        return
-      else
-        return
-      end
-    end
-
-    if failed_policy then return end
+    local strict_policy = (p == 'reject' or p == 'quarantine')
+    local quarantine_policy = (p == 'quarantine')
 
     -- Check dkim and spf symbols
     local spf_ok = false
@@ -229,11 +149,11 @@ local function dmarc_callback(task)
     if not (spf_ok or dkim_ok) then
       res = 1.0
       if quarantine_policy then
-        if not pct or pct == 100 or (math.random(100) <= pct) then
+        if pct == 100 or (math.random(100) <= pct) then
           task:insert_result('DMARC_POLICY_QUARANTINE', res, lookup_domain)
         end
       elseif strict_policy then
-        if not pct or pct == 100 or (math.random(100) <= pct) then
+        if pct == 100 or (math.random(100) <= pct) then
           task:insert_result('DMARC_POLICY_REJECT', res, lookup_domain)
         end
       else
@@ -255,16 +175,72 @@ local function dmarc_callback(task)
           'LPUSH', {redis_key, report_data})
       end
     end
+  end
+
+  -- Policy of the exact domain is preferred, organisational domain policy is
+  -- used merely if the exact domain has no record
+  local function dmarc_check_lookups()
+    if done then return true end
+
+    local exact = lookups[hfrom_domain]
+    if not exact then return false end
+
+    local lookup_domain = hfrom_domain
+    if exact['record'] == '' and dmarc_domain ~= hfrom_domain then
+      if not lookups[dmarc_domain] then return false end
+      lookup_domain = dmarc_domain
+    end
+
+    done = true
+    if lookups[lookup_domain]['policy'] then
+      dmarc_check_policy(lookup_domain, lookups[lookup_domain]['policy'])
+    end
+
+    return true
+  end
+
+  local function dmarc_lookup(domain)
+    if policy_cache then
+      local record = policy_cache:get(domain)
+
+      if record then
+        local policy
+        if record ~= '' and record ~= '!' then
+          policy = rspamd_util.parse_dmarc_record(record)
+        end
+        lookups[domain] = {record = record, policy = policy}
+        return
+      end
+    end
+
+    local function dmarc_dns_cb(resolver, to_resolve, results, err, key)
+      local record, policy = '', nil
 
-    -- XXX: handle rua and push data to redis
+      if results then
+        record,policy = dmarc_parse_results(results)
+      end
+
+      if policy_cache and (results or err == 'no records with this name' or
+          err == 'requested record is not found') then
+        policy_cache:set(domain, record, cache_expire)
+      end
+
+      lookups[domain] = {record = record, policy = policy}
+      dmarc_check_lookups()
+    end
+
+    task:get_resolver():resolve_txt({
+      task=task,
+      name = '_dmarc.' .. domain,
+      callback = dmarc_dns_cb})
   end
 
-  -- Do initial request
-  local resolve_name = '_dmarc.' .. from[1]['domain']
-  task:get_resolver():resolve_txt({
-    task=task,
-    name = resolve_name,
-    callback = dmarc_dns_cb})
+  -- Both lookups are issued at once unless exact policy is cached
+  dmarc_lookup(hfrom_domain)
+  if not dmarc_check_lookups() and dmarc_domain ~= hfrom_domain then
+    dmarc_lookup(dmarc_domain)
+    dmarc_check_lookups()
+  end
 end
 
 local opts = rspamd_config:get_all_opt('dmarc')
@@ -285,6 +261,19 @@ if opts['key_prefix'] then
   dmarc_redis_key_prefix = opts['key_prefix']
 end
 
+if opts['cache_size'] then
+  cache_size = tonumber(opts['cache_size'])
+end
+
+if opts['cache_expire'] then
+  cache_expire = tonumber(opts['cache_expire'])
+end
+
+if cache_size > 0 then
+  -- Must be created before workers are spawned to be shared between them
+  policy_cache = rspamd_shared_cache.create(rspamd_config, {bytes = cache_size})
+end
+
 -- Check spf and dkim sections for changed symbols
 local function check_mopt(var, opts, name)
   if opts[name] then
@@ -75,9 +75,8 @@ local function load_fann(id)
     return false
   end
 
-  local fd = rspamd_util.lock_file(fname)
+  -- Trainer replaces file atomically, so no locking is needed
   data[id].fann = rspamd_fann.load(fname)
-  rspamd_util.unlock_file(fd) -- closes fd
 
   if data[id].fann then
     local n = rspamd_config:get_symbols_count()
@@ -183,24 +182,9 @@ local function fann_train_callback(score, required_score,results, cf, id, opts)
   end
 
   if data[id].ntrains > max_trains then
-    -- Store fann on disk
-    local res = false
-
-    local err,st = rspamd_util.stat(fname)
-    if err then
-      local fd,err = rspamd_util.create_file(fname)
-      if not fd then
-        rspamd_logger.errx(cf, 'cannot save fann in %s: %s', fname, err)
-      else
-        rspamd_util.lock_file(fname, fd)
-        res = data[id].fann_train:save(fname)
-        rspamd_util.unlock_file(fd) -- Closes fd as well
-      end
-    else
-      local fd = rspamd_util.lock_file(fname)
-      res = data[id].fann_train:save(fname)
-      rspamd_util.unlock_file(fd) -- Closes fd as well
-    end
+    -- Publish fann for scanners: it is saved to a temporary file and then
+    -- renamed, so scanners reload it by mtime and never see partial data
+    local res = data[id].fann_train:save(fname)
 
     if not res then
       rspamd_logger.errx(cf, 'cannot save fann in %s', fname)
@@ -263,8 +247,10 @@ else
           max_trains = opts['train']['max_train']
         end
         if opts['train']['max_epoch'] then
-          max_trains = opts['train']['max_epoch']
+          max_epoch = opts['train']['max_epoch']
         end
+        -- Training is performed by log helper worker only, so scanners just
+        -- load published networks and run inference
         cfg:register_worker_script("log_helper",
           function(score, req_score, results, cf, id)
             if use_settings then
@@ -20,6 +20,7 @@ local rspamd_redis = require "rspamd_redis"
 local upstream_list = require "rspamd_upstream_list"
 local rspamd_regexp = require "rspamd_regexp"
 local rspamd_util = require "rspamd_util"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 local _ = require "fun"
 
 -- Default settings
@@ -52,9 +53,20 @@ local options = {
   lower_bound = 10, -- minimum number of messages to be scored
   metric = 'default',
   min_score = nil,
-  max_score = nil
+  max_score = nil,
+  -- Scores are read from and written to redis for each message in `exact`
+  -- mode, in `local` mode they are cached and aggregated in shared memory
+  mode = 'exact',
+  max_drift = 10, -- number of pending updates of a key that triggers flush
+  sync_interval = 10, -- maximum time in seconds between flushes of a key
+  cache_ttl = 60, -- time in seconds to cache scores read from redis
+  shm_size = 16 * 1024 * 1024
 }
 
+local shm_scores
+-- Pending deltas of keys without messages for this time are lost
+local pending_ttl = 24 * 3600
+
 local asn_re = rspamd_regexp.create_cached("[\\|\\s]")
 
 local function asn_check(task)
@@ -118,6 +130,22 @@ local function ip_score_get_task_vars(task)
   return asn, country, ipnet
 end
 
+-- Adds pending deltas to scores stored in redis
+local flush_script = [[
+for i = 1, #ARGV, 3 do
+  local v = redis.call('HGET', KEYS[1], ARGV[i])
+  local score, total = 0, 0
+  if v then
+    local s, t = string.match(v, '^([^|]+)|(%d+)')
+    score = tonumber(s) or 0
+    total = tonumber(t) or 0
+  end
+  redis.call('HSET', KEYS[1], ARGV[i], string.format('%f|%d',
+    score + tonumber(ARGV[i + 1]), total + tonumber(ARGV[i + 2])))
+end
+return #ARGV / 3
+]]
+
 -- Set score based on metric's action
 local ip_score_set = function(task)
   local function new_score_set(score, old_score, old_total)
@@ -171,6 +199,35 @@ local ip_score_set = function(task)
   local upstream = upstreams:get_upstream_by_hash(hkey)
   local addr = upstream:get_addr()
 
+  if shm_scores then
+    local args = {flush_script, '1', options['hash']}
+
+    _.each(function(field)
+      local taken = select(2, shm_scores:bucket_add('c:' .. field, 0, 1,
+        pending_ttl, options['max_drift'],
+        options['sync_interval']))
+
+      if taken and taken > 0 then
+        -- Take score delta along with the counter
+        local dscore = select(2, shm_scores:bucket_add('s:' .. field, 0, 0,
+          pending_ttl, 1, 0)) or 0
+        table.insert(args, field)
+        table.insert(args, string.format('%f', dscore + score))
+        table.insert(args, tostring(taken))
+      else
+        shm_scores:bucket_add('s:' .. field, 0, score,
+          pending_ttl)
+      end
+    end, {options['asn_prefix'] .. asn, options['country_prefix'] .. country,
+      options['ipnet_prefix'] .. ipnet, ip:to_string()})
+
+    if #args > 3 then
+      rspamd_redis.make_request(task, addr, score_set_cb, 'EVAL', args)
+    end
+
+    return
+  end
+
   asn_score,total_asn = new_score_set(score, asn_score, total_asn)
   country_score,total_country = new_score_set(score, country_score, total_country)
   ipnet_score,total_ipnet = new_score_set(score, ipnet_score, total_ipnet)
@@ -188,7 +245,7 @@ end
 local ip_score_check = function(task)
   local asn, country, ipnet = ip_score_get_task_vars(task)
 
-  local ip_score_redis_cb = function(task, err, data)
+  local process_scores = function(data)
     local function calculate_score(score)
       local parts = asn_re:split(score)
       local rep = tonumber(parts[1])
@@ -206,10 +263,7 @@ local ip_score_check = function(task)
       return mult * rspamd_util.tanh(2.718 * sc / total)
     end
 
-    if err then
-      -- Key is not found or error occurred
-      return
-    elseif data then
+    if data then
       -- Scores and total number of messages per bucket
       local asn_score,total_asn,
         country_score,total_country,
@@ -269,6 +323,28 @@ local ip_score_check = function(task)
     end
   end
 
+  local ip_score_redis_cb = function(task, err, data)
+    if err then
+      -- Key is not found or error occurred
+      return
+    end
+
+    if data and shm_scores then
+      local cached = {}
+      for i = 1,4 do
+        if data[i] and type(data[i]) ~= 'userdata' then
+          cached[i] = tostring(data[i])
+        else
+          cached[i] = ''
+        end
+      end
+      shm_scores:set(task:get_mempool():get_variable('ip_score_key'),
+        table.concat(cached, '\n'), options['cache_ttl'])
+    end
+
+    process_scores(data)
+  end
+
   local function create_get_command(ip, asn, country, ipnet)
     local cmd = 'HMGET'
 
@@ -318,6 +394,29 @@ local ip_score_check = function(task)
     end
 
     local cmd, args = create_get_command(ip, asn, country, ipnet)
+
+    if shm_scores then
+      -- Reply of the same request is cached in shared memory
+      local cache_key = 'r:' .. table.concat(args, '\n', 2)
+      local cached = shm_scores:get(cache_key)
+
+      if cached then
+        local data = {}
+        local i = 1
+        for v in string.gmatch(cached .. '\n', '([^\n]*)\n') do
+          if v ~= '' then
+            data[i] = v
+          end
+          i = i + 1
+        end
+        process_scores(data)
+
+        return
+      end
+
+      task:get_mempool():set_variable('ip_score_key', cache_key)
+    end
+
     local upstream = upstreams:get_upstream_by_hash(
       ip_score_hash_key(asn, country, ipnet, ip))
     local addr = upstream:get_addr()
@@ -345,6 +444,14 @@ local configure_ip_score_module = function()
     if options['asn_cc_whitelist'] then
       asn_cc_whitelist = rspamd_config:add_hash_map(opts['asn_cc_whitelist'])
     end
+    if options['mode'] == 'local' then
+      -- Must be created before workers are spawned to be shared between them
+      shm_scores = rspamd_shared_cache.create(rspamd_config,
+        {bytes = tonumber(options['shm_size'])})
+    elseif options['mode'] ~= 'exact' then
+      rspamd_logger.errx(rspamd_config, 'invalid ip_score mode: %s',
+        options['mode'])
+    end
   end
 end
 
@@ -17,8 +17,11 @@ limitations under the License.
 -- Multimap is rspamd module designed to define and operate with different maps
 
 local rules = {}
+-- Rules with the same input are matched by a single map group
+local groups = {}
 local rspamd_logger = require "rspamd_logger"
 local cdb = require "rspamd_cdb"
+local rspamd_map_group = require "rspamd_map_group"
 local util = require "rspamd_util"
 local regexp = require "rspamd_regexp"
 local _ = require "fun"
@@ -295,7 +298,7 @@ local function multimap_callback(task, pre_filter)
   if ip:is_valid() then
     _.each(function(r) match_rule(r, ip) end,
       _.filter(function(r)
-        return pre_filter == r['prefilter'] and r['type'] == 'ip'
+        return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'ip'
       end, rules))
   end
 
@@ -305,7 +308,7 @@ local function multimap_callback(task, pre_filter)
     match_list(r, hv, {'decoded'})
   end,
   _.filter(function(r)
-    return pre_filter == r['prefilter'] and r['type'] == 'header'
+    return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'header'
   end, rules))
 
   -- Rcpt rules
@@ -315,7 +318,7 @@ local function multimap_callback(task, pre_filter)
       match_addr(r, rcpts)
     end,
     _.filter(function(r)
-      return pre_filter == r['prefilter'] and r['type'] == 'rcpt'
+      return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'rcpt'
     end, rules))
   end
 
@@ -327,7 +330,7 @@ local function multimap_callback(task, pre_filter)
         match_addr(r, from)
       end,
       _.filter(function(r)
-        return pre_filter == r['prefilter'] and r['type'] == 'from'
+        return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'from'
       end, rules))
     end
   end
@@ -339,7 +342,7 @@ local function multimap_callback(task, pre_filter)
         match_url(r, url)
       end,
       _.filter(function(r)
-        return pre_filter == r['prefilter'] and r['type'] == 'url'
+        return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'url'
       end, rules))
     end
   end
@@ -352,10 +355,94 @@ local function multimap_callback(task, pre_filter)
         match_filename(r, fn)
       end,
       _.filter(function(r)
-        return pre_filter == r['prefilter'] and r['type'] == 'filename'
+        return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'filename'
       end, rules))
     end
   end
+  -- Grouped rules: each input is extracted and filtered once per group
+  local function group_values(g)
+    local values = {}
+
+    local function add_value(v, filter_func)
+      if v and filter_func then
+        v = filter_func(g['filter'], v, g)
+      end
+      if v then
+        table.insert(values, v)
+      end
+    end
+
+    local function add_addrs(addrs)
+      local filter_func
+      if g['filter'] then filter_func = apply_filter end
+      for _i,a in ipairs(addrs) do
+        add_value(a['addr'], filter_func)
+        if a['domain'] then
+          add_value('@' .. a['domain'], filter_func)
+        end
+        if a['user'] then
+          add_value(a['user'] .. '@', filter_func)
+        end
+      end
+    end
+
+    if g['type'] == 'ip' then
+      if ip:is_valid() then
+        table.insert(values, ip)
+      end
+    elseif g['type'] == 'header' then
+      local hv = task:get_header_full(g['header'])
+      if hv then
+        local filter_func
+        if g['filter'] then filter_func = apply_filter end
+        for _i,h in ipairs(hv) do
+          add_value(h['decoded'], filter_func)
+        end
+      end
+    elseif g['type'] == 'rcpt' then
+      if task:has_recipients() then
+        add_addrs(task:get_recipients() or {})
+      end
+    elseif g['type'] == 'from' then
+      if task:has_from() then
+        add_addrs(task:get_from() or {})
+      end
+    elseif g['type'] == 'url' then
+      if task:has_urls() then
+        for _i,u in ipairs(task:get_urls()) do
+          if g['filter'] then
+            add_value(apply_url_filter(g['filter'], u, g))
+          else
+            add_value(u:get_host())
+          end
+        end
+      end
+    elseif g['type'] == 'filename' then
+      local filter_func
+      if g['filter'] then filter_func = apply_filename_filter end
+      for _i,p in ipairs(task:get_parts()) do
+        add_value(p:get_filename(), filter_func)
+      end
+    end
+
+    return values
+  end
+
+  _.each(function(g)
+    local values = group_values(g)
+    if #values > 0 then
+      for _i,id in ipairs(g['map_group']:match(values)) do
+        local r = g['rules'][id]
+        task:insert_result(r['symbol'], 1)
+
+        if pre_filter then
+          task:set_pre_result(r['action'], 'Matched map: ' .. r['symbol'])
+        end
+      end
+    end
+  end,
+  _.filter(function(g) return pre_filter == g['prefilter'] end, groups))
+
   -- RBL rules
   if ip:is_valid() then
     _.each(function(r)
@@ -375,7 +462,7 @@ local function multimap_callback(task, pre_filter)
           })
       end,
     _.filter(function(r)
-      return pre_filter == r['prefilter'] and r['type'] == 'dnsbl'
+      return pre_filter == r['prefilter'] and not r['group'] and r['type'] == 'dnsbl'
     end, rules))
   end
 end
@@ -465,6 +552,38 @@ local function add_multimap_rule(key, newrule)
   return nil
 end
 
+-- Puts rule to the group of rules with the same input
+local groups_by_input = {}
+local function add_rule_to_group(rule)
+  local map = rule['radix'] or rule['hash']
+  if not map then
+    -- cdb and dnsbl rules are checked separately
+    return
+  end
+
+  local key = table.concat({tostring(rule['prefilter']), rule['type'],
+    rule['header'] or '', rule['filter'] or ''}, ':')
+  local g = groups_by_input[key]
+  if not g then
+    g = {
+      prefilter = rule['prefilter'],
+      type = rule['type'],
+      header = rule['header'],
+      filter = rule['filter'],
+      map_group = rspamd_map_group.create(),
+      rules = {},
+    }
+    groups_by_input[key] = g
+    table.insert(groups, g)
+  end
+
+  local id = #g['rules'] + 1
+  if g['map_group']:add(map, id) then
+    g['rules'][id] = rule
+    rule['group'] = true
+  end
+end
+
 -- Registration
 local opts =  rspamd_config:get_all_opt('multimap')
 if opts and type(opts) == 'table' then
@@ -475,6 +594,7 @@ if opts and type(opts) == 'table' then
         rspamd_logger.errx(rspamd_config, 'cannot add rule: "'..k..'"')
       else
         table.insert(rules, rule)
+        add_rule_to_group(rule)
       end
     else
       rspamd_logger.errx(rspamd_config, 'parameter ' .. k .. ' is invalid, must be an object')
@@ -22,13 +22,37 @@ local domains = nil
 local strict_domains = {}
 local redirector_domains = {}
 local rspamd_logger = require "rspamd_logger"
+local rspamd_map_group = require "rspamd_map_group"
 local util = require "rspamd_util"
 local opts = rspamd_config:get_all_opt('phishing')
 
+-- Redirector maps are matched against url tld, other maps against phished tld
+local redirector_group = rspamd_map_group.create()
+local phished_group = rspamd_map_group.create()
+local domains_id = 0
+
 local function phishing_cb(task)
   local urls = task:get_urls()
 
   if urls then
+    -- Maps are matched once per host as many urls share the same hosts
+    local redirector_cache = {}
+    local phished_cache = {}
+    local seen = {}
+
+    local function match_cached(group, cache, host)
+      local res = cache[host]
+      if not res then
+        res = {}
+        for _,id in ipairs(group:match(host)) do
+          res[id] = true
+        end
+        cache[host] = res
+      end
+
+      return res
+    end
+
     for _,url in ipairs(urls) do
       if url:is_phished() then
         local found = false
@@ -40,39 +64,50 @@ local function phishing_cb(task)
           return
         end
 
-        local weight = 1.0
-        local dist = util.levenshtein_distance(tld, ptld)
-        dist = 2 * dist / (#tld + #ptld)
+        -- Results depend merely on hosts pair
+        local key = tld .. '\0' .. ptld
+        if not seen[key] then
+          seen[key] = true
 
-        if dist > 0.3 and dist <= 1.0 then
-          -- Use distance to penalize the total weight
-          weight = util.tanh(3 * (1 - dist + 0.1))
-        end
-        rspamd_logger.debugx(task, "distance: %1 -> %2: %3", tld, ptld, dist)
+          local weight = 1.0
+          local dist = util.levenshtein_distance(tld, ptld)
+          dist = 2 * dist / (#tld + #ptld)
+
+          if dist > 0.3 and dist <= 1.0 then
+            -- Use distance to penalize the total weight
+            weight = util.tanh(3 * (1 - dist + 0.1))
+          end
+          rspamd_logger.debugx(task, "distance: %1 -> %2: %3", tld, ptld, dist)
 
-        if #redirector_domains > 0 then
-          for _,rule in ipairs(redirector_domains) do
-            if rule['map']:get_key(url:get_tld()) then
-              task:insert_result(rule['symbol'], weight, ptld)
-              found = true
+          if #redirector_domains > 0 then
+            local res = match_cached(redirector_group, redirector_cache, tld)
+            for i,rule in ipairs(redirector_domains) do
+              if res[i] then
+                task:insert_result(rule['symbol'], weight, ptld)
+                found = true
+              end
             end
           end
-        end
-        if not found and #strict_domains > 0 then
-          for _,rule in ipairs(strict_domains) do
-            if rule['map']:get_key(ptld) then
-              task:insert_result(rule['symbol'], 1.0, ptld)
-              found = true
+
+          local res
+          if not found and #strict_domains > 0 then
+            res = match_cached(phished_group, phished_cache, ptld)
+            for i,rule in ipairs(strict_domains) do
+              if res[i] then
+                task:insert_result(rule['symbol'], 1.0, ptld)
+                found = true
+              end
             end
           end
-        end
-        if not found then
-          if domains then
-            if domains:get_key(ptld) then
+          if not found then
+            if domains then
+              res = match_cached(phished_group, phished_cache, ptld)
+              if res[domains_id] then
+                task:insert_result(symbol, weight, ptld)
+              end
+            else
               task:insert_result(symbol, weight, ptld)
             end
-          else
-            task:insert_result(symbol, weight, ptld)
           end
         end
       end
@@ -118,9 +153,19 @@ if opts then
       callback = phishing_cb
     })
   end
-  if opts['domains'] and type(opt['domains']) == 'string' then
-    domains = rspamd_config:add_hash_map (opts['domains'])
-  end
   phishing_map('strict_domains', strict_domains)
   phishing_map('redirector_domains', redirector_domains)
+  if opts['domains'] and type(opts['domains']) == 'string' then
+    domains = rspamd_config:add_hash_map (opts['domains'])
+    if domains then
+      domains_id = #strict_domains + 1
+      phished_group:add(domains, domains_id)
+    end
+  end
+  for i,rule in ipairs(strict_domains) do
+    phished_group:add(rule['map'], i)
+  end
+  for i,rule in ipairs(redirector_domains) do
+    redirector_group:add(rule['map'], i)
+  end
 end
@@ -45,11 +45,21 @@ local upstreams
 local ratelimit_symbol
 -- Do not delay mail after 1 day
 local max_delay = 24 * 3600
+-- Buckets are checked in redis for each message in `exact` mode or in shared
+-- memory in `local` mode, where deltas are flushed to redis asynchronously
+local mode = 'exact'
+local shm_buckets
+-- Pending delta of a local bucket that triggers flush to redis
+local max_drift = 10
+-- Maximum time in seconds between flushes of a local bucket
+local sync_interval = 10
+local shm_size = 16 * 1024 * 1024
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_redis = require "rspamd_redis"
 local upstream_list = require "rspamd_upstream_list"
 local rspamd_util = require "rspamd_util"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 local _ = require "fun"
 --local dumper = require 'pl.pretty'.dump
 
@@ -120,6 +130,24 @@ local function generate_format_string(args, is_set)
   --return _.foldl(function(acc, k) return acc .. ' %s' end, 'MGET', args)
 end
 
+--- Apply limit for the leaked bucket
+local function check_bucket(task, bucket, threshold)
+  if bucket > 0 then
+    if ratelimit_symbol then
+      local mult = 2 * rspamd_util.tanh(bucket / (threshold * 2))
+
+      if mult > 0.5 then
+        task:insert_result(ratelimit_symbol, mult,
+          tostring(mult))
+      end
+    else
+      if bucket > threshold then
+        task:set_pre_result('soft reject', 'Ratelimit exceeded')
+      end
+    end
+  end
+end
+
 --- Check specific limit inside redis
 local function check_limits(task, args)
 
@@ -144,20 +172,7 @@ local function check_limits(task, args)
             atime - ctime)
         else
           bucket = bucket - rate * (ntime - atime);
-          if bucket > 0 then
-            if ratelimit_symbol then
-              local mult = 2 * rspamd_util.tanh(bucket / (threshold * 2))
-
-              if mult > 0.5 then
-                task:insert_result(ratelimit_symbol, mult,
-                  tostring(mult))
-              end
-            else
-              if bucket > threshold then
-                task:set_pre_result('soft reject', 'Ratelimit exceeded')
-              end
-            end
-          end
+          check_bucket(task, bucket, threshold)
         end
       end, _.zip(parse_limits(data), _.map(function(a) return a[1] end, args)))
     elseif err then
@@ -238,6 +253,98 @@ local function set_limits(task, args)
   end
 end
 
+-- Adds delta to bucket in redis and returns its new level
+local sync_script = [[
+local now, rate, delta = tonumber(ARGV[1]), tonumber(ARGV[2]), tonumber(ARGV[3])
+local v = redis.call('GET', KEYS[1])
+local bucket, ctime = 0, now
+if v then
+  local atime, b, c = string.match(v, '^([^:]+):([^:]+):?([^:]*)$')
+  atime = tonumber(atime) or now
+  ctime = tonumber(c) or atime
+  bucket = (tonumber(b) or 0) - rate * (now - atime)
+  if bucket < 0 or now - ctime > tonumber(ARGV[4]) then
+    bucket = 0
+    ctime = now
+  end
+end
+bucket = bucket + delta
+redis.call('SETEX', KEYS[1], ARGV[4], string.format('%.3f:%.3f:%.3f', now, bucket, ctime))
+return tostring(bucket)
+]]
+
+local function task_time(task)
+  local tv = task:get_timeval()
+  return tv['tv_usec'] / 1000000. + tv['tv_sec']
+end
+
+--- Check limits in shared memory
+local function check_local_limits(task, args)
+  local ntime = task_time(task)
+
+  _.each(function(arg)
+    local limit = arg[1]
+    check_bucket(task, shm_buckets:bucket_get(arg[2], limit[2], ntime),
+      limit[1])
+  end, args)
+end
+
+--- Update limits in shared memory and flush deltas that are due to redis
+local function set_local_limits(task, args)
+  local ntime = task_time(task)
+  local flushes = {}
+
+  _.each(function(arg)
+    local rate = arg[1][2]
+    local key = arg[2]
+    local taken = select(2, shm_buckets:bucket_add(key, rate, 1, max_delay,
+      max_drift, sync_interval, ntime))
+
+    if taken and taken > 0 then
+      local upstream = upstreams:get_upstream_by_hash(key)
+      local addr = upstream:get_addr()
+      local id = string.format('%s:%s', addr:to_string(), addr:get_port())
+
+      if not flushes[id] then
+        flushes[id] = {upstream = upstream, commands = {}, buckets = {}}
+      end
+
+      local f = flushes[id]
+      table.insert(f.commands, {'EVAL', {sync_script, '1', key,
+        string.format('%.3f', ntime), tostring(rate), tostring(taken),
+        tostring(max_delay)}})
+      table.insert(f.buckets, {key, rate})
+    end
+  end, args)
+
+  -- All deltas for the same server are sent in a single pipeline
+  _.each(function(id, f)
+    local function sync_cb(t, err, results)
+      if err then
+        rspamd_logger.infox(t, 'got error while flushing limits to %1: %2',
+          id, err)
+        f.upstream:fail()
+      end
+
+      if results then
+        _.each(function(i, b)
+          local level = tonumber(results[i])
+          if level then
+            shm_buckets:bucket_sync(b[1], b[2], level, max_delay, ntime)
+          end
+        end, _.enumerate(f.buckets))
+      end
+    end
+
+    rspamd_redis.make_pipeline({
+      task = task,
+      host = f.upstream:get_addr(),
+      commands = f.commands,
+      callback = sync_cb,
+    })
+  end, flushes)
+end
+
 --- Make rate key
 local function make_rate_key(from, to, ip)
   if from and ip and ip:is_valid() then
@@ -330,11 +437,19 @@ end
 
 --- Check limit
 local function rate_test(task)
-  rate_test_set(task, check_limits)
+  if shm_buckets then
+    rate_test_set(task, check_local_limits)
+  else
+    rate_test_set(task, check_limits)
+  end
 end
 --- Update limit
 local function rate_set(task)
-  rate_test_set(task, set_limits)
+  if shm_buckets then
+    rate_test_set(task, set_local_limits)
+  else
+    rate_test_set(task, set_limits)
+  end
 end
 
 
@@ -417,6 +532,29 @@ if opts then
     max_rcpt = tonumber(opts['max_delay'])
   end
 
+  if opts['mode'] then
+    mode = opts['mode']
+  end
+
+  if opts['max_drift'] then
+    max_drift = tonumber(opts['max_drift'])
+  end
+
+  if opts['sync_interval'] then
+    sync_interval = tonumber(opts['sync_interval'])
+  end
+
+  if opts['shm_size'] then
+    shm_size = tonumber(opts['shm_size'])
+  end
+
+  if mode == 'local' then
+    -- Must be created before workers are spawned to be shared between them
+    shm_buckets = rspamd_shared_cache.create(rspamd_config, {bytes = shm_size})
+  elseif mode ~= 'exact' then
+    rspamd_logger.errx(rspamd_config, 'invalid ratelimit mode: %s', mode)
+  end
+
   if not opts['servers'] then
     rspamd_logger.infox(rspamd_config, 'no servers are specified, disabling module')
   else
@@ -21,10 +21,12 @@ limitations under the License.
 
 local rbls = {}
 local local_exclusions = nil
+local native_rbls = nil
 
 local rspamd_logger = require 'rspamd_logger'
 local rspamd_ip = require 'rspamd_ip'
 local rspamd_util = require 'rspamd_util'
+local rspamd_rbl = require 'rspamd_rbl'
 
 local symbols = {
   dkim_allow_symbol = 'R_DKIM_ALLOW',
@@ -99,6 +101,9 @@ local function rbl_cb (task)
     task:inc_dns_req()
   end
 
+  -- Lists with plain return codes are checked by the native engine
+  native_rbls:check(task)
+
   local havegot = {}
   local notgot = {}
 
@@ -359,6 +364,11 @@ if(opts['local_exclude_ip_map'] ~= nil) then
   local_exclusions = rspamd_config:add_radix_map(opts['local_exclude_ip_map'])
 end
 
+native_rbls = rspamd_rbl.create(rspamd_config, {
+  exclusions = local_exclusions,
+  dkim_symbol = symbols['dkim_allow_symbol'],
+})
+
 local white_symbols = {}
 local black_symbols = {}
 local need_dkim = false
@@ -375,8 +385,17 @@ for key,rbl in pairs(opts['rbls']) do
       rbl[default_v[2]] = opts[default]
     end
   end
-  if type(rbl['returncodes']) == 'table' then
-    for s,_ in pairs(rbl['returncodes']) do
+  local code_symbols = {}
+  for _,codes in ipairs({'returncodes', 'returnbits'}) do
+    if type(rbl[codes]) == 'table' then
+      for s,_ in pairs(rbl[codes]) do
+        code_symbols[s] = true
+      end
+    end
+  end
+  local has_codes = next(code_symbols) ~= nil
+  if has_codes then
+    for s,_ in pairs(code_symbols) do
       if type(rspamd_config.get_api_version) ~= 'nil' then
         rspamd_config:register_symbol({
           name = s,
@@ -415,8 +434,8 @@ for key,rbl in pairs(opts['rbls']) do
     end
   end
   if not rbl['symbol'] and
-    ((rbl['returncodes'] and rbl['unknown']) or
-    (not rbl['returncodes'])) then
+    ((has_codes and rbl['unknown']) or
+    (not has_codes)) then
       rbl['symbol'] = key
   end
   if type(rspamd_config.get_api_version) ~= 'nil' and rbl['symbol'] then
@@ -454,7 +473,13 @@ for key,rbl in pairs(opts['rbls']) do
       end
     end
   end
-  rbls[key] = rbl
+  if not native_rbls:add_rule(key, rbl) then
+    if rbl['returnbits'] then
+      rspamd_logger.errx(rspamd_config,
+        'returnbits of %1 require plain returncodes and are ignored', key)
+    end
+    rbls[key] = rbl
+  end
 end
 for _, w in pairs(white_symbols) do
   for _, b in pairs(black_symbols) do
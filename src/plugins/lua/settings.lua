@@ -21,13 +21,10 @@ limitations under the License.
 local set_section = rspamd_config:get_all_opt("settings")
 
 local settings = {
-  [1] = {},
-  [2] = {},
-  [3] = {}
+  rules = {}
 }
 local settings_ids = {}
 local settings_initialized = false
-local max_pri = 0
 local rspamd_logger = require "rspamd_logger"
 local rspamd_ip = require "rspamd_ip"
 local rspamd_regexp = require "rspamd_regexp"
@@ -90,127 +87,57 @@ local function check_query_settings(task)
   return false
 end
 
--- Check limit for a task
-local function check_settings(task)
-  local function check_addr_setting(rule, addr)
-    local function check_specific_addr(elt)
-      if rule['name'] then
-        if elt['addr'] == rule['name'] then
-          return true
-        end
-      end
-      if rule['user'] then
-        if rule['user'] == elt['user'] then
-          return true
-        end
-      end
-      if rule['domain'] then
-        if rule['domain'] == elt['domain'] then
-          return true
-        end
-      end
-      if rule['regexp'] then
-        if rule['regexp']:match(elt['addr']) then
-          return true
-        end
-      end
-      return false
-    end
-
-    for _, e in ipairs(addr) do
-      if check_specific_addr(e) then
-        return true
-      end
-    end
-
-    return false
+-- Adds rule index to the list of rules for a key in the specified index
+local function index_add(idx, key, rule_idx)
+  local l = idx[key]
+  if not l then
+    l = {}
+    idx[key] = l
   end
+  table.insert(l, rule_idx)
+end
 
-  local function check_ip_setting(rule, ip)
-    if rule[2] ~= 0 then
-      local nip = ip:apply_mask(rule[2])
-      if nip and nip:to_string() == rule[1]:to_string() then
-        return true
-      end
-    elseif ip:to_string() == rule[1]:to_string() then
-      return true
+-- Marks all rules from the list as matched by the field
+local function mark_matched(matched, l)
+  if l then
+    for _,r in ipairs(l) do
+      matched[r] = true
     end
-
-    return false
   end
+end
 
-  local function check_specific_setting(name, rule, ip, from, rcpt, user)
-    local res = false
-
-    if rule['ip'] then
-      if not ip then
-        return nil
-      end
-      for _, i in ipairs(rule['ip']) do
-        res = check_ip_setting(i, ip)
-        if res then
-          break
-        end
-      end
-      if not res then
-        return nil
-      end
-    end
-
-    if rule['from'] then
-      if not from then
-        return nil
+-- Check limit for a task
+local function check_settings(task)
+  local function match_addrs(idx, addrs, matched)
+    for _,elt in ipairs(addrs) do
+      if elt['addr'] then
+        mark_matched(matched, idx.name[elt['addr']])
       end
-      for _, i in ipairs(rule['from']) do
-        res = check_addr_setting(i, from)
-        if res then
-          break
-        end
+      if elt['user'] then
+        mark_matched(matched, idx.user[elt['user']])
       end
-      if not res then
-        return nil
+      if elt['domain'] then
+        mark_matched(matched, idx.domain[elt['domain']])
       end
-    end
-
-    if rule['rcpt'] then
-      if not rcpt then
-        return nil
-      end
-      for _, i in ipairs(rule['rcpt']) do
-        res = check_addr_setting(i, rcpt)
-        if res then
-          break
+      if elt['addr'] then
+        for _,re in ipairs(idx.regexps) do
+          if not matched[re[2]] and re[1]:match(elt['addr']) then
+            matched[re[2]] = true
+          end
         end
       end
-      if not res then
-        return nil
-      end
     end
+  end
 
-    if rule['user'] then
-      if not user then
-        return nil
-      end
-      for _, i in ipairs(rule['user']) do
-        res = check_addr_setting(i, user)
-        if res then
-          break
-        end
-      end
-      if not res then
-        return nil
-      end
-    end
+  local function match_ip(ip, matched)
+    mark_matched(matched, settings.ip.exact[ip:to_string()])
 
-    if res then
-      if rule['whitelist'] then
-        rule['apply'] = {whitelist = true}
+    for mask,idx in pairs(settings.ip.masks) do
+      local nip = ip:apply_mask(mask)
+      if nip then
+        mark_matched(matched, idx[nip:to_string()])
       end
-
-      return rule
     end
-
-    return nil
   end
 
   -- Check if we have override as query argument
@@ -242,25 +169,59 @@ local function check_settings(task)
       user[1]["addr"] = uname
     end
   end
+
+  -- Rules matched by each field, rule matches if all its fields do so
+  local matched = {
+    ip = {},
+    from = {},
+    rcpt = {},
+    user = {},
+  }
+  if ip and ip:is_valid() then
+    match_ip(ip, matched.ip)
+  end
+  if from then
+    match_addrs(settings.from, from, matched.from)
+  end
+  if rcpt then
+    match_addrs(settings.rcpt, rcpt, matched.rcpt)
+  end
+  match_addrs(settings.user, user, matched.user)
+
+  local candidates = {}
+  for _,m in pairs(matched) do
+    for r,_ in pairs(m) do
+      candidates[r] = true
+    end
+  end
+
+  local res = {}
+  for r,_ in pairs(candidates) do
+    local rule = settings.rules[r]
+    if all(function(f) return matched[f][r] end, rule.fields) then
+      table.insert(res, r)
+    end
+  end
+
   -- Match rules according their order
-  for pri = max_pri,1,-1 do
-    if settings[pri] then
-      for name, r in pairs(settings[pri]) do
-        local rule = check_specific_setting(name, r, ip, from, rcpt, user)
-        if rule then
-          rspamd_logger.infox(task, "<%1> apply settings according to rule %2",
-            task:get_message_id(), name)
-          if rule['apply'] then
-            task:set_settings(rule['apply'])
-          end
-          if rule['symbols'] then
-            -- Add symbols, specified in the settings
-            each(function(val)
-              task:insert_result(val, 1.0)
-            end, rule['symbols'])
-          end
-        end
-      end
+  table.sort(res, function(r1, r2)
+    local p1, p2 = settings.rules[r1].pri, settings.rules[r2].pri
+    if p1 ~= p2 then return p1 > p2 end
+    return tostring(settings.rules[r1].name) < tostring(settings.rules[r2].name)
+  end)
+
+  for _,r in ipairs(res) do
+    local rule = settings.rules[r]
+    rspamd_logger.infox(task, "<%1> apply settings according to rule %2",
+      task:get_message_id(), rule.name)
+    if rule['apply'] then
+      task:set_settings(rule['apply'])
+    end
+    if rule['symbols'] then
+      -- Add symbols, specified in the settings
+      each(function(val)
+        task:insert_result(val, 1.0)
+      end, rule['symbols'])
     end
   end
 
@@ -430,6 +391,53 @@ local function process_settings_table(tbl)
     return out
   end
 
+  -- Adds rule conditions to the indexes
+  local index_rule = function(idx, rule)
+    local r = settings.rules[idx]
+    if rule['ip'] then
+      table.insert(r.fields, 'ip')
+      for _,i in ipairs(rule['ip']) do
+        if i[2] ~= 0 then
+          local nip = i[1]:apply_mask(i[2])
+          if nip then
+            if not settings.ip.masks[i[2]] then
+              settings.ip.masks[i[2]] = {}
+            end
+            index_add(settings.ip.masks[i[2]], nip:to_string(), idx)
+          end
+        else
+          index_add(settings.ip.exact, i[1]:to_string(), idx)
+        end
+      end
+    end
+
+    each(function(f)
+      if rule[f] then
+        table.insert(r.fields, f)
+        for _,a in ipairs(rule[f]) do
+          if a['name'] then
+            index_add(settings[f].name, a['name'], idx)
+          elseif a['user'] then
+            index_add(settings[f].user, a['user'], idx)
+          elseif a['domain'] then
+            index_add(settings[f].domain, a['domain'], idx)
+          elseif a['regexp'] then
+            table.insert(settings[f].regexps, {a['regexp'], idx})
+          end
+        end
+      end
+    end, {'from', 'rcpt', 'user'})
+  end
+
+  local new_addr_index = function()
+    return {
+      name = {},
+      user = {},
+      domain = {},
+      regexps = {},
+    }
+  end
+
   settings_initialized = false
   -- filter trash in the input
   local ft = filter(
@@ -441,21 +449,34 @@ local function process_settings_table(tbl)
     end, tbl)
 
   -- clear all settings
-  max_pri = 0
   local nrules = 0
   settings_ids = {}
-  for k,v in pairs(settings) do settings[k]={} end
-  -- fill new settings by priority
+  settings = {
+    rules = {},
+    ip = {
+      exact = {},
+      masks = {},
+    },
+    from = new_addr_index(),
+    rcpt = new_addr_index(),
+    user = new_addr_index(),
+  }
+  -- fill new settings and their indexes
   for_each(function(k, v)
-    local pri = get_priority(v)
-    if pri > max_pri then max_pri = pri end
-    if not settings[pri] then
-      settings[pri] = {}
-    end
     local s = process_setting_elt(k, v)
     if s then
-      settings[pri][k] = s
+      if s['whitelist'] then
+        s['apply'] = {whitelist = true}
+      end
       nrules = nrules + 1
+      settings.rules[nrules] = {
+        name = k,
+        pri = get_priority(v),
+        apply = s['apply'],
+        symbols = s['symbols'],
+        fields = {},
+      }
+      index_rule(nrules, s)
     end
   end, ft)
 
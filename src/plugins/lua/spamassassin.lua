@@ -93,6 +93,8 @@ local freemail_domains = {}
 local pcre_only_regexps = {}
 local freemail_trie
 local sa_mempool = rspamd_mempool.create()
+-- Atoms of meta rules evaluated without calling lua
+local sa_atoms = rspamd_expression.create_atoms(sa_mempool)
 local replace = {
   tags = {},
   pre = {},
@@ -1076,55 +1078,6 @@ local function apply_replacements(str)
   return false,str
 end
 
-local function parse_atom(str)
-  local atom = table.concat(_.totable(_.take_while(function(c)
-    if string.find(', \t()><+!|&\n', c) then
-      return false
-    end
-    return true
-  end, _.iter(str))), '')
-
-  return atom
-end
-
-local function process_atom(atom, task)
-  local atom_cb = atoms[atom]
-
-  if atom_cb then
-    local res = atom_cb(task)
-
-    if not res then
-      rspamd_logger.debugx(task, 'atom: %1, NULL result', atom)
-    elseif res > 0 then
-      rspamd_logger.debugx(task, 'atom: %1, result: %2', atom, res)
-    end
-    return res
-  else
-    local ext_dep = external_deps[atom]
-    if ext_dep then
-      local res = 0
-
-      if type(ext_dep) == 'number' then
-        if task:has_symbol(atom) then
-          res = 1
-        end
-      elseif type(ext_dep) == 'string' then
-        -- Apply replacement
-        if task:has_symbol(ext_dep) then
-          res = 1
-        end
-      end
-
-      rspamd_logger.debugx(task, 'external atom: %1, result: %2', atom, res)
-
-      return res
-    else
-      rspamd_logger.debugx(task, 'Cannot find atom ' .. atom)
-    end
-  end
-  return 0
-end
-
 local function post_process()
   -- Replace rule tags
   local ntags = {}
@@ -1188,35 +1141,8 @@ local function post_process()
 
       local raw = false
       local check = {}
-      -- Cached path for ordinary expressions
-      if r['ordinary'] then
-        local h = r['header'][1]
-        local t = 'header'
 
-        if h['raw'] then
-          t = 'rawheader'
-        end
-
-        if not r['re'] then
-          rspamd_logger.errx(task, 're is missing for rule %s (%s header)', k,
-            h['header'])
-          return 0
-        end
-
-        local ret = task:process_regexp(r['re'], t, h['header'], h['strong'])
-
-        if r['not'] then
-          if ret ~= 0 then
-            ret = 0
-          else
-            ret = 1
-          end
-        end
-
-        return ret
-      end
-
-      -- Slow path
+      -- Slow path, ordinary expressions are processed by the regexp cache
       _.each(function(h)
         local headers = {}
         local hname = h['header']
@@ -1290,7 +1216,26 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    --rspamd_config:register_symbol(k, calculate_score(k), f)
+    if r['ordinary'] and r['re'] then
+      local h = r['header'][1]
+      local t = 'header'
+
+      if r['mime'] then
+        t = 'mimeheader'
+      elseif h['raw'] then
+        t = 'rawheader'
+      end
+
+      sa_atoms:add_regexp(k, {
+        re = r['re'],
+        type = t,
+        header = h['header'],
+        strong = h['strong'],
+        ['not'] = r['not'],
+      })
+    else
+      sa_atoms:add_function(k, f)
+    end
     atoms[k] = f
   end,
   _.filter(function(k, r)
@@ -1313,7 +1258,7 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    --rspamd_config:register_symbol(k, calculate_score(k), f)
+    sa_atoms:add_function(k, f)
     atoms[k] = f
   end,
     _.filter(function(k, r)
@@ -1340,7 +1285,7 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    --rspamd_config:register_symbol(k, calculate_score(k), f)
+    sa_atoms:add_function(k, f)
     atoms[k] = f
   end,
   _.filter(function(k, r)
@@ -1366,7 +1311,11 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    --rspamd_config:register_symbol(k, calculate_score(k), f)
+    if r['re'] then
+      sa_atoms:add_regexp(k, {re = r['re'], type = r['type']})
+    else
+      sa_atoms:add_function(k, f)
+    end
     atoms[k] = f
   end,
   _.filter(function(k, r)
@@ -1389,7 +1338,11 @@ local function post_process()
         add_sole_meta(k, r)
       end
     end
-    --rspamd_config:register_symbol(k, calculate_score(k), f)
+    if r['re'] then
+      sa_atoms:add_regexp(k, {re = r['re'], type = 'url'})
+    else
+      sa_atoms:add_function(k, f)
+    end
     atoms[k] = f
   end,
     _.filter(function(k, r)
@@ -1419,8 +1372,7 @@ local function post_process()
 
         return res
       end
-      expression = rspamd_expression.create(r['meta'],
-        {parse_atom, process_atom}, sa_mempool)
+      expression = rspamd_expression.create(r['meta'], sa_atoms, sa_mempool)
       if not expression then
         rspamd_logger.errx(rspamd_config, 'Cannot parse expression ' .. r['meta'])
       else
@@ -1439,6 +1391,8 @@ local function post_process()
         })
         r['expression'] = expression
         if not atoms[k] then
+          -- Nested metas are evaluated natively and inserted once
+          sa_atoms:add_expression(k, expression)
           atoms[k] = meta_cb
         end
       end
@@ -1476,6 +1430,7 @@ local function post_process()
               else
                 external_deps[a] = 1
               end
+              sa_atoms:add_symbol(a, rspamd_symbol or a)
             end
           end
         end
@@ -65,12 +65,28 @@ read_regexp_expression (rspamd_mempool_t * pool,
 	struct regexp_module_item *chain,
 	const gchar *symbol,
 	const gchar *line,
+	const gchar *group,
 	struct rspamd_config *cfg)
 {
 	struct rspamd_expression *e = NULL;
+	struct rspamd_mime_expr_ud ud;
+	struct rspamd_symbol_def *sdef;
 	GError *err = NULL;
 
-	if (!rspamd_parse_expression (line, 0, &mime_expr_subr, cfg, pool, &err,
+	if (group == NULL && cfg->default_metric != NULL) {
+		/* Symbol might be already defined in some group of the metric */
+		sdef = g_hash_table_lookup (cfg->default_metric->symbols, symbol);
+
+		if (sdef != NULL && sdef->gr != NULL) {
+			group = sdef->gr->name;
+		}
+	}
+
+	/* Split regexps by groups to skip scanning of disabled ones */
+	ud.cfg = cfg;
+	ud.group = group;
+
+	if (!rspamd_parse_expression (line, 0, &mime_expr_subr, &ud, pool, &err,
 			&e)) {
 		msg_warn_pool ("%s = \"%s\" is invalid regexp expression: %e", symbol,
 				line,
@@ -158,7 +174,7 @@ regexp_module_config (struct rspamd_config *cfg)
 
 			if (!read_regexp_expression (regexp_module_ctx->regexp_pool,
 				cur_item, ucl_object_key (value),
-				ucl_obj_tostring (value), cfg)) {
+				ucl_obj_tostring (value), NULL, cfg)) {
 				res = FALSE;
 			}
 			else {
@@ -195,6 +211,12 @@ regexp_module_config (struct rspamd_config *cfg)
 			gboolean is_lua = FALSE, valid_expression = TRUE;
 
 			/* We have some lua table, extract its arguments */
+			elt = ucl_object_lookup (value, "group");
+
+			if (elt) {
+				group = ucl_object_tostring (elt);
+			}
+
 			elt = ucl_object_lookup (value, "callback");
 
 			if (elt == NULL || elt->type != UCL_USERDATA) {
@@ -210,7 +232,7 @@ regexp_module_config (struct rspamd_config *cfg)
 
 					if (!read_regexp_expression (regexp_module_ctx->regexp_pool,
 							cur_item, ucl_object_key (value),
-							ucl_obj_tostring (elt), cfg)) {
+							ucl_obj_tostring (elt), group, cfg)) {
 						res = FALSE;
 					}
 					else {
@@ -265,12 +287,6 @@ regexp_module_config (struct rspamd_config *cfg)
 					description = ucl_object_tostring (elt);
 				}
 
-				elt = ucl_object_lookup (value, "group");
-
-				if (elt) {
-					group = ucl_object_tostring (elt);
-				}
-
 				elt = ucl_object_lookup (value, "score");
 
 				if (elt) {
@@ -30,6 +30,7 @@
 #include "libutil/map.h"
 #include "rspamd.h"
 #include "addr.h"
+#include "libutil/shared_cache.h"
 
 #define DEFAULT_SYMBOL_FAIL "R_SPF_FAIL"
 #define DEFAULT_SYMBOL_SOFTFAIL "R_SPF_SOFTFAIL"
@@ -37,6 +38,7 @@
 #define DEFAULT_SYMBOL_ALLOW "R_SPF_ALLOW"
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
+#define DEFAULT_SHARED_CACHE_SIZE (4 * 1024 * 1024)
 
 struct spf_ctx {
 	struct module_ctx ctx;
@@ -48,6 +50,7 @@ struct spf_ctx {
 	rspamd_mempool_t *spf_pool;
 	radix_compressed_t *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	struct rspamd_shared_cache *shared_cache;
 };
 
 static struct spf_ctx *spf_module_ctx = NULL;
@@ -153,6 +156,15 @@ spf_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"spf",
+			"Memory used to share flattened SPF records among all processes (0 to disable)",
+			"shared_cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			NULL,
+			0);
 
 	return 0;
 }
@@ -164,6 +176,7 @@ spf_module_config (struct rspamd_config *cfg)
 	const ucl_object_t *value;
 	gint res = TRUE, cb_id;
 	guint cache_size;
+	gsize shared_cache_size;
 	const gchar *str;
 
 	if (!rspamd_config_is_module_enabled (cfg, "spf")) {
@@ -207,6 +220,13 @@ spf_module_config (struct rspamd_config *cfg)
 	else {
 		cache_size = DEFAULT_CACHE_SIZE;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "spf", "shared_cache_size")) != NULL) {
+		shared_cache_size = ucl_obj_toint (value);
+	}
+	else {
+		shared_cache_size = DEFAULT_SHARED_CACHE_SIZE;
+	}
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "spf", "whitelist")) != NULL) {
@@ -252,6 +272,14 @@ spf_module_config (struct rspamd_config *cfg)
 			NULL,
 			(GDestroyNotify)spf_record_unref);
 
+	if (shared_cache_size > 0) {
+		/* Modules are configured before workers are spawned */
+		spf_module_ctx->shared_cache = rspamd_shared_cache_new (cfg->cfg_pool,
+				0, shared_cache_size, 0);
+		rspamd_config_register_persistent_cache (cfg, "spf",
+				spf_module_ctx->shared_cache);
+	}
+
 	msg_info_config ("init internal spf module");
 
 	return res;
@@ -272,115 +300,107 @@ spf_module_reconfig (struct rspamd_config *cfg)
 	return spf_module_config (cfg);
 }
 
-static gboolean
-spf_check_element (struct spf_addr *addr, struct rspamd_task *task)
+static void
+spf_insert_result (struct spf_addr *addr, struct rspamd_task *task)
 {
-	gboolean res = FALSE;
-	const guint8 *s, *d;
 	gchar *spf_result;
-	guint af, mask, bmask, addrlen;
 	const gchar *spf_message, *spf_symbol;
 	GList *opts = NULL;
 
-	if (task->from_addr == NULL) {
-		return FALSE;
+	spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
+	opts = g_list_prepend (opts, spf_result);
+	switch (addr->mech) {
+	case SPF_FAIL:
+		spf_symbol = spf_module_ctx->symbol_fail;
+		spf_message = "(SPF): spf fail";
+		break;
+	case SPF_SOFT_FAIL:
+		spf_symbol = spf_module_ctx->symbol_softfail;
+		spf_message = "(SPF): spf softfail";
+		break;
+	case SPF_NEUTRAL:
+		spf_symbol = spf_module_ctx->symbol_neutral;
+		spf_message = "(SPF): spf neutral";
+		break;
+	default:
+		spf_symbol = spf_module_ctx->symbol_allow;
+		spf_message = "(SPF): spf allow";
+		break;
 	}
+	rspamd_task_insert_result (task,
+			spf_symbol,
+			1,
+			opts);
+	task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
+}
 
-	af = rspamd_inet_address_get_af (task->from_addr);
-	/* Basic comparing algorithm */
-	if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
-		((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
-		d = rspamd_inet_address_get_radix_key (task->from_addr, &addrlen);
+static void
+spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
+{
+	struct spf_addr *addr;
 
-		if (af == AF_INET6) {
-			s = (const guint8 *)addr->addr6;
-			mask = addr->m.dual.mask_v6;
-		}
-		else {
-			s = (const guint8 *)addr->addr4;
-			mask = addr->m.dual.mask_v4;
-		}
+	if (!rec->failed) {
+		addr = rspamd_spf_record_match (rec, task->from_addr);
 
-		/* Compare the first bytes */
-		bmask = mask / CHAR_BIT;
-		if (bmask > addrlen) {
-			msg_info_task ("bad mask length: %d", mask);
-		}
-		else if (memcmp (s, d, bmask) == 0) {
-
-			if (bmask * CHAR_BIT != mask) {
-				/* Compare the remaining bits */
-				s += bmask;
-				d += bmask;
-				mask = (0xff << (CHAR_BIT - (mask - bmask * 8))) & 0xff;
-				if ((*s & mask) == (*d & mask)) {
-					res = TRUE;
-				}
-			}
-			else {
-				res = TRUE;
-			}
+		if (addr) {
+			spf_insert_result (addr, task);
 		}
 	}
 	else {
-		if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
-			res = TRUE;
-		}
-		else {
-			res = FALSE;
-		}
+		msg_info_task ("<%s>: ignore spf results due to DNS failure",
+						task->message_id);
 	}
+}
 
-	if (res) {
-		spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
-		opts = g_list_prepend (opts, spf_result);
-		switch (addr->mech) {
-		case SPF_FAIL:
-			spf_symbol = spf_module_ctx->symbol_fail;
-			spf_message = "(SPF): spf fail";
-			break;
-		case SPF_SOFT_FAIL:
-			spf_symbol = spf_module_ctx->symbol_softfail;
-			spf_message = "(SPF): spf softfail";
-			break;
-		case SPF_NEUTRAL:
-			spf_symbol = spf_module_ctx->symbol_neutral;
-			spf_message = "(SPF): spf neutral";
-			break;
-		default:
-			spf_symbol = spf_module_ctx->symbol_allow;
-			spf_message = "(SPF): spf allow";
-			break;
-		}
-		rspamd_task_insert_result (task,
-				spf_symbol,
-				1,
-				opts);
-		task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
-		return TRUE;
+static void
+spf_shared_cache_insert (struct spf_resolved *record, struct rspamd_task *task)
+{
+	guchar *data;
+	gsize len;
+
+	if (spf_module_ctx->shared_cache == NULL || record->failed ||
+			record->ttl == 0) {
+		return;
 	}
 
-	return FALSE;
+	data = rspamd_spf_record_pack (record, task->tv.tv_sec + record->ttl, &len);
+	rspamd_shared_cache_insert (spf_module_ctx->shared_cache,
+			record->domain, strlen (record->domain), data, len,
+			task->tv.tv_sec, record->ttl);
+	g_free (data);
 }
 
-static void
-spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
+/* Records resolved by other processes are moved to the local cache */
+static struct spf_resolved *
+spf_shared_cache_lookup (const gchar *domain, struct rspamd_task *task)
 {
-	guint i;
-	struct spf_addr *addr;
+	struct spf_resolved *l;
+	guchar *data;
+	gsize len;
 
-	if (!rec->failed) {
-		for (i = 0; i < rec->elts->len; i ++) {
-			addr = &g_array_index (rec->elts, struct spf_addr, i);
-			if (spf_check_element (addr, task)) {
-				break;
-			}
-		}
+	if (spf_module_ctx->shared_cache == NULL) {
+		return NULL;
 	}
-	else {
-		msg_info_task ("<%s>: ignore spf results due to DNS failure",
-						task->message_id);
+
+	data = rspamd_shared_cache_lookup (spf_module_ctx->shared_cache,
+			domain, strlen (domain), task->tv.tv_sec, &len);
+
+	if (data == NULL) {
+		return NULL;
+	}
+
+	l = rspamd_spf_record_unpack (domain, data, len, task->tv.tv_sec);
+	g_free (data);
+
+	if (l == NULL) {
+		return NULL;
 	}
+
+	rspamd_spf_record_compile (l);
+	rspamd_lru_hash_insert (spf_module_ctx->spf_hash, l->domain, l,
+			task->tv.tv_sec, l->ttl);
+
+	return l;
 }
 
 static void
@@ -394,11 +414,12 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 			rspamd_lru_hash_lookup (spf_module_ctx->spf_hash,
 			record->domain, task->tv.tv_sec)) == NULL) {
 
+			rspamd_spf_record_compile (record);
 			l = spf_record_ref (record);
 			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
 				record->domain, l,
 				task->tv.tv_sec, record->ttl);
-
+			spf_shared_cache_insert (record, task);
 		}
 		spf_record_ref (l);
 		spf_check_list (l, task);
@@ -429,7 +450,8 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 	if (domain) {
 		if ((l =
 			rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
-			task->tv.tv_sec)) != NULL) {
+			task->tv.tv_sec)) != NULL ||
+			(l = spf_shared_cache_lookup (domain, task)) != NULL) {
 			spf_record_ref (l);
 			spf_check_list (l, task);
 			spf_record_unref (l);
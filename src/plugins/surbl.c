@@ -23,6 +23,9 @@
  * - redirector_connect_timeout (seconds): redirector connect timeout (default: 1s)
  * - redirector_read_timeout (seconds): timeout for reading data (default: 5s)
  * - redirector_hosts_map (map string): map that contains domains to check with redirector
+ * - redirector_cache_size (integer): memory to share redirector results among workers (default: 1Mb)
+ * - redirector_cache_servers (string): optional redis servers to share redirector results among hosts
+ * - url_expire (seconds): time to keep redirector results (default: 1d)
  * Surbl options:
  * - exceptions (map string): map of domains that should be checked via surbl using 3 (e.g. somehost.domain.com)
  *   components of domain name instead of normal 2 (e.g. domain.com)
@@ -36,18 +39,24 @@
 #include "config.h"
 #include "libmime/message.h"
 #include "libutil/map.h"
+#include "libutil/shared_cache.h"
+#include "libserver/redis_pool.h"
 #include "rspamd.h"
 #include "surbl.h"
 #include "utlist.h"
 #include "libserver/html.h"
 #include "unix-std.h"
+#ifdef WITH_HIREDIS
+#include "hiredis.h"
+#endif
 
 static struct surbl_ctx *surbl_module_ctx = NULL;
 static const guint64 rspamd_surbl_cb_magic = 0xe09b8536f80de0d1ULL;
+/* Per task table of surbl DNS requests */
+#define SURBL_REQUESTS_VAR "surbl_requests"
 
 static void surbl_test_url (struct rspamd_task *task, void *user_data);
 static void surbl_dns_callback (struct rdns_reply *reply, gpointer arg);
-static void surbl_dns_ip_callback (struct rdns_reply *reply, gpointer arg);
 static void process_dns_results (struct rspamd_task *task,
 	struct suffix_item *suffix, gchar *url, guint32 addr);
 
@@ -253,6 +262,10 @@ surbl_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 	surbl_module_ctx->tld2_file = NULL;
 	surbl_module_ctx->whitelist_file = NULL;
 	surbl_module_ctx->redirectors = NULL;
+	surbl_module_ctx->redirector_cache = NULL;
+	surbl_module_ctx->redirector_cache_servers = NULL;
+	surbl_module_ctx->redirector_cache_password = NULL;
+	surbl_module_ctx->redirector_cache_db = NULL;
 	surbl_module_ctx->whitelist = g_hash_table_new (rspamd_strcase_hash,
 			rspamd_strcase_equal);
 	/* Zero exceptions hashes */
@@ -311,6 +324,60 @@ surbl_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"surbl",
+			"Memory used to share redirector results among all processes (0 to disable)",
+			"redirector_cache_size",
+			UCL_INT,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"surbl",
+			"Redis servers used to share redirector results among hosts",
+			"redirector_cache_servers",
+			UCL_STRING,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"surbl",
+			"Password for redirector cache redis servers",
+			"redirector_cache_password",
+			UCL_STRING,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"surbl",
+			"Database for redirector cache redis servers",
+			"redirector_cache_db",
+			UCL_STRING,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"surbl",
+			"Prefix of redirector cache keys in redis",
+			"redirector_cache_prefix",
+			UCL_STRING,
+			NULL,
+			0,
+			NULL,
+			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"surbl",
+			"Time to keep redirector results",
+			"url_expire",
+			UCL_TIME,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"surbl",
 			"Maximum number of URLs to process per message",
@@ -464,6 +531,7 @@ surbl_module_config (struct rspamd_config *cfg)
 	const gchar *redir_val, *ip_val;
 	guint32 bit;
 	gint cb_id, nrules = 0;
+	gsize cache_size;
 
 	if (!rspamd_config_is_module_enabled (cfg, "surbl")) {
 		return TRUE;
@@ -537,6 +605,60 @@ surbl_module_config (struct rspamd_config *cfg)
 		}
 	}
 
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_size")) != NULL) {
+		cache_size = ucl_obj_toint (value);
+	}
+	else {
+		cache_size = DEFAULT_REDIRECTOR_CACHE_SIZE;
+	}
+
+	if (surbl_module_ctx->use_redirector && cache_size > 0) {
+		/* Modules are configured before workers are spawned */
+		surbl_module_ctx->redirector_cache = rspamd_shared_cache_new (
+				surbl_module_ctx->surbl_pool, 0, cache_size, 0);
+		rspamd_config_register_persistent_cache (cfg, "surbl_redirector",
+				surbl_module_ctx->redirector_cache);
+	}
+
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_servers")) != NULL &&
+			surbl_module_ctx->use_redirector) {
+		surbl_module_ctx->redirector_cache_servers =
+				rspamd_upstreams_create (cfg->ups_ctx);
+		rspamd_mempool_add_destructor (surbl_module_ctx->surbl_pool,
+				(rspamd_mempool_destruct_t)rspamd_upstreams_destroy,
+				surbl_module_ctx->redirector_cache_servers);
+
+		if (!rspamd_upstreams_from_ucl (
+				surbl_module_ctx->redirector_cache_servers,
+				value, DEFAULT_REDIRECTOR_CACHE_PORT, NULL)) {
+			msg_err_config ("cannot parse redirector cache servers");
+			surbl_module_ctx->redirector_cache_servers = NULL;
+		}
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_prefix")) != NULL) {
+		surbl_module_ctx->redirector_cache_prefix = ucl_obj_tostring (value);
+	}
+	else {
+		surbl_module_ctx->redirector_cache_prefix =
+				DEFAULT_REDIRECTOR_CACHE_PREFIX;
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_password")) != NULL) {
+		surbl_module_ctx->redirector_cache_password = ucl_obj_tostring (value);
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "surbl",
+		"redirector_cache_db")) != NULL) {
+		surbl_module_ctx->redirector_cache_db = ucl_obj_tostring (value);
+	}
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "surbl", "max_urls")) != NULL) {
 		surbl_module_ctx->max_urls = ucl_obj_toint (value);
@@ -645,7 +767,7 @@ surbl_module_config (struct rspamd_config *cfg)
 					0,
 					surbl_test_url,
 					new_suffix,
-					SYMBOL_TYPE_CALLBACK,
+					SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_CONTENT,
 					-1);
 			nrules++;
 			new_suffix->callback_id = cb_id;
@@ -974,6 +1096,62 @@ format_surbl_request (rspamd_mempool_t * pool,
 	return result;
 }
 
+static void surbl_dns_process_param (struct surbl_dns_request *req,
+		struct dns_param *param);
+
+/*
+ * Queries each DNS name merely once per task: params for pending names wait
+ * for the reply and params for already resolved names are processed at once
+ */
+static void
+surbl_dns_request_add (struct rspamd_task *task, const gchar *name,
+		struct dns_param *param)
+{
+	GHashTable *requests;
+	struct surbl_dns_request *req;
+
+	requests = rspamd_mempool_get_variable (task->task_pool,
+			SURBL_REQUESTS_VAR);
+
+	if (requests == NULL) {
+		requests = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
+		rspamd_mempool_set_variable (task->task_pool, SURBL_REQUESTS_VAR,
+				requests, (rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	req = g_hash_table_lookup (requests, name);
+
+	if (req == NULL) {
+		req = rspamd_mempool_alloc0 (task->task_pool, sizeof (*req));
+		req->task = task;
+		req->name = rspamd_mempool_strdup (task->task_pool, name);
+		req->waiters = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_ptr_array_free_hard, req->waiters);
+		g_hash_table_insert (requests, req->name, req);
+
+		if (!make_dns_request_task (task, surbl_dns_callback, req,
+				RDNS_REQUEST_A, req->name)) {
+			/* Do not retry failed requests */
+			req->replied = TRUE;
+
+			return;
+		}
+	}
+	else if (req->replied) {
+		msg_debug_task ("reuse surbl reply for %s", name);
+		surbl_dns_process_param (req, param);
+
+		return;
+	}
+	else {
+		msg_debug_task ("join pending surbl request for %s", name);
+	}
+
+	rspamd_session_watcher_push_specific (task->s, param->w);
+	g_ptr_array_add (req->waiters, param);
+}
+
 static void
 make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
 	struct suffix_item *suffix, gboolean forced, GHashTable *tree)
@@ -1015,15 +1193,12 @@ make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
 			param->suffix = suffix;
 			param->host_resolve =
 					rspamd_mempool_strdup (task->task_pool, surbl_req);
+			param->w = rspamd_session_get_watcher (task->s);
+			param->resolve_ip = TRUE;
 			debug_task ("send surbl dns ip request %s to %s", surbl_req,
 					suffix->suffix);
 
-			if (make_dns_request_task (task,
-					surbl_dns_ip_callback,
-					(void *) param, RDNS_REQUEST_A, surbl_req)) {
-				param->w = rspamd_session_get_watcher (task->s);
-				rspamd_session_watcher_push (task->s);
-			}
+			surbl_dns_request_add (task, surbl_req, param);
 		}
 	}
 	else if ((surbl_req = format_surbl_request (task->task_pool, &f, suffix, TRUE,
@@ -1035,14 +1210,11 @@ make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
 		param->suffix = suffix;
 		param->host_resolve =
 			rspamd_mempool_strdup (task->task_pool, surbl_req);
+		param->w = rspamd_session_get_watcher (task->s);
+		param->resolve_ip = FALSE;
 		debug_task ("send surbl dns request %s", surbl_req);
 
-		if (make_dns_request_task (task,
-				surbl_dns_callback,
-				(void *) param, RDNS_REQUEST_A, surbl_req)) {
-			param->w = rspamd_session_get_watcher (task->s);
-			rspamd_session_watcher_push (task->s);
-		}
+		surbl_dns_request_add (task, surbl_req, param);
 	}
 	else if (err != NULL) {
 		if (err->code != WHITELIST_ERROR && err->code != DUPLICATE_ERROR) {
@@ -1122,84 +1294,109 @@ process_dns_results (struct rspamd_task *task,
 }
 
 static void
-surbl_dns_callback (struct rdns_reply *reply, gpointer arg)
+surbl_dns_process_param (struct surbl_dns_request *req,
+		struct dns_param *param)
 {
-	struct dns_param *param = (struct dns_param *)arg;
-	struct rspamd_task *task;
-	struct rdns_reply_entry *elt;
+	struct rspamd_task *task = req->task;
+	struct dns_param *ip_param;
+	GString *to_resolve;
+	guint32 ip_addr;
+	guint i;
 
-	task = param->task;
-	/* If we have result from DNS server, this url exists in SURBL, so increase score */
-	if (reply->code == RDNS_RC_NOERROR && reply->entries) {
-		msg_debug_task ("<%s> domain [%s] is in surbl %s",
-				param->task->message_id,
-			param->host_resolve, param->suffix->suffix);
-		elt = reply->entries;
-		if (elt->type == RDNS_REQUEST_A) {
-			process_dns_results (param->task, param->suffix,
-				param->host_resolve, (guint32)elt->content.a.addr.s_addr);
+	if (!param->resolve_ip) {
+		/* If we have result from DNS server, this url exists in SURBL */
+		if (req->naddrs > 0) {
+			msg_debug_task ("<%s> domain [%s] is in surbl %s",
+					task->message_id,
+					param->host_resolve, param->suffix->suffix);
+			process_dns_results (task, param->suffix,
+					param->host_resolve, req->addrs[0]);
 		}
+		else {
+			msg_debug_task ("<%s> domain [%s] is not in surbl %s",
+					task->message_id, param->host_resolve,
+					param->suffix->suffix);
+		}
+
+		return;
 	}
-	else {
-		msg_debug_task ("<%s> domain [%s] is not in surbl %s",
-			param->task->message_id, param->host_resolve,
-			param->suffix->suffix);
+
+	if (req->naddrs == 0) {
+		msg_debug_task ("<%s> domain [%s] cannot be resolved for SURBL check %s",
+				task->message_id, param->host_resolve,
+				param->suffix->suffix);
+
+		return;
 	}
 
-	rspamd_session_watcher_pop (param->task->s, param->w);
+	/* Addresses are checked against the list itself */
+	ip_param = rspamd_mempool_alloc (task->task_pool, sizeof (*ip_param));
+	memcpy (ip_param, param, sizeof (*ip_param));
+	ip_param->resolve_ip = FALSE;
+
+	for (i = 0; i < req->naddrs; i ++) {
+		to_resolve = g_string_sized_new (
+				strlen (param->suffix->suffix) +
+				sizeof ("255.255.255.255."));
+		ip_addr = req->addrs[i];
+
+		/* Big endian <4>.<3>.<2>.<1> */
+		rspamd_printf_gstring (to_resolve, "%d.%d.%d.%d.%s",
+				ip_addr >> 24 & 0xff,
+				ip_addr >> 16 & 0xff,
+				ip_addr >> 8 & 0xff,
+				ip_addr & 0xff, param->suffix->suffix);
+		msg_debug_task (
+				"<%s> domain [%s] send %v request to surbl",
+				task->message_id,
+				param->host_resolve,
+				to_resolve);
+
+		surbl_dns_request_add (task, to_resolve->str, ip_param);
+
+		g_string_free (to_resolve, TRUE);
+	}
 }
 
 static void
-surbl_dns_ip_callback (struct rdns_reply *reply, gpointer arg)
+surbl_dns_callback (struct rdns_reply *reply, gpointer arg)
 {
-	struct dns_param *param = (struct dns_param *) arg;
-	struct rspamd_task *task;
+	struct surbl_dns_request *req = arg;
+	struct rspamd_task *task = req->task;
 	struct rdns_reply_entry *elt;
-	GString *to_resolve;
-	guint32 ip_addr;
-
-	task = param->task;
-	/* If we have result from DNS server, this url exists in SURBL, so increase score */
-	if (reply->code == RDNS_RC_NOERROR && reply->entries) {
+	struct dns_param *param;
+	guint i;
 
+	if (reply->code == RDNS_RC_NOERROR) {
 		LL_FOREACH (reply->entries, elt) {
-
 			if (elt->type == RDNS_REQUEST_A) {
-				to_resolve = g_string_sized_new (
-						strlen (param->suffix->suffix) +
-						sizeof ("255.255.255.255."));
-				ip_addr = elt->content.a.addr.s_addr;
-
-				/* Big endian <4>.<3>.<2>.<1> */
-				rspamd_printf_gstring (to_resolve, "%d.%d.%d.%d.%s",
-						ip_addr >> 24 & 0xff,
-						ip_addr >> 16 & 0xff,
-						ip_addr >> 8 & 0xff,
-						ip_addr & 0xff, param->suffix->suffix);
-				msg_debug_task (
-						"<%s> domain [%s] send %v request to surbl",
-						param->task->message_id,
-						param->host_resolve,
-						to_resolve);
-
-				if (make_dns_request_task (task,
-						surbl_dns_callback,
-						param, RDNS_REQUEST_A, to_resolve->str)) {
-					rspamd_session_watcher_push_specific (task->s, param->w);
-				}
+				req->naddrs ++;
+			}
+		}
+
+		if (req->naddrs > 0) {
+			req->addrs = rspamd_mempool_alloc (task->task_pool,
+					req->naddrs * sizeof (guint32));
+			i = 0;
 
-				g_string_free (to_resolve, TRUE);
+			LL_FOREACH (reply->entries, elt) {
+				if (elt->type == RDNS_REQUEST_A) {
+					req->addrs[i ++] = (guint32)elt->content.a.addr.s_addr;
+				}
 			}
 		}
 	}
-	else {
-		msg_debug_task ("<%s> domain [%s] cannot be resolved for SURBL check %s",
-				param->task->message_id, param->host_resolve,
-				param->suffix->suffix);
 
+	req->replied = TRUE;
+
+	/* Fan out the reply to every url that has produced this name */
+	for (i = 0; i < req->waiters->len; i ++) {
+		param = g_ptr_array_index (req->waiters, i);
+		surbl_dns_process_param (req, param);
+		rspamd_session_watcher_pop (task->s, param->w);
 	}
 
-	rspamd_session_watcher_pop (param->task->s, param->w);
+	g_ptr_array_set_size (req->waiters, 0);
 }
 
 static void
@@ -1207,8 +1404,28 @@ free_redirector_session (void *ud)
 {
 	struct redirector_param *param = (struct redirector_param *)ud;
 
+	/* Socket is either kept for the next redirector call or closed */
+	rspamd_http_keepalive_release (param->conn,
+			rspamd_upstream_addr (param->redirector), NULL,
+			param->task->ev_base);
 	rspamd_http_connection_unref (param->conn);
-	close (param->sock);
+}
+
+static void
+surbl_redirector_write (struct redirector_param *param)
+{
+	struct rspamd_http_message *msg;
+	struct timeval *timeout;
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_assign (msg->url, param->url->string,
+			param->url->urllen);
+	timeout = rspamd_mempool_alloc (param->task->task_pool,
+			sizeof (struct timeval));
+	double_to_tv (surbl_module_ctx->read_timeout, timeout);
+
+	rspamd_http_connection_write_message (param->conn, msg, NULL,
+			NULL, param, param->sock, timeout, param->task->ev_base);
 }
 
 static void
@@ -1217,8 +1434,27 @@ surbl_redirector_error (struct rspamd_http_connection *conn,
 {
 	struct redirector_param *param = (struct redirector_param *)conn->ud;
 	struct rspamd_task *task;
+	const rspamd_inet_addr_t *addr;
 
 	task = param->task;
+	addr = rspamd_upstream_addr (param->redirector);
+
+	if (param->reused && rspamd_http_keepalive_stale (conn, err)) {
+		/* Peer has closed an idle socket, so repeat request over a new one */
+		rspamd_http_keepalive_release (conn, addr, NULL, task->ev_base);
+		param->reused = FALSE;
+		param->sock = rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+
+		if (param->sock != -1) {
+			msg_debug_task ("keep-alive connection to %s is closed, "
+					"retry request", rspamd_inet_address_to_string (addr));
+			rspamd_http_connection_reset (conn);
+			surbl_redirector_write (param);
+
+			return;
+		}
+	}
+
 	msg_err_task ("connection with http server %s terminated incorrectly: %e",
 		rspamd_inet_address_to_string (rspamd_upstream_addr (param->redirector)),
 		err);
@@ -1227,16 +1463,109 @@ surbl_redirector_error (struct rspamd_http_connection *conn,
 			param);
 }
 
+/* Check url that redirector has resolved the original one to */
+static void
+surbl_redirector_process_uri (struct rspamd_url *url, struct rspamd_task *task,
+		struct suffix_item *suffix, GHashTable *tree,
+		const gchar *uri, gsize urilen)
+{
+	gint r;
+	struct rspamd_url *redirected_url;
+	gchar *urlstr;
+
+	urlstr = rspamd_mempool_alloc (task->task_pool, urilen + 1);
+	redirected_url = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*redirected_url));
+	rspamd_strlcpy (urlstr, uri, urilen + 1);
+	r = rspamd_url_parse (redirected_url, urlstr, urilen, task->task_pool);
+
+	if (r == URI_ERRNO_OK) {
+		if (!g_hash_table_lookup (task->urls, redirected_url)) {
+			g_hash_table_insert (task->urls, redirected_url,
+					redirected_url);
+			redirected_url->phished_url = url;
+			redirected_url->flags |= RSPAMD_URL_FLAG_REDIRECTED;
+		}
+
+		make_surbl_requests (redirected_url, task, suffix, FALSE, tree);
+	}
+	else {
+		msg_info_task ("cannot parse redirector reply: %s", urlstr);
+	}
+}
+
+#ifdef WITH_HIREDIS
+static void
+surbl_redirector_cache_set_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_pool *pool = priv;
+
+	rspamd_redis_pool_release_connection (pool, c, FALSE);
+}
+#endif
+
+static void
+surbl_redirector_cache_store (struct rspamd_url *url, struct rspamd_task *task,
+		const gchar *uri, gsize urilen)
+{
+#ifdef WITH_HIREDIS
+	struct upstream *selected;
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *redis;
+#endif
+
+	if (surbl_module_ctx->redirector_cache) {
+		rspamd_shared_cache_insert (surbl_module_ctx->redirector_cache,
+				url->string, url->urllen, uri, urilen,
+				task->tv.tv_sec, surbl_module_ctx->url_expire);
+	}
+
+#ifdef WITH_HIREDIS
+	if (surbl_module_ctx->redirector_cache_servers == NULL) {
+		return;
+	}
+
+	selected = rspamd_upstream_get (surbl_module_ctx->redirector_cache_servers,
+			RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
+
+	if (selected == NULL) {
+		return;
+	}
+
+	addr = rspamd_upstream_addr (selected);
+	redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			task->ev_base,
+			surbl_module_ctx->redirector_cache_db,
+			surbl_module_ctx->redirector_cache_password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (redis == NULL) {
+		rspamd_upstream_fail (selected);
+		return;
+	}
+
+	/* Nobody waits for this reply, so it does not hold the task */
+	if (redisAsyncCommand (redis, surbl_redirector_cache_set_cb,
+			task->cfg->redis_pool,
+			"SETEX %s%b %d %b",
+			surbl_module_ctx->redirector_cache_prefix,
+			url->string, (size_t)url->urllen,
+			(gint)surbl_module_ctx->url_expire,
+			uri, (size_t)urilen) != REDIS_OK) {
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				redis, TRUE);
+	}
+#endif
+}
+
 static int
 surbl_redirector_finish (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
 {
 	struct redirector_param *param = (struct redirector_param *)conn->ud;
 	struct rspamd_task *task;
-	gint r, urllen;
-	struct rspamd_url *redirected_url;
 	const rspamd_ftok_t *hdr;
-	gchar *urlstr;
 
 	task = param->task;
 
@@ -1248,32 +1577,10 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 					param->task->message_id,
 					param->url->urllen, param->url->string,
 					hdr);
-			urllen = hdr->len;
-			urlstr = rspamd_mempool_alloc (task->task_pool,
-					urllen + 1);
-			redirected_url = rspamd_mempool_alloc (task->task_pool,
-					sizeof (*redirected_url));
-			rspamd_strlcpy (urlstr, hdr->begin, urllen + 1);
-			r = rspamd_url_parse (redirected_url, urlstr, urllen,
-					task->task_pool);
-
-			if (r == URI_ERRNO_OK) {
-				if (!g_hash_table_lookup (task->urls, redirected_url)) {
-					g_hash_table_insert (task->urls, redirected_url,
-							redirected_url);
-					redirected_url->phished_url = param->url;
-					redirected_url->flags |= RSPAMD_URL_FLAG_REDIRECTED;
-				}
-
-				make_surbl_requests (redirected_url,
-						param->task,
-						param->suffix,
-						FALSE,
-						param->tree);
-			}
-			else {
-				msg_info_task ("cannot parse redirector reply: %s", urlstr);
-			}
+			surbl_redirector_cache_store (param->url, task,
+					hdr->begin, hdr->len);
+			surbl_redirector_process_uri (param->url, task, param->suffix,
+					param->tree, hdr->begin, hdr->len);
 		}
 	}
 	else {
@@ -1295,17 +1602,16 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 	struct suffix_item *suffix, const gchar *rule, GHashTable *tree)
 {
 	gint s = -1;
+	gboolean reused = FALSE;
 	struct redirector_param *param;
-	struct timeval *timeout;
 	struct upstream *selected;
-	struct rspamd_http_message *msg;
 
 	selected = rspamd_upstream_get (surbl_module_ctx->redirectors,
 			RSPAMD_UPSTREAM_ROUND_ROBIN, url->host, url->hostlen);
 
 	if (selected) {
-		s = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
-				SOCK_STREAM, TRUE);
+		s = rspamd_http_keepalive_connect (rspamd_upstream_addr (selected),
+				NULL, &reused);
 	}
 
 	if (s == -1) {
@@ -1323,24 +1629,20 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 	param->task = task;
 	param->conn = rspamd_http_connection_new (NULL, surbl_redirector_error,
 			surbl_redirector_finish,
-			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 			RSPAMD_HTTP_CLIENT, NULL);
-	msg = rspamd_http_new_message (HTTP_REQUEST);
-	msg->url = rspamd_fstring_assign (msg->url, url->string, url->urllen);
 	param->sock = s;
+	param->reused = reused;
 	param->suffix = suffix;
 	param->redirector = selected;
 	param->tree = tree;
-	timeout = rspamd_mempool_alloc (task->task_pool, sizeof (struct timeval));
-	double_to_tv (surbl_module_ctx->read_timeout, timeout);
 
 	rspamd_session_add_event (task->s,
 		free_redirector_session,
 		param,
 		g_quark_from_static_string ("surbl"));
 
-	rspamd_http_connection_write_message (param->conn, msg, NULL,
-			NULL, param, s, timeout, task->ev_base);
+	surbl_redirector_write (param);
 
 	msg_info_task (
 		"<%s> registered redirector call for %*s to %s, according to rule: %s",
@@ -1350,6 +1652,185 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 		rule);
 }
 
+#ifdef WITH_HIREDIS
+static void
+surbl_redirector_cache_fin (gpointer ud)
+{
+	struct redirector_cache_param *param = ud;
+	redisAsyncContext *redis;
+
+	event_del (&param->timeout);
+
+	if (param->redis) {
+		redis = param->redis;
+		param->redis = NULL;
+		/* Connection with the pending request is not reused */
+		rspamd_redis_pool_release_connection (param->task->cfg->redis_pool,
+				redis, FALSE);
+	}
+}
+
+static void
+surbl_redirector_cache_timeout (gint fd, short what, gpointer ud)
+{
+	struct redirector_cache_param *param = ud;
+	struct rspamd_task *task;
+
+	task = param->task;
+	msg_info_task ("redirector cache server %s timed out",
+			rspamd_upstream_name (param->selected));
+	rspamd_upstream_fail (param->selected);
+	register_redirector_call (param->url, task, param->suffix, param->rule,
+			param->tree);
+	rspamd_session_remove_event (task->s, surbl_redirector_cache_fin, param);
+}
+
+static void
+surbl_redirector_cache_get_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redirector_cache_param *param = priv;
+	redisReply *reply = r;
+	struct rspamd_task *task;
+
+	if (param->redis == NULL) {
+		/* Connection has been closed */
+		return;
+	}
+
+	task = param->task;
+
+	if (c->err == 0 && reply != NULL) {
+		rspamd_upstream_ok (param->selected);
+
+		if (reply->type == REDIS_REPLY_STRING) {
+			msg_debug_task ("<%s> got cached redirector reply: '%*s' -> '%*s'",
+					task->message_id,
+					param->url->urllen, param->url->string,
+					(gint)reply->len, reply->str);
+
+			if (surbl_module_ctx->redirector_cache) {
+				rspamd_shared_cache_insert (surbl_module_ctx->redirector_cache,
+						param->url->string, param->url->urllen,
+						reply->str, reply->len,
+						task->tv.tv_sec, surbl_module_ctx->url_expire);
+			}
+
+			surbl_redirector_process_uri (param->url, task, param->suffix,
+					param->tree, reply->str, reply->len);
+		}
+		else {
+			register_redirector_call (param->url, task, param->suffix,
+					param->rule, param->tree);
+		}
+	}
+	else {
+		rspamd_upstream_fail (param->selected);
+		register_redirector_call (param->url, task, param->suffix,
+				param->rule, param->tree);
+	}
+
+	rspamd_session_remove_event (task->s, surbl_redirector_cache_fin, param);
+}
+
+static gboolean
+surbl_redirector_cache_redis_lookup (struct rspamd_url *url,
+		struct rspamd_task *task,
+		struct suffix_item *suffix, const gchar *rule, GHashTable *tree)
+{
+	struct redirector_cache_param *param;
+	struct upstream *selected;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+
+	selected = rspamd_upstream_get (surbl_module_ctx->redirector_cache_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (selected == NULL) {
+		return FALSE;
+	}
+
+	param = rspamd_mempool_alloc0 (task->task_pool, sizeof (*param));
+	param->url = url;
+	param->task = task;
+	param->selected = selected;
+	param->suffix = suffix;
+	param->rule = rule;
+	param->tree = tree;
+
+	addr = rspamd_upstream_addr (selected);
+	param->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			task->ev_base,
+			surbl_module_ctx->redirector_cache_db,
+			surbl_module_ctx->redirector_cache_password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (param->redis == NULL) {
+		rspamd_upstream_fail (selected);
+		return FALSE;
+	}
+
+	if (redisAsyncCommand (param->redis, surbl_redirector_cache_get_cb, param,
+			"GET %s%b",
+			surbl_module_ctx->redirector_cache_prefix,
+			url->string, (size_t)url->urllen) != REDIS_OK) {
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				param->redis, TRUE);
+
+		return FALSE;
+	}
+
+	event_set (&param->timeout, -1, EV_TIMEOUT,
+			surbl_redirector_cache_timeout, param);
+	event_base_set (task->ev_base, &param->timeout);
+	double_to_tv (DEFAULT_REDIRECTOR_CACHE_TIMEOUT, &tv);
+	event_add (&param->timeout, &tv);
+	rspamd_session_add_event (task->s, surbl_redirector_cache_fin, param,
+			g_quark_from_static_string ("surbl"));
+
+	return TRUE;
+}
+#endif
+
+/*
+ * Urls already resolved by the redirector are taken from the shared memory
+ * or from redis, other ones are sent to the redirector
+ */
+static void
+surbl_redirector_resolve (struct rspamd_url *url, struct rspamd_task *task,
+		struct suffix_item *suffix, const gchar *rule, GHashTable *tree)
+{
+	gchar *uri;
+	gsize urilen;
+
+	if (surbl_module_ctx->redirector_cache) {
+		uri = rspamd_shared_cache_lookup (surbl_module_ctx->redirector_cache,
+				url->string, url->urllen, task->tv.tv_sec, &urilen);
+
+		if (uri != NULL) {
+			msg_debug_task ("<%s> got cached redirector reply: '%*s' -> '%*s'",
+					task->message_id,
+					url->urllen, url->string,
+					(gint)urilen, uri);
+			surbl_redirector_process_uri (url, task, suffix, tree,
+					uri, urilen);
+			g_free (uri);
+
+			return;
+		}
+	}
+
+#ifdef WITH_HIREDIS
+	if (surbl_module_ctx->redirector_cache_servers &&
+			surbl_redirector_cache_redis_lookup (url, task, suffix, rule,
+					tree)) {
+		return;
+	}
+#endif
+
+	register_redirector_call (url, task, suffix, rule, tree);
+}
+
 static void
 surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 {
@@ -1393,7 +1874,7 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 							g_list_prepend (NULL, found_tld));
 				}
 
-				register_redirector_call (url,
+				surbl_redirector_resolve (url,
 						param->task,
 						param->suffix,
 						found_tld,
@@ -10,6 +10,10 @@
 #define DEFAULT_REDIRECTOR_READ_TIMEOUT 5.0
 #define DEFAULT_SURBL_MAX_URLS 1000
 #define DEFAULT_SURBL_URL_EXPIRE 86400
+#define DEFAULT_REDIRECTOR_CACHE_SIZE (1024 * 1024)
+#define DEFAULT_REDIRECTOR_CACHE_PREFIX "rdr_"
+#define DEFAULT_REDIRECTOR_CACHE_TIMEOUT 0.5
+#define DEFAULT_REDIRECTOR_CACHE_PORT 6379
 #define DEFAULT_SURBL_SYMBOL "SURBL_DNS"
 #define DEFAULT_SURBL_SUFFIX "multi.surbl.org"
 #define SURBL_OPTION_NOIP (1 << 0)
@@ -35,6 +39,11 @@ struct surbl_ctx {
 	GHashTable *redirector_tlds;
 	guint use_redirector;
 	struct upstream_list *redirectors;
+	struct rspamd_shared_cache *redirector_cache;
+	struct upstream_list *redirector_cache_servers;
+	const gchar *redirector_cache_prefix;
+	const gchar *redirector_cache_password;
+	const gchar *redirector_cache_db;
 	rspamd_mempool_t *surbl_pool;
 };
 
@@ -54,6 +63,17 @@ struct dns_param {
 	gchar *host_resolve;
 	struct suffix_item *suffix;
 	struct rspamd_async_watcher *w;
+	gboolean resolve_ip;
+};
+
+/* DNS name queried once per task for all urls and suffixes that produce it */
+struct surbl_dns_request {
+	struct rspamd_task *task;
+	gchar *name;
+	GPtrArray *waiters;
+	guint32 *addrs;
+	guint naddrs;
+	gboolean replied;
 };
 
 struct redirector_param {
@@ -62,8 +82,21 @@ struct redirector_param {
 	struct upstream *redirector;
 	struct rspamd_http_connection *conn;
 	gint sock;
+	gboolean reused;
+	GHashTable *tree;
+	struct suffix_item *suffix;
+};
+
+/* Lookup of redirector result in redis */
+struct redirector_cache_param {
+	struct rspamd_url *url;
+	struct rspamd_task *task;
+	struct upstream *selected;
+	struct redisAsyncContext *redis;
+	struct event timeout;
 	GHashTable *tree;
 	struct suffix_item *suffix;
+	const gchar *rule;
 };
 
 struct surbl_bit_item {
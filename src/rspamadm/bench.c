@@ -0,0 +1,911 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cryptobox.h"
+#include "printf.h"
+#include "http.h"
+#include "addr.h"
+#include "unix-std.h"
+#include "rspamd.h"
+#include <event.h>
+#include "libutil/util.h"
+
+#define BENCH_DEFAULT_PORT 11333
+#define BENCH_DEFAULT_CONTROL_PORT 11334
+/* Granularity of open loop requests scheduling */
+#define BENCH_RATE_TICK 0.001
+
+static gchar *connect_str = "localhost";
+static gchar *controller_str = NULL;
+static gchar *password = NULL;
+static gchar *key = NULL;
+static gchar *path = "/check";
+static gint concurrency = 16;
+static gdouble rate = 0;
+static gdouble duration = 10.0;
+static gint64 max_requests = 0;
+static gdouble timeout = 10.0;
+static gint nsymbols = 20;
+static gboolean no_keepalive = FALSE;
+static gboolean json = FALSE;
+
+static void rspamadm_bench (gint argc, gchar **argv);
+static const char *rspamadm_bench_help (gboolean full_help);
+
+struct rspamadm_command bench_command = {
+		.name = "bench",
+		.flags = 0,
+		.help = rspamadm_bench_help,
+		.run = rspamadm_bench
+};
+
+static GOptionEntry entries[] = {
+		{"connect", 'h', 0, G_OPTION_ARG_STRING, &connect_str,
+				"Scan messages using the specified worker (localhost:11333)", NULL},
+		{"controller", 'C', 0, G_OPTION_ARG_STRING, &controller_str,
+				"Get symbols counters from the specified controller", NULL},
+		{"password", 'P', 0, G_OPTION_ARG_STRING, &password,
+				"Controller password", NULL},
+		{"key", 'k', 0, G_OPTION_ARG_STRING, &key,
+				"Encrypt requests with the specified pubkey", NULL},
+		{"path", 'p', 0, G_OPTION_ARG_STRING, &path,
+				"HTTP path of requests (/check by default)", NULL},
+		{"concurrency", 'n', 0, G_OPTION_ARG_INT, &concurrency,
+				"Number of parallel requests (16 by default)", NULL},
+		{"rate", 'r', 0, G_OPTION_ARG_DOUBLE, &rate,
+				"Send requests at the fixed rate (per second) instead of closed loop", NULL},
+		{"duration", 'd', 0, G_OPTION_ARG_DOUBLE, &duration,
+				"Duration of test in seconds (10 by default)", NULL},
+		{"requests", 'N', 0, G_OPTION_ARG_INT64, &max_requests,
+				"Stop after the specified number of requests", NULL},
+		{"timeout", 't', 0, G_OPTION_ARG_DOUBLE, &timeout,
+				"Timeout for a request (10 seconds by default)", NULL},
+		{"symbols", 's', 0, G_OPTION_ARG_INT, &nsymbols,
+				"Number of the most expensive symbols to show (20 by default)", NULL},
+		{"no-keepalive", 0, 0, G_OPTION_ARG_NONE, &no_keepalive,
+				"Use a new connection for each request", NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output json", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct rspamadm_bench_msg {
+	const gchar *data;
+	gsize len;
+};
+
+struct rspamadm_bench_ctx {
+	struct event_base *ev_base;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_cryptobox_pubkey *key;
+	struct rspamd_cryptobox_keypair *keypair;
+	struct rspamd_keypair_cache *keys_cache;
+	GArray *corpus;
+	GArray *latencies;
+	guint next_msg;
+	guint inflight;
+	guint64 sent;
+	guint64 errors;
+	guint64 actions[METRIC_ACTION_MAX];
+	gdouble start;
+	gdouble deadline;
+	gboolean stopping;
+	struct event rate_ev;
+};
+
+struct rspamadm_bench_req {
+	struct rspamadm_bench_ctx *ctx;
+	struct rspamd_http_connection *conn;
+	gdouble scheduled;
+};
+
+/* Snapshot of a symbol counter from the controller */
+struct rspamadm_bench_symbol {
+	const gchar *name;
+	gdouble avg_time;
+	gdouble p99;
+	gint64 frequency;
+	gint64 hits;
+};
+
+static const char *
+rspamadm_bench_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Replay corpus against rspamd and report throughput\n\n"
+				"Usage: rspamadm bench [-h host] [-n concurrency] [-r rate] "
+				"[-d seconds] path...\n"
+				"Where options are:\n\n"
+				"-h: worker to scan messages with (localhost:11333)\n"
+				"-C: controller to get symbols counters from\n"
+				"-P: controller password\n"
+				"-k: encrypt requests with the specified pubkey\n"
+				"-p: HTTP path of requests (/check by default)\n"
+				"-n: number of parallel requests (16 by default)\n"
+				"-r: send requests at the fixed rate instead of closed loop\n"
+				"-d: duration of test in seconds (10 by default)\n"
+				"-N: stop after the specified number of requests\n"
+				"-t: timeout for a request (10 seconds by default)\n"
+				"-s: number of the most expensive symbols to show\n"
+				"-j: output json\n"
+				"--no-keepalive: use a new connection for each request\n"
+				"--help: shows available options and commands\n\n"
+				"Files and directories are scanned in a loop until the "
+				"test is finished. In rate mode\nlatency is counted from the "
+				"moment when a request should have been sent.\n";
+	}
+	else {
+		help_str = "Replay corpus against rspamd and report throughput";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_bench_add_file (GArray *corpus, const gchar *fname)
+{
+	struct rspamadm_bench_msg m;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	fd = open (fname, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot open %s: %s\n", fname,
+				strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return;
+	}
+
+	if (!S_ISREG (st.st_mode) || st.st_size == 0) {
+		close (fd);
+
+		return;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		rspamd_fprintf (stderr, "cannot mmap %s: %s\n", fname,
+				strerror (errno));
+
+		return;
+	}
+
+	m.data = map;
+	m.len = st.st_size;
+	g_array_append_val (corpus, m);
+}
+
+static void
+rspamadm_bench_load (GArray *corpus, const gchar *name)
+{
+	struct stat st;
+	struct dirent *ent;
+	DIR *d;
+	gchar filebuf[PATH_MAX];
+
+	if (stat (name, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot stat %s: %s\n", name, strerror (errno));
+		exit (1);
+	}
+
+	if (!S_ISDIR (st.st_mode)) {
+		rspamadm_bench_add_file (corpus, name);
+
+		return;
+	}
+
+	d = opendir (name);
+
+	if (d == NULL) {
+		rspamd_fprintf (stderr, "cannot open directory %s: %s\n", name,
+				strerror (errno));
+		exit (1);
+	}
+
+	while ((ent = readdir (d)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+
+		rspamd_snprintf (filebuf, sizeof (filebuf), "%s%c%s",
+				name, G_DIR_SEPARATOR, ent->d_name);
+		rspamadm_bench_add_file (corpus, filebuf);
+	}
+
+	closedir (d);
+}
+
+static rspamd_inet_addr_t *
+rspamadm_bench_parse_addr (const gchar *str, guint default_port)
+{
+	GPtrArray *addrs = NULL;
+	rspamd_inet_addr_t *addr;
+
+	if (!rspamd_parse_host_port_priority (str, &addrs, NULL, NULL,
+			default_port, NULL)) {
+		rspamd_fprintf (stderr, "cannot parse %s\n", str);
+		exit (1);
+	}
+
+	addr = rspamd_inet_address_copy (g_ptr_array_index (addrs, 0));
+	g_ptr_array_free (addrs, TRUE);
+
+	return addr;
+}
+
+static void rspamadm_bench_send (struct rspamadm_bench_ctx *ctx,
+		gdouble scheduled);
+
+static void
+rspamadm_bench_check_stop (struct rspamadm_bench_ctx *ctx)
+{
+	if (!ctx->stopping) {
+		if ((max_requests > 0 && ctx->sent >= (guint64)max_requests) ||
+				rspamd_get_ticks () >= ctx->deadline) {
+			ctx->stopping = TRUE;
+		}
+	}
+
+	if (ctx->stopping && ctx->inflight == 0) {
+		/* Do not wait for idle keep-alive sockets */
+		event_base_loopbreak (ctx->ev_base);
+	}
+}
+
+static void
+rspamadm_bench_req_fin (struct rspamadm_bench_req *req)
+{
+	struct rspamadm_bench_ctx *ctx = req->ctx;
+
+	rspamd_http_keepalive_release (req->conn, ctx->addr, ctx->key,
+			ctx->ev_base);
+	rspamd_http_connection_unref (req->conn);
+	g_slice_free1 (sizeof (*req), req);
+	ctx->inflight --;
+
+	rspamadm_bench_check_stop (ctx);
+
+	if (!ctx->stopping && rate <= 0) {
+		/* Closed loop: the next request is sent as soon as one is finished */
+		rspamadm_bench_send (ctx, rspamd_get_ticks ());
+	}
+}
+
+static void
+rspamadm_bench_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamadm_bench_req *req = conn->ud;
+
+	if (req->ctx->errors == 0) {
+		rspamd_fprintf (stderr, "request failed: %e\n", err);
+	}
+
+	req->ctx->errors ++;
+	rspamadm_bench_req_fin (req);
+}
+
+static gint
+rspamadm_bench_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamadm_bench_req *req = conn->ud;
+	struct rspamadm_bench_ctx *ctx = req->ctx;
+	struct ucl_parser *parser;
+	const ucl_object_t *metric, *elt;
+	ucl_object_t *obj;
+	gdouble latency;
+	gint action;
+
+	latency = rspamd_get_ticks () - req->scheduled;
+
+	if (msg->code != 200 || msg->body_buf.len == 0) {
+		if (ctx->errors == 0) {
+			rspamd_fprintf (stderr, "request failed: HTTP error %d\n",
+					msg->code);
+		}
+
+		ctx->errors ++;
+		rspamadm_bench_req_fin (req);
+
+		return 0;
+	}
+
+	g_array_append_val (ctx->latencies, latency);
+	parser = ucl_parser_new (0);
+
+	if (ucl_parser_add_chunk (parser, msg->body_buf.begin, msg->body_buf.len)) {
+		obj = ucl_parser_get_object (parser);
+		metric = ucl_object_lookup (obj, "default");
+		elt = metric ? ucl_object_lookup (metric, "action") : NULL;
+
+		if (elt && rspamd_action_from_str (ucl_object_tostring (elt), &action)) {
+			ctx->actions[action] ++;
+		}
+
+		ucl_object_unref (obj);
+	}
+
+	ucl_parser_free (parser);
+	rspamadm_bench_req_fin (req);
+
+	return 0;
+}
+
+static void
+rspamadm_bench_send (struct rspamadm_bench_ctx *ctx, gdouble scheduled)
+{
+	struct rspamadm_bench_req *req;
+	struct rspamadm_bench_msg *m;
+	struct rspamd_http_message *msg;
+	struct timeval tv;
+	gint fd;
+
+	if (no_keepalive) {
+		fd = rspamd_inet_address_connect (ctx->addr, SOCK_STREAM, TRUE);
+	}
+	else {
+		fd = rspamd_http_keepalive_connect (ctx->addr, ctx->key, NULL);
+	}
+
+	if (fd == -1) {
+		rspamd_fprintf (stderr, "cannot connect to %s: %s\n",
+				connect_str, strerror (errno));
+		exit (1);
+	}
+
+	m = &g_array_index (ctx->corpus, struct rspamadm_bench_msg, ctx->next_msg);
+	ctx->next_msg = (ctx->next_msg + 1) % ctx->corpus->len;
+
+	req = g_slice_alloc (sizeof (*req));
+	req->ctx = ctx;
+	req->scheduled = scheduled;
+	req->conn = rspamd_http_connection_new (NULL,
+			rspamadm_bench_error_handler,
+			rspamadm_bench_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE |
+			(no_keepalive ? 0 : RSPAMD_HTTP_CLIENT_KEEP_ALIVE),
+			RSPAMD_HTTP_CLIENT,
+			ctx->keys_cache);
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_append (msg->url, path, strlen (path));
+	msg->body = rspamd_fstring_new_init (m->data, m->len);
+
+	if (ctx->key) {
+		msg->peer_key = rspamd_pubkey_ref (ctx->key);
+		rspamd_http_connection_set_key (req->conn, ctx->keypair);
+	}
+
+	double_to_tv (timeout, &tv);
+	ctx->sent ++;
+	ctx->inflight ++;
+	rspamd_http_connection_write_message (req->conn, msg, NULL, "text/plain",
+			req, fd, &tv, ctx->ev_base);
+}
+
+static void
+rspamadm_bench_rate_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamadm_bench_ctx *ctx = ud;
+	struct timeval tv;
+	gdouble now, scheduled;
+
+	now = rspamd_get_ticks ();
+
+	/*
+	 * Requests that could not be sent because of concurrency limit are delayed
+	 * but their latency is still counted from the scheduled time
+	 */
+	for (;;) {
+		rspamadm_bench_check_stop (ctx);
+
+		if (ctx->stopping) {
+			return;
+		}
+
+		scheduled = ctx->start + ctx->sent / rate;
+
+		if (scheduled > now || ctx->inflight >= (guint)concurrency) {
+			break;
+		}
+
+		rspamadm_bench_send (ctx, scheduled);
+	}
+
+	double_to_tv (MAX (scheduled - now, BENCH_RATE_TICK), &tv);
+	evtimer_add (&ctx->rate_ev, &tv);
+}
+
+static gint
+rspamadm_bench_latency_cmp (gconstpointer a, gconstpointer b)
+{
+	const gdouble *d1 = a, *d2 = b;
+
+	if (*d1 < *d2) {
+		return -1;
+	}
+	else if (*d1 > *d2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static gdouble
+rspamadm_bench_quantile (GArray *sorted, gdouble q)
+{
+	guint idx;
+
+	if (sorted->len == 0) {
+		return 0;
+	}
+
+	idx = q * sorted->len;
+
+	if (idx >= sorted->len) {
+		idx = sorted->len - 1;
+	}
+
+	/* In milliseconds */
+	return g_array_index (sorted, gdouble, idx) * 1000.0;
+}
+
+struct rspamadm_bench_counters_cbdata {
+	struct event_base *ev_base;
+	ucl_object_t *res;
+};
+
+static void
+rspamadm_bench_counters_error (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamadm_bench_counters_cbdata *cbd = conn->ud;
+
+	rspamd_fprintf (stderr, "cannot get counters: %e\n", err);
+	event_base_loopbreak (cbd->ev_base);
+}
+
+static gint
+rspamadm_bench_counters_finish (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamadm_bench_counters_cbdata *cbd = conn->ud;
+	struct ucl_parser *parser;
+
+	parser = ucl_parser_new (0);
+
+	if (msg->code != 200 || !ucl_parser_add_chunk (parser,
+			msg->body_buf.begin, msg->body_buf.len)) {
+		rspamd_fprintf (stderr, "cannot get counters: HTTP error %d\n",
+				msg->code);
+	}
+	else {
+		cbd->res = ucl_parser_get_object (parser);
+	}
+
+	ucl_parser_free (parser);
+	event_base_loopbreak (cbd->ev_base);
+
+	return 0;
+}
+
+/* Returns hash of symbols counters indexed by name */
+static GHashTable *
+rspamadm_bench_get_counters (struct event_base *ev_base,
+		rspamd_inet_addr_t *addr)
+{
+	struct rspamadm_bench_counters_cbdata cbd;
+	struct rspamd_http_connection *conn;
+	struct rspamd_http_message *msg;
+	struct rspamadm_bench_symbol *sym;
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	GHashTable *res;
+	struct timeval tv;
+	gint fd;
+
+	fd = rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+
+	if (fd == -1) {
+		rspamd_fprintf (stderr, "cannot connect to %s: %s\n",
+				controller_str, strerror (errno));
+		exit (1);
+	}
+
+	cbd.ev_base = ev_base;
+	cbd.res = NULL;
+	conn = rspamd_http_connection_new (NULL, rspamadm_bench_counters_error,
+			rspamadm_bench_counters_finish, RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT, NULL);
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_append (msg->url, "/counters",
+			sizeof ("/counters") - 1);
+
+	if (password) {
+		rspamd_http_message_add_header (msg, "Password", password);
+	}
+
+	double_to_tv (timeout, &tv);
+	rspamd_http_connection_write_message (conn, msg, NULL, NULL, &cbd, fd,
+			&tv, ev_base);
+	event_base_loop (ev_base, 0);
+	rspamd_http_connection_unref (conn);
+	close (fd);
+
+	if (cbd.res == NULL) {
+		exit (1);
+	}
+
+	res = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, g_free);
+
+	while ((cur = ucl_object_iterate (cbd.res, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "symbol");
+
+		if (elt == NULL) {
+			continue;
+		}
+
+		sym = g_malloc0 (sizeof (*sym));
+		sym->name = g_strdup (ucl_object_tostring (elt));
+		elt = ucl_object_lookup (cur, "time");
+		sym->avg_time = elt ? ucl_object_todouble (elt) : 0;
+		elt = ucl_object_lookup (cur, "p99");
+		sym->p99 = elt ? ucl_object_todouble (elt) : 0;
+		elt = ucl_object_lookup (cur, "frequency");
+		sym->frequency = elt ? ucl_object_toint (elt) : 0;
+		g_hash_table_insert (res, (gpointer)sym->name, sym);
+	}
+
+	ucl_object_unref (cbd.res);
+
+	return res;
+}
+
+static gint
+rspamadm_bench_symbol_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamadm_bench_symbol *s1 = *(const struct rspamadm_bench_symbol **)a,
+			*s2 = *(const struct rspamadm_bench_symbol **)b;
+	gdouble c1 = s1->avg_time * s1->hits, c2 = s2->avg_time * s2->hits;
+
+	if (c1 > c2) {
+		return -1;
+	}
+	else if (c1 < c2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Symbols are sorted by the total time spent during the test: number of hits
+ * is the difference of counters and time is the average one after the test
+ */
+static GPtrArray *
+rspamadm_bench_symbols_cost (GHashTable *before, GHashTable *after)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamadm_bench_symbol *sym, *old;
+	GPtrArray *res;
+
+	res = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, after);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		sym = v;
+		old = g_hash_table_lookup (before, k);
+		sym->hits = sym->frequency - (old ? old->frequency : 0);
+
+		if (sym->hits > 0) {
+			g_ptr_array_add (res, sym);
+		}
+	}
+
+	g_ptr_array_sort (res, rspamadm_bench_symbol_cmp);
+
+	return res;
+}
+
+static void
+rspamadm_bench_report (struct rspamadm_bench_ctx *ctx, gdouble elapsed,
+		GPtrArray *symbols)
+{
+	struct rspamadm_bench_symbol *sym;
+	ucl_object_t *top, *obj, *elt;
+	gdouble total_cost = 0, mean = 0;
+	guint64 done;
+	gchar *out;
+	guint i;
+
+	done = ctx->latencies->len;
+	g_array_sort (ctx->latencies, rspamadm_bench_latency_cmp);
+
+	for (i = 0; i < done; i ++) {
+		mean += g_array_index (ctx->latencies, gdouble, i);
+	}
+
+	if (done > 0) {
+		mean = mean * 1000.0 / done;
+	}
+
+	if (symbols) {
+		for (i = 0; i < symbols->len; i ++) {
+			sym = g_ptr_array_index (symbols, i);
+			total_cost += sym->avg_time * sym->hits;
+		}
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromint (done), "requests", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->errors), "errors",
+			0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (elapsed), "elapsed",
+			0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (elapsed > 0 ? done / elapsed : 0),
+			"throughput", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (mean), "mean", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamadm_bench_quantile (ctx->latencies, 0)),
+			"min", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamadm_bench_quantile (ctx->latencies, 0.5)),
+			"p50", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamadm_bench_quantile (ctx->latencies, 0.9)),
+			"p90", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamadm_bench_quantile (ctx->latencies, 0.99)),
+			"p99", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamadm_bench_quantile (ctx->latencies, 0.999)),
+			"p999", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamadm_bench_quantile (ctx->latencies, 1.0)),
+			"max", 0, false);
+	ucl_object_insert_key (top, obj, "latency", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		ucl_object_insert_key (obj, ucl_object_fromint (ctx->actions[i]),
+				rspamd_action_to_str (i), 0, false);
+	}
+
+	ucl_object_insert_key (top, obj, "actions", 0, false);
+
+	if (symbols) {
+		obj = ucl_object_typed_new (UCL_ARRAY);
+
+		for (i = 0; i < symbols->len && i < (guint)nsymbols; i ++) {
+			sym = g_ptr_array_index (symbols, i);
+			elt = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (elt, ucl_object_fromstring (sym->name),
+					"symbol", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromint (sym->hits),
+					"hits", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromdouble (sym->avg_time),
+					"time", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromdouble (sym->p99),
+					"p99", 0, false);
+			ucl_object_insert_key (elt, ucl_object_fromdouble (total_cost > 0 ?
+					sym->avg_time * sym->hits / total_cost * 100.0 : 0),
+					"share", 0, false);
+			ucl_array_append (obj, elt);
+		}
+
+		ucl_object_insert_key (top, obj, "symbols", 0, false);
+	}
+
+	if (json) {
+		out = ucl_object_emit (top, UCL_EMIT_JSON);
+		rspamd_printf ("%s\n", out);
+		free (out);
+		ucl_object_unref (top);
+
+		return;
+	}
+
+	rspamd_printf ("Requests: %uL (%uL errors) in %.2f seconds, "
+			"%.1f requests per second\n",
+			done, ctx->errors, elapsed, elapsed > 0 ? done / elapsed : 0.0);
+	rspamd_printf ("Latency (ms): mean %.2f, min %.2f, p50 %.2f, p90 %.2f, "
+			"p99 %.2f, p99.9 %.2f, max %.2f\n",
+			mean,
+			rspamadm_bench_quantile (ctx->latencies, 0),
+			rspamadm_bench_quantile (ctx->latencies, 0.5),
+			rspamadm_bench_quantile (ctx->latencies, 0.9),
+			rspamadm_bench_quantile (ctx->latencies, 0.99),
+			rspamadm_bench_quantile (ctx->latencies, 0.999),
+			rspamadm_bench_quantile (ctx->latencies, 1.0));
+	rspamd_printf ("Actions:");
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		if (ctx->actions[i] > 0) {
+			rspamd_printf (" %s: %uL", rspamd_action_to_str (i),
+					ctx->actions[i]);
+		}
+	}
+
+	rspamd_printf ("\n");
+
+	if (symbols && symbols->len > 0) {
+		rspamd_printf ("\nSymbols by cost (time is in microseconds):\n");
+		printf ("%-32s %10s %10s %10s %8s\n", "Symbol", "Hits",
+				"Avg. time", "P99 time", "Share");
+
+		for (i = 0; i < symbols->len && i < (guint)nsymbols; i ++) {
+			sym = g_ptr_array_index (symbols, i);
+			printf ("%-32s %10" G_GINT64_FORMAT " %10.1f %10.0f %7.2f%%\n",
+					sym->name, sym->hits, sym->avg_time, sym->p99,
+					total_cost > 0 ?
+					sym->avg_time * sym->hits / total_cost * 100.0 : 0.0);
+		}
+
+		if (done > 0) {
+			rspamd_printf ("Symbols time per message: %.1f microseconds\n",
+					total_cost / done);
+		}
+	}
+
+	ucl_object_unref (top);
+}
+
+static void
+rspamadm_bench (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamadm_bench_ctx ctx;
+	rspamd_inet_addr_t *controller_addr = NULL;
+	GHashTable *before = NULL, *after = NULL;
+	GPtrArray *symbols = NULL;
+	struct rspamadm_bench_msg *m;
+	struct timeval tv;
+	gdouble elapsed;
+	gint i;
+
+	context = g_option_context_new (
+			"bench - replay corpus against rspamd and report throughput");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		rspamd_fprintf (stderr, "no corpus specified\n");
+		exit (1);
+	}
+
+	if (concurrency <= 0) {
+		concurrency = 1;
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.corpus = g_array_new (FALSE, FALSE, sizeof (struct rspamadm_bench_msg));
+	ctx.latencies = g_array_sized_new (FALSE, FALSE, sizeof (gdouble), 1024);
+
+	for (i = 1; i < argc; i ++) {
+		rspamadm_bench_load (ctx.corpus, argv[i]);
+	}
+
+	if (ctx.corpus->len == 0) {
+		rspamd_fprintf (stderr, "no messages to send\n");
+		exit (1);
+	}
+
+	ctx.ev_base = event_init ();
+	ctx.addr = rspamadm_bench_parse_addr (connect_str, BENCH_DEFAULT_PORT);
+	ctx.keys_cache = rspamd_keypair_cache_new (32);
+
+	if (key) {
+		ctx.key = rspamd_pubkey_from_base32 (key, 0, RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+
+		if (ctx.key == NULL) {
+			rspamd_fprintf (stderr, "invalid key: %s\n", key);
+			exit (1);
+		}
+
+		ctx.keypair = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	if (controller_str) {
+		controller_addr = rspamadm_bench_parse_addr (controller_str,
+				BENCH_DEFAULT_CONTROL_PORT);
+		before = rspamadm_bench_get_counters (ctx.ev_base, controller_addr);
+	}
+
+	ctx.start = rspamd_get_ticks ();
+	ctx.deadline = ctx.start + duration;
+
+	if (rate > 0) {
+		evtimer_set (&ctx.rate_ev, rspamadm_bench_rate_cb, &ctx);
+		event_base_set (ctx.ev_base, &ctx.rate_ev);
+		rspamadm_bench_rate_cb (-1, EV_TIMEOUT, &ctx);
+	}
+	else {
+		for (i = 0; i < concurrency; i ++) {
+			rspamadm_bench_send (&ctx, ctx.start);
+		}
+	}
+
+	event_base_loop (ctx.ev_base, 0);
+	elapsed = rspamd_get_ticks () - ctx.start;
+
+	if (rate > 0 && evtimer_pending (&ctx.rate_ev, NULL)) {
+		evtimer_del (&ctx.rate_ev);
+	}
+
+	if (controller_addr) {
+		/* Counters are updated by workers periodically */
+		rspamd_fprintf (stderr, "waiting for symbols counters to be updated\n");
+		double_to_tv (1.0, &tv);
+		event_base_loopexit (ctx.ev_base, &tv);
+		event_base_loop (ctx.ev_base, 0);
+		after = rspamadm_bench_get_counters (ctx.ev_base, controller_addr);
+		symbols = rspamadm_bench_symbols_cost (before, after);
+	}
+
+	rspamadm_bench_report (&ctx, elapsed, symbols);
+
+	if (symbols) {
+		g_ptr_array_free (symbols, TRUE);
+		g_hash_table_unref (before);
+		g_hash_table_unref (after);
+		rspamd_inet_address_destroy (controller_addr);
+	}
+
+	for (i = 0; i < (gint)ctx.corpus->len; i ++) {
+		m = &g_array_index (ctx.corpus, struct rspamadm_bench_msg, i);
+		munmap ((gpointer)m->data, m->len);
+	}
+
+	if (ctx.key) {
+		rspamd_pubkey_unref (ctx.key);
+		rspamd_keypair_unref (ctx.keypair);
+	}
+
+	g_array_free (ctx.corpus, TRUE);
+	g_array_free (ctx.latencies, TRUE);
+	rspamd_keypair_cache_destroy (ctx.keys_cache);
+	rspamd_inet_address_destroy (ctx.addr);
+}
@@ -24,6 +24,10 @@ extern struct rspamadm_command control_command;
 extern struct rspamadm_command confighelp_command;
 extern struct rspamadm_command statconvert_command;
 extern struct rspamadm_command signtool_command;
+extern struct rspamadm_command mapcompile_command;
+extern struct rspamadm_command logdecode_command;
+extern struct rspamadm_command bench_command;
+extern struct rspamadm_command profile_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -36,6 +40,10 @@ const struct rspamadm_command *commands[] = {
 	&confighelp_command,
 	&statconvert_command,
 	&signtool_command,
+	&mapcompile_command,
+	&logdecode_command,
+	&bench_command,
+	&profile_command,
 	NULL
 };
 
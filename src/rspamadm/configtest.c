@@ -23,6 +23,7 @@
 static gboolean quiet = FALSE;
 static gchar *config = NULL;
 static gboolean strict = FALSE;
+static gchar *snapshot = NULL;
 extern struct rspamd_main *rspamd_main;
 /* Defined in modules.c */
 extern module_t *modules[];
@@ -45,6 +46,9 @@ static GOptionEntry entries[] = {
 				"Config file to test",     NULL},
 		{"strict", 's', 0, G_OPTION_ARG_NONE, &strict,
 				"Stop on any error in config", NULL},
+		{"snapshot", 0, 0, G_OPTION_ARG_STRING, &snapshot,
+				"Save parsed config tree to this file for rspamd --config-snapshot",
+				NULL},
 		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -55,10 +59,13 @@ rspamadm_configtest_help (gboolean full_help)
 
 	if (full_help) {
 		help_str = "Perform configuration file test\n\n"
-				"Usage: rspamadm configtest [-q -c <config_name>]\n"
+				"Usage: rspamadm configtest [-q -c <config_name>]"
+				" [--snapshot <file>]\n"
 				"Where options are:\n\n"
 				"-q: quiet output\n"
 				"-c: config file to test\n"
+				"-s: stop on any error in config\n"
+				"--snapshot: save parsed config tree for rspamd --config-snapshot\n"
 				"--help: shows available options and commands";
 	}
 	else {
@@ -136,6 +143,7 @@ rspamadm_configtest (gint argc, gchar **argv)
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
 	cfg->cfg_name = config;
+	cfg->snapshot_file = snapshot;
 
 	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
 			config_logger, rspamd_main, ucl_vars)) {
@@ -171,6 +179,21 @@ rspamadm_configtest (gint argc, gchar **argv)
 		}
 	}
 
+	if (ret && snapshot) {
+		if (cfg->snapshot_key == NULL ||
+				!rspamd_config_save_snapshot (cfg, &error)) {
+			if (!quiet) {
+				rspamd_printf ("cannot save config snapshot: %s\n",
+						error ? error->message : "config uses include_map");
+			}
+
+			if (error) {
+				g_error_free (error);
+				error = NULL;
+			}
+		}
+	}
+
 	if (!quiet) {
 		rspamd_printf ("syntax %s\n", ret ? "OK" : "BAD");
 	}
@@ -245,6 +245,6 @@ rspamadm_control (gint argc, gchar **argv)
 
 	rspamd_http_connection_unref (conn);
 	rspamd_inet_address_destroy (addr);
-	lua_close (L);
+	rspamd_lua_close (L);
 	close (sock);
 }
@@ -16,11 +16,15 @@
 #include "config.h"
 #include "rspamadm.h"
 #include "logger.h"
+#include "util.h"
+#include "shingles.h"
 #include "sqlite_utils.h"
+#include "xxhash.h"
 
 static gchar *target = NULL;
 static gchar **sources = NULL;
 static gboolean quiet;
+static gint jobs = 0;
 
 static void rspamadm_fuzzy_merge (gint argc, gchar **argv);
 static const char *rspamadm_fuzzy_merge_help (gboolean full_help);
@@ -37,6 +41,8 @@ static GOptionEntry entries[] = {
 				"Source for merge (can be repeated)",                    NULL},
 		{"destination", 'd', 0, G_OPTION_ARG_STRING, &target,
 				"Destination db",     NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of reader threads (default: number of CPUs)", NULL},
 		{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
 				"Supress output", NULL},
 		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
@@ -57,12 +63,64 @@ static const gchar *create_tables_sql =
 				"ON UPDATE CASCADE);"
 				"CREATE UNIQUE INDEX IF NOT EXISTS d ON digests(digest);"
 				"CREATE INDEX IF NOT EXISTS t ON digests(time);"
+				"CREATE INDEX IF NOT EXISTS dgst_id ON shingles(digest_id);"
 				"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 				"COMMIT;";
-static const gchar *select_digests_sql =
-				"SELECT * FROM digests;";
-static const gchar *select_shingles_sql =
-				"SELECT * FROM shingles;";
+/* Must be kept in sync with fuzzy_backend.c */
+static const gchar *create_bands_sql =
+				"BEGIN;"
+				"CREATE TABLE IF NOT EXISTS bands("
+				"key INTEGER NOT NULL,"
+				"digest_id INTEGER NOT NULL REFERENCES digests(id) ON DELETE CASCADE "
+				"ON UPDATE CASCADE,"
+				"PRIMARY KEY(key, digest_id)) WITHOUT ROWID;"
+				"CREATE INDEX IF NOT EXISTS bdgst_id ON bands(digest_id);"
+				"COMMIT;";
+/*
+ * Sources are read in digest order within a shard range, each digest is
+ * followed by its shingles (NULL for digests without shingles)
+ */
+static const gchar *select_source_sql =
+				"SELECT d.digest, d.flag, d.value, d.time, s.number, s.value "
+				"FROM digests d LEFT JOIN shingles s ON s.digest_id = d.id "
+				"WHERE d.digest >= ?1 AND d.digest < ?2 ORDER BY d.digest;";
+static const gchar *select_source_last_sql =
+				"SELECT d.digest, d.flag, d.value, d.time, s.number, s.value "
+				"FROM digests d LEFT JOIN shingles s ON s.digest_id = d.id "
+				"WHERE d.digest >= ?1 ORDER BY d.digest;";
+static const gchar *select_dest_sql =
+				"SELECT digest, flag, value, time FROM digests "
+				"WHERE digest >= ?1 AND digest < ?2 ORDER BY digest;";
+static const gchar *select_dest_last_sql =
+				"SELECT digest, flag, value, time FROM digests "
+				"WHERE digest >= ?1 ORDER BY digest;";
+
+#if RSPAMD_SHINGLE_SIZE != 32
+#error "shingles insert statement should be adjusted to RSPAMD_SHINGLE_SIZE"
+#endif
+#define SHINGLE_ROW "(?,?,?)"
+#define SHINGLE_ROWS4 SHINGLE_ROW "," SHINGLE_ROW "," SHINGLE_ROW "," SHINGLE_ROW
+#define SHINGLE_ROWS16 SHINGLE_ROWS4 "," SHINGLE_ROWS4 "," SHINGLE_ROWS4 "," \
+	SHINGLE_ROWS4
+#define SHINGLE_ROWS32 SHINGLE_ROWS16 "," SHINGLE_ROWS16
+#define SHINGLES_MASK_FULL 0xffffffffU
+/* Bands layout is the same as in fuzzy_backend.c */
+#define RSPAMD_SHINGLE_BAND 2
+#define RSPAMD_SHINGLE_BANDS (RSPAMD_SHINGLE_SIZE / RSPAMD_SHINGLE_BAND)
+#define BAND_ROW "(?,?)"
+#define BAND_ROWS4 BAND_ROW "," BAND_ROW "," BAND_ROW "," BAND_ROW
+#define BAND_ROWS16 BAND_ROWS4 "," BAND_ROWS4 "," BAND_ROWS4 "," BAND_ROWS4
+
+static const gchar *insert_bands_sql =
+				"INSERT OR IGNORE INTO bands(key, digest_id) "
+				"VALUES " BAND_ROWS16 ";";
+static const gchar *insert_band_sql =
+				"INSERT OR IGNORE INTO bands(key, digest_id) VALUES (?1, ?2);";
+
+/* Operations passed from a reader to the writer at once */
+#define MERGE_BATCH_OPS 4096
+/* Maximum number of shards, digests are split by their first byte */
+#define MERGE_MAX_JOBS 64
 
 enum statement_idx {
 	TRANSACTION_START = 0,
@@ -71,8 +129,7 @@ enum statement_idx {
 	INSERT,
 	UPDATE,
 	INSERT_SHINGLE,
-	CHECK,
-	CHECK_DIGEST_ID,
+	INSERT_SHINGLES,
 	COUNT,
 	STMAX
 };
@@ -120,6 +177,16 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[STMAX] = {
 				.result = SQLITE_DONE,
 				.ret = ""
 		},
+		/* Bound directly by rspamadm_fuzzy_merge_insert_shingles */
+		[INSERT_SHINGLES] = {
+				.idx = INSERT_SHINGLES,
+				.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
+						"VALUES " SHINGLE_ROWS32 ";",
+				.args = "",
+				.stmt = NULL,
+				.result = SQLITE_DONE,
+				.ret = ""
+		},
 		[UPDATE] = {
 				.idx = UPDATE,
 				.sql = "UPDATE digests SET value=?1, time=?2 WHERE "
@@ -129,22 +196,6 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[STMAX] = {
 				.result = SQLITE_DONE,
 				.ret = ""
 		},
-		[CHECK] = {
-				.idx = CHECK,
-				.sql = "SELECT value, time, flag FROM digests WHERE digest==?1;",
-				.args = "B",
-				.stmt = NULL,
-				.result = SQLITE_ROW,
-				.ret = "III"
-		},
-		[CHECK_DIGEST_ID] = {
-				.idx = CHECK_DIGEST_ID,
-				.sql = "SELECT id FROM digests WHERE digest==?1",
-				.args = "B",
-				.stmt = NULL,
-				.result = SQLITE_ROW,
-				.ret = "I"
-		},
 		[COUNT] = {
 				.idx = COUNT,
 				.sql = "SELECT COUNT(*) FROM digests;",
@@ -166,6 +217,8 @@ rspamadm_fuzzy_merge_help (gboolean full_help)
 				"Where options are:\n\n"
 				"-s: source db for merge\n"
 				"-d: destination db for merge\n"
+				"-j: number of threads reading sources (default: number of CPUs)\n"
+				"-q: suppress output\n"
 				"--help: shows available options and commands";
 	}
 	else {
@@ -178,42 +231,622 @@ rspamadm_fuzzy_merge_help (gboolean full_help)
 enum op_type {
 	OP_INSERT = 0,
 	OP_UPDATE,
-	OP_INSERT_SHINGLE,
 };
+
+/* Digest with its shingles (mask has bits of the known shingles set) */
+struct fuzzy_merge_row {
+	guchar digest[64];
+	gint64 flag;
+	gint64 value;
+	gint64 tm;
+	guint32 mask;
+	guint64 hashes[RSPAMD_SHINGLE_SIZE];
+};
+
 struct fuzzy_merge_op {
 	enum op_type op;
-	guchar digest[64];
-	union {
-		struct {
-			guint flag;
-			gint64 value;
-			gint64 tm;
-			gint64 id;
-		} dgst;
-		struct {
-			guint number;
-			gint64 value;
-		} shgl;
-	} data;
+	struct fuzzy_merge_row row;
+};
+
+struct fuzzy_merge_cursor {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	const gchar *path;
+	gint rc;
+	gboolean valid;
+	struct fuzzy_merge_row row;
+};
+
+struct fuzzy_merge_ctx;
+
+struct fuzzy_merge_batch {
+	GArray *ops;
+	gboolean last;
+};
+
+/* Digests range [lo, hi) processed by a single reader */
+struct fuzzy_merge_shard {
+	struct fuzzy_merge_ctx *ctx;
+	guchar lo;
+	guchar hi;
+	gboolean last;
+	struct fuzzy_merge_batch *batch;
+	GError *err;
+	guint64 nnew;
+	guint64 nupdated;
+	guint64 ndup_dst;
+	guint64 ndup_other;
+	guint64 nshingles;
+};
+
+struct fuzzy_merge_ctx {
+	rspamd_mempool_t *pool;
+	sqlite3 *dest_db;
+	GArray *prstmt;
+	sqlite3_stmt *insert_bands;
+	sqlite3_stmt *insert_band;
+	/* NULL when shards are processed by the writer itself */
+	GAsyncQueue *free_batches;
+	GAsyncQueue *ready_batches;
+	gint stop;
+	guint64 inserted;
+	guint64 updated;
+	guint64 shingles_inserted;
 };
 
+static struct fuzzy_merge_batch *
+rspamadm_fuzzy_merge_batch_new (void)
+{
+	struct fuzzy_merge_batch *batch;
+
+	batch = g_malloc0 (sizeof (*batch));
+	batch->ops = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct fuzzy_merge_op), MERGE_BATCH_OPS);
+
+	return batch;
+}
+
+static void
+rspamadm_fuzzy_merge_batch_free (struct fuzzy_merge_batch *batch)
+{
+	g_array_free (batch->ops, TRUE);
+	g_free (batch);
+}
+
+static inline gint64
+rspamadm_fuzzy_merge_band_key (const guint64 *hashes, guint band)
+{
+	return (gint64)XXH64 (&hashes[band * RSPAMD_SHINGLE_BAND],
+			sizeof (*hashes) * RSPAMD_SHINGLE_BAND, band);
+}
+
 static guint
-rspamadm_op_hash (gconstpointer p)
+rspamadm_fuzzy_merge_nshingles (guint32 mask)
 {
-	const struct fuzzy_merge_op *op = p;
-	guint res;
+	guint n = 0;
+
+	while (mask) {
+		mask &= mask - 1;
+		n ++;
+	}
 
-	/* Uniformly distributed */
-	memcpy (&res, op->digest, sizeof (res));
-	return res;
+	return n;
 }
 
 static gboolean
-rspamadm_op_equal (gconstpointer a, gconstpointer b)
+rspamadm_fuzzy_merge_insert_shingles (struct fuzzy_merge_ctx *ctx,
+		const struct fuzzy_merge_row *row, gint64 id)
 {
-	const struct fuzzy_merge_op *op1 = a, *op2 = b;
+	const guint32 band_mask = (1U << RSPAMD_SHINGLE_BAND) - 1;
+	sqlite3_stmt *stmt;
+	guint i;
+	gint rc;
+
+	if (row->mask == SHINGLES_MASK_FULL) {
+		stmt = g_array_index (ctx->prstmt, struct rspamd_sqlite3_prstmt,
+				INSERT_SHINGLES).stmt;
+		sqlite3_reset (stmt);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			sqlite3_bind_int64 (stmt, i * 3 + 1, row->hashes[i]);
+			sqlite3_bind_int64 (stmt, i * 3 + 2, i);
+			sqlite3_bind_int64 (stmt, i * 3 + 3, id);
+		}
+
+		rc = sqlite3_step (stmt);
+		sqlite3_reset (stmt);
+
+		if (rc != SQLITE_DONE) {
+			return FALSE;
+		}
+
+		ctx->shingles_inserted += RSPAMD_SHINGLE_SIZE;
+	}
+	else {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (!(row->mask & (1U << i))) {
+				continue;
+			}
+
+			if (rspamd_sqlite3_run_prstmt (ctx->pool,
+					ctx->dest_db,
+					ctx->prstmt,
+					INSERT_SHINGLE,
+					(gint64)row->hashes[i],
+					(gint64)i,
+					id) != SQLITE_OK) {
+				return FALSE;
+			}
+
+			ctx->shingles_inserted ++;
+		}
+	}
+
+	if (ctx->insert_bands == NULL) {
+		/* Bands are built by the fuzzy backend on the next start */
+		return TRUE;
+	}
+
+	if (row->mask == SHINGLES_MASK_FULL) {
+		stmt = ctx->insert_bands;
+		sqlite3_reset (stmt);
+
+		for (i = 0; i < RSPAMD_SHINGLE_BANDS; i ++) {
+			sqlite3_bind_int64 (stmt, i * 2 + 1,
+					rspamadm_fuzzy_merge_band_key (row->hashes, i));
+			sqlite3_bind_int64 (stmt, i * 2 + 2, id);
+		}
+
+		rc = sqlite3_step (stmt);
+		sqlite3_reset (stmt);
+
+		return rc == SQLITE_DONE;
+	}
+
+	stmt = ctx->insert_band;
+
+	for (i = 0; i < RSPAMD_SHINGLE_BANDS; i ++) {
+		if (((row->mask >> (i * RSPAMD_SHINGLE_BAND)) & band_mask) != band_mask) {
+			continue;
+		}
+
+		sqlite3_reset (stmt);
+		sqlite3_bind_int64 (stmt, 1,
+				rspamadm_fuzzy_merge_band_key (row->hashes, i));
+		sqlite3_bind_int64 (stmt, 2, id);
+		rc = sqlite3_step (stmt);
+		sqlite3_reset (stmt);
 
-	return memcmp (op1->digest, op2->digest, sizeof (op1->digest)) == 0;
+		if (rc != SQLITE_DONE) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Called from the main thread only */
+static gboolean
+rspamadm_fuzzy_merge_write (struct fuzzy_merge_ctx *ctx, GArray *ops)
+{
+	struct fuzzy_merge_op *op;
+	gint64 id;
+	guint i;
+
+	for (i = 0; i < ops->len; i ++) {
+		op = &g_array_index (ops, struct fuzzy_merge_op, i);
+
+		switch (op->op) {
+		case OP_INSERT:
+			/* flag, digest, value, time */
+			if (rspamd_sqlite3_run_prstmt (ctx->pool,
+					ctx->dest_db,
+					ctx->prstmt,
+					INSERT,
+					(gint)op->row.flag,
+					(gint64)sizeof (op->row.digest), op->row.digest,
+					op->row.value,
+					op->row.tm) != SQLITE_OK) {
+				rspamd_fprintf (stderr, "cannot insert digest: %s\n",
+						sqlite3_errmsg (ctx->dest_db));
+				return FALSE;
+			}
+
+			ctx->inserted ++;
+
+			if (op->row.mask != 0) {
+				id = sqlite3_last_insert_rowid (ctx->dest_db);
+
+				if (!rspamadm_fuzzy_merge_insert_shingles (ctx, &op->row, id)) {
+					rspamd_fprintf (stderr, "cannot insert shingles: %s\n",
+							sqlite3_errmsg (ctx->dest_db));
+					return FALSE;
+				}
+			}
+			break;
+		case OP_UPDATE:
+			if (rspamd_sqlite3_run_prstmt (ctx->pool,
+					ctx->dest_db,
+					ctx->prstmt,
+					UPDATE,
+					op->row.value,
+					op->row.tm,
+					(gint64)sizeof (op->row.digest),
+					op->row.digest) != SQLITE_OK) {
+				rspamd_fprintf (stderr, "cannot update digest: %s\n",
+						sqlite3_errmsg (ctx->dest_db));
+				return FALSE;
+			}
+
+			ctx->updated ++;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamadm_fuzzy_merge_flush (struct fuzzy_merge_shard *shard)
+{
+	struct fuzzy_merge_ctx *ctx = shard->ctx;
+
+	if (ctx->ready_batches) {
+		g_async_queue_push (ctx->ready_batches, shard->batch);
+		shard->batch = g_async_queue_pop (ctx->free_batches);
+	}
+	else {
+		if (!rspamadm_fuzzy_merge_write (ctx, shard->batch->ops)) {
+			ctx->stop = 1;
+		}
+
+		g_array_set_size (shard->batch->ops, 0);
+	}
+}
+
+static void
+rspamadm_fuzzy_merge_emit (struct fuzzy_merge_shard *shard,
+		enum op_type type, const struct fuzzy_merge_row *row)
+{
+	struct fuzzy_merge_op *op;
+
+	g_array_set_size (shard->batch->ops, shard->batch->ops->len + 1);
+	op = &g_array_index (shard->batch->ops, struct fuzzy_merge_op,
+			shard->batch->ops->len - 1);
+	op->op = type;
+	memcpy (&op->row, row, sizeof (*row));
+
+	if (shard->batch->ops->len >= MERGE_BATCH_OPS) {
+		rspamadm_fuzzy_merge_flush (shard);
+	}
+}
+
+static gboolean
+rspamadm_fuzzy_merge_cursor_open (struct fuzzy_merge_shard *shard,
+		struct fuzzy_merge_cursor *cur, const gchar *path,
+		const gchar *sql, const gchar *last_sql)
+{
+	cur->path = path;
+	cur->valid = FALSE;
+	cur->rc = SQLITE_DONE;
+
+	/* Private cache connections read a consistent WAL snapshot */
+	if (sqlite3_open_v2 (path, &cur->db,
+			SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_PRIVATECACHE,
+			NULL) != SQLITE_OK) {
+		g_set_error (&shard->err, rspamadm_error (), errno,
+				"cannot open %s: %s", path, sqlite3_errmsg (cur->db));
+		return FALSE;
+	}
+
+	sqlite3_busy_timeout (cur->db, 10000);
+
+	if (sqlite3_prepare_v2 (cur->db, shard->last ? last_sql : sql, -1,
+			&cur->stmt, NULL) != SQLITE_OK) {
+		g_set_error (&shard->err, rspamadm_error (), EINVAL,
+				"cannot prepare statement for %s: %s", path,
+				sqlite3_errmsg (cur->db));
+		return FALSE;
+	}
+
+	/* Digests are stored as text, so bounds are compared as text too */
+	sqlite3_bind_text (cur->stmt, 1, (const gchar *)&shard->lo,
+			shard->lo == 0 ? 0 : 1, SQLITE_STATIC);
+
+	if (!shard->last) {
+		sqlite3_bind_text (cur->stmt, 2, (const gchar *)&shard->hi, 1,
+				SQLITE_STATIC);
+	}
+
+	cur->rc = sqlite3_step (cur->stmt);
+
+	return TRUE;
+}
+
+static void
+rspamadm_fuzzy_merge_cursor_close (struct fuzzy_merge_cursor *cur)
+{
+	if (cur->stmt) {
+		sqlite3_finalize (cur->stmt);
+	}
+
+	if (cur->db) {
+		sqlite3_close (cur->db);
+	}
+}
+
+/* Reads the next digest and all its shingles */
+static gboolean
+rspamadm_fuzzy_merge_cursor_next (struct fuzzy_merge_shard *shard,
+		struct fuzzy_merge_cursor *cur)
+{
+	struct fuzzy_merge_row *row = &cur->row;
+	sqlite3_stmt *stmt = cur->stmt;
+	const guchar *digest;
+	gint64 number;
+
+	cur->valid = FALSE;
+
+	while (cur->rc == SQLITE_ROW) {
+		digest = sqlite3_column_blob (stmt, 0);
+
+		if (sqlite3_column_bytes (stmt, 0) != sizeof (row->digest)) {
+			/* Malformed digest */
+			cur->rc = sqlite3_step (stmt);
+			continue;
+		}
+
+		memcpy (row->digest, digest, sizeof (row->digest));
+		row->flag = sqlite3_column_int64 (stmt, 1);
+		row->value = sqlite3_column_int64 (stmt, 2);
+		row->tm = sqlite3_column_int64 (stmt, 3);
+		row->mask = 0;
+		cur->valid = TRUE;
+
+		do {
+			if (sqlite3_column_count (stmt) > 4 &&
+					sqlite3_column_type (stmt, 4) != SQLITE_NULL) {
+				number = sqlite3_column_int64 (stmt, 4);
+
+				if (number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+					row->hashes[number] = sqlite3_column_int64 (stmt, 5);
+					row->mask |= 1U << number;
+				}
+			}
+
+			cur->rc = sqlite3_step (stmt);
+		} while (cur->rc == SQLITE_ROW &&
+				(digest = sqlite3_column_blob (stmt, 0)) != NULL &&
+				sqlite3_column_bytes (stmt, 0) == sizeof (row->digest) &&
+				memcmp (digest, row->digest, sizeof (row->digest)) == 0);
+
+		break;
+	}
+
+	if (cur->rc != SQLITE_ROW && cur->rc != SQLITE_DONE) {
+		g_set_error (&shard->err, rspamadm_error (), EINVAL,
+				"cannot read %s: %s", cur->path, sqlite3_errmsg (cur->db));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * K-way merge of sources with the destination over a shard range: all cursors
+ * are sorted by digest, so each digest is decided once without lookups
+ */
+static gboolean
+rspamadm_fuzzy_merge_shard (struct fuzzy_merge_shard *shard)
+{
+	struct fuzzy_merge_ctx *ctx = shard->ctx;
+	struct fuzzy_merge_cursor *srcs, dst, *cur;
+	struct fuzzy_merge_row *min, *best, row;
+	gboolean in_dst, ret = FALSE;
+	guint i, nsrc, nsame;
+
+	nsrc = g_strv_length (sources);
+	srcs = g_malloc0 (sizeof (*srcs) * nsrc);
+	memset (&dst, 0, sizeof (dst));
+
+	for (i = 0; i < nsrc; i ++) {
+		if (!rspamadm_fuzzy_merge_cursor_open (shard, &srcs[i], sources[i],
+				select_source_sql, select_source_last_sql) ||
+				!rspamadm_fuzzy_merge_cursor_next (shard, &srcs[i])) {
+			goto end;
+		}
+	}
+
+	if (!rspamadm_fuzzy_merge_cursor_open (shard, &dst, target,
+			select_dest_sql, select_dest_last_sql) ||
+			!rspamadm_fuzzy_merge_cursor_next (shard, &dst)) {
+		goto end;
+	}
+
+	while (!g_atomic_int_get (&ctx->stop)) {
+		min = NULL;
+
+		for (i = 0; i < nsrc; i ++) {
+			if (srcs[i].valid && (min == NULL ||
+					memcmp (srcs[i].row.digest, min->digest,
+							sizeof (min->digest)) < 0)) {
+				min = &srcs[i].row;
+			}
+		}
+
+		if (min == NULL) {
+			break;
+		}
+
+		/* Skip digests that exist in the destination only */
+		while (dst.valid &&
+				memcmp (dst.row.digest, min->digest, sizeof (min->digest)) < 0) {
+			if (!rspamadm_fuzzy_merge_cursor_next (shard, &dst)) {
+				goto end;
+			}
+		}
+
+		in_dst = dst.valid &&
+				memcmp (dst.row.digest, min->digest, sizeof (min->digest)) == 0;
+		best = NULL;
+		nsame = 0;
+
+		for (i = 0; i < nsrc; i ++) {
+			cur = &srcs[i];
+
+			if (!cur->valid || memcmp (cur->row.digest, min->digest,
+					sizeof (min->digest)) != 0) {
+				continue;
+			}
+
+			nsame ++;
+
+			/*
+			 * We compare values and if src value is bigger than
+			 * local one then we replace dest value with the src value
+			 */
+			if (in_dst) {
+				if (cur->row.flag == dst.row.flag &&
+						cur->row.value > (best ? best->value : dst.row.value)) {
+					best = &cur->row;
+				}
+			}
+			else if (best == NULL || cur->row.value > best->value) {
+				best = &cur->row;
+			}
+		}
+
+		shard->ndup_other += nsame - 1;
+
+		if (best) {
+			memcpy (&row, best, sizeof (row));
+
+			if (in_dst) {
+				rspamadm_fuzzy_merge_emit (shard, OP_UPDATE, &row);
+				shard->nupdated ++;
+			}
+			else {
+				rspamadm_fuzzy_merge_emit (shard, OP_INSERT, &row);
+				shard->nnew ++;
+				shard->nshingles += rspamadm_fuzzy_merge_nshingles (row.mask);
+			}
+		}
+		else {
+			memcpy (&row, min, sizeof (row));
+			shard->ndup_dst ++;
+		}
+
+		for (i = 0; i < nsrc; i ++) {
+			cur = &srcs[i];
+
+			if (cur->valid && memcmp (cur->row.digest, row.digest,
+					sizeof (row.digest)) == 0) {
+				if (!rspamadm_fuzzy_merge_cursor_next (shard, cur)) {
+					goto end;
+				}
+			}
+		}
+	}
+
+	ret = TRUE;
+
+end:
+	for (i = 0; i < nsrc; i ++) {
+		rspamadm_fuzzy_merge_cursor_close (&srcs[i]);
+	}
+
+	rspamadm_fuzzy_merge_cursor_close (&dst);
+	g_free (srcs);
+
+	return ret;
+}
+
+static gpointer
+rspamadm_fuzzy_merge_thread (gpointer ud)
+{
+	struct fuzzy_merge_shard *shard = ud;
+
+	rspamadm_fuzzy_merge_shard (shard);
+	shard->batch->last = TRUE;
+	g_async_queue_push (shard->ctx->ready_batches, shard->batch);
+	shard->batch = NULL;
+
+	return NULL;
+}
+
+static guint
+rspamadm_fuzzy_merge_jobs (void)
+{
+	glong ncpus;
+
+	if (jobs > 0) {
+		return MIN (jobs, MERGE_MAX_JOBS);
+	}
+
+	ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (ncpus <= 0) {
+		return 1;
+	}
+
+	return MIN (ncpus, MERGE_MAX_JOBS);
+}
+
+/*
+ * Bands are filled either for a new destination or if the destination already
+ * has them, otherwise fuzzy storage builds them for all digests on start
+ */
+static gboolean
+rspamadm_fuzzy_merge_init_bands (struct fuzzy_merge_ctx *ctx, GError **err)
+{
+	sqlite3_stmt *stmt;
+	gboolean has_shingles = FALSE, has_bands = FALSE;
+
+	if (sqlite3_prepare_v2 (ctx->dest_db,
+			"SELECT EXISTS(SELECT 1 FROM shingles);", -1, &stmt,
+			NULL) == SQLITE_OK) {
+		if (sqlite3_step (stmt) == SQLITE_ROW) {
+			has_shingles = sqlite3_column_int64 (stmt, 0) != 0;
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+	if (!has_shingles) {
+		if (sqlite3_exec (ctx->dest_db, create_bands_sql, NULL, NULL,
+				NULL) != SQLITE_OK) {
+			g_set_error (err, rspamadm_error (), EINVAL,
+					"cannot create bands: %s", sqlite3_errmsg (ctx->dest_db));
+			return FALSE;
+		}
+
+		has_bands = TRUE;
+	}
+	else if (sqlite3_prepare_v2 (ctx->dest_db,
+			"SELECT EXISTS(SELECT 1 FROM bands);", -1, &stmt,
+			NULL) == SQLITE_OK) {
+		if (sqlite3_step (stmt) == SQLITE_ROW) {
+			has_bands = sqlite3_column_int64 (stmt, 0) != 0;
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+	if (!has_bands) {
+		return TRUE;
+	}
+
+	if (sqlite3_prepare_v2 (ctx->dest_db, insert_bands_sql, -1,
+			&ctx->insert_bands, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2 (ctx->dest_db, insert_band_sql, -1,
+			&ctx->insert_band, NULL) != SQLITE_OK) {
+		g_set_error (err, rspamadm_error (), EINVAL,
+				"cannot prepare bands statements: %s",
+				sqlite3_errmsg (ctx->dest_db));
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 static void
@@ -221,18 +854,17 @@ rspamadm_fuzzy_merge (gint argc, gchar **argv)
 {
 	GOptionContext *context;
 	GError *error = NULL;
-	sqlite3 *dest_db;
-	GPtrArray *source_dbs;
-	GArray *prstmt;
-	GPtrArray *ops;
-	GHashTable *unique_ops, *digests_id;
-	rspamd_mempool_t *pool;
-	guint i, nsrc;
-	guint64 old_count, inserted = 0, updated = 0, shingles_inserted = 0;
-	gint64 value, flag, tm, dig_id, src_value, src_flag;
+	struct fuzzy_merge_ctx ctx;
+	struct fuzzy_merge_shard *shards, *shard;
+	struct fuzzy_merge_batch *batch;
+	GPtrArray *threads;
+	GThread *th;
 	sqlite3 *src;
-	sqlite3_stmt *stmt, *shgl_stmt;
-	struct fuzzy_merge_op *nop, *op;
+	sqlite3_stmt *stmt;
+	guint i, nsrc, nshards, nactive;
+	guint64 old_count, nnew = 0, nupdated = 0, ndup_dst = 0, ndup_other = 0,
+			nshingles = 0;
+	gboolean failed = FALSE;
 
 	context = g_option_context_new (
 			"fuzzy_merge - merge fuzzy databases");
@@ -254,333 +886,207 @@ rspamadm_fuzzy_merge (gint argc, gchar **argv)
 		exit (1);
 	}
 
-	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_merge");
-	dest_db = rspamd_sqlite3_open_or_create (pool, target, create_tables_sql,
-			&error);
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "fuzzy_merge");
+	nsrc = g_strv_length (sources);
+
+	/* Check sources before touching the destination */
+	for (i = 0; i < nsrc; i++) {
+		if (sqlite3_open_v2 (sources[i], &src, SQLITE_OPEN_READONLY,
+				NULL) != SQLITE_OK ||
+				sqlite3_prepare_v2 (src, "SELECT id FROM digests LIMIT 1;", -1,
+				&stmt, NULL) != SQLITE_OK) {
+			rspamd_fprintf(stderr, "cannot open source %s: %s\n", sources[i],
+					sqlite3_errmsg (src));
+			exit (1);
+		}
+
+		sqlite3_finalize (stmt);
+		sqlite3_close (src);
+	}
+
+	ctx.dest_db = rspamd_sqlite3_open_or_create (ctx.pool, target,
+			create_tables_sql, &rspamd_sqlite3_throughput_tune, &error);
 
-	if (dest_db == NULL) {
+	if (ctx.dest_db == NULL) {
 		rspamd_fprintf(stderr, "cannot open destination: %s\n", error->message);
 		g_error_free (error);
 		exit (1);
 	}
 
-	prstmt = rspamd_sqlite3_init_prstmt (dest_db, prepared_stmts,
+	ctx.prstmt = rspamd_sqlite3_init_prstmt (ctx.dest_db, prepared_stmts,
 			STMAX, &error);
 
-	if (prstmt == NULL) {
+	if (ctx.prstmt == NULL || !rspamadm_fuzzy_merge_init_bands (&ctx, &error)) {
 		rspamd_fprintf(stderr, "cannot init prepared statements: %s\n", error->message);
 		g_error_free (error);
 		exit (1);
 	}
 
-	rspamd_sqlite3_run_prstmt (pool, dest_db, prstmt, COUNT, &old_count);
+	rspamd_sqlite3_run_prstmt (ctx.pool, ctx.dest_db, ctx.prstmt, COUNT,
+			&old_count);
 
-	nsrc = g_strv_length (sources);
-	source_dbs = g_ptr_array_sized_new (nsrc);
-	ops = g_ptr_array_new ();
-	unique_ops = g_hash_table_new (rspamadm_op_hash, rspamadm_op_equal);
+	nshards = sqlite3_threadsafe () ? rspamadm_fuzzy_merge_jobs () : 1;
+	shards = g_malloc0 (sizeof (*shards) * nshards);
 
-	for (i = 0; i < nsrc; i++) {
-		src = rspamd_sqlite3_open_or_create (pool, sources[i], NULL, &error);
-
-		if (src == NULL) {
-			rspamd_fprintf(stderr, "cannot open source %s: %s\n", sources[i],
-					error->message);
-			g_error_free (error);
-			exit (1);
-		}
+	for (i = 0; i < nshards; i ++) {
+		shard = &shards[i];
+		shard->ctx = &ctx;
+		shard->lo = (i * 256) / nshards;
+		shard->hi = ((i + 1) * 256) / nshards;
+		shard->last = (i == nshards - 1);
+		shard->batch = rspamadm_fuzzy_merge_batch_new ();
+	}
 
-		g_ptr_array_add (source_dbs, src);
+	if (!quiet) {
+		rspamd_printf ("merging %ud sources into %s using %ud threads\n",
+				nsrc, target, nshards);
 	}
 
-	for (i = 0; i < nsrc; i++) {
-		const guchar *digest;
-		guint64 nsrc_ops = 0, ndup_dst = 0, ndup_other = 0, nupdated = 0,
-				nsrc_shingles = 0;
+	/* All changes are written in a single transaction */
+	if (rspamd_sqlite3_run_prstmt (ctx.pool,
+			ctx.dest_db,
+			ctx.prstmt,
+			TRANSACTION_START) != SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot start transaction in destination: %s\n",
+				sqlite3_errmsg (ctx.dest_db));
+		exit (1);
+	}
 
-		src = g_ptr_array_index (source_dbs, i);
-		
-		if (!quiet) {
-			rspamd_printf ("reading data from %s\n", sources[i]);
+	if (nshards == 1) {
+		if (!rspamadm_fuzzy_merge_shard (&shards[0])) {
+			failed = TRUE;
+		}
+		else if (!ctx.stop) {
+			rspamadm_fuzzy_merge_flush (&shards[0]);
 		}
 
-		if (sqlite3_prepare_v2 (src, select_digests_sql, -1, &stmt, NULL) !=
-					SQLITE_OK) {
-			rspamd_fprintf(stderr, "cannot prepare statement %s: %s\n",
-					select_digests_sql, sqlite3_errmsg (src));
-			exit (1);
+		failed = failed || ctx.stop;
+		rspamadm_fuzzy_merge_batch_free (shards[0].batch);
+	}
+	else {
+		ctx.free_batches = g_async_queue_new ();
+		ctx.ready_batches = g_async_queue_new ();
+		threads = g_ptr_array_sized_new (nshards);
+
+		/* Limits memory used by readers that are faster than the writer */
+		for (i = 0; i < nshards * 2; i ++) {
+			g_async_queue_push (ctx.free_batches,
+					rspamadm_fuzzy_merge_batch_new ());
 		}
 
-		/* Temporary index for inserted IDs */
-		digests_id = g_hash_table_new (g_int64_hash, g_int64_equal);
-
-		while (sqlite3_step (stmt) == SQLITE_ROW) {
-			/* id, flag, digest, value, time */
-			digest = sqlite3_column_text (stmt, 2);
-			src_value = sqlite3_column_int64 (stmt, 3);
-			src_flag = sqlite3_column_int64 (stmt, 1);
-
-			/* Now search for this digest in the destination */
-			if (rspamd_sqlite3_run_prstmt (pool,
-					dest_db,
-					prstmt,
-					CHECK,
-					(gint64)sqlite3_column_bytes (stmt, 2), digest,
-					&value, &tm, &flag) == SQLITE_OK) {
-				/*
-				 * We compare values and if src value is bigger than
-				 * local one then we replace dest value with the src value
-				 */
-				if (src_value > value && src_flag == flag) {
-					nop = g_slice_alloc (sizeof (*nop));
-					nop->op = OP_UPDATE;
-					memcpy (nop->digest, digest,
-							sizeof (nop->digest));
-					nop->data.dgst.flag = flag;
-					/* Update time as well */
-					nop->data.dgst.tm = sqlite3_column_int64 (stmt, 4);
-					nop->data.dgst.id = sqlite3_column_int64 (stmt, 0);
-
-					if ((op = g_hash_table_lookup (unique_ops, nop)) == NULL) {
-						g_ptr_array_add (ops, nop);
-						g_hash_table_insert (unique_ops, nop, nop);
-						nupdated ++;
-					}
-					else {
-						if (op->data.dgst.value < nop->data.dgst.value) {
-							op->data.dgst.value = nop->data.dgst.value;
-							op->data.dgst.tm = nop->data.dgst.tm;
-							nupdated ++;
-						}
-						else {
-							ndup_other ++;
-						}
-						g_slice_free1 (sizeof (*nop), nop);
-					}
-				}
-				else {
-					ndup_dst ++;
-				}
-			}
-			else {
-				/* Digest has not been found, but maybe we have the same in other
-				 * sources ?
-				 */
-				nop = g_slice_alloc (sizeof (*nop));
-				nop->op = OP_INSERT;
-				memcpy (nop->digest, digest,
-						sizeof (nop->digest));
-				nop->data.dgst.flag = src_flag;
-				nop->data.dgst.value = src_value;
-				/* Update time as well */
-				nop->data.dgst.tm = sqlite3_column_int64 (stmt, 4);
-				nop->data.dgst.id = sqlite3_column_int64 (stmt, 0);
-
-				if ((op = g_hash_table_lookup (unique_ops, nop)) == NULL) {
-					g_ptr_array_add (ops, nop);
-					g_hash_table_insert (unique_ops, nop, nop);
-					g_hash_table_insert (digests_id, &nop->data.dgst.id,
-							nop);
-					nsrc_ops ++;
-				}
-				else {
-					if (op->data.dgst.value < nop->data.dgst.value) {
-						op->data.dgst.value = nop->data.dgst.value;
-						op->data.dgst.tm = nop->data.dgst.tm;
-						op->data.dgst.tm = nop->data.dgst.tm;
-						nupdated++;
-					}
-					else {
-						ndup_other++;
-					}
-					g_slice_free1 (sizeof (*nop), nop);
-				}
+		for (i = 0; i < nshards; i ++) {
+			th = rspamd_create_thread ("fuzzy_merge",
+					rspamadm_fuzzy_merge_thread, &shards[i], &error);
+
+			if (th == NULL) {
+				rspamd_fprintf (stderr, "cannot create thread: %s\n",
+						error->message);
+				exit (1);
 			}
+
+			g_ptr_array_add (threads, th);
 		}
 
-		/* We also need to scan all shingles and select those that
-		 * are to be inserted
-		 */
-		if (sqlite3_prepare_v2 (src,
-				select_shingles_sql,
-				-1,
-				&shgl_stmt,
-				NULL) == SQLITE_OK) {
-			sqlite3_bind_int64 (shgl_stmt,
-					sqlite3_column_int64 (stmt, 0), 1);
-
-			while (sqlite3_step (shgl_stmt) == SQLITE_ROW) {
-				gint64 id = sqlite3_column_int64 (shgl_stmt, 2);
-
-				if ((op = g_hash_table_lookup (digests_id, &id)) != NULL) {
-					/* value, number, digest_id */
-					nop = g_slice_alloc (sizeof (*nop));
-					nop->op = OP_INSERT_SHINGLE;
-					memcpy (nop->digest, op->digest, sizeof (nop->digest));
-					nop->data.shgl.number = sqlite3_column_int64 (shgl_stmt, 1);
-					nop->data.shgl.value = sqlite3_column_int64 (shgl_stmt,
-							0);
-					g_ptr_array_add (ops, nop);
-					nsrc_shingles ++;
-				}
+		nactive = nshards;
+
+		while (nactive > 0) {
+			batch = g_async_queue_pop (ctx.ready_batches);
+
+			if (!failed && !rspamadm_fuzzy_merge_write (&ctx, batch->ops)) {
+				failed = TRUE;
+				g_atomic_int_set (&ctx.stop, 1);
 			}
 
-			sqlite3_finalize (shgl_stmt);
+			if (batch->last) {
+				nactive --;
+				rspamadm_fuzzy_merge_batch_free (batch);
+			}
+			else {
+				g_array_set_size (batch->ops, 0);
+				g_async_queue_push (ctx.free_batches, batch);
+			}
 		}
-		else {
-			rspamd_fprintf (stderr, "cannot prepare statement %s: %s\n",
-					select_shingles_sql, sqlite3_errmsg (src));
-			exit (1);
+
+		for (i = 0; i < threads->len; i ++) {
+			g_thread_join (g_ptr_array_index (threads, i));
 		}
 
-		if (!quiet) {
-			rspamd_printf ("processed %s: %L new hashes, %L duplicate hashes (other sources), "
-							"%L duplicate hashes (destination), %L hashes to update, "
-							"%L shingles to insert\n\n",
-					sources[i],
-					nsrc_ops,
-					ndup_other,
-					ndup_dst,
-					nupdated,
-					nsrc_shingles);
+		while ((batch = g_async_queue_try_pop (ctx.free_batches)) != NULL) {
+			rspamadm_fuzzy_merge_batch_free (batch);
 		}
-		/* Cleanup */
-		g_hash_table_unref (digests_id);
-		sqlite3_finalize (stmt);
-		sqlite3_close (src);
-	}
-	
-	if (!quiet) {
-		rspamd_printf ("start writing to %s, %ud ops pending\n", target, ops->len);
-	}
 
-	/* Start transaction */
-	if (rspamd_sqlite3_run_prstmt (pool,
-			dest_db,
-			prstmt,
-			TRANSACTION_START) != SQLITE_OK) {
-		rspamd_fprintf (stderr, "cannot start transaction in destination: %s\n",
-				sqlite3_errmsg (dest_db));
-		exit (1);
+		g_ptr_array_free (threads, TRUE);
+		g_async_queue_unref (ctx.free_batches);
+		g_async_queue_unref (ctx.ready_batches);
 	}
 
-	/* Now all ops are inside ops array, so we just iterate over it */
-	for (i = 0; i < ops->len; i ++) {
-		op = g_ptr_array_index (ops, i);
+	for (i = 0; i < nshards; i ++) {
+		shard = &shards[i];
 
-		switch (op->op) {
-		case OP_INSERT:
-			/* flag, digest, value, time */
-			if (rspamd_sqlite3_run_prstmt (pool,
-					dest_db,
-					prstmt,
-					INSERT,
-					(gint64)op->data.dgst.flag,
-					(gint64)sizeof (op->digest), op->digest,
-					op->data.dgst.value,
-					op->data.dgst.tm) != SQLITE_OK) {
-				rspamd_fprintf(stderr, "cannot insert digest: %s\n",
-						sqlite3_errmsg (dest_db));
-				goto err;
-			}
+		if (shard->err) {
+			rspamd_fprintf (stderr, "merge failed: %s\n", shard->err->message);
+			g_error_free (shard->err);
+			failed = TRUE;
+		}
 
-			inserted ++;
-			break;
-		case OP_UPDATE:
-			if (rspamd_sqlite3_run_prstmt (pool,
-					dest_db,
-					prstmt,
-					UPDATE,
-					(gint64) op->data.dgst.value,
-					op->data.dgst.tm,
-					(gint64) sizeof (op->digest),
-					op->digest) != SQLITE_OK) {
-				rspamd_fprintf(stderr, "cannot update digest: %s\n",
-						sqlite3_errmsg (dest_db));
-				goto err;
-			}
+		nnew += shard->nnew;
+		nupdated += shard->nupdated;
+		ndup_dst += shard->ndup_dst;
+		ndup_other += shard->ndup_other;
+		nshingles += shard->nshingles;
+	}
 
-			updated ++;
-			break;
-		case OP_INSERT_SHINGLE:
-			/* First select the appropriate digest */
-			if (rspamd_sqlite3_run_prstmt (pool,
-					dest_db,
-					prstmt,
-					CHECK_DIGEST_ID,
-					(gint64) sizeof (op->digest),
-					op->digest,
-					&dig_id) == SQLITE_OK) {
-				if (rspamd_sqlite3_run_prstmt (pool,
-						dest_db,
-						prstmt,
-						INSERT_SHINGLE,
-						(gint64)op->data.shgl.value,
-						(gint64)op->data.shgl.number,
-						dig_id) != SQLITE_OK) {
-					rspamd_fprintf(stderr, "cannot insert shingle: %s\n",
-							sqlite3_errmsg (dest_db));
-					goto err;
-				}
+	g_free (shards);
 
-				shingles_inserted ++;
-			}
-			else {
-				msg_warn_pool ("cannot find digest id for shingle");
-			}
+	if (!failed && rspamd_sqlite3_run_prstmt (ctx.pool,
+			ctx.dest_db,
+			ctx.prstmt,
+			TRANSACTION_COMMIT) != SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot commit transaction: %s\n",
+				sqlite3_errmsg (ctx.dest_db));
+		failed = TRUE;
+	}
 
-			break;
-		}
+	if (failed) {
+		rspamd_sqlite3_run_prstmt (ctx.pool,
+				ctx.dest_db,
+				ctx.prstmt,
+				TRANSACTION_ROLLBACK);
 	}
 
-	/* Normal closing */
-	if (rspamd_sqlite3_run_prstmt (pool,
-			dest_db,
-			prstmt,
-			TRANSACTION_COMMIT) != SQLITE_OK) {
-		rspamd_fprintf (stderr, "cannot commit transaction: %s\n",
-				sqlite3_errmsg (dest_db));
-		goto err;
+	if (ctx.insert_bands) {
+		sqlite3_finalize (ctx.insert_bands);
 	}
 
-	rspamd_sqlite3_close_prstmt (dest_db, prstmt);
-	sqlite3_close (dest_db);
-	for (i = 0; i < ops->len; i++) {
-		op = g_ptr_array_index (ops, i);
-		g_slice_free1 (sizeof (*op), op);
+	if (ctx.insert_band) {
+		sqlite3_finalize (ctx.insert_band);
+	}
+
+	rspamd_sqlite3_close_prstmt (ctx.dest_db, ctx.prstmt);
+	sqlite3_close (ctx.dest_db);
+	rspamd_mempool_delete (ctx.pool);
+
+	if (failed) {
+		if (!quiet) {
+			rspamd_printf ("Merge failed, rolled back\n");
+		}
+
+		exit (EXIT_FAILURE);
 	}
-	g_ptr_array_free (ops, TRUE);
-	rspamd_mempool_delete (pool);
 
 	if (!quiet) {
+		rspamd_printf ("processed sources: %L new hashes, %L duplicate hashes "
+				"(other sources), %L duplicate hashes (destination), "
+				"%L hashes to update, %L shingles to insert\n\n",
+				nnew, ndup_other, ndup_dst, nupdated, nshingles);
 		rspamd_printf ("Successfully merged data into %s\n%L hashes added, "
 				"%L hashes updated, %L shingles inserted\nhashes count before update: "
 				"%L\nhashes count after update: %L\n",
 				target,
-				inserted, updated, shingles_inserted,
-				old_count, old_count + inserted);
+				ctx.inserted, ctx.updated, ctx.shingles_inserted,
+				old_count, old_count + ctx.inserted);
 	}
 
 	exit (EXIT_SUCCESS);
-
-err:
-	rspamd_sqlite3_run_prstmt (pool,
-		dest_db,
-		prstmt,
-		TRANSACTION_ROLLBACK);
-	rspamd_sqlite3_close_prstmt (dest_db, prstmt);
-	sqlite3_close (dest_db);
-	for (i = 0; i < ops->len; i++) {
-		op = g_ptr_array_index (ops, i);
-		g_slice_free1 (sizeof (*op), op);
-	}
-	g_ptr_array_free (ops, TRUE);
-	rspamd_mempool_delete (pool);
-
-
-	if (!quiet) {
-		rspamd_printf ("Merge failed, rolled back\n");
-	}
-
-	exit (EXIT_FAILURE);
 }
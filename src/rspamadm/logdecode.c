@@ -0,0 +1,194 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "rspamd.h"
+#include "protocol.h"
+#include "addr.h"
+#include "unix-std.h"
+
+static gboolean ucl = FALSE;
+
+static void rspamadm_logdecode (gint argc, gchar **argv);
+static const char *rspamadm_logdecode_help (gboolean full_help);
+
+struct rspamadm_command logdecode_command = {
+		.name = "logdecode",
+		.flags = 0,
+		.help = rspamadm_logdecode_help,
+		.run = rspamadm_logdecode
+};
+
+static GOptionEntry entries[] = {
+		{"ucl", 'u', 0, G_OPTION_ARG_NONE, &ucl,
+				"Output records in UCL format instead of JSON lines", NULL},
+		{NULL,       0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_logdecode_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Decode binary task log written by log_helper\n\n"
+				"Usage: rspamadm logdecode [-u] <file>...\n"
+				"Where options are:\n\n"
+				"-u: output records in UCL format\n"
+				"--help: shows available options and commands\n\n"
+				"Each record is printed as a JSON object on a separate line,\n"
+				"symbols are identified by their ids in the symbols cache";
+	}
+	else {
+		help_str = "Decode binary task log";
+	}
+
+	return help_str;
+}
+
+static ucl_object_t *
+rspamadm_logdecode_record (const struct rspamd_protocol_log_task_record *rec)
+{
+	ucl_object_t *top, *syms;
+	rspamd_inet_addr_t *addr;
+	gchar numbuf[32];
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromdouble (rec->timestamp),
+			"timestamp", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring (
+			rspamd_action_to_str (rec->action)), "action", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (rec->score),
+			"score", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (rec->required_score),
+			"required_score", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (rec->settings_id),
+			"settings_id", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (rec->time_real),
+			"time_real", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (rec->time_virtual),
+			"time_virtual", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (rec->msg_len),
+			"size", 0, false);
+
+	if (rec->af == AF_INET || rec->af == AF_INET6) {
+		addr = rspamd_inet_address_new (rec->af, rec->addr);
+		ucl_object_insert_key (top, ucl_object_fromstring (
+				rspamd_inet_address_to_string (addr)), "ip", 0, false);
+		rspamd_inet_address_destroy (addr);
+	}
+
+	syms = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < rec->nresults; i ++) {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "%d",
+				(gint)rec->results[i].id);
+		ucl_object_insert_key (syms,
+				ucl_object_fromdouble (rec->results[i].score),
+				numbuf, 0, true);
+	}
+
+	ucl_object_insert_key (top, syms, "symbols", 0, false);
+
+	return top;
+}
+
+static gboolean
+rspamadm_logdecode_file (const gchar *fname)
+{
+	const struct rspamd_protocol_log_task_record *rec;
+	ucl_object_t *obj;
+	rspamd_fstring_t *out;
+	guchar *bytes, *p;
+	gsize len, rlen;
+
+	bytes = rspamd_file_xmap (fname, PROT_READ, &len);
+
+	if (bytes == NULL) {
+		fprintf (stderr, "cannot open %s: %s\n", fname, strerror (errno));
+		return FALSE;
+	}
+
+	p = bytes;
+	out = rspamd_fstring_new ();
+
+	while (p + sizeof (*rec) <= bytes + len) {
+		rec = (const struct rspamd_protocol_log_task_record *)p;
+		rlen = sizeof (*rec) +
+				sizeof (struct rspamd_protocol_log_symbol_result) * rec->nresults;
+
+		if (rec->magic != RSPAMD_PROTOCOL_LOG_TASK_MAGIC ||
+				p + rlen > bytes + len) {
+			rspamd_fprintf (stderr, "%s: bad record at offset %z\n", fname,
+					(gsize)(p - bytes));
+			break;
+		}
+
+		obj = rspamadm_logdecode_record (rec);
+		out->len = 0;
+		rspamd_ucl_emit_fstring (obj,
+				ucl ? UCL_EMIT_CONFIG : UCL_EMIT_JSON_COMPACT, &out);
+		rspamd_printf ("%V\n", out);
+		ucl_object_unref (obj);
+		p += rlen;
+	}
+
+	rspamd_fstring_free (out);
+	munmap (bytes, len);
+
+	return p == bytes + len;
+}
+
+static void
+rspamadm_logdecode (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gint i, ret = 0;
+
+	context = g_option_context_new (
+			"logdecode - decode binary task log");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		fprintf (stderr, "no input file specified\n");
+		exit (1);
+	}
+
+	for (i = 1; i < argc; i ++) {
+		if (!rspamadm_logdecode_file (argv[i])) {
+			ret = 1;
+		}
+	}
+
+	g_option_context_free (context);
+
+	if (ret != 0) {
+		exit (ret);
+	}
+}
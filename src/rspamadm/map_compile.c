@@ -0,0 +1,137 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "rspamd.h"
+#include "map.h"
+#include "radix.h"
+#include "unix-std.h"
+
+static gchar *output = NULL;
+
+static void rspamadm_mapcompile (gint argc, gchar **argv);
+static const char *rspamadm_mapcompile_help (gboolean full_help);
+
+struct rspamadm_command mapcompile_command = {
+		.name = "mapcompile",
+		.flags = 0,
+		.help = rspamadm_mapcompile_help,
+		.run = rspamadm_mapcompile
+};
+
+static GOptionEntry entries[] = {
+		{"output", 'o', 0, G_OPTION_ARG_STRING, &output,
+				"Output file for the compiled map", NULL},
+		{NULL,       0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_mapcompile_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile radix (IP) map to a binary image\n\n"
+				"Usage: rspamadm mapcompile -o <output> <map>\n"
+				"Where options are:\n\n"
+				"-o: output file, by default <map>.bin\n"
+				"--help: shows available options and commands\n\n"
+				"Compiled maps are detected automatically and mapped to\n"
+				"memory on load without parsing";
+	}
+	else {
+		help_str = "Compile radix map to a binary image";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_mapcompile (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct map_cb_data cbdata;
+	rspamd_mempool_t *pool;
+	guchar *bytes;
+	gsize len;
+	gchar *outpath;
+	gint ret = 0;
+
+	context = g_option_context_new (
+			"mapcompile - compile radix map to a binary image");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		fprintf (stderr, "no input map specified\n");
+		exit (1);
+	}
+
+	bytes = rspamd_file_xmap (argv[1], PROT_READ, &len);
+
+	if (bytes == NULL) {
+		fprintf (stderr, "cannot open %s: %s\n", argv[1], strerror (errno));
+		exit (1);
+	}
+
+	if (output) {
+		outpath = g_strdup (output);
+	}
+	else {
+		outpath = g_strdup_printf ("%s.bin", argv[1]);
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "mapcompile");
+	memset (&cbdata, 0, sizeof (cbdata));
+
+	if (len > 0) {
+		rspamd_radix_read (pool, (gchar *)bytes, len, &cbdata, TRUE);
+	}
+	else {
+		cbdata.cur_data = radix_create_compressed ();
+	}
+
+	if (!radix_compressed_save (cbdata.cur_data, outpath, &error)) {
+		fprintf (stderr, "cannot compile %s: %s\n", argv[1], error->message);
+		g_error_free (error);
+		ret = 1;
+	}
+	else {
+		rspamd_printf ("compiled %z prefixes from %s to %s\n",
+				radix_get_size (cbdata.cur_data), argv[1], outpath);
+	}
+
+	radix_destroy_compressed (cbdata.cur_data);
+	munmap (bytes, len);
+	rspamd_mempool_delete (pool);
+	g_free (outpath);
+	g_option_context_free (context);
+
+	if (ret != 0) {
+		exit (ret);
+	}
+}
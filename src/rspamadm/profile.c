@@ -0,0 +1,655 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "cfg_rcl.h"
+#include "rspamd.h"
+#include "task.h"
+#include "dns.h"
+#include "re_cache.h"
+#include "symbols_cache.h"
+#include "lua/lua_common.h"
+#include <event.h>
+
+static gchar *config = NULL;
+static gint iterations = 10;
+static gchar *ip = NULL;
+static gboolean synthetic_dns = FALSE;
+static gint nsymbols = 20;
+static gint nclasses = 10;
+static gboolean json = FALSE;
+extern struct rspamd_main *rspamd_main;
+/* Defined in modules.c */
+extern module_t *modules[];
+extern worker_t *workers[];
+
+static void rspamadm_profile (gint argc, gchar **argv);
+static const char *rspamadm_profile_help (gboolean full_help);
+
+struct rspamadm_command profile_command = {
+		.name = "profile",
+		.flags = 0,
+		.help = rspamadm_profile_help,
+		.run = rspamadm_profile
+};
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+				"Config file to use", NULL},
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+				"Scan message the specified number of times (10 by default)", NULL},
+		{"ip", 'i', 0, G_OPTION_ARG_STRING, &ip,
+				"Sender IP address", NULL},
+		{"synthetic-dns", 0, 0, G_OPTION_ARG_NONE, &synthetic_dns,
+				"Reply NXDOMAIN to all DNS requests without network", NULL},
+		{"symbols", 's', 0, G_OPTION_ARG_INT, &nsymbols,
+				"Number of the most expensive symbols to show (20 by default)", NULL},
+		{"classes", 'r', 0, G_OPTION_ARG_INT, &nclasses,
+				"Number of the most expensive regexp classes to show (10 by default)",
+				NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output json", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const gchar *stage_names[RSPAMD_TASK_STAGES_COUNT] = {
+		"connect",
+		"envelope",
+		"read_message",
+		"pre_filters",
+		"filters",
+		"classifiers_pre",
+		"classifiers",
+		"classifiers_post",
+		"composites",
+		"post_filters",
+		"learn_pre",
+		"learn",
+		"learn_post",
+		"done",
+		"replied"
+};
+
+struct rspamadm_profile_entry {
+	gchar *name;
+	gdouble time;
+	gdouble lua_cpu;
+	gint64 calls;
+	gint64 hits;
+	gint64 bytes;
+};
+
+static const char *
+rspamadm_profile_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Scan message in process and report where time is spent\n\n"
+				"Usage: rspamadm profile [-c config] [-n iterations] "
+				"[--synthetic-dns] message\n"
+				"Where options are:\n\n"
+				"-c: config file to use\n"
+				"-n: scan message the specified number of times (10 by default)\n"
+				"-i: sender IP address\n"
+				"--synthetic-dns: reply NXDOMAIN to all DNS requests without network\n"
+				"-s: number of the most expensive symbols to show (20 by default)\n"
+				"-r: number of the most expensive regexp classes to show "
+				"(10 by default)\n"
+				"-j: output json\n"
+				"--help: shows available options and commands";
+	}
+	else {
+		help_str = "Scan message in process and report where time is spent";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = G_LOG_LEVEL_WARNING;
+
+	rspamd_set_logger (rm->cfg, g_quark_from_static_string ("profile"), rm);
+
+	if (rspamd_log_open_priv (rm->logger, rm->workers_uid, rm->workers_gid) ==
+			-1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static struct rspamd_config *
+rspamadm_profile_load_config (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	const gchar *confdir;
+	worker_t **pworker;
+
+	if (config == NULL) {
+		if ((confdir = g_hash_table_lookup (ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		config = g_strdup_printf ("%s%c%s", confdir, G_DIR_SEPARATOR,
+				"rspamd.conf");
+	}
+
+	pworker = &workers[0];
+
+	while (*pworker) {
+		/* Init string quarks */
+		(void) g_quark_from_static_string ((*pworker)->name);
+		pworker++;
+	}
+
+	cfg->cache = rspamd_symbols_cache_new (cfg);
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
+			config_logger, rspamd_main, ucl_vars)) {
+		return NULL;
+	}
+
+	rspamd_lua_post_load_config (cfg);
+
+	if (!rspamd_init_filters (cfg, FALSE) ||
+			!rspamd_config_post_load (cfg, FALSE)) {
+		return NULL;
+	}
+
+	if (!rspamd_symbols_cache_validate (cfg->cache, cfg, FALSE)) {
+		return NULL;
+	}
+
+#ifdef WITH_HYPERSCAN
+	/* Use the same databases as workers if they are compiled */
+	if (!rspamd_re_cache_load_hyperscan (cfg->re_cache,
+			cfg->hs_cache_dir ? cfg->hs_cache_dir : RSPAMD_DBDIR "/")) {
+		rspamd_fprintf (stderr, "hyperscan databases are not loaded, "
+				"regexps are checked by PCRE\n");
+	}
+#endif
+
+	/* Measure all lua callbacks */
+	cfg->lua_profile_rate = 1.0;
+
+	return cfg;
+}
+
+static gboolean
+rspamadm_profile_fin (struct rspamd_task *task, void *ud)
+{
+	/* Nothing to reply */
+	return TRUE;
+}
+
+static gint
+rspamadm_profile_entry_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamadm_profile_entry *e1 = *(const struct rspamadm_profile_entry **)a,
+			*e2 = *(const struct rspamadm_profile_entry **)b;
+
+	if (e1->time > e2->time) {
+		return -1;
+	}
+	else if (e1->time < e2->time) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamadm_profile_entry_free (gpointer p)
+{
+	struct rspamadm_profile_entry *e = p;
+
+	g_free (e->name);
+	g_free (e);
+}
+
+/* Symbols sorted by time, time is in microseconds */
+static GPtrArray *
+rspamadm_profile_symbols (struct rspamd_config *cfg, gdouble *lua_cpu)
+{
+	GPtrArray *res;
+	ucl_object_t *top;
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	struct rspamadm_profile_entry *e;
+
+	res = g_ptr_array_new_with_free_func (rspamadm_profile_entry_free);
+	top = rspamd_symbols_cache_local_counters (cfg->cache);
+	*lua_cpu = 0;
+
+	while ((cur = ucl_object_iterate (top, &it, true)) != NULL) {
+		e = g_malloc0 (sizeof (*e));
+		e->name = g_strdup (ucl_object_tostring (
+				ucl_object_lookup (cur, "symbol")));
+
+		if ((elt = ucl_object_lookup (cur, "calls")) != NULL) {
+			e->calls = ucl_object_toint (elt);
+		}
+		if ((elt = ucl_object_lookup (cur, "hits")) != NULL) {
+			e->hits = ucl_object_toint (elt);
+		}
+		if ((elt = ucl_object_lookup (cur, "time")) != NULL) {
+			e->time = ucl_object_todouble (elt);
+		}
+		if ((elt = ucl_object_lookup (cur, "lua_cpu")) != NULL) {
+			e->lua_cpu = ucl_object_todouble (elt);
+			*lua_cpu += e->lua_cpu;
+		}
+
+		g_ptr_array_add (res, e);
+	}
+
+	ucl_object_unref (top);
+	g_ptr_array_sort (res, rspamadm_profile_entry_cmp);
+
+	return res;
+}
+
+static void
+rspamadm_profile_re_account (GHashTable *tbl, GPtrArray *res,
+		const ucl_object_t *cur, const gchar *scans_key)
+{
+	const ucl_object_t *elt;
+	const gchar *type, *hdr = NULL;
+	struct rspamadm_profile_entry *e;
+	gchar *name;
+
+	elt = ucl_object_lookup (cur, "type");
+	type = elt ? ucl_object_tostring (elt) : "unknown";
+
+	if ((elt = ucl_object_lookup (cur, "header")) != NULL) {
+		hdr = ucl_object_tostring (elt);
+	}
+
+	name = hdr ? g_strdup_printf ("%s(%s)", type, hdr) : g_strdup (type);
+	e = g_hash_table_lookup (tbl, name);
+
+	if (e == NULL) {
+		e = g_malloc0 (sizeof (*e));
+		e->name = name;
+		g_hash_table_insert (tbl, e->name, e);
+		g_ptr_array_add (res, e);
+	}
+	else {
+		g_free (name);
+	}
+
+	if ((elt = ucl_object_lookup (cur, scans_key)) != NULL) {
+		e->calls += ucl_object_toint (elt);
+	}
+	if ((elt = ucl_object_lookup (cur, "bytes")) != NULL) {
+		e->bytes += ucl_object_toint (elt);
+	}
+	if ((elt = ucl_object_lookup (cur, "time")) != NULL) {
+		e->time += ucl_object_todouble (elt);
+	}
+}
+
+/*
+ * Regexp classes sorted by time in seconds: hyperscan time is accounted per
+ * class, PCRE time is accounted per regexp, so both are summed here
+ */
+static GPtrArray *
+rspamadm_profile_re_classes (struct rspamd_config *cfg)
+{
+	GPtrArray *res;
+	GHashTable *tbl;
+	ucl_object_t *top;
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+
+	res = g_ptr_array_new_with_free_func (rspamadm_profile_entry_free);
+
+	if (cfg->re_cache == NULL) {
+		return res;
+	}
+
+	tbl = g_hash_table_new (g_str_hash, g_str_equal);
+	top = rspamd_re_cache_profile (cfg->re_cache);
+
+	while ((cur = ucl_object_iterate (ucl_object_lookup (top, "classes"),
+			&it, true)) != NULL) {
+		rspamadm_profile_re_account (tbl, res, cur, "scans");
+	}
+
+	it = NULL;
+
+	while ((cur = ucl_object_iterate (ucl_object_lookup (top, "regexps"),
+			&it, true)) != NULL) {
+		rspamadm_profile_re_account (tbl, res, cur, "checks");
+	}
+
+	ucl_object_unref (top);
+	g_hash_table_unref (tbl);
+	g_ptr_array_sort (res, rspamadm_profile_entry_cmp);
+
+	return res;
+}
+
+static void
+rspamadm_profile (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_config *cfg;
+	struct rspamd_task *task;
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_task_profile profile;
+	struct metric_result *mres;
+	struct rspamadm_profile_entry *e;
+	struct event_base *ev_base;
+	GPtrArray *symbols, *classes;
+	ucl_object_t *top, *obj, *elt;
+	const gchar *action = "no action";
+	gchar *message = NULL, *out;
+	gsize mlen;
+	gdouble t1, v1, wall = 0, cpu = 0, min_wall = 0, max_wall = 0, diff,
+			lua_cpu, score = 0, mime;
+	guint64 dns_requests = 0;
+	gint i;
+
+	context = g_option_context_new (
+			"profile - scan message in process and report where time is spent");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2) {
+		rspamd_fprintf (stderr, "no message specified\n");
+		exit (1);
+	}
+
+	if (iterations <= 0) {
+		iterations = 1;
+	}
+
+	if (!g_file_get_contents (argv[1], &message, &mlen, &error)) {
+		rspamd_fprintf (stderr, "cannot read %s: %s\n", argv[1],
+				error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	cfg = rspamadm_profile_load_config ();
+
+	if (cfg == NULL) {
+		rspamd_fprintf (stderr, "cannot load config %s\n", config);
+		exit (1);
+	}
+
+	ev_base = event_init ();
+	resolver = dns_resolver_init (rspamd_main->logger, ev_base, cfg);
+
+	if (synthetic_dns) {
+		rspamd_dns_resolver_set_synthetic (resolver);
+	}
+
+	/* Profile is shared by all scans, so it holds their sums */
+	memset (&profile, 0, sizeof (profile));
+
+	for (i = 0; i < iterations; i ++) {
+		task = rspamd_task_new (NULL, cfg);
+		task->ev_base = ev_base;
+		task->resolver = resolver;
+		task->profile = &profile;
+		task->fin_callback = rspamadm_profile_fin;
+		task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+				rspamd_task_restore, (event_finalizer_t)rspamd_task_free, task);
+
+		if (ip && !rspamd_parse_inet_address (&task->from_addr, ip,
+				strlen (ip))) {
+			rspamd_fprintf (stderr, "invalid ip address: %s\n", ip);
+			exit (1);
+		}
+
+		t1 = rspamd_get_ticks ();
+		v1 = rspamd_get_virtual_ticks ();
+
+		if (!rspamd_task_load_message (task, NULL, message, mlen)) {
+			rspamd_fprintf (stderr, "cannot load message: %e\n", task->err);
+			exit (1);
+		}
+
+		if (rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL)) {
+			/* Resolver keeps its own events, so loop cannot just exit */
+			while (!RSPAMD_TASK_IS_PROCESSED (task)) {
+				event_base_loop (ev_base, EVLOOP_ONCE);
+			}
+		}
+
+		diff = rspamd_get_ticks () - t1;
+		cpu += rspamd_get_virtual_ticks () - v1;
+		wall += diff;
+
+		if (i == 0 || diff < min_wall) {
+			min_wall = diff;
+		}
+		if (diff > max_wall) {
+			max_wall = diff;
+		}
+
+		dns_requests += task->dns_requests;
+		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+		if (mres) {
+			score = mres->score;
+			action = rspamd_action_to_str (rspamd_check_action_metric (task,
+					mres));
+		}
+
+		rspamd_session_destroy (task->s);
+	}
+
+	symbols = rspamadm_profile_symbols (cfg, &lua_cpu);
+	classes = rspamadm_profile_re_classes (cfg);
+	/* Parsing of mime structure includes html and urls */
+	mime = profile.stages[2] - profile.html - profile.urls;
+
+	/* All times below are in milliseconds per scan unless specified */
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromstring (argv[1]), "message",
+			0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (mlen), "size", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (iterations), "iterations",
+			0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (score), "score",
+			0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring (action), "action",
+			0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (wall * 1000.0 / iterations), "mean", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (min_wall * 1000.0),
+			"min", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (max_wall * 1000.0),
+			"max", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (cpu * 1000.0 / iterations), "cpu", 0, false);
+	ucl_object_insert_key (top, obj, "time", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+		if (profile.stages[i] > 0) {
+			ucl_object_insert_key (obj,
+					ucl_object_fromdouble (profile.stages[i] * 1000.0 / iterations),
+					stage_names[i], 0, false);
+		}
+	}
+
+	ucl_object_insert_key (top, obj, "stages", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (mime * 1000.0 / iterations), "mime", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (profile.html * 1000.0 / iterations), "html",
+			0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (profile.urls * 1000.0 / iterations), "urls",
+			0, false);
+	ucl_object_insert_key (top, obj, "parsing", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble ((gdouble)dns_requests / iterations),
+			"requests", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble ((gdouble)resolver->replies / iterations),
+			"replies", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (resolver->wait_time * 1000.0 / iterations),
+			"wait", 0, false);
+	ucl_object_insert_key (obj, ucl_object_frombool (synthetic_dns),
+			"synthetic", 0, false);
+	ucl_object_insert_key (top, obj, "dns", 0, false);
+
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (lua_cpu * 1000.0 / iterations), "lua",
+			0, false);
+
+	obj = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < (gint)classes->len && i < nclasses; i ++) {
+		e = g_ptr_array_index (classes, i);
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromstring (e->name),
+				"class", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (e->time * 1000.0 / iterations),
+				"time", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (e->calls / iterations),
+				"scans", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (e->bytes / iterations),
+				"bytes", 0, false);
+		ucl_array_append (obj, elt);
+	}
+
+	ucl_object_insert_key (top, obj, "re_cache", 0, false);
+
+	/* Symbols times are in microseconds as in other symbols reports */
+	obj = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < (gint)symbols->len && i < nsymbols; i ++) {
+		e = g_ptr_array_index (symbols, i);
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromstring (e->name),
+				"symbol", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (e->time / iterations), "time", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (e->lua_cpu * 1e6 / iterations), "lua",
+				0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (e->calls), "calls",
+				0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (e->hits), "hits",
+				0, false);
+		ucl_array_append (obj, elt);
+	}
+
+	ucl_object_insert_key (top, obj, "symbols", 0, false);
+
+	if (json) {
+		out = ucl_object_emit (top, UCL_EMIT_JSON);
+		rspamd_printf ("%s\n", out);
+		free (out);
+	}
+	else {
+		rspamd_printf ("Message: %s (%z bytes), %d scans, action: %s, "
+				"score: %.2f\n", argv[1], mlen, iterations, action, score);
+		rspamd_printf ("Scan time (ms): mean %.3f, min %.3f, max %.3f, "
+				"cpu %.3f\n", wall * 1000.0 / iterations, min_wall * 1000.0,
+				max_wall * 1000.0, cpu * 1000.0 / iterations);
+		rspamd_printf ("\nStages (ms per scan, DNS waits excluded):\n");
+
+		for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+			if (profile.stages[i] > 0) {
+				printf ("  %-20s %10.3f\n", stage_names[i],
+						profile.stages[i] * 1000.0 / iterations);
+			}
+		}
+
+		printf ("    %-18s %10.3f\n", "mime", mime * 1000.0 / iterations);
+		printf ("    %-18s %10.3f\n", "html",
+				profile.html * 1000.0 / iterations);
+		printf ("    %-18s %10.3f\n", "urls",
+				profile.urls * 1000.0 / iterations);
+		rspamd_printf ("\nLua callbacks: %.3f ms per scan\n",
+				lua_cpu * 1000.0 / iterations);
+		rspamd_printf ("DNS%s: %.1f requests, %.1f replies, %.3f ms waited "
+				"per scan\n",
+				synthetic_dns ? " (synthetic)" : "",
+				(gdouble)dns_requests / iterations,
+				(gdouble)resolver->replies / iterations,
+				resolver->wait_time * 1000.0 / iterations);
+
+		if (classes->len > 0) {
+			rspamd_printf ("\nRegexp classes (per scan):\n");
+			printf ("%-40s %10s %10s %12s\n", "Class", "Time, ms", "Scans",
+					"Bytes");
+
+			for (i = 0; i < (gint)classes->len && i < nclasses; i ++) {
+				e = g_ptr_array_index (classes, i);
+				printf ("%-40s %10.3f %10" G_GINT64_FORMAT " %12"
+						G_GINT64_FORMAT "\n",
+						e->name, e->time * 1000.0 / iterations,
+						e->calls / iterations, e->bytes / iterations);
+			}
+		}
+
+		if (symbols->len > 0) {
+			rspamd_printf ("\nSymbols by time (microseconds per scan):\n");
+			printf ("%-32s %10s %10s %10s %10s\n", "Symbol", "Time", "Lua",
+					"Calls", "Hits");
+
+			for (i = 0; i < (gint)symbols->len && i < nsymbols; i ++) {
+				e = g_ptr_array_index (symbols, i);
+				printf ("%-32s %10.1f %10.1f %10" G_GINT64_FORMAT " %10"
+						G_GINT64_FORMAT "\n",
+						e->name, e->time / iterations,
+						e->lua_cpu * 1e6 / iterations, e->calls, e->hits);
+			}
+		}
+	}
+
+	ucl_object_unref (top);
+	g_ptr_array_free (symbols, TRUE);
+	g_ptr_array_free (classes, TRUE);
+	g_free (message);
+}
@@ -24,6 +24,7 @@ static gchar *symbol = NULL;
 static gchar *cache_db = NULL;
 static gchar *redis_db = NULL;
 static gchar *redis_password = NULL;
+static gint batch_size = 0;
 
 static void rspamadm_statconvert (gint argc, gchar **argv);
 static const char *rspamadm_statconvert_help (gboolean full_help);
@@ -48,6 +49,8 @@ static GOptionEntry entries[] = {
 				"Database in redis (should be numeric)", NULL},
 		{"password", 'p', 0, G_OPTION_ARG_STRING, &redis_password,
 				"Password to connect to redis", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch_size,
+				"Number of commands pipelined to redis at once (1000 by default)", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -66,7 +69,8 @@ rspamadm_statconvert_help (gboolean full_help)
 				"-s: symbol in redis (e.g. BAYES_SPAM)\n"
 				"-c: also convert data from the learn cache\n"
 				"-D: output redis database\n"
-				"-p: redis password\n";
+				"-p: redis password\n"
+				"-b: number of commands pipelined to redis at once\n";
 	}
 	else {
 		help_str = "Convert statistics from sqlite3 to redis";
@@ -137,12 +141,17 @@ rspamadm_statconvert (gint argc, gchar **argv)
 				"redis_db", 0, false);
 	}
 
+	if (batch_size > 0) {
+		ucl_object_insert_key (obj, ucl_object_fromint (batch_size),
+				"batch", 0, false);
+	}
+
 	rspamadm_execute_lua_ucl_subr (L,
 			argc,
 			argv,
 			obj,
 			rspamadm_script_stat_convert);
 
-	lua_close (L);
+	rspamd_lua_close (L);
 	ucl_object_unref (obj);
 }
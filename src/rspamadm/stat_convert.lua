@@ -2,15 +2,18 @@ local sqlite3 = require "rspamd_sqlite3"
 local redis = require "rspamd_redis"
 local util = require "rspamd_util"
 
-local function send_redis(server, symbol, tokens, password, db)
-  local ret = true
+-- Commands sent to redis in a single pipeline (each reply takes lua stack)
+local default_batch = 1000
+local max_batch = 3000
+
+local function connect_redis(server, password, db)
   local conn,err = redis.connect_sync({
     host = server,
   })
 
   if not conn then
     print('Cannot connect to ' .. server .. ' error: ' .. err)
-    return false
+    return nil
   end
 
   if password then
@@ -20,46 +23,67 @@ local function send_redis(server, symbol, tokens, password, db)
     conn:add_cmd('SELECT', {db})
   end
 
-  for _,t in ipairs(tokens) do
-    if not conn:add_cmd('HINCRBY', {symbol .. t[3], t[1], t[2]}) then
-      ret = false
+  return conn
+end
+
+-- Executes pending pipeline and checks all replies
+local function flush_redis(conn)
+  local replies = {conn:exec()}
+
+  for i = 1,#replies,2 do
+    if not replies[i] then
+      print('Redis error: ' .. tostring(replies[i + 1]))
+      return false
     end
   end
 
-  if ret then
-    ret = conn:exec()
+  return true
+end
+
+local function print_progress(what, done, total, start)
+  local elapsed = util.get_ticks() - start
+  local rate = 0
+
+  if elapsed > 0 then
+    rate = done / elapsed
   end
 
-  return ret
+  if total > 0 then
+    print(string.format('%s: %d of %d (%.1f%%), %.0f per second',
+      what, done, total, done * 100.0 / total, rate))
+  else
+    print(string.format('%s: %d, %.0f per second', what, done, rate))
+  end
+end
+
+local function count_rows(db, tbl)
+  for row in db:rows('SELECT count(*) AS cnt FROM ' .. tbl .. ';') do
+    return tonumber(row.cnt) or 0
+  end
+
+  return 0
 end
 
-local function convert_learned(cache, server, password, db)
+local function convert_learned(cache, server, password, redis_db, batch)
   local converted = 0
+  local pending = 0
   local db = sqlite3.open(cache)
-  local ret = true
 
   if not db then
     print('Cannot open cache database: ' .. cache)
     return false
   end
 
-  db:sql('BEGIN;')
-
-  local conn,err = redis.connect_sync({
-    host = server,
-  })
+  local conn = connect_redis(server, password, redis_db)
 
   if not conn then
-    print('Cannot connect to ' .. server .. ' error: ' .. err)
     return false
   end
 
-  if password then
-    conn:add_cmd('AUTH', {password})
-  end
-  if db then
-    conn:add_cmd('SELECT', {db})
-  end
+  local total = count_rows(db, 'learns')
+  local start = util.get_ticks()
+
+  db:sql('BEGIN;')
 
   for row in db:rows('SELECT * FROM learns;') do
     local is_spam
@@ -73,42 +97,59 @@ local function convert_learned(cache, server, password, db)
 
     if not conn:add_cmd('HSET', {'learned_ids', digest, is_spam}) then
       print('Cannot add hash: ' .. digest)
-      ret = false
-    else
-      converted = converted + 1
+      db:sql('COMMIT;')
+      return false
     end
-  end
-  db:sql('COMMIT;')
 
-  if ret then
-    ret = conn:exec()
+    pending = pending + 1
+    converted = converted + 1
+
+    if pending >= batch then
+      if not flush_redis(conn) then
+        db:sql('COMMIT;')
+        return false
+      end
+
+      pending = 0
+
+      if converted % (batch * 100) == 0 then
+        print_progress('Learned cache', converted, total, start)
+      end
+    end
   end
+  db:sql('COMMIT;')
 
-  if ret then
-    print(string.format('Converted %d cached items from sqlite3 learned cache to redis',
-      converted))
-  else
+  if not flush_redis(conn) then
     print('Error occurred during sending data to redis')
+    return false
   end
 
-  return ret
+  print(string.format('Converted %d cached items from sqlite3 learned cache to redis',
+    converted))
+
+  return true
 end
 
 return function (args, res)
   local db = sqlite3.open(res['source_db'])
-  local tokens = {}
   local num = 0
   local total = 0
   local nusers = 0
-  local lim = 1000 -- Update each 1000 tokens
   local users_map = {}
   local learns = {}
   local redis_password = res['redis_password']
   local redis_db = res['redis_db']
-  local ret = false
+  local batch = tonumber(res['batch']) or default_batch
+
+  if batch <= 0 then
+    batch = default_batch
+  elseif batch > max_batch then
+    batch = max_batch
+  end
 
   if res['cache_db'] then
-    if not convert_learned(res['cache_db'], res['redis_host']) then
+    if not convert_learned(res['cache_db'], res['redis_host'],
+        redis_password, redis_db, batch) then
       print('Cannot convert learned cache to redis')
       return
     end
@@ -119,6 +160,16 @@ return function (args, res)
     return
   end
 
+  -- The same connection is used for all pipelines
+  local conn = connect_redis(res['redis_host'], redis_password, redis_db)
+
+  if not conn then
+    return
+  end
+
+  local ntokens = count_rows(db, 'tokens')
+  local start = util.get_ticks()
+
   db:sql('BEGIN;')
   -- Fill users mapping
   for row in db:rows('SELECT * FROM users;') do
@@ -140,64 +191,54 @@ return function (args, res)
     end
   end
 
-  -- Fill tokens, sending data to redis each `lim` records
+  -- Stream tokens, sending pipeline to redis each `batch` records
   for row in db:rows('SELECT token,value,user FROM tokens;') do
     local user = ''
     if row.user ~= 0 and users_map[row.user] then
       user = users_map[row.user]
     end
 
-    table.insert(tokens, {row.token, row.value, user})
+    if not conn:add_cmd('HINCRBY', {res['symbol'] .. user, row.token, row.value}) then
+      print('Cannot send tokens to the redis server')
+      db:sql('COMMIT;')
+      return
+    end
 
     num = num + 1
     total = total + 1
-    if num > lim then
-      if not send_redis(res['redis_host'], res['symbol'],
-        tokens, redis_password, redis_db) then
 
+    if num >= batch then
+      if not flush_redis(conn) then
         print('Cannot send tokens to the redis server')
+        db:sql('COMMIT;')
         return
       end
 
       num = 0
-      tokens = {}
+
+      if total % (batch * 100) == 0 then
+        print_progress('Tokens', total, ntokens, start)
+      end
     end
   end
-  if #tokens > 0 and
-    not send_redis(res['redis_host'], res['symbol'], tokens,
-      redis_password, redis_db) then
 
+  if not flush_redis(conn) then
     print('Cannot send tokens to the redis server')
+    db:sql('COMMIT;')
     return
   end
-  -- Now update all users
-  local conn,err = redis.connect_sync({
-    host = res['redis_host'],
-  })
-
-  if not conn then
-    print('Cannot connect to ' .. res['redis_host'] .. ' error: ' .. err)
-    return false
-  end
-
-  if redis_password then
-    conn:add_cmd('AUTH', {redis_password})
-  end
-  if redis_db then
-    conn:add_cmd('SELECT', {redis_db})
-  end
 
+  -- Now update all users
   for id,learned in pairs(learns) do
-    local user = users_map[id]
+    local user = users_map[id] or ''
     if not conn:add_cmd('HINCRBY', {res['symbol'] .. user, 'learns', learned}) then
       print('Cannot update learns for user: ' .. user)
     end
   end
   db:sql('COMMIT;')
 
-  ret = conn:exec()
-
-  if ret then
+  if flush_redis(conn) then
+    print_progress('Tokens', total, ntokens, start)
     print(string.format('Migrated %d tokens for %d users for symbol %s',
      total, nusers, res['symbol']))
   else
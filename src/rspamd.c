@@ -89,6 +89,7 @@ static gboolean is_debug = FALSE;
 static gboolean is_insecure = FALSE;
 static gboolean gen_keypair = FALSE;
 static gboolean encrypt_password = FALSE;
+static gchar *config_snapshot = NULL;
 static GHashTable *ucl_vars = NULL;
 
 static guint term_attempts = 0;
@@ -96,6 +97,11 @@ static guint term_attempts = 0;
 /* List of unrelated forked processes */
 static GArray *other_workers = NULL;
 
+/* Pending retirement of the previous workers generation */
+static struct event reload_ev;
+static gboolean reload_pending = FALSE;
+static gdouble reload_start = 0;
+
 /* List of active listen sockets indexed by worker type */
 static GHashTable *listen_sockets = NULL;
 
@@ -134,6 +140,9 @@ static GOptionEntry entries[] =
 	  "keypair", NULL},
 	{ "encrypt-password", 0, 0, G_OPTION_ARG_NONE, &encrypt_password, "Encrypt "
 	  "controller password to store in the configuration file", NULL },
+	{ "config-snapshot", 0, 0, G_OPTION_ARG_FILENAME, &config_snapshot,
+	  "Reuse parsed config tree from this file if config files are not "
+	  "changed", NULL },
 	{ "version", 'v', 0, G_OPTION_ARG_NONE, &show_version,
 	  "Show version and exit", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
@@ -288,6 +297,14 @@ reread_config (struct rspamd_main *rspamd_main)
 	}
 	else {
 		msg_debug_main ("replacing config");
+
+		/* Caches of the old config are transferred to the new workers */
+		if (rspamd_main->cfg->caches_file) {
+			rspamd_config_save_caches (rspamd_main->cfg,
+					rspamd_main->cfg->caches_file);
+		}
+
+		rspamd_upstreams_probe_stop (rspamd_main->cfg->ups_ctx);
 		REF_RELEASE (rspamd_main->cfg);
 
 		rspamd_main->cfg = tmp_cfg;
@@ -298,6 +315,17 @@ reread_config (struct rspamd_main *rspamd_main)
 		}
 
 		rspamd_init_filters (rspamd_main->cfg, TRUE);
+
+		if (rspamd_main->cfg->caches_file) {
+			rspamd_config_load_caches (rspamd_main->cfg,
+					rspamd_main->cfg->caches_file);
+		}
+
+		/* Workers of the new configuration are forked after this */
+		rspamd_upstreams_probe_start (rspamd_main->cfg->ups_ctx,
+				rspamd_main->ev_base,
+				rspamd_main->cfg->upstream_probe_interval);
+
 		msg_info_main ("config has been reread successfully");
 	}
 }
@@ -339,22 +367,42 @@ rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 	event_add (&nw->wait_ev, &tv);
 }
 
+/*
+ * Addresses that cannot be bound are reported one by one, `deferred` is set
+ * if some addresses are left to be bound by workers themselves
+ */
 static GList *
-create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type)
+create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type,
+		gboolean reuseport, gboolean *deferred)
 {
 	GList *result = NULL;
+	rspamd_inet_addr_t *addr;
 	gint fd;
 	guint i;
 	gpointer p;
 
+	*deferred = FALSE;
 	g_ptr_array_sort (addrs, rspamd_inet_address_compare_ptr);
 	for (i = 0; i < cnt; i ++) {
-		fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-				listen_type, TRUE);
+		addr = g_ptr_array_index (addrs, i);
+
+		if (reuseport && rspamd_inet_address_get_af (addr) != AF_UNIX) {
+			/* Each worker binds its own socket for this address */
+			*deferred = TRUE;
+			continue;
+		}
+
+		fd = rspamd_inet_address_listen (addr, listen_type, TRUE);
 		if (fd != -1) {
 			p = GINT_TO_POINTER (fd);
 			result = g_list_prepend (result, p);
 		}
+		else {
+			msg_err ("cannot listen on %s:%d: %s",
+					rspamd_inet_address_to_string (addr),
+					(gint)rspamd_inet_address_get_port (addr),
+					strerror (errno));
+		}
 	}
 
 	return result;
@@ -467,11 +515,16 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 	gpointer p;
 	guintptr key;
 	struct rspamd_worker_bind_conf *bcf;
-	gboolean listen_ok = FALSE;
+	gboolean listen_ok = FALSE, deferred;
 	GPtrArray *seen_mandatory_workers;
 	worker_t **cw, *wrk;
 	guint i;
 
+	if (rspamd_main->cfg->preload_maps) {
+		/* Maps are then shared by all workers until they are reread */
+		rspamd_map_preload (rspamd_main->cfg);
+	}
+
 	/* Special hack for hs_helper if it's not defined in a config */
 	seen_mandatory_workers = g_ptr_array_new ();
 	cur = rspamd_main->cfg->workers;
@@ -488,7 +541,11 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 				g_ptr_array_add (seen_mandatory_workers, cf->worker);
 			}
 			if (cf->worker->flags & RSPAMD_WORKER_HAS_SOCKET) {
+				/* Each bind line must provide at least one socket */
+				listen_ok = cf->bind_conf != NULL;
+
 				LL_FOREACH (cf->bind_conf, bcf) {
+					deferred = FALSE;
 					key = make_listen_key (bcf);
 					if ((p =
 						g_hash_table_lookup (listen_sockets,
@@ -497,27 +554,28 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, cf->reuseport,
+									&deferred);
 						}
 						else {
 							ls = systemd_get_socket (rspamd_main, bcf->cnt);
 						}
 
-						if (ls == NULL) {
+						/* With reuseport workers bind inet addresses themselves */
+						if (ls == NULL && !deferred) {
 							msg_err_main ("cannot listen on %s socket %s: %s",
 								bcf->is_systemd ? "systemd" : "normal",
 								bcf->name,
 								strerror (errno));
+							listen_ok = FALSE;
 						}
-						else {
+						else if (ls != NULL) {
 							g_hash_table_insert (listen_sockets, (gpointer)key, ls);
-							listen_ok = TRUE;
 						}
 					}
 					else {
 						/* We had socket for this type of worker */
 						ls = p;
-						listen_ok = TRUE;
 					}
 					/* Do not add existing lists as it causes loops */
 					if (g_list_position (cf->listen_socks, ls) == -1) {
@@ -528,8 +586,8 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 					spawn_worker_type (rspamd_main, ev_base, cf);
 				}
 				else {
-					msg_err_main ("cannot create listen socket for %s at %s",
-							g_quark_to_string (cf->type), cf->bind_conf->name);
+					msg_err_main ("cannot create listen sockets for %s",
+							g_quark_to_string (cf->type));
 
 					exit (EXIT_FAILURE);
 				}
@@ -582,16 +640,67 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 }
 
 static void
-kill_old_workers (gpointer key, gpointer value, gpointer unused)
+kill_old_workers (gpointer key, gpointer value, gpointer ud)
 {
 	struct rspamd_worker *w = value;
 	struct rspamd_main *rspamd_main;
+	gboolean all = GPOINTER_TO_INT (ud);
 
 	rspamd_main = w->srv;
+
+	if (w->generation == rspamd_main->generation || w->retiring) {
+		return;
+	}
+
+	if (!all && (w->cf->worker->flags & RSPAMD_WORKER_NOTIFY_READY)) {
+		/* Keep scanning until new workers of this kind are ready */
+		return;
+	}
+
+	w->retiring = TRUE;
 	kill (w->pid, SIGUSR2);
 	msg_info_main ("send signal to worker %P", w->pid);
 }
 
+static void
+check_new_workers (gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_worker *w = value;
+	gboolean *all_ready = ud;
+
+	if (w->generation == w->srv->generation &&
+			(w->cf->worker->flags & RSPAMD_WORKER_NOTIFY_READY) &&
+			!w->ready) {
+		*all_ready = FALSE;
+	}
+}
+
+static void
+rspamd_reload_check_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+	gboolean all_ready = TRUE;
+
+	g_hash_table_foreach (rspamd_main->workers, check_new_workers, &all_ready);
+
+	if (!all_ready) {
+		if (rspamd_get_ticks () - reload_start < RELOAD_READY_TIMEOUT) {
+			return;
+		}
+
+		msg_warn_main ("new workers are not ready after %d seconds, "
+				"terminate old workers anyway", RELOAD_READY_TIMEOUT);
+	}
+	else {
+		msg_info_main ("new workers are ready, terminate old workers");
+	}
+
+	event_del (&reload_ev);
+	reload_pending = FALSE;
+	g_hash_table_foreach (rspamd_main->workers, kill_old_workers,
+			GINT_TO_POINTER (TRUE));
+}
+
 static gboolean
 wait_for_workers (gpointer key, gpointer value, gpointer unused)
 {
@@ -732,8 +841,11 @@ static gboolean
 load_rspamd_config (struct rspamd_main *rspamd_main,
 		struct rspamd_config *cfg, gboolean init_modules, gboolean validate)
 {
+	GError *err = NULL;
+
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
+	cfg->snapshot_file = config_snapshot;
 
 	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
 		config_logger, rspamd_main, ucl_vars)) {
@@ -763,7 +875,12 @@ load_rspamd_config (struct rspamd_main *rspamd_main,
 	}
 
 	/* Do post-load actions */
-	rspamd_config_post_load (cfg, validate);
+	if (rspamd_config_post_load (cfg, validate) && cfg->snapshot_key) {
+		if (!rspamd_config_save_snapshot (cfg, &err)) {
+			msg_warn_main ("cannot save config snapshot: %e", err);
+			g_error_free (err);
+		}
+	}
 
 	return TRUE;
 }
@@ -812,10 +929,19 @@ rspamd_usr1_handler (gint signo, short what, gpointer arg)
 			NULL);
 }
 
+static void
+rspamd_log_drain_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+
+	rspamd_log_drain (rspamd_main->logger);
+}
+
 static void
 rspamd_hup_handler (gint signo, short what, gpointer arg)
 {
 	struct rspamd_main *rspamd_main = arg;
+	struct timeval tv;
 
 	rspamd_log_reopen_priv (rspamd_main->logger,
 			rspamd_main->workers_uid,
@@ -823,11 +949,35 @@ rspamd_hup_handler (gint signo, short what, gpointer arg)
 	msg_info_main ("rspamd "
 			RVERSION
 			" is restarting");
-	g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
+
+	if (reload_pending) {
+		/* Do not keep more than two generations of workers */
+		event_del (&reload_ev);
+		reload_pending = FALSE;
+		g_hash_table_foreach (rspamd_main->workers, kill_old_workers,
+				GINT_TO_POINTER (TRUE));
+	}
+
+	/*
+	 * Scanners of the old generation continue to serve requests until the
+	 * new ones have loaded everything, other workers are stopped now
+	 */
+	rspamd_main->generation ++;
+	g_hash_table_foreach (rspamd_main->workers, kill_old_workers,
+			GINT_TO_POINTER (FALSE));
 	rspamd_map_remove_all (rspamd_main->cfg);
 	reread_config (rspamd_main);
 	rspamd_check_core_limits (rspamd_main);
 	spawn_workers (rspamd_main, rspamd_main->ev_base);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 500000;
+	reload_start = rspamd_get_ticks ();
+	reload_pending = TRUE;
+	event_set (&reload_ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_reload_check_handler, rspamd_main);
+	event_base_set (rspamd_main->ev_base, &reload_ev);
+	event_add (&reload_ev, &tv);
 }
 
 static void
@@ -893,11 +1043,17 @@ rspamd_cld_handler (gint signo, short what, gpointer arg)
 						cur->pid,
 						WEXITSTATUS (res));
 			}
-			/* Fork another worker in replace of dead one */
-			rspamd_check_core_limits (rspamd_main);
-			rspamd_fork_delayed (cur->cf, cur->index, rspamd_main);
+			if (cur->generation == rspamd_main->generation) {
+				/* Fork another worker in replace of dead one */
+				rspamd_check_core_limits (rspamd_main);
+				rspamd_fork_delayed (cur->cf, cur->index, rspamd_main);
+			}
+			/* Workers of the old generation refer to the released config */
 		}
 
+		rspamd_metrics_release (cur->metrics);
+		rspamd_control_bcast_release (rspamd_main->control_bcast,
+				cur->control_slot);
 		event_del (&cur->srv_ev);
 		/* We also need to clean descriptors left */
 		close (cur->control_pipe[0]);
@@ -997,8 +1153,8 @@ main (gint argc, gchar **argv, gchar **env)
 	GQuark type;
 	rspamd_inet_addr_t *control_addr = NULL;
 	struct event_base *ev_base;
-	struct event term_ev, int_ev, cld_ev, hup_ev, usr1_ev, control_ev;
-	struct timeval term_tv;
+	struct event term_ev, int_ev, cld_ev, hup_ev, usr1_ev, control_ev, log_ev;
+	struct timeval term_tv, log_tv;
 	struct rspamd_main *rspamd_main;
 
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
@@ -1010,6 +1166,10 @@ main (gint argc, gchar **argv, gchar **env)
 			"main");
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 			sizeof (struct rspamd_stat));
+	rspamd_main->metrics = rspamd_metrics_segment_new (rspamd_main->server_pool,
+			RSPAMD_METRICS_MAX_SLOTS);
+	rspamd_main->control_bcast = rspamd_control_bcast_new (
+			rspamd_main->server_pool);
 	rspamd_main->cfg = rspamd_config_new ();
 	rspamd_main->spairs = g_hash_table_new_full (rspamd_spair_hash,
 			rspamd_spair_equal, g_free, rspamd_spair_close);
@@ -1157,12 +1317,13 @@ main (gint argc, gchar **argv, gchar **env)
 	msg_info_main ("cpu features: %s",
 			rspamd_main->cfg->libs_ctx->crypto_ctx->cpu_extensions);
 	msg_info_main ("cryptobox configuration: curve25519(%s), "
-			"chacha20(%s), poly1305(%s), siphash(%s), blake2(%s)",
+			"chacha20(%s), poly1305(%s), siphash(%s), blake2(%s), base64(%s)",
 			rspamd_main->cfg->libs_ctx->crypto_ctx->curve25519_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->chacha20_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->poly1305_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->siphash_impl,
-			rspamd_main->cfg->libs_ctx->crypto_ctx->blake2_impl);
+			rspamd_main->cfg->libs_ctx->crypto_ctx->blake2_impl,
+			rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl);
 
 	/* Daemonize */
 	if (!no_fork && daemon (0, 0) == -1) {
@@ -1221,7 +1382,13 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Maybe read roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_load (rspamd_main->history,
-			rspamd_main->cfg->history_file);
+			rspamd_main->cfg->history_file, rspamd_main->cfg->cache);
+	}
+
+	/* Warm up shared caches before workers are spawned */
+	if (rspamd_main->cfg->caches_file) {
+		rspamd_config_load_caches (rspamd_main->cfg,
+			rspamd_main->cfg->caches_file);
 	}
 
 #if defined(WITH_GPERF_TOOLS)
@@ -1253,8 +1420,18 @@ main (gint argc, gchar **argv, gchar **env)
 	evsignal_set (&usr1_ev, SIGUSR1, rspamd_usr1_handler, rspamd_main);
 	event_base_set (ev_base, &usr1_ev);
 	event_add (&usr1_ev, NULL);
+	/* Drain log lines written by workers (if log_async is enabled) */
+	log_tv.tv_sec = 0;
+	log_tv.tv_usec = 100000;
+	event_set (&log_ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_log_drain_handler, rspamd_main);
+	event_base_set (ev_base, &log_ev);
+	event_add (&log_ev, &log_tv);
 
 	rspamd_check_core_limits (rspamd_main);
+	/* Probes results are shared with workers, so they are started before */
+	rspamd_upstreams_probe_start (rspamd_main->cfg->ups_ctx, ev_base,
+			rspamd_main->cfg->upstream_probe_interval);
 	rspamd_mempool_lock_mutex (rspamd_main->start_mtx);
 	spawn_workers (rspamd_main, ev_base);
 	rspamd_mempool_unlock_mutex (rspamd_main->start_mtx);
@@ -1277,6 +1454,11 @@ main (gint argc, gchar **argv, gchar **env)
 	event_del (&hup_ev);
 	event_del (&cld_ev);
 	event_del (&usr1_ev);
+	rspamd_upstreams_probe_stop (rspamd_main->cfg->ups_ctx);
+
+	if (reload_pending) {
+		event_del (&reload_ev);
+	}
 
 	if (control_fd != -1) {
 		event_del (&control_ev);
@@ -1305,11 +1487,17 @@ main (gint argc, gchar **argv, gchar **env)
 
 	event_base_loop (ev_base, 0);
 	event_del (&term_ev);
+	event_del (&log_ev);
 
 	/* Maybe save roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_save (rspamd_main->history,
-			rspamd_main->cfg->history_file);
+			rspamd_main->cfg->history_file, rspamd_main->cfg->cache);
+	}
+
+	if (rspamd_main->cfg->caches_file) {
+		rspamd_config_save_caches (rspamd_main->cfg,
+			rspamd_main->cfg->caches_file);
 	}
 
 	msg_info_main ("terminating...");
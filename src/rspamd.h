@@ -18,6 +18,7 @@
 #include "libserver/buffer.h"
 #include "libserver/events.h"
 #include "libserver/roll_history.h"
+#include "libserver/worker_metrics.h"
 #include "libserver/task.h"
 #include <magic.h>
 
@@ -26,6 +27,8 @@
 #define FIXED_CONFIG_FILE RSPAMD_CONFDIR "/rspamd.conf"
 /* Time in seconds to exit for old worker */
 #define SOFT_SHUTDOWN_TIME 10
+/* Time in seconds to wait for new workers readiness on reload */
+#define RELOAD_READY_TIMEOUT 60
 
 /* Spam subject */
 #define SPAM_SUBJECT "*** SPAM *** "
@@ -60,6 +63,11 @@ struct rspamd_worker {
 	                                     main process. [0] - main, [1] - worker			*/
 	struct event srv_ev;            /**< used by main for read workers' requests		*/
 	gpointer control_data;          /**< used by control protocol to handle commands	*/
+	struct rspamd_worker_metrics *metrics; /**< shared counters of this worker		*/
+	guint generation;               /**< config generation the worker is started with	*/
+	gboolean ready;                 /**< worker has notified that it can scan			*/
+	gboolean retiring;              /**< worker has been asked to shut down				*/
+	gint control_slot;              /**< slot in the shared broadcast area or -1		*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -163,6 +171,7 @@ enum rspamd_worker_flags {
 	RSPAMD_WORKER_THREADED = (1 << 2),
 	RSPAMD_WORKER_KILLABLE = (1 << 3),
 	RSPAMD_WORKER_ALWAYS_START = (1 << 4),
+	RSPAMD_WORKER_NOTIFY_READY = (1 << 5),
 };
 
 typedef struct worker_s {
@@ -208,6 +217,7 @@ gboolean rspamd_check_module (struct rspamd_config *cfg, module_t *wrk);
 
 struct pidfh;
 struct rspamd_config;
+struct rspamd_control_bcast;
 struct tokenizer;
 struct rspamd_stat_classifier;
 struct rspamd_classifier_config;
@@ -237,6 +247,9 @@ struct rspamd_main {
 	rspamd_pidfh_t *pfh;                                        /**< struct pidfh for pidfile						*/
 	GQuark type;                                                /**< process type									*/
 	struct rspamd_stat *stat;                                   /**< pointer to statistics							*/
+	struct rspamd_metrics_segment *metrics;                     /**< per worker counters (shared)					*/
+	struct rspamd_control_bcast *control_bcast;                 /**< broadcast control commands (shared)				*/
+	guint generation;                                           /**< incremented on each config reload				*/
 
 	rspamd_mempool_t *server_pool;                              /**< server's memory pool							*/
 	rspamd_mempool_mutex_t *start_mtx;                          /**< server is starting up							*/
@@ -41,15 +41,30 @@
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
 /* Timeout for task processing */
 #define DEFAULT_TASK_TIMEOUT 8.0
+/* Initial adaptive limit of tasks being scanned */
+#define DEFAULT_TASKS_LIMIT 16.0
+/* Multiplier applied to the adaptive limit when latency is too high */
+#define TASKS_LIMIT_DECREASE 0.5
+/* Lua GC steps performed when worker is idle */
+#define DEFAULT_LUA_GC_INTERVAL 1.0
+#define DEFAULT_LUA_GC_IDLE_STEP 1024
+/* Fair scheduling of tasks */
+#define DEFAULT_MAX_LARGE_SCANNING 1
+#define DEFAULT_LARGE_MESSAGE_SIZE (1024 * 1024)
+#define DEFAULT_FAIR_QUANTUM (64 * 1024)
+/* Messages of a batch scanned at once */
+#define DEFAULT_BATCH_CONCURRENCY 8
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
+static struct rspamd_task *rspamd_worker_task_new (struct rspamd_worker *worker,
+		gint fd, rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn);
 
 worker_t normal_worker = {
 		"normal",                   /* Name */
 		init_worker,                /* Init function */
 		start_worker,               /* Start function */
-		RSPAMD_WORKER_HAS_SOCKET|RSPAMD_WORKER_KILLABLE,
+		RSPAMD_WORKER_HAS_SOCKET|RSPAMD_WORKER_KILLABLE|RSPAMD_WORKER_NOTIFY_READY,
 		SOCK_STREAM,                /* TCP socket */
 		RSPAMD_WORKER_VER           /* Version info */
 };
@@ -83,9 +98,340 @@ reduce_tasks_count (gpointer arg)
 }
 
 static void
-rspamd_task_timeout (gint fd, short what, gpointer ud)
+reduce_inflight_tasks (gpointer arg)
+{
+	struct rspamd_worker *worker = arg;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+
+	ctx->inflight_tasks --;
+
+	if (worker->metrics) {
+		worker->metrics->inflight = ctx->inflight_tasks;
+	}
+}
+
+static GQuark
+rspamd_worker_quark (void)
+{
+	return g_quark_from_static_string ("normal-worker");
+}
+
+/*
+ * Check whether a new task can be scanned within the adaptive limit
+ */
+static gboolean
+rspamd_worker_admit_task (struct rspamd_worker_ctx *ctx)
+{
+	if (ctx->target_latency <= 0) {
+		return TRUE;
+	}
+
+	return ctx->inflight_tasks < (guint)ctx->tasks_limit;
+}
+
+/*
+ * Update the adaptive limit of tasks using AIMD: the limit grows additively
+ * while tasks are scanned in time and it is halved (once per target latency
+ * interval) when scan latency exceeds the target
+ */
+static void
+rspamd_worker_update_tasks_limit (struct rspamd_worker_ctx *ctx,
+		gdouble latency)
+{
+	gdouble now;
+
+	if (latency > ctx->target_latency) {
+		now = rspamd_get_ticks ();
+
+		if (now - ctx->last_limit_decrease > ctx->target_latency) {
+			ctx->tasks_limit = MAX (1.0,
+					ctx->tasks_limit * TASKS_LIMIT_DECREASE);
+			ctx->last_limit_decrease = now;
+			msg_info_ctx ("scan latency %.3f exceeds target %.3f, "
+					"decrease tasks limit to %ud",
+					latency, ctx->target_latency, (guint)ctx->tasks_limit);
+		}
+	}
+	else if (ctx->inflight_tasks + 1 >= (guint)ctx->tasks_limit) {
+		/* Grow limit only if it actually restricts concurrency */
+		ctx->tasks_limit += 1.0 / ctx->tasks_limit;
+
+		if (ctx->max_tasks != 0 && ctx->tasks_limit > ctx->max_tasks) {
+			ctx->tasks_limit = ctx->max_tasks;
+		}
+	}
+}
+
+/*
+ * Perform incremental step of lua GC that collects as much garbage as has
+ * been allocated since the previous step plus `extra` kilobytes, so full
+ * collections are not triggered during scanning of tasks
+ */
+static void
+rspamd_worker_lua_gc_step (struct rspamd_worker_ctx *ctx, guint extra)
+{
+	lua_State *L = ctx->cfg->lua_state;
+	gint grown;
+
+	grown = lua_gc (L, LUA_GCCOUNT, 0) - ctx->lua_gc_last;
+
+	if (grown > 0 || extra > 0) {
+		lua_gc (L, LUA_GCSTEP, MAX (grown, 0) + extra);
+	}
+
+	ctx->lua_gc_last = lua_gc (L, LUA_GCCOUNT, 0);
+}
+
+static void
+rspamd_worker_lua_gc_idle (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_ctx *ctx = ud;
+	struct timeval tv;
+
+	if (ctx->inflight_tasks == 0) {
+		rspamd_worker_lua_gc_step (ctx, ctx->lua_gc_idle_step);
+	}
+
+	double_to_tv (ctx->lua_gc_interval, &tv);
+	event_add (&ctx->lua_gc_ev, &tv);
+}
+
+/*
+ * Tasks wait for scanning in per client queues served by deficit round robin,
+ * so each client can scan about `fair_quantum` bytes per round. Large
+ * messages have their own limit, so they cannot occupy all scanning slots.
+ */
+struct rspamd_worker_flow {
+	gchar *key;
+	GQueue tasks;
+	gint64 deficit;
+};
+
+struct rspamd_worker_sched_elt {
+	struct rspamd_task *task;
+	struct rspamd_worker_flow *flow;
+	GList link;
+	gboolean large;
+	gboolean scanning;
+};
+
+static void
+rspamd_worker_flow_free (gpointer p)
+{
+	struct rspamd_worker_flow *flow = p;
+
+	g_free (flow->key);
+	g_free (flow);
+}
+
+static void
+rspamd_worker_sched_wakeup (struct rspamd_worker_ctx *ctx)
+{
+	struct timeval tv;
+
+	if (!ctx->sched_pending && ctx->active_flows.length > 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add (&ctx->sched_ev, &tv);
+		ctx->sched_pending = TRUE;
+	}
+}
+
+/* Removes task from its queue */
+static void
+rspamd_worker_sched_unqueue (struct rspamd_worker_ctx *ctx,
+		struct rspamd_worker_sched_elt *elt)
+{
+	struct rspamd_worker_flow *flow = elt->flow;
+
+	g_queue_unlink (&flow->tasks, &elt->link);
+	elt->flow = NULL;
+
+	if (flow->tasks.length == 0) {
+		g_queue_remove (&ctx->active_flows, flow);
+		g_hash_table_remove (ctx->flows, flow->key);
+	}
+}
+
+/* Accounts task as being scanned */
+static void
+rspamd_worker_sched_take (struct rspamd_worker_ctx *ctx,
+		struct rspamd_worker_sched_elt *elt)
+{
+	if (elt->flow) {
+		rspamd_worker_sched_unqueue (ctx, elt);
+	}
+
+	elt->scanning = TRUE;
+	ctx->scanning ++;
+
+	if (elt->large) {
+		ctx->large_scanning ++;
+	}
+}
+
+static void
+rspamd_worker_sched_elt_dtor (gpointer p)
+{
+	struct rspamd_worker_sched_elt *elt = p;
+	struct rspamd_worker_ctx *ctx = elt->task->worker->ctx;
+
+	if (elt->flow) {
+		rspamd_worker_sched_unqueue (ctx, elt);
+	}
+	else if (elt->scanning) {
+		ctx->scanning --;
+
+		if (elt->large) {
+			ctx->large_scanning --;
+		}
+
+		/* Tasks are not started from the destructor of another task */
+		rspamd_worker_sched_wakeup (ctx);
+	}
+}
+
+static gboolean
+rspamd_worker_sched_can_take (struct rspamd_worker_ctx *ctx, gboolean large)
+{
+	if (ctx->scanning >= ctx->max_scanning) {
+		return FALSE;
+	}
+
+	if (large && ctx->large_scanning >= ctx->max_large_scanning) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_sched_dispatch (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_ctx *ctx = ud;
+	struct rspamd_worker_flow *flow;
+	struct rspamd_worker_sched_elt *elt;
+	guint blocked = 0;
+
+	ctx->sched_pending = FALSE;
+
+	while (ctx->scanning < ctx->max_scanning &&
+			blocked < ctx->active_flows.length) {
+		flow = g_queue_peek_head (&ctx->active_flows);
+		elt = flow->tasks.head->data;
+
+		if (!rspamd_worker_sched_can_take (ctx, elt->large)) {
+			/* Let other clients go while large tasks are scanned */
+			g_queue_push_tail (&ctx->active_flows,
+					g_queue_pop_head (&ctx->active_flows));
+			blocked ++;
+			continue;
+		}
+
+		blocked = 0;
+
+		if (flow->deficit < (gint64)elt->task->msg.len) {
+			flow->deficit += ctx->fair_quantum;
+			g_queue_push_tail (&ctx->active_flows,
+					g_queue_pop_head (&ctx->active_flows));
+			continue;
+		}
+
+		flow->deficit -= elt->task->msg.len;
+		rspamd_worker_sched_take (ctx, elt);
+		rspamd_task_process (elt->task, RSPAMD_TASK_PROCESS_ALL);
+	}
+}
+
+/* Large tasks let other tasks being scanned handle their events */
+static gboolean
+rspamd_worker_task_should_yield (struct rspamd_task *task)
+{
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
+
+	return ctx->scanning > ctx->large_scanning;
+}
+
+static void
+rspamd_worker_schedule_task (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task)
+{
+	struct rspamd_worker_sched_elt *elt;
+	struct rspamd_worker_flow *flow;
+	rspamd_ftok_t *hdr, srch;
+	gchar *key = NULL;
+
+	if (ctx->max_scanning == 0 || RSPAMD_TASK_IS_SKIPPED (task)) {
+		rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+
+		return;
+	}
+
+	elt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*elt));
+	elt->task = task;
+	elt->link.data = elt;
+	elt->large = task->msg.len >= ctx->large_message_size;
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_worker_sched_elt_dtor, elt);
+	rspamd_mempool_set_variable (task->task_pool, "sched_elt", elt, NULL);
+
+	if (elt->large) {
+		task->yield_callback = rspamd_worker_task_should_yield;
+	}
+
+	if (ctx->active_flows.length == 0 &&
+			rspamd_worker_sched_can_take (ctx, elt->large)) {
+		rspamd_worker_sched_take (ctx, elt);
+		rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+
+		return;
+	}
+
+	if (ctx->fair_header) {
+		srch.begin = ctx->fair_header;
+		srch.len = strlen (ctx->fair_header);
+		hdr = g_hash_table_lookup (task->request_headers, &srch);
+
+		if (hdr) {
+			key = g_strndup (hdr->begin, hdr->len);
+		}
+	}
+
+	if (key == NULL) {
+		key = g_strdup (rspamd_inet_address_to_string (task->client_addr));
+	}
+
+	flow = g_hash_table_lookup (ctx->flows, key);
+
+	if (flow == NULL) {
+		flow = g_malloc0 (sizeof (*flow));
+		flow->key = key;
+		g_hash_table_insert (ctx->flows, flow->key, flow);
+		g_queue_push_tail (&ctx->active_flows, flow);
+	}
+	else {
+		g_free (key);
+	}
+
+	elt->flow = flow;
+	g_queue_push_tail_link (&flow->tasks, &elt->link);
+	msg_debug_task ("queue task of %z bytes from %s, %ud tasks are scanned",
+			task->msg.len, flow->key, ctx->scanning);
+	rspamd_worker_sched_wakeup (ctx);
+}
+
+static void
+rspamd_task_timeout (gpointer ud)
 {
 	struct rspamd_task *task = (struct rspamd_task *) ud;
+	struct rspamd_worker_sched_elt *elt;
+
+	elt = rspamd_mempool_get_variable (task->task_pool, "sched_elt");
+
+	if (elt && elt->flow) {
+		msg_info_task ("task timed out while waiting in queue");
+		rspamd_worker_sched_take (task->worker->ctx, elt);
+	}
 
 	if (!(task->processed_stages & RSPAMD_TASK_STAGE_FILTERS)) {
 		msg_info_task ("processing of task timed out, forced processing");
@@ -122,7 +468,20 @@ rspamd_worker_guard_handler (gint fd, short what, void *data)
 	}
 #endif
 
-	r = read (fd, fake_buf, sizeof (fake_buf));
+	if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		/* Data is the next request, so it must be left in the socket */
+		r = recv (fd, fake_buf, 1, MSG_PEEK);
+
+		if (r > 0) {
+			event_del (task->guard_ev);
+			task->guard_ev = NULL;
+
+			return;
+		}
+	}
+	else {
+		r = read (fd, fake_buf, sizeof (fake_buf));
+	}
 
 	if (r > 0) {
 		msg_warn_task ("received extra data after task is loaded, ignoring");
@@ -159,6 +518,351 @@ rspamd_worker_guard_handler (gint fd, short what, void *data)
 	}
 }
 
+/*
+ * Batch of messages sent in a single request to `/checkbatch`, each message is
+ * prefixed by its length as a decimal number followed by a newline. Messages
+ * are scanned by separate tasks, at most `batch_concurrency` at once, and
+ * their results are written as lines of JSON in order of completion.
+ */
+struct rspamd_worker_batch {
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+	const gchar *pos;
+	const gchar *end;
+	/* Tasks being scanned and the finished ones waiting to be freed */
+	GQueue running;
+	GPtrArray *finished;
+	rspamd_fstring_t *reply;
+	struct event ev;
+	guint nmessages;
+	gboolean pending;
+	gboolean done;
+};
+
+struct rspamd_worker_batch_elt {
+	struct rspamd_worker_batch *batch;
+	struct rspamd_task *task;
+	GList link;
+	guint idx;
+};
+
+static void rspamd_worker_batch_step (struct rspamd_worker_batch *batch);
+
+static void
+rspamd_worker_batch_wakeup (struct rspamd_worker_batch *batch)
+{
+	struct timeval tv;
+
+	if (!batch->pending) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add (&batch->ev, &tv);
+		batch->pending = TRUE;
+	}
+}
+
+static void
+rspamd_worker_batch_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+
+	batch->pending = FALSE;
+	rspamd_worker_batch_step (batch);
+}
+
+static void
+rspamd_worker_batch_free (struct rspamd_worker_batch *batch)
+{
+	if (batch->pending) {
+		event_del (&batch->ev);
+	}
+
+	g_ptr_array_free (batch->finished, TRUE);
+
+	if (batch->reply) {
+		rspamd_fstring_free (batch->reply);
+	}
+
+	g_free (batch);
+}
+
+/* Finished tasks are freed outside of their own callbacks */
+static void
+rspamd_worker_batch_cleanup (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_task *child;
+	guint i;
+
+	for (i = 0; i < batch->finished->len; i ++) {
+		child = g_ptr_array_index (batch->finished, i);
+		rspamd_session_destroy (child->s);
+	}
+
+	g_ptr_array_set_size (batch->finished, 0);
+}
+
+/* Called when the batch is finished or when its connection is terminated */
+static void
+rspamd_worker_batch_fin (gpointer ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+	struct rspamd_worker_batch_elt *elt;
+
+	rspamd_worker_batch_cleanup (batch);
+
+	if (batch->done) {
+		/* Reply is written by the parent task */
+		return;
+	}
+
+	while ((elt = g_queue_peek_head (&batch->running)) != NULL) {
+		g_queue_unlink (&batch->running, &elt->link);
+		rspamd_session_destroy (elt->task->s);
+	}
+
+	rspamd_worker_batch_free (batch);
+}
+
+static gboolean
+rspamd_worker_batch_task_fin (struct rspamd_task *task, void *ud)
+{
+	struct rspamd_worker_batch_elt *elt = ud;
+	struct rspamd_worker_batch *batch = elt->batch;
+	struct rspamd_http_message *msg;
+	ucl_object_t *top;
+
+	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
+		return TRUE;
+	}
+
+	if (task->err != NULL) {
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_fromint (elt->idx),
+				"index", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromstring (task->err->message),
+				"error", 0, false);
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &batch->reply);
+		batch->reply = rspamd_fstring_append (batch->reply, "\n", 1);
+		ucl_object_unref (top);
+	}
+	else {
+		msg = rspamd_http_new_message (HTTP_RESPONSE);
+		rspamd_protocol_http_reply (msg, task);
+		rspamd_protocol_write_log_pipe (task->worker->ctx, task);
+		rspamd_printf_fstring (&batch->reply, "{\"index\":%ud,\"result\":%V}\n",
+				elt->idx, msg->body);
+		rspamd_http_message_free (msg);
+	}
+
+	task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+	g_queue_unlink (&batch->running, &elt->link);
+	g_ptr_array_add (batch->finished, task);
+	rspamd_worker_batch_wakeup (batch);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_worker_batch_reply (struct rspamd_task *task, void *ud)
+{
+	struct rspamd_worker_batch *batch = ud;
+	struct rspamd_http_message *msg;
+
+	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
+		/* Batch has been already freed */
+		return TRUE;
+	}
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->date = time (NULL);
+	msg->status = rspamd_fstring_new_init ("OK", 2);
+	msg->body = batch->reply;
+	batch->reply = NULL;
+
+	if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
+
+	msg_info_task ("scanned batch of %ud messages", batch->nmessages);
+	rspamd_worker_batch_free (batch);
+
+	rspamd_http_connection_reset (task->http_conn);
+	rspamd_http_connection_write_message (task->http_conn, msg, NULL,
+			"application/x-ndjson", task, task->sock, &task->tv, task->ev_base);
+	task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+
+	return TRUE;
+}
+
+/* Extracts the next message of the batch, pos is set to end on errors */
+static gboolean
+rspamd_worker_batch_next (struct rspamd_worker_batch *batch,
+		const gchar **start, gsize *len)
+{
+	const gchar *p = batch->pos, *end = batch->end;
+	guint64 mlen = 0;
+	ucl_object_t *top;
+
+	/* Messages could be separated by empty lines */
+	while (p < end && (*p == '\r' || *p == '\n')) {
+		p ++;
+	}
+
+	if (p == end) {
+		batch->pos = end;
+
+		return FALSE;
+	}
+
+	while (p < end && g_ascii_isdigit (*p) && mlen <= (guint64)(end - p)) {
+		mlen = mlen * 10 + (*p - '0');
+		p ++;
+	}
+
+	if (p < end && *p == '\r') {
+		p ++;
+	}
+
+	if (p == batch->pos || p == end || *p != '\n' ||
+			mlen > (guint64)(end - p - 1)) {
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_fromint (batch->nmessages),
+				"index", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromstring ("invalid length of message"),
+				"error", 0, false);
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &batch->reply);
+		batch->reply = rspamd_fstring_append (batch->reply, "\n", 1);
+		ucl_object_unref (top);
+		batch->pos = end;
+
+		return FALSE;
+	}
+
+	p ++;
+	*start = p;
+	*len = mlen;
+	batch->pos = p + mlen;
+
+	return TRUE;
+}
+
+static struct rspamd_task *
+rspamd_worker_batch_task_new (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_task *parent = batch->task, *task;
+	struct rspamd_worker_ctx *ctx = parent->worker->ctx;
+	struct rspamd_worker_batch_elt *elt;
+
+	task = rspamd_task_new (parent->worker, ctx->cfg);
+
+	if (!ctx->is_mime) {
+		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+	}
+
+	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+	task->client_addr = rspamd_inet_address_copy (parent->client_addr);
+
+	elt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*elt));
+	elt->batch = batch;
+	elt->task = task;
+	elt->link.data = elt;
+	elt->idx = batch->nmessages ++;
+	task->fin_callback = rspamd_worker_batch_task_fin;
+	task->fin_arg = elt;
+	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, (event_finalizer_t)rspamd_task_free, task);
+
+	ctx->inflight_tasks ++;
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)reduce_inflight_tasks,
+			task->worker);
+
+	if (task->worker->metrics) {
+		task->worker->metrics->inflight = ctx->inflight_tasks;
+	}
+
+	g_queue_push_tail_link (&batch->running, &elt->link);
+
+	return task;
+}
+
+static void
+rspamd_worker_batch_step (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_worker_ctx *ctx = batch->task->worker->ctx;
+	struct rspamd_task *task;
+	const gchar *start;
+	gsize len;
+
+	rspamd_worker_batch_cleanup (batch);
+
+	while (batch->running.length < ctx->batch_concurrency &&
+			rspamd_worker_batch_next (batch, &start, &len)) {
+		task = rspamd_worker_batch_task_new (batch);
+
+		/* Headers and query arguments of request are applied to all messages */
+		if (!rspamd_protocol_handle_request (task, batch->msg) ||
+				!rspamd_task_load_message (task, batch->msg, start, len)) {
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+
+		task->cmd = CMD_CHECK;
+		task->flags &= ~(RSPAMD_TASK_FLAG_KEEPALIVE|RSPAMD_TASK_FLAG_COMPACT);
+
+		if (ctx->task_timeout > 0.0) {
+			rspamd_timer_add (rspamd_timer_wheel_get (ctx->ev_base),
+					&task->timeout_ev, ctx->task_timeout, rspamd_task_timeout,
+					task);
+		}
+
+		rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+
+		if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
+			/* Nothing is pending, so the task is replied now */
+			rspamd_session_pending (task->s);
+		}
+	}
+
+	if (batch->running.length == 0 && batch->pos == batch->end) {
+		/* The parent task is finished and the batch is freed when replied */
+		batch->done = TRUE;
+		rspamd_session_remove_event (batch->task->s, rspamd_worker_batch_fin,
+				batch);
+	}
+}
+
+static void
+rspamd_worker_batch_start (struct rspamd_task *task,
+		struct rspamd_http_message *msg, const gchar *chunk, gsize len)
+{
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
+	struct rspamd_worker_batch *batch;
+
+	batch = g_malloc0 (sizeof (*batch));
+	batch->task = task;
+	batch->msg = msg;
+	batch->pos = chunk;
+	batch->end = chunk + len;
+	batch->finished = g_ptr_array_new ();
+	batch->reply = rspamd_fstring_sized_new (BUFSIZ);
+	g_queue_init (&batch->running);
+	evtimer_set (&batch->ev, rspamd_worker_batch_timer, batch);
+	event_base_set (ctx->ev_base, &batch->ev);
+
+	/* Parent task is not scanned, it merely keeps the connection */
+	task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	task->fin_callback = rspamd_worker_batch_reply;
+	task->fin_arg = batch;
+	rspamd_session_add_event (task->s, rspamd_worker_batch_fin, batch,
+			rspamd_worker_quark ());
+
+	rspamd_worker_batch_step (batch);
+}
+
 static gint
 rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
@@ -166,11 +870,26 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 	struct rspamd_worker_ctx *ctx;
-	struct timeval task_tv;
 	struct event *guard_ev;
+	gboolean batch = FALSE;
 
 	ctx = task->worker->ctx;
 
+	if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		/* Do not account idle time of a reused connection */
+		task->time_real = rspamd_get_ticks ();
+	}
+	else if (task->profile) {
+		task->profile->read = rspamd_get_ticks () - task->time_real;
+	}
+
+	if (ctx->keepalive_timeout > 0 && (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE)) {
+		task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+	}
+	else {
+		task->flags &= ~RSPAMD_TASK_FLAG_KEEPALIVE;
+	}
+
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -179,7 +898,34 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		if (task->cmd == CMD_PING) {
 			task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		}
+		else if (task->cmd == CMD_CHECK_BATCH) {
+			/* Messages of batch are admitted by its concurrency limit */
+			batch = TRUE;
+		}
+		else if (!rspamd_worker_admit_task (ctx)) {
+			/* Reply early, so the client can try another server */
+			msg_info_task ("reject task: %ud tasks are being scanned while "
+					"limit is %ud", ctx->inflight_tasks,
+					(guint)ctx->tasks_limit);
+			g_set_error (&task->err, rspamd_worker_quark (), 503,
+					"server is overloaded");
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
 		else {
+			/* Tasks are also counted to detect idle time for lua GC */
+			ctx->inflight_tasks ++;
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)reduce_inflight_tasks,
+					task->worker);
+
+			if (task->worker->metrics) {
+				task->worker->metrics->inflight = ctx->inflight_tasks;
+			}
+
+			if (ctx->target_latency > 0) {
+				task->flags |= RSPAMD_TASK_FLAG_ADMITTED;
+			}
+
 			if (!rspamd_task_load_message (task, msg, chunk, len)) {
 				msg_err_task ("cannot load message: %e", task->err);
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -187,13 +933,11 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
-	/* Set global timeout for the task */
-	if (ctx->task_timeout > 0.0) {
-		event_set (&task->timeout_ev, -1, EV_TIMEOUT, rspamd_task_timeout,
+	/* Set global timeout for the task, messages of batch have their own */
+	if (ctx->task_timeout > 0.0 && !batch) {
+		rspamd_timer_add (rspamd_timer_wheel_get (ctx->ev_base),
+				&task->timeout_ev, ctx->task_timeout, rspamd_task_timeout,
 				task);
-		event_base_set (ctx->ev_base, &task->timeout_ev);
-		double_to_tv (ctx->task_timeout, &task_tv);
-		event_add (&task->timeout_ev, &task_tv);
 	}
 
 	/* Set socket guard */
@@ -209,7 +953,12 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	event_add (guard_ev, NULL);
 	task->guard_ev = guard_ev;
 
-	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+	if (batch) {
+		rspamd_worker_batch_start (task, msg, chunk, len);
+	}
+	else {
+		rspamd_worker_schedule_task (ctx, task);
+	}
 
 	return 0;
 }
@@ -219,23 +968,83 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 
-	msg_info_task ("abnormally closing connection from: %s, error: %e",
-		rspamd_inet_address_to_string (task->client_addr), err);
+	if ((task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) &&
+			task->processed_stages == 0) {
+		/* Peer has not sent the next request */
+		msg_debug_task ("closing idle connection from: %s, error: %e",
+			rspamd_inet_address_to_string (task->client_addr), err);
+	}
+	else {
+		msg_info_task ("abnormally closing connection from: %s, error: %e",
+			rspamd_inet_address_to_string (task->client_addr), err);
+	}
 	/* Terminate session immediately */
 	rspamd_session_destroy (task->s);
 }
 
+/*
+ * Detach connection from the replied task and wait for the next request
+ */
+static void
+rspamd_worker_keepalive (struct rspamd_task *task)
+{
+	struct rspamd_worker *worker = task->worker;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_http_connection *conn;
+	rspamd_inet_addr_t *addr;
+	gint fd;
+
+	conn = task->http_conn;
+	fd = task->sock;
+	addr = task->client_addr;
+	task->http_conn = NULL;
+	task->sock = -1;
+	task->client_addr = NULL;
+
+	msg_debug_task ("keep connection from: %s for the next request",
+			rspamd_inet_address_to_string (addr));
+	rspamd_session_destroy (task->s);
+
+	/* Reused connections are limited as well as the new ones */
+	task = rspamd_worker_task_new (worker, fd, addr, conn);
+	task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+	rspamd_http_connection_reset (conn);
+	rspamd_http_connection_read_message (conn,
+			task,
+			fd,
+			&ctx->keepalive_tv,
+			ctx->ev_base);
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_ctx *ctx = task->worker->ctx;
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* We are done here */
-		msg_debug_task ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
-		rspamd_session_destroy (task->s);
+		if (task->flags & RSPAMD_TASK_FLAG_ADMITTED) {
+			task->flags &= ~RSPAMD_TASK_FLAG_ADMITTED;
+			rspamd_worker_update_tasks_limit (ctx,
+					rspamd_get_ticks () - task->time_real);
+		}
+
+		if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+			/* Connection is finished when the whole reply is written */
+			if (conn->finished) {
+				rspamd_worker_keepalive (task);
+			}
+		}
+		else {
+			msg_debug_task ("normally closing connection from: %s",
+				rspamd_inet_address_to_string (task->client_addr));
+			rspamd_session_destroy (task->s);
+		}
+
+		/* Garbage of the finished task is collected between tasks */
+		rspamd_worker_lua_gc_step (ctx, 0);
 	}
 	else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
 		rspamd_session_pending (task->s);
@@ -275,12 +1084,37 @@ accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
-	task = rspamd_task_new (worker, ctx->cfg);
+	worker->srv->stat->connections_count++;
+
+	if (worker->metrics) {
+		worker->metrics->connections ++;
+	}
+
+	task = rspamd_worker_task_new (worker, nfd, addr, NULL);
 
 	msg_info_task ("accepted connection from %s port %d",
 		rspamd_inet_address_to_string (addr),
 		rspamd_inet_address_get_port (addr));
 
+	rspamd_http_connection_read_message (task->http_conn,
+			task,
+		nfd,
+		&ctx->io_tv,
+		ctx->ev_base);
+}
+
+/*
+ * Construct task for the connection (new one is created if `conn` is NULL)
+ */
+static struct rspamd_task *
+rspamd_worker_task_new (struct rspamd_worker *worker,
+		gint fd, rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (worker, ctx->cfg);
+
 	/* Copy some variables */
 	if (ctx->is_mime) {
 		task->flags |= RSPAMD_TASK_FLAG_MIME;
@@ -289,21 +1123,28 @@ accept_socket (gint fd, short what, void *arg)
 		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
 	}
 
-	task->sock = nfd;
+	task->sock = fd;
 	task->client_addr = addr;
 
-	worker->srv->stat->connections_count++;
 	task->resolver = ctx->resolver;
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
 
-	task->http_conn = rspamd_http_connection_new (
-		rspamd_worker_body_handler,
-		rspamd_worker_error_handler,
-		rspamd_worker_finish_handler,
-		0,
-		RSPAMD_HTTP_SERVER,
-		ctx->keys_cache);
+	if (conn == NULL) {
+		conn = rspamd_http_connection_new (
+			rspamd_worker_body_handler,
+			rspamd_worker_error_handler,
+			rspamd_worker_finish_handler,
+			0,
+			RSPAMD_HTTP_SERVER,
+			ctx->keys_cache);
+
+		if (ctx->key) {
+			rspamd_http_connection_set_key (conn, ctx->key);
+		}
+	}
+
+	task->http_conn = conn;
 	task->ev_base = ctx->ev_base;
 	worker->nconns++;
 	rspamd_mempool_add_destructor (task->task_pool,
@@ -313,15 +1154,7 @@ accept_socket (gint fd, short what, void *arg)
 	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
 			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
 
-	if (ctx->key) {
-		rspamd_http_connection_set_key (task->http_conn, ctx->key);
-	}
-
-	rspamd_http_connection_read_message (task->http_conn,
-			task,
-		nfd,
-		&ctx->io_tv,
-		ctx->ev_base);
+	return task;
 }
 
 #ifdef WITH_HYPERSCAN
@@ -334,6 +1167,7 @@ rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
 {
 	struct rspamd_control_reply rep;
 	struct rspamd_re_cache *cache = worker->srv->cfg->re_cache;
+	struct rspamd_worker_ctx *ctx = ud;
 
 	memset (&rep, 0, sizeof (rep));
 	rep.type = RSPAMD_CONTROL_HYPERSCAN_LOADED;
@@ -347,11 +1181,14 @@ rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
 				worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir);
 	}
 
-	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
+	if (!worker->ready) {
+		/* Hyperscan is loaded, so we no longer fall back to PCRE */
+		worker->ready = TRUE;
+		rspamd_worker_notify_ready (worker, ctx->ev_base);
 	}
 
+	rspamd_control_worker_reply (worker, fd, &rep);
+
 	return TRUE;
 }
 #endif
@@ -383,10 +1220,7 @@ rspamd_worker_log_pipe_handler (struct rspamd_main *rspamd_main,
 		msg_err ("cannot attach log pipe: invalid fd");
 	}
 
-	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
-	}
+	rspamd_control_worker_reply (worker, fd, &rep);
 
 	return TRUE;
 }
@@ -406,6 +1240,12 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = DEFAULT_TASK_TIMEOUT;
+	ctx->lua_gc_interval = DEFAULT_LUA_GC_INTERVAL;
+	ctx->lua_gc_idle_step = DEFAULT_LUA_GC_IDLE_STEP;
+	ctx->max_large_scanning = DEFAULT_MAX_LARGE_SCANNING;
+	ctx->large_message_size = DEFAULT_LARGE_MESSAGE_SIZE;
+	ctx->fair_quantum = DEFAULT_FAIR_QUANTUM;
+	ctx->batch_concurrency = DEFAULT_BATCH_CONCURRENCY;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -465,6 +1305,28 @@ init_worker (struct rspamd_config *cfg)
 					G_STRINGIFY(DEFAULT_TASK_TIMEOUT)
 					" seconds");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"target_latency",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						target_latency),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Adapt limit of parallel tasks to keep scan time below this "
+					"value, default: 0 (disabled)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to wait for the next request on a keep-alive connection, "
+					"default: 0 (connections are closed after reply)");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"max_tasks",
@@ -475,6 +1337,103 @@ init_worker (struct rspamd_config *cfg)
 			RSPAMD_CL_FLAG_INT_32,
 			"Maximum count of parallel tasks processed by a single worker process");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"cpu_threads",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						cpu_threads),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of threads to execute cpu bound symbols, default: 0 (disabled)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lua_gc_idle_interval",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						lua_gc_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Interval of lua GC steps while no tasks are scanned, default: "
+					G_STRINGIFY(DEFAULT_LUA_GC_INTERVAL)
+					" seconds (0 to disable)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lua_gc_idle_step",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						lua_gc_idle_step),
+			RSPAMD_CL_FLAG_INT_32,
+			"Amount of lua GC work in kilobytes performed while idle, default: "
+					G_STRINGIFY(DEFAULT_LUA_GC_IDLE_STEP));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_scanning",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						max_scanning),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum count of tasks scanned at once, others wait in per client "
+					"queues, default: 0 (no queues)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_large_scanning",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						max_large_scanning),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum count of large messages scanned at once, default: "
+					G_STRINGIFY(DEFAULT_MAX_LARGE_SCANNING));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"large_message_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						large_message_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of messages treated as large for scheduling, default: 1Mb");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"fair_quantum",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						fair_quantum),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Bytes scanned for a client per round of the queues, default: 64Kb");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"fair_header",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						fair_header),
+			0,
+			"Request header that identifies clients for queues, default: "
+					"client address");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"batch_concurrency",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						batch_concurrency),
+			RSPAMD_CL_FLAG_INT_32,
+			"Maximum count of messages of a /checkbatch request scanned at "
+					"once, default: " G_STRINGIFY(DEFAULT_BATCH_CONCURRENCY));
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"keypair",
@@ -496,10 +1455,47 @@ start_worker (struct rspamd_worker *worker)
 {
 	struct rspamd_worker_ctx *ctx = worker->ctx;
 	struct rspamd_worker_log_pipe *lp, *ltmp;
+	struct timeval tv;
 
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
 	msec_to_tv (ctx->timeout, &ctx->io_tv);
+	double_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
+	ctx->tasks_limit = DEFAULT_TASKS_LIMIT;
+
+	if (ctx->max_tasks != 0 && ctx->tasks_limit > ctx->max_tasks) {
+		ctx->tasks_limit = ctx->max_tasks;
+	}
 	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base);
+	rspamd_symbols_cache_start_threads (worker->srv->cfg->cache, ctx->ev_base,
+			ctx->cpu_threads);
+
+	ctx->lua_gc_last = lua_gc (ctx->cfg->lua_state, LUA_GCCOUNT, 0);
+
+	if (ctx->batch_concurrency == 0) {
+		ctx->batch_concurrency = 1;
+	}
+
+	if (ctx->max_scanning > 0) {
+		if (ctx->max_large_scanning == 0) {
+			ctx->max_large_scanning = 1;
+		}
+		if (ctx->fair_quantum == 0) {
+			ctx->fair_quantum = DEFAULT_FAIR_QUANTUM;
+		}
+
+		ctx->flows = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+				NULL, rspamd_worker_flow_free);
+		g_queue_init (&ctx->active_flows);
+		evtimer_set (&ctx->sched_ev, rspamd_worker_sched_dispatch, ctx);
+		event_base_set (ctx->ev_base, &ctx->sched_ev);
+	}
+
+	if (ctx->lua_gc_interval > 0) {
+		evtimer_set (&ctx->lua_gc_ev, rspamd_worker_lua_gc_idle, ctx);
+		event_base_set (ctx->ev_base, &ctx->lua_gc_ev);
+		double_to_tv (ctx->lua_gc_interval, &tv);
+		event_add (&ctx->lua_gc_ev, &tv);
+	}
 
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
@@ -509,8 +1505,8 @@ start_worker (struct rspamd_worker *worker)
 	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
 			ctx->ev_base, ctx->resolver->r);
 
-	/* XXX: stupid default */
-	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	ctx->keys_cache = rspamd_keypair_cache_new_shared (
+			ctx->cfg->keypair_cache_size, ctx->cfg->keypair_shared_cache);
 	rspamd_stat_init (worker->srv->cfg, ctx->ev_base);
 
 #ifdef WITH_HYPERSCAN
@@ -524,6 +1520,22 @@ start_worker (struct rspamd_worker *worker)
 			RSPAMD_CONTROL_LOG_PIPE,
 			rspamd_worker_log_pipe_handler,
 			ctx);
+
+#ifdef WITH_HYPERSCAN
+	if (worker->srv->cfg->disable_hyperscan ||
+			rspamd_re_cache_is_hs_loaded (worker->srv->cfg->re_cache)) {
+		worker->ready = TRUE;
+	}
+#else
+	worker->ready = TRUE;
+#endif
+
+	if (worker->ready) {
+		/* File maps have been read by rspamd_map_watch already */
+		rspamd_worker_notify_ready (worker, ctx->ev_base);
+	}
+	/* Otherwise we notify main when hyperscan is loaded */
+
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
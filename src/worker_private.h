@@ -52,6 +52,46 @@ struct rspamd_worker_ctx {
 	guint32 max_tasks;
 	/* Maximum time for task processing */
 	gdouble task_timeout;
+	/* Scan latency for adaptive limit of tasks (0 to disable) */
+	gdouble target_latency;
+	/* Current adaptive limit of tasks being scanned */
+	gdouble tasks_limit;
+	/* Number of tasks being scanned */
+	guint inflight_tasks;
+	/* Time of the last decrease of the adaptive limit */
+	gdouble last_limit_decrease;
+	/* Idle timeout of connections reused for the next request */
+	gdouble keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Threads for cpu bound symbols */
+	guint32 cpu_threads;
+	/* Interval of lua GC steps when no tasks are scanned (0 to disable) */
+	gdouble lua_gc_interval;
+	/* Size of these steps in kilobytes */
+	guint32 lua_gc_idle_step;
+	struct event lua_gc_ev;
+	/* Size of lua heap in kilobytes after the last step */
+	gint lua_gc_last;
+	/* Limit of tasks scanned at once, others are queued (0 to disable) */
+	guint32 max_scanning;
+	/* Limit of large tasks scanned at once */
+	guint32 max_large_scanning;
+	/* Size of messages counted as large */
+	gsize large_message_size;
+	/* Bytes that each client can scan per round of the queue */
+	gsize fair_quantum;
+	/* Request header identifying clients (client address if NULL) */
+	gchar *fair_header;
+	/* Number of tasks being scanned according to the limits above */
+	guint scanning;
+	guint large_scanning;
+	/* Queued tasks of each client and clients with queued tasks */
+	GHashTable *flows;
+	GQueue active_flows;
+	struct event sched_ev;
+	gboolean sched_pending;
+	/* Messages of a batch request scanned at once */
+	guint32 batch_concurrency;
 	/* Events base */
 	struct event_base *ev_base;
 	/* Encryption key */
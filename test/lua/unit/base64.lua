@@ -9,7 +9,12 @@ context("Base64 encodning", function()
       size_t str_len, size_t *outlen);
     void g_free(void *ptr);
     int memcmp(const void *a1, const void *a2, size_t len);
+    void rspamd_cryptobox_init (void);
+    size_t base64_test (bool generic, size_t niters, size_t len);
+    double rspamd_get_ticks (void);
   ]]
+
+  ffi.C.rspamd_cryptobox_init()
   
   local function random_buf(max_size)
     local l = ffi.C.ottery_rand_unsigned() % max_size + 1
@@ -109,4 +114,20 @@ vehemence of any carnal pleasure.]]
       assert_equal(cmp, 0, "fuzz test failed for length: " .. tostring(l))
     end
   end)
-end)
\ No newline at end of file
+  test("Base64 test reference vectors (1KB)", function()
+    local t1 = ffi.C.rspamd_get_ticks()
+    local res = ffi.C.base64_test(true, 100000, 1024)
+    local t2 = ffi.C.rspamd_get_ticks()
+
+    print("Reference base64 (1KB): " .. tostring(t2 - t1) .. " sec")
+    assert_not_equal(res, 0)
+  end)
+  test("Base64 test optimized vectors (1KB)", function()
+    local t1 = ffi.C.rspamd_get_ticks()
+    local res = ffi.C.base64_test(false, 100000, 1024)
+    local t2 = ffi.C.rspamd_get_ticks()
+
+    print("Optimized base64 (1KB): " .. tostring(t2 - t1) .. " sec")
+    assert_not_equal(res, 0)
+  end)
+end)
@@ -0,0 +1,49 @@
+-- DMARC records parser tests
+
+context("DMARC records parser", function()
+  local util = require("rspamd_util")
+
+  test("Parse valid records", function()
+    local cases = {
+      {'v=DMARC1; p=reject; rua=mailto:d@rua.agari.com; ruf=mailto:dk@bounce.paypal.com',
+        {p = 'reject', adkim = 'r', aspf = 'r', pct = 100,
+          rua = 'mailto:d@rua.agari.com'}},
+      {'v=DMARC1\\; P=Quarantine\\; sp=none; pct=50; adkim=s',
+        {p = 'quarantine', sp = 'none', adkim = 's', aspf = 'r', pct = 50}},
+      {'v=DMARC1', {p = 'none', adkim = 'r', aspf = 'r', pct = 100}},
+    }
+
+    for _,c in ipairs(cases) do
+      local policy = util.parse_dmarc_record(c[1])
+      assert_not_nil(policy, c[1])
+      for k,v in pairs(c[2]) do
+        assert_equal(policy[k], v, string.format("%s: '%s' doesn't match '%s'",
+          c[1], k, tostring(policy[k])))
+      end
+      for k,_ in pairs(policy) do
+        assert_not_nil(c[2][k], string.format("%s: unexpected '%s'", c[1], k))
+      end
+    end
+  end)
+
+  test("Parse other records", function()
+    assert_nil(util.parse_dmarc_record('v=spf1 -all'))
+    assert_nil(util.parse_dmarc_record(''))
+    assert_nil(util.parse_dmarc_record('p=reject; v=DMARC1'))
+  end)
+
+  test("Parse invalid records", function()
+    local cases = {
+      'v=DMARC1; p=bad',
+      'v=DMARC1; p=reject; adkim=x',
+      'v=DMARC1; p=reject; pct=101',
+      'v=DMARC1; p=reject; junk',
+    }
+
+    for _,c in ipairs(cases) do
+      local policy, err = util.parse_dmarc_record(c)
+      assert_false(policy, c)
+      assert_not_nil(err, c)
+    end
+  end)
+end)
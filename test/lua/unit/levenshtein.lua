@@ -0,0 +1,59 @@
+--[[
+Copyright (c) 2016, Vsevolod Stakhov <vsevolod@highsecure.ru>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+]]--
+
+context("Levenshtein distance unit test", function()
+  local util = require("rspamd_util")
+
+  local cases = {
+    {'kitten', 'sitting', 3},
+    {'flaw', 'lawn', 2},
+    {'abc', 'abc', 0},
+    {'a', 'abcdef', 5},
+    {'abcdef', 'fedcba', 6},
+  }
+
+  test("Full distance", function()
+    for _,c in ipairs(cases) do
+      local res = util.levenshtein_distance(c[1], c[2])
+      assert_equal(res, c[3],
+        string.format("distance between '%s' and '%s' is %s, expected %s",
+          c[1], c[2], res, c[3]))
+    end
+  end)
+
+  test("Bounded distance", function()
+    for _,c in ipairs(cases) do
+      for max = 0,7 do
+        local res = util.levenshtein_distance(c[1], c[2], max)
+        local expected = c[3]
+        if expected > max then expected = max + 1 end
+        assert_equal(res, expected,
+          string.format("distance between '%s' and '%s' bounded by %s is %s, expected %s",
+            c[1], c[2], max, res, expected))
+      end
+    end
+  end)
+end)
@@ -0,0 +1,103 @@
+context("Shared cache unit tests", function()
+  local rspamd_shared_cache = require "rspamd_shared_cache"
+  local rspamd_mempool = require "rspamd_mempool"
+
+  test("Shared cache set and get", function()
+    local pool = rspamd_mempool.create()
+    local cache = rspamd_shared_cache.create(pool, {bytes = 65536, shards = 2})
+
+    assert_not_nil(cache)
+    assert_true(cache:set('a', 'bcd'))
+    assert_true(cache:set('b', string.rep('x', 1000)))
+    assert_equal(cache:get('a'), 'bcd')
+    assert_equal(cache:get('b'), string.rep('x', 1000))
+    assert_nil(cache:get('c'))
+
+    assert_true(cache:set('a', 'efg'))
+    assert_equal(cache:get('a'), 'efg')
+    assert_true(cache:remove('a'))
+    assert_nil(cache:get('a'))
+
+    -- too large for a shard
+    assert_false(cache:set('c', string.rep('x', 65536)))
+
+    local st = cache:stat()
+    assert_equal(st.elts, 1)
+    assert_equal(st.hits, 3)
+    pool:destroy()
+  end)
+
+  test("Shared cache eviction", function()
+    local pool = rspamd_mempool.create()
+    local cache = rspamd_shared_cache.create(pool, {bytes = 4096, shards = 1})
+
+    for i = 1,1000 do
+      assert_true(cache:set('key' .. tostring(i), string.rep('v', 32)))
+    end
+
+    local st = cache:stat()
+    assert_true(st.bytes <= 4096)
+    assert_true(st.evictions > 0)
+    assert_equal(cache:get('key1000'), string.rep('v', 32))
+    assert_nil(cache:get('key1'))
+    pool:destroy()
+  end)
+
+  test("Shared cache leaky buckets", function()
+    local pool = rspamd_mempool.create()
+    local cache = rspamd_shared_cache.create(pool, {bytes = 65536, shards = 2})
+    local now = 1000
+
+    assert_equal(cache:bucket_get('bk', 1, now), 0)
+    -- new bucket is flushed immediately
+    local level, taken = cache:bucket_add('bk', 1, 1, 60, 3, 10, now)
+    assert_equal(level, 1)
+    assert_equal(taken, 1)
+    level, taken = cache:bucket_add('bk', 1, 1, 60, 3, 10, now)
+    assert_equal(level, 2)
+    assert_equal(taken, 0)
+    level, taken = cache:bucket_add('bk', 1, 1, 60, 3, 10, now)
+    assert_equal(taken, 0)
+    -- drift is reached
+    level, taken = cache:bucket_add('bk', 1, 1, 60, 3, 10, now)
+    assert_equal(level, 4)
+    assert_equal(taken, 3)
+    -- leaked by 2 seconds
+    assert_equal(cache:bucket_get('bk', 1, now + 2), 2)
+    level, taken = cache:bucket_add('bk', 1, 1, 60, 3, 10, now + 2)
+    assert_equal(level, 3)
+    -- external level plus pending delta
+    assert_equal(cache:bucket_sync('bk', 1, 10, 60, now + 2), 11)
+    -- interval is reached
+    level, taken = cache:bucket_add('bk', 1, 0, 60, 3, 10, now + 11)
+    assert_equal(level, 2)
+    assert_equal(taken, 1)
+    pool:destroy()
+  end)
+
+  test("Shared cache serialization", function()
+    local pool = rspamd_mempool.create()
+    local cache = rspamd_shared_cache.create(pool, {bytes = 65536, shards = 2})
+    local now = os.time()
+
+    assert_true(cache:set('a', 'bcd'))
+    assert_true(cache:set('b', string.rep('x', 100), 60))
+    assert_true(cache:set('c', 'short', 1))
+
+    local data, n = cache:serialize(now)
+    assert_equal(n, 3)
+
+    local copy = rspamd_shared_cache.create(pool, {bytes = 65536, shards = 4})
+    -- element with ttl 1 has expired
+    assert_equal(copy:deserialize(data, now + 10), 2)
+    assert_equal(copy:get('a'), 'bcd')
+    assert_equal(copy:get('b'), string.rep('x', 100))
+    assert_nil(copy:get('c'))
+    -- the original expiration time is kept
+    local _, left = copy:serialize(now + 61)
+    assert_equal(left, 1)
+
+    assert_nil(copy:deserialize(data:sub(1, #data - 1)))
+    pool:destroy()
+  end)
+end)
@@ -87,6 +87,34 @@ context("SMTP address check functions", function()
       assert_nil(st, "should not be able to parse " .. case)
     end, cases_invalid)
   end)
+  test("Parse mime addrs", function()
+    local cases = {
+      {'John Smith <js@example.com>',
+        {{name = 'John Smith', addr = 'js@example.com', user = 'js', domain = 'example.com'}}},
+      {'"Smith, John" <js@example.com>, b@example.org',
+        {{name = 'Smith, John', addr = 'js@example.com'}, {name = '', addr = 'b@example.org'}}},
+      {'a@example.com (Al B)', {{name = 'Al B', addr = 'a@example.com', user = 'a'}}},
+      {'group: a@example.com, C <c@example.com>; d@example.com',
+        {{addr = 'a@example.com'}, {name = 'C', addr = 'c@example.com'}, {addr = 'd@example.com'}}},
+      {'<@r1,@r2:x@example.com>', {{addr = 'x@example.com', domain = 'example.com'}}},
+      {'=?utf-8?b?0J/RgNC40LLQtdGC?= <p@example.ru>', {{name = 'Привет', addr = 'p@example.ru'}}},
+    }
+
+    each(function(case)
+      local res = util.parse_mail_address(case[1])
+      assert_not_nil(res, "should be able to parse " .. case[1])
+      assert_equal(#case[2], #res, "invalid number of addresses in " .. case[1])
+
+      for i,ex in ipairs(case[2]) do
+        each(function(k, v)
+          assert_equal(v, res[i][k], k .. " mismatch for " .. case[1])
+        end, ex)
+      end
+    end, cases)
+
+    assert_nil(util.parse_mail_address('undisclosed-recipients:;'))
+  end)
+
   test("Speed test", function()
     local case = '<@domain1,@domain2,@domain3:abc%d@example.com>'
     local niter = 100000
@@ -0,0 +1,109 @@
+-- Test substring search routines
+
+context("Substring search", function()
+  local ffi = require("ffi")
+  ffi.cdef[[
+    long rspamd_substring_search (const char *in, size_t inlen,
+      const char *srch, size_t srchlen);
+    long rspamd_substring_search_caseless (const char *in, size_t inlen,
+      const char *srch, size_t srchlen);
+    long rspamd_substring_search_twoway (const char *in, int inlen,
+      const char *srch, int srchlen);
+    unsigned ottery_rand_unsigned(void);
+    double rspamd_get_ticks (void);
+  ]]
+
+  local function lua_find(s, pat, caseless)
+    if caseless then
+      s = string.lower(s)
+      pat = string.lower(pat)
+    end
+    local r = string.find(s, pat, 1, true)
+
+    if r then return r - 1 end
+    return -1
+  end
+
+  test("Substring search cases", function()
+    local cases = {
+      {"abc", "abc", 0},
+      {"abc", "c", 2},
+      {"abcd", "bc", 1},
+      {"abc", "abcd", -1},
+      {"Header: value\r\n\r\nbody", "\r\n\r\n", 13},
+      {string.rep("a", 100) .. "ab", "aab", 99},
+      {string.rep("ab", 50) .. "abc", "bc", 101},
+      {string.rep("x", 1000) .. "DKIM-Signature", "DKIM-Signature", 1000},
+      {string.rep("x", 1000) .. "DKIM-Signatur", "DKIM-Signature", -1},
+    }
+
+    for _,c in ipairs(cases) do
+      local r = tonumber(ffi.C.rspamd_substring_search(c[1], #c[1], c[2], #c[2]))
+      assert_equal(r, c[3], string.format("search %s: %d, expected %d",
+          c[2], r, c[3]))
+      r = tonumber(ffi.C.rspamd_substring_search_twoway(c[1], #c[1], c[2], #c[2]))
+      assert_equal(r, c[3], string.format("twoway %s: %d, expected %d",
+          c[2], r, c[3]))
+      r = tonumber(ffi.C.rspamd_substring_search_caseless(c[1]:upper(), #c[1],
+          c[2], #c[2]))
+      assert_equal(r, c[3], string.format("caseless %s: %d, expected %d",
+          c[2], r, c[3]))
+    end
+  end)
+
+  test("Substring search fuzz", function()
+    local alpha = {'a', 'b', 'A', 'B'}
+
+    for _ = 1,1000 do
+      local t = {}
+      local p = {}
+      local len = ffi.C.ottery_rand_unsigned() % 200
+      local plen = ffi.C.ottery_rand_unsigned() % 40 + 1
+
+      for i = 1,len do
+        t[i] = alpha[ffi.C.ottery_rand_unsigned() % #alpha + 1]
+      end
+      for i = 1,plen do
+        p[i] = alpha[ffi.C.ottery_rand_unsigned() % 2 + 1]
+      end
+
+      local s = table.concat(t)
+      local pat = table.concat(p)
+      local r = tonumber(ffi.C.rspamd_substring_search(s, #s, pat, #pat))
+      assert_equal(r, lua_find(s, pat, false), "search failed for " .. pat)
+      r = tonumber(ffi.C.rspamd_substring_search_twoway(s, #s, pat, #pat))
+      assert_equal(r, lua_find(s, pat, false), "twoway failed for " .. pat)
+      r = tonumber(ffi.C.rspamd_substring_search_caseless(s, #s, pat, #pat))
+      assert_equal(r, lua_find(s, pat, true), "caseless failed for " .. pat)
+    end
+  end)
+
+  local function bench(name, func, pat)
+    local t = {}
+
+    for i = 1,65536 do
+      t[i] = string.char(ffi.C.ottery_rand_unsigned() % 26 + 97)
+    end
+
+    local str = table.concat(t)
+    local niters = 1000
+    local r
+    local t1 = ffi.C.rspamd_get_ticks()
+    for _ = 1,niters do
+      r = func(str, #str, pat, #pat)
+    end
+    local t2 = ffi.C.rspamd_get_ticks()
+
+    print(string.format("%s (%dB needle, 64KB): %s sec", name, #pat,
+        tostring(t2 - t1)))
+    assert_equal(tonumber(r), lua_find(str, pat, name == "Caseless search"))
+  end
+
+  for _,pat in ipairs({"\r\n\r\n", "DKIM-Signature", string.rep("x", 48)}) do
+    test("Substring search speed (" .. #pat .. "B)", function()
+      bench("Search", ffi.C.rspamd_substring_search, pat)
+      bench("Caseless search", ffi.C.rspamd_substring_search_caseless, pat)
+      bench("Two-way search", ffi.C.rspamd_substring_search_twoway, pat)
+    end)
+  end
+end)
@@ -0,0 +1,56 @@
+-- Opaque text objects tests
+
+context("Text objects", function()
+  local util = require "rspamd_util"
+  local rspamd_trie = require "rspamd_trie"
+  local hash = require "rspamd_cryptobox_hash"
+
+  local function text(s)
+    return util.decode_base64(util.encode_base64(s):str())
+  end
+
+  test("Slices", function()
+    local t = text('hello world')
+    local cases = {
+      {{1, 5}, 'hello'},
+      {{7}, 'world'},
+      {{-5, -1}, 'world'},
+      {{-100, 2}, 'he'},
+      {{5, 100}, 'o world'},
+      {{6, 5}, ''},
+    }
+
+    for _,c in ipairs(cases) do
+      local s = t:sub(c[1][1], c[1][2])
+      assert_equal(s:str(), c[2])
+      assert_equal(s:len(), #c[2])
+    end
+
+    -- Slices of slices
+    assert_equal(t:sub(7):sub(1, 3):str(), 'wor')
+  end)
+
+  test("Comparison", function()
+    assert_true(text('abc') == text('abc'))
+    assert_false(text('abc') == text('abcd'))
+    assert_true(text('abc') < text('abcd'))
+    assert_true(text('abd') > text('abcd'))
+    assert_true(text('abc') <= text('abc'))
+  end)
+
+  test("Functions accept texts", function()
+    assert_equal(util.levenshtein_distance(text('test'), 'text'), 1)
+    assert_true(util.strequal_caseless(text('TeSt'), 'test'))
+    assert_false(util.strequal_caseless('test', 'other'))
+
+    local trie = rspamd_trie.create({'world'})
+    assert_true(trie:match(text('hello world')))
+    assert_true(trie:match({'hello', text('world')}))
+
+    local h1 = hash.create()
+    h1:update(text('hello'))
+    local h2 = hash.create()
+    h2:update('hello')
+    assert_equal(h1:hex(), h2:hex())
+  end)
+end)
@@ -108,4 +108,30 @@ context("Text tokenization test", function()
       end
     end
   end)
+  test("Tokenize text to hashes and views", function()
+    local text = "Lorem ipsum dolor LOREM, word,,,,,word    ipsum"
+    local words = util.tokenize_text(text)
+    local hashes = util.tokenize_text_hashes(text)
+
+    assert_equal(#hashes, #words)
+    assert_equal(hashes[1], hashes[4], "hashes must be case insensitive")
+    assert_equal(hashes[5], hashes[6])
+    assert_equal(hashes[2], hashes[7])
+    assert_not_equal(hashes[1], hashes[2])
+
+    local seen = {}
+    local n = util.tokenize_text_cb(text, function(w, i)
+      assert_equal(i, #seen + 1)
+      table.insert(seen, w:str())
+    end)
+    assert_equal(n, #words)
+    for i,wrd in ipairs(words) do
+      assert_equal(seen[i], wrd)
+    end
+
+    n = util.tokenize_text_cb(text, function(w, i)
+      return i < 2
+    end)
+    assert_equal(n, 2, "iteration must stop on false")
+  end)
 end)
\ No newline at end of file
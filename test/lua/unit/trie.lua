@@ -60,4 +60,71 @@ context("Trie search functions", function()
     end
 
   end)
+
+  test("Trie search in multiple inputs", function()
+    local trie = t.create({'test', 'she'})
+    assert_not_nil(trie, "cannot create trie")
+
+    local res = {}
+    local function cb(idx, pos)
+      table.insert(res, {pos, idx})
+
+      return 0
+    end
+
+    -- Matches must not span inputs
+    local ret = trie:match({'te', 'st', 'she test'}, cb)
+    assert_true(ret, 'no matches in multiple inputs')
+    table.sort(res, function(a, b) return a[1] < b[1] end)
+    assert_equal(2, #res, 'invalid number of matches: ' .. logger.slog('%s', res))
+    assert_equal(2, res[1][2])
+    assert_equal(1, res[2][2])
+
+    ret = trie:match({'non', 'existent'}, cb)
+    assert_false(ret, 'false match in multiple inputs')
+
+    -- Inputs could be values of any keys
+    res = {}
+    ret = trie:match({subject = 'test', 'she', [5] = 'no'}, cb)
+    assert_true(ret, 'no matches in key/value inputs')
+    assert_equal(2, #res, 'invalid number of matches: ' .. logger.slog('%s', res))
+
+    assert_false(pcall(function() trie:match({'test', 1}, cb) end),
+        'invalid input is silently skipped')
+  end)
+  test("Trie collect matches", function()
+    local trie = t.create({'test', 'est', 'she'})
+    assert_not_nil(trie, "cannot create trie")
+
+    -- Each pattern is reported once
+    local res = trie:match('she test test')
+    assert_not_nil(res, 'no matches collected')
+    table.sort(res)
+    assert_equal(3, #res, 'invalid number of matches: ' .. logger.slog('%s', res))
+    assert_equal(1, res[1])
+    assert_equal(2, res[2])
+    assert_equal(3, res[3])
+
+    res = trie:match({'te', 'st', 'est'})
+    assert_equal(1, #res)
+    assert_equal(2, res[1])
+
+    assert_false(trie:match('non-existent'), 'false match in collect mode')
+  end)
+
+  test("Trie sharing", function()
+    local t1 = t.create({'abc', 'def'})
+    local t2 = t.create({'abc', 'def'})
+    local t3 = t.create({'abcdef'})
+    assert_not_nil(t1, "cannot create trie")
+    assert_not_nil(t2, "cannot create trie")
+    assert_not_nil(t3, "cannot create trie")
+
+    t1 = nil
+    collectgarbage()
+
+    local res = t2:match('xdefabc')
+    assert_equal(2, #res)
+    assert_false(t3:match('abc def'), 'patterns of different tries are mixed')
+  end)
 end)
@@ -94,6 +94,12 @@ context("URL check functions", function()
       {"http://twitter.com#test", true, {
         host = 'twitter.com', fragment = 'test'
       }},
+      {"http://www.example.co.uk", true, {
+        host = 'www.example.co.uk', tld = 'example.co.uk'
+      }},
+      {"http://www.test.ck", true, {
+        host = 'www.test.ck', tld = 'www.test.ck'
+      }},
     }
 
     for _,c in ipairs(cases) do
@@ -5,12 +5,16 @@ context("UTF8 check functions", function()
   ffi.cdef[[
     void rspamd_str_lc_utf8 (char *str, unsigned int size);
     void rspamd_str_lc (char *str, unsigned int size);
+    int rspamd_lc_cmp (const char *s, const char *d, size_t l);
+    double rspamd_get_ticks (void);
   ]]
 
   test("UTF lowercase", function()
     local cases = {
       {"АбЫрвАлг", "абырвалг"},
-      {"АAБBвc", "аaбbвc"}
+      {"АAБBвc", "аaбbвc"},
+      {"Received-SPF: PASS Ёжик В Тумане", "received-spf: pass ёжик в тумане"},
+      {"ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`@ЖЖ", "abcdefghijklmnopqrstuvwxyz[\\]^_`@жж"}
     }
     
     for _,c in ipairs(cases) do
@@ -26,7 +30,9 @@ context("UTF8 check functions", function()
       {"AbCdEf", "abcdef"},
       {"A", "a"},
       {"AaAa", "aaaa"},
-      {"AaAaAaAa", "aaaaaaaa"}
+      {"AaAaAaAa", "aaaaaaaa"},
+      {"Content-Transfer-Encoding", "content-transfer-encoding"},
+      {"@ABCDEFGHIJKLMNOPQRSTUVWXYZ[`{\xc0\xdf", "@abcdefghijklmnopqrstuvwxyz[`{\xc0\xdf"}
     }
     
     for _,c in ipairs(cases) do
@@ -37,4 +43,34 @@ context("UTF8 check functions", function()
       assert_equal(s, c[2])
     end
   end)
-end)
\ No newline at end of file
+  test("ASCII caseless compare", function()
+    local cases = {
+      {"Content-Transfer-Encoding", "content-transfer-encoding", true},
+      {"Content-Transfer-Encoding", "content-transfer-encodinG", true},
+      {"Content-Transfer-Encoding", "content-transfer-encodinh", false},
+      {"X-Spam-Status-Extended-Header", "X-SPAM-STATUS-EXTENDED-HEADEX", false},
+      {"abc", "ABd", false},
+      {"[", "{", false},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = ffi.C.rspamd_lc_cmp(c[1], c[2], #c[1]) == 0
+      assert_equal(res, c[3], c[1] .. " vs " .. c[2])
+    end
+  end)
+  test("ASCII lowercase speed", function()
+    local str = string.rep("Content-Type: Text/Plain; Charset=UTF-8 ", 100)
+    local buf = ffi.new("char[?]", #str + 1)
+    local niters = 100000
+
+    local t1 = ffi.C.rspamd_get_ticks()
+    for _ = 1,niters do
+      ffi.copy(buf, str)
+      ffi.C.rspamd_str_lc(buf, #str)
+    end
+    local t2 = ffi.C.rspamd_get_ticks()
+
+    print("Lowercase (" .. tostring(#str) .. "B): " .. tostring(t2 - t1) .. " sec")
+    assert_equal(ffi.string(buf), string.lower(str))
+  end)
+end)
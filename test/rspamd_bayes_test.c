@@ -0,0 +1,125 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "classifiers/classifiers.h"
+#include "ottery.h"
+#include <math.h>
+
+static const guint ntokens = 10000;
+static const guint niter = 100;
+
+static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
+
+#define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
+/* Per token scoring as it was done before blocks were introduced */
+static void
+bayes_score_tokens_scalar (const gdouble *spam_counts, const gdouble *ham_counts,
+		const guint *window_idx, guint len,
+		guint64 spam_learns, guint64 ham_learns,
+		struct bayes_tokens_score *res)
+{
+	guint i;
+	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
+		ham_prob, fw, w, norm_sum, norm_sub, total_count;
+
+	for (i = 0; i < len; i ++) {
+		total_count = spam_counts[i] + ham_counts[i];
+		res->total_hits += total_count;
+
+		if (total_count > 0) {
+			spam_freq = (spam_counts[i] / MAX (1., (double)spam_learns));
+			ham_freq = (ham_counts[i] / MAX (1., (double)ham_learns));
+			spam_prob = spam_freq / (spam_freq + ham_freq);
+			ham_prob = ham_freq / (spam_freq + ham_freq);
+			fw = feature_weight[window_idx[i] % G_N_ELEMENTS (feature_weight)];
+			norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
+			norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
+			w = (norm_sub) / (norm_sum) *
+					(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+			bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
+			bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
+			res->spam_prob += log (bayes_spam_prob);
+			res->ham_prob += log (bayes_ham_prob);
+			res->processed_tokens ++;
+		}
+	}
+}
+
+void
+rspamd_bayes_test_func (void)
+{
+	gdouble *spam_counts, *ham_counts;
+	guint *window_idx;
+	struct bayes_tokens_score scalar, blocks;
+	gdouble t1, t2;
+	guint i;
+
+	spam_counts = g_malloc (sizeof (*spam_counts) * ntokens);
+	ham_counts = g_malloc (sizeof (*ham_counts) * ntokens);
+	window_idx = g_malloc (sizeof (*window_idx) * ntokens);
+
+	for (i = 0; i < ntokens; i ++) {
+		/* About third of tokens are unknown for each class */
+		spam_counts[i] = ottery_rand_range (2) ? ottery_rand_range (1000) : 0;
+		ham_counts[i] = ottery_rand_range (2) ? ottery_rand_range (1000) : 0;
+		window_idx[i] = ottery_rand_range (6) + 1;
+	}
+
+	memset (&scalar, 0, sizeof (scalar));
+	memset (&blocks, 0, sizeof (blocks));
+	bayes_score_tokens_scalar (spam_counts, ham_counts, window_idx, ntokens,
+			100000, 80000, &scalar);
+	bayes_score_tokens (spam_counts, ham_counts, window_idx, ntokens,
+			100000, 80000, &blocks);
+
+	g_assert (scalar.processed_tokens == blocks.processed_tokens);
+	g_assert (scalar.total_hits == blocks.total_hits);
+	g_assert (fabs (scalar.spam_prob - blocks.spam_prob) <=
+			fabs (scalar.spam_prob) * 1e-9);
+	g_assert (fabs (scalar.ham_prob - blocks.ham_prob) <=
+			fabs (scalar.ham_prob) * 1e-9);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		memset (&scalar, 0, sizeof (scalar));
+		bayes_score_tokens_scalar (spam_counts, ham_counts, window_idx, ntokens,
+				100000, 80000, &scalar);
+	}
+
+	t2 = rspamd_get_ticks ();
+	msg_info ("scalar scoring of %ud tokens: %.6f", ntokens,
+			(t2 - t1) / niter);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		memset (&blocks, 0, sizeof (blocks));
+		bayes_score_tokens (spam_counts, ham_counts, window_idx, ntokens,
+				100000, 80000, &blocks);
+	}
+
+	t2 = rspamd_get_ticks ();
+	msg_info ("blocks scoring of %ud tokens: %.6f", ntokens,
+			(t2 - t1) / niter);
+
+	g_free (spam_counts);
+	g_free (ham_counts);
+	g_free (window_idx);
+}
@@ -0,0 +1,595 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for core kernels. Every dataset is generated from a fixed
+ * seed, so the numbers are comparable between runs and builds. Each kernel
+ * prints a single JSON line to stdout:
+ *
+ * {"name":"...","iterations":N,"bytes":N,"time":S,"ops_per_sec":R,"mb_per_sec":R}
+ *
+ * Run with `rspamd-test -m perf -p /rspamd/bench`
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "radix.h"
+#include "url.h"
+#include "html.h"
+#include "multipattern.h"
+#include "shingles.h"
+#include "hash.h"
+#include "cryptobox.h"
+#include "stat_internal.h"
+#include "tests.h"
+
+static const guint64 bench_seed = 0x7273706d6462656eULL;
+static const gsize text_len = 64 * 1024;
+static const guint nwords = 512;
+static const guint npatterns = 1024;
+static const guint nnetworks = 10000;
+static const guint naddrs = 65536;
+
+static guint64 bench_state;
+
+/* xorshift64*: tiny and fully determined by the seed, unlike ottery */
+static guint64
+bench_rand (void)
+{
+	bench_state ^= bench_state >> 12;
+	bench_state ^= bench_state << 25;
+	bench_state ^= bench_state >> 27;
+
+	return bench_state * 0x2545F4914F6CDD1DULL;
+}
+
+static guint
+bench_rand_range (guint max)
+{
+	return bench_rand () % max;
+}
+
+static void
+bench_report (const gchar *name, guint64 iters, gsize bytes, gdouble elapsed)
+{
+	gdouble ops, mbs;
+
+	if (elapsed <= 0) {
+		elapsed = 1e-9;
+	}
+
+	ops = iters / elapsed;
+	mbs = bytes / elapsed / (1024.0 * 1024.0);
+
+	rspamd_printf ("{\"name\":\"%s\",\"iterations\":%uL,\"bytes\":%z,"
+			"\"time\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f}\n",
+			name, iters, bytes, elapsed, ops, mbs);
+	g_test_maximized_result (ops, "%s: %.1f ops/sec", name, ops);
+}
+
+static gchar **
+bench_generate_vocabulary (guint cnt)
+{
+	gchar **res;
+	guint i, j, len;
+
+	res = g_malloc0 ((cnt + 1) * sizeof (gchar *));
+
+	for (i = 0; i < cnt; i ++) {
+		len = bench_rand_range (10) + 2;
+		res[i] = g_malloc (len + 1);
+
+		for (j = 0; j < len; j ++) {
+			res[i][j] = 'a' + bench_rand_range (26);
+		}
+
+		res[i][len] = '\0';
+	}
+
+	return res;
+}
+
+/*
+ * Generates text of roughly `len` bytes mixing vocabulary words with urls
+ * and emails, wrapped in paragraphs and links if `html` is TRUE
+ */
+static GString *
+bench_generate_text (gchar **vocab, gsize len, gboolean html)
+{
+	GString *res;
+	const gchar *w;
+	guint r, n = 0;
+
+	res = g_string_sized_new (len + 256);
+
+	if (html) {
+		g_string_append (res, "<html><head><title>bench</title></head>"
+				"<body><p>");
+	}
+
+	while (res->len < len) {
+		w = vocab[bench_rand_range (nwords)];
+		r = bench_rand_range (64);
+
+		if (r == 0) {
+			if (html) {
+				rspamd_printf_gstring (res, "<a href=\"http://www.%s.com/%s\">"
+						"%s</a> ", w, vocab[bench_rand_range (nwords)], w);
+			}
+			else {
+				rspamd_printf_gstring (res, "http://www.%s.com/%s?id=%ud ", w,
+						vocab[bench_rand_range (nwords)], n);
+			}
+		}
+		else if (r == 1) {
+			rspamd_printf_gstring (res, "%s@%s.org ", w,
+					vocab[bench_rand_range (nwords)]);
+		}
+		else if (r == 2 && html) {
+			g_string_append (res, "</p>\n<p>&quot;");
+		}
+		else {
+			g_string_append (res, w);
+			g_string_append_c (res, (n % 16 == 15) ? '\n' : ' ');
+		}
+
+		n ++;
+	}
+
+	if (html) {
+		g_string_append (res, "</p></body></html>");
+	}
+
+	return res;
+}
+
+static void
+bench_mempool (void)
+{
+	rspamd_mempool_t *pool;
+	gsize sizes[4096], total = 0;
+	guint i, j, niter = 256;
+	gdouble t1, t2;
+
+	for (i = 0; i < G_N_ELEMENTS (sizes); i ++) {
+		sizes[i] = bench_rand_range (248) + 8;
+	}
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+
+		for (j = 0; j < G_N_ELEMENTS (sizes); j ++) {
+			g_assert (rspamd_mempool_alloc (pool, sizes[j]) != NULL);
+			total += sizes[j];
+		}
+
+		rspamd_mempool_delete (pool);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("mempool_alloc", (guint64)niter * G_N_ELEMENTS (sizes),
+			total, t2 - t1);
+}
+
+static void
+bench_radix (void)
+{
+	radix_compressed_t *tree;
+	GString *list;
+	rspamd_inet_addr_t **addrs;
+	uintptr_t *results;
+	struct in_addr ina;
+	guint i, j, niter = 16, found = 0;
+	gdouble t1, t2;
+
+	tree = radix_create_compressed ();
+	list = g_string_sized_new (nnetworks * 20);
+
+	for (i = 0; i < nnetworks; i ++) {
+		ina.s_addr = bench_rand ();
+		rspamd_printf_gstring (list, "%s%s/%ud", i > 0 ? "," : "",
+				inet_ntoa (ina), bench_rand_range (2) ? 16 : 24);
+	}
+
+	rspamd_radix_add_iplist (list->str, ",", tree, GUINT_TO_POINTER (1));
+	g_string_free (list, TRUE);
+
+	addrs = g_malloc (naddrs * sizeof (*addrs));
+	results = g_malloc (naddrs * sizeof (*results));
+
+	for (i = 0; i < naddrs; i ++) {
+		ina.s_addr = bench_rand ();
+		addrs[i] = rspamd_inet_address_new (AF_INET, &ina);
+	}
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		for (j = 0; j < naddrs; j ++) {
+			if (radix_find_compressed_addr (tree, addrs[j]) != RADIX_NO_VALUE) {
+				found ++;
+			}
+		}
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("radix_find_compressed_addr", (guint64)niter * naddrs, 0,
+			t2 - t1);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		radix_find_compressed_addr_batch (tree,
+				(const rspamd_inet_addr_t **)addrs, naddrs, results);
+
+		for (j = 0; j < naddrs; j ++) {
+			if (results[j] != RADIX_NO_VALUE) {
+				found --;
+			}
+		}
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("radix_find_compressed_addr_batch", (guint64)niter * naddrs,
+			0, t2 - t1);
+
+	/* Both lookup flavours must agree */
+	g_assert (found == 0);
+
+	for (i = 0; i < naddrs; i ++) {
+		rspamd_inet_address_destroy (addrs[i]);
+	}
+
+	g_free (addrs);
+	g_free (results);
+	radix_destroy_compressed (tree);
+}
+
+static void
+bench_url_cb (struct rspamd_url *url, gsize start_offset, gsize end_offset,
+		void *ud)
+{
+	guint *nurls = ud;
+
+	(*nurls) ++;
+}
+
+static void
+bench_url (GString *text)
+{
+	rspamd_mempool_t *pool;
+	guint i, niter = 64, nurls = 0;
+	gdouble t1, t2;
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+		rspamd_url_find_multiple (pool, text->str, text->len, FALSE,
+				bench_url_cb, &nurls);
+		rspamd_mempool_delete (pool);
+	}
+
+	t2 = rspamd_get_ticks ();
+	g_assert (nurls > 0);
+	bench_report ("url_find_multiple", niter, (gsize)niter * text->len,
+			t2 - t1);
+}
+
+static void
+bench_html (GString *text)
+{
+	rspamd_mempool_t *pool;
+	struct html_content *hc;
+	GByteArray *in, *res;
+	guint i, niter = 64;
+	gdouble t1, t2;
+
+	in = g_byte_array_sized_new (text->len);
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		/* Parser modifies input in place */
+		g_byte_array_set_size (in, 0);
+		g_byte_array_append (in, text->str, text->len);
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+		hc = rspamd_mempool_alloc0 (pool, sizeof (*hc));
+		res = rspamd_html_process_part (pool, hc, in);
+		g_assert (res != NULL && res->len > 0);
+		g_byte_array_free (res, TRUE);
+		rspamd_mempool_delete (pool);
+	}
+
+	t2 = rspamd_get_ticks ();
+	g_byte_array_free (in, TRUE);
+	bench_report ("html_process_part", niter, (gsize)niter * text->len,
+			t2 - t1);
+}
+
+static gint
+bench_multipattern_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	return 0;
+}
+
+static void
+bench_multipattern (gchar **vocab, GString *text)
+{
+	struct rspamd_multipattern *mp;
+	GError *err = NULL;
+	guint i, niter = 64, nfound = 0, total = 0;
+	gchar pat[64];
+	gdouble t1, t2;
+
+	mp = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_ICASE);
+
+	for (i = 0; i < npatterns; i ++) {
+		/* Mix plain words with longer domain like patterns */
+		if (i % 2 == 0) {
+			rspamd_multipattern_add_pattern (mp, vocab[i % nwords], 0);
+		}
+		else {
+			rspamd_snprintf (pat, sizeof (pat), "%s.%s",
+					vocab[bench_rand_range (nwords)],
+					i % 4 == 1 ? "com" : "org");
+			rspamd_multipattern_add_pattern (mp, pat, 0);
+		}
+	}
+
+	g_assert (rspamd_multipattern_compile (mp, &err));
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_multipattern_lookup (mp, text->str, text->len,
+				bench_multipattern_cb, NULL, &nfound);
+		total += nfound;
+	}
+
+	t2 = rspamd_get_ticks ();
+	g_assert (total > 0);
+	bench_report ("multipattern_lookup", niter, (gsize)niter * text->len,
+			t2 - t1);
+	rspamd_multipattern_destroy (mp);
+}
+
+static GArray *
+bench_split_words (GString *text)
+{
+	GArray *res;
+	rspamd_ftok_t w;
+	const gchar *p, *end, *c;
+
+	res = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_ftok_t), 8192);
+	p = text->str;
+	end = p + text->len;
+
+	while (p < end) {
+		c = p;
+
+		while (p < end && !g_ascii_isspace (*p)) {
+			p ++;
+		}
+
+		if (p > c) {
+			w.begin = c;
+			w.len = p - c;
+			g_array_append_val (res, w);
+		}
+
+		p ++;
+	}
+
+	return res;
+}
+
+static void
+bench_tokenizer (GArray *words, gsize bytes)
+{
+	struct rspamd_stat_ctx ctx;
+	struct rspamd_stat_tokens *tokens;
+	rspamd_mempool_t *pool;
+	guint i, niter = 64;
+	gdouble t1, t2;
+
+	memset (&ctx, 0, sizeof (ctx));
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	ctx.tkcf = rspamd_tokenizer_osb_get_config (pool, NULL, NULL);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		tokens = rspamd_stat_tokens_new (pool, 0, words->len * 5);
+		rspamd_tokenizer_osb (&ctx, pool, words, FALSE, NULL, tokens);
+		g_assert (tokens->len > 0);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("tokenizer_osb", niter, niter * bytes, t2 - t1);
+	rspamd_mempool_delete (pool);
+}
+
+static void
+bench_shingles (GArray *words, gsize bytes)
+{
+	struct rspamd_shingle *sgl;
+	guchar key[16];
+	guint i, niter = 64;
+	gdouble t1, t2;
+
+	for (i = 0; i < sizeof (key); i ++) {
+		key[i] = bench_rand ();
+	}
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		sgl = rspamd_shingles_generate (words, key, NULL,
+				rspamd_shingles_default_filter, NULL);
+		g_assert (sgl != NULL);
+		g_free (sgl);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("shingles_generate", niter, niter * bytes, t2 - t1);
+}
+
+static void
+bench_cryptobox (void)
+{
+	guchar *buf, out[rspamd_cryptobox_HASHBYTES];
+	rspamd_nm_t nm;
+	rspamd_nonce_t nonce;
+	rspamd_mac_t mac;
+	rspamd_sipkey_t sk;
+	gsize i, len = text_len;
+	guint niter = 256;
+	gdouble t1, t2;
+
+	buf = g_malloc (len);
+
+	for (i = 0; i < len; i ++) {
+		buf[i] = bench_rand ();
+	}
+
+	for (i = 0; i < sizeof (nm); i ++) {
+		nm[i] = bench_rand ();
+	}
+
+	for (i = 0; i < sizeof (nonce); i ++) {
+		nonce[i] = bench_rand ();
+	}
+
+	for (i = 0; i < sizeof (sk); i ++) {
+		sk[i] = bench_rand ();
+	}
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_cryptobox_hash (out, buf, len, NULL, 0);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("cryptobox_hash", niter, (gsize)niter * len, t2 - t1);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_cryptobox_siphash (out, buf, len, sk);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("cryptobox_siphash", niter, (gsize)niter * len, t2 - t1);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_cryptobox_encrypt_nm_inplace (buf, len, nonce, nm, mac,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("cryptobox_encrypt_25519", niter, (gsize)niter * len,
+			t2 - t1);
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_cryptobox_encrypt_nm_inplace (buf, len, nonce, nm, mac,
+				RSPAMD_CRYPTOBOX_MODE_NIST);
+	}
+
+	t2 = rspamd_get_ticks ();
+	bench_report ("cryptobox_encrypt_nist", niter, (gsize)niter * len,
+			t2 - t1);
+
+	g_free (buf);
+}
+
+static void
+bench_lru (void)
+{
+	rspamd_lru_hash_t *hash;
+	guint *keys, i, nkeys = 1 << 20, hits = 0;
+	time_t now = 1000;
+	gdouble t1, t2;
+
+	hash = rspamd_lru_hash_new_full (4096, NULL, NULL,
+			g_direct_hash, g_direct_equal);
+	keys = g_malloc (nkeys * sizeof (*keys));
+
+	for (i = 0; i < nkeys; i ++) {
+		/* Working set is twice the size of the cache */
+		keys[i] = bench_rand_range (8192) + 1;
+	}
+
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < nkeys; i ++) {
+		if (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (keys[i]), now)) {
+			hits ++;
+		}
+		else {
+			rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (keys[i]),
+					GUINT_TO_POINTER (keys[i]), now, 0);
+		}
+	}
+
+	t2 = rspamd_get_ticks ();
+	g_assert (hits > 0);
+	bench_report ("lru_lookup_insert", nkeys, 0, t2 - t1);
+
+	g_free (keys);
+	rspamd_lru_hash_destroy (hash);
+}
+
+void
+rspamd_bench_test_func (void)
+{
+	gchar **vocab;
+	GString *text, *html;
+	GArray *words;
+
+	bench_state = bench_seed;
+	vocab = bench_generate_vocabulary (nwords);
+	text = bench_generate_text (vocab, text_len, FALSE);
+	html = bench_generate_text (vocab, text_len, TRUE);
+	words = bench_split_words (text);
+
+	bench_mempool ();
+	bench_radix ();
+	bench_url (text);
+	bench_html (html);
+	bench_multipattern (vocab, text);
+	bench_tokenizer (words, text->len);
+	bench_shingles (words, text->len);
+	bench_cryptobox ();
+	bench_lru ();
+
+	g_array_free (words, TRUE);
+	g_string_free (text, TRUE);
+	g_string_free (html, TRUE);
+	g_strfreev (vocab);
+}
@@ -152,6 +152,101 @@ create_constrainted_split (struct rspamd_cryptobox_segment *seg, int mseg,
 	return used;
 }
 
+static void
+check_verify_batch (enum rspamd_cryptobox_mode sig_mode)
+{
+	rspamd_sig_pk_t *pks;
+	rspamd_sig_sk_t sk;
+	guchar (*sigs)[rspamd_cryptobox_MAX_SIGBYTES], (*msgs)[64];
+	const guchar *psigs[32], *pmsgs[32], *ppks[32];
+	gsize mlens[32];
+	bool valid[32];
+	const gint nsigs = G_N_ELEMENTS (psigs);
+	gdouble t1, t2;
+	gint i;
+
+	pks = g_malloc (sizeof (*pks) * nsigs);
+	sigs = g_malloc (sizeof (*sigs) * nsigs);
+	msgs = g_malloc (sizeof (*msgs) * nsigs);
+
+	for (i = 0; i < nsigs; i ++) {
+		rspamd_cryptobox_keypair_sig (pks[i], sk, sig_mode);
+		ottery_rand_bytes (msgs[i], sizeof (msgs[i]));
+		mlens[i] = i + 1;
+		rspamd_cryptobox_sign (sigs[i], NULL, msgs[i], mlens[i], sk, sig_mode);
+		psigs[i] = sigs[i];
+		pmsgs[i] = msgs[i];
+		ppks[i] = pks[i];
+	}
+
+	t1 = rspamd_get_ticks ();
+	g_assert (rspamd_cryptobox_verify_batch (psigs, pmsgs, mlens, ppks, nsigs,
+			valid, sig_mode));
+	t2 = rspamd_get_ticks ();
+	msg_info ("batch verification of %d signatures: %.6f", nsigs, t2 - t1);
+
+	for (i = 0; i < nsigs; i ++) {
+		g_assert (valid[i]);
+	}
+
+	/* Corrupt a single message */
+	msgs[nsigs / 2][0] ^= 0x1;
+	g_assert (!rspamd_cryptobox_verify_batch (psigs, pmsgs, mlens, ppks, nsigs,
+			valid, sig_mode));
+
+	for (i = 0; i < nsigs; i ++) {
+		g_assert (valid[i] == (i != nsigs / 2));
+	}
+
+	g_free (pks);
+	g_free (sigs);
+	g_free (msgs);
+}
+
+static void
+check_encrypt_multi (enum rspamd_cryptobox_mode enc_mode)
+{
+	struct rspamd_cryptobox_message msgs[40];
+	guchar (*data)[1024], (*plain)[1024];
+	rspamd_nm_t keys[G_N_ELEMENTS (msgs)];
+	rspamd_nonce_t nonces[G_N_ELEMENTS (msgs)];
+	rspamd_mac_t macs[G_N_ELEMENTS (msgs)];
+	gdouble t1, t2;
+	guint i;
+
+	data = g_malloc (sizeof (*data) * G_N_ELEMENTS (msgs));
+	plain = g_malloc (sizeof (*plain) * G_N_ELEMENTS (msgs));
+
+	for (i = 0; i < G_N_ELEMENTS (msgs); i ++) {
+		ottery_rand_bytes (keys[i], sizeof (keys[i]));
+		ottery_rand_bytes (nonces[i], sizeof (nonces[i]));
+		ottery_rand_bytes (plain[i], sizeof (plain[i]));
+		memcpy (data[i], plain[i], sizeof (plain[i]));
+		msgs[i].data = data[i];
+		/* Mix short messages with a few long ones */
+		msgs[i].len = (i % 10 == 9) ? sizeof (data[i]) : i * 7;
+		msgs[i].nonce = nonces[i];
+		msgs[i].nm = keys[i];
+		msgs[i].sig = macs[i];
+	}
+
+	t1 = rspamd_get_ticks ();
+	rspamd_cryptobox_encrypt_nm_inplace_multi (msgs, G_N_ELEMENTS (msgs),
+			enc_mode);
+	t2 = rspamd_get_ticks ();
+	msg_info ("multi encryption of %d messages: %.6f",
+			(gint)G_N_ELEMENTS (msgs), t2 - t1);
+
+	for (i = 0; i < G_N_ELEMENTS (msgs); i ++) {
+		g_assert (rspamd_cryptobox_decrypt_nm_inplace (data[i], msgs[i].len,
+				nonces[i], keys[i], macs[i], enc_mode));
+		g_assert (memcmp (data[i], plain[i], msgs[i].len) == 0);
+	}
+
+	g_free (data);
+	g_free (plain);
+}
+
 void
 rspamd_cryptobox_test_func (void)
 {
@@ -345,4 +440,8 @@ start:
 		mode = RSPAMD_CRYPTOBOX_MODE_NIST;
 		goto start;
 	}
+
+	check_verify_batch (RSPAMD_CRYPTOBOX_MODE_25519);
+	check_encrypt_multi (RSPAMD_CRYPTOBOX_MODE_25519);
+	check_encrypt_multi (RSPAMD_CRYPTOBOX_MODE_NIST);
 }
@@ -0,0 +1,111 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "hash.h"
+#include "ottery.h"
+
+static const guint niter = 100500;
+static const guint nelts = 1024;
+
+void
+rspamd_lru_test_func (void)
+{
+	rspamd_lru_hash_t *hash;
+	gpointer k, v;
+	guint i, key, cnt;
+	time_t now = 1000;
+	gint it;
+
+	/* Insert + lookup + replace */
+	hash = rspamd_lru_hash_new_full (32, NULL, NULL,
+			g_direct_hash, g_direct_equal);
+
+	for (i = 1; i <= 32; i ++) {
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i * 2), now, 0);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == 32);
+
+	for (i = 1; i <= 32; i ++) {
+		g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (i), now) ==
+				GUINT_TO_POINTER (i * 2));
+	}
+
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (1),
+			GUINT_TO_POINTER (100), now, 0);
+	g_assert (rspamd_lru_hash_size (hash) == 32);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), now) ==
+			GUINT_TO_POINTER (100));
+
+	/* Referenced elements survive eviction of the fresh one */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (33),
+			GUINT_TO_POINTER (66), now, 0);
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (34),
+			GUINT_TO_POINTER (68), now, 0);
+	g_assert (rspamd_lru_hash_size (hash) == 32);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (34), now) ==
+			GUINT_TO_POINTER (68));
+
+	cnt = 0;
+	it = 0;
+
+	while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {
+		g_assert (rspamd_lru_hash_lookup (hash, k, now) == v);
+		cnt ++;
+	}
+
+	g_assert (cnt == 32);
+	rspamd_lru_hash_destroy (hash);
+
+	/* TTL */
+	hash = rspamd_lru_hash_new_full (32, NULL, NULL,
+			g_direct_hash, g_direct_equal);
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (1),
+			GUINT_TO_POINTER (1), now, 10);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), now + 5) ==
+			GUINT_TO_POINTER (1));
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), now + 11) ==
+			NULL);
+	g_assert (rspamd_lru_hash_size (hash) == 0);
+	rspamd_lru_hash_destroy (hash);
+
+	/* Fuzz test: table must stay consistent after random evictions */
+	hash = rspamd_lru_hash_new_full (nelts, NULL, NULL,
+			g_direct_hash, g_direct_equal);
+
+	for (i = 0; i < niter; i ++) {
+		key = ottery_rand_uint32 () % (nelts * 4) + 1;
+
+		if (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (key), now) == NULL) {
+			rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (key),
+					GUINT_TO_POINTER (key + 1), now, 0);
+		}
+
+		g_assert (rspamd_lru_hash_size (hash) <= nelts);
+	}
+
+	it = 0;
+
+	while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {
+		g_assert (GPOINTER_TO_UINT (v) == GPOINTER_TO_UINT (k) + 1);
+		g_assert (rspamd_lru_hash_lookup (hash, k, now) == v);
+	}
+
+	rspamd_lru_hash_destroy (hash);
+}
@@ -18,6 +18,7 @@
 #include "radix.h"
 #include "ottery.h"
 #include "btrie.h"
+#include "unix-std.h"
 
 const gsize max_elts = 500 * 1024;
 const gint lookup_cycles = 1 * 1024;
@@ -137,6 +138,91 @@ rspamd_radix_test_vec (void)
 	radix_destroy_compressed (tree);
 }
 
+/* Depends on addresses parsed by rspamd_radix_test_vec */
+static void
+rspamd_radix_test_image (void)
+{
+	radix_compressed_t *tree = radix_create_compressed (), *image;
+	struct _tv *t = &test_vec[0];
+	gchar path[] = "/tmp/rspamd_radix_test.XXXXXX", **values;
+	GError *err = NULL;
+	const guint8 *keys[G_N_ELEMENTS (test_vec) * 2];
+	gsize keylens[G_N_ELEMENTS (test_vec) * 2];
+	uintptr_t results[G_N_ELEMENTS (test_vec) * 2];
+	gulong i, val;
+	guint nkeys;
+	gint fd;
+
+	values = g_malloc0 (G_N_ELEMENTS (test_vec) * sizeof (*values));
+	i = 0;
+
+	while (t->ip != NULL) {
+		values[i] = g_strdup_printf ("%lu", i);
+		radix_insert_compressed (tree, t->addr, t->len, t->mask,
+				(uintptr_t)values[i]);
+		i ++;
+		t ++;
+	}
+
+	fd = mkstemp (path);
+	g_assert (fd != -1);
+	close (fd);
+	g_assert (radix_compressed_save (tree, path, &err));
+	image = radix_compressed_load (path, &err);
+	g_assert (image != NULL);
+	unlink (path);
+
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		val = radix_find_compressed (image, t->addr, t->len);
+		g_assert (val != RADIX_NO_VALUE);
+		g_assert_cmpstr ((const gchar *)val, ==, values[i]);
+
+		if (t->nip != NULL) {
+			val = radix_find_compressed (image, t->naddr, t->len);
+			g_assert (val == RADIX_NO_VALUE ||
+					strcmp ((const gchar *)val, values[i]) != 0);
+		}
+
+		g_free (values[i]);
+		i ++;
+		t ++;
+	}
+
+	/* Batched lookups must agree with the single ones */
+	nkeys = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		keys[nkeys] = t->addr;
+		keylens[nkeys ++] = t->len;
+
+		if (t->nip != NULL) {
+			keys[nkeys] = t->naddr;
+			keylens[nkeys ++] = t->len;
+		}
+		t ++;
+	}
+
+	radix_find_compressed_batch (image, keys, keylens, nkeys, results);
+
+	for (i = 0; i < nkeys; i ++) {
+		g_assert (results[i] ==
+				radix_find_compressed (image, keys[i], keylens[i]));
+	}
+
+	radix_find_compressed_batch (tree, keys, keylens, nkeys, results);
+
+	for (i = 0; i < nkeys; i ++) {
+		g_assert (results[i] ==
+				radix_find_compressed (tree, keys[i], keylens[i]));
+	}
+
+	radix_destroy_compressed (image);
+	radix_destroy_compressed (tree);
+	g_free (values);
+}
+
 static void
 rspamd_btrie_test_vec (void)
 {
@@ -226,6 +312,7 @@ rspamd_radix_test_func (void)
 
 	rspamd_btrie_test_vec ();
 	rspamd_radix_test_vec ();
+	rspamd_radix_test_image ();
 
 	nelts = max_elts;
 	/* First of all we generate many elements and push them to the array */
@@ -110,6 +110,36 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	g_free (sgl_permuted);
 }
 
+static guint64
+test_minimal_filter (guint64 *input, gsize count,
+		gint shno, const guchar *key, gpointer ud)
+{
+	return rspamd_shingles_default_filter (input, count, shno, key, ud);
+}
+
+static void
+test_filters (gsize cnt, gsize max_len)
+{
+	GArray *input;
+	struct rspamd_shingle *sgl, *sgl_generic;
+	guchar key[16];
+
+	/* Inline minimum must be the same as the generic filtering */
+	ottery_rand_bytes (key, sizeof (key));
+	input = generate_fuzzy_words (cnt, max_len);
+	sgl = rspamd_shingles_generate (input, key, NULL,
+			rspamd_shingles_default_filter, NULL);
+	sgl_generic = rspamd_shingles_generate (input, key, NULL,
+			test_minimal_filter, NULL);
+
+	g_assert (memcmp (sgl, sgl_generic, sizeof (*sgl)) == 0);
+
+	free_fuzzy_words (input);
+	g_array_free (input, TRUE);
+	g_free (sgl);
+	g_free (sgl_generic);
+}
+
 void
 rspamd_shingles_test_func (void)
 {
@@ -119,4 +149,8 @@ rspamd_shingles_test_func (void)
 	test_case (5000, 20, 0.01);
 	test_case (5000, 15, 0);
 	test_case (5000, 30, 1.0);
+	test_filters (0, 10);
+	test_filters (2, 10);
+	test_filters (3, 10);
+	test_filters (500, 20);
 }
@@ -50,6 +50,13 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/lru", rspamd_lru_test_func);
+	g_test_add_func ("/rspamd/timer", rspamd_timer_test_func);
+	g_test_add_func ("/rspamd/bayes", rspamd_bayes_test_func);
+
+	if (g_test_perf ()) {
+		g_test_add_func ("/rspamd/bench", rspamd_bench_test_func);
+	}
 
 #if 0
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
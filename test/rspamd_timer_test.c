@@ -0,0 +1,103 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+static const guint ntimers = 64;
+static const gdouble resolution = 0.01;
+
+struct timer_test_elt {
+	struct rspamd_timer t;
+	gdouble start;
+	gdouble timeout;
+	gboolean called;
+	struct rspamd_timer_wheel *wheel;
+	struct timer_test_elt *victim;
+};
+
+static gdouble last_timeout;
+
+static void
+rspamd_timer_test_cb (gpointer ud)
+{
+	struct timer_test_elt *elt = ud;
+	gdouble elapsed;
+
+	elapsed = rspamd_get_ticks () - elt->start;
+
+	g_assert (!elt->called);
+	g_assert (elapsed >= elt->timeout);
+	/* Timers are called in the order of their timeouts up to the resolution */
+	g_assert (elt->timeout >= last_timeout - resolution);
+
+	elt->called = TRUE;
+	last_timeout = elt->timeout;
+
+	if (elt->victim) {
+		rspamd_timer_cancel (&elt->victim->t);
+	}
+}
+
+void
+rspamd_timer_test_func (void)
+{
+	struct event_base *ev_base;
+	struct rspamd_timer_wheel *wheel;
+	struct timer_test_elt *elts;
+	guint i;
+
+	ev_base = event_init ();
+	wheel = rspamd_timer_wheel_new (ev_base, resolution);
+	elts = g_malloc0 (sizeof (*elts) * ntimers);
+
+	for (i = 0; i < ntimers; i ++) {
+		elts[i].timeout = (ntimers - i) * resolution / 2.0;
+		elts[i].start = rspamd_get_ticks ();
+		rspamd_timer_add (wheel, &elts[i].t, elts[i].timeout,
+				rspamd_timer_test_cb, &elts[i]);
+	}
+
+	g_assert (rspamd_timer_wheel_count (wheel) == ntimers);
+
+	/* Cancel and reschedule some timers */
+	rspamd_timer_cancel (&elts[0].t);
+	g_assert (!rspamd_timer_is_armed (&elts[0].t));
+	rspamd_timer_add (wheel, &elts[1].t, elts[1].timeout,
+			rspamd_timer_test_cb, &elts[1]);
+	g_assert (rspamd_timer_wheel_count (wheel) == ntimers - 1);
+
+	/* The first timer to fire cancels the second one */
+	elts[ntimers - 1].victim = &elts[ntimers - 2];
+
+	event_base_loop (ev_base, 0);
+
+	g_assert (rspamd_timer_wheel_count (wheel) == 0);
+	g_assert (!elts[0].called);
+	g_assert (!elts[ntimers - 2].called);
+
+	for (i = 1; i < ntimers; i ++) {
+		if (i != ntimers - 2) {
+			g_assert (elts[i].called);
+		}
+	}
+
+	rspamd_timer_wheel_destroy (wheel);
+	g_free (elts);
+	event_base_free (ev_base);
+}
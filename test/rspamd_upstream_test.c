@@ -41,6 +41,13 @@ rspamd_upstream_test_method (struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_test_latency_cb (struct upstream *up, void *ud)
+{
+	rspamd_upstream_ok_latency (up,
+			strcmp (rspamd_upstream_name (up), "kernel.org") == 0 ? 1.0 : 0.01);
+}
+
 static void
 rspamd_upstream_timeout_handler (int fd, short what, void *arg)
 {
@@ -53,7 +60,7 @@ void
 rspamd_upstream_test_func (void)
 {
 	struct upstream_list *ls, *nls;
-	struct upstream *up, *upn;
+	struct upstream *up, *upn, *hashed[1000];
 	struct event_base *ev_base = event_init ();
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_config *cfg;
@@ -129,6 +136,19 @@ rspamd_upstream_test_func (void)
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "google.com");
 	rspamd_upstream_test_method (ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "microsoft.com");
 
+	/* Test latency rotation: the slowest upstream loses all choices */
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls, test_upstream_list, 443, NULL));
+
+	rspamd_upstreams_foreach (nls, rspamd_upstream_test_latency_cb, NULL);
+
+	for (i = 0; i < 100; i ++) {
+		up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		g_assert (strcmp (rspamd_upstream_name (up), "kernel.org") != 0);
+	}
+
+	rspamd_upstreams_destroy (nls);
+
 	/* Test stable hashing */
 	nls = rspamd_upstreams_create (cfg->ups_ctx);
 	g_assert (rspamd_upstreams_parse_line (nls, test_upstream_list, 443, NULL));
@@ -162,12 +182,28 @@ rspamd_upstream_test_func (void)
 	evtimer_set (&ev, rspamd_upstream_timeout_handler, resolver);
 	event_base_set (ev_base, &ev);
 
+	for (i = 0; i < G_N_ELEMENTS (hashed); i ++) {
+		hashed[i] = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_HASHED, &i,
+				sizeof (i));
+	}
+
 	up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
 	for (i = 0; i < 100; i ++) {
 		rspamd_upstream_fail (up);
 	}
 	g_assert (rspamd_upstreams_alive (ls) == 2);
 
+	/* Keys of the alive upstreams must not be moved */
+	for (i = 0; i < G_N_ELEMENTS (hashed); i ++) {
+		upn = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_HASHED, &i,
+				sizeof (i));
+		g_assert (upn != up);
+
+		if (hashed[i] != up) {
+			g_assert (upn == hashed[i]);
+		}
+	}
+
 	tv.tv_sec = 2;
 	tv.tv_usec = 0;
 	event_add (&ev, &tv);
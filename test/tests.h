@@ -41,4 +41,13 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_lru_test_func (void);
+
+void rspamd_timer_test_func (void);
+
+void rspamd_bayes_test_func (void);
+
+/* Microbenchmarks, run with -m perf */
+void rspamd_bench_test_func (void);
+
 #endif